@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "ktutil_locl.h"
+
+/*
+ * Apply many add, remove and purge operations to a file keytab in one
+ * pass: read it once, change it in memory and write it out compacted,
+ * without the holes that removing entries leaves, replacing the old
+ * file in one rename.  Each of the commands on their own reads the
+ * whole keytab at least once per operation.
+ */
+
+struct bulk_entry {
+    krb5_keytab_entry e;
+    char *name;			/* unparsed principal, for purge */
+    int gone;
+};
+
+struct bulk {
+    struct bulk_entry *val;
+    size_t len;
+    size_t alloc;
+    unsigned int added;
+    unsigned int removed;
+};
+
+static int
+bulk_append(struct bulk *b, krb5_keytab_entry *e)
+{
+    krb5_error_code ret;
+    struct bulk_entry *be;
+
+    if (b->len == b->alloc) {
+	size_t n = b->alloc ? b->alloc * 2 : 64;
+
+	be = realloc(b->val, n * sizeof(*be));
+	if (be == NULL) {
+	    krb5_warnx(context, "malloc: out of memory");
+	    return ENOMEM;
+	}
+	b->val = be;
+	b->alloc = n;
+    }
+    be = &b->val[b->len];
+    ret = krb5_unparse_name(context, e->principal, &be->name);
+    if (ret) {
+	krb5_warn(context, ret, "krb5_unparse_name");
+	return ret;
+    }
+    be->e = *e;
+    be->gone = 0;
+    b->len++;
+    return 0;
+}
+
+static void
+bulk_free(struct bulk *b)
+{
+    size_t i;
+
+    for (i = 0; i < b->len; i++) {
+	krb5_kt_free_entry(context, &b->val[i].e);
+	free(b->val[i].name);
+    }
+    free(b->val);
+}
+
+static int
+parse_enctype(const char *s, krb5_enctype *enctype)
+{
+    krb5_error_code ret;
+    int t;
+
+    ret = krb5_string_to_enctype(context, s, enctype);
+    if (ret == 0)
+	return 0;
+    if (sscanf(s, "%d", &t) == 1) {
+	*enctype = t;
+	return 0;
+    }
+    krb5_warn(context, ret, "%s", s);
+    return ret;
+}
+
+/* add principal kvno enctype [hex-key] */
+static int
+bulk_add(struct bulk *b, int argc, char **argv)
+{
+    krb5_error_code ret;
+    krb5_keytab_entry e;
+    krb5_enctype enctype;
+    unsigned int kvno;
+
+    if (argc < 4 || argc > 5 || sscanf(argv[2], "%u", &kvno) != 1) {
+	krb5_warnx(context, "usage: add principal kvno enctype [hex-key]");
+	return EINVAL;
+    }
+    if ((ret = parse_enctype(argv[3], &enctype)) != 0)
+	return ret;
+
+    memset(&e, 0, sizeof(e));
+    ret = krb5_parse_name(context, argv[1], &e.principal);
+    if (ret) {
+	krb5_warn(context, ret, "%s", argv[1]);
+	return ret;
+    }
+    if (argc == 5) {
+	size_t len = (strlen(argv[4]) + 1) / 2;
+	void *data = malloc(len ? len : 1);
+
+	if (data == NULL) {
+	    ret = ENOMEM;
+	} else if ((size_t)hex_decode(argv[4], data, len) != len) {
+	    krb5_warnx(context, "hex decode failed");
+	    ret = EINVAL;
+	} else {
+	    ret = krb5_keyblock_init(context, enctype, data, len, &e.keyblock);
+	}
+	if (data)
+	    memset_s(data, len, 0, len);
+	free(data);
+	memset_s(argv[4], strlen(argv[4]), 0, strlen(argv[4]));
+    } else {
+	ret = krb5_generate_random_keyblock(context, enctype, &e.keyblock);
+    }
+    if (ret == 0) {
+	e.vno = kvno;
+	e.timestamp = time(NULL);
+	ret = bulk_append(b, &e);
+    }
+    if (ret) {
+	krb5_warn(context, ret, "add %s", argv[1]);
+	krb5_kt_free_entry(context, &e);
+	return ret;
+    }
+    b->added++;
+    return 0;
+}
+
+/* remove principal [kvno [enctype]] */
+static int
+bulk_remove(struct bulk *b, int argc, char **argv)
+{
+    krb5_error_code ret;
+    krb5_principal principal;
+    krb5_enctype enctype = 0;
+    unsigned int kvno = 0;
+    int found = 0;
+    size_t i;
+
+    if (argc < 2 || argc > 4 ||
+	(argc > 2 && sscanf(argv[2], "%u", &kvno) != 1)) {
+	krb5_warnx(context, "usage: remove principal [kvno [enctype]]");
+	return EINVAL;
+    }
+    if (argc > 3 && (ret = parse_enctype(argv[3], &enctype)) != 0)
+	return ret;
+    ret = krb5_parse_name(context, argv[1], &principal);
+    if (ret) {
+	krb5_warn(context, ret, "%s", argv[1]);
+	return ret;
+    }
+    for (i = 0; i < b->len; i++) {
+	if (!b->val[i].gone &&
+	    krb5_kt_compare(context, &b->val[i].e, principal, kvno, enctype)) {
+	    b->val[i].gone = 1;
+	    b->removed++;
+	    found = 1;
+	}
+    }
+    krb5_free_principal(context, principal);
+    if (!found && verbose_flag)
+	krb5_warnx(context, "remove %s: no such entry", argv[1]);
+    return 0;
+}
+
+static struct bulk *sort_bulk;
+
+static int
+cmp_name(const void *a, const void *b)
+{
+    const struct bulk_entry *ea = &sort_bulk->val[*(const size_t *)a];
+    const struct bulk_entry *eb = &sort_bulk->val[*(const size_t *)b];
+
+    return strcmp(ea->name, eb->name);
+}
+
+/* purge [age], as the purge command: drop superseded keys older than age */
+static int
+bulk_purge(struct bulk *b, int argc, char **argv)
+{
+    time_t judgement_day = time(NULL);
+    size_t *idx, i, j, k, n = 0;
+    int age;
+
+    if (argc > 2) {
+	krb5_warnx(context, "usage: purge [age]");
+	return EINVAL;
+    }
+    age = parse_time(argc > 1 ? argv[1] : "1 week", "s");
+    if (age < 0) {
+	krb5_warnx(context, "unparsable time `%s'", argv[1]);
+	return EINVAL;
+    }
+
+    /* Group the entries by principal */
+    idx = malloc((b->len ? b->len : 1) * sizeof(*idx));
+    if (idx == NULL) {
+	krb5_warnx(context, "malloc: out of memory");
+	return ENOMEM;
+    }
+    for (i = 0; i < b->len; i++)
+	if (!b->val[i].gone)
+	    idx[n++] = i;
+    sort_bulk = b;
+    qsort(idx, n, sizeof(*idx), cmp_name);
+
+    for (i = 0; i < n; i = j) {
+	struct bulk_entry *newest = &b->val[idx[i]];
+
+	for (j = i + 1; j < n && strcmp(b->val[idx[j]].name, newest->name) == 0; j++)
+	    if (b->val[idx[j]].e.vno > newest->e.vno)
+		newest = &b->val[idx[j]];
+	if (judgement_day - newest->e.timestamp <= age)
+	    continue;
+	for (k = i; k < j; k++) {
+	    struct bulk_entry *be = &b->val[idx[k]];
+
+	    if (be->e.vno < newest->e.vno) {
+		if (verbose_flag)
+		    printf("removing %s vno %d\n", be->name, be->e.vno);
+		be->gone = 1;
+		b->removed++;
+	    }
+	}
+    }
+    free(idx);
+    return 0;
+}
+
+static int
+bulk_line(struct bulk *b, char *line)
+{
+    char *argv[6];
+    char *p, *last = NULL;
+    int argc = 0;
+
+    line[strcspn(line, "#\r\n")] = '\0';
+    for (p = strtok_r(line, " \t", &last); p != NULL;
+	 p = strtok_r(NULL, " \t", &last)) {
+	if (argc == sizeof(argv) / sizeof(argv[0]) - 1) {
+	    krb5_warnx(context, "too many arguments");
+	    return EINVAL;
+	}
+	argv[argc++] = p;
+    }
+    argv[argc] = NULL;
+
+    if (argc == 0)
+	return 0;
+    if (strcmp(argv[0], "add") == 0)
+	return bulk_add(b, argc, argv);
+    if (strcmp(argv[0], "remove") == 0 || strcmp(argv[0], "delete") == 0)
+	return bulk_remove(b, argc, argv);
+    if (strcmp(argv[0], "purge") == 0)
+	return bulk_purge(b, argc, argv);
+    krb5_warnx(context, "unknown operation `%s'", argv[0]);
+    return EINVAL;
+}
+
+static int
+bulk_read(struct bulk *b, krb5_keytab keytab)
+{
+    krb5_error_code ret;
+    krb5_kt_cursor cursor;
+    krb5_keytab_entry entry;
+
+    ret = krb5_kt_start_seq_get(context, keytab, &cursor);
+    if (ret == ENOENT)
+	return 0;		/* created on write */
+    if (ret) {
+	krb5_warn(context, ret, "%s", keytab_string);
+	return ret;
+    }
+    while ((ret = krb5_kt_next_entry(context, keytab, &entry, &cursor)) == 0) {
+	if ((ret = bulk_append(b, &entry)) != 0) {
+	    krb5_kt_free_entry(context, &entry);
+	    break;
+	}
+    }
+    krb5_kt_end_seq_get(context, keytab, &cursor);
+    if (ret == KRB5_KT_END)
+	return 0;
+    krb5_warn(context, ret, "%s", keytab_string);
+    return ret;
+}
+
+/* Write the entries left to a new file and rename it over `path' */
+static int
+bulk_write(struct bulk *b, const char *path)
+{
+    krb5_error_code ret = 0;
+    krb5_keytab out;
+    struct stat st;
+    char *tmp, *name;
+    size_t i;
+    int fd;
+
+    if (asprintf(&tmp, "%s.XXXXXX", path) == -1 || tmp == NULL) {
+	krb5_warnx(context, "malloc: out of memory");
+	return ENOMEM;
+    }
+    if ((fd = mkstemp(tmp)) == -1) {
+	ret = errno;
+	krb5_warn(context, ret, "mkstemp %s", tmp);
+	free(tmp);
+	return ret;
+    }
+    if (stat(path, &st) == 0)
+	(void) fchmod(fd, st.st_mode & 07777);
+    close(fd);
+
+    if (asprintf(&name, "WRFILE:%s", tmp) == -1 || name == NULL) {
+	krb5_warnx(context, "malloc: out of memory");
+	ret = ENOMEM;
+	goto out;
+    }
+    ret = krb5_kt_resolve(context, name, &out);
+    free(name);
+    if (ret) {
+	krb5_warn(context, ret, "resolving keytab %s", tmp);
+	goto out;
+    }
+    /* Appends, without scanning what is already written, see keytab_file.c */
+    for (i = 0; ret == 0 && i < b->len; i++) {
+	if (b->val[i].gone)
+	    continue;
+	ret = krb5_kt_add_entry(context, out, &b->val[i].e);
+	if (ret)
+	    krb5_warn(context, ret, "writing %s", tmp);
+    }
+    krb5_kt_close(context, out);
+    if (ret == 0 && rk_rename(tmp, path) == -1) {
+	ret = errno;
+	krb5_warn(context, ret, "rename %s to %s", tmp, path);
+    }
+
+ out:
+    if (ret)
+	unlink(tmp);
+    free(tmp);
+    return ret;
+}
+
+int
+kt_bulk(void *opt, int argc, char **argv)
+{
+    krb5_error_code ret;
+    krb5_keytab keytab;
+    struct bulk b;
+    char type[KRB5_KT_PREFIX_MAX_LEN];
+    char path[MAXPATHLEN];
+    char buf[BUFSIZ];
+    unsigned int lineno = 0;
+    FILE *f = stdin;
+
+    memset(&b, 0, sizeof(b));
+    if ((keytab = ktutil_open_keytab()) == NULL)
+	return 1;
+    ret = krb5_kt_get_type(context, keytab, type, sizeof(type));
+    if (ret == 0)
+	ret = krb5_kt_get_name(context, keytab, path, sizeof(path));
+    if (ret == 0 && strcmp(type, "FILE") != 0 && strcmp(type, "WRFILE") != 0) {
+	krb5_warnx(context, "%s: bulk only works on FILE keytabs",
+		   keytab_string);
+	ret = EINVAL;
+    }
+    if (ret == 0)
+	ret = bulk_read(&b, keytab);
+    krb5_kt_close(context, keytab);
+    if (ret)
+	goto out;
+
+    if (argc > 0 && strcmp(argv[0], "-") != 0) {
+	f = fopen(argv[0], "r");
+	if (f == NULL) {
+	    ret = errno;
+	    krb5_warn(context, ret, "%s", argv[0]);
+	    goto out;
+	}
+    }
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+	lineno++;
+	ret = bulk_line(&b, buf);
+	if (ret) {
+	    krb5_warnx(context, "%s:%u: keytab left unchanged",
+		       argc > 0 ? argv[0] : "-", lineno);
+	    break;
+	}
+    }
+    memset_s(buf, sizeof(buf), 0, sizeof(buf));
+    if (f != stdin)
+	fclose(f);
+
+    if (ret == 0 && (b.added || b.removed))
+	ret = bulk_write(&b, path);
+    if (ret == 0 && verbose_flag)
+	fprintf(stderr, "%s: %u added, %u removed\n", keytab_string,
+		b.added, b.removed);
+
+ out:
+    bulk_free(&b);
+    return ret != 0;
+}
@@ -76,6 +76,9 @@ read_words (const char *filename, char ***ret_w)
     return n;
 }
 
+static char *password_str;
+static char *realm_str;
+
 static void
 add_user (krb5_context ctx, void *hndl, unsigned nwords, char **words)
 {
@@ -85,28 +88,33 @@ add_user (krb5_context ctx, void *hndl, unsigned nwords, char **words)
     krb5_error_code ret;
     int mask;
 
-    r1 = rand();
-    r2 = rand();
+    do {
+	r1 = rand();
+	r2 = rand();
 
-    snprintf (name, sizeof(name), "%s%d", words[r1 % nwords], r2 % 1000);
+	snprintf (name, sizeof(name), "%s%d", words[r1 % nwords], r2 % 1000);
 
-    mask = KADM5_PRINCIPAL;
+	mask = KADM5_PRINCIPAL;
 
-    memset(&princ, 0, sizeof(princ));
-    ret = krb5_parse_name(ctx, name, &princ.principal);
-    if (ret)
-	krb5_err(ctx, 1, ret, "krb5_parse_name");
+	memset(&princ, 0, sizeof(princ));
+	ret = krb5_parse_name(ctx, name, &princ.principal);
+	if (ret)
+	    krb5_err(ctx, 1, ret, "krb5_parse_name");
 
-    ret = kadm5_create_principal (hndl, &princ, mask, name);
+	ret = kadm5_create_principal (hndl, &princ, mask,
+				      password_str ? password_str : name);
+	kadm5_free_principal_ent(hndl, &princ);
+	/* Name collisions are expected with small word lists; pick again */
+    } while (ret == KADM5_DUP);
     if (ret)
 	krb5_err (ctx, 1, ret, "kadm5_create_principal");
-    kadm5_free_principal_ent(hndl, &princ);
     printf ("%s\n", name);
 }
 
 static void
 add_users (const char *filename, unsigned n)
 {
+    kadm5_config_params conf;
     krb5_error_code ret;
     int i;
     void *hndl;
@@ -117,11 +125,17 @@ add_users (const char *filename, unsigned n)
     ret = krb5_init_context(&ctx);
     if (ret)
 	errx (1, "krb5_init_context failed: %d", ret);
+    memset(&conf, 0, sizeof(conf));
+    if (realm_str) {
+	krb5_set_default_realm(ctx, realm_str);
+	conf.realm = realm_str;
+	conf.mask |= KADM5_CONFIG_REALM;
+    }
     ret = kadm5_s_init_with_password_ctx(ctx,
 					 KADM5_ADMIN_SERVICE,
 					 NULL,
 					 KADM5_ADMIN_SERVICE,
-					 NULL, 0, 0,
+					 &conf, 0, 0,
 					 &hndl);
     if(ret)
 	krb5_err(ctx, 1, ret, "kadm5_init_with_password");
@@ -139,6 +153,10 @@ static int version_flag	= 0;
 static int help_flag	= 0;
 
 static struct getargs args[] = {
+    { "password",	0,   arg_string, &password_str,
+      "password for all users (default: the user name)", "password" },
+    { "realm",		'r', arg_string, &realm_str,
+      "realm to add the users to", "realm" },
     { "version", 	0,   arg_flag, &version_flag, NULL, NULL },
     { "help",		0,   arg_flag, &help_flag,    NULL, NULL }
 };
@@ -37,12 +37,135 @@
 
 extern int local_flag;
 
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+
+/*
+ * With --threads each thread dumps one shard of the database (see
+ * hdb_foreach_shard()) through a handle and a krb5_context of its own.
+ * The first shard goes straight to the output and the others to
+ * temporary files, which are then copied to the output in order, so the
+ * output is the same as with one thread.
+ */
+struct dump_shard {
+    krb5_context context;
+    HDB *db;
+    unsigned int shard;
+    unsigned int nshards;
+    unsigned flags;
+    struct hdb_print_entry_arg parg;
+    krb5_error_code ret;
+    pthread_t thread;
+    unsigned int started:1;
+};
+
+static void *
+dump_shard_thread(void *arg)
+{
+    struct dump_shard *s = arg;
+
+    s->ret = hdb_foreach_shard(s->context, s->db, s->flags, s->shard,
+                               s->nshards, hdb_print_entry, &s->parg);
+    return NULL;
+}
+
+static krb5_error_code
+dump_shard_open(HDB *db, struct dump_shard *s)
+{
+    krb5_error_code ret;
+    char *dbname;
+
+    ret = krb5_init_context(&s->context);
+    if (ret)
+        return ret;
+    if (db->hdb_method_name)
+        ret = asprintf(&dbname, "%.*s:%s",
+                       (int) strlen(db->hdb_method_name) - 1,
+                       db->hdb_method_name, db->hdb_name);
+    else
+        ret = asprintf(&dbname, "%s", db->hdb_name);
+    if (ret == -1)
+        return krb5_enomem(s->context);
+    ret = hdb_create(s->context, &s->db, dbname);
+    free(dbname);
+    if (ret == 0)
+        ret = hdb_copy_master_key(s->context, db, s->db);
+    if (ret == 0)
+        ret = s->db->hdb_open(s->context, s->db, O_RDONLY, 0600);
+    if (ret) {
+        krb5_warn(s->context, ret, "hdb_open");
+        if (s->db)
+            s->db->hdb_destroy(s->context, s->db);
+        s->db = NULL;
+    }
+    return ret;
+}
+
+static krb5_error_code
+dump_threads(HDB *db, unsigned flags, struct hdb_print_entry_arg *parg,
+             unsigned int nthreads)
+{
+    struct dump_shard *shards;
+    krb5_error_code ret = 0;
+    unsigned int i;
+    char buf[8192];
+    size_t len;
+
+    shards = calloc(nthreads, sizeof(shards[0]));
+    if (shards == NULL)
+        return krb5_enomem(context);
+    for (i = 0; ret == 0 && i < nthreads; i++) {
+        shards[i].shard = i;
+        shards[i].nshards = nthreads;
+        shards[i].flags = flags;
+        shards[i].parg = *parg;
+        if (i > 0 && (shards[i].parg.out = tmpfile()) == NULL)
+            krb5_warn(context, ret = errno, "tmpfile");
+        else
+            ret = dump_shard_open(db, &shards[i]);
+    }
+
+    for (i = 0; ret == 0 && i < nthreads; i++) {
+        if (pthread_create(&shards[i].thread, NULL, dump_shard_thread,
+                           &shards[i]) == 0)
+            shards[i].started = 1;
+        else
+            dump_shard_thread(&shards[i]);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        FILE *tmp = i > 0 ? shards[i].parg.out : NULL;
+
+        if (shards[i].started)
+            pthread_join(shards[i].thread, NULL);
+        if (ret == 0 && shards[i].ret)
+            krb5_warn(shards[i].context, shards[i].ret, "hdb_foreach_shard");
+        if (ret == 0 && tmp) {
+            rewind(tmp);
+            while ((len = fread(buf, 1, sizeof(buf), tmp)) > 0)
+                fwrite(buf, 1, len, parg->out);
+        }
+        if (tmp)
+            fclose(tmp);
+        if (shards[i].db) {
+            shards[i].db->hdb_close(shards[i].context, shards[i].db);
+            shards[i].db->hdb_destroy(shards[i].context, shards[i].db);
+        }
+        if (shards[i].context)
+            krb5_free_context(shards[i].context);
+    }
+    free(shards);
+    return ret;
+}
+#endif /* ENABLE_PTHREAD_SUPPORT && HAVE_PTHREAD_H */
+
 int
 dump(struct dump_options *opt, int argc, char **argv)
 {
     krb5_error_code ret;
     FILE *f;
     struct hdb_print_entry_arg parg;
+    unsigned flags;
     HDB *db = NULL;
 
     if (!local_flag) {
@@ -52,6 +175,25 @@ dump(struct dump_options *opt, int argc, char **argv)
 
     db = _kadm5_s_get_db(kadm_handle);
 
+    if (opt->format_string && strcmp(opt->format_string, "flat") == 0) {
+        /* A snapshot for read-only KDCs; see lib/hdb/hdb-flat.c */
+        if (argc == 0 || opt->decrypt_flag) {
+            krb5_warnx(context, "the flat format needs a dump-file, and "
+                       "keeps keys encrypted");
+            return 0;
+        }
+        ret = db->hdb_open(context, db, O_RDONLY, 0600);
+        if (ret) {
+            krb5_warn(context, ret, "hdb_open");
+            return 0;
+        }
+        ret = hdb_flat_dump(context, db, argv[0]);
+        if (ret)
+            krb5_warn(context, ret, "writing flat snapshot %s", argv[0]);
+        db->hdb_close(context, db);
+        return 0;
+    }
+
     if (argc == 0)
 	f = stdout;
     else
@@ -73,11 +215,16 @@ dump(struct dump_options *opt, int argc, char **argv)
         parg.fmt = HDB_DUMP_MIT;
         fprintf(f, "kdb5_util load_dump version 5\n"); /* 5||6, either way */
     } else {
-        krb5_errx(context, 1, "Supported dump formats: Heimdal and MIT");
+        krb5_errx(context, 1, "Supported dump formats: Heimdal, MIT and flat");
     }
     parg.out = f;
-    hdb_foreach(context, db, opt->decrypt_flag ? HDB_F_DECRYPT : 0,
-		hdb_print_entry, &parg);
+    flags = opt->decrypt_flag ? HDB_F_DECRYPT : 0;
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+    /* Backends that cannot shard are dumped with one thread */
+    if (opt->threads_integer < 2 || db->hdb_set_shard == NULL ||
+	dump_threads(db, flags, &parg, opt->threads_integer) != 0)
+#endif
+    hdb_foreach(context, db, flags, hdb_print_entry, &parg);
 
     db->hdb_close(context, db);
 out:
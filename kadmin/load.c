@@ -400,13 +400,306 @@ my_fgetln(FILE *f, char **bufp, size_t *szp, size_t *lenp)
     return 0; /* *len == 0 || no EOL -> EOF */
 }
 
+/*
+ * Parse one line of a dump into `ent'.  On error complain, free `ent'
+ * and return -1.
+ */
+static int
+parse_line(const char *filename, int lineno, char *line, hdb_entry_ex *ent)
+{
+    krb5_error_code ret;
+    struct entry e;
+    char *p;
+
+    p = line;
+    while (isspace((unsigned char)*p))
+        p++;
+
+    e.principal = p;
+    for (p = line; *p; p++){
+        if (*p == '\\') /* Support '\n' escapes??? */
+            p++;
+        else if (isspace((unsigned char)*p)) {
+            *p = 0;
+            break;
+        }
+    }
+    p = skip_next(p);
+
+    e.key = p;
+    p = skip_next(p);
+
+    e.created = p;
+    p = skip_next(p);
+
+    e.modified = p;
+    p = skip_next(p);
+
+    e.valid_start = p;
+    p = skip_next(p);
+
+    e.valid_end = p;
+    p = skip_next(p);
+
+    e.pw_end = p;
+    p = skip_next(p);
+
+    e.max_life = p;
+    p = skip_next(p);
+
+    e.max_renew = p;
+    p = skip_next(p);
+
+    e.flags = p;
+    p = skip_next(p);
+
+    e.generation = p;
+    p = skip_next(p);
+
+    e.extensions = p;
+    skip_next(p);
+
+    memset(ent, 0, sizeof(*ent));
+    ret = krb5_parse_name(context, e.principal, &ent->entry.principal);
+    if (ret) {
+        const char *msg = krb5_get_error_message(context, ret);
+        fprintf(stderr, "%s:%d:%s (%s)\n",
+                filename, lineno, msg, e.principal);
+        krb5_free_error_message(context, msg);
+        return -1;
+    }
+
+    if (parse_keys(&ent->entry, e.key)) {
+        fprintf (stderr, "%s:%d:error parsing keys (%s)\n",
+                 filename, lineno, e.key);
+        goto fail;
+    }
+
+    if (parse_event(&ent->entry.created_by, e.created) == -1) {
+        fprintf (stderr, "%s:%d:error parsing created event (%s)\n",
+                 filename, lineno, e.created);
+        goto fail;
+    }
+    if (parse_event_alloc (&ent->entry.modified_by, e.modified) == -1) {
+        fprintf (stderr, "%s:%d:error parsing event (%s)\n",
+                 filename, lineno, e.modified);
+        goto fail;
+    }
+    if (parse_time_string_alloc (&ent->entry.valid_start, e.valid_start) == -1) {
+        fprintf (stderr, "%s:%d:error parsing time (%s)\n",
+                 filename, lineno, e.valid_start);
+        goto fail;
+    }
+    if (parse_time_string_alloc (&ent->entry.valid_end,   e.valid_end) == -1) {
+        fprintf (stderr, "%s:%d:error parsing time (%s)\n",
+                 filename, lineno, e.valid_end);
+        goto fail;
+    }
+    if (parse_time_string_alloc (&ent->entry.pw_end,      e.pw_end) == -1) {
+        fprintf (stderr, "%s:%d:error parsing time (%s)\n",
+                 filename, lineno, e.pw_end);
+        goto fail;
+    }
+
+    if (parse_integer_alloc (&ent->entry.max_life,  e.max_life) == -1) {
+        fprintf (stderr, "%s:%d:error parsing lifetime (%s)\n",
+                 filename, lineno, e.max_life);
+        goto fail;
+    }
+    if (parse_integer_alloc (&ent->entry.max_renew, e.max_renew) == -1) {
+        fprintf (stderr, "%s:%d:error parsing lifetime (%s)\n",
+                 filename, lineno, e.max_renew);
+        goto fail;
+    }
+
+    if (parse_hdbflags2int (&ent->entry.flags, e.flags) != 1) {
+        fprintf (stderr, "%s:%d:error parsing flags (%s)\n",
+                 filename, lineno, e.flags);
+        goto fail;
+    }
+
+    if(parse_generation(e.generation, &ent->entry.generation) == -1) {
+        fprintf (stderr, "%s:%d:error parsing generation (%s)\n",
+                 filename, lineno, e.generation);
+        goto fail;
+    }
+
+    if (parse_extensions(&e.extensions, &ent->entry.extensions) == -1) {
+        fprintf (stderr, "%s:%d:error parsing extension (%s)\n",
+                 filename, lineno, e.extensions);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    hdb_free_entry (context, ent);
+    return -1;
+}
+
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+
+/*
+ * With --threads the dump is read in rounds of LOAD_ROUND_LINES lines per
+ * thread.  While the threads parse one round, the main thread stores the
+ * entries of the previous one, in order, so the result is the same as
+ * with one thread.
+ */
+#define LOAD_ROUND_LINES 1024
+
+struct load_round {
+    const char *filename;
+    char **lines;
+    hdb_entry_ex *ents;
+    int *bad;
+    size_t n;
+    int lineno;                 /* of lines[0] */
+};
+
+struct load_slice {
+    struct load_round *round;
+    size_t start;
+    size_t end;
+    pthread_t thread;
+    unsigned int started:1;
+};
+
+static void *
+load_slice_thread(void *arg)
+{
+    struct load_slice *s = arg;
+    struct load_round *r = s->round;
+    size_t i;
+
+    for (i = s->start; i < s->end; i++)
+        r->bad[i] = parse_line(r->filename, r->lineno + (int)i, r->lines[i],
+                               &r->ents[i]);
+    return NULL;
+}
+
+/*
+ * Store the entries of round `r' unless `ret' is an earlier error, and
+ * free the round's lines and entries.
+ */
+static krb5_error_code
+load_round_finish(HDB *db, struct load_round *r, krb5_error_code ret,
+                  int *badp)
+{
+    size_t i;
+
+    for (i = 0; i < r->n; i++) {
+        free(r->lines[i]);
+        if (r->bad[i]) {
+            *badp = 1;
+            continue;
+        }
+        if (ret == 0) {
+            ret = db->hdb_store(context, db, HDB_F_REPLACE, &r->ents[i]);
+            if (ret)
+                krb5_warn(context, ret, "db_store");
+        }
+        hdb_free_entry(context, &r->ents[i]);
+    }
+    r->n = 0;
+    return ret;
+}
+
+static krb5_error_code
+load_threads(FILE *f, const char *filename, HDB *db, unsigned int nthreads,
+             int *badp)
+{
+    krb5_error_code ret = 0;
+    krb5_error_code ret2 = 0;
+    struct load_round rounds[2];
+    struct load_round *r, *prev = NULL;
+    struct load_slice *slices;
+    size_t max = (size_t)nthreads * LOAD_ROUND_LINES;
+    size_t per, i;
+    char *line = NULL;
+    size_t linesz = 0;
+    size_t linelen = 0;
+    int lineno = 1;
+    int cur = 0;
+
+    memset(rounds, 0, sizeof(rounds));
+    slices = calloc(nthreads, sizeof(slices[0]));
+    for (i = 0; slices && i < 2; i++) {
+        rounds[i].filename = filename;
+        rounds[i].lines = calloc(max, sizeof(rounds[i].lines[0]));
+        rounds[i].ents = calloc(max, sizeof(rounds[i].ents[0]));
+        rounds[i].bad = calloc(max, sizeof(rounds[i].bad[0]));
+        if (!rounds[i].lines || !rounds[i].ents || !rounds[i].bad)
+            break;
+    }
+    if (slices == NULL || i < 2) {
+        ret = krb5_enomem(context);
+        goto out;
+    }
+
+    for (;;) {
+        r = &rounds[cur];
+        r->lineno = lineno;
+        while (ret2 == 0 && r->n < max &&
+               (ret2 = my_fgetln(f, &line, &linesz, &linelen)) == 0 &&
+               linelen > 0) {
+            if ((r->lines[r->n] = strdup(line)) == NULL) {
+                ret2 = krb5_enomem(context);
+                break;
+            }
+            r->n++;
+            lineno++;
+        }
+
+        per = (r->n + nthreads - 1) / nthreads;
+        for (i = 0; i < nthreads; i++) {
+            slices[i].round = r;
+            slices[i].start = i * per < r->n ? i * per : r->n;
+            slices[i].end = (i + 1) * per < r->n ? (i + 1) * per : r->n;
+            slices[i].started = 0;
+            if (slices[i].start == slices[i].end)
+                continue;
+            if (pthread_create(&slices[i].thread, NULL, load_slice_thread,
+                               &slices[i]) == 0)
+                slices[i].started = 1;
+            else
+                load_slice_thread(&slices[i]);
+        }
+
+        if (prev)
+            ret = load_round_finish(db, prev, ret, badp);
+
+        for (i = 0; i < nthreads; i++)
+            if (slices[i].started)
+                pthread_join(slices[i].thread, NULL);
+
+        prev = r;
+        cur ^= 1;
+        if (r->n < max || ret2)
+            break;
+    }
+    ret = load_round_finish(db, prev, ret, badp);
+    if (ret == 0)
+        ret = ret2;
+
+out:
+    free(line);
+    for (i = 0; i < 2; i++) {
+        free(rounds[i].lines);
+        free(rounds[i].ents);
+        free(rounds[i].bad);
+    }
+    free(slices);
+    return ret;
+}
+#endif
+
 /*
  * Parse the dump file in `filename' and create the database (merging
  * iff merge)
  */
 
 static int
-doit(const char *filename, int mergep)
+doit(const char *filename, int mergep, unsigned int nthreads)
 {
     krb5_error_code ret = 0;
     krb5_error_code ret2 = 0;
@@ -414,10 +707,9 @@ doit(const char *filename, int mergep)
     char *line = NULL;
     size_t linesz = 0;
     size_t linelen = 0;
-    char *p;
     int lineno;
+    int bad = 0;
     int flags = O_RDWR;
-    struct entry e;
     hdb_entry_ex ent;
     HDB *db = _kadm5_s_get_db(kadm_handle);
 
@@ -454,151 +746,30 @@ doit(const char *filename, int mergep)
 	return 1;
     }
     (void) db->hdb_set_sync(context, db, 0);
+    ret2 = hdb_begin_batch(context, db);
+    if (ret2) {
+	krb5_warn(context, ret2, "hdb_begin_batch");
+	(void) db->hdb_close(context, db);
+	fclose(f);
+	return 1;
+    }
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+    if (nthreads > 1) {
+        /* Make sure the threads only read the default realm */
+        char *realm = NULL;
+
+        if (krb5_get_default_realm(context, &realm) == 0)
+            free(realm);
+        ret2 = load_threads(f, filename, db, nthreads, &bad);
+    } else
+#endif
     for (lineno = 1;
          (ret2 = my_fgetln(f, &line, &linesz, &linelen)) == 0 && linelen > 0;
 	 ++lineno) {
-	p = line;
-	while (isspace((unsigned char)*p))
-	    p++;
-
-	e.principal = p;
-	for (p = line; *p; p++){
-	    if (*p == '\\') /* Support '\n' escapes??? */
-		p++;
-	    else if (isspace((unsigned char)*p)) {
-		*p = 0;
-		break;
-	    }
-	}
-	p = skip_next(p);
-
-	e.key = p;
-	p = skip_next(p);
-
-	e.created = p;
-	p = skip_next(p);
-
-	e.modified = p;
-	p = skip_next(p);
-
-	e.valid_start = p;
-	p = skip_next(p);
-
-	e.valid_end = p;
-	p = skip_next(p);
-
-	e.pw_end = p;
-	p = skip_next(p);
-
-	e.max_life = p;
-	p = skip_next(p);
-
-	e.max_renew = p;
-	p = skip_next(p);
-
-	e.flags = p;
-	p = skip_next(p);
-
-	e.generation = p;
-	p = skip_next(p);
-
-	e.extensions = p;
-	skip_next(p);
-
-	memset(&ent, 0, sizeof(ent));
-	ret2 = krb5_parse_name(context, e.principal, &ent.entry.principal);
-	if (ret2) {
-	    const char *msg = krb5_get_error_message(context, ret);
-	    fprintf(stderr, "%s:%d:%s (%s)\n",
-		    filename, lineno, msg, e.principal);
-	    krb5_free_error_message(context, msg);
-            ret = 1;
-	    continue;
-	}
-
-	if (parse_keys(&ent.entry, e.key)) {
-	    fprintf (stderr, "%s:%d:error parsing keys (%s)\n",
-		     filename, lineno, e.key);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-
-	if (parse_event(&ent.entry.created_by, e.created) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing created event (%s)\n",
-		     filename, lineno, e.created);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-	if (parse_event_alloc (&ent.entry.modified_by, e.modified) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing event (%s)\n",
-		     filename, lineno, e.modified);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-	if (parse_time_string_alloc (&ent.entry.valid_start, e.valid_start) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing time (%s)\n",
-		     filename, lineno, e.valid_start);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-	if (parse_time_string_alloc (&ent.entry.valid_end,   e.valid_end) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing time (%s)\n",
-		     filename, lineno, e.valid_end);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-	if (parse_time_string_alloc (&ent.entry.pw_end,      e.pw_end) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing time (%s)\n",
-		     filename, lineno, e.pw_end);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-
-	if (parse_integer_alloc (&ent.entry.max_life,  e.max_life) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing lifetime (%s)\n",
-		     filename, lineno, e.max_life);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-
-	}
-	if (parse_integer_alloc (&ent.entry.max_renew, e.max_renew) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing lifetime (%s)\n",
-		     filename, lineno, e.max_renew);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
+	if (parse_line(filename, lineno, line, &ent)) {
+            bad = 1;
 	    continue;
-	}
-
-	if (parse_hdbflags2int (&ent.entry.flags, e.flags) != 1) {
-	    fprintf (stderr, "%s:%d:error parsing flags (%s)\n",
-		     filename, lineno, e.flags);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-
-	if(parse_generation(e.generation, &ent.entry.generation) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing generation (%s)\n",
-		     filename, lineno, e.generation);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
-
-	if (parse_extensions(&e.extensions, &ent.entry.extensions) == -1) {
-	    fprintf (stderr, "%s:%d:error parsing extension (%s)\n",
-		     filename, lineno, e.extensions);
-	    hdb_free_entry (context, &ent);
-            ret = 1;
-	    continue;
-	}
+        }
 
 	ret2 = db->hdb_store(context, db, HDB_F_REPLACE, &ent);
 	hdb_free_entry (context, &ent);
@@ -608,8 +779,16 @@ doit(const char *filename, int mergep)
 	}
     }
     free(line);
+    if (bad)
+        ret = 1;
     if (ret2)
         ret = ret2;
+    /* Keep what was loaded before any error, as without batching */
+    ret2 = hdb_end_batch(context, db, 1);
+    if (ret2) {
+        krb5_warn(context, ret2, "hdb_end_batch");
+        ret = ret2;
+    }
     ret2 = db->hdb_set_sync(context, db, 1);
     if (ret2) {
         krb5_err(context, 1, ret2, "failed to sync the HDB");
@@ -627,24 +806,24 @@ doit(const char *filename, int mergep)
 extern int local_flag;
 
 static int
-loadit(int mergep, const char *name, int argc, char **argv)
+loadit(int mergep, const char *name, int nthreads, int argc, char **argv)
 {
     if(!local_flag) {
 	krb5_warnx(context, "%s is only available in local (-l) mode", name);
 	return 0;
     }
 
-    return doit(argv[0], mergep);
+    return doit(argv[0], mergep, nthreads > 1 ? nthreads : 1);
 }
 
 int
-load(void *opt, int argc, char **argv)
+load(struct load_options *opt, int argc, char **argv)
 {
-    return loadit(0, "load", argc, argv);
+    return loadit(0, "load", opt->threads_integer, argc, argv);
 }
 
 int
-merge(void *opt, int argc, char **argv)
+merge(struct merge_options *opt, int argc, char **argv)
 {
-    return loadit(1, "merge", argc, argv);
+    return loadit(1, "merge", opt->threads_integer, argc, argv);
 }
@@ -38,9 +38,66 @@ static kadm5_ret_t check_aliases(kadm5_server_context *,
                                  kadm5_principal_ent_rec *,
                                  kadm5_principal_ent_rec *);
 
+struct kadmind_conn {
+    krb5_context context;
+    krb5_auth_context ac;
+    krb5_socket_t fd;
+    void *kadm_handlep;
+    krb5_data *replies;         /* held until their batch is committed */
+    size_t nreplies;
+};
+
+static void flush_batch(struct kadmind_conn *);
+static void send_partial_reply(struct kadmind_conn *, krb5_storage *);
+
+/* Names per reply when streaming kadm_get_princs */
+#define LIST_STREAM_CHUNK 1000
+
+struct list_stream {
+    struct kadmind_conn *conn;
+    char **names;
+    int32_t n;
+};
+
+static int
+list_stream_flush(struct list_stream *ls)
+{
+    krb5_storage *sp;
+    int32_t i;
+
+    if (ls->n == 0)
+	return 0;
+    sp = krb5_storage_emem();
+    if (sp == NULL)
+	return ENOMEM;
+    krb5_store_int32(sp, 0);
+    krb5_store_int32(sp, -ls->n);
+    for (i = 0; i < ls->n; i++) {
+	krb5_store_string(sp, ls->names[i]);
+	free(ls->names[i]);
+    }
+    ls->n = 0;
+    send_partial_reply(ls->conn, sp);
+    krb5_storage_free(sp);
+    return 0;
+}
+
+static int
+list_stream_add(void *data, const char *name)
+{
+    struct list_stream *ls = data;
+
+    if ((ls->names[ls->n] = strdup(name)) == NULL)
+	return ENOMEM;
+    if (++ls->n < LIST_STREAM_CHUNK)
+	return 0;
+    return list_stream_flush(ls);
+}
+
 static kadm5_ret_t
-kadmind_dispatch(void *kadm_handlep, krb5_boolean initial,
-		 krb5_data *in, krb5_data *out, int readonly)
+kadmind_dispatch(void *kadm_handlep, struct kadmind_conn *conn,
+		 krb5_boolean initial, krb5_data *in, krb5_data *out,
+		 int readonly)
 {
     kadm5_ret_t ret;
     int32_t cmd, mask, kvno, tmp;
@@ -610,6 +667,36 @@ kadmind_dispatch(void *kadm_handlep, krb5_boolean initial,
 	    free(expression);
 	    goto fail;
 	}
+	if (tmp & KADM_GET_PRINCS_STREAM) {
+	    struct list_stream ls;
+
+	    /* Not in the middle of the iteration, which may be of a batch */
+	    flush_batch(conn);
+	    ls.conn = conn;
+	    ls.n = 0;
+	    ls.names = calloc(LIST_STREAM_CHUNK, sizeof(ls.names[0]));
+	    if (ls.names == NULL)
+		ret = krb5_enomem(contextp->context);
+	    else
+		ret = kadm5_iter_principals(kadm_handlep, expression,
+					    list_stream_add, &ls);
+	    if (ret == 0)
+		ret = list_stream_flush(&ls);
+	    while (ls.n > 0)
+		free(ls.names[--ls.n]);
+	    free(ls.names);
+	    free(expression);
+	    krb5_storage_free(sp);
+	    sp = krb5_storage_emem();
+	    if (sp == NULL) {
+		ret = krb5_enomem(contextp->context);
+		goto fail;
+	    }
+	    krb5_store_int32(sp, ret);
+	    if (ret == 0)
+		krb5_store_int32(sp, 0);
+	    break;
+	}
 	ret = kadm5_get_principals(kadm_handlep, expression, &princs, &n_princs);
 	free(expression);
 	krb5_storage_free(sp);
@@ -785,6 +872,86 @@ check_aliases(kadm5_server_context *contextp,
     return 0;
 }
 
+/*
+ * Is there another request already waiting on the connection?
+ */
+static int
+request_pending(krb5_socket_t fd)
+{
+    struct timeval tv;
+    fd_set fds;
+
+#ifndef NO_LIMIT_FD_SETSIZE
+    if (fd >= FD_SETSIZE)
+	return 0;
+#endif
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    return select(fd + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+/*
+ * Clients that pipeline their requests (automated provisioning, say)
+ * leave further requests queued on the socket while we handle one.
+ * With [kadmin] batch-requests = N we then lock the HDB and keep it and
+ * the iprop log open across up to N such back-to-back requests, instead
+ * of reopening both for each, and let the log group-commit them.  The
+ * replies are held until the batch is committed, and the lock is
+ * released as soon as the client stops sending, so interactive clients,
+ * and other kadmind processes, are not held up.
+ */
+static void
+write_replies(struct kadmind_conn *conn, krb5_data *replies, size_t n)
+{
+    krb5_error_code ret = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+	if (ret == 0)
+	    ret = krb5_write_priv_message(conn->context, conn->ac, &conn->fd,
+					  &replies[i]);
+	krb5_data_free(&replies[i]);
+    }
+    if(ret)
+	krb5_err(conn->context, 1, ret, "krb5_write_priv_message");
+}
+
+/*
+ * Commit the batch so far and send its replies.  If the commit fails we
+ * must not claim success, so drop the connection.
+ */
+static void
+flush_batch(struct kadmind_conn *conn)
+{
+    krb5_error_code ret;
+
+    if (conn->nreplies == 0)
+	return;
+    ret = kadm5_log_group_commit(conn->kadm_handlep);
+    if (ret)
+	krb5_err(conn->context, 1, ret, "kadm5_log_group_commit");
+    write_replies(conn, conn->replies, conn->nreplies);
+    conn->nreplies = 0;
+}
+
+/*
+ * Send one of several replies to the current request.
+ */
+static void
+send_partial_reply(struct kadmind_conn *conn, krb5_storage *sp)
+{
+    krb5_data out;
+    krb5_error_code ret;
+
+    flush_batch(conn);
+    ret = krb5_storage_to_data(sp, &out);
+    if (ret)
+	krb5_err(conn->context, 1, ret, "krb5_storage_to_data");
+    write_replies(conn, &out, 1);
+}
+
 static void
 v5_loop (krb5_context contextp,
 	 krb5_auth_context ac,
@@ -793,8 +960,28 @@ v5_loop (krb5_context contextp,
 	 krb5_socket_t fd,
          int readonly)
 {
+    struct kadmind_conn conn;
     krb5_error_code ret;
     krb5_data in, out;
+    int batch_max;
+    int locked = 0;
+
+    conn.context = contextp;
+    conn.ac = ac;
+    conn.fd = fd;
+    conn.kadm_handlep = kadm_handlep;
+    conn.replies = NULL;
+    conn.nreplies = 0;
+
+    batch_max = krb5_config_get_int_default(contextp, NULL, 0,
+					    "kadmin", "batch-requests", NULL);
+    if (readonly || batch_max < 2)
+	batch_max = 0;
+    if (batch_max) {
+	conn.replies = calloc(batch_max, sizeof(conn.replies[0]));
+	if (conn.replies == NULL)
+	    batch_max = 0;
+    }
 
     for (;;) {
 	doing_useful_work = 0;
@@ -806,14 +993,26 @@ v5_loop (krb5_context contextp,
 	if(ret)
 	    krb5_err(contextp, 1, ret, "krb5_read_priv_message");
 	doing_useful_work = 1;
-	ret = kadmind_dispatch(kadm_handlep, initial, &in, &out, readonly);
+	if (!locked && batch_max && request_pending(fd) &&
+	    kadm5_lock(kadm_handlep) == 0)
+	    locked = 1;
+	ret = kadmind_dispatch(kadm_handlep, &conn, initial, &in, &out,
+			       readonly);
 	if (ret)
 	    krb5_err(contextp, 1, ret, "kadmind_dispatch");
 	krb5_data_free(&in);
-	ret = krb5_write_priv_message(contextp, ac, &fd, &out);
-	krb5_data_free(&out);
-	if(ret)
-	    krb5_err(contextp, 1, ret, "krb5_write_priv_message");
+	if (!locked) {
+	    write_replies(&conn, &out, 1);
+	    continue;
+	}
+	conn.replies[conn.nreplies++] = out;
+	if (conn.nreplies < (size_t)batch_max && request_pending(fd))
+	    continue;
+	flush_batch(&conn);
+	ret = kadm5_unlock(kadm_handlep);
+	locked = 0;
+	if (ret)
+	    krb5_err(contextp, 1, ret, "kadm5_unlock");
     }
 }
 
@@ -649,6 +649,65 @@ foreach_principal(const char *exp_str,
     return ret;
 }
 
+struct stream_data {
+    int (*func)(krb5_principal, void *);
+    const char *funcname;
+    void *data;
+    krb5_error_code saved_ret;
+};
+
+static int
+stream_one(void *data, const char *name)
+{
+    struct stream_data *d = data;
+    krb5_principal princ_ent;
+    krb5_error_code ret;
+
+    ret = krb5_parse_name(context, name, &princ_ent);
+    if(ret){
+	krb5_warn(context, ret, "krb5_parse_name(%s)", name);
+	return 0;
+    }
+    ret = (*d->func)(princ_ent, d->data);
+    if(ret) {
+	krb5_warn(context, ret, "%s %s", d->funcname, name);
+	krb5_clear_error_message(context);
+	if (d->saved_ret == 0)
+	    d->saved_ret = ret;
+    }
+    krb5_free_principal(context, princ_ent);
+    return 0;
+}
+
+/*
+ * Like foreach_principal(), but calls `func' as matching principals
+ * are found rather than once all of them have been, so that listing a
+ * large database does not have to wait for (or hold) the whole list.
+ * `func' must not use kadm_handle.
+ */
+int
+stream_principals(const char *exp_str,
+		  int (*func)(krb5_principal, void*),
+		  const char *funcname,
+		  void *data)
+{
+    struct stream_data d;
+    krb5_error_code ret;
+
+    if(!is_expression(exp_str))
+	return foreach_principal(exp_str, func, funcname, data);
+    d.func = func;
+    d.funcname = funcname;
+    d.data = data;
+    d.saved_ret = 0;
+    ret = kadm5_iter_principals(kadm_handle, exp_str, stream_one, &d);
+    if(ret) {
+	krb5_warn(context, ret, "kadm5_iter_principals");
+	return ret;
+    }
+    return d.saved_ret;
+}
+
 /*
  * prompt with `prompt' and default value `def', and store the reply
  * in `buf, len'
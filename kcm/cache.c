@@ -34,19 +34,78 @@
 
 #include "kcm_locl.h"
 
-HEIMDAL_MUTEX ccache_mutex = HEIMDAL_MUTEX_INITIALIZER;
-kcm_ccache_data *ccache_head = NULL;
+/*
+ * The caches are kept in a hash table by name, and indexed in a second
+ * one by UUID, so that neither lookup has to walk all of them.  Each
+ * bucket has its own mutex; where both are needed the name bucket is
+ * locked first.
+ */
+#define CCACHE_BUCKETS 1024
+
+struct ccache_bucket {
+    HEIMDAL_MUTEX mutex;
+    kcm_ccache_data *head;
+    int init;
+};
+
+static struct ccache_bucket ccache_by_name[CCACHE_BUCKETS];
+static struct ccache_bucket ccache_by_uuid[CCACHE_BUCKETS];
+static HEIMDAL_MUTEX ccache_init_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static int ccache_buckets_init = 0;
+
+static HEIMDAL_MUTEX ccache_nextid_mutex = HEIMDAL_MUTEX_INITIALIZER;
 static unsigned int ccache_nextid = 0;
 
+static void
+ccache_init_buckets(void)
+{
+    size_t i;
+
+    HEIMDAL_MUTEX_lock(&ccache_init_mutex);
+    if (!ccache_buckets_init) {
+	for (i = 0; i < CCACHE_BUCKETS; i++) {
+	    HEIMDAL_MUTEX_init(&ccache_by_name[i].mutex);
+	    HEIMDAL_MUTEX_init(&ccache_by_uuid[i].mutex);
+	}
+	ccache_buckets_init = 1;
+    }
+    HEIMDAL_MUTEX_unlock(&ccache_init_mutex);
+}
+
+static struct ccache_bucket *
+name_bucket(const char *name)
+{
+    const unsigned char *p;
+    uint32_t h = 2166136261U;
+
+    if (!ccache_buckets_init)
+	ccache_init_buckets();
+    for (p = (const unsigned char *)name; *p; p++)
+	h = (h ^ *p) * 16777619U;
+    return &ccache_by_name[h % CCACHE_BUCKETS];
+}
+
+static struct ccache_bucket *
+uuid_bucket(const kcmuuid_t uuid)
+{
+    uint32_t h;
+
+    if (!ccache_buckets_init)
+	ccache_init_buckets();
+    /* UUIDs are random */
+    h = uuid[0] | (uuid[1] << 8) | (uuid[2] << 16) | ((uint32_t)uuid[3] << 24);
+    return &ccache_by_uuid[h % CCACHE_BUCKETS];
+}
+
 char *kcm_ccache_nextid(pid_t pid, uid_t uid, gid_t gid)
 {
     unsigned n;
     char *name;
     int ret;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
+    HEIMDAL_MUTEX_lock(&ccache_nextid_mutex);
     n = ++ccache_nextid;
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
+    HEIMDAL_MUTEX_unlock(&ccache_nextid_mutex);
 
     ret = asprintf(&name, "%ld:%u", (long)uid, n);
     if (ret == -1)
@@ -60,6 +119,7 @@ kcm_ccache_resolve(krb5_context context,
 		   const char *name,
 		   kcm_ccache *ccache)
 {
+    struct ccache_bucket *b = name_bucket(name);
     kcm_ccache p;
     krb5_error_code ret;
 
@@ -67,9 +127,9 @@ kcm_ccache_resolve(krb5_context context,
 
     ret = KRB5_FCC_NOFILE;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
+    HEIMDAL_MUTEX_lock(&b->mutex);
 
-    for (p = ccache_head; p != NULL; p = p->next) {
+    for (p = b->head; p != NULL; p = p->next) {
 	if ((p->flags & KCM_FLAGS_VALID) == 0)
 	    continue;
 	if (strcmp(p->name, name) == 0) {
@@ -83,7 +143,7 @@ kcm_ccache_resolve(krb5_context context,
 	*ccache = p;
     }
 
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
+    HEIMDAL_MUTEX_unlock(&b->mutex);
 
     return ret;
 }
@@ -93,6 +153,7 @@ kcm_ccache_resolve_by_uuid(krb5_context context,
 			   kcmuuid_t uuid,
 			   kcm_ccache *ccache)
 {
+    struct ccache_bucket *b = uuid_bucket(uuid);
     kcm_ccache p;
     krb5_error_code ret;
 
@@ -100,9 +161,9 @@ kcm_ccache_resolve_by_uuid(krb5_context context,
 
     ret = KRB5_FCC_NOFILE;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
+    HEIMDAL_MUTEX_lock(&b->mutex);
 
-    for (p = ccache_head; p != NULL; p = p->next) {
+    for (p = b->head; p != NULL; p = p->uuid_next) {
 	if ((p->flags & KCM_FLAGS_VALID) == 0)
 	    continue;
 	if (memcmp(p->uuid, uuid, sizeof(kcmuuid_t)) == 0) {
@@ -116,7 +177,7 @@ kcm_ccache_resolve_by_uuid(krb5_context context,
 	*ccache = p;
     }
 
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
+    HEIMDAL_MUTEX_unlock(&b->mutex);
 
     return ret;
 }
@@ -126,24 +187,29 @@ kcm_ccache_get_uuids(krb5_context context, kcm_client *client, kcm_operation opc
 {
     krb5_error_code ret;
     kcm_ccache p;
+    size_t i;
 
     ret = KRB5_FCC_NOFILE;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
+    for (i = 0; i < CCACHE_BUCKETS; i++) {
+	struct ccache_bucket *b = &ccache_by_uuid[i];
 
-    for (p = ccache_head; p != NULL; p = p->next) {
-	if ((p->flags & KCM_FLAGS_VALID) == 0)
-	    continue;
-	ret = kcm_access(context, client, opcode, p);
-	if (ret) {
-	    ret = 0;
+	if (b->head == NULL)
 	    continue;
+	HEIMDAL_MUTEX_lock(&b->mutex);
+	for (p = b->head; p != NULL; p = p->uuid_next) {
+	    if ((p->flags & KCM_FLAGS_VALID) == 0)
+		continue;
+	    ret = kcm_access(context, client, opcode, p);
+	    if (ret) {
+		ret = 0;
+		continue;
+	    }
+	    krb5_storage_write(sp, p->uuid, sizeof(p->uuid));
 	}
-	krb5_storage_write(sp, p->uuid, sizeof(p->uuid));
+	HEIMDAL_MUTEX_unlock(&b->mutex);
     }
 
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
-
     return ret;
 }
 
@@ -151,38 +217,41 @@ kcm_ccache_get_uuids(krb5_context context, kcm_client *client, kcm_operation opc
 krb5_error_code kcm_debug_ccache(krb5_context context)
 {
     kcm_ccache p;
+    size_t i;
 
-    for (p = ccache_head; p != NULL; p = p->next) {
-	char *cpn = NULL, *spn = NULL;
-	int ncreds = 0;
-	struct kcm_creds *k;
+    for (i = 0; i < CCACHE_BUCKETS; i++) {
+	for (p = ccache_by_name[i].head; p != NULL; p = p->next) {
+	    char *cpn = NULL, *spn = NULL;
+	    int ncreds = 0;
+	    struct kcm_creds *k;
 
-	if ((p->flags & KCM_FLAGS_VALID) == 0) {
-	    kcm_log(7, "cache %08x: empty slot");
-	    continue;
-	}
+	    if ((p->flags & KCM_FLAGS_VALID) == 0) {
+		kcm_log(7, "cache %08x: empty slot");
+		continue;
+	    }
 
-	KCM_ASSERT_VALID(p);
+	    KCM_ASSERT_VALID(p);
 
-	for (k = p->creds; k != NULL; k = k->next)
-	    ncreds++;
+	    for (k = p->creds; k != NULL; k = k->next)
+		ncreds++;
 
-	if (p->client != NULL)
-	    krb5_unparse_name(context, p->client, &cpn);
-	if (p->server != NULL)
-	    krb5_unparse_name(context, p->server, &spn);
+	    if (p->client != NULL)
+		krb5_unparse_name(context, p->client, &cpn);
+	    if (p->server != NULL)
+		krb5_unparse_name(context, p->server, &spn);
 
-	kcm_log(7, "cache %08x: name %s refcnt %d flags %04x mode %04o "
-		"uid %d gid %d client %s server %s ncreds %d",
-		p, p->name, p->refcnt, p->flags, p->mode, p->uid, p->gid,
-		(cpn == NULL) ? "<none>" : cpn,
-		(spn == NULL) ? "<none>" : spn,
-		ncreds);
+	    kcm_log(7, "cache %08x: name %s refcnt %d flags %04x mode %04o "
+		    "uid %d gid %d client %s server %s ncreds %d",
+		    p, p->name, p->refcnt, p->flags, p->mode, p->uid, p->gid,
+		    (cpn == NULL) ? "<none>" : cpn,
+		    (spn == NULL) ? "<none>" : spn,
+		    ncreds);
 
-	if (cpn != NULL)
-	    free(cpn);
-	if (spn != NULL)
-	    free(spn);
+	    if (cpn != NULL)
+		free(cpn);
+	    if (spn != NULL)
+		free(spn);
+	}
     }
 
     return 0;
@@ -220,6 +289,7 @@ kcm_free_ccache_data_internal(krb5_context context,
     cache->kdc_offset = 0;
 
     cache->next = NULL;
+    cache->uuid_next = NULL;
     cache->refcnt = 0;
 
     HEIMDAL_MUTEX_unlock(&cache->mutex);
@@ -230,13 +300,14 @@ kcm_free_ccache_data_internal(krb5_context context,
 krb5_error_code
 kcm_ccache_destroy(krb5_context context, const char *name)
 {
+    struct ccache_bucket *b = name_bucket(name), *ub;
     kcm_ccache *p, ccache;
     krb5_error_code ret;
 
     ret = KRB5_FCC_NOFILE;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
-    for (p = &ccache_head; *p != NULL; p = &(*p)->next) {
+    HEIMDAL_MUTEX_lock(&b->mutex);
+    for (p = &b->head; *p != NULL; p = &(*p)->next) {
 	if (((*p)->flags & KCM_FLAGS_VALID) == 0)
 	    continue;
 	if (strcmp((*p)->name, name) == 0) {
@@ -254,11 +325,22 @@ kcm_ccache_destroy(krb5_context context, const char *name)
 
     ccache = *p;
     *p = (*p)->next;
+
+    ub = uuid_bucket(ccache->uuid);
+    HEIMDAL_MUTEX_lock(&ub->mutex);
+    for (p = &ub->head; *p != NULL; p = &(*p)->uuid_next) {
+	if (*p == ccache) {
+	    *p = ccache->uuid_next;
+	    break;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&ub->mutex);
+
     kcm_free_ccache_data_internal(context, ccache);
     free(ccache);
 
 out:
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
+    HEIMDAL_MUTEX_unlock(&b->mutex);
 
     return ret;
 }
@@ -268,50 +350,44 @@ kcm_ccache_alloc(krb5_context context,
 		 const char *name,
 		 kcm_ccache *ccache)
 {
+    struct ccache_bucket *b = name_bucket(name), *ub;
     kcm_ccache slot = NULL, p;
     krb5_error_code ret;
-    int new_slot = 0;
 
     *ccache = NULL;
 
     /* First, check for duplicates */
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
+    HEIMDAL_MUTEX_lock(&b->mutex);
     ret = 0;
-    for (p = ccache_head; p != NULL; p = p->next) {
-	if (p->flags & KCM_FLAGS_VALID) {
-	    if (strcmp(p->name, name) == 0) {
-		ret = KRB5_CC_WRITE;
-		break;
-	    }
-	} else if (slot == NULL)
-	    slot = p;
+    for (p = b->head; p != NULL; p = p->next) {
+	if ((p->flags & KCM_FLAGS_VALID) && strcmp(p->name, name) == 0) {
+	    ret = KRB5_CC_WRITE;
+	    break;
+	}
     }
 
     if (ret)
 	goto out;
 
     /*
-     * Create an enpty slot for us.
+     * Create a slot for us.
      */
+    slot = (kcm_ccache_data *)malloc(sizeof(*slot));
     if (slot == NULL) {
-	slot = (kcm_ccache_data *)malloc(sizeof(*slot));
-	if (slot == NULL) {
-	    ret = KRB5_CC_NOMEM;
-	    goto out;
-	}
-	slot->next = ccache_head;
-	HEIMDAL_MUTEX_init(&slot->mutex);
-	new_slot = 1;
+	ret = KRB5_CC_NOMEM;
+	goto out;
     }
 
     RAND_bytes(slot->uuid, sizeof(slot->uuid));
 
     slot->name = strdup(name);
     if (slot->name == NULL) {
+	free(slot);
 	ret = KRB5_CC_NOMEM;
 	goto out;
     }
 
+    HEIMDAL_MUTEX_init(&slot->mutex);
     slot->refcnt = 1;
     slot->flags = KCM_FLAGS_VALID;
     slot->mode = S_IRUSR | S_IWUSR;
@@ -320,28 +396,117 @@ kcm_ccache_alloc(krb5_context context,
     slot->client = NULL;
     slot->server = NULL;
     slot->creds = NULL;
+    slot->creds_index = NULL;
+    slot->ncreds = 0;
     slot->key.keytab = NULL;
     slot->tkt_life = 0;
     slot->renew_life = 0;
     slot->kdc_offset = 0;
 
-    if (new_slot)
-	ccache_head = slot;
+    slot->next = b->head;
+    b->head = slot;
 
-    *ccache = slot;
+    ub = uuid_bucket(slot->uuid);
+    HEIMDAL_MUTEX_lock(&ub->mutex);
+    slot->uuid_next = ub->head;
+    ub->head = slot;
+    HEIMDAL_MUTEX_unlock(&ub->mutex);
 
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
-    return 0;
+    *ccache = slot;
 
 out:
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
-    if (new_slot && slot != NULL) {
-	HEIMDAL_MUTEX_destroy(&slot->mutex);
-	free(slot);
-    }
+    HEIMDAL_MUTEX_unlock(&b->mutex);
     return ret;
 }
 
+/*
+ * Once a cache holds more than a few credentials they are also indexed
+ * by server name (ignoring the realm, as some lookups do) and by UUID.
+ * Within a server bucket the credentials stay in the order of the list,
+ * so lookups still find the first match.
+ */
+#define CREDS_INDEX_MIN 16
+#define CREDS_INDEX_SIZE 64
+
+struct kcm_creds_index {
+    struct kcm_creds *by_server[CREDS_INDEX_SIZE];
+    struct kcm_creds *by_uuid[CREDS_INDEX_SIZE];
+};
+
+static unsigned int
+creds_server_hash(krb5_const_principal server)
+{
+    const unsigned char *p;
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    if (server == NULL)
+	return 0;
+    for (i = 0; i < server->name.name_string.len; i++) {
+	for (p = (const unsigned char *)server->name.name_string.val[i];
+	     *p; p++)
+	    h = (h ^ *p) * 16777619U;
+	h = (h ^ '/') * 16777619U;
+    }
+    return h % CREDS_INDEX_SIZE;
+}
+
+static unsigned int
+creds_uuid_hash(const kcmuuid_t uuid)
+{
+    /* UUIDs are random */
+    return (uuid[0] | (uuid[1] << 8)) % CREDS_INDEX_SIZE;
+}
+
+static void
+creds_index_add(struct kcm_creds_index *idx, struct kcm_creds *c)
+{
+    struct kcm_creds **p;
+
+    c->server_next = NULL;
+    p = &idx->by_server[creds_server_hash(c->cred.server)];
+    while (*p != NULL)
+	p = &(*p)->server_next;
+    *p = c;
+
+    p = &idx->by_uuid[creds_uuid_hash(c->uuid)];
+    c->uuid_next = *p;
+    *p = c;
+}
+
+static void
+creds_index_del(struct kcm_creds_index *idx, struct kcm_creds *c)
+{
+    struct kcm_creds **p;
+
+    for (p = &idx->by_server[creds_server_hash(c->cred.server)];
+	 *p != NULL; p = &(*p)->server_next) {
+	if (*p == c) {
+	    *p = c->server_next;
+	    break;
+	}
+    }
+    for (p = &idx->by_uuid[creds_uuid_hash(c->uuid)];
+	 *p != NULL; p = &(*p)->uuid_next) {
+	if (*p == c) {
+	    *p = c->uuid_next;
+	    break;
+	}
+    }
+}
+
+static void
+creds_index_build(kcm_ccache ccache)
+{
+    struct kcm_creds *c;
+
+    ccache->creds_index = calloc(1, sizeof(*ccache->creds_index));
+    if (ccache->creds_index == NULL)
+	return; /* Lookups just walk the list */
+    for (c = ccache->creds; c != NULL; c = c->next)
+	creds_index_add(ccache->creds_index, c);
+}
+
 krb5_error_code
 kcm_ccache_remove_creds_internal(krb5_context context,
 				 kcm_ccache ccache)
@@ -358,6 +523,9 @@ kcm_ccache_remove_creds_internal(krb5_context context,
 	free(old);
     }
     ccache->creds = NULL;
+    free(ccache->creds_index);
+    ccache->creds_index = NULL;
+    ccache->ncreds = 0;
 
     return 0;
 }
@@ -524,6 +692,14 @@ kcm_ccache_find_cred_uuid(krb5_context context,
 {
     struct kcm_creds *c;
 
+    if (ccache->creds_index != NULL) {
+	for (c = ccache->creds_index->by_uuid[creds_uuid_hash(uuid)];
+	     c != NULL; c = c->uuid_next)
+	    if (memcmp(c->uuid, uuid, sizeof(c->uuid)) == 0)
+		return c;
+	return NULL;
+    }
+
     for (c = ccache->creds; c != NULL; c = c->next)
 	if (memcmp(c->uuid, uuid, sizeof(c->uuid)) == 0)
 	    return c;
@@ -559,12 +735,19 @@ kcm_ccache_store_cred_internal(krb5_context context,
 	if (ret) {
 	    free(*c);
 	    *c = NULL;
+	    return ret;
 	}
     } else {
 	**credp = *creds;
 	ret = 0;
     }
 
+    ccache->ncreds++;
+    if (ccache->creds_index != NULL)
+	creds_index_add(ccache->creds_index, *c);
+    else if (ccache->ncreds >= CREDS_INDEX_MIN)
+	creds_index_build(ccache);
+
     return ret;
 }
 
@@ -584,6 +767,9 @@ kcm_ccache_remove_cred_internal(krb5_context context,
 	    struct kcm_creds *cred = *c;
 
 	    *c = cred->next;
+	    if (ccache->creds_index != NULL)
+		creds_index_del(ccache->creds_index, cred);
+	    ccache->ncreds--;
 	    krb5_free_cred_contents(context, &cred->cred);
 	    free(cred);
 	    ret = 0;
@@ -628,10 +814,19 @@ kcm_ccache_retrieve_cred_internal(krb5_context context,
     ret = KRB5_CC_END;
 
     match = FALSE;
-    for (c = ccache->creds; c != NULL; c = c->next) {
-	match = krb5_compare_creds(context, whichfields, mcreds, &c->cred);
-	if (match)
-	    break;
+    if (ccache->creds_index != NULL && mcreds->server != NULL) {
+	c = ccache->creds_index->by_server[creds_server_hash(mcreds->server)];
+	for (; c != NULL; c = c->server_next) {
+	    match = krb5_compare_creds(context, whichfields, mcreds, &c->cred);
+	    if (match)
+		break;
+	}
+    } else {
+	for (c = ccache->creds; c != NULL; c = c->next) {
+	    match = krb5_compare_creds(context, whichfields, mcreds, &c->cred);
+	    if (match)
+		break;
+	}
     }
 
     if (match) {
@@ -664,17 +859,54 @@ kcm_ccache_retrieve_cred(krb5_context context,
 char *
 kcm_ccache_first_name(kcm_client *client)
 {
-    kcm_ccache p;
+    kcm_ccache p = NULL;
     char *name = NULL;
+    size_t i;
 
-    HEIMDAL_MUTEX_lock(&ccache_mutex);
+    for (i = 0; name == NULL && i < CCACHE_BUCKETS; i++) {
+	struct ccache_bucket *b = &ccache_by_name[i];
 
-    for (p = ccache_head; p != NULL; p = p->next) {
-	if (kcm_is_same_session(client, p->uid, p->session))
-	    break;
+	if (b->head == NULL)
+	    continue;
+	HEIMDAL_MUTEX_lock(&b->mutex);
+	for (p = b->head; p != NULL; p = p->next) {
+	    if (kcm_is_same_session(client, p->uid, p->session))
+		break;
+	}
+	if (p)
+	    name = strdup(p->name);
+	HEIMDAL_MUTEX_unlock(&b->mutex);
     }
-    if (p)
-	name = strdup(p->name);
-    HEIMDAL_MUTEX_unlock(&ccache_mutex);
     return name;
 }
+
+/*
+ * Call `func' on every valid cache, with the cache's mutex held, and
+ * stop at the first non-zero return.
+ */
+krb5_error_code
+kcm_ccache_foreach(krb5_context context,
+		   krb5_error_code (*func)(krb5_context, kcm_ccache, void *),
+		   void *data)
+{
+    krb5_error_code ret = 0;
+    kcm_ccache p;
+    size_t i;
+
+    for (i = 0; ret == 0 && i < CCACHE_BUCKETS; i++) {
+	struct ccache_bucket *b = &ccache_by_name[i];
+
+	if (b->head == NULL)
+	    continue;
+	HEIMDAL_MUTEX_lock(&b->mutex);
+	for (p = b->head; ret == 0 && p != NULL; p = p->next) {
+	    if ((p->flags & KCM_FLAGS_VALID) == 0)
+		continue;
+	    HEIMDAL_MUTEX_lock(&p->mutex);
+	    ret = (*func)(context, p, data);
+	    HEIMDAL_MUTEX_unlock(&p->mutex);
+	}
+	HEIMDAL_MUTEX_unlock(&b->mutex);
+    }
+    return ret;
+}
@@ -58,6 +58,11 @@ static const char *renew_life = NULL;
 static const char *ticket_life = NULL;
 
 int launchd_flag = 0;
+int kcm_threads = 0;
+int kcm_event_threads = 0;
+char *snapshot_file = NULL;
+char *snapshot_key_file = NULL;
+int snapshot_interval = 0;
 int disallow_getting_krbtgt = 0;
 int name_constraints = -1;
 
@@ -122,6 +127,26 @@ static struct getargs args[] = {
 	"max-request",	'r', arg_integer, &max_request_str,
 	"max request size", "bytes"
     },
+    {
+	"threads",	0,	arg_integer,	&kcm_threads,
+	"number of threads handling requests", "number"
+    },
+    {
+	"renew-threads",	0,	arg_integer,	&kcm_event_threads,
+	"number of threads renewing credentials", "number"
+    },
+    {
+	"snapshot-file",	0,	arg_string,	&snapshot_file,
+	"file to save credentials caches in across restarts", "file"
+    },
+    {
+	"snapshot-key",	0,	arg_string,	&snapshot_key_file,
+	"key for the snapshot file", "file"
+    },
+    {
+	"snapshot-interval",	0,	arg_integer,	&snapshot_interval,
+	"seconds between snapshot updates", "seconds"
+    },
     {
 	"socket-path",		's', arg_string, &socket_path,
     	"path to kcm domain socket", "path"
@@ -384,6 +409,24 @@ kcm_configure(int argc, char **argv)
 	system_principal = kcm_system_config_get_string("principal");
     }
 
+    if (snapshot_file == NULL) {
+	p = krb5_config_get_string(kcm_context, NULL, "kcm",
+				   "snapshot-file", NULL);
+	if (p != NULL && (snapshot_file = strdup(p)) == NULL)
+	    krb5_errx(kcm_context, 1, "out of memory");
+    }
+    if (snapshot_key_file == NULL) {
+	p = krb5_config_get_string(kcm_context, NULL, "kcm",
+				   "snapshot-key", NULL);
+	if (p != NULL && (snapshot_key_file = strdup(p)) == NULL)
+	    krb5_errx(kcm_context, 1, "out of memory");
+    }
+    if (snapshot_interval == 0)
+	snapshot_interval = krb5_config_get_time_default(kcm_context, NULL, 0,
+							 "kcm",
+							 "snapshot-interval",
+							 NULL);
+
     if (system_principal != NULL) {
 	ret = ccache_init_system();
 	if (ret)
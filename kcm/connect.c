@@ -35,6 +35,162 @@
 
 #include "kcm_locl.h"
 
+/*
+ * GET_TICKET requests wait for a TGS exchange with the KDC.  Rather than
+ * hold up the thread that called kcm_service() for that long, they are
+ * run on a pool of threads of their own that complete the call when
+ * done.  A request that is the same as one already running, from the
+ * same user and session, waits for that one and gets its reply instead
+ * of asking the KDC again.
+ */
+
+struct async_call {
+    struct async_call *next;	/* in the queue, or in the running list */
+    struct async_call *waiters;	/* identical calls waiting for this one */
+    kcm_client client;
+    krb5_data request;
+    heim_ipc_complete complete;
+    heim_sipc_call cctx;
+};
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+static HEIMDAL_MUTEX async_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static struct async_call *async_head = NULL, **async_tail = &async_head;
+static struct async_call *async_running = NULL;
+static int async_started = 0;
+
+static int
+same_call(const struct async_call *a, const struct async_call *b)
+{
+    return a->client.uid == b->client.uid &&
+	a->client.session == b->client.session &&
+	a->request.length == b->request.length &&
+	memcmp(a->request.data, b->request.data, a->request.length) == 0;
+}
+
+static void
+async_complete(struct async_call *c, krb5_error_code ret, krb5_data *rep)
+{
+    (*c->complete)(c->cctx, ret, rep);
+    krb5_data_free(&c->request);
+    free(c);
+}
+
+static void *
+async_worker(void *arg)
+{
+    krb5_context context = arg;
+    struct async_call *c, *w, **p;
+    krb5_error_code ret;
+    krb5_data rep;
+
+    for (;;) {
+	HEIMDAL_MUTEX_lock(&async_mutex);
+	while (async_head == NULL)
+	    pthread_cond_wait(&async_cond, &async_mutex);
+	c = async_head;
+	if ((async_head = c->next) == NULL)
+	    async_tail = &async_head;
+	c->next = async_running;
+	async_running = c;
+	HEIMDAL_MUTEX_unlock(&async_mutex);
+
+	krb5_data_zero(&rep);
+	ret = kcm_dispatch(context, &c->client, &c->request, &rep);
+
+	HEIMDAL_MUTEX_lock(&async_mutex);
+	for (p = &async_running; *p != c; p = &(*p)->next)
+	    ;
+	*p = c->next;
+	HEIMDAL_MUTEX_unlock(&async_mutex);
+
+	while ((w = c->waiters) != NULL) {
+	    c->waiters = w->next;
+	    async_complete(w, ret, &rep);
+	}
+	async_complete(c, ret, &rep);
+	krb5_data_free(&rep);
+    }
+    return NULL;
+}
+#endif
+
+/*
+ * Start the threads that run GET_TICKET requests.  Without them the
+ * requests are handled as all others are.
+ */
+krb5_error_code
+kcm_async_start(krb5_context context, int nthreads)
+{
+#ifdef ENABLE_PTHREAD_SUPPORT
+    pthread_t t;
+    int i, ret;
+
+    if (nthreads <= 0)
+	nthreads = KCM_EVENT_THREADS;
+
+    for (i = 0; i < nthreads; i++) {
+	ret = pthread_create(&t, NULL, async_worker, context);
+	if (ret)
+	    return i > 0 ? 0 : ret;
+	pthread_detach(t);
+	async_started = 1;
+    }
+    return 0;
+#else
+    return ENOTSUP;
+#endif
+}
+
+/* Take on `request' if it is to be run by the async threads */
+static int
+async_dispatch(kcm_client *client, krb5_data *request,
+	       heim_ipc_complete complete, heim_sipc_call cctx)
+{
+#ifdef ENABLE_PTHREAD_SUPPORT
+    const unsigned char *op = request->data;
+    struct async_call *c, *r;
+
+    if (!async_started || request->length < 2 ||
+	((op[0] << 8) | op[1]) != KCM_OP_GET_TICKET)
+	return 0;
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL)
+	return 0;
+    if (krb5_data_copy(&c->request, request->data, request->length)) {
+	free(c);
+	return 0;
+    }
+    c->client = *client;
+    c->complete = complete;
+    c->cctx = cctx;
+
+    HEIMDAL_MUTEX_lock(&async_mutex);
+    for (r = async_running; r != NULL; r = r->next)
+	if (same_call(r, c))
+	    break;
+    if (r == NULL) {
+	for (r = async_head; r != NULL; r = r->next)
+	    if (same_call(r, c))
+		break;
+    }
+    if (r != NULL) {
+	c->next = r->waiters;
+	r->waiters = c;
+    } else {
+	*async_tail = c;
+	async_tail = &c->next;
+	pthread_cond_signal(&async_cond);
+    }
+    HEIMDAL_MUTEX_unlock(&async_mutex);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
 void
 kcm_service(void *ctx, const heim_idata *req,
 	    const heim_icred cred,
@@ -77,6 +233,9 @@ kcm_service(void *ctx, const heim_idata *req,
 
     /* buf is now pointing at opcode */
 
+    if (async_dispatch(&peercred, &request, complete, cctx))
+	return;
+
     ret = kcm_dispatch(kcm_context, &peercred, &request, &rep);
 
     (*complete)(cctx, ret, &rep);
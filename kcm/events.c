@@ -34,15 +34,143 @@
 
 RCSID("$Id$");
 
-/* thread-safe in case we multi-thread later */
+/*
+ * Pending events are kept in a binary heap ordered by fire time.  With
+ * pthreads a scheduler thread sleeps until the earliest one is due and
+ * hands it to a small pool of worker threads, so that caches expiring
+ * together are renewed side by side rather than one KDC round trip
+ * after another.  A renewal that falls due while another one for the
+ * same client, owner and server is running waits for it and gets a copy
+ * of its ticket instead of asking the KDC again.
+ *
+ * events_mutex may be taken before a cache's mutex, never after.
+ */
 static HEIMDAL_MUTEX events_mutex = HEIMDAL_MUTEX_INITIALIZER;
-static kcm_event *events_head = NULL;
-static time_t last_run = 0;
+static kcm_event **events_heap = NULL;
+static size_t events_num = 0, events_alloc = 0;
+static kcm_event *events_running = NULL;
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+static pthread_cond_t events_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static kcm_event *jobs_head = NULL, **jobs_tail = &jobs_head;
+#endif
 
 static char *action_strings[] = {
 	"NONE", "ACQUIRE_CREDS", "RENEW_CREDS",
 	"DESTROY_CREDS", "DESTROY_EMPTY_CACHE" };
 
+static void log_event(kcm_event *, char *);
+
+static time_t
+jitter(time_t range)
+{
+    uint32_t r;
+
+    if (range <= 0)
+	return 0;
+    RAND_bytes((void *)&r, sizeof(r));
+    return r % range;
+}
+
+static int
+heap_less(size_t a, size_t b)
+{
+    return events_heap[a]->fire_time < events_heap[b]->fire_time;
+}
+
+static void
+heap_swap(size_t a, size_t b)
+{
+    kcm_event *t = events_heap[a];
+
+    events_heap[a] = events_heap[b];
+    events_heap[b] = t;
+    events_heap[a]->heap_index = a;
+    events_heap[b]->heap_index = b;
+}
+
+static void
+heap_up(size_t i)
+{
+    while (i > 0 && heap_less(i, (i - 1) / 2)) {
+	heap_swap(i, (i - 1) / 2);
+	i = (i - 1) / 2;
+    }
+}
+
+static void
+heap_down(size_t i)
+{
+    size_t l, m;
+
+    for (;;) {
+	l = 2 * i + 1;
+	m = i;
+	if (l < events_num && heap_less(l, m))
+	    m = l;
+	if (l + 1 < events_num && heap_less(l + 1, m))
+	    m = l + 1;
+	if (m == i)
+	    break;
+	heap_swap(i, m);
+	i = m;
+    }
+}
+
+static krb5_error_code
+heap_insert(kcm_event *e)
+{
+    if (events_num == events_alloc) {
+	size_t n = events_alloc ? events_alloc * 2 : 64;
+	kcm_event **h;
+
+	h = realloc(events_heap, n * sizeof(*h));
+	if (h == NULL)
+	    return KRB5_CC_NOMEM;
+	events_heap = h;
+	events_alloc = n;
+    }
+    e->heap_index = events_num;
+    events_heap[events_num++] = e;
+    heap_up(e->heap_index);
+#ifdef ENABLE_PTHREAD_SUPPORT
+    /* The scheduler may be sleeping until a later time */
+    if (e->heap_index == 0)
+	pthread_cond_signal(&events_cond);
+#endif
+    return 0;
+}
+
+static void
+heap_remove(kcm_event *e)
+{
+    size_t i = e->heap_index;
+
+    if (i != --events_num) {
+	events_heap[i] = events_heap[events_num];
+	events_heap[i]->heap_index = i;
+	heap_up(i);
+	heap_down(i);
+    }
+}
+
+static int
+in_heap(kcm_event *e)
+{
+    return !e->running && e->heap_index < events_num &&
+	events_heap[e->heap_index] == e;
+}
+
+/* Called with events_mutex held */
+static void
+free_event(krb5_context context, kcm_event *e)
+{
+    log_event(e, "removing");
+    kcm_release_ccache(context, e->ccache);
+    free(e);
+}
+
 krb5_error_code
 kcm_enqueue_event(krb5_context context,
 		  kcm_event *event)
@@ -84,36 +212,41 @@ log_event(kcm_event *event, char *msg)
 	    event->ccache->name);
 }
 
+/* Called with events_mutex held */
 krb5_error_code
 kcm_enqueue_event_internal(krb5_context context,
 			   kcm_event *event)
 {
-    kcm_event **e;
+    krb5_error_code ret;
+    kcm_event *e;
 
     if (event->action == KCM_EVENT_NONE)
 	return 0;
 
-    for (e = &events_head; *e != NULL; e = &(*e)->next)
-	;
-
-    *e = (kcm_event *)malloc(sizeof(kcm_event));
-    if (*e == NULL) {
+    e = (kcm_event *)calloc(1, sizeof(kcm_event));
+    if (e == NULL) {
 	return KRB5_CC_NOMEM;
     }
 
-    (*e)->valid = 1;
-    (*e)->fire_time = event->fire_time;
-    (*e)->fire_count = 0;
-    (*e)->expire_time = event->expire_time;
-    (*e)->backoff_time = event->backoff_time;
+    e->valid = 1;
+    e->fire_time = event->fire_time;
+    e->fire_count = 0;
+    e->expire_time = event->expire_time;
+    e->backoff_time = event->backoff_time;
 
-    (*e)->action = event->action;
+    e->action = event->action;
 
     kcm_retain_ccache(context, event->ccache);
-    (*e)->ccache = event->ccache;
-    (*e)->next = NULL;
+    e->ccache = event->ccache;
 
-    log_event(*e, "enqueuing");
+    ret = heap_insert(e);
+    if (ret) {
+	kcm_release_ccache(context, e->ccache);
+	free(e);
+	return ret;
+    }
+
+    log_event(e, "enqueuing");
 
     return 0;
 }
@@ -125,9 +258,12 @@ krb5_error_code
 kcm_debug_events(krb5_context context)
 {
     kcm_event *e;
+    size_t i;
 
-    for (e = events_head; e != NULL; e = e->next)
-	log_event(e, "debug");
+    for (i = 0; i < events_num; i++)
+	log_event(events_heap[i], "debug");
+    for (e = events_running; e != NULL; e = e->next)
+	log_event(e, "running");
 
     return 0;
 }
@@ -148,28 +284,6 @@ kcm_enqueue_event_relative(krb5_context context,
     return ret;
 }
 
-static krb5_error_code
-kcm_remove_event_internal(krb5_context context,
-			  kcm_event **e)
-{
-    kcm_event *next;
-
-    next = (*e)->next;
-
-    (*e)->valid = 0;
-    (*e)->fire_time = 0;
-    (*e)->fire_count = 0;
-    (*e)->expire_time = 0;
-    (*e)->backoff_time = 0;
-    kcm_release_ccache(context, (*e)->ccache);
-    (*e)->next = NULL;
-    free(*e);
-
-    *e = next;
-
-    return 0;
-}
-
 static int
 is_primary_credential_p(krb5_context context,
 			kcm_ccache ccache,
@@ -230,8 +344,14 @@ kcm_ccache_make_default_event(krb5_context context,
 		event->action = KCM_EVENT_NONE;
 	    ccache->flags &= ~(KCM_FLAGS_RENEWABLE);
 	}
-	/* requeue with some slop factor */
+	/*
+	 * Requeue with some slop factor, spread out so that tickets
+	 * issued together are not all renewed at the same moment.
+	 */
 	event->fire_time = newcred->times.endtime - KCM_EVENT_QUEUE_INTERVAL;
+	event->fire_time -= jitter(min(KCM_EVENT_MAX_JITTER,
+				       (newcred->times.endtime -
+					newcred->times.starttime) / 10));
     } else {
 	event->action = KCM_EVENT_NONE;
     }
@@ -254,40 +374,24 @@ kcm_ccache_enqueue_default(krb5_context context,
     if (ret)
 	return ret;
 
-    ret = kcm_enqueue_event_internal(context, &event);
-    if (ret)
-	return ret;
-
-    return 0;
+    return kcm_enqueue_event(context, &event);
 }
 
 krb5_error_code
 kcm_remove_event(krb5_context context,
 		 kcm_event *event)
 {
-    krb5_error_code ret;
-    kcm_event **e;
-    int found = 0;
-
-    log_event(event, "removing");
+    krb5_error_code ret = 0;
 
     HEIMDAL_MUTEX_lock(&events_mutex);
-    for (e = &events_head; *e != NULL; e = &(*e)->next) {
-	if (event == *e) {
-	    *e = event->next;
-	    found++;
-	    break;
-	}
-    }
-
-    if (!found) {
+    if (event->running) {
+	/* Dropped once it has run */
+	event->valid = 0;
+    } else if (in_heap(event)) {
+	heap_remove(event);
+	free_event(context, event);
+    } else
 	ret = KRB5_CC_NOTFOUND;
-	goto out;
-    }
-
-    ret = kcm_remove_event_internal(context, &event);
-
-out:
     HEIMDAL_MUTEX_unlock(&events_mutex);
 
     return ret;
@@ -297,18 +401,31 @@ krb5_error_code
 kcm_cleanup_events(krb5_context context,
 		   kcm_ccache ccache)
 {
-    kcm_event **e;
+    kcm_event *e;
+    size_t i, j;
 
     KCM_ASSERT_VALID(ccache);
 
     HEIMDAL_MUTEX_lock(&events_mutex);
 
-    for (e = &events_head; *e != NULL; e = &(*e)->next) {
-	if ((*e)->valid && (*e)->ccache == ccache) {
-	    kcm_remove_event_internal(context, e);
+    for (i = j = 0; i < events_num; i++) {
+	e = events_heap[i];
+	if (e->ccache == ccache) {
+	    free_event(context, e);
+	} else {
+	    e->heap_index = j;
+	    events_heap[j++] = e;
 	}
-	if (*e == NULL)
-	    break;
+    }
+    if (j != events_num) {
+	events_num = j;
+	for (i = events_num / 2; i-- > 0; )
+	    heap_down(i);
+    }
+
+    for (e = events_running; e != NULL; e = e->next) {
+	if (e->ccache == ccache)
+	    e->valid = 0;
     }
 
     HEIMDAL_MUTEX_unlock(&events_mutex);
@@ -316,129 +433,368 @@ kcm_cleanup_events(krb5_context context,
     return 0;
 }
 
+/*
+ * Fire an event, without events_mutex held.  On success `*newcred' is
+ * a copy of the credential acquired or renewed, if any.
+ */
 static krb5_error_code
 kcm_fire_event(krb5_context context,
-	       kcm_event **e)
+	       kcm_event *event,
+	       krb5_creds **newcred)
 {
-    kcm_event *event;
+    kcm_ccache ccache = event->ccache;
     krb5_error_code ret;
     krb5_creds *credp = NULL;
-    int oneshot = 1;
 
-    event = *e;
+    *newcred = NULL;
 
     switch (event->action) {
     case KCM_EVENT_ACQUIRE_CREDS:
-	ret = kcm_ccache_acquire(context, event->ccache, &credp);
-	oneshot = 0;
+	ret = kcm_ccache_acquire(context, ccache, &credp);
 	break;
     case KCM_EVENT_RENEW_CREDS:
-	ret = kcm_ccache_refresh(context, event->ccache, &credp);
+	ret = kcm_ccache_refresh(context, ccache, &credp);
 	if (ret == KRB5KRB_AP_ERR_TKT_EXPIRED) {
-	    ret = kcm_ccache_acquire(context, event->ccache, &credp);
+	    ret = kcm_ccache_acquire(context, ccache, &credp);
 	}
-	oneshot = 0;
 	break;
     case KCM_EVENT_DESTROY_CREDS:
-	ret = kcm_ccache_destroy(context, event->ccache->name);
+	ret = kcm_ccache_destroy(context, ccache->name);
 	break;
     case KCM_EVENT_DESTROY_EMPTY_CACHE:
-	ret = kcm_ccache_destroy_if_empty(context, event->ccache);
+	ret = kcm_ccache_destroy_if_empty(context, ccache);
 	break;
     default:
 	ret = KRB5_FCC_INTERNAL;
 	break;
     }
 
+    /* `credp' points into the cache, which requests may change */
+    if (ret == 0 && credp != NULL) {
+	HEIMDAL_MUTEX_lock(&ccache->mutex);
+	if (ccache->creds != NULL)
+	    ret = krb5_copy_creds(context, &ccache->creds->cred, newcred);
+	HEIMDAL_MUTEX_unlock(&ccache->mutex);
+    }
+
+    return ret;
+}
+
+/*
+ * Store a credential renewed for another cache.
+ */
+static krb5_error_code
+kcm_share_creds(krb5_context context,
+		kcm_ccache ccache,
+		krb5_creds *newcred)
+{
+    krb5_error_code ret;
+    krb5_creds *tmp;
+
+    HEIMDAL_MUTEX_lock(&ccache->mutex);
+    kcm_ccache_remove_creds_internal(context, ccache);
+    ret = kcm_ccache_store_cred_internal(context, ccache, newcred, 1, &tmp);
+    HEIMDAL_MUTEX_unlock(&ccache->mutex);
+
+    return ret;
+}
+
+/*
+ * Work out what should follow a successful acquisition or renewal,
+ * without events_mutex held.
+ */
+static void
+kcm_next_event(krb5_context context,
+	       kcm_event *event,
+	       krb5_creds *newcred,
+	       kcm_event *next)
+{
+    char *cpn;
+
+    *next = *event;
+    next->action = KCM_EVENT_NONE;
+
+    if (newcred == NULL)
+	return;
+
+    if (krb5_unparse_name(context, event->ccache->client, &cpn))
+	cpn = NULL;
+
+    kcm_log(0, "%s credentials in cache %s for principal %s",
+	    (event->action == KCM_EVENT_ACQUIRE_CREDS) ?
+		"Acquired" : "Renewed",
+	    event->ccache->name,
+	    (cpn != NULL) ? cpn : "<none>");
+
+    if (cpn != NULL)
+	free(cpn);
+
+    /* Succeeded, but possibly replaced with another event */
+    HEIMDAL_MUTEX_lock(&event->ccache->mutex);
+    if (kcm_ccache_make_default_event(context, next, newcred))
+	next->action = KCM_EVENT_NONE;
+    HEIMDAL_MUTEX_unlock(&event->ccache->mutex);
+}
+
+/*
+ * Requeue or remove an event that has run.  Called with events_mutex
+ * held.
+ */
+static void
+kcm_event_done(krb5_context context,
+	       kcm_event *event,
+	       krb5_error_code ret,
+	       const kcm_event *next)
+{
+    kcm_event **e;
+    const char *estr;
+
+    for (e = &events_running; *e != NULL; e = &(*e)->next) {
+	if (*e == event) {
+	    *e = event->next;
+	    break;
+	}
+    }
+    event->next = NULL;
+    event->running = 0;
     event->fire_count++;
 
+    if (!event->valid) {
+	free_event(context, event);
+	return;
+    }
+
     if (ret) {
+	estr = krb5_get_error_message(context, ret);
+	kcm_log(1, "Could not fire event for cache %s: %s",
+		event->ccache->name, estr);
+	krb5_free_error_message(context, estr);
+
 	/* Reschedule failed event for another time */
-	event->fire_time += event->backoff_time;
+	event->fire_time = time(NULL) + event->backoff_time +
+	    jitter(event->backoff_time / 2);
 	if (event->backoff_time < KCM_EVENT_MAX_BACKOFF_TIME)
 	    event->backoff_time *= 2;
 
 	/* Remove it if it would never get executed */
 	if (event->expire_time &&
-	    event->fire_time > event->expire_time)
-	    kcm_remove_event_internal(context, e);
-    } else {
-	if (!oneshot) {
-	    char *cpn;
-
-	    if (krb5_unparse_name(context, event->ccache->client,
-				  &cpn))
-		cpn = NULL;
-
-	    kcm_log(0, "%s credentials in cache %s for principal %s",
-		    (event->action == KCM_EVENT_ACQUIRE_CREDS) ?
-			"Acquired" : "Renewed",
-		    event->ccache->name,
-		    (cpn != NULL) ? cpn : "<none>");
-
-	    if (cpn != NULL)
-		free(cpn);
-
-	    /* Succeeded, but possibly replaced with another event */
-	    ret = kcm_ccache_make_default_event(context, event, credp);
-	    if (ret || event->action == KCM_EVENT_NONE)
-		oneshot = 1;
-	    else
-		log_event(event, "requeuing");
+	    event->fire_time > event->expire_time) {
+	    free_event(context, event);
+	    return;
 	}
-	if (oneshot)
-	    kcm_remove_event_internal(context, e);
+    } else if (next->action == KCM_EVENT_NONE) {
+	free_event(context, event);
+	return;
+    } else {
+	event->action = next->action;
+	event->fire_time = next->fire_time;
+	event->expire_time = next->expire_time;
+	event->backoff_time = next->backoff_time;
+	log_event(event, "requeuing");
     }
 
-    return ret;
+    if (heap_insert(event))
+	free_event(context, event);
 }
 
-krb5_error_code
-kcm_run_events(krb5_context context, time_t now)
+/*
+ * Run an event and the renewals coalesced with it.
+ */
+static void
+kcm_run_event(krb5_context context, kcm_event *event)
 {
-    krb5_error_code ret;
-    kcm_event **e;
-    const char *estr;
+    kcm_event next, *f, *followers;
+    krb5_creds *newcred = NULL;
+    krb5_error_code ret, fret;
+
+    ret = kcm_fire_event(context, event, &newcred);
+    kcm_next_event(context, event, ret ? NULL : newcred, &next);
 
     HEIMDAL_MUTEX_lock(&events_mutex);
+    followers = event->coalesced;
+    event->coalesced = NULL;
+    kcm_event_done(context, event, ret, &next);
+    HEIMDAL_MUTEX_unlock(&events_mutex);
+
+    while ((f = followers) != NULL) {
+	followers = f->coalesced;
+	f->coalesced = NULL;
 
-    /* Only run event queue every N seconds */
-    if (now < last_run + KCM_EVENT_QUEUE_INTERVAL) {
+	fret = ret;
+	if (fret == 0 && newcred != NULL)
+	    fret = kcm_share_creds(context, f->ccache, newcred);
+	kcm_next_event(context, f, fret ? NULL : newcred, &next);
+
+	HEIMDAL_MUTEX_lock(&events_mutex);
+	kcm_event_done(context, f, fret, &next);
 	HEIMDAL_MUTEX_unlock(&events_mutex);
-	return 0;
     }
 
-    /* go through events list, fire and expire */
-    for (e = &events_head; *e != NULL; e = &(*e)->next) {
-	if ((*e)->valid == 0)
-	    continue;
-
-	if (now >= (*e)->fire_time) {
-	    ret = kcm_fire_event(context, e);
-	    if (ret) {
-		estr = krb5_get_error_message(context, ret);
-		kcm_log(1, "Could not fire event for cache %s: %s",
-			(*e)->ccache->name, estr);
-		krb5_free_error_message(context, estr);
-	    }
-	} else if ((*e)->expire_time && now >= (*e)->expire_time) {
-	    ret = kcm_remove_event_internal(context, e);
-	    if (ret) {
-		estr = krb5_get_error_message(context, ret);
-		kcm_log(1, "Could not expire event for cache %s: %s",
-			(*e)->ccache->name, estr);
-		krb5_free_error_message(context, estr);
-	    }
+    if (newcred != NULL)
+	krb5_free_creds(context, newcred);
+}
+
+static int
+same_principal(krb5_context context,
+	       krb5_const_principal a,
+	       krb5_const_principal b)
+{
+    if (a == NULL || b == NULL)
+	return a == b;
+    return krb5_principal_compare(context, a, b);
+}
+
+/*
+ * Mark a due event as running.  Returns zero if it was coalesced with a
+ * renewal already running, which will finish it.  Called with
+ * events_mutex held.
+ */
+static int
+kcm_start_event(krb5_context context, kcm_event *event)
+{
+    kcm_ccache a = event->ccache, b;
+    kcm_event *e = NULL;
+
+    if (event->action == KCM_EVENT_RENEW_CREDS && a->client != NULL) {
+	for (e = events_running; e != NULL; e = e->next) {
+	    b = e->ccache;
+	    if (e->running == 1 &&
+		e->action == KCM_EVENT_RENEW_CREDS &&
+		b->uid == a->uid &&
+		b->client != NULL &&
+		same_principal(context, a->client, b->client) &&
+		same_principal(context, a->server, b->server))
+		break;
 	}
+    }
 
-	if (*e == NULL)
-	    break;
+    event->next = events_running;
+    events_running = event;
+
+    if (e != NULL) {
+	event->running = 2;
+	event->coalesced = e->coalesced;
+	e->coalesced = event;
+	log_event(event, "coalescing");
+	return 0;
     }
 
-    last_run = now;
+    event->running = 1;
+    event->coalesced = NULL;
+    return 1;
+}
+
+/*
+ * Run the events that are due, one after another.  Used when there
+ * is no scheduler thread.
+ */
+krb5_error_code
+kcm_run_events(krb5_context context, time_t now)
+{
+    kcm_event *e;
+
+    HEIMDAL_MUTEX_lock(&events_mutex);
+
+    while (events_num > 0 && events_heap[0]->fire_time <= now) {
+	e = events_heap[0];
+	heap_remove(e);
+	if (kcm_start_event(context, e)) {
+	    HEIMDAL_MUTEX_unlock(&events_mutex);
+	    kcm_run_event(context, e);
+	    HEIMDAL_MUTEX_lock(&events_mutex);
+	}
+    }
 
     HEIMDAL_MUTEX_unlock(&events_mutex);
 
     return 0;
 }
 
+#ifdef ENABLE_PTHREAD_SUPPORT
+static void *
+events_worker(void *arg)
+{
+    krb5_context context = arg;
+    kcm_event *e;
+
+    HEIMDAL_MUTEX_lock(&events_mutex);
+    for (;;) {
+	while (jobs_head == NULL)
+	    pthread_cond_wait(&jobs_cond, &events_mutex);
+	e = jobs_head;
+	jobs_head = e->job_next;
+	if (jobs_head == NULL)
+	    jobs_tail = &jobs_head;
+	HEIMDAL_MUTEX_unlock(&events_mutex);
+
+	kcm_run_event(context, e);
+
+	HEIMDAL_MUTEX_lock(&events_mutex);
+    }
+    return NULL;
+}
+
+static void *
+events_scheduler(void *arg)
+{
+    krb5_context context = arg;
+    struct timespec ts;
+    kcm_event *e;
+
+    HEIMDAL_MUTEX_lock(&events_mutex);
+    for (;;) {
+	time_t now = time(NULL);
+
+	while (events_num > 0 && events_heap[0]->fire_time <= now) {
+	    e = events_heap[0];
+	    heap_remove(e);
+	    if (kcm_start_event(context, e)) {
+		e->job_next = NULL;
+		*jobs_tail = e;
+		jobs_tail = &e->job_next;
+		pthread_cond_signal(&jobs_cond);
+	    }
+	}
+
+	if (events_num == 0) {
+	    pthread_cond_wait(&events_cond, &events_mutex);
+	} else {
+	    ts.tv_sec = events_heap[0]->fire_time;
+	    ts.tv_nsec = 0;
+	    pthread_cond_timedwait(&events_cond, &events_mutex, &ts);
+	}
+    }
+    return NULL;
+}
+#endif
+
+/*
+ * Start running events in the background, on `nthreads' worker
+ * threads.  Returns non-zero if they could not be started; the caller
+ * then has to call kcm_run_events() itself.
+ */
+int
+kcm_events_start(krb5_context context, int nthreads)
+{
+#ifdef ENABLE_PTHREAD_SUPPORT
+    pthread_t t;
+    int i, ret;
+
+    if (nthreads <= 0)
+	nthreads = KCM_EVENT_THREADS;
+
+    for (i = 0; i < nthreads; i++) {
+	ret = pthread_create(&t, NULL, events_worker, context);
+	if (ret)
+	    return ret;
+	pthread_detach(t);
+    }
+    ret = pthread_create(&t, NULL, events_scheduler, context);
+    if (ret)
+	return ret;
+    pthread_detach(t);
+    return 0;
+#else
+    return ENOTSUP;
+#endif
+}
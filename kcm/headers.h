@@ -80,6 +80,7 @@
 
 
 #include <krb5.h>
+#include <heimbase.h>
 #include <heim_threads.h>
 
 #include <heim-ipc.h>
@@ -66,6 +66,7 @@
 
 struct kcm_ccache_data;
 struct kcm_creds;
+struct kcm_creds_index;
 
 struct kcm_default_cache {
     uid_t uid;
@@ -80,6 +81,8 @@ struct kcm_creds {
     kcmuuid_t uuid;
     krb5_creds cred;
     struct kcm_creds *next;
+    struct kcm_creds *server_next;      /* in its creds_index buckets */
+    struct kcm_creds *uuid_next;
 };
 
 typedef struct kcm_ccache_data {
@@ -94,6 +97,8 @@ typedef struct kcm_ccache_data {
     krb5_principal client; /* primary client principal */
     krb5_principal server; /* primary server principal (TGS if NULL) */
     struct kcm_creds *creds;
+    struct kcm_creds_index *creds_index; /* NULL while there are few creds */
+    unsigned int ncreds;
     krb5_deltat tkt_life;
     krb5_deltat renew_life;
     int32_t kdc_offset;
@@ -102,7 +107,8 @@ typedef struct kcm_ccache_data {
 	krb5_keyblock keyblock;
     } key;
     HEIMDAL_MUTEX mutex;
-    struct kcm_ccache_data *next;
+    struct kcm_ccache_data *next;       /* in its name hash bucket */
+    struct kcm_ccache_data *uuid_next;  /* in its UUID hash bucket */
 } kcm_ccache_data;
 
 #define KCM_ASSERT_VALID(_ccache)		do { \
@@ -130,13 +136,20 @@ typedef struct kcm_event {
 	KCM_EVENT_DESTROY_EMPTY_CACHE
     } action;
     kcm_ccache ccache;
-    struct kcm_event *next;
+    size_t heap_index;		/* in the event heap, unless running */
+    int running;		/* 1 if firing, 2 if coalesced */
+    struct kcm_event *next;	/* in the list of running events */
+    struct kcm_event *coalesced; /* renewals waiting for this one */
+    struct kcm_event *job_next;	/* in the worker queue */
 } kcm_event;
 
-/* wakeup interval for event queue */
+/* how long before expiry to renew */
 #define KCM_EVENT_QUEUE_INTERVAL		60
 #define KCM_EVENT_DEFAULT_BACKOFF_TIME		5
 #define KCM_EVENT_MAX_BACKOFF_TIME		(12 * 60 * 60)
+/* renewals are spread over up to this much more */
+#define KCM_EVENT_MAX_JITTER			(5 * 60)
+#define KCM_EVENT_THREADS			4
 
 
 /* Request format is  LENGTH | MAJOR | MINOR | OPERATION | request */
@@ -170,6 +183,11 @@ extern int name_constraints;
 extern int detach_from_console;
 extern int daemon_child;
 extern int launchd_flag;
+extern int kcm_threads;
+extern int kcm_event_threads;
+extern char *snapshot_file;
+extern char *snapshot_key_file;
+extern int snapshot_interval;
 extern int disallow_getting_krbtgt;
 
 #if 0
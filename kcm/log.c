@@ -83,3 +83,20 @@ kcm_log(int level, const char *fmt, ...)
     if(s) free(s);
     va_end(ap);
 }
+
+void
+kcm_debug_memory(krb5_context context)
+{
+    int64_t bytes, objects;
+    int i;
+
+    if (!heim_mem_account_enabled())
+	return;
+
+    for (i = 0; i < HEIM_MEM_NUM_TAGS; i++) {
+	if (heim_mem_stats(i, &bytes, &objects))
+	    continue;
+	kcm_log(0, "memory %s: %lld bytes in %lld objects",
+		heim_mem_tag_name(i), (long long)bytes, (long long)objects);
+    }
+}
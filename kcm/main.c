@@ -40,10 +40,13 @@ extern const char *socket_path;
 
 const char *service_name = "org.h5l.kcm";
 
+sig_atomic_t exit_flag = 0;
+
 static RETSIGTYPE
 sigusr1(int sig)
 {
     kcm_debug_ccache(kcm_context);
+    kcm_debug_memory(kcm_context);
 }
 
 static RETSIGTYPE
@@ -52,6 +55,12 @@ sigusr2(int sig)
     kcm_debug_events(kcm_context);
 }
 
+static RETSIGTYPE
+sigterm(int sig)
+{
+    exit_flag = 1;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -116,6 +125,39 @@ main(int argc, char **argv)
 
     roken_detach_finish(NULL, daemon_child);
 
+    /* The snapshot thread saves the caches and exits on SIGTERM */
+    if (kcm_snapshot_start(kcm_context)) {
+#ifdef HAVE_SIGACTION
+	struct sigaction sa;
+
+	sa.sa_flags = 0;
+	sa.sa_handler = sigterm;
+	sigemptyset(&sa.sa_mask);
+
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+#else
+	signal(SIGTERM, sigterm);
+	signal(SIGINT, sigterm);
+#endif
+    }
+
+    if (kcm_threads > 0) {
+	ret = heim_sipc_set_threads(kcm_threads);
+	if (ret)
+	    krb5_warn(kcm_context, ret, "Could not use %d threads",
+		      kcm_threads);
+    }
+
+    ret = kcm_events_start(kcm_context, kcm_event_threads);
+    if (ret && ret != ENOTSUP)
+	krb5_warn(kcm_context, ret, "Could not start renewing credentials");
+
+    ret = kcm_async_start(kcm_context, kcm_event_threads);
+    if (ret && ret != ENOTSUP)
+	krb5_warn(kcm_context, ret, "Could not start getting tickets "
+		  "asynchronously");
+
     heim_ipc_main();
 
     krb5_free_context(kcm_context);
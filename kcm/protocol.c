@@ -810,14 +810,17 @@ kcm_op_get_initial_ticket(krb5_context context,
 	ccache->key.keyblock = key;
     	ccache->flags |= KCM_FLAGS_USE_CACHED_KEY;
 
+	HEIMDAL_MUTEX_unlock(&ccache->mutex);
+
+	/* The event queue locks the cache itself */
 	ret = kcm_ccache_enqueue_default(context, ccache, NULL);
 	if (ret) {
+	    HEIMDAL_MUTEX_lock(&ccache->mutex);
 	    ccache->server = NULL;
 	    krb5_keyblock_zero(&ccache->key.keyblock);
 	    ccache->flags &= ~(KCM_FLAGS_USE_CACHED_KEY);
+	    HEIMDAL_MUTEX_unlock(&ccache->mutex);
 	}
-
-	HEIMDAL_MUTEX_unlock(&ccache->mutex);
     }
 
     free(name);
@@ -1058,6 +1061,7 @@ kcm_op_get_cache_by_uuid(krb5_context context,
 }
 
 struct kcm_default_cache *default_caches;
+static HEIMDAL_MUTEX default_caches_mutex = HEIMDAL_MUTEX_INITIALIZER;
 
 static krb5_error_code
 kcm_op_get_default_cache(krb5_context context,
@@ -1074,12 +1078,14 @@ kcm_op_get_default_cache(krb5_context context,
 
     KCM_LOG_REQUEST(context, client, opcode);
 
+    HEIMDAL_MUTEX_lock(&default_caches_mutex);
     for (c = default_caches; c != NULL; c = c->next) {
 	if (kcm_is_same_session(client, c->uid, c->session)) {
-	    name = c->name;
+	    name = n = strdup(c->name);
 	    break;
 	}
     }
+    HEIMDAL_MUTEX_unlock(&default_caches_mutex);
     if (name == NULL)
 	name = n = kcm_ccache_first_name(client);
 
@@ -1101,6 +1107,7 @@ kcm_drop_default_cache(krb5_context context, kcm_client *client, char *name)
 {
     struct kcm_default_cache **c;
 
+    HEIMDAL_MUTEX_lock(&default_caches_mutex);
     for (c = &default_caches; *c != NULL; c = &(*c)->next) {
 	if (!kcm_is_same_session(client, (*c)->uid, (*c)->session))
 	    continue;
@@ -1112,6 +1119,7 @@ kcm_drop_default_cache(krb5_context context, kcm_client *client, char *name)
 	    break;
 	}
     }
+    HEIMDAL_MUTEX_unlock(&default_caches_mutex);
 }
 
 static krb5_error_code
@@ -1131,6 +1139,7 @@ kcm_op_set_default_cache(krb5_context context,
 
     KCM_LOG_REQUEST_NAME(context, client, opcode, name);
 
+    HEIMDAL_MUTEX_lock(&default_caches_mutex);
     for (c = default_caches; c != NULL; c = c->next) {
 	if (kcm_is_same_session(client, c->uid, c->session))
 	    break;
@@ -1138,6 +1147,7 @@ kcm_op_set_default_cache(krb5_context context,
     if (c == NULL) {
 	c = malloc(sizeof(*c));
 	if (c == NULL) {
+	    HEIMDAL_MUTEX_unlock(&default_caches_mutex);
             free(name);
 	    return ENOMEM;
         }
@@ -1151,6 +1161,7 @@ kcm_op_set_default_cache(krb5_context context,
 	free(c->name);
 	c->name = name;
     }
+    HEIMDAL_MUTEX_unlock(&default_caches_mutex);
 
     return 0;
 }
@@ -1797,6 +1808,8 @@ kcm_dispatch(krb5_context context,
     krb5_storage_seek(resp_sp, 4, SEEK_SET);
 
     ret = (*method)(context, client, opcode, req_sp, resp_sp);
+    if (ret == 0)
+	kcm_snapshot_note(context, opcode, req_data);
 
 out:
     if (req_sp != NULL) {
@@ -1806,7 +1819,7 @@ out:
     krb5_storage_seek(resp_sp, 0, SEEK_SET);
     krb5_store_int32(resp_sp, ret);
 
-    ret = krb5_storage_to_data(resp_sp, resp_data);
+    ret = krb5_storage_steal_data(resp_sp, resp_data);
     krb5_storage_free(resp_sp);
 
     return ret;
@@ -0,0 +1,783 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "kcm_locl.h"
+
+RCSID("$Id$");
+
+/*
+ * Snapshots of the credentials caches, so that restarting kcm does not
+ * send every user back to the KDC.
+ *
+ * The snapshot file is a sequence of records, each a length-prefixed
+ * blob encrypted (and integrity protected) in a key kept in a separate
+ * file.  The first record holds every cache; each later one holds the
+ * caches changed or destroyed since the record before it.  Deltas are
+ * appended every snapshot-interval seconds; after SNAPSHOT_MAX_DELTAS
+ * of them, and on shutdown, a new file is written and renamed over the
+ * old one.  A record torn by a crash fails to decrypt and ends the
+ * restore, keeping everything before it.
+ *
+ * Record contents:
+ *	uint8	version
+ *	uint8	SNAPSHOT_FULL or SNAPSHOT_DELTA
+ *	{ uint8 SNAPSHOT_PUT, cache | uint8 SNAPSHOT_DEL, NameZ } ...
+ *	uint8	0
+ */
+
+#define SNAPSHOT_VERSION	1
+
+#define SNAPSHOT_FULL		1
+#define SNAPSHOT_DELTA		2
+
+#define SNAPSHOT_PUT		1
+#define SNAPSHOT_DEL		2
+
+#define SNAPSHOT_DEFAULT_INTERVAL	30
+#define SNAPSHOT_MAX_DELTAS		64
+#define SNAPSHOT_MAX_RECORD		(256 * 1024 * 1024)
+#define SNAPSHOT_DIRTY_SIZE		256
+
+struct dirty_name {
+    char *name;
+    struct dirty_name *next;
+};
+
+static HEIMDAL_MUTEX dirty_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct dirty_name *dirty[SNAPSHOT_DIRTY_SIZE];
+
+static HEIMDAL_MUTEX snapshot_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static krb5_crypto snapshot_crypto = NULL;
+static int snapshot_fd = -1;
+static unsigned int snapshot_deltas = 0;
+static int snapshot_stale = 0;
+static time_t snapshot_last = 0;
+static int snapshot_thread = 0;
+
+static unsigned int
+dirty_hash(const char *name)
+{
+    const unsigned char *p;
+    uint32_t h = 2166136261U;
+
+    for (p = (const unsigned char *)name; *p != '\0'; p++)
+	h = (h ^ *p) * 16777619U;
+    return h % SNAPSHOT_DIRTY_SIZE;
+}
+
+/* Takes ownership of `name' */
+static void
+mark_dirty(char *name)
+{
+    struct dirty_name **d;
+
+    HEIMDAL_MUTEX_lock(&dirty_mutex);
+    for (d = &dirty[dirty_hash(name)]; *d != NULL; d = &(*d)->next) {
+	if (strcmp((*d)->name, name) == 0)
+	    break;
+    }
+    if (*d == NULL && (*d = calloc(1, sizeof(**d))) != NULL) {
+	(*d)->name = name;
+	name = NULL;
+    }
+    HEIMDAL_MUTEX_unlock(&dirty_mutex);
+    free(name);
+}
+
+static struct dirty_name *
+take_dirty(void)
+{
+    struct dirty_name *list = NULL, *d;
+    size_t i;
+
+    HEIMDAL_MUTEX_lock(&dirty_mutex);
+    for (i = 0; i < SNAPSHOT_DIRTY_SIZE; i++) {
+	while ((d = dirty[i]) != NULL) {
+	    dirty[i] = d->next;
+	    d->next = list;
+	    list = d;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&dirty_mutex);
+    return list;
+}
+
+static void
+free_dirty(struct dirty_name *list)
+{
+    struct dirty_name *d;
+
+    while ((d = list) != NULL) {
+	list = d->next;
+	free(d->name);
+	free(d);
+    }
+}
+
+static krb5_error_code
+store_principal_opt(krb5_storage *sp, krb5_const_principal p)
+{
+    krb5_error_code ret;
+
+    ret = krb5_store_uint8(sp, p != NULL);
+    if (ret == 0 && p != NULL)
+	ret = krb5_store_principal(sp, p);
+    return ret;
+}
+
+static krb5_error_code
+ret_principal_opt(krb5_storage *sp, krb5_principal *p)
+{
+    krb5_error_code ret;
+    uint8_t present;
+
+    *p = NULL;
+    ret = krb5_ret_uint8(sp, &present);
+    if (ret == 0 && present)
+	ret = krb5_ret_principal(sp, p);
+    return ret;
+}
+
+/* Called with the cache's mutex held */
+static krb5_error_code
+store_cache(krb5_context context, kcm_ccache ccache, void *data)
+{
+    krb5_storage *sp = data;
+    struct kcm_creds *c;
+    krb5_error_code ret;
+    uint32_t n = 0;
+
+    ret = krb5_store_uint8(sp, SNAPSHOT_PUT);
+    if (ret == 0)
+	ret = krb5_store_stringz(sp, ccache->name);
+    if (ret == 0)
+	ret = krb5_store_uint16(sp, ccache->flags);
+    if (ret == 0)
+	ret = krb5_store_uint16(sp, ccache->mode);
+    if (ret == 0)
+	ret = krb5_store_int32(sp, ccache->uid);
+    if (ret == 0)
+	ret = krb5_store_int32(sp, ccache->gid);
+    if (ret == 0)
+	ret = krb5_store_int32(sp, ccache->session);
+    if (ret == 0)
+	ret = store_principal_opt(sp, ccache->client);
+    if (ret == 0)
+	ret = store_principal_opt(sp, ccache->server);
+    if (ret == 0)
+	ret = krb5_store_int32(sp, ccache->tkt_life);
+    if (ret == 0)
+	ret = krb5_store_int32(sp, ccache->renew_life);
+    if (ret == 0)
+	ret = krb5_store_int32(sp, ccache->kdc_offset);
+    if (ret == 0 && (ccache->flags & KCM_FLAGS_USE_KEYTAB)) {
+	char *ktname;
+
+	ret = krb5_kt_get_full_name(context, ccache->key.keytab, &ktname);
+	if (ret == 0) {
+	    ret = krb5_store_stringz(sp, ktname);
+	    free(ktname);
+	}
+    } else if (ret == 0 && (ccache->flags & KCM_FLAGS_USE_CACHED_KEY))
+	ret = krb5_store_keyblock(sp, ccache->key.keyblock);
+
+    for (c = ccache->creds; c != NULL; c = c->next)
+	n++;
+    if (ret == 0)
+	ret = krb5_store_uint32(sp, n);
+    for (c = ccache->creds; ret == 0 && c != NULL; c = c->next)
+	ret = krb5_store_creds(sp, &c->cred);
+
+    return ret;
+}
+
+/*
+ * Read a cache and replace any cache of the same name with it.  A cache
+ * that is in use, such as the system cache configured at startup, is
+ * left alone.
+ */
+static krb5_error_code
+ret_cache(krb5_context context, krb5_storage *sp)
+{
+    kcm_ccache ccache = NULL;
+    krb5_principal client = NULL, server = NULL;
+    krb5_keyblock keyblock;
+    krb5_keytab keytab = NULL;
+    krb5_error_code ret;
+    uint16_t flags, mode;
+    int32_t uid, gid, session, tkt_life, renew_life, kdc_offset;
+    uint32_t n;
+    char *name = NULL, *ktname = NULL;
+
+    krb5_keyblock_zero(&keyblock);
+
+    ret = krb5_ret_stringz(sp, &name);
+    if (ret == 0)
+	ret = krb5_ret_uint16(sp, &flags);
+    if (ret == 0)
+	ret = krb5_ret_uint16(sp, &mode);
+    if (ret == 0)
+	ret = krb5_ret_int32(sp, &uid);
+    if (ret == 0)
+	ret = krb5_ret_int32(sp, &gid);
+    if (ret == 0)
+	ret = krb5_ret_int32(sp, &session);
+    if (ret == 0)
+	ret = ret_principal_opt(sp, &client);
+    if (ret == 0)
+	ret = ret_principal_opt(sp, &server);
+    if (ret == 0)
+	ret = krb5_ret_int32(sp, &tkt_life);
+    if (ret == 0)
+	ret = krb5_ret_int32(sp, &renew_life);
+    if (ret == 0)
+	ret = krb5_ret_int32(sp, &kdc_offset);
+    if (ret == 0 && (flags & KCM_FLAGS_USE_KEYTAB)) {
+	ret = krb5_ret_stringz(sp, &ktname);
+	if (ret == 0)
+	    ret = krb5_kt_resolve(context, ktname, &keytab);
+    } else if (ret == 0 && (flags & KCM_FLAGS_USE_CACHED_KEY))
+	ret = krb5_ret_keyblock(sp, &keyblock);
+    if (ret == 0)
+	ret = krb5_ret_uint32(sp, &n);
+    if (ret)
+	goto out;
+
+    ret = kcm_ccache_destroy(context, name);
+    if (ret == 0 || ret == KRB5_FCC_NOFILE)
+	ret = kcm_ccache_new(context, name, &ccache);
+    if (ret == 0) {
+	ccache->flags = flags | KCM_FLAGS_VALID;
+	ccache->mode = mode;
+	ccache->uid = uid;
+	ccache->gid = gid;
+	ccache->session = session;
+	ccache->client = client;
+	ccache->server = server;
+	ccache->tkt_life = tkt_life;
+	ccache->renew_life = renew_life;
+	ccache->kdc_offset = kdc_offset;
+	if (flags & KCM_FLAGS_USE_KEYTAB)
+	    ccache->key.keytab = keytab;
+	else if (flags & KCM_FLAGS_USE_CACHED_KEY)
+	    ccache->key.keyblock = keyblock;
+	client = server = NULL;
+	keytab = NULL;
+	krb5_keyblock_zero(&keyblock);
+    } else {
+	kcm_log(0, "Not restoring cache %s from snapshot: in use", name);
+	ret = 0;
+    }
+
+    while (n-- > 0) {
+	krb5_creds creds, *tmp;
+
+	ret = krb5_ret_creds(sp, &creds);
+	if (ret)
+	    break;
+	if (ccache == NULL) {
+	    krb5_free_cred_contents(context, &creds);
+	    continue;
+	}
+	ret = kcm_ccache_store_cred_internal(context, ccache, &creds, 0, &tmp);
+	if (ret) {
+	    krb5_free_cred_contents(context, &creds);
+	    break;
+	}
+    }
+
+    if (ccache != NULL) {
+	/* Carry on renewing its tickets */
+	if (ret == 0 && ccache->creds != NULL)
+	    kcm_ccache_enqueue_default(context, ccache, &ccache->creds->cred);
+	kcm_release_ccache(context, ccache);
+	if (ret)
+	    kcm_ccache_destroy(context, name);
+    }
+
+out:
+    krb5_free_principal(context, client);
+    krb5_free_principal(context, server);
+    if (keytab != NULL)
+	krb5_kt_close(context, keytab);
+    krb5_free_keyblock_contents(context, &keyblock);
+    free(ktname);
+    free(name);
+
+    return ret;
+}
+
+static krb5_error_code
+apply_record(krb5_context context, krb5_data *data, int first)
+{
+    krb5_error_code ret;
+    krb5_storage *sp;
+    uint8_t version, type, op;
+    char *name;
+
+    sp = krb5_storage_from_readonly_mem(data->data, data->length);
+    if (sp == NULL)
+	return ENOMEM;
+
+    ret = krb5_ret_uint8(sp, &version);
+    if (ret == 0)
+	ret = krb5_ret_uint8(sp, &type);
+    if (ret == 0 && (version != SNAPSHOT_VERSION ||
+		     (first && type != SNAPSHOT_FULL)))
+	ret = KRB5_CC_FORMAT;
+
+    while (ret == 0) {
+	ret = krb5_ret_uint8(sp, &op);
+	if (ret || op == 0)
+	    break;
+	switch (op) {
+	case SNAPSHOT_PUT:
+	    ret = ret_cache(context, sp);
+	    break;
+	case SNAPSHOT_DEL:
+	    ret = krb5_ret_stringz(sp, &name);
+	    if (ret == 0) {
+		kcm_ccache_destroy(context, name);
+		free(name);
+	    }
+	    break;
+	default:
+	    ret = KRB5_CC_FORMAT;
+	    break;
+	}
+    }
+
+    krb5_storage_free(sp);
+    return ret;
+}
+
+static krb5_error_code
+restore(krb5_context context)
+{
+    krb5_error_code ret;
+    krb5_storage *sp;
+    krb5_data enc, data;
+    unsigned int n;
+    const char *estr;
+    int fd;
+
+    fd = open(snapshot_file, O_RDONLY);
+    if (fd < 0)
+	return errno == ENOENT ? 0 : errno;
+    sp = krb5_storage_from_fd(fd);
+    close(fd);
+    if (sp == NULL)
+	return ENOMEM;
+    krb5_storage_set_max_alloc(sp, SNAPSHOT_MAX_RECORD);
+
+    for (n = 0; ; n++) {
+	ret = krb5_ret_data(sp, &enc);
+	if (ret)
+	    break;
+	ret = krb5_decrypt(context, snapshot_crypto, KRB5_KU_OTHER_ENCRYPTED,
+			   enc.data, enc.length, &data);
+	krb5_data_free(&enc);
+	if (ret)
+	    break;
+	ret = apply_record(context, &data, n == 0);
+	memset(data.data, 0, data.length);
+	krb5_data_free(&data);
+	if (ret)
+	    break;
+    }
+    krb5_storage_free(sp);
+
+    kcm_log(0, "Restored %u snapshot records from %s", n, snapshot_file);
+    if (ret && ret != HEIM_ERR_EOF) {
+	estr = krb5_get_error_message(context, ret);
+	kcm_log(0, "Ignoring the rest of snapshot %s: %s",
+		snapshot_file, estr);
+	krb5_free_error_message(context, estr);
+    }
+
+    return 0;
+}
+
+static krb5_error_code
+write_record(krb5_context context, int fd, krb5_storage *plain)
+{
+    krb5_error_code ret;
+    krb5_storage *sp;
+    krb5_data data, enc, rec;
+
+    ret = krb5_store_uint8(plain, 0);
+    if (ret == 0)
+	ret = krb5_storage_to_data(plain, &data);
+    if (ret)
+	return ret;
+
+    ret = krb5_encrypt(context, snapshot_crypto, KRB5_KU_OTHER_ENCRYPTED,
+		       data.data, data.length, &enc);
+    memset(data.data, 0, data.length);
+    krb5_data_free(&data);
+    if (ret)
+	return ret;
+
+    sp = krb5_storage_emem();
+    if (sp == NULL) {
+	krb5_data_free(&enc);
+	return ENOMEM;
+    }
+    ret = krb5_store_data(sp, enc);
+    krb5_data_free(&enc);
+    if (ret == 0)
+	ret = krb5_storage_to_data(sp, &rec);
+    krb5_storage_free(sp);
+    if (ret)
+	return ret;
+
+    if (net_write(fd, rec.data, rec.length) != (ssize_t)rec.length)
+	ret = errno;
+    else if (fsync(fd) < 0)
+	ret = errno;
+    krb5_data_free(&rec);
+
+    return ret;
+}
+
+static krb5_storage *
+record_begin(int type)
+{
+    krb5_storage *sp;
+
+    sp = krb5_storage_emem();
+    if (sp == NULL)
+	return NULL;
+    if (krb5_store_uint8(sp, SNAPSHOT_VERSION) ||
+	krb5_store_uint8(sp, type)) {
+	krb5_storage_free(sp);
+	return NULL;
+    }
+    return sp;
+}
+
+/* Called with snapshot_mutex held */
+static krb5_error_code
+write_full(krb5_context context)
+{
+    krb5_error_code ret;
+    krb5_storage *sp;
+    char *tmp;
+    int fd;
+
+    if (asprintf(&tmp, "%s.new", snapshot_file) == -1 || tmp == NULL)
+	return ENOMEM;
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (fd < 0) {
+	ret = errno;
+	free(tmp);
+	return ret;
+    }
+    rk_cloexec(fd);
+
+    /* Changes from here on go into the next delta */
+    free_dirty(take_dirty());
+
+    sp = record_begin(SNAPSHOT_FULL);
+    if (sp == NULL)
+	ret = ENOMEM;
+    else
+	ret = kcm_ccache_foreach(context, store_cache, sp);
+    if (ret == 0)
+	ret = write_record(context, fd, sp);
+    if (sp != NULL)
+	krb5_storage_free(sp);
+    if (ret == 0 && rename(tmp, snapshot_file) < 0)
+	ret = errno;
+    if (ret) {
+	close(fd);
+	unlink(tmp);
+	free(tmp);
+	return ret;
+    }
+    free(tmp);
+
+    if (snapshot_fd != -1)
+	close(snapshot_fd);
+    snapshot_fd = fd;
+    snapshot_deltas = 0;
+    snapshot_stale = 0;
+
+    return 0;
+}
+
+/* Called with snapshot_mutex held */
+static krb5_error_code
+write_delta(krb5_context context)
+{
+    struct dirty_name *list, *d;
+    krb5_error_code ret = 0;
+    krb5_storage *sp;
+    kcm_ccache ccache;
+
+    if (snapshot_stale || snapshot_deltas >= SNAPSHOT_MAX_DELTAS)
+	return write_full(context);
+
+    list = take_dirty();
+    if (list == NULL)
+	return 0;
+
+    sp = record_begin(SNAPSHOT_DELTA);
+    if (sp == NULL)
+	ret = ENOMEM;
+    for (d = list; ret == 0 && d != NULL; d = d->next) {
+	if (kcm_ccache_resolve(context, d->name, &ccache) == 0) {
+	    HEIMDAL_MUTEX_lock(&ccache->mutex);
+	    ret = store_cache(context, ccache, sp);
+	    HEIMDAL_MUTEX_unlock(&ccache->mutex);
+	    kcm_release_ccache(context, ccache);
+	} else {
+	    ret = krb5_store_uint8(sp, SNAPSHOT_DEL);
+	    if (ret == 0)
+		ret = krb5_store_stringz(sp, d->name);
+	}
+    }
+    if (ret == 0)
+	ret = write_record(context, snapshot_fd, sp);
+    if (sp != NULL)
+	krb5_storage_free(sp);
+    free_dirty(list);
+
+    if (ret == 0)
+	snapshot_deltas++;
+    return ret;
+}
+
+static void
+snapshot_write(krb5_context context, int full)
+{
+    krb5_error_code ret;
+    const char *estr;
+
+    HEIMDAL_MUTEX_lock(&snapshot_mutex);
+    ret = full ? write_full(context) : write_delta(context);
+    if (ret) {
+	/* A failed append may have left a torn record; start afresh */
+	snapshot_stale = 1;
+	estr = krb5_get_error_message(context, ret);
+	kcm_log(0, "Failed to write snapshot %s: %s", snapshot_file, estr);
+	krb5_free_error_message(context, estr);
+    }
+    HEIMDAL_MUTEX_unlock(&snapshot_mutex);
+}
+
+static krb5_error_code
+load_key(krb5_context context, const char *file, krb5_keyblock *key)
+{
+    krb5_error_code ret;
+    krb5_storage *sp;
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    if (fd >= 0) {
+	sp = krb5_storage_from_fd(fd);
+	close(fd);
+	if (sp == NULL)
+	    return ENOMEM;
+	ret = krb5_ret_keyblock(sp, key);
+	krb5_storage_free(sp);
+	return ret;
+    }
+    if (errno != ENOENT)
+	return errno;
+
+    ret = krb5_generate_random_keyblock(context,
+					ETYPE_AES256_CTS_HMAC_SHA1_96, key);
+    if (ret)
+	return ret;
+
+    fd = open(file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+	ret = errno;
+	krb5_free_keyblock_contents(context, key);
+	return ret;
+    }
+    sp = krb5_storage_from_fd(fd);
+    if (sp == NULL)
+	ret = ENOMEM;
+    else
+	ret = krb5_store_keyblock(sp, *key);
+    if (sp != NULL)
+	krb5_storage_free(sp);
+    if (ret == 0 && fsync(fd) < 0)
+	ret = errno;
+    close(fd);
+    if (ret) {
+	unlink(file);
+	krb5_free_keyblock_contents(context, key);
+    }
+    return ret;
+}
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+static void *
+snapshot_loop(void *arg)
+{
+    krb5_context context = arg;
+
+    while (!exit_flag) {
+	sleep(1);
+	kcm_snapshot_tick(context);
+    }
+
+    snapshot_write(context, 1);
+    kcm_log(0, "Wrote snapshot %s, exiting", snapshot_file);
+    exit(0);
+}
+#endif
+
+/*
+ * Note the caches changed by a successful request.
+ */
+void
+kcm_snapshot_note(krb5_context context,
+		  kcm_operation opcode,
+		  krb5_data *req_data)
+{
+    krb5_storage *sp;
+    uint16_t op;
+    char *name;
+    int n;
+
+    if (snapshot_crypto == NULL)
+	return;
+
+    switch (opcode) {
+    case KCM_OP_INITIALIZE:
+    case KCM_OP_DESTROY:
+    case KCM_OP_STORE:
+    case KCM_OP_REMOVE_CRED:
+    case KCM_OP_SET_FLAGS:
+    case KCM_OP_CHOWN:
+    case KCM_OP_CHMOD:
+    case KCM_OP_GET_INITIAL_TICKET:
+    case KCM_OP_GET_TICKET:
+    case KCM_OP_SET_KDC_OFFSET:
+	n = 1;
+	break;
+    case KCM_OP_MOVE_CACHE:
+	n = 2;
+	break;
+    default:
+	return;
+    }
+
+    /* These requests all start with the names of the caches they change */
+    sp = krb5_storage_from_readonly_mem(req_data->data, req_data->length);
+    if (sp == NULL)
+	return;
+    if (krb5_ret_uint16(sp, &op) == 0) {
+	while (n-- > 0 && krb5_ret_stringz(sp, &name) == 0)
+	    mark_dirty(name);
+    }
+    krb5_storage_free(sp);
+
+    if (!snapshot_thread)
+	kcm_snapshot_tick(context);
+}
+
+/*
+ * Append a delta if snapshot-interval has passed since the last one.
+ */
+void
+kcm_snapshot_tick(krb5_context context)
+{
+    time_t now = time(NULL);
+
+    if (snapshot_crypto == NULL || now - snapshot_last < snapshot_interval)
+	return;
+    snapshot_last = now;
+    snapshot_write(context, 0);
+}
+
+/*
+ * Restore the caches from the snapshot file, if one is configured, and
+ * start writing snapshots.  Returns non-zero if a snapshot thread was
+ * started; it writes a final snapshot and exits the process once
+ * exit_flag is set.
+ */
+int
+kcm_snapshot_start(krb5_context context)
+{
+    krb5_error_code ret;
+    krb5_keyblock key;
+    char *keyfile = NULL;
+
+    if (snapshot_file == NULL)
+	return 0;
+
+    if (snapshot_interval <= 0)
+	snapshot_interval = SNAPSHOT_DEFAULT_INTERVAL;
+
+    if (snapshot_key_file == NULL &&
+	asprintf(&keyfile, "%s.key", snapshot_file) == -1)
+	krb5_errx(context, 1, "out of memory");
+
+    ret = load_key(context, snapshot_key_file ? snapshot_key_file : keyfile,
+		   &key);
+    if (ret)
+	krb5_err(context, 1, ret, "snapshot key %s",
+		 snapshot_key_file ? snapshot_key_file : keyfile);
+    free(keyfile);
+
+    ret = krb5_crypto_init(context, &key, 0, &snapshot_crypto);
+    krb5_free_keyblock_contents(context, &key);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init");
+
+    ret = restore(context);
+    if (ret)
+	krb5_warn(context, ret, "restoring snapshot %s", snapshot_file);
+
+    snapshot_last = time(NULL);
+    snapshot_write(context, 1);
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+    {
+	pthread_t t;
+
+	if (pthread_create(&t, NULL, snapshot_loop, context) == 0) {
+	    pthread_detach(t);
+	    snapshot_thread = 1;
+	}
+    }
+#endif
+
+    return snapshot_thread;
+}
@@ -44,7 +44,7 @@ struct dbinfo {
     struct dbinfo *next;
 };
 
-static char *config_file;	/* location of kdc config file */
+char *config_file;	/* location of kdc config file */
 
 static int require_preauth = -1; /* 1 == require preauth for all principals */
 static char *max_request_str;	/* `max_request' as a string */
@@ -59,17 +59,38 @@ static int version_flag;
 /* Should we enable the HTTP hack? */
 int enable_http = -1;
 
+/* Should every worker open its own SO_REUSEPORT sockets? */
+int reuse_port = -1;
+
+/* Number of request processing threads in each worker process */
+int num_kdc_threads = -1;
+
+/* Pin worker processes to CPUs or NUMA nodes? */
+int cpu_affinity = KDC_AFFINITY_NONE;
+static const char *cpu_affinity_str;
+
 /* Log over requests to the KDC */
 const char *request_log;
 
 /* A string describing on what ports to listen */
 const char *port_str;
 
+/* TCP port (or service) on which to serve metrics, if any */
+const char *metrics_port_str;
+
 krb5_addresses explicit_addresses;
 
 size_t max_request_udp;
 size_t max_request_tcp;
 
+/* Requests answered on one TCP connection before we close it */
+unsigned int max_tcp_requests;
+
+/* Admission control limits, 0 for none */
+unsigned int max_tcp_connections;
+unsigned int max_tcp_connections_per_addr;
+unsigned int shed_queue_depth;
+
 
 static struct getarg_strings addresses_str;	/* addresses to listen on */
 
@@ -92,9 +113,18 @@ static struct getargs args[] = {
     },
     { "enable-http", 'H', arg_flag, &enable_http, "turn on HTTP support",
    	 NULL },
+    {	"reuse-port",	0,	arg_flag, &reuse_port,
+	"give each worker process its own SO_REUSEPORT sockets", NULL },
+    {	"threads",	0,	arg_integer, &num_kdc_threads,
+	"number of request processing threads per worker process", "number" },
+    {	"cpu-affinity",	0,	arg_string, rk_UNCONST(&cpu_affinity_str),
+	"pin each worker process to a CPU or NUMA node", "none|cpu|node" },
     {	"ports",	'P', 	arg_string, rk_UNCONST(&port_str),
 	"ports to listen to", "portspec"
     },
+    {	"metrics-port",	0,	arg_string, rk_UNCONST(&metrics_port_str),
+	"TCP port on which to serve metrics", "port"
+    },
     {
 	"detach",       0 ,      arg_flag, &detach_from_console,
 	"detach from console", NULL
@@ -151,6 +181,39 @@ add_one_address (krb5_context context, const char *str, int first)
     krb5_free_addresses (context, &tmp);
 }
 
+/* The [kdc] settings read into globals that can change on reload */
+static void
+read_limits(krb5_context context)
+{
+    max_tcp_requests = krb5_config_get_int_default(context, NULL, 100, "kdc",
+						   "max-tcp-requests", NULL);
+    if (max_tcp_requests == 0)
+	max_tcp_requests = 1;
+
+    max_tcp_connections =
+	krb5_config_get_int_default(context, NULL, 0, "kdc",
+				    "max-tcp-connections", NULL);
+    max_tcp_connections_per_addr =
+	krb5_config_get_int_default(context, NULL, 0, "kdc",
+				    "max-tcp-connections-per-address", NULL);
+    shed_queue_depth =
+	krb5_config_get_int_default(context, NULL, 0, "kdc",
+				    "shed-queue-depth", NULL);
+}
+
+static void
+apply_disable_des(krb5_context context)
+{
+    if(disable_des) {
+	krb5_enctype_disable(context, ETYPE_DES_CBC_CRC);
+	krb5_enctype_disable(context, ETYPE_DES_CBC_MD4);
+	krb5_enctype_disable(context, ETYPE_DES_CBC_MD5);
+	krb5_enctype_disable(context, ETYPE_DES_CBC_NONE);
+	krb5_enctype_disable(context, ETYPE_DES_CFB64_NONE);
+	krb5_enctype_disable(context, ETYPE_DES_PCBC_NONE);
+    }
+}
+
 krb5_kdc_configuration *
 configure(krb5_context context, int argc, char **argv, int *optidx)
 {
@@ -276,6 +339,31 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
 	enable_http = krb5_config_get_bool(context, NULL, "kdc",
 					   "enable-http", NULL);
 
+    if(reuse_port == -1)
+	reuse_port = krb5_config_get_bool_default(context, NULL, FALSE, "kdc",
+						  "reuse-port", NULL);
+
+    if(num_kdc_threads == -1)
+	num_kdc_threads = krb5_config_get_int_default(context, NULL, 0, "kdc",
+						      "num-kdc-threads", NULL);
+
+    if(cpu_affinity_str == NULL)
+	cpu_affinity_str = krb5_config_get_string_default(context, NULL, "none",
+							  "kdc", "cpu-affinity",
+							  NULL);
+    if (strcasecmp(cpu_affinity_str, "cpu") == 0)
+	cpu_affinity = KDC_AFFINITY_CPU;
+    else if (strcasecmp(cpu_affinity_str, "node") == 0)
+	cpu_affinity = KDC_AFFINITY_NODE;
+    else if (strcasecmp(cpu_affinity_str, "none") == 0)
+	cpu_affinity = KDC_AFFINITY_NONE;
+    else
+	krb5_errx(context, 1, "unknown cpu-affinity: %s", cpu_affinity_str);
+
+    if(metrics_port_str == NULL)
+	metrics_port_str = krb5_config_get_string(context, NULL, "kdc",
+						  "metrics-port", NULL);
+
     if(request_log == NULL)
 	request_log = krb5_config_get_string(context, NULL,
 					     "kdc",
@@ -292,6 +380,8 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
     if(max_request_udp == 0)
 	max_request_udp = 64 * 1024;
 
+    read_limits(context);
+
     if (port_str == NULL)
 	port_str = "+";
 
@@ -300,14 +390,7 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
 						   FALSE,
 						   "kdc",
 						   "disable-des", NULL);
-    if(disable_des) {
-	krb5_enctype_disable(context, ETYPE_DES_CBC_CRC);
-	krb5_enctype_disable(context, ETYPE_DES_CBC_MD4);
-	krb5_enctype_disable(context, ETYPE_DES_CBC_MD5);
-	krb5_enctype_disable(context, ETYPE_DES_CBC_NONE);
-	krb5_enctype_disable(context, ETYPE_DES_CFB64_NONE);
-	krb5_enctype_disable(context, ETYPE_DES_PCBC_NONE);
-    }
+    apply_disable_des(context);
 
     krb5_kdc_plugin_init(context);
 
@@ -315,3 +398,127 @@ configure(krb5_context context, int argc, char **argv, int *optidx)
 
     return config;
 }
+
+static void
+free_config(krb5_context context, krb5_kdc_configuration *config)
+{
+    int i;
+
+    krb5_kdc_close_dbs(context, config);
+    for (i = 0; i < config->num_db; i++)
+	if (config->db[i])
+	    (*config->db[i]->hdb_destroy)(context, config->db[i]);
+    free(config->db);
+    krb5_config_free_strings(config->hdb_prewarm_principals);
+    free(config);
+}
+
+static krb5_error_code
+read_config(krb5_context context, krb5_kdc_configuration **configp)
+{
+    krb5_error_code ret;
+    char **files;
+
+    *configp = NULL;
+    ret = krb5_prepend_config_files_default(config_file, &files);
+    if (ret)
+	return ret;
+    ret = krb5_set_config_files(context, files);
+    krb5_free_config_files(files);
+    if (ret == 0)
+	ret = krb5_kdc_get_config(context, configp);
+    if (ret == 0) {
+	ret = krb5_kdc_set_dbinfo(context, *configp);
+	if (ret) {
+	    free_config(context, *configp);
+	    *configp = NULL;
+	}
+    }
+    return ret;
+}
+
+/*
+ * Check that the configuration files parse and that every database
+ * they name opens, without touching the running context, whose
+ * configuration the running krb5_kdc_configuration points into.
+ */
+static krb5_error_code
+check_config(krb5_context context, krb5_kdc_configuration *old)
+{
+    krb5_kdc_configuration *config;
+    krb5_context scratch;
+    krb5_error_code ret;
+    int i;
+
+    ret = krb5_init_context(&scratch);
+    if (ret)
+	return ret;
+    ret = read_config(scratch, &config);
+    for (i = 0; ret == 0 && i < config->num_db; i++) {
+	HDB *db = config->db[i];
+
+	ret = db->hdb_open(scratch, db, O_RDONLY, 0);
+	if (ret == 0)
+	    (void) db->hdb_close(scratch, db);
+	else
+	    kdc_log(context, old, 0, "Could not open database %s: %s",
+		    db->hdb_name ? db->hdb_name : "",
+		    krb5_get_error_message(scratch, ret));
+    }
+    if (ret)
+	kdc_log(context, old, 0, "Not reloading configuration: %s",
+		krb5_get_error_message(scratch, ret));
+    if (config)
+	free_config(scratch, config);
+    krb5_free_context(scratch);
+    return ret;
+}
+
+/*
+ * Re-read the configuration files, on SIGHUP, into a new configuration
+ * for the next generation of worker processes.  Nothing changes unless
+ * the new files parse and all their databases open.  What only takes
+ * effect at startup (command line options, ports, addresses, worker
+ * processes and threads, cache sizes) keeps its old value.
+ */
+
+krb5_error_code
+reconfigure(krb5_context context, krb5_kdc_configuration **configp)
+{
+    krb5_kdc_configuration *old = *configp;
+    krb5_kdc_configuration *config;
+    krb5_error_code ret;
+
+    ret = check_config(context, old);
+    if (ret)
+	return ret;
+
+    /*
+     * The files were just found good; if they change under us now, the
+     * old configuration points into a freed tree, so give up.
+     */
+    ret = read_config(context, &config);
+    if (ret)
+	krb5_err(context, 1, ret, "reloading configuration");
+
+    /* Sized once, before the first worker */
+    config->num_kdc_processes = old->num_kdc_processes;
+    config->tgs_replay_cache_size = old->tgs_replay_cache_size;
+    config->tgs_ticket_cache_size = old->tgs_ticket_cache_size;
+    config->realm_cache_size = old->realm_cache_size;
+    config->hot_keys = old->hot_keys;
+
+    kdc_openlog(context, "kdc", config);
+    krb5_closelog(context, old->logf);
+    old->logf = NULL;
+    free_config(context, old);
+
+    if (require_preauth != -1)
+	config->require_preauth = require_preauth;
+    read_limits(context);
+    apply_disable_des(context);
+    krb5_kdc_pkinit_config(context, config);
+    *configp = config;
+    kdc_log(context, config, 0, "Reloaded configuration");
+    return 0;
+}
@@ -32,6 +32,15 @@
  */
 
 #include "kdc_locl.h"
+#include <ctype.h>
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
+
+#if defined(HAVE_FORK) && defined(HAVE_SCHED_GETAFFINITY) && \
+    defined(HAVE_SCHED_SETAFFINITY) && defined(CPU_SET) && defined(CPU_COUNT)
+#define KDC_AFFINITY 1
+#endif
 
 /*
  * a tuple describing on what to listen
@@ -49,6 +58,9 @@ static struct port_desc *ports;
 static size_t num_ports;
 static pid_t bonjour_pid = -1;
 
+/* The CPU this worker process was placed on, or -1 */
+static int worker_cpu = -1;
+
 /*
  * add `family, port, protocol' to the list with duplicate suppresion.
  */
@@ -198,11 +210,18 @@ struct descr {
     unsigned char *buf;
     size_t size;
     size_t len;
+    size_t used;		/* high-water mark of `buf', to wipe */
     time_t timeout;
     struct sockaddr_storage __ss;
     struct sockaddr *sa;
     socklen_t sock_len;
     char addr_string[128];
+    int metrics;		/* serves the metrics page, not requests */
+    size_t reqlen;		/* length of the request at buf + 4 */
+    unsigned int nreqs;		/* requests answered on this connection */
+    unsigned int oneshot:1;	/* close after the current request */
+    unsigned int busy:1;	/* a request is with the thread pool */
+    unsigned int admitted:1;	/* counted against the connection limits */
 };
 
 static void
@@ -226,6 +245,211 @@ reinit_descrs (struct descr *d, int n)
 	d[i].sa = (struct sockaddr *)&d[i].__ss;
 }
 
+/*
+ * Readiness notification for the worker loop.
+ *
+ * Sockets are registered once, when they are created or accepted, by
+ * their index in the descriptor table, and unregistered in
+ * clear_descr().  The loop then only looks at the descriptors that
+ * are reported ready instead of scanning the whole table.  We use
+ * epoll(7) on Linux and kqueue(2) on the BSDs and macOS, and fall back
+ * to select() (limited to FD_SETSIZE) elsewhere or if those fail.
+ */
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#include <sys/epoll.h>
+#define KDC_EVENTS_EPOLL 1
+#elif defined(HAVE_SYS_EVENT_H) && defined(HAVE_KQUEUE)
+#include <sys/event.h>
+#define KDC_EVENTS_KQUEUE 1
+#endif
+
+#define EV_ISLIVE	(-1)	/* index used for the master liveness socket */
+#define EV_POOL		(-2)	/* index used for the thread pool wakeup */
+#define EV_MAX_READY	64
+
+struct event_reg {
+    krb5_socket_t s;
+    int idx;
+};
+
+static struct {
+    int fd;			/* epoll/kqueue descriptor, -1 for select() */
+    struct event_reg *regs;	/* registered sockets, select() only */
+    size_t nregs;
+    size_t sregs;
+} events = { -1, NULL, 0, 0 };
+
+static void
+events_init(krb5_context context, krb5_kdc_configuration *config)
+{
+    const char *backend = "select";
+
+#if defined(KDC_EVENTS_EPOLL)
+    events.fd = epoll_create1(EPOLL_CLOEXEC);
+    if (events.fd == -1)
+	krb5_warn(context, errno, "epoll_create1, falling back to select");
+    else
+	backend = "epoll";
+#elif defined(KDC_EVENTS_KQUEUE)
+    events.fd = kqueue();
+    if (events.fd == -1) {
+	krb5_warn(context, errno, "kqueue, falling back to select");
+    } else {
+	rk_cloexec(events.fd);
+	backend = "kqueue";
+    }
+#endif
+    kdc_log(context, config, 4, "using %s for socket events", backend);
+}
+
+static int
+events_add(krb5_context context, krb5_socket_t s, int idx)
+{
+    struct event_reg *tmp;
+
+#if defined(KDC_EVENTS_EPOLL)
+    if (events.fd != -1) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = (uint32_t)idx;
+	if (epoll_ctl(events.fd, EPOLL_CTL_ADD, s, &ev) == -1) {
+	    krb5_warn(context, errno, "epoll_ctl(ADD)");
+	    return -1;
+	}
+	return 0;
+    }
+#elif defined(KDC_EVENTS_KQUEUE)
+    if (events.fd != -1) {
+	struct kevent kev;
+
+	EV_SET(&kev, s, EVFILT_READ, EV_ADD, 0, 0, (void *)(intptr_t)idx);
+	if (kevent(events.fd, &kev, 1, NULL, 0, NULL) == -1) {
+	    krb5_warn(context, errno, "kevent(EV_ADD)");
+	    return -1;
+	}
+	return 0;
+    }
+#endif
+
+#if !defined(NO_LIMIT_FD_SETSIZE) && defined(FD_SETSIZE)
+    if (s >= FD_SETSIZE) {
+	krb5_warnx(context, "socket FD too large");
+	return -1;
+    }
+#endif
+    if (events.nregs == events.sregs) {
+	tmp = realloc(events.regs, (events.sregs + 16) * sizeof(*tmp));
+	if (tmp == NULL) {
+	    krb5_warnx(context, "No memory");
+	    return -1;
+	}
+	events.regs = tmp;
+	events.sregs += 16;
+    }
+    events.regs[events.nregs].s = s;
+    events.regs[events.nregs].idx = idx;
+    events.nregs++;
+    return 0;
+}
+
+static void
+events_del(krb5_socket_t s)
+{
+    size_t i;
+
+#if defined(KDC_EVENTS_EPOLL)
+    if (events.fd != -1) {
+	(void) epoll_ctl(events.fd, EPOLL_CTL_DEL, s, NULL);
+	return;
+    }
+#elif defined(KDC_EVENTS_KQUEUE)
+    if (events.fd != -1) {
+	struct kevent kev;
+
+	EV_SET(&kev, s, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	(void) kevent(events.fd, &kev, 1, NULL, 0, NULL);
+	return;
+    }
+#endif
+
+    for (i = 0; i < events.nregs; i++) {
+	if (events.regs[i].s == s) {
+	    events.regs[i] = events.regs[--events.nregs];
+	    return;
+	}
+    }
+}
+
+/*
+ * Wait up to `timeout' seconds for sockets to become readable and
+ * store the descriptor table indices of at most `nready' of them in
+ * `ready'.  Returns the number of indices stored or -1 on error.
+ */
+
+static int
+events_wait(int *ready, int nready, int timeout)
+{
+    struct timeval tmout;
+    fd_set fds;
+    int max_fd = 0;
+    int n = 0;
+    size_t i;
+
+#if defined(KDC_EVENTS_EPOLL)
+    if (events.fd != -1) {
+	struct epoll_event evs[EV_MAX_READY];
+	int ret;
+
+	if (nready > EV_MAX_READY)
+	    nready = EV_MAX_READY;
+	ret = epoll_wait(events.fd, evs, nready, timeout * 1000);
+	for (n = 0; n < ret; n++)
+	    ready[n] = (int)evs[n].data.u32;
+	return ret;
+    }
+#elif defined(KDC_EVENTS_KQUEUE)
+    if (events.fd != -1) {
+	struct kevent kevs[EV_MAX_READY];
+	struct timespec ts;
+	int ret;
+
+	if (nready > EV_MAX_READY)
+	    nready = EV_MAX_READY;
+	ts.tv_sec = timeout;
+	ts.tv_nsec = 0;
+	ret = kevent(events.fd, NULL, 0, kevs, nready, &ts);
+	for (n = 0; n < ret; n++)
+	    ready[n] = (int)(intptr_t)kevs[n].udata;
+	return ret;
+    }
+#endif
+
+    FD_ZERO(&fds);
+    for (i = 0; i < events.nregs; i++) {
+	if (max_fd < (int)events.regs[i].s)
+	    max_fd = events.regs[i].s;
+	FD_SET(events.regs[i].s, &fds);
+    }
+
+    tmout.tv_sec = timeout;
+    tmout.tv_usec = 0;
+    switch (select(max_fd + 1, &fds, 0, 0, &tmout)) {
+    case -1:
+	return -1;
+    case 0:
+	return 0;
+    default:
+	break;
+    }
+    for (i = 0; i < events.nregs && n < nready; i++)
+	if (FD_ISSET(events.regs[i].s, &fds))
+	    ready[n++] = events.regs[i].idx;
+    return n;
+}
+
 /*
  * Create the socket (family, type, port) in `d'
  */
@@ -265,6 +489,27 @@ init_socket(krb5_context context,
 	int one = 1;
 	setsockopt(d->s, SOL_SOCKET, SO_REUSEADDR, (void *)&one, sizeof(one));
     }
+#endif
+#if defined(HAVE_SETSOCKOPT) && defined(SOL_SOCKET) && \
+    (defined(SO_REUSEPORT_LB) || defined(SO_REUSEPORT))
+    if (reuse_port > 0) {
+	int one = 1;
+#ifdef SO_REUSEPORT_LB
+	int opt = SO_REUSEPORT_LB;	/* FreeBSD: load-balancing variant */
+#else
+	int opt = SO_REUSEPORT;
+#endif
+
+	if (setsockopt(d->s, SOL_SOCKET, opt, (void *)&one, sizeof(one)) < 0)
+	    krb5_warn(context, errno, "setsockopt(SO_REUSEPORT)");
+    }
+#endif
+#if defined(HAVE_SETSOCKOPT) && defined(SOL_SOCKET) && defined(SO_INCOMING_CPU)
+    /* Prefer this worker's sockets for traffic arriving on its CPU */
+    if (reuse_port > 0 && worker_cpu >= 0 &&
+	setsockopt(d->s, SOL_SOCKET, SO_INCOMING_CPU, (void *)&worker_cpu,
+		   sizeof(worker_cpu)) < 0)
+	krb5_warn(context, errno, "setsockopt(SO_INCOMING_CPU)");
 #endif
     d->type = type;
     d->port = port;
@@ -318,10 +563,10 @@ init_sockets(krb5_context context,
 	    krb5_err (context, 1, ret, "krb5_get_all_server_addrs");
     }
     parse_ports(context, config, port_str);
-    d = malloc(addresses.len * num_ports * sizeof(*d));
+    d = malloc(addresses.len * (num_ports + 2) * sizeof(*d));
     if (d == NULL)
 	krb5_errx(context, 1, "malloc(%lu) failed",
-		  (unsigned long)num_ports * sizeof(*d));
+		  (unsigned long)(num_ports + 2) * sizeof(*d));
 
     for (i = 0; i < num_ports; i++){
 	for (j = 0; j < addresses.len; ++j) {
@@ -343,7 +588,25 @@ init_sockets(krb5_context context,
 	    }
 	}
     }
-    krb5_free_addresses (context, &addresses);
+    if (metrics_port_str) {
+	int port = krb5_getportbyname(context, metrics_port_str, "tcp", 0);
+	char *end;
+
+	if (port == 0)
+	    port = htons(strtol(metrics_port_str, &end, 0));
+	for (j = 0; port != 0 && j < addresses.len; ++j) {
+	    init_socket(context, config, &d[num], &addresses.val[j],
+			addresses.val[j].addr_type == KRB5_ADDRESS_INET6 ?
+			AF_INET6 : AF_INET, SOCK_STREAM, port);
+	    if (d[num].s != rk_INVALID_SOCKET) {
+		kdc_log(context, config, 3, "serving metrics on port %u/tcp",
+			ntohs(port));
+		d[num++].metrics = 1;
+	    }
+	}
+    }
+    if (addresses.val != explicit_addresses.val)
+	krb5_free_addresses (context, &addresses);
     d = realloc(d, num * sizeof(*d));
     if (d == NULL && num != 0)
 	krb5_errx(context, 1, "realloc(%lu) failed",
@@ -421,42 +684,347 @@ send_reply(krb5_context context,
  */
 
 static void
-do_request(krb5_context context,
-	   krb5_kdc_configuration *config,
-	   void *buf, size_t len, krb5_boolean prependlength,
-	   struct descr *d)
+process_data(krb5_context context,
+	     krb5_kdc_configuration *config,
+	     void *buf, size_t len, krb5_boolean *prependlength,
+	     struct descr *d, krb5_data *reply)
 {
     krb5_error_code ret;
-    krb5_data reply;
     int datagram_reply = (d->type == SOCK_DGRAM);
 
+    /* One clock read per request, shared with libkrb5 */
     krb5_kdc_update_time(NULL);
+    krb5_set_time_cache(context, &_kdc_now);
 
-    krb5_data_zero(&reply);
+    krb5_data_zero(reply);
     ret = krb5_kdc_process_request(context, config,
-				   buf, len, &reply, &prependlength,
+				   buf, len, reply, prependlength,
 				   d->addr_string, d->sa,
 				   datagram_reply);
+    krb5_set_time_cache(context, NULL);
     if(request_log)
-	krb5_kdc_save_request(context, request_log, buf, len, &reply, d->sa);
-    if(reply.length){
-	send_reply(context, config, prependlength, d, &reply);
-	krb5_data_free(&reply);
-    }
+	krb5_kdc_save_request(context, request_log, buf, len, reply, d->sa);
     if(ret)
 	kdc_log(context, config, 1,
 		"Failed processing %lu byte request from %s",
 		(unsigned long)len, d->addr_string);
 }
 
+static void
+do_request_now(krb5_context context,
+	       krb5_kdc_configuration *config,
+	       void *buf, size_t len, krb5_boolean prependlength,
+	       struct descr *d)
+{
+    krb5_data reply;
+
+    process_data(context, config, buf, len, &prependlength, d, &reply);
+    if(reply.length){
+	send_reply(context, config, prependlength, d, &reply);
+	krb5_data_free(&reply);
+    }
+}
+
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+
 /*
- * Handle incoming data to the UDP socket in `d'
+ * Threaded worker pool (num-kdc-threads).
+ *
+ * The worker process' loop() remains the only thread that touches the
+ * descriptor table: it reads datagrams and assembles TCP requests as
+ * before, then queues each complete request to a pool of threads that
+ * process it and send the reply.  While a TCP request is with the
+ * pool its connection is marked busy and not read from, so that the
+ * replies go out in order; once the reply has been sent the thread
+ * hands the job back to loop() through the wakeup pipe, which then
+ * resumes reading the connection.
+ *
+ * Every thread has its own krb5_context and its own HDB handles (the
+ * HDB backends cannot be used concurrently through one handle); the
+ * rest of the configuration is shared read-only.
  */
 
+#define KDC_THREADS 1
+#define KDC_MAX_QUEUED_PER_THREAD 64
+
+struct kdc_job {
+    struct kdc_job *next;
+    struct descr d;
+    int idx;
+    krb5_boolean prependlength;
+    unsigned char *data;	/* the request: in `buf' or the TCP buffer */
+    size_t len;
+    unsigned char buf[1];
+};
+
+struct kdc_thread {
+    pthread_t thread;
+    krb5_context context;
+    krb5_kdc_configuration config;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    struct kdc_job *head;
+    struct kdc_job **tail;
+    struct kdc_job *done;	/* finished TCP jobs, for loop() */
+    size_t queued;
+    size_t max_queued;
+    int shutdown;
+    int nthreads;
+    struct kdc_thread *threads;
+    int wake[2];
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    NULL, &pool.head, NULL, 0, 0, 0, 0, NULL, { -1, -1 }
+};
+
+static void *
+pool_thread(void *arg)
+{
+    struct kdc_thread *t = arg;
+    struct kdc_job *job;
+
+    /* All of a worker's threads warm up at once */
+    krb5_kdc_prewarm(t->context, &t->config);
+
+    for (;;) {
+	pthread_mutex_lock(&pool.lock);
+	while (pool.head == NULL && !pool.shutdown)
+	    pthread_cond_wait(&pool.cv, &pool.lock);
+	if ((job = pool.head) == NULL) {
+	    pthread_mutex_unlock(&pool.lock);
+	    break;
+	}
+	if ((pool.head = job->next) == NULL)
+	    pool.tail = &pool.head;
+	pool.queued--;
+	pthread_mutex_unlock(&pool.lock);
+	krb5_kdc_metrics_queue(-1);
+
+	do_request_now(t->context, &t->config, job->data, job->len,
+		       job->prependlength, &job->d);
+	if (job->d.type != SOCK_STREAM) {
+	    free(job);
+	    continue;
+	}
+	pthread_mutex_lock(&pool.lock);
+	job->next = pool.done;
+	pool.done = job;
+	pthread_mutex_unlock(&pool.lock);
+	while (write(pool.wake[1], "", 1) < 0 && errno == EINTR)
+	    ;
+    }
+    return NULL;
+}
+
 static void
-handle_udp(krb5_context context,
+pool_start(krb5_context context, krb5_kdc_configuration *config)
+{
+    krb5_error_code ret;
+    int i;
+
+    if (num_kdc_threads <= 0)
+	return;
+
+    pool.threads = calloc(num_kdc_threads, sizeof(pool.threads[0]));
+    if (pool.threads == NULL)
+	krb5_errx(context, 1, "out of memory");
+    if (pipe(pool.wake) == -1)
+	krb5_err(context, 1, errno, "pipe");
+    rk_cloexec(pool.wake[0]);
+    rk_cloexec(pool.wake[1]);
+    socket_set_nonblocking(pool.wake[0], 1);
+    socket_set_nonblocking(pool.wake[1], 1);
+
+    for (i = 0; i < num_kdc_threads; i++) {
+	struct kdc_thread *t = &pool.threads[i];
+	char **files;
+
+	/*
+	 * krb5_copy_context() does not re-derive the settings that
+	 * krb5_init_context() computes from the configuration, so build
+	 * each thread's context from the same files instead.
+	 */
+	ret = krb5_init_context(&t->context);
+	if (ret)
+	    krb5_errx(context, 1, "krb5_init_context failed: %d", ret);
+	ret = krb5_prepend_config_files_default(config_file, &files);
+	if (ret)
+	    krb5_err(context, 1, ret, "getting configuration files");
+	ret = krb5_set_config_files(t->context, files);
+	krb5_free_config_files(files);
+	if (ret)
+	    krb5_err(context, 1, ret, "reading configuration files");
+	t->config = *config;
+	t->config.db = NULL;
+	t->config.num_db = 0;
+	t->config.db_state = NULL;
+	t->config.num_db_state = 0;
+	t->config.entry_cache = NULL;
+	t->config.negative_cache = NULL;
+	t->config.etype_info_cache = NULL;
+	ret = krb5_kdc_set_dbinfo(t->context, &t->config);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_kdc_set_dbinfo");
+	if ((ret = pthread_create(&t->thread, NULL, pool_thread, t)) != 0)
+	    krb5_err(context, 1, ret, "pthread_create");
+	pool.nthreads++;
+    }
+    pool.max_queued = shed_queue_depth ? shed_queue_depth :
+	pool.nthreads * KDC_MAX_QUEUED_PER_THREAD;
+    kdc_log(context, config, 3, "KDC worker %d started %d request threads",
+	    (int)getpid(), pool.nthreads);
+}
+
+static void
+pool_stop(krb5_context context)
+{
+    struct kdc_job *job;
+    int i, j;
+
+    if (pool.nthreads == 0)
+	return;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = 1;
+    pthread_cond_broadcast(&pool.cv);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < pool.nthreads; i++) {
+	struct kdc_thread *t = &pool.threads[i];
+
+	pthread_join(t->thread, NULL);
+	krb5_kdc_close_dbs(t->context, &t->config);
+	for (j = 0; j < t->config.num_db; j++)
+	    if (t->config.db[j]->hdb_destroy)
+		(*t->config.db[j]->hdb_destroy)(t->context, t->config.db[j]);
+	free(t->config.db);
+	krb5_free_context(t->context);
+    }
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.nthreads = 0;
+    while ((job = pool.done) != NULL) {
+	pool.done = job->next;
+	free(job);
+    }
+    close(pool.wake[0]);
+    close(pool.wake[1]);
+    pool.wake[0] = pool.wake[1] = -1;
+}
+
+/*
+ * Queue the request to the pool.  For TCP the connection `d' (at index
+ * `idx') is busy until the job comes back to pool_reap(), so the job
+ * can use the request where it lies in the connection's buffer; UDP
+ * requests are copied.  Returns 1 if the request was queued and -1 if
+ * it was dropped.  When the queue is full TCP requests are answered
+ * right away with KRB5KDC_ERR_SVC_UNAVAILABLE (returning 0), so that the
+ * client can try another KDC, and UDP requests are dropped.
+ */
+
+static int
+pool_queue(krb5_context context,
 	   krb5_kdc_configuration *config,
-	   struct descr *d)
+	   void *buf, size_t len, krb5_boolean prependlength,
+	   struct descr *d, int idx)
+{
+    struct kdc_job *job;
+    size_t copy = d->type == SOCK_STREAM ? 0 : len;
+    int full;
+
+    /* Only we add jobs, so the queue cannot fill up behind our back */
+    pthread_mutex_lock(&pool.lock);
+    full = pool.queued >= pool.max_queued;
+    pthread_mutex_unlock(&pool.lock);
+    if (full) {
+	krb5_data reply;
+
+	krb5_kdc_metrics_shed("queue");
+	if (d->type != SOCK_STREAM) {
+	    kdc_log(context, config, 4,
+		    "Request queue full, dropping request from %s",
+		    d->addr_string);
+	    return -1;
+	}
+	kdc_log(context, config, 4,
+		"Request queue full, refusing request from %s",
+		d->addr_string);
+	if (krb5_mk_error(context, KRB5KDC_ERR_SVC_UNAVAILABLE,
+			  NULL, NULL, NULL, NULL, NULL, NULL, &reply))
+	    return -1;
+	send_reply(context, config, TRUE, d, &reply);
+	krb5_data_free(&reply);
+	return 0;
+    }
+
+    job = malloc(sizeof(*job) + copy);
+    if (job == NULL) {
+	kdc_log(context, config, 1, "Failed to allocate %lu bytes",
+		(unsigned long)(sizeof(*job) + copy));
+	return -1;
+    }
+    job->next = NULL;
+    job->idx = idx;
+    job->d = *d;
+    job->d.buf = NULL;
+    job->d.size = job->d.len = job->d.used = 0;
+    reinit_descrs(&job->d, 1);
+    job->prependlength = prependlength;
+    job->len = len;
+    if (copy) {
+	memcpy(job->buf, buf, len);
+	job->data = job->buf;
+    } else {
+	job->data = buf;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (d->type == SOCK_STREAM) {
+	events_del(d->s);
+	d->busy = 1;
+    }
+    *pool.tail = job;
+    pool.tail = &job->next;
+    pool.queued++;
+    pthread_cond_signal(&pool.cv);
+    pthread_mutex_unlock(&pool.lock);
+    krb5_kdc_metrics_queue(1);
+    return 1;
+}
+
+#endif /* ENABLE_PTHREAD_SUPPORT && HAVE_PTHREAD_H */
+
+/*
+ * Handle the request in `buf, len' from `d' (at index `idx' for TCP).
+ * Returns 0 if it has been answered, 1 if it was queued to the thread
+ * pool and -1 if it was dropped.
+ */
+
+static int
+do_request(krb5_context context,
+	   krb5_kdc_configuration *config,
+	   void *buf, size_t len, krb5_boolean prependlength,
+	   struct descr *d, int idx)
+{
+#ifdef KDC_THREADS
+    if (pool.nthreads > 0)
+	return pool_queue(context, config, buf, len, prependlength, d, idx);
+#endif
+    do_request_now(context, config, buf, len, prependlength, d);
+    return 0;
+}
+
+/*
+ * Receive and handle a single datagram on the UDP socket in `d'
+ */
+
+static void
+handle_udp_one(krb5_context context,
+	       krb5_kdc_configuration *config,
+	       struct descr *d)
 {
     unsigned char *buf;
     ssize_t n;
@@ -493,54 +1061,353 @@ handle_udp(krb5_context context,
 	    send_reply(context, config, FALSE, d, &data);
 	    krb5_data_free(&data);
 	} else {
-	    do_request(context, config, buf, n, FALSE, d);
+	    (void) do_request(context, config, buf, n, FALSE, d, -1);
 	}
     }
     free (buf);
 }
 
-static void
-clear_descr(struct descr *d)
-{
-    if(d->buf)
-	memset(d->buf, 0, d->size);
-    d->len = 0;
-    if(d->s != rk_INVALID_SOCKET)
-	rk_closesocket(d->s);
-    d->s = rk_INVALID_SOCKET;
-}
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
 
+/*
+ * Batched UDP: drain up to UDP_BATCH queued datagrams with one
+ * recvmmsg(), process them in order and flush all the replies with
+ * sendmmsg(), saving two system calls per request under load.  If the
+ * kernel lacks these system calls we fall back to handle_udp_one() for
+ * good.
+ */
 
-/* remove HTTP %-quoting from buf */
-static int
-de_http(char *buf)
+#define UDP_BATCH 16
+
+static int udp_batch_disabled;
+
+static void
+handle_udp_batch(krb5_context context,
+		 krb5_kdc_configuration *config,
+		 struct descr *d)
 {
-    unsigned char *p, *q;
-    unsigned int x;
+    static unsigned char *bufs;
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct sockaddr_storage from[UDP_BATCH];
+    krb5_data replies[UDP_BATCH];
+    struct mmsghdr out[UDP_BATCH];
+    struct iovec oiov[UDP_BATCH];
+    int i, n, nout = 0, sent;
+
+    if (bufs == NULL) {
+	bufs = malloc(UDP_BATCH * max_request_udp);
+	if (bufs == NULL) {
+	    kdc_log(context, config, 1, "Failed to allocate %lu bytes",
+		    (unsigned long)(UDP_BATCH * max_request_udp));
+	    handle_udp_one(context, config, d);
+	    return;
+	}
+    }
 
-    for (p = q = (unsigned char *)buf; *p; p++, q++) {
-	if (*p == '%') {
-	    if (!(isxdigit(p[1]) && isxdigit(p[2])))
-		return -1;
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < UDP_BATCH; i++) {
+	iov[i].iov_base = bufs + i * max_request_udp;
+	iov[i].iov_len = max_request_udp;
+	msgs[i].msg_hdr.msg_name = &from[i];
+	msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+	msgs[i].msg_hdr.msg_iov = &iov[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
-	    if (sscanf((char *)p + 1, "%2x", &x) != 1)
-		return -1;
+    n = recvmmsg(d->s, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+	if (errno == ENOSYS) {
+	    udp_batch_disabled = 1;
+	    handle_udp_one(context, config, d);
+	} else if (errno != EAGAIN && errno != EINTR) {
+	    krb5_warn(context, errno, "recvmmsg");
+	}
+	return;
+    }
 
-	    *q = x;
-	    p += 2;
+    for (i = 0; i < n; i++) {
+	krb5_boolean prependlength = FALSE;
+
+	d->sock_len = msgs[i].msg_hdr.msg_namelen;
+	memcpy(&d->__ss, &from[i], d->sock_len);
+	addr_to_string(context, d->sa, d->sock_len,
+		       d->addr_string, sizeof(d->addr_string));
+
+	if (msgs[i].msg_len == max_request_udp ||
+	    (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+	    krb5_warnx(context,
+		       "recvmmsg: truncated packet from %s, asking for TCP",
+		       d->addr_string);
+	    if (krb5_mk_error(context, KRB5KRB_ERR_RESPONSE_TOO_BIG,
+			      NULL, NULL, NULL, NULL, NULL, NULL,
+			      &replies[i]))
+		krb5_data_zero(&replies[i]);
 	} else {
-	    *q = *p;
+#ifdef KDC_THREADS
+	    if (pool.nthreads > 0) {
+		krb5_data_zero(&replies[i]);
+		(void) pool_queue(context, config, iov[i].iov_base,
+				  msgs[i].msg_len, FALSE, d, -1);
+		continue;
+	    }
+#endif
+	    process_data(context, config, iov[i].iov_base, msgs[i].msg_len,
+			 &prependlength, d, &replies[i]);
 	}
-    }
-    *q = '\0';
-    return 0;
-}
+	if (replies[i].length == 0)
+	    continue;
 
-#define TCP_TIMEOUT 4
+	kdc_log(context, config, 4, "sending %lu bytes to %s",
+		(unsigned long)replies[i].length, d->addr_string);
+	memset(&out[nout], 0, sizeof(out[nout]));
+	oiov[nout].iov_base = replies[i].data;
+	oiov[nout].iov_len = replies[i].length;
+	out[nout].msg_hdr.msg_name = &from[i];
+	out[nout].msg_hdr.msg_namelen = msgs[i].msg_hdr.msg_namelen;
+	out[nout].msg_hdr.msg_iov = &oiov[nout];
+	out[nout].msg_hdr.msg_iovlen = 1;
+	nout++;
+    }
 
-/*
- * accept a new TCP connection on `d[parent]' and store it in `d[child]'
- */
+    for (sent = 0; sent < nout; ) {
+	int ret = sendmmsg(d->s, out + sent, nout - sent, 0);
+
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    kdc_log(context, config, 1, "sendmmsg: %s", strerror(errno));
+	    /* Skip the datagram that failed and carry on with the rest */
+	    sent++;
+	    continue;
+	}
+	sent += ret;
+    }
+
+    for (i = 0; i < n; i++)
+	krb5_data_free(&replies[i]);
+}
+
+#endif
+
+/*
+ * Handle incoming data to the UDP socket in `d'
+ */
+
+static void
+handle_udp(krb5_context context,
+	   krb5_kdc_configuration *config,
+	   struct descr *d)
+{
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+    if (!udp_batch_disabled) {
+	handle_udp_batch(context, config, d);
+	return;
+    }
+#endif
+    handle_udp_one(context, config, d);
+}
+
+/*
+ * TCP receive buffers.
+ *
+ * Buffers come in a few size classes.  When a connection is closed its
+ * buffer is wiped and kept on the free list of its class for the next
+ * connection, rather than each connection growing its own buffer with
+ * realloc() as its data trickles in.  Buffers for requests larger than
+ * the largest class are allocated to size and freed after use.
+ */
+
+#define TCP_BUF_CLASSES		3
+#define TCP_BUF_FREE_MAX	32
+
+static const size_t tcp_buf_class_size[TCP_BUF_CLASSES] = {
+    4096, 16384, 65536
+};
+
+static struct {
+    size_t n;
+    unsigned char *bufs[TCP_BUF_FREE_MAX];
+} tcp_buf_free[TCP_BUF_CLASSES];
+
+static unsigned char *
+tcp_buf_get(size_t need, size_t *size)
+{
+    unsigned char *buf;
+    size_t i;
+
+    for (i = 0; i < TCP_BUF_CLASSES; i++) {
+	if (need > tcp_buf_class_size[i])
+	    continue;
+	*size = tcp_buf_class_size[i];
+	if (tcp_buf_free[i].n > 0)
+	    return tcp_buf_free[i].bufs[--tcp_buf_free[i].n];
+	return malloc(*size);
+    }
+    buf = malloc(need);
+    if (buf != NULL)
+	*size = need;
+    return buf;
+}
+
+static void
+tcp_buf_put(unsigned char *buf, size_t size, size_t used)
+{
+    size_t i;
+
+    memset(buf, 0, used);
+    for (i = 0; i < TCP_BUF_CLASSES; i++) {
+	if (size == tcp_buf_class_size[i] &&
+	    tcp_buf_free[i].n < TCP_BUF_FREE_MAX) {
+	    tcp_buf_free[i].bufs[tcp_buf_free[i].n++] = buf;
+	    return;
+	}
+    }
+    free(buf);
+}
+
+/*
+ * Admission control for TCP connections: at most max_tcp_connections
+ * per worker and max_tcp_connections_per_addr from one address.
+ * Connections past the limits are closed as soon as they are accepted,
+ * before anything is read from them.
+ */
+
+static unsigned int num_tcp_connections;
+static heim_dict_t tcp_addr_connections;
+
+static int
+tcp_admit(krb5_context context,
+	  krb5_kdc_configuration *config,
+	  struct descr *d)
+{
+    heim_string_t key;
+    heim_number_t n;
+    int count = 0;
+
+    if (max_tcp_connections_per_addr == 0) {
+	num_tcp_connections++;
+	d->admitted = 1;
+	return 1;
+    }
+
+    if (tcp_addr_connections == NULL &&
+	(tcp_addr_connections = heim_dict_create(101)) == NULL)
+	return 0;
+    key = heim_string_create(d->addr_string);
+    if (key == NULL)
+	return 0;
+    n = heim_dict_get_value(tcp_addr_connections, key);
+    if (n)
+	count = heim_number_get_int(n);
+    if ((unsigned int)count >= max_tcp_connections_per_addr) {
+	heim_release(key);
+	kdc_log(context, config, 4,
+		"Too many TCP connections from %s, closing", d->addr_string);
+	krb5_kdc_metrics_shed("address");
+	return 0;
+    }
+    n = heim_number_create(count + 1);
+    if (n == NULL ||
+	heim_dict_set_value(tcp_addr_connections, key, n) != 0) {
+	heim_release(n);
+	heim_release(key);
+	return 0;
+    }
+    heim_release(n);
+    heim_release(key);
+    num_tcp_connections++;
+    d->admitted = 1;
+    return 1;
+}
+
+static void
+tcp_release(struct descr *d)
+{
+    heim_string_t key;
+    heim_number_t n;
+    int count;
+
+    d->admitted = 0;
+    num_tcp_connections--;
+    if (tcp_addr_connections == NULL ||
+	(key = heim_string_create(d->addr_string)) == NULL)
+	return;
+    n = heim_dict_get_value(tcp_addr_connections, key);
+    count = n ? heim_number_get_int(n) : 0;
+    if (count <= 1) {
+	heim_dict_delete_key(tcp_addr_connections, key);
+    } else if ((n = heim_number_create(count - 1)) != NULL) {
+	heim_dict_set_value(tcp_addr_connections, key, n);
+	heim_release(n);
+    }
+    heim_release(key);
+}
+
+static int
+tcp_at_limit(void)
+{
+    return max_tcp_connections != 0 &&
+	num_tcp_connections >= max_tcp_connections;
+}
+
+static void
+clear_descr(struct descr *d)
+{
+    if (d->admitted)
+	tcp_release(d);
+    if(d->buf)
+	tcp_buf_put(d->buf, d->size, d->used);
+    d->buf = NULL;
+    d->size = 0;
+    d->used = 0;
+    d->len = 0;
+    d->reqlen = 0;
+    d->nreqs = 0;
+    d->oneshot = 0;
+    d->busy = 0;
+    if(d->s != rk_INVALID_SOCKET) {
+	events_del(d->s);
+	rk_closesocket(d->s);
+    }
+    d->s = rk_INVALID_SOCKET;
+}
+
+
+/* remove HTTP %-quoting from buf */
+static int
+de_http(char *buf)
+{
+    unsigned char *p, *q;
+    unsigned int x;
+
+    for (p = q = (unsigned char *)buf; *p; p++, q++) {
+	if (*p == '%') {
+	    if (!(isxdigit(p[1]) && isxdigit(p[2])))
+		return -1;
+
+	    if (sscanf((char *)p + 1, "%2x", &x) != 1)
+		return -1;
+
+	    *q = x;
+	    p += 2;
+	} else {
+	    *q = *p;
+	}
+    }
+    *q = '\0';
+    return 0;
+}
+
+#define TCP_TIMEOUT 4
+
+/* How long a worker of an old generation serves its open connections */
+#define DRAIN_TIMEOUT 10
+#define TCP_READ_CHUNK 4096
+
+/*
+ * accept a new TCP connection on `d[parent]' and store it in `d[child]'
+ */
 
 static void
 add_new_tcp (krb5_context context,
@@ -549,6 +1416,18 @@ add_new_tcp (krb5_context context,
 {
     krb5_socket_t s;
 
+    if (tcp_at_limit()) {
+	/* Shed the connection without taking a descriptor slot for it */
+	s = accept(d[parent].s, NULL, NULL);
+	if (!rk_IS_BAD_SOCKET(s)) {
+	    kdc_log(context, config, 4,
+		    "Too many TCP connections, closing new one");
+	    krb5_kdc_metrics_shed("connections");
+	    rk_closesocket(s);
+	}
+	return;
+    }
+
     if (child == -1)
 	return;
 
@@ -559,25 +1438,29 @@ add_new_tcp (krb5_context context,
 	    krb5_warn(context, rk_SOCK_ERRNO, "accept");
 	return;
     }
+    addr_to_string (context,
+		    d[child].sa, d[child].sock_len,
+		    d[child].addr_string, sizeof(d[child].addr_string));
 
-#ifdef FD_SETSIZE
-    if (s >= FD_SETSIZE) {
-	krb5_warnx(context, "socket FD too large");
+    if (!tcp_admit(context, config, &d[child])) {
+	rk_closesocket (s);
+	return;
+    }
+    if (events_add(context, s, child)) {
+	tcp_release(&d[child]);
 	rk_closesocket (s);
 	return;
     }
-#endif
 
     d[child].s = s;
     d[child].timeout = time(NULL) + TCP_TIMEOUT;
     d[child].type = SOCK_STREAM;
-    addr_to_string (context,
-		    d[child].sa, d[child].sock_len,
-		    d[child].addr_string, sizeof(d[child].addr_string));
+    d[child].metrics = d[parent].metrics;
 }
 
 /*
- * Grow `d' to handle at least `n'.
+ * Grow `d' to handle at least `n' more bytes, moving to a buffer of a
+ * larger class if need be.
  * Return != 0 if fails
  */
 
@@ -588,31 +1471,36 @@ grow_descr (krb5_context context,
 {
     if (d->size - d->len < n) {
 	unsigned char *tmp;
-	size_t grow;
+	size_t size;
 
-	grow = max(1024, d->len + n);
-	if (d->size + grow > max_request_tcp) {
+	if (d->len + n > max_request_tcp) {
 	    kdc_log(context, config, 2, "Request exceeds max request size (%lu bytes).",
-		    (unsigned long)d->size + grow);
+		    (unsigned long)(d->len + n));
 	    clear_descr(d);
 	    return -1;
 	}
-	tmp = realloc (d->buf, d->size + grow);
+	tmp = tcp_buf_get(d->len + n, &size);
 	if (tmp == NULL) {
-	    kdc_log(context, config, 1, "Failed to re-allocate %lu bytes.",
-		    (unsigned long)d->size + grow);
+	    kdc_log(context, config, 1, "Failed to allocate %lu bytes.",
+		    (unsigned long)(d->len + n));
 	    clear_descr(d);
 	    return -1;
 	}
-	d->size += grow;
+	if (d->buf) {
+	    memcpy(tmp, d->buf, d->len);
+	    tcp_buf_put(d->buf, d->size, d->used);
+	}
 	d->buf = tmp;
+	d->size = size;
+	d->used = d->len;
     }
     return 0;
 }
 
 /*
  * Try to handle the TCP data at `d->buf, d->len'.
- * Return -1 if failed, 0 if succesful, and 1 if data is complete.
+ * Return -1 if failed, 0 if more data is needed, and 1 if a complete
+ * request is at `d->buf + 4' (of length `d->reqlen').
  */
 
 static int
@@ -631,8 +1519,7 @@ handle_vanilla_tcp (krb5_context context,
     krb5_ret_uint32(sp, &len);
     krb5_storage_free(sp);
     if(d->len - 4 >= len) {
-	memmove(d->buf, d->buf + 4, d->len - 4);
-	d->len -= 4;
+	d->reqlen = len;
 	return 1;
     }
     return 0;
@@ -784,6 +1671,182 @@ http1_request_is_complete(const unsigned char *req, size_t len)
      */
 }
 
+/*
+ * Answer any HTTP request on a metrics socket with the current metrics.
+ * Return -1 if failed, 0 if more data is needed and 2 when done.
+ */
+
+static int
+handle_metrics_tcp(krb5_context context,
+		   krb5_kdc_configuration *config,
+		   struct descr *d)
+{
+    krb5_data metrics;
+    char *hdr = NULL;
+    int hdr_len;
+    size_t i;
+    krb5_error_code ret;
+
+    if (!http1_request_is_complete(d->buf, d->len)) {
+	if (!http1_request_taste(d->buf, d->len) && d->len > 4) {
+	    kdc_log(context, config, 2, "Non-HTTP metrics request from %s",
+		    d->addr_string);
+	    return -1;
+	}
+	return 0;
+    }
+
+    ret = krb5_kdc_metrics_format(context, &metrics);
+    if (ret) {
+	kdc_log(context, config, 1, "Failed to format metrics: %d", ret);
+	return -1;
+    }
+    hdr_len = asprintf(&hdr,
+		       "HTTP/1.0 200 OK\r\n"
+		       "Server: Heimdal/" VERSION "\r\n"
+		       "Cache-Control: no-cache\r\n"
+		       "Content-type: text/plain; version=0.0.4\r\n"
+		       "Content-length: %lu\r\n\r\n",
+		       (unsigned long)metrics.length);
+    if (hdr_len < 0 || hdr == NULL) {
+	krb5_data_free(&metrics);
+	return -1;
+    }
+    if (rk_IS_SOCKET_ERROR(send(d->s, hdr, hdr_len, 0))) {
+	kdc_log(context, config, 1, "HTTP write failed: %s: %s",
+		d->addr_string, strerror(rk_SOCK_ERRNO));
+	ret = -1;
+    }
+    if (memcmp(d->buf, "HEAD ", sizeof("HEAD ") - 1) == 0)
+	metrics.length = 0;
+    for (i = 0; ret == 0 && i < metrics.length; ) {
+	ssize_t n;
+
+	n = send(d->s, (char *)metrics.data + i, metrics.length - i, 0);
+	if (rk_IS_SOCKET_ERROR(n)) {
+	    kdc_log(context, config, 1, "HTTP write failed: %s: %s",
+		    d->addr_string, strerror(rk_SOCK_ERRNO));
+	    ret = -1;
+	} else {
+	    i += n;
+	}
+    }
+    free(hdr);
+    krb5_data_free(&metrics);
+    return ret ? -1 : 2;
+}
+
+/*
+ * Done with the request at the head of the TCP connection `d': drop it
+ * from the buffer, and close the connection if it has served its
+ * quota or was not a Kerberos one.
+ */
+
+static void
+tcp_request_done(struct descr *d)
+{
+    size_t used = 4 + d->reqlen;
+
+    if (d->oneshot || rk_IS_BAD_SOCKET(d->s) ||
+	++d->nreqs >= max_tcp_requests || used > d->len) {
+	clear_descr(d);
+	return;
+    }
+    memmove(d->buf, d->buf + used, d->len - used);
+    d->len -= used;
+    d->reqlen = 0;
+    d->timeout = time(NULL) + TCP_TIMEOUT;
+}
+
+/*
+ * Process what has been received on the TCP connection `d[idx]'.
+ *
+ * Kerberos requests are answered in order and the connection is kept
+ * open afterwards, so that a client can send several requests without
+ * setting up a new connection for each; a request that is already
+ * buffered behind the one just answered is processed right away.  HTTP
+ * and anything else get one answer, then the connection is closed.
+ */
+
+static void
+tcp_dispatch(krb5_context context,
+	     krb5_kdc_configuration *config,
+	     struct descr *d, int idx)
+{
+    int ret = 0;
+
+    while (!rk_IS_BAD_SOCKET(d[idx].s) && !d[idx].busy && d[idx].len > 0) {
+	if (d[idx].metrics) {
+	    ret = handle_metrics_tcp(context, config, &d[idx]);
+	    break;
+	}
+	if(d[idx].len > 4 && d[idx].buf[0] == 0) {
+	    ret = handle_vanilla_tcp (context, config, &d[idx]);
+	    if (ret != 1)
+		break;
+	    ret = do_request(context, config, d[idx].buf + 4, d[idx].reqlen,
+			     TRUE, &d[idx], idx);
+	    if (ret < 0)
+		break;
+	    if (ret == 0)
+		tcp_request_done(&d[idx]);
+	    ret = 0;
+	    continue;
+	}
+	if (enable_http &&
+	    http1_request_taste(d[idx].buf, d[idx].len)) {
+
+	    if (http1_request_is_complete(d[idx].buf, d[idx].len)) {
+		/* NUL-terminate at the request header ending \r\n\r\n */
+		d[idx].buf[d[idx].len - 4] = '\0';
+		ret = handle_http_tcp (context, config, &d[idx]);
+	    }
+	    if (ret == 1) {
+		d[idx].oneshot = 1;
+		if (do_request(context, config, d[idx].buf, d[idx].len,
+			       TRUE, &d[idx], idx) == 1)
+		    ret = 0;	/* closed when the pool is done with it */
+	    }
+	    break;
+	}
+	if (d[idx].len > 4) {
+	    kdc_log (context, config,
+		     2, "TCP data of strange type from %s to %s/%d",
+		     d[idx].addr_string, descr_type(d + idx),
+		     ntohs(d[idx].port));
+	    if (d[idx].buf[0] & 0x80) {
+		krb5_data reply;
+
+		kdc_log (context, config, 2, "TCP extension not supported");
+
+		ret = krb5_mk_error(context,
+				    KRB5KRB_ERR_FIELD_TOOLONG,
+				    NULL,
+				    NULL,
+				    NULL,
+				    NULL,
+				    NULL,
+				    NULL,
+				    &reply);
+		if (ret == 0) {
+		    send_reply(context, config, TRUE, d + idx, &reply);
+		    krb5_data_free(&reply);
+		}
+	    }
+	    ret = -1;
+	}
+	break;
+    }
+
+    /*
+     * ret == 0 -> not enough of request buffered -> wait for more
+     * ret != 0 -> error (probably ENOMEM), or a one-shot request that
+     *             has been answered: close the connection
+     */
+    if (ret != 0)
+	clear_descr(d + idx);
+}
+
 /*
  * Handle incoming data to the TCP socket in `d[index]'
  */
@@ -793,88 +1856,94 @@ handle_tcp(krb5_context context,
 	   krb5_kdc_configuration *config,
 	   struct descr *d, int idx, int min_free)
 {
-    unsigned char buf[1024];
-    int n;
-    int ret = 0;
+    size_t want = TCP_READ_CHUNK;
+    ssize_t n;
 
     if (d[idx].timeout == 0) {
 	add_new_tcp (context, config, d, idx, min_free);
 	return;
     }
 
-    n = recvfrom(d[idx].s, buf, sizeof(buf), 0, NULL, NULL);
+    /*
+     * Once the length of a Kerberos request is known make room for all
+     * of it, so that it is received straight into place.
+     */
+    if (d[idx].len >= 4 && d[idx].buf[0] == 0) {
+	size_t framelen = 4 + (((size_t)d[idx].buf[1] << 16) |
+			       ((size_t)d[idx].buf[2] << 8) | d[idx].buf[3]);
+
+	if (framelen > d[idx].len)
+	    want = framelen - d[idx].len;
+    }
+    if (d[idx].len + want > max_request_tcp && d[idx].len < max_request_tcp)
+	want = max_request_tcp - d[idx].len;
+    if (grow_descr (context, config, &d[idx], want))
+	return;
+
+    n = recv(d[idx].s, d[idx].buf + d[idx].len, d[idx].size - d[idx].len, 0);
     if(rk_IS_SOCKET_ERROR(n)){
 	krb5_warn(context, rk_SOCK_ERRNO, "recvfrom failed from %s to %s/%d",
 		  d[idx].addr_string, descr_type(d + idx),
 		  ntohs(d[idx].port));
 	return;
     } else if (n == 0) {
-	krb5_warnx(context, "connection closed before end of data after %lu "
-		   "bytes from %s to %s/%d", (unsigned long)d[idx].len,
-		   d[idx].addr_string, descr_type(d + idx),
-		   ntohs(d[idx].port));
+	/* A client closing between requests is the normal end */
+	if (d[idx].len > 0 || d[idx].nreqs == 0)
+	    krb5_warnx(context, "connection closed before end of data after "
+		       "%lu bytes from %s to %s/%d", (unsigned long)d[idx].len,
+		       d[idx].addr_string, descr_type(d + idx),
+		       ntohs(d[idx].port));
 	clear_descr (d + idx);
 	return;
     }
-    if (grow_descr (context, config, &d[idx], n))
-	return;
-    memcpy(d[idx].buf + d[idx].len, buf, n);
     d[idx].len += n;
-    if(d[idx].len > 4 && d[idx].buf[0] == 0) {
-	ret = handle_vanilla_tcp (context, config, &d[idx]);
-    } else if (enable_http &&
-               http1_request_taste(d[idx].buf, d[idx].len)) {
-
-        if (http1_request_is_complete(d[idx].buf, d[idx].len)) {
-            /* NUL-terminate at the request header ending \r\n\r\n */
-            d[idx].buf[d[idx].len - 4] = '\0';
-            ret = handle_http_tcp (context, config, &d[idx]);
-        }
-    } else if (d[idx].len > 4) {
-	kdc_log (context, config,
-		 2, "TCP data of strange type from %s to %s/%d",
-		 d[idx].addr_string, descr_type(d + idx),
-		 ntohs(d[idx].port));
-	if (d[idx].buf[0] & 0x80) {
-	    krb5_data reply;
-
-	    kdc_log (context, config, 2, "TCP extension not supported");
-
-	    ret = krb5_mk_error(context,
-				KRB5KRB_ERR_FIELD_TOOLONG,
-				NULL,
-				NULL,
-				NULL,
-				NULL,
-				NULL,
-				NULL,
-				&reply);
-	    if (ret == 0) {
-		send_reply(context, config, TRUE, d + idx, &reply);
-		krb5_data_free(&reply);
-	    }
-	}
-	clear_descr(d + idx);
-	return;
-    }
+    if (d[idx].used < d[idx].len)
+	d[idx].used = d[idx].len;
+    tcp_dispatch(context, config, d, idx);
+}
 
-    /*
-     * ret == 0 -> not enough of request buffered -> wait for more
-     * ret == 1 -> go ahead and perform the request
-     * ret != 0 (really, < 0) -> error, probably ENOMEM, close connection
-     */
-    if (ret == 1)
-	do_request(context, config,
-		   d[idx].buf, d[idx].len, TRUE, &d[idx]);
+#ifdef KDC_THREADS
 
-    /*
-     * Note: this means we don't keep the connection open even where we
-     * the protocol permits it.
-     */
-    if (ret != 0)
-	clear_descr(d + idx);
+/*
+ * Take back the TCP connections whose requests the pool has answered
+ * and carry on reading them.
+ */
+
+static void
+pool_reap(krb5_context context,
+	  krb5_kdc_configuration *config,
+	  struct descr *d, unsigned int ndescr)
+{
+    struct kdc_job *job, *next;
+    char buf[64];
+
+    while (read(pool.wake[0], buf, sizeof(buf)) > 0)
+	;
+
+    pthread_mutex_lock(&pool.lock);
+    job = pool.done;
+    pool.done = NULL;
+    pthread_mutex_unlock(&pool.lock);
+
+    for (; job != NULL; job = next) {
+	int idx = job->idx;
+
+	next = job->next;
+	free(job);
+	if (idx < 0 || (unsigned int)idx >= ndescr || !d[idx].busy)
+	    continue;
+	d[idx].busy = 0;
+	if (events_add(context, d[idx].s, idx)) {
+	    clear_descr(&d[idx]);
+	    continue;
+	}
+	tcp_request_done(&d[idx]);
+	tcp_dispatch(context, config, d, idx);
+    }
 }
 
+#endif
+
 #ifdef HAVE_FORK
 static void
 handle_islive(int fd)
@@ -936,69 +2005,154 @@ loop(krb5_context context, krb5_kdc_configuration *config,
 {
     struct descr *d = *dp;
     unsigned int ndescr = *ndescrp;
+    time_t next_expire = 0;
+    time_t drain_until = 0;
+    size_t i;
+
+    events_init(context, config);
+#ifdef KDC_THREADS
+    pool_start(context, config);
+    if (pool.nthreads > 0 && events_add(context, pool.wake[0], EV_POOL))
+	krb5_errx(context, 1, "failed to watch the thread pool");
+    if (pool.nthreads == 0)
+#endif
+	krb5_kdc_prewarm(context, config);
+    if (islive > -1 && events_add(context, islive, EV_ISLIVE))
+	krb5_errx(context, 1, "failed to watch the KDC master socket");
+    for (i = 0; i < ndescr; i++)
+	if (!rk_IS_BAD_SOCKET(d[i].s) && events_add(context, d[i].s, i))
+	    clear_descr(&d[i]);
 
     while (exit_flag == 0) {
-	struct timeval tmout;
-	fd_set fds;
-	int min_free = -1;
-	int max_fd = 0;
-	size_t i;
-
-	FD_ZERO(&fds);
-        if (islive > -1) {
-            FD_SET(islive, &fds);
-            max_fd = islive;
-        }
-	for (i = 0; i < ndescr; i++) {
-	    if (!rk_IS_BAD_SOCKET(d[i].s)) {
-		if (d[i].type == SOCK_STREAM &&
-		   d[i].timeout && d[i].timeout < time(NULL)) {
-		    kdc_log(context, config, 2,
-			    "TCP-connection from %s expired after %lu bytes",
-			    d[i].addr_string, (unsigned long)d[i].len);
-		    clear_descr(&d[i]);
+	int ready[EV_MAX_READY];
+	time_t now = time(NULL);
+	int n, k;
+
+	if (hot_keys_flag) {
+	    hot_keys_flag = 0;
+	    krb5_kdc_hot_keys_log(context, config);
+	    krb5_kdc_memory_log(context, config);
+	}
+
+#ifdef HAVE_FORK
+	/*
+	 * On SIGHUP from the master a new generation of workers, with the
+	 * new configuration, takes over the listeners.  Stop accepting,
+	 * and finish what we have: queued and running requests, and the
+	 * TCP connections, which are closed as soon as they are idle.
+	 */
+	if (reload_flag) {
+	    reload_flag = 0;
+	    if (islive == -1) {
+		kdc_log(context, config, 0,
+			"Reloading the configuration needs worker processes; "
+			"restart the KDC instead");
+	    } else if (drain_until == 0) {
+		for (i = 0; i < ndescr; i++)
+		    if (!rk_IS_BAD_SOCKET(d[i].s) &&
+			(d[i].type == SOCK_DGRAM || d[i].timeout == 0))
+			clear_descr(&d[i]);
+		drain_until = now + DRAIN_TIMEOUT;
+		kdc_log(context, config, 3, "KDC worker %d draining",
+			(int)getpid());
+	    }
+	}
+	if (drain_until) {
+	    int open = 0;
+
+	    for (i = 0; i < ndescr; i++) {
+		if (rk_IS_BAD_SOCKET(d[i].s))
 		    continue;
-		}
-#ifndef NO_LIMIT_FD_SETSIZE
-		if (max_fd < d[i].s)
-		    max_fd = d[i].s;
-#ifdef FD_SETSIZE
-		if (max_fd >= FD_SETSIZE)
-		    krb5_errx(context, 1, "fd too large");
-#endif
+		if (!d[i].busy && d[i].len == 0)
+		    clear_descr(&d[i]);
+		else
+		    open++;
+	    }
+	    if (open == 0 || now >= drain_until) {
+		exit_flag = SIGHUP;
+		break;
+	    }
+	}
 #endif
-		FD_SET(d[i].s, &fds);
+
+	/* Expire idle TCP connections at most once a second */
+	if (now >= next_expire) {
+	    for (i = 0; i < ndescr; i++) {
+		if (!rk_IS_BAD_SOCKET(d[i].s) && d[i].type == SOCK_STREAM &&
+		    d[i].timeout && d[i].timeout < now && !d[i].busy) {
+		    if (d[i].len == 0 && d[i].nreqs > 0)
+			kdc_log(context, config, 4,
+				"Idle TCP-connection from %s closed after "
+				"%u requests", d[i].addr_string, d[i].nreqs);
+		    else
+			kdc_log(context, config, 2,
+				"TCP-connection from %s expired after %lu bytes",
+				d[i].addr_string, (unsigned long)d[i].len);
+		    clear_descr(&d[i]);
+		}
 	    }
+	    next_expire = now + 1;
 	}
 
-	tmout.tv_sec = TCP_TIMEOUT;
-	tmout.tv_usec = 0;
-	switch(select(max_fd + 1, &fds, 0, 0, &tmout)){
-	case 0:
-	    break;
-	case -1:
-	    if (errno != EINTR)
-		krb5_warn(context, rk_SOCK_ERRNO, "select");
-	    break;
-	default:
+#ifdef PKINIT
+	/*
+	 * Refill the PKINIT ephemeral key pools one key at a time, and
+	 * only when no socket is ready.
+	 */
+	if (config->enable_pkinit && _kdc_pk_key_pool_wanted()) {
+	    n = events_wait(ready, EV_MAX_READY, 0);
+	    if (n == 0) {
+		_kdc_pk_key_pool_fill(context);
+		continue;
+	    }
+	} else
+#endif
+	n = events_wait(ready, EV_MAX_READY, drain_until ? 1 : TCP_TIMEOUT);
+	if (n < 0) {
+	    if (rk_SOCK_ERRNO != EINTR)
+		krb5_warn(context, rk_SOCK_ERRNO, "waiting for socket events");
+	    continue;
+	}
+
+	for (k = 0; k < n; k++) {
+	    int idx = ready[k];
+
+	    if (idx == EV_ISLIVE) {
 #ifdef HAVE_FORK
-	    if (islive > -1 && FD_ISSET(islive, &fds))
 		handle_islive(islive);
 #endif
-	    for (i = 0; i < ndescr; i++)
-		if (!rk_IS_BAD_SOCKET(d[i].s) && FD_ISSET(d[i].s, &fds)) {
-		    min_free = next_min_free(context, dp, ndescrp);
-                    ndescr = *ndescrp;
-                    d = *dp;
+		continue;
+	    }
+#ifdef KDC_THREADS
+	    if (idx == EV_POOL) {
+		pool_reap(context, config, d, ndescr);
+		continue;
+	    }
+#endif
+	    if (idx < 0 || (unsigned int)idx >= ndescr ||
+		rk_IS_BAD_SOCKET(d[idx].s))
+		continue;
+
+	    if (d[idx].type == SOCK_DGRAM) {
+		handle_udp(context, config, &d[idx]);
+	    } else if (d[idx].type == SOCK_STREAM) {
+		int min_free = -1;
 
-		    if (d[i].type == SOCK_DGRAM)
-			handle_udp(context, config, &d[i]);
-		    else if (d[i].type == SOCK_STREAM)
-			handle_tcp(context, config, d, i, min_free);
+		/* Only listeners need a free slot, to accept into */
+		if (d[idx].timeout == 0 && !tcp_at_limit()) {
+		    min_free = next_min_free(context, dp, ndescrp);
+		    ndescr = *ndescrp;
+		    d = *dp;
 		}
+		handle_tcp(context, config, d, idx, min_free);
+	    }
 	}
     }
 
+#ifdef KDC_THREADS
+    pool_stop(context);
+#endif
+
     switch (exit_flag) {
     case -1:
 	kdc_log(context, config, 0,
@@ -1013,6 +2167,12 @@ loop(krb5_context context, krb5_kdc_configuration *config,
     case SIGTERM:
 	kdc_log(context, config, 0, "Terminated");
 	break;
+#ifdef HAVE_FORK
+    case SIGHUP:
+	kdc_log(context, config, 3,
+		"KDC worker process exiting after reload");
+	break;
+#endif
     default:
 	kdc_log(context, config, 0, "Unexpected exit reason: %d", exit_flag);
 	break;
@@ -1054,14 +2214,20 @@ kill_kids(pid_t *pids, int max_kids, int sig)
 
     for (i=0; i < max_kids; i++)
 	if (pids[i] > 0)
-	    kill(sig, pids[i]);
+	    kill(pids[i], sig);
     if (bonjour_pid > 0)
-        kill(sig, bonjour_pid);
+        kill(bonjour_pid, sig);
 }
 
+/*
+ * pids[0..max_kids-1] are the current workers, and the rest of the
+ * npids slots the workers of older generations still draining after a
+ * reload.  Returns 1 when it reaped a current worker, 0 for any other
+ * process, and -1 when there was none to reap.
+ */
 static int
 reap_kid(krb5_context context, krb5_kdc_configuration *config,
-	 pid_t *pids, int max_kids, int options)
+	 pid_t *pids, int max_kids, int npids, int options)
 {
     pid_t pid;
     char *what;
@@ -1073,22 +2239,26 @@ reap_kid(krb5_context context, krb5_kdc_configuration *config,
 
     pid = waitpid(-1, &status, options);
     if (pid <= 0)
-	return 0;
+	return -1;
 
     if (pid == bonjour_pid) {
         bonjour_pid = (pid_t)-1;
         what = "bonjour";
     } else {
-        for (i=0; i < max_kids; i++) {
+        for (i=0; i < npids; i++) {
             if (pids[i] == pid) {
                 pids[i] = (pid_t)-1;
-                what = "worker";
-                ret = 1;
+                if (i < max_kids) {
+                    what = "worker";
+                    ret = 1;
+                } else {
+                    what = "draining worker";
+                }
                 break;
             }
         }
 
-        if (i == max_kids) {
+        if (i == npids) {
             /* should not happen */
             what = "untracked";
             sev = "warning: ";
@@ -1114,19 +2284,57 @@ reap_kid(krb5_context context, krb5_kdc_configuration *config,
 
 static int
 reap_kids(krb5_context context, krb5_kdc_configuration *config,
-	  pid_t *pids, int max_kids)
+	  pid_t *pids, int max_kids, int npids)
 {
     int reaped = 0;
+    int ret;
 
-    for (;;) {
-	if (reap_kid(context, config, pids, max_kids, WNOHANG) == 0)
-	    break;
-	reaped++;
-    }
+    while ((ret = reap_kid(context, config, pids, max_kids, npids,
+			   WNOHANG)) >= 0)
+	reaped += ret;
 
     return reaped;
 }
 
+/*
+ * Hand the current workers over to draining (see loop()), moving them
+ * past max_kids in *pidsp, so that the master forks a new generation.
+ */
+static void
+drain_kids(krb5_context context, krb5_kdc_configuration *config,
+	   pid_t **pidsp, int max_kids, int *npidsp)
+{
+    pid_t *pids = *pidsp;
+    int i, j = max_kids;
+
+    for (i = 0; i < max_kids; i++) {
+	if (pids[i] <= 0)
+	    continue;
+	while (j < *npidsp && pids[j] > 0)
+	    j++;
+	if (j == *npidsp) {
+	    pid_t *tmp = realloc(pids, (*npidsp + max_kids) * sizeof(*pids));
+
+	    if (tmp == NULL) {
+		/* Can't track it; it will be reaped as untracked */
+		kill(pids[i], SIGHUP);
+		pids[i] = (pid_t)-1;
+		continue;
+	    }
+	    pids = *pidsp = tmp;
+	    for (j = *npidsp; j < *npidsp + max_kids; j++)
+		pids[j] = (pid_t)-1;
+	    j = *npidsp;
+	    *npidsp += max_kids;
+	}
+	kill(pids[i], SIGHUP);
+	pids[j] = pids[i];
+	pids[i] = (pid_t)-1;
+	kdc_log(context, config, 3, "KDC worker process draining: %d",
+		(int)pids[j]);
+    }
+}
+
 static void
 select_sleep(int microseconds)
 {
@@ -1138,6 +2346,131 @@ select_sleep(int microseconds)
 }
 #endif
 
+#ifdef KDC_AFFINITY
+
+/*
+ * Worker placement (cpu-affinity).
+ *
+ * Worker process slot n is placed on the n-th of the CPUs the KDC was
+ * started on: pinned to that CPU with "cpu", or to all of its NUMA
+ * node's CPUs with "node", which leaves the worker's threads room to
+ * spread out.  A worker that is restarted reuses its slot, and so its
+ * CPU.  With reuse-port the worker's sockets are also tagged with
+ * SO_INCOMING_CPU so that the kernel hands it the traffic that arrives
+ * on its CPU.
+ */
+
+static cpu_set_t master_cpus;
+
+static int
+kdc_cpus_init(void)
+{
+    CPU_ZERO(&master_cpus);
+    if (sched_getaffinity(0, sizeof(master_cpus), &master_cpus) != 0)
+	return 0;
+    return CPU_COUNT(&master_cpus);
+}
+
+static int
+nth_cpu(int n)
+{
+    int count = CPU_COUNT(&master_cpus);
+    int cpu;
+
+    if (count == 0)
+	return -1;
+    n %= count;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	if (CPU_ISSET(cpu, &master_cpus) && n-- == 0)
+	    return cpu;
+    return -1;
+}
+
+/*
+ * Find the NUMA node of `cpu' and add its CPUs to `set' (Linux sysfs).
+ * Returns the node, or -1 if it is not known.
+ */
+static int
+node_cpus(int cpu, cpu_set_t *set)
+{
+    char path[64], buf[1024], *p, *end;
+    struct dirent *de;
+    DIR *dir;
+    FILE *f;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    if ((dir = opendir(path)) == NULL)
+	return -1;
+    while ((de = readdir(dir)) != NULL) {
+	if (strncmp(de->d_name, "node", 4) == 0 &&
+	    isdigit((unsigned char)de->d_name[4])) {
+	    node = atoi(de->d_name + 4);
+	    break;
+	}
+    }
+    closedir(dir);
+    if (node < 0)
+	return -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+	     node);
+    if ((f = fopen(path, "r")) == NULL)
+	return -1;
+    p = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    if (p == NULL)
+	return -1;
+
+    /* A list of ranges: "0-7,16-23" */
+    while (isdigit((unsigned char)*p)) {
+	long lo, hi;
+
+	lo = hi = strtol(p, &end, 10);
+	if (*end == '-')
+	    hi = strtol(end + 1, &end, 10);
+	for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+	    CPU_SET(lo, set);
+	p = end;
+	if (*p == ',')
+	    p++;
+    }
+    return node;
+}
+
+static void
+place_worker(krb5_context context, krb5_kdc_configuration *config, int slot)
+{
+    cpu_set_t set;
+    int cpu, node = -1;
+
+    if (cpu_affinity == KDC_AFFINITY_NONE || (cpu = nth_cpu(slot)) < 0)
+	return;
+
+    CPU_ZERO(&set);
+    if (cpu_affinity == KDC_AFFINITY_NODE &&
+	(node = node_cpus(cpu, &set)) >= 0)
+	CPU_AND(&set, &set, &master_cpus);
+    if (CPU_COUNT(&set) == 0) {
+	node = -1;
+	CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+	kdc_log(context, config, 1, "sched_setaffinity(CPU %d): %s",
+		cpu, strerror(errno));
+	return;
+    }
+    worker_cpu = cpu;
+    if (node >= 0)
+	kdc_log(context, config, 3, "KDC worker process %d placed on "
+		"NUMA node %d", (int)getpid(), node);
+    else
+	kdc_log(context, config, 3, "KDC worker process %d placed on CPU %d",
+		(int)getpid(), cpu);
+}
+
+#endif /* KDC_AFFINITY */
+
 void
 start_kdc(krb5_context context,
 	  krb5_kdc_configuration *config, const char *argv0)
@@ -1151,6 +2484,7 @@ start_kdc(krb5_context context,
     pid_t *pids;
     int max_kdcs = config->num_kdc_processes;
     int num_kdcs = 0;
+    int npids;
     int i;
     int islive[2];
 #endif
@@ -1161,6 +2495,22 @@ start_kdc(krb5_context context,
 #endif
 
 #ifdef HAVE_FORK
+    /* One worker per CPU we may run on, or failing that, online */
+#ifdef KDC_AFFINITY
+    if (kdc_cpus_init() == 0 && cpu_affinity != KDC_AFFINITY_NONE) {
+	kdc_log(context, config, 1,
+		"could not get the CPU set, ignoring cpu-affinity");
+	cpu_affinity = KDC_AFFINITY_NONE;
+    }
+    if (max_kdcs < 1)
+	max_kdcs = CPU_COUNT(&master_cpus);
+#else
+    if (cpu_affinity != KDC_AFFINITY_NONE) {
+	kdc_log(context, config, 1,
+		"cpu-affinity is not supported on this platform, ignoring");
+	cpu_affinity = KDC_AFFINITY_NONE;
+    }
+#endif
 #ifdef _SC_NPROCESSORS_ONLN
     if (max_kdcs < 1)
 	max_kdcs = sysconf(_SC_NPROCESSORS_ONLN);
@@ -1172,6 +2522,7 @@ start_kdc(krb5_context context,
     pids = calloc(max_kdcs, sizeof(*pids));
     if (pids == NULL)
 	krb5_err(context, 1, errno, "malloc");
+    npids = max_kdcs;
 
     /*
      * We open a socketpair of which we hand one end to each of our kids.
@@ -1184,11 +2535,85 @@ start_kdc(krb5_context context,
     socket_set_nonblocking(islive[1], 1);
 #endif
 
+#if !defined(SO_REUSEPORT_LB) && !defined(SO_REUSEPORT)
+    if (reuse_port > 0) {
+	kdc_log(context, config, 1,
+		"reuse-port is not supported on this platform, ignoring");
+	reuse_port = 0;
+    }
+#endif
+#ifdef HAVE_FORK
+    if (testing_flag)
+	reuse_port = 0;
+#else
+    reuse_port = 0;
+#endif
+
+    /* Before forking, so that all workers share the counters */
+    if (metrics_port_str) {
+	krb5_error_code ret = krb5_kdc_metrics_init(context);
+
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_kdc_metrics_init");
+    }
+    {
+	krb5_error_code ret = krb5_kdc_ratelimit_init(context, config);
+
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_kdc_ratelimit_init");
+    }
+    {
+	krb5_error_code ret = krb5_kdc_tgs_replay_init(context, config);
+
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_kdc_tgs_replay_init");
+    }
+    {
+	krb5_error_code ret = krb5_kdc_tgt_cache_init(context, config);
+
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_kdc_tgt_cache_init");
+    }
+    {
+	krb5_error_code ret = krb5_kdc_realm_cache_init(context, config);
+
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_kdc_realm_cache_init");
+    }
+    {
+	krb5_error_code ret = krb5_kdc_hot_keys_init(context, config);
+
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_kdc_hot_keys_init");
+    }
+
     ndescr = init_sockets(context, config, &d);
     if(ndescr <= 0)
 	krb5_errx(context, 1, "No sockets!");
 
 #ifdef HAVE_FORK
+    /*
+     * Check the databases and fill the page cache once, before any
+     * worker exists, so that workers (which warm up their own handles
+     * and caches) start on a warm system.  Workers must not inherit
+     * open database handles.
+     */
+    if (!testing_flag) {
+	krb5_kdc_prewarm(context, config);
+	krb5_kdc_close_dbs(context, config);
+    }
+
+    /*
+     * With reuse-port each worker binds its own sockets after fork(),
+     * and the kernel spreads incoming datagrams and connections across
+     * them.  The master only checks above that the ports can be bound;
+     * it must not keep listening itself, or it would be handed traffic
+     * that nobody reads.
+     */
+    if (reuse_port > 0) {
+	for (i = 0; i < ndescr; ++i)
+	    clear_descr(&d[i]);
+    }
 
 # ifdef __APPLE__
     if (do_bonjour < 0)
@@ -1207,18 +2632,56 @@ start_kdc(krb5_context context,
         /* Note that we might never execute the body of this loop */
         while (exit_flag == 0) {
 
+            if (hot_keys_flag) {
+                hot_keys_flag = 0;
+                krb5_kdc_hot_keys_log(context, config);
+                krb5_kdc_memory_log(context, config);
+            }
+
+            /*
+             * Reload: once the new configuration checks out, start a
+             * new generation of workers with it and let the old one
+             * finish its requests.  The listening sockets stay open
+             * throughout, so nothing is refused in between.
+             */
+            if (reload_flag) {
+                reload_flag = 0;
+                if (reconfigure(context, &config) == 0) {
+                    krb5_kdc_realm_cache_flush(context);
+                    krb5_kdc_prewarm(context, config);
+                    krb5_kdc_close_dbs(context, config);
+                    drain_kids(context, config, &pids, max_kdcs, &npids);
+                    num_kdcs = 0;
+                }
+            }
+
             if (num_kdcs >= max_kdcs) {
-                num_kdcs -= reap_kid(context, config, pids, max_kdcs, 0);
+                if (reap_kid(context, config, pids, max_kdcs, npids, 0) > 0)
+                    num_kdcs--;
                 continue;
             }
 
             if (num_kdcs > 0)
-                num_kdcs -= reap_kids(context, config, pids, max_kdcs);
+                num_kdcs -= reap_kids(context, config, pids, max_kdcs, npids);
+
+            /* The worker's slot in pids[] also picks its CPU */
+            for (i = 0; i < max_kdcs; i++)
+                if (pids[i] <= 0)
+                    break;
 
             pid = fork();
             switch (pid) {
             case 0:
                 close(islive[0]);
+#ifdef KDC_AFFINITY
+                place_worker(context, config, i);
+#endif
+                if (reuse_port > 0) {
+                    free(d);
+                    ndescr = init_sockets(context, config, &d);
+                    if (ndescr <= 0)
+                        krb5_errx(context, 1, "No sockets!");
+                }
                 loop(context, config, &d, &ndescr, islive[1]);
                 exit(0);
             case -1:
@@ -1228,13 +2691,9 @@ start_kdc(krb5_context context,
                 sleep(10);
                 break;
             default:
-		for (i = 0; i < max_kdcs; i++) {
-		    if (pids[i] <= 0) {
-			pids[i] = pid;
-			break;
-		    }
-		}
-                if (i >= max_kdcs) {
+                if (i < max_kdcs) {
+                    pids[i] = pid;
+                } else {
                     /* This should not happen */
                     kdc_log(context, config, 1,
                             "warning: forked untracked child process: %d",
@@ -1258,13 +2717,19 @@ start_kdc(krb5_context context,
         for (i = 0; i < ndescr; ++i)
             clear_descr(&d[i]);
 
+        /* From here on draining workers are waited for like the rest */
+        for (i = max_kdcs; i < npids; i++)
+            if (pids[i] > 0)
+                num_kdcs++;
+        max_kdcs = npids;
+
         gettimeofday(&tv1, NULL);
         tv2 = tv1;
 
         /* Reap every 10ms, terminate stragglers once a second, give up after 10 */
         for (;;) {
             struct timeval tv3;
-            num_kdcs -= reap_kids(context, config, pids, max_kdcs);
+            num_kdcs -= reap_kids(context, config, pids, max_kdcs, npids);
             if (num_kdcs == 0 && bonjour_pid <= 0)
                 goto end;
             /*
@@ -1286,7 +2751,7 @@ start_kdc(krb5_context context,
         /* Kill stragglers and reap every 200ms, give up after 15s */
         for (;;) {
             kill_kids(pids, max_kdcs, SIGKILL);
-            num_kdcs -= reap_kids(context, config, pids, max_kdcs);
+            num_kdcs -= reap_kids(context, config, pids, max_kdcs, npids);
             if (num_kdcs == 0 && bonjour_pid <= 0)
                 break;
             select_sleep(200000);
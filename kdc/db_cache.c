@@ -0,0 +1,481 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A bounded LRU cache of decoded HDB entries with their keys already
+ * unsealed, for the krbtgt and service lookups that dominate TGS
+ * traffic ([kdc] hdb-cache-size).
+ *
+ * Entries are keyed by principal, lookup flags and kvno, and tagged
+ * with the database generation (see misc.c) at the time they were
+ * fetched: a change to any database file makes them stale, as does
+ * reaching hdb-cache-lifetime, which bounds how long changes to
+ * databases that are not files (LDAP) go unseen.  Callers get a copy
+ * that they own, as before.  Evicted entries have their keys wiped.
+ *
+ * A second cache of the same shape ([kdc] hdb-negative-cache-size)
+ * remembers which databases do not have a principal, so that lookups
+ * in configurations with several databases, and retries for bogus
+ * principals, skip the backends known not to have it.  Its entries
+ * carry no HDB entry, and are per database: they are tagged with that
+ * database's own generation, so a change to one database does not
+ * flush what is known about the others.
+ *
+ * A third, small cache holds the encoded ETYPE-INFO2 and ETYPE-INFO
+ * padata sent with PREAUTH_REQUIRED errors and AS-REPs.  These depend
+ * only on the enctype and salt of the client key chosen, so they are
+ * keyed by exactly that: a key change changes what is looked up and
+ * nothing ever needs invalidating.  It is direct-mapped; a colliding
+ * insert replaces the older encoding.
+ *
+ * Each request thread has its own configuration, and so its own caches;
+ * no locking is needed.
+ */
+
+#include "kdc_locl.h"
+
+struct cache_ent {
+    struct cache_ent *chain;		/* hash bucket chain */
+    struct cache_ent *newer, *older;	/* LRU list */
+    uint32_t hash;
+    char *key;
+    int db;				/* index into config->db */
+    uint64_t generation;
+    time_t expires;
+    size_t size;			/* for memory accounting */
+    hdb_entry_ex ent;			/* unused in the negative cache */
+};
+
+struct kdc_entry_cache {
+    size_t max;
+    size_t nbuckets;
+    size_t count;
+    struct cache_ent **buckets;
+    struct cache_ent *newest, *oldest;
+};
+
+static uint32_t
+key_hash(const char *s)
+{
+    uint32_t h = 2166136261U;
+
+    for (; *s; s++)
+	h = (h ^ (unsigned char)*s) * 16777619U;
+    return h;
+}
+
+static void
+lru_unlink(struct kdc_entry_cache *c, struct cache_ent *e)
+{
+    if (e->newer)
+	e->newer->older = e->older;
+    else
+	c->newest = e->older;
+    if (e->older)
+	e->older->newer = e->newer;
+    else
+	c->oldest = e->newer;
+    e->newer = e->older = NULL;
+}
+
+static void
+lru_push(struct kdc_entry_cache *c, struct cache_ent *e)
+{
+    e->older = c->newest;
+    e->newer = NULL;
+    if (c->newest)
+	c->newest->newer = e;
+    c->newest = e;
+    if (c->oldest == NULL)
+	c->oldest = e;
+}
+
+static void
+cache_remove(krb5_context context, struct kdc_entry_cache *c,
+	     struct cache_ent *e)
+{
+    struct cache_ent **ep;
+
+    for (ep = &c->buckets[e->hash % c->nbuckets]; *ep; ep = &(*ep)->chain) {
+	if (*ep == e) {
+	    *ep = e->chain;
+	    break;
+	}
+    }
+    lru_unlink(c, e);
+    c->count--;
+    heim_mem_account(HEIM_MEM_CACHE, -(int64_t)e->size, -1);
+    hdb_free_entry(context, &e->ent);
+    free(e->key);
+    free(e);
+}
+
+static struct kdc_entry_cache *
+cache_create(size_t max)
+{
+    struct kdc_entry_cache *c;
+
+    if ((c = calloc(1, sizeof(*c))) == NULL)
+	return NULL;
+    c->max = max;
+    c->nbuckets = max | 1;
+    c->buckets = calloc(c->nbuckets, sizeof(c->buckets[0]));
+    if (c->buckets == NULL) {
+	free(c);
+	return NULL;
+    }
+    return c;
+}
+
+/* Find `key' for database `db', or for any database if `db' is -1 */
+static struct cache_ent *
+cache_find(struct kdc_entry_cache *c, const char *key, uint32_t hash, int db)
+{
+    struct cache_ent *e;
+
+    for (e = c->buckets[hash % c->nbuckets]; e; e = e->chain)
+	if (e->hash == hash && (db == -1 || e->db == db) &&
+	    strcmp(e->key, key) == 0)
+	    return e;
+    return NULL;
+}
+
+/* Insert `e', replacing any entry for the same key, evicting if full */
+static void
+cache_insert(krb5_context context, struct kdc_entry_cache *c,
+	     struct cache_ent *e, int db)
+{
+    struct cache_ent *old;
+
+    if ((old = cache_find(c, e->key, e->hash, db)) != NULL)
+	cache_remove(context, c, old);
+    while (c->count >= c->max && c->oldest)
+	cache_remove(context, c, c->oldest);
+
+    e->chain = c->buckets[e->hash % c->nbuckets];
+    c->buckets[e->hash % c->nbuckets] = e;
+    lru_push(c, e);
+    c->count++;
+    e->size = sizeof(*e) + strlen(e->key) + 1;
+    if (e->ent.entry.principal)
+	e->size += length_HDB_entry(&e->ent.entry);
+    heim_mem_account(HEIM_MEM_CACHE, e->size, 1);
+}
+
+static void
+cache_free(krb5_context context, struct kdc_entry_cache *c)
+{
+    if (c == NULL)
+	return;
+    while (c->oldest)
+	cache_remove(context, c, c->oldest);
+    free(c->buckets);
+    free(c);
+}
+
+static krb5_error_code
+copy_ent(krb5_context context, const hdb_entry_ex *from, hdb_entry_ex *to)
+{
+    krb5_error_code ret;
+
+    memset(to, 0, sizeof(*to));
+    ret = copy_HDB_entry(&from->entry, &to->entry);
+    if (ret)
+	return krb5_enomem(context);
+    return 0;
+}
+
+/*
+ * Look up `key' in the cache.  On a hit, return 0 with a copy of the
+ * entry in `*h' and the index of the database it came from in `*db'.
+ */
+
+krb5_error_code
+_kdc_db_cache_get(krb5_context context, krb5_kdc_configuration *config,
+		  const char *key, uint64_t generation, int *db,
+		  hdb_entry_ex **h)
+{
+    struct kdc_entry_cache *c = config->entry_cache;
+    struct cache_ent *e;
+    hdb_entry_ex *ent;
+    uint32_t hash;
+
+    if (c == NULL) {
+	_kdc_metrics_db_cache(0);
+	return HDB_ERR_NOENTRY;
+    }
+
+    hash = key_hash(key);
+    e = cache_find(c, key, hash, -1);
+    if (e && (e->generation != generation || e->expires <= kdc_time ||
+	      e->db >= config->num_db)) {
+	cache_remove(context, c, e);
+	e = NULL;
+    }
+    if (e == NULL) {
+	_kdc_metrics_db_cache(0);
+	return HDB_ERR_NOENTRY;
+    }
+
+    if ((ent = malloc(sizeof(*ent))) == NULL)
+	return krb5_enomem(context);
+    if (copy_ent(context, &e->ent, ent) != 0) {
+	free(ent);
+	return krb5_enomem(context);
+    }
+    lru_unlink(c, e);
+    lru_push(c, e);
+    *db = e->db;
+    *h = ent;
+    _kdc_metrics_db_cache(1);
+    return 0;
+}
+
+/*
+ * Add a copy of entry `ent', found under `key' in database `db', to
+ * the cache, evicting the least recently used entry if it is full.
+ * Entries with backend private state are not cached.
+ */
+
+void
+_kdc_db_cache_add(krb5_context context, krb5_kdc_configuration *config,
+		  const char *key, uint64_t generation, int db,
+		  const hdb_entry_ex *ent)
+{
+    struct kdc_entry_cache *c = config->entry_cache;
+    struct cache_ent *e;
+
+    if (config->hdb_cache_size == 0 || ent->ctx || ent->free_entry)
+	return;
+
+    if (c == NULL) {
+	if ((c = cache_create(config->hdb_cache_size)) == NULL)
+	    return;
+	config->entry_cache = c;
+    }
+
+    if ((e = calloc(1, sizeof(*e))) == NULL)
+	return;
+    if ((e->key = strdup(key)) == NULL ||
+	copy_ent(context, ent, &e->ent) != 0) {
+	free(e->key);
+	free(e);
+	return;
+    }
+    e->hash = key_hash(key);
+    e->db = db;
+    e->generation = generation;
+    e->expires = kdc_time + config->hdb_cache_lifetime;
+
+    cache_insert(context, c, e, -1);
+}
+
+/*
+ * Return true if database `db' is known not to have the entry looked
+ * up under `key' as of its generation `generation'.
+ */
+
+int
+_kdc_db_negcache_check(krb5_context context, krb5_kdc_configuration *config,
+		       const char *key, int db, uint64_t generation)
+{
+    struct kdc_entry_cache *c = config->negative_cache;
+    struct cache_ent *e;
+
+    if (c == NULL ||
+	(e = cache_find(c, key, key_hash(key), db)) == NULL)
+	return 0;
+    if (e->generation != generation || e->expires <= kdc_time) {
+	cache_remove(context, c, e);
+	return 0;
+    }
+    lru_unlink(c, e);
+    lru_push(c, e);
+    _kdc_metrics_db_cache(2);
+    return 1;
+}
+
+/*
+ * Remember that database `db', as of generation `generation', does not
+ * have the entry looked up under `key'.
+ */
+
+void
+_kdc_db_negcache_add(krb5_context context, krb5_kdc_configuration *config,
+		     const char *key, int db, uint64_t generation)
+{
+    struct kdc_entry_cache *c = config->negative_cache;
+    struct cache_ent *e;
+
+    if (config->hdb_negative_cache_size == 0)
+	return;
+
+    if (c == NULL) {
+	if ((c = cache_create(config->hdb_negative_cache_size)) == NULL)
+	    return;
+	config->negative_cache = c;
+    }
+
+    if ((e = calloc(1, sizeof(*e))) == NULL)
+	return;
+    if ((e->key = strdup(key)) == NULL) {
+	free(e);
+	return;
+    }
+    e->hash = key_hash(key);
+    e->db = db;
+    e->generation = generation;
+    e->expires = kdc_time + config->hdb_negative_cache_lifetime;
+    cache_insert(context, c, e, db);
+}
+
+#define ETYPE_INFO_CACHE_SIZE	64
+
+struct etype_info_ent {
+    int padata_type;			/* 0 for an empty slot */
+    krb5_enctype etype;
+    int salttype;			/* -1 if the key has no salt */
+    krb5_boolean with_salt;		/* the salt is sent */
+    krb5_data salt;
+    krb5_data value;
+};
+
+struct kdc_etype_info_cache {
+    struct etype_info_ent ent[ETYPE_INFO_CACHE_SIZE];
+};
+
+static struct etype_info_ent *
+etype_info_slot(krb5_kdc_configuration *config, int padata_type,
+		const Key *key, krb5_boolean with_salt, int *salttype)
+{
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    *salttype = key->salt ? (int)key->salt->type : -1;
+    h = (h ^ (uint32_t)padata_type) * 16777619U;
+    h = (h ^ (uint32_t)key->key.keytype) * 16777619U;
+    h = (h ^ (uint32_t)*salttype) * 16777619U;
+    if (with_salt) {
+	const unsigned char *p = key->salt->salt.data;
+
+	for (i = 0; i < key->salt->salt.length; i++)
+	    h = (h ^ p[i]) * 16777619U;
+    }
+    return &config->etype_info_cache->ent[h % ETYPE_INFO_CACHE_SIZE];
+}
+
+/*
+ * Look up the encoded `padata_type' (ETYPE-INFO2 or ETYPE-INFO) for
+ * client key `key'.  On a hit, return 1 with a copy in `value'.
+ */
+
+int
+_kdc_etype_info_cache_get(krb5_kdc_configuration *config, int padata_type,
+			  const Key *key, krb5_boolean include_salt,
+			  krb5_data *value)
+{
+    krb5_boolean with_salt = key->salt && include_salt;
+    struct etype_info_ent *e;
+    int salttype;
+
+    if (config->etype_info_cache == NULL)
+	return 0;
+
+    e = etype_info_slot(config, padata_type, key, with_salt, &salttype);
+    if (e->padata_type != padata_type || e->etype != key->key.keytype ||
+	e->salttype != salttype || e->with_salt != with_salt ||
+	(with_salt && krb5_data_cmp(&e->salt, &key->salt->salt) != 0))
+	return 0;
+    return krb5_data_copy(value, e->value.data, e->value.length) == 0;
+}
+
+/*
+ * Remember the encoding `buf'/`len' of `padata_type' for client key
+ * `key'.
+ */
+
+void
+_kdc_etype_info_cache_add(krb5_kdc_configuration *config, int padata_type,
+			  const Key *key, krb5_boolean include_salt,
+			  const void *buf, size_t len)
+{
+    krb5_boolean with_salt = key->salt && include_salt;
+    struct etype_info_ent *e;
+    int salttype;
+
+    if (config->etype_info_cache == NULL &&
+	(config->etype_info_cache =
+	 calloc(1, sizeof(*config->etype_info_cache))) == NULL)
+	return;
+
+    e = etype_info_slot(config, padata_type, key, with_salt, &salttype);
+    krb5_data_free(&e->salt);
+    krb5_data_free(&e->value);
+    e->padata_type = 0;
+    if ((with_salt &&
+	 krb5_data_copy(&e->salt, key->salt->salt.data,
+			key->salt->salt.length) != 0) ||
+	krb5_data_copy(&e->value, buf, len) != 0) {
+	krb5_data_free(&e->salt);
+	return;
+    }
+    e->padata_type = padata_type;
+    e->etype = key->key.keytype;
+    e->salttype = salttype;
+    e->with_salt = with_salt;
+}
+
+static void
+etype_info_cache_free(struct kdc_etype_info_cache *c)
+{
+    size_t i;
+
+    if (c == NULL)
+	return;
+    for (i = 0; i < ETYPE_INFO_CACHE_SIZE; i++) {
+	krb5_data_free(&c->ent[i].salt);
+	krb5_data_free(&c->ent[i].value);
+    }
+    free(c);
+}
+
+void
+_kdc_db_cache_free(krb5_context context, krb5_kdc_configuration *config)
+{
+    cache_free(context, config->entry_cache);
+    cache_free(context, config->negative_cache);
+    etype_info_cache_free(config->etype_info_cache);
+    config->entry_cache = NULL;
+    config->negative_cache = NULL;
+    config->etype_info_cache = NULL;
+}
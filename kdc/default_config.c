@@ -112,6 +112,8 @@ krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
     c->synthetic_clients_max_life = 300;
     c->synthetic_clients_max_renew = 300;
     c->pkinit_dh_min_bits = 1024;
+    c->pkinit_key_pool_size = 8;
+    c->pkinit_verify_cache_lifetime = 300;
     c->db = NULL;
     c->num_db = 0;
     c->logf = NULL;
@@ -249,6 +251,78 @@ krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
 				     "kdc",
 				     "encode_as_rep_as_tgs_rep", NULL);
 
+    c->audit_stage_timing =
+	krb5_config_get_bool_default(context, NULL,
+				     FALSE,
+				     "kdc",
+				     "audit-stage-timing", NULL);
+
+    c->hdb_keep_open =
+	krb5_config_get_bool_default(context, NULL, FALSE, "kdc",
+				     "hdb-keep-open", NULL);
+    c->hdb_cache_size =
+	krb5_config_get_int_default(context, NULL, 0, "kdc",
+				    "hdb-cache-size", NULL);
+    c->hdb_cache_lifetime =
+	krb5_config_get_time_default(context, NULL, 60, "kdc",
+				     "hdb-cache-lifetime", NULL);
+    c->hdb_negative_cache_size =
+	krb5_config_get_int_default(context, NULL, 0, "kdc",
+				    "hdb-negative-cache-size", NULL);
+    c->hdb_negative_cache_lifetime =
+	krb5_config_get_time_default(context, NULL, 30, "kdc",
+				     "hdb-negative-cache-lifetime", NULL);
+    c->hdb_prewarm =
+	krb5_config_get_bool_default(context, NULL, FALSE, "kdc",
+				     "hdb-prewarm", NULL);
+    c->hdb_prewarm_principals =
+	krb5_config_get_strings(context, NULL, "kdc",
+				"hdb-prewarm-principals", NULL);
+
+    c->preauth_failure_burst =
+	krb5_config_get_int_default(context, NULL, 0, "kdc",
+				    "preauth-failure-burst", NULL);
+    c->preauth_failure_address_burst =
+	krb5_config_get_int_default(context, NULL, 0, "kdc",
+				    "preauth-failure-address-burst", NULL);
+    c->preauth_failure_rate =
+	krb5_config_get_int_default(context, NULL, 1, "kdc",
+				    "preauth-failure-rate", NULL);
+    if (c->preauth_failure_burst > 1000000)
+	c->preauth_failure_burst = 1000000;
+    if (c->preauth_failure_address_burst > 1000000)
+	c->preauth_failure_address_burst = 1000000;
+    if (c->preauth_failure_rate > 1000000)
+	c->preauth_failure_rate = 1000000;
+
+    c->tgs_replay_cache_size =
+	krb5_config_get_int_default(context, NULL, 0, "kdc",
+				    "tgs-replay-cache-size", NULL);
+    if (c->tgs_replay_cache_size > 64 * 1024 * 1024)
+	c->tgs_replay_cache_size = 64 * 1024 * 1024;
+
+    c->tgs_ticket_cache_size =
+	krb5_config_get_int_default(context, NULL, 0, "kdc",
+				    "tgs-ticket-cache-size", NULL);
+    if (c->tgs_ticket_cache_size > 256 * 1024)
+	c->tgs_ticket_cache_size = 256 * 1024;
+
+    c->realm_cache_size =
+	krb5_config_get_int_default(context, NULL, 0, "kdc",
+				    "realm-cache-size", NULL);
+    if (c->realm_cache_size > 1024 * 1024)
+	c->realm_cache_size = 1024 * 1024;
+    c->realm_cache_ttl =
+	krb5_config_get_time_default(context, NULL, 300, "kdc",
+				     "realm-cache-ttl", NULL);
+
+    c->hot_keys =
+	krb5_config_get_int_default(context, NULL, 0, "kdc",
+				    "hot-keys", NULL);
+    c->hot_keys_half_life =
+	krb5_config_get_time_default(context, NULL, 3600, "kdc",
+				     "hot-keys-half-life", NULL);
+
     c->kdc_warn_pwexpire =
 	krb5_config_get_time_default (context, NULL,
 				      c->kdc_warn_pwexpire,
@@ -321,6 +395,17 @@ krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
 	krb5_config_get_int_default(context, NULL,
 				    0,
 				    "kdc", "pkinit_dh_min_bits", NULL);
+    c->pkinit_key_pool_size =
+	krb5_config_get_int_default(context, NULL,
+				    c->pkinit_key_pool_size,
+				    "kdc", "pkinit_key_pool_size", NULL);
+    if (c->pkinit_key_pool_size < 0)
+	c->pkinit_key_pool_size = 0;
+    c->pkinit_verify_cache_lifetime =
+	krb5_config_get_time_default(context, NULL,
+				     c->pkinit_verify_cache_lifetime,
+				     "kdc", "pkinit_verify_cache_lifetime",
+				     NULL);
 
     c->pkinit_max_life_from_cert_extension =
         krb5_config_get_bool_default(context, NULL,
@@ -368,6 +453,12 @@ krb5_kdc_get_config(krb5_context context, krb5_kdc_configuration **config)
 				     "kdc",
 				     "enable_gss_auth_data", NULL);
 
+    c->gss_preauth_context_cache =
+	krb5_config_get_bool_default(context, NULL,
+				     c->gss_preauth_context_cache,
+				     "kdc",
+				     "gss_preauth_context_cache", NULL);
+
     ret = _kdc_gss_get_mechanism_config(context, "kdc",
 					"gss_mechanisms_allowed",
 					&c->gss_mechanisms_allowed);
@@ -35,6 +35,183 @@
 
 #include "kdc_locl.h"
 
+/*
+ * Multi round exchanges (PKINIT, OTP, GSS pre-authentication) pay for
+ * FAST in every round: the cookie key is fetched from the database
+ * and keyed each time, and clients that reuse their armor AP-REQ have
+ * it decrypted and turned into an armor key again.  Both results are
+ * kept in small per-process caches.
+ *
+ * Cookie keys are kept for FAST_COOKIE_KEY_CACHE_TIME seconds, after
+ * which the cookie principal is fetched again to pick up new keys.
+ *
+ * Armor entries are keyed by a digest of the armor AP-REQ and of the
+ * armor server key that decrypts it, and live until the ticket ends
+ * or the authenticator leaves the clock skew, whichever comes first,
+ * which is how long a fresh verification would have accepted it.
+ */
+
+#define FAST_COOKIE_KEY_CACHE_TIME	60
+#define FAST_COOKIE_KEY_CACHE_SIZE	4
+#define FAST_ARMOR_CACHE_SIZE		64
+#define FAST_ARMOR_DIGEST_LEN		32	/* SHA-256 */
+
+struct fast_cookie_key {
+    krb5_enctype enctype;
+    krb5_crypto crypto;
+};
+
+struct fast_armor_entry {
+    unsigned char digest[FAST_ARMOR_DIGEST_LEN];
+    time_t expires;
+    krb5_ticket *ticket;
+    krb5_keyblock armorkey;
+};
+
+static HEIMDAL_MUTEX fast_cache_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct fast_cookie_key fast_cookie_keys[FAST_COOKIE_KEY_CACHE_SIZE];
+static krb5_enctype fast_cookie_preferred = KRB5_ENCTYPE_NULL;
+static time_t fast_cookie_fetched;
+static struct fast_armor_entry fast_armor_cache[FAST_ARMOR_CACHE_SIZE];
+
+/* Called with fast_cache_mutex held */
+static void
+fast_cookie_keys_flush(krb5_context context)
+{
+    size_t i;
+
+    for (i = 0; i < FAST_COOKIE_KEY_CACHE_SIZE; i++) {
+	if (fast_cookie_keys[i].crypto)
+	    krb5_crypto_destroy(context, fast_cookie_keys[i].crypto);
+	fast_cookie_keys[i].crypto = NULL;
+	fast_cookie_keys[i].enctype = KRB5_ENCTYPE_NULL;
+    }
+    fast_cookie_preferred = KRB5_ENCTYPE_NULL;
+    fast_cookie_fetched = 0;
+}
+
+/* Called with fast_cache_mutex held */
+static krb5_crypto
+fast_cookie_key_lookup(krb5_enctype enctype)
+{
+    size_t i;
+
+    if (enctype == KRB5_ENCTYPE_NULL)
+	return NULL;
+    for (i = 0; i < FAST_COOKIE_KEY_CACHE_SIZE; i++)
+	if (fast_cookie_keys[i].crypto && fast_cookie_keys[i].enctype == enctype)
+	    return fast_cookie_keys[i].crypto;
+    return NULL;
+}
+
+/*
+ * Called with fast_cache_mutex held, returns FALSE if the cache is
+ * full and the caller keeps ownership of crypto.
+ */
+static krb5_boolean
+fast_cookie_key_insert(krb5_enctype enctype, krb5_crypto crypto)
+{
+    size_t i;
+
+    for (i = 0; i < FAST_COOKIE_KEY_CACHE_SIZE; i++) {
+	if (fast_cookie_keys[i].crypto == NULL) {
+	    fast_cookie_keys[i].enctype = enctype;
+	    fast_cookie_keys[i].crypto = crypto;
+	    if (fast_cookie_fetched == 0)
+		fast_cookie_fetched = kdc_time;
+	    return TRUE;
+	}
+    }
+    return FALSE;
+}
+
+static void
+fast_armor_digest(const krb5_data *armor, const krb5_keyblock *key,
+		  unsigned char digest[FAST_ARMOR_DIGEST_LEN])
+{
+    EVP_MD_CTX *m = EVP_MD_CTX_create();
+
+    EVP_DigestInit_ex(m, EVP_sha256(), NULL);
+    EVP_DigestUpdate(m, armor->data, armor->length);
+    EVP_DigestUpdate(m, key->keyvalue.data, key->keyvalue.length);
+    EVP_DigestFinal_ex(m, digest, NULL);
+    EVP_MD_CTX_destroy(m);
+}
+
+static struct fast_armor_entry *
+fast_armor_slot(const unsigned char digest[FAST_ARMOR_DIGEST_LEN])
+{
+    return &fast_armor_cache[(digest[0] | (digest[1] << 8)) %
+			     FAST_ARMOR_CACHE_SIZE];
+}
+
+/* Called with fast_cache_mutex held */
+static void
+fast_armor_entry_free(krb5_context context, struct fast_armor_entry *e)
+{
+    if (e->ticket)
+	krb5_free_ticket(context, e->ticket);
+    krb5_free_keyblock_contents(context, &e->armorkey);
+    memset(e, 0, sizeof(*e));
+}
+
+/*
+ * Look up a previously verified armor AP-REQ, returning copies of its
+ * ticket and armor key.
+ */
+static krb5_boolean
+fast_armor_cache_get(krb5_context context,
+		     const unsigned char digest[FAST_ARMOR_DIGEST_LEN],
+		     krb5_ticket **ticket,
+		     krb5_keyblock *armorkey)
+{
+    struct fast_armor_entry *e = fast_armor_slot(digest);
+    krb5_boolean found = FALSE;
+
+    HEIMDAL_MUTEX_lock(&fast_cache_mutex);
+    if (e->ticket && e->expires <= kdc_time)
+	fast_armor_entry_free(context, e);
+    if (e->ticket && ct_memcmp(e->digest, digest, sizeof(e->digest)) == 0 &&
+	krb5_copy_ticket(context, e->ticket, ticket) == 0) {
+	if (krb5_copy_keyblock_contents(context, &e->armorkey, armorkey) == 0)
+	    found = TRUE;
+	else {
+	    krb5_free_ticket(context, *ticket);
+	    *ticket = NULL;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&fast_cache_mutex);
+
+    return found;
+}
+
+static void
+fast_armor_cache_put(krb5_context context,
+		     const unsigned char digest[FAST_ARMOR_DIGEST_LEN],
+		     krb5_auth_context ac,
+		     const krb5_ticket *ticket,
+		     const krb5_keyblock *armorkey)
+{
+    struct fast_armor_entry *e = fast_armor_slot(digest);
+    time_t expires;
+
+    expires = ticket->ticket.endtime;
+    if (ac->authenticator->ctime + context->max_skew < expires)
+	expires = ac->authenticator->ctime + context->max_skew;
+    if (expires <= kdc_time)
+	return;
+
+    HEIMDAL_MUTEX_lock(&fast_cache_mutex);
+    fast_armor_entry_free(context, e);
+    if (krb5_copy_ticket(context, ticket, &e->ticket) == 0 &&
+	krb5_copy_keyblock_contents(context, armorkey, &e->armorkey) == 0) {
+	memcpy(e->digest, digest, sizeof(e->digest));
+	e->expires = expires;
+    } else
+	fast_armor_entry_free(context, e);
+    HEIMDAL_MUTEX_unlock(&fast_cache_mutex);
+}
+
 static krb5_error_code
 salt_fastuser_crypto(astgs_request_t r,
 		     krb5_const_principal salt_principal,
@@ -107,14 +284,27 @@ get_fastuser_crypto(astgs_request_t r,
 		    krb5_enctype enctype,
 		    krb5_crypto *crypto)
 {
-    krb5_principal fast_princ;
+    krb5_principal fast_princ = NULL;
     hdb_entry_ex *fast_user = NULL;
     Key *cookie_key = NULL;
     krb5_crypto fast_crypto = NULL;
+    krb5_boolean preferred = (enctype == KRB5_ENCTYPE_NULL);
+    krb5_boolean owned = FALSE;
     krb5_error_code ret;
 
     *crypto = NULL;
 
+    HEIMDAL_MUTEX_lock(&fast_cache_mutex);
+
+    if (fast_cookie_fetched &&
+	fast_cookie_fetched + FAST_COOKIE_KEY_CACHE_TIME < kdc_time)
+	fast_cookie_keys_flush(r->context);
+
+    fast_crypto = fast_cookie_key_lookup(preferred ?
+					 fast_cookie_preferred : enctype);
+    if (fast_crypto)
+	goto salt;
+
     ret = krb5_make_principal(r->context, &fast_princ,
 			      KRB5_WELLKNOWN_ORG_H5L_REALM,
 			      KRB5_WELLKNOWN_NAME, "org.h5l.fast-cookie", NULL);
@@ -126,7 +316,7 @@ get_fastuser_crypto(astgs_request_t r,
     if (ret)
 	goto out;
 
-    if (enctype == KRB5_ENCTYPE_NULL)
+    if (preferred)
 	ret = _kdc_get_preferred_key(r->context, r->config, fast_user,
 				     "fast-cookie", &enctype, &cookie_key);
     else
@@ -140,16 +330,22 @@ get_fastuser_crypto(astgs_request_t r,
     if (ret)
 	goto out;
 
-    ret = salt_fastuser_crypto(r, ticket_client,
-			       cookie_key->key.keytype,
+    if (preferred)
+	fast_cookie_preferred = cookie_key->key.keytype;
+    owned = !fast_cookie_key_insert(cookie_key->key.keytype, fast_crypto);
+
+ salt:
+    krb5_crypto_getenctype(r->context, fast_crypto, &enctype);
+    ret = salt_fastuser_crypto(r, ticket_client, enctype,
 			       fast_crypto, crypto);
     if (ret)
 	goto out;
 
  out:
+    HEIMDAL_MUTEX_unlock(&fast_cache_mutex);
     if (fast_user)
 	_kdc_free_ent(r->context, fast_user);
-    if (fast_crypto)
+    if (owned)
 	krb5_crypto_destroy(r->context, fast_crypto);
     krb5_free_principal(r->context, fast_princ);
 
@@ -465,6 +661,8 @@ fast_unwrap_request(astgs_request_t r,
     krb5_keyblock armorkey;
     krb5_keyblock explicit_armorkey;
     krb5_boolean explicit_armor;
+    krb5_boolean cached = FALSE;
+    unsigned char digest[FAST_ARMOR_DIGEST_LEN];
     krb5_error_code ret;
     krb5_ap_req ap_req;
     KrbFastReq fastreq = {0};
@@ -473,6 +671,8 @@ fast_unwrap_request(astgs_request_t r,
     size_t len;
     int i = 0;
 
+    krb5_keyblock_zero(&armorkey);
+
     pa = _kdc_find_padata(&r->req, &i, KRB5_PADATA_FX_FAST);
     if (pa == NULL) {
 	if (tgs_ac && r->fast_asserted) {
@@ -570,14 +770,22 @@ fast_unwrap_request(astgs_request_t r,
 	    goto out;
 	}
 
-	ret = krb5_verify_ap_req2(r->context, &ac,
-				  &ap_req,
-				  armor_server_principal,
-				  &r->armor_key->key,
-				  0,
-				  &ap_req_options,
-				  &r->armor_ticket,
-				  KRB5_KU_AP_REQ_AUTH);
+	fast_armor_digest(&fxreq.u.armored_data.armor->armor_value,
+			  &r->armor_key->key, digest);
+	cached = fast_armor_cache_get(r->context, digest,
+				      &r->armor_ticket, &armorkey);
+	if (cached) {
+	    kdc_log(r->context, r->config, 10, "FAST armor found in cache");
+	} else {
+	    ret = krb5_verify_ap_req2(r->context, &ac,
+				      &ap_req,
+				      armor_server_principal,
+				      &r->armor_key->key,
+				      0,
+				      &ap_req_options,
+				      &r->armor_ticket,
+				      KRB5_KU_AP_REQ_AUTH);
+	}
 	free_AP_REQ(&ap_req);
 	if (ret)
 	    goto out;
@@ -607,7 +815,7 @@ fast_unwrap_request(astgs_request_t r,
     _kdc_audit_addkv((kdc_request_t)r, 0, "armor_client_name", "%s",
 		      armor_client_principal_name ? armor_client_principal_name : "<unknown>");
 
-    if (ac->remote_subkey == NULL) {
+    if (!cached && ac->remote_subkey == NULL) {
 	krb5_auth_con_free(r->context, ac);
 	kdc_log(r->context, r->config, 2,
 		"FAST AP-REQ remote subkey missing");
@@ -618,11 +826,19 @@ fast_unwrap_request(astgs_request_t r,
     r->fast.flags.kdc_verified =
 	!_kdc_is_anonymous_pkinit(r->context, ticket->client);
 
-    ret = _krb5_fast_armor_key(r->context,
-			       ac->remote_subkey,
-			       &ticket->ticket.key,
-			       &armorkey,
-			       explicit_armor ? NULL : &r->armor_crypto);
+    if (cached) {
+	if (!explicit_armor)
+	    ret = krb5_crypto_init(r->context, &armorkey, 0,
+				   &r->armor_crypto);
+    } else {
+	ret = _krb5_fast_armor_key(r->context,
+				   ac->remote_subkey,
+				   &ticket->ticket.key,
+				   &armorkey,
+				   explicit_armor ? NULL : &r->armor_crypto);
+	if (ret == 0 && fxreq.u.armored_data.armor != NULL)
+	    fast_armor_cache_put(r->context, digest, ac, ticket, &armorkey);
+    }
     if (ret)
 	goto out;
 
@@ -638,8 +854,6 @@ fast_unwrap_request(astgs_request_t r,
 	krb5_free_keyblock_contents(r->context, &explicit_armorkey);
     }
 
-    krb5_free_keyblock_contents(r->context, &armorkey);
-
     ret = krb5_decrypt_EncryptedData(r->context, r->armor_crypto,
 				     KRB5_KU_FAST_ENC,
 				     &fxreq.u.armored_data.enc_fast_req,
@@ -730,6 +944,7 @@ fast_unwrap_request(astgs_request_t r,
  out:
     if (ac && ac != tgs_ac)
 	krb5_auth_con_free(r->context, ac);
+    krb5_free_keyblock_contents(r->context, &armorkey);
 
     krb5_free_principal(r->context, armor_server_principal);
     krb5_xfree(armor_client_principal_name);
@@ -53,6 +53,42 @@ struct gss_client_params {
     krb5_checksum req_body_checksum;
 };
 
+/*
+ * Acquiring the krbtgt acceptor credential resolves and searches the
+ * keytab, so each worker keeps one per realm and hands out duplicates.
+ * A cached credential is dropped when the default keytab file changes
+ * or after PA_GSS_CRED_LIFETIME seconds, whichever comes first.
+ *
+ * With gss_preauth_context_cache, a multi-leg context is kept in the
+ * worker between legs and only a random reference to it goes into the
+ * FAST cookie, saving an export and an import per leg.  The context
+ * cannot follow a leg to another KDC process, so this is only useful
+ * when legs of an exchange reach the same process.
+ */
+
+#define PA_GSS_CRED_CACHE_SIZE		4
+#define PA_GSS_CRED_LIFETIME		300
+#define PA_GSS_CONTEXT_CACHE_SIZE	256
+
+static const char pa_gss_context_ref_magic[] = "h5l-gss-ctx-ref:";
+#define PA_GSS_CONTEXT_REF_MAGIC_LEN	(sizeof(pa_gss_context_ref_magic) - 1)
+#define PA_GSS_CONTEXT_REF_LEN		(PA_GSS_CONTEXT_REF_MAGIC_LEN + 16)
+
+static struct pa_gss_cred_entry {
+    char *realm;
+    gss_cred_id_t cred;
+    time_t acquired;
+    time_t keytab_mtime;
+} pa_gss_creds[PA_GSS_CRED_CACHE_SIZE];
+
+static struct pa_gss_context_entry {
+    unsigned char ref[PA_GSS_CONTEXT_REF_LEN];
+    gss_ctx_id_t context_handle;
+    time_t expires;
+} pa_gss_contexts[PA_GSS_CONTEXT_CACHE_SIZE];
+
+static HEIMDAL_MUTEX pa_gss_cache_mutex = HEIMDAL_MUTEX_INITIALIZER;
+
 static void
 pa_gss_display_status(astgs_request_t r,
                       OM_uint32 major,
@@ -196,6 +232,86 @@ out:
     return ret;
 }
 
+static krb5_boolean
+pa_gss_is_context_ref(gss_const_buffer_t token)
+{
+    return token->length == PA_GSS_CONTEXT_REF_LEN &&
+	memcmp(token->value, pa_gss_context_ref_magic,
+	       PA_GSS_CONTEXT_REF_MAGIC_LEN) == 0;
+}
+
+/*
+ * Take the context a reference token refers to out of the cache.
+ */
+static gss_ctx_id_t
+pa_gss_context_cache_take(gss_const_buffer_t ref)
+{
+    gss_ctx_id_t ctx = GSS_C_NO_CONTEXT;
+    size_t i;
+
+    HEIMDAL_MUTEX_lock(&pa_gss_cache_mutex);
+    for (i = 0; i < PA_GSS_CONTEXT_CACHE_SIZE; i++) {
+	struct pa_gss_context_entry *e = &pa_gss_contexts[i];
+
+	if (e->context_handle != GSS_C_NO_CONTEXT &&
+	    e->expires > kdc_time &&
+	    ct_memcmp(e->ref, ref->value, sizeof(e->ref)) == 0) {
+	    ctx = e->context_handle;
+	    e->context_handle = GSS_C_NO_CONTEXT;
+	    break;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&pa_gss_cache_mutex);
+
+    return ctx;
+}
+
+/*
+ * Move a context into the cache, returning the reference token that
+ * stands in for it in the cookie.
+ */
+static krb5_error_code
+pa_gss_context_cache_put(astgs_request_t r,
+			 gss_ctx_id_t *context_handle,
+			 gss_buffer_t ref)
+{
+    struct pa_gss_context_entry *e = NULL, *oldest = NULL;
+    gss_ctx_id_t evicted = GSS_C_NO_CONTEXT;
+    OM_uint32 minor;
+    size_t i;
+
+    ref->value = malloc(PA_GSS_CONTEXT_REF_LEN);
+    if (ref->value == NULL)
+	return krb5_enomem(r->context);
+    ref->length = PA_GSS_CONTEXT_REF_LEN;
+    memcpy(ref->value, pa_gss_context_ref_magic, PA_GSS_CONTEXT_REF_MAGIC_LEN);
+    krb5_generate_random_block((unsigned char *)ref->value +
+			       PA_GSS_CONTEXT_REF_MAGIC_LEN, 16);
+
+    HEIMDAL_MUTEX_lock(&pa_gss_cache_mutex);
+    for (i = 0; i < PA_GSS_CONTEXT_CACHE_SIZE; i++) {
+	struct pa_gss_context_entry *c = &pa_gss_contexts[i];
+
+	if (c->context_handle == GSS_C_NO_CONTEXT || c->expires <= kdc_time) {
+	    e = c;
+	    break;
+	}
+	if (oldest == NULL || c->expires < oldest->expires)
+	    oldest = c;
+    }
+    if (e == NULL)
+	e = oldest;
+    evicted = e->context_handle;
+    memcpy(e->ref, ref->value, sizeof(e->ref));
+    e->context_handle = *context_handle;
+    e->expires = kdc_time + FAST_EXPIRATION_TIME;
+    *context_handle = GSS_C_NO_CONTEXT;
+    HEIMDAL_MUTEX_unlock(&pa_gss_cache_mutex);
+
+    gss_delete_sec_context(&minor, &evicted, GSS_C_NO_BUFFER);
+    return 0;
+}
+
 /*
  * Deserialize a GSS-API security context from the FAST cookie.
  */
@@ -228,6 +344,17 @@ pa_gss_get_context_state(astgs_request_t r,
         return ret;
     }
 
+    if (pa_gss_is_context_ref(&sec_context_token)) {
+        gcp->context_handle = pa_gss_context_cache_take(&sec_context_token);
+        gss_release_buffer(&minor, &sec_context_token);
+        if (gcp->context_handle == GSS_C_NO_CONTEXT) {
+            kdc_log(r->context, r->config, 4,
+                    "GSS pre-authentication context not found in cache");
+            return KRB5KDC_ERR_PREAUTH_FAILED;
+        }
+        return 0;
+    }
+
     major = gss_import_sec_context(&minor, &sec_context_token,
                                    &gcp->context_handle);
     if (GSS_ERROR(major)) {
@@ -318,12 +445,19 @@ pa_gss_set_context_state(astgs_request_t r,
             return ret;
     }
 
-    major = gss_export_sec_context(&minor, &gcp->context_handle,
-                                   &sec_context_token);
-    if (GSS_ERROR(major)) {
-        pa_gss_display_status(r, major, minor, gcp,
-                              "Failed to export GSS pre-authentication context");
-        return _krb5_gss_map_error(major, minor);
+    if (r->config->gss_preauth_context_cache) {
+        ret = pa_gss_context_cache_put(r, &gcp->context_handle,
+                                       &sec_context_token);
+        if (ret)
+            return ret;
+    } else {
+        major = gss_export_sec_context(&minor, &gcp->context_handle,
+                                       &sec_context_token);
+        if (GSS_ERROR(major)) {
+            pa_gss_display_status(r, major, minor, gcp,
+                                  "Failed to export GSS pre-authentication context");
+            return _krb5_gss_map_error(major, minor);
+        }
     }
 
     ret = pa_gss_encode_context_state(r, &sec_context_token,
@@ -395,6 +529,104 @@ pa_gss_acquire_acceptor_cred(astgs_request_t r,
     return ret;
 }
 
+static time_t
+pa_gss_keytab_mtime(krb5_context context)
+{
+    char name[MAXPATHLEN];
+    const char *path = name;
+    struct stat sb;
+
+    if (krb5_kt_default_name(context, name, sizeof(name)) != 0)
+	return 0;
+    if (strncmp(name, "FILE:", 5) == 0)
+	path = name + 5;
+    else if (strchr(name, ':') != NULL && name[0] != '/')
+	return 0;
+    if (stat(path, &sb) != 0)
+	return 0;
+    return sb.st_mtime;
+}
+
+/*
+ * Return a duplicate of this worker's acceptor credential for the
+ * request realm, acquiring it if there is none or it went stale.
+ */
+static krb5_error_code
+pa_gss_get_acceptor_cred(astgs_request_t r,
+                         gss_client_params *gcp,
+                         gss_cred_id_t *cred)
+{
+    struct pa_gss_cred_entry *e = NULL;
+    gss_cred_id_t stale = GSS_C_NO_CREDENTIAL;
+    gss_cred_id_t fresh = GSS_C_NO_CREDENTIAL;
+    const char *realm = r->req.req_body.realm;
+    time_t mtime = pa_gss_keytab_mtime(r->context);
+    krb5_error_code ret = 0;
+    OM_uint32 major, minor;
+    size_t i;
+
+    *cred = GSS_C_NO_CREDENTIAL;
+
+    HEIMDAL_MUTEX_lock(&pa_gss_cache_mutex);
+    for (i = 0; i < PA_GSS_CRED_CACHE_SIZE; i++) {
+	if (pa_gss_creds[i].realm &&
+	    strcmp(pa_gss_creds[i].realm, realm) == 0) {
+	    e = &pa_gss_creds[i];
+	    break;
+	}
+    }
+    if (e && e->acquired + PA_GSS_CRED_LIFETIME > kdc_time &&
+	e->keytab_mtime == mtime) {
+	major = gss_duplicate_cred(&minor, e->cred, cred);
+	HEIMDAL_MUTEX_unlock(&pa_gss_cache_mutex);
+	if (major == GSS_S_COMPLETE)
+	    return 0;
+	/* fall back to acquiring our own */
+    } else
+	HEIMDAL_MUTEX_unlock(&pa_gss_cache_mutex);
+
+    ret = pa_gss_acquire_acceptor_cred(r, gcp, &fresh);
+    if (ret)
+	return ret;
+
+    major = gss_duplicate_cred(&minor, fresh, cred);
+    if (major != GSS_S_COMPLETE) {
+	/* Use it uncached */
+	*cred = fresh;
+	return 0;
+    }
+
+    HEIMDAL_MUTEX_lock(&pa_gss_cache_mutex);
+    if (e == NULL || e->realm == NULL || strcmp(e->realm, realm) != 0) {
+	for (e = NULL, i = 0; i < PA_GSS_CRED_CACHE_SIZE; i++) {
+	    if (pa_gss_creds[i].realm == NULL ||
+		strcmp(pa_gss_creds[i].realm, realm) == 0) {
+		e = &pa_gss_creds[i];
+		break;
+	    }
+	}
+	if (e == NULL)
+	    e = &pa_gss_creds[0];
+    }
+    if (e->realm == NULL || strcmp(e->realm, realm) != 0) {
+	free(e->realm);
+	e->realm = strdup(realm);
+    }
+    stale = e->cred;
+    if (e->realm) {
+	e->cred = fresh;
+	e->acquired = kdc_time;
+	e->keytab_mtime = mtime;
+	fresh = GSS_C_NO_CREDENTIAL;
+    } else
+	e->cred = GSS_C_NO_CREDENTIAL;
+    HEIMDAL_MUTEX_unlock(&pa_gss_cache_mutex);
+
+    gss_release_cred(&minor, &stale);
+    gss_release_cred(&minor, &fresh);
+    return 0;
+}
+
 krb5_error_code
 _kdc_gss_rd_padata(astgs_request_t r,
                    const PA_DATA *pa,
@@ -436,7 +668,7 @@ _kdc_gss_rd_padata(astgs_request_t r,
     if (ret)
         goto out;
 
-    ret = pa_gss_acquire_acceptor_cred(r, gcp, &cred);
+    ret = pa_gss_get_acceptor_cred(r, gcp, &cred);
     if (ret)
         goto out;
 
@@ -44,6 +44,10 @@ static int to_stdout;
 static int verbose_flag;
 static int encrypt_flag;
 static int decrypt_flag;
+static int threads = 1;
+static int stream_flag;
+static int compress_flag;
+static int frame_size = HPROP_FRAME_SIZE;
 static hdb_master_key mkey5;
 
 static char *source_type;
@@ -86,39 +90,163 @@ open_socket(krb5_context context, const char *hostname, const char *port)
     return -1;
 }
 
+/*
+ * Seal or unseal the keys of `entry' as requested and encode it for
+ * sending.  Split out of v5_prop() so that mit_prop_dump() can do this in
+ * worker threads, each with a master key of its own.
+ */
 krb5_error_code
-v5_prop(krb5_context context, HDB *db, hdb_entry_ex *entry, void *appdata)
+v5_prop_encode(krb5_context context, hdb_master_key mkey,
+               hdb_entry_ex *entry, krb5_data *data)
 {
     krb5_error_code ret;
-    struct prop_data *pd = appdata;
-    krb5_data data;
 
     if(encrypt_flag) {
-	ret = hdb_seal_keys_mkey(context, &entry->entry, mkey5);
+	ret = hdb_seal_keys_mkey(context, &entry->entry, mkey);
 	if (ret) {
 	    krb5_warn(context, ret, "hdb_seal_keys_mkey");
 	    return ret;
 	}
     }
     if(decrypt_flag) {
-	ret = hdb_unseal_keys_mkey(context, &entry->entry, mkey5);
+	ret = hdb_unseal_keys_mkey(context, &entry->entry, mkey);
 	if (ret) {
 	    krb5_warn(context, ret, "hdb_unseal_keys_mkey");
 	    return ret;
 	}
     }
 
-    ret = hdb_entry2value(context, &entry->entry, &data);
-    if(ret) {
+    ret = hdb_entry2value(context, &entry->entry, data);
+    if(ret)
 	krb5_warn(context, ret, "hdb_entry2value");
+    return ret;
+}
+
+/*
+ * Send the entries collected so far as one streaming frame, compressed
+ * if that was agreed on and makes it smaller.
+ */
+krb5_error_code
+v5_prop_flush(struct prop_data *pd)
+{
+    krb5_error_code ret;
+    krb5_data payload, frame;
+    unsigned char *p;
+
+    if(!pd->stream || pd->frame_len == 0)
+	return 0;
+
+    ret = krb5_storage_to_data(pd->frame, &payload);
+    if(ret)
 	return ret;
+    krb5_storage_truncate(pd->frame, 0);
+    pd->frame_len = 0;
+
+#ifdef HAVE_ZLIB
+    if(pd->compress) {
+	uLongf clen = compressBound(payload.length);
+
+	ret = krb5_data_alloc(&frame, 5 + clen);
+	if(ret) {
+	    krb5_data_free(&payload);
+	    return ret;
+	}
+	p = frame.data;
+	if(compress2(p + 5, &clen, payload.data, payload.length,
+		     Z_BEST_SPEED) == Z_OK && clen < payload.length) {
+	    p[0] = HPROP_FRAME_COMPRESSED;
+	    _krb5_put_int(p + 1, payload.length, 4);
+	    frame.length = 5 + clen;
+	    goto send;
+	}
+	krb5_data_free(&frame);
     }
+#endif
 
+    ret = krb5_data_alloc(&frame, 1 + payload.length);
+    if(ret) {
+	krb5_data_free(&payload);
+	return ret;
+    }
+    p = frame.data;
+    p[0] = 0;
+    memcpy(p + 1, payload.data, payload.length);
+
+#ifdef HAVE_ZLIB
+send:
+#endif
+    krb5_data_free(&payload);
+    ret = krb5_write_priv_message(pd->context, pd->auth_context,
+				  &pd->sock, &frame);
+    krb5_data_free(&frame);
+    return ret;
+}
+
+krb5_error_code
+v5_prop_send(struct prop_data *pd, krb5_data *data)
+{
+    krb5_error_code ret;
+
+    if(pd->skip > 0) {
+	pd->skip--;
+	return 0;
+    }
+    if(pd->stream) {
+	ret = krb5_store_data(pd->frame, *data);
+	if(ret)
+	    return ret;
+	pd->frame_len += 4 + data->length;
+	if(pd->frame_len >= (size_t)frame_size)
+	    return v5_prop_flush(pd);
+	return 0;
+    }
     if(to_stdout)
-	ret = krb5_write_message(context, &pd->sock, &data);
-    else
-	ret = krb5_write_priv_message(context, pd->auth_context,
-				      &pd->sock, &data);
+	return krb5_write_message(pd->context, &pd->sock, data);
+    return krb5_write_priv_message(pd->context, pd->auth_context,
+				   &pd->sock, data);
+}
+
+/*
+ * Set up a krb5_context and master key for a worker thread; a krb5_crypto
+ * must not be shared between threads.
+ */
+krb5_error_code
+v5_prop_thread_init(krb5_context *context, hdb_master_key *mkey)
+{
+    krb5_error_code ret;
+
+    *mkey = NULL;
+    ret = krb5_init_context(context);
+    if(ret)
+	return ret;
+    ret = krb5_allow_weak_crypto(*context, 1);
+    if(ret == 0 && local_realm)
+	ret = krb5_set_default_realm(*context, local_realm);
+    if(ret == 0 && (decrypt_flag || encrypt_flag))
+	ret = hdb_read_master_key(*context, mkeyfile, mkey);
+    if(ret) {
+	krb5_free_context(*context);
+	*context = NULL;
+    }
+    return ret;
+}
+
+krb5_error_code
+v5_prop(krb5_context context, HDB *db, hdb_entry_ex *entry, void *appdata)
+{
+    krb5_error_code ret;
+    struct prop_data *pd = appdata;
+    krb5_data data;
+
+    /* Don't bother encoding what the receiver already has */
+    if(pd->skip > 0) {
+	pd->skip--;
+	return 0;
+    }
+    ret = v5_prop_encode(context, mkey5, entry, &data);
+    if(ret)
+	return ret;
+    ret = v5_prop_send(pd, &data);
     krb5_data_free(&data);
     return ret;
 }
@@ -137,6 +265,14 @@ struct getargs args[] = {
     { "decrypt",  'D',  arg_flag,   &decrypt_flag,   "decrypt keys", NULL },
     { "encrypt",  'E',  arg_flag,   &encrypt_flag,   "encrypt keys", NULL },
     { "stdout",	  'n',  arg_flag,   &to_stdout, "dump to stdout", NULL },
+    { "threads",  'j',  arg_integer, &threads,
+      "number of threads to convert a mit-dump with", "number" },
+    { "stream",   0,	arg_flag,   &stream_flag,
+      "send entries in large frames, resuming interrupted transfers", NULL },
+    { "compress", 0,	arg_flag,   &compress_flag,
+      "compress streamed frames", NULL },
+    { "frame-size", 0,	arg_integer, &frame_size,
+      "size of streamed frames", "bytes" },
     { "verbose",  'v',	arg_flag, &verbose_flag, NULL, NULL },
     { "version",   0,	arg_flag, &version_flag, NULL, NULL },
     { "help",     'h',	arg_flag, &help_flag, NULL, NULL }
@@ -247,6 +383,113 @@ iterate (krb5_context context,
     return ret;
 }
 
+/*
+ * Identify what is being sent, so that hpropd can tell whether an
+ * interrupted transfer it has a checkpoint for can be resumed.  That
+ * needs the entries to come in the same order, so not with a threaded
+ * mit-dump conversion, and an unchanged source, for which we go by the
+ * modification time and size of its file.
+ */
+static char *
+stream_session(krb5_context context, int type, const char *database_name)
+{
+    static const char *suffixes[] = { "", ".db", ".mdb", ".sqlite" };
+    struct stat sb;
+    const char *path = database_name;
+    const char *p;
+    char *file = NULL;
+    char *session = NULL;
+    size_t i;
+
+    if(type == HPROP_MIT_DUMP && threads > 1)
+	return strdup("");
+    if(path == NULL)
+	path = hdb_default_db(context);
+    if(type == HPROP_HEIMDAL && (p = strchr(path, ':')) != NULL &&
+       p - path < 8)
+	path = p + 1;
+
+    for(i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+	if(asprintf(&file, "%s%s", path, suffixes[i]) == -1)
+	    return NULL;
+	if(stat(file, &sb) == 0)
+	    break;
+	free(file);
+	file = NULL;
+    }
+    if(file == NULL)
+	return strdup("");
+    if(asprintf(&session, "%s:%lld:%lld:%d:%d", file,
+		(long long)sb.st_mtime, (long long)sb.st_size,
+		encrypt_flag, decrypt_flag) == -1)
+	session = NULL;
+    free(file);
+    return session;
+}
+
+/*
+ * Negotiate the streaming protocol with hpropd, see hprop.h.
+ */
+static krb5_error_code
+stream_hello(krb5_context context, krb5_auth_context auth_context,
+	     int fd, const char *session, struct prop_data *pd)
+{
+    krb5_error_code ret;
+    krb5_storage *sp;
+    krb5_data data;
+    char *version = NULL;
+    uint32_t flags = 0, have = 0;
+
+    sp = krb5_storage_emem();
+    if(sp == NULL)
+	return krb5_enomem(context);
+    ret = krb5_store_stringz(sp, HPROP_STREAM_VERSION);
+    if(ret == 0)
+	ret = krb5_store_uint32(sp, pd->compress ? HPROP_STREAM_COMPRESS : 0);
+    if(ret == 0)
+	ret = krb5_store_stringz(sp, session);
+    if(ret == 0)
+	ret = krb5_storage_to_data(sp, &data);
+    krb5_storage_free(sp);
+    if(ret)
+	return ret;
+
+    ret = krb5_write_priv_message(context, auth_context, &fd, &data);
+    krb5_data_free(&data);
+    if(ret)
+	return ret;
+
+    /* An hpropd without streaming support just drops the connection */
+    ret = krb5_read_priv_message(context, auth_context, &fd, &data);
+    if(ret)
+	return ret;
+    sp = krb5_storage_from_data(&data);
+    if(sp == NULL) {
+	krb5_data_free(&data);
+	return krb5_enomem(context);
+    }
+    ret = krb5_ret_stringz(sp, &version);
+    if(ret == 0 && strcmp(version, HPROP_STREAM_VERSION) != 0) {
+	ret = KRB5_SENDAUTH_BADAPPLVERS;
+	krb5_set_error_message(context, ret,
+			       "unexpected stream version %s", version);
+    }
+    if(ret == 0)
+	ret = krb5_ret_uint32(sp, &flags);
+    if(ret == 0)
+	ret = krb5_ret_uint32(sp, &have);
+    krb5_storage_free(sp);
+    krb5_data_free(&data);
+    free(version);
+    if(ret)
+	return ret;
+
+    if(!(flags & HPROP_STREAM_COMPRESS))
+	pd->compress = 0;
+    pd->skip = have;
+    return 0;
+}
+
 static int
 dump_database (krb5_context context, int type,
 	       const char *database_name, HDB *db)
@@ -255,9 +498,11 @@ dump_database (krb5_context context, int type,
     struct prop_data pd;
     krb5_data data;
 
+    memset(&pd, 0, sizeof(pd));
     pd.context      = context;
     pd.auth_context = NULL;
     pd.sock         = STDOUT_FILENO;
+    pd.threads      = threads;
 
     ret = iterate (context, database_name, db, type, &pd);
     if (ret)
@@ -279,6 +524,13 @@ propagate_database (krb5_context context, int type,
     krb5_principal server;
     krb5_error_code ret;
     int i, failed = 0;
+    char *session = NULL;
+
+    if(stream_flag) {
+	session = stream_session(context, type, database_name);
+	if(session == NULL)
+	    krb5_errx(context, 1, "out of memory");
+    }
 
     for(i = optidx; i < argc; i++){
 	krb5_auth_context auth_context;
@@ -289,6 +541,8 @@ propagate_database (krb5_context context, int type,
 	char *port, portstr[NI_MAXSERV];
 	char *host = argv[i];
 
+	memset(&pd, 0, sizeof(pd));
+
 	port = strchr(host, ':');
 	if(port == NULL) {
 	    snprintf(portstr, sizeof(portstr), "%u",
@@ -347,8 +601,29 @@ propagate_database (krb5_context context, int type,
 	pd.context      = context;
 	pd.auth_context = auth_context;
 	pd.sock         = fd;
+	pd.threads      = threads;
+
+	if(stream_flag) {
+	    pd.stream = 1;
+	    pd.compress = compress_flag;
+	    pd.frame = krb5_storage_emem();
+	    if(pd.frame == NULL)
+		krb5_errx(context, 1, "out of memory");
+	    ret = stream_hello(context, auth_context, fd, session, &pd);
+	    if(ret) {
+		krb5_warn(context, ret, "stream negotiation with %s failed "
+			  "(is hpropd too old for --stream?)", host);
+		failed++;
+		goto next_host;
+	    }
+	    if(verbose_flag && pd.skip)
+		krb5_warnx(context, "%s: resuming after %lu entries",
+			   host, pd.skip);
+	}
 
 	ret = iterate (context, database_name, db, type, &pd);
+	if (ret == 0)
+	    ret = v5_prop_flush(&pd);
 	if (ret) {
 	    krb5_warnx(context, "iterate to host %s failed", host);
 	    failed++;
@@ -372,9 +647,12 @@ propagate_database (krb5_context context, int type,
 	    krb5_data_free (&data);
 
     next_host:
+	if(pd.frame)
+	    krb5_storage_free(pd.frame);
 	krb5_auth_con_free(context, auth_context);
 	close(fd);
     }
+    free(session);
     if (failed)
 	return 1;
     return 0;
@@ -420,6 +698,17 @@ main(int argc, char **argv)
 	krb5_errx(context, 1,
 		  "only one of `--encrypt' and `--decrypt' is meaningful");
 
+    if(stream_flag && to_stdout)
+	krb5_errx(context, 1, "`--stream' cannot be used with `--stdout'");
+    if(frame_size < 1024 || frame_size > HPROP_FRAME_MAX / 2)
+	krb5_errx(context, 1, "bad frame size %d", frame_size);
+#ifndef HAVE_ZLIB
+    if(compress_flag) {
+	krb5_warnx(context, "built without zlib, not compressing");
+	compress_flag = 0;
+    }
+#endif
+
     if(source_type != NULL) {
 	type = parse_source_type(source_type);
 	if(type == 0)
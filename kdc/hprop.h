@@ -38,13 +38,51 @@
 
 #include "headers.h"
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
 struct prop_data{
     krb5_context context;
     krb5_auth_context auth_context;
     int sock;
+    int threads;
+    int stream;			/* send entries in frames */
+    int compress;		/* and compress them */
+    krb5_storage *frame;	/* entries not yet sent */
+    size_t frame_len;
+    unsigned long skip;		/* entries the receiver already has */
 };
 
 #define HPROP_VERSION "hprop-0.0"
+
+/*
+ * Streaming mode.  After authentication hprop sends a hello message:
+ *
+ *	string	HPROP_STREAM_VERSION
+ *	uint32	flags (HPROP_STREAM_*) the sender would like to use
+ *	string	session identifier, "" if the transfer cannot be resumed
+ *
+ * and hpropd answers with:
+ *
+ *	string	HPROP_STREAM_VERSION
+ *	uint32	flags it accepts
+ *	uint32	number of entries it already has from an earlier,
+ *		interrupted transfer of the same session
+ *
+ * Each following KRB-PRIV message is a frame of many entries: a flags
+ * byte (HPROP_FRAME_*), then, if compressed, the uint32 length of the
+ * uncompressed payload and the zlib-compressed payload, else the payload
+ * itself.  The payload is a sequence of uint32 length prefixed encoded
+ * entries.  An empty message ends the transfer, as in the classic
+ * protocol, and is acknowledged by hpropd with an empty message.
+ */
+#define HPROP_STREAM_VERSION "hprop-stream-1"
+#define HPROP_STREAM_COMPRESS 1
+
+#define HPROP_FRAME_COMPRESSED 1
+#define HPROP_FRAME_SIZE (1024 * 1024)
+#define HPROP_FRAME_MAX (64 * 1024 * 1024)
 #define HPROP_NAME "hprop"
 #define HPROP_KEYTAB "HDBGET:"
 #define HPROP_PORT 754
@@ -54,6 +92,11 @@ struct prop_data{
 #endif
 
 krb5_error_code v5_prop(krb5_context, HDB*, hdb_entry_ex*, void*);
+krb5_error_code v5_prop_encode(krb5_context, hdb_master_key, hdb_entry_ex*,
+                               krb5_data*);
+krb5_error_code v5_prop_send(struct prop_data*, krb5_data*);
+krb5_error_code v5_prop_flush(struct prop_data*);
+krb5_error_code v5_prop_thread_init(krb5_context*, hdb_master_key*);
 int mit_prop_dump(void*, const char*);
 
 #endif /* __HPROP_H__ */
@@ -41,6 +41,7 @@ static const char *database;
 static int from_stdin;
 static char *local_realm;
 static char *ktname = NULL;
+static int checkpoint_entries = 10000;
 
 struct getargs args[] = {
     { "database", 'd', arg_string, rk_UNCONST(&database), "database", "file" },
@@ -52,6 +53,8 @@ struct getargs args[] = {
 #endif
     { "keytab",   'k',	arg_string, &ktname,	"keytab to use for authentication", "keytab" },
     { "realm",   'r',	arg_string, &local_realm, "realm to use", NULL },
+    { "checkpoint", 0,	arg_integer, &checkpoint_entries,
+      "entries between checkpoints of a streamed transfer", "number" },
     { "version",    0, arg_flag, &version_flag, NULL, NULL },
     { "help",    'h',  arg_flag, &help_flag, NULL, NULL}
 };
@@ -66,6 +69,207 @@ usage(int ret)
     exit (ret);
 }
 
+static int nprincs;
+
+/*
+ * Store, or print, one received entry.
+ */
+static void
+receive_entry(krb5_context context, HDB *db, int flags, krb5_data *data)
+{
+    krb5_error_code ret;
+    hdb_entry_ex entry;
+
+    memset(&entry, 0, sizeof(entry));
+    ret = hdb_value2entry(context, data, &entry.entry);
+    if (ret)
+	krb5_err(context, 1, ret, "hdb_value2entry");
+    if (print_dump) {
+	struct hdb_print_entry_arg parg;
+
+	parg.out = stdout;
+	parg.fmt = HDB_DUMP_HEIMDAL;
+	hdb_print_entry(context, db, &entry, &parg);
+    } else {
+	ret = db->hdb_store(context, db, flags, &entry);
+	if (ret == HDB_ERR_EXISTS) {
+	    char *s;
+	    ret = krb5_unparse_name(context, entry.entry.principal, &s);
+	    if (ret)
+		s = strdup(unparseable_name);
+	    krb5_warnx(context, "Entry exists: %s", s);
+	    free(s);
+	} else if (ret)
+	    krb5_err(context, 1, ret, "db_store");
+	else
+	    nprincs++;
+    }
+    hdb_free_entry(context, &entry);
+}
+
+/*
+ * Is `data' the hello message of the streaming protocol (see hprop.h)?
+ */
+static int
+is_stream_hello(krb5_data *data)
+{
+    size_t len = sizeof(HPROP_STREAM_VERSION);
+
+    return data->length > len &&
+	memcmp(data->data, HPROP_STREAM_VERSION, len) == 0;
+}
+
+/*
+ * The checkpoint file records how many entries of which session have
+ * been committed to which temporary database, so that a transfer that
+ * was interrupted can carry on from there.
+ */
+static char *
+checkpoint_file(krb5_context context)
+{
+    char *fn;
+
+    if (asprintf(&fn, "%s/hpropd.checkpoint", hdb_db_dir(context)) == -1)
+	krb5_errx(context, 1, "out of memory");
+    return fn;
+}
+
+static unsigned long
+read_checkpoint(const char *fn, const char *tmp_db, const char *session)
+{
+    char db_buf[1024], session_buf[1024];
+    unsigned long have = 0;
+    FILE *f;
+
+    if (session[0] == '\0')
+	return 0;
+    f = fopen(fn, "r");
+    if (f == NULL)
+	return 0;
+    if (fgets(db_buf, sizeof(db_buf), f) == NULL ||
+	fgets(session_buf, sizeof(session_buf), f) == NULL ||
+	fscanf(f, "%lu", &have) != 1)
+	have = 0;
+    fclose(f);
+    db_buf[strcspn(db_buf, "\n")] = '\0';
+    session_buf[strcspn(session_buf, "\n")] = '\0';
+    if (strcmp(db_buf, tmp_db) != 0 || strcmp(session_buf, session) != 0)
+	return 0;
+    return have;
+}
+
+static void
+write_checkpoint(krb5_context context, const char *fn,
+		 const char *tmp_db, const char *session, unsigned long have)
+{
+    char *tmp;
+    FILE *f;
+
+    if (asprintf(&tmp, "%s.new", fn) == -1)
+	krb5_errx(context, 1, "out of memory");
+    f = fopen(tmp, "w");
+    if (f == NULL)
+	krb5_err(context, 1, errno, "open %s", tmp);
+    fprintf(f, "%s\n%s\n%lu\n", tmp_db, session, have);
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+	krb5_err(context, 1, errno, "write %s", tmp);
+    fclose(f);
+    if (rename(tmp, fn) != 0)
+	krb5_err(context, 1, errno, "rename %s", tmp);
+    free(tmp);
+}
+
+/*
+ * Uncompress a frame as needed, returning its payload.
+ */
+static void
+decode_frame(krb5_context context, krb5_data *data, krb5_data *payload)
+{
+    unsigned char *p = data->data;
+    krb5_error_code ret;
+
+    if (data->length < 1)
+	krb5_errx(context, 1, "short frame");
+    if (p[0] & HPROP_FRAME_COMPRESSED) {
+#ifdef HAVE_ZLIB
+	unsigned long len;
+	uLongf dlen;
+
+	if (data->length < 5)
+	    krb5_errx(context, 1, "short frame");
+	_krb5_get_int(p + 1, &len, 4);
+	if (len > HPROP_FRAME_MAX)
+	    krb5_errx(context, 1, "frame too large (%lu bytes)", len);
+	ret = krb5_data_alloc(payload, len);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_data_alloc");
+	dlen = len;
+	if (uncompress(payload->data, &dlen, p + 5, data->length - 5) != Z_OK ||
+	    dlen != len)
+	    krb5_errx(context, 1, "corrupt compressed frame");
+#else
+	krb5_errx(context, 1, "compressed frame, but built without zlib");
+#endif
+    } else {
+	ret = krb5_data_copy(payload, p + 1, data->length - 1);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_data_copy");
+    }
+}
+
+/*
+ * Receive a streamed transfer, committing the entries and recording a
+ * checkpoint every `checkpoint_entries' entries.
+ */
+static void
+receive_stream(krb5_context context, krb5_auth_context ac,
+	       krb5_socket_t sock, HDB *db, int flags,
+	       const char *ckpt, const char *tmp_db, const char *session,
+	       unsigned long have)
+{
+    unsigned long since = 0;
+    krb5_error_code ret;
+    krb5_data data, payload, entry;
+    krb5_storage *sp;
+
+    for (;;) {
+	ret = krb5_read_priv_message(context, ac, &sock, &data);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_read_priv_message");
+	if (data.length == 0)
+	    break;
+	decode_frame(context, &data, &payload);
+	krb5_data_free(&data);
+
+	sp = krb5_storage_from_data(&payload);
+	if (sp == NULL)
+	    krb5_errx(context, 1, "out of memory");
+	while (krb5_storage_seek(sp, 0, SEEK_CUR) < (off_t)payload.length) {
+	    ret = krb5_ret_data(sp, &entry);
+	    if (ret)
+		krb5_err(context, 1, ret, "corrupt frame");
+	    receive_entry(context, db, flags, &entry);
+	    krb5_data_free(&entry);
+	    have++;
+	    since++;
+	}
+	krb5_storage_free(sp);
+	krb5_data_free(&payload);
+
+	if (!print_dump && session[0] != '\0' && checkpoint_entries > 0 &&
+	    since >= (unsigned long)checkpoint_entries) {
+	    ret = hdb_end_batch(context, db, 1);
+	    if (ret)
+		krb5_err(context, 1, ret, "hdb_end_batch");
+	    write_checkpoint(context, ckpt, tmp_db, session, have);
+	    ret = hdb_begin_batch(context, db);
+	    if (ret)
+		krb5_err(context, 1, ret, "hdb_begin_batch(%s)", tmp_db);
+	    since = 0;
+	}
+    }
+}
+
 int
 main(int argc, char **argv)
 {
@@ -80,7 +284,13 @@ main(int argc, char **argv)
     int optidx = 0;
     char *tmp_db;
     krb5_log_facility *fac;
-    int nprincs;
+    krb5_data first;
+    char *session = NULL;
+    char *ckpt = NULL;
+    unsigned long have = 0;
+    int have_first = 0;
+    int stream = 0;
+    int store_flags = 0;
 
     setprogname(argv[0]);
 
@@ -207,6 +417,37 @@ main(int argc, char **argv)
 	    krb5_err(context, 1, ret, "krb5_kt_close");
     }
 
+    /* A streaming hprop says so in its first message */
+    krb5_data_zero(&first);
+    if (!from_stdin) {
+	ret = krb5_read_priv_message(context, ac, &sock, &first);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_read_priv_message");
+	have_first = 1;
+	if (is_stream_hello(&first)) {
+	    krb5_storage *sp;
+	    char *version;
+	    uint32_t flags;
+
+	    sp = krb5_storage_from_data(&first);
+	    if (sp == NULL)
+		krb5_errx(context, 1, "out of memory");
+	    ret = krb5_ret_stringz(sp, &version);
+	    if (ret == 0)
+		ret = krb5_ret_uint32(sp, &flags);
+	    if (ret == 0)
+		ret = krb5_ret_stringz(sp, &session);
+	    if (ret)
+		krb5_err(context, 1, ret, "malformed stream hello");
+	    krb5_storage_free(sp);
+	    free(version);
+	    krb5_data_free(&first);
+	    have_first = 0;
+	    stream = 1;
+	}
+    }
+
+    tmp_db = NULL;
     if (!print_dump) {
 	int aret;
 
@@ -217,17 +458,83 @@ main(int argc, char **argv)
 	ret = hdb_create(context, &db, tmp_db);
 	if (ret)
 	    krb5_err(context, 1, ret, "hdb_create(%s)", tmp_db);
-	ret = db->hdb_open(context, db, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+	if (stream) {
+	    ckpt = checkpoint_file(context);
+	    have = read_checkpoint(ckpt, tmp_db, session);
+	}
+	/* Carry on with the entries committed by an interrupted transfer */
+	if (have > 0 &&
+	    db->hdb_open(context, db, O_RDWR, 0600) == 0) {
+	    krb5_log(context, fac, 0, "Resuming after %lu principals", have);
+	    store_flags = HDB_F_REPLACE;
+	} else {
+	    have = 0;
+	    if (ckpt)
+		unlink(ckpt);
+	    ret = db->hdb_open(context, db, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	    if (ret)
+		krb5_err(context, 1, ret, "hdb_open(%s)", tmp_db);
+	}
+	ret = hdb_begin_batch(context, db);
 	if (ret)
-	    krb5_err(context, 1, ret, "hdb_open(%s)", tmp_db);
+	    krb5_err(context, 1, ret, "hdb_begin_batch(%s)", tmp_db);
     }
 
     nprincs = 0;
-    while (1){
+    if (stream) {
+	krb5_storage *sp;
 	krb5_data data;
-	hdb_entry_ex entry;
+	uint32_t flags = 0;
+
+#ifdef HAVE_ZLIB
+	flags |= HPROP_STREAM_COMPRESS;
+#endif
+	sp = krb5_storage_emem();
+	if (sp == NULL)
+	    krb5_errx(context, 1, "out of memory");
+	ret = krb5_store_stringz(sp, HPROP_STREAM_VERSION);
+	if (ret == 0)
+	    ret = krb5_store_uint32(sp, flags);
+	if (ret == 0)
+	    ret = krb5_store_uint32(sp, have);
+	if (ret == 0)
+	    ret = krb5_storage_to_data(sp, &data);
+	krb5_storage_free(sp);
+	if (ret)
+	    krb5_err(context, 1, ret, "stream hello");
+	ret = krb5_write_priv_message(context, ac, &sock, &data);
+	krb5_data_free(&data);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_write_priv_message");
+
+	receive_stream(context, ac, sock, db, store_flags,
+		       ckpt, tmp_db, session, have);
 
-	if (from_stdin) {
+	if (!print_dump) {
+	    ret = hdb_end_batch(context, db, 1);
+	    if (ret)
+		krb5_err(context, 1, ret, "hdb_end_batch");
+	    ret = db->hdb_close(context, db);
+	    if (ret)
+		krb5_err(context, 1, ret, "db_close");
+	    ret = db->hdb_rename(context, db, database);
+	    if (ret)
+		krb5_err(context, 1, ret, "db_rename");
+	    unlink(ckpt);
+	}
+	/* Acknowledge only once everything is committed */
+	krb5_data_zero(&data);
+	krb5_write_priv_message(context, ac, &sock, &data);
+    }
+
+    while (!stream) {
+	krb5_data data;
+
+	if (have_first) {
+	    data = first;
+	    have_first = 0;
+	} else if (from_stdin) {
 	    ret = krb5_read_message(context, &sock, &data);
 	    if (ret != 0 && ret != HEIM_ERR_EOF)
 		krb5_err(context, 1, ret, "krb5_read_message");
@@ -244,6 +551,9 @@ main(int argc, char **argv)
 		krb5_write_priv_message(context, ac, &sock, &data);
 	    }
 	    if (!print_dump) {
+		ret = hdb_end_batch(context, db, 1);
+		if (ret)
+		    krb5_err(context, 1, ret, "hdb_end_batch");
 		ret = db->hdb_close(context, db);
 		if (ret)
 		    krb5_err(context, 1, ret, "db_close");
@@ -253,35 +563,14 @@ main(int argc, char **argv)
 	    }
 	    break;
 	}
-	memset(&entry, 0, sizeof(entry));
-	ret = hdb_value2entry(context, &data, &entry.entry);
+	receive_entry(context, db, 0, &data);
 	krb5_data_free(&data);
-	if (ret)
-	    krb5_err(context, 1, ret, "hdb_value2entry");
-	if (print_dump) {
-            struct hdb_print_entry_arg parg;
-
-            parg.out = stdout;
-            parg.fmt = HDB_DUMP_HEIMDAL;
-	    hdb_print_entry(context, db, &entry, &parg);
-        } else {
-	    ret = db->hdb_store(context, db, 0, &entry);
-	    if (ret == HDB_ERR_EXISTS) {
-		char *s;
-		ret = krb5_unparse_name(context, entry.entry.principal, &s);
-		if (ret)
-		    s = strdup(unparseable_name);
-		krb5_warnx(context, "Entry exists: %s", s);
-		free(s);
-	    } else if (ret)
-		krb5_err(context, 1, ret, "db_store");
-	    else
-		nprincs++;
-	}
-	hdb_free_entry(context, &entry);
     }
     if (!print_dump)
 	krb5_log(context, fac, 0, "Received %d principals", nprincs);
+    free(session);
+    free(ckpt);
+    free(tmp_db);
 
     if (inetd_flag == 0)
 	rk_closesocket(sock);
@@ -171,6 +171,8 @@ typedef struct kadmin_request_desc {
     unsigned int create:1;
     unsigned int ro:1;
     unsigned int is_self:1;
+    unsigned int kadm_handle_pooled:1;
+    unsigned int failed:1;
     char frombuf[128];
 } *kadmin_request_desc;
 
@@ -276,19 +278,67 @@ audit_trail(kadmin_request_desc r, krb5_error_code ret)
 static krb5_log_facility *logfac;
 static pthread_key_t k5ctx;
 
+#define KADM_HANDLE_POOL_SIZE 4
+
+/*
+ * Per-thread state: a krb5_context and a small pool of read-only kadm5
+ * handles, one per realm, so that a thread serving many requests need not
+ * set up a new handle (and, for a remote kadmind, a new connection) for
+ * each.  A handle uses the krb5_context of the thread that made it, so
+ * handles are never shared between threads.
+ */
+struct pooled_kadm_handle {
+    char *realm;
+    void *handle;
+    time_t created;
+};
+
+struct thread_state {
+    krb5_context context;
+    struct pooled_kadm_handle handles[KADM_HANDLE_POOL_SIZE];
+};
+
+static struct thread_state *
+get_thread_state(void)
+{
+    return pthread_getspecific(k5ctx);
+}
+
 static krb5_error_code
 get_krb5_context(krb5_context *contextp)
 {
+    struct thread_state *ts;
     krb5_error_code ret;
 
-    if ((*contextp = pthread_getspecific(k5ctx)))
+    if ((ts = get_thread_state())) {
+        *contextp = ts->context;
         return 0;
+    }
 
-    ret = krb5_init_context(contextp);
+    *contextp = NULL;
+    if ((ts = calloc(1, sizeof(*ts))) == NULL)
+        return ENOMEM;
+    ret = krb5_init_context(&ts->context);
     /* XXX krb5_set_log_dest(), warn_dest, debug_dest */
     if (ret == 0)
-        (void) pthread_setspecific(k5ctx, *contextp);
-    return ret;
+        ret = pthread_setspecific(k5ctx, ts);
+    if (ret) {
+        if (ts->context)
+            krb5_free_context(ts->context);
+        free(ts);
+        return ret;
+    }
+    *contextp = ts->context;
+    return 0;
+}
+
+static void
+drop_pooled_kadm_handle(struct pooled_kadm_handle *h)
+{
+    kadm5_destroy(h->handle);
+    free(h->realm);
+    h->handle = NULL;
+    h->realm = NULL;
 }
 
 static int port = -1;
@@ -302,6 +352,9 @@ static int verbose_counter;
 static int version_flag;
 static int reverse_proxied_flag;
 static int thread_per_client_flag;
+static int thread_pool_size;
+static int kadm_handle_lifetime = 300;
+static int keytab_cache_ttl = 60;
 struct getarg_strings audiences;
 static const char *cert_file;
 static const char *priv_key_file;
@@ -409,6 +462,76 @@ out:
     return ret;
 }
 
+/*
+ * Get a read-only kadm5 handle for a request from the thread's pool, or
+ * make one and add it to the pool.  Handles are replaced after
+ * --kadmin-handle-lifetime seconds, and after requests that failed.
+ *
+ * Does NOT set an HTTP response.
+ */
+static krb5_error_code
+get_pooled_kadm_handle(kadmin_request_desc r, const char *want_realm)
+{
+    struct thread_state *ts = get_thread_state();
+    struct pooled_kadm_handle *h, *free_slot = NULL;
+    const char *name = want_realm ? want_realm : "";
+    time_t now = time(NULL);
+    krb5_error_code ret;
+    size_t i;
+
+    r->kadm_handle_pooled = 0;
+    if (ts == NULL || kadm_handle_lifetime <= 0)
+        return get_kadm_handle(r->context, want_realm, 0 /* want_write */,
+                               &r->kadm_handle);
+
+    for (i = 0; i < KADM_HANDLE_POOL_SIZE; i++) {
+        h = &ts->handles[i];
+        if (h->handle && now - h->created >= kadm_handle_lifetime)
+            drop_pooled_kadm_handle(h);
+        if (h->handle == NULL) {
+            if (free_slot == NULL)
+                free_slot = h;
+            continue;
+        }
+        if (strcmp(h->realm, name) == 0) {
+            r->kadm_handle = h->handle;
+            r->kadm_handle_pooled = 1;
+            return 0;
+        }
+    }
+
+    ret = get_kadm_handle(r->context, want_realm, 0 /* want_write */,
+                          &r->kadm_handle);
+    if (ret || free_slot == NULL ||
+        (free_slot->realm = strdup(name)) == NULL)
+        return ret; /* Not pooled, but usable */
+    free_slot->handle = r->kadm_handle;
+    free_slot->created = now;
+    r->kadm_handle_pooled = 1;
+    return 0;
+}
+
+/* Release a request's kadm5 handle */
+static void
+put_kadm_handle(kadmin_request_desc r)
+{
+    struct thread_state *ts = get_thread_state();
+    size_t i;
+
+    if (r->kadm_handle == NULL)
+        return;
+    if (!r->kadm_handle_pooled) {
+        kadm5_destroy(r->kadm_handle);
+    } else if (r->failed && ts) {
+        /* It may be the handle's fault, e.g., a dead kadmind connection */
+        for (i = 0; i < KADM_HANDLE_POOL_SIZE; i++)
+            if (ts->handles[i].handle == r->kadm_handle)
+                drop_pooled_kadm_handle(&ts->handles[i]);
+    }
+    r->kadm_handle = NULL;
+    r->kadm_handle_pooled = 0;
+}
+
 static krb5_error_code resp(kadmin_request_desc, int, krb5_error_code,
                             enum MHD_ResponseMemoryMode, const char *,
                             const void *, size_t, const char *, const char *);
@@ -485,7 +608,15 @@ validate_token(kadmin_request_desc r)
 static void
 k5_free_context(void *ctx)
 {
-    krb5_free_context(ctx);
+    struct thread_state *ts = ctx;
+    size_t i;
+
+    /* The handles use the context, so they go first */
+    for (i = 0; i < KADM_HANDLE_POOL_SIZE; i++)
+        if (ts->handles[i].handle)
+            drop_pooled_kadm_handle(&ts->handles[i]);
+    krb5_free_context(ts->context);
+    free(ts);
 }
 
 #ifndef HAVE_UNLINKAT
@@ -635,6 +766,8 @@ resp(kadmin_request_desc r,
 
     (void) gettimeofday(&r->tv_end, NULL);
     audit_trail(r, ret);
+    if (http_status_code >= 500)
+        r->failed = 1;
 
     if (body && bodylen == BODYLEN_IS_STRLEN)
         bodylen = strlen(body);
@@ -1157,6 +1290,215 @@ write_keytab(kadmin_request_desc r,
     return ret;
 }
 
+/*
+ * Keytab cache.
+ *
+ * Hosts fetch the keys of their virtual (namespace-derived) service
+ * principals in large waves, e.g., at boot.  Those keys are derived from
+ * the namespace's keys according to its key rotation schedule, and the set
+ * of keys derived for a principal changes only at a few points in each
+ * rotation period (see derive_keys() in lib/hdb/common.c): when a new
+ * period starts, when the previous period's keys are dropped half-way
+ * through it, and when the next period's keys are added three quarters of
+ * the way through it.  So we keep the keys of read-only fetches of virtual
+ * principals in memory until the next quarter period boundary or the
+ * start of a future key rotation, and no longer than --keytab-cache-ttl
+ * seconds.
+ */
+#define KT_CACHE_BUCKETS 4096
+#define KT_CACHE_MAX_ENTRIES 100000
+
+struct kt_cache_ent {
+    struct kt_cache_ent *next;
+    char *name;
+    time_t expires;
+    size_t nkeys;
+    krb5_kvno *kvnos;
+    krb5_keyblock *keys;
+};
+
+static struct kt_cache_ent *kt_cache[KT_CACHE_BUCKETS];
+static size_t kt_cache_nentries;
+static pthread_mutex_t kt_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+kt_cache_ent_free(struct kt_cache_ent *e)
+{
+    size_t i;
+
+    for (i = 0; i < e->nkeys; i++)
+        krb5_free_keyblock_contents(NULL, &e->keys[i]);
+    free(e->keys);
+    free(e->kvnos);
+    free(e->name);
+    free(e);
+}
+
+static struct kt_cache_ent **
+kt_cache_bucket(const char *name)
+{
+    uint32_t h = 2166136261U;
+
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 16777619U;
+    return &kt_cache[h % KT_CACHE_BUCKETS];
+}
+
+/* Drop the expired entries of a bucket.  Call with kt_cache_lock held. */
+static void
+kt_cache_expire(struct kt_cache_ent **ep, time_t now)
+{
+    struct kt_cache_ent *e;
+
+    while ((e = *ep) != NULL) {
+        if (e->expires > now) {
+            ep = &e->next;
+            continue;
+        }
+        *ep = e->next;
+        kt_cache_ent_free(e);
+        kt_cache_nentries--;
+    }
+}
+
+/*
+ * Until when may the keys of `princ' be cached?  Returns 0 if they may
+ * not be.
+ */
+static time_t
+kt_cache_expiry(kadm5_principal_ent_rec *princ, time_t now)
+{
+    HDB_Ext_KeyRotation kr;
+    krb5_tl_data *tl;
+    time_t expires = now + keytab_cache_ttl;
+    size_t i;
+
+    if (!(princ->attributes & (KRB5_KDB_VIRTUAL_KEYS | KRB5_KDB_VIRTUAL)))
+        return 0;
+    for (tl = princ->tl_data; tl; tl = tl->tl_data_next)
+        if (tl->tl_data_type == KRB5_TL_KEY_ROTATION)
+            break;
+    if (tl == NULL ||
+        decode_HDB_Ext_KeyRotation(tl->tl_data_contents, tl->tl_data_length,
+                                   &kr, NULL))
+        return 0;
+    for (i = 0; i < kr.len; i++) {
+        const KeyRotation *krp = &kr.val[i];
+        time_t q;
+
+        if (krp->epoch > now) {
+            if (krp->epoch < expires)
+                expires = krp->epoch;
+            continue;
+        }
+        if ((q = krp->period / 4) < 1)
+            q = 1;
+        q = krp->epoch + ((now - krp->epoch) / q + 1) * q;
+        if (q < expires)
+            expires = q;
+    }
+    free_HDB_Ext_KeyRotation(&kr);
+    return expires > now ? expires : 0;
+}
+
+static void
+kt_cache_put(kadmin_request_desc r,
+             const char *name,
+             kadm5_principal_ent_rec *princ)
+{
+    struct kt_cache_ent *e, **ep;
+    time_t now = time(NULL);
+    size_t i;
+
+    if (keytab_cache_ttl <= 0 || princ->n_key_data <= 0 ||
+        kadm5_some_keys_are_bogus(princ->n_key_data, &princ->key_data[0]))
+        return;
+    if ((e = calloc(1, sizeof(*e))) == NULL)
+        return;
+    e->expires = kt_cache_expiry(princ, now);
+    e->name = strdup(name);
+    e->kvnos = calloc(princ->n_key_data, sizeof(e->kvnos[0]));
+    e->keys = calloc(princ->n_key_data, sizeof(e->keys[0]));
+    if (e->expires == 0 || e->name == NULL || e->kvnos == NULL ||
+        e->keys == NULL) {
+        kt_cache_ent_free(e);
+        return;
+    }
+    for (i = 0; i < princ->n_key_data; i++) {
+        krb5_key_data *kd = &princ->key_data[i];
+
+        e->kvnos[i] = kd->key_data_kvno;
+        e->keys[i].keytype = kd->key_data_type[0];
+        if (krb5_data_copy(&e->keys[i].keyvalue, kd->key_data_contents[0],
+                           kd->key_data_length[0])) {
+            kt_cache_ent_free(e);
+            return;
+        }
+        e->nkeys++;
+    }
+
+    pthread_mutex_lock(&kt_cache_lock);
+    ep = kt_cache_bucket(name);
+    kt_cache_expire(ep, now);
+    if (kt_cache_nentries < KT_CACHE_MAX_ENTRIES) {
+        e->next = *ep;
+        *ep = e;
+        kt_cache_nentries++;
+        e = NULL;
+    }
+    pthread_mutex_unlock(&kt_cache_lock);
+    if (e)
+        kt_cache_ent_free(e);
+}
+
+/*
+ * Write the cached keys of `p' to the request's keytab, if we have them.
+ * Returns ENOENT if we don't.
+ */
+static krb5_error_code
+kt_cache_get(kadmin_request_desc r, const char *name, krb5_principal p)
+{
+    struct kt_cache_ent *e, **ep;
+    krb5_keytab_entry *entries = NULL;
+    krb5_error_code ret = ENOENT;
+    time_t now = time(NULL);
+    size_t i, n = 0;
+
+    if (keytab_cache_ttl <= 0)
+        return ENOENT;
+
+    pthread_mutex_lock(&kt_cache_lock);
+    ep = kt_cache_bucket(name);
+    kt_cache_expire(ep, now);
+    for (e = *ep; e; e = e->next)
+        if (strcmp(e->name, name) == 0)
+            break;
+    /* Copy the keys out so we don't write the keytab holding the lock */
+    if (e && (entries = calloc(e->nkeys, sizeof(entries[0])))) {
+        for (n = 0; n < e->nkeys; n++) {
+            entries[n].principal = p;
+            entries[n].vno = e->kvnos[n];
+            entries[n].timestamp = now;
+            if (krb5_copy_keyblock_contents(r->context, &e->keys[n],
+                                            &entries[n].keyblock))
+                break;
+        }
+        if (n == e->nkeys)
+            ret = 0;
+    }
+    pthread_mutex_unlock(&kt_cache_lock);
+
+    for (i = 0; ret == 0 && i < n; i++)
+        ret = krb5_kt_add_entry(r->context, r->keytab, &entries[i]);
+    if (ret && ret != ENOENT)
+        krb5_warn(r->context, ret,
+                  "Failed to write cached keytab entries for %s", name);
+    for (i = 0; i < n; i++)
+        krb5_free_keyblock_contents(r->context, &entries[i].keyblock);
+    free(entries);
+    return ret;
+}
+
 static void
 random_password(krb5_context context, char *buf, size_t buflen)
 {
@@ -1212,6 +1554,7 @@ get_keys1(kadmin_request_desc r, const char *pname)
     krb5_key_salt_tuple *kstuple = NULL;
     krb5_error_code ret = 0;
     krb5_principal p = NULL;
+    char *name = NULL;
     uint32_t mask =
         KADM5_PRINCIPAL | KADM5_KVNO | KADM5_MAX_LIFE | KADM5_MAX_RLIFE |
         KADM5_ATTRIBUTES | KADM5_KEY_DATA | KADM5_TL_DATA;
@@ -1230,6 +1573,18 @@ get_keys1(kadmin_request_desc r, const char *pname)
         ret = krb5_principal_set_realm(r->context, p, r->realm);
     else if (ret == 0 && realm)
         ret = krb5_principal_set_realm(r->context, p, realm);
+    if (ret == 0)
+        ret = krb5_unparse_name(r->context, p, &name);
+    /*
+     * Cached keys are only ever those of virtual principals, for which
+     * rotation requests are ignored unless materializing.
+     */
+    if (ret == 0 && !r->materialize &&
+        kt_cache_get(r, name, p) == 0) {
+        krb5_free_principal(r->context, p);
+        free(name);
+        return 0;
+    }
     if (ret == 0 && r->enctypes)
         ret = krb5_string_to_keysalts2(r->context, r->enctypes,
                                        &nkstuple, &kstuple);
@@ -1261,8 +1616,7 @@ get_keys1(kadmin_request_desc r, const char *pname)
             ret = strcmp(r->method, "POST") == 0 ? 0 : ENOSYS; /* XXX */
         if (ret == 0 && local_hdb && local_hdb_read_only) {
             /* Make sure we can write */
-            kadm5_destroy(r->kadm_handle);
-            r->kadm_handle = NULL;
+            put_kadm_handle(r);
             ret = get_kadm_handle(r->context, r->realm, 1 /* want_write */,
                                   &r->kadm_handle);
         }
@@ -1298,8 +1652,7 @@ get_keys1(kadmin_request_desc r, const char *pname)
             ret = strcmp(r->method, "POST") == 0 ? 0 : ENOSYS; /* XXX */
         if (ret == 0 && local_hdb && local_hdb_read_only) {
             /* Make sure we can write */
-            kadm5_destroy(r->kadm_handle);
-            r->kadm_handle = NULL;
+            put_kadm_handle(r);
             ret = get_kadm_handle(r->context, r->realm, 1 /* want_write */,
                                   &r->kadm_handle);
         }
@@ -1336,8 +1689,7 @@ get_keys1(kadmin_request_desc r, const char *pname)
             ret = strcmp(r->method, "POST") == 0 ? 0 : ENOSYS; /* XXX */
         if (ret == 0 && local_hdb && local_hdb_read_only) {
             /* Make sure we can write */
-            kadm5_destroy(r->kadm_handle);
-            r->kadm_handle = NULL;
+            put_kadm_handle(r);
             ret = get_kadm_handle(r->context, r->realm, 1 /* want_write */,
                                   &r->kadm_handle);
         }
@@ -1369,9 +1721,12 @@ get_keys1(kadmin_request_desc r, const char *pname)
 
     if (ret == 0)
         ret = write_keytab(r, &princ, pname);
+    if (ret == 0 && !refetch && !change && !r->materialize)
+        kt_cache_put(r, name, &princ);
     if (freeit)
         kadm5_free_principal_ent(r->kadm_handle, &princ);
     krb5_free_principal(r->context, p);
+    free(name);
     return ret;
 }
 
@@ -1396,8 +1751,7 @@ get_keysN(kadmin_request_desc r, const char *method)
     if (ret)
         return ret; /* authorize_req() calls bad_req() on error */
 
-    ret = get_kadm_handle(r->context, r->realm ? r->realm : realm,
-                          0 /* want_write */, &r->kadm_handle);
+    ret = get_pooled_kadm_handle(r, r->realm ? r->realm : realm);
 
     if (strcmp(method, "POST") == 0 && (ret = check_csrf(r)))
         return ret; /* check_csrf() calls bad_req() on error */
@@ -1586,8 +1940,7 @@ clean_req_desc(kadmin_request_desc r)
         krb5_kt_destroy(r->context, r->keytab);
     else if (r->keytab_name && strchr(r->keytab_name, ':'))
         (void) unlink(strchr(r->keytab_name, ':') + 1);
-    if (r->kadm_handle)
-        kadm5_destroy(r->kadm_handle);
+    put_kadm_handle(r);
     hx509_request_free(&r->req);
     heim_release(r->service_names);
     heim_release(r->hostnames);
@@ -1642,8 +1995,7 @@ get_config(kadmin_request_desc r)
      * authentication (above).
      */
 
-    ret = get_kadm_handle(r->context, r->realm ? r->realm : realm,
-                          0 /* want_write */, &r->kadm_handle);
+    ret = get_pooled_kadm_handle(r, r->realm ? r->realm : realm);
 
     memset(&princ, 0, sizeof(princ));
     princ.key_data = NULL;
@@ -1701,8 +2053,7 @@ mac_csrf_token(kadmin_request_desc r, krb5_storage *sp)
     memset(&princ, 0, sizeof(princ));
     ret = krb5_storage_to_data(sp, &data);
     if (r->kadm_handle == NULL)
-        ret = get_kadm_handle(r->context, r->realm, 0 /* want_write */,
-                              &r->kadm_handle);
+        ret = get_pooled_kadm_handle(r, r->realm);
     if (ret == 0)
         ret = krb5_make_principal(r->context, &p,
                                   r->realm ? r->realm : realm,
@@ -1949,6 +2300,14 @@ static struct getargs args[] = {
     { "private-key", 0, arg_string, &priv_key_file,
         "private key file path (PEM)", "HX509-STORE" },
     { "thread-per-client", 't', arg_flag, &thread_per_client_flag, "thread per-client", NULL },
+    { "thread-pool-size", 0, arg_integer, &thread_pool_size,
+        "serve requests with a pool of this many threads", "NUMBER" },
+    { "kadmin-handle-lifetime", 0, arg_integer, &kadm_handle_lifetime,
+        "seconds for which threads reuse read-only kadmin handles (0: never)",
+        "SECONDS" },
+    { "keytab-cache-ttl", 0, arg_integer, &keytab_cache_ttl,
+        "maximum seconds to cache virtual principals' keys (0: never)",
+        "SECONDS" },
     { "realm", 0, arg_string, &realm, "realm", "REALM" },
     { "hdb", 0, arg_string, &hdb, "HDB filename", "PATH" },
     { "read-only-admin-server", 0, arg_string, &kadmin_server,
@@ -2203,6 +2562,16 @@ again:
         free(s);
     }
 
+    if (thread_pool_size > 0) {
+        /*
+         * Long-lived threads get more use out of their pooled kadmin
+         * handles than ones that live only as long as a connection.
+         */
+        if (thread_per_client_flag)
+            errx(1, "--thread-per-client and --thread-pool-size are "
+                 "mutually exclusive");
+        flags = MHD_USE_SELECT_INTERNALLY;
+    }
     if (verbose_counter > 1)
         flags |= MHD_USE_DEBUG;
     if (thread_per_client_flag)
@@ -2250,6 +2619,9 @@ again:
                                    MHD_OPTION_SOCK_ADDR, &sin,
                                    MHD_OPTION_CONNECTION_LIMIT, (unsigned int)200,
                                    MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int)10,
+                                   MHD_OPTION_THREAD_POOL_SIZE,
+                                   (unsigned int)(thread_pool_size > 0 ?
+                                                  thread_pool_size : 0),
                                    MHD_OPTION_END);
     } else if (sock != MHD_INVALID_SOCKET) {
         /*
@@ -2263,6 +2635,9 @@ again:
                                    MHD_OPTION_HTTPS_MEM_CERT, cert_pem,
                                    MHD_OPTION_CONNECTION_LIMIT, (unsigned int)200,
                                    MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int)10,
+                                   MHD_OPTION_THREAD_POOL_SIZE,
+                                   (unsigned int)(thread_pool_size > 0 ?
+                                                  thread_pool_size : 0),
                                    MHD_OPTION_LISTEN_SOCKET, sock,
                                    MHD_OPTION_END);
         sock = MHD_INVALID_SOCKET;
@@ -2274,6 +2649,9 @@ again:
                                    MHD_OPTION_HTTPS_MEM_CERT, cert_pem,
                                    MHD_OPTION_CONNECTION_LIMIT, (unsigned int)200,
                                    MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int)10,
+                                   MHD_OPTION_THREAD_POOL_SIZE,
+                                   (unsigned int)(thread_pool_size > 0 ?
+                                                  thread_pool_size : 0),
                                    MHD_OPTION_END);
     }
     if (current == NULL)
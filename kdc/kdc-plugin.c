@@ -255,6 +255,12 @@ _kdc_finalize_reply(astgs_request_t r)
     return ret;
 }
 
+krb5_boolean
+_kdc_have_plugin(void)
+{
+    return have_plugin;
+}
+
 static krb5_error_code KRB5_LIB_CALL
 audit(krb5_context context, const void *plug, void *plugctx, void *userctx)
 {
@@ -35,14 +35,50 @@
 
 static int version_flag;
 static int help_flag;
+static char *mode_str = "check";
+static double speed = 1.0;
+static int workers = 1;
 
 struct getargs args[] = {
+    { "mode",	 'm',	arg_string, &mode_str,
+      "replay mode: check replies, timed (recorded arrival times) or max rate",
+      "check|timed|max" },
+    { "speed",	 's',	arg_double, &speed,
+      "timed mode: replay this many times faster than recorded", "factor" },
+    { "workers", 'w',	arg_integer, &workers,
+      "benchmark modes: number of worker processes", "number" },
     { "version",   0,	arg_flag, &version_flag, NULL, NULL },
     { "help",     'h',	arg_flag, &help_flag,    NULL, NULL }
 };
 
 static const int num_args = sizeof(args) / sizeof(args[0]);
 
+enum replay_mode { MODE_CHECK, MODE_TIMED, MODE_MAX };
+
+struct record {
+    uint32_t t;
+    double when;		/* seconds since the first record */
+    struct sockaddr_storage sa;
+    char astr[80];
+    krb5_data d;
+    uint32_t clty;
+    uint32_t tag;
+    int type;
+};
+
+/* Message types reported on */
+enum { RT_AS, RT_TGS, RT_OTHER, RT_NUM };
+
+static const char *type_names[RT_NUM] = { "AS-REQ", "TGS-REQ", "other" };
+
+struct replay_stats {
+    struct {
+	uint64_t count;
+	uint64_t mismatch;
+	uint64_t usec;
+    } type[RT_NUM];
+};
+
 static void
 usage(int ret)
 {
@@ -50,14 +86,264 @@ usage(int ret)
     exit (ret);
 }
 
+static int
+request_type(const krb5_data *d)
+{
+    Der_class cl;
+    Der_type ty;
+    unsigned int tag;
+
+    if (der_get_tag(d->data, d->length, &cl, &ty, &tag, NULL) != 0 ||
+	cl != ASN1_C_APPL)
+	return RT_OTHER;
+    if (tag == krb_as_req)
+	return RT_AS;
+    if (tag == krb_tgs_req)
+	return RT_TGS;
+    return RT_OTHER;
+}
+
+/*
+ * Load the whole log up front so that the benchmark modes measure the
+ * KDC rather than reading the log.
+ */
+
+static size_t
+read_records(krb5_context context, const char *fn, struct record **precs)
+{
+    struct record *recs = NULL;
+    size_t n = 0, alloc = 0, i, j, k;
+    krb5_error_code ret;
+    krb5_storage *sp;
+    int fd;
+
+    fd = open(fn, O_RDONLY);
+    if (fd < 0)
+	err(1, "open: %s", fn);
+
+    sp = krb5_storage_from_fd(fd);
+    if (sp == NULL)
+	krb5_errx(context, 1, "krb5_storage_from_fd");
+
+    while(1) {
+	struct record *r;
+	krb5_socklen_t salen;
+	krb5_address a;
+	uint32_t t;
+
+	ret = krb5_ret_uint32(sp, &t);
+	if (ret == HEIM_ERR_EOF)
+	    break;
+	else if (ret)
+	    krb5_errx(context, 1, "krb5_ret_uint32(version)");
+	if (t != 1)
+	    krb5_errx(context, 1, "version not 1");
+
+	if (n == alloc) {
+	    alloc = alloc ? alloc * 2 : 64;
+	    recs = erealloc(recs, alloc * sizeof(recs[0]));
+	}
+	r = &recs[n];
+	memset(r, 0, sizeof(*r));
+
+	ret = krb5_ret_uint32(sp, &r->t);
+	if (ret)
+	    krb5_errx(context, 1, "krb5_ret_uint32(time)");
+	ret = krb5_ret_address(sp, &a);
+	if (ret)
+	    krb5_errx(context, 1, "krb5_ret_address");
+	ret = krb5_ret_data(sp, &r->d);
+	if (ret)
+	    krb5_errx(context, 1, "krb5_ret_data");
+	ret = krb5_ret_uint32(sp, &r->clty);
+	if (ret)
+	    krb5_errx(context, 1, "krb5_ret_uint32(class|type)");
+	ret = krb5_ret_uint32(sp, &r->tag);
+	if (ret)
+	    krb5_errx(context, 1, "krb5_ret_uint32(tag)");
+
+	salen = sizeof(r->sa);
+	ret = krb5_addr2sockaddr (context, &a, (struct sockaddr *)&r->sa,
+				  &salen, 88);
+	if (ret == KRB5_PROG_ATYPE_NOSUPP) {
+	    krb5_data_free(&r->d);
+	    krb5_free_address(context, &a);
+	    continue;
+	} else if (ret)
+	    krb5_err(context, 1, ret, "krb5_addr2sockaddr");
+
+	ret = krb5_print_address(&a, r->astr, sizeof(r->astr), NULL);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_print_address");
+	krb5_free_address(context, &a);
+
+	r->type = request_type(&r->d);
+	n++;
+    }
+
+    krb5_storage_free(sp);
+    close(fd);
+
+    /*
+     * Times are only recorded to the second, so spread the requests
+     * of each second evenly over it.
+     */
+    for (i = 0; i < n; i = j) {
+	for (j = i; j < n && recs[j].t == recs[i].t; j++)
+	    ;
+	for (k = i; k < j; k++)
+	    recs[k].when = ((double)recs[k].t - recs[0].t) +
+		(double)(k - i) / (j - i);
+    }
+
+    *precs = recs;
+    return n;
+}
+
+static void
+replay_one(krb5_context context, krb5_kdc_configuration *config,
+	   struct record *rec, struct replay_stats *st, int check)
+{
+    struct timeval tv, start, stop;
+    krb5_error_code ret;
+    krb5_data r;
+    int mismatch = 0;
+
+    if (check)
+	printf("processing request from %s, %lu bytes\n",
+	       rec->astr, (unsigned long)rec->d.length);
+
+    r.length = 0;
+    r.data = NULL;
+
+    tv.tv_sec = rec->t;
+    tv.tv_usec = 0;
+
+    krb5_kdc_update_time(&tv);
+    krb5_set_real_time(context, tv.tv_sec, 0);
+
+    gettimeofday(&start, NULL);
+    ret = krb5_kdc_process_request(context, config,
+				   rec->d.data, rec->d.length,
+				   &r, NULL, rec->astr,
+				   (struct sockaddr *)&rec->sa, 0);
+    gettimeofday(&stop, NULL);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kdc_process_request");
+
+    if (r.length) {
+	Der_class cl;
+	Der_type ty;
+	unsigned int tag2;
+	ret = der_get_tag (r.data, r.length,
+			   &cl, &ty, &tag2, NULL);
+	if (MAKE_TAG(cl, ty, 0) != rec->clty) {
+	    if (check)
+		krb5_errx(context, 1, "class|type mismatch: %d != %d",
+			  (int)MAKE_TAG(cl, ty, 0), (int)rec->clty);
+	    mismatch = 1;
+	} else if (rec->tag != tag2) {
+	    if (check)
+		krb5_errx(context, 1, "tag mismatch");
+	    mismatch = 1;
+	}
+
+	krb5_data_free(&r);
+    } else {
+	if (rec->clty != 0xffffffff) {
+	    if (check)
+		krb5_errx(context, 1, "clty not invalid");
+	    mismatch = 1;
+	} else if (rec->tag != 0xffffffff) {
+	    if (check)
+		krb5_errx(context, 1, "tag not invalid");
+	    mismatch = 1;
+	}
+    }
+
+    timevalsub(&stop, &start);
+    st->type[rec->type].count++;
+    st->type[rec->type].mismatch += mismatch;
+    st->type[rec->type].usec +=
+	(uint64_t)stop.tv_sec * 1000000 + stop.tv_usec;
+}
+
+static double
+elapsed_since(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    timevalsub(&now, start);
+    return now.tv_sec + now.tv_usec / 1000000.0;
+}
+
+/*
+ * Replay every nw'th record starting at w, either back to back or at
+ * the recorded (scaled) arrival times.
+ */
+
+static void
+replay_worker(krb5_context context, krb5_kdc_configuration *config,
+	      struct record *recs, size_t n, int w, int nw,
+	      enum replay_mode mode, struct replay_stats *st)
+{
+    struct timeval start;
+    size_t i;
+
+    gettimeofday(&start, NULL);
+    for (i = w; i < n; i += nw) {
+	if (mode == MODE_TIMED) {
+	    double wait = recs[i].when / speed - elapsed_since(&start);
+
+	    if (wait > 0) {
+		struct timeval tv;
+
+		tv.tv_sec = (time_t)wait;
+		tv.tv_usec = (wait - tv.tv_sec) * 1000000;
+		select(0, NULL, NULL, NULL, &tv);
+	    }
+	}
+	replay_one(context, config, &recs[i], st, mode == MODE_CHECK);
+    }
+}
+
+static void
+print_stats(const struct replay_stats *st, double elapsed)
+{
+    uint64_t count = 0, mismatch = 0;
+    int i;
+
+    printf("time: %.6f\n", elapsed);
+    for (i = 0; i < RT_NUM; i++) {
+	if (st->type[i].count == 0)
+	    continue;
+	printf("%s: %llu requests %.2f req/s, %.1f usec/req, "
+	       "%llu reply mismatches\n", type_names[i],
+	       (unsigned long long)st->type[i].count,
+	       elapsed > 0 ? st->type[i].count / elapsed : 0.0,
+	       (double)st->type[i].usec / st->type[i].count,
+	       (unsigned long long)st->type[i].mismatch);
+	count += st->type[i].count;
+	mismatch += st->type[i].mismatch;
+    }
+    printf("total: %llu requests %.2f req/s, %llu reply mismatches\n",
+	   (unsigned long long)count, elapsed > 0 ? count / elapsed : 0.0,
+	   (unsigned long long)mismatch);
+}
+
 int
 main(int argc, char **argv)
 {
     krb5_error_code ret;
     krb5_context context;
     krb5_kdc_configuration *config;
-    krb5_storage *sp;
-    int fd, optidx = 0;
+    struct replay_stats st;
+    struct record *recs = NULL;
+    struct timeval start;
+    enum replay_mode mode;
+    size_t i, n;
+    int optidx = 0;
 
     setprogname(argv[0]);
 
@@ -72,6 +358,31 @@ main(int argc, char **argv)
 	exit(0);
     }
 
+    argc -= optidx;
+    argv += optidx;
+
+    if (argc != 1)
+	usage(1);
+
+    if (strcmp(mode_str, "check") == 0)
+	mode = MODE_CHECK;
+    else if (strcmp(mode_str, "timed") == 0)
+	mode = MODE_TIMED;
+    else if (strcmp(mode_str, "max") == 0)
+	mode = MODE_MAX;
+    else
+	errx(1, "unknown mode: %s", mode_str);
+    if (speed <= 0)
+	errx(1, "speed must be positive");
+    if (workers < 1 || mode == MODE_CHECK)
+	workers = 1;
+#ifndef HAVE_FORK
+    if (workers > 1) {
+	warnx("no fork(), using a single worker");
+	workers = 1;
+    }
+#endif
+
     ret = krb5_init_context(&context);
     if (ret)
 	errx (1, "krb5_init_context failed to parse configuration file");
@@ -103,107 +414,76 @@ main(int argc, char **argv)
     }
 #endif /* PKINIT */
 
-    if (argc != 2)
-	errx(1, "argc != 2");
-
     printf("kdc replay\n");
 
-    fd = open(argv[1], O_RDONLY);
-    if (fd < 0)
-	err(1, "open: %s", argv[1]);
-
-    sp = krb5_storage_from_fd(fd);
-    if (sp == NULL)
-	krb5_errx(context, 1, "krb5_storage_from_fd");
-
-    while(1) {
-	struct sockaddr_storage sa;
-	krb5_socklen_t salen = sizeof(sa);
-	struct timeval tv;
-	krb5_address a;
-	krb5_data d, r;
-	uint32_t t, clty, tag;
-	char astr[80];
-
-	ret = krb5_ret_uint32(sp, &t);
-	if (ret == HEIM_ERR_EOF)
-	    break;
-	else if (ret)
-	    krb5_errx(context, 1, "krb5_ret_uint32(version)");
-	if (t != 1)
-	    krb5_errx(context, 1, "version not 1");
-	ret = krb5_ret_uint32(sp, &t);
-	if (ret)
-	    krb5_errx(context, 1, "krb5_ret_uint32(time)");
-	ret = krb5_ret_address(sp, &a);
-	if (ret)
-	    krb5_errx(context, 1, "krb5_ret_address");
-	ret = krb5_ret_data(sp, &d);
-	if (ret)
-	    krb5_errx(context, 1, "krb5_ret_data");
-	ret = krb5_ret_uint32(sp, &clty);
-	if (ret)
-	    krb5_errx(context, 1, "krb5_ret_uint32(class|type)");
-	ret = krb5_ret_uint32(sp, &tag);
-	if (ret)
-	    krb5_errx(context, 1, "krb5_ret_uint32(tag)");
-
-
-	ret = krb5_addr2sockaddr (context, &a, (struct sockaddr *)&sa,
-				  &salen, 88);
-	if (ret == KRB5_PROG_ATYPE_NOSUPP)
-	    goto out;
-	else if (ret)
-	    krb5_err(context, 1, ret, "krb5_addr2sockaddr");
-
-	ret = krb5_print_address(&a, astr, sizeof(astr), NULL);
-	if (ret)
-	    krb5_err(context, 1, ret, "krb5_print_address");
-
-	printf("processing request from %s, %lu bytes\n",
-	       astr, (unsigned long)d.length);
-
-	r.length = 0;
-	r.data = NULL;
-
-	tv.tv_sec = t;
-	tv.tv_usec = 0;
-
-	krb5_kdc_update_time(&tv);
-	krb5_set_real_time(context, tv.tv_sec, 0);
-
-	ret = krb5_kdc_process_request(context, config, d.data, d.length,
-				       &r, NULL, astr,
-				       (struct sockaddr *)&sa, 0);
-	if (ret)
-	    krb5_err(context, 1, ret, "krb5_kdc_process_request");
-
-	if (r.length) {
-	    Der_class cl;
-	    Der_type ty;
-	    unsigned int tag2;
-	    ret = der_get_tag (r.data, r.length,
-			       &cl, &ty, &tag2, NULL);
-	    if (MAKE_TAG(cl, ty, 0) != clty)
-		krb5_errx(context, 1, "class|type mismatch: %d != %d",
-			  (int)MAKE_TAG(cl, ty, 0), (int)clty);
-	    if (tag != tag2)
-		krb5_errx(context, 1, "tag mismatch");
-
-	    krb5_data_free(&r);
-	} else {
-	    if (clty != 0xffffffff)
-		krb5_errx(context, 1, "clty not invalid");
-	    if (tag != 0xffffffff)
-		krb5_errx(context, 1, "tag not invalid");
+    n = read_records(context, argv[0], &recs);
+
+    memset(&st, 0, sizeof(st));
+    gettimeofday(&start, NULL);
+
+    if (workers == 1) {
+	replay_worker(context, config, recs, n, 0, 1, mode, &st);
+    } else {
+#ifdef HAVE_FORK
+	/*
+	 * The KDC is not thread safe, so run the workers as processes,
+	 * each replaying a slice of the log, and collect their counters
+	 * over pipes.
+	 */
+	pid_t *pids = ecalloc(workers, sizeof(pids[0]));
+	int *fds = ecalloc(workers, sizeof(fds[0]));
+	int w, j;
+
+	fflush(stdout);
+	for (w = 0; w < workers; w++) {
+	    int p[2];
+
+	    if (pipe(p) < 0)
+		err(1, "pipe");
+	    pids[w] = fork();
+	    if (pids[w] < 0)
+		err(1, "fork");
+	    if (pids[w] == 0) {
+		struct replay_stats wst;
+
+		close(p[0]);
+		memset(&wst, 0, sizeof(wst));
+		replay_worker(context, config, recs, n, w, workers, mode, &wst);
+		if (net_write(p[1], &wst, sizeof(wst)) != sizeof(wst))
+		    _exit(1);
+		_exit(0);
+	    }
+	    close(p[1]);
+	    fds[w] = p[0];
 	}
-
-    out:
-	krb5_data_free(&d);
-	krb5_free_address(context, &a);
+	for (w = 0; w < workers; w++) {
+	    struct replay_stats wst;
+	    int status;
+
+	    if (net_read(fds[w], &wst, sizeof(wst)) != sizeof(wst))
+		memset(&wst, 0, sizeof(wst));
+	    close(fds[w]);
+	    if (waitpid(pids[w], &status, 0) < 0)
+		err(1, "waitpid");
+	    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		errx(1, "replay worker %d failed", w);
+	    for (j = 0; j < RT_NUM; j++) {
+		st.type[j].count += wst.type[j].count;
+		st.type[j].mismatch += wst.type[j].mismatch;
+		st.type[j].usec += wst.type[j].usec;
+	    }
+	}
+	free(fds);
+	free(pids);
+#endif
     }
 
-    krb5_storage_free(sp);
+    if (mode != MODE_CHECK)
+	print_stats(&st, elapsed_since(&start));
+
+    for (i = 0; i < n; i++)
+	krb5_data_free(&recs[i].d);
+    free(recs);
     krb5_free_context(context);
 
     printf("done\n");
@@ -44,6 +44,8 @@ struct perf {
     struct perf *next;
 } *ptop;
 
+#define USEC_PER_SEC 1000000
+
 int detach_from_console = -1;
 int daemon_child = -1;
 int do_bonjour = -1;
@@ -56,6 +58,44 @@ static const char *astr = "0.0.0.0";
 
 static void eval_object(heim_object_t);
 
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/*
+ * Small xorshift generator used to pick mix entries and pool members;
+ * each load worker reseeds it so forked workers do not run in lockstep.
+ */
+
+static uint64_t
+tester_random(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/*
+ * A string value may also be given as an array of strings (a pool),
+ * in which case a random member is used for each evaluation.
+ */
+
+static const char *
+pick_string(heim_object_t o)
+{
+    if (o == NULL)
+	return NULL;
+    if (heim_get_tid(o) == heim_array_get_type_id()) {
+	size_t len = heim_array_get_length(o);
+
+	if (len == 0)
+	    return NULL;
+	o = heim_array_get_value(o, tester_random() % len);
+    }
+    if (heim_get_tid(o) != heim_string_get_type_id())
+	return NULL;
+    return heim_string_get_utf8(o);
+}
+
 
 /*
  *
@@ -140,8 +180,6 @@ perf_stop(struct perf *perf)
 	   (unsigned long)perf->stop.tv_sec,
 	   (unsigned long)perf->stop.tv_usec);
 
-#define USEC_PER_SEC 1000000
-
     if (perf->as_req) {
 	double as_ps = 0.0;
 	as_ps = (perf->as_req * USEC_PER_SEC) / (double)((perf->stop.tv_sec * USEC_PER_SEC) + perf->stop.tv_usec);
@@ -209,7 +247,8 @@ copy_keytab(krb5_context context, krb5_keytab from, krb5_keytab to)
 static void
 eval_kinit(heim_dict_t o)
 {
-    heim_string_t user, password, keytab, fast_armor_cc, pk_user_id, ccache;
+    heim_string_t password, keytab, fast_armor_cc, pk_user_id, ccache;
+    const char *user;
     krb5_get_init_creds_opt *opt;
     krb5_init_creds_context ctx;
     krb5_principal client;
@@ -220,7 +259,7 @@ eval_kinit(heim_dict_t o)
     if (ptop)
 	ptop->as_req++;
 
-    user = heim_dict_get_value(o, HSTR("client"));
+    user = pick_string(heim_dict_get_value(o, HSTR("client")));
     if (user == NULL)
 	krb5_errx(kdc_context, 1, "no client");
 
@@ -232,7 +271,7 @@ eval_kinit(heim_dict_t o)
 
     ccache = heim_dict_get_value(o, HSTR("ccache"));
 
-    ret = krb5_parse_name(kdc_context, heim_string_get_utf8(user), &client);
+    ret = krb5_parse_name(kdc_context, user, &client);
     if (ret)
 	krb5_err(kdc_context, 1, ret, "krb5_unparse_name");
 
@@ -342,18 +381,19 @@ eval_kinit(heim_dict_t o)
 static void
 eval_kgetcred(heim_dict_t o)
 {
-    heim_string_t server, ccache;
+    heim_string_t ccache;
+    const char *server, *impersonate;
     krb5_get_creds_opt opt;
     heim_bool_t nostore;
     krb5_error_code ret;
     krb5_ccache cc = NULL;
-    krb5_principal s;
+    krb5_principal s, imp = NULL;
     krb5_creds *out = NULL;
 
     if (ptop)
 	ptop->tgs_req++;
 
-    server = heim_dict_get_value(o, HSTR("server"));
+    server = pick_string(heim_dict_get_value(o, HSTR("server")));
     if (server == NULL)
 	krb5_errx(kdc_context, 1, "no server");
 
@@ -369,7 +409,7 @@ eval_kgetcred(heim_dict_t o)
     if (ret)
 	krb5_err(kdc_context, 1, ret, "krb5_cc_resolve");
 
-    ret = krb5_parse_name(kdc_context, heim_string_get_utf8(server), &s);
+    ret = krb5_parse_name(kdc_context, server, &s);
     if (ret)
 	krb5_err(kdc_context, 1, ret, "krb5_parse_name");
 
@@ -380,12 +420,25 @@ eval_kgetcred(heim_dict_t o)
     if (heim_bool_val(nostore))
 	krb5_get_creds_opt_add_options(kdc_context, opt, KRB5_GC_NO_STORE);
 
+    /* S4U2Self: "server" is then normally the ccache client itself */
+    impersonate = pick_string(heim_dict_get_value(o, HSTR("impersonate")));
+    if (impersonate) {
+	ret = krb5_parse_name(kdc_context, impersonate, &imp);
+	if (ret)
+	    krb5_err(kdc_context, 1, ret, "krb5_parse_name");
+	ret = krb5_get_creds_opt_set_impersonate(kdc_context, opt, imp);
+	if (ret)
+	    krb5_err(kdc_context, 1, ret, "krb5_get_creds_opt_set_impersonate");
+    }
+
     ret = krb5_get_creds(kdc_context, opt, cc, s, &out);
     if (ret)
 	krb5_err(kdc_context, 1, ret, "krb5_get_creds");
     
     krb5_free_creds(kdc_context, out);
     krb5_free_principal(kdc_context, s);
+    if (imp)
+	krb5_free_principal(kdc_context, imp);
     krb5_get_creds_opt_free(kdc_context, opt);
     krb5_cc_close(kdc_context, cc);
 }
@@ -415,6 +468,402 @@ eval_kdestroy(heim_dict_t o)
 }
 
 
+/*
+ *
+ */
+
+/*
+ * Load generation:
+ *
+ *   { "op" : "load",
+ *     "workers" : 4,		number of concurrent worker processes
+ *     "num" : 10000,		total requests, and/or
+ *     "duration" : 10,		seconds to run for
+ *     "rate" : 2000,		open-loop arrivals/s over all workers
+ *     "histogram" : true,	dump the latency buckets too
+ *     "mix" : [ { "name" : "as", "weight" : 3, "value" : { ... } },
+ *               { "name" : "tgs", "weight" : 1, "value" : { ... } } ] }
+ *
+ * Without "rate" each worker issues requests back to back (closed
+ * loop).  With it, requests are scheduled at fixed intervals and the
+ * latency is measured from the scheduled time, so queueing behind a
+ * slow request is counted rather than hidden.
+ *
+ * The KDC and HDB backends are not thread safe, so concurrency is
+ * provided by forking workers, the same way the KDC itself scales.
+ */
+
+/*
+ * Log-linear latency histogram in microseconds: LAT_SUB buckets per
+ * power of two, so each bucket is within 1/LAT_SUB of its value.
+ */
+
+#define LAT_SUB_BITS	4
+#define LAT_SUB		(1 << LAT_SUB_BITS)
+#define LAT_BUCKETS	(40 * LAT_SUB)
+
+struct lat_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t bucket[LAT_BUCKETS];
+};
+
+struct load_entry {
+    const char *name;
+    heim_object_t value;
+    unsigned long weight;
+};
+
+struct load {
+    struct load_entry *mix;
+    size_t nmix;
+    unsigned long total_weight;
+    uint64_t num;		/* per worker, 0 is unlimited */
+    uint64_t duration;		/* usec, 0 is unlimited */
+    uint64_t interval;		/* usec between arrivals per worker */
+};
+
+static uint64_t
+now_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * USEC_PER_SEC + tv.tv_usec;
+}
+
+static size_t
+lat_bucket(uint64_t v)
+{
+    unsigned shift = 0;
+    size_t b;
+
+    if (v < LAT_SUB)
+	return v;
+    while ((v >> shift) >= 2 * LAT_SUB)
+	shift++;
+    b = (shift + 1) * LAT_SUB + ((v >> shift) - LAT_SUB);
+    return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+/* Upper bound of the values that land in bucket b */
+static uint64_t
+lat_bucket_value(size_t b)
+{
+    unsigned shift;
+
+    if (b < LAT_SUB)
+	return b;
+    shift = b / LAT_SUB - 1;
+    return (((uint64_t)LAT_SUB + b % LAT_SUB + 1) << shift) - 1;
+}
+
+static void
+lat_add(struct lat_hist *h, uint64_t v)
+{
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+	h->max = v;
+    h->bucket[lat_bucket(v)]++;
+}
+
+static void
+lat_merge(struct lat_hist *to, const struct lat_hist *from)
+{
+    size_t i;
+
+    to->count += from->count;
+    to->sum += from->sum;
+    if (from->max > to->max)
+	to->max = from->max;
+    for (i = 0; i < LAT_BUCKETS; i++)
+	to->bucket[i] += from->bucket[i];
+}
+
+static uint64_t
+lat_percentile(const struct lat_hist *h, double p)
+{
+    uint64_t rank, seen = 0;
+    size_t i;
+
+    if (h->count == 0)
+	return 0;
+    rank = (uint64_t)(p * h->count / 100.0);
+    if (rank >= h->count)
+	rank = h->count - 1;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+	seen += h->bucket[i];
+	if (seen > rank)
+	    break;
+    }
+    if (i == LAT_BUCKETS)
+	return h->max;
+    return min(lat_bucket_value(i), h->max);
+}
+
+static void
+lat_print(const char *name, const struct lat_hist *h, uint64_t elapsed,
+	  int histogram)
+{
+    size_t i;
+
+    printf("%s: %llu requests %.2lf req/s\n", name,
+	   (unsigned long long)h->count,
+	   elapsed ? (h->count * (double)USEC_PER_SEC) / elapsed : 0.0);
+    if (h->count == 0)
+	return;
+    printf("%s: latency usec mean %llu p50 %llu p95 %llu p99 %llu "
+	   "p999 %llu max %llu\n", name,
+	   (unsigned long long)(h->sum / h->count),
+	   (unsigned long long)lat_percentile(h, 50.0),
+	   (unsigned long long)lat_percentile(h, 95.0),
+	   (unsigned long long)lat_percentile(h, 99.0),
+	   (unsigned long long)lat_percentile(h, 99.9),
+	   (unsigned long long)h->max);
+    if (!histogram)
+	return;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+	if (h->bucket[i] == 0)
+	    continue;
+	printf("%s:\t<= %llu\t%llu\n", name,
+	       (unsigned long long)lat_bucket_value(i),
+	       (unsigned long long)h->bucket[i]);
+    }
+}
+
+static struct load_entry *
+load_pick(struct load *l)
+{
+    unsigned long w;
+    size_t i;
+
+    if (l->nmix == 1)
+	return &l->mix[0];
+    w = tester_random() % l->total_weight;
+    for (i = 0; i < l->nmix - 1; i++) {
+	if (w < l->mix[i].weight)
+	    break;
+	w -= l->mix[i].weight;
+    }
+    return &l->mix[i];
+}
+
+/*
+ * Run one worker; hists[0] collects all requests and hists[1 + n]
+ * those of mix entry n.
+ */
+
+static void
+load_worker(struct load *l, struct lat_hist *hists)
+{
+    uint64_t start, next, sched, t, i;
+    struct load_entry *e;
+
+    start = next = now_usec();
+    for (i = 0; l->num == 0 || i < l->num; i++) {
+	t = now_usec();
+	if (l->duration && t - start >= l->duration)
+	    break;
+	if (l->interval) {
+	    if (next > t) {
+		struct timeval tv;
+
+		tv.tv_sec = (next - t) / USEC_PER_SEC;
+		tv.tv_usec = (next - t) % USEC_PER_SEC;
+		select(0, NULL, NULL, NULL, &tv);
+	    }
+	    sched = next;
+	    next += l->interval;
+	} else {
+	    sched = t;
+	}
+
+	e = load_pick(l);
+	eval_object(e->value);
+
+	t = now_usec();
+	t = t > sched ? t - sched : 0;
+	lat_add(&hists[0], t);
+	lat_add(&hists[1 + (e - l->mix)], t);
+    }
+}
+
+static void
+eval_load(heim_dict_t o)
+{
+    heim_object_t mix = heim_dict_get_value(o, HSTR("mix"));
+    heim_object_t value = heim_dict_get_value(o, HSTR("value"));
+    heim_number_t n;
+    heim_bool_t hb;
+    struct load l;
+    struct lat_hist *hists;
+    uint64_t start, elapsed, num = 0;
+    size_t i, nhists;
+    int workers = 1, histogram = 0;
+    double rate = 0;
+
+    memset(&l, 0, sizeof(l));
+
+    if ((n = heim_dict_get_value(o, HSTR("workers"))) != NULL)
+	workers = heim_number_get_int(n);
+    if ((n = heim_dict_get_value(o, HSTR("num"))) != NULL)
+	num = heim_number_get_long(n);
+    if ((n = heim_dict_get_value(o, HSTR("duration"))) != NULL)
+	l.duration = heim_number_get_long(n) * USEC_PER_SEC;
+    if ((n = heim_dict_get_value(o, HSTR("rate"))) != NULL)
+	rate = heim_number_get_long(n);
+    if ((hb = heim_dict_get_value(o, HSTR("histogram"))) != NULL)
+	histogram = heim_bool_val(hb);
+
+    heim_assert(workers > 0, "workers > 0");
+    heim_assert(num > 0 || l.duration > 0, "num or duration missing");
+    heim_assert(mix != NULL || value != NULL, "mix or value missing");
+
+#ifndef HAVE_FORK
+    if (workers > 1) {
+	warnx("no fork(), running a single load worker");
+	workers = 1;
+    }
+#endif
+
+    if (mix) {
+	heim_assert(heim_get_tid(mix) == heim_array_get_type_id(),
+		    "mix is not an array");
+	l.nmix = heim_array_get_length(mix);
+	heim_assert(l.nmix > 0, "mix is empty");
+    } else {
+	l.nmix = 1;
+    }
+    l.mix = calloc(l.nmix, sizeof(l.mix[0]));
+    if (l.mix == NULL)
+	errx(1, "out of memory");
+
+    for (i = 0; i < l.nmix; i++) {
+	struct load_entry *e = &l.mix[i];
+	heim_dict_t d;
+
+	if (mix == NULL) {
+	    e->value = value;
+	    e->weight = 1;
+	    e->name = "load";
+	    continue;
+	}
+	d = heim_array_get_value(mix, i);
+	heim_assert(heim_get_tid(d) == heim_dict_get_type_id(),
+		    "mix entry is not a dict");
+	e->value = heim_dict_get_value(d, HSTR("value"));
+	heim_assert(e->value != NULL, "mix entry value missing");
+	n = heim_dict_get_value(d, HSTR("weight"));
+	e->weight = n ? heim_number_get_long(n) : 1;
+	heim_assert(e->weight > 0, "weight > 0");
+	e->name = pick_string(heim_dict_get_value(d, HSTR("name")));
+	if (e->name == NULL && heim_get_tid(e->value) == heim_dict_get_type_id())
+	    e->name = pick_string(heim_dict_get_value(e->value, HSTR("op")));
+	if (e->name == NULL)
+	    e->name = "load";
+	l.total_weight += e->weight;
+    }
+    if (mix == NULL)
+	l.total_weight = 1;
+
+    /* Spread the request count and the arrival rate over the workers */
+    if (num)
+	l.num = (num + workers - 1) / workers;
+    if (rate > 0)
+	l.interval = (uint64_t)(workers * (double)USEC_PER_SEC / rate);
+
+    nhists = l.nmix + 1;
+    hists = calloc(nhists, sizeof(hists[0]));
+    if (hists == NULL)
+	errx(1, "out of memory");
+
+    printf("load: %d worker(s)", workers);
+    if (num)
+	printf(" %llu requests", (unsigned long long)num);
+    if (l.duration)
+	printf(" %llu s", (unsigned long long)(l.duration / USEC_PER_SEC));
+    if (l.interval)
+	printf(" open loop %.0lf req/s", rate);
+    printf("\n");
+    fflush(stdout);
+
+    start = now_usec();
+
+    if (workers == 1) {
+	load_worker(&l, hists);
+    } else {
+#ifdef HAVE_FORK
+	struct lat_hist *wh;
+	pid_t *pids;
+	int *fds, w;
+
+	pids = calloc(workers, sizeof(pids[0]));
+	fds = calloc(workers, sizeof(fds[0]));
+	wh = calloc(nhists, sizeof(wh[0]));
+	if (pids == NULL || fds == NULL || wh == NULL)
+	    errx(1, "out of memory");
+
+	for (w = 0; w < workers; w++) {
+	    int p[2];
+
+	    if (pipe(p) < 0)
+		err(1, "pipe");
+	    pids[w] = fork();
+	    if (pids[w] < 0)
+		err(1, "fork");
+	    if (pids[w] == 0) {
+		close(p[0]);
+		rng_state ^= (uint64_t)(getpid() + 1) * 0x2545f4914f6cdd1dULL;
+		if (rng_state == 0)
+		    rng_state = 1;
+		load_worker(&l, wh);
+		if (net_write(p[1], wh, nhists * sizeof(wh[0])) !=
+		    (ssize_t)(nhists * sizeof(wh[0])))
+		    _exit(1);
+		_exit(0);
+	    }
+	    close(p[1]);
+	    fds[w] = p[0];
+	}
+
+	for (w = 0; w < workers; w++) {
+	    int status;
+
+	    if (net_read(fds[w], wh, nhists * sizeof(wh[0])) !=
+		(ssize_t)(nhists * sizeof(wh[0])))
+		memset(wh, 0, nhists * sizeof(wh[0]));
+	    close(fds[w]);
+	    if (waitpid(pids[w], &status, 0) < 0)
+		err(1, "waitpid");
+	    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		errx(1, "load worker %d failed", w);
+	    for (i = 0; i < nhists; i++)
+		lat_merge(&hists[i], &wh[i]);
+	}
+	free(wh);
+	free(fds);
+	free(pids);
+#endif
+    }
+
+    elapsed = now_usec() - start;
+
+    printf("time: %llu.%06llu\n",
+	   (unsigned long long)(elapsed / USEC_PER_SEC),
+	   (unsigned long long)(elapsed % USEC_PER_SEC));
+    lat_print("total", &hists[0], elapsed, histogram);
+    if (l.nmix > 1) {
+	for (i = 0; i < l.nmix; i++)
+	    lat_print(l.mix[i].name, &hists[1 + i], elapsed, histogram);
+    }
+    fflush(stdout);
+
+    free(hists);
+    free(l.mix);
+}
+
 /*
  *
  */
@@ -445,6 +894,8 @@ eval_object(heim_object_t o)
 	    eval_kgetcred(o);
 	} else if (strcmp(op, "kdestroy") == 0) {
 	    eval_kdestroy(o);
+	} else if (strcmp(op, "load") == 0) {
+	    eval_load(o);
 	} else {
 	    errx(1, "unsupported ops %s", op);
 	}
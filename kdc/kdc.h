@@ -101,6 +101,8 @@ typedef struct krb5_kdc_configuration {
     char **pkinit_kdc_cert_pool;
     char **pkinit_kdc_revoke;
     int pkinit_dh_min_bits;
+    int pkinit_key_pool_size;
+    int pkinit_verify_cache_lifetime;
     /* XXX Turn these into bit-fields */
     int pkinit_require_binding;
     int pkinit_allow_proxy_certs;
@@ -118,6 +120,7 @@ typedef struct krb5_kdc_configuration {
 
     int enable_gss_preauth;
     int enable_gss_auth_data;
+    int gss_preauth_context_cache;
     gss_OID_set gss_mechanisms_allowed;
     gss_OID_set gss_cross_realm_mechanisms_allowed;
 
@@ -126,6 +129,38 @@ typedef struct krb5_kdc_configuration {
     int enable_kx509;
 
     const char *app;
+
+    krb5_boolean audit_stage_timing;
+
+    unsigned int preauth_failure_burst;
+    unsigned int preauth_failure_address_burst;
+    unsigned int preauth_failure_rate;
+
+    unsigned int tgs_replay_cache_size;
+    unsigned int tgs_ticket_cache_size;
+
+    unsigned int realm_cache_size;
+    time_t realm_cache_ttl;
+
+    unsigned int hot_keys;
+    time_t hot_keys_half_life;
+
+    krb5_boolean hdb_keep_open;
+    struct kdc_db_state *db_state;
+    int num_db_state;
+
+    unsigned int hdb_cache_size;
+    time_t hdb_cache_lifetime;
+    struct kdc_entry_cache *entry_cache;
+
+    unsigned int hdb_negative_cache_size;
+    time_t hdb_negative_cache_lifetime;
+    struct kdc_entry_cache *negative_cache;
+
+    struct kdc_etype_info_cache *etype_info_cache;
+
+    krb5_boolean hdb_prewarm;
+    char **hdb_prewarm_principals;
 } krb5_kdc_configuration;
 
 #define ASTGS_REQUEST_DESC_COMMON_ELEMENTS			\
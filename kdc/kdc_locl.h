@@ -43,6 +43,20 @@
 typedef struct pk_client_params pk_client_params;
 typedef struct gss_client_params gss_client_params;
 
+/* One lookup of a batch for _kdc_db_fetch_multi() */
+struct kdc_db_fetch {
+    krb5_const_principal principal;
+    unsigned flags;
+    krb5uint32 *kvno_ptr;
+    HDB **db;
+    hdb_entry_ex **h;
+    krb5_error_code ret;
+};
+
+/* A cache shared by the worker processes, see shm_cache.c */
+struct kdc_shm_cache;
+#define KDC_SHM_CACHE_NOREPLACE	0x1
+
 #include <kdc-private.h>
 
 #define FAST_EXPIRATION_TIME (3 * 60)
@@ -66,6 +80,23 @@ struct kdc_request_desc {
 
 struct kdc_patypes;
 
+/*
+ * Request processing stages whose latency is added to the audit trail
+ * when [kdc] audit-stage-timing is enabled, see _kdc_stage_end().
+ */
+enum kdc_stage {
+    KDC_STAGE_DECODE = 0,
+    KDC_STAGE_CLIENT_FETCH,
+    KDC_STAGE_SERVER_FETCH,
+    KDC_STAGE_KRBTGT_FETCH,
+    KDC_STAGE_UNSEAL,
+    KDC_STAGE_PREAUTH,
+    KDC_STAGE_PAC,
+    KDC_STAGE_ENCRYPT,
+    KDC_STAGE_ENCODE,
+    KDC_STAGE_MAX
+};
+
 struct astgs_request_desc {
     ASTGS_REQUEST_DESC_COMMON_ELEMENTS;
 
@@ -92,6 +123,10 @@ struct astgs_request_desc {
     Key *armor_key;
 
     KDCFastState fast;
+
+    /* Time spent in each enum kdc_stage */
+    struct timeval stage_time[KDC_STAGE_MAX];
+    unsigned int stages_timed;
 };
 
 typedef struct kx509_req_context_desc {
@@ -112,13 +147,24 @@ typedef struct kx509_req_context_desc {
 #undef heim_pcontext
 
 extern sig_atomic_t exit_flag;
+extern sig_atomic_t hot_keys_flag;
+extern sig_atomic_t reload_flag;
 extern size_t max_request_udp;
 extern size_t max_request_tcp;
+extern unsigned int max_tcp_requests;
+extern unsigned int max_tcp_connections;
+extern unsigned int max_tcp_connections_per_addr;
+extern unsigned int shed_queue_depth;
 extern const char *request_log;
 extern const char *port_str;
+extern const char *metrics_port_str;
 extern krb5_addresses explicit_addresses;
 
 extern int enable_http;
+extern int reuse_port;
+extern int num_kdc_threads;
+extern int cpu_affinity;
+extern char *config_file;
 
 extern int detach_from_console;
 extern int daemon_child;
@@ -130,6 +176,11 @@ extern const struct units _kdc_digestunits[];
 
 #define KDC_LOG_FILE		"kdc.log"
 
+/* cpu-affinity: placement of worker processes */
+#define KDC_AFFINITY_NONE	0
+#define KDC_AFFINITY_CPU	1
+#define KDC_AFFINITY_NODE	2
+
 extern struct timeval _kdc_now;
 #define kdc_time (_kdc_now.tv_sec)
 
@@ -142,6 +193,9 @@ start_kdc(krb5_context context, krb5_kdc_configuration *config, const char *argv
 krb5_kdc_configuration *
 configure(krb5_context context, int argc, char **argv, int *optidx);
 
+krb5_error_code
+reconfigure(krb5_context context, krb5_kdc_configuration **configp);
+
 #ifdef __APPLE__
 void bonjour_announce(krb5_context, krb5_kdc_configuration *);
 #endif
@@ -405,14 +405,13 @@ _kdc_set_e_text(astgs_request_t r, const char *fmt, ...)
 	__attribute__ ((__format__ (__printf__, 2, 3)))
 {
     va_list ap;
-    char *e_text = NULL;
-    int vasprintf_ret;
+    char *e_text;
 
     va_start(ap, fmt);
-    vasprintf_ret = vasprintf(&e_text, fmt, ap);
+    e_text = _kdc_request_vasprintf((kdc_request_t)r, fmt, ap);
     va_end(ap);
 
-    if (vasprintf_ret < 0 || !e_text) {
+    if (e_text == NULL) {
 	/* not much else to do... */
         kdc_log(r->context, r->config, 1,
                 "Could not set e_text: %s (out of memory)", fmt);
@@ -423,12 +422,10 @@ _kdc_set_e_text(astgs_request_t r, const char *fmt, ...)
     if (r->e_text) {
 	kdc_log(r->context, r->config, 1, "trying to replace e-text: %s\n",
 		e_text);
-	free(e_text);
 	return;
     }
 
     r->e_text = e_text;
-    r->e_text_buf = e_text;
     kdc_log(r->context, r->config, 4, "%s", e_text);
 }
 
@@ -483,7 +480,10 @@ pa_pkinit_validate(astgs_request_t r, const PA_DATA *pa)
     char *client_cert = NULL;
     krb5_error_code ret;
 
+    HEIM_PROBE1(kdc__pkinit__rd__padata__start,
+		_krb5_principal_probe_hash(r->client_princ));
     ret = _kdc_pk_rd_padata(r, pa, &pkp);
+    HEIM_PROBE1(kdc__pkinit__rd__padata__done, ret);
     if (ret || pkp == NULL) {
 	ret = KRB5KRB_AP_ERR_BAD_INTEGRITY;
 	_kdc_r_log(r, 4, "Failed to decode PKINIT PA-DATA -- %s",
@@ -1044,6 +1044,127 @@ pa_used_flag_isset(astgs_request_t r, unsigned int flag)
     return (r->pa_used->flags & flag) == flag;
 }
 
+/*
+ * For a derived-key enctype without padding, such as AES, the
+ * ciphertext is a header, the encrypted plaintext and a trailer, and
+ * can be made in place over a plaintext encoded between the two.  Says
+ * whether `crypto' is one, and how long the header and trailer are.
+ */
+static krb5_boolean
+in_place_lengths(krb5_context context, krb5_crypto crypto,
+		 size_t *hlen, size_t *tlen)
+{
+    size_t plen;
+
+    if (krb5_crypto_length(context, crypto, KRB5_CRYPTO_TYPE_HEADER, hlen) ||
+	krb5_crypto_length(context, crypto, KRB5_CRYPTO_TYPE_PADDING, &plen) ||
+	krb5_crypto_length(context, crypto, KRB5_CRYPTO_TYPE_TRAILER, tlen)) {
+	krb5_clear_error_message(context);
+	return FALSE;
+    }
+    return plen == 0;
+}
+
+/*
+ * Encrypt the `len' bytes at `p + hlen' in place, making `p' the
+ * ciphertext, and fill in the rest of `ed', except ed->cipher.
+ */
+static krb5_error_code
+encrypt_in_place(krb5_context context, krb5_crypto crypto, unsigned usage,
+		 int kvno, unsigned char *p, size_t hlen, size_t len,
+		 size_t tlen, EncryptedData *ed)
+{
+    krb5_crypto_iov iov[3];
+    krb5_error_code ret;
+
+    iov[0].flags = KRB5_CRYPTO_TYPE_HEADER;
+    iov[0].data.data = p;
+    iov[0].data.length = hlen;
+    iov[1].flags = KRB5_CRYPTO_TYPE_DATA;
+    iov[1].data.data = p + hlen;
+    iov[1].data.length = len;
+    iov[2].flags = KRB5_CRYPTO_TYPE_TRAILER;
+    iov[2].data.data = p + hlen + len;
+    iov[2].data.length = tlen;
+    ret = krb5_encrypt_iov_ivec(context, crypto, usage, iov, 3, NULL);
+    if (ret)
+	return ret;
+
+    ret = krb5_crypto_getenctype(context, crypto, &ed->etype);
+    if (ret)
+	return ret;
+    if (kvno) {
+	ALLOC(ed->kvno);
+	if (ed->kvno == NULL)
+	    return krb5_enomem(context);
+	*ed->kvno = kvno;
+    } else
+	ed->kvno = NULL;
+    return 0;
+}
+
+/*
+ * Build the KDC-REP in one buffer.  Its encrypted part comes last in
+ * the encoding, so with the sizes known up front the plaintext is
+ * encoded right where the ciphertext goes, encrypted there, and the
+ * rest of the reply encoded around it (der_put_octet_string() leaves
+ * contents that are already in place alone).
+ */
+static krb5_error_code
+encode_reply_in_place(astgs_request_t r, krb5_crypto crypto, unsigned usage,
+		      int ckvno, size_t hlen, size_t tlen, krb5_data *reply)
+{
+    KDC_REP *rep = &r->rep;
+    EncKDCRepPart *ek = &r->ek;
+    krb5_boolean as_rep = rep->msg_type == krb_as_rep;
+    krb5_boolean as_rep_part = as_rep && !r->config->encode_as_rep_as_tgs_rep;
+    unsigned char *buf, *cipher;
+    size_t len, clen, total, size = 0;
+    krb5_error_code ret;
+
+    len = as_rep_part ? length_EncASRepPart(ek) : length_EncTGSRepPart(ek);
+    clen = hlen + len + tlen;
+
+    rep->enc_part.cipher.data = NULL;
+    rep->enc_part.cipher.length = clen;
+    total = as_rep ? length_AS_REP(rep) : length_TGS_REP(rep);
+    rep->enc_part.cipher.length = 0;
+
+    buf = malloc(total);
+    if (buf == NULL)
+	return krb5_enomem(r->context);
+    cipher = buf + total - clen;
+
+    if (as_rep_part)
+	ret = encode_EncASRepPart(cipher + hlen + len - 1, len, ek, &size);
+    else
+	ret = encode_EncTGSRepPart(cipher + hlen + len - 1, len, ek, &size);
+    if (ret == 0 && size != len)
+	krb5_abortx(r->context, "Internal error in ASN.1 encoder");
+    if (ret == 0)
+	ret = encrypt_in_place(r->context, crypto, usage, ckvno,
+			       cipher, hlen, len, tlen, &rep->enc_part);
+    if (ret == 0) {
+	rep->enc_part.cipher.data = cipher;
+	rep->enc_part.cipher.length = clen;
+	if (as_rep)
+	    ret = encode_AS_REP(buf + total - 1, total, rep, &size);
+	else
+	    ret = encode_TGS_REP(buf + total - 1, total, rep, &size);
+	/* The reply owns the ciphertext */
+	krb5_data_zero(&rep->enc_part.cipher);
+    }
+    if (ret == 0 && size != total)
+	krb5_abortx(r->context, "Internal error in ASN.1 encoder");
+    if (ret) {
+	free(buf);
+	return ret;
+    }
+    reply->data = buf;
+    reply->length = total;
+    return 0;
+}
+
 /*
  *
  */
@@ -1061,41 +1182,60 @@ _kdc_encode_reply(krb5_context context,
     unsigned char *buf;
     size_t buf_size;
     size_t len = 0;
+    size_t size = 0;
+    size_t hlen, tlen;
+    unsigned usage;
     krb5_error_code ret;
     krb5_crypto crypto;
     KDC_REP *rep = &r->rep;
     EncTicketPart *et = &r->et;
     EncKDCRepPart *ek = &r->ek;
+    struct timeval tv;
 
     heim_assert(rep->padata != NULL, "reply padata uninitialized");
 
-    ASN1_MALLOC_ENCODE(EncTicketPart, buf, buf_size, et, &len, ret);
-    if(ret) {
-	const char *msg = krb5_get_error_message(context, ret);
-	kdc_log(context, config, 4, "Failed to encode ticket: %s", msg);
-	krb5_free_error_message(context, msg);
-	return ret;
-    }
-    if(buf_size != len)
-	krb5_abortx(context, "Internal error in ASN.1 encoder");
+    _kdc_stage_start(r, &tv);
 
-    ret = krb5_crypto_init(context, skey, etype, &crypto);
+    ret = krb5_crypto_init_cached(context, skey, etype, &crypto);
     if (ret) {
         const char *msg = krb5_get_error_message(context, ret);
 	kdc_log(context, config, 4, "krb5_crypto_init failed: %s", msg);
 	krb5_free_error_message(context, msg);
-	free(buf);
 	return ret;
     }
 
-    ret = krb5_encrypt_EncryptedData(context,
-				     crypto,
-				     KRB5_KU_TICKET,
-				     buf,
-				     len,
-				     skvno,
-				     &rep->ticket.enc_part);
-    free(buf);
+    if (in_place_lengths(context, crypto, &hlen, &tlen)) {
+	len = length_EncTicketPart(et);
+	buf_size = hlen + len + tlen;
+	buf = malloc(buf_size);
+	if (buf == NULL)
+	    ret = krb5_enomem(context);
+	else
+	    ret = encode_EncTicketPart(buf + hlen + len - 1, len, et, &size);
+	if (ret == 0 && size != len)
+	    krb5_abortx(context, "Internal error in ASN.1 encoder");
+	if (ret == 0)
+	    ret = encrypt_in_place(context, crypto, KRB5_KU_TICKET, skvno,
+				   buf, hlen, len, tlen, &rep->ticket.enc_part);
+	if (ret == 0) {
+	    rep->ticket.enc_part.cipher.data = buf;
+	    rep->ticket.enc_part.cipher.length = buf_size;
+	} else
+	    free(buf);
+    } else {
+	ASN1_MALLOC_ENCODE(EncTicketPart, buf, buf_size, et, &len, ret);
+	if (ret == 0 && buf_size != len)
+	    krb5_abortx(context, "Internal error in ASN.1 encoder");
+	if (ret == 0)
+	    ret = krb5_encrypt_EncryptedData(context,
+					     crypto,
+					     KRB5_KU_TICKET,
+					     buf,
+					     len,
+					     skvno,
+					     &rep->ticket.enc_part);
+	free(buf);
+    }
     krb5_crypto_destroy(context, crypto);
     if(ret) {
 	const char *msg = krb5_get_error_message(context, ret);
@@ -1103,6 +1243,7 @@ _kdc_encode_reply(krb5_context context,
 	krb5_free_error_message(context, msg);
 	return ret;
     }
+    _kdc_stage_end(r, KDC_STAGE_ENCRYPT, &tv);
 
     if (r && r->armor_crypto) {
 	KrbFastFinished finished;
@@ -1171,6 +1312,34 @@ _kdc_encode_reply(krb5_context context,
 	rep->padata = NULL;
     }
 
+    ret = krb5_crypto_init(context, &r->reply_key, 0, &crypto);
+    if (ret) {
+	const char *msg = krb5_get_error_message(context, ret);
+	kdc_log(context, config, 4, "krb5_crypto_init failed: %s", msg);
+	krb5_free_error_message(context, msg);
+	return ret;
+    }
+    if (rep->msg_type == krb_as_rep)
+	usage = KRB5_KU_AS_REP_ENC_PART;
+    else if (rk_is_subkey)
+	usage = KRB5_KU_TGS_REP_ENC_PART_SUB_KEY;
+    else
+	usage = KRB5_KU_TGS_REP_ENC_PART_SESSION;
+
+    if (in_place_lengths(context, crypto, &hlen, &tlen)) {
+	ret = encode_reply_in_place(r, crypto, usage, ckvno, hlen, tlen,
+				    reply);
+	krb5_crypto_destroy(context, crypto);
+	if (ret) {
+	    const char *msg = krb5_get_error_message(context, ret);
+	    kdc_log(context, config, 4, "Failed to encode KDC-REP: %s", msg);
+	    krb5_free_error_message(context, msg);
+	    return ret;
+	}
+	_kdc_stage_end(r, KDC_STAGE_ENCODE, &tv);
+	return 0;
+    }
+
     if(rep->msg_type == krb_as_rep && !config->encode_as_rep_as_tgs_rep)
 	ASN1_MALLOC_ENCODE(EncASRepPart, buf, buf_size, ek, &len, ret);
     else
@@ -1179,43 +1348,28 @@ _kdc_encode_reply(krb5_context context,
 	const char *msg = krb5_get_error_message(context, ret);
 	kdc_log(context, config, 4, "Failed to encode KDC-REP: %s", msg);
 	krb5_free_error_message(context, msg);
+	krb5_crypto_destroy(context, crypto);
 	return ret;
     }
     if(buf_size != len) {
 	free(buf);
+	krb5_crypto_destroy(context, crypto);
 	kdc_log(context, config, 4, "Internal error in ASN.1 encoder");
 	_kdc_set_e_text(r, "KDC internal error");
 	return KRB5KRB_ERR_GENERIC;
     }
-    ret = krb5_crypto_init(context, &r->reply_key, 0, &crypto);
-    if (ret) {
-	const char *msg = krb5_get_error_message(context, ret);
-	free(buf);
-	kdc_log(context, config, 4, "krb5_crypto_init failed: %s", msg);
-	krb5_free_error_message(context, msg);
-	return ret;
-    }
-    if(rep->msg_type == krb_as_rep) {
-	krb5_encrypt_EncryptedData(context,
-				   crypto,
-				   KRB5_KU_AS_REP_ENC_PART,
-				   buf,
-				   len,
-				   ckvno,
-				   &rep->enc_part);
-	free(buf);
+    krb5_encrypt_EncryptedData(context,
+			       crypto,
+			       usage,
+			       buf,
+			       len,
+			       ckvno,
+			       &rep->enc_part);
+    free(buf);
+    if(rep->msg_type == krb_as_rep)
 	ASN1_MALLOC_ENCODE(AS_REP, buf, buf_size, rep, &len, ret);
-    } else {
-	krb5_encrypt_EncryptedData(context,
-				   crypto,
-				   rk_is_subkey ? KRB5_KU_TGS_REP_ENC_PART_SUB_KEY : KRB5_KU_TGS_REP_ENC_PART_SESSION,
-				   buf,
-				   len,
-				   ckvno,
-				   &rep->enc_part);
-	free(buf);
+    else
 	ASN1_MALLOC_ENCODE(TGS_REP, buf, buf_size, rep, &len, ret);
-    }
     krb5_crypto_destroy(context, crypto);
     if(ret) {
 	const char *msg = krb5_get_error_message(context, ret);
@@ -1231,6 +1385,7 @@ _kdc_encode_reply(krb5_context context,
     }
     reply->data = buf;
     reply->length = buf_size;
+    _kdc_stage_end(r, KDC_STAGE_ENCODE, &tv);
     return 0;
 }
 
@@ -1238,6 +1393,22 @@ _kdc_encode_reply(krb5_context context,
  *
  */
 
+/* Append `value', a copy of a cached encoding, to `md', which takes it over */
+static krb5_error_code
+add_cached_padata(METHOD_DATA *md, int type, krb5_data *value)
+{
+    krb5_error_code ret;
+
+    ret = realloc_method_data(md);
+    if (ret) {
+	krb5_data_free(value);
+	return ret;
+    }
+    md->val[md->len - 1].padata_type = type;
+    md->val[md->len - 1].padata_value = *value;
+    return 0;
+}
+
 static krb5_error_code
 make_etype_info_entry(krb5_context context,
 		      ETYPE_INFO_ENTRY *ent,
@@ -1295,11 +1466,15 @@ get_pa_etype_info(krb5_context context,
 		  METHOD_DATA *md, Key *ckey,
 		  krb5_boolean include_salt)
 {
+    krb5_data cached;
     krb5_error_code ret = 0;
     ETYPE_INFO pa;
     unsigned char *buf;
     size_t len;
 
+    if (_kdc_etype_info_cache_get(config, KRB5_PADATA_ETYPE_INFO, ckey,
+				  include_salt, &cached))
+	return add_cached_padata(md, KRB5_PADATA_ETYPE_INFO, &cached);
 
     pa.len = 1;
     pa.val = calloc(1, sizeof(pa.val[0]));
@@ -1316,6 +1491,8 @@ get_pa_etype_info(krb5_context context,
     free_ETYPE_INFO(&pa);
     if(ret)
 	return ret;
+    _kdc_etype_info_cache_add(config, KRB5_PADATA_ETYPE_INFO, ckey,
+			      include_salt, buf, len);
     ret = realloc_method_data(md);
     if(ret) {
 	free(buf);
@@ -1417,11 +1594,16 @@ get_pa_etype_info2(krb5_context context,
 		   METHOD_DATA *md, Key *ckey,
 		   krb5_boolean include_salt)
 {
+    krb5_data cached;
     krb5_error_code ret = 0;
     ETYPE_INFO2 pa;
     unsigned char *buf;
     size_t len;
 
+    if (_kdc_etype_info_cache_get(config, KRB5_PADATA_ETYPE_INFO2, ckey,
+				  include_salt, &cached))
+	return add_cached_padata(md, KRB5_PADATA_ETYPE_INFO2, &cached);
+
     pa.len = 1;
     pa.val = calloc(1, sizeof(pa.val[0]));
     if(pa.val == NULL)
@@ -1437,6 +1619,8 @@ get_pa_etype_info2(krb5_context context,
     free_ETYPE_INFO2(&pa);
     if(ret)
 	return ret;
+    _kdc_etype_info_cache_add(config, KRB5_PADATA_ETYPE_INFO2, ckey,
+			      include_salt, buf, len);
     ret = realloc_method_data(md);
     if(ret) {
 	free(buf);
@@ -2018,33 +2202,6 @@ add_synthetic_princ_ad(astgs_request_t r)
 				       &data);
 }
 
-static krb5_error_code
-get_local_tgs(krb5_context context,
-	      krb5_kdc_configuration *config,
-	      krb5_const_realm realm,
-	      hdb_entry_ex **krbtgt)
-{
-    krb5_error_code ret;
-    krb5_principal tgs_name;
-
-    *krbtgt = NULL;
-
-    ret = krb5_make_principal(context,
-			      &tgs_name,
-			      realm,
-			      KRB5_TGS_NAME,
-			      realm,
-			      NULL);
-    if (ret)
-	return ret;
-
-    ret = _kdc_db_fetch(context, config, tgs_name,
-			HDB_F_GET_KRBTGT, NULL, NULL, krbtgt);
-    krb5_free_principal(context, tgs_name);
-
-    return ret;
-}
-
 /*
  *
  */
@@ -2068,6 +2225,9 @@ _kdc_as_rep(astgs_request_t r)
     const char *msg;
     hdb_entry_ex *krbtgt = NULL;
     Key *krbtgt_key;
+    krb5_principal tgs_name;
+    struct kdc_db_fetch fetch[3];
+    struct timeval tv;
 
     memset(rep, 0, sizeof(*rep));
 
@@ -2137,9 +2297,45 @@ _kdc_as_rep(astgs_request_t r)
 	goto out;
     }
 
-    ret = _kdc_db_fetch(r->context, config, r->client_princ,
-                        HDB_F_GET_CLIENT | HDB_F_SYNTHETIC_OK | flags, NULL,
-                        &r->clientdb, &r->client);
+    /* Turn away password guessing before doing any work for it */
+    if (req->padata && _kdc_preauth_ratelimited(r)) {
+	_kdc_set_const_e_text(r, "Too many failed pre-authentication "
+			      "attempts, try again later");
+	_kdc_audit_setkv_number((kdc_request_t)r, KDC_REQUEST_KV_AUTH_EVENT,
+				KDC_AUTH_EVENT_CLIENT_LOCKED_OUT);
+	ret = KRB5KDC_ERR_CLIENT_REVOKED;
+	goto out;
+    }
+
+    /*
+     * Look up the client, the server and, unless the server is one, the
+     * local krbtgt (for signing authdata) together, so that a remote
+     * database costs one round trip rather than three.
+     */
+    ret = krb5_make_principal(r->context, &tgs_name,
+			      r->server_princ->realm, KRB5_TGS_NAME,
+			      r->server_princ->realm, NULL);
+    if (ret)
+	goto out;
+    memset(fetch, 0, sizeof(fetch));
+    fetch[0].principal = r->client_princ;
+    fetch[0].flags = HDB_F_GET_CLIENT | HDB_F_SYNTHETIC_OK | flags;
+    fetch[0].db = &r->clientdb;
+    fetch[0].h = &r->client;
+    fetch[1].principal = r->server_princ;
+    fetch[1].flags = HDB_F_GET_SERVER | HDB_F_DELAY_NEW_KEYS |
+	flags | (is_tgs ? HDB_F_GET_KRBTGT : 0);
+    fetch[1].h = &r->server;
+    fetch[2].principal = tgs_name;
+    fetch[2].flags = HDB_F_GET_KRBTGT;
+    fetch[2].h = &krbtgt;
+
+    _kdc_stage_start(r, &tv);
+    _kdc_db_fetch_multi(r->context, config, fetch, is_tgs ? 2 : 3);
+    _kdc_stage_end(r, KDC_STAGE_CLIENT_FETCH, &tv);
+    krb5_free_principal(r->context, tgs_name);
+
+    ret = fetch[0].ret;
     switch (ret) {
     case 0:	/* Success */
 	break;
@@ -2179,10 +2375,7 @@ _kdc_as_rep(astgs_request_t r)
 	goto out;
     }
     }
-    ret = _kdc_db_fetch(r->context, config, r->server_princ,
-			HDB_F_GET_SERVER | HDB_F_DELAY_NEW_KEYS |
-			flags | (is_tgs ? HDB_F_GET_KRBTGT : 0),
-			NULL, NULL, &r->server);
+    ret = fetch[1].ret;
     switch (ret) {
     case 0:	/* Success */
 	break;
@@ -2244,16 +2437,20 @@ _kdc_as_rep(astgs_request_t r)
                 }
 		_kdc_audit_addkv((kdc_request_t)r, KDC_AUDIT_VIS, "pa", "%s",
 				 pat[n].name);
+		_kdc_stage_start(r, &tv);
 		ret = pat[n].validate(r, pa);
+		_kdc_stage_end(r, KDC_STAGE_PREAUTH, &tv);
 		if (ret != 0) {
 		    krb5_error_code  ret2;
 		    Key *ckey = NULL;
 		    krb5_boolean default_salt;
 
-		    if (ret != KRB5_KDC_ERR_MORE_PREAUTH_DATA_REQUIRED &&
-			!_kdc_audit_getkv((kdc_request_t)r, KDC_REQUEST_KV_AUTH_EVENT))
-			_kdc_audit_setkv_number((kdc_request_t)r, KDC_REQUEST_KV_AUTH_EVENT,
-						KDC_AUTH_EVENT_PREAUTH_FAILED);
+		    if (ret != KRB5_KDC_ERR_MORE_PREAUTH_DATA_REQUIRED) {
+			_kdc_preauth_failed(r);
+			if (!_kdc_audit_getkv((kdc_request_t)r, KDC_REQUEST_KV_AUTH_EVENT))
+			    _kdc_audit_setkv_number((kdc_request_t)r, KDC_REQUEST_KV_AUTH_EVENT,
+						    KDC_AUTH_EVENT_PREAUTH_FAILED);
+		    }
 
 		    /*
 		     * If there is a client key, send ETYPE_INFO{,2}
@@ -2385,8 +2582,7 @@ _kdc_as_rep(astgs_request_t r)
     if (is_tgs) {
 	krbtgt_key = skey;
     } else {
-	ret = get_local_tgs(r->context, config, r->server_princ->realm,
-			    &krbtgt);
+	ret = fetch[2].ret;
 	if (ret)
 	    goto out;
 
@@ -2480,12 +2676,13 @@ _kdc_as_rep(astgs_request_t r)
         }
     }
 
-    ret = copy_PrincipalName(&rep->cname, &r->et.cname);
-    if (ret)
-	goto out;
-    ret = copy_Realm(&rep->crealm, &r->et.crealm);
-    if (ret)
-	goto out;
+    /*
+     * Much of the ticket and of the encrypted part is the same as the
+     * reply or the request, so they share it rather than copying it;
+     * see the cleanup at the end.
+     */
+    r->et.cname = rep->cname;
+    r->et.crealm = rep->crealm;
 
     {
 	time_t start;
@@ -2551,10 +2748,7 @@ _kdc_as_rep(astgs_request_t r)
 	}
     }
 
-    if(b->addresses){
-	ALLOC(r->et.caddr);
-	copy_HostAddresses(b->addresses, r->et.caddr);
-    }
+    r->et.caddr = b->addresses;
 
     r->et.transited.tr_type = domain_X500_Compress;
     krb5_data_zero(&r->et.transited.contents);
@@ -2606,25 +2800,12 @@ _kdc_as_rep(astgs_request_t r)
 	r->ek.key_expiration = NULL;
     r->ek.flags = r->et.flags;
     r->ek.authtime = r->et.authtime;
-    if (r->et.starttime) {
-	ALLOC(r->ek.starttime);
-	*r->ek.starttime = *r->et.starttime;
-    }
+    r->ek.starttime = r->et.starttime;
     r->ek.endtime = r->et.endtime;
-    if (r->et.renew_till) {
-	ALLOC(r->ek.renew_till);
-	*r->ek.renew_till = *r->et.renew_till;
-    }
-    ret = copy_Realm(&rep->ticket.realm, &r->ek.srealm);
-    if (ret)
-	goto out;
-    ret = copy_PrincipalName(&rep->ticket.sname, &r->ek.sname);
-    if (ret)
-	goto out;
-    if(r->et.caddr){
-	ALLOC(r->ek.caddr);
-	copy_HostAddresses(r->et.caddr, r->ek.caddr);
-    }
+    r->ek.renew_till = r->et.renew_till;
+    r->ek.srealm = rep->ticket.realm;
+    r->ek.sname = rep->ticket.sname;
+    r->ek.caddr = r->et.caddr;
 
     /*
      * Check and session and reply keys
@@ -2642,17 +2823,14 @@ _kdc_as_rep(astgs_request_t r)
 	goto out;
     }
 
-    ret = copy_EncryptionKey(&r->session_key, &r->et.key);
-    if (ret)
-	goto out;
-
-    ret = copy_EncryptionKey(&r->session_key, &r->ek.key);
-    if (ret)
-	goto out;
+    r->et.key = r->session_key;
+    r->ek.key = r->session_key;
 
     /* Add the PAC */
     if (!r->et.flags.anonymous) {
+	_kdc_stage_start(r, &tv);
 	generate_pac(r, skey, krbtgt_key, is_tgs);
+	_kdc_stage_end(r, KDC_STAGE_PAC, &tv);
     }
 
     if (r->client->entry.flags.synthetic) {
@@ -2748,9 +2926,21 @@ out:
     if (r->pa_used && r->pa_used->cleanup)
 	r->pa_used->cleanup(r);
 
+    /* Only what the ticket and encrypted part don't share, see above */
     free_AS_REP(&r->rep);
-    free_EncTicketPart(&r->et);
-    free_EncKDCRepPart(&r->ek);
+    free_TransitedEncoding(&r->et.transited);
+    free(r->et.starttime);
+    free(r->et.renew_till);
+    if (r->et.authorization_data) {
+	free_AuthorizationData(r->et.authorization_data);
+	free(r->et.authorization_data);
+    }
+    free_LastReq(&r->ek.last_req);
+    free(r->ek.key_expiration);
+    if (r->ek.encrypted_pa_data) {
+	free_METHOD_DATA(r->ek.encrypted_pa_data);
+	free(r->ek.encrypted_pa_data);
+    }
     _kdc_free_fast_state(&r->fast);
 
     if (r->client_princ) {
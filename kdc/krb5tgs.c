@@ -505,21 +505,27 @@ fix_transited_encoding(krb5_context context,
 	    free(rs);
 	}
     }
-    if(check_policy) {
-	ret = krb5_check_transited(context, client_realm,
-				   server_realm,
-				   realms, num_realms, NULL);
+    et->transited.tr_type = domain_X500_Compress;
+    ret = krb5_domain_x500_encode(realms, num_realms, &et->transited.contents);
+    if(ret) {
+	krb5_warn(context, ret, "Encoding transited encoding");
+	goto free_realms;
+    }
+    if(check_policy &&
+       !_krb5_transited_cache_find(context, client_realm, server_realm,
+				   &et->transited.contents)) {
+	ret = _kdc_check_transited(context, config, client_realm,
+				   server_realm, realms, num_realms);
 	if(ret) {
 	    krb5_warn(context, ret, "cross-realm %s -> %s",
 		      client_realm, server_realm);
 	    goto free_realms;
 	}
-	et->flags.transited_policy_checked = 1;
+	_krb5_transited_cache_add(context, client_realm, server_realm,
+				  &et->transited.contents);
     }
-    et->transited.tr_type = domain_X500_Compress;
-    ret = krb5_domain_x500_encode(realms, num_realms, &et->transited.contents);
-    if(ret)
-	krb5_warn(context, ret, "Encoding transited encoding");
+    if(check_policy)
+	et->flags.transited_policy_checked = 1;
   free_realms:
     for(i = 0; i < num_realms; i++)
 	free(realms[i]);
@@ -533,7 +539,7 @@ tgs_make_reply(astgs_request_t r,
 	       const EncTicketPart *tgt,
 	       const EncryptionKey *serverkey,
 	       const EncryptionKey *krbtgtkey,
-	       const krb5_keyblock *sessionkey,
+	       krb5_keyblock *sessionkey,
 	       krb5_kvno kvno,
 	       AuthorizationData *auth_data,
 	       hdb_entry_ex *server,
@@ -551,6 +557,7 @@ tgs_make_reply(astgs_request_t r,
     EncKDCRepPart *ek = &r->ek;
     KDCOptions f = b->kdc_options;
     krb5_error_code ret;
+    struct timeval tv;
     int is_weak = 0;
 
     heim_assert(r->client_princ != NULL, "invalid client name passed to tgs_make_reply");
@@ -680,8 +687,13 @@ tgs_make_reply(astgs_request_t r,
     if (!server->entry.flags.proxiable)
 	et->flags.proxiable = 0;
 
-    if (auth_data) {
-	unsigned int i = 0;
+    /*
+     * The caller discards auth_data and sessionkey after this, so the
+     * ticket takes them over rather than copying them.
+     */
+    if (auth_data && auth_data->len) {
+	AuthorizationDataElement *val;
+	unsigned int n = 0;
 
 	/* XXX check authdata */
 
@@ -693,18 +705,24 @@ tgs_make_reply(astgs_request_t r,
 		goto out;
 	    }
 	}
-	for(i = 0; i < auth_data->len ; i++) {
-	    ret = add_AuthorizationData(et->authorization_data, &auth_data->val[i]);
-	    if (ret) {
-		krb5_set_error_message(r->context, ret, "malloc: out of memory");
-		goto out;
-	    }
+	n = et->authorization_data->len;
+	val = realloc(et->authorization_data->val,
+		      (n + auth_data->len) * sizeof(*val));
+	if (val == NULL) {
+	    ret = ENOMEM;
+	    krb5_set_error_message(r->context, ret, "malloc: out of memory");
+	    goto out;
 	}
+	memcpy(val + n, auth_data->val, auth_data->len * sizeof(*val));
+	et->authorization_data->val = val;
+	et->authorization_data->len = n + auth_data->len;
+	free(auth_data->val);
+	auth_data->val = NULL;
+	auth_data->len = 0;
     }
 
-    ret = krb5_copy_keyblock_contents(r->context, sessionkey, &et->key);
-    if (ret)
-	goto out;
+    et->key = *sessionkey;
+    krb5_keyblock_zero(sessionkey);
     et->crealm = rep->crealm;
     et->cname = rep->cname;
 
@@ -763,10 +781,12 @@ tgs_make_reply(astgs_request_t r,
 	    krb5_boolean is_tgs =
 		krb5_principal_is_krbtgt(r->context, server->entry.principal);
 
+	    _kdc_stage_start(r, &tv);
 	    ret = _krb5_kdc_pac_sign_ticket(r->context, r->pac, r->client_princ, serverkey,
 					    krbtgtkey, rodc_id, NULL, r->canon_client_princ,
 					    add_ticket_sig, et,
 					    is_tgs ? &r->pac_attributes : NULL);
+	    _kdc_stage_end(r, KDC_STAGE_PAC, &tv);
 	    if (ret)
 		goto out;
 	}
@@ -847,7 +867,8 @@ tgs_check_authenticator(krb5_context context,
 	kdc_log(context, config, 4,
 		"Failed to verify authenticator checksum: %s", msg);
 	krb5_free_error_message(context, msg);
-    }
+    } else
+	ret = _kdc_tgs_replay_check(context, config, auth);
 out:
     free_Authenticator(auth);
     free(auth);
@@ -873,7 +894,7 @@ need_referral(krb5_context context, krb5_kdc_configuration *config,
 
     kdc_log(context, config, 5, "Searching referral for %s", name);
 
-    return _krb5_get_host_realm_int(context, name, FALSE, realms) == 0;
+    return _kdc_get_host_realm(context, config, name, FALSE, realms) == 0;
 }
 
 static krb5_error_code
@@ -929,6 +950,7 @@ tgs_parse_request(astgs_request_t r,
     const Keys *krbtgt_keys;/* keyset for TGT tkt_vno */
     Key *tkey;
     krb5_keyblock *subkey = NULL;
+    struct timeval tv;
     unsigned usage;
 
     *auth_data = NULL;
@@ -936,7 +958,8 @@ tgs_parse_request(astgs_request_t r,
     *cusec = NULL;
 
     memset(&ap_req, 0, sizeof(ap_req));
-    ret = krb5_decode_ap_req(r->context, &tgs_req->padata_value, &ap_req);
+    ret = _krb5_decode_ap_req_borrowed(r->context, &tgs_req->padata_value,
+				       &ap_req);
     if(ret){
 	const char *msg = krb5_get_error_message(r->context, ret);
 	kdc_log(r->context, config, 4, "Failed to decode AP-REQ: %s", msg);
@@ -957,8 +980,10 @@ tgs_parse_request(astgs_request_t r,
 				       ap_req.ticket.realm);
 
     krbtgt_kvno = ap_req.ticket.enc_part.kvno ? *ap_req.ticket.enc_part.kvno : 0;
+    _kdc_stage_start(r, &tv);
     ret = _kdc_db_fetch(r->context, config, princ, HDB_F_GET_KRBTGT,
 			&krbtgt_kvno, NULL, &r->krbtgt);
+    _kdc_stage_end(r, KDC_STAGE_KRBTGT_FETCH, &tv);
 
     if (ret == HDB_ERR_NOT_FOUND_HERE) {
 	/* XXX Factor out this unparsing of the same princ all over */
@@ -1048,15 +1073,18 @@ next_kvno:
     if (r->config->warn_ticket_addresses)
         verify_ap_req_flags |= KRB5_VERIFY_AP_REQ_IGNORE_ADDRS;
 
-    ret = krb5_verify_ap_req2(r->context,
-			      &ac,
-			      &ap_req,
-			      princ,
-			      &tkey->key,
-			      verify_ap_req_flags,
-			      &ap_req_options,
-			      &r->ticket,
-			      KRB5_KU_TGS_REQ_AUTH);
+    _kdc_stage_start(r, &tv);
+    ret = _kdc_tgt_cache_verify_ap_req(r->context,
+				       &ac,
+				       &ap_req,
+				       princ,
+				       krbtgt_kvno_try,
+				       &tkey->key,
+				       verify_ap_req_flags,
+				       &ap_req_options,
+				       &r->ticket,
+				       KRB5_KU_TGS_REQ_AUTH);
+    _kdc_stage_end(r, KDC_STAGE_UNSEAL, &tv);
     if (r->ticket && r->ticket->ticket.caddr)
         _kdc_audit_addaddrs((kdc_request_t)r, r->ticket->ticket.caddr, "tixaddrs");
     if (r->config->warn_ticket_addresses && ret == KRB5KRB_AP_ERR_BADADDR &&
@@ -1208,7 +1236,7 @@ next_kvno:
     krb5_auth_con_free(r->context, ac);
 
 out:
-    free_AP_REQ(&ap_req);
+    free_AP_REQ_borrowed(&ap_req);
 
     return ret;
 }
@@ -1290,26 +1318,24 @@ eout:
 }
 
 /*
- * This function is intended to be used when failure to find the client is
- * acceptable.
+ * Check the result `ret' of looking up the client `cp' of a TGS request,
+ * freeing `*client' if it may not be used.
  */
-krb5_error_code
-_kdc_db_fetch_client(krb5_context context,
-		     krb5_kdc_configuration *config,
-		     int flags,
-		     krb5_principal cp,
-		     const char *cpn,
-		     const char *krbtgt_realm,
-		     HDB **clientdb,
-		     hdb_entry_ex **client_out)
+static krb5_error_code
+check_client(krb5_context context,
+	     krb5_kdc_configuration *config,
+	     krb5_error_code ret,
+	     krb5_principal cp,
+	     const char *cpn,
+	     const char *krbtgt_realm,
+	     hdb_entry_ex **client)
 {
-    krb5_error_code ret;
-    hdb_entry_ex *client = NULL;
-
-    *client_out = NULL;
+    if (ret && *client) {
+	/* E.g., HDB_ERR_WRONG_REALM comes with a referral entry */
+	_kdc_free_ent(context, *client);
+	*client = NULL;
+    }
 
-    ret = _kdc_db_fetch(context, config, cp, HDB_F_GET_CLIENT | flags,
-			NULL, clientdb, &client);
     if (ret == HDB_ERR_NOT_FOUND_HERE) {
 	/*
 	 * This is OK, we are just trying to find out if they have
@@ -1333,12 +1359,41 @@ _kdc_db_fetch_client(krb5_context context,
 	msg = krb5_get_error_message(context, ret);
 	kdc_log(context, config, 4, "Client not found in database: %s", msg);
 	krb5_free_error_message(context, msg);
-    } else if (client->entry.flags.invalid || !client->entry.flags.client) {
+    } else if ((*client)->entry.flags.invalid || !(*client)->entry.flags.client) {
         kdc_log(context, config, 4, "Client has invalid bit set");
-	_kdc_free_ent(context, client);
+	_kdc_free_ent(context, *client);
+	*client = NULL;
         return KRB5KDC_ERR_POLICY;
     }
 
+    return 0;
+}
+
+/*
+ * This function is intended to be used when failure to find the client is
+ * acceptable.
+ */
+krb5_error_code
+_kdc_db_fetch_client(krb5_context context,
+		     krb5_kdc_configuration *config,
+		     int flags,
+		     krb5_principal cp,
+		     const char *cpn,
+		     const char *krbtgt_realm,
+		     HDB **clientdb,
+		     hdb_entry_ex **client_out)
+{
+    krb5_error_code ret;
+    hdb_entry_ex *client = NULL;
+
+    *client_out = NULL;
+
+    ret = _kdc_db_fetch(context, config, cp, HDB_F_GET_CLIENT | flags,
+			NULL, clientdb, &client);
+    ret = check_client(context, config, ret, cp, cpn, krbtgt_realm, &client);
+    if (ret)
+	return ret;
+
     *client_out = client;
 
     return 0;
@@ -1361,6 +1416,8 @@ tgs_build_reply(astgs_request_t priv,
     char *spn = NULL, *cpn = NULL, *krbtgt_out_n = NULL;
     char *user2user_name = NULL;
     hdb_entry_ex *server = NULL, *client = NULL;
+    krb5_error_code client_ret = 0;
+    int client_fetched = 0;
     hdb_entry_ex *user2user_krbtgt = NULL;
     HDB *clientdb;
     HDB *serverdb = NULL;
@@ -1389,6 +1446,7 @@ tgs_build_reply(astgs_request_t priv,
 
     Key *tkey_sign;
     int flags = HDB_F_FOR_TGS_REQ;
+    struct timeval tv;
 
     int result;
 
@@ -1444,9 +1502,36 @@ server_lookup:
     if (server)
         _kdc_free_ent(context, server);
     server = NULL;
-    ret = _kdc_db_fetch(context, config, priv->server_princ,
-                        HDB_F_GET_SERVER | HDB_F_DELAY_NEW_KEYS | flags,
-			NULL, &serverdb, &server);
+    _kdc_stage_start(priv, &tv);
+    if (!client_fetched) {
+	/*
+	 * The first time around look up the client too, so that a remote
+	 * database costs one round trip rather than two.  The client is
+	 * checked further down.
+	 */
+	struct kdc_db_fetch fetch[2];
+
+	memset(fetch, 0, sizeof(fetch));
+	fetch[0].principal = priv->server_princ;
+	fetch[0].flags = HDB_F_GET_SERVER | HDB_F_DELAY_NEW_KEYS | flags;
+	fetch[0].db = &serverdb;
+	fetch[0].h = &server;
+	fetch[1].principal = priv->client_princ;
+	fetch[1].flags = HDB_F_GET_CLIENT | flags;
+	if (_kdc_synthetic_princ_used_p(context, priv->ticket))
+	    fetch[1].flags |= HDB_F_SYNTHETIC_OK;
+	fetch[1].db = &priv->clientdb;
+	fetch[1].h = &priv->client;
+	_kdc_db_fetch_multi(context, config, fetch, 2);
+	ret = fetch[0].ret;
+	client_ret = fetch[1].ret;
+	client_fetched = 1;
+    } else {
+	ret = _kdc_db_fetch(context, config, priv->server_princ,
+			    HDB_F_GET_SERVER | HDB_F_DELAY_NEW_KEYS | flags,
+			    NULL, &serverdb, &server);
+    }
+    _kdc_stage_end(priv, KDC_STAGE_SERVER_FETCH, &tv);
     priv->server = server;
     if (ret == HDB_ERR_NOT_FOUND_HERE) {
 	kdc_log(context, config, 5, "target %s does not have secrets at this KDC, need to proxy", spn);
@@ -1497,8 +1582,9 @@ server_lookup:
 	} else if ((req_rlm = get_krbtgt_realm(&priv->server_princ->name)) != NULL) {
             if (capath == NULL) {
                 /* With referalls, hierarchical capaths are always enabled */
-                ret2 = _krb5_find_capath(context, tgt->crealm, our_realm,
-                                         req_rlm, TRUE, &capath, &num_capath);
+                ret2 = _kdc_find_capath(context, config, tgt->crealm,
+                                        our_realm, req_rlm, TRUE, &capath,
+                                        &num_capath);
                 if (ret2) {
                     ret = ret2;
                     _kdc_audit_addreason((kdc_request_t)priv,
@@ -1882,16 +1968,15 @@ server_lookup:
 	goto out;
     }
 
-    if (_kdc_synthetic_princ_used_p(context, priv->ticket))
-	flags |= HDB_F_SYNTHETIC_OK;
-
-    ret = _kdc_db_fetch_client(context, config, flags, priv->client_princ,
-			       cpn, our_realm, &clientdb, &client);
+    /* The client was looked up along with the server */
+    _kdc_stage_start(priv, &tv);
+    ret = check_client(context, config, client_ret, priv->client_princ,
+		       cpn, our_realm, &priv->client);
     if (ret)
 	goto out;
-    flags &= ~HDB_F_SYNTHETIC_OK;
-    priv->client = client;
-    priv->clientdb = clientdb;
+    _kdc_stage_end(priv, KDC_STAGE_CLIENT_FETCH, &tv);
+    client = priv->client;
+    clientdb = priv->clientdb;
 
     ret = _kdc_check_pac(context, config, priv->client_princ, NULL,
 			 priv->client, priv->server,
@@ -1899,6 +1984,7 @@ server_lookup:
 			 &priv->ticket_key->key, &priv->ticket_key->key, tgt,
 			 &kdc_issued, &priv->pac, &priv->canon_client_princ,
 			 &priv->pac_attributes);
+    _kdc_stage_end(priv, KDC_STAGE_PAC, &tv);
     if (ret) {
 	const char *msg = krb5_get_error_message(context, ret);
         _kdc_audit_addreason((kdc_request_t)priv, "PAC check failed");
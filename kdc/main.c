@@ -43,6 +43,8 @@
 #endif
 
 sig_atomic_t exit_flag = 0;
+sig_atomic_t hot_keys_flag = 0;
+sig_atomic_t reload_flag = 0;
 
 int detach_from_console = -1;
 int daemon_child = -1;
@@ -59,6 +61,18 @@ sigterm(int sig)
     exit_flag = sig;
 }
 
+static RETSIGTYPE
+sigusr1(int sig)
+{
+    hot_keys_flag = 1;
+}
+
+static RETSIGTYPE
+sighup(int sig)
+{
+    reload_flag = 1;
+}
+
 /*
  * Allow dropping root bit, since heimdal reopens the database all the
  * time the database needs to be owned by the user you are switched
@@ -150,6 +164,14 @@ main(int argc, char **argv)
 	sa.sa_handler = sigchld;
 	sigaction(SIGCHLD, &sa, NULL);
 #endif
+#ifdef SIGUSR1
+	sa.sa_handler = sigusr1;
+	sigaction(SIGUSR1, &sa, NULL);
+#endif
+#ifdef SIGHUP
+	sa.sa_handler = sighup;
+	sigaction(SIGHUP, &sa, NULL);
+#endif
 
 	sa.sa_handler = SIG_IGN;
 #ifdef SIGPIPE
@@ -162,6 +184,12 @@ main(int argc, char **argv)
 #ifdef SIGCHLD
     signal(SIGCHLD, sigchld);
 #endif
+#ifdef SIGUSR1
+    signal(SIGUSR1, sigusr1);
+#endif
+#ifdef SIGHUP
+    signal(SIGHUP, sighup);
+#endif
 #ifdef SIGXCPU
     signal(SIGXCPU, sigterm);
 #endif
@@ -0,0 +1,902 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * KDC metrics: request counters by type and result, request and HDB
+ * fetch latency histograms and the request queue depth.
+ *
+ * The counters live in one anonymous shared mapping that the master
+ * creates before forking its workers, so every worker updates, and
+ * can report, the totals for the whole KDC.  Updating them costs a few
+ * relaxed atomic additions; when metrics are not enabled the hooks
+ * return after a NULL check.
+ *
+ * The hot keys tracker finds the client principals, server principals
+ * and client networks that make the most requests.  For each of these
+ * it keeps a count-min sketch, a few rows of counters indexed by
+ * different hashes of the key whose smallest counter bounds the key's
+ * count from above, and a small table of the keys with the largest
+ * counts seen so far.  Recording a request costs a hash and one atomic
+ * addition per sketch row; the table is only locked when a key's
+ * count exceeds the smallest count in the table, and a busy table is
+ * simply skipped.  All counts are halved every hot-keys-half-life, so
+ * that the table follows current load.  Like the metrics, the tracker
+ * lives in shared memory and covers all worker processes.
+ */
+
+#include "kdc_locl.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#if defined(HAVE_STDATOMIC_H)
+typedef _Atomic uint64_t kdc_counter;
+#define COUNTER_ADD(c, v) atomic_fetch_add_explicit(&(c), (v), memory_order_relaxed)
+#define COUNTER_SUB(c, v) atomic_fetch_sub_explicit(&(c), (v), memory_order_relaxed)
+#define COUNTER_GET(c)    atomic_load_explicit(&(c), memory_order_relaxed)
+#define COUNTER_CAS(c, o, n) counter_cas(&(c), (o), (n))
+static inline int
+counter_cas(kdc_counter *c, uint64_t o, uint64_t n)
+{
+    return atomic_compare_exchange_strong(c, &o, n);
+}
+#elif defined(__GNUC__) && defined(HAVE___SYNC_ADD_AND_FETCH)
+typedef uint64_t kdc_counter;
+#define COUNTER_ADD(c, v) __sync_fetch_and_add(&(c), (v))
+#define COUNTER_SUB(c, v) __sync_fetch_and_sub(&(c), (v))
+#define COUNTER_GET(c)    __sync_fetch_and_add(&(c), 0)
+#define COUNTER_CAS(c, o, n) __sync_bool_compare_and_swap(&(c), (o), (n))
+#else
+/* No atomics: counts may be lost under contention, but nothing worse */
+typedef volatile uint64_t kdc_counter;
+#define COUNTER_ADD(c, v) (((c) += (v)) - (v))
+#define COUNTER_SUB(c, v) ((c) -= (v))
+#define COUNTER_GET(c)    (c)
+#define COUNTER_CAS(c, o, n) ((c) == (o) ? ((c) = (n), 1) : 0)
+#endif
+
+static const char *req_types[] = {
+    "AS-REQ", "TGS-REQ", "DIGEST", "KX509", "unknown"
+};
+#define NUM_REQ_TYPES (sizeof(req_types) / sizeof(req_types[0]))
+
+static const struct {
+    krb5_error_code code;
+    const char *name;
+} results[] = {
+    { 0,				"SUCCESS" },
+    { KRB5KDC_ERR_PREAUTH_REQUIRED,	"PREAUTH_REQUIRED" },
+    { KRB5KDC_ERR_PREAUTH_FAILED,	"PREAUTH_FAILED" },
+    { KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN,	"C_PRINCIPAL_UNKNOWN" },
+    { KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN,	"S_PRINCIPAL_UNKNOWN" },
+    { KRB5KDC_ERR_CLIENT_REVOKED,	"CLIENT_REVOKED" },
+    { KRB5KDC_ERR_KEY_EXPIRED,		"KEY_EXPIRED" },
+    { KRB5KDC_ERR_BADOPTION,		"BADOPTION" },
+    { KRB5KDC_ERR_ETYPE_NOSUPP,		"ETYPE_NOSUPP" },
+    { KRB5KDC_ERR_POLICY,		"POLICY" },
+    { KRB5KRB_AP_ERR_SKEW,		"SKEW" },
+    { KRB5KRB_AP_ERR_BAD_INTEGRITY,	"BAD_INTEGRITY" },
+    { KRB5KRB_AP_ERR_TKT_EXPIRED,	"TKT_EXPIRED" },
+    { KRB5KRB_ERR_RESPONSE_TOO_BIG,	"RESPONSE_TOO_BIG" },
+    { HDB_ERR_NOT_FOUND_HERE,		"NOT_FOUND_HERE" },
+    { ENOMEM,				"ENOMEM" },
+};
+#define NUM_RESULTS (sizeof(results) / sizeof(results[0]) + 1) /* + other */
+
+static const char *shed_reasons[] = {
+    "connections", "address", "queue"
+};
+#define NUM_SHED_REASONS (sizeof(shed_reasons) / sizeof(shed_reasons[0]))
+
+static const char *ratelimit_keys[] = {
+    "client", "address"
+};
+#define NUM_RATELIMIT_KEYS (sizeof(ratelimit_keys) / sizeof(ratelimit_keys[0]))
+
+static const char *db_cache_results[] = { "miss", "hit", "negative" };
+
+/* Histogram bucket upper bounds, in microseconds */
+static const uint64_t bounds[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000
+};
+#define NUM_BUCKETS (sizeof(bounds) / sizeof(bounds[0]) + 1) /* + +Inf */
+
+struct histogram {
+    kdc_counter bucket[NUM_BUCKETS];
+    kdc_counter sum_usec;
+    kdc_counter count;
+};
+
+struct kdc_metrics {
+    kdc_counter requests[NUM_REQ_TYPES][NUM_RESULTS];
+    struct histogram request_time[NUM_REQ_TYPES];
+    struct histogram hdb_fetch_time;
+    kdc_counter queue_depth;
+    kdc_counter shed[NUM_SHED_REASONS];
+    kdc_counter ratelimited[NUM_RATELIMIT_KEYS];
+    kdc_counter db_cache[3];
+    kdc_counter tgs_replay;
+    kdc_counter tgt_cache[2];
+};
+
+static struct kdc_metrics *metrics;
+
+#define HK_DEPTH	4	/* count-min sketch rows */
+#define HK_WIDTH	4096	/* counters per row, a power of two */
+#define HK_TOP_MAX	256	/* most keys tracked of each kind */
+#define HK_NAME_MAX	128
+
+static const struct {
+    const char *metric;
+    const char *label;
+} hk_kinds[] = {
+    { "kdc_hot_client_requests",  "principal" },
+    { "kdc_hot_server_requests",  "principal" },
+    { "kdc_hot_network_requests", "network" },
+};
+#define HK_CLIENT	0
+#define HK_SERVER	1
+#define HK_NETWORK	2
+#define HK_NKINDS	(sizeof(hk_kinds) / sizeof(hk_kinds[0]))
+
+struct hk_slot {
+    uint64_t hash;		/* 0 for an unused slot */
+    uint64_t count;
+    char name[HK_NAME_MAX];
+};
+
+struct hk_kind {
+    kdc_counter sketch[HK_DEPTH][HK_WIDTH];
+    kdc_counter floor;		/* smallest count in a full table */
+    kdc_counter lock;
+    struct hk_slot top[HK_TOP_MAX];
+};
+
+struct hot_keys {
+    unsigned int ntop;
+    int64_t half_life;
+    kdc_counter halved;		/* when the counts were last halved */
+    struct hk_kind kind[HK_NKINDS];
+};
+
+static struct hot_keys *hot;
+
+/**
+ * Enable metrics collection.  Call this before forking worker
+ * processes so that they all share the same counters.
+ *
+ * @param context a Kerberos 5 context
+ *
+ * @return 0 on success, or an error code
+ */
+
+KDC_LIB_FUNCTION krb5_error_code KDC_LIB_CALL
+krb5_kdc_metrics_init(krb5_context context)
+{
+    void *p;
+
+    if (metrics)
+	return 0;
+
+#if defined(HAVE_MMAP) && defined(MAP_SHARED) && defined(MAP_ANON)
+    p = mmap(NULL, sizeof(*metrics), PROT_READ | PROT_WRITE,
+	     MAP_ANON | MAP_SHARED, -1, 0);
+    if (p == MAP_FAILED) {
+	krb5_error_code ret = errno;
+
+	krb5_set_error_message(context, ret, "mmap metrics: %s",
+			       strerror(ret));
+	return ret;
+    }
+    memset(p, 0, sizeof(*metrics));
+#else
+    /* Without shared memory each process only counts its own requests */
+    p = calloc(1, sizeof(*metrics));
+    if (p == NULL)
+	return krb5_enomem(context);
+#endif
+    metrics = p;
+    return 0;
+}
+
+static void
+histogram_add(struct histogram *h, const struct timeval *start,
+	      const struct timeval *end)
+{
+    int64_t usec;
+    size_t i;
+
+    usec = (int64_t)(end->tv_sec - start->tv_sec) * 1000000 +
+	(end->tv_usec - start->tv_usec);
+    if (usec < 0)
+	usec = 0;
+    for (i = 0; i < NUM_BUCKETS - 1; i++)
+	if ((uint64_t)usec <= bounds[i])
+	    break;
+    COUNTER_ADD(h->bucket[i], 1);
+    COUNTER_ADD(h->sum_usec, (uint64_t)usec);
+    COUNTER_ADD(h->count, 1);
+}
+
+/*
+ * Start timing an operation for _kdc_metrics_hdb_fetch().
+ */
+
+void
+_kdc_metrics_clock(struct timeval *tv)
+{
+    if (metrics)
+	gettimeofday(tv, NULL);
+}
+
+void
+_kdc_metrics_hdb_fetch(const struct timeval *start)
+{
+    struct timeval now;
+
+    if (metrics == NULL)
+	return;
+    gettimeofday(&now, NULL);
+    histogram_add(&metrics->hdb_fetch_time, start, &now);
+}
+
+/*
+ * Count a finished request of service `type' (NULL if no service
+ * claimed it), with KDC outcome `ret', that started at `start'.
+ */
+
+void
+_kdc_metrics_request(const char *type, krb5_error_code ret,
+		     const struct timeval *start)
+{
+    struct timeval now;
+    size_t t, i;
+
+    if (metrics == NULL)
+	return;
+
+    for (t = 0; t < NUM_REQ_TYPES - 1; t++)
+	if (type && strcmp(type, req_types[t]) == 0)
+	    break;
+    for (i = 0; i < NUM_RESULTS - 1; i++)
+	if (results[i].code == ret)
+	    break;
+    COUNTER_ADD(metrics->requests[t][i], 1);
+
+    gettimeofday(&now, NULL);
+    histogram_add(&metrics->request_time[t], start, &now);
+}
+
+/**
+ * Account for requests queued to (positive `delta') or taken off
+ * (negative `delta') a worker's request queue.
+ *
+ * @param delta change in the number of queued requests
+ */
+
+KDC_LIB_FUNCTION void KDC_LIB_CALL
+krb5_kdc_metrics_queue(int delta)
+{
+    if (metrics == NULL)
+	return;
+    if (delta > 0)
+	COUNTER_ADD(metrics->queue_depth, (uint64_t)delta);
+    else if (delta < 0)
+	COUNTER_SUB(metrics->queue_depth, (uint64_t)-delta);
+}
+
+/**
+ * Count a connection or request turned away by admission control.
+ *
+ * @param reason "connections" (per-worker connection limit), "address"
+ *        (per-address connection limit) or "queue" (request queue full)
+ */
+
+KDC_LIB_FUNCTION void KDC_LIB_CALL
+krb5_kdc_metrics_shed(const char *reason)
+{
+    size_t i;
+
+    if (metrics == NULL)
+	return;
+    for (i = 0; i < NUM_SHED_REASONS; i++) {
+	if (strcmp(reason, shed_reasons[i]) == 0) {
+	    COUNTER_ADD(metrics->shed[i], 1);
+	    return;
+	}
+    }
+}
+
+/*
+ * Count an AS-REQ rejected because its client principal or address
+ * (`key' "client" or "address") failed pre-authentication too often.
+ */
+
+void
+_kdc_metrics_ratelimited(const char *key)
+{
+    size_t i;
+
+    if (metrics == NULL)
+	return;
+    for (i = 0; i < NUM_RATELIMIT_KEYS; i++) {
+	if (strcmp(key, ratelimit_keys[i]) == 0) {
+	    COUNTER_ADD(metrics->ratelimited[i], 1);
+	    return;
+	}
+    }
+}
+
+/*
+ * Count a TGS-REQ rejected as a replay.
+ */
+
+void
+_kdc_metrics_tgs_replay(void)
+{
+    if (metrics == NULL)
+	return;
+    COUNTER_ADD(metrics->tgs_replay, 1);
+}
+
+/*
+ * Count an HDB entry cache lookup: `result' is 0 for a miss, 1 for a
+ * hit, and 2 for a database lookup skipped by the negative cache.
+ */
+
+void
+_kdc_metrics_db_cache(int result)
+{
+    if (metrics && result >= 0 && result < 3)
+	COUNTER_ADD(metrics->db_cache[result], 1);
+}
+
+/*
+ * Count a decrypted TGT cache lookup: `hit' is 0 for a miss, 1 for a
+ * hit.
+ */
+
+void
+_kdc_metrics_tgt_cache(int hit)
+{
+    if (metrics)
+	COUNTER_ADD(metrics->tgt_cache[!!hit], 1);
+}
+
+/**
+ * Set up the hot keys tracker.  Call this before forking worker
+ * processes so that they all share the same tracker.  Does nothing
+ * unless hot-keys is configured.
+ *
+ * @param context a Kerberos 5 context
+ * @param config the KDC configuration
+ *
+ * @return 0 on success, or an error code
+ */
+
+KDC_LIB_FUNCTION krb5_error_code KDC_LIB_CALL
+krb5_kdc_hot_keys_init(krb5_context context,
+		       krb5_kdc_configuration *config)
+{
+    void *p;
+
+    if (hot || config->hot_keys == 0)
+	return 0;
+
+#if defined(HAVE_MMAP) && defined(MAP_SHARED) && defined(MAP_ANON)
+    p = mmap(NULL, sizeof(*hot), PROT_READ | PROT_WRITE,
+	     MAP_ANON | MAP_SHARED, -1, 0);
+    if (p == MAP_FAILED) {
+	krb5_error_code ret = errno;
+
+	krb5_set_error_message(context, ret, "mmap hot keys: %s",
+			       strerror(ret));
+	return ret;
+    }
+    memset(p, 0, sizeof(*hot));
+#else
+    /* Without shared memory each process only tracks its own requests */
+    p = calloc(1, sizeof(*hot));
+    if (p == NULL)
+	return krb5_enomem(context);
+#endif
+    hot = p;
+    hot->ntop = config->hot_keys < HK_TOP_MAX ? config->hot_keys : HK_TOP_MAX;
+    hot->half_life = config->hot_keys_half_life;
+    hot->halved = time(NULL);
+    return 0;
+}
+
+static uint64_t
+hk_hash(uint64_t h, const void *ptr, size_t len)
+{
+    const unsigned char *p = ptr;
+
+    while (len--)
+	h = (h ^ *p++) * 0x100000001b3ULL;
+    return h;
+}
+
+/* Row `i' of the sketch uses the i-th of a family of derived hashes */
+static size_t
+hk_index(uint64_t hash, size_t i)
+{
+    return (size_t)((hash + i * ((hash >> 32) | 1)) & (HK_WIDTH - 1));
+}
+
+static uint64_t
+hk_estimate(struct hk_kind *k, uint64_t hash)
+{
+    uint64_t est = UINT64_MAX, n;
+    size_t i;
+
+    for (i = 0; i < HK_DEPTH; i++)
+	if ((n = COUNTER_GET(k->sketch[i][hk_index(hash, i)])) < est)
+	    est = n;
+    return est;
+}
+
+/*
+ * Lock a table, giving up after a while in case a worker died holding
+ * the lock; readers then see a table that may be mid-update, which is
+ * harmless.  Returns whether the lock is held.
+ */
+static int
+hk_lock(struct hk_kind *k)
+{
+    unsigned int tries = 1000000;
+
+    while (!COUNTER_CAS(k->lock, 0, 1))
+	if (--tries == 0)
+	    return 0;
+    return 1;
+}
+
+static void
+hk_unlock(struct hk_kind *k, int locked)
+{
+    if (locked)
+	COUNTER_SUB(k->lock, 1);
+}
+
+/* Halve every count.  The winner of the race for `halved' does it. */
+static void
+hk_decay(time_t now)
+{
+    uint64_t then = COUNTER_GET(hot->halved);
+    size_t t, i, j;
+
+    if (hot->half_life <= 0 || (int64_t)(now - then) < hot->half_life ||
+	!COUNTER_CAS(hot->halved, then, (uint64_t)now))
+	return;
+    for (t = 0; t < HK_NKINDS; t++) {
+	struct hk_kind *k = &hot->kind[t];
+	int locked;
+
+	for (i = 0; i < HK_DEPTH; i++)
+	    for (j = 0; j < HK_WIDTH; j++)
+		COUNTER_SUB(k->sketch[i][j], COUNTER_GET(k->sketch[i][j]) / 2);
+	locked = hk_lock(k);
+	for (i = 0; i < hot->ntop; i++)
+	    k->top[i].count /= 2;
+	COUNTER_SUB(k->floor, COUNTER_GET(k->floor) / 2);
+	hk_unlock(k, locked);
+    }
+}
+
+static void
+hk_network_name(const struct sockaddr *sa, char *buf, size_t len)
+{
+    char a[INET6_ADDRSTRLEN];
+
+    *buf = '\0';
+    if (sa->sa_family == AF_INET) {
+	struct in_addr in = ((const struct sockaddr_in *)sa)->sin_addr;
+	unsigned char *b = (unsigned char *)&in;
+
+	b[3] = 0;
+	if (inet_ntop(AF_INET, &in, a, sizeof(a)))
+	    snprintf(buf, len, "%s/24", a);
+    }
+#ifdef HAVE_IPV6
+    else if (sa->sa_family == AF_INET6) {
+	struct in6_addr in6 = ((const struct sockaddr_in6 *)sa)->sin6_addr;
+
+	memset(&in6.s6_addr[8], 0, 8);
+	if (inet_ntop(AF_INET6, &in6, a, sizeof(a)))
+	    snprintf(buf, len, "%s/64", a);
+    }
+#endif
+}
+
+/*
+ * Count a request for key `hash' in `k', and if it is now among the
+ * heaviest, put it in the table under `name', or the network of `sa'
+ * if `name' is NULL.
+ */
+static void
+hk_record(struct hk_kind *k, uint64_t hash, const char *name,
+	  const struct sockaddr *sa)
+{
+    struct hk_slot *slot, *victim = NULL;
+    uint64_t est = UINT64_MAX, n, least = UINT64_MAX;
+    size_t i;
+
+    hash = hash ? hash : 1;
+    for (i = 0; i < HK_DEPTH; i++)
+	if ((n = COUNTER_ADD(k->sketch[i][hk_index(hash, i)], 1) + 1) < est)
+	    est = n;
+    if (est <= COUNTER_GET(k->floor) || !COUNTER_CAS(k->lock, 0, 1))
+	return;
+
+    for (i = 0; i < hot->ntop; i++) {
+	slot = &k->top[i];
+	if (slot->hash == hash) {
+	    slot->count = est;
+	    victim = NULL;
+	    break;
+	}
+	if (victim == NULL || slot->count < victim->count)
+	    victim = slot;
+    }
+    if (victim && victim->count < est) {
+	victim->hash = hash;
+	victim->count = est;
+	if (name)
+	    strlcpy(victim->name, name, sizeof(victim->name));
+	else
+	    hk_network_name(sa, victim->name, sizeof(victim->name));
+    }
+    for (i = 0; i < hot->ntop; i++)
+	if (k->top[i].count < least)
+	    least = k->top[i].count;
+    /* Only changed with the lock held, so this can't fail */
+    (void) COUNTER_CAS(k->floor, COUNTER_GET(k->floor), least);
+    hk_unlock(k, 1);
+}
+
+/*
+ * Count a request from client `cname' for server `sname' (either may
+ * be NULL) from address `sa' in the hot keys tracker.
+ */
+
+void
+_kdc_hot_keys_request(const char *cname, const char *sname,
+		      const struct sockaddr *sa)
+{
+    uint64_t h;
+
+    if (hot == NULL)
+	return;
+
+    hk_decay(time(NULL));
+    if (cname)
+	hk_record(&hot->kind[HK_CLIENT],
+		  hk_hash(0xcbf29ce484222325ULL, cname, strlen(cname)),
+		  cname, NULL);
+    if (sname)
+	hk_record(&hot->kind[HK_SERVER],
+		  hk_hash(0xcbf29ce484222325ULL, sname, strlen(sname)),
+		  sname, NULL);
+    if (sa == NULL)
+	return;
+    h = hk_hash(0xcbf29ce484222325ULL, &sa->sa_family, sizeof(sa->sa_family));
+    if (sa->sa_family == AF_INET)
+	h = hk_hash(h, &((const struct sockaddr_in *)sa)->sin_addr, 3);
+#ifdef HAVE_IPV6
+    else if (sa->sa_family == AF_INET6)
+	h = hk_hash(h, &((const struct sockaddr_in6 *)sa)->sin6_addr, 8);
+#endif
+    else
+	return;
+    hk_record(&hot->kind[HK_NETWORK], h, NULL, sa);
+}
+
+struct hk_entry {
+    uint64_t count;
+    char name[HK_NAME_MAX];
+};
+
+static int
+hk_entry_cmp(const void *a, const void *b)
+{
+    const struct hk_entry *x = a, *y = b;
+
+    if (x->count != y->count)
+	return x->count > y->count ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+/*
+ * Snapshot the table of kind `t', heaviest first, with counts
+ * re-estimated from the sketch.  Returns the number of entries.
+ */
+static size_t
+hk_snapshot(size_t t, struct hk_entry *e)
+{
+    struct hk_kind *k = &hot->kind[t];
+    size_t i, n = 0;
+    int locked;
+
+    locked = hk_lock(k);
+    for (i = 0; i < hot->ntop; i++) {
+	if (k->top[i].hash == 0)
+	    continue;
+	e[n].count = hk_estimate(k, k->top[i].hash);
+	memcpy(e[n].name, k->top[i].name, sizeof(e[n].name));
+	e[n].name[sizeof(e[n].name) - 1] = '\0';
+	n++;
+    }
+    hk_unlock(k, locked);
+    qsort(e, n, sizeof(e[0]), hk_entry_cmp);
+    return n;
+}
+
+/* Prometheus label values escape backslash, double quote and newline */
+static struct rk_strpool *
+hk_label(struct rk_strpool *p, const char *s)
+{
+    for (; p && *s; s++) {
+	if (*s == '\\' || *s == '"')
+	    p = rk_strpoolprintf(p, "\\%c", *s);
+	else if (*s == '\n')
+	    p = rk_strpoolprintf(p, "\\n");
+	else
+	    p = rk_strpoolprintf(p, "%c", *s);
+    }
+    return p;
+}
+
+static struct rk_strpool *
+format_hot_keys(struct rk_strpool *p)
+{
+    struct hk_entry e[HK_TOP_MAX];
+    size_t t, i, n;
+
+    for (t = 0; t < HK_NKINDS; t++) {
+	p = rk_strpoolprintf(p, "# TYPE %s gauge\n", hk_kinds[t].metric);
+	n = hk_snapshot(t, e);
+	for (i = 0; i < n; i++) {
+	    p = rk_strpoolprintf(p, "%s{%s=\"", hk_kinds[t].metric,
+				 hk_kinds[t].label);
+	    p = hk_label(p, e[i].name);
+	    p = rk_strpoolprintf(p, "\"} %llu\n",
+				 (unsigned long long)e[i].count);
+	}
+    }
+    return p;
+}
+
+/**
+ * Log the hot keys tables, heaviest first.  The KDC does this when it
+ * receives SIGUSR1.
+ *
+ * @param context a Kerberos 5 context
+ * @param config the KDC configuration
+ */
+
+KDC_LIB_FUNCTION void KDC_LIB_CALL
+krb5_kdc_hot_keys_log(krb5_context context,
+		      krb5_kdc_configuration *config)
+{
+    struct hk_entry e[HK_TOP_MAX];
+    size_t t, i, n;
+
+    if (hot == NULL) {
+	kdc_log(context, config, 0, "Hot keys tracking is not enabled");
+	return;
+    }
+    for (t = 0; t < HK_NKINDS; t++) {
+	n = hk_snapshot(t, e);
+	for (i = 0; i < n; i++)
+	    kdc_log(context, config, 0, "%s %lu: %s %llu", hk_kinds[t].metric,
+		    (unsigned long)i + 1, e[i].name, (unsigned long long)e[i].count);
+    }
+}
+
+/**
+ * Log the memory held by each subsystem of this process, when [libdefaults]
+ * memory_accounting is on.  The KDC does this, in each process, when it
+ * receives SIGUSR1.
+ *
+ * @param context a Kerberos 5 context
+ * @param config the KDC configuration
+ */
+
+KDC_LIB_FUNCTION void KDC_LIB_CALL
+krb5_kdc_memory_log(krb5_context context,
+		    krb5_kdc_configuration *config)
+{
+    int64_t bytes, objects;
+    int t;
+
+    if (!heim_mem_account_enabled())
+	return;
+    for (t = 0; t < HEIM_MEM_NUM_TAGS; t++) {
+	if (heim_mem_stats(t, &bytes, &objects) == 0)
+	    kdc_log(context, config, 0, "memory %s: %lld bytes, %lld objects",
+		    heim_mem_tag_name(t), (long long)bytes, (long long)objects);
+    }
+}
+
+/* The memory of the process that serves the page, not of the whole KDC */
+static struct rk_strpool *
+format_memory(struct rk_strpool *p)
+{
+    int64_t bytes, objects;
+    int t;
+
+    p = rk_strpoolprintf(p, "# TYPE kdc_memory_bytes gauge\n");
+    for (t = 0; t < HEIM_MEM_NUM_TAGS; t++) {
+	if (heim_mem_stats(t, &bytes, &objects) == 0)
+	    p = rk_strpoolprintf(p, "kdc_memory_bytes{subsystem=\"%s\","
+				 "pid=\"%ld\"} %lld\n", heim_mem_tag_name(t),
+				 (long)getpid(), (long long)bytes);
+    }
+    p = rk_strpoolprintf(p, "# TYPE kdc_memory_objects gauge\n");
+    for (t = 0; t < HEIM_MEM_NUM_TAGS; t++) {
+	if (heim_mem_stats(t, &bytes, &objects) == 0)
+	    p = rk_strpoolprintf(p, "kdc_memory_objects{subsystem=\"%s\","
+				 "pid=\"%ld\"} %lld\n", heim_mem_tag_name(t),
+				 (long)getpid(), (long long)objects);
+    }
+    return p;
+}
+
+static struct rk_strpool *
+format_histogram(struct rk_strpool *p, const char *name, const char *labels,
+		 struct histogram *h)
+{
+    uint64_t cum = 0;
+    size_t i;
+
+    for (i = 0; i < NUM_BUCKETS; i++) {
+	cum += COUNTER_GET(h->bucket[i]);
+	if (i < NUM_BUCKETS - 1)
+	    p = rk_strpoolprintf(p, "%s_bucket{%s%sle=\"%lu.%06lu\"} %llu\n",
+				 name, labels, *labels ? "," : "",
+				 (unsigned long)(bounds[i] / 1000000),
+				 (unsigned long)(bounds[i] % 1000000),
+				 (unsigned long long)cum);
+	else
+	    p = rk_strpoolprintf(p, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+				 name, labels, *labels ? "," : "",
+				 (unsigned long long)cum);
+    }
+    p = rk_strpoolprintf(p, "%s_sum%s%s%s %llu.%06llu\n", name,
+			 *labels ? "{" : "", labels, *labels ? "}" : "",
+			 (unsigned long long)(COUNTER_GET(h->sum_usec) / 1000000),
+			 (unsigned long long)(COUNTER_GET(h->sum_usec) % 1000000));
+    p = rk_strpoolprintf(p, "%s_count%s%s%s %llu\n", name,
+			 *labels ? "{" : "", labels, *labels ? "}" : "",
+			 (unsigned long long)COUNTER_GET(h->count));
+    return p;
+}
+
+/**
+ * Format the current metrics in the Prometheus text exposition
+ * format.
+ *
+ * @param context a Kerberos 5 context
+ * @param out the formatted metrics, free with krb5_data_free()
+ *
+ * @return 0 on success, or an error code
+ */
+
+KDC_LIB_FUNCTION krb5_error_code KDC_LIB_CALL
+krb5_kdc_metrics_format(krb5_context context, krb5_data *out)
+{
+    struct rk_strpool *p = NULL;
+    char *s;
+    size_t t, i;
+
+    krb5_data_zero(out);
+    if (metrics == NULL) {
+	krb5_set_error_message(context, ENOENT, "KDC metrics not enabled");
+	return ENOENT;
+    }
+
+    p = rk_strpoolprintf(p, "# TYPE kdc_requests_total counter\n");
+    for (t = 0; t < NUM_REQ_TYPES; t++) {
+	for (i = 0; i < NUM_RESULTS; i++) {
+	    uint64_t n = COUNTER_GET(metrics->requests[t][i]);
+
+	    if (n == 0)
+		continue;
+	    p = rk_strpoolprintf(p, "kdc_requests_total{type=\"%s\","
+				 "result=\"%s\"} %llu\n", req_types[t],
+				 i < NUM_RESULTS - 1 ? results[i].name : "OTHER",
+				 (unsigned long long)n);
+	}
+    }
+
+    p = rk_strpoolprintf(p, "# TYPE kdc_request_seconds histogram\n");
+    for (t = 0; t < NUM_REQ_TYPES; t++) {
+	char labels[32];
+
+	if (COUNTER_GET(metrics->request_time[t].count) == 0)
+	    continue;
+	snprintf(labels, sizeof(labels), "type=\"%s\"", req_types[t]);
+	p = format_histogram(p, "kdc_request_seconds", labels,
+			     &metrics->request_time[t]);
+    }
+
+    p = rk_strpoolprintf(p, "# TYPE kdc_hdb_fetch_seconds histogram\n");
+    p = format_histogram(p, "kdc_hdb_fetch_seconds", "",
+			 &metrics->hdb_fetch_time);
+
+    p = rk_strpoolprintf(p, "# TYPE kdc_request_queue_depth gauge\n"
+			 "kdc_request_queue_depth %llu\n",
+			 (unsigned long long)COUNTER_GET(metrics->queue_depth));
+
+    p = rk_strpoolprintf(p, "# TYPE kdc_shed_total counter\n");
+    for (i = 0; i < NUM_SHED_REASONS; i++)
+	p = rk_strpoolprintf(p, "kdc_shed_total{reason=\"%s\"} %llu\n",
+			     shed_reasons[i],
+			     (unsigned long long)COUNTER_GET(metrics->shed[i]));
+
+    p = rk_strpoolprintf(p, "# TYPE kdc_preauth_ratelimited_total counter\n");
+    for (i = 0; i < NUM_RATELIMIT_KEYS; i++)
+	p = rk_strpoolprintf(p, "kdc_preauth_ratelimited_total"
+			     "{key=\"%s\"} %llu\n", ratelimit_keys[i],
+			     (unsigned long long)COUNTER_GET(metrics->ratelimited[i]));
+
+    p = rk_strpoolprintf(p, "# TYPE kdc_hdb_cache_total counter\n");
+    for (i = 0; i < 3; i++)
+	p = rk_strpoolprintf(p, "kdc_hdb_cache_total{result=\"%s\"} %llu\n",
+			     db_cache_results[i],
+			     (unsigned long long)COUNTER_GET(metrics->db_cache[i]));
+
+    p = rk_strpoolprintf(p, "# TYPE kdc_tgs_replay_total counter\n");
+    p = rk_strpoolprintf(p, "kdc_tgs_replay_total %llu\n",
+			 (unsigned long long)COUNTER_GET(metrics->tgs_replay));
+
+    p = rk_strpoolprintf(p, "# TYPE kdc_tgt_cache_total counter\n");
+    for (i = 0; i < 2; i++)
+	p = rk_strpoolprintf(p, "kdc_tgt_cache_total{result=\"%s\"} %llu\n",
+			     db_cache_results[i],
+			     (unsigned long long)COUNTER_GET(metrics->tgt_cache[i]));
+
+    if (hot)
+	p = format_hot_keys(p);
+    if (heim_mem_account_enabled())
+	p = format_memory(p);
+
+    s = rk_strpoolcollect(p);
+    if (s == NULL)
+	return krb5_enomem(context);
+    out->data = s;
+    out->length = strlen(s);
+    return 0;
+}
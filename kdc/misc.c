@@ -51,6 +51,333 @@ name_type_ok(krb5_context context,
 
 struct timeval _kdc_now;
 
+/*
+ * With [kdc] hdb-keep-open each process (or request thread, which has
+ * its own HDB handles) opens its databases on first use and keeps them
+ * open, instead of opening and closing them around every lookup.
+ *
+ * To still see changes made by kadmind or ipropd, that and the entry
+ * caches (hdb-cache-size, hdb-negative-cache-size) stat() the database
+ * files before each
+ * lookup.  When a file's identity, size or times have changed, its
+ * generation is bumped, which invalidates cached entries, and a kept
+ * open handle is reopened.  A file modified within the last second of
+ * when it was last checked may change again without any visible
+ * difference in its times, so it counts as changed once more on the
+ * next lookup.  Databases that are not files (LDAP) never change
+ * generation; their handles stay open until a lookup fails, and their
+ * cached entries live for hdb-cache-lifetime.
+ */
+
+struct kdc_db_state {
+    pid_t pid;			/* process with the handle open, or 0 */
+    int have_stamp;
+    int racy;
+    struct stat st;
+    struct stat wal;		/* SQLite write-ahead log, if any */
+    uint64_t generation;
+};
+
+static void
+db_stamp(HDB *db, struct kdc_db_state *s)
+{
+    static const char *suffixes[] = { ".mdb", ".db", "" };
+    char path[MAXPATHLEN];
+    size_t i;
+
+    s->have_stamp = 0;
+    if (db->hdb_name == NULL)
+	return;
+    for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+	snprintf(path, sizeof(path), "%s%s", db->hdb_name, suffixes[i]);
+	if (stat(path, &s->st) == 0 && S_ISREG(s->st.st_mode)) {
+	    s->have_stamp = 1;
+	    /* SQLite in WAL mode commits to <file>-wal, not <file> */
+	    strlcat(path, "-wal", sizeof(path));
+	    if (stat(path, &s->wal) != 0)
+		memset(&s->wal, 0, sizeof(s->wal));
+	    s->racy = s->st.st_mtime >= time(NULL) - 1 ||
+		s->wal.st_mtime >= time(NULL) - 1;
+	    return;
+	}
+    }
+}
+
+static int
+db_changed(HDB *db, struct kdc_db_state *s)
+{
+    struct kdc_db_state now;
+
+    if (!s->have_stamp)
+	return 0;
+    if (s->racy)
+	return 1;
+    db_stamp(db, &now);
+    return !now.have_stamp ||
+	now.st.st_dev != s->st.st_dev ||
+	now.st.st_ino != s->st.st_ino ||
+	now.st.st_size != s->st.st_size ||
+	now.st.st_mtime != s->st.st_mtime ||
+	now.st.st_ctime != s->st.st_ctime ||
+	now.wal.st_ino != s->wal.st_ino ||
+	now.wal.st_size != s->wal.st_size ||
+	now.wal.st_mtime != s->wal.st_mtime ||
+	now.wal.st_ctime != s->wal.st_ctime;
+}
+
+/*
+ * Check all databases for changes, and return the sum of their
+ * generations (which changes whenever any of them does), or 0 if
+ * neither hdb-keep-open nor the caches are in use.
+ */
+static uint64_t
+db_refresh(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct kdc_db_state *s;
+    uint64_t generation = 0;
+    int i;
+
+    if (!config->hdb_keep_open && config->hdb_cache_size == 0 &&
+	config->hdb_negative_cache_size == 0)
+	return 0;
+
+    if (config->num_db_state < config->num_db) {
+	s = realloc(config->db_state, config->num_db * sizeof(*s));
+	if (s == NULL)
+	    return 0;
+	memset(s + config->num_db_state, 0,
+	       (config->num_db - config->num_db_state) * sizeof(*s));
+	config->db_state = s;
+	config->num_db_state = config->num_db;
+    }
+
+    for (i = 0; i < config->num_db; i++) {
+	HDB *db = config->db[i];
+
+	s = &config->db_state[i];
+	if (s->pid != 0 && s->pid != getpid()) {
+	    /* Opened by our parent before fork() */
+	    db->hdb_close(context, db);
+	    s->pid = 0;
+	}
+	if (s->generation == 0 || db_changed(db, s)) {
+	    if (s->pid != 0) {
+		kdc_log(context, config, 5, "Database %s changed, reopening it",
+			db->hdb_name ? db->hdb_name : "");
+		db->hdb_close(context, db);
+		s->pid = 0;
+	    }
+	    /* Before any reopen, so that changes made meanwhile are noticed */
+	    db_stamp(db, s);
+	    s->generation++;
+	}
+	generation += s->generation;
+    }
+    return generation;
+}
+
+static krb5_error_code
+db_open(krb5_context context, krb5_kdc_configuration *config, int i)
+{
+    HDB *db = config->db[i];
+    krb5_error_code ret;
+
+    if (!config->hdb_keep_open || config->num_db_state <= i)
+	return db->hdb_open(context, db, O_RDONLY, 0);
+    if (config->db_state[i].pid == getpid())
+	return 0;
+    ret = db->hdb_open(context, db, O_RDONLY, 0);
+    if (ret == 0)
+	config->db_state[i].pid = getpid();
+    return ret;
+}
+
+static void
+db_done(krb5_context context, krb5_kdc_configuration *config, int i,
+	krb5_error_code ret)
+{
+    HDB *db = config->db[i];
+
+    if (!config->hdb_keep_open || config->num_db_state <= i ||
+	config->db_state[i].pid == 0) {
+	db->hdb_close(context, db);
+	return;
+    }
+    switch (ret) {
+    case 0:
+    case HDB_ERR_NOENTRY:
+    case HDB_ERR_WRONG_REALM:
+    case HDB_ERR_NOT_FOUND_HERE:
+	break;
+    default:
+	/* Perhaps the handle went bad (e.g., a lost LDAP connection) */
+	db->hdb_close(context, db);
+	config->db_state[i].pid = 0;
+	break;
+    }
+}
+
+/*
+ * Return the cache key for a lookup, or NULL if neither cache is in
+ * use.  Only server and krbtgt lookups go in the entry cache, as client
+ * entries carry lockout state that changes behind our back; knowing
+ * that a principal does not exist is safe to cache for all lookups.
+ */
+static char *
+cache_key(krb5_context context, krb5_kdc_configuration *config,
+	  krb5_const_principal principal, unsigned flags, unsigned kvno,
+	  int *positive)
+{
+    char *name = NULL, *key = NULL;
+
+    *positive = config->hdb_cache_size > 0 && !(flags & HDB_F_GET_CLIENT) &&
+	(flags & (HDB_F_GET_SERVER | HDB_F_GET_KRBTGT));
+    if (!*positive && config->hdb_negative_cache_size == 0)
+	return NULL;
+    if (krb5_unparse_name(context, principal, &name) != 0)
+	return NULL;
+    if (asprintf(&key, "%x:%u:%d:%s", flags, kvno,
+		 (int)principal->name.name_type, name) < 0)
+	key = NULL;
+    free(name);
+    return key;
+}
+
+/**
+ * Close the databases that hdb-keep-open left open, and empty the
+ * entry cache, before the databases are destroyed.
+ *
+ * @param context a Kerberos 5 context
+ * @param config the KDC configuration whose databases to close
+ */
+
+KDC_LIB_FUNCTION void KDC_LIB_CALL
+krb5_kdc_close_dbs(krb5_context context, krb5_kdc_configuration *config)
+{
+    int i;
+
+    for (i = 0; i < config->num_db_state && i < config->num_db; i++)
+	if (config->db_state[i].pid == getpid())
+	    config->db[i]->hdb_close(context, config->db[i]);
+    free(config->db_state);
+    config->db_state = NULL;
+    config->num_db_state = 0;
+    _kdc_db_cache_free(context, config);
+}
+
+/*
+ * Fetch `principal' as the TGS would, and for a krbtgt, again by its
+ * current kvno, as tickets name it.
+ */
+static void
+prewarm_fetch(krb5_context context, krb5_kdc_configuration *config,
+	      krb5_const_principal principal, unsigned flags)
+{
+    hdb_entry_ex *h = NULL;
+    krb5_error_code ret;
+    krb5uint32 kvno;
+
+    ret = _kdc_db_fetch(context, config, principal, flags, NULL, NULL, &h);
+    if (ret == 0 && (flags & HDB_F_GET_KRBTGT)) {
+	kvno = h->entry.kvno;
+	_kdc_free_ent(context, h);
+	h = NULL;
+	ret = _kdc_db_fetch(context, config, principal, flags, &kvno, NULL,
+			    &h);
+    }
+    if (ret == 0) {
+	_kdc_free_ent(context, h);
+    } else {
+	const char *msg = krb5_get_error_message(context, ret);
+	char *name = NULL;
+
+	(void) krb5_unparse_name(context, principal, &name);
+	kdc_log(context, config, 1, "Could not pre-warm %s: %s",
+		name ? name : "<unknown>", msg);
+	krb5_free_error_message(context, msg);
+	free(name);
+    }
+}
+
+/**
+ * With [kdc] hdb-prewarm, open every database once, then look up the
+ * krbtgt of each default realm and the [kdc] hdb-prewarm-principals
+ * the way TGS requests do.  This surfaces database problems at
+ * startup, and warms what a process (or request thread) would
+ * otherwise warm on its first requests: its kept open database
+ * handles (hdb-keep-open), its entry cache (hdb-cache-size), and the
+ * system's page cache of the database files.
+ *
+ * @param context a Kerberos 5 context
+ * @param config the KDC configuration to warm
+ */
+
+KDC_LIB_FUNCTION void KDC_LIB_CALL
+krb5_kdc_prewarm(krb5_context context, krb5_kdc_configuration *config)
+{
+    krb5_realm *realms = NULL;
+    krb5_principal p;
+    krb5_error_code ret;
+    struct timeval start, end;
+    size_t n = 0;
+    int i;
+
+    if (!config->hdb_prewarm)
+	return;
+    gettimeofday(&start, NULL);
+    krb5_kdc_update_time(&start);
+
+    (void) db_refresh(context, config);
+    for (i = 0; i < config->num_db; i++) {
+	HDB *db = config->db[i];
+
+	ret = db_open(context, config, i);
+	if (ret) {
+	    const char *msg = krb5_get_error_message(context, ret);
+
+	    kdc_log(context, config, 0, "Failed to open database %s: %s",
+		    db->hdb_name ? db->hdb_name : "", msg);
+	    krb5_free_error_message(context, msg);
+	    continue;
+	}
+	db_done(context, config, i, 0);
+    }
+
+    if (krb5_get_default_realms(context, &realms) == 0) {
+	for (i = 0; realms[i]; i++, n++) {
+	    if (krb5_make_principal(context, &p, realms[i], KRB5_TGS_NAME,
+				    realms[i], NULL) != 0)
+		continue;
+	    prewarm_fetch(context, config, p, HDB_F_GET_KRBTGT);
+	    krb5_free_principal(context, p);
+	}
+	krb5_free_host_realm(context, realms);
+    }
+    for (i = 0; config->hdb_prewarm_principals &&
+		config->hdb_prewarm_principals[i]; i++, n++) {
+	ret = krb5_parse_name(context, config->hdb_prewarm_principals[i], &p);
+	if (ret) {
+	    const char *msg = krb5_get_error_message(context, ret);
+
+	    kdc_log(context, config, 1, "Could not pre-warm %s: %s",
+		    config->hdb_prewarm_principals[i], msg);
+	    krb5_free_error_message(context, msg);
+	    continue;
+	}
+	prewarm_fetch(context, config, p,
+		      HDB_F_GET_SERVER | HDB_F_DELAY_NEW_KEYS |
+		      HDB_F_FOR_TGS_REQ);
+	krb5_free_principal(context, p);
+    }
+
+    gettimeofday(&end, NULL);
+    kdc_log(context, config, 4,
+	    "Pre-warmed %d databases and %lu principals in %ld ms",
+	    config->num_db, (unsigned long)n,
+	    (long)((end.tv_sec - start.tv_sec) * 1000 +
+		   (end.tv_usec - start.tv_usec) / 1000));
+}
+
 static krb5_error_code
 synthesize_hdb_close(krb5_context context, struct HDB *db)
 {
@@ -122,14 +449,75 @@ synthesize_client(krb5_context context,
     return ret;
 }
 
-KDC_LIB_FUNCTION krb5_error_code KDC_LIB_CALL
-_kdc_db_fetch(krb5_context context,
-	      krb5_kdc_configuration *config,
-	      krb5_const_principal principal,
-	      unsigned flags,
-	      krb5uint32 *kvno_ptr,
-	      HDB **db,
-	      hdb_entry_ex **h)
+/*
+ * Finish a lookup whose result from the databases is `ret': hand out
+ * (and maybe cache) the entry found in database `i', or synthesize a
+ * client.  `*ent' is set to NULL if handed out.
+ */
+static krb5_error_code
+fetch_done(krb5_context context,
+	   krb5_kdc_configuration *config,
+	   krb5_const_principal principal,
+	   unsigned flags,
+	   const char *key,
+	   int positive,
+	   uint64_t generation,
+	   int i,
+	   krb5_error_code ret,
+	   hdb_entry_ex **ent,
+	   HDB **db,
+	   hdb_entry_ex **h)
+{
+    switch (ret) {
+    case HDB_ERR_WRONG_REALM:
+    case 0:
+        /*
+         * the ent->entry.principal just contains hints for the client
+         * to retry. This is important for enterprise principal routing
+         * between trusts.
+         */
+        if (ret == 0 && key && positive)
+            _kdc_db_cache_add(context, config, key, generation, i, *ent);
+        if (db)
+            *db = config->db[i];
+        *h = *ent;
+        *ent = NULL;
+        break;
+
+    case HDB_ERR_NOENTRY:
+        if (db)
+            *db = NULL;
+        if ((flags & HDB_F_GET_CLIENT) && (flags & HDB_F_SYNTHETIC_OK) &&
+            config->synthetic_clients) {
+            ret = synthesize_client(context, config, principal, db, h);
+            if (ret) {
+                krb5_set_error_message(context, ret, "could not synthesize "
+                                       "HDB client principal entry");
+                ret = HDB_ERR_NOENTRY;
+                krb5_prepend_error_message(context, ret, "no such entry found in hdb");
+            }
+        } else {
+            krb5_set_error_message(context, ret, "no such entry found in hdb");
+        }
+        break;
+
+    default:
+        if (db)
+            *db = NULL;
+        break;
+    }
+
+    return ret;
+}
+
+static krb5_error_code
+db_fetch(krb5_context context,
+	 krb5_kdc_configuration *config,
+	 krb5_const_principal principal,
+	 unsigned flags,
+	 krb5uint32 *kvno_ptr,
+	 HDB **db,
+	 hdb_entry_ex **h)
 {
     hdb_entry_ex *ent = NULL;
     krb5_error_code ret = HDB_ERR_NOENTRY;
@@ -137,6 +525,10 @@ _kdc_db_fetch(krb5_context context,
     unsigned kvno = 0;
     krb5_principal enterprise_principal = NULL;
     krb5_const_principal princ;
+    struct timeval fetch_start;
+    uint64_t generation;
+    char *key;
+    int positive;
 
     *h = NULL;
 
@@ -151,9 +543,21 @@ _kdc_db_fetch(krb5_context context,
 	flags |= HDB_F_ALL_KVNOS;
     }
 
+    generation = db_refresh(context, config);
+    key = cache_key(context, config, principal, flags, kvno, &positive);
+    if (key && positive &&
+        _kdc_db_cache_get(context, config, key, generation, &i, h) == 0) {
+        if (db)
+            *db = config->db[i];
+        free(key);
+        return 0;
+    }
+
     ent = calloc(1, sizeof (*ent));
-    if (ent == NULL)
+    if (ent == NULL) {
+        free(key);
         return krb5_enomem(context);
+    }
 
     if (principal->name.name_type == KRB5_NT_ENTERPRISE_PRINCIPAL) {
         if (principal->name.name_string.len != 1) {
@@ -176,7 +580,14 @@ _kdc_db_fetch(krb5_context context,
         if (db)
             *db = curdb;
 
-	ret = curdb->hdb_open(context, curdb, O_RDONLY, 0);
+        if (key && config->num_db_state > i &&
+            _kdc_db_negcache_check(context, config, key, i,
+                                   config->db_state[i].generation)) {
+            ret = HDB_ERR_NOENTRY;
+            continue;
+        }
+
+	ret = db_open(context, config, i);
 	if (ret) {
 	    const char *msg = krb5_get_error_message(context, ret);
 	    kdc_log(context, config, 0, "Failed to open database: %s", msg);
@@ -188,11 +599,17 @@ _kdc_db_fetch(krb5_context context,
         if (!(curdb->hdb_capability_flags & HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL) && enterprise_principal)
             princ = enterprise_principal;
 
+        _kdc_metrics_clock(&fetch_start);
         ret = hdb_fetch_kvno(context, curdb, princ, flags, 0, 0, kvno, ent);
-	curdb->hdb_close(context, curdb);
+        _kdc_metrics_hdb_fetch(&fetch_start);
+	db_done(context, config, i, ret);
 
-        if (ret == HDB_ERR_NOENTRY)
+        if (ret == HDB_ERR_NOENTRY) {
+            if (key && config->num_db_state > i)
+                _kdc_db_negcache_add(context, config, key, i,
+                                     config->db_state[i].generation);
             continue; /* Check the other databases */
+        }
 
         /*
          * This is really important, because errors like
@@ -204,50 +621,212 @@ _kdc_db_fetch(krb5_context context,
         break;
     }
 
-    switch (ret) {
-    case HDB_ERR_WRONG_REALM:
-    case 0:
-        /*
-         * the ent->entry.principal just contains hints for the client
-         * to retry. This is important for enterprise principal routing
-         * between trusts.
-         */
-        *h = ent;
-        ent = NULL;
-        break;
+    ret = fetch_done(context, config, principal, flags, key, positive,
+                     generation, i, ret, &ent, db, h);
 
-    case HDB_ERR_NOENTRY:
-        if (db)
-            *db = NULL;
-        if ((flags & HDB_F_GET_CLIENT) && (flags & HDB_F_SYNTHETIC_OK) &&
-            config->synthetic_clients) {
-            ret = synthesize_client(context, config, principal, db, h);
-            if (ret) {
-                krb5_set_error_message(context, ret, "could not synthesize "
-                                       "HDB client principal entry");
-                ret = HDB_ERR_NOENTRY;
-                krb5_prepend_error_message(context, ret, "no such entry found in hdb");
-            }
+out:
+    krb5_free_principal(context, enterprise_principal);
+    free(ent);
+    free(key);
+    return ret;
+}
+
+KDC_LIB_FUNCTION krb5_error_code KDC_LIB_CALL
+_kdc_db_fetch(krb5_context context,
+	      krb5_kdc_configuration *config,
+	      krb5_const_principal principal,
+	      unsigned flags,
+	      krb5uint32 *kvno_ptr,
+	      HDB **db,
+	      hdb_entry_ex **h)
+{
+    krb5_error_code ret;
+
+    HEIM_PROBE2(kdc__db__fetch__start, _krb5_principal_probe_hash(principal),
+		flags);
+    ret = db_fetch(context, config, principal, flags, kvno_ptr, db, h);
+    if (ret == 0)
+	heim_mem_account(HEIM_MEM_HDB, sizeof(**h), 1);
+    HEIM_PROBE3(kdc__db__fetch__done, _krb5_principal_probe_hash(principal),
+		flags, ret);
+    return ret;
+}
+
+/*
+ * Look up several principals, as _kdc_db_fetch() would each, but with one
+ * batch per database so that backends with a remote server (LDAP) pay one
+ * round trip rather than one per principal.  The result of each lookup is
+ * in its `ret'.
+ */
+void
+_kdc_db_fetch_multi(krb5_context context,
+		    krb5_kdc_configuration *config,
+		    struct kdc_db_fetch *reqs,
+		    size_t nreqs)
+{
+    struct fetch_state {
+        hdb_entry_ex *ent;
+        char *key;
+        unsigned flags;
+        unsigned kvno;
+        int positive;
+        int pending;
+        int i;
+    } *st = NULL;
+    struct hdb_fetch_req *hreqs = NULL;
+    struct timeval fetch_start;
+    uint64_t generation;
+    size_t j, m, *idx = NULL;
+    int i;
+
+    if (nreqs > 1) {
+        st = calloc(nreqs, sizeof(st[0]));
+        hreqs = calloc(nreqs, sizeof(hreqs[0]));
+        idx = calloc(nreqs, sizeof(idx[0]));
+    }
+    if (st == NULL || hreqs == NULL || idx == NULL) {
+        for (j = 0; j < nreqs; j++)
+            reqs[j].ret = _kdc_db_fetch(context, config, reqs[j].principal,
+                                        reqs[j].flags, reqs[j].kvno_ptr,
+                                        reqs[j].db, reqs[j].h);
+        free(st);
+        free(hreqs);
+        free(idx);
+        return;
+    }
+
+    generation = db_refresh(context, config);
+    for (j = 0; j < nreqs; j++) {
+        struct kdc_db_fetch *r = &reqs[j];
+
+        *r->h = NULL;
+
+        /* Leave the odd ones to _kdc_db_fetch() */
+        if (r->principal->name.name_type == KRB5_NT_ENTERPRISE_PRINCIPAL ||
+            !name_type_ok(context, config, r->principal)) {
+            r->ret = _kdc_db_fetch(context, config, r->principal, r->flags,
+                                   r->kvno_ptr, r->db, r->h);
+            continue;
+        }
+
+        st[j].flags = r->flags | HDB_F_DECRYPT;
+        if (r->kvno_ptr != NULL && *r->kvno_ptr != 0) {
+            st[j].kvno = *r->kvno_ptr;
+            st[j].flags |= HDB_F_KVNO_SPECIFIED;
         } else {
-            krb5_set_error_message(context, ret, "no such entry found in hdb");
+            st[j].flags |= HDB_F_ALL_KVNOS;
         }
-        break;
 
-    default:
-        if (db)
-            *db = NULL;
-        break;
+        st[j].key = cache_key(context, config, r->principal, st[j].flags,
+                              st[j].kvno, &st[j].positive);
+        if (st[j].key && st[j].positive &&
+            _kdc_db_cache_get(context, config, st[j].key, generation,
+                              &i, r->h) == 0) {
+            if (r->db)
+                *r->db = config->db[i];
+            r->ret = 0;
+            heim_mem_account(HEIM_MEM_HDB, sizeof(**r->h), 1);
+            continue;
+        }
+
+        if ((st[j].ent = calloc(1, sizeof(*st[j].ent))) == NULL) {
+            r->ret = krb5_enomem(context);
+            continue;
+        }
+        st[j].pending = 1;
+        r->ret = HDB_ERR_NOENTRY;
     }
 
-out:
-    krb5_free_principal(context, enterprise_principal);
-    free(ent);
-    return ret;
+    for (i = 0; i < config->num_db; i++) {
+        HDB *curdb = config->db[i];
+        krb5_error_code ret;
+
+        for (j = m = 0; j < nreqs; j++) {
+            if (!st[j].pending)
+                continue;
+            if (st[j].key && config->num_db_state > i &&
+                _kdc_db_negcache_check(context, config, st[j].key, i,
+                                       config->db_state[i].generation)) {
+                reqs[j].ret = HDB_ERR_NOENTRY;
+                continue;
+            }
+            hreqs[m].principal = reqs[j].principal;
+            hreqs[m].flags = st[j].flags;
+            hreqs[m].kvno = st[j].kvno;
+            hreqs[m].entry = st[j].ent;
+            hreqs[m].ret = HDB_ERR_NOENTRY;
+            idx[m++] = j;
+        }
+        if (m == 0)
+            continue;
+
+        ret = db_open(context, config, i);
+        if (ret) {
+            const char *msg = krb5_get_error_message(context, ret);
+            kdc_log(context, config, 0, "Failed to open database: %s", msg);
+            krb5_free_error_message(context, msg);
+            for (j = 0; j < m; j++)
+                reqs[idx[j]].ret = ret;
+            continue;
+        }
+
+        _kdc_metrics_clock(&fetch_start);
+        (void) hdb_fetch_kvno_multi(context, curdb, 0, hreqs, m);
+        _kdc_metrics_hdb_fetch(&fetch_start);
+
+        /* Any failure that might mean a bad handle closes it */
+        for (j = 0, ret = 0; j < m && ret == 0; j++) {
+            switch (hreqs[j].ret) {
+            case 0:
+            case HDB_ERR_NOENTRY:
+            case HDB_ERR_WRONG_REALM:
+            case HDB_ERR_NOT_FOUND_HERE:
+                break;
+            default:
+                ret = hreqs[j].ret;
+                break;
+            }
+        }
+        db_done(context, config, i, ret);
+
+        for (j = 0; j < m; j++) {
+            size_t k = idx[j];
+
+            reqs[k].ret = hreqs[j].ret;
+            if (reqs[k].ret == HDB_ERR_NOENTRY) {
+                if (st[k].key && config->num_db_state > i)
+                    _kdc_db_negcache_add(context, config, st[k].key, i,
+                                         config->db_state[i].generation);
+                continue; /* Check the other databases */
+            }
+            /* Found, or an error that must be propagated (see above) */
+            st[k].pending = 0;
+            st[k].i = i;
+        }
+    }
+
+    for (j = 0; j < nreqs; j++) {
+        if (st[j].ent == NULL)
+            continue;
+        reqs[j].ret = fetch_done(context, config, reqs[j].principal,
+                                 st[j].flags, st[j].key, st[j].positive,
+                                 generation, st[j].i, reqs[j].ret,
+                                 &st[j].ent, reqs[j].db, reqs[j].h);
+        free(st[j].ent);
+        if (reqs[j].ret == 0)
+            heim_mem_account(HEIM_MEM_HDB, sizeof(**reqs[j].h), 1);
+    }
+    for (j = 0; j < nreqs; j++)
+        free(st[j].key);
+    free(st);
+    free(hreqs);
+    free(idx);
 }
 
 KDC_LIB_FUNCTION void KDC_LIB_CALL
 _kdc_free_ent(krb5_context context, hdb_entry_ex *ent)
 {
+    heim_mem_account(HEIM_MEM_HDB, -(int64_t)sizeof(*ent), -1);
     hdb_free_entry (context, ent);
     free (ent);
 }
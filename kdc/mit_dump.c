@@ -137,6 +137,307 @@ my_fgetln(FILE *f, char **bufp, size_t *szp, size_t *lenp)
     return 0; /* *len == 0 || no EOL -> EOF */
 }
 
+/*
+ * Convert one "princ" line to an entry.  Returns -1 if the line was
+ * skipped with a warning.
+ */
+static krb5_error_code
+princ_line2entry(krb5_context context, krb5_storage *sp, char *line,
+                 int lineno, hdb_entry_ex *ent)
+{
+    krb5_error_code ret;
+    krb5_data kdb_ent;
+
+    krb5_storage_truncate(sp, 0);
+    ret = _hdb_mit_dump2mitdb_entry(context, line, sp);
+    if (ret) {
+        if (ret > 0)
+            warn("line: %d: failed to parse; ignoring", lineno);
+        else
+            warnx("line: %d: failed to parse; ignoring", lineno);
+        return -1;
+    }
+    ret = krb5_storage_to_data(sp, &kdb_ent);
+    if (ret)
+        return ret;
+    ret = _hdb_mdb_value2entry(context, &kdb_ent, 0, &ent->entry);
+    krb5_data_free(&kdb_ent);
+    if (ret) {
+        warnx("line: %d: failed to store; ignoring", lineno);
+        return -1;
+    }
+    return 0;
+}
+
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+
+/*
+ * With --threads the reading thread only splits the dump into batches of
+ * "princ" lines.  A pool of workers converts each batch to entries, seals
+ * or unseals their keys (each worker has a master key of its own), encodes
+ * them, and then sends the whole batch under a lock.  Entries thus reach
+ * hpropd in batch order rather than dump order, which it doesn't mind.
+ *
+ * There are a fixed number of batches, recycled through a free list, so
+ * the reader can't get far ahead of the workers.
+ */
+#define MIT_DUMP_BATCH 512
+
+struct line_batch {
+    struct line_batch *next;
+    char *buf;
+    size_t len;
+    size_t sz;
+    size_t n;
+    size_t off[MIT_DUMP_BATCH];
+    int lineno[MIT_DUMP_BATCH];
+};
+
+struct line_pool {
+    struct prop_data *pd;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;
+    pthread_cond_t free_cv;
+    pthread_mutex_t send_lock;
+    struct line_batch *queue;
+    struct line_batch **queue_tail;
+    struct line_batch *free_list;
+    struct line_batch *batches;
+    size_t nbatches;
+    pthread_t *threads;
+    int nthreads;
+    int done;
+    krb5_error_code ret;
+};
+
+static void
+pool_fail(struct line_pool *pool, krb5_error_code ret)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->ret == 0)
+        pool->ret = ret;
+    pthread_cond_broadcast(&pool->work_cv);
+    pthread_cond_broadcast(&pool->free_cv);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static krb5_error_code
+pool_do_batch(krb5_context context, hdb_master_key mkey, krb5_storage *sp,
+              struct line_pool *pool, struct line_batch *b, krb5_data *out)
+{
+    krb5_error_code ret = 0;
+    size_t i, nout = 0;
+
+    for (i = 0; ret == 0 && i < b->n; i++) {
+        hdb_entry_ex ent;
+
+        memset(&ent, 0, sizeof(ent));
+        ret = princ_line2entry(context, sp, b->buf + b->off[i],
+                               b->lineno[i], &ent);
+        if (ret == -1) {
+            ret = 0;
+            continue;
+        }
+        if (ret)
+            break;
+        ret = v5_prop_encode(context, mkey, &ent, &out[nout]);
+        hdb_free_entry(context, &ent);
+        if (ret == 0)
+            nout++;
+    }
+
+    pthread_mutex_lock(&pool->send_lock);
+    for (i = 0; i < nout; i++) {
+        if (ret == 0)
+            ret = v5_prop_send(pool->pd, &out[i]);
+        krb5_data_free(&out[i]);
+    }
+    pthread_mutex_unlock(&pool->send_lock);
+    return ret;
+}
+
+static void *
+pool_worker(void *arg)
+{
+    struct line_pool *pool = arg;
+    struct line_batch *b;
+    krb5_context context = NULL;
+    krb5_storage *sp = NULL;
+    hdb_master_key mkey = NULL;
+    krb5_data *out = NULL;
+    krb5_error_code ret;
+
+    ret = v5_prop_thread_init(&context, &mkey);
+    if (ret == 0 && (sp = krb5_storage_emem()) == NULL)
+        ret = ENOMEM;
+    if (ret == 0 && (out = calloc(MIT_DUMP_BATCH, sizeof(out[0]))) == NULL)
+        ret = ENOMEM;
+
+    while (ret == 0) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queue == NULL && !pool->done && pool->ret == 0)
+            pthread_cond_wait(&pool->work_cv, &pool->lock);
+        if ((b = pool->queue) != NULL && pool->ret == 0) {
+            if ((pool->queue = b->next) == NULL)
+                pool->queue_tail = &pool->queue;
+        } else {
+            b = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (b == NULL)
+            break;
+
+        ret = pool_do_batch(context, mkey, sp, pool, b, out);
+
+        pthread_mutex_lock(&pool->lock);
+        b->n = b->len = 0;
+        b->next = pool->free_list;
+        pool->free_list = b;
+        pthread_cond_signal(&pool->free_cv);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (ret)
+        pool_fail(pool, ret);
+
+    free(out);
+    if (sp)
+        krb5_storage_free(sp);
+    if (context) {
+        hdb_free_master_key(context, mkey);
+        krb5_free_context(context);
+    }
+    return NULL;
+}
+
+static void
+pool_stop(struct line_pool *pool)
+{
+    size_t i;
+    int k;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->done = 1;
+    pthread_cond_broadcast(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+    for (k = 0; k < pool->nthreads; k++)
+        pthread_join(pool->threads[k], NULL);
+    for (i = 0; pool->batches && i < pool->nbatches; i++)
+        free(pool->batches[i].buf);
+    free(pool->batches);
+    free(pool->threads);
+    pool->batches = NULL;
+    pool->threads = NULL;
+    pool->nthreads = 0;
+    pthread_cond_destroy(&pool->work_cv);
+    pthread_cond_destroy(&pool->free_cv);
+    pthread_mutex_destroy(&pool->send_lock);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+static krb5_error_code
+pool_start(struct line_pool *pool, struct prop_data *pd)
+{
+    size_t i;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->pd = pd;
+    pool->queue_tail = &pool->queue;
+    pool->nbatches = 2 * pd->threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->send_lock, NULL);
+    pthread_cond_init(&pool->work_cv, NULL);
+    pthread_cond_init(&pool->free_cv, NULL);
+    pool->batches = calloc(pool->nbatches, sizeof(pool->batches[0]));
+    pool->threads = calloc(pd->threads, sizeof(pool->threads[0]));
+    if (pool->batches == NULL || pool->threads == NULL) {
+        pool_stop(pool);
+        return ENOMEM;
+    }
+    for (i = 0; i < pool->nbatches; i++) {
+        pool->batches[i].next = pool->free_list;
+        pool->free_list = &pool->batches[i];
+    }
+    for (; pool->nthreads < pd->threads; pool->nthreads++) {
+        if (pthread_create(&pool->threads[pool->nthreads], NULL,
+                           pool_worker, pool) != 0)
+            break;
+    }
+    if (pool->nthreads == 0) {
+        pool_stop(pool);
+        return EAGAIN;
+    }
+    return 0;
+}
+
+/* Append a line to the current batch, queueing it when full */
+static krb5_error_code
+pool_add_line(struct line_pool *pool, struct line_batch **bp,
+              const char *line, size_t len, int lineno)
+{
+    struct line_batch *b = *bp;
+    krb5_error_code ret;
+
+    if (b == NULL) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->free_list == NULL && pool->ret == 0)
+            pthread_cond_wait(&pool->free_cv, &pool->lock);
+        if ((ret = pool->ret) == 0) {
+            b = pool->free_list;
+            pool->free_list = b->next;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (ret)
+            return ret;
+        *bp = b;
+    }
+
+    if (b->len + len + 1 > b->sz) {
+        size_t sz = b->sz ? b->sz : 65536;
+        char *tmp;
+
+        while (sz < b->len + len + 1)
+            sz *= 2;
+        if ((tmp = realloc(b->buf, sz)) == NULL)
+            return ENOMEM;
+        b->buf = tmp;
+        b->sz = sz;
+    }
+    memcpy(b->buf + b->len, line, len);
+    b->buf[b->len + len] = '\0';
+    b->off[b->n] = b->len;
+    b->lineno[b->n] = lineno;
+    b->len += len + 1;
+    if (++b->n == MIT_DUMP_BATCH) {
+        pthread_mutex_lock(&pool->lock);
+        b->next = NULL;
+        *pool->queue_tail = b;
+        pool->queue_tail = &b->next;
+        pthread_cond_signal(&pool->work_cv);
+        pthread_mutex_unlock(&pool->lock);
+        *bp = NULL;
+    }
+    return 0;
+}
+
+/* Queue any partial batch, wait for the workers and tear down the pool */
+static krb5_error_code
+pool_finish(struct line_pool *pool, struct line_batch *b)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (b && b->n) {
+        b->next = NULL;
+        *pool->queue_tail = b;
+        pool->queue_tail = &b->next;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    /* The workers drain the queue before they see pool->done */
+    pool_stop(pool);
+    return pool->ret;
+}
+#endif /* ENABLE_PTHREAD_SUPPORT && HAVE_PTHREAD_H */
+
 int
 mit_prop_dump(void *arg, const char *file)
 {
@@ -149,13 +450,22 @@ mit_prop_dump(void *arg, const char *file)
     struct hdb_entry_ex ent;
     struct prop_data *pd = arg;
     krb5_storage *sp = NULL;
-    krb5_data kdb_ent;
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+    struct line_pool pool;
+    struct line_batch *batch = NULL;
+    int use_pool = 0;
+#endif
 
     memset(&ent, 0, sizeof (ent));
     f = fopen(file, "r");
     if (f == NULL)
 	return errno;
 
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+    if (pd->threads > 1 && pool_start(&pool, pd) == 0)
+        use_pool = 1;
+#endif
+
     ret = ENOMEM;
     sp = krb5_storage_emem();
     if (!sp)
@@ -191,29 +501,31 @@ mit_prop_dump(void *arg, const char *file)
 	    warnx("line %d: not a principal", lineno);
 	    continue;
 	}
-        krb5_storage_truncate(sp, 0);
-        ret = _hdb_mit_dump2mitdb_entry(pd->context, line, sp);
-        if (ret) {
-            if (ret > 0)
-                warn("line: %d: failed to parse; ignoring", lineno);
-            else
-                warnx("line: %d: failed to parse; ignoring", lineno);
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+        if (use_pool) {
+            ret = pool_add_line(&pool, &batch, line, line_len, lineno);
+            if (ret) break;
             continue;
         }
-        ret = krb5_storage_to_data(sp, &kdb_ent);
-        if (ret) break;
-        ret = _hdb_mdb_value2entry(pd->context, &kdb_ent, 0, &ent.entry);
-        krb5_data_free(&kdb_ent);
-        if (ret) {
-            warnx("line: %d: failed to store; ignoring", lineno);
+#endif
+        ret = princ_line2entry(pd->context, sp, line, lineno, &ent);
+        if (ret == -1)
             continue;
-        }
+        if (ret) break;
 	ret = v5_prop(pd->context, NULL, &ent, arg);
         hdb_free_entry(pd->context, &ent);
         if (ret) break;
     }
 
 out:
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H)
+    if (use_pool) {
+        krb5_error_code ret2 = pool_finish(&pool, batch);
+
+        if (ret == 0)
+            ret = ret2;
+    }
+#endif
     fclose(f);
     free(line);
     if (sp)
@@ -224,4 +536,3 @@ out:
         errx(1, "line %d: problem parsing dump line", lineno);
     return ret;
 }
-
@@ -39,6 +39,126 @@
  * https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-sfu/
  */
 
+/*
+ * Front ends that do S4U2Self and S4U2Proxy for every user session
+ * ask the same (proxy, target) question over and over, and the
+ * allowed-to-delegate-to lists can be long.  Decisions taken from the
+ * HDB ACL are remembered per process, keyed by both principals and
+ * stamped with the proxy entry's kvno and creation and modification
+ * times, so that a changed entry no longer matches its old decisions.
+ * Backends that do not maintain the modification time (or change the
+ * ACL behind our back) are covered by a short lifetime.
+ */
+
+#define S4U_ACL_CACHE_SIZE	256
+#define S4U_ACL_CACHE_TIME	60
+
+struct s4u_acl_entry {
+    krb5_principal proxy;
+    krb5_principal target;
+    krb5uint32 kvno;
+    time_t created;
+    time_t modified;
+    time_t expires;
+    krb5_error_code result;
+};
+
+static HEIMDAL_MUTEX s4u_acl_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct s4u_acl_entry s4u_acl_cache[S4U_ACL_CACHE_SIZE];
+
+static uint32_t
+s4u_acl_hash_princ(uint32_t h, krb5_const_principal p)
+{
+    const unsigned char *s;
+    size_t i;
+
+    for (s = (const unsigned char *)p->realm; *s; s++)
+	h = (h ^ *s) * 16777619;
+    for (i = 0; i < p->name.name_string.len; i++) {
+	h = (h ^ '/') * 16777619;
+	for (s = (const unsigned char *)p->name.name_string.val[i]; *s; s++)
+	    h = (h ^ *s) * 16777619;
+    }
+    return h;
+}
+
+static struct s4u_acl_entry *
+s4u_acl_slot(krb5_const_principal proxy, krb5_const_principal target)
+{
+    uint32_t h = 2166136261U;
+
+    h = s4u_acl_hash_princ(h, proxy);
+    h = s4u_acl_hash_princ(h, target);
+    return &s4u_acl_cache[h % S4U_ACL_CACHE_SIZE];
+}
+
+static krb5_boolean
+s4u_acl_entry_matches(krb5_context context,
+		      const struct s4u_acl_entry *e,
+		      const hdb_entry *proxy,
+		      krb5_const_principal target)
+{
+    return e->proxy != NULL &&
+	e->expires > kdc_time &&
+	e->kvno == proxy->kvno &&
+	e->created == proxy->created_by.time &&
+	e->modified == (proxy->modified_by ? proxy->modified_by->time : 0) &&
+	krb5_principal_compare(context, e->proxy, proxy->principal) &&
+	krb5_principal_compare(context, e->target, target);
+}
+
+static krb5_boolean
+s4u_acl_cache_get(krb5_context context,
+		  const hdb_entry *proxy,
+		  krb5_const_principal target,
+		  krb5_error_code *result)
+{
+    struct s4u_acl_entry *e;
+    krb5_boolean found;
+
+    if (proxy->principal == NULL)
+	return FALSE;
+    e = s4u_acl_slot(proxy->principal, target);
+
+    HEIMDAL_MUTEX_lock(&s4u_acl_mutex);
+    found = s4u_acl_entry_matches(context, e, proxy, target);
+    if (found)
+	*result = e->result;
+    HEIMDAL_MUTEX_unlock(&s4u_acl_mutex);
+
+    return found;
+}
+
+static void
+s4u_acl_cache_put(krb5_context context,
+		  const hdb_entry *proxy,
+		  krb5_const_principal target,
+		  krb5_error_code result)
+{
+    struct s4u_acl_entry *e;
+
+    if (proxy->principal == NULL)
+	return;
+    e = s4u_acl_slot(proxy->principal, target);
+
+    HEIMDAL_MUTEX_lock(&s4u_acl_mutex);
+    krb5_free_principal(context, e->proxy);
+    krb5_free_principal(context, e->target);
+    e->proxy = e->target = NULL;
+    if (krb5_copy_principal(context, proxy->principal, &e->proxy) == 0 &&
+	krb5_copy_principal(context, target, &e->target) == 0) {
+	e->kvno = proxy->kvno;
+	e->created = proxy->created_by.time;
+	e->modified = proxy->modified_by ? proxy->modified_by->time : 0;
+	e->expires = kdc_time + S4U_ACL_CACHE_TIME;
+	e->result = result;
+    } else {
+	krb5_free_principal(context, e->proxy);
+	e->proxy = NULL;
+    }
+    HEIMDAL_MUTEX_unlock(&s4u_acl_mutex);
+}
+
 /*
  * Determine if constrained delegation is allowed from this client to this server
  */
@@ -77,19 +197,29 @@ check_constrained_delegation(krb5_context context,
 	if (krb5_principal_compare(context, client->entry.principal, server->entry.principal) == TRUE)
 	    return 0;
 
-	ret = hdb_entry_get_ConstrainedDelegACL(&client->entry, &acl);
-	if (ret) {
-	    krb5_clear_error_message(context);
-	    return ret;
-	}
+	if (s4u_acl_cache_get(context, &client->entry, target, &ret)) {
+	    if (ret == 0)
+		return 0;
+	} else {
+	    ret = hdb_entry_get_ConstrainedDelegACL(&client->entry, &acl);
+	    if (ret) {
+		krb5_clear_error_message(context);
+		return ret;
+	    }
 
-	if (acl) {
-	    for (i = 0; i < acl->len; i++) {
-		if (krb5_principal_compare(context, target, &acl->val[i]) == TRUE)
-		    return 0;
+	    ret = KRB5KDC_ERR_BADOPTION;
+	    if (acl) {
+		for (i = 0; i < acl->len; i++) {
+		    if (krb5_principal_compare(context, target, &acl->val[i]) == TRUE) {
+			ret = 0;
+			break;
+		    }
+		}
 	    }
+	    s4u_acl_cache_put(context, &client->entry, target, ret);
+	    if (ret == 0)
+		return 0;
 	}
-	ret = KRB5KDC_ERR_BADOPTION;
     }
     kdc_log(context, config, 4,
 	    "Bad request for constrained delegation");
@@ -93,6 +93,96 @@ _kdc_pk_free_client_ec_param(krb5_context context,
 #endif
 }
 
+/*
+ * Pool of ephemeral P-256 keys (the only curve get_ecdh_param()
+ * accepts), see the DH pool in pkinit.c.
+ */
+
+#ifdef HAVE_HCRYPTO_W_OPENSSL
+static size_t ec_pool_size;
+static EC_KEY **ec_pool;
+static size_t ec_pool_nkeys;
+static krb5_boolean ec_pool_used;
+static HEIMDAL_MUTEX ec_pool_mutex = HEIMDAL_MUTEX_INITIALIZER;
+
+static EC_KEY *
+ec_pool_get(const EC_GROUP *group)
+{
+    EC_KEY *key = NULL;
+
+    if (ec_pool_size == 0 ||
+	EC_GROUP_get_curve_name(group) != NID_X9_62_prime256v1)
+	return NULL;
+
+    HEIMDAL_MUTEX_lock(&ec_pool_mutex);
+    ec_pool_used = TRUE;
+    if (ec_pool_nkeys > 0) {
+	key = ec_pool[--ec_pool_nkeys];
+	ec_pool[ec_pool_nkeys] = NULL;
+    }
+    HEIMDAL_MUTEX_unlock(&ec_pool_mutex);
+
+    return key;
+}
+#endif /* HAVE_HCRYPTO_W_OPENSSL */
+
+void
+_kdc_pk_ec_key_pool_init(size_t size)
+{
+#ifdef HAVE_HCRYPTO_W_OPENSSL
+    if (size) {
+	ec_pool = calloc(size, sizeof(ec_pool[0]));
+	if (ec_pool == NULL)
+	    size = 0;
+    }
+    ec_pool_size = size;
+#endif
+}
+
+krb5_boolean
+_kdc_pk_ec_key_pool_wanted(void)
+{
+#ifdef HAVE_HCRYPTO_W_OPENSSL
+    /* Only spend time on the pool once a client has used ECDH */
+    return ec_pool_used && ec_pool_nkeys < ec_pool_size;
+#else
+    return FALSE;
+#endif
+}
+
+krb5_boolean
+_kdc_pk_ec_key_pool_fill_one(krb5_context context)
+{
+#ifdef HAVE_HCRYPTO_W_OPENSSL
+    EC_KEY *key;
+
+    if (!_kdc_pk_ec_key_pool_wanted())
+	return FALSE;
+
+    key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    if (key == NULL || EC_KEY_generate_key(key) != 1) {
+	/* Stop trying until a client uses ECDH again */
+	if (key)
+	    EC_KEY_free(key);
+	ec_pool_used = FALSE;
+	return TRUE;
+    }
+
+    HEIMDAL_MUTEX_lock(&ec_pool_mutex);
+    if (ec_pool_nkeys < ec_pool_size) {
+	ec_pool[ec_pool_nkeys++] = key;
+	key = NULL;
+    }
+    HEIMDAL_MUTEX_unlock(&ec_pool_mutex);
+
+    if (key)
+	EC_KEY_free(key);
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
 #ifdef HAVE_HCRYPTO_W_OPENSSL
 static krb5_error_code
 generate_ecdh_keyblock(krb5_context context,
@@ -129,15 +219,18 @@ generate_ecdh_keyblock(krb5_context context,
         return ret;
     }
 
-    ephemeral = EC_KEY_new();
-    if (ephemeral == NULL)
-        return krb5_enomem(context);
+    ephemeral = ec_pool_get(group);
+    if (ephemeral == NULL) {
+        ephemeral = EC_KEY_new();
+        if (ephemeral == NULL)
+            return krb5_enomem(context);
 
-    EC_KEY_set_group(ephemeral, group);
+        EC_KEY_set_group(ephemeral, group);
 
-    if (EC_KEY_generate_key(ephemeral) != 1) {
-	EC_KEY_free(ephemeral);
-        return krb5_enomem(context);
+        if (EC_KEY_generate_key(ephemeral) != 1) {
+            EC_KEY_free(ephemeral);
+            return krb5_enomem(context);
+        }
     }
 
     size = (EC_GROUP_get_degree(group) + 7) / 8;
@@ -69,17 +69,39 @@ struct pk_client_params {
     hx509_verify_ctx verify_ctx;
 };
 
+/*
+ * The mappings file is hashed on (principal, subject), which is the
+ * question _kdc_pk_check_client() asks, and is read again when its
+ * modification time changes; the new table replaces the old one once
+ * it is complete, so requests never see a half loaded file.
+ */
+
 struct pk_principal_mapping {
-    unsigned int len;
+    size_t len;
+    size_t nbuckets;		/* power of two */
     struct pk_allowed_princ {
+	struct pk_allowed_princ *next;
+	uint32_t hash;
 	krb5_principal principal;
 	char *subject;
-    } *val;
+    } **buckets;
 };
 
+#define PK_MAPPING_MIN_BUCKETS	256
+
 static struct krb5_pk_identity *kdc_identity;
-static struct pk_principal_mapping principal_mappings;
+static struct pk_principal_mapping *principal_mappings;
+static char *mappings_file;
+static time_t mappings_mtime;
+static time_t mappings_checked;
+static HEIMDAL_RWLOCK mappings_lock = HEIMDAL_RWLOCK_INITIALIZER;
+
+static void refresh_mappings(krb5_context, krb5_kdc_configuration *);
+static krb5_boolean find_principal_mapping(krb5_context,
+					   krb5_const_principal,
+					   const char *);
 static struct krb5_dh_moduli **moduli;
+static hx509_verify_cache verify_cache;
 
 static struct {
     krb5_data data;
@@ -87,6 +109,163 @@ static struct {
     time_t next_update;
 } ocsp;
 
+/*
+ * Generating the KDC's ephemeral DH key pair dominates the cost of a
+ * DH PKINIT exchange.  Key pairs for each group clients have used are
+ * generated ahead of time by _kdc_pk_key_pool_fill(), which the
+ * request loop calls when it is idle, and taken from the pool in the
+ * request path; when the pool is empty the key is generated inline.
+ */
+
+#define PK_DH_POOL_GROUPS	4
+
+static struct pk_dh_pool {
+    char *group;		/* moduli name, NULL if unused */
+    DH *params;			/* p, g and q of the group */
+    DH **keys;
+    size_t nkeys;
+} dh_pool[PK_DH_POOL_GROUPS];
+static size_t key_pool_size;
+static HEIMDAL_MUTEX dh_pool_mutex = HEIMDAL_MUTEX_INITIALIZER;
+
+static DH *
+dh_copy_params(const DH *from)
+{
+    DH *dh = DH_new();
+
+    if (dh == NULL)
+	return NULL;
+    dh->p = BN_dup(from->p);
+    dh->g = BN_dup(from->g);
+    if (from->q)
+	dh->q = BN_dup(from->q);
+    if (dh->p == NULL || dh->g == NULL || (from->q && dh->q == NULL)) {
+	DH_free(dh);
+	return NULL;
+    }
+    return dh;
+}
+
+/*
+ * Take a pooled key pair for the group of `cp', registering the group
+ * so that the pool is filled for the next request if there is none.
+ */
+static DH *
+dh_pool_get(pk_client_params *cp)
+{
+    struct pk_dh_pool *pool = NULL;
+    DH *dh = NULL;
+    size_t i;
+
+    if (key_pool_size == 0 || cp->dh_group_name == NULL)
+	return NULL;
+
+    HEIMDAL_MUTEX_lock(&dh_pool_mutex);
+    for (i = 0; i < PK_DH_POOL_GROUPS; i++) {
+	if (dh_pool[i].group == NULL) {
+	    if (pool == NULL)
+		pool = &dh_pool[i];
+	} else if (strcmp(dh_pool[i].group, cp->dh_group_name) == 0) {
+	    pool = &dh_pool[i];
+	    break;
+	}
+    }
+    if (pool && pool->group == NULL) {
+	pool->group = strdup(cp->dh_group_name);
+	pool->params = dh_copy_params(cp->u.dh.key);
+	pool->keys = calloc(key_pool_size, sizeof(pool->keys[0]));
+	if (pool->group == NULL || pool->params == NULL || pool->keys == NULL) {
+	    free(pool->group);
+	    if (pool->params)
+		DH_free(pool->params);
+	    free(pool->keys);
+	    memset(pool, 0, sizeof(*pool));
+	}
+    } else if (pool && pool->nkeys > 0) {
+	dh = pool->keys[--pool->nkeys];
+	pool->keys[pool->nkeys] = NULL;
+    }
+    HEIMDAL_MUTEX_unlock(&dh_pool_mutex);
+
+    return dh;
+}
+
+static krb5_boolean
+dh_pool_wanted(void)
+{
+    size_t i;
+
+    for (i = 0; i < PK_DH_POOL_GROUPS; i++)
+	if (dh_pool[i].group && dh_pool[i].nkeys < key_pool_size)
+	    return TRUE;
+    return FALSE;
+}
+
+static krb5_boolean
+dh_pool_fill_one(void)
+{
+    struct pk_dh_pool *pool = NULL;
+    DH *dh = NULL;
+    size_t i;
+
+    HEIMDAL_MUTEX_lock(&dh_pool_mutex);
+    for (i = 0; i < PK_DH_POOL_GROUPS; i++) {
+	if (dh_pool[i].group && dh_pool[i].nkeys < key_pool_size) {
+	    pool = &dh_pool[i];
+	    dh = dh_copy_params(pool->params);
+	    break;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&dh_pool_mutex);
+
+    if (dh == NULL)
+	return FALSE;
+
+    if (!DH_generate_key(dh)) {
+	/* Stop trying until a client uses the group again */
+	HEIMDAL_MUTEX_lock(&dh_pool_mutex);
+	while (pool->nkeys > 0)
+	    DH_free(pool->keys[--pool->nkeys]);
+	free(pool->group);
+	DH_free(pool->params);
+	free(pool->keys);
+	memset(pool, 0, sizeof(*pool));
+	HEIMDAL_MUTEX_unlock(&dh_pool_mutex);
+    } else {
+	HEIMDAL_MUTEX_lock(&dh_pool_mutex);
+	if (pool->nkeys < key_pool_size) {
+	    pool->keys[pool->nkeys++] = dh;
+	    dh = NULL;
+	}
+	HEIMDAL_MUTEX_unlock(&dh_pool_mutex);
+    }
+
+    if (dh)
+	DH_free(dh);
+    return TRUE;
+}
+
+/*
+ * Return true if there are ephemeral key pools below their target
+ * size.
+ */
+krb5_boolean
+_kdc_pk_key_pool_wanted(void)
+{
+    return dh_pool_wanted() || _kdc_pk_ec_key_pool_wanted();
+}
+
+/*
+ * Generate one pooled ephemeral key pair, meant to be called when the
+ * KDC has nothing else to do.
+ */
+void
+_kdc_pk_key_pool_fill(krb5_context context)
+{
+    if (!dh_pool_fill_one())
+	(void) _kdc_pk_ec_key_pool_fill_one(context);
+}
+
 /*
  *
  */
@@ -192,6 +371,7 @@ generate_dh_keyblock(krb5_context context,
     krb5_keyblock key;
     krb5_error_code ret;
     size_t dh_gen_keylen, size;
+    DH *pooled;
 
     memset(&key, 0, sizeof(key));
 
@@ -203,7 +383,11 @@ generate_dh_keyblock(krb5_context context,
 	    goto out;
 	}
 
-	if (!DH_generate_key(client_params->u.dh.key)) {
+	pooled = dh_pool_get(client_params);
+	if (pooled) {
+	    DH_free(client_params->u.dh.key);
+	    client_params->u.dh.key = pooled;
+	} else if (!DH_generate_key(client_params->u.dh.key)) {
 	    ret = KRB5KRB_ERR_GENERIC;
 	    krb5_set_error_message(context, ret,
 				   "Can't generate Diffie-Hellman keys");
@@ -459,6 +643,8 @@ _kdc_pk_rd_padata(astgs_request_t priv,
 
     hx509_verify_set_time(cp->verify_ctx, kdc_time);
     hx509_verify_attach_anchors(cp->verify_ctx, trust_anchors);
+    if (verify_cache)
+	hx509_verify_attach_cache(cp->verify_ctx, verify_cache);
     hx509_certs_free(&trust_anchors);
 
     if (config->pkinit_allow_proxy_certs)
@@ -1785,16 +1971,9 @@ _kdc_pk_check_client(astgs_request_t r,
 	}
     }
 
-    for (i = 0; i < principal_mappings.len; i++) {
-	krb5_boolean b;
-
-	b = krb5_principal_compare(r->context,
-				   client->entry.principal,
-				   principal_mappings.val[i].principal);
-	if (b == FALSE)
-	    continue;
-	if (strcmp(principal_mappings.val[i].subject, *subject_name) != 0)
-	    continue;
+    refresh_mappings(r->context, config);
+    if (find_principal_mapping(r->context, client->entry.principal,
+			       *subject_name)) {
 	kdc_log(r->context, config, 5,
 		"Found matching PKINIT FILE ACL");
 	return 0;
@@ -1815,37 +1994,126 @@ _kdc_pk_check_client(astgs_request_t r,
     return ret;
 }
 
+static uint32_t
+mapping_hash(krb5_const_principal principal, const char *subject)
+{
+    const unsigned char *p;
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    for (p = (const unsigned char *)principal->realm; *p; p++)
+	h = (h ^ *p) * 16777619;
+    for (i = 0; i < principal->name.name_string.len; i++) {
+	h = (h ^ '/') * 16777619;
+	for (p = (const unsigned char *)principal->name.name_string.val[i]; *p; p++)
+	    h = (h ^ *p) * 16777619;
+    }
+    h = (h ^ ':') * 16777619;
+    for (p = (const unsigned char *)subject; *p; p++)
+	h = (h ^ *p) * 16777619;
+    return h;
+}
+
+static void
+free_principal_mappings(krb5_context context, struct pk_principal_mapping *m)
+{
+    struct pk_allowed_princ *e, *next;
+    size_t i;
+
+    if (m == NULL)
+	return;
+    for (i = 0; i < m->nbuckets; i++) {
+	for (e = m->buckets[i]; e; e = next) {
+	    next = e->next;
+	    krb5_free_principal(context, e->principal);
+	    free(e->subject);
+	    free(e);
+	}
+    }
+    free(m->buckets);
+    free(m);
+}
+
+static krb5_error_code
+grow_principal_mappings(struct pk_principal_mapping *m)
+{
+    struct pk_allowed_princ **buckets, *e, *next;
+    size_t i, n = m->nbuckets * 2;
+
+    buckets = calloc(n, sizeof(buckets[0]));
+    if (buckets == NULL)
+	return ENOMEM;
+    for (i = 0; i < m->nbuckets; i++) {
+	for (e = m->buckets[i]; e; e = next) {
+	    next = e->next;
+	    e->next = buckets[e->hash & (n - 1)];
+	    buckets[e->hash & (n - 1)] = e;
+	}
+    }
+    free(m->buckets);
+    m->buckets = buckets;
+    m->nbuckets = n;
+    return 0;
+}
+
 static krb5_error_code
 add_principal_mapping(krb5_context context,
+		      struct pk_principal_mapping *m,
 		      const char *principal_name,
 		      const char * subject)
 {
-   struct pk_allowed_princ *tmp;
-   krb5_principal principal;
+   struct pk_allowed_princ *e;
    krb5_error_code ret;
 
-   tmp = realloc(principal_mappings.val,
-	         (principal_mappings.len + 1) * sizeof(*tmp));
-   if (tmp == NULL)
+   if (m->len >= m->nbuckets * 2 && grow_principal_mappings(m))
        return ENOMEM;
-   principal_mappings.val = tmp;
 
-   ret = krb5_parse_name(context, principal_name, &principal);
-   if (ret)
-       return ret;
+   e = calloc(1, sizeof(*e));
+   if (e == NULL)
+       return ENOMEM;
 
-   principal_mappings.val[principal_mappings.len].principal = principal;
+   ret = krb5_parse_name(context, principal_name, &e->principal);
+   if (ret) {
+       free(e);
+       return ret;
+   }
 
-   principal_mappings.val[principal_mappings.len].subject = strdup(subject);
-   if (principal_mappings.val[principal_mappings.len].subject == NULL) {
-       krb5_free_principal(context, principal);
+   e->subject = strdup(subject);
+   if (e->subject == NULL) {
+       krb5_free_principal(context, e->principal);
+       free(e);
        return ENOMEM;
    }
-   principal_mappings.len++;
+   e->hash = mapping_hash(e->principal, e->subject);
+   e->next = m->buckets[e->hash & (m->nbuckets - 1)];
+   m->buckets[e->hash & (m->nbuckets - 1)] = e;
+   m->len++;
 
    return 0;
 }
 
+static krb5_boolean
+find_principal_mapping(krb5_context context,
+		       krb5_const_principal principal,
+		       const char *subject)
+{
+    struct pk_allowed_princ *e;
+    krb5_boolean found = FALSE;
+    uint32_t h = mapping_hash(principal, subject);
+
+    HEIMDAL_RWLOCK_rdlock(&mappings_lock);
+    if (principal_mappings) {
+	e = principal_mappings->buckets[h & (principal_mappings->nbuckets - 1)];
+	for (; e && !found; e = e->next)
+	    found = e->hash == h &&
+		strcmp(e->subject, subject) == 0 &&
+		krb5_principal_compare(context, principal, e->principal);
+    }
+    HEIMDAL_RWLOCK_unlock(&mappings_lock);
+
+    return found;
+}
+
 krb5_error_code
 _kdc_add_initial_verified_cas(krb5_context context,
 			      krb5_kdc_configuration *config,
@@ -1879,9 +2147,10 @@ _kdc_add_initial_verified_cas(krb5_context context,
  *
  */
 
-static void
+static struct pk_principal_mapping *
 load_mappings(krb5_context context, const char *fn)
 {
+    struct pk_principal_mapping *m;
     krb5_error_code ret;
     char buf[1024];
     unsigned long lineno = 0;
@@ -1889,7 +2158,18 @@ load_mappings(krb5_context context, const char *fn)
 
     f = fopen(fn, "r");
     if (f == NULL)
-	return;
+	return NULL;
+
+    m = calloc(1, sizeof(*m));
+    if (m)
+	m->buckets = calloc(PK_MAPPING_MIN_BUCKETS, sizeof(m->buckets[0]));
+    if (m == NULL || m->buckets == NULL) {
+	krb5_warnx(context, "PKINIT: out of memory loading %s", fn);
+	free(m);
+	fclose(f);
+	return NULL;
+    }
+    m->nbuckets = PK_MAPPING_MIN_BUCKETS;
 
     while (fgets(buf, sizeof(buf), f) != NULL) {
 	char *subject_name, *p;
@@ -1911,7 +2191,7 @@ load_mappings(krb5_context context, const char *fn)
 	}
 	*subject_name++ = '\0';
 
-	ret = add_principal_mapping(context, p, subject_name);
+	ret = add_principal_mapping(context, m, p, subject_name);
 	if (ret) {
 	    krb5_warn(context, ret, "failed to add line %lu \":\" :%s\n",
 		      lineno, buf);
@@ -1920,6 +2200,39 @@ load_mappings(krb5_context context, const char *fn)
     }
 
     fclose(f);
+    return m;
+}
+
+/*
+ * Reload the mappings file if it changed, checking at most once a
+ * second.
+ */
+static void
+refresh_mappings(krb5_context context, krb5_kdc_configuration *config)
+{
+    struct pk_principal_mapping *m, *old;
+    struct stat sb;
+    time_t mtime;
+
+    if (mappings_file == NULL || mappings_checked == kdc_time)
+	return;
+    mappings_checked = kdc_time;
+
+    mtime = stat(mappings_file, &sb) == 0 ? sb.st_mtime : 0;
+    if (mtime == mappings_mtime)
+	return;
+
+    m = mtime ? load_mappings(context, mappings_file) : NULL;
+
+    HEIMDAL_RWLOCK_wrlock(&mappings_lock);
+    old = principal_mappings;
+    principal_mappings = m;
+    mappings_mtime = mtime;
+    HEIMDAL_RWLOCK_unlock(&mappings_lock);
+
+    free_principal_mappings(context, old);
+    kdc_log(context, config, 3, "PKINIT: reloaded %s, %lu mappings",
+	    mappings_file, m ? (unsigned long)m->len : 0UL);
 }
 
 /*
@@ -1945,8 +2258,15 @@ krb5_kdc_pk_initialize(krb5_context context,
     if (ret)
 	krb5_err(context, 1, ret, "PKINIT: failed to load moduli file");
 
-    principal_mappings.len = 0;
-    principal_mappings.val = NULL;
+    key_pool_size = config->pkinit_key_pool_size;
+    _kdc_pk_ec_key_pool_init(key_pool_size);
+
+    if (config->pkinit_verify_cache_lifetime > 0 &&
+	hx509_verify_cache_init(context->hx509ctx, 1024,
+				config->pkinit_verify_cache_lifetime,
+				&verify_cache) != 0)
+	krb5_warnx(context, "PKINIT: failed to allocate verify cache");
+
 
     ret = _krb5_pk_load_id(context,
 			   &kdc_identity,
@@ -2028,9 +2348,19 @@ krb5_kdc_pk_initialize(krb5_context context,
 	file = fn;
     }
 
-    load_mappings(context, file);
-    if (fn)
-	free(fn);
+    {
+	struct stat sb;
+
+	mappings_file = fn ? fn : strdup(file);
+	fn = NULL;
+	if (mappings_file == NULL) {
+	    krb5_warnx(context, "PKINIT: out of memory");
+	    return ENOMEM;
+	}
+	if (stat(mappings_file, &sb) == 0)
+	    mappings_mtime = sb.st_mtime;
+	principal_mappings = load_mappings(context, mappings_file);
+    }
 
     return 0;
 }
@@ -42,6 +42,49 @@
 #undef  __attribute__
 #define __attribute__(x)
 
+/*
+ * Per-request arena.  The request object and a small bump allocator
+ * live together in one block on process_request()'s stack; anything
+ * allocated with _kdc_request_alloc() that does not fit in the inline
+ * buffer comes from chunks which are all released when the request is
+ * done.  Nothing allocated from the arena may outlive the request.
+ *
+ * The block also records whether anything will look at the request's
+ * formatted audit key/value pairs, so that they are not built for
+ * nothing; see audit_wanted().
+ */
+
+#define REQUEST_BLOCK(r)	((struct kdc_request_block *)(r))
+
+#define KDC_ARENA_ALIGN		16
+#define KDC_ARENA_INLINE	2048
+#define KDC_ARENA_CHUNK		8192
+
+#define KDC_ARENA_ROUND(n) \
+    (((n) + KDC_ARENA_ALIGN - 1) & ~((size_t)KDC_ARENA_ALIGN - 1))
+
+struct kdc_arena_chunk {
+    struct kdc_arena_chunk *next;
+};
+
+struct kdc_request_block {
+    union {
+	struct kdc_request_desc kdc;
+	struct astgs_request_desc astgs;
+	struct kx509_req_context_desc kx509;
+    } u;
+    struct kdc_arena_chunk *chunks;
+    unsigned char *ptr;
+    size_t avail;
+    unsigned int audit_kv:1;		/* someone consumes r->kv */
+    unsigned int audit_trail:1;		/* the audit trail gets logged */
+    union {
+	uint64_t align;
+	void *ptr;
+	unsigned char buf[KDC_ARENA_INLINE];
+    } inline_buf;
+};
+
 KDC_LIB_FUNCTION void KDC_LIB_CALL
 _kdc_audit_vaddreason(kdc_request_t r, const char *fmt, va_list ap)
 	__attribute__ ((__format__ (__printf__, 2, 0)))
@@ -71,7 +114,8 @@ _kdc_audit_vaddkv(kdc_request_t r, int flags, const char *k,
 		  const char *fmt, va_list ap)
 	__attribute__ ((__format__ (__printf__, 4, 0)))
 {
-    heim_audit_vaddkv((heim_svc_req_desc)r, flags, k, fmt, ap);
+    if (REQUEST_BLOCK(r)->audit_kv)
+	heim_audit_vaddkv((heim_svc_req_desc)r, flags, k, fmt, ap);
 }
 
 KDC_LIB_FUNCTION void KDC_LIB_CALL
@@ -81,6 +125,9 @@ _kdc_audit_addkv(kdc_request_t r, int flags, const char *k,
 {
     va_list ap;
 
+    if (!REQUEST_BLOCK(r)->audit_kv)
+	return;
+
     va_start(ap, fmt);
     heim_audit_vaddkv((heim_svc_req_desc)r, flags, k, fmt, ap);
     va_end(ap);
@@ -91,7 +138,8 @@ _kdc_audit_addkv_timediff(kdc_request_t r, const char *k,
 			  const struct timeval *start,
 			  const struct timeval *end)
 {
-    heim_audit_addkv_timediff((heim_svc_req_desc)r,k, start, end);
+    if (REQUEST_BLOCK(r)->audit_kv)
+	heim_audit_addkv_timediff((heim_svc_req_desc)r,k, start, end);
 }
 
 KDC_LIB_FUNCTION void KDC_LIB_CALL
@@ -140,6 +188,9 @@ _kdc_audit_addaddrs(kdc_request_t r, HostAddresses *a, const char *key)
     size_t i;
     char buf[128];
 
+    if (!REQUEST_BLOCK(r)->audit_kv)
+	return;
+
     if (a->len > 3) {
         char numkey[32];
 
@@ -154,11 +205,75 @@ _kdc_audit_addaddrs(kdc_request_t r, HostAddresses *a, const char *key)
     }
 }
 
+/*
+ * Per-stage timers.  _kdc_stage_start() samples the clock into `tv' and
+ * _kdc_stage_end() adds the time since then to the given stage, leaving
+ * `tv' at the current time so consecutive stages can share it.  Both
+ * are no-ops unless [kdc] audit-stage-timing is set.
+ */
+
+void
+_kdc_stage_start(astgs_request_t r, struct timeval *tv)
+{
+    if (r->config->audit_stage_timing)
+	gettimeofday(tv, NULL);
+}
+
+void
+_kdc_stage_end(astgs_request_t r, int stage, struct timeval *tv)
+{
+    struct timeval now, *acc;
+
+    if (!r->config->audit_stage_timing || stage < 0 || stage >= KDC_STAGE_MAX)
+	return;
+
+    gettimeofday(&now, NULL);
+    acc = &r->stage_time[stage];
+    acc->tv_sec += now.tv_sec - tv->tv_sec;
+    acc->tv_usec += now.tv_usec - tv->tv_usec;
+    while (acc->tv_usec < 0) {
+	acc->tv_usec += 1000000;
+	acc->tv_sec--;
+    }
+    while (acc->tv_usec >= 1000000) {
+	acc->tv_usec -= 1000000;
+	acc->tv_sec++;
+    }
+    r->stages_timed |= 1U << stage;
+    *tv = now;
+}
+
+static void
+audit_stage_times(astgs_request_t r)
+{
+    static const char *names[KDC_STAGE_MAX] = {
+	"t-decode",
+	"t-client-fetch",
+	"t-server-fetch",
+	"t-krbtgt-fetch",
+	"t-unseal",
+	"t-preauth",
+	"t-pac",
+	"t-encrypt",
+	"t-encode",
+    };
+    struct timeval zero = { 0, 0 };
+    int i;
+
+    for (i = 0; i < KDC_STAGE_MAX; i++)
+	if (r->stages_timed & (1U << i))
+	    _kdc_audit_addkv_timediff((kdc_request_t)r, names[i],
+				      &zero, &r->stage_time[i]);
+}
+
 KDC_LIB_FUNCTION void KDC_LIB_CALL
 _kdc_audit_trail(kdc_request_t r, krb5_error_code ret)
 {
     const char *retname = NULL;
 
+    if (!REQUEST_BLOCK(r)->audit_trail)
+	return;
+
     /* Get a symbolic name for some error codes */
 #define CASE(x)	case x : retname = #x; break
     switch (ret ? ret : r->ret) {
@@ -207,22 +322,37 @@ _kdc_audit_trail(kdc_request_t r, krb5_error_code ret)
     heim_audit_trail((heim_svc_req_desc)r, ret, retname);
 }
 
+/*
+ * Ticket times and skew checks only need seconds, so read the cheap
+ * coarse clock where there is one.
+ */
 KDC_LIB_FUNCTION void KDC_LIB_CALL
 krb5_kdc_update_time(struct timeval *tv)
 {
-    if (tv == NULL)
+    if (tv == NULL) {
+#ifdef CLOCK_REALTIME_COARSE
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0) {
+	    _kdc_now.tv_sec = ts.tv_sec;
+	    _kdc_now.tv_usec = ts.tv_nsec / 1000;
+	    return;
+	}
+#endif
 	gettimeofday(&_kdc_now, NULL);
-    else
+    } else
 	_kdc_now = *tv;
 }
 
 
+/*
+ * process_request() allocates every request from a kdc_request_block,
+ * which has room for the largest extension of kdc_request_desc, so
+ * extending a request only has to clear the extension part.
+ */
 #define EXTEND_REQUEST_T(LHS, RHS) do {			\
-	RHS = realloc(LHS, sizeof(*RHS));		\
-	if (!RHS)					\
-	    return krb5_enomem((LHS)->context);		\
-	LHS = (void *)RHS;				\
-	memset(((char *)LHS) + sizeof(*LHS),		\
+	RHS = (void *)(LHS);				\
+	memset(((char *)RHS) + sizeof(*LHS),		\
 	       0x0,					\
 	       sizeof(*RHS) - sizeof(*LHS));		\
     } while (0)
@@ -232,14 +362,17 @@ kdc_as_req(kdc_request_t *rptr, int *claim)
 {
     astgs_request_t r;
     krb5_error_code ret;
+    struct timeval tv;
     size_t len;
 
     /* We must free things in the extensions */
     EXTEND_REQUEST_T(*rptr, r);
 
+    _kdc_stage_start(r, &tv);
     ret = decode_AS_REQ(r->request.data, r->request.length, &r->req, &len);
     if (ret)
 	return ret;
+    _kdc_stage_end(r, KDC_STAGE_DECODE, &tv);
 
     r->reqtype = "AS-REQ";
     r->use_request_t = 1;
@@ -247,6 +380,7 @@ kdc_as_req(kdc_request_t *rptr, int *claim)
 
     ret = _kdc_as_rep(r);
     free_AS_REQ(&r->req);
+    audit_stage_times(r);
     return ret;
 }
 
@@ -256,14 +390,17 @@ kdc_tgs_req(kdc_request_t *rptr, int *claim)
 {
     astgs_request_t r;
     krb5_error_code ret;
+    struct timeval tv;
     size_t len;
 
     /* We must free things in the extensions */
     EXTEND_REQUEST_T(*rptr, r);
 
+    _kdc_stage_start(r, &tv);
     ret = decode_TGS_REQ(r->request.data, r->request.length, &r->req, &len);
     if (ret)
 	return ret;
+    _kdc_stage_end(r, KDC_STAGE_DECODE, &tv);
 
     r->reqtype = "TGS-REQ";
     r->use_request_t = 1;
@@ -271,6 +408,7 @@ kdc_tgs_req(kdc_request_t *rptr, int *claim)
 
     ret = _kdc_tgs_rep(r);
     free_TGS_REQ(&r->req);
+    audit_stage_times(r);
     return ret;
 }
 
@@ -339,6 +477,131 @@ static struct krb5_kdc_service services[] =  {
     { 0, NULL, NULL }
 };
 
+void *
+_kdc_request_alloc(kdc_request_t r, size_t len)
+{
+    struct kdc_request_block *b = (struct kdc_request_block *)r;
+    void *p;
+
+    len = KDC_ARENA_ROUND(len);
+    if (len > b->avail) {
+	size_t hdr = KDC_ARENA_ROUND(sizeof(struct kdc_arena_chunk));
+	size_t size = len > KDC_ARENA_CHUNK ? len : KDC_ARENA_CHUNK;
+	struct kdc_arena_chunk *c;
+
+	c = malloc(hdr + size);
+	if (c == NULL)
+	    return NULL;
+	c->next = b->chunks;
+	b->chunks = c;
+	b->ptr = (unsigned char *)c + hdr;
+	b->avail = size;
+    }
+    p = b->ptr;
+    b->ptr += len;
+    b->avail -= len;
+    return p;
+}
+
+char *
+_kdc_request_vasprintf(kdc_request_t r, const char *fmt, va_list ap)
+	__attribute__ ((__format__ (__printf__, 2, 0)))
+{
+    va_list ap2;
+    char *s;
+    int len;
+
+    va_copy(ap2, ap);
+    len = vsnprintf(NULL, 0, fmt, ap2);
+    va_end(ap2);
+    if (len < 0)
+	return NULL;
+
+    s = _kdc_request_alloc(r, len + 1);
+    if (s != NULL)
+	vsnprintf(s, len + 1, fmt, ap);
+    return s;
+}
+
+/*
+ * The formatted audit key/value pairs are read by the audit trail
+ * (logged at level 3 by heim_audit_trail()), by KDC plugins and by HDB
+ * audit hooks.  Typed values set with the _kdc_audit_setkv_*() calls
+ * are always kept since the KDC itself reads some of them back.
+ */
+
+static void
+audit_wanted(struct kdc_request_block *b, krb5_context context,
+	     krb5_kdc_configuration *config)
+{
+    unsigned int i;
+
+    b->audit_trail = !!heim_have_log(context->hcontext, config->logf, 3);
+    b->audit_kv = b->audit_trail || _kdc_have_plugin();
+    for (i = 0; !b->audit_kv && i < config->num_db; i++)
+	if (config->db[i]->hdb_audit)
+	    b->audit_kv = 1;
+}
+
+static void
+request_block_init(struct kdc_request_block *b, krb5_context context,
+		   krb5_kdc_configuration *config)
+{
+    memset(&b->u, 0, sizeof(b->u));
+    b->chunks = NULL;
+    b->ptr = b->inline_buf.buf;
+    b->avail = sizeof(b->inline_buf.buf);
+    audit_wanted(b, context, config);
+}
+
+static void
+request_block_free(struct kdc_request_block *b)
+{
+    struct kdc_arena_chunk *c;
+
+    while ((c = b->chunks) != NULL) {
+	b->chunks = c->next;
+	free(c);
+    }
+}
+
+/*
+ * AS-REQ and TGS-REQ are recognised by their outer DER application tag,
+ * which lets process_request() hand them straight to their service
+ * instead of trial-decoding the request as each Kerberos message type
+ * in turn.  Returns NULL for anything that is not a Kerberos request.
+ */
+
+static const struct krb5_kdc_service *
+find_krb5_service(const unsigned char *buf, size_t len)
+{
+    krb5_error_code (*process)(kdc_request_t *, int *);
+    Der_class cl;
+    Der_type ty;
+    unsigned int tag;
+    unsigned int i;
+
+    if (der_get_tag(buf, len, &cl, &ty, &tag, NULL) != 0 ||
+	cl != ASN1_C_APPL || ty != CONS)
+	return NULL;
+
+    switch (tag) {
+    case krb_as_req:
+	process = kdc_as_req;
+	break;
+    case krb_tgs_req:
+	process = kdc_tgs_req;
+	break;
+    default:
+	return NULL;
+    }
+
+    for (i = 0; services[i].process != NULL; i++)
+	if (services[i].process == process)
+	    return &services[i];
+    return NULL;
+}
+
 static int
 process_request(krb5_context context,
 		krb5_kdc_configuration *config,
@@ -351,14 +614,14 @@ process_request(krb5_context context,
 		struct sockaddr *addr,
 		int datagram_reply)
 {
-    kdc_request_t r;
+    const struct krb5_kdc_service *krb5_service;
+    struct kdc_request_block block;
+    kdc_request_t r = &block.u.kdc;
     krb5_error_code ret;
     unsigned int i;
     int claim = 0;
 
-    r = calloc(sizeof(*r), 1);
-    if (!r)
-	return krb5_enomem(context);
+    request_block_init(&block, context, config);
 
     r->context = context;
     r->hcontext = context->hcontext;
@@ -375,41 +638,55 @@ process_request(krb5_context context,
     if (r->kv == NULL || r->attributes == NULL) {
 	heim_release(r->kv);
 	heim_release(r->attributes);
-	free(r);
 	return krb5_enomem(context);
     }
 
     gettimeofday(&r->tv_start, NULL);
+    HEIM_PROBE2(kdc__request__start, len, from);
+
+    krb5_service = find_krb5_service(buf, len);
 
     for (i = 0; services[i].process != NULL; i++) {
 	if (krb5_only && (services[i].flags & KS_KRB5) == 0)
 	    continue;
+	/* Kerberos requests only go to their own service; others are probed */
+	if (krb5_service ? &services[i] != krb5_service
+			 : (services[i].flags & KS_KRB5) != 0)
+	    continue;
 	kdc_log(context, config, 7, "Probing for %s", services[i].name);
 	ret = (*services[i].process)(&r, &claim);
 	if (claim) {
 	    if (prependlength && services[i].flags & KS_NO_LENGTH)
 		*prependlength = 0;
 
+	    HEIM_PROBE4(kdc__request__done, services[i].name,
+			heim_probe_hash(0, r->use_request_t ? r->cname : NULL),
+			heim_probe_hash(0, r->use_request_t ? r->sname : NULL),
+			ret ? ret : r->ret);
 	    if (r->use_request_t) {
 		gettimeofday(&r->tv_end, NULL);
 		_kdc_audit_trail(r, ret);
+		_kdc_hot_keys_request(r->cname, r->sname, r->addr);
 		free(r->cname);
 		free(r->sname);
-		free(r->e_text_buf);
 	    }
+	    _kdc_metrics_request(services[i].name, ret ? ret : r->ret,
+				 &r->tv_start);
 
             heim_release(r->reason);
             heim_release(r->kv);
 	    heim_release(r->attributes);
-            free(r);
+	    request_block_free(&block);
 	    return ret;
 	}
     }
 
+    _kdc_metrics_request(NULL, -1, &r->tv_start);
+    HEIM_PROBE4(kdc__request__done, "unknown", 0, 0, -1);
     heim_release(r->reason);
     heim_release(r->kv);
     heim_release(r->attributes);
-    free(r);
+    request_block_free(&block);
     return -1;
 }
 
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Rate limiting of failed AS-REQ pre-authentication.
+ *
+ * Every client principal and every source address has a token bucket
+ * holding up to preauth-failure-burst (for principals) or
+ * preauth-failure-address-burst (for addresses) tokens, refilled at
+ * preauth-failure-rate tokens a minute.  Each failed pre-authentication
+ * takes a token from both buckets of the request; while either bucket
+ * is empty, AS-REQs with pre-authentication data for that principal or
+ * from that address are rejected before any client lookup or key work
+ * is done.  Requests without pre-authentication data are never limited,
+ * so clients can still learn which pre-authentication is required.
+ *
+ * The buckets live in a fixed size, open addressed table keyed by a
+ * hash of the principal name or address.  Like the metrics, the table
+ * is one anonymous shared mapping that the master creates before
+ * forking its workers, so the limits apply to the KDC as a whole; when
+ * the table is full the fullest nearby bucket is reused, which forgets
+ * the entity that is furthest from being limited.
+ */
+
+#include "kdc_locl.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H) && \
+    defined(_POSIX_THREAD_PROCESS_SHARED) && _POSIX_THREAD_PROCESS_SHARED > 0
+#include <pthread.h>
+#define RL_LOCKING 1
+#endif
+
+#define RL_SLOTS	8192	/* power of two */
+#define RL_PROBES	8
+#define RL_MILLI	1000	/* tokens are kept in thousandths */
+
+struct rl_bucket {
+    uint64_t key;		/* 0 for an unused bucket */
+    uint64_t stamp;		/* last refill, in milliseconds */
+    uint32_t tokens;		/* in thousandths of a token */
+    uint32_t max;		/* burst, in thousandths of a token */
+};
+
+struct rl_table {
+#ifdef RL_LOCKING
+    pthread_mutex_t lock;
+#endif
+    struct rl_bucket b[RL_SLOTS];
+};
+
+static struct rl_table *table;
+
+/* FNV-1a, with the kind of key mixed in so names and addresses differ */
+static uint64_t
+rl_hash(char kind, const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    h = (h ^ (unsigned char)kind) * 0x100000001b3ULL;
+    for (; *s; s++)
+	h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+    return h ? h : 1;
+}
+
+static uint64_t
+rl_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Bring a bucket up to date and return its tokens */
+static uint32_t
+rl_refill(krb5_kdc_configuration *config, struct rl_bucket *b, uint64_t now)
+{
+    uint64_t t = b->tokens;
+
+    if (now > b->stamp) {
+	/* rate tokens a minute is rate thousandths every 60 ms */
+	t += (now - b->stamp) * config->preauth_failure_rate / 60;
+	b->stamp = now;
+    }
+    if (t > b->max)
+	t = b->max;
+    b->tokens = (uint32_t)t;
+    return b->tokens;
+}
+
+/*
+ * Find the bucket for `key'.  If there is none and `create' is set,
+ * claim an unused bucket, or else the fullest one, for it.
+ */
+static struct rl_bucket *
+rl_lookup(krb5_kdc_configuration *config, uint64_t key, uint32_t burst,
+	  uint64_t now, int create)
+{
+    struct rl_bucket *b, *victim = NULL;
+    uint32_t tokens, most = 0;
+    size_t i;
+
+    for (i = 0; i < RL_PROBES; i++) {
+	b = &table->b[(key + i) & (RL_SLOTS - 1)];
+	if (b->key == key)
+	    return b;
+	if (!create)
+	    continue;
+	/* An unused bucket is better than any full one */
+	tokens = b->key ? rl_refill(config, b, now) : UINT32_MAX;
+	if (victim == NULL || tokens > most) {
+	    victim = b;
+	    most = tokens;
+	}
+    }
+    if (victim) {
+	victim->key = key;
+	victim->stamp = now;
+	victim->max = victim->tokens = burst * RL_MILLI;
+    }
+    return victim;
+}
+
+static void
+rl_lock(void)
+{
+#ifdef RL_LOCKING
+    pthread_mutex_lock(&table->lock);
+#endif
+}
+
+static void
+rl_unlock(void)
+{
+#ifdef RL_LOCKING
+    pthread_mutex_unlock(&table->lock);
+#endif
+}
+
+/**
+ * Set up the pre-authentication failure rate limiter.  Call this
+ * before forking worker processes so that they all share the same
+ * buckets.  Does nothing unless a limit is configured.
+ *
+ * @param context a Kerberos 5 context
+ * @param config the KDC configuration
+ *
+ * @return 0 on success, or an error code
+ */
+
+KDC_LIB_FUNCTION krb5_error_code KDC_LIB_CALL
+krb5_kdc_ratelimit_init(krb5_context context,
+			krb5_kdc_configuration *config)
+{
+    void *p;
+
+    if (table || (config->preauth_failure_burst == 0 &&
+		  config->preauth_failure_address_burst == 0))
+	return 0;
+
+#if defined(HAVE_MMAP) && defined(MAP_SHARED) && defined(MAP_ANON)
+    p = mmap(NULL, sizeof(*table), PROT_READ | PROT_WRITE,
+	     MAP_ANON | MAP_SHARED, -1, 0);
+    if (p == MAP_FAILED) {
+	krb5_error_code ret = errno;
+
+	krb5_set_error_message(context, ret, "mmap rate limit table: %s",
+			       strerror(ret));
+	return ret;
+    }
+    memset(p, 0, sizeof(*table));
+#else
+    /* Without shared memory each process keeps its own buckets */
+    p = calloc(1, sizeof(*table));
+    if (p == NULL)
+	return krb5_enomem(context);
+#endif
+
+#ifdef RL_LOCKING
+    {
+	pthread_mutexattr_t attr;
+	int ret;
+
+	ret = pthread_mutexattr_init(&attr);
+	if (ret == 0) {
+	    (void) pthread_mutexattr_setpshared(&attr,
+						PTHREAD_PROCESS_SHARED);
+	    ret = pthread_mutex_init(&((struct rl_table *)p)->lock, &attr);
+	    pthread_mutexattr_destroy(&attr);
+	}
+	if (ret) {
+	    krb5_set_error_message(context, ret,
+				   "rate limit table lock: %s", strerror(ret));
+	    return ret;
+	}
+    }
+#endif
+    table = p;
+    return 0;
+}
+
+/*
+ * Return non-zero if AS-REQ `r' comes from a client principal or
+ * address that has used up its pre-authentication failures.
+ */
+
+int
+_kdc_preauth_ratelimited(astgs_request_t r)
+{
+    krb5_kdc_configuration *config = r->config;
+    struct rl_bucket *b;
+    const char *which = NULL;
+    uint64_t now;
+
+    if (table == NULL)
+	return 0;
+
+    now = rl_now();
+    rl_lock();
+    if (config->preauth_failure_burst && r->cname) {
+	b = rl_lookup(config, rl_hash('c', r->cname),
+		      config->preauth_failure_burst, now, 0);
+	if (b && rl_refill(config, b, now) < RL_MILLI)
+	    which = "client";
+    }
+    if (which == NULL && config->preauth_failure_address_burst && r->from) {
+	b = rl_lookup(config, rl_hash('a', r->from),
+		      config->preauth_failure_address_burst, now, 0);
+	if (b && rl_refill(config, b, now) < RL_MILLI)
+	    which = "address";
+    }
+    rl_unlock();
+
+    if (which == NULL)
+	return 0;
+
+    kdc_log(r->context, config, 3,
+	    "Too many failed pre-authentication attempts by %s (%s) from %s",
+	    r->cname, which, r->from);
+    _kdc_audit_addkv((kdc_request_t)r, 0, "ratelimited", "%s", which);
+    _kdc_metrics_ratelimited(which);
+    return 1;
+}
+
+/*
+ * Take a token from the buckets of AS-REQ `r', whose
+ * pre-authentication failed.
+ */
+
+void
+_kdc_preauth_failed(astgs_request_t r)
+{
+    krb5_kdc_configuration *config = r->config;
+    struct rl_bucket *b;
+    uint64_t now;
+
+    if (table == NULL)
+	return;
+
+    now = rl_now();
+    rl_lock();
+    if (config->preauth_failure_burst && r->cname) {
+	b = rl_lookup(config, rl_hash('c', r->cname),
+		      config->preauth_failure_burst, now, 1);
+	if (b && rl_refill(config, b, now) >= RL_MILLI)
+	    b->tokens -= RL_MILLI;
+    }
+    if (config->preauth_failure_address_burst && r->from) {
+	b = rl_lookup(config, rl_hash('a', r->from),
+		      config->preauth_failure_address_burst, now, 1);
+	if (b && rl_refill(config, b, now) >= RL_MILLI)
+	    b->tokens -= RL_MILLI;
+    }
+    rl_unlock();
+}
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * A cache of cross-realm lookups: host-to-realm mappings for
+ * referrals, and the capaths between pairs of realms used both to
+ * route referrals and to check transited encodings.
+ *
+ * These come from [domain_realm] and [capaths] and, with DNS enabled,
+ * from TXT records, and the same few answers are looked up again for
+ * most cross-realm TGS-REQs.  They are kept in a cache shared by all
+ * workers (see shm_cache.c) for realm-cache-ttl seconds.  A host with
+ * no realm is remembered as well.
+ *
+ * Cached realm lists are stored as the realm names one after another,
+ * each followed by a NUL.
+ */
+
+#include "kdc_locl.h"
+
+#define REALM_CACHE_MAX_KEY	512
+#define REALM_CACHE_MAX_VALUE	1024
+
+static struct kdc_shm_cache *realm_cache;
+static time_t realm_cache_ttl;
+
+/**
+ * Set up the cross-realm lookup cache.  Call this before forking
+ * worker processes so that they all share the same cache.  Does
+ * nothing unless realm-cache-size is configured.
+ *
+ * @param context a Kerberos 5 context
+ * @param config the KDC configuration
+ *
+ * @return 0 on success, or an error code
+ */
+
+KDC_LIB_FUNCTION krb5_error_code KDC_LIB_CALL
+krb5_kdc_realm_cache_init(krb5_context context,
+			  krb5_kdc_configuration *config)
+{
+    if (realm_cache || config->realm_cache_size == 0)
+	return 0;
+    realm_cache_ttl = config->realm_cache_ttl;
+    return _kdc_shm_cache_create(context, "realm",
+				 config->realm_cache_size,
+				 REALM_CACHE_MAX_KEY, REALM_CACHE_MAX_VALUE,
+				 &realm_cache);
+}
+
+/**
+ * Forget every cached mapping, in every process, as when the
+ * configuration they were drawn from has been reloaded.
+ *
+ * @param context a Kerberos 5 context
+ */
+
+KDC_LIB_FUNCTION void KDC_LIB_CALL
+krb5_kdc_realm_cache_flush(krb5_context context)
+{
+    _kdc_shm_cache_invalidate(realm_cache);
+}
+
+/*
+ * Make a cache key of the kind `kind' and the strings `s0', `s1' and
+ * `s2' (which may be NULL), each followed by a NUL.  Returns 0 if it
+ * is too long to cache.
+ */
+static size_t
+rc_key(char key[REALM_CACHE_MAX_KEY], char kind,
+       const char *s0, const char *s1, const char *s2)
+{
+    const char *s[3];
+    size_t len = 0, l;
+    int i;
+
+    s[0] = s0;
+    s[1] = s1;
+    s[2] = s2;
+    key[len++] = kind;
+    for (i = 0; i < 3; i++) {
+	if (s[i] == NULL)
+	    continue;
+	l = strlen(s[i]) + 1;
+	if (len + l > REALM_CACHE_MAX_KEY)
+	    return 0;
+	memcpy(key + len, s[i], l);
+	len += l;
+    }
+    return len;
+}
+
+/* Encode a NULL-terminated list of realms, returns FALSE if too long */
+static krb5_boolean
+rc_encode(char **list, char buf[REALM_CACHE_MAX_VALUE], size_t *len)
+{
+    size_t l, i;
+
+    *len = 0;
+    for (i = 0; list && list[i]; i++) {
+	l = strlen(list[i]) + 1;
+	if (*len + l > REALM_CACHE_MAX_VALUE)
+	    return FALSE;
+	memcpy(buf + *len, list[i], l);
+	*len += l;
+    }
+    return TRUE;
+}
+
+/* Decode a cached list of realms into a NULL-terminated array */
+static krb5_error_code
+rc_decode(krb5_context context, const krb5_data *value,
+	  char ***list, size_t *n)
+{
+    const char *p = value->data, *end = p + value->length;
+    size_t i, count = 0;
+    char **l;
+
+    *list = NULL;
+    *n = 0;
+    for (i = 0; i < value->length; i++)
+	if (p[i] == '\0')
+	    count++;
+    if (count == 0)
+	return 0;
+
+    if ((l = calloc(count + 1, sizeof(*l))) == NULL)
+	return krb5_enomem(context);
+    for (i = 0; i < count && p < end; i++) {
+	if ((l[i] = strdup(p)) == NULL) {
+	    _krb5_free_capath(context, l);
+	    return krb5_enomem(context);
+	}
+	p += strlen(p) + 1;
+    }
+    *list = l;
+    *n = count;
+    return 0;
+}
+
+static void
+rc_put(const char *key, size_t keylen, char **list)
+{
+    char buf[REALM_CACHE_MAX_VALUE];
+    krb5_data value;
+
+    value.data = buf;
+    if (rc_encode(list, buf, &value.length))
+	(void) _kdc_shm_cache_put(realm_cache, key, keylen, 0,
+				  kdc_time + realm_cache_ttl, &value, 0);
+}
+
+/*
+ * As _krb5_get_host_realm_int(), caching the answer, including that
+ * `host' has no realm.  Free `realms' with krb5_free_host_realm().
+ */
+
+krb5_error_code
+_kdc_get_host_realm(krb5_context context,
+		    krb5_kdc_configuration *config,
+		    const char *host,
+		    krb5_boolean use_dns,
+		    krb5_realm **realms)
+{
+    char key[REALM_CACHE_MAX_KEY];
+    krb5_error_code ret;
+    krb5_data value;
+    size_t keylen, n;
+
+    *realms = NULL;
+    keylen = rc_key(key, use_dns ? 'H' : 'h', host, NULL, NULL);
+    if (realm_cache == NULL || keylen == 0)
+	return _krb5_get_host_realm_int(context, host, use_dns, realms);
+
+    if (_kdc_shm_cache_get(realm_cache, key, keylen, 0, &value) == 0) {
+	ret = rc_decode(context, &value, realms, &n);
+	krb5_data_free(&value);
+	if (ret == 0 && n == 0) {
+	    krb5_set_error_message(context, KRB5_ERR_HOST_REALM_UNKNOWN,
+				   N_("unable to find realm of host %s", ""),
+				   host);
+	    ret = KRB5_ERR_HOST_REALM_UNKNOWN;
+	}
+	return ret;
+    }
+
+    ret = _krb5_get_host_realm_int(context, host, use_dns, realms);
+    if (ret == 0)
+	rc_put(key, keylen, *realms);
+    else if (ret == KRB5_ERR_HOST_REALM_UNKNOWN)
+	rc_put(key, keylen, NULL);
+    return ret;
+}
+
+/*
+ * As _krb5_find_capath(), caching the path.  Free `rpath' with
+ * _krb5_free_capath().
+ */
+
+krb5_error_code
+_kdc_find_capath(krb5_context context,
+		 krb5_kdc_configuration *config,
+		 const char *client_realm,
+		 const char *local_realm,
+		 const char *server_realm,
+		 krb5_boolean use_hierarchical,
+		 char ***rpath,
+		 size_t *npath)
+{
+    char key[REALM_CACHE_MAX_KEY];
+    krb5_error_code ret;
+    krb5_data value;
+    size_t keylen;
+
+    *rpath = NULL;
+    *npath = 0;
+    keylen = rc_key(key, use_hierarchical ? 'C' : 'c',
+		    client_realm, local_realm, server_realm);
+    if (realm_cache == NULL || keylen == 0)
+	return _krb5_find_capath(context, client_realm, local_realm,
+				 server_realm, use_hierarchical, rpath, npath);
+
+    if (_kdc_shm_cache_get(realm_cache, key, keylen, 0, &value) == 0) {
+	ret = rc_decode(context, &value, rpath, npath);
+	krb5_data_free(&value);
+	return ret;
+    }
+
+    ret = _krb5_find_capath(context, client_realm, local_realm,
+			    server_realm, use_hierarchical, rpath, npath);
+    if (ret == 0)
+	rc_put(key, keylen, *rpath);
+    return ret;
+}
+
+/*
+ * As krb5_check_transited(), with the capath from the cache.
+ */
+
+krb5_error_code
+_kdc_check_transited(krb5_context context,
+		     krb5_kdc_configuration *config,
+		     krb5_const_realm client_realm,
+		     krb5_const_realm server_realm,
+		     krb5_realm *realms,
+		     unsigned int num_realms)
+{
+    krb5_error_code ret;
+    char **capath = NULL;
+    size_t num_capath = 0;
+    size_t i, j;
+
+    if (realm_cache == NULL)
+	return krb5_check_transited(context, client_realm, server_realm,
+				    realms, num_realms, NULL);
+
+    /* In transit checks hierarchical capaths are optional */
+    ret = _kdc_find_capath(context, config, client_realm, client_realm,
+			   server_realm, FALSE, &capath, &num_capath);
+    if (ret)
+	return ret;
+
+    for (i = 0; i < num_realms; i++) {
+	for (j = 0; j < num_capath; j++)
+	    if (strcmp(realms[i], capath[j]) == 0)
+		break;
+	if (j == num_capath) {
+	    krb5_set_error_message(context, KRB5KRB_AP_ERR_ILL_CR_TKT,
+				   N_("no transit allowed "
+				      "through realm %s from %s to %s", ""),
+				   realms[i], client_realm, server_realm);
+	    ret = KRB5KRB_AP_ERR_ILL_CR_TKT;
+	    break;
+	}
+    }
+    _krb5_free_capath(context, capath);
+    return ret;
+}
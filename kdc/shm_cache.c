@@ -0,0 +1,409 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A cache shared by all KDC worker processes.
+ *
+ * Forked workers that each cache the same things each take the same
+ * misses.  A cache made with _kdc_shm_cache_create() before the
+ * workers are forked is instead one anonymous shared mapping: a fixed
+ * number of fixed size slots, each holding a key and a value of
+ * bounded size, so that nothing is ever allocated once it exists.
+ *
+ * The slots are split into stripes with a lock each, and a key only
+ * ever probes the slots of the stripe its hash selects, so workers
+ * rarely wait on each other.  When every probed slot is live, the one
+ * least recently used is replaced.
+ *
+ * Every entry is tagged with the generation of the cache when it was
+ * stored, so _kdc_shm_cache_invalidate() empties the whole cache by
+ * bumping that; and with a generation of the caller's, such as that
+ * of the database it came from, which lookups must match.  Entries
+ * also expire at a time the caller chooses.
+ *
+ * Values are copied in and out: callers store encodings, never
+ * pointers.
+ */
+
+#include "kdc_locl.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H) && \
+    defined(_POSIX_THREAD_PROCESS_SHARED) && _POSIX_THREAD_PROCESS_SHARED > 0
+#include <pthread.h>
+#define SC_LOCKING 1
+#endif
+
+#define SC_STRIPES	64	/* power of two */
+#define SC_PROBES	8
+
+struct sc_slot {
+    uint64_t hash;		/* 0 for an unused slot */
+    uint64_t cache_gen;		/* generation of the cache */
+    uint64_t gen;		/* generation of the caller */
+    uint64_t used;		/* tick of last use, for replacement */
+    int64_t expires;
+    uint32_t keylen;
+    uint32_t valuelen;
+    /* followed by the key and then the value */
+};
+
+struct sc_stripe {
+#ifdef SC_LOCKING
+    pthread_mutex_t lock;
+#endif
+    uint64_t tick;
+    char pad[64];		/* keep stripe locks on their own lines */
+};
+
+struct kdc_shm_cache {
+    size_t per_stripe;		/* slots per stripe, a power of two */
+    size_t slot_size;
+    size_t max_key;
+    size_t max_value;
+    volatile uint64_t generation;
+    struct sc_stripe stripe[SC_STRIPES];
+    /* followed by the slots */
+};
+
+static struct sc_slot *
+sc_slot(struct kdc_shm_cache *c, size_t i)
+{
+    return (struct sc_slot *)((char *)(c + 1) + i * c->slot_size);
+}
+
+static uint64_t
+sc_hash(const void *ptr, size_t len)
+{
+    const unsigned char *p = ptr;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (len--)
+	h = (h ^ *p++) * 0x100000001b3ULL;
+    /* FNV-1a leaves the high bits, which pick the stripe, poorly mixed */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+static void
+sc_lock(struct sc_stripe *s)
+{
+#ifdef SC_LOCKING
+    pthread_mutex_lock(&s->lock);
+#endif
+}
+
+static void
+sc_unlock(struct sc_stripe *s)
+{
+#ifdef SC_LOCKING
+    pthread_mutex_unlock(&s->lock);
+#endif
+}
+
+static int
+sc_live(struct kdc_shm_cache *c, struct sc_slot *e)
+{
+    return e->hash != 0 && e->cache_gen == c->generation &&
+	e->expires >= kdc_time;
+}
+
+/*
+ * Find the slot of `key' in its stripe, or if it isn't there and
+ * `victim' is not NULL, the slot to store it in.  Call with the
+ * stripe locked.
+ */
+static struct sc_slot *
+sc_find(struct kdc_shm_cache *c, uint64_t hash, const void *key,
+	size_t keylen, struct sc_slot **victim)
+{
+    size_t stripe = (hash >> 32) & (SC_STRIPES - 1);
+    size_t mask = c->per_stripe - 1;
+    struct sc_slot *e, *v = NULL;
+    size_t i;
+
+    for (i = 0; i < SC_PROBES && i < c->per_stripe; i++) {
+	e = sc_slot(c, stripe * c->per_stripe + ((hash + i) & mask));
+	if (e->hash == hash && e->keylen == keylen &&
+	    memcmp(e + 1, key, keylen) == 0)
+	    return e;
+	/* A free, stale or expired slot is better than any live one */
+	if (!sc_live(c, e)) {
+	    if (v == NULL || sc_live(c, v))
+		v = e;
+	} else if (v == NULL || (sc_live(c, v) && e->used < v->used)) {
+	    v = e;
+	}
+    }
+    if (victim)
+	*victim = v;
+    return NULL;
+}
+
+/**
+ * Create a cache shared by the processes forked after this call.
+ *
+ * @param context a Kerberos 5 context
+ * @param name a name for the cache, for error messages
+ * @param nentries the number of entries the cache holds, rounded up
+ * @param max_key the largest key to be stored, in bytes
+ * @param max_value the largest value to be stored, in bytes
+ * @param cp the cache
+ *
+ * @return 0 on success, or an error code
+ */
+
+krb5_error_code
+_kdc_shm_cache_create(krb5_context context,
+		      const char *name,
+		      size_t nentries,
+		      size_t max_key,
+		      size_t max_value,
+		      struct kdc_shm_cache **cp)
+{
+    struct kdc_shm_cache *c;
+    size_t per_stripe = SC_PROBES, slot_size, size;
+    void *p;
+
+    *cp = NULL;
+    while (per_stripe * SC_STRIPES < nentries)
+	per_stripe <<= 1;
+    slot_size = (sizeof(struct sc_slot) + max_key + max_value + 7) & ~(size_t)7;
+    size = sizeof(*c) + per_stripe * SC_STRIPES * slot_size;
+
+#if defined(HAVE_MMAP) && defined(MAP_SHARED) && defined(MAP_ANON)
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	     MAP_ANON | MAP_SHARED, -1, 0);
+    if (p == MAP_FAILED) {
+	krb5_error_code ret = errno;
+
+	krb5_set_error_message(context, ret, "mmap %s cache: %s", name,
+			       strerror(ret));
+	return ret;
+    }
+    memset(p, 0, size);
+#else
+    /* Without shared memory each process keeps its own cache */
+    p = calloc(1, size);
+    if (p == NULL)
+	return krb5_enomem(context);
+#endif
+    c = p;
+    c->per_stripe = per_stripe;
+    c->slot_size = slot_size;
+    c->max_key = max_key;
+    c->max_value = max_value;
+    c->generation = 1;
+
+#ifdef SC_LOCKING
+    {
+	pthread_mutexattr_t attr;
+	size_t i;
+	int ret;
+
+	ret = pthread_mutexattr_init(&attr);
+	if (ret == 0) {
+	    (void) pthread_mutexattr_setpshared(&attr,
+						PTHREAD_PROCESS_SHARED);
+	    for (i = 0; ret == 0 && i < SC_STRIPES; i++)
+		ret = pthread_mutex_init(&c->stripe[i].lock, &attr);
+	    pthread_mutexattr_destroy(&attr);
+	}
+	if (ret) {
+	    krb5_set_error_message(context, ret, "%s cache lock: %s", name,
+				   strerror(ret));
+	    return ret;
+	}
+    }
+#endif
+    *cp = c;
+    return 0;
+}
+
+/**
+ * Look `key' up in a shared cache.
+ *
+ * @param c the cache, or NULL
+ * @param key the key
+ * @param keylen the length of the key
+ * @param gen the caller's generation the entry must have
+ * @param value a copy of the value, free with krb5_data_free(), or
+ *        NULL if only the presence of the key is of interest
+ *
+ * @return 0 if found, ENOENT if not, or ENOMEM
+ */
+
+krb5_error_code
+_kdc_shm_cache_get(struct kdc_shm_cache *c,
+		   const void *key,
+		   size_t keylen,
+		   uint64_t gen,
+		   krb5_data *value)
+{
+    uint64_t hash;
+    struct sc_stripe *s;
+    struct sc_slot *e;
+    krb5_error_code ret = ENOENT;
+
+    if (value)
+	krb5_data_zero(value);
+    if (c == NULL || keylen > c->max_key)
+	return ENOENT;
+
+    hash = sc_hash(key, keylen);
+    s = &c->stripe[(hash >> 32) & (SC_STRIPES - 1)];
+    sc_lock(s);
+    e = sc_find(c, hash, key, keylen, NULL);
+    if (e && sc_live(c, e) && e->gen == gen) {
+	e->used = ++s->tick;
+	ret = value ?
+	    krb5_data_copy(value, (char *)(e + 1) + e->keylen, e->valuelen) :
+	    0;
+    }
+    sc_unlock(s);
+    return ret;
+}
+
+/**
+ * Store `value' under `key' in a shared cache until `expires'.
+ *
+ * @param c the cache, or NULL
+ * @param key the key
+ * @param keylen the length of the key
+ * @param gen the caller's generation to tag the entry with
+ * @param expires when the entry expires
+ * @param value the value, or NULL for an empty value
+ * @param flags KDC_SHM_CACHE_NOREPLACE to not replace a live entry
+ *
+ * @return 0 on success, EEXIST if KDC_SHM_CACHE_NOREPLACE was given
+ *         and the key is present, or E2BIG if the key or value is
+ *         too large for the cache
+ */
+
+krb5_error_code
+_kdc_shm_cache_put(struct kdc_shm_cache *c,
+		   const void *key,
+		   size_t keylen,
+		   uint64_t gen,
+		   time_t expires,
+		   const krb5_data *value,
+		   int flags)
+{
+    size_t valuelen = value ? value->length : 0;
+    struct sc_slot *e, *victim = NULL;
+    struct sc_stripe *s;
+    uint64_t hash;
+
+    if (c == NULL)
+	return 0;
+    if (keylen > c->max_key || valuelen > c->max_value)
+	return E2BIG;
+
+    hash = sc_hash(key, keylen);
+    s = &c->stripe[(hash >> 32) & (SC_STRIPES - 1)];
+    sc_lock(s);
+    e = sc_find(c, hash, key, keylen, &victim);
+    if (e && (flags & KDC_SHM_CACHE_NOREPLACE) && sc_live(c, e) &&
+	e->gen == gen) {
+	e->used = ++s->tick;
+	sc_unlock(s);
+	return EEXIST;
+    }
+    if (e == NULL)
+	e = victim;
+    e->hash = hash;
+    e->cache_gen = c->generation;
+    e->gen = gen;
+    e->used = ++s->tick;
+    e->expires = expires;
+    e->keylen = keylen;
+    e->valuelen = valuelen;
+    memcpy(e + 1, key, keylen);
+    if (valuelen)
+	memcpy((char *)(e + 1) + keylen, value->data, valuelen);
+    sc_unlock(s);
+    return 0;
+}
+
+/**
+ * Remove `key' from a shared cache.
+ *
+ * @param c the cache, or NULL
+ * @param key the key
+ * @param keylen the length of the key
+ */
+
+void
+_kdc_shm_cache_remove(struct kdc_shm_cache *c,
+		      const void *key,
+		      size_t keylen)
+{
+    struct sc_stripe *s;
+    struct sc_slot *e;
+    uint64_t hash;
+
+    if (c == NULL || keylen > c->max_key)
+	return;
+
+    hash = sc_hash(key, keylen);
+    s = &c->stripe[(hash >> 32) & (SC_STRIPES - 1)];
+    sc_lock(s);
+    if ((e = sc_find(c, hash, key, keylen, NULL)) != NULL)
+	e->hash = 0;
+    sc_unlock(s);
+}
+
+/**
+ * Empty a shared cache, in every process.
+ *
+ * @param c the cache, or NULL
+ */
+
+void
+_kdc_shm_cache_invalidate(struct kdc_shm_cache *c)
+{
+    size_t i;
+
+    if (c == NULL)
+	return;
+    /* Take every lock so no entry is stored with the old generation */
+    for (i = 0; i < SC_STRIPES; i++)
+	sc_lock(&c->stripe[i]);
+    c->generation++;
+    for (i = SC_STRIPES; i > 0; i--)
+	sc_unlock(&c->stripe[i - 1]);
+}
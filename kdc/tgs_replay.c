@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Replay detection for TGS-REQ authenticators.
+ *
+ * An authenticator is identified by a hash of its client name, ctime,
+ * cusec and checksum; the checksum covers the request body and thus
+ * its nonce.  Authenticators are only accepted within the clock skew
+ * of their ctime, so an entry need only be remembered until ctime
+ * plus the skew.
+ *
+ * The hashes are kept in a cache shared by all workers (see
+ * shm_cache.c), so a replay is caught whichever worker sees it.  When
+ * the cache is full the least recently seen authenticators are
+ * dropped.
+ */
+
+#include "kdc_locl.h"
+
+static struct kdc_shm_cache *replay_cache;
+
+static uint64_t
+rc_hash_bytes(uint64_t h, const void *ptr, size_t len)
+{
+    const unsigned char *p = ptr;
+
+    while (len--)
+	h = (h ^ *p++) * 0x100000001b3ULL;
+    return h;
+}
+
+/* FNV-1a over the parts of the authenticator that identify it */
+static uint64_t
+rc_hash(const Authenticator *auth)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int64_t ctime = auth->ctime;
+    int32_t cusec = auth->cusec;
+    size_t i;
+
+    h = rc_hash_bytes(h, auth->crealm, strlen(auth->crealm) + 1);
+    for (i = 0; i < auth->cname.name_string.len; i++)
+	h = rc_hash_bytes(h, auth->cname.name_string.val[i],
+			  strlen(auth->cname.name_string.val[i]) + 1);
+    h = rc_hash_bytes(h, &ctime, sizeof(ctime));
+    h = rc_hash_bytes(h, &cusec, sizeof(cusec));
+    if (auth->cksum)
+	h = rc_hash_bytes(h, auth->cksum->checksum.data,
+			  auth->cksum->checksum.length);
+    return h ? h : 1;
+}
+
+/**
+ * Set up the TGS authenticator replay cache.  Call this before
+ * forking worker processes so that they all share the same cache.
+ * Does nothing unless tgs-replay-cache-size is configured.
+ *
+ * @param context a Kerberos 5 context
+ * @param config the KDC configuration
+ *
+ * @return 0 on success, or an error code
+ */
+
+KDC_LIB_FUNCTION krb5_error_code KDC_LIB_CALL
+krb5_kdc_tgs_replay_init(krb5_context context,
+			 krb5_kdc_configuration *config)
+{
+    if (replay_cache || config->tgs_replay_cache_size == 0)
+	return 0;
+    return _kdc_shm_cache_create(context, "TGS replay",
+				 config->tgs_replay_cache_size,
+				 sizeof(uint64_t), 0, &replay_cache);
+}
+
+/*
+ * Record the TGS-REQ authenticator `auth', whose checksum has been
+ * verified, and return KRB5KRB_AP_ERR_REPEAT if it has been seen
+ * before within the clock skew.
+ */
+
+krb5_error_code
+_kdc_tgs_replay_check(krb5_context context,
+		      krb5_kdc_configuration *config,
+		      const Authenticator *auth)
+{
+    uint64_t key;
+    time_t expires;
+
+    if (replay_cache == NULL)
+	return 0;
+
+    expires = auth->ctime + context->max_skew;
+    if (expires < kdc_time)
+	return 0;
+
+    key = rc_hash(auth);
+    if (_kdc_shm_cache_put(replay_cache, &key, sizeof(key), 0, expires,
+			   NULL, KDC_SHM_CACHE_NOREPLACE) != EEXIST)
+	return 0;
+
+    kdc_log(context, config, 2,
+	    "Replayed TGS-REQ authenticator, ctime %lld",
+	    (long long)auth->ctime);
+    _kdc_metrics_tgs_replay();
+    return KRB5KRB_AP_ERR_REPEAT;
+}
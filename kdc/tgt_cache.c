@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * A cache of decrypted TGTs.
+ *
+ * A client presents the same TGT with every TGS-REQ it makes over the
+ * TGT's lifetime, and decrypting it with the krbtgt key each time is
+ * half the symmetric crypto of a TGS-REQ.  Here the decrypted
+ * EncTicketPart is kept in a cache shared by all workers (see
+ * shm_cache.c), so that a TGS-REQ with a TGT seen before only costs
+ * its authenticator.
+ *
+ * Entries are found by a SHA-256 digest of the krbtgt kvno and key and
+ * of the ticket ciphertext, so an entry is only ever returned for the
+ * key that decrypted it and a new krbtgt key simply stops finding old
+ * ones.  Only tickets that decrypted (and so passed the integrity
+ * check) are cached, and entries expire with the ticket.  All the
+ * other checks on the ticket are made again on every use.
+ *
+ * The plaintext, session key and all, is kept in memory shared only
+ * by the kdc's own processes.
+ */
+
+#include "kdc_locl.h"
+
+/* Largest TGT encoding cached; TGTs with large PACs are not cached */
+#define TGT_CACHE_MAX_VALUE	4096
+
+static struct kdc_shm_cache *tgt_cache;
+
+/**
+ * Set up the decrypted TGT cache.  Call this before forking worker
+ * processes so that they all share the same cache.  Does nothing
+ * unless tgs-ticket-cache-size is configured.
+ *
+ * @param context a Kerberos 5 context
+ * @param config the KDC configuration
+ *
+ * @return 0 on success, or an error code
+ */
+
+KDC_LIB_FUNCTION krb5_error_code KDC_LIB_CALL
+krb5_kdc_tgt_cache_init(krb5_context context,
+			krb5_kdc_configuration *config)
+{
+    if (tgt_cache || config->tgs_ticket_cache_size == 0)
+	return 0;
+    return _kdc_shm_cache_create(context, "TGT",
+				 config->tgs_ticket_cache_size,
+				 32, TGT_CACHE_MAX_VALUE, &tgt_cache);
+}
+
+static void
+tgt_cache_digest(krb5uint32 kvno,
+		 const krb5_keyblock *key,
+		 const EncryptedData *enc_part,
+		 unsigned char digest[32])
+{
+    unsigned char buf[12];
+    EVP_MD_CTX *m;
+
+    buf[0] = (kvno >> 24) & 0xff;
+    buf[1] = (kvno >> 16) & 0xff;
+    buf[2] = (kvno >> 8) & 0xff;
+    buf[3] = kvno & 0xff;
+    buf[4] = (key->keytype >> 24) & 0xff;
+    buf[5] = (key->keytype >> 16) & 0xff;
+    buf[6] = (key->keytype >> 8) & 0xff;
+    buf[7] = key->keytype & 0xff;
+    buf[8] = (enc_part->etype >> 24) & 0xff;
+    buf[9] = (enc_part->etype >> 16) & 0xff;
+    buf[10] = (enc_part->etype >> 8) & 0xff;
+    buf[11] = enc_part->etype & 0xff;
+
+    m = EVP_MD_CTX_create();
+    EVP_DigestInit_ex(m, EVP_sha256(), NULL);
+    EVP_DigestUpdate(m, buf, sizeof(buf));
+    EVP_DigestUpdate(m, key->keyvalue.data, key->keyvalue.length);
+    EVP_DigestUpdate(m, enc_part->cipher.data, enc_part->cipher.length);
+    EVP_DigestFinal_ex(m, digest, NULL);
+    EVP_MD_CTX_destroy(m);
+}
+
+static void
+tgt_cache_data_free(krb5_data *data)
+{
+    memset_s(data->data, data->length, 0, data->length);
+    krb5_data_free(data);
+}
+
+/* Decrypt and decode the TGT in `ap_req' into `et', from the cache if we can */
+static krb5_error_code
+tgt_cache_decrypt(krb5_context context,
+		  krb5_ap_req *ap_req,
+		  krb5uint32 kvno,
+		  krb5_keyblock *key,
+		  EncTicketPart *et)
+{
+    EncryptedData *enc_part = &ap_req->ticket.enc_part;
+    unsigned char digest[32];
+    krb5_error_code ret;
+    krb5_crypto crypto;
+    krb5_data plain;
+    size_t len;
+
+    tgt_cache_digest(kvno, key, enc_part, digest);
+    if (_kdc_shm_cache_get(tgt_cache, digest, sizeof(digest), 0,
+			   &plain) == 0) {
+	ret = decode_EncTicketPart(plain.data, plain.length, et, &len);
+	tgt_cache_data_free(&plain);
+	if (ret == 0) {
+	    _kdc_metrics_tgt_cache(1);
+	    return 0;
+	}
+	_kdc_shm_cache_remove(tgt_cache, digest, sizeof(digest));
+    }
+    _kdc_metrics_tgt_cache(0);
+
+    ret = krb5_crypto_init(context, key, 0, &crypto);
+    if (ret)
+	return ret;
+    ret = krb5_decrypt_EncryptedData(context, crypto, KRB5_KU_TICKET,
+				     enc_part, &plain);
+    krb5_crypto_destroy(context, crypto);
+    if (ret)
+	return ret;
+
+    ret = decode_EncTicketPart(plain.data, plain.length, et, &len);
+    if (ret == 0 && et->endtime + context->max_skew > kdc_time)
+	(void) _kdc_shm_cache_put(tgt_cache, digest, sizeof(digest), 0,
+				  et->endtime + context->max_skew, &plain, 0);
+    else if (ret)
+	krb5_set_error_message(context, ret,
+			       N_("Failed to decode encrypted "
+				  "ticket part", ""));
+    tgt_cache_data_free(&plain);
+    return ret;
+}
+
+/*
+ * Verify the TGS-REQ AP-REQ `ap_req' as krb5_verify_ap_req2() would,
+ * `key' being the key of kvno `kvno' of the krbtgt, taking the
+ * decrypted TGT from the cache when it is there.
+ */
+
+krb5_error_code
+_kdc_tgt_cache_verify_ap_req(krb5_context context,
+			     krb5_auth_context *auth_context,
+			     krb5_ap_req *ap_req,
+			     krb5_const_principal server,
+			     krb5uint32 kvno,
+			     krb5_keyblock *key,
+			     krb5_flags flags,
+			     krb5_flags *ap_req_options,
+			     krb5_ticket **ticket,
+			     krb5_key_usage usage)
+{
+    krb5_error_code ret;
+    EncTicketPart et;
+
+    if (tgt_cache == NULL || ap_req->ap_options.use_session_key)
+	return krb5_verify_ap_req2(context, auth_context, ap_req, server,
+				   key, flags, ap_req_options, ticket, usage);
+
+    memset(&et, 0, sizeof(et));
+    ret = tgt_cache_decrypt(context, ap_req, kvno, key, &et);
+    if (ret)
+	return ret;
+    ret = _krb5_verify_ap_req_decrypted(context, auth_context, ap_req,
+					server, &et, flags, ap_req_options,
+					ticket, usage);
+    memset_s(et.key.keyvalue.data, et.key.keyvalue.length,
+	     0, et.key.keyvalue.length);
+    free_EncTicketPart(&et);
+    return ret;
+}
@@ -50,6 +50,38 @@ krb5_addresses explicit_addresses;
 
 static sig_atomic_t exit_flag = 0;
 
+static int num_processes = -1;
+static int batch_requests = -1;
+
+/*
+ * Replies held back while a batch of password changes is written under
+ * one HDB lock; they are only sent once the batch has been committed.
+ */
+struct held_reply {
+    int s;
+    struct sockaddr_storage ss;
+    int sa_size;
+    u_char *data;
+    size_t len;
+};
+
+static struct held_reply *held_replies;
+static size_t num_held_replies;
+static int holding_replies;
+
+/*
+ * One kadm5 handle per realm is kept for batched self-service password
+ * changes, and locked for the duration of a batch.
+ */
+struct realm_handle {
+    char *realm;
+    void *handle;
+    int locked;
+    struct realm_handle *next;
+};
+
+static struct realm_handle *realm_handles;
+
 static void
 add_one_address (const char *str, int first)
 {
@@ -115,6 +147,25 @@ send_reply (int s,
     iov[2].iov_base       = rest->data;
     iov[2].iov_len        = rest->length;
 
+    if (holding_replies && num_held_replies < (size_t)batch_requests &&
+	sa_size <= (int)sizeof(held_replies[0].ss)) {
+	struct held_reply *h = &held_replies[num_held_replies];
+
+	h->data = malloc(len);
+	if (h->data != NULL) {
+	    memcpy(h->data, header, 6);
+	    if (ap_rep_len)
+		memcpy(h->data + 6, ap_rep->data, ap_rep_len);
+	    memcpy(h->data + 6 + ap_rep_len, rest->data, rest->length);
+	    h->len = len;
+	    h->s = s;
+	    memcpy(&h->ss, sa, sa_size);
+	    h->sa_size = sa_size;
+	    num_held_replies++;
+	    return;
+	}
+    }
+
     if (sendmsg (s, &msghdr, 0) < 0)
 	krb5_warn (context, errno, "sendmsg");
 }
@@ -231,6 +282,123 @@ reply_priv (krb5_auth_context auth_context,
     krb5_data_free (&krb_priv_data);
 }
 
+/*
+ * Get the batch handle for `realm', locking the HDB the first time it
+ * is used in a batch.  Returns NULL if the request has to be handled on
+ * its own instead.
+ */
+
+static void *
+batch_handle(krb5_realm realm)
+{
+    struct realm_handle *r;
+    kadm5_config_params conf;
+    krb5_error_code ret;
+
+    for (r = realm_handles; r != NULL; r = r->next)
+	if (strcmp(r->realm, realm) == 0)
+	    break;
+    if (r == NULL) {
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+	    return NULL;
+	r->realm = strdup(realm);
+	if (r->realm == NULL) {
+	    free(r);
+	    return NULL;
+	}
+	memset(&conf, 0, sizeof(conf));
+	conf.realm = r->realm;
+	conf.mask |= KADM5_CONFIG_REALM;
+	ret = kadm5_init_with_password_ctx(context,
+					   KADM5_ADMIN_SERVICE,
+					   NULL,
+					   KADM5_ADMIN_SERVICE,
+					   &conf, 0, 0,
+					   &r->handle);
+	if (ret) {
+	    krb5_warn(context, ret, "kadm5_init_with_password_ctx");
+	    free(r->realm);
+	    free(r);
+	    return NULL;
+	}
+	r->next = realm_handles;
+	realm_handles = r;
+    }
+    if (!r->locked) {
+	struct realm_handle *o;
+
+	/* Realms may share a database; lock only one per batch */
+	for (o = realm_handles; o != NULL; o = o->next)
+	    if (o->locked)
+		return NULL;
+	ret = kadm5_lock(r->handle);
+	if (ret) {
+	    krb5_warn(context, ret, "kadm5_lock");
+	    return NULL;
+	}
+	r->locked = 1;
+    }
+    return r->handle;
+}
+
+/*
+ * Commit the password changes of the current batch and send the replies
+ * that were held back for it.  If the commit fails the replies are
+ * dropped rather than claiming success; the clients will retry.
+ */
+
+static void
+end_batch(void)
+{
+    struct realm_handle *r;
+    krb5_error_code ret;
+    int failed = 0;
+    size_t i;
+
+    for (r = realm_handles; r != NULL; r = r->next) {
+	if (!r->locked)
+	    continue;
+	ret = kadm5_log_group_commit(r->handle);
+	if (ret) {
+	    krb5_warn(context, ret, "kadm5_log_group_commit");
+	    failed = 1;
+	}
+	ret = kadm5_unlock(r->handle);
+	if (ret)
+	    krb5_warn(context, ret, "kadm5_unlock");
+	r->locked = 0;
+    }
+    holding_replies = 0;
+
+    if (failed && num_held_replies)
+	krb5_warnx(context, "dropping %lu replies of a failed batch",
+		   (unsigned long)num_held_replies);
+    for (i = 0; i < num_held_replies; i++) {
+	struct held_reply *h = &held_replies[i];
+
+	if (!failed &&
+	    sendto(h->s, h->data, h->len, 0,
+		   (struct sockaddr *)&h->ss, h->sa_size) < 0)
+	    krb5_warn(context, errno, "sendto");
+	free(h->data);
+    }
+    num_held_replies = 0;
+}
+
+static void
+free_realm_handles(void)
+{
+    struct realm_handle *r;
+
+    while ((r = realm_handles) != NULL) {
+	realm_handles = r->next;
+	kadm5_destroy(r->handle);
+	free(r->realm);
+	free(r);
+    }
+}
+
 /*
  * Change the password for `principal', sending the reply back on `s'
  * (`sa', `sa_size') to `pwd_data'.
@@ -249,6 +417,7 @@ change (krb5_auth_context auth_context,
     char *client = NULL, *admin = NULL;
     kadm5_config_params conf;
     void *kadm5_handle = NULL;
+    krb5_principal batch_caller = NULL;
     krb5_principal principal = NULL;
     krb5_data *pwd_data = NULL;
     char *tmp;
@@ -342,20 +511,39 @@ change (krb5_auth_context auth_context,
 	goto out;
     }
 
-    conf.realm = principal->realm;
-    conf.mask |= KADM5_CONFIG_REALM;
+    /*
+     * Users changing their own password in a batch share the realm's
+     * locked handle, acting as themselves.  No ACL check is done for
+     * them, so only the password quality check and the modifier
+     * recorded in the entry depend on the caller.
+     */
+    if (holding_replies &&
+	krb5_principal_compare(context, admin_principal, principal) &&
+	(kadm5_handle = batch_handle(principal->realm)) != NULL) {
+	kadm5_server_context *server_context = kadm5_handle;
 
-    ret = kadm5_init_with_password_ctx(context,
-				       admin,
-				       NULL,
-				       KADM5_ADMIN_SERVICE,
-				       &conf, 0, 0,
-				       &kadm5_handle);
-    if (ret) {
-	krb5_warn (context, ret, "kadm5_init_with_password_ctx");
-	reply_priv (auth_context, s, sa, sa_size, 2,
-		    "Internal error");
-	goto out;
+	batch_caller = server_context->caller;
+	server_context->caller = principal;
+    } else {
+	/* Other handles must not wait on the batch's HDB lock */
+	if (holding_replies)
+	    end_batch();
+
+	conf.realm = principal->realm;
+	conf.mask |= KADM5_CONFIG_REALM;
+
+	ret = kadm5_init_with_password_ctx(context,
+					   admin,
+					   NULL,
+					   KADM5_ADMIN_SERVICE,
+					   &conf, 0, 0,
+					   &kadm5_handle);
+	if (ret) {
+	    krb5_warn (context, ret, "kadm5_init_with_password_ctx");
+	    reply_priv (auth_context, s, sa, sa_size, 2,
+			"Internal error");
+	    goto out;
+	}
     }
 
     ret = krb5_unparse_name(context, principal, &client);
@@ -426,7 +614,9 @@ out:
 	free(client);
     if (pwd_data)
 	krb5_free_data(context, pwd_data);
-    if (kadm5_handle)
+    if (batch_caller)
+	((kadm5_server_context *)kadm5_handle)->caller = batch_caller;
+    else if (kadm5_handle)
 	kadm5_destroy (kadm5_handle);
 }
 
@@ -586,7 +776,9 @@ process (krb5_keytab keytab,
     krb5_ticket *ticket;
     krb5_address other_addr;
     uint16_t version;
+    struct timeval start, stop;
 
+    gettimeofday(&start, NULL);
     memset(&other_addr, 0, sizeof(other_addr));
     krb5_data_zero (&out_data);
 
@@ -636,6 +828,19 @@ process (krb5_keytab keytab,
 	krb5_free_ticket (context, ticket);
     }
 
+    {
+	char str[128];
+	size_t len;
+
+	if (krb5_print_address(&other_addr, str, sizeof(str), &len) != 0)
+	    strlcpy(str, "unknown address", sizeof(str));
+	gettimeofday(&stop, NULL);
+	timevalsub(&stop, &start);
+	krb5_warnx(context, "request from %s took %ld.%06ld seconds%s",
+		   str, (long)stop.tv_sec, (long)stop.tv_usec,
+		   holding_replies ? " (batched)" : "");
+    }
+
 out:
     krb5_free_address(context, &other_addr);
     krb5_data_free(&out_data);
@@ -675,11 +880,198 @@ struct getargs args[] = {
     { "config-file", 'c', arg_string, &config_file, NULL, NULL },
     { "realm", 'r', arg_string, &realm_str, "default realm", "realm" },
     { "port",  'p', arg_string, &port_str, "port", NULL },
+    { "num-processes", 0, arg_integer, &num_processes,
+      "number of worker processes to serve requests with", "number" },
+    { "batch-requests", 0, arg_integer, &batch_requests,
+      "maximum number of password changes to commit together", "number" },
     { "version", 0, arg_flag, &version_flag, NULL, NULL },
     { "help", 0, arg_flag, &help_flag, NULL, NULL }
 };
 int num_args = sizeof(args) / sizeof(args[0]);
 
+/*
+ * Is there another request already waiting on `s'?
+ */
+
+static int
+request_pending(int s)
+{
+    struct timeval tv;
+    fd_set fds;
+
+    FD_ZERO(&fds);
+    FD_SET(s, &fds);
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    return select(s + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+/*
+ * Serve requests on `sockets' until told to exit, or until `islive'
+ * becomes readable, which means that the master process has gone away.
+ *
+ * When further requests are already queued on a socket, up to
+ * `batch_requests' of them are handled back to back with the HDB locked
+ * and kept open, and committed together before any reply is sent.
+ */
+
+static void
+loop(krb5_keytab keytab, int *sockets, krb5_addresses *addrs,
+     fd_set *real_fdset, int maxfd, int islive)
+{
+    struct sockaddr_storage __ss;
+    struct sockaddr *sa = (struct sockaddr *)&__ss;
+    unsigned i;
+    int nreq;
+
+    while (exit_flag == 0) {
+	krb5_ssize_t retx;
+	fd_set fdset = *real_fdset;
+
+	if (islive > -1)
+	    FD_SET(islive, &fdset);
+	retx = select(max(maxfd, islive) + 1, &fdset, NULL, NULL, NULL);
+	if (retx < 0) {
+	    if (errno == EINTR)
+		continue;
+	    else
+		krb5_err(context, 1, errno, "select");
+	}
+	if (islive > -1 && FD_ISSET(islive, &fdset))
+	    break;
+	for (i = 0; i < addrs->len; ++i) {
+	    if (sockets[i] < 0 || !FD_ISSET(sockets[i], &fdset))
+		continue;
+	    for (nreq = 0; nreq < batch_requests; nreq++) {
+		u_char buf[BUFSIZ];
+		socklen_t addrlen = sizeof(__ss);
+
+		retx = recvfrom(sockets[i], buf, sizeof(buf), 0,
+				sa, &addrlen);
+		if (retx < 0) {
+		    /* Another worker may have taken the datagram */
+		    if (errno == EINTR || errno == EAGAIN ||
+			errno == EWOULDBLOCK)
+			break;
+		    else
+			krb5_err(context, 1, errno, "recvfrom");
+		}
+
+		if (nreq == 0 && batch_requests > 1 &&
+		    request_pending(sockets[i]))
+		    holding_replies = 1;
+
+		process(keytab, sockets[i],
+			 &addrs->val[i],
+			 sa, addrlen,
+			 buf, retx);
+
+		if (!holding_replies || !request_pending(sockets[i]))
+		    break;
+	    }
+	    if (holding_replies || num_held_replies)
+		end_batch();
+	}
+    }
+}
+
+#ifdef HAVE_FORK
+static int
+reap_kids(pid_t *pids, int max_kids, int options)
+{
+    pid_t pid;
+    int status;
+    int reaped = 0;
+    int i;
+
+    while ((pid = waitpid(-1, &status, options)) > 0) {
+	for (i = 0; i < max_kids; i++) {
+	    if (pids[i] == pid) {
+		pids[i] = (pid_t)-1;
+		reaped++;
+		break;
+	    }
+	}
+	if (WIFSIGNALED(status))
+	    krb5_warnx(context, "worker process %d died of signal %d",
+		       (int)pid, WTERMSIG(status));
+	else if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+	    krb5_warnx(context, "worker process %d exited with status %d",
+		       (int)pid, WEXITSTATUS(status));
+	options |= WNOHANG;
+    }
+    return reaped;
+}
+
+/*
+ * Run `num_processes' workers sharing the listening sockets, restarting
+ * those that die, until told to exit.
+ */
+
+static void
+start_workers(krb5_keytab keytab, int *sockets, krb5_addresses *addrs,
+	      fd_set *real_fdset, int maxfd)
+{
+    pid_t *pids;
+    int num_kids = 0;
+    int islive[2];
+    int i;
+
+    pids = calloc(num_processes, sizeof(*pids));
+    if (pids == NULL)
+	krb5_err(context, 1, errno, "malloc");
+
+    /*
+     * Each worker gets one end of this socketpair; when we exit, for
+     * whatever reason, they see EOF on it and exit too.
+     */
+    if (socketpair(PF_UNIX, SOCK_STREAM, 0, islive) == -1)
+	krb5_err(context, 1, errno, "socketpair");
+
+    while (exit_flag == 0) {
+	if (num_kids >= num_processes) {
+	    num_kids -= reap_kids(pids, num_processes, 0);
+	    continue;
+	}
+
+	for (i = 0; i < num_processes; i++)
+	    if (pids[i] <= 0)
+		break;
+
+	switch (pids[i] = fork()) {
+	case 0:
+	    close(islive[0]);
+	    free(pids);
+	    loop(keytab, sockets, addrs, real_fdset, maxfd, islive[1]);
+	    exit(0);
+	case -1:
+	    krb5_warn(context, errno, "fork");
+	    sleep(10);
+	    break;
+	default:
+	    krb5_warnx(context, "worker process %d started", (int)pids[i]);
+	    num_kids++;
+	    break;
+	}
+    }
+
+    close(islive[0]);
+    close(islive[1]);
+
+    for (i = 0; i < num_processes; i++)
+	if (pids[i] > 0)
+	    kill(pids[i], SIGTERM);
+    while (num_kids > 0) {
+	int reaped = reap_kids(pids, num_processes, 0);
+
+	if (reaped == 0)
+	    break;
+	num_kids -= reaped;
+    }
+    free(pids);
+}
+#endif
+
 static int
 doit(krb5_keytab keytab, int port)
 {
@@ -723,8 +1115,12 @@ doit(krb5_keytab keytab, int port)
 	    if (ret)
 		strlcpy(str, "unknown address", sizeof(str));
 	    krb5_warn(context, save_errno, "bind(%s)", str);
+	    close(sockets[i]);
+	    sockets[i] = -1;
 	    continue;
 	}
+	/* Workers share the sockets, so a readable one may be empty */
+	socket_set_nonblocking(sockets[i], 1);
 	maxfd = max(maxfd, sockets[i]);
 	if (maxfd >= FD_SETSIZE)
 	    krb5_errx(context, 1, "fd too large");
@@ -733,43 +1129,28 @@ doit(krb5_keytab keytab, int port)
     if (maxfd == -1)
 	krb5_errx(context, 1, "No sockets!");
 
-    roken_detach_finish(NULL, daemon_child);
-
-    while (exit_flag == 0) {
-	krb5_ssize_t retx;
-	fd_set fdset = real_fdset;
-
-	retx = select(maxfd + 1, &fdset, NULL, NULL, NULL);
-	if (retx < 0) {
-	    if (errno == EINTR)
-		continue;
-	    else
-		krb5_err(context, 1, errno, "select");
-	}
-	for (i = 0; i < n; ++i)
-	    if (FD_ISSET(sockets[i], &fdset)) {
-		u_char buf[BUFSIZ];
-		socklen_t addrlen = sizeof(__ss);
+    if (batch_requests > 1) {
+	held_replies = calloc(batch_requests, sizeof(held_replies[0]));
+	if (held_replies == NULL)
+	    krb5_err(context, 1, errno, "malloc");
+    } else
+	batch_requests = 1;
 
-		retx = recvfrom(sockets[i], buf, sizeof(buf), 0,
-				sa, &addrlen);
-		if (retx < 0) {
-		    if (errno == EINTR)
-			break;
-		    else
-			krb5_err(context, 1, errno, "recvfrom");
-		}
+    roken_detach_finish(NULL, daemon_child);
 
-		process(keytab, sockets[i],
-			 &addrs.val[i],
-			 sa, addrlen,
-			 buf, retx);
-	    }
-    }
+#ifdef HAVE_FORK
+    if (num_processes > 1)
+	start_workers(keytab, sockets, &addrs, &real_fdset, maxfd);
+    else
+#endif
+	loop(keytab, sockets, &addrs, &real_fdset, maxfd, -1);
 
     for (i = 0; i < n; ++i)
-	close(sockets[i]);
+	if (sockets[i] >= 0)
+	    close(sockets[i]);
     free(sockets);
+    free(held_replies);
+    free_realm_handles();
 
     krb5_free_addresses(context, &addrs);
     krb5_free_context(context);
@@ -822,6 +1203,17 @@ main(int argc, char **argv)
     if (realm_str)
 	krb5_set_default_realm(context, realm_str);
 
+    if (num_processes == -1)
+	num_processes = krb5_config_get_int_default(context, NULL, 1,
+						    "kadmin",
+						    "kpasswdd-processes",
+						    NULL);
+    if (batch_requests == -1)
+	batch_requests = krb5_config_get_int_default(context, NULL, 0,
+						     "kadmin",
+						     "kpasswdd-batch-requests",
+						     NULL);
+
     krb5_openlog(context, "kpasswdd", &log_facility);
     krb5_set_warn_dest(context, log_facility);
 
@@ -32,6 +32,94 @@
  */
 
 #include "kuser_locl.h"
+#include "send_to_kdc_plugin.h"
+
+/*
+ * Asynchronous KDC load generator.
+ *
+ * Requests are built up front, one per word in the input file (client
+ * names for AS-REQs, service names for TGS-REQs), and then sent with
+ * up to --concurrency of them outstanding at a time over UDP or TCP.
+ * With --rate requests are started at fixed intervals (open loop) and
+ * latency is measured from the scheduled start, so time spent waiting
+ * for a free slot counts against the KDC rather than being hidden.
+ */
+
+#define USEC_PER_SEC	1000000
+#define MAX_TCP_REPLY	(1024 * 1024)
+#define TGS_REFRESH	60	/* rebuild TGS-REQs well within clock skew */
+
+/*
+ * Log-linear latency histogram in microseconds: LAT_SUB buckets per
+ * power of two, so each bucket is within 1/LAT_SUB of its value.
+ */
+
+#define LAT_SUB_BITS	4
+#define LAT_SUB		(1 << LAT_SUB_BITS)
+#define LAT_BUCKETS	(40 * LAT_SUB)
+
+struct lat_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t bucket[LAT_BUCKETS];
+};
+
+struct err_count {
+    int32_t code;
+    uint64_t count;
+};
+
+struct stats {
+    uint64_t sent;
+    uint64_t replies;
+    uint64_t timeouts;
+    uint64_t neterrors;
+    uint64_t as_rep;
+    uint64_t tgs_rep;
+    uint64_t krb_error;
+    uint64_t other;
+    struct err_count *errs;
+    size_t nerrs;
+    struct lat_hist lat;
+};
+
+struct kdc_addr {
+    struct sockaddr_storage ss;
+    socklen_t len;
+};
+
+enum slot_state { SLOT_FREE, SLOT_CONNECTING, SLOT_SENDING, SLOT_READING };
+
+struct slot {
+    rk_socket_t fd;
+    enum slot_state state;
+    uint64_t sched;		/* scheduled start, for latency */
+    uint64_t sent;		/* actual start, for the timeout */
+    const krb5_data *req;
+    size_t off;			/* request bytes sent */
+    unsigned char len[4];	/* TCP reply length */
+    unsigned char *buf;		/* TCP reply */
+    size_t have;
+    size_t need;
+};
+
+struct gen {
+    krb5_context context;
+    int tcp;
+    struct kdc_addr *kdcs;
+    size_t nkdcs;
+    size_t next_kdc;
+    struct slot *slots;
+    size_t nslots;
+    size_t *freelist;
+    size_t nfree;
+    krb5_data *pool;
+    size_t npool;
+    uint64_t timeout;
+    struct stats st;
+    unsigned char rbuf[65536];
+};
 
 static unsigned
 read_words (const char *filename, char ***ret_w)
@@ -60,45 +148,797 @@ read_words (const char *filename, char ***ret_w)
     return n;
 }
 
+static uint64_t
+now_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * USEC_PER_SEC + tv.tv_usec;
+}
+
+static size_t
+lat_bucket(uint64_t v)
+{
+    unsigned shift = 0;
+    size_t b;
+
+    if (v < LAT_SUB)
+	return v;
+    while ((v >> shift) >= 2 * LAT_SUB)
+	shift++;
+    b = (shift + 1) * LAT_SUB + ((v >> shift) - LAT_SUB);
+    return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+/* Upper bound of the values that land in bucket b */
+static uint64_t
+lat_bucket_value(size_t b)
+{
+    unsigned shift;
+
+    if (b < LAT_SUB)
+	return b;
+    shift = b / LAT_SUB - 1;
+    return (((uint64_t)LAT_SUB + b % LAT_SUB + 1) << shift) - 1;
+}
+
 static void
-generate_requests (const char *filename, unsigned nreq)
+lat_add(struct lat_hist *h, uint64_t v)
+{
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+	h->max = v;
+    h->bucket[lat_bucket(v)]++;
+}
+
+static uint64_t
+lat_percentile(const struct lat_hist *h, double p)
 {
+    uint64_t rank, seen = 0;
+    size_t i;
+
+    if (h->count == 0)
+	return 0;
+    rank = (uint64_t)(p * h->count / 100.0);
+    if (rank >= h->count)
+	rank = h->count - 1;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+	seen += h->bucket[i];
+	if (seen > rank)
+	    break;
+    }
+    if (i == LAT_BUCKETS)
+	return h->max;
+    return min(lat_bucket_value(i), h->max);
+}
+
+/*
+ * Request construction
+ */
+
+static krb5_data *capture_req;
+
+static krb5_error_code
+capture_init(krb5_context context, void **pctx)
+{
+    *pctx = NULL;
+    return 0;
+}
+
+static void
+capture_fini(void *ctx)
+{
+}
+
+static krb5_error_code
+capture_send_to_kdc(krb5_context context,
+		    void *ctx,
+		    krb5_krbhst_info *ho,
+		    time_t timeout,
+		    const krb5_data *in,
+		    krb5_data *out)
+{
+    return KRB5_PLUGIN_NO_HANDLE;
+}
+
+/*
+ * While building a TGS-REQ, keep the encoded request and fail the
+ * exchange instead of talking to the KDC.
+ */
+
+static krb5_error_code
+capture_send_to_realm(krb5_context context,
+		      void *ctx,
+		      krb5_const_realm realm,
+		      time_t timeout,
+		      const krb5_data *in,
+		      krb5_data *out)
+{
+    krb5_error_code ret;
+
+    if (capture_req == NULL)
+	return KRB5_PLUGIN_NO_HANDLE;
+    ret = krb5_data_copy(capture_req, in->data, in->length);
+    capture_req = NULL;
+    return ret ? ret : KRB5_KDC_UNREACH;
+}
+
+static krb5plugin_send_to_kdc_ftable capture = {
+    KRB5_PLUGIN_SEND_TO_KDC_VERSION_2,
+    capture_init,
+    capture_fini,
+    capture_send_to_kdc,
+    capture_send_to_realm
+};
+
+static void
+build_as_req(krb5_context context, const char *name, krb5_data *req)
+{
+    krb5_init_creds_context ctx;
     krb5_principal client;
-    krb5_context context;
     krb5_error_code ret;
-    krb5_creds cred;
-    int i;
+    unsigned int flags = 0;
+    krb5_data in;
+
+    ret = krb5_parse_name(context, name, &client);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_name %s", name);
+
+    ret = krb5_init_creds_init(context, client, NULL, NULL, 0, NULL, &ctx);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_init_creds_init");
+
+    krb5_data_zero(&in);
+    ret = krb5_init_creds_step(context, ctx, &in, req, NULL, &flags);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_init_creds_step %s", name);
+    if ((flags & KRB5_INIT_CREDS_STEP_FLAG_CONTINUE) == 0)
+	krb5_errx(context, 1, "no AS-REQ for %s", name);
+
+    krb5_init_creds_free(context, ctx);
+    krb5_free_principal(context, client);
+}
+
+static void
+build_tgs_req(krb5_context context, krb5_ccache cc, const char *name,
+	      krb5_data *req)
+{
+    krb5_get_creds_opt opt;
+    krb5_principal server;
+    krb5_creds *out = NULL;
+    krb5_error_code ret;
+
+    ret = krb5_parse_name(context, name, &server);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_name %s", name);
+
+    ret = krb5_get_creds_opt_alloc(context, &opt);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_get_creds_opt_alloc");
+    krb5_get_creds_opt_add_options(context, opt, KRB5_GC_NO_STORE);
+
+    krb5_data_zero(req);
+    capture_req = req;
+    ret = krb5_get_creds(context, opt, cc, server, &out);
+    capture_req = NULL;
+    if (ret == 0)
+	krb5_free_creds(context, out);
+    if (req->length == 0)
+	krb5_err(context, 1, ret, "no TGS-REQ for %s", name);
+
+    krb5_get_creds_opt_free(context, opt);
+    krb5_free_principal(context, server);
+}
+
+/*
+ * Copy just the TGT of the default ccache into a MEMORY ccache, so
+ * that service tickets already in the default ccache are not used
+ * instead of building a TGS-REQ.
+ */
+
+static krb5_ccache
+tgt_ccache(krb5_context context)
+{
+    krb5_principal client, tgs;
+    krb5_creds mcreds, creds;
+    krb5_ccache id, mcc;
+    krb5_error_code ret;
+
+    ret = krb5_cc_default(context, &id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_cc_default");
+    ret = krb5_cc_get_principal(context, id, &client);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_cc_get_principal");
+    ret = krb5_make_principal(context, &tgs, client->realm,
+			      KRB5_TGS_NAME, client->realm, NULL);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_make_principal");
+
+    memset(&mcreds, 0, sizeof(mcreds));
+    mcreds.client = client;
+    mcreds.server = tgs;
+    ret = krb5_cc_retrieve_cred(context, id, 0, &mcreds, &creds);
+    if (ret)
+	krb5_err(context, 1, ret, "no TGT in the default ccache");
+
+    ret = krb5_cc_new_unique(context, "MEMORY", NULL, &mcc);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_cc_new_unique");
+    ret = krb5_cc_initialize(context, mcc, client);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_cc_initialize");
+    ret = krb5_cc_store_cred(context, mcc, &creds);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_cc_store_cred");
+
+    krb5_free_cred_contents(context, &creds);
+    krb5_free_principal(context, tgs);
+    krb5_free_principal(context, client);
+    krb5_cc_close(context, id);
+    return mcc;
+}
+
+/* Prefix the request with its length for the TCP transport */
+static void
+frame_req(krb5_context context, krb5_data *req)
+{
+    krb5_error_code ret;
+    unsigned char *p;
+    size_t len = req->length;
+
+    ret = krb5_data_realloc(req, len + 4);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_data_realloc");
+    p = req->data;
+    memmove(p + 4, p, len);
+    p[0] = (len >> 24) & 0xff;
+    p[1] = (len >> 16) & 0xff;
+    p[2] = (len >> 8) & 0xff;
+    p[3] = len & 0xff;
+}
+
+static void
+build_pool(struct gen *g, krb5_ccache cc, char **words, unsigned nwords)
+{
+    unsigned i;
+
+    for (i = 0; i < nwords; i++) {
+	krb5_data_free(&g->pool[i]);
+	if (cc)
+	    build_tgs_req(g->context, cc, words[i], &g->pool[i]);
+	else
+	    build_as_req(g->context, words[i], &g->pool[i]);
+	if (g->tcp)
+	    frame_req(g->context, &g->pool[i]);
+    }
+    g->npool = nwords;
+}
+
+/*
+ * KDC addresses
+ */
+
+static void
+add_kdc_addrs(struct gen *g, struct addrinfo *ai)
+{
+    for (; ai != NULL; ai = ai->ai_next) {
+	struct kdc_addr *k;
+
+	if (ai->ai_addrlen > sizeof(k->ss))
+	    continue;
+	g->kdcs = erealloc(g->kdcs, (g->nkdcs + 1) * sizeof(g->kdcs[0]));
+	k = &g->kdcs[g->nkdcs++];
+	memset(k, 0, sizeof(*k));
+	memcpy(&k->ss, ai->ai_addr, ai->ai_addrlen);
+	k->len = ai->ai_addrlen;
+    }
+}
+
+static void
+resolve_kdc(struct gen *g, const char *spec)
+{
+    struct addrinfo hints, *ai;
+    char *copy, *host, *port;
+    int ret;
+
+    host = copy = estrdup(spec);
+    port = strrchr(host, ':');
+    if (port != NULL && strchr(port + 1, ']') == NULL &&
+	(host[0] != '[' || port[-1] == ']') &&
+	(strchr(host, ':') == port || host[0] == '[')) {
+	*port++ = '\0';
+    } else {
+	port = "88";
+    }
+    if (host[0] == '[') {
+	host++;
+	host[strcspn(host, "]")] = '\0';
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = g->tcp ? SOCK_STREAM : SOCK_DGRAM;
+    ret = getaddrinfo(host, port, &hints, &ai);
+    if (ret)
+	errx(1, "%s: %s", spec, gai_strerror(ret));
+    add_kdc_addrs(g, ai);
+    freeaddrinfo(ai);
+    free(copy);
+}
+
+static void
+find_kdcs(struct gen *g, const char *realm)
+{
+    krb5_krbhst_handle handle;
+    krb5_krbhst_info *hi;
+    krb5_error_code ret;
+
+    ret = krb5_krbhst_init(g->context, realm, KRB5_KRBHST_KDC, &handle);
+    if (ret)
+	krb5_err(g->context, 1, ret, "krb5_krbhst_init");
+    while (krb5_krbhst_next(g->context, handle, &hi) == 0) {
+	struct addrinfo *ai;
+
+	if (hi->proto != (g->tcp ? KRB5_KRBHST_TCP : KRB5_KRBHST_UDP))
+	    continue;
+	if (krb5_krbhst_get_addrinfo(g->context, hi, &ai) == 0)
+	    add_kdc_addrs(g, ai);
+    }
+    krb5_krbhst_free(g->context, handle);
+}
+
+/*
+ * Replies and the request state machine
+ */
+
+static void
+count_error(struct stats *st, int32_t code)
+{
+    size_t i;
+
+    for (i = 0; i < st->nerrs; i++) {
+	if (st->errs[i].code == code) {
+	    st->errs[i].count++;
+	    return;
+	}
+    }
+    st->errs = erealloc(st->errs, (st->nerrs + 1) * sizeof(st->errs[0]));
+    st->errs[st->nerrs].code = code;
+    st->errs[st->nerrs].count = 1;
+    st->nerrs++;
+}
+
+static void
+slot_close(struct gen *g, struct slot *s)
+{
+    rk_closesocket(s->fd);
+    s->fd = rk_INVALID_SOCKET;
+    free(s->buf);
+    s->buf = NULL;
+    s->state = SLOT_FREE;
+    g->freelist[g->nfree++] = s - g->slots;
+}
+
+static void
+slot_failed(struct gen *g, struct slot *s)
+{
+    g->st.neterrors++;
+    slot_close(g, s);
+}
+
+static void
+slot_reply(struct gen *g, struct slot *s, const unsigned char *p, size_t len)
+{
+    struct stats *st = &g->st;
+
+    lat_add(&st->lat, now_usec() - s->sched);
+    st->replies++;
+
+    /* The outer APPLICATION tag is enough to tell the replies apart */
+    if (len > 0 && p[0] == 0x6b) {
+	st->as_rep++;
+    } else if (len > 0 && p[0] == 0x6d) {
+	st->tgs_rep++;
+    } else if (len > 0 && p[0] == 0x7e) {
+	KRB_ERROR error;
+
+	st->krb_error++;
+	if (decode_KRB_ERROR(p, len, &error, NULL) == 0) {
+	    count_error(st, error.error_code);
+	    free_KRB_ERROR(&error);
+	}
+    } else {
+	st->other++;
+    }
+    slot_close(g, s);
+}
+
+static int
+would_block(void)
+{
+#ifdef HAVE_WINSOCK
+    return rk_SOCK_ERRNO == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+static void
+slot_send(struct gen *g, struct slot *s)
+{
+    ssize_t n;
+
+    n = send(s->fd, (char *)s->req->data + s->off, s->req->length - s->off, 0);
+    if (n < 0) {
+	if (!would_block())
+	    slot_failed(g, s);
+	return;
+    }
+    s->off += n;
+    if (s->off == s->req->length)
+	s->state = SLOT_READING;
+}
+
+static void
+slot_connected(struct gen *g, struct slot *s)
+{
+    socklen_t len = sizeof(int);
+    int error = 0;
+
+    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, (void *)&error, &len) < 0 ||
+	error != 0) {
+	slot_failed(g, s);
+	return;
+    }
+    s->state = SLOT_SENDING;
+    slot_send(g, s);
+}
+
+static void
+slot_recv(struct gen *g, struct slot *s)
+{
+    ssize_t n;
+
+    if (!g->tcp) {
+	n = recv(s->fd, g->rbuf, sizeof(g->rbuf), 0);
+	if (n < 0) {
+	    if (!would_block())
+		slot_failed(g, s);
+	    return;
+	}
+	slot_reply(g, s, g->rbuf, n);
+	return;
+    }
+
+    if (s->have < 4) {
+	n = recv(s->fd, s->len + s->have, 4 - s->have, 0);
+	if (n <= 0) {
+	    if (n == 0 || !would_block())
+		slot_failed(g, s);
+	    return;
+	}
+	s->have += n;
+	if (s->have < 4)
+	    return;
+	s->need = ((size_t)s->len[0] << 24) | ((size_t)s->len[1] << 16) |
+	    ((size_t)s->len[2] << 8) | s->len[3];
+	if (s->need == 0 || s->need > MAX_TCP_REPLY) {
+	    slot_failed(g, s);
+	    return;
+	}
+	s->buf = emalloc(s->need);
+    }
+
+    n = recv(s->fd, s->buf + s->have - 4, s->need - (s->have - 4), 0);
+    if (n <= 0) {
+	if (n == 0 || !would_block())
+	    slot_failed(g, s);
+	return;
+    }
+    s->have += n;
+    if (s->have - 4 == s->need)
+	slot_reply(g, s, s->buf, s->need);
+}
+
+static void
+slot_start(struct gen *g, const krb5_data *req, uint64_t sched)
+{
+    struct kdc_addr *k = &g->kdcs[g->next_kdc++ % g->nkdcs];
+    struct slot *s = &g->slots[g->freelist[--g->nfree]];
+
+    memset(s, 0, sizeof(*s));
+    s->req = req;
+    s->sched = sched;
+    s->sent = now_usec();
+    g->st.sent++;
+
+    s->fd = socket(k->ss.ss_family, g->tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (rk_IS_BAD_SOCKET(s->fd)) {
+	slot_failed(g, s);
+	return;
+    }
+#ifndef HAVE_WINSOCK
+    if (s->fd >= FD_SETSIZE) {
+	slot_failed(g, s);
+	return;
+    }
+#endif
+    socket_set_nonblocking(s->fd, 1);
+
+    if (connect(s->fd, (struct sockaddr *)&k->ss, k->len) < 0) {
+#ifdef HAVE_WINSOCK
+	if (WSAGetLastError() == WSAEWOULDBLOCK)
+	    errno = EINPROGRESS;
+#endif
+	if (g->tcp && errno == EINPROGRESS) {
+	    s->state = SLOT_CONNECTING;
+	    return;
+	}
+	slot_failed(g, s);
+	return;
+    }
+    s->state = SLOT_SENDING;
+    slot_send(g, s);
+}
+
+/*
+ * Reporting
+ */
+
+static void
+print_stats(struct gen *g, uint64_t elapsed, int rate)
+{
+    struct stats *st = &g->st;
+    struct lat_hist *h = &st->lat;
+    size_t i;
+
+    printf("elapsed: %llu.%06llu s\n",
+	   (unsigned long long)(elapsed / USEC_PER_SEC),
+	   (unsigned long long)(elapsed % USEC_PER_SEC));
+    printf("sent: %llu replies: %llu timeouts: %llu network errors: %llu\n",
+	   (unsigned long long)st->sent, (unsigned long long)st->replies,
+	   (unsigned long long)st->timeouts,
+	   (unsigned long long)st->neterrors);
+    printf("rate: %.2lf replies/s", elapsed ?
+	   (st->replies * (double)USEC_PER_SEC) / elapsed : 0.0);
+    if (rate)
+	printf(" (target %d req/s)", rate);
+    printf("\n");
+    printf("replies: AS-REP %llu TGS-REP %llu KRB-ERROR %llu other %llu\n",
+	   (unsigned long long)st->as_rep, (unsigned long long)st->tgs_rep,
+	   (unsigned long long)st->krb_error, (unsigned long long)st->other);
+    for (i = 0; i < st->nerrs; i++) {
+	const char *msg;
+
+	msg = krb5_get_error_message(g->context,
+				     st->errs[i].code + KRB5KDC_ERR_NONE);
+	printf("  error %d (%s): %llu\n", (int)st->errs[i].code, msg,
+	       (unsigned long long)st->errs[i].count);
+	krb5_free_error_message(g->context, msg);
+    }
+    if (h->count == 0)
+	return;
+    printf("latency usec: mean %llu p50 %llu p95 %llu p99 %llu "
+	   "p999 %llu max %llu\n",
+	   (unsigned long long)(h->sum / h->count),
+	   (unsigned long long)lat_percentile(h, 50.0),
+	   (unsigned long long)lat_percentile(h, 95.0),
+	   (unsigned long long)lat_percentile(h, 99.0),
+	   (unsigned long long)lat_percentile(h, 99.9),
+	   (unsigned long long)h->max);
+}
+
+static int version_flag	= 0;
+static int help_flag	= 0;
+static int tgs_flag	= 0;
+static int concurrency	= 1;
+static int rate		= 0;
+static int duration	= 0;
+static int timeout	= 5;
+static char *transport	= "udp";
+static char *realm_str	= NULL;
+static struct getarg_strings kdc_strings;
+
+static void
+generate_requests (const char *filename, unsigned nreq)
+{
+    krb5_ccache cc = NULL;
+    struct gen g;
     char **words;
     unsigned nwords;
+    uint64_t start, next, built, interval = 0, launched = 0;
+    krb5_error_code ret;
+    char *realm;
+    size_t i;
+    int stopping = 0;
 
-    ret = krb5_init_context (&context);
+    memset(&g, 0, sizeof(g));
+
+    ret = krb5_init_context (&g.context);
     if (ret)
 	errx (1, "krb5_init_context failed: %d", ret);
 
+    if (strcasecmp(transport, "tcp") == 0)
+	g.tcp = 1;
+    else if (strcasecmp(transport, "udp") != 0)
+	errx(1, "unknown transport %s", transport);
+
     nwords = read_words (filename, &words);
 
-    for (i = 0; i < nreq; ++i) {
-	char *name = words[rand() % nwords];
+    if (tgs_flag) {
+	krb5_plugin_register(g.context, PLUGIN_TYPE_DATA,
+			     KRB5_PLUGIN_SEND_TO_KDC, &capture);
+	cc = tgt_ccache(g.context);
+    }
 
-	memset(&cred, 0, sizeof(cred));
+    g.pool = ecalloc(nwords, sizeof(g.pool[0]));
+    build_pool(&g, cc, words, nwords);
+    built = now_usec();
 
-	ret = krb5_parse_name (context, name, &client);
+    if (realm_str) {
+	realm = estrdup(realm_str);
+    } else if (cc) {
+	krb5_principal p;
+
+	ret = krb5_cc_get_principal(g.context, cc, &p);
 	if (ret)
-	    krb5_err (context, 1, ret, "krb5_parse_name %s", name);
+	    krb5_err(g.context, 1, ret, "krb5_cc_get_principal");
+	realm = estrdup(krb5_principal_get_realm(g.context, p));
+	krb5_free_principal(g.context, p);
+    } else {
+	krb5_principal p;
 
-	ret = krb5_get_init_creds_password (context, &cred, client, "",
-					    NULL, NULL, 0, NULL, NULL);
+	ret = krb5_parse_name(g.context, words[0], &p);
 	if (ret)
-	    krb5_free_cred_contents (context, &cred);
-	krb5_free_principal(context, client);
+	    krb5_err(g.context, 1, ret, "krb5_parse_name %s", words[0]);
+	realm = estrdup(krb5_principal_get_realm(g.context, p));
+	krb5_free_principal(g.context, p);
     }
+
+    for (i = 0; i < kdc_strings.num_strings; i++)
+	resolve_kdc(&g, kdc_strings.strings[i]);
+    if (kdc_strings.num_strings == 0)
+	find_kdcs(&g, realm);
+    if (g.nkdcs == 0)
+	errx(1, "no %s KDCs found for %s", transport, realm);
+
+    if (concurrency < 1)
+	concurrency = 1;
+    if (concurrency > FD_SETSIZE - 16) {
+	warnx("concurrency limited to %d", FD_SETSIZE - 16);
+	concurrency = FD_SETSIZE - 16;
+    }
+    g.nslots = concurrency;
+    g.slots = ecalloc(g.nslots, sizeof(g.slots[0]));
+    g.freelist = ecalloc(g.nslots, sizeof(g.freelist[0]));
+    for (i = 0; i < g.nslots; i++) {
+	g.slots[i].fd = rk_INVALID_SOCKET;
+	g.freelist[g.nfree++] = g.nslots - 1 - i;
+    }
+    g.timeout = (uint64_t)timeout * USEC_PER_SEC;
+    if (rate > 0)
+	interval = USEC_PER_SEC / rate;
+    if (interval == 0 && rate > 0)
+	interval = 1;
+
+    start = next = now_usec();
+    for (;;) {
+	struct timeval tv;
+	fd_set rfds, wfds;
+	rk_socket_t max_fd = 0;
+	uint64_t t = now_usec(), wait = USEC_PER_SEC / 10;
+
+	if ((nreq && launched >= nreq) ||
+	    (duration && t - start >= (uint64_t)duration * USEC_PER_SEC))
+	    stopping = 1;
+
+	while (!stopping && g.nfree > 0 && (interval == 0 || next <= t)) {
+	    slot_start(&g, &g.pool[rand() % g.npool], interval ? next : t);
+	    launched++;
+	    if (interval)
+		next += interval;
+	    if (nreq && launched >= nreq)
+		stopping = 1;
+	}
+
+	if (stopping && g.nfree == g.nslots)
+	    break;
+
+	t = now_usec();
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	for (i = 0; i < g.nslots; i++) {
+	    struct slot *s = &g.slots[i];
+
+	    if (s->state == SLOT_FREE)
+		continue;
+	    if (t - s->sent >= g.timeout) {
+		g.st.timeouts++;
+		slot_close(&g, s);
+		continue;
+	    }
+	    if (s->state == SLOT_READING)
+		FD_SET(s->fd, &rfds);
+	    else
+		FD_SET(s->fd, &wfds);
+	    if (s->fd > max_fd)
+		max_fd = s->fd;
+	}
+
+	if (!stopping && interval && g.nfree > 0)
+	    wait = next > t ? min(wait, next - t) : 0;
+	tv.tv_sec = wait / USEC_PER_SEC;
+	tv.tv_usec = wait % USEC_PER_SEC;
+
+	if (g.nfree == g.nslots) {
+	    if (wait)
+		select(0, NULL, NULL, NULL, &tv);
+	    continue;
+	}
+	if (select(max_fd + 1, &rfds, &wfds, NULL, &tv) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    err(1, "select");
+	}
+
+	for (i = 0; i < g.nslots; i++) {
+	    struct slot *s = &g.slots[i];
+
+	    if (s->state == SLOT_FREE)
+		continue;
+	    if (s->state == SLOT_READING && FD_ISSET(s->fd, &rfds))
+		slot_recv(&g, s);
+	    else if (s->state == SLOT_CONNECTING && FD_ISSET(s->fd, &wfds))
+		slot_connected(&g, s);
+	    else if (s->state == SLOT_SENDING && FD_ISSET(s->fd, &wfds))
+		slot_send(&g, s);
+	}
+
+	/* Stay within the clock skew allowed for the authenticators */
+	if (cc && !stopping && now_usec() - built >= TGS_REFRESH * USEC_PER_SEC) {
+	    build_pool(&g, cc, words, nwords);
+	    built = now_usec();
+	}
+    }
+
+    print_stats(&g, now_usec() - start, rate);
+
+    if (cc)
+	krb5_cc_destroy(g.context, cc);
+    for (i = 0; i < g.npool; i++)
+	krb5_data_free(&g.pool[i]);
+    for (i = 0; i < nwords; i++)
+	free(words[i]);
+    free(g.pool);
+    free(g.slots);
+    free(g.freelist);
+    free(g.kdcs);
+    free(g.st.errs);
     free(words);
+    free(realm);
+    krb5_free_context(g.context);
 }
 
-static int version_flag	= 0;
-static int help_flag	= 0;
-
 static struct getargs args[] = {
+    { "concurrency", 'c', arg_integer, &concurrency,
+      "number of requests outstanding at a time", "number" },
+    { "rate",	'r', arg_integer, &rate,
+      "requests per second to start (open loop)", "number" },
+    { "duration", 'd', arg_integer, &duration,
+      "seconds to run for", "seconds" },
+    { "timeout", 't', arg_integer, &timeout,
+      "seconds to wait for a reply", "seconds" },
+    { "transport", 0, arg_string, &transport,
+      "transport to use", "udp|tcp" },
+    { "kdc",	'k', arg_strings, &kdc_strings,
+      "KDC to send requests to", "host[:port]" },
+    { "realm",	0,   arg_string, &realm_str,
+      "realm to look up KDCs for", "realm" },
+    { "tgs",	0,   arg_flag, &tgs_flag,
+      "send TGS-REQs for the services in the file, using the default ccache",
+      NULL },
     { "version", 	0,   arg_flag, &version_flag, NULL, NULL },
     { "help",		0,   arg_flag, &help_flag,    NULL, NULL }
 };
@@ -109,7 +949,7 @@ usage (int ret)
     arg_printusage (args,
 		    sizeof(args)/sizeof(*args),
 		    NULL,
-		    "file number");
+		    "file [number]");
     exit (ret);
 }
 
@@ -117,7 +957,7 @@ int
 main(int argc, char **argv)
 {
     int optidx = 0;
-    int nreq;
+    int nreq = 0;
     char *end;
 
     setprogname(argv[0]);
@@ -135,12 +975,16 @@ main(int argc, char **argv)
     argc -= optidx;
     argv += optidx;
 
-    if (argc != 2)
+    if (argc != 2 && !(argc == 1 && duration > 0))
 	usage (1);
     srand (0);
-    nreq = strtol (argv[1], &end, 0);
-    if (argv[1] == end || *end != '\0')
-	usage (1);
+    if (argc == 2) {
+	nreq = strtol (argv[1], &end, 0);
+	if (argv[1] == end || *end != '\0' || nreq < 0)
+	    usage (1);
+    }
+    rk_SOCK_INIT();
     generate_requests (argv[0], nreq);
+    rk_SOCK_EXIT();
     return 0;
 }
@@ -61,18 +61,14 @@ enum asn1_print_flags {
 
 #define ASN1_MALLOC_ENCODE(T, B, BL, S, L, R)                  \
   do {                                                         \
-    (BL) = length_##T((S));                                    \
-    (B) = malloc((BL));                                        \
-    if((B) == NULL) {                                          \
-      (R) = ENOMEM;                                            \
-    } else {                                                   \
-      (R) = encode_##T(((unsigned char*)(B)) + (BL) - 1, (BL), \
-                       (S), (L));                              \
-      if((R) != 0) {                                           \
-        free((B));                                             \
-        (B) = NULL;                                            \
-      }                                                        \
-    }                                                          \
+    void *asn1_me_b_;                                          \
+    size_t asn1_me_bl_;                                        \
+    (void)sizeof(length_##T((S)));                             \
+    (R) = _asn1_malloc_encode((asn1_malloc_encode_f)encode_##T, \
+                              (asn1_malloc_length_f)length_##T, \
+                              (S), &asn1_me_b_, &asn1_me_bl_, (L)); \
+    (B) = asn1_me_b_;                                          \
+    (BL) = asn1_me_bl_;                                        \
   } while (0)
 
 #ifdef _WIN32
@@ -87,4 +83,15 @@ enum asn1_print_flags {
 #define ASN1CALL
 #endif
 
+typedef int (ASN1CALL *asn1_malloc_encode_f)(unsigned char *, size_t,
+                                             const void *, size_t *);
+typedef size_t (ASN1CALL *asn1_malloc_length_f)(const void *);
+
+ASN1EXP int ASN1CALL _asn1_malloc_encode(asn1_malloc_encode_f,
+                                         asn1_malloc_length_f,
+                                         const void *, void **,
+                                         size_t *, size_t *);
+
+struct asn1_arena;
+
 #endif
@@ -113,6 +113,19 @@
  * offset is the offset of the choice struct
  */
 
+/* choice:
+ *  0..23 flags A1_CF_*
+ * 28..31 op
+ *
+ * ptr points to the CHOICE template: a header (tt is the offset of the
+ * ellipsis, if any, offset is the offset of the element discriminant, and
+ * ptr is the count of entries that follow), one entry per alternative and
+ * the names.  If A1_CF_TAG_INDEX is set these are followed by another
+ * header whose ptr is the count of tag index entries, and then by the tag
+ * index entries, sorted by class and tag, whose tt is the outer tag of an
+ * alternative and whose offset is that alternative's template index.
+ */
+
 /* opentypeid: offset is zero
  *             ptr points to value if it is not an integer
  *             ptr   is the  value if it is     an integer
@@ -166,6 +179,8 @@
 
 #define A1_PF_INDEFINTE		0x1
 #define A1_PF_ALLOW_BER		0x2
+#define A1_PF_BORROW		0x4	/* OCTET STRINGs point into the input */
+#define A1_PF_ARENA		0x8	/* allocated from a struct asn1_arena */
 
 #define A1_HF_PRESERVE		0x1
 #define A1_HF_ELLIPSIS		0x2
@@ -180,8 +195,11 @@
 
 #define A1_OS_IS_SORTED		(0x01000000)
 #define A1_OS_OT_IS_ARRAY	(0x02000000)
+#define A1_OS_LAZY		(0x08000000)	/* see _asn1_decode_open_types() */
 #define A1_OTI_IS_INTEGER	(0x04000000)
 
+#define A1_CF_TAG_INDEX		(0x00000001)
+
 
 struct asn1_template {
     uint32_t tt;
@@ -256,9 +274,16 @@ _asn1_copy_top (
 	const void * /*from*/,
 	void * /*to*/);
 
+int
+_asn1_copy_top_arena(const struct asn1_template *, const void *,
+		     struct asn1_arena *, void **);
+
 void
 _asn1_free_top(const struct asn1_template *, void *);
 
+void
+_asn1_free_borrowed_top(const struct asn1_template *, void *);
+
 char *
 _asn1_print_top(const struct asn1_template *, int, const void *);
 
@@ -271,6 +296,14 @@ _asn1_decode_top (
 	void * /*data*/,
 	size_t * /*size*/);
 
+int
+_asn1_decode_top_arena(const struct asn1_template *, unsigned,
+		       struct asn1_arena *, const unsigned char *, size_t,
+		       void **, size_t *);
+
+int
+_asn1_decode_open_types(const struct asn1_template *, void *);
+
 int
 _asn1_encode (
 	const struct asn1_template * /*t*/,
@@ -0,0 +1,739 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Benchmark the generated ASN.1 codecs: decode, free, encode, length
+ * and copy, per type and sample, reporting ns/op and (with glibc)
+ * allocations/op.
+ *
+ * Built-in samples cover the Kerberos messages the KDC handles most.
+ * Certificates, CMS and PKINIT messages are given on the command line
+ * as TYPE:FILE, DER or PEM, e.g.
+ *
+ *	asn1_bench Certificate:../hx509/data/test.crt \
+ *		   ContentInfo:../hx509/data/test-signed-data
+ *
+ * asn1_bench is linked with libasn1 and asn1_bench_template with
+ * libasn1template; when Heimdal is configured without templating the
+ * two compare the codegen and template backends.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+#include <err.h>
+#include <roken.h>
+#include <getarg.h>
+#include <base64.h>
+#include <com_err.h>
+
+#include <asn1-common.h>
+#include <asn1_err.h>
+#include <der.h>
+#include <krb5_asn1.h>
+#include <rfc2459_asn1.h>
+#include <cms_asn1.h>
+#include <pkinit_asn1.h>
+
+#ifdef ASN1_BENCH_TEMPLATE
+#define BACKEND "libasn1template"
+#else
+#define BACKEND "libasn1"
+#endif
+
+/*
+ * Count allocations by interposing on malloc(3) and friends, which is
+ * easy with glibc as it exports the real ones under other names.
+ */
+#ifdef __GLIBC__
+#define HAVE_ALLOC_COUNT 1
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static unsigned long nallocs;
+
+void *
+malloc(size_t size)
+{
+    nallocs++;
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    nallocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    nallocs++;
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+typedef int (ASN1CALL *bench_decode_f)(const unsigned char *, size_t,
+                                      void *, size_t *);
+typedef int (ASN1CALL *bench_encode_f)(unsigned char *, size_t,
+                                      const void *, size_t *);
+typedef size_t (ASN1CALL *bench_length_f)(const void *);
+typedef int (ASN1CALL *bench_copy_f)(const void *, void *);
+typedef void (ASN1CALL *bench_free_f)(void *);
+
+struct bench_type {
+    const char *name;
+    size_t size;
+    bench_decode_f decode;
+    bench_encode_f encode;
+    bench_length_f length;
+    bench_copy_f copy;
+    bench_free_f release;
+};
+
+#define BENCH_TYPE(n, t)			\
+    { n, sizeof(t),				\
+      (bench_decode_f)decode_##t,		\
+      (bench_encode_f)encode_##t,		\
+      (bench_length_f)length_##t,		\
+      (bench_copy_f)copy_##t,			\
+      (bench_free_f)free_##t }
+
+static const struct bench_type types[] = {
+    BENCH_TYPE("AP-REQ", AP_REQ),
+    BENCH_TYPE("AS-REP", AS_REP),
+    BENCH_TYPE("AS-REQ", AS_REQ),
+    BENCH_TYPE("AuthPack", AuthPack),
+    BENCH_TYPE("Authenticator", Authenticator),
+    BENCH_TYPE("Certificate", Certificate),
+    BENCH_TYPE("ContentInfo", ContentInfo),
+    BENCH_TYPE("EncTicketPart", EncTicketPart),
+    BENCH_TYPE("KRB-ERROR", KRB_ERROR),
+    BENCH_TYPE("PA-DATA", PA_DATA),
+    BENCH_TYPE("PA-PK-AS-REP", PA_PK_AS_REP),
+    BENCH_TYPE("PA-PK-AS-REQ", PA_PK_AS_REQ),
+    BENCH_TYPE("SignedData", SignedData),
+    BENCH_TYPE("TGS-REP", TGS_REP),
+    BENCH_TYPE("TGS-REQ", TGS_REQ),
+    BENCH_TYPE("Ticket", Ticket),
+};
+
+struct sample {
+    const struct bench_type *type;
+    char *label;
+    unsigned char *der;
+    size_t len;
+    void *value;		/* decoded der */
+    size_t enclen;		/* length of value re-encoded */
+};
+
+static struct sample *samples;
+static size_t nsamples;
+
+static getarg_strings type_strs = { 0, NULL };
+static getarg_strings op_strs = { 0, NULL };
+static char *seconds_str = "0.5";
+static int builtin_flag = 1;
+static int list_flag;
+static int version_flag;
+static int help_flag;
+
+static struct getargs args[] = {
+    { "type",		't',	arg_strings,	&type_strs,
+      "type to benchmark (repeatable)", "type" },
+    { "op",		'o',	arg_strings,	&op_strs,
+      "operation to benchmark (repeatable)",
+      "decode|free|encode|length|copy" },
+    { "seconds",	's',	arg_string,	&seconds_str,
+      "time to spend on each measurement", "seconds" },
+    { "builtin",	0,	arg_negative_flag, &builtin_flag,
+      "don't use the built-in Kerberos samples", NULL },
+    { "list-types",	0,	arg_flag,	&list_flag,
+      "list the types that samples may be given for", NULL },
+    { "version",	0,	arg_flag,	&version_flag,
+      "print version", NULL },
+    { "help",		0,	arg_flag,	&help_flag,
+      NULL, NULL }
+};
+
+static double seconds;
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static const struct bench_type *
+find_type(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(types)/sizeof(types[0]); i++)
+        if (strcmp(types[i].name, name) == 0)
+            return &types[i];
+    return NULL;
+}
+
+static int
+selected(const getarg_strings *strs, const char *name)
+{
+    int i;
+
+    if (strs->num_strings == 0)
+        return 1;
+    for (i = 0; i < strs->num_strings; i++)
+        if (strcmp(strs->strings[i], name) == 0)
+            return 1;
+    return 0;
+}
+
+/* Takes ownership of `der' */
+static void
+add_sample(const struct bench_type *type, const char *label,
+           unsigned char *der, size_t len)
+{
+    struct sample *s;
+    size_t size;
+    int ret;
+
+    samples = erealloc(samples, (nsamples + 1) * sizeof(samples[0]));
+    s = &samples[nsamples++];
+    s->type = type;
+    s->label = estrdup(label);
+    s->der = der;
+    s->len = len;
+    s->value = ecalloc(1, type->size);
+    ret = type->decode(der, len, s->value, &size);
+    if (ret)
+        errx(1, "%s: can't decode as %s: %s", label, type->name,
+             error_message(ret));
+    if (size != len)
+        errx(1, "%s: %lu bytes of trailing garbage", label,
+             (unsigned long)(len - size));
+    s->enclen = type->length(s->value);
+}
+
+#define ADD_BUILTIN(T, n, v)						\
+    do {								\
+        unsigned char *der_;						\
+        size_t len_, size_;						\
+        int ret_;							\
+        ASN1_MALLOC_ENCODE(T, der_, len_, (v), &size_, ret_);		\
+        if (ret_)							\
+            errx(1, "encode_" #T ": %s", error_message(ret_));		\
+        add_sample(find_type(n), "builtin", der_, len_);		\
+    } while (0)
+
+/*
+ * Kerberos samples shaped like what a KDC sees: a PA-ENC-TIMESTAMP
+ * AS-REQ, a TGS-REQ carrying an AP-REQ, replies and an error.
+ */
+static void
+add_builtin_samples(void)
+{
+    static char *client_comp[] = { "lha" };
+    static char *tgs_comp[] = { "krbtgt", "SU.SE" };
+    static char *host_comp[] = { "host", "nutcracker.e.kth.se" };
+    static unsigned char cipher[512], keyvalue[32], adbuf[256], tsbuf[60];
+    ENCTYPE etypes[] = {
+        KRB5_ENCTYPE_AES256_CTS_HMAC_SHA1_96, KRB5_ENCTYPE_AES128_CTS_HMAC_SHA1_96,
+        KRB5_ENCTYPE_AES256_CTS_HMAC_SHA384_192, KRB5_ENCTYPE_ARCFOUR_HMAC_MD5
+    };
+    AuthorizationDataElement ad;
+    AuthorizationData authz;
+    PrincipalName client, tgs, host;
+    EncTicketPart etp;
+    Authenticator auth;
+    Ticket ticket;
+    AP_REQ apreq;
+    PA_DATA pa[2];
+    KDC_REQ req;
+    KDC_REP rep;
+    KRB_ERROR error;
+    time_t t = 1700000000;
+    int kvno = 2;
+    unsigned char *der;
+    size_t len, size, i;
+    int ret;
+
+    for (i = 0; i < sizeof(cipher); i++)
+        cipher[i] = i * 7;
+    for (i = 0; i < sizeof(keyvalue); i++)
+        keyvalue[i] = i;
+    memset(adbuf, 0x5a, sizeof(adbuf));
+    memset(tsbuf, 0xa5, sizeof(tsbuf));
+
+    client.name_type = KRB5_NT_PRINCIPAL;
+    client.name_string.len = 1;
+    client.name_string.val = client_comp;
+    tgs.name_type = KRB5_NT_SRV_INST;
+    tgs.name_string.len = 2;
+    tgs.name_string.val = tgs_comp;
+    host.name_type = KRB5_NT_SRV_HST;
+    host.name_string.len = 2;
+    host.name_string.val = host_comp;
+
+    ad.ad_type = KRB5_AUTHDATA_IF_RELEVANT;
+    ad.ad_data.data = adbuf;
+    ad.ad_data.length = sizeof(adbuf);
+    authz.len = 1;
+    authz.val = &ad;
+
+    memset(&etp, 0, sizeof(etp));
+    etp.flags.forwardable = 1;
+    etp.flags.renewable = 1;
+    etp.flags.initial = 1;
+    etp.flags.pre_authent = 1;
+    etp.key.keytype = KRB5_ENCTYPE_AES256_CTS_HMAC_SHA1_96;
+    etp.key.keyvalue.data = keyvalue;
+    etp.key.keyvalue.length = sizeof(keyvalue);
+    etp.crealm = "SU.SE";
+    etp.cname = client;
+    etp.transited.tr_type = 1;
+    etp.authtime = t;
+    etp.starttime = &t;
+    etp.endtime = t + 36000;
+    etp.renew_till = &t;
+    etp.authorization_data = &authz;
+    ADD_BUILTIN(EncTicketPart, "EncTicketPart", &etp);
+
+    memset(&ticket, 0, sizeof(ticket));
+    ticket.tkt_vno = 5;
+    ticket.realm = "SU.SE";
+    ticket.sname = tgs;
+    ticket.enc_part.etype = KRB5_ENCTYPE_AES256_CTS_HMAC_SHA1_96;
+    ticket.enc_part.kvno = &kvno;
+    ticket.enc_part.cipher.data = cipher;
+    ticket.enc_part.cipher.length = sizeof(cipher);
+    ADD_BUILTIN(Ticket, "Ticket", &ticket);
+
+    memset(&auth, 0, sizeof(auth));
+    auth.authenticator_vno = 5;
+    auth.crealm = "SU.SE";
+    auth.cname = client;
+    auth.cusec = 4711;
+    auth.ctime = t;
+    auth.subkey = &etp.key;
+    ADD_BUILTIN(Authenticator, "Authenticator", &auth);
+
+    memset(&apreq, 0, sizeof(apreq));
+    apreq.pvno = 5;
+    apreq.msg_type = krb_ap_req;
+    apreq.ticket = ticket;
+    apreq.authenticator.etype = KRB5_ENCTYPE_AES256_CTS_HMAC_SHA1_96;
+    apreq.authenticator.cipher.data = cipher;
+    apreq.authenticator.cipher.length = 200;
+    ADD_BUILTIN(AP_REQ, "AP-REQ", &apreq);
+
+    /* AS-REQ with PA-ENC-TIMESTAMP and PA-PAC-REQUEST */
+    memset(pa, 0, sizeof(pa));
+    pa[0].padata_type = KRB5_PADATA_ENC_TIMESTAMP;
+    pa[0].padata_value.data = tsbuf;
+    pa[0].padata_value.length = sizeof(tsbuf);
+    pa[1].padata_type = KRB5_PADATA_PA_PAC_REQUEST;
+    pa[1].padata_value.data = "\x30\x05\xa0\x03\x01\x01\xff";
+    pa[1].padata_value.length = 7;
+    ADD_BUILTIN(PA_DATA, "PA-DATA", &pa[0]);
+
+    memset(&req, 0, sizeof(req));
+    req.pvno = 5;
+    req.msg_type = krb_as_req;
+    req.padata = ecalloc(1, sizeof(*req.padata));
+    req.padata->len = 2;
+    req.padata->val = pa;
+    req.req_body.kdc_options.forwardable = 1;
+    req.req_body.kdc_options.renewable = 1;
+    req.req_body.cname = &client;
+    req.req_body.realm = "SU.SE";
+    req.req_body.sname = &tgs;
+    req.req_body.till = &t;
+    req.req_body.rtime = &t;
+    req.req_body.nonce = 0x12345678;
+    req.req_body.etype.len = sizeof(etypes)/sizeof(etypes[0]);
+    req.req_body.etype.val = etypes;
+    ADD_BUILTIN(AS_REQ, "AS-REQ", &req);
+
+    /* TGS-REQ with PA-TGS-REQ */
+    ASN1_MALLOC_ENCODE(AP_REQ, der, len, &apreq, &size, ret);
+    if (ret)
+        errx(1, "encode_AP_REQ: %s", error_message(ret));
+    pa[0].padata_type = KRB5_PADATA_TGS_REQ;
+    pa[0].padata_value.data = der;
+    pa[0].padata_value.length = len;
+    req.msg_type = krb_tgs_req;
+    req.padata->len = 1;
+    req.req_body.cname = NULL;
+    req.req_body.sname = &host;
+    req.req_body.rtime = NULL;
+    ADD_BUILTIN(TGS_REQ, "TGS-REQ", &req);
+    free(der);
+    free(req.padata);
+
+    memset(&rep, 0, sizeof(rep));
+    rep.pvno = 5;
+    rep.msg_type = krb_as_rep;
+    rep.crealm = "SU.SE";
+    rep.cname = client;
+    rep.ticket = ticket;
+    rep.enc_part.etype = KRB5_ENCTYPE_AES256_CTS_HMAC_SHA1_96;
+    rep.enc_part.cipher.data = cipher;
+    rep.enc_part.cipher.length = 300;
+    ADD_BUILTIN(AS_REP, "AS-REP", &rep);
+    rep.msg_type = krb_tgs_rep;
+    rep.ticket.sname = host;
+    ADD_BUILTIN(TGS_REP, "TGS-REP", &rep);
+
+    memset(&error, 0, sizeof(error));
+    error.pvno = 5;
+    error.msg_type = krb_error;
+    error.stime = t;
+    error.susec = 4711;
+    error.error_code = 25; /* KDC_ERR_PREAUTH_REQUIRED */
+    error.realm = "SU.SE";
+    error.sname = tgs;
+    error.e_data = &pa[1].padata_value;
+    ADD_BUILTIN(KRB_ERROR, "KRB-ERROR", &error);
+}
+
+/* Read a DER file, or the first object in a PEM file */
+static void
+add_file_sample(const char *arg)
+{
+    const struct bench_type *type;
+    const char *file;
+    unsigned char *der;
+    char *tname, *data, *b64, *p, *q;
+    size_t len;
+    int ret;
+
+    file = strchr(arg, ':');
+    if (file == NULL)
+        errx(1, "sample must be given as TYPE:FILE: %s", arg);
+    tname = estrdup(arg);
+    tname[file - arg] = '\0';
+    file++;
+    if ((type = find_type(tname)) == NULL)
+        errx(1, "unknown type %s (see --list-types)", tname);
+    free(tname);
+
+    ret = rk_undumpdata(file, (void **)&data, &len);
+    if (ret)
+        errx(1, "%s: %s", file, strerror(ret));
+
+    if (len > 11 && strncmp(data, "-----BEGIN ", 11) == 0) {
+        data = erealloc(data, len + 1);
+        data[len] = '\0';
+        if ((p = strchr(data, '\n')) == NULL ||
+            (q = strstr(p, "-----END ")) == NULL)
+            errx(1, "%s: malformed PEM", file);
+        *q = '\0';
+        b64 = ++p;
+        /* Squeeze out line breaks for rk_base64_decode() */
+        for (q = p; *p; p++)
+            if (!isspace((unsigned char)*p))
+                *q++ = *p;
+        *q = '\0';
+        der = emalloc(strlen(b64) + 1);
+        ret = rk_base64_decode(b64, der);
+        if (ret < 0)
+            errx(1, "%s: malformed PEM", file);
+        len = ret;
+        free(data);
+    } else {
+        der = (unsigned char *)data;
+    }
+    add_sample(type, file, der, len);
+}
+
+/*
+ * Each operation is timed over batches of up to BATCH values so that
+ * decode and free (and copy and free) can be timed separately without
+ * reading the clock around every call.
+ */
+#define BATCH 256
+
+struct result {
+    double t;
+    unsigned long n;
+    unsigned long allocs;
+};
+
+enum { OP_DECODE, OP_FREE, OP_ENCODE, OP_LENGTH, OP_COPY, NOPS };
+
+static const char *opnames[NOPS] = {
+    "decode", "free", "encode", "length", "copy"
+};
+
+static void
+run_decode(const struct sample *s, void **vals, size_t batch,
+           struct result *res)
+{
+    const struct bench_type *type = s->type;
+    unsigned long a0, a1;
+    double t0, t1, t2;
+    size_t i, size;
+    int ret;
+
+#ifdef HAVE_ALLOC_COUNT
+    a0 = nallocs;
+#else
+    a0 = 0;
+#endif
+    t0 = now();
+    for (i = 0; i < batch; i++) {
+        ret = type->decode(s->der, s->len, vals[i], &size);
+        if (ret)
+            errx(1, "decode %s: %s", type->name, error_message(ret));
+    }
+    t1 = now();
+#ifdef HAVE_ALLOC_COUNT
+    a1 = nallocs;
+#else
+    a1 = 0;
+#endif
+    for (i = 0; i < batch; i++)
+        type->release(vals[i]);
+    t2 = now();
+
+    res[OP_DECODE].t += t1 - t0;
+    res[OP_DECODE].n += batch;
+    res[OP_DECODE].allocs += a1 - a0;
+    res[OP_FREE].t += t2 - t1;
+    res[OP_FREE].n += batch;
+}
+
+static void
+run_copy(const struct sample *s, void **vals, size_t batch,
+         struct result *res)
+{
+    const struct bench_type *type = s->type;
+    unsigned long a0, a1;
+    double t0, t1;
+    size_t i;
+    int ret;
+
+#ifdef HAVE_ALLOC_COUNT
+    a0 = nallocs;
+#else
+    a0 = 0;
+#endif
+    t0 = now();
+    for (i = 0; i < batch; i++) {
+        ret = type->copy(s->value, vals[i]);
+        if (ret)
+            errx(1, "copy %s: %s", type->name, error_message(ret));
+    }
+    t1 = now();
+#ifdef HAVE_ALLOC_COUNT
+    a1 = nallocs;
+#else
+    a1 = 0;
+#endif
+    for (i = 0; i < batch; i++)
+        type->release(vals[i]);
+
+    res[OP_COPY].t += t1 - t0;
+    res[OP_COPY].n += batch;
+    res[OP_COPY].allocs += a1 - a0;
+}
+
+/* Encodes into a buffer of the right size, as ASN1_MALLOC_ENCODE does */
+static void
+run_encode(const struct sample *s, unsigned char *buf, size_t batch,
+           struct result *res)
+{
+    const struct bench_type *type = s->type;
+    double t0, t1, t2;
+    size_t i, size, len = 0;
+    int ret;
+
+    t0 = now();
+    for (i = 0; i < batch; i++)
+        len += type->length(s->value);
+    t1 = now();
+    for (i = 0; i < batch; i++) {
+        ret = type->encode(buf + s->enclen - 1, s->enclen, s->value, &size);
+        if (ret)
+            errx(1, "encode %s: %s", type->name, error_message(ret));
+    }
+    t2 = now();
+    if (len != batch * s->enclen || size != s->enclen)
+        errx(1, "encode %s: length mismatch", type->name);
+
+    res[OP_LENGTH].t += t1 - t0;
+    res[OP_LENGTH].n += batch;
+    res[OP_ENCODE].t += t2 - t1;
+    res[OP_ENCODE].n += batch;
+}
+
+static void
+bench_sample(const struct sample *s)
+{
+    struct result res[NOPS];
+    unsigned char *buf;
+    void *vals[BATCH];
+    size_t batch, i;
+    double start;
+    int o;
+
+    memset(res, 0, sizeof(res));
+    for (i = 0; i < BATCH; i++)
+        vals[i] = ecalloc(1, s->type->size);
+    buf = emalloc(s->enclen);
+
+    /* Warm up */
+    run_decode(s, vals, 1, res);
+    run_copy(s, vals, 1, res);
+    run_encode(s, buf, 1, res);
+    memset(res, 0, sizeof(res));
+
+    if (selected(&op_strs, "decode") || selected(&op_strs, "free")) {
+        start = now();
+        for (batch = 1; now() - start < seconds; )  {
+            run_decode(s, vals, batch, res);
+            if (batch < BATCH)
+                batch *= 2;
+        }
+    }
+    if (selected(&op_strs, "encode") || selected(&op_strs, "length")) {
+        start = now();
+        for (batch = 1; now() - start < seconds; )  {
+            run_encode(s, buf, batch, res);
+            if (batch < BATCH)
+                batch *= 2;
+        }
+    }
+    if (selected(&op_strs, "copy")) {
+        start = now();
+        for (batch = 1; now() - start < seconds; )  {
+            run_copy(s, vals, batch, res);
+            if (batch < BATCH)
+                batch *= 2;
+        }
+    }
+
+    for (o = 0; o < NOPS; o++) {
+        char allocs[32];
+
+        if (res[o].n == 0 || !selected(&op_strs, opnames[o]))
+            continue;
+#ifdef HAVE_ALLOC_COUNT
+        if (o == OP_DECODE || o == OP_COPY)
+            snprintf(allocs, sizeof(allocs), "%.1f",
+                     (double)res[o].allocs / res[o].n);
+        else
+#endif
+            strlcpy(allocs, "-", sizeof(allocs));
+        printf("%-16s %-24.24s %7lu %-7s %10.0f %9s\n",
+               s->type->name, s->label, (unsigned long)s->len, opnames[o],
+               res[o].t * 1e9 / res[o].n, allocs);
+    }
+    fflush(stdout);
+
+    for (i = 0; i < BATCH; i++)
+        free(vals[i]);
+    free(buf);
+}
+
+static void
+usage(int ret)
+{
+    arg_printusage(args, sizeof(args)/sizeof(*args), NULL, "[TYPE:FILE ...]");
+    exit(ret);
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t i;
+    int optidx = 0;
+    char *end;
+
+    setprogname(argv[0]);
+
+    if (getarg(args, sizeof(args) / sizeof(args[0]), argc, argv, &optidx))
+        usage(1);
+    if (help_flag)
+        usage(0);
+    if (version_flag) {
+        print_version(NULL);
+        exit(0);
+    }
+    if (list_flag) {
+        for (i = 0; i < sizeof(types)/sizeof(types[0]); i++)
+            printf("%s\n", types[i].name);
+        exit(0);
+    }
+
+    seconds = strtod(seconds_str, &end);
+    if (*end != '\0' || seconds <= 0)
+        errx(1, "bad --seconds: %s", seconds_str);
+    for (i = 0; i < op_strs.num_strings; i++) {
+        int o;
+
+        for (o = 0; o < NOPS; o++)
+            if (strcmp(op_strs.strings[i], opnames[o]) == 0)
+                break;
+        if (o == NOPS)
+            errx(1, "unknown --op: %s", op_strs.strings[i]);
+    }
+
+    if (builtin_flag)
+        add_builtin_samples();
+    for (i = optidx; i < argc; i++)
+        add_file_sample(argv[i]);
+
+    printf("# %s\n", BACKEND);
+    printf("%-16s %-24s %7s %-7s %10s %9s\n",
+           "type", "sample", "bytes", "op", "ns/op", "allocs/op");
+    for (i = 0; i < nsamples; i++)
+        if (selected(&type_strs, samples[i].type->name))
+            bench_sample(&samples[i]);
+
+    for (i = 0; i < nsamples; i++) {
+        samples[i].type->release(samples[i].value);
+        free(samples[i].value);
+        free(samples[i].der);
+        free(samples[i].label);
+    }
+    free(samples);
+    return 0;
+}
@@ -1577,6 +1577,167 @@ check_fail_Ticket(void)
     return 0;
 }
 
+/*
+ * decode_Ticket_borrowed() must produce the same value as
+ * decode_Ticket(), and free_Ticket_borrowed() must release it without
+ * touching the input buffer (with templates the cipher points into it).
+ */
+
+static int
+test_ticket_borrowed(void)
+{
+    unsigned char cipher[40];
+    unsigned char *buf;
+    size_t len, size, i;
+    Ticket t, t2;
+    int ret;
+
+    for (i = 0; i < sizeof(cipher); i++)
+	cipher[i] = i;
+
+    memset(&t, 0, sizeof(t));
+    t.tkt_vno = 5;
+    t.realm = "SU.SE";
+    t.sname.name_type = KRB5_NT_PRINCIPAL;
+    t.sname.name_string.len = 1;
+    t.sname.name_string.val = lha_principal;
+    t.enc_part.etype = 18;
+    t.enc_part.cipher.data = cipher;
+    t.enc_part.cipher.length = sizeof(cipher);
+
+    ASN1_MALLOC_ENCODE(Ticket, buf, len, &t, &size, ret);
+    if (ret)
+	return 1;
+    if (len != size)
+	abort();
+
+    ret = decode_Ticket_borrowed(buf, len, &t2, &size);
+    if (ret || size != len) {
+	free(buf);
+	return 1;
+    }
+    if (t2.enc_part.cipher.length != sizeof(cipher) ||
+	memcmp(t2.enc_part.cipher.data, cipher, sizeof(cipher)) != 0 ||
+	strcmp(t2.realm, t.realm) != 0 ||
+	t2.sname.name_string.len != 1 ||
+	strcmp(t2.sname.name_string.val[0], lha_principal[0]) != 0)
+	ret = 1;
+    free_Ticket_borrowed(&t2);
+    if (t2.enc_part.cipher.data != NULL)
+	ret = 1;
+
+    /* A truncated input must fail and clean up after itself */
+    if (decode_Ticket_borrowed(buf, len - 1, &t2, &size) == 0)
+	ret = 1;
+    free(buf);
+    return ret;
+}
+
+static int
+test_ticket_arena(void)
+{
+    unsigned char cipher[40];
+    unsigned char *buf;
+    size_t len, size, i;
+    struct asn1_arena *arena;
+    Ticket t, *t2, *t3;
+    int ret;
+
+    for (i = 0; i < sizeof(cipher); i++)
+	cipher[i] = i;
+
+    memset(&t, 0, sizeof(t));
+    t.tkt_vno = 5;
+    t.realm = "SU.SE";
+    t.sname.name_type = KRB5_NT_PRINCIPAL;
+    t.sname.name_string.len = 1;
+    t.sname.name_string.val = lha_principal;
+    t.enc_part.etype = 18;
+    t.enc_part.cipher.data = cipher;
+    t.enc_part.cipher.length = sizeof(cipher);
+
+    ASN1_MALLOC_ENCODE(Ticket, buf, len, &t, &size, ret);
+    if (ret)
+	return 1;
+    if (len != size)
+	abort();
+
+    /* A tiny chunk size forces the arena to grow */
+    if (asn1_arena_create(32, &arena)) {
+	free(buf);
+	return 1;
+    }
+
+    ret = decode_Ticket_arena(buf, len, arena, &t2, &size);
+    if (ret == 0 && size != len)
+	ret = 1;
+    if (ret == 0)
+	ret = copy_Ticket_arena(t2, arena, &t3);
+    for (i = 0; ret == 0 && i < 2; i++) {
+	const Ticket *d = i ? t3 : t2;
+
+	if (d->enc_part.cipher.length != sizeof(cipher) ||
+	    memcmp(d->enc_part.cipher.data, cipher, sizeof(cipher)) != 0 ||
+	    strcmp(d->realm, t.realm) != 0 ||
+	    d->sname.name_string.len != 1 ||
+	    strcmp(d->sname.name_string.val[0], lha_principal[0]) != 0)
+	    ret = 1;
+    }
+
+    /* A truncated input must fail, leaving its debris in the arena */
+    if (ret == 0 && decode_Ticket_arena(buf, len - 1, arena, &t2, &size) == 0)
+	ret = 1;
+    if (ret == 0 && t2 != NULL)
+	ret = 1;
+
+    asn1_arena_destroy(arena);
+    free(buf);
+    return ret;
+}
+
+static int
+test_malloc_encode(void)
+{
+    static const size_t sizes[] = { 0, 100, 4000, 4096, 10000 };
+    unsigned char *cipher, *buf;
+    size_t len, size, i, j;
+    EncryptedData ed, ed2;
+    int ret = 0;
+
+    cipher = malloc(10000);
+    if (cipher == NULL)
+	return 1;
+    for (i = 0; i < 10000; i++)
+	cipher[i] = i;
+
+    /* Sizes on both sides of the scratch buffer in _asn1_malloc_encode() */
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]) && ret == 0; i++) {
+	memset(&ed, 0, sizeof(ed));
+	ed.etype = 18;
+	ed.cipher.data = cipher;
+	ed.cipher.length = sizes[i];
+
+	ASN1_MALLOC_ENCODE(EncryptedData, buf, len, &ed, &size, ret);
+	if (ret)
+	    break;
+	if (len != size || len != length_EncryptedData(&ed))
+	    abort();
+
+	ret = decode_EncryptedData(buf, len, &ed2, &size);
+	if (ret == 0) {
+	    if (size != len || ed2.cipher.length != sizes[i])
+		ret = 1;
+	    for (j = 0; ret == 0 && j < sizes[i]; j++)
+		if (((unsigned char *)ed2.cipher.data)[j] != cipher[j])
+		    ret = 1;
+	    free_EncryptedData(&ed2);
+	}
+	free(buf);
+    }
+    free(cipher);
+    return ret;
+}
+
 static int
 check_seq(void)
 {
@@ -2552,6 +2713,44 @@ test_ios(void)
     free_Certificate(&c1);
     return 0;
 }
+
+static int
+test_lazy_open_types(void)
+{
+    TESTDefault def = { "heimdal", 7, 2147483647, 0 };
+    TESTExtension ext, ext2;
+    unsigned char *buf;
+    size_t len, size;
+    int ret;
+
+    memset(&ext, 0, sizeof(ext));
+    ext.extnID = asn1_oid_id_test_default;
+    ASN1_MALLOC_ENCODE(TESTDefault, ext.extnValue.data, ext.extnValue.length,
+                       &def, &size, ret);
+    if (ret)
+        return 1;
+    ASN1_MALLOC_ENCODE(TESTExtension, buf, len, &ext, &size, ret);
+    free(ext.extnValue.data);
+    if (ret)
+        return 1;
+
+    /* The open type is not decoded until asked for */
+    ret = decode_TESTExtension(buf, len, &ext2, &size);
+    free(buf);
+    if (ret)
+        return 1;
+    if (size != len || ext2._ioschoice_extnValue.element != 0)
+        ret = 1;
+    if (ret == 0 && decode_open_types_TESTExtension(&ext2))
+        ret = 1;
+    if (ret == 0 && ext2._ioschoice_extnValue.element == 0)
+        ret = 1;
+    /* A second call is a no-op */
+    if (ret == 0 && decode_open_types_TESTExtension(&ext2))
+        ret = 1;
+    free_TESTExtension(&ext2);
+    return ret;
+}
 #endif
 
 int
@@ -2584,6 +2783,9 @@ main(int argc, char **argv)
     DO_ONE(check_fail_sequence);
     DO_ONE(check_fail_choice);
     DO_ONE(check_fail_Ticket);
+    DO_ONE(test_ticket_borrowed);
+    DO_ONE(test_ticket_arena);
+    DO_ONE(test_malloc_encode);
 
     DO_ONE(check_seq);
     DO_ONE(check_seq_of_size);
@@ -2601,6 +2803,7 @@ main(int argc, char **argv)
 
 #if ASN1_IOS_SUPPORTED
     DO_ONE(test_ios);
+    DO_ONE(test_lazy_open_types);
 #endif
 
     return ret;
@@ -97,6 +97,9 @@ typedef struct heim_ber_time_t {
 } heim_ber_time_t;
 
 struct asn1_template;
+struct asn1_arena;
+
+typedef void (ASN1CALL *asn1_arena_cleanup_f)(void *);
 
 #include <der-protos.h>
 
@@ -306,6 +306,11 @@ der_put_visible_string (unsigned char *p, size_t len,
     return der_put_general_string(p, len, str, size);
 }
 
+/*
+ * The contents may already be where they go, put there by a caller
+ * that sized the encoding first (see _kdc_encode_reply()).
+ */
+
 int ASN1CALL
 der_put_octet_string (unsigned char *p, size_t len,
 		      const heim_octet_string *data, size_t *size)
@@ -313,7 +318,8 @@ der_put_octet_string (unsigned char *p, size_t len,
     if (len < data->length)
 	return ASN1_OVERFLOW;
     p -= data->length;
-    memcpy (p+1, data->data, data->length);
+    if (p + 1 != (unsigned char *)data->data)
+	memcpy (p+1, data->data, data->length);
     *size = data->length;
     return 0;
 }
@@ -654,3 +660,66 @@ _heim_der_set_sort(const void *a1, const void *a2)
 	return ret;
     return (int)(s1->length - s2->length);
 }
+
+/*
+ * Allocate and encode `data' in one pass.  The encoders write
+ * backwards from the end of the buffer, so we first encode into a
+ * scratch buffer on the stack, which is large enough for most
+ * Kerberos messages, and copy the result into a buffer of the exact
+ * size.  Only when that overflows do we fall back to sizing the
+ * value with the length function and encoding it a second time.
+ *
+ * This is what ASN1_MALLOC_ENCODE() expands to.  The scratch buffer
+ * is cleared afterwards since the value may well hold key material.
+ */
+
+#define MALLOC_ENCODE_SCRATCH 4096
+
+int ASN1CALL
+_asn1_malloc_encode(asn1_malloc_encode_f encode,
+		    asn1_malloc_length_f length,
+		    const void *data, void **buf, size_t *buf_len,
+		    size_t *size)
+{
+    unsigned char scratch[MALLOC_ENCODE_SCRATCH];
+    unsigned char *p;
+    size_t len;
+    int ret;
+
+    *buf = NULL;
+    *buf_len = 0;
+    *size = 0;
+
+    ret = (*encode)(scratch + sizeof(scratch) - 1, sizeof(scratch),
+		    data, &len);
+    if (ret == 0) {
+	p = malloc(len ? len : 1);
+	if (p == NULL) {
+	    memset_s(scratch, sizeof(scratch), 0, sizeof(scratch));
+	    return ENOMEM;
+	}
+	memcpy(p, scratch + sizeof(scratch) - len, len);
+	memset_s(scratch + sizeof(scratch) - len, len, 0, len);
+	*buf = p;
+	*buf_len = *size = len;
+	return 0;
+    }
+    /* The encoders may have left part of the value in the scratch buffer */
+    memset_s(scratch, sizeof(scratch), 0, sizeof(scratch));
+    if (ret != ASN1_OVERFLOW)
+	return ret;
+
+    len = (*length)(data);
+    p = malloc(len ? len : 1);
+    if (p == NULL)
+	return ENOMEM;
+    ret = (*encode)(p + len - 1, len, data, size);
+    if (ret) {
+	free(p);
+	*size = 0;
+	return ret;
+    }
+    *buf = p;
+    *buf_len = len;
+    return 0;
+}
@@ -257,20 +257,14 @@ init_generate (const char *filename, const char *base)
              "};\n\n");
     fputs("#define ASN1_MALLOC_ENCODE(T, B, BL, S, L, R)                  \\\n"
 	  "  do {                                                         \\\n"
-	  "    (BL) = length_##T((S));                                    \\\n"
-	  "    (B) = malloc((BL));                                        \\\n"
-	  "    if((B) == NULL) {                                          \\\n"
-	  "      *(L) = 0;                                                \\\n"
-	  "      (R) = ENOMEM;                                            \\\n"
-	  "    } else {                                                   \\\n"
-	  "      (R) = encode_##T(((unsigned char*)(B)) + (BL) - 1, (BL), \\\n"
-	  "                       (S), (L));                              \\\n"
-	  "      if((R) != 0) {                                           \\\n"
-	  "        free((B));                                             \\\n"
-	  "        (B) = NULL;                                            \\\n"
-	  "        *(L) = 0;                                              \\\n"
-	  "      }                                                        \\\n"
-	  "    }                                                          \\\n"
+	  "    void *asn1_me_b_;                                          \\\n"
+	  "    size_t asn1_me_bl_;                                        \\\n"
+	  "    (void)sizeof(length_##T((S)));                             \\\n"
+	  "    (R) = _asn1_malloc_encode((asn1_malloc_encode_f)encode_##T, \\\n"
+	  "                              (asn1_malloc_length_f)length_##T, \\\n"
+	  "                              (S), &asn1_me_b_, &asn1_me_bl_, (L)); \\\n"
+	  "    (B) = asn1_me_b_;                                          \\\n"
+	  "    (BL) = asn1_me_bl_;                                        \\\n"
 	  "  } while (0)\n\n",
 	  headerfile);
     fputs("#ifdef _WIN32\n"
@@ -283,14 +277,23 @@ init_generate (const char *filename, const char *base)
 	  "#else\n"
 	  "#define ASN1EXP\n"
 	  "#define ASN1CALL\n"
-	  "#endif\n",
+	  "#endif\n\n",
+	  headerfile);
+    fputs("typedef int (ASN1CALL *asn1_malloc_encode_f)(unsigned char *, size_t,\n"
+	  "                                             const void *, size_t *);\n"
+	  "typedef size_t (ASN1CALL *asn1_malloc_length_f)(const void *);\n\n"
+	  "ASN1EXP int ASN1CALL _asn1_malloc_encode(asn1_malloc_encode_f,\n"
+	  "                                         asn1_malloc_length_f,\n"
+	  "                                         const void *, void **,\n"
+	  "                                         size_t *, size_t *);\n\n",
 	  headerfile);
     fputs("#ifndef ENOTSUP\n"
 	  "/* Very old MSVC CRTs lack ENOTSUP */\n"
 	  "#define ENOTSUP EINVAL\n"
 	  "#endif\n",
 	  headerfile);
-    fprintf (headerfile, "struct units;\n\n");
+    fprintf (headerfile, "struct units;\n");
+    fprintf (headerfile, "struct asn1_arena;\n\n");
     fprintf (headerfile, "#endif\n\n");
     if (asprintf(&fn, "%s_files", base) < 0 || fn == NULL)
 	errx(1, "malloc");
@@ -1906,6 +1909,16 @@ generate_type (const Symbol *s)
 	generate_type_length (s);
 	generate_type_copy (s);
         generate_type_print_stub(s);
+    } else if (specialize_type(s->name)) {
+	/*
+	 * Specialized codecs for a hot type; its template is still
+	 * emitted for print_TYPE() and for the types that refer to it.
+	 */
+	generate_type_encode (s);
+	generate_type_decode (s);
+	generate_type_free (s);
+	generate_type_length (s);
+	generate_type_copy (s);
     }
     generate_type_seq (s);
     generate_glue (s->type, s->gen_name);
@@ -1948,6 +1961,39 @@ generate_type (const Symbol *s)
             exp,
             s->gen_name, s->gen_name);
 
+    if (borrow_type(s->name)) {
+        fprintf(h,
+                "%sint    ASN1CALL "
+                "decode_%s_borrowed(const unsigned char *, size_t, %s *, "
+                "size_t *);\n",
+                exp,
+                s->gen_name, s->gen_name);
+        fprintf(h,
+                "%svoid   ASN1CALL free_%s_borrowed(%s *);\n",
+                exp,
+                s->gen_name, s->gen_name);
+    }
+
+    if (arena_type(s->name)) {
+        fprintf(h,
+                "%sint    ASN1CALL "
+                "decode_%s_arena(const unsigned char *, size_t, "
+                "struct asn1_arena *, %s **, size_t *);\n",
+                exp,
+                s->gen_name, s->gen_name);
+        fprintf(h,
+                "%sint    ASN1CALL "
+                "copy_%s_arena(const %s *, struct asn1_arena *, %s **);\n",
+                exp,
+                s->gen_name, s->gen_name, s->gen_name);
+    }
+
+    if (lazy_open_types_type(s->name))
+        fprintf(h,
+                "%sint    ASN1CALL decode_open_types_%s(%s *);\n",
+                exp,
+                s->gen_name, s->gen_name);
+
     fprintf(h, "\n\n");
 
     if (!one_code_file) {
@@ -289,5 +289,29 @@ generate_type_copy (const Symbol *s)
   fprintf(codefile,
 	  "}\n\n");
   used_fail = save_used_fail;
+
+  /*
+   * Without templates an arena copy is an ordinary one into the arena,
+   * released by a cleanup.  With them (--specialize) it comes from the
+   * template backend.
+   */
+  if (!template_flag && arena_type(s->name))
+      fprintf (codefile, "int ASN1CALL\n"
+	       "copy_%s_arena(const %s *from, struct asn1_arena *arena,"
+	       " %s **to)\n"
+	       "{\n"
+	       "%s *d;\n"
+	       "int e;\n"
+	       "*to = NULL;\n"
+	       "if ((d = asn1_arena_alloc(arena, sizeof(*d))) == NULL)\n"
+	       "return ENOMEM;\n"
+	       "e = asn1_arena_add_cleanup(arena, "
+	       "(asn1_arena_cleanup_f)free_%s, d);\n"
+	       "if (e == 0) e = copy_%s(from, d);\n"
+	       "if (e == 0) *to = d;\n"
+	       "return e;\n"
+	       "}\n\n",
+	       s->gen_name, s->gen_name, s->gen_name, s->gen_name,
+	       s->gen_name, s->gen_name);
 }
 
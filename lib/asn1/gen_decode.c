@@ -838,4 +838,53 @@ generate_type_decode (const Symbol *s)
 	abort ();
     }
     fprintf (codefile, "}\n\n");
+
+    /*
+     * The variants below come from the template backend when there is
+     * one (--specialize).
+     */
+    if (template_flag)
+	return;
+
+    /* Without templates a borrowed decode is an ordinary one */
+    if (borrow_type(s->name))
+	fprintf (codefile, "int ASN1CALL\n"
+		 "decode_%s_borrowed(const unsigned char *p, size_t len,"
+		 " %s *data, size_t *size)\n"
+		 "{\n"
+		 "return decode_%s(p, len, data, size);\n"
+		 "}\n\n",
+		 s->gen_name, s->gen_name, s->gen_name);
+
+    /* Without templates open types are never decoded */
+    if (lazy_open_types_type(s->name))
+	fprintf (codefile, "int ASN1CALL\n"
+		 "decode_open_types_%s(%s *data)\n"
+		 "{\n"
+		 "return 0;\n"
+		 "}\n\n",
+		 s->gen_name, s->gen_name);
+
+    /*
+     * Without templates an arena decode is an ordinary one into the
+     * arena, released by a cleanup.
+     */
+    if (arena_type(s->name))
+	fprintf (codefile, "int ASN1CALL\n"
+		 "decode_%s_arena(const unsigned char *p, size_t len,"
+		 " struct asn1_arena *arena, %s **data, size_t *size)\n"
+		 "{\n"
+		 "%s *d;\n"
+		 "int e;\n"
+		 "*data = NULL;\n"
+		 "if ((d = asn1_arena_alloc(arena, sizeof(*d))) == NULL)\n"
+		 "return ENOMEM;\n"
+		 "e = asn1_arena_add_cleanup(arena, "
+		 "(asn1_arena_cleanup_f)free_%s, d);\n"
+		 "if (e == 0) e = decode_%s(p, len, d, size);\n"
+		 "if (e == 0) *data = d;\n"
+		 "return e;\n"
+		 "}\n\n",
+		 s->gen_name, s->gen_name, s->gen_name, s->gen_name,
+		 s->gen_name);
 }
@@ -190,7 +190,7 @@ generate_type_free (const Symbol *s)
     free_type ("data", s->type, preserve);
     while (decorate_type(s->gen_name, &deco, &more_deco)) {
         if (deco.heim_object) {
-            fprintf(codefile, "heim_retain((data)->%s);\n", deco.field_name);
+            fprintf(codefile, "heim_release((data)->%s);\n", deco.field_name);
             fprintf(codefile, "(data)->%s = 0;\n", deco.field_name);
         } else if (deco.ext && deco.free_function_name == NULL) {
             /* Decorated with field of external type but no free function */
@@ -231,5 +231,14 @@ generate_type_free (const Symbol *s)
         free(deco.field_type);
     }
     fprintf (codefile, "}\n\n");
+
+    /* Without templates a borrowed decode is an ordinary one */
+    if (borrow_type(s->name))
+	fprintf (codefile, "void ASN1CALL\n"
+		 "free_%s_borrowed(%s *data)\n"
+		 "{\n"
+		 "free_%s(data);\n"
+		 "}\n\n",
+		 s->gen_name, s->gen_name, s->gen_name);
 }
 
@@ -144,6 +144,10 @@ int is_tagged_type(const Type *);
 
 int preserve_type(const char *);
 int seq_type(const char *);
+int borrow_type(const char *);
+int arena_type(const char *);
+int lazy_open_types_type(const char *);
+int specialize_type(const char *);
 
 struct decoration {
     char *field_type;           /* C type name */
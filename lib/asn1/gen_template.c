@@ -547,6 +547,48 @@ compact_tag(const Type *t)
     return t;
 }
 
+/*
+ * Find the outer tag of a CHOICE alternative, chasing type references.
+ * Returns 0 if the tag can't be known at compile time (untagged CHOICE,
+ * imported type, open type, ...).
+ */
+static int
+choice_alt_tag(const Type *t, int *tagclass, int *tagvalue)
+{
+    while (t && t->type == TType) {
+        if (t->subtype)
+            t = t->subtype;
+        else if (t->symbol && t->symbol->type)
+            t = t->symbol->type;
+        else
+            return 0;
+    }
+    if (t == NULL || t->type != TTag)
+        return 0;
+    *tagclass = t->tag.tagclass;
+    *tagvalue = t->tag.tagvalue;
+    return 1;
+}
+
+struct choice_tag {
+    int tagclass;
+    int tagvalue;
+    size_t alt;
+};
+
+static int
+choice_tag_cmp(const void *a, const void *b)
+{
+    const struct choice_tag *ta = a;
+    const struct choice_tag *tb = b;
+
+    if (ta->tagclass != tb->tagclass)
+        return ta->tagclass < tb->tagclass ? -1 : 1;
+    if (ta->tagvalue != tb->tagvalue)
+        return ta->tagvalue < tb->tagvalue ? -1 : 1;
+    return 0;
+}
+
 static void
 defval(struct templatehead *temp, Member *m)
 {
@@ -829,6 +871,12 @@ template_object_set(IOSObjectSet *os, Field *typeidfield, Field *opentypefield)
     os->symbol->emitted_template = 1;
 }
 
+/*
+ * C type name of the type being generated if its open types are to be
+ * decoded lazily (--lazy-open-types), else NULL.
+ */
+static const char *lazy_open_types_basetype;
+
 static void
 template_open_type(struct templatehead *temp,
                    const char *basetype,
@@ -855,8 +903,11 @@ template_open_type(struct templatehead *temp,
                       * We always sort object sets for now as we can't import
                       * values yet, so they must all be known.
                       */
-                     "A1_OP_OPENTYPE_OBJSET | A1_OS_IS_SORTED |%s | (%llu << 10) | %llu",
+                     "A1_OP_OPENTYPE_OBJSET | A1_OS_IS_SORTED |%s%s | (%llu << 10) | %llu",
                      is_array_of_open_type ? "A1_OS_OT_IS_ARRAY" : "0",
+                     lazy_open_types_basetype &&
+                     strcmp(basetype, lazy_open_types_basetype) == 0 ?
+                        " | A1_OS_LAZY" : "",
                      (unsigned long long)opentypeidx,
                      (unsigned long long)typeididx);
     free(s);
@@ -1319,9 +1370,45 @@ template_members(struct templatehead *temp,
 	int ellipsis = 0;
 	char *e;
 	static unsigned long choice_counter = 0;
+	struct choice_tag *tags = NULL;
+	size_t ntags = 0, nalts = 0;
+	int tag_index = 1;
 
 	HEIM_TAILQ_INIT(&template);
 
+	/*
+	 * Collect the outer tag of every alternative so that the decoder can
+	 * dispatch on the tag at hand with a binary search instead of trying
+	 * each alternative in turn.  If any tag is unknown or ambiguous we
+	 * emit no index and the decoder falls back to trying them all.
+	 */
+	HEIM_TAILQ_FOREACH(m, t->members, members) {
+	    if (!m->ellipsis)
+		nalts++;
+	}
+	if (nalts && (tags = calloc(nalts, sizeof(tags[0]))) == NULL)
+	    errx(1, "malloc");
+	HEIM_TAILQ_FOREACH(m, t->members, members) {
+	    if (m->ellipsis)
+		continue;
+	    if (!choice_alt_tag(m->type, &tags[ntags].tagclass,
+				&tags[ntags].tagvalue)) {
+		tag_index = 0;
+		break;
+	    }
+	    tags[ntags].alt = ntags + 1;
+	    ntags++;
+	}
+	if (tag_index && ntags) {
+	    qsort(tags, ntags, sizeof(tags[0]), choice_tag_cmp);
+	    for (i = 1; i < ntags; i++) {
+		if (choice_tag_cmp(&tags[i - 1], &tags[i]) == 0)
+		    tag_index = 0;
+	    }
+	} else {
+	    tag_index = 0;
+	}
+
 	if (asprintf(&tname, "asn1_choice_%s_%s%lu",
 		     basetype, name ? name : "", choice_counter++) < 0 || tname == NULL)
 	    errx(1, "malloc");
@@ -1385,12 +1472,29 @@ template_members(struct templatehead *temp,
 	i = 1;
 	HEIM_TAILQ_FOREACH(q, &template, members) {
 	    int last = (HEIM_TAILQ_LAST(&template, templatehead) == q);
-	    fprintf(f, "/* %lu */ %s%s\n", (unsigned long)i++, q->line, last ? "" : ",");
+	    fprintf(f, "/* %lu */ %s%s\n", (unsigned long)i++, q->line,
+		    last && !tag_index ? "" : ",");
+	}
+	if (tag_index) {
+	    size_t k;
+
+	    /* Tag index, not included in the header's count */
+	    fprintf(f, "/* %lu */ { 0, 0, ((void *)(uintptr_t)%lu) },\n",
+		    (unsigned long)i++, (unsigned long)ntags);
+	    for (k = 0; k < ntags; k++)
+		fprintf(f, "/* %lu */ { A1_TAG_T(%s,PRIM,%s), %lu, NULL }%s\n",
+			(unsigned long)i++,
+			classname(tags[k].tagclass),
+			valuename(tags[k].tagclass, tags[k].tagvalue),
+			(unsigned long)tags[k].alt,
+			k + 1 < ntags ? "," : "");
 	}
 	fprintf(f, "};\n");
 
-	add_line(temp, "{ A1_OP_CHOICE, %s, %s }", poffset, tname);
+	add_line(temp, "{ A1_OP_CHOICE%s, %s, %s }",
+		 tag_index ? "|A1_CF_TAG_INDEX" : "", poffset, tname);
 
+	free(tags);
 	free(e);
 	free(tname);
 	break;
@@ -1530,6 +1634,7 @@ generate_template(const Symbol *s)
     const char *dupname;
     struct decoration deco;
     ssize_t more_deco = -1;
+    int specialized = specialize_type(s->name);
 
     if (use_extern(s)) {
 	gen_extern_stubs(f, s->gen_name);
@@ -1562,72 +1667,141 @@ generate_template(const Symbol *s)
         free(deco.field_type);
     }
 
+    lazy_open_types_basetype =
+        lazy_open_types_type(s->name) ? s->gen_name : NULL;
     generate_template_type(s->gen_name, &dupname, s->name, s->gen_name, NULL, s->type, 0, 0, 1);
-
-    fprintf(f,
-	    "\n"
-	    "int ASN1CALL\n"
-	    "decode_%s(const unsigned char *p, size_t len, %s *data, size_t *size)\n"
-	    "{\n"
-	    "    return _asn1_decode_top(asn1_%s, 0|%s, p, len, data, size);\n"
-	    "}\n"
-	    "\n",
-	    s->gen_name,
-	    s->gen_name,
-	    dupname,
-	    support_ber ? "A1_PF_ALLOW_BER" : "0");
-
-    fprintf(f,
-	    "\n"
-	    "int ASN1CALL\n"
-	    "encode_%s(unsigned char *p, size_t len, const %s *data, size_t *size)\n"
-	    "{\n"
-	    "    return _asn1_encode%s(asn1_%s, p, len, data, size);\n"
-	    "}\n"
-	    "\n",
-	    s->gen_name,
-	    s->gen_name,
-	    fuzzer_string,
-	    dupname);
-
-    fprintf(f,
-	    "\n"
-	    "size_t ASN1CALL\n"
-	    "length_%s(const %s *data)\n"
-	    "{\n"
-	    "    return _asn1_length%s(asn1_%s, data);\n"
-	    "}\n"
-	    "\n",
-	    s->gen_name,
-	    s->gen_name,
-	    fuzzer_string,
-	    dupname);
-
-
-    fprintf(f,
-	    "\n"
-	    "void ASN1CALL\n"
-	    "free_%s(%s *data)\n"
-	    "{\n"
-	    "    _asn1_free_top(asn1_%s, data);\n"
-	    "}\n"
-	    "\n",
-	    s->gen_name,
-	    s->gen_name,
-	    dupname);
-
-    fprintf(f,
-	    "\n"
-	    "int ASN1CALL\n"
-	    "copy_%s(const %s *from, %s *to)\n"
-	    "{\n"
-	    "    return _asn1_copy_top(asn1_%s, from, to);\n"
-	    "}\n"
-	    "\n",
-	    s->gen_name,
-	    s->gen_name,
-	    s->gen_name,
-	    dupname);
+    lazy_open_types_basetype = NULL;
+
+    /* With --specialize gen_decode.c and friends provide these */
+    if (!specialized)
+	fprintf(f,
+		"\n"
+		"int ASN1CALL\n"
+		"decode_%s(const unsigned char *p, size_t len, %s *data, size_t *size)\n"
+		"{\n"
+		"    return _asn1_decode_top(asn1_%s, 0|%s, p, len, data, size);\n"
+		"}\n"
+		"\n",
+		s->gen_name,
+		s->gen_name,
+		dupname,
+		support_ber ? "A1_PF_ALLOW_BER" : "0");
+
+    if (borrow_type(s->name))
+        fprintf(f,
+                "\n"
+                "int ASN1CALL\n"
+                "decode_%s_borrowed(const unsigned char *p, size_t len, %s *data, size_t *size)\n"
+                "{\n"
+                "    return _asn1_decode_top(asn1_%s, A1_PF_BORROW|%s, p, len, data, size);\n"
+                "}\n"
+                "\n"
+                "\n"
+                "void ASN1CALL\n"
+                "free_%s_borrowed(%s *data)\n"
+                "{\n"
+                "    _asn1_free_borrowed_top(asn1_%s, data);\n"
+                "}\n"
+                "\n",
+                s->gen_name,
+                s->gen_name,
+                dupname,
+                support_ber ? "A1_PF_ALLOW_BER" : "0",
+                s->gen_name,
+                s->gen_name,
+                dupname);
+
+    if (lazy_open_types_type(s->name))
+        fprintf(f,
+                "\n"
+                "int ASN1CALL\n"
+                "decode_open_types_%s(%s *data)\n"
+                "{\n"
+                "    return _asn1_decode_open_types(asn1_%s, data);\n"
+                "}\n"
+                "\n",
+                s->gen_name,
+                s->gen_name,
+                dupname);
+
+    if (arena_type(s->name))
+        fprintf(f,
+                "\n"
+                "int ASN1CALL\n"
+                "decode_%s_arena(const unsigned char *p, size_t len, struct asn1_arena *arena, %s **data, size_t *size)\n"
+                "{\n"
+                "    return _asn1_decode_top_arena(asn1_%s, %s, arena, p, len, (void **)data, size);\n"
+                "}\n"
+                "\n"
+                "\n"
+                "int ASN1CALL\n"
+                "copy_%s_arena(const %s *from, struct asn1_arena *arena, %s **to)\n"
+                "{\n"
+                "    return _asn1_copy_top_arena(asn1_%s, from, arena, (void **)to);\n"
+                "}\n"
+                "\n",
+                s->gen_name,
+                s->gen_name,
+                dupname,
+                support_ber ? "A1_PF_ALLOW_BER" : "0",
+                s->gen_name,
+                s->gen_name,
+                s->gen_name,
+                dupname);
+
+    if (!specialized) {
+	fprintf(f,
+		"\n"
+		"int ASN1CALL\n"
+		"encode_%s(unsigned char *p, size_t len, const %s *data, size_t *size)\n"
+		"{\n"
+		"    return _asn1_encode%s(asn1_%s, p, len, data, size);\n"
+		"}\n"
+		"\n",
+		s->gen_name,
+		s->gen_name,
+		fuzzer_string,
+		dupname);
+
+	fprintf(f,
+		"\n"
+		"size_t ASN1CALL\n"
+		"length_%s(const %s *data)\n"
+		"{\n"
+		"    return _asn1_length%s(asn1_%s, data);\n"
+		"}\n"
+		"\n",
+		s->gen_name,
+		s->gen_name,
+		fuzzer_string,
+		dupname);
+
+
+	fprintf(f,
+		"\n"
+		"void ASN1CALL\n"
+		"free_%s(%s *data)\n"
+		"{\n"
+		"    _asn1_free_top(asn1_%s, data);\n"
+		"}\n"
+		"\n",
+		s->gen_name,
+		s->gen_name,
+		dupname);
+
+	fprintf(f,
+		"\n"
+		"int ASN1CALL\n"
+		"copy_%s(const %s *from, %s *to)\n"
+		"{\n"
+		"    return _asn1_copy_top(asn1_%s, from, to);\n"
+		"}\n"
+		"\n",
+		s->gen_name,
+		s->gen_name,
+		s->gen_name,
+		dupname);
+    }
 
     fprintf(f,
 	    "\n"
@@ -39,6 +39,10 @@ extern FILE *yyin;
 
 static getarg_strings preserve;
 static getarg_strings seq;
+static getarg_strings borrow;
+static getarg_strings arena;
+static getarg_strings lazy_open_types;
+static getarg_strings specialize;
 static getarg_strings decorate;
 
 static int
@@ -140,6 +144,30 @@ seq_type(const char *p)
     return bsearch_strings(&seq, p, '\0', 0) > -1;
 }
 
+int
+borrow_type(const char *p)
+{
+    return bsearch_strings(&borrow, p, '\0', 0) > -1;
+}
+
+int
+arena_type(const char *p)
+{
+    return bsearch_strings(&arena, p, '\0', 0) > -1;
+}
+
+int
+lazy_open_types_type(const char *p)
+{
+    return bsearch_strings(&lazy_open_types, p, '\0', 0) > -1;
+}
+
+int
+specialize_type(const char *p)
+{
+    return bsearch_strings(&specialize, p, '\0', 0) > -1;
+}
+
 /*
  * Split `s' on `sep' and fill fs[] with pointers to the substrings.
  *
@@ -288,6 +316,22 @@ struct getargs args[] = {
             "verification)", "TYPE" },
     { "sequence", 0, arg_strings, &seq,
         "Generate add/remove functions for SEQUENCE OF types", "TYPE" },
+    { "borrow-octet-strings", 0, arg_strings, &borrow,
+        "Names of types for which to generate decode_TYPE_borrowed() and "
+            "free_TYPE_borrowed(), whose OCTET STRING values point into the "
+            "decoded buffer instead of being copied (template backend only; "
+            "otherwise they copy)", "TYPE" },
+    { "arena", 0, arg_strings, &arena,
+        "Names of types for which to generate decode_TYPE_arena() and "
+            "copy_TYPE_arena(), which allocate the whole value from a "
+            "struct asn1_arena", "TYPE" },
+    { "lazy-open-types", 0, arg_strings, &lazy_open_types,
+        "Names of types whose open types are not decoded by decode_TYPE() "
+            "but by decode_open_types_TYPE(), on first access", "TYPE" },
+    { "specialize", 0, arg_strings, &specialize,
+        "Names of types for which to generate specialized (non-template) "
+            "encode, decode, length, free and copy functions even with "
+            "--template", "TYPE" },
     { "decorate", 0, arg_strings, &decorate,
         "Generate private field for SEQUENCE/SET type", "DECORATION" },
     { "one-code-file", 0, arg_flag, &one_code_file, NULL, NULL },
@@ -458,6 +502,19 @@ main(int argc, char **argv)
     if (seq.num_strings)
         mergesort_r(seq.strings, seq.num_strings, sizeof(seq.strings),
                     strcmp4mergesort_r, "");
+    if (borrow.num_strings)
+        mergesort_r(borrow.strings, borrow.num_strings,
+                    sizeof(borrow.strings[0]), strcmp4mergesort_r, "");
+    if (arena.num_strings)
+        mergesort_r(arena.strings, arena.num_strings,
+                    sizeof(arena.strings[0]), strcmp4mergesort_r, "");
+    if (lazy_open_types.num_strings)
+        mergesort_r(lazy_open_types.strings, lazy_open_types.num_strings,
+                    sizeof(lazy_open_types.strings[0]), strcmp4mergesort_r,
+                    "");
+    if (specialize.num_strings)
+        mergesort_r(specialize.strings, specialize.num_strings,
+                    sizeof(specialize.strings[0]), strcmp4mergesort_r, "");
     if (decorate.num_strings)
         mergesort_r(decorate.strings, decorate.num_strings,
                     sizeof(decorate.strings[0]), strcmp4mergesort_r, ":");
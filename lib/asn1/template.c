@@ -39,6 +39,8 @@
 #include <vis-extras.h>
 #include <heimbase.h>
 
+static void _asn1_free_flags(const struct asn1_template *, unsigned, void *);
+
 #ifndef ENOTSUP
 /* Very old MSVC CRTs don't have ENOTSUP */
 #define ENOTSUP EINVAL
@@ -98,6 +100,388 @@ _asn1_sizeofType(const struct asn1_template *t)
     return t->offset;
 }
 
+/*
+ * Arenas.  A value decoded or copied with _asn1_decode_top_arena() or
+ * _asn1_copy_top_arena() lives, with everything it points to, in
+ * memory carved out of a few large chunks, and is released all at once
+ * by asn1_arena_destroy() instead of by walking it with free_<TYPE>().
+ *
+ * Values of types from other modules (A1_OP_TYPE_EXTERN) and
+ * decorations are still allocated by their own functions; they are
+ * decoded into a separate box in the arena and the box is released
+ * by a cleanup registered with asn1_arena_add_cleanup().
+ */
+
+#define ARENA_ALIGN		16
+#define ARENA_CHUNK		4096
+
+#define ARENA_ROUND(n) \
+    (((n) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+
+struct asn1_arena_chunk {
+    struct asn1_arena_chunk *next;
+};
+
+struct asn1_arena_cleanup {
+    struct asn1_arena_cleanup *next;
+    asn1_arena_cleanup_f f;
+    void *ptr;
+};
+
+struct asn1_arena {
+    struct asn1_arena_chunk *chunks;
+    struct asn1_arena_cleanup *cleanups;
+    unsigned char *ptr;
+    size_t avail;
+    size_t chunk_size;
+    size_t size;		/* all malloc()ed, for memory accounting */
+};
+
+/**
+ * Create an arena for use with the decode_TYPE_arena() and
+ * copy_TYPE_arena() functions.  `chunk_size' is the size of the
+ * blocks memory is allocated in, zero picks a default; the first block
+ * is allocated along with the arena.
+ */
+
+int ASN1CALL
+asn1_arena_create(size_t chunk_size, struct asn1_arena **arenap)
+{
+    struct asn1_arena *arena;
+    size_t hdr = ARENA_ROUND(sizeof(*arena));
+
+    *arenap = NULL;
+    if (chunk_size == 0)
+	chunk_size = ARENA_CHUNK;
+    chunk_size = ARENA_ROUND(chunk_size);
+    if (chunk_size == 0 || chunk_size > SIZE_MAX - hdr)
+	return ERANGE;
+
+    arena = malloc(hdr + chunk_size);
+    if (arena == NULL)
+	return ENOMEM;
+    arena->chunks = NULL;
+    arena->cleanups = NULL;
+    arena->ptr = (unsigned char *)arena + hdr;
+    arena->avail = chunk_size;
+    arena->chunk_size = chunk_size;
+    arena->size = hdr + chunk_size;
+    heim_mem_account(HEIM_MEM_ASN1, arena->size, 1);
+    *arenap = arena;
+    return 0;
+}
+
+/**
+ * Allocate `len' zeroed bytes from `arena'.  The memory is released by
+ * asn1_arena_destroy().
+ */
+
+void * ASN1CALL
+asn1_arena_alloc(struct asn1_arena *arena, size_t len)
+{
+    void *p;
+
+    if (len > SIZE_MAX - ARENA_ALIGN)
+	return NULL;
+    len = ARENA_ROUND(len);
+    if (len > arena->avail) {
+	size_t hdr = ARENA_ROUND(sizeof(struct asn1_arena_chunk));
+	size_t size = len > arena->chunk_size ? len : arena->chunk_size;
+	struct asn1_arena_chunk *c;
+
+	if (size > SIZE_MAX - hdr)
+	    return NULL;
+	c = malloc(hdr + size);
+	if (c == NULL)
+	    return NULL;
+	c->next = arena->chunks;
+	arena->chunks = c;
+	arena->size += hdr + size;
+	heim_mem_account(HEIM_MEM_ASN1, hdr + size, 0);
+	arena->ptr = (unsigned char *)c + hdr;
+	arena->avail = size;
+    }
+    p = arena->ptr;
+    arena->ptr += len;
+    arena->avail -= len;
+    memset(p, 0, len);
+    return p;
+}
+
+/**
+ * Arrange for `f(ptr)' to be called when `arena' is destroyed.
+ * Cleanups run in the reverse order of their registration.
+ */
+
+int ASN1CALL
+asn1_arena_add_cleanup(struct asn1_arena *arena, asn1_arena_cleanup_f f,
+		       void *ptr)
+{
+    struct asn1_arena_cleanup *c;
+
+    c = asn1_arena_alloc(arena, sizeof(*c));
+    if (c == NULL)
+	return ENOMEM;
+    c->f = f;
+    c->ptr = ptr;
+    c->next = arena->cleanups;
+    arena->cleanups = c;
+    return 0;
+}
+
+/**
+ * Run the cleanups of `arena' and release all memory allocated from
+ * it, including every value decoded or copied into it.
+ */
+
+void ASN1CALL
+asn1_arena_destroy(struct asn1_arena *arena)
+{
+    struct asn1_arena_cleanup *cl;
+    struct asn1_arena_chunk *c;
+
+    if (arena == NULL)
+	return;
+    for (cl = arena->cleanups; cl != NULL; cl = cl->next)
+	(cl->f)(cl->ptr);
+    while ((c = arena->chunks) != NULL) {
+	arena->chunks = c->next;
+	free(c);
+    }
+    heim_mem_account(HEIM_MEM_ASN1, -(int64_t)arena->size, -1);
+    free(arena);
+}
+
+static void *
+a1_calloc(struct asn1_arena *arena, size_t nmemb, size_t size)
+{
+    if (arena == NULL)
+	return calloc(nmemb, size);
+    if (size && nmemb > SIZE_MAX / size)
+	return NULL;
+    return asn1_arena_alloc(arena, nmemb * size);
+}
+
+static void
+a1_free(struct asn1_arena *arena, void *ptr)
+{
+    if (arena == NULL)
+	free(ptr);
+}
+
+static void ASN1CALL
+a1_heim_release(void *ptr)
+{
+    heim_release(*(heim_object_t *)ptr);
+}
+
+/*
+ * Allocate a box for a value that will be filled in by functions that
+ * do their own allocation, released with `release' on arena destroy.
+ */
+static void *
+a1_box(struct asn1_arena *arena, asn1_type_release release, size_t size)
+{
+    void *box;
+
+    if ((box = asn1_arena_alloc(arena, size)) == NULL)
+	return NULL;
+    if (asn1_arena_add_cleanup(arena, release, box))
+	return NULL;
+    return box;
+}
+
+static void *
+a1_dup(struct asn1_arena *arena, const void *ptr, size_t len, size_t extra)
+{
+    unsigned char *p;
+
+    if (len > SIZE_MAX - extra ||
+	(p = asn1_arena_alloc(arena, len + extra)) == NULL)
+	return NULL;
+    if (len)
+	memcpy(p, ptr, len);
+    return p;
+}
+
+/*
+ * Copy a primitive value into `arena'.  For the types that point to
+ * allocated memory, that memory is duplicated in the arena.
+ */
+static int
+a1_prim_copy(struct asn1_arena *arena, unsigned int type,
+	     const void *from, void *to)
+{
+    memcpy(to, from, asn1_template_prim[type].size);
+
+    switch (type) {
+    case A1T_HEIM_INTEGER: {
+	heim_integer *i = to;
+
+	if ((i->data = a1_dup(arena, i->data, i->length, 0)) == NULL)
+	    goto enomem;
+	break;
+    }
+    case A1T_GENERAL_STRING:
+    case A1T_VISIBLE_STRING:
+    case A1T_UTF8_STRING:
+    case A1T_TELETEX_STRING: {
+	char **s = to;
+
+	if (*s && (*s = a1_dup(arena, *s, strlen(*s) + 1, 0)) == NULL)
+	    goto enomem;
+	break;
+    }
+    case A1T_OCTET_STRING:
+    case A1T_OCTET_STRING_BER: {
+	heim_octet_string *os = to;
+
+	if ((os->data = a1_dup(arena, os->data, os->length, 0)) == NULL)
+	    goto enomem;
+	break;
+    }
+    case A1T_IA5_STRING:
+    case A1T_PRINTABLE_STRING: {
+	heim_printable_string *ps = to;
+
+	/* NUL terminated, as by der_copy_printable_string() */
+	if ((ps->data = a1_dup(arena, ps->data, ps->length, 1)) == NULL)
+	    goto enomem;
+	break;
+    }
+    case A1T_BMP_STRING: {
+	heim_bmp_string *bs = to;
+
+	if ((bs->data = a1_dup(arena, bs->data,
+			       bs->length * sizeof(bs->data[0]), 0)) == NULL)
+	    goto enomem;
+	break;
+    }
+    case A1T_UNIVERSAL_STRING: {
+	heim_universal_string *us = to;
+
+	if ((us->data = a1_dup(arena, us->data,
+			       us->length * sizeof(us->data[0]), 0)) == NULL)
+	    goto enomem;
+	break;
+    }
+    case A1T_HEIM_BIT_STRING: {
+	heim_bit_string *bs = to;
+
+	if ((bs->data = a1_dup(arena, bs->data,
+			       (bs->length + 7) / 8, 0)) == NULL)
+	    goto enomem;
+	break;
+    }
+    case A1T_OID: {
+	heim_oid *oid = to;
+
+	if ((oid->components =
+	     a1_dup(arena, oid->components,
+		    oid->length * sizeof(oid->components[0]), 0)) == NULL)
+	    goto enomem;
+	break;
+    }
+    default:
+	break;
+    }
+    return 0;
+
+enomem:
+    memset(to, 0, asn1_template_prim[type].size);
+    return ENOMEM;
+}
+
+/*
+ * Decode a primitive value into `arena'.  Strings are decoded straight
+ * into the arena; the rarer types that need more work are decoded as
+ * usual and then moved.
+ */
+static int
+a1_prim_decode(struct asn1_arena *arena, unsigned int type,
+	       const unsigned char *p, size_t len, void *el, size_t *size)
+{
+    union {
+	heim_integer i;
+	heim_octet_string os;
+	heim_bmp_string bmp;
+	heim_universal_string us;
+	heim_bit_string bs;
+	heim_oid oid;
+    } tmp;
+    int ret;
+
+    switch (type) {
+    case A1T_GENERAL_STRING:
+    case A1T_VISIBLE_STRING:
+    case A1T_UTF8_STRING:
+    case A1T_TELETEX_STRING: {
+	const unsigned char *p1 = memchr(p, 0, len);
+	char **s = el;
+
+	/* As in der_get_general_string(), allow trailing NULs only */
+	if (p1 != NULL) {
+	    while ((size_t)(p1 - p) < len && *p1 == '\0')
+		p1++;
+	    if ((size_t)(p1 - p) != len)
+		return ASN1_BAD_CHARACTER;
+	}
+	if ((*s = a1_dup(arena, p, len, 1)) == NULL)
+	    return len == SIZE_MAX ? ASN1_BAD_LENGTH : ENOMEM;
+	*size = len;
+	return 0;
+    }
+    case A1T_OCTET_STRING:
+    case A1T_IA5_STRING:
+    case A1T_PRINTABLE_STRING: {
+	heim_octet_string *os = el;
+
+	if ((os->data = a1_dup(arena, p, len, 1)) == NULL)
+	    return len == SIZE_MAX ? ASN1_BAD_LENGTH : ENOMEM;
+	os->length = len;
+	*size = len;
+	return 0;
+    }
+    case A1T_HEIM_INTEGER:
+    case A1T_OCTET_STRING_BER:
+    case A1T_BMP_STRING:
+    case A1T_UNIVERSAL_STRING:
+    case A1T_HEIM_BIT_STRING:
+    case A1T_OID:
+	memset(&tmp, 0, sizeof(tmp));
+	ret = (asn1_template_prim[type].decode)(p, len, &tmp, size);
+	if (ret == 0)
+	    ret = a1_prim_copy(arena, type, &tmp, el);
+	(asn1_template_prim[type].release)(&tmp);
+	return ret;
+    default:
+	return (asn1_template_prim[type].decode)(p, len, el, size);
+    }
+}
+
+/*
+ * Decode a value of a type from another module.  In an arena it goes
+ * into a box that is released when the arena is destroyed, and `el'
+ * gets a shallow copy, so that `el' can later be cleared or reused
+ * without leaking or double-releasing anything.
+ */
+static int
+a1_decode_extern(const struct asn1_type_func *f, struct asn1_arena *arena,
+		 const unsigned char *p, size_t len, void *el, size_t *size)
+{
+    void *box;
+    int ret;
+
+    if (arena == NULL)
+	return (f->decode)(p, len, el, size);
+    if ((box = a1_box(arena, f->release, f->size)) == NULL)
+	return ENOMEM;
+    ret = (f->decode)(p, len, box, size);
+    if (ret == 0)
+	memcpy(el, box, f->size);
+    return ret;
+}
+
 /*
  * Here is abstraction to not so well evil fact of bit fields in C,
  * they are endian dependent, so when getting and setting bits in the
@@ -250,6 +634,41 @@ typeid_int_cmp(const void *intp,
     }
 }
 
+/*
+ * Find the CHOICE alternative whose outer tag matches the tag at `p' using
+ * the compiler-generated tag index (see A1_CF_TAG_INDEX).  Returns the
+ * alternative's template index, or 0 if no alternative has that tag.
+ */
+static unsigned int
+choice4tag(const struct asn1_template *choice,
+           const unsigned char *p, size_t len)
+{
+    const struct asn1_template *idx = &choice[A1_HEADER_LEN(choice) + 1];
+    size_t lo = 0, hi = A1_HEADER_LEN(idx);
+    unsigned int tag;
+    Der_class class;
+    Der_type type;
+    size_t l;
+
+    if (der_get_tag(p, len, &class, &type, &tag, &l))
+        return 0;
+
+    idx++;
+    while (lo < hi) {
+        size_t mid = lo + ((hi - lo) >> 1);
+        unsigned int mclass = A1_TAG_CLASS(idx[mid].tt);
+        unsigned int mtag = A1_TAG_TAG(idx[mid].tt);
+
+        if (class < mclass || (class == mclass && tag < mtag))
+            hi = mid;
+        else if (class > mclass || tag > mtag)
+            lo = mid + 1;
+        else
+            return idx[mid].offset;
+    }
+    return 0;
+}
+
 /*
  * Map a logical SET/SEQUENCE member to a template entry.
  *
@@ -360,9 +779,14 @@ template4member(const struct asn1_template *t, size_t f)
  *          } _ioschoice_values;
  *      } AttributeSet;
  */
+static int _asn1_decode_arena(const struct asn1_template *, unsigned,
+                              struct asn1_arena *, const unsigned char *,
+                              size_t, void *, size_t *);
+
 static int
 _asn1_decode_open_type(const struct asn1_template *t,
                        unsigned flags,
+                       struct asn1_arena *arena,
                        void *data,
                        const struct asn1_template *ttypeid,
                        const struct asn1_template *topentype)
@@ -637,11 +1061,12 @@ _asn1_decode_open_type(const struct asn1_template *t,
         void *o;
 
         if (d->data && d->length) {
-            if ((o = calloc(1, tactual_type->offset)) == NULL)
+            if ((o = a1_calloc(arena, 1, tactual_type->offset)) == NULL)
                 return ENOMEM;
 
             /* Re-enter to decode the encoded open type value */
-            ret = _asn1_decode(tactual_type->ptr, flags, d->data, d->length, o, &sz);
+            ret = _asn1_decode_arena(tactual_type->ptr, flags, arena, d->data,
+                                     d->length, o, &sz);
             /*
              * Store the decoded object in the union:
              *
@@ -657,8 +1082,8 @@ _asn1_decode_open_type(const struct asn1_template *t,
              * All the union arms are pointers.
              */
             if (ret) {
-                _asn1_free(tactual_type->ptr, o);
-                free(o);
+                _asn1_free_flags(tactual_type->ptr, flags, o);
+                a1_free(arena, o);
                 /*
                  * So we failed to decode the open type -- that should not be fatal
                  * to decoding the rest of the input.  Only ENOMEM should be fatal.
@@ -695,21 +1120,22 @@ _asn1_decode_open_type(const struct asn1_template *t,
                ((uintptr_t)d) % sizeof(void *) != 0)
             d = (const void *)(((const char *)d) + sizeof(len));
 
-        if ((val = calloc(len, sizeof(*val))) == NULL)
+        if ((val = a1_calloc(arena, len, sizeof(*val))) == NULL)
             ret = ENOMEM;
 
         /* Increment the count of decoded values as we decode */
         *lenp = len;
         for (i = 0; ret != ENOMEM && i < len; i++) {
-            if ((val[i] = calloc(1, tactual_type->offset)) == NULL)
+            if ((val[i] = a1_calloc(arena, 1, tactual_type->offset)) == NULL)
                 ret = ENOMEM;
             if (ret == 0)
                 /* Re-enter to decode the encoded open type value */
-                ret = _asn1_decode(tactual_type->ptr, flags, d[0][i].data,
-                                   d[0][i].length, val[i], &sz);
+                ret = _asn1_decode_arena(tactual_type->ptr, flags, arena,
+                                         d[0][i].data, d[0][i].length,
+                                         val[i], &sz);
             if (ret) {
-                _asn1_free(tactual_type->ptr, val[i]);
-                free(val[i]);
+                _asn1_free_flags(tactual_type->ptr, flags, val[i]);
+                a1_free(arena, val[i]);
                 val[i] = NULL;
             }
         }
@@ -720,9 +1146,15 @@ _asn1_decode_open_type(const struct asn1_template *t,
     }
 }
 
-int
-_asn1_decode(const struct asn1_template *t, unsigned flags,
-	     const unsigned char *p, size_t len, void *data, size_t *size)
+/*
+ * With A1_PF_ARENA in `flags' everything is allocated from `arena' and
+ * nothing decoded is ever freed, only cleared.
+ */
+static int
+_asn1_decode_arena(const struct asn1_template *t, unsigned flags,
+		   struct asn1_arena *arena,
+		   const unsigned char *p, size_t len, void *data,
+		   size_t *size)
 {
     const struct asn1_template *tbase = t;
     const struct asn1_template *tdefval = NULL;
@@ -767,8 +1199,12 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
             size_t opentypeid = t->tt & ((1<<10)-1);
             size_t opentype = (t->tt >> 10) & ((1<<10)-1);
 
+            /* Left for _asn1_decode_open_types() */
+            if (t->tt & A1_OS_LAZY)
+                break;
+
             /* Note that the only error returned here would be ENOMEM */
-            ret = _asn1_decode_open_type(t, flags, data,
+            ret = _asn1_decode_open_type(t, flags, arena, data,
                                          template4member(tbase, opentypeid),
                                          template4member(tbase, opentype));
             if (ret)
@@ -795,15 +1231,16 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 	    }
 
 	    if (t->tt & A1_FLAG_OPTIONAL) {
-		*pel = calloc(1, elsize);
+		*pel = a1_calloc(arena, 1, elsize);
 		if (*pel == NULL)
 		    return ENOMEM;
 		el = *pel;
                 if ((t->tt & A1_OP_MASK) == A1_OP_TYPE) {
-                    ret = _asn1_decode(t->ptr, flags, p, len, el, &newsize);
+                    ret = _asn1_decode_arena(t->ptr, flags, arena, p, len, el,
+                                             &newsize);
                 } else {
-                    const struct asn1_type_func *f = t->ptr;
-                    ret = (f->decode)(p, len, el, &newsize);
+                    ret = a1_decode_extern(t->ptr, arena, p, len, el,
+                                           &newsize);
                 }
                 if (ret) {
                     /*
@@ -811,21 +1248,22 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
                      * though we should really look more carefully at `ret'.
                      */
                     if ((t->tt & A1_OP_MASK) == A1_OP_TYPE) {
-                        _asn1_free(t->ptr, el);
-                    } else {
+                        _asn1_free_flags(t->ptr, flags, el);
+                    } else if (arena == NULL) {
                         const struct asn1_type_func *f = t->ptr;
                         f->release(el);
                     }
-		    free(*pel);
+		    a1_free(arena, *pel);
 		    *pel = NULL;
 		    break;
                 }
 	    } else {
                 if ((t->tt & A1_OP_MASK) == A1_OP_TYPE) {
-                    ret = _asn1_decode(t->ptr, flags, p, len, el, &newsize);
+                    ret = _asn1_decode_arena(t->ptr, flags, arena, p, len, el,
+                                             &newsize);
                 } else {
-                    const struct asn1_type_func *f = t->ptr;
-                    ret = (f->decode)(p, len, el, &newsize);
+                    ret = a1_decode_extern(t->ptr, arena, p, len, el,
+                                           &newsize);
                 }
             }
 	    if (ret) {
@@ -850,12 +1288,22 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
                     } else if (tdefval->tt & A1_DV_INTEGER) {
                         struct heim_integer *i = (void *)(char *)el;
 
-                        if ((ret = der_copy_heim_integer(tdefval->ptr, i)))
+                        if (arena)
+                            ret = a1_prim_copy(arena, A1T_HEIM_INTEGER,
+                                               tdefval->ptr, i);
+                        else
+                            ret = der_copy_heim_integer(tdefval->ptr, i);
+                        if (ret)
                             return ret;
                     } else if (tdefval->tt & A1_DV_UTF8STRING) {
                         char **s = el;
 
-                        if ((*s = strdup(tdefval->ptr)) == NULL)
+                        if (arena)
+                            *s = a1_dup(arena, tdefval->ptr,
+                                        strlen(tdefval->ptr) + 1, 0);
+                        else
+                            *s = strdup(tdefval->ptr);
+                        if (*s == NULL)
                             return ENOMEM;
                     } else {
                         abort();
@@ -916,12 +1364,22 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
                     } else if (tdefval->tt & A1_DV_INTEGER) {
                         struct heim_integer *i = (void *)(char *)data;
 
-                        if ((ret = der_copy_heim_integer(tdefval->ptr, i)))
+                        if (arena)
+                            ret = a1_prim_copy(arena, A1T_HEIM_INTEGER,
+                                               tdefval->ptr, i);
+                        else
+                            ret = der_copy_heim_integer(tdefval->ptr, i);
+                        if (ret)
                             return ret;
                     } else if (tdefval->tt & A1_DV_UTF8STRING) {
                         char **s = data;
 
-                        if ((*s = strdup(tdefval->ptr)) == NULL)
+                        if (arena)
+                            *s = a1_dup(arena, tdefval->ptr,
+                                        strlen(tdefval->ptr) + 1, 0);
+                        else
+                            *s = strdup(tdefval->ptr);
+                        if (*s == NULL)
                             return ENOMEM;
                     } else {
                         abort();
@@ -963,7 +1421,7 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 	    if (t->tt & A1_FLAG_OPTIONAL) {
 		size_t ellen = _asn1_sizeofType(t->ptr);
 
-		*pel = calloc(1, ellen);
+		*pel = a1_calloc(arena, 1, ellen);
 		if (*pel == NULL)
 		    return ENOMEM;
 		data = *pel;
@@ -990,14 +1448,16 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
                         continue;
                     }
                     if ((subtype->tt & A1_OP_MASK) == A1_OP_TAG) {
-                        ret = _asn1_decode(subtype->ptr, subflags, p, datalen, data, &newsize);
+                        ret = _asn1_decode_arena(subtype->ptr, subflags, arena,
+                                                 p, datalen, data, &newsize);
                         have_tag = 1;
                     } else {
                         subtype = subtype->ptr;
                     }
                 }
             } else {
-                ret = _asn1_decode(t->ptr, subflags, p, datalen, data, &newsize);
+                ret = _asn1_decode_arena(t->ptr, subflags, arena, p, datalen,
+                                         data, &newsize);
             }
             if (ret == 0 && !is_indefinite && newsize != datalen)
 		/* Hidden data */
@@ -1033,8 +1493,8 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
                 if (!(t->tt & A1_FLAG_OPTIONAL))
                     return ret;
 
-                _asn1_free(t->ptr, data);
-                free(data);
+                _asn1_free_flags(t->ptr, flags, data);
+                a1_free(arena, data);
                 *pel = NULL;
                 return ret;
             }
@@ -1059,9 +1519,22 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 		return ASN1_PARSE_ERROR;
 	    }
 
-	    ret = (asn1_template_prim[type].decode)(p, len, el, &newsize);
-	    if (ret)
-		return ret;
+	    if ((flags & A1_PF_BORROW) && type == A1T_OCTET_STRING) {
+		heim_octet_string *os = el;
+
+		/* Point into the input; see _asn1_free_borrowed_top() */
+		os->data = rk_UNCONST(p);
+		os->length = len;
+		newsize = len;
+	    } else if (arena) {
+		ret = a1_prim_decode(arena, type, p, len, el, &newsize);
+		if (ret)
+		    return ret;
+	    } else {
+		ret = (asn1_template_prim[type].decode)(p, len, el, &newsize);
+		if (ret)
+		    return ret;
+	    }
 	    p += newsize; len -= newsize;
 
 	    break;
@@ -1072,6 +1545,7 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 	    size_t newsize;
 	    size_t ellen = _asn1_sizeofType(t->ptr);
 	    size_t vallength = 0;
+	    size_t valsize = 0;
 
 	    while (len > 0) {
 		void *tmp;
@@ -1079,17 +1553,31 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 		if (vallength > newlen)
 		    return ASN1_OVERFLOW;
 
-                /* XXX Slow */
-		tmp = realloc(el->val, newlen);
-		if (tmp == NULL)
-		    return ENOMEM;
-
-		memset(DPO(tmp, vallength), 0, ellen);
-		el->val = tmp;
+		if (arena) {
+		    /* Grow geometrically, the old array stays in the arena */
+		    if (newlen > valsize) {
+			valsize = newlen <= SIZE_MAX / 2 ? newlen * 2 : newlen;
+			tmp = asn1_arena_alloc(arena, valsize);
+			if (tmp == NULL)
+			    return ENOMEM;
+			if (vallength)
+			    memcpy(tmp, el->val, vallength);
+			el->val = tmp;
+		    }
+		} else {
+		    /* XXX Slow */
+		    tmp = realloc(el->val, newlen);
+		    if (tmp == NULL)
+			return ENOMEM;
+
+		    memset(DPO(tmp, vallength), 0, ellen);
+		    el->val = tmp;
+		}
 
 		el->len++;
-		ret = _asn1_decode(t->ptr, flags & (~A1_PF_INDEFINTE), p, len,
-				   DPO(el->val, vallength), &newsize);
+		ret = _asn1_decode_arena(t->ptr, flags & (~A1_PF_INDEFINTE),
+					 arena, p, len,
+					 DPO(el->val, vallength), &newsize);
 		if (ret)
 		    return ret;
 		vallength = newlen;
@@ -1131,7 +1619,7 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
 	    const struct asn1_template *choice = t->ptr;
 	    unsigned int *element = DPO(data, choice->offset);
 	    size_t datalen;
-	    unsigned int i;
+	    unsigned int i, first = 1, last = A1_HEADER_LEN(choice);
 
 	    /*
              * CHOICE element IDs are assigned in monotonically increasing
@@ -1141,7 +1629,20 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
              */
 	    *element = ~0;
 
-	    for (i = 1; i < A1_HEADER_LEN(choice) + 1 && choice[i].tt; i++) {
+	    /*
+	     * When the compiler could prove the alternatives' outer tags are
+	     * distinct it gave us a sorted tag index, so only the one
+	     * alternative that can match needs to be tried.
+	     */
+	    if (t->tt & A1_CF_TAG_INDEX) {
+		first = choice4tag(choice, p, len);
+		if (first == 0)
+		    first = last + 1;
+		else
+		    last = first;
+	    }
+
+	    for (i = first; i < last + 1 && choice[i].tt; i++) {
 		/*
                  * This is more permissive than is required.  CHOICE
                  * alternatives must have different outer tags, so in principle
@@ -1159,26 +1660,32 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
                  * and raise an error, then we don't have to be concerned here
                  * at all.
                  */
-		ret = _asn1_decode(choice[i].ptr, 0, p, len,
-				   DPO(data, choice[i].offset), &datalen);
+		ret = _asn1_decode_arena(choice[i].ptr, flags & A1_PF_ARENA,
+					 arena, p, len,
+					 DPO(data, choice[i].offset), &datalen);
 		if (ret == 0) {
 		    *element = i;
 		    p += datalen; len -= datalen;
 		    break;
 		}
-                _asn1_free(choice[i].ptr, DPO(data, choice[i].offset));
+                _asn1_free_flags(choice[i].ptr, flags & A1_PF_ARENA,
+                                 DPO(data, choice[i].offset));
                 if (ret != ASN1_BAD_ID && ret != ASN1_MISPLACED_FIELD &&
                     ret != ASN1_MISSING_FIELD)
 		    return ret;
 	    }
-	    if (i >= A1_HEADER_LEN(choice) + 1 || !choice[i].tt) {
+	    if (i > last || !choice[i].tt) {
 		if (choice->tt == 0)
 		    return ASN1_BAD_ID;
 
                 /* This is the ellipsis case */
 		*element = 0;
-		ret = der_get_octet_string(p, len,
-					   DPO(data, choice->tt), &datalen);
+		if (arena)
+		    ret = a1_prim_decode(arena, A1T_OCTET_STRING, p, len,
+					 DPO(data, choice->tt), &datalen);
+		else
+		    ret = der_get_octet_string(p, len,
+					       DPO(data, choice->tt), &datalen);
 		if (ret)
 		    return ret;
 		p += datalen; len -= datalen;
@@ -1209,7 +1716,7 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
     if (startp) {
 	heim_octet_string *save = data;
 
-	save->data = malloc(oldlen);
+	save->data = arena ? asn1_arena_alloc(arena, oldlen) : malloc(oldlen);
 	if (save->data == NULL)
 	    return ENOMEM;
 	else {
@@ -1220,6 +1727,14 @@ _asn1_decode(const struct asn1_template *t, unsigned flags,
     return 0;
 }
 
+int
+_asn1_decode(const struct asn1_template *t, unsigned flags,
+	     const unsigned char *p, size_t len, void *data, size_t *size)
+{
+    return _asn1_decode_arena(t, flags & ~A1_PF_ARENA, NULL, p, len, data,
+			      size);
+}
+
 /*
  * This should be called with a `A1_TAG_T(ASN1_C_UNIV, PRIM, UT_Integer)'
  * template as the `ttypeid'.
@@ -2194,6 +2709,7 @@ _asn1_length(const struct asn1_template *t, const void *data)
 /* See commentary in _asn1_decode_open_type() */
 static void
 _asn1_free_open_type(const struct asn1_template *t, /* object set template */
+                     unsigned flags,
                      void *data)
 {
     const struct asn1_template *tactual_type;
@@ -2216,7 +2732,7 @@ _asn1_free_open_type(const struct asn1_template *t, /* object set template */
                ((uintptr_t)dp) % sizeof(void *) != 0)
             dp = (void *)(((char *)dp) + sizeof(*elementp));
         if (*dp) {
-            _asn1_free(tactual_type, *dp);
+            _asn1_free_flags(tactual_type, flags, *dp);
             free(*dp);
             *dp = NULL;
         }
@@ -2233,7 +2749,7 @@ _asn1_free_open_type(const struct asn1_template *t, /* object set template */
 
     for (i = 0; i < len; i++) {
         if (val[i]) {
-            _asn1_free(tactual_type, val[i]);
+            _asn1_free_flags(tactual_type, flags, val[i]);
             free(val[i]);
         }
     }
@@ -2242,11 +2758,21 @@ _asn1_free_open_type(const struct asn1_template *t, /* object set template */
     *dp = NULL;
 }
 
-void
-_asn1_free(const struct asn1_template *t, void *data)
+/*
+ * With A1_PF_BORROW in `flags', OCTET STRING values are assumed to
+ * point into the buffer they were decoded from and are not freed.
+ * With A1_PF_ARENA everything belongs to an arena and is only cleared.
+ */
+static void
+_asn1_free_flags(const struct asn1_template *t, unsigned flags, void *data)
 {
     size_t elements = A1_HEADER_LEN(t);
 
+    if (flags & A1_PF_ARENA) {
+	memset(data, 0, _asn1_sizeofType(t));
+	return;
+    }
+
     if (t->tt & A1_HF_PRESERVE)
 	der_free_octet_string(data);
 
@@ -2255,7 +2781,7 @@ _asn1_free(const struct asn1_template *t, void *data)
     while (elements) {
 	switch (t->tt & A1_OP_MASK) {
         case A1_OP_OPENTYPE_OBJSET: {
-            _asn1_free_open_type(t, data);
+            _asn1_free_open_type(t, flags, data);
             break;
         }
         case A1_OP_NAME: break;
@@ -2274,7 +2800,7 @@ _asn1_free(const struct asn1_template *t, void *data)
 	    }
 
 	    if ((t->tt & A1_OP_MASK) == A1_OP_TYPE || (t->tt & A1_OP_MASK) == A1_OP_TYPE_DECORATE) {
-		_asn1_free(t->ptr, el);
+		_asn1_free_flags(t->ptr, flags, el);
 	    } else if ((t->tt & A1_OP_MASK) == A1_OP_TYPE_EXTERN) {
 		const struct asn1_type_func *f = t->ptr;
 		(f->release)(el);
@@ -2305,7 +2831,10 @@ _asn1_free(const struct asn1_template *t, void *data)
 		ABORT_ON_ERROR();
 		break;
 	    }
-	    (asn1_template_prim[type].release)(el);
+	    if ((flags & A1_PF_BORROW) && type == A1T_OCTET_STRING)
+		memset(el, 0, sizeof(heim_octet_string));
+	    else
+		(asn1_template_prim[type].release)(el);
 	    break;
 	}
 	case A1_OP_TAG: {
@@ -2316,11 +2845,11 @@ _asn1_free(const struct asn1_template *t, void *data)
 
 		if (*pel == NULL)
 		    break;
-                _asn1_free(t->ptr, *pel);
+                _asn1_free_flags(t->ptr, flags, *pel);
 		free(*pel);
                 *pel = NULL;
             } else {
-                _asn1_free(t->ptr, el);
+                _asn1_free_flags(t->ptr, flags, el);
             }
 
 	    break;
@@ -2333,7 +2862,7 @@ _asn1_free(const struct asn1_template *t, void *data)
 	    unsigned int i;
 
 	    for (i = 0; i < el->len; i++) {
-		_asn1_free(t->ptr, element);
+		_asn1_free_flags(t->ptr, flags, element);
 		element += ellen;
 	    }
 	    free(el->val);
@@ -2355,7 +2884,8 @@ _asn1_free(const struct asn1_template *t, void *data)
 		der_free_octet_string(DPO(data, choice->tt));
 	    } else {
 		choice += *element;
-		_asn1_free(choice->ptr, DPO(data, choice->offset));
+		/* CHOICE arms are never decoded with A1_PF_BORROW */
+		_asn1_free_flags(choice->ptr, 0, DPO(data, choice->offset));
 	    }
 	    break;
 	}
@@ -2368,6 +2898,12 @@ _asn1_free(const struct asn1_template *t, void *data)
     }
 }
 
+void
+_asn1_free(const struct asn1_template *t, void *data)
+{
+    _asn1_free_flags(t, 0, data);
+}
+
 static char *
 getindent(int flags, unsigned int i)
 {
@@ -2768,9 +3304,13 @@ _asn1_print_top(const struct asn1_template *t,
     return rk_strpoolcollect(r);
 }
 
+static int _asn1_copy_arena(const struct asn1_template *, struct asn1_arena *,
+                            const void *, void *);
+
 /* See commentary in _asn1_decode_open_type() */
 static int
 _asn1_copy_open_type(const struct asn1_template *t, /* object set template */
+                     struct asn1_arena *arena,
                      const void *from,
                      void *to)
 {
@@ -2811,10 +3351,10 @@ _asn1_copy_open_type(const struct asn1_template *t, /* object set template */
                ((uintptr_t)dtop) % sizeof(void *) != 0)
             dtop = (void *)(((char *)dtop) + sizeof(*etop));
 
-        if ((*dtop = calloc(1, tactual_type->offset)) == NULL)
+        if ((*dtop = a1_calloc(arena, 1, tactual_type->offset)) == NULL)
             ret = ENOMEM;
         if (ret == 0)
-            ret = _asn1_copy(tactual_type->ptr, *dfromp, *dtop);
+            ret = _asn1_copy_arena(tactual_type->ptr, arena, *dfromp, *dtop);
         if (ret == 0)
             *etop = *efromp;
         return ret;
@@ -2831,34 +3371,58 @@ _asn1_copy_open_type(const struct asn1_template *t, /* object set template */
     len = *lenfromp;
     *lentop = 0;
     *dtop = NULL;
-    if ((valto = calloc(len, sizeof(valto[0]))) == NULL)
+    if ((valto = a1_calloc(arena, len, sizeof(valto[0]))) == NULL)
         ret = ENOMEM;
     for (i = 0, len = *lenfromp; ret == 0 && i < len; (*lentop)++, i++) {
         if (valfrom[i] == NULL) {
             valto[i] = NULL;
             continue;
         }
-        if ((valto[i] = calloc(1, tactual_type->offset)) == NULL)
+        if ((valto[i] = a1_calloc(arena, 1, tactual_type->offset)) == NULL)
             ret = ENOMEM;
         else
-            ret = _asn1_copy(tactual_type->ptr, valfrom[i], valto[i]);
+            ret = _asn1_copy_arena(tactual_type->ptr, arena, valfrom[i],
+                                   valto[i]);
     }
 
-    for (i = 0; ret && i < len; i++) {
+    for (i = 0; ret && arena == NULL && i < len; i++) {
         if (valto[i]) {
             _asn1_free(tactual_type->ptr, valto[i]);
             free(valto[i]);
         }
     }
     if (ret)
-        free(valto);
+        a1_free(arena, valto);
     else
         *dtop = valto;
     return ret;
 }
 
-int
-_asn1_copy(const struct asn1_template *t, const void *from, void *to)
+/*
+ * Copy a value of a type from another module or a decoration; see
+ * a1_decode_extern().
+ */
+static int
+a1_copy_extern(const struct asn1_type_func *f, struct asn1_arena *arena,
+	       const void *from, void *to)
+{
+    void *box;
+    int ret;
+
+    if (arena == NULL || f->release == NULL)
+	return (f->copy)(from, to);
+    if ((box = a1_box(arena, f->release, f->size)) == NULL)
+	return ENOMEM;
+    ret = (f->copy)(from, box);
+    if (ret == 0)
+	memcpy(to, box, f->size);
+    return ret;
+}
+
+/* With a non-NULL `arena' everything is allocated from it */
+static int
+_asn1_copy_arena(const struct asn1_template *t, struct asn1_arena *arena,
+		 const void *from, void *to)
 {
     size_t elements = A1_HEADER_LEN(t);
     int ret = 0;
@@ -2867,7 +3431,10 @@ _asn1_copy(const struct asn1_template *t, const void *from, void *to)
     t++;
 
     if (preserve) {
-	ret = der_copy_octet_string(from, to);
+	if (arena)
+	    ret = a1_prim_copy(arena, A1T_OCTET_STRING, from, to);
+	else
+	    ret = der_copy_octet_string(from, to);
 	if (ret)
 	    return ret;
     }
@@ -2875,7 +3442,7 @@ _asn1_copy(const struct asn1_template *t, const void *from, void *to)
     while (elements) {
 	switch (t->tt & A1_OP_MASK) {
         case A1_OP_OPENTYPE_OBJSET: {
-            _asn1_copy_open_type(t, from, to);
+            _asn1_copy_open_type(t, arena, from, to);
             break;
         }
         case A1_OP_NAME: break;
@@ -2903,32 +3470,38 @@ _asn1_copy(const struct asn1_template *t, const void *from, void *to)
 		    break;
 		fel = *pfel;
 
-		tel = *ptel = calloc(1, size);
+		tel = *ptel = a1_calloc(arena, 1, size);
 		if (tel == NULL)
 		    return ENOMEM;
 	    }
 
 	    if ((t->tt & A1_OP_MASK) == A1_OP_TYPE ||
                 (t->tt & A1_OP_MASK) == A1_OP_TYPE_DECORATE) {
-		ret = _asn1_copy(t->ptr, fel, tel);
+		ret = _asn1_copy_arena(t->ptr, arena, fel, tel);
 	    } else if ((t->tt & A1_OP_MASK) == A1_OP_TYPE_EXTERN) {
-		const struct asn1_type_func *f = t->ptr;
-                ret = (f->copy)(fel, tel);
+                ret = a1_copy_extern(t->ptr, arena, fel, tel);
 	    } else {
 		const struct asn1_type_func *f = t->ptr;
 
                 /* A1_OP_TYPE_DECORATE_EXTERN */
-                if (t->tt & A1_FLAG_HEIM_OBJ)
-                    *(heim_object_t *)tel = heim_retain(*(void **)fel);
-                else if (f->copy)
-                    ret = (f->copy)(fel, tel);
+                if (t->tt & A1_FLAG_HEIM_OBJ) {
+                    heim_object_t *box = tel;
+
+                    if (arena &&
+                        (box = a1_box(arena, a1_heim_release,
+                                      sizeof(*box))) == NULL)
+                        return ENOMEM;
+                    *box = heim_retain(*(void **)fel);
+                    *(heim_object_t *)tel = *box;
+                } else if (f->copy)
+                    ret = a1_copy_extern(f, arena, fel, tel);
                 else
                     memset(tel, 0, f->size);
 	    }
 
 	    if (ret) {
 		if (t->tt & A1_FLAG_OPTIONAL) {
-		    free(*ptel);
+		    a1_free(arena, *ptel);
 		    *ptel = NULL;
 		}
 		return ret;
@@ -2944,7 +3517,10 @@ _asn1_copy(const struct asn1_template *t, const void *from, void *to)
 		ABORT_ON_ERROR();
 		return ASN1_PARSE_ERROR;
 	    }
-	    ret = (asn1_template_prim[type].copy)(fel, tel);
+	    if (arena)
+		ret = a1_prim_copy(arena, type, fel, tel);
+	    else
+		ret = (asn1_template_prim[type].copy)(fel, tel);
 	    if (ret)
 		return ret;
 	    break;
@@ -2967,15 +3543,15 @@ _asn1_copy(const struct asn1_template *t, const void *from, void *to)
 		}
 		from = *fel;
 
-		to = *tel = calloc(1, _asn1_sizeofType(t->ptr));
+		to = *tel = a1_calloc(arena, 1, _asn1_sizeofType(t->ptr));
 		if (to == NULL)
 		    return ENOMEM;
 	    }
 
-	    ret = _asn1_copy(t->ptr, from, to);
+	    ret = _asn1_copy_arena(t->ptr, arena, from, to);
 	    if (ret) {
 		if (tel) {
-		    free(*tel);
+		    a1_free(arena, *tel);
 		    *tel = NULL;
 		}
 		return ret;
@@ -2993,16 +3569,16 @@ _asn1_copy(const struct asn1_template *t, const void *from, void *to)
 	    size_t ellen = _asn1_sizeofType(t->ptr);
 	    unsigned int i;
 
-	    tel->val = calloc(fel->len, ellen);
+	    tel->val = a1_calloc(arena, fel->len, ellen);
 	    if (tel->val == NULL)
 		return ENOMEM;
 
 	    tel->len = fel->len;
 
 	    for (i = 0; i < fel->len; i++) {
-		ret = _asn1_copy(t->ptr,
-				 DPOC(fel->val, (i * ellen)),
-				 DPO(tel->val, (i *ellen)));
+		ret = _asn1_copy_arena(t->ptr, arena,
+				       DPOC(fel->val, (i * ellen)),
+				       DPO(tel->val, (i *ellen)));
 		if (ret)
 		    return ret;
 	    }
@@ -3024,13 +3600,16 @@ _asn1_copy(const struct asn1_template *t, const void *from, void *to)
 
 	    *telement = *felement;
 
-	    if (*felement == 0) {
+	    if (*felement == 0 && arena) {
+		ret = a1_prim_copy(arena, A1T_OCTET_STRING,
+				   DPOC(from, choice->tt), DPO(to, choice->tt));
+	    } else if (*felement == 0) {
 		ret = der_copy_octet_string(DPOC(from, choice->tt), DPO(to, choice->tt));
 	    } else {
 		choice += *felement;
-		ret = _asn1_copy(choice->ptr,
-				 DPOC(from, choice->offset),
-				 DPO(to, choice->offset));
+		ret = _asn1_copy_arena(choice->ptr, arena,
+				       DPOC(from, choice->offset),
+				       DPO(to, choice->offset));
 	    }
 	    if (ret)
 		return ret;
@@ -3046,18 +3625,71 @@ _asn1_copy(const struct asn1_template *t, const void *from, void *to)
     return 0;
 }
 
+int
+_asn1_copy(const struct asn1_template *t, const void *from, void *to)
+{
+    return _asn1_copy_arena(t, NULL, from, to);
+}
+
 int
 _asn1_decode_top(const struct asn1_template *t, unsigned flags, const unsigned char *p, size_t len, void *data, size_t *size)
 {
     int ret;
     memset(data, 0, t->offset);
     ret = _asn1_decode(t, flags, p, len, data, size);
-    if (ret)
+    if (ret && (flags & A1_PF_BORROW))
+	_asn1_free_borrowed_top(t, data);
+    else if (ret)
 	_asn1_free_top(t, data);
 
     return ret;
 }
 
+/*
+ * Decode the open types of a value of a type whose open types are decoded
+ * lazily (see A1_OS_LAZY), i.e., on first access rather than by
+ * _asn1_decode_top().  Open types already decoded are left alone.  The
+ * value must have been decoded with _asn1_decode_top(), not into an arena
+ * or with borrowed OCTET STRINGs.
+ */
+int
+_asn1_decode_open_types(const struct asn1_template *t, void *data)
+{
+    const struct asn1_template *tbase;
+    size_t elements;
+    int ret;
+
+    /* Walk past the outer tag(s) to the SET/SEQUENCE's members */
+    while (A1_HEADER_LEN(t) == 1 &&
+           ((t[1].tt & A1_OP_MASK) == A1_OP_TAG ||
+            (t[1].tt & A1_OP_MASK) == A1_OP_TYPE)) {
+        if (t[1].tt & A1_FLAG_OPTIONAL)
+            return 0;
+        data = DPO(data, t[1].offset);
+        t = t[1].ptr;
+    }
+
+    tbase = t;
+    elements = A1_HEADER_LEN(t);
+    for (t++; elements; t++, elements--) {
+        size_t opentypeid, opentype;
+
+        if ((t->tt & A1_OP_MASK) != A1_OP_OPENTYPE_OBJSET)
+            continue;
+        if (*(int *)DPO(data, t->offset) != 0)
+            continue;
+
+        opentypeid = t->tt & ((1<<10)-1);
+        opentype = (t->tt >> 10) & ((1<<10)-1);
+        ret = _asn1_decode_open_type(t, 0, NULL, data,
+                                     template4member(tbase, opentypeid),
+                                     template4member(tbase, opentype));
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
 int
 _asn1_copy_top(const struct asn1_template *t, const void *from, void *to)
 {
@@ -3070,9 +3702,58 @@ _asn1_copy_top(const struct asn1_template *t, const void *from, void *to)
     return ret;
 }
 
+/*
+ * Decode into a value allocated, with everything it points to, from
+ * `arena'.  On error whatever was allocated stays in the arena.
+ */
+int
+_asn1_decode_top_arena(const struct asn1_template *t, unsigned flags,
+		       struct asn1_arena *arena, const unsigned char *p,
+		       size_t len, void **datap, size_t *size)
+{
+    void *data;
+    int ret;
+
+    *datap = NULL;
+    if ((data = asn1_arena_alloc(arena, t->offset)) == NULL)
+	return ENOMEM;
+    ret = _asn1_decode_arena(t, flags | A1_PF_ARENA, arena, p, len, data,
+			     size);
+    if (ret == 0)
+	*datap = data;
+    return ret;
+}
+
+int
+_asn1_copy_top_arena(const struct asn1_template *t, const void *from,
+		     struct asn1_arena *arena, void **top)
+{
+    void *to;
+    int ret;
+
+    *top = NULL;
+    if ((to = asn1_arena_alloc(arena, t->offset)) == NULL)
+	return ENOMEM;
+    ret = _asn1_copy_arena(t, arena, from, to);
+    if (ret == 0)
+	*top = to;
+    return ret;
+}
+
 void
 _asn1_free_top(const struct asn1_template *t, void *data)
 {
     _asn1_free(t, data);
     memset(data, 0, t->offset);
 }
+
+/*
+ * Free a value decoded with A1_PF_BORROW, leaving alone the OCTET
+ * STRING values that point into the decoded buffer.
+ */
+void
+_asn1_free_borrowed_top(const struct asn1_template *t, void *data)
+{
+    _asn1_free_flags(t, A1_PF_BORROW, data);
+    memset(data, 0, t->offset);
+}
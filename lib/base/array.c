@@ -36,14 +36,20 @@
 #include "baselocl.h"
 
 /*
- *
+ * Most arrays are tiny, so the first few elements are stored in the
+ * array object itself.  Beyond that the backing store grows
+ * geometrically.  Free slots may be kept at either end so that
+ * appending and prepending are both amortized O(1).
  */
 
+#define ARRAY_INLINE_LEN 4
+
 struct heim_array_data {
     size_t len;
     heim_object_t *val;
     size_t allocated_len;
     heim_object_t *allocated;
+    heim_object_t inline_val[ARRAY_INLINE_LEN];
 };
 
 static void
@@ -53,7 +59,8 @@ array_dealloc(heim_object_t ptr)
     size_t n;
     for (n = 0; n < array->len; n++)
 	heim_release(array->val[n]);
-    free(array->allocated);
+    if (array->allocated != array->inline_val)
+	free(array->allocated);
 }
 
 struct heim_type_data array_object = {
@@ -82,9 +89,9 @@ heim_array_create(void)
     if (array == NULL)
 	return NULL;
 
-    array->allocated = NULL;
-    array->allocated_len = 0;
-    array->val = NULL;
+    array->allocated = array->inline_val;
+    array->allocated_len = ARRAY_INLINE_LEN;
+    array->val = array->inline_val;
     array->len = 0;
 
     return array;
@@ -102,6 +109,35 @@ heim_array_get_type_id(void)
     return HEIM_TID_ARRAY;
 }
 
+/*
+ * Internal function to grow the backing store (doubling it), leaving
+ * half the new free slots at the front if we're growing to prepend,
+ * else all of them at the end.
+ */
+static int
+array_grow(heim_array_t array, int prepend)
+{
+    heim_object_t *ptr;
+    size_t new_len = array->allocated_len << 1;
+    size_t leading;
+
+    if (new_len < array->len + 1)
+	return ENOMEM; /* overflow */
+    ptr = malloc(new_len * sizeof(ptr[0]));
+    if (ptr == NULL)
+	return ENOMEM;
+    leading = prepend ? (new_len - array->len) >> 1 : 0;
+    if (array->len)
+	(void) memcpy(&ptr[leading], array->val,
+		      array->len * sizeof(array->val[0]));
+    if (array->allocated != array->inline_val)
+	free(array->allocated);
+    array->allocated = ptr;
+    array->allocated_len = new_len;
+    array->val = &ptr[leading];
+    return 0;
+}
+
 /**
  * Append object to array
  *
@@ -114,41 +150,25 @@ heim_array_get_type_id(void)
 int
 heim_array_append_value(heim_array_t array, heim_object_t object)
 {
-    heim_object_t *ptr;
     size_t leading = array->val - array->allocated; /* unused leading slots */
     size_t trailing = array->allocated_len - array->len - leading;
-    size_t new_len;
-
-    if (trailing > 0) {
-	/* We have pre-allocated space; use it */
-	array->val[array->len++] = heim_retain(object);
-	return 0;
-    }
-
-    if (leading > (array->len + 1)) {
-	/*
-	 * We must have appending to, and deleting at index 0 from this
-	 * array a lot; don't want to grow forever!
-	 */
-	(void) memmove(&array->allocated[0], &array->val[0],
-		       array->len * sizeof(array->val[0]));
-	array->val = array->allocated;
+    int ret;
 
-	/* We have pre-allocated space; use it */
-	array->val[array->len++] = heim_retain(object);
-	return 0;
+    if (trailing == 0) {
+	if (leading > array->len) {
+	    /*
+	     * We must have appending to, and deleting at index 0 from
+	     * this array a lot; don't want to grow forever!
+	     */
+	    (void) memmove(&array->allocated[0], &array->val[0],
+			   array->len * sizeof(array->val[0]));
+	    array->val = array->allocated;
+	} else if ((ret = array_grow(array, 0)) != 0) {
+	    return ret;
+	}
     }
 
-    /* Pre-allocate extra .5 times number of used slots */
-    new_len = leading + array->len + 1 + (array->len >> 1);
-    ptr = realloc(array->allocated, new_len * sizeof(array->val[0]));
-    if (ptr == NULL)
-	return ENOMEM;
-    array->allocated = ptr;
-    array->allocated_len = new_len;
-    array->val = &ptr[leading];
     array->val[array->len++] = heim_retain(object);
-
     return 0;
 }
 
@@ -160,46 +180,29 @@ heim_array_append_value(heim_array_t array, heim_object_t object)
 static int
 heim_array_prepend_value(heim_array_t array, heim_object_t object)
 {
-    heim_object_t *ptr;
     size_t leading = array->val - array->allocated; /* unused leading slots */
     size_t trailing = array->allocated_len - array->len - leading;
-    size_t new_len;
-
-    if (leading > 0) {
-	/* We have pre-allocated space; use it */
-	array->val--;
-	array->val[0] = heim_retain(object);
-	array->len++;
-	return 0;
-    }
-    if (trailing > (array->len + 1)) {
-	/*
-	 * We must have prepending to, and deleting at index
-	 * array->len - 1 from this array a lot; don't want to grow
-	 * forever!
-	 */
-	(void) memmove(&array->allocated[array->len], &array->val[0],
-		       array->len * sizeof(array->val[0]));
-	array->val = &array->allocated[array->len];
-
-	/* We have pre-allocated space; use it */
-	array->val--;
-	array->val[0] = heim_retain(object);
-	array->len++;
-	return 0;
+    int ret;
+
+    if (leading == 0) {
+	if (trailing > array->len) {
+	    /*
+	     * We must have prepending to, and deleting at index
+	     * array->len - 1 from this array a lot; don't want to grow
+	     * forever!  Re-center the elements.
+	     */
+	    leading = (trailing + 1) >> 1;
+	    (void) memmove(&array->allocated[leading], &array->val[0],
+			   array->len * sizeof(array->val[0]));
+	    array->val = &array->allocated[leading];
+	} else if ((ret = array_grow(array, 1)) != 0) {
+	    return ret;
+	}
     }
-    /* Pre-allocate extra .5 times number of used slots */
-    new_len = array->len + 1 + trailing + (array->len >> 1);
-    ptr = realloc(array->allocated, new_len * sizeof(array->val[0]));
-    if (ptr == NULL)
-	return ENOMEM;
-    (void) memmove(&ptr[1], &ptr[0], array->len * sizeof (array->val[0]));
-    array->allocated = ptr;
-    array->allocated_len = new_len;
-    array->val = &ptr[0];
+
+    array->val--;
     array->val[0] = heim_retain(object);
     array->len++;
-
     return 0;
 }
 
@@ -234,11 +237,11 @@ heim_array_insert_value(heim_array_t array, size_t idx, heim_object_t object)
 	return ret;
     /*
      * Shift to the right by one all the elements after idx, then set
-     * [idx] to the new object.
+     * [idx] to the new object (already retained by the append).
      */
     (void) memmove(&array->val[idx + 1], &array->val[idx],
 	           (array->len - idx - 1) * sizeof(array->val[0]));
-    array->val[idx] = heim_retain(object);
+    array->val[idx] = object;
 
     return 0;
 }
@@ -422,7 +425,9 @@ heim_array_delete_value(heim_array_t array, size_t idx)
      * value" so we can leave holes in the array, avoid memmove()s on
      * delete, and opportunistically re-use those holes on insert.
      */
-    if (idx == 0)
+    if (array->len == 0)
+	array->val = array->allocated;
+    else if (idx == 0)
 	array->val++;
     else if (idx < array->len)
 	(void) memmove(&array->val[idx], &array->val[idx + 1],
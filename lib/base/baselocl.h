@@ -85,6 +85,19 @@
 #undef HEIMDAL_PRINTF_ATTRIBUTE
 #define HEIMDAL_PRINTF_ATTRIBUTE(x)
 
+#ifndef _WIN32
+/* Results of user information lookups for path token expansion */
+struct heim_expand_cache {
+    HEIMDAL_MUTEX           mutex;
+    pid_t                   pid;
+    uid_t                   uid;
+    uid_t                   euid;
+    char                    *homedir;
+    char                    *username;
+    char                    *loginname;
+};
+#endif
+
 struct heim_context_s {
     heim_log_facility       *log_dest;
     heim_log_facility       *warn_dest;
@@ -95,4 +108,9 @@ struct heim_context_s {
     struct et_list          *et_list;
     char                    *error_string;
     heim_error_code         error_code;
+    char                    *config_cache;
+    struct heim_config_index *config_index;
+#ifndef _WIN32
+    struct heim_expand_cache expand_cache;
+#endif
 };
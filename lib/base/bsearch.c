@@ -76,16 +76,28 @@
  * in the middle of a record.  Here it is the right sub-tree searches
  * that are less efficient than left sub-tree searches.
  *
+ * Where mmap() is available we avoid all of that for files: the file is
+ * mapped read-only (so all processes searching it share the same pages)
+ * and an array of line offsets is built once at open time, after which
+ * a lookup is a plain binary search over whole records with no reads.
+ *
  * bsearch_common() contains the common text block binary search code.
  *
  * _bsearch_text() is the interface for searching in-core text.
  * _bsearch_file() is the interface for block-wise searching files.
  */
 
+#if defined(HAVE_MMAP) && !defined(NO_MMAP)
+#include <sys/mman.h>
+#endif
+
 struct bsearch_file_handle {
     int fd;          /* file descriptor */
     char *cache;     /* cache bytes */
     char *page;      /* one double-size page worth of bytes */
+    char *map;       /* mmap()ed file, if any */
+    size_t *lines;   /* offsets of records in map */
+    size_t nlines;   /* number of records in map */
     size_t file_sz;  /* file size */
     size_t cache_sz; /* cache size */
     size_t page_sz;  /* page size */
@@ -327,10 +339,144 @@ _bsearch_text(const char *buf, size_t buf_sz, const char *key,
 
 #define MAX_BLOCK_SIZE (1024 * 1024)
 #define DEFAULT_MAX_FILE_SIZE (1024 * 1024)
+
+#if defined(HAVE_MMAP) && !defined(NO_MMAP)
+/*
+ * Map the file and index the offsets at which its records start.
+ *
+ * Returns 0 on success, else an error number, in which case the caller
+ * falls back on reading the file.
+ */
+static int
+map_file(bsearch_file_handle bfh, int fd)
+{
+    const char *p, *end;
+    size_t *lines;
+    size_t alloced = 64;
+    size_t n = 0;
+    void *map;
+
+    map = mmap(NULL, bfh->file_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+	return errno;
+
+    if ((lines = malloc(alloced * sizeof(lines[0]))) == NULL) {
+	(void) munmap(map, bfh->file_sz);
+	return ENOMEM;
+    }
+
+    for (p = map, end = p + bfh->file_sz; p < end; p++) {
+	/* Skip empty lines */
+	if (*p == '\r' || *p == '\n')
+	    continue;
+	if (n == alloced) {
+	    size_t *tmp;
+
+	    tmp = realloc(lines, (alloced << 1) * sizeof(lines[0]));
+	    if (tmp == NULL) {
+		free(lines);
+		(void) munmap(map, bfh->file_sz);
+		return ENOMEM;
+	    }
+	    lines = tmp;
+	    alloced <<= 1;
+	}
+	lines[n++] = p - (const char *)map;
+	p = memchr(p, '\n', end - p);
+	if (p == NULL)
+	    break;
+    }
+
+    bfh->map = map;
+    bfh->lines = lines;
+    bfh->nlines = n;
+    return 0;
+}
+
+/*
+ * Binary search the line index of an mmap()ed file.  Records are split
+ * into key and value exactly as in bsearch_common().
+ */
+static int
+bsearch_map(bsearch_file_handle bfh, const char *key, char **value,
+	    size_t *location, size_t *loops)
+{
+    const char *buf = bfh->map;
+    size_t key_len = strlen(key);
+    size_t loop_count = 0;
+    size_t l = 0;
+    size_t r = bfh->nlines;
+    int ret = -1;
+
+    if (location)
+	*location = bfh->nlines ? bfh->lines[0] : 0;
+
+    while (l < r) {
+	size_t m = l + ((r - l) >> 1);
+	size_t k, end, rec_key_len, val_start = 0, val_len = 0;
+	int key_cmp;
+
+	loop_count++;
+	end = m + 1 < bfh->nlines ? bfh->lines[m + 1] : bfh->file_sz;
+
+	/* Find the end of the key: unquoted whitespace or EOL */
+	for (k = bfh->lines[m]; k < end; k++) {
+	    if (buf[k] == '\\') {
+		k++;
+		continue;
+	    }
+	    if (isspace((unsigned char)buf[k]))
+		break;
+	}
+	if (k > end)
+	    k = end;
+	rec_key_len = k - bfh->lines[m];
+	while (k < end && buf[k] != '\r' && buf[k] != '\n' &&
+	       isspace((unsigned char)buf[k]))
+	    k++;
+	for (val_start = k; k < end && buf[k] != '\r' && buf[k] != '\n'; k++)
+	    ;
+	val_len = k - val_start;
+
+	key_cmp = strncmp(key, &buf[bfh->lines[m]], rec_key_len);
+	if (key_cmp == 0 && key_len != rec_key_len)
+	    key_cmp = 1;
+	if (key_cmp < 0) {
+	    r = m;
+	    if (location)
+		*location = bfh->lines[m];
+	} else if (key_cmp > 0) {
+	    l = m + 1;
+	    if (location)
+		*location = val_start + val_len;
+	} else {
+	    if (location)
+		*location = bfh->lines[m];
+	    ret = 0;
+	    if (val_len && value) {
+		*value = malloc(val_len + 1);
+		if (*value == NULL) {
+		    ret = ENOMEM;
+		    break;
+		}
+		(void) memcpy(*value, &buf[val_start], val_len);
+		(*value)[val_len] = '\0';
+	    }
+	    break;
+	}
+    }
+
+    if (loops)
+	*loops = loop_count;
+    return ret;
+}
+#endif
+
 /*
- * Open a file for binary searching.  The file will be read in entirely
- * if it is smaller than @max_sz, else a cache of @max_sz bytes will be
- * allocated.
+ * Open a file for binary searching.  The file will be mapped and its
+ * records indexed if mmap() is available, else it will be read in
+ * entirely if it is smaller than @max_sz, else a cache of @max_sz bytes
+ * will be allocated.
  *
  * Returns 0 on success, else an error number or -1 if the file is empty.
  *
@@ -412,6 +558,17 @@ _bsearch_file_open(const char *fname, size_t max_sz, size_t page_sz,
     new_bfh->page_sz = page_sz;
     new_bfh->file_sz = st.st_size;
 
+#if defined(HAVE_MMAP) && !defined(NO_MMAP)
+    if ((off_t)new_bfh->file_sz == st.st_size &&
+	map_file(new_bfh, fd) == 0) {
+	new_bfh->cache_sz = new_bfh->file_sz;
+	(void) close(fd);
+	new_bfh->fd = -1;
+	*bfh = new_bfh;
+	return 0;
+    }
+#endif
+
     if (max_sz >= st.st_size) {
 	/* Whole-file method */
 	new_bfh->cache = malloc(st.st_size + 1);
@@ -503,6 +660,11 @@ _bsearch_file_close(bsearch_file_handle *bfh)
 	return;
     if ((*bfh)->fd >= 0)
 	(void) close((*bfh)->fd);
+#if defined(HAVE_MMAP) && !defined(NO_MMAP)
+    if ((*bfh)->map)
+	(void) munmap((*bfh)->map, (*bfh)->file_sz);
+    free((*bfh)->lines);
+#endif
     if ((*bfh)->page)
 	free((*bfh)->page);
     if ((*bfh)->cache)
@@ -709,6 +871,15 @@ _bsearch_file(bsearch_file_handle bfh, const char *key,
     if (reads)
 	*reads = 0;
 
+#if defined(HAVE_MMAP) && !defined(NO_MMAP)
+    /* If the file is mapped then search its line index */
+    if (bfh->map) {
+	if (value)
+	    *value = NULL;
+	return bsearch_map(bfh, key, value, location, loops);
+    }
+#endif
+
     /* If whole file is in memory then search that and we're done */
     if (bfh->file_sz == bfh->cache_sz)
 	return _bsearch_text(bfh->cache, bfh->cache_sz, key, value, location, loops);
@@ -0,0 +1,719 @@
+/*
+ * Copyright (c) 2024 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Two things to make reading krb5.conf cheap for short lived processes:
+ *
+ * - A compiled copy of the parsed configuration, written to the file
+ *   set with heim_context_set_config_cache() and used instead of the
+ *   sources for as long as none of them (nor the directories given to
+ *   includedir) have changed.
+ *
+ * - A hash index of the tree heim_set_config_files() returns, so that
+ *   looking up a path in it does not compare every name of every
+ *   section on the way.
+ */
+
+#include "baselocl.h"
+
+#if defined(HAVE_MMAP) && !defined(NO_MMAP)
+#include <sys/mman.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/*
+ * Sources of the configuration being parsed, recorded while
+ * heim_set_config_files() parses for a cache.
+ */
+
+struct config_source {
+    char *path;
+    int present;
+    struct stat st;
+};
+
+struct config_sources {
+    size_t len;
+    struct config_source *val;
+    int error;
+};
+
+static HEIMDAL_THREAD_LOCAL struct config_sources *recording;
+
+void
+_heim_config_note_source(const char *path, const struct stat *st)
+{
+    struct config_source *s;
+
+    if (recording == NULL || recording->error)
+        return;
+    s = realloc(recording->val, (recording->len + 1) * sizeof(s[0]));
+    if (s == NULL) {
+        recording->error = ENOMEM;
+        return;
+    }
+    recording->val = s;
+    s = &recording->val[recording->len];
+    memset(s, 0, sizeof(*s));
+    if ((s->path = strdup(path)) == NULL) {
+        recording->error = ENOMEM;
+        return;
+    }
+    if (st != NULL) {
+        s->present = 1;
+        s->st = *st;
+    }
+    recording->len++;
+}
+
+static void
+free_sources(struct config_sources *sources)
+{
+    size_t i;
+
+    for (i = 0; i < sources->len; i++)
+        free(sources->val[i].path);
+    free(sources->val);
+    memset(sources, 0, sizeof(*sources));
+}
+
+/*
+ * The cache file, in host byte order:
+ *
+ *    header
+ *    sources[nsources]
+ *    nodes[nnodes]		tree in pre-order, node 0 is the root
+ *    files[nfiles]		offsets of the names given to
+ *				heim_set_config_files()
+ *    strings[strsize]
+ *
+ * Node and string references are offsets, node references are one
+ * based with zero meaning none and always point further into the
+ * array, so a valid file can only describe a tree.
+ */
+
+#define CACHE_MAGIC	"HEIMCFC"
+#define CACHE_VERSION	1
+#define CACHE_BOM	0x01020304
+
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t bom;
+    uint32_t homedir_access;
+    uint32_t nfiles;
+    uint32_t nsources;
+    uint32_t nnodes;
+    uint32_t strsize;
+    uint32_t pad;
+};
+
+struct cache_source {
+    uint32_t path;
+    uint32_t present;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime;
+    int64_t ctime;
+};
+
+struct cache_node {
+    uint32_t name;
+    uint32_t type;
+    uint32_t next;
+    uint32_t value;		/* string offset or first child */
+};
+
+static int
+source_changed(const struct cache_source *s, const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) == -1)
+        return s->present;
+    return !s->present ||
+        s->dev != (uint64_t)st.st_dev ||
+        s->ino != (uint64_t)st.st_ino ||
+        s->size != (int64_t)st.st_size ||
+        s->mtime != (int64_t)st.st_mtime ||
+        s->ctime != (int64_t)st.st_ctime;
+}
+
+/*
+ * Rebuild the tree from a cache image, checking everything, returns
+ * -1 when the image can not be used.
+ */
+
+static int
+load_image(heim_context context, const unsigned char *image, size_t len,
+           char **filenames, heim_config_section **res)
+{
+    const struct cache_header *h = (const void *)image;
+    const struct cache_source *sources;
+    const struct cache_node *nodes;
+    const uint32_t *files;
+    const char *strings;
+    heim_config_binding **b = NULL;
+    unsigned char *seen = NULL;
+    size_t i, off;
+
+    if (len < sizeof(*h) ||
+        memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != CACHE_VERSION || h->bom != CACHE_BOM ||
+        h->homedir_access != context->homedir_access ||
+        h->nnodes == 0)
+        return -1;
+
+    off = sizeof(*h);
+    if ((len - off) / sizeof(sources[0]) < h->nsources)
+        return -1;
+    sources = (const void *)(image + off);
+    off += h->nsources * sizeof(sources[0]);
+    if ((len - off) / sizeof(nodes[0]) < h->nnodes)
+        return -1;
+    nodes = (const void *)(image + off);
+    off += h->nnodes * sizeof(nodes[0]);
+    if ((len - off) / sizeof(files[0]) < h->nfiles)
+        return -1;
+    files = (const void *)(image + off);
+    off += h->nfiles * sizeof(files[0]);
+    if (len - off != h->strsize || h->strsize == 0 ||
+        image[len - 1] != '\0')
+        return -1;
+    strings = (const char *)image + off;
+
+    /* Same files asked for ... */
+    for (i = 0; i < h->nfiles; i++) {
+        if (filenames == NULL || filenames[i] == NULL ||
+            files[i] >= h->strsize ||
+            strcmp(filenames[i], strings + files[i]) != 0)
+            return -1;
+    }
+    if (filenames != NULL && filenames[i] != NULL && filenames[i][0] != '\0')
+        return -1;
+
+    /* ... and none of them changed */
+    for (i = 0; i < h->nsources; i++) {
+        if (sources[i].path >= h->strsize ||
+            source_changed(&sources[i], strings + sources[i].path))
+            return -1;
+    }
+
+    for (i = 0; i < h->nnodes; i++) {
+        const struct cache_node *n = &nodes[i];
+
+        if (n->name >= h->strsize ||
+            (n->next != 0 && (n->next <= i + 1 || n->next > h->nnodes)))
+            return -1;
+        if (n->type == heim_config_string) {
+            if (n->value >= h->strsize)
+                return -1;
+        } else if (n->type == heim_config_list) {
+            if (n->value != 0 && (n->value <= i + 1 || n->value > h->nnodes))
+                return -1;
+        } else {
+            return -1;
+        }
+    }
+
+    b = calloc(h->nnodes, sizeof(b[0]));
+    seen = calloc(h->nnodes, 1);
+    if (b == NULL || seen == NULL)
+        goto enomem;
+    for (i = 0; i < h->nnodes; i++) {
+        if ((b[i] = calloc(1, sizeof(*b[i]))) == NULL ||
+            (b[i]->name = strdup(strings + nodes[i].name)) == NULL)
+            goto enomem;
+        /* Lists are empty until linked below, strings are filled now */
+        b[i]->type = heim_config_list;
+    }
+
+    /* Each node but the root must be referenced exactly once */
+    for (i = 0; i < h->nnodes; i++) {
+        const struct cache_node *n = &nodes[i];
+
+        if (n->next != 0) {
+            if (seen[n->next - 1]++)
+                goto bad;
+            b[i]->next = b[n->next - 1];
+        }
+        if (n->type == heim_config_string) {
+            b[i]->type = heim_config_string;
+            b[i]->u.string = strdup(strings + n->value);
+            if (b[i]->u.string == NULL)
+                goto enomem;
+        } else if (n->value != 0) {
+            if (seen[n->value - 1]++)
+                goto bad;
+            b[i]->u.list = b[n->value - 1];
+        }
+    }
+    for (i = 1; i < h->nnodes; i++)
+        if (!seen[i])
+            goto bad;
+    if (seen[0])
+        goto bad;
+
+    *res = b[0];
+    free(seen);
+    free(b);
+    return 0;
+
+  bad:
+  enomem:
+    /* Nodes may not be linked into a tree yet, free them one by one */
+    for (i = 0; b != NULL && i < h->nnodes && b[i] != NULL; i++) {
+        free(b[i]->name);
+        if (b[i]->type == heim_config_string)
+            free(b[i]->u.string);
+        free(b[i]);
+    }
+    free(seen);
+    free(b);
+    return -1;
+}
+
+static int
+cache_load(heim_context context, char **filenames, heim_config_section **res)
+{
+    unsigned char *image = NULL;
+    struct stat st;
+    int mapped = 0;
+    int fd, ret = -1;
+
+    fd = open(context->config_cache, O_RDONLY | O_BINARY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    /*
+     * Whoever can write the cache decides the configuration, and paths
+     * in it may have been expanded for its owner.
+     */
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+#ifndef _WIN32
+        st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+#endif
+        st.st_size < (off_t)sizeof(struct cache_header) ||
+        st.st_size > 64 * 1024 * 1024)
+        goto out;
+
+#if defined(HAVE_MMAP) && !defined(NO_MMAP)
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED)
+        image = NULL;
+    else
+        mapped = 1;
+#endif
+    if (image == NULL) {
+        if ((image = malloc(st.st_size)) == NULL ||
+            net_read(fd, image, st.st_size) != st.st_size)
+            goto out;
+    }
+
+    ret = load_image(context, image, st.st_size, filenames, res);
+
+  out:
+#if defined(HAVE_MMAP) && !defined(NO_MMAP)
+    if (mapped)
+        munmap(image, st.st_size);
+    else
+#endif
+    free(image);
+    close(fd);
+    return ret;
+}
+
+struct cache_writer {
+    struct cache_node *nodes;
+    size_t nnodes;
+    char *strings;
+    size_t strsize;
+    size_t stralloc;
+};
+
+static int
+add_string(struct cache_writer *w, const char *s, uint32_t *off)
+{
+    size_t len = strlen(s) + 1;
+
+    if (w->strsize + len > w->stralloc) {
+        size_t n = max(w->stralloc * 2, w->strsize + len + 1024);
+        char *p = realloc(w->strings, n);
+
+        if (p == NULL)
+            return ENOMEM;
+        w->strings = p;
+        w->stralloc = n;
+    }
+    memcpy(w->strings + w->strsize, s, len);
+    *off = w->strsize;
+    w->strsize += len;
+    return 0;
+}
+
+static size_t
+count_nodes(const heim_config_binding *b)
+{
+    size_t n = 0;
+
+    for (; b != NULL; b = b->next) {
+        n++;
+        if (b->type == heim_config_list)
+            n += count_nodes(b->u.list);
+    }
+    return n;
+}
+
+/* Returns the one based index of the first node written */
+static int
+add_nodes(struct cache_writer *w, const heim_config_binding *b,
+          uint32_t *first)
+{
+    struct cache_node *prev = NULL;
+    int ret;
+
+    *first = 0;
+    for (; b != NULL; b = b->next) {
+        size_t i = w->nnodes++;
+        struct cache_node *n = &w->nodes[i];
+
+        if (prev != NULL)
+            prev->next = i + 1;
+        else
+            *first = i + 1;
+        n->type = b->type;
+        if ((ret = add_string(w, b->name, &n->name)))
+            return ret;
+        if (b->type == heim_config_string)
+            ret = add_string(w, b->u.string, &n->value);
+        else
+            ret = add_nodes(w, b->u.list, &n->value);
+        if (ret)
+            return ret;
+        /* w->nodes does not move, it is sized up front */
+        prev = n;
+    }
+    return 0;
+}
+
+static void
+cache_save(heim_context context,
+           char **filenames,
+           const struct config_sources *sources,
+           const heim_config_section *tree)
+{
+    struct cache_writer w;
+    struct cache_header h;
+    struct cache_source *cs = NULL;
+    uint32_t *files = NULL;
+    uint32_t root;
+    size_t i, nfiles = 0;
+    char *tmp = NULL;
+    int fd = -1;
+
+    memset(&w, 0, sizeof(w));
+    if (tree == NULL || sources->error)
+        return;
+
+    while (filenames != NULL && filenames[nfiles] != NULL &&
+           filenames[nfiles][0] != '\0')
+        nfiles++;
+
+    w.nodes = calloc(count_nodes(tree), sizeof(w.nodes[0]));
+    cs = calloc(sources->len ? sources->len : 1, sizeof(cs[0]));
+    files = calloc(nfiles ? nfiles : 1, sizeof(files[0]));
+    if (w.nodes == NULL || cs == NULL || files == NULL ||
+        add_nodes(&w, tree, &root))
+        goto out;
+
+    for (i = 0; i < sources->len; i++) {
+        const struct config_source *s = &sources->val[i];
+
+        if (add_string(&w, s->path, &cs[i].path))
+            goto out;
+        cs[i].present = s->present;
+        if (s->present) {
+            cs[i].dev = s->st.st_dev;
+            cs[i].ino = s->st.st_ino;
+            cs[i].size = s->st.st_size;
+            cs[i].mtime = s->st.st_mtime;
+            cs[i].ctime = s->st.st_ctime;
+        }
+    }
+    for (i = 0; i < nfiles; i++)
+        if (add_string(&w, filenames[i], &files[i]))
+            goto out;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+    h.version = CACHE_VERSION;
+    h.bom = CACHE_BOM;
+    h.homedir_access = context->homedir_access;
+    h.nfiles = nfiles;
+    h.nsources = sources->len;
+    h.nnodes = w.nnodes;
+    h.strsize = w.strsize;
+
+    /* Write a new file and rename it into place, readers never wait */
+    if (asprintf(&tmp, "%s.XXXXXX", context->config_cache) == -1 ||
+        tmp == NULL) {
+        tmp = NULL;
+        goto out;
+    }
+    if ((fd = mkstemp(tmp)) < 0)
+        goto out;
+    if (net_write(fd, &h, sizeof(h)) != sizeof(h) ||
+        net_write(fd, cs, sources->len * sizeof(cs[0])) !=
+            (ssize_t)(sources->len * sizeof(cs[0])) ||
+        net_write(fd, w.nodes, w.nnodes * sizeof(w.nodes[0])) !=
+            (ssize_t)(w.nnodes * sizeof(w.nodes[0])) ||
+        net_write(fd, files, nfiles * sizeof(files[0])) !=
+            (ssize_t)(nfiles * sizeof(files[0])) ||
+        net_write(fd, w.strings, w.strsize) != (ssize_t)w.strsize ||
+        close(fd) != 0) {
+        fd = -1;
+        (void) unlink(tmp);
+        goto out;
+    }
+    fd = -1;
+    if (rename(tmp, context->config_cache) != 0)
+        (void) unlink(tmp);
+
+  out:
+    if (fd >= 0) {
+        close(fd);
+        (void) unlink(tmp);
+    }
+    free(tmp);
+    free(files);
+    free(cs);
+    free(w.nodes);
+    free(w.strings);
+}
+
+/*
+ * The index: open addressing on (list, name, type), giving the first
+ * binding of that name and type in the list, which is what
+ * heim_config_vget_next() searches for at each step down the tree.
+ */
+
+struct config_index_entry {
+    const heim_config_binding *head;
+    const heim_config_binding *b;
+};
+
+struct heim_config_index {
+    const heim_config_section *root;
+    size_t mask;
+    struct config_index_entry *entries;
+};
+
+static size_t
+index_hash(const heim_config_binding *head, const char *name, int type)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 1099511628211ULL;
+    h ^= (uintptr_t)head >> 4;
+    h ^= (uint64_t)type << 32;
+    h *= 1099511628211ULL;
+    return (size_t)(h ^ (h >> 29));
+}
+
+static struct config_index_entry *
+index_slot(const struct heim_config_index *idx,
+           const heim_config_binding *head,
+           const char *name,
+           int type)
+{
+    size_t i = index_hash(head, name, type) & idx->mask;
+    struct config_index_entry *e;
+
+    for (;; i = (i + 1) & idx->mask) {
+        e = &idx->entries[i];
+        if (e->b == NULL ||
+            (e->head == head && e->b->type == (unsigned)type &&
+             strcmp(e->b->name, name) == 0))
+            return e;
+    }
+}
+
+static void
+index_add(struct heim_config_index *idx, const heim_config_binding *head)
+{
+    const heim_config_binding *b;
+    struct config_index_entry *e;
+
+    for (b = head; b != NULL; b = b->next) {
+        e = index_slot(idx, head, b->name, b->type);
+        if (e->b == NULL) {
+            e->head = head;
+            e->b = b;
+        }
+        if (b->type == heim_config_list)
+            index_add(idx, b->u.list);
+    }
+}
+
+void
+_heim_config_index_free(heim_context context)
+{
+    if (context->config_index == NULL)
+        return;
+    free(context->config_index->entries);
+    free(context->config_index);
+    context->config_index = NULL;
+}
+
+void
+_heim_config_index_build(heim_context context, const heim_config_section *root)
+{
+    struct heim_config_index *idx;
+    size_t n, size = 16;
+
+    _heim_config_index_free(context);
+    if (root == NULL)
+        return;
+
+    n = count_nodes(root);
+    while (size < n * 2)
+        size *= 2;
+    if ((idx = calloc(1, sizeof(*idx))) == NULL)
+        return;
+    if ((idx->entries = calloc(size, sizeof(idx->entries[0]))) == NULL) {
+        free(idx);
+        return;
+    }
+    idx->root = root;
+    idx->mask = size - 1;
+    index_add(idx, root);
+    context->config_index = idx;
+}
+
+/*
+ * Return the first binding of the given name and type in the list
+ * `head', which must be the indexed tree or a list under it.
+ */
+
+const heim_config_binding *
+_heim_config_index_lookup(heim_context context,
+                          const heim_config_binding *head,
+                          const char *name,
+                          int type)
+{
+    return index_slot(context->config_index, head, name, type)->b;
+}
+
+int
+_heim_config_index_covers(heim_context context, const heim_config_section *c)
+{
+    return context != NULL && context->config_index != NULL &&
+        context->config_index->root == c;
+}
+
+/**
+ * Set a file to keep a compiled copy of the configuration in, used by
+ * heim_set_config_files() while none of its sources change.  NULL
+ * turns this off.
+ *
+ * @param context A heim context
+ * @param path the cache file, it must be owned by the caller
+ *
+ * @return Return an error code or 0, see heim_get_error_message().
+ *
+ * @ingroup heim_support
+ */
+
+heim_error_code
+heim_context_set_config_cache(heim_context context, const char *path)
+{
+    char *s = NULL;
+
+    if (path != NULL && (s = strdup(path)) == NULL)
+        return heim_enomem(context);
+    free(context->config_cache);
+    context->config_cache = s;
+    return 0;
+}
+
+static heim_error_code
+parse_files(heim_context context, char **filenames, heim_config_binding **res)
+{
+    heim_error_code ret;
+
+    while (filenames != NULL && *filenames != NULL && **filenames != '\0') {
+        ret = heim_config_parse_file_multi(context, *filenames, res);
+        if (ret != 0 && ret != ENOENT && ret != EACCES && ret != EPERM
+            && ret != HEIM_ERR_CONFIG_BADFORMAT) {
+            heim_config_file_free(context, *res);
+            *res = NULL;
+            return ret;
+        }
+        filenames++;
+    }
+    return 0;
+}
+
+/*
+ * Parse `filenames' into `res', through the cache if one is set.
+ */
+
+heim_error_code
+_heim_config_parse_files(heim_context context, char **filenames,
+                         heim_config_binding **res)
+{
+    struct config_sources sources, *saved = recording;
+    heim_error_code ret;
+
+    *res = NULL;
+    if (context->config_cache == NULL)
+        return parse_files(context, filenames, res);
+    if (cache_load(context, filenames, res) == 0)
+        return 0;
+
+    memset(&sources, 0, sizeof(sources));
+    recording = &sources;
+    ret = parse_files(context, filenames, res);
+    recording = saved;
+    if (ret == 0)
+        cache_save(context, filenames, &sources, *res);
+    free_sources(&sources);
+    return ret;
+}
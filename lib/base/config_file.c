@@ -490,10 +490,17 @@ heim_config_parse_dir_multi(heim_context context,
 {
     struct dirent *entry;
     heim_error_code ret;
+    struct stat st;
     DIR *d;
 
-    if ((d = opendir(dname)) == NULL)
-        return errno;
+    /* Adding or removing a fragment changes the directory */
+    if ((d = opendir(dname)) == NULL) {
+        ret = errno;
+        _heim_config_note_source(dname, NULL);
+        return ret;
+    }
+    if (stat(dname, &st) == 0)
+        _heim_config_note_source(dname, &st);
 
     while ((entry = readdir(d)) != NULL) {
         char *p = entry->d_name;
@@ -591,6 +598,7 @@ heim_config_parse_file_multi(heim_context context,
 
     if (is_plist_file(fname)) {
 #if defined(HAVE_FRAMEWORK_COREFOUNDATION)
+        _heim_config_note_source(fname, stat(fname, &st) == 0 ? &st : NULL);
         ret = parse_plist_config(context, fname, res);
         if (ret) {
             heim_set_error_message(context, ret,
@@ -622,13 +630,15 @@ heim_config_parse_file_multi(heim_context context,
         f.f = fopen(fname, "r");
         f.s = NULL;
         if (f.f == NULL || fstat(fileno(f.f), &st) == -1) {
+            ret = errno;
             if (f.f != NULL)
                 (void) fclose(f.f);
-            ret = errno;
+            _heim_config_note_source(fname, NULL);
             heim_set_error_message(context, ret, "open or stat %s: %s",
                                    fname, strerror(ret));
             goto out;
         }
+        _heim_config_note_source(fname, &st);
 
         if (!S_ISREG(st.st_mode)) {
             (void) fclose(f.f);
@@ -703,6 +713,8 @@ free_binding(heim_context context, heim_config_binding *b)
 heim_error_code
 heim_config_file_free(heim_context context, heim_config_section *s)
 {
+    if (s != NULL && _heim_config_index_covers(context, s))
+        _heim_config_index_free(context);
     free_binding (context, s);
     return 0;
 }
@@ -782,6 +794,31 @@ vget_next(heim_context context,
     return NULL;
 }
 
+/* vget_next() through the index of the context's configuration */
+static const void *
+vget_next_indexed(heim_context context,
+                  const heim_config_binding *b,
+                  const heim_config_binding **pointer,
+                  int type,
+                  const char *name,
+                  va_list args)
+{
+    const char *p;
+
+    while ((p = va_arg(args, const char *)) != NULL) {
+        b = _heim_config_index_lookup(context, b, name, heim_config_list);
+        if (b == NULL)
+            return NULL;
+        b = b->u.list;
+        name = p;
+    }
+    b = _heim_config_index_lookup(context, b, name, type);
+    if (b == NULL)
+        return NULL;
+    *pointer = b;
+    return b->u.generic;
+}
+
 const void *
 heim_config_vget_next(heim_context context,
                       const heim_config_section *c,
@@ -801,6 +838,8 @@ heim_config_vget_next(heim_context context,
         p = va_arg(args, const char *);
         if (p == NULL)
             return NULL;
+        if (_heim_config_index_covers(context, c))
+            return vget_next_indexed(context, c, pointer, type, p, args);
         return vget_next(context, c, pointer, type, p, args);
     }
 
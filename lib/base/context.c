@@ -52,6 +52,9 @@ heim_context_init(void)
     context->log_dest = NULL;
     context->time_fmt = NULL;
     context->et_list = NULL;
+#ifndef _WIN32
+    HEIMDAL_MUTEX_init(&context->expand_cache.mutex);
+#endif
     return context;
 }
 
@@ -67,8 +70,16 @@ heim_context_free(heim_context *contextp)
     heim_closelog(context, context->warn_dest);
     heim_closelog(context, context->log_dest);
     free_error_table(context->et_list);
+    _heim_config_index_free(context);
+    free(context->config_cache);
     free(context->time_fmt);
     free(context->error_string);
+#ifndef _WIN32
+    HEIMDAL_MUTEX_destroy(&context->expand_cache.mutex);
+    free(context->expand_cache.homedir);
+    free(context->expand_cache.username);
+    free(context->expand_cache.loginname);
+#endif
     free(context);
 }
 
@@ -358,19 +369,11 @@ heim_error_code
 heim_set_config_files(heim_context context, char **filenames,
                       heim_config_binding **res)
 {
-    heim_error_code ret = 0;
-
-    *res = NULL;
-    while (filenames != NULL && *filenames != NULL && **filenames != '\0') {
-        ret = heim_config_parse_file_multi(context, *filenames, res);
-        if (ret != 0 && ret != ENOENT && ret != EACCES && ret != EPERM
-            && ret != HEIM_ERR_CONFIG_BADFORMAT) {
-            heim_config_file_free(context, *res);
-            *res = NULL;
-            return ret;
-        }
-        filenames++;
-    }
+    heim_error_code ret;
+
+    ret = _heim_config_parse_files(context, filenames, res);
+    if (ret)
+        return ret;
 
 #ifdef _WIN32
     /*
@@ -380,6 +383,7 @@ heim_set_config_files(heim_context context, char **filenames,
                                    REGPATH_HEIMDAL, res);
 
 #endif
+    _heim_config_index_build(context, *res);
     return 0;
 }
 
@@ -301,6 +301,8 @@ dbtype_iter2create_f(heim_object_t dbtype, heim_object_t junk, void *arg)
  *  - "read-only", with any value (disallow writes)
  *  - "sync", with any value (make transactions durable)
  *  - "journal-name", with a string value naming a journal file name
+ *  - "append-journal", with any value (JSON DBs only: commits append
+ *    to <dbname>.journal instead of rewriting the whole file)
  *
  * @param dbtype  Name of DB type
  * @param dbname  Name of DB (likely a file path)
@@ -1305,10 +1307,31 @@ read_json(const char *dbname, heim_object_t *out, heim_error_t *error)
     return 0;
 }
 
+/*
+ * With the "append-journal" option, commits don't rewrite the whole
+ * JSON file.  Instead the changes are appended to <dbname>.journal as
+ * records of the form
+ *
+ *	<length>:["s", table, key, value]\n
+ *	<length>:["d", table, key]\n
+ *
+ * and replayed on top of the JSON file when it's read.  Once the
+ * journal has grown larger than the DB itself (and JSON_DB_COMPACT_MIN)
+ * the committer folds it back into the JSON file, so the cost of a
+ * commit is amortized O(size of the change).  Replaying a record that
+ * is already in the JSON file is harmless, which makes compaction
+ * crash-safe.  A torn record at the end of the journal is ignored.
+ */
+
+#define JSON_DB_COMPACT_MIN (1024 * 1024)
+
 typedef struct json_db {
     heim_dict_t dict;
     heim_string_t dbname;
     heim_string_t bkpname;
+    heim_string_t journalname;	/* NULL unless append-journal */
+    heim_array_t pending;	/* changes not yet in the journal */
+    off_t journal_size;		/* journal bytes reflected in dict */
     int fd;
     time_t last_read_time;
     unsigned int read_only:1;
@@ -1316,6 +1339,321 @@ typedef struct json_db {
     unsigned int locked_needs_unlink:1;
 } *json_db_t;
 
+static int json_db_close(void *, heim_error_t *);
+
+static int
+json_db_write(void *ctx, const void *data, size_t len)
+{
+    int fd = *(int *)ctx;
+    ssize_t bytes;
+
+    while (len > 0) {
+	bytes = write(fd, data, len);
+	if (bytes < 0 && errno == EINTR)
+	    continue;
+	if (bytes <= 0)
+	    return errno ? errno : EIO;
+	data = (const char *)data + bytes;
+	len -= bytes;
+    }
+    return 0;
+}
+
+static int
+json_db_apply(json_db_t jsondb, heim_object_t rec)
+{
+    heim_object_t op, table, key;
+
+    if (heim_get_tid(rec) != HEIM_TID_ARRAY ||
+	heim_array_get_length(rec) < 3)
+	return EINVAL;
+    op = heim_array_get_value(rec, 0);
+    table = heim_array_get_value(rec, 1);
+    key = heim_array_get_value(rec, 2);
+    if (heim_get_tid(op) != HEIM_TID_STRING)
+	return EINVAL;
+
+    if (strcmp(heim_string_get_utf8(op), "s") == 0 &&
+	heim_array_get_length(rec) == 4)
+	return heim_path_create(jsondb->dict, 29,
+				heim_array_get_value(rec, 3), NULL,
+				table, key, NULL);
+    if (strcmp(heim_string_get_utf8(op), "d") == 0) {
+	heim_path_delete(jsondb->dict, NULL, table, key, NULL);
+	return 0;
+    }
+    return EINVAL;
+}
+
+/* Apply the journal records past jsondb->journal_size to the dict */
+static int
+json_db_read_journal(json_db_t jsondb, heim_error_t *error)
+{
+    const char *fname = heim_string_get_utf8(jsondb->journalname);
+    heim_object_t rec;
+    struct stat st;
+    char *buf, *p, *end, *q;
+    unsigned long len;
+    ssize_t bytes;
+    int fd, ret = 0;
+
+    fd = open(fname, O_RDONLY);
+    if (fd < 0)
+	return errno == ENOENT ? 0 : HEIM_ERROR(error, errno,
+	    (errno, N_("Could not open JSON DB journal %s: %s", ""),
+	     fname, strerror(errno)));
+    if (fstat(fd, &st) == -1 || st.st_size <= jsondb->journal_size) {
+	(void) close(fd);
+	return 0;
+    }
+
+    buf = malloc(st.st_size - jsondb->journal_size + 1);
+    if (buf == NULL) {
+	(void) close(fd);
+	return HEIM_ENOMEM(error);
+    }
+    if (lseek(fd, jsondb->journal_size, SEEK_SET) == -1)
+	bytes = -1;
+    else
+	bytes = read(fd, buf, st.st_size - jsondb->journal_size);
+    (void) close(fd);
+    if (bytes < 0) {
+	free(buf);
+	return HEIM_ERROR(error, errno,
+			  (errno, N_("Could not read JSON DB journal %s: %s", ""),
+			   fname, strerror(errno)));
+    }
+    buf[bytes] = '\0';
+
+    for (p = buf, end = buf + bytes; p < end; p = q + len + 1) {
+	len = strtoul(p, &q, 10);
+	if (q == p || *q != ':' || len > (unsigned long)(end - q - 1) ||
+	    q[1 + len] != '\n')
+	    break; /* torn write at the end of the journal */
+	q++;
+	rec = heim_json_create_with_bytes(q, len, 10, 0, NULL);
+	if (rec == NULL) {
+	    ret = EINVAL;
+	    break;
+	}
+	ret = json_db_apply(jsondb, rec);
+	heim_release(rec);
+	if (ret)
+	    break;
+	jsondb->journal_size += (q + len + 1) - p;
+    }
+    free(buf);
+    if (ret)
+	return HEIM_ERROR(error, ret,
+			  (ret, N_("Invalid JSON DB journal %s", ""), fname));
+    return 0;
+}
+
+/* Re-read the JSON file and the whole journal */
+static int
+json_db_reload(json_db_t jsondb, heim_error_t *error)
+{
+    heim_dict_t contents = NULL;
+    int ret;
+
+    /* Ignore file is gone (ENOENT) */
+    ret = read_json(heim_string_get_utf8(jsondb->dbname),
+		    (heim_object_t *)&contents, error);
+    if (ret)
+	return ret;
+    if (contents == NULL)
+	contents = heim_dict_create(29);
+    if (contents == NULL)
+	return HEIM_ENOMEM(error);
+    heim_release(jsondb->dict);
+    jsondb->dict = contents;
+    jsondb->last_read_time = time(NULL);
+    jsondb->journal_size = 0;
+    if (jsondb->journalname)
+	return json_db_read_journal(jsondb, error);
+    return 0;
+}
+
+static int
+json_db_log(json_db_t jsondb, heim_string_t op, heim_string_t table,
+	    heim_string_t key, heim_object_t value)
+{
+    heim_array_t rec;
+    int ret;
+
+    if (jsondb->pending == NULL &&
+	(jsondb->pending = heim_array_create()) == NULL)
+	return ENOMEM;
+    rec = heim_array_create();
+    if (rec == NULL)
+	return ENOMEM;
+    ret = heim_array_append_value(rec, op);
+    if (ret == 0)
+	ret = heim_array_append_value(rec, table);
+    if (ret == 0)
+	ret = heim_array_append_value(rec, key);
+    if (ret == 0 && value)
+	ret = heim_array_append_value(rec, value);
+    if (ret == 0)
+	ret = heim_array_append_value(jsondb->pending, rec);
+    heim_release(rec);
+    return ret;
+}
+
+struct json_db_journal_buf {
+    char *str;
+    size_t len;
+    int ret;
+};
+
+static void
+json_db_journal_add(heim_object_t rec, void *arg, int *stop)
+{
+    struct json_db_journal_buf *b = arg;
+    heim_string_t json;
+    const char *str;
+    char *p;
+    int n;
+
+    json = heim_json_copy_serialize(rec, HEIM_JSON_F_ONE_LINE, NULL);
+    if (json == NULL) {
+	b->ret = ENOMEM;
+	*stop = 1;
+	return;
+    }
+    str = heim_string_get_utf8(json);
+    n = strlen(str);
+    if (n > 0 && str[n - 1] == '\n')
+	n--;
+    p = realloc(b->str, b->len + n + 32);
+    if (p == NULL) {
+	heim_release(json);
+	b->ret = ENOMEM;
+	*stop = 1;
+	return;
+    }
+    b->str = p;
+    b->len += snprintf(b->str + b->len, n + 32, "%d:%.*s\n", n, n, str);
+    heim_release(json);
+}
+
+/*
+ * Fold the journal into the JSON file.  Called with the DB locked; the
+ * new file is written under a different name than the lock file so
+ * that the lock is held until the journal has been truncated.
+ */
+static int
+json_db_compact(json_db_t jsondb, heim_error_t *error)
+{
+    const char *dbname = heim_string_get_utf8(jsondb->dbname);
+    char *tmpname = NULL;
+    heim_error_t e = NULL;
+    int fd, ret;
+
+    ret = json_db_reload(jsondb, error);
+    if (ret)
+	return ret;
+
+    if (asprintf(&tmpname, "%s.compact", dbname) == -1 || tmpname == NULL)
+	return HEIM_ENOMEM(error);
+    fd = open(tmpname, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (fd < 0) {
+	ret = errno;
+	free(tmpname);
+	return HEIM_ERROR(error, ret,
+			  (ret, N_("Could not compact JSON DB %s: %s", ""),
+			   dbname, strerror(ret)));
+    }
+    ret = heim_json_serialize(jsondb->dict, 0, json_db_write, &fd, &e);
+    if (ret == 0 && fsync(fd) == -1)
+	ret = errno;
+    if (close(fd) == -1 && ret == 0)
+	ret = errno;
+    if (ret == 0 && rename(tmpname, dbname) == -1)
+	ret = errno;
+    if (ret) {
+	(void) unlink(tmpname);
+	free(tmpname);
+	if (error)
+	    *error = e;
+	else
+	    heim_release(e);
+	return ret;
+    }
+    free(tmpname);
+
+    fd = open(heim_string_get_utf8(jsondb->journalname),
+	      O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (fd > -1)
+	(void) close(fd);
+    jsondb->journal_size = 0;
+    jsondb->last_read_time = time(NULL);
+    return 0;
+}
+
+static int
+json_db_sync_journal(json_db_t jsondb, heim_error_t *error)
+{
+    const char *fname = heim_string_get_utf8(jsondb->journalname);
+    struct json_db_journal_buf b;
+    struct stat st;
+    off_t before;
+    int fd, ret;
+
+    if (jsondb->pending == NULL || heim_array_get_length(jsondb->pending) == 0)
+	return 0;
+
+    b.str = NULL;
+    b.len = 0;
+    b.ret = 0;
+    heim_array_iterate_f(jsondb->pending, &b, json_db_journal_add);
+    heim_release(jsondb->pending);
+    jsondb->pending = NULL;
+    if (b.ret) {
+	free(b.str);
+	return HEIM_ENOMEM(error);
+    }
+
+    fd = open(fname, O_CREAT | O_WRONLY | O_APPEND, 0600);
+    if (fd < 0) {
+	ret = errno;
+	free(b.str);
+	return HEIM_ERROR(error, ret,
+			  (ret, N_("Could not open JSON DB journal %s: %s", ""),
+			   fname, strerror(ret)));
+    }
+    before = fstat(fd, &st) == 0 ? st.st_size : -1;
+    ret = json_db_write(&fd, b.str, b.len);
+    free(b.str);
+    if (ret == 0 && fsync(fd) == -1)
+	ret = errno;
+    if (ret == 0 && fstat(fd, &st) == -1)
+	ret = errno;
+    (void) close(fd);
+    if (ret) {
+	/* A partial record is ignored by readers */
+	return HEIM_ERROR(error, ret,
+			  (ret, N_("Could not write JSON DB journal %s: %s", ""),
+			   fname, strerror(ret)));
+    }
+
+    /*
+     * Our dict already has these changes; if nobody else appended
+     * since we last read the journal it now reflects all of it.
+     */
+    if (before == jsondb->journal_size)
+	jsondb->journal_size = st.st_size;
+
+    if (st.st_size > JSON_DB_COMPACT_MIN) {
+	struct stat dbst;
+
+	if (stat(heim_string_get_utf8(jsondb->dbname), &dbst) == -1 ||
+	    st.st_size > dbst.st_size)
+	    return json_db_compact(jsondb, error);
+    }
+    return 0;
+}
+
 static int
 json_db_open(void *plug, const char *dbtype, const char *dbname,
 	     heim_dict_t options, void **db, heim_error_t *error)
@@ -1324,6 +1662,7 @@ json_db_open(void *plug, const char *dbtype, const char *dbname,
     heim_dict_t contents = NULL;
     heim_string_t dbname_s = NULL;
     heim_string_t bkpname_s = NULL;
+    heim_string_t journalname_s = NULL;
 
     if (error)
 	*error = NULL;
@@ -1343,14 +1682,27 @@ json_db_open(void *plug, const char *dbtype, const char *dbname,
 	if (options) {
 	    heim_object_t vc, ve, vt;
 
+#ifndef WIN32
+	    if (heim_dict_get_value(options, HSTR("append-journal"))) {
+		journalname_s = heim_string_create_with_format("%s.journal",
+							       dbname);
+		if (journalname_s == NULL)
+		    return HEIM_ENOMEM(error);
+	    }
+#endif
 	    vc = heim_dict_get_value(options, HSTR("create"));
 	    ve = heim_dict_get_value(options, HSTR("exclusive"));
 	    vt = heim_dict_get_value(options, HSTR("truncate"));
 	    if (vc && vt) {
 		ret = open_file(dbname, 1, ve ? 1 : 0, NULL, error);
-		if (ret)
+		if (ret) {
+		    heim_release(journalname_s);
 		    return ret;
+		}
+		if (journalname_s)
+		    (void) unlink(heim_string_get_utf8(journalname_s));
 	    } else if (vc || ve || vt) {
+		heim_release(journalname_s);
 		return HEIM_ERROR(error, EINVAL,
 				  (EINVAL, N_("Invalid JSON DB open options",
 					      "")));
@@ -1376,12 +1728,15 @@ json_db_open(void *plug, const char *dbtype, const char *dbname,
 	    heim_dict_delete_key(options, HSTR("truncate"));
 	}
 	dbname_s = heim_string_create(dbname);
-	if (dbname_s == NULL)
+	if (dbname_s == NULL) {
+	    heim_release(journalname_s);
 	    return HEIM_ENOMEM(error);
+	}
 	
 	len = snprintf(NULL, 0, "%s~", dbname);
 	bkpname = malloc(len + 2);
 	if (bkpname == NULL) {
+	    heim_release(journalname_s);
 	    heim_release(dbname_s);
 	    return HEIM_ENOMEM(error);
 	}
@@ -1389,18 +1744,21 @@ json_db_open(void *plug, const char *dbtype, const char *dbname,
 	bkpname_s = heim_string_create(bkpname);
 	free(bkpname);
 	if (bkpname_s == NULL) {
+	    heim_release(journalname_s);
 	    heim_release(dbname_s);
 	    return HEIM_ENOMEM(error);
 	}
 
 	ret = read_json(dbname, (heim_object_t *)&contents, error);
 	if (ret) {
+	    heim_release(journalname_s);
 	    heim_release(bkpname_s);
 	    heim_release(dbname_s);
 	    return ret;
         }
 
 	if (contents != NULL && heim_get_tid(contents) != HEIM_TID_DICT) {
+	    heim_release(journalname_s);
 	    heim_release(bkpname_s);
 	    heim_release(dbname_s);
 	    return HEIM_ERROR(error, EINVAL,
@@ -1414,6 +1772,7 @@ json_db_open(void *plug, const char *dbtype, const char *dbname,
 	heim_release(contents);
 	heim_release(dbname_s);
 	heim_release(bkpname_s);
+	heim_release(journalname_s);
 	return ENOMEM;
     }
 
@@ -1421,6 +1780,9 @@ json_db_open(void *plug, const char *dbtype, const char *dbname,
     jsondb->fd = -1;
     jsondb->dbname = dbname_s;
     jsondb->bkpname = bkpname_s;
+    jsondb->journalname = journalname_s;
+    jsondb->pending = NULL;
+    jsondb->journal_size = 0;
     jsondb->read_only = 0;
 
     if (contents != NULL)
@@ -1428,11 +1790,23 @@ json_db_open(void *plug, const char *dbtype, const char *dbname,
     else {
 	jsondb->dict = heim_dict_create(29);
 	if (jsondb->dict == NULL) {
+	    heim_release(jsondb->dbname);
+	    heim_release(jsondb->bkpname);
+	    heim_release(jsondb->journalname);
 	    heim_release(jsondb);
 	    return ENOMEM;
 	}
     }
 
+    if (jsondb->journalname) {
+	int ret = json_db_read_journal(jsondb, error);
+
+	if (ret) {
+	    (void) json_db_close(jsondb, NULL);
+	    return ret;
+	}
+    }
+
     *db = jsondb;
     return 0;
 }
@@ -1449,6 +1823,8 @@ json_db_close(void *db, heim_error_t *error)
     jsondb->fd = -1;
     heim_release(jsondb->dbname);
     heim_release(jsondb->bkpname);
+    heim_release(jsondb->journalname);
+    heim_release(jsondb->pending);
     heim_release(jsondb->dict);
     heim_release(jsondb);
     return 0;
@@ -1490,6 +1866,8 @@ json_db_unlock(void *db, heim_error_t *error)
     if (jsondb->locked_needs_unlink)
 	unlink(heim_string_get_utf8(jsondb->bkpname));
     jsondb->locked_needs_unlink = 0;
+    heim_release(jsondb->pending);
+    jsondb->pending = NULL;
     return ret;
 }
 
@@ -1497,10 +1875,7 @@ static int
 json_db_sync(void *db, heim_error_t *error)
 {
     json_db_t jsondb = db;
-    size_t len, bytes;
-    heim_error_t e;
-    heim_string_t json;
-    const char *json_text = NULL;
+    heim_error_t e = NULL;
     int ret = 0;
     int fd = -1;
 #ifdef WIN32
@@ -1509,18 +1884,8 @@ json_db_sync(void *db, heim_error_t *error)
 
     heim_assert(jsondb->fd > -1, "DB not locked when sync attempted");
 
-    json = heim_json_copy_serialize(jsondb->dict, 0, &e);
-    if (json == NULL) {
-	if (error)
-	    *error = e;
-	else
-	    heim_release(e);
-	return heim_error_get_code(e);
-    }
-
-    json_text = heim_string_get_utf8(json);
-    len = strlen(json_text);
-    errno = 0;
+    if (jsondb->journalname)
+	return json_db_sync_journal(jsondb, error);
 
 #ifdef WIN32
     while (tries--) {
@@ -1529,18 +1894,25 @@ json_db_sync(void *db, heim_error_t *error)
 	    break;
 	sleep(1);
     }
-    if (ret) {
-	heim_release(json);
+    if (ret)
 	return ret;
-    }
 #else
     fd = jsondb->fd;
 #endif /* WIN32 */
 
-    bytes = write(fd, json_text, len);
-    heim_release(json);
-    if (bytes != len)
-	return errno ? errno : EIO;
+    /* Stream the DB to the file rather than building it in memory */
+    errno = 0;
+    ret = heim_json_serialize(jsondb->dict, 0, json_db_write, &fd, &e);
+    if (ret) {
+	if (error)
+	    *error = e;
+	else
+	    heim_release(e);
+#ifdef WIN32
+	(void) close(fd);
+#endif
+	return ret;
+    }
     ret = fsync(fd);
     if (ret)
 	return ret;
@@ -1588,19 +1960,20 @@ json_db_copy_value(void *db, heim_string_t table, heim_data_t key,
 
     if (st.st_mtime > jsondb->last_read_time ||
 	st.st_ctime > jsondb->last_read_time) {
-	heim_dict_t contents = NULL;
-	int ret;
-
-	/* Ignore file is gone (ENOENT) */
-	ret = read_json(heim_string_get_utf8(jsondb->dbname),
-		(heim_object_t *)&contents, error);
+	if (json_db_reload(jsondb, error))
+	    return NULL;
+    } else if (jsondb->journalname) {
+	struct stat jst;
+	int ret = 0;
+
+	/* A journal shorter than what we've read has been compacted */
+	if (stat(heim_string_get_utf8(jsondb->journalname), &jst) == 0 &&
+	    jst.st_size < jsondb->journal_size)
+	    ret = json_db_reload(jsondb, error);
+	else
+	    ret = json_db_read_journal(jsondb, error);
 	if (ret)
 	    return NULL;
-	if (contents == NULL)
-	    contents = heim_dict_create(29);
-	heim_release(jsondb->dict);
-	jsondb->dict = contents;
-	jsondb->last_read_time = time(NULL);
     }
 
     key_string = heim_string_create_with_bytes(key_data->data,
@@ -1642,6 +2015,8 @@ json_db_set_value(void *db, heim_string_t table,
 	table = HSTR("");
 
     ret = heim_path_create(jsondb->dict, 29, value, error, table, key_string, NULL);
+    if (ret == 0 && jsondb->journalname)
+	ret = json_db_log(jsondb, HSTR("s"), table, key_string, value);
     heim_release(key_string);
     return ret;
 }
@@ -1672,6 +2047,11 @@ json_db_del_key(void *db, heim_string_t table, heim_data_t key,
 	table = HSTR("");
 
     heim_path_delete(jsondb->dict, error, table, key_string, NULL);
+    if (jsondb->journalname &&
+	json_db_log(jsondb, HSTR("d"), table, key_string, NULL) != 0) {
+	heim_release(key_string);
+	return HEIM_ENOMEM(error);
+    }
     heim_release(key_string);
     return 0;
 }
@@ -35,30 +35,47 @@
 
 #include "baselocl.h"
 
+/*
+ * Open addressing with linear probing.  Entries live in the table
+ * itself and remember the hash of their key, so that probing only
+ * calls heim_cmp() on likely matches and growing the table does not
+ * hash the keys again.  The table size is a power of two and is
+ * doubled when it becomes three quarters full.  Deleted entries are
+ * marked with a tombstone so that probe sequences stay intact; they
+ * are dropped when the table is resized.
+ */
+
 struct hashentry {
-    struct hashentry **prev;
-    struct hashentry *next;
     heim_object_t key;
     heim_object_t value;
+    uintptr_t hash;
 };
 
 struct heim_dict_data {
-    size_t size;
-    struct hashentry **tab;
+    size_t size;	/* number of slots, power of two */
+    size_t count;	/* live entries */
+    size_t used;	/* live entries and tombstones */
+    struct hashentry *tab;
 };
 
+#define DICT_MIN_SIZE 8
+
+/* pointer aligned, so it can't be mistaken for a tagged object */
+static heim_object_t dict_tombstone[1];
+#define TOMBSTONE ((heim_object_t)dict_tombstone)
+
+#define LIVE_P(e) ((e)->key != NULL && (e)->key != TOMBSTONE)
+
 static void
 dict_dealloc(void *ptr)
 {
     heim_dict_t dict = ptr;
-    struct hashentry **h, *g, *i;
-
-    for (h = dict->tab; h < &dict->tab[dict->size]; ++h) {
-	for (g = h[0]; g; g = i) {
-	    i = g->next;
-	    heim_release(g->key);
-	    heim_release(g->value);
-	    free(g);
+    size_t i;
+
+    for (i = 0; i < dict->size; i++) {
+	if (LIVE_P(&dict->tab[i])) {
+	    heim_release(dict->tab[i].key);
+	    heim_release(dict->tab[i].value);
 	}
     }
     free(dict->tab);
@@ -75,32 +92,30 @@ struct heim_type_data dict_object = {
     NULL
 };
 
-static size_t
-isprime(size_t p)
-{
-    size_t q, i;
+/*
+ * Many objects hash to their address, whose low bits are mostly
+ * zero; spread the bits before masking with the table size.
+ */
 
-    for(i = 2 ; i < p; i++) {
-	q = p / i;
+static uintptr_t
+dict_hash(heim_object_t key)
+{
+    uintptr_t h = heim_get_hash(key);
 
-	if (i * q == p)
-	    return 0;
-	if (i * i > p)
-	    return 1;
-    }
-    return 1;
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return h;
 }
 
 static size_t
-findprime(size_t p)
+dict_size_for(size_t count)
 {
-    if (p % 2 == 0)
-	p++;
-
-    while (isprime(p) == 0)
-	p += 2;
+    size_t size = DICT_MIN_SIZE;
 
-    return p;
+    while (size / 4 * 3 < count + 1)
+	size <<= 1;
+    return size;
 }
 
 /**
@@ -115,13 +130,10 @@ heim_dict_create(size_t size)
     heim_dict_t dict;
 
     dict = _heim_alloc_object(&dict_object, sizeof(*dict));
-
-    dict->size = findprime(size);
-    if (dict->size == 0) {
-	heim_release(dict);
+    if (dict == NULL)
 	return NULL;
-    }
 
+    dict->size = dict_size_for(size);
     dict->tab = calloc(dict->size, sizeof(dict->tab[0]));
     if (dict->tab == NULL) {
 	dict->size = 0;
@@ -147,18 +159,59 @@ heim_dict_get_type_id(void)
 /* Intern search function */
 
 static struct hashentry *
-_search(heim_dict_t dict, heim_object_t ptr)
+_search(heim_dict_t dict, heim_object_t ptr, uintptr_t v)
 {
-    uintptr_t v = heim_get_hash(ptr);
+    size_t mask = dict->size - 1;
+    size_t i = v & mask;
     struct hashentry *p;
 
-    for (p = dict->tab[v % dict->size]; p != NULL; p = p->next)
-	if (heim_cmp(ptr, p->key) == 0)
+    for (p = &dict->tab[i]; p->key != NULL; p = &dict->tab[i]) {
+	if (p->key != TOMBSTONE && p->hash == v && heim_cmp(ptr, p->key) == 0)
 	    return p;
+	i = (i + 1) & mask;
+    }
 
     return NULL;
 }
 
+/* Find the slot a key that is not in the table goes to */
+
+static struct hashentry *
+_free_slot(heim_dict_t dict, uintptr_t v)
+{
+    size_t mask = dict->size - 1;
+    size_t i = v & mask;
+
+    while (LIVE_P(&dict->tab[i]))
+	i = (i + 1) & mask;
+    return &dict->tab[i];
+}
+
+static int
+_resize(heim_dict_t dict, size_t size)
+{
+    struct hashentry *old = dict->tab, *h;
+    size_t i, oldsize = dict->size;
+
+    dict->tab = calloc(size, sizeof(dict->tab[0]));
+    if (dict->tab == NULL) {
+	dict->tab = old;
+	return ENOMEM;
+    }
+    dict->size = size;
+
+    for (i = 0; i < oldsize; i++) {
+	if (!LIVE_P(&old[i]))
+	    continue;
+	h = _free_slot(dict, old[i].hash);
+	*h = old[i];
+    }
+    dict->used = dict->count;
+    free(old);
+
+    return 0;
+}
+
 /**
  * Search for element in hash table
  *
@@ -172,7 +225,7 @@ heim_object_t
 heim_dict_get_value(heim_dict_t dict, heim_object_t key)
 {
     struct hashentry *p;
-    p = _search(dict, key);
+    p = _search(dict, key, dict_hash(key));
     if (p == NULL)
 	return NULL;
 
@@ -192,7 +245,7 @@ heim_object_t
 heim_dict_copy_value(heim_dict_t dict, heim_object_t key)
 {
     struct hashentry *p;
-    p = _search(dict, key);
+    p = _search(dict, key, dict_hash(key));
     if (p == NULL)
 	return NULL;
 
@@ -212,32 +265,33 @@ heim_dict_copy_value(heim_dict_t dict, heim_object_t key)
 int
 heim_dict_set_value(heim_dict_t dict, heim_object_t key, heim_object_t value)
 {
-    struct hashentry **tabptr, *h;
+    uintptr_t v = dict_hash(key);
+    struct hashentry *h;
 
-    h = _search(dict, key);
+    h = _search(dict, key, v);
     if (h) {
-	heim_release(h->value);
-	h->value = heim_retain(value);
-    } else {
-	uintptr_t v;
-
-	h = malloc(sizeof(*h));
-	if (h == NULL)
-	    return ENOMEM;
+	heim_object_t old = h->value;
 
-	h->key = heim_retain(key);
 	h->value = heim_retain(value);
+	heim_release(old);
+	return 0;
+    }
 
-	v = heim_get_hash(key);
-
-	tabptr = &dict->tab[v % dict->size];
-	h->next = *tabptr;
-	*tabptr = h;
-	h->prev = tabptr;
-	if (h->next)
-	    h->next->prev = &h->next;
+    if (dict->used + 1 > dict->size / 4 * 3) {
+	/* grow, or just sweep out tombstones if that's enough */
+	int ret = _resize(dict, dict_size_for(dict->count + 1));
+	if (ret)
+	    return ret;
     }
 
+    h = _free_slot(dict, v);
+    if (h->key == NULL)
+	dict->used++;
+    dict->count++;
+    h->key = heim_retain(key);
+    h->value = heim_retain(value);
+    h->hash = v;
+
     return 0;
 }
 
@@ -251,18 +305,20 @@ heim_dict_set_value(heim_dict_t dict, heim_object_t key, heim_object_t value)
 void
 heim_dict_delete_key(heim_dict_t dict, heim_object_t key)
 {
-    struct hashentry *h = _search(dict, key);
+    struct hashentry *h = _search(dict, key, dict_hash(key));
+    heim_object_t k, v;
 
     if (h == NULL)
 	return;
 
-    heim_release(h->key);
-    heim_release(h->value);
+    k = h->key;
+    v = h->value;
+    h->key = TOMBSTONE;
+    h->value = NULL;
+    dict->count--;
 
-    if ((*(h->prev) = h->next) != NULL)
-	h->next->prev = h->prev;
-
-    free(h);
+    heim_release(k);
+    heim_release(v);
 }
 
 /**
@@ -276,11 +332,15 @@ heim_dict_delete_key(heim_dict_t dict, heim_object_t key)
 void
 heim_dict_iterate_f(heim_dict_t dict, void *arg, heim_dict_iterator_f_t func)
 {
-    struct hashentry **h, *g;
-
-    for (h = dict->tab; h < &dict->tab[dict->size]; ++h)
-	for (g = *h; g; g = g->next)
-	    func(g->key, g->value, arg);
+    size_t i;
+
+    /*
+     * The table is indexed afresh on every step as func may add or
+     * delete keys.
+     */
+    for (i = 0; i < dict->size; i++)
+	if (LIVE_P(&dict->tab[i]))
+	    func(dict->tab[i].key, dict->tab[i].value, arg);
 }
 
 #ifdef __BLOCKS__
@@ -294,10 +354,10 @@ heim_dict_iterate_f(heim_dict_t dict, void *arg, heim_dict_iterator_f_t func)
 void
 heim_dict_iterate(heim_dict_t dict, void (^func)(heim_object_t, heim_object_t))
 {
-    struct hashentry **h, *g;
+    size_t i;
 
-    for (h = dict->tab; h < &dict->tab[dict->size]; ++h)
-	for (g = *h; g; g = g->next)
-	    func(g->key, g->value);
+    for (i = 0; i < dict->size; i++)
+	if (LIVE_P(&dict->tab[i]))
+	    func(dict->tab[i].key, dict->tab[i].value);
 }
 #endif
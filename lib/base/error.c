@@ -143,7 +143,7 @@ heim_error_copy_string(heim_error_t error)
 {
     if (heim_get_tid(error) != HEIM_TID_ERROR) {
 	if (heim_get_tid(error) == heim_number_get_type_id())
-	    return __heim_string_constant(strerror(heim_number_get_int((heim_number_t)error)));
+	    return _heim_string_intern(strerror(heim_number_get_int((heim_number_t)error)));
 	heim_abort("invalid heim_error_t");
     }
     /* XXX concat all strings */
@@ -318,6 +318,87 @@ expand_euid(heim_context context, PTYPE param, const char *postfix,
 }
 #endif /* _WIN32 */
 
+#ifndef _WIN32
+/*
+ * Finding the home directory, user name or login name can take passwd
+ * or utmp lookups, so what those find is cached in the context.  The
+ * cache is dropped if the process forks or changes its real or
+ * effective UID.  Values taken from the environment are cheap and may
+ * change, so those are never cached.
+ */
+static char *
+get_userinfo(heim_context context, char **cachep,
+             char *(*get)(char *, size_t), char *buf, size_t bufsz)
+{
+    struct heim_expand_cache *c;
+    char *s;
+
+    if (context == NULL)
+        return get(buf, bufsz);
+
+    c = &context->expand_cache;
+    HEIMDAL_MUTEX_lock(&c->mutex);
+    if (c->pid != getpid() || c->uid != getuid() || c->euid != geteuid()) {
+        free(c->homedir);
+        free(c->username);
+        free(c->loginname);
+        c->homedir = c->username = c->loginname = NULL;
+        c->pid = getpid();
+        c->uid = getuid();
+        c->euid = geteuid();
+    }
+    if (*cachep != NULL) {
+        s = strlcpy(buf, *cachep, bufsz) < bufsz ? buf : NULL;
+    } else if ((s = get(buf, bufsz)) != NULL) {
+        *cachep = strdup(s); /* it's only a cache; ignore ENOMEM */
+    }
+    HEIMDAL_MUTEX_unlock(&c->mutex);
+    return s;
+}
+
+static int
+have_env(const char *name)
+{
+    const char *p = secure_getenv(name);
+
+    return p != NULL && p[0] != '\0';
+}
+
+static char *
+get_homedir(heim_context context, char *buf, size_t bufsz)
+{
+    /* The passwd lookup is by user name, which may come from the env */
+    if (!issuid() &&
+        (have_env("HOME") || have_env("USER") || have_env("LOGNAME")))
+        return roken_get_homedir(buf, bufsz);
+    return get_userinfo(context,
+                        context ? &context->expand_cache.homedir : NULL,
+                        roken_get_homedir, buf, bufsz);
+}
+
+static char *
+get_username(heim_context context, char *buf, size_t bufsz)
+{
+    if (have_env("USER") || have_env("LOGNAME"))
+        return roken_get_username(buf, bufsz);
+    return get_userinfo(context,
+                        context ? &context->expand_cache.username : NULL,
+                        roken_get_username, buf, bufsz);
+}
+
+static char *
+get_loginname(heim_context context, char *buf, size_t bufsz)
+{
+    return get_userinfo(context,
+                        context ? &context->expand_cache.loginname : NULL,
+                        roken_get_loginname, buf, bufsz);
+}
+#else
+#define get_homedir(c, b, s)    roken_get_homedir((b), (s))
+#define get_username(c, b, s)   roken_get_username((b), (s))
+#define get_loginname(c, b, s)  roken_get_loginname((b), (s))
+#endif
+
 static heim_error_code
 expand_home(heim_context context, PTYPE param, const char *postfix,
             const char *arg, char **str)
@@ -325,7 +406,7 @@ expand_home(heim_context context, PTYPE param, const char *postfix,
     char homedir[MAX_PATH];
     int ret;
 
-    if (roken_get_homedir(homedir, sizeof(homedir)))
+    if (get_homedir(context, homedir, sizeof(homedir)))
         ret = asprintf(str, "%s", homedir);
     else
         ret = asprintf(str, "/unknown");
@@ -339,7 +420,7 @@ expand_username(heim_context context, PTYPE param, const char *postfix,
                 const char *arg, char **str)
 {
     char user[128];
-    const char *username = roken_get_username(user, sizeof(user));
+    const char *username = get_username(context, user, sizeof(user));
 
     if (username == NULL) {
         heim_set_error_message(context, ENOTTY,
@@ -360,7 +441,7 @@ expand_loginname(heim_context context, PTYPE param, const char *postfix,
                  const char *arg, char **str)
 {
     char user[128];
-    const char *username = roken_get_loginname(user, sizeof(user));
+    const char *username = get_loginname(context, user, sizeof(user));
 
     if (username == NULL) {
         heim_set_error_message(context, ENOTTY,
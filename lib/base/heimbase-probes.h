@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef HEIMBASE_PROBES_H
+#define HEIMBASE_PROBES_H 1
+
+/*
+ * USDT (user-level statically defined tracing) probes, for DTrace,
+ * SystemTap, perf and bpftrace.
+ *
+ * Configure with --enable-usdt to compile the probes in, where
+ * <sys/sdt.h> is available.  A probe site is then a single nop until a
+ * tracer attaches to it; its arguments are still computed, so they
+ * should stay cheap.  Without --enable-usdt the probes and their
+ * arguments compile to nothing.
+ *
+ * All probes belong to the "heimdal" provider.  Probe names are given
+ * with double underscores, which tracers show as dashes:
+ * HEIM_PROBE1(kdc__request__start, ...) is heimdal:kdc-request-start.
+ * Probes come in -start and -done pairs, the latter with the error code
+ * as their last argument, so that a tracer can time what is between.
+ *
+ * Principals are identified by heim_probe_hash() of their unparsed
+ * name (see _krb5_principal_probe_hash()), so that traces can be
+ * correlated without exposing names.
+ */
+
+#include <stdint.h>
+
+#ifdef HEIM_USDT
+#include <sys/sdt.h>
+
+#define HEIM_PROBE0(n)			DTRACE_PROBE(heimdal, n)
+#define HEIM_PROBE1(n, a)		DTRACE_PROBE1(heimdal, n, a)
+#define HEIM_PROBE2(n, a, b)		DTRACE_PROBE2(heimdal, n, a, b)
+#define HEIM_PROBE3(n, a, b, c)		DTRACE_PROBE3(heimdal, n, a, b, c)
+#define HEIM_PROBE4(n, a, b, c, d)	DTRACE_PROBE4(heimdal, n, a, b, c, d)
+
+#else
+
+#define HEIM_PROBE0(n)			do { } while (0)
+#define HEIM_PROBE1(n, a)		do { } while (0)
+#define HEIM_PROBE2(n, a, b)		do { } while (0)
+#define HEIM_PROBE3(n, a, b, c)		do { } while (0)
+#define HEIM_PROBE4(n, a, b, c, d)	do { } while (0)
+
+#endif
+
+/* FNV-1a; start with `h' = 0, and chain calls to hash several strings */
+static inline uint32_t
+heim_probe_hash(uint32_t h, const char *s)
+{
+    if (h == 0)
+	h = 2166136261U;
+    while (s && *s)
+	h = (h ^ (unsigned char)*s++) * 16777619U;
+    return h;
+}
+
+#endif /* HEIMBASE_PROBES_H */
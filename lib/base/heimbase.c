@@ -41,6 +41,7 @@ static heim_base_atomic_integer_type tidglobal = HEIM_TID_USER;
 struct heim_base {
     heim_type_t isa;
     heim_base_atomic_integer_type ref_cnt;
+    unsigned int size;	/* bytes allocated, | FROM_SLAB if from a slab */
     HEIM_TAILQ_ENTRY(heim_base) autorel;
     heim_auto_release_t autorelpool;
     uintptr_t isaextra[3];
@@ -50,6 +51,7 @@ struct heim_base {
 struct heim_base_mem {
     heim_type_t isa;
     heim_base_atomic_integer_type ref_cnt;
+    unsigned int size;
     HEIM_TAILQ_ENTRY(heim_base) autorel;
     heim_auto_release_t autorelpool;
     const char *name;
@@ -57,9 +59,13 @@ struct heim_base_mem {
     uintptr_t isaextra[1];
 };
 
+#define FROM_SLAB 0x80000000U
+
 #define PTR2BASE(ptr) (((struct heim_base *)ptr) - 1)
 #define BASE2PTR(ptr) ((void *)(((struct heim_base *)ptr) + 1))
 
+static void slab_free(struct heim_base *);
+
 #ifdef HEIM_BASE_NEED_ATOMIC_MUTEX
 HEIMDAL_MUTEX _heim_base_mutex = HEIMDAL_MUTEX_INITIALIZER;
 #endif
@@ -133,7 +139,8 @@ heim_release(void *ptr)
 	}
 	if (p->isa->dealloc)
 	    p->isa->dealloc(ptr);
-	free(p);
+	heim_mem_account(HEIM_MEM_OBJECT, -(int64_t)(p->size & ~FROM_SLAB), -1);
+	slab_free(p);
     } else
 	heim_abort("over release");
 }
@@ -294,8 +301,10 @@ heim_alloc(size_t size, const char *name, heim_type_dealloc dealloc)
 	return NULL;
     p->isa = &memory_object;
     p->ref_cnt = 1;
+    p->size = size + sizeof(*p);
     p->name = name;
     p->dealloc = dealloc;
+    heim_mem_account(HEIM_MEM_OBJECT, p->size, 1);
     return BASE2PTR(p);
 }
 
@@ -326,15 +335,232 @@ _heim_create_type(const char *name,
     return type;
 }
 
+/*
+ * Object allocation.
+ *
+ * Most objects are small and short-lived, so rather than go to malloc()
+ * for each one we keep freed objects on per-size-class free lists: one
+ * per thread, so that the common case takes no locks, backed by a
+ * shared depot that threads exchange batches of objects with.  Both are
+ * bounded; beyond that objects are returned to free().  Objects larger
+ * than the largest size class always come from calloc().
+ *
+ * Define NO_HEIM_SLAB to build without this (e.g., for memory
+ * debuggers).
+ */
+
+#define SLAB_GRANULE	32	/* size classes are multiples of this */
+#define SLAB_CLASSES	8	/* so up to 256 bytes, header included */
+#define SLAB_TLS_MAX	64	/* objects cached per thread per class */
+#define SLAB_DEPOT_MAX	1024	/* objects in the depot per class */
+
+#ifndef NO_HEIM_SLAB
+
+struct slab_free {
+    struct slab_free *next;
+};
+
+struct slab_list {
+    struct slab_free *head;
+    size_t count;
+};
+
+static HEIMDAL_MUTEX slab_depot_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct slab_list slab_depot[SLAB_CLASSES];
+
+static int slab_key_created = 0;
+static HEIMDAL_thread_key slab_key;
+
+struct slab_tls {
+    struct slab_list lists[SLAB_CLASSES];
+};
+
+static void
+slab_push(struct slab_list *l, struct slab_free *f)
+{
+    f->next = l->head;
+    l->head = f;
+    l->count++;
+}
+
+static struct slab_free *
+slab_pop(struct slab_list *l)
+{
+    struct slab_free *f = l->head;
+
+    if (f) {
+	l->head = f->next;
+	l->count--;
+    }
+    return f;
+}
+
+/* Move up to n objects from a thread's list to the depot, or free them */
+static void
+slab_drain(struct slab_list *l, size_t cls, size_t n)
+{
+    struct slab_free *f;
+
+    HEIMDAL_MUTEX_lock(&slab_depot_mutex);
+    while (n-- && (f = slab_pop(l)) != NULL) {
+	if (slab_depot[cls].count < SLAB_DEPOT_MAX) {
+	    slab_push(&slab_depot[cls], f);
+	} else {
+	    HEIMDAL_MUTEX_unlock(&slab_depot_mutex);
+	    free(f);
+	    HEIMDAL_MUTEX_lock(&slab_depot_mutex);
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&slab_depot_mutex);
+}
+
+static void
+slab_tls_delete(void *ptr)
+{
+    struct slab_tls *tls = ptr;
+    size_t i;
+
+    if (tls == NULL)
+	return;
+    for (i = 0; i < SLAB_CLASSES; i++)
+	slab_drain(&tls->lists[i], i, tls->lists[i].count);
+    free(tls);
+}
+
+static void
+init_slab_tls(void *ptr)
+{
+    int ret;
+    HEIMDAL_key_create(&slab_key, slab_tls_delete, ret);
+    if (ret == 0)
+	slab_key_created = 1;
+}
+
+static struct slab_tls *
+slab_tls(void)
+{
+    static heim_base_once_t once = HEIM_BASE_ONCE_INIT;
+    struct slab_tls *tls;
+    int ret;
+
+    heim_base_once_f(&once, NULL, init_slab_tls);
+    if (!slab_key_created)
+	return NULL;
+
+    tls = HEIMDAL_getspecific(slab_key);
+    if (tls == NULL) {
+	tls = calloc(1, sizeof(*tls));
+	if (tls == NULL)
+	    return NULL;
+	HEIMDAL_setspecific(slab_key, tls, ret);
+	if (ret) {
+	    free(tls);
+	    return NULL;
+	}
+    }
+    return tls;
+}
+
+static struct heim_base *
+slab_alloc(size_t size)
+{
+    struct slab_tls *tls;
+    struct slab_list *l;
+    struct slab_free *f = NULL;
+    size_t cls = (size - 1) / SLAB_GRANULE;
+    struct heim_base *p;
+
+    if (cls >= SLAB_CLASSES) {
+	if ((p = calloc(1, size)) != NULL)
+	    p->size = size;
+	return p;
+    }
+
+    if ((tls = slab_tls()) != NULL) {
+	l = &tls->lists[cls];
+	if (l->head == NULL) {
+	    /* Refill half the thread's cache from the depot */
+	    HEIMDAL_MUTEX_lock(&slab_depot_mutex);
+	    while (l->count < SLAB_TLS_MAX / 2 &&
+		   (f = slab_pop(&slab_depot[cls])) != NULL)
+		slab_push(l, f);
+	    HEIMDAL_MUTEX_unlock(&slab_depot_mutex);
+	}
+	f = slab_pop(l);
+    } else {
+	HEIMDAL_MUTEX_lock(&slab_depot_mutex);
+	f = slab_pop(&slab_depot[cls]);
+	HEIMDAL_MUTEX_unlock(&slab_depot_mutex);
+    }
+
+    if (f) {
+	p = (struct heim_base *)f;
+	memset(p, 0, (cls + 1) * SLAB_GRANULE);
+    } else if ((p = calloc(1, (cls + 1) * SLAB_GRANULE)) == NULL) {
+	return NULL;
+    }
+    p->size = ((cls + 1) * SLAB_GRANULE) | FROM_SLAB;
+    return p;
+}
+
+static void
+slab_free(struct heim_base *p)
+{
+    struct slab_tls *tls;
+    struct slab_free *f = (struct slab_free *)p;
+    size_t cls;
+
+    if ((p->size & FROM_SLAB) == 0) {
+	free(p);
+	return;
+    }
+    cls = (p->size & ~FROM_SLAB) / SLAB_GRANULE - 1;
+
+    if ((tls = slab_tls()) != NULL) {
+	slab_push(&tls->lists[cls], f);
+	if (tls->lists[cls].count > SLAB_TLS_MAX)
+	    slab_drain(&tls->lists[cls], cls, SLAB_TLS_MAX / 2);
+	return;
+    }
+
+    HEIMDAL_MUTEX_lock(&slab_depot_mutex);
+    if (slab_depot[cls].count < SLAB_DEPOT_MAX) {
+	slab_push(&slab_depot[cls], f);
+	f = NULL;
+    }
+    HEIMDAL_MUTEX_unlock(&slab_depot_mutex);
+    free(f);
+}
+
+#else
+
+static struct heim_base *
+slab_alloc(size_t size)
+{
+    struct heim_base *p = calloc(1, size);
+
+    if (p != NULL)
+	p->size = size;
+    return p;
+}
+
+static void
+slab_free(struct heim_base *p)
+{
+    free(p);
+}
+
+#endif /* NO_HEIM_SLAB */
+
 heim_object_t
 _heim_alloc_object(heim_type_t type, size_t size)
 {
-    /* XXX should use posix_memalign */
-    struct heim_base *p = calloc(1, size + sizeof(*p));
+    struct heim_base *p = slab_alloc(size + sizeof(*p));
     if (p == NULL)
 	return NULL;
     p->isa = type;
     p->ref_cnt = 1;
+    heim_mem_account(HEIM_MEM_OBJECT, p->size & ~FROM_SLAB, 1);
 
     return BASE2PTR(p);
 }
@@ -474,6 +474,11 @@ heim_object_t heim_json_create_with_bytes(const void *, size_t, size_t,
 heim_string_t heim_json_copy_serialize(heim_object_t, heim_json_flags_t,
 				       heim_error_t *);
 
+typedef int (*heim_json_write_f_t)(void *, const void *, size_t);
+
+int heim_json_serialize(heim_object_t, heim_json_flags_t,
+			heim_json_write_f_t, void *, heim_error_t *);
+
 
 /*
  * Debug
@@ -522,6 +527,20 @@ void heim_w32_service_thread_detach(void *);
 
 typedef struct heim_svc_req_desc_common_s *heim_svc_req_desc;
 
+/*
+ * Memory accounting subsystems
+ */
+
+typedef enum heim_mem_tag {
+    HEIM_MEM_ASN1 = 0,		/* decoded ASN.1 values */
+    HEIM_MEM_HDB,		/* HDB entries */
+    HEIM_MEM_CACHE,		/* daemon caches */
+    HEIM_MEM_CRYPTO,		/* krb5_crypto contexts */
+    HEIM_MEM_OBJECT,		/* heim objects */
+    HEIM_MEM_IPC,		/* IPC clients and buffers */
+    HEIM_MEM_NUM_TAGS
+} heim_mem_tag;
+
 #include <heimbase-protos.h>
 
 #endif /* HEIM_BASE_H */
@@ -103,9 +103,34 @@ _heim_type_get_tid(heim_type_t type);
 void
 _heim_make_permanent(heim_object_t ptr);
 
+heim_string_t
+_heim_string_intern(const char *);
+
 heim_data_t
 _heim_db_get_value(heim_db_t, heim_string_t, heim_data_t, heim_error_t *);
 
+/* config_cache.c */
+struct stat;
+
+void
+_heim_config_note_source(const char *, const struct stat *);
+
+heim_error_code
+_heim_config_parse_files(heim_context, char **, heim_config_binding **);
+
+void
+_heim_config_index_build(heim_context, const heim_config_section *);
+
+void
+_heim_config_index_free(heim_context);
+
+int
+_heim_config_index_covers(heim_context, const heim_config_section *);
+
+const heim_config_binding *
+_heim_config_index_lookup(heim_context, const heim_config_binding *,
+			  const char *, int);
+
 
 /* tagged tid */
 extern struct heim_type_data _heim_null_object;
@@ -275,6 +275,20 @@ heim_base2json(heim_object_t obj, void *ctx, heim_json_flags_t flags,
  *
  */
 
+/*
+ * Dict keys tend to repeat (arrays of records, the same fields in
+ * every audit entry), so plain keys are interned for the duration of
+ * a parse: each distinct key is allocated once and then shared.
+ */
+
+#define JSON_INTERN_MAX 1024
+
+struct json_key {
+    uint32_t hash;
+    size_t len;
+    heim_string_t str;
+};
+
 struct parse_ctx {
     unsigned long lineno;
     const uint8_t *p;
@@ -283,6 +297,9 @@ struct parse_ctx {
     heim_error_t error;
     size_t depth;
     heim_json_flags_t flags;
+    struct json_key *keys;
+    size_t keys_size;
+    size_t keys_count;
 };
 
 
@@ -431,6 +448,123 @@ parse_string(struct parse_ctx *ctx)
     return NULL;
 }
 
+static uint32_t
+key_hash(const uint8_t *p, size_t len)
+{
+    uint32_t h = 2166136261U;
+
+    while (len--)
+	h = (h ^ *p++) * 16777619U;
+    return h;
+}
+
+static int
+intern_grow(struct parse_ctx *ctx)
+{
+    struct json_key *keys;
+    size_t i, j, size = ctx->keys_size ? ctx->keys_size * 2 : 64;
+
+    keys = calloc(size, sizeof(keys[0]));
+    if (keys == NULL)
+	return ENOMEM;
+    for (i = 0; i < ctx->keys_size; i++) {
+	if (ctx->keys[i].str == NULL)
+	    continue;
+	for (j = ctx->keys[i].hash & (size - 1);
+	     keys[j].str != NULL;
+	     j = (j + 1) & (size - 1))
+	    ;
+	keys[j] = ctx->keys[i];
+    }
+    free(ctx->keys);
+    ctx->keys = keys;
+    ctx->keys_size = size;
+    return 0;
+}
+
+static heim_string_t
+intern_key(struct parse_ctx *ctx, const uint8_t *p, size_t len)
+{
+    uint32_t h = key_hash(p, len);
+    heim_string_t str;
+    size_t i;
+
+    if (ctx->keys_size) {
+	for (i = h & (ctx->keys_size - 1);
+	     ctx->keys[i].str != NULL;
+	     i = (i + 1) & (ctx->keys_size - 1)) {
+	    struct json_key *k = &ctx->keys[i];
+
+	    if (k->hash == h && k->len == len &&
+		memcmp(heim_string_get_utf8(k->str), p, len) == 0)
+		return heim_retain(k->str);
+	}
+    }
+
+    str = heim_string_create_with_bytes(p, len);
+    if (str == NULL || ctx->keys_count >= JSON_INTERN_MAX)
+	return str;
+    if ((ctx->keys_count + 1) * 4 > ctx->keys_size * 3 &&
+	intern_grow(ctx) != 0)
+	return str;
+
+    for (i = h & (ctx->keys_size - 1);
+	 ctx->keys[i].str != NULL;
+	 i = (i + 1) & (ctx->keys_size - 1))
+	;
+    ctx->keys[i].hash = h;
+    ctx->keys[i].len = len;
+    ctx->keys[i].str = heim_retain(str);
+    ctx->keys_count++;
+    return str;
+}
+
+static void
+intern_free(struct parse_ctx *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->keys_size; i++)
+	heim_release(ctx->keys[i].str);
+    free(ctx->keys);
+    ctx->keys = NULL;
+    ctx->keys_size = ctx->keys_count = 0;
+}
+
+static heim_object_t
+parse_key(struct parse_ctx *ctx)
+{
+    const uint8_t *start, *q;
+    heim_string_t key;
+
+    /*
+     * Only plain strings are interned; anything with escapes or that
+     * might be decoded as data takes the general path.
+     */
+    if (*ctx->p == '"' &&
+	(ctx->flags & (HEIM_JSON_F_STRICT_STRINGS |
+		       HEIM_JSON_F_TRY_DECODE_DATA)) == 0) {
+	start = q = ctx->p + 1;
+	while (q < ctx->pend && *q != '"' && *q != '\\' && *q != '\n')
+	    q++;
+	if (q < ctx->pend && *q == '"') {
+	    key = intern_key(ctx, start, q - start);
+	    if (key == NULL) {
+		ctx->error = heim_error_create_enomem();
+		return NULL;
+	    }
+	    ctx->p = q + 1;
+	    return key;
+	}
+    }
+
+    if (ctx->flags & HEIM_JSON_F_STRICT_DICT)
+	/* JSON allows only string keys */
+	return parse_string(ctx);
+    /* heim_dict_t allows any heim_object_t as key */
+    return parse_value(ctx);
+}
+
 static int
 parse_pair(heim_dict_t dict, struct parse_ctx *ctx)
 {
@@ -445,12 +579,7 @@ parse_pair(heim_dict_t dict, struct parse_ctx *ctx)
 	return 0;
     }
 
-    if (ctx->flags & HEIM_JSON_F_STRICT_DICT)
-	/* JSON allows only string keys */
-	key = parse_string(ctx);
-    else
-	/* heim_dict_t allows any heim_object_t as key */
-	key = parse_value(ctx);
+    key = parse_key(ctx);
     if (key == NULL)
 	/* Even heim_dict_t does not allow C NULLs as keys though! */
 	return -1;
@@ -686,8 +815,12 @@ heim_json_create_with_bytes(const void *data, size_t length, size_t max_depth,
     ctx.error = NULL;
     ctx.flags = flags;
     ctx.depth = max_depth;
+    ctx.keys = NULL;
+    ctx.keys_size = 0;
+    ctx.keys_count = 0;
 
     o = parse_value(&ctx);
+    intern_free(&ctx);
 
     if (o == NULL && error) {
 	*error = ctx.error;
@@ -761,6 +894,119 @@ strbuf_add(void *ctx, const char *str)
 	strbuf->len--;
 }
 
+/*
+ * Streaming output: serialize through a small buffer straight to a
+ * caller supplied writer.  The last byte is held back when flushing so
+ * that a trailing '\n' can still be eaten (see strbuf_add()).
+ */
+
+struct heim_json_sink {
+    heim_json_write_f_t write;
+    void *ctx;
+    heim_json_flags_t flags;
+    int ret;
+    size_t len;
+    char buf[1024];
+};
+
+static void
+sink_flush(struct heim_json_sink *sink, size_t keep)
+{
+    if (sink->len <= keep)
+	return;
+    if (sink->ret == 0)
+	sink->ret = sink->write(sink->ctx, sink->buf, sink->len - keep);
+    memmove(sink->buf, sink->buf + sink->len - keep, keep);
+    sink->len = keep;
+}
+
+static void
+sink_add(void *ctx, const char *str)
+{
+    struct heim_json_sink *sink = ctx;
+    size_t len, n;
+
+    if (sink->ret)
+	return;
+
+    if (str == NULL) {
+	if (sink->len > 0 && sink->buf[sink->len - 1] == '\n')
+	    sink->len--;
+	return;
+    }
+
+    len = strlen(str);
+    if (len == 0)
+	return;
+    while (len > 0) {
+	if (sink->len == sizeof(sink->buf))
+	    sink_flush(sink, 1);
+	n = sizeof(sink->buf) - sink->len;
+	if (n > len)
+	    n = len;
+	memcpy(sink->buf + sink->len, str, n);
+	sink->len += n;
+	str += n;
+	len -= n;
+    }
+    if (sink->buf[sink->len - 1] == '\n' &&
+	(sink->flags & HEIM_JSON_F_ONE_LINE))
+	sink->len--;
+}
+
+/**
+ * Serialize an object as JSON, handing the output to a writer in
+ * pieces as it is produced rather than building it in memory.
+ *
+ * @param obj the object to serialize
+ * @param flags JSON flags, as for heim_json_copy_serialize()
+ * @param func called with each piece of output; a non-zero return
+ * stops the serialization and is returned
+ * @param ctx passed to func
+ * @param error if not NULL, set to an error object on failure
+ *
+ * @return 0 on success, an errno or the writer's return value
+ *
+ * @addtogroup heimbase
+ */
+
+int
+heim_json_serialize(heim_object_t obj, heim_json_flags_t flags,
+		    heim_json_write_f_t func, void *ctx, heim_error_t *error)
+{
+    struct heim_json_sink sink;
+    int ret;
+
+    if (error)
+	*error = NULL;
+
+    sink.write = func;
+    sink.ctx = ctx;
+    sink.flags = flags;
+    sink.ret = 0;
+    sink.len = 0;
+
+    ret = heim_base2json(obj, &sink, flags, sink_add);
+    if (ret) {
+	if (error) {
+	    if (ret == ENOMEM)
+		*error = heim_error_create_enomem();
+	    else
+		*error = heim_error_create(ret, "Impossible to JSON-encode "
+					   "object");
+	}
+	return ret;
+    }
+    if (flags & HEIM_JSON_F_ONE_LINE) {
+	sink.flags &= ~HEIM_JSON_F_ONE_LINE;
+	sink_add(&sink, "\n");
+    }
+    sink_flush(&sink, 0);
+    if (sink.ret && error)
+	*error = heim_error_create(sink.ret, "Failed to write JSON");
+    return sink.ret;
+}
+
 #define STRBUF_INIT_SZ 64
 
 heim_string_t
@@ -345,11 +345,249 @@ open_file(heim_context context, heim_log_facility *fac, int min, int max,
     return ret;
 }
 
+#if defined(ENABLE_PTHREAD_SUPPORT) && defined(HAVE_PTHREAD_H) && \
+    !defined(_WIN32)
+
+/*
+ * Asynchronous destinations ("ASYNC:" prefix).
+ *
+ * The caller's thread only formats the message and queues a copy; a
+ * writer thread per destination and process takes whatever is queued,
+ * in batches, and hands it to the real destination, so a slow disk or
+ * a blocked syslog socket never stalls the caller.  The queue lock is
+ * held only to move a pointer.  When the queue is full messages are
+ * dropped and counted, and the writer reports how many were lost once
+ * it catches up.
+ *
+ * The writer is started on first use in each process, so a destination
+ * opened before fork(2) gets a writer of its own in every child, and
+ * an atexit(3) handler lets the writers drain their queues when the
+ * process exits without closing its log facilities.
+ */
+
+#define ASYNC_LOG_QUEUE 4096
+#define ASYNC_LOG_BATCH 64
+
+struct async_log {
+    struct async_log *next;
+    heim_log_log_func_t log_func;
+    heim_log_close_func_t close_func;
+    void *data;
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    pthread_t writer;
+    pid_t pid;                  /* process running the writer, or 0 */
+    int exiting;
+    size_t head;
+    size_t count;
+    uint64_t dropped;
+    uint64_t reported;
+    char *q[ASYNC_LOG_QUEUE];   /* "time\0message\0" */
+};
+
+static HEIMDAL_MUTEX async_start_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct async_log *async_logs;
+static int async_atexit_done;
+
+static void *
+async_writer(void *arg)
+{
+    struct async_log *a = arg;
+    char *batch[ASYNC_LOG_BATCH];
+    uint64_t dropped;
+    size_t i, n;
+
+    for (;;) {
+        pthread_mutex_lock(&a->lock);
+        while (a->count == 0 && !a->exiting)
+            pthread_cond_wait(&a->cv, &a->lock);
+        if (a->count == 0) {
+            pthread_mutex_unlock(&a->lock);
+            break;
+        }
+        for (n = 0; a->count > 0 && n < ASYNC_LOG_BATCH; n++) {
+            batch[n] = a->q[a->head];
+            a->head = (a->head + 1) % ASYNC_LOG_QUEUE;
+            a->count--;
+        }
+        dropped = a->dropped - a->reported;
+        a->reported = a->dropped;
+        pthread_mutex_unlock(&a->lock);
+
+        /* The file and syslog destinations do not use the context */
+        if (dropped) {
+            char msg[80];
+
+            snprintf(msg, sizeof(msg), "log queue full: %llu messages dropped",
+                     (unsigned long long)dropped);
+            (*a->log_func)(NULL, NULL, msg, a->data);
+        }
+        for (i = 0; i < n; i++) {
+            (*a->log_func)(NULL, batch[i], batch[i] + strlen(batch[i]) + 1,
+                           a->data);
+            free(batch[i]);
+        }
+    }
+    return NULL;
+}
+
+/* Drop messages queued by another process (our parent before fork) */
+static void
+async_clear(struct async_log *a)
+{
+    for (; a->count > 0; a->count--) {
+        free(a->q[a->head]);
+        a->head = (a->head + 1) % ASYNC_LOG_QUEUE;
+    }
+}
+
+static int
+async_start(struct async_log *a)
+{
+    pid_t pid = getpid();
+    int ret = 0;
+
+    HEIMDAL_MUTEX_lock(&async_start_mutex);
+    if (a->pid != pid) {
+        if (a->pid != 0) {
+            /* After fork(): the lock may have been held by a dead thread */
+            pthread_mutex_init(&a->lock, NULL);
+            pthread_cond_init(&a->cv, NULL);
+            async_clear(a);
+        }
+        a->exiting = 0;
+        ret = pthread_create(&a->writer, NULL, async_writer, a);
+        if (ret == 0)
+            a->pid = pid;
+    }
+    HEIMDAL_MUTEX_unlock(&async_start_mutex);
+    return ret;
+}
+
+static void HEIM_CALLCONV
+log_async(heim_context context, const char *timestr, const char *msg,
+          void *data)
+{
+    struct async_log *a = data;
+    size_t tlen = timestr ? strlen(timestr) : 0;
+    size_t mlen = strlen(msg);
+    char *rec;
+
+    if (a->pid != getpid() && async_start(a) != 0) {
+        (*a->log_func)(context, timestr, msg, a->data);
+        return;
+    }
+
+    rec = malloc(tlen + mlen + 2);
+    if (rec) {
+        memcpy(rec, timestr ? timestr : "", tlen + 1);
+        memcpy(rec + tlen + 1, msg, mlen + 1);
+    }
+
+    pthread_mutex_lock(&a->lock);
+    if (rec == NULL || a->count == ASYNC_LOG_QUEUE) {
+        a->dropped++;
+        pthread_mutex_unlock(&a->lock);
+        free(rec);
+        return;
+    }
+    a->q[(a->head + a->count) % ASYNC_LOG_QUEUE] = rec;
+    if (a->count++ == 0)
+        pthread_cond_signal(&a->cv);
+    pthread_mutex_unlock(&a->lock);
+}
+
+/* Stop this process' writer, which first drains the queue */
+static void
+async_stop(struct async_log *a)
+{
+    if (a->pid != getpid())
+        return;
+    pthread_mutex_lock(&a->lock);
+    a->exiting = 1;
+    pthread_cond_signal(&a->cv);
+    pthread_mutex_unlock(&a->lock);
+    pthread_join(a->writer, NULL);
+    a->pid = 0;
+}
+
+static void
+async_atexit(void)
+{
+    struct async_log *a;
+
+    HEIMDAL_MUTEX_lock(&async_start_mutex);
+    for (a = async_logs; a; a = a->next)
+        async_stop(a);
+    HEIMDAL_MUTEX_unlock(&async_start_mutex);
+}
+
+static void HEIM_CALLCONV
+close_async(void *data)
+{
+    struct async_log *a = data;
+    struct async_log **ap;
+
+    HEIMDAL_MUTEX_lock(&async_start_mutex);
+    for (ap = &async_logs; *ap; ap = &(*ap)->next) {
+        if (*ap == a) {
+            *ap = a->next;
+            break;
+        }
+    }
+    HEIMDAL_MUTEX_unlock(&async_start_mutex);
+
+    async_stop(a);
+    async_clear(a);
+    (*a->close_func)(a->data);
+    pthread_cond_destroy(&a->cv);
+    pthread_mutex_destroy(&a->lock);
+    free(a);
+}
+
+/* Make the destination last added to `f' asynchronous */
+static heim_error_code
+make_async(heim_context context, heim_log_facility *f)
+{
+    struct heim_log_facility_internal *fp = &f->val[f->len - 1];
+    struct async_log *a;
+
+    if ((a = calloc(1, sizeof(*a))) == NULL)
+        return heim_enomem(context);
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->cv, NULL);
+    a->log_func = fp->log_func;
+    a->close_func = fp->close_func;
+    a->data = fp->data;
+    fp->log_func = log_async;
+    fp->close_func = close_async;
+    fp->data = a;
+
+    HEIMDAL_MUTEX_lock(&async_start_mutex);
+    a->next = async_logs;
+    async_logs = a;
+    if (!async_atexit_done && atexit(async_atexit) == 0)
+        async_atexit_done = 1;
+    HEIMDAL_MUTEX_unlock(&async_start_mutex);
+    return 0;
+}
+
+#else
+
+/* Without threads ASYNC: destinations are written synchronously */
+static heim_error_code
+make_async(heim_context context, heim_log_facility *f)
+{
+    return 0;
+}
+
+#endif
+
 heim_error_code
 heim_addlog_dest(heim_context context, heim_log_facility *f, const char *orig)
 {
     heim_error_code ret = 0;
-    int min = 0, max = 3, n;
+    int min = 0, max = 3, n, async = 0;
     char c;
     const char *p = orig;
 #ifdef _WIN32
@@ -384,6 +622,10 @@ heim_addlog_dest(heim_context context, heim_log_facility *f, const char *orig)
         }
         p++;
     }
+    if (strncmp(p, "ASYNC:", sizeof("ASYNC:") - 1) == 0) {
+        p += sizeof("ASYNC:") - 1;
+        async = 1;
+    }
     if (strcmp(p, "STDERR") == 0) {
         ret = open_file(context, f, min, max, NULL, NULL, stderr,
                         FILEDISP_KEEPOPEN, 0);
@@ -427,6 +669,8 @@ heim_addlog_dest(heim_context context, heim_log_facility *f, const char *orig)
         heim_set_error_message(context, ret,
                                N_("unknown log type: %s", ""), p);
     }
+    if (ret == 0 && async)
+        ret = make_async(context, f);
     return ret;
 }
 
@@ -524,6 +768,25 @@ __attribute__ ((__format__ (__printf__, 5, 0)))
     return 0;
 }
 
+/*
+ * Returns non-zero if a message logged at `level' to `fac' would be
+ * written anywhere, so callers can skip building expensive messages.
+ */
+
+int
+heim_have_log(heim_context context, heim_log_facility *fac, int level)
+{
+    int i;
+
+    if (!fac)
+        fac = context->log_dest;
+    for (i = 0; fac && i < fac->len; i++)
+        if (fac->val[i].min <= level &&
+            (fac->val[i].max < 0 || fac->val[i].max >= level))
+            return 1;
+    return 0;
+}
+
 heim_error_code
 heim_vlog(heim_context context,
           heim_log_facility *fac,
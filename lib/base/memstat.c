@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Optional memory accounting: the bytes and number of objects that each
+ * subsystem holds, so that the growth of a long-running daemon can be
+ * put down to one of them without a heap profiler.  Subsystems report
+ * their allocations and frees with heim_mem_account(); the counts are
+ * per process.  Until heim_mem_account_enable() is called reporting
+ * costs one test of a flag.
+ */
+
+#include "baselocl.h"
+
+#if defined(HAVE_STDATOMIC_H)
+#include <stdatomic.h>
+typedef _Atomic int64_t mem_counter;
+#define COUNTER_ADD(c, v) atomic_fetch_add_explicit(&(c), (v), memory_order_relaxed)
+#define COUNTER_GET(c)    atomic_load_explicit(&(c), memory_order_relaxed)
+#elif defined(__GNUC__) && defined(HAVE___SYNC_ADD_AND_FETCH)
+typedef int64_t mem_counter;
+#define COUNTER_ADD(c, v) __sync_fetch_and_add(&(c), (v))
+#define COUNTER_GET(c)    __sync_fetch_and_add(&(c), 0)
+#else
+/* No atomics: counts may be off under contention, but nothing worse */
+typedef volatile int64_t mem_counter;
+#define COUNTER_ADD(c, v) ((c) += (v))
+#define COUNTER_GET(c)    (c)
+#endif
+
+static const char *tag_names[HEIM_MEM_NUM_TAGS] = {
+    "asn1", "hdb", "cache", "crypto", "object", "ipc"
+};
+
+static struct {
+    mem_counter bytes;
+    mem_counter objects;
+} counts[HEIM_MEM_NUM_TAGS];
+
+static int enabled = 0;
+
+/**
+ * Turn memory accounting on or off.  Turning it on part way through
+ * counts only what is allocated, and freed, from then on, so it is best
+ * done at startup.
+ *
+ * @param on non-zero to turn accounting on
+ */
+
+void
+heim_mem_account_enable(int on)
+{
+    enabled = on;
+}
+
+int
+heim_mem_account_enabled(void)
+{
+    return enabled;
+}
+
+/**
+ * Record that a subsystem allocated (positive) or freed (negative)
+ * memory.
+ *
+ * @param tag the subsystem
+ * @param bytes change in the bytes it holds
+ * @param objects change in the number of objects it holds
+ */
+
+void
+heim_mem_account(heim_mem_tag tag, int64_t bytes, int64_t objects)
+{
+    if (!enabled || (unsigned)tag >= HEIM_MEM_NUM_TAGS)
+	return;
+    if (bytes)
+	COUNTER_ADD(counts[tag].bytes, bytes);
+    if (objects)
+	COUNTER_ADD(counts[tag].objects, objects);
+}
+
+/**
+ * Get the memory a subsystem holds.
+ *
+ * @param tag the subsystem
+ * @param bytes the bytes it holds
+ * @param objects the number of objects it holds
+ *
+ * @return 0, or EINVAL for an unknown tag
+ */
+
+int
+heim_mem_stats(heim_mem_tag tag, int64_t *bytes, int64_t *objects)
+{
+    if ((unsigned)tag >= HEIM_MEM_NUM_TAGS)
+	return EINVAL;
+    *bytes = COUNTER_GET(counts[tag].bytes);
+    *objects = COUNTER_GET(counts[tag].objects);
+    return 0;
+}
+
+/**
+ * @return the name of a subsystem tag, as used in logs and metrics
+ */
+
+const char *
+heim_mem_tag_name(heim_mem_tag tag)
+{
+    if ((unsigned)tag >= HEIM_MEM_NUM_TAGS)
+	return "unknown";
+    return tag_names[tag];
+}
@@ -65,6 +65,22 @@ static heim_dict_t __modules;
 
 static HEIMDAL_MUTEX modules_mutex = HEIMDAL_MUTEX_INITIALIZER;
 
+/*
+ * Plugins found by heim_plugin_run_f(), keyed by module, name and
+ * minimum version, so that later calls neither walk every DSO nor
+ * dlsym() again in those without the plugin.  Like the modules it is
+ * process wide, and it is dropped, under modules_mutex, whenever the
+ * modules change.
+ */
+static heim_dict_t resolved_plugins;
+
+static void
+drop_resolved_plugins(void)
+{
+    heim_release(resolved_plugins);
+    resolved_plugins = NULL;
+}
+
 static void
 copy_modules_once(void *context)
 {
@@ -223,6 +239,7 @@ heim_plugin_register(heim_context context,
     }
 
     ret = 0;
+    drop_resolved_plugins();
     if (!ctx.is_dup) {
         /* Note: refactored plugin API only supports common plugin layout */
         struct heim_plugin *pl;
@@ -354,6 +371,7 @@ heim_load_plugins(heim_context context,
     }
     heim_release(s);
     heim_release(modules);
+    drop_resolved_plugins();
 
     for (di = paths; *di != NULL; di++) {
         free(dirname);
@@ -469,6 +487,7 @@ heim_unload_plugins(heim_context context, const char *module)
 
     modules = copy_modules();
     heim_dict_delete_key(modules, sname);
+    drop_resolved_plugins();
 
     HEIMDAL_MUTEX_unlock(&modules_mutex);
 
@@ -742,6 +761,7 @@ heim_plugin_run_f(heim_context context,
 {
     heim_string_t m = heim_string_create(caller->module);
     heim_dict_t modules, dict = NULL;
+    heim_string_t key;
     struct iter_ctx s;
 
     s.context = context;
@@ -749,21 +769,34 @@ heim_plugin_run_f(heim_context context,
     s.caller = caller;
     s.n = heim_string_create(caller->name);
     s.flags = flags;
-    s.result = heim_array_create();
+    s.result = NULL;
     s.func = func;
     s.userctx = userctx;
     s.plugin_no_handle_retval = nohandle;
     s.ret = nohandle;
 
+    key = heim_string_create_with_format("%s/%s/%d", caller->module,
+                                         caller->name, caller->min_version);
+
     HEIMDAL_MUTEX_lock(&modules_mutex);
 
     /* Get loaded plugins */
     modules = copy_modules();
     dict = heim_dict_copy_value(modules, m);
 
-    /* Add loaded plugins to s.result array */
-    if (dict)
-        heim_dict_iterate_f(dict, &s, search_modules);
+    if (resolved_plugins != NULL && key != NULL)
+        s.result = heim_dict_copy_value(resolved_plugins, key);
+    if (s.result == NULL) {
+        /* Add loaded plugins to s.result array */
+        s.result = heim_array_create();
+        if (dict)
+            heim_dict_iterate_f(dict, &s, search_modules);
+
+        if (resolved_plugins == NULL)
+            resolved_plugins = heim_dict_create(11);
+        if (resolved_plugins != NULL && key != NULL && s.result != NULL)
+            heim_dict_set_value(resolved_plugins, key, s.result);
+    }
 
     /* We don't need to hold modules_mutex during plugin invocation */
     HEIMDAL_MUTEX_unlock(&modules_mutex);
@@ -772,6 +805,7 @@ heim_plugin_run_f(heim_context context,
     heim_array_iterate_f(s.result, &s, eval_results);
 
     heim_release(s.result);
+    heim_release(key);
     heim_release(s.n);
     heim_release(dict);
     heim_release(m);
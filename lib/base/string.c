@@ -73,14 +73,31 @@ string_cmp(void *a, void *b)
     return strcmp(a, b);
 }
 
+/*
+ * The hash is computed once and cached in the third isaextra slot (the
+ * first two hold the dealloc function and pointer of string refs);
+ * strings are immutable, so it can never go stale.  Zero means "not yet
+ * computed".  Racing threads all store the same value.
+ */
 static uintptr_t
 string_hash(void *ptr)
 {
-    const char *s = ptr;
-    uintptr_t n;
-
-    for (n = 0; *s; ++s)
-	n += *s;
+    uintptr_t *hashp = _heim_get_isaextra(ptr, 2);
+    const unsigned char *s;
+    uint32_t n;
+
+    if (*hashp)
+	return *hashp;
+
+    /* FNV-1a; hash the referenced string of string refs too */
+    s = (const unsigned char *)heim_string_get_utf8(ptr);
+    for (n = 2166136261U; *s; ++s) {
+	n ^= *s;
+	n *= 16777619U;
+    }
+    if (n == 0)
+	n = 1;
+    *hashp = n;
     return n;
 }
 
@@ -223,9 +240,22 @@ heim_string_get_utf8(heim_string_t string)
 }
 
 /*
+ * Interned string constants.
  *
+ * HSTR() is typically evaluated many times at the same call site with
+ * the same literal, so before creating a string object and looking it
+ * up by value we look up the literal's address in a small direct-mapped
+ * cache.  Distinct literals with the same contents still end up with
+ * the same string object via the dict.
  */
 
+#define STRING_CONST_CACHE_SIZE 256
+
+struct string_const_cache_entry {
+    const char *str;
+    heim_string_t s;
+};
+
 static void
 init_string(void *ptr)
 {
@@ -234,10 +264,16 @@ init_string(void *ptr)
     heim_assert(*dict != NULL, "__heim_string_constant");
 }
 
+static HEIMDAL_MUTEX string_const_mutex = HEIMDAL_MUTEX_INITIALIZER;
+
+/*
+ * Intern a string.  Unlike __heim_string_constant() the argument need
+ * not be a literal (e.g., strerror() output, whose contents may change
+ * at the same address).
+ */
 heim_string_t
-__heim_string_constant(const char *_str)
+_heim_string_intern(const char *_str)
 {
-    static HEIMDAL_MUTEX mutex = HEIMDAL_MUTEX_INITIALIZER;
     static heim_base_once_t once;
     static heim_dict_t dict = NULL;
     heim_string_t s, s2;
@@ -245,7 +281,7 @@ __heim_string_constant(const char *_str)
     heim_base_once_f(&once, &dict, init_string);
     s = heim_string_create(_str);
 
-    HEIMDAL_MUTEX_lock(&mutex);
+    HEIMDAL_MUTEX_lock(&string_const_mutex);
     s2 = heim_dict_get_value(dict, s);
     if (s2) {
 	heim_release(s);
@@ -254,7 +290,30 @@ __heim_string_constant(const char *_str)
 	_heim_make_permanent(s);
 	heim_dict_set_value(dict, s, s);
     }
-    HEIMDAL_MUTEX_unlock(&mutex);
+    HEIMDAL_MUTEX_unlock(&string_const_mutex);
+
+    return s;
+}
+
+heim_string_t
+__heim_string_constant(const char *_str)
+{
+    static struct string_const_cache_entry cache[STRING_CONST_CACHE_SIZE];
+    struct string_const_cache_entry *e;
+    heim_string_t s;
+
+    e = &cache[((uintptr_t)_str >> 3) % STRING_CONST_CACHE_SIZE];
+    HEIMDAL_MUTEX_lock(&string_const_mutex);
+    s = e->str == _str ? e->s : NULL;
+    HEIMDAL_MUTEX_unlock(&string_const_mutex);
+    if (s)
+	return s;
+
+    s = _heim_string_intern(_str);
 
+    HEIMDAL_MUTEX_lock(&string_const_mutex);
+    e->str = _str;
+    e->s = s;
+    HEIMDAL_MUTEX_unlock(&string_const_mutex);
     return s;
 }
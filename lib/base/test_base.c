@@ -148,6 +148,7 @@ test_dict(void)
     heim_string_t a2 = heim_string_create("hejsan");
     heim_number_t a3 = heim_number_create(3);
     heim_string_t a4 = heim_string_create("foosan");
+    int i;
 
     dict = heim_dict_create(10);
 
@@ -164,6 +165,28 @@ test_dict(void)
 
     heim_release(dict);
 
+    /* grow well past the initial size, with deletes in between */
+    dict = heim_dict_create(1);
+    for (i = 0; i < 1000; i++) {
+	a1 = heim_number_create(i);
+	heim_dict_set_value(dict, a1, a1);
+	if (i % 3 == 0)
+	    heim_dict_delete_key(dict, a1);
+	heim_release(a1);
+    }
+    for (i = 0; i < 1000; i++) {
+	heim_object_t o;
+
+	a1 = heim_number_create(i);
+	o = heim_dict_get_value(dict, a1);
+	if (i % 3 == 0)
+	    heim_assert(o == NULL, "deleted key still in dict");
+	else
+	    heim_assert(o != NULL && heim_cmp(o, a1) == 0, "key lost");
+	heim_release(a1);
+    }
+    heim_release(dict);
+
     return 0;
 }
 
@@ -196,8 +219,9 @@ test_auto_release(void)
 static int
 test_string(void)
 {
-    heim_string_t s1, s2;
+    heim_string_t s1, s2, s3;
     const char *string = "hejsan";
+    int i;
 
     s1 = heim_string_create(string);
     s2 = heim_string_create(string);
@@ -207,6 +231,21 @@ test_string(void)
 	exit(1);
     }
 
+    s3 = heim_string_ref_create(string, NULL);
+    if (heim_get_hash(s1) != heim_get_hash(s3) ||
+	heim_get_hash(s1) != heim_get_hash(HSTR("hejsan"))) {
+	printf("equal strings hash differently\n");
+	exit(1);
+    }
+    heim_release(s3);
+
+    for (i = 0; i < 2; i++) {
+	if (HSTR("hejsan") != HSTR("hejsan")) {
+	    printf("string constants not interned\n");
+	    exit(1);
+	}
+    }
+
     heim_release(s1);
     heim_release(s2);
 
@@ -231,6 +270,23 @@ test_error(void)
     return 0;
 }
 
+struct json_out {
+    char buf[1024];
+    size_t len;
+};
+
+static int
+json_out_f(void *ctx, const void *data, size_t len)
+{
+    struct json_out *out = ctx;
+
+    if (len > sizeof(out->buf) - out->len)
+	return ENOSPC;
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+    return 0;
+}
+
 static int
 test_json(void)
 {
@@ -361,6 +417,32 @@ test_json(void)
 	}
     }
 
+    /* Streamed output must match the in-memory serialization */
+    for (i = 0; i < (sizeof (j) / sizeof (j[0])); i++) {
+	struct json_out out;
+	heim_string_t str;
+
+	o = heim_json_create(j[i], 10, 0, NULL);
+	heim_assert(o != NULL, "parse");
+	str = heim_json_copy_serialize(o, HEIM_JSON_F_ONE_LINE, NULL);
+	heim_assert(str != NULL, "serialize");
+	memset(&out, 0, sizeof(out));
+	heim_assert(heim_json_serialize(o, HEIM_JSON_F_ONE_LINE, json_out_f,
+					&out, NULL) == 0, "stream");
+	heim_assert(out.len == strlen(heim_string_get_utf8(str)) &&
+		    memcmp(out.buf, heim_string_get_utf8(str), out.len) == 0,
+		    "streamed JSON differs");
+	heim_release(str);
+	heim_release(o);
+    }
+
+    /* Repeated keys are shared */
+    o = heim_json_create("[ { \"k1\" : 1 }, { \"k1\" : 2 } ]", 10, 0, NULL);
+    heim_assert(o != NULL, "array");
+    o2 = heim_array_get_value(o, 1);
+    heim_assert(heim_dict_get_value(o2, k1) != NULL, "interned key lookup");
+    heim_release(o);
+
     heim_release(k1);
 
     return 0;
@@ -665,6 +747,60 @@ static struct heim_db_type dbt = {
     dict_db_del_key, dict_db_iter
 };
 
+static int
+test_db_journal(const char *dbname)
+{
+    heim_data_t k1, k2, v1, v2, v;
+    heim_dict_t options;
+    heim_db_t db, db2;
+    int ret;
+
+    options = heim_dict_create(11);
+    if (options == NULL) return ENOMEM;
+    if (heim_dict_set_value(options, HSTR("append-journal"), heim_null_create()) ||
+	heim_dict_set_value(options, HSTR("create"), heim_null_create()) ||
+	heim_dict_set_value(options, HSTR("truncate"), heim_null_create()))
+	return ENOMEM;
+    db = heim_db_create("json", dbname, options, NULL);
+    heim_assert(db, "...");
+    heim_release(options);
+
+    k1 = heim_data_create("msg", strlen("msg"));
+    k2 = heim_data_create("msg2", strlen("msg2"));
+    v1 = heim_data_create("Hello world!", strlen("Hello world!"));
+    v2 = heim_data_create("FooBar", strlen("FooBar"));
+
+    ret = heim_db_set_value(db, NULL, k1, v1, NULL);
+    heim_assert(!ret, "...");
+    ret = heim_db_set_value(db, NULL, k2, v2, NULL);
+    heim_assert(!ret, "...");
+    ret = heim_db_delete_key(db, NULL, k1, NULL);
+    heim_assert(!ret, "...");
+
+    /* A second handle sees the journalled changes */
+    options = heim_dict_create(11);
+    if (options == NULL) return ENOMEM;
+    if (heim_dict_set_value(options, HSTR("append-journal"), heim_null_create()))
+	return ENOMEM;
+    db2 = heim_db_create("json", dbname, options, NULL);
+    heim_assert(db2, "...");
+    heim_release(options);
+
+    v = heim_db_copy_value(db2, NULL, k1, NULL);
+    heim_assert(v == NULL, "deleted key came back from the journal");
+    v = heim_db_copy_value(db2, NULL, k2, NULL);
+    heim_assert(v && !heim_cmp(v, v2), "journalled value lost");
+    heim_release(v);
+
+    heim_release(db2);
+    heim_release(db);
+    heim_release(k1);
+    heim_release(k2);
+    heim_release(v1);
+    heim_release(v2);
+    return 0;
+}
+
 static int
 test_db(const char *dbtype, const char *dbname)
 {
@@ -940,6 +1076,49 @@ test_array()
     return 0;
 }
 
+static int
+test_log(void)
+{
+    const char *specs[] = { "0-/ASYNC:FILE=test_log.log", NULL };
+    heim_log_facility *fac = NULL;
+    heim_context context;
+    char buf[128];
+    FILE *f;
+    int i, n = 0;
+
+    unlink("test_log.log");
+    if ((context = heim_context_init()) == NULL)
+	return ENOMEM;
+    if (heim_openlog(context, "test_base", specs, &fac) != 0) {
+	heim_context_free(&context);
+	return 1;
+    }
+    for (i = 0; i < 1000; i++)
+	heim_log(context, fac, 0, "message %d", i);
+    /* Closing waits for the writer to drain the queue */
+    heim_closelog(context, fac);
+    heim_context_free(&context);
+
+    if ((f = fopen("test_log.log", "r")) == NULL)
+	return 1;
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+	char *p = strstr(buf, "message ");
+
+	/* Messages are either written in order or dropped and counted */
+	if (p && atoi(p + sizeof("message ") - 1) >= n)
+	    n = atoi(p + sizeof("message ") - 1) + 1;
+	else if (strstr(buf, "messages dropped") == NULL)
+	    break;
+    }
+    fclose(f);
+    unlink("test_log.log");
+    if (n != 1000) {
+	fprintf(stderr, "ASYNC log lost or reordered messages\n");
+	return 1;
+    }
+    return 0;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -956,7 +1135,9 @@ main(int argc, char **argv)
     res |= test_path();
     res |= test_db(NULL, NULL);
     res |= test_db("json", argc > 1 ? argv[1] : "test_db.json");
+    res |= test_db_journal("test_db_journal.json");
     res |= test_array();
+    res |= test_log();
 
     return res ? 1 : 0;
 }
@@ -0,0 +1,563 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * An end-to-end benchmark for GSS-API mechanisms.  Like test_context, this
+ * plays both the initiator and the acceptor in one process, but rather than
+ * checking one exchange it has N threads each establish a number of
+ * security contexts and then wrap/unwrap and get/verify MICs over each of
+ * them, and reports throughput and latency percentiles for each operation,
+ * for each mechanism given.
+ *
+ * The ops/s column is the rate one would see if the threads did only that
+ * operation: the count divided by the time the threads spent doing it.
+ *
+ * This is not a test -- it's a manual utility:
+ *
+ *  $ KRB5CCNAME=FILE:/tmp/cc KRB5_KTNAME=FILE:/tmp/kt \
+ *      ./gss_bench --threads=8 --contexts=1000 --operations=100 \
+ *      --mech-types=krb5,spnego host@test.h5l.se
+ *  $ ./gss_bench --anonymous --mech-types=sanon-x25519 host@test.h5l.se
+ */
+
+#include "krb5/gsskrb5_locl.h"
+#include <err.h>
+#include <pthread.h>
+#include <getarg.h>
+#include <gssapi.h>
+#include <gssapi_krb5.h>
+#include <gssapi_spnego.h>
+#include "test_common.h"
+
+enum bench_op { OP_ESTABLISH, OP_WRAP, OP_UNWRAP, OP_GETMIC, OP_VERIFYMIC,
+                OP_MAX };
+
+static const char *op_names[OP_MAX] = {
+    "context", "wrap", "unwrap", "getmic", "verifymic"
+};
+
+struct op_stats {
+    uint64_t count;
+    uint64_t errors;
+    double busy;        /* seconds spent in this operation */
+    uint32_t *lat;      /* latencies, in microseconds */
+    size_t nlat;
+    size_t alloced;
+};
+
+struct worker {
+    gss_OID mech;
+    gss_cred_id_t cred;
+    gss_name_t target;
+    pthread_t thread;
+    struct op_stats st[OP_MAX];
+};
+
+static char *type_string;
+static char *mechs_string = "krb5";
+static char *client_ccache;
+static char *client_keytab;
+static char *acceptor_keytab;
+static char *limit_enctype_string;
+static int nthreads = 1;
+static int ncontexts = 100;
+static int operations = 100;
+static int message_size = 1024;
+static int conf_flag = 1;
+static int mutual_auth_flag;
+static int anon_flag;
+static int help_flag;
+static int version_flag;
+
+static krb5_enctype limit_enctype;
+static gss_buffer_desc message;
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+record(struct op_stats *st, double start, double end)
+{
+    double us = (end - start) * 1000000.0;
+
+    st->count++;
+    st->busy += end - start;
+    if (st->nlat == st->alloced) {
+        size_t n = st->alloced ? st->alloced * 2 : 4096;
+        uint32_t *tmp = realloc(st->lat, n * sizeof(st->lat[0]));
+
+        if (tmp == NULL)
+            err(1, "Out of memory");
+        st->lat = tmp;
+        st->alloced = n;
+    }
+    st->lat[st->nlat++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+/*
+ * Establish a context, passing tokens from the initiator to the acceptor
+ * and back until both are done.
+ */
+static void
+establish(struct worker *w, gss_ctx_id_t *cctx, gss_ctx_id_t *sctx)
+{
+    OM_uint32 maj_stat, min_stat;
+    OM_uint32 flags = GSS_C_REPLAY_FLAG | GSS_C_INTEG_FLAG | GSS_C_CONF_FLAG;
+    gss_buffer_desc input_token = GSS_C_EMPTY_BUFFER;
+    gss_buffer_desc output_token = GSS_C_EMPTY_BUFFER;
+    gss_name_t src_name = GSS_C_NO_NAME;
+    int client_done = 0, server_done = 0;
+
+    if (mutual_auth_flag)
+        flags |= GSS_C_MUTUAL_FLAG;
+    if (anon_flag)
+        flags |= GSS_C_ANON_FLAG;
+
+    while (!client_done || !server_done) {
+        if (!client_done) {
+            maj_stat = gss_init_sec_context(&min_stat, w->cred, cctx,
+                                            w->target, w->mech, flags, 0,
+                                            GSS_C_NO_CHANNEL_BINDINGS,
+                                            &input_token, NULL,
+                                            &output_token, NULL, NULL);
+            if (GSS_ERROR(maj_stat))
+                errx(1, "gss_init_sec_context: %s",
+                     gssapi_err(maj_stat, min_stat, w->mech));
+            client_done = !(maj_stat & GSS_S_CONTINUE_NEEDED);
+            gss_release_buffer(&min_stat, &input_token);
+        }
+        if (output_token.length == 0)
+            break;
+        if (!server_done) {
+            maj_stat = gss_accept_sec_context(&min_stat, sctx,
+                                              GSS_C_NO_CREDENTIAL,
+                                              &output_token,
+                                              GSS_C_NO_CHANNEL_BINDINGS,
+                                              &src_name, NULL,
+                                              &input_token, NULL, NULL,
+                                              NULL);
+            if (GSS_ERROR(maj_stat))
+                errx(1, "gss_accept_sec_context: %s",
+                     gssapi_err(maj_stat, min_stat, w->mech));
+            server_done = !(maj_stat & GSS_S_CONTINUE_NEEDED);
+            gss_release_name(&min_stat, &src_name);
+        }
+        gss_release_buffer(&min_stat, &output_token);
+        if (input_token.length == 0 && !client_done)
+            errx(1, "Acceptor produced no token for an unfinished initiator");
+    }
+    gss_release_buffer(&min_stat, &input_token);
+    gss_release_buffer(&min_stat, &output_token);
+    if (!client_done || !server_done)
+        errx(1, "Context establishment did not complete");
+}
+
+static void
+per_message(struct worker *w, gss_ctx_id_t cctx, gss_ctx_id_t sctx)
+{
+    OM_uint32 maj_stat, min_stat;
+    gss_buffer_desc token, out;
+    double t0, t1;
+    int conf_state;
+
+    t0 = now();
+    maj_stat = gss_wrap(&min_stat, cctx, conf_flag, GSS_C_QOP_DEFAULT,
+                        &message, &conf_state, &token);
+    t1 = now();
+    record(&w->st[OP_WRAP], t0, t1);
+    if (maj_stat != GSS_S_COMPLETE) {
+        w->st[OP_WRAP].errors++;
+    } else {
+        t0 = now();
+        maj_stat = gss_unwrap(&min_stat, sctx, &token, &out, NULL, NULL);
+        t1 = now();
+        record(&w->st[OP_UNWRAP], t0, t1);
+        if (maj_stat != GSS_S_COMPLETE)
+            w->st[OP_UNWRAP].errors++;
+        else
+            gss_release_buffer(&min_stat, &out);
+        gss_release_buffer(&min_stat, &token);
+    }
+
+    t0 = now();
+    maj_stat = gss_get_mic(&min_stat, cctx, GSS_C_QOP_DEFAULT, &message,
+                           &token);
+    t1 = now();
+    record(&w->st[OP_GETMIC], t0, t1);
+    if (maj_stat != GSS_S_COMPLETE) {
+        w->st[OP_GETMIC].errors++;
+    } else {
+        t0 = now();
+        maj_stat = gss_verify_mic(&min_stat, sctx, &message, &token, NULL);
+        t1 = now();
+        record(&w->st[OP_VERIFYMIC], t0, t1);
+        if (maj_stat != GSS_S_COMPLETE)
+            w->st[OP_VERIFYMIC].errors++;
+        gss_release_buffer(&min_stat, &token);
+    }
+}
+
+static void *
+run_worker(void *d)
+{
+    struct worker *w = d;
+    OM_uint32 min_stat;
+    int i, k;
+
+    for (i = 0; i < ncontexts; i++) {
+        gss_ctx_id_t cctx = GSS_C_NO_CONTEXT;
+        gss_ctx_id_t sctx = GSS_C_NO_CONTEXT;
+        double t0;
+
+        t0 = now();
+        establish(w, &cctx, &sctx);
+        record(&w->st[OP_ESTABLISH], t0, now());
+
+        for (k = 0; k < operations; k++)
+            per_message(w, cctx, sctx);
+
+        gss_delete_sec_context(&min_stat, &cctx, GSS_C_NO_BUFFER);
+        gss_delete_sec_context(&min_stat, &sctx, GSS_C_NO_BUFFER);
+    }
+    return NULL;
+}
+
+/*
+ * Describe the session key of one context, so results for different
+ * enctypes can be told apart.
+ */
+static void
+describe(krb5_context context, struct worker *w)
+{
+    OM_uint32 maj_stat, min_stat;
+    gss_ctx_id_t cctx = GSS_C_NO_CONTEXT;
+    gss_ctx_id_t sctx = GSS_C_NO_CONTEXT;
+    krb5_keyblock *key = NULL;
+    char *enctype = NULL;
+
+    establish(w, &cctx, &sctx);
+    maj_stat = gsskrb5_get_subkey(&min_stat, cctx, &key);
+    if (maj_stat == GSS_S_COMPLETE &&
+        krb5_enctype_to_string(context, key->keytype, &enctype) == 0)
+        printf("%s, %s, %d byte messages%s\n", gss_oid_to_name(w->mech),
+               enctype, message_size, conf_flag ? "" : " (integrity only)");
+    else
+        printf("%s, %d byte messages%s\n", gss_oid_to_name(w->mech),
+               message_size, conf_flag ? "" : " (integrity only)");
+    free(enctype);
+    if (key)
+        krb5_free_keyblock(context, key);
+    gss_delete_sec_context(&min_stat, &cctx, GSS_C_NO_BUFFER);
+    gss_delete_sec_context(&min_stat, &sctx, GSS_C_NO_BUFFER);
+}
+
+static int
+lat_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t
+percentile(const uint32_t *lat, size_t n, unsigned int pct)
+{
+    size_t i = (n * pct + 99) / 100;
+
+    return lat[i ? i - 1 : 0];
+}
+
+static void
+report(struct worker *workers, size_t nworkers, double elapsed)
+{
+    size_t i, k;
+
+    printf("%-10s %10s %8s %12s %8s %8s %8s %8s\n",
+           "op", "count", "errors", "ops/s",
+           "p50us", "p90us", "p99us", "maxus");
+    for (i = 0; i < OP_MAX; i++) {
+        struct op_stats all;
+
+        memset(&all, 0, sizeof(all));
+        for (k = 0; k < nworkers; k++) {
+            all.count += workers[k].st[i].count;
+            all.errors += workers[k].st[i].errors;
+            all.busy += workers[k].st[i].busy;
+            all.nlat += workers[k].st[i].nlat;
+        }
+        if (all.nlat == 0)
+            continue;
+        if (all.busy <= 0)
+            all.busy = 1e-6;
+        if ((all.lat = calloc(all.nlat, sizeof(all.lat[0]))) == NULL)
+            err(1, "Out of memory");
+        for (k = 0; k < nworkers; k++) {
+            if (workers[k].st[i].nlat == 0)
+                continue;
+            memcpy(all.lat + all.alloced, workers[k].st[i].lat,
+                   workers[k].st[i].nlat * sizeof(all.lat[0]));
+            all.alloced += workers[k].st[i].nlat;
+        }
+        qsort(all.lat, all.nlat, sizeof(all.lat[0]), lat_cmp);
+        printf("%-10s %10llu %8llu %12.1f %8u %8u %8u %8u\n",
+               op_names[i], (unsigned long long)all.count,
+               (unsigned long long)all.errors,
+               all.count / (all.busy / nworkers),
+               percentile(all.lat, all.nlat, 50),
+               percentile(all.lat, all.nlat, 90),
+               percentile(all.lat, all.nlat, 99),
+               all.lat[all.nlat - 1]);
+        free(all.lat);
+    }
+    printf("%lu contexts in %.2fs with %lu threads\n\n",
+           (unsigned long)(nworkers * ncontexts), elapsed,
+           (unsigned long)nworkers);
+}
+
+static gss_cred_id_t
+acquire_initiator_cred(gss_OID mech)
+{
+    OM_uint32 maj_stat, min_stat;
+    gss_key_value_element_desc elements[2];
+    gss_key_value_set_desc store;
+    gss_OID_set_desc mechs;
+    gss_cred_id_t cred = GSS_C_NO_CREDENTIAL;
+
+    if (anon_flag)
+        return GSS_C_NO_CREDENTIAL;
+
+    store.count = 0;
+    store.elements = elements;
+    if (client_ccache) {
+        elements[store.count].key = "ccache";
+        elements[store.count++].value = client_ccache;
+    }
+    if (client_keytab) {
+        elements[store.count].key = "client_keytab";
+        elements[store.count++].value = client_keytab;
+    }
+    mechs.count = 1;
+    mechs.elements = mech;
+
+    maj_stat = gss_acquire_cred_from(&min_stat, GSS_C_NO_NAME,
+                                     GSS_C_INDEFINITE, &mechs,
+                                     GSS_C_INITIATE,
+                                     store.count ? &store
+                                                 : GSS_C_NO_CRED_STORE,
+                                     &cred, NULL, NULL);
+    if (GSS_ERROR(maj_stat))
+        errx(1, "gss_acquire_cred_from: %s",
+             gssapi_err(maj_stat, min_stat, mech));
+
+    if (limit_enctype) {
+        maj_stat = gss_krb5_set_allowable_enctypes(&min_stat, cred,
+                                                   1, &limit_enctype);
+        if (maj_stat)
+            errx(1, "gss_krb5_set_allowable_enctypes: %s",
+                 gssapi_err(maj_stat, min_stat, mech));
+    }
+    return cred;
+}
+
+static void
+bench_mech(krb5_context context, gss_OID mech, gss_name_t target)
+{
+    OM_uint32 min_stat;
+    struct worker *workers;
+    gss_cred_id_t cred;
+    double start;
+    size_t k;
+
+    cred = acquire_initiator_cred(mech);
+
+    if ((workers = calloc(nthreads, sizeof(workers[0]))) == NULL)
+        err(1, "Out of memory");
+    for (k = 0; k < (size_t)nthreads; k++) {
+        workers[k].mech = mech;
+        workers[k].cred = cred;
+        workers[k].target = target;
+    }
+
+    /* This also warms up the ccache with a service ticket */
+    describe(context, &workers[0]);
+
+    start = now();
+    for (k = 0; k < (size_t)nthreads; k++) {
+        if ((errno = pthread_create(&workers[k].thread, NULL,
+                                    run_worker, &workers[k])))
+            krb5_err(context, 1, errno, "Could not create a worker thread");
+    }
+    for (k = 0; k < (size_t)nthreads; k++)
+        (void) pthread_join(workers[k].thread, NULL);
+
+    report(workers, nthreads, now() - start);
+
+    for (k = 0; k < (size_t)nthreads; k++) {
+        size_t i;
+
+        for (i = 0; i < OP_MAX; i++)
+            free(workers[k].st[i].lat);
+    }
+    free(workers);
+    gss_release_cred(&min_stat, &cred);
+}
+
+struct getargs args[] = {
+    { "mech-types",	0,	arg_string, &mechs_string,
+	"mechanisms to benchmark, in turn", "mech,..." },
+    { "name-type",	0,	arg_string, &type_string,
+	"type of the target name", "hostbased-service|krb5-principal-name" },
+    { "threads",	't',	arg_integer, &nthreads,
+	"number of worker threads", "N" },
+    { "contexts",	'c',	arg_integer, &ncontexts,
+	"contexts established per thread", "N" },
+    { "operations",	'n',	arg_integer, &operations,
+	"wrap/unwrap and MIC pairs per context", "N" },
+    { "message-size",	0,	arg_integer, &message_size,
+	"size of the wrapped and MICed messages", "bytes" },
+    { "conf",		0,	arg_negative_flag, &conf_flag,
+	"wrap with confidentiality", NULL },
+    { "mutual-auth",	0,	arg_flag,   &mutual_auth_flag,
+	"request mutual authentication", NULL },
+    { "anonymous",	0,	arg_flag,   &anon_flag,
+	"initiate anonymously", NULL },
+    { "client-ccache",	0,	arg_string, &client_ccache,
+	"initiator credentials cache", "ccache" },
+    { "client-keytab",	0,	arg_string, &client_keytab,
+	"initiator keytab", "keytab" },
+    { "acceptor-keytab", 0,	arg_string, &acceptor_keytab,
+	"acceptor keytab", "keytab" },
+    { "limit-enctype",	0,	arg_string, &limit_enctype_string,
+	"initiator enctype", "enctype" },
+    { "help",		'h',	arg_flag,   &help_flag,    NULL, NULL },
+    { "version",	0,	arg_flag,   &version_flag, NULL, NULL }
+};
+
+static int num_args = sizeof(args) / sizeof(args[0]);
+
+int
+main(int argc, char **argv)
+{
+    OM_uint32 maj_stat, min_stat;
+    krb5_context context;
+    gss_buffer_desc name_buf;
+    gss_name_t target;
+    gss_OID nameoid;
+    char *mechs, *mech, *s;
+    int o = 0;
+
+    setprogname(argv[0]);
+
+    if (getarg(args, num_args, argc, argv, &o))
+	krb5_std_usage(1, args, num_args);
+
+    if (help_flag)
+	krb5_std_usage(0, args, num_args);
+
+    if (version_flag){
+	print_version(NULL);
+	return 0;
+    }
+
+    argc -= o;
+    argv += o;
+    if (argc != 1)
+	krb5_std_usage(1, args, num_args);
+
+    if (nthreads <= 0 || ncontexts <= 0 || operations < 0 ||
+        message_size < 0)
+        errx(1, "Invalid arguments");
+
+    if ((krb5_init_context(&context)))
+	errx(1, "krb5_init_context failed");
+
+    if (type_string == NULL ||
+        strcmp(type_string, "hostbased-service") == 0)
+	nameoid = GSS_C_NT_HOSTBASED_SERVICE;
+    else if (strcmp(type_string, "krb5-principal-name") == 0)
+	nameoid = GSS_KRB5_NT_PRINCIPAL_NAME;
+    else
+	errx(1, "%s not supported", type_string);
+
+    if (limit_enctype_string) {
+	krb5_error_code ret;
+
+	ret = krb5_string_to_enctype(context, limit_enctype_string,
+				     &limit_enctype);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_string_to_enctype");
+    }
+
+    if (acceptor_keytab) {
+        maj_stat = gsskrb5_register_acceptor_identity(acceptor_keytab);
+        if (maj_stat != GSS_S_COMPLETE)
+            errx(1, "gsskrb5_register_acceptor_identity failed");
+    }
+
+    name_buf.value = argv[0];
+    name_buf.length = strlen(argv[0]);
+    maj_stat = gss_import_name(&min_stat, &name_buf, nameoid, &target);
+    if (GSS_ERROR(maj_stat))
+        errx(1, "gss_import_name: %s",
+             gssapi_err(maj_stat, min_stat, GSS_C_NO_OID));
+
+    message.length = message_size;
+    if ((message.value = malloc(message_size ? message_size : 1)) == NULL)
+        err(1, "Out of memory");
+    memset(message.value, 'x', message.length);
+
+    if ((mechs = strdup(mechs_string)) == NULL)
+        err(1, "Out of memory");
+    for (mech = strtok_r(mechs, ", ", &s);
+         mech;
+         mech = strtok_r(NULL, ", ", &s)) {
+        gss_OID oid = gss_name_to_oid(mech);
+
+        if (oid == GSS_C_NO_OID)
+            errx(1, "Mechanism %s not known", mech);
+        bench_mech(context, oid, target);
+    }
+
+    free(mechs);
+    free(message.value);
+    gss_release_name(&min_stat, &target);
+    krb5_free_context(context);
+    return 0;
+}
@@ -713,6 +713,10 @@ gss_cred_id_t
 _gss_mg_find_mech_cred(gss_const_cred_id_t cred_handle,
 		       gss_const_OID mech_type);
 
+gssapi_mech_interface
+_gss_mg_get_context_mech(gss_const_ctx_id_t context_handle,
+			 gss_ctx_id_t *mech_ctx);
+
 #include <krb5.h>
 
 /*
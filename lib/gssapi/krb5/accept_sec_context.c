@@ -36,6 +36,86 @@
 HEIMDAL_MUTEX gssapi_keytab_mutex = HEIMDAL_MUTEX_INITIALIZER;
 krb5_keytab _gsskrb5_keytab;
 
+/*
+ * The keytab used to accept without a credential.  A FILE keytab is
+ * resolved once and shared by all such accepts (FILE keytab lookups
+ * are served from a shared index of the file), other types are still
+ * resolved for each accept.  Registering a new acceptor identity drops
+ * the shared one, which is closed when the last accept using it is
+ * done.
+ */
+
+struct acceptor_keytab {
+    krb5_keytab keytab;
+    unsigned int refs;
+};
+
+static struct acceptor_keytab *shared_acceptor_keytab;
+
+static struct acceptor_keytab *
+acceptor_keytab_get(krb5_context context)
+{
+    struct acceptor_keytab *akt;
+    krb5_error_code kret;
+    char type[KRB5_KT_PREFIX_MAX_LEN];
+    char *name = NULL;
+
+    HEIMDAL_MUTEX_lock(&gssapi_keytab_mutex);
+    if ((akt = shared_acceptor_keytab) != NULL) {
+	akt->refs++;
+	HEIMDAL_MUTEX_unlock(&gssapi_keytab_mutex);
+	return akt;
+    }
+
+    akt = calloc(1, sizeof(*akt));
+    if (akt == NULL) {
+	HEIMDAL_MUTEX_unlock(&gssapi_keytab_mutex);
+	return NULL;
+    }
+    akt->refs = 1;
+
+    if (_gsskrb5_keytab != NULL) {
+	kret = krb5_kt_get_full_name(context, _gsskrb5_keytab, &name);
+	if (kret == 0) {
+	    kret = krb5_kt_resolve(context, name, &akt->keytab);
+	    krb5_xfree(name);
+	}
+    } else {
+	kret = krb5_kt_default(context, &akt->keytab);
+    }
+    if (kret) {
+	HEIMDAL_MUTEX_unlock(&gssapi_keytab_mutex);
+	free(akt);
+	return NULL;
+    }
+
+    if (krb5_kt_get_type(context, akt->keytab, type, sizeof(type)) == 0 &&
+	strcmp(type, "FILE") == 0) {
+	akt->refs++;
+	shared_acceptor_keytab = akt;
+    }
+    HEIMDAL_MUTEX_unlock(&gssapi_keytab_mutex);
+    return akt;
+}
+
+static void
+acceptor_keytab_release(krb5_context context, struct acceptor_keytab *akt)
+{
+    int last;
+
+    if (akt == NULL)
+	return;
+
+    HEIMDAL_MUTEX_lock(&gssapi_keytab_mutex);
+    last = (--akt->refs == 0);
+    HEIMDAL_MUTEX_unlock(&gssapi_keytab_mutex);
+
+    if (last) {
+	krb5_kt_close(context, akt->keytab);
+	free(akt);
+    }
+}
+
 static krb5_error_code
 validate_keytab(krb5_context context, const char *name, krb5_keytab *id)
 {
@@ -57,6 +137,7 @@ validate_keytab(krb5_context context, const char *name, krb5_keytab *id)
 OM_uint32
 _gsskrb5_register_acceptor_identity(OM_uint32 *min_stat, const char *identity)
 {
+    struct acceptor_keytab *old;
     krb5_context context;
     krb5_error_code ret;
 
@@ -68,6 +149,9 @@ _gsskrb5_register_acceptor_identity(OM_uint32 *min_stat, const char *identity)
 
     HEIMDAL_MUTEX_lock(&gssapi_keytab_mutex);
 
+    old = shared_acceptor_keytab;
+    shared_acceptor_keytab = NULL;
+
     if(_gsskrb5_keytab != NULL) {
 	krb5_kt_close(context, _gsskrb5_keytab);
 	_gsskrb5_keytab = NULL;
@@ -87,6 +171,7 @@ _gsskrb5_register_acceptor_identity(OM_uint32 *min_stat, const char *identity)
 	    ret = asprintf(&p, "FILE:%s", identity);
 	    if(ret < 0 || p == NULL) {
 		HEIMDAL_MUTEX_unlock(&gssapi_keytab_mutex);
+		acceptor_keytab_release(context, old);
 		return GSS_S_FAILURE;
 	    }
 	    ret = validate_keytab(context, p, &_gsskrb5_keytab);
@@ -94,6 +179,7 @@ _gsskrb5_register_acceptor_identity(OM_uint32 *min_stat, const char *identity)
 	}
     }
     HEIMDAL_MUTEX_unlock(&gssapi_keytab_mutex);
+    acceptor_keytab_release(context, old);
     if(ret) {
 	*min_stat = ret;
 	return GSS_S_FAILURE;
@@ -277,7 +363,9 @@ gsskrb5_acceptor_ready(OM_uint32 * minor_status,
     ret = _gssapi_msg_order_create(minor_status,
 				   &ctx->order,
 				   _gssapi_msg_order_f(ctx->flags),
-				   seq_number, 0, is_cfx);
+				   seq_number,
+				   _gssapi_msg_order_window(context),
+				   is_cfx);
     if (ret)
 	return ret;
 
@@ -392,7 +480,7 @@ gsskrb5_acceptor_start(OM_uint32 * minor_status,
     krb5_flags ap_options;
     krb5_keytab keytab = NULL;
     int is_cfx = 0;
-    int close_kt = 0;
+    struct acceptor_keytab *akt = NULL;
     const gsskrb5_cred acceptor_cred = (gsskrb5_cred)acceptor_cred_handle;
 
     /*
@@ -421,20 +509,9 @@ gsskrb5_acceptor_start(OM_uint32 * minor_status,
      * We need to get our keytab
      */
     if (acceptor_cred == NULL) {
-	HEIMDAL_MUTEX_lock(&gssapi_keytab_mutex);
-	if (_gsskrb5_keytab != NULL) {
-	    char *name = NULL;
-	    kret = krb5_kt_get_full_name(context, _gsskrb5_keytab, &name);
-	    if (kret == 0) {
-		kret = krb5_kt_resolve(context, name, &keytab);
-		krb5_xfree(name);
-	    }
-	    if (kret == 0)
-		close_kt = 1;
-	    else
-		keytab = NULL;
-	}
-	HEIMDAL_MUTEX_unlock(&gssapi_keytab_mutex);
+	akt = acceptor_keytab_get(context);
+	if (akt != NULL)
+	    keytab = akt->keytab;
     } else if (acceptor_cred->keytab != NULL) {
 	keytab = acceptor_cred->keytab;
     }
@@ -457,8 +534,7 @@ gsskrb5_acceptor_start(OM_uint32 * minor_status,
 	if (kret) {
 	    if (in)
 		krb5_rd_req_in_ctx_free(context, in);
-	    if (close_kt)
-		krb5_kt_close(context, keytab);
+	    acceptor_keytab_release(context, akt);
 	    *minor_status = kret;
 	    return GSS_S_FAILURE;
 	}
@@ -469,8 +545,7 @@ gsskrb5_acceptor_start(OM_uint32 * minor_status,
 			       server,
 			       in, &out);
 	krb5_rd_req_in_ctx_free(context, in);
-	if (close_kt)
-	    krb5_kt_close(context, keytab);
+	acceptor_keytab_release(context, akt);
 	if (kret == KRB5KRB_AP_ERR_SKEW || kret == KRB5KRB_AP_ERR_TKT_NYV) {
 	    /*
 	     * No reply in non-MUTUAL mode, but we don't know that its
@@ -158,6 +158,20 @@ _gssapi_wrap_size_cfx(OM_uint32 *minor_status,
     return 0;
 }
 
+static void
+reverse_bytes(u_char *p, size_t len)
+{
+    u_char *q, c;
+
+    if (len < 2)
+	return;
+    for (q = p + len - 1; p < q; p++, q--) {
+	c = *p;
+	*p = *q;
+	*q = c;
+    }
+}
+
 /*
  * Rotate "rrc" bytes to the front or back
  */
@@ -165,7 +179,7 @@ _gssapi_wrap_size_cfx(OM_uint32 *minor_status,
 static krb5_error_code
 rrc_rotate(void *data, size_t len, uint16_t rrc, krb5_boolean unrotate)
 {
-    u_char *tmp, buf[256];
+    u_char buf[256];
     size_t left;
 
     if (len == 0)
@@ -178,27 +192,26 @@ rrc_rotate(void *data, size_t len, uint16_t rrc, krb5_boolean unrotate)
 
     left = len - rrc;
 
-    if (rrc <= sizeof(buf)) {
-	tmp = buf;
-    } else {
-	tmp = malloc(rrc);
-	if (tmp == NULL)
-	    return ENOMEM;
-    }
-
-    if (unrotate) {
-	memcpy(tmp, data, rrc);
+    if (rrc > sizeof(buf)) {
+	/* Rotate by three reversals rather than allocating */
+	if (unrotate) {
+	    reverse_bytes(data, rrc);
+	    reverse_bytes((u_char *)data + rrc, left);
+	} else {
+	    reverse_bytes(data, left);
+	    reverse_bytes((u_char *)data + left, rrc);
+	}
+	reverse_bytes(data, len);
+    } else if (unrotate) {
+	memcpy(buf, data, rrc);
 	memmove(data, (u_char *)data + rrc, left);
-	memcpy((u_char *)data + left, tmp, rrc);
+	memcpy((u_char *)data + left, buf, rrc);
     } else {
-	memcpy(tmp, (u_char *)data + left, rrc);
+	memcpy(buf, (u_char *)data + left, rrc);
 	memmove((u_char *)data + rrc, data, left);
-	memcpy(data, tmp, rrc);
+	memcpy(data, buf, rrc);
     }
 
-    if (rrc > sizeof(buf))
-	free(tmp);
-
     return 0;
 }
 
@@ -1302,23 +1315,66 @@ OM_uint32 _gssapi_wrap_cfx(OM_uint32 *minor_status,
 	 * The specification does not require that the padding
 	 * bytes are initialized.
 	 */
+	size_t hlen, tlen, plen, dlen;
+
 	p += sizeof(*token);
-	memcpy(p, input_message_buffer->value, input_message_buffer->length);
-	memset(p + input_message_buffer->length, 0xFF, padlength);
-	memcpy(p + input_message_buffer->length + padlength,
-	       token, sizeof(*token));
+	dlen = input_message_buffer->length + padlength + sizeof(*token);
 
-	ret = krb5_encrypt(context, ctx->crypto,
-			   usage, p,
-			   input_message_buffer->length + padlength +
-				sizeof(*token),
-			   &cipher);
-	if (ret != 0) {
-	    *minor_status = ret;
-	    _gsskrb5_release_buffer(minor_status, output_message_buffer);
-	    return GSS_S_FAILURE;
+	/*
+	 * The ciphertext is confounder | data | hmac, so when the
+	 * enctype needs no padding, encrypt in place in the output
+	 * buffer instead of into a new buffer that is then copied.
+	 */
+	if (krb5_crypto_length(context, ctx->crypto,
+			       KRB5_CRYPTO_TYPE_HEADER, &hlen) == 0 &&
+	    krb5_crypto_length(context, ctx->crypto,
+			       KRB5_CRYPTO_TYPE_TRAILER, &tlen) == 0 &&
+	    krb5_crypto_length(context, ctx->crypto,
+			       KRB5_CRYPTO_TYPE_PADDING, &plen) == 0 &&
+	    plen == 0 &&
+	    sizeof(*token) + hlen + dlen + tlen == wrapped_len) {
+	    krb5_crypto_iov iov[3];
+
+	    memcpy(p + hlen, input_message_buffer->value,
+		   input_message_buffer->length);
+	    memset(p + hlen + input_message_buffer->length, 0xFF, padlength);
+	    memcpy(p + hlen + input_message_buffer->length + padlength,
+		   token, sizeof(*token));
+
+	    iov[0].flags = KRB5_CRYPTO_TYPE_HEADER;
+	    iov[0].data.data = p;
+	    iov[0].data.length = hlen;
+	    iov[1].flags = KRB5_CRYPTO_TYPE_DATA;
+	    iov[1].data.data = p + hlen;
+	    iov[1].data.length = dlen;
+	    iov[2].flags = KRB5_CRYPTO_TYPE_TRAILER;
+	    iov[2].data.data = p + hlen + dlen;
+	    iov[2].data.length = tlen;
+
+	    ret = krb5_encrypt_iov_ivec(context, ctx->crypto, usage,
+					iov, 3, NULL);
+	    if (ret != 0) {
+		*minor_status = ret;
+		_gsskrb5_release_buffer(minor_status, output_message_buffer);
+		return GSS_S_FAILURE;
+	    }
+	} else {
+	    memcpy(p, input_message_buffer->value,
+		   input_message_buffer->length);
+	    memset(p + input_message_buffer->length, 0xFF, padlength);
+	    memcpy(p + input_message_buffer->length + padlength,
+		   token, sizeof(*token));
+
+	    ret = krb5_encrypt(context, ctx->crypto, usage, p, dlen, &cipher);
+	    if (ret != 0) {
+		*minor_status = ret;
+		_gsskrb5_release_buffer(minor_status, output_message_buffer);
+		return GSS_S_FAILURE;
+	    }
+	    assert(sizeof(*token) + cipher.length == wrapped_len);
+	    memcpy(p, cipher.data, cipher.length);
+	    krb5_data_free(&cipher);
 	}
-	assert(sizeof(*token) + cipher.length == wrapped_len);
 	token->RRC[0] = (rrc >> 8) & 0xFF;
 	token->RRC[1] = (rrc >> 0) & 0xFF;
 
@@ -1327,64 +1383,56 @@ OM_uint32 _gssapi_wrap_cfx(OM_uint32 *minor_status,
 	 * for DCERPC, as windows rotates by EC+RRC.
 	 */
 	if (IS_DCE_STYLE(ctx)) {
-		ret = rrc_rotate(cipher.data, cipher.length, rrc+padlength, FALSE);
+		ret = rrc_rotate(p, wrapped_len - sizeof(*token),
+				 rrc+padlength, FALSE);
 	} else {
-		ret = rrc_rotate(cipher.data, cipher.length, rrc, FALSE);
+		ret = rrc_rotate(p, wrapped_len - sizeof(*token), rrc, FALSE);
 	}
 	if (ret != 0) {
 	    *minor_status = ret;
 	    _gsskrb5_release_buffer(minor_status, output_message_buffer);
 	    return GSS_S_FAILURE;
 	}
-	memcpy(p, cipher.data, cipher.length);
-	krb5_data_free(&cipher);
     } else {
-	char *buf;
-	Checksum cksum;
+	krb5_crypto_iov iov[3];
 
-	buf = malloc(input_message_buffer->length + sizeof(*token));
-	if (buf == NULL) {
-	    *minor_status = ENOMEM;
-	    _gsskrb5_release_buffer(minor_status, output_message_buffer);
-	    return GSS_S_FAILURE;
-	}
-	memcpy(buf, input_message_buffer->value, input_message_buffer->length);
-	memcpy(buf + input_message_buffer->length, token, sizeof(*token));
+	/*
+	 * Checksum (plaintext | "header") straight into the end of the
+	 * output buffer, the header still has EC and RRC zero here.
+	 */
+	p += sizeof(*token);
+	memcpy(p, input_message_buffer->value, input_message_buffer->length);
 
-	ret = krb5_create_checksum(context, ctx->crypto,
-				   usage, 0, buf,
-				   input_message_buffer->length +
-					sizeof(*token),
-				   &cksum);
+	iov[0].flags = KRB5_CRYPTO_TYPE_DATA;
+	iov[0].data.data = p;
+	iov[0].data.length = input_message_buffer->length;
+	iov[1].flags = KRB5_CRYPTO_TYPE_DATA;
+	iov[1].data.data = token;
+	iov[1].data.length = sizeof(*token);
+	iov[2].flags = KRB5_CRYPTO_TYPE_CHECKSUM;
+	iov[2].data.data = p + input_message_buffer->length;
+	iov[2].data.length = cksumsize;
+
+	ret = krb5_create_checksum_iov(context, ctx->crypto, usage,
+				       iov, 3, NULL);
 	if (ret != 0) {
 	    *minor_status = ret;
 	    _gsskrb5_release_buffer(minor_status, output_message_buffer);
-	    free(buf);
 	    return GSS_S_FAILURE;
 	}
 
-	free(buf);
-
-	assert(cksum.checksum.length == cksumsize);
-	token->EC[0] =  (cksum.checksum.length >> 8) & 0xFF;
-	token->EC[1] =  (cksum.checksum.length >> 0) & 0xFF;
+	token->EC[0] =  (cksumsize >> 8) & 0xFF;
+	token->EC[1] =  (cksumsize >> 0) & 0xFF;
 	token->RRC[0] = (rrc >> 8) & 0xFF;
 	token->RRC[1] = (rrc >> 0) & 0xFF;
 
-	p += sizeof(*token);
-	memcpy(p, input_message_buffer->value, input_message_buffer->length);
-	memcpy(p + input_message_buffer->length,
-	       cksum.checksum.data, cksum.checksum.length);
-
 	ret = rrc_rotate(p,
-	    input_message_buffer->length + cksum.checksum.length, rrc, FALSE);
+	    input_message_buffer->length + cksumsize, rrc, FALSE);
 	if (ret != 0) {
 	    *minor_status = ret;
 	    _gsskrb5_release_buffer(minor_status, output_message_buffer);
-	    free_Checksum(&cksum);
 	    return GSS_S_FAILURE;
 	}
-	free_Checksum(&cksum);
     }
 
     if (conf_state != NULL) {
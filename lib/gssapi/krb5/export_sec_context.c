@@ -92,6 +92,8 @@ _gsskrb5_export_sec_context(
 	flags |= SC_TARGET_NAME;
     if (ctx->order)
 	flags |= SC_ORDER;
+    if (ctx->crypto)
+	flags |= SC_DERIVED_KEYS;
 
     kret = krb5_store_int32 (sp, flags);
     if (kret) {
@@ -195,7 +197,7 @@ _gsskrb5_export_sec_context(
     }
 
     if (ctx->target) {
-        kret = krb5_store_principal(sp, ctx->source);
+        kret = krb5_store_principal(sp, ctx->target);
 	if (kret) {
 	    *minor_status = kret;
 	    goto failure;
@@ -233,8 +235,31 @@ _gsskrb5_export_sec_context(
             goto failure;
         }
     }
+    /*
+     * The keys derived from the session key, so the importer need not
+     * derive them again.  For CFX we derive all the per-message keys
+     * here first, as contexts are often exported before any use.  This
+     * comes last so that importers that don't know about it ignore it.
+     */
+    if (ctx->crypto) {
+        static const krb5_key_usage cfx_usages[] = {
+            KRB5_KU_USAGE_ACCEPTOR_SEAL, KRB5_KU_USAGE_ACCEPTOR_SIGN,
+            KRB5_KU_USAGE_INITIATOR_SEAL, KRB5_KU_USAGE_INITIATOR_SIGN
+        };
+
+        if (ctx->more_flags & IS_CFX)
+            (void) krb5_crypto_prepare_usages(context, ctx->crypto,
+                                              cfx_usages,
+                                              sizeof(cfx_usages) /
+                                              sizeof(cfx_usages[0]));
+        kret = _krb5_crypto_store_derived_keys(context, ctx->crypto, sp);
+        if (kret) {
+            *minor_status = kret;
+            goto failure;
+        }
+    }
 
-    kret = krb5_storage_to_data (sp, &data);
+    kret = krb5_storage_steal_data(sp, &data);
     krb5_storage_free (sp);
     if (kret) {
 	HEIMDAL_MUTEX_unlock(&ctx->ctx_id_mutex);
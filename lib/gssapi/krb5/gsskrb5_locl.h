@@ -144,6 +144,7 @@ extern HEIMDAL_MUTEX gssapi_keytab_mutex;
 #define SC_TARGET_NAME    0x0040
 #define SC_ORDER          0x0080
 #define SC_AUTHENTICATOR  0x0100
+#define SC_DERIVED_KEYS   0x0200
 
 struct gsskrb5_ccache_name_args {
     const char *name;
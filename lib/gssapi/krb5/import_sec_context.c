@@ -58,8 +58,8 @@ _gsskrb5_import_sec_context (
 
     localp = remotep = NULL;
 
-    sp = krb5_storage_from_mem (interprocess_token->value,
-				interprocess_token->length);
+    sp = krb5_storage_from_readonly_mem(interprocess_token->value,
+					interprocess_token->length);
     if (sp == NULL) {
 	*minor_status = ENOMEM;
 	return GSS_S_FAILURE;
@@ -192,10 +192,19 @@ _gsskrb5_import_sec_context (
             goto failure;
     }
 
-    krb5_storage_free (sp);
-
     _gsskrb5i_is_cfx(context, ctx, (ctx->more_flags & LOCAL) == 0);
 
+    if ((flags & SC_DERIVED_KEYS) && ctx->crypto) {
+        kret = _krb5_crypto_ret_derived_keys(context, ctx->crypto, sp);
+        if (kret) {
+            *minor_status = kret;
+            ret = GSS_S_FAILURE;
+            goto failure;
+        }
+    }
+
+    krb5_storage_free (sp);
+
     *context_handle = (gss_ctx_id_t)ctx;
 
     return GSS_S_COMPLETE;
@@ -213,6 +222,8 @@ failure:
 	krb5_free_address (context, remotep);
     if(ctx->order)
 	_gssapi_msg_order_destroy(&ctx->order);
+    if (ctx->crypto)
+	krb5_crypto_destroy(context, ctx->crypto);
     HEIMDAL_MUTEX_destroy(&ctx->ctx_id_mutex);
     krb5_storage_free (sp);
     free (ctx);
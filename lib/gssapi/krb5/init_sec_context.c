@@ -309,7 +309,9 @@ gsskrb5_initiator_ready(
     ret = _gssapi_msg_order_create(minor_status,
 				   &ctx->order,
 				   _gssapi_msg_order_f(flags),
-				   seq_number, 0, is_cfx);
+				   seq_number,
+				   _gssapi_msg_order_window(context),
+				   is_cfx);
     if (ret) return ret;
 
     ctx->state	= INITIATOR_READY;
@@ -672,6 +672,78 @@ get_peer_realm(OM_uint32 *minor_status,
     return GSS_S_COMPLETE;
 }
 
+/*
+ * The PAC of a name is found in the Ticket's authorization data and parsed
+ * on first use, and the parsed PAC is kept with the name's attributes so
+ * that later queries for PAC-derived attributes are served from it.  A
+ * parsed PAC decodes some of its buffers on demand, and copies of a name
+ * share the same parsed PAC, so it is only used under pac_view_mutex.
+ */
+struct pac_view {
+    krb5_data ad;           /* The AD-WIN2K-PAC element's contents */
+    krb5_pac pac;           /* Borrows from `ad' */
+    krb5_error_code ret;    /* ENOENT if there is no PAC */
+};
+
+static HEIMDAL_MUTEX pac_view_mutex = HEIMDAL_MUTEX_INITIALIZER;
+
+static void
+pac_view_dealloc(void *ptr)
+{
+    struct pac_view *v = ptr;
+
+    krb5_pac_free(NULL, v->pac);
+    krb5_data_free(&v->ad);
+}
+
+/* On success returns with pac_view_mutex held; see unlock_pac_view() */
+static krb5_error_code
+lock_pac_view(krb5_context context,
+              PrincipalNameAttrs *nameattrs,
+              const EncTicketPart *ticket,
+              struct pac_view **viewp)
+{
+    struct pac_view *v;
+    krb5_error_code ret;
+
+    *viewp = NULL;
+
+    HEIMDAL_MUTEX_lock(&pac_view_mutex);
+    if ((v = nameattrs->pac_view) == NULL) {
+        v = heim_alloc(sizeof(*v), "gss-krb5-pac-view", pac_view_dealloc);
+        if (v == NULL) {
+            HEIMDAL_MUTEX_unlock(&pac_view_mutex);
+            return krb5_enomem(context);
+        }
+        v->ret = _krb5_get_ad(context, ticket->authorization_data,
+                              NULL, KRB5_AUTHDATA_WIN2K_PAC, &v->ad);
+        if (v->ret == 0)
+            v->ret = _krb5_pac_parse_borrowed(context, v->ad.data,
+                                              v->ad.length, &v->pac);
+        if (v->ret && v->ret != ENOENT) {
+            /* Don't remember transient failures */
+            ret = v->ret;
+            HEIMDAL_MUTEX_unlock(&pac_view_mutex);
+            heim_release(v);
+            return ret;
+        }
+        nameattrs->pac_view = v;
+    }
+    if ((ret = v->ret)) {
+        HEIMDAL_MUTEX_unlock(&pac_view_mutex);
+        return ret;
+    }
+    *viewp = v;
+    return 0;
+}
+
+static void
+unlock_pac_view(struct pac_view *v)
+{
+    if (v)
+        HEIMDAL_MUTEX_unlock(&pac_view_mutex);
+}
+
 static OM_uint32
 get_pac(OM_uint32 *minor_status,
         const CompositePrincipal *name,
@@ -686,14 +758,14 @@ get_pac(OM_uint32 *minor_status,
 {
     krb5_error_code kret;
     krb5_context context;
-    krb5_data data, pac_data;
+    krb5_data data;
     krb5_data suffix;
     PrincipalNameAttrs *nameattrs = name->nameattrs;
     PrincipalNameAttrSrc *src = nameattrs ? nameattrs->source : NULL;
     EncTicketPart *ticket = NULL;
+    struct pac_view *v = NULL;
 
     krb5_data_zero(&data);
-    krb5_data_zero(&pac_data);
 
     if (src) switch (src->element) {
     case choice_PrincipalNameAttrSrc_enc_ticket_part:
@@ -722,30 +794,20 @@ get_pac(OM_uint32 *minor_status,
     if (complete)
         *complete = 1;
 
-    kret = _krb5_get_ad(context, ticket->authorization_data,
-                        NULL, KRB5_AUTHDATA_WIN2K_PAC, &pac_data);
-    if (kret == 0 && suffix.length) {
-        krb5_pac pac;
-
-        kret = krb5_pac_parse(context, pac_data.data, pac_data.length, &pac);
-        if (kret == 0) {
-            kret = _krb5_pac_get_buffer_by_name(context, pac, &suffix,
-                                                value ? &data : NULL);
-            krb5_pac_free(context, pac);
-        }
+    kret = lock_pac_view(context, nameattrs, ticket, &v);
+    if (kret == 0 && suffix.length)
+        kret = _krb5_pac_get_buffer_by_name(context, v->pac, &suffix,
+                                            value ? &data : NULL);
+    else if (kret == 0 && value)
+        kret = krb5_data_copy(&data, v->ad.data, v->ad.length);
+    unlock_pac_view(v);
 
-        if (value) {
-            value->length = data.length;
-            value->value = data.data;
-            krb5_data_zero(&data);
-        }
-    } else if (kret == 0 && value) {
-        value->length = pac_data.length;
-        value->value = pac_data.data;
-        krb5_data_zero(&pac_data);
+    if (kret == 0 && value) {
+        value->length = data.length;
+        value->value = data.data;
+        krb5_data_zero(&data);
     }
 
-    krb5_data_free(&pac_data);
     krb5_data_free(&data);
     *minor_status = kret;
     if (kret == ENOENT)
@@ -1084,27 +1146,19 @@ get_canonical_name(OM_uint32 *minor_status,
                                                   kdcrep->sname,
                                                   kdcrep->srealm);
     } else if (ticket) {
-        krb5_data data;
-        krb5_pac pac = NULL;
-
-        krb5_data_zero(&data);
+        struct pac_view *v = NULL;
 
         /* Use canonical name from PAC if available */
-        kret = _krb5_get_ad(context, ticket->authorization_data,
-                            NULL, KRB5_AUTHDATA_WIN2K_PAC, &data);
+        kret = lock_pac_view(context, nameattrs, ticket, &v);
         if (kret == 0)
-            kret = krb5_pac_parse(context, data.data, data.length, &pac);
-        if (kret == 0)
-            kret = _krb5_pac_get_canon_principal(context, pac, &p);
+            kret = _krb5_pac_get_canon_principal(context, v->pac, &p);
+        unlock_pac_view(v);
         if (kret == 0 && authenticated)
             *authenticated = nameattrs->pac_verified;
         else if (kret == ENOENT)
             kret = _krb5_principalname2krb5_principal(context, &p,
                                                       ticket->cname,
                                                       ticket->crealm);
-
-        krb5_data_free(&data);
-        krb5_pac_free(context, pac);
     } else
         return GSS_S_UNAVAILABLE;
     if (kret == 0 && value) {
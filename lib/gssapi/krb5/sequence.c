@@ -34,6 +34,16 @@
 #include "gsskrb5_locl.h"
 
 #define DEFAULT_JITTER_WINDOW 20
+#define MAX_JITTER_WINDOW 65536
+
+/*
+ * Sequence numbers at or below last_seq are tracked in a bitmap of
+ * nbits (a power of two, at least the jitter window) indexed by the
+ * sequence number modulo nbits, so that checking a number and moving
+ * the window forward do not move any memory.  `length' is how many
+ * numbers at and below last_seq are inside the window and not before
+ * first_seq.
+ */
 
 struct gss_msg_order {
     OM_uint32 flags;
@@ -41,7 +51,9 @@ struct gss_msg_order {
     OM_uint32 length;
     OM_uint32 jitter_window;
     OM_uint32 first_seq;
-    OM_uint32 elem[1];
+    OM_uint32 last_seq;
+    OM_uint32 nbits;
+    uint32_t bits[1];
 };
 
 
@@ -54,22 +66,52 @@ msg_order_alloc(OM_uint32 *minor_status,
 		struct gss_msg_order **o,
 		OM_uint32 jitter_window)
 {
+    OM_uint32 nbits = 32;
     size_t len;
 
-    len = jitter_window * sizeof((*o)->elem[0]);
+    if (jitter_window > MAX_JITTER_WINDOW) {
+	*o = NULL;
+	*minor_status = ERANGE;
+	return GSS_S_FAILURE;
+    }
+
+    while (nbits < jitter_window)
+	nbits <<= 1;
+
+    len = (nbits / 32) * sizeof((*o)->bits[0]);
     len += sizeof(**o);
-    len -= sizeof((*o)->elem[0]);
+    len -= sizeof((*o)->bits[0]);
 
     *o = calloc(1, len);
     if (*o == NULL) {
 	*minor_status = ENOMEM;
 	return GSS_S_FAILURE;
     }
+    (*o)->nbits = nbits;
 
     *minor_status = 0;
     return GSS_S_COMPLETE;
 }
 
+/*
+ * The jitter window to use, [gssapi] sequence_window in krb5.conf,
+ * or 0 for the default.
+ */
+
+OM_uint32
+_gssapi_msg_order_window(krb5_context context)
+{
+    int window;
+
+    window = krb5_config_get_int_default(context, NULL, 0, "gssapi",
+					 "sequence_window", NULL);
+    if (window < 0)
+	return 0;
+    if (window > MAX_JITTER_WINDOW)
+	return MAX_JITTER_WINDOW;
+    return window;
+}
+
 /*
  *
  */
@@ -95,7 +137,7 @@ _gssapi_msg_order_create(OM_uint32 *minor_status,
     (*o)->length = 0;
     (*o)->first_seq = seq_num;
     (*o)->jitter_window = jitter_window;
-    (*o)->elem[0] = seq_num - 1;
+    (*o)->last_seq = seq_num - 1;
 
     *minor_status = 0;
     return GSS_S_COMPLETE;
@@ -109,39 +151,58 @@ _gssapi_msg_order_destroy(struct gss_msg_order **m)
     return GSS_S_COMPLETE;
 }
 
+static int
+seq_test(struct gss_msg_order *o, OM_uint32 seq_num)
+{
+    OM_uint32 bit = seq_num & (o->nbits - 1);
+    return (o->bits[bit / 32] >> (bit % 32)) & 1;
+}
+
 static void
-elem_set(struct gss_msg_order *o, unsigned int slot, OM_uint32 val)
+seq_set(struct gss_msg_order *o, OM_uint32 seq_num)
 {
-    o->elem[slot % o->jitter_window] = val;
+    OM_uint32 bit = seq_num & (o->nbits - 1);
+    o->bits[bit / 32] |= 1U << (bit % 32);
 }
 
 static void
-elem_insert(struct gss_msg_order *o,
-	    unsigned int after_slot,
-	    OM_uint32 seq_num)
+seq_clear(struct gss_msg_order *o, OM_uint32 seq_num)
 {
-    assert(o->jitter_window > after_slot);
+    OM_uint32 bit = seq_num & (o->nbits - 1);
+    o->bits[bit / 32] &= ~(1U << (bit % 32));
+}
 
-    if (o->length > after_slot)
-	memmove(&o->elem[after_slot + 1], &o->elem[after_slot],
-		(o->length - after_slot - 1) * sizeof(o->elem[0]));
+/* Move the window forward so that seq_num is the last and seen */
+static void
+seq_advance(struct gss_msg_order *o, OM_uint32 seq_num)
+{
+    OM_uint32 n = seq_num - o->last_seq;
 
-    elem_set(o, after_slot, seq_num);
+    if (n >= o->nbits) {
+	memset(o->bits, 0, (o->nbits / 32) * sizeof(o->bits[0]));
+    } else {
+	OM_uint32 i;
 
-    if (o->length < o->jitter_window)
-	o->length++;
+	for (i = 1; i <= n; i++)
+	    seq_clear(o, o->last_seq + i);
+    }
+    if (n >= o->jitter_window - o->length)
+	o->length = o->jitter_window;
+    else
+	o->length += n;
+    o->last_seq = seq_num;
+    seq_set(o, seq_num);
 }
 
 /* rule 1: expected sequence number */
 /* rule 2: > expected sequence number */
-/* rule 3: seqnum < seqnum(first) */
-/* rule 4+5: seqnum in [seqnum(first),seqnum(last)]  */
+/* rule 3: seqnum older than the window */
+/* rule 4+5: seqnum inside the window  */
 
 OM_uint32
 _gssapi_msg_order_check(struct gss_msg_order *o, OM_uint32 seq_num)
 {
-    OM_uint32 r;
-    size_t i;
+    OM_uint32 r, ahead, behind;
 
     if (o == NULL)
 	return GSS_S_COMPLETE;
@@ -149,21 +210,20 @@ _gssapi_msg_order_check(struct gss_msg_order *o, OM_uint32 seq_num)
     if ((o->flags & (GSS_C_REPLAY_FLAG|GSS_C_SEQUENCE_FLAG)) == 0)
 	return GSS_S_COMPLETE;
 
+    /* sequence numbers wrap, so compare them modulo 2^32 */
+    ahead = seq_num - o->last_seq;
+
     /* check if the packet is the next in order */
-    if (o->elem[0] == seq_num - 1) {
-	elem_insert(o, 0, seq_num);
+    if (ahead == 1) {
+	seq_advance(o, seq_num);
 	return GSS_S_COMPLETE;
     }
 
     r = (o->flags & (GSS_C_REPLAY_FLAG|GSS_C_SEQUENCE_FLAG))==GSS_C_REPLAY_FLAG;
 
-    /* sequence number larger then largest sequence number
-     * or smaller then the first sequence number */
-    if (seq_num > o->elem[0]
-	|| seq_num < o->first_seq
-	|| o->length == 0)
-    {
-	elem_insert(o, 0, seq_num);
+    /* sequence number larger then largest sequence number */
+    if (ahead != 0 && ahead < 0x80000000U) {
+	seq_advance(o, seq_num);
 	if (r) {
 	    return GSS_S_COMPLETE;
 	} else {
@@ -171,33 +231,23 @@ _gssapi_msg_order_check(struct gss_msg_order *o, OM_uint32 seq_num)
 	}
     }
 
-    assert(o->length > 0);
-
-    /* sequence number smaller the first sequence number */
-    if (seq_num < o->elem[o->length - 1]) {
+    /* sequence number before the window */
+    behind = o->last_seq - seq_num;
+    if (behind >= o->length) {
 	if (r)
 	    return(GSS_S_OLD_TOKEN);
 	else
 	    return(GSS_S_UNSEQ_TOKEN);
     }
 
-    if (seq_num == o->elem[o->length - 1]) {
+    if (seq_test(o, seq_num))
 	return GSS_S_DUPLICATE_TOKEN;
-    }
-
-    for (i = 0; i < o->length - 1; i++) {
-	if (o->elem[i] == seq_num)
-	    return GSS_S_DUPLICATE_TOKEN;
-	if (o->elem[i + 1] < seq_num && o->elem[i] < seq_num) {
-	    elem_insert(o, i, seq_num);
-	    if (r)
-		return GSS_S_COMPLETE;
-	    else
-		return GSS_S_UNSEQ_TOKEN;
-	}
-    }
 
-    return GSS_S_FAILURE;
+    seq_set(o, seq_num);
+    if (r)
+	return GSS_S_COMPLETE;
+    else
+	return GSS_S_UNSEQ_TOKEN;
 }
 
 OM_uint32
@@ -214,7 +264,7 @@ krb5_error_code
 _gssapi_msg_order_export(krb5_storage *sp, struct gss_msg_order *o)
 {
     krb5_error_code kret;
-    OM_uint32 i;
+    OM_uint32 i, n;
 
     kret = krb5_store_int32(sp, o->flags);
     if (kret)
@@ -232,11 +282,22 @@ _gssapi_msg_order_export(krb5_storage *sp, struct gss_msg_order *o)
     if (kret)
         return kret;
 
-    for (i = 0; i < o->jitter_window; i++) {
-        kret = krb5_store_int32(sp, o->elem[i]);
-	if (kret)
-	    return kret;
+    /*
+     * The format is a list of jitter_window numbers, the last one
+     * first and then the others seen in the window, padded with the
+     * last one.
+     */
+    kret = krb5_store_int32(sp, o->last_seq);
+    for (i = 1, n = 1; kret == 0 && i < o->length; i++) {
+	if (!seq_test(o, o->last_seq - i))
+	    continue;
+	kret = krb5_store_int32(sp, o->last_seq - i);
+	n++;
     }
+    for (; kret == 0 && n < o->jitter_window; n++)
+	kret = krb5_store_int32(sp, o->last_seq);
+    if (kret)
+	return kret;
 
     return 0;
 }
@@ -250,6 +311,8 @@ _gssapi_msg_order_import(OM_uint32 *minor_status,
     krb5_error_code kret;
     int32_t i, flags, start, length, jitter_window, first_seq;
 
+    *o = NULL;
+
     kret = krb5_ret_int32(sp, &flags);
     if (kret)
 	goto failed;
@@ -266,20 +329,34 @@ _gssapi_msg_order_import(OM_uint32 *minor_status,
     if (kret)
 	goto failed;
 
+    if (jitter_window <= 0) {
+	kret = EINVAL;
+	goto failed;
+    }
     ret = msg_order_alloc(minor_status, o, jitter_window);
     if (ret != GSS_S_COMPLETE)
         return ret;
 
     (*o)->flags = flags;
     (*o)->start = start;
-    (*o)->length = length;
+    (*o)->length = (OM_uint32)length > (OM_uint32)jitter_window ?
+	(OM_uint32)jitter_window : (OM_uint32)length;
     (*o)->jitter_window = jitter_window;
     (*o)->first_seq = first_seq;
 
     for( i = 0; i < jitter_window; i++ ) {
-        kret = krb5_ret_int32(sp, (int32_t*)&((*o)->elem[i]));
+	uint32_t seq_num;
+
+        kret = krb5_ret_uint32(sp, &seq_num);
 	if (kret)
 	    goto failed;
+	if (i == 0) {
+	    (*o)->last_seq = seq_num;
+	    if ((*o)->length > 0)
+		seq_set(*o, seq_num);
+	} else if ((*o)->last_seq - seq_num < (*o)->length) {
+	    seq_set(*o, seq_num);
+	}
     }
 
     *minor_status = 0;
@@ -359,3 +359,21 @@ _gss_mg_log_cred(int level,
     free(str);
 }
 
+/*
+ * Return the mechanism of a mechglue context and the mechanism's own
+ * context, or NULL if there is none yet.
+ */
+
+gssapi_mech_interface
+_gss_mg_get_context_mech(gss_const_ctx_id_t context_handle,
+			 gss_ctx_id_t *mech_ctx)
+{
+    const struct _gss_context *ctx =
+	(const struct _gss_context *)context_handle;
+
+    if (ctx == NULL || ctx->gc_ctx == GSS_C_NO_CONTEXT)
+	return NULL;
+
+    *mech_ctx = ctx->gc_ctx;
+    return ctx->gc_mech;
+}
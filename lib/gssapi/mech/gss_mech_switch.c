@@ -35,7 +35,6 @@
 
 struct _gss_mech_switch_list _gss_mechs = { NULL, NULL } ;
 gss_OID_set _gss_mech_oids;
-static HEIMDAL_MUTEX _gss_mech_mutex = HEIMDAL_MUTEX_INITIALIZER;
 
 /*
  * Convert a string containing an OID in 'dot' form
@@ -244,22 +243,15 @@ add_builtin(gssapi_mech_interface mech)
     return 0;
 }
 
-static void
-init_mech_switch_list(void *p)
-{
-    struct _gss_mech_switch_list *mechs = p;
-
-    HEIM_TAILQ_INIT(mechs);
-}
-
 /*
- * Load the mechanisms file (/etc/gss/mech).
+ * Load the mechanisms file (/etc/gss/mech).  This runs exactly once;
+ * the list is never modified afterwards, so lookups need no lock.
  */
-void
-_gss_load_mech(void)
+static void
+load_mechs(void *arg)
 {
+	struct _gss_mech_switch_list *mechs = arg;
 	OM_uint32	major_status, minor_status;
-	static heim_base_once_t once = HEIM_BASE_ONCE_INIT;
 #ifdef HAVE_DLOPEN
 	FILE		*fp;
 	char		buf[256];
@@ -272,21 +264,12 @@ _gss_load_mech(void)
 	const char	*conf = secure_getenv("GSS_MECH_CONFIG");
 #endif
 
-	heim_base_once_f(&once, &_gss_mechs, init_mech_switch_list);
-
-	HEIMDAL_MUTEX_lock(&_gss_mech_mutex);
-
-	if (!HEIM_TAILQ_EMPTY(&_gss_mechs)) {
-		HEIMDAL_MUTEX_unlock(&_gss_mech_mutex);
-		return;
-	}
+	HEIM_TAILQ_INIT(mechs);
 
 	major_status = gss_create_empty_oid_set(&minor_status,
 	    &_gss_mech_oids);
-	if (major_status) {
-		HEIMDAL_MUTEX_unlock(&_gss_mech_mutex);
+	if (major_status)
 		return;
-	}
 
 	add_builtin(__gss_krb5_initialize());
 	add_builtin(__gss_spnego_initialize());
@@ -462,33 +445,57 @@ out:
 
 #endif
 	add_builtin(__gss_sanon_initialize());
-	HEIMDAL_MUTEX_unlock(&_gss_mech_mutex);
 }
 
-gssapi_mech_interface
-__gss_get_mechanism(gss_const_OID mech)
+void
+_gss_load_mech(void)
+{
+	static heim_base_once_t once = HEIM_BASE_ONCE_INIT;
+
+	heim_base_once_f(&once, &_gss_mechs, load_mechs);
+}
+
+/*
+ * Callers nearly always pass one of the interned mechanism OIDs
+ * (GSS_KRB5_MECHANISM and friends, or an OID handed back by an
+ * earlier call), so try pointer equality over the whole list before
+ * falling back to comparing the encodings.
+ */
+static struct _gss_mech_switch *
+find_mech(gss_const_OID mech)
 {
-        struct _gss_mech_switch	*m;
+	struct _gss_mech_switch	*m;
 
 	_gss_load_mech();
+	if (mech == GSS_C_NO_OID)
+		return NULL;
+	HEIM_TAILQ_FOREACH(m, &_gss_mechs, gm_link) {
+		if (m->gm_mech_oid == mech ||
+		    (m->gm_mech.gm_mech_oid.elements == mech->elements &&
+		     m->gm_mech.gm_mech_oid.length == mech->length))
+			return m;
+	}
 	HEIM_TAILQ_FOREACH(m, &_gss_mechs, gm_link) {
 		if (gss_oid_equal(&m->gm_mech.gm_mech_oid, mech))
-			return &m->gm_mech;
+			return m;
 	}
 	return NULL;
 }
 
+gssapi_mech_interface
+__gss_get_mechanism(gss_const_OID mech)
+{
+	struct _gss_mech_switch	*m = find_mech(mech);
+
+	return m ? &m->gm_mech : NULL;
+}
+
 gss_OID
 _gss_mg_support_mechanism(gss_const_OID mech)
 {
-	struct _gss_mech_switch *m;
+	struct _gss_mech_switch *m = find_mech(mech);
 
-	_gss_load_mech();
-	HEIM_TAILQ_FOREACH(m, &_gss_mechs, gm_link) {
-		if (gss_oid_equal(&m->gm_mech.gm_mech_oid, mech))
-			return m->gm_mech_oid;
-	}
-	return NULL;
+	return m ? m->gm_mech_oid : NULL;
 }
 
 enum mech_name_match {
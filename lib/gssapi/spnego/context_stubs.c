@@ -32,6 +32,13 @@
 
 #include "spnego_locl.h"
 
+/*
+ * The per-message functions are only reached through the mechglue,
+ * which has already checked the arguments and initialized the outputs,
+ * so they call the negotiated mechanism directly rather than going
+ * through the mechglue a second time.
+ */
+
 OM_uint32 GSSAPI_CALLCONV _gss_spnego_process_context_token
            (OM_uint32 *minor_status,
             gss_const_ctx_id_t context_handle,
@@ -118,6 +125,8 @@ OM_uint32 GSSAPI_CALLCONV _gss_spnego_get_mic
            )
 {
     gssspnego_ctx ctx;
+    gssapi_mech_interface m;
+    gss_ctx_id_t mctx;
 
     *minor_status = 0;
 
@@ -131,8 +140,12 @@ OM_uint32 GSSAPI_CALLCONV _gss_spnego_get_mic
 	return GSS_S_NO_CONTEXT;
     }
 
-    return gss_get_mic(minor_status, ctx->negotiated_ctx_id,
-		       qop_req, message_buffer, message_token);
+    m = _gss_mg_get_context_mech(ctx->negotiated_ctx_id, &mctx);
+    if (m == NULL)
+	return GSS_S_NO_CONTEXT;
+
+    return m->gm_get_mic(minor_status, mctx,
+			 qop_req, message_buffer, message_token);
 }
 
 OM_uint32 GSSAPI_CALLCONV _gss_spnego_verify_mic
@@ -144,6 +157,8 @@ OM_uint32 GSSAPI_CALLCONV _gss_spnego_verify_mic
            )
 {
     gssspnego_ctx ctx;
+    gssapi_mech_interface m;
+    gss_ctx_id_t mctx;
 
     *minor_status = 0;
 
@@ -157,11 +172,15 @@ OM_uint32 GSSAPI_CALLCONV _gss_spnego_verify_mic
 	return GSS_S_NO_CONTEXT;
     }
 
-    return gss_verify_mic(minor_status,
-			  ctx->negotiated_ctx_id,
-			  message_buffer,
-			  token_buffer,
-			  qop_state);
+    m = _gss_mg_get_context_mech(ctx->negotiated_ctx_id, &mctx);
+    if (m == NULL)
+	return GSS_S_NO_CONTEXT;
+
+    return m->gm_verify_mic(minor_status,
+			    mctx,
+			    message_buffer,
+			    token_buffer,
+			    qop_state);
 }
 
 OM_uint32 GSSAPI_CALLCONV _gss_spnego_wrap
@@ -175,6 +194,8 @@ OM_uint32 GSSAPI_CALLCONV _gss_spnego_wrap
            )
 {
     gssspnego_ctx ctx;
+    gssapi_mech_interface m;
+    gss_ctx_id_t mctx;
 
     *minor_status = 0;
 
@@ -188,13 +209,17 @@ OM_uint32 GSSAPI_CALLCONV _gss_spnego_wrap
 	return GSS_S_NO_CONTEXT;
     }
 
-    return gss_wrap(minor_status,
-		    ctx->negotiated_ctx_id,
-		    conf_req_flag,
-		    qop_req,
-		    input_message_buffer,
-		    conf_state,
-		    output_message_buffer);
+    m = _gss_mg_get_context_mech(ctx->negotiated_ctx_id, &mctx);
+    if (m == NULL)
+	return GSS_S_NO_CONTEXT;
+
+    return m->gm_wrap(minor_status,
+		      mctx,
+		      conf_req_flag,
+		      qop_req,
+		      input_message_buffer,
+		      conf_state,
+		      output_message_buffer);
 }
 
 OM_uint32 GSSAPI_CALLCONV _gss_spnego_unwrap
@@ -207,6 +232,8 @@ OM_uint32 GSSAPI_CALLCONV _gss_spnego_unwrap
            )
 {
     gssspnego_ctx ctx;
+    gssapi_mech_interface m;
+    gss_ctx_id_t mctx;
 
     *minor_status = 0;
 
@@ -220,12 +247,16 @@ OM_uint32 GSSAPI_CALLCONV _gss_spnego_unwrap
 	return GSS_S_NO_CONTEXT;
     }
 
-    return gss_unwrap(minor_status,
-		      ctx->negotiated_ctx_id,
-		      input_message_buffer,
-		      output_message_buffer,
-		      conf_state,
-		      qop_state);
+    m = _gss_mg_get_context_mech(ctx->negotiated_ctx_id, &mctx);
+    if (m == NULL)
+	return GSS_S_NO_CONTEXT;
+
+    return m->gm_unwrap(minor_status,
+			mctx,
+			input_message_buffer,
+			output_message_buffer,
+			conf_state,
+			qop_state);
 }
 
 OM_uint32 GSSAPI_CALLCONV _gss_spnego_inquire_context (
@@ -411,15 +442,23 @@ _gss_spnego_wrap_iov(OM_uint32 * minor_status,
 		     int iov_count)
 {
     gssspnego_ctx ctx = (gssspnego_ctx)context_handle;
+    gssapi_mech_interface m;
+    gss_ctx_id_t mctx;
 
     *minor_status = 0;
 
     if (ctx == NULL || ctx->negotiated_ctx_id == GSS_C_NO_CONTEXT)
 	return GSS_S_NO_CONTEXT;
 
-    return gss_wrap_iov(minor_status, ctx->negotiated_ctx_id,
-			conf_req_flag, qop_req, conf_state,
-			iov, iov_count);
+    m = _gss_mg_get_context_mech(ctx->negotiated_ctx_id, &mctx);
+    if (m == NULL)
+	return GSS_S_NO_CONTEXT;
+    if (m->gm_wrap_iov == NULL)
+	return GSS_S_UNAVAILABLE;
+
+    return m->gm_wrap_iov(minor_status, mctx,
+			  conf_req_flag, qop_req, conf_state,
+			  iov, iov_count);
 }
 
 OM_uint32 GSSAPI_CALLCONV
@@ -431,16 +470,24 @@ _gss_spnego_unwrap_iov(OM_uint32 *minor_status,
 		       int iov_count)
 {
     gssspnego_ctx ctx = (gssspnego_ctx)context_handle;
+    gssapi_mech_interface m;
+    gss_ctx_id_t mctx;
 
     *minor_status = 0;
 
     if (ctx == NULL || ctx->negotiated_ctx_id == GSS_C_NO_CONTEXT)
 	return GSS_S_NO_CONTEXT;
 
-    return gss_unwrap_iov(minor_status,
-			  ctx->negotiated_ctx_id,
-			  conf_state, qop_state,
-			  iov, iov_count);
+    m = _gss_mg_get_context_mech(ctx->negotiated_ctx_id, &mctx);
+    if (m == NULL)
+	return GSS_S_NO_CONTEXT;
+    if (m->gm_unwrap_iov == NULL)
+	return GSS_S_UNAVAILABLE;
+
+    return m->gm_unwrap_iov(minor_status,
+			    mctx,
+			    conf_state, qop_state,
+			    iov, iov_count);
 }
 
 OM_uint32 GSSAPI_CALLCONV
@@ -46,6 +46,140 @@ GSISC(spnego_reply);
 GSISC(wait_server_mic);
 GSISC(step_completed);
 
+/*
+ * A cache of the mechanism each target's acceptor selected, kept for
+ * [gssapi] spnego_mech_cache_lifetime seconds (by default not at all).
+ * While an entry is fresh only that mechanism is probed and offered to
+ * the target, so the initiator doesn't repeat gss_init_sec_context()
+ * calls, and the KDC exchanges they may cause, for candidates the
+ * acceptor won't pick.  The outcome depends on the credential, so only
+ * contexts using the default credential use the cache.
+ */
+
+struct mech_cache_entry {
+    struct mech_cache_entry *next;
+    char *target;
+    gss_OID name_type;
+    gss_OID mech;
+    time_t expires;
+};
+
+#define MECH_CACHE_MAX 64
+
+static HEIMDAL_MUTEX mech_cache_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct mech_cache_entry *mech_cache;
+
+static time_t
+mech_cache_lifetime(void)
+{
+    return krb5_config_get_time_default(_gss_mg_krb5_context(), NULL, 0,
+					"gssapi", "spnego_mech_cache_lifetime",
+					NULL);
+}
+
+/* Returns the entry for `target', with the link pointing to it */
+static struct mech_cache_entry **
+mech_cache_find(const char *target, gss_const_OID name_type)
+{
+    struct mech_cache_entry **pp;
+
+    for (pp = &mech_cache; *pp; pp = &(*pp)->next)
+	if (strcmp((*pp)->target, target) == 0 &&
+	    gss_oid_equal((*pp)->name_type, name_type))
+	    return pp;
+    return pp;
+}
+
+static gss_OID
+mech_cache_get(gss_const_name_t target_name)
+{
+    struct mech_cache_entry **pp, *e;
+    gss_buffer_desc name = GSS_C_EMPTY_BUFFER;
+    gss_OID name_type = GSS_C_NO_OID;
+    gss_OID mech = GSS_C_NO_OID;
+    OM_uint32 major, minor;
+    char *target;
+
+    if (mech_cache_lifetime() <= 0)
+	return GSS_C_NO_OID;
+    major = gss_display_name(&minor, target_name, &name, &name_type);
+    if (major != GSS_S_COMPLETE)
+	return GSS_C_NO_OID;
+    target = strndup(name.value, name.length);
+    gss_release_buffer(&minor, &name);
+    if (target == NULL)
+	return GSS_C_NO_OID;
+
+    HEIMDAL_MUTEX_lock(&mech_cache_mutex);
+    pp = mech_cache_find(target, name_type);
+    if ((e = *pp) != NULL) {
+	if (e->expires > time(NULL)) {
+	    mech = e->mech;
+	} else {
+	    *pp = e->next;
+	    free(e->target);
+	    free(e);
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&mech_cache_mutex);
+    free(target);
+    return mech;
+}
+
+/* Remembers the acceptor's choice, or forgets it if `mech' is NULL */
+static void
+mech_cache_put(gss_const_name_t target_name, gss_OID mech)
+{
+    struct mech_cache_entry **pp, *e;
+    gss_buffer_desc name = GSS_C_EMPTY_BUFFER;
+    gss_OID name_type = GSS_C_NO_OID;
+    OM_uint32 major, minor;
+    time_t lifetime;
+    size_t n;
+    char *target;
+
+    if ((lifetime = mech_cache_lifetime()) <= 0)
+	return;
+    major = gss_display_name(&minor, target_name, &name, &name_type);
+    if (major != GSS_S_COMPLETE)
+	return;
+    target = strndup(name.value, name.length);
+    gss_release_buffer(&minor, &name);
+    if (target == NULL)
+	return;
+
+    HEIMDAL_MUTEX_lock(&mech_cache_mutex);
+    pp = mech_cache_find(target, name_type);
+    if ((e = *pp) != NULL) {
+	*pp = e->next;
+	free(e->target);
+	free(e);
+    }
+    if (mech != GSS_C_NO_OID && (e = calloc(1, sizeof(*e))) != NULL) {
+	e->target = target;
+	e->name_type = name_type;
+	e->mech = mech;
+	e->expires = time(NULL) + lifetime;
+	e->next = mech_cache;
+	mech_cache = e;
+	target = NULL;
+
+	/* Drop the least recently added entries beyond the limit */
+	for (n = 1, pp = &mech_cache->next; *pp; n++) {
+	    if (n < MECH_CACHE_MAX) {
+		pp = &(*pp)->next;
+		continue;
+	    }
+	    e = *pp;
+	    *pp = e->next;
+	    free(e->target);
+	    free(e);
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&mech_cache_mutex);
+    free(target);
+}
+
 
  /*
   * Is target_name an sane target for `mech´.
@@ -67,6 +201,14 @@ initiator_approved(OM_uint32 *minor_status,
     auth_scheme scheme;
     int negoex = 0;
 
+    /* Don't probe mechs the acceptor didn't pick last time */
+    if (sel->cached_mech_type != GSS_C_NO_OID &&
+	!(gss_oid_equal(sel->cached_mech_type, GSS_NEGOEX_MECHANISM) ?
+	  _gss_negoex_mech_p(mech) : gss_oid_equal(sel->cached_mech_type, mech))) {
+	*minor_status = 0;
+	return GSS_S_BAD_MECH;
+    }
+
     maj_stat = gss_init_sec_context(&min_stat,
 				    cred,
 				    &ctx,
@@ -282,6 +424,8 @@ spnego_initial(OM_uint32 * minor_status,
     sel.req_flags = req_flags;
     sel.time_req = time_req;
     sel.input_chan_bindings = (gss_channel_bindings_t)input_chan_bindings;
+    if (cred == GSS_C_NO_CREDENTIAL)
+	sel.cached_mech_type = mech_cache_get(ctx->target_name);
 
     sub = _gss_spnego_indicate_mechtypelist(&minor,
 					    ctx->target_name,
@@ -292,6 +436,22 @@ spnego_initial(OM_uint32 * minor_status,
 					    cred,
 					    &nt.u.negTokenInit.mechTypes,
 					    &ctx->preferred_mech_type);
+    if (GSS_ERROR(sub) && sel.cached_mech_type != GSS_C_NO_OID &&
+	sel.preferred_mech_type == GSS_C_NO_OID) {
+	/* The cached mech no longer works here; try them all */
+	mech_cache_put(ctx->target_name, GSS_C_NO_OID);
+	free_MechTypeList(&nt.u.negTokenInit.mechTypes);
+	sel.cached_mech_type = GSS_C_NO_OID;
+	sub = _gss_spnego_indicate_mechtypelist(&minor,
+						ctx->target_name,
+						req_flags,
+						initiator_approved,
+						&sel,
+						0,
+						cred,
+						&nt.u.negTokenInit.mechTypes,
+						&ctx->preferred_mech_type);
+    }
     if (GSS_ERROR(sub)) {
 	*minor_status = minor;
 	return sub;
@@ -522,6 +682,8 @@ spnego_reply(OM_uint32 * minor_status,
 	}
 
 	_gss_spnego_log_mech("initiator selected mechanism", ctx->selected_mech_type);
+	if (cred == GSS_C_NO_CREDENTIAL)
+	    mech_cache_put(ctx->target_name, ctx->selected_mech_type);
 
 	free(oid.elements);
 
@@ -137,6 +137,7 @@ struct gssspnego_optimistic_ctx {
     gss_name_t target_name;
     OM_uint32 time_req;
     gss_channel_bindings_t input_chan_bindings;
+    gss_OID cached_mech_type;	/* only probe this mech, if set */
     /* out */
     gss_OID preferred_mech_type;
     gss_OID negotiated_mech_type;
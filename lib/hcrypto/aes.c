@@ -41,12 +41,253 @@
 #include "rijndael-alg-fst.h"
 #include "aes.h"
 
+/*
+ * On x86 CPUs with AES-NI, and on ARMv8 CPUs with the Crypto Extension
+ * (when built for them), single blocks and the whole blocks of CBC are
+ * done with the AES instructions.  Whether to is decided once, at
+ * runtime.  The key schedule is still made by rijndael-alg-fst.c, then
+ * stored in memory byte order; its decryption schedule already is the
+ * "equivalent inverse cipher" form that AESDEC and AESD want.
+ *
+ * Define NO_AES_ACCEL to build without this.
+ */
+#if !defined(NO_AES_ACCEL) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define AES_ACCEL_X86 1
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#define ACCEL_FUNC __attribute__((target("aes,sse2"))) static
+typedef __m128i accel_block;
+#define ACCEL_LOAD(p) _mm_loadu_si128((const __m128i *)(const void *)(p))
+#define ACCEL_STORE(p, b) _mm_storeu_si128((__m128i *)(void *)(p), (b))
+#define ACCEL_XOR(a, b) _mm_xor_si128((a), (b))
+#elif !defined(NO_AES_ACCEL) && defined(__GNUC__) && defined(__aarch64__) && \
+    (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#define AES_ACCEL_ARM 1
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+#endif
+#define ACCEL_FUNC static
+typedef uint8x16_t accel_block;
+#define ACCEL_LOAD(p) vld1q_u8((const uint8_t *)(p))
+#define ACCEL_STORE(p, b) vst1q_u8((uint8_t *)(p), (b))
+#define ACCEL_XOR(a, b) veorq_u8((a), (b))
+#endif
+
+#if defined(AES_ACCEL_X86) || defined(AES_ACCEL_ARM)
+#define HAVE_AES_ACCEL 1
+
+static int
+aes_accel(void)
+{
+    static volatile int accel = -1;
+
+    if (accel == -1) {
+#ifdef AES_ACCEL_X86
+	unsigned int a, b, c, d;
+
+	accel = __get_cpuid(1, &a, &b, &c, &d) &&
+	    (c & bit_AES) && (d & bit_SSE2);
+#elif defined(__linux__)
+	accel = (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#else
+	accel = 1; /* built for a CPU that has it */
+#endif
+    }
+    return accel;
+}
+
+/* Rewrite a rijndael-alg-fst.c key schedule in memory byte order */
+static void
+schedule_to_bytes(AES_KEY *key)
+{
+    unsigned char *p = (unsigned char *)key->key;
+    int i;
+
+    for (i = 0; i < (key->rounds + 1) * 4; i++, p += 4) {
+	uint32_t w = key->key[i];
+
+	p[0] = w >> 24;
+	p[1] = w >> 16;
+	p[2] = w >> 8;
+	p[3] = w;
+    }
+}
+
+ACCEL_FUNC void
+load_schedule(const AES_KEY *key, accel_block *k)
+{
+    int i;
+
+    for (i = 0; i <= key->rounds; i++)
+	k[i] = ACCEL_LOAD(&key->key[i * 4]);
+}
+
+#ifdef AES_ACCEL_X86
+ACCEL_FUNC accel_block
+accel_enc1(accel_block s, const accel_block *k, int rounds)
+{
+    int i;
+
+    s = _mm_xor_si128(s, k[0]);
+    for (i = 1; i < rounds; i++)
+	s = _mm_aesenc_si128(s, k[i]);
+    return _mm_aesenclast_si128(s, k[rounds]);
+}
+
+ACCEL_FUNC accel_block
+accel_dec1(accel_block s, const accel_block *k, int rounds)
+{
+    int i;
+
+    s = _mm_xor_si128(s, k[0]);
+    for (i = 1; i < rounds; i++)
+	s = _mm_aesdec_si128(s, k[i]);
+    return _mm_aesdeclast_si128(s, k[rounds]);
+}
+
+ACCEL_FUNC void
+accel_dec4(accel_block *s, const accel_block *k, int rounds)
+{
+    int i;
+
+    s[0] = _mm_xor_si128(s[0], k[0]);
+    s[1] = _mm_xor_si128(s[1], k[0]);
+    s[2] = _mm_xor_si128(s[2], k[0]);
+    s[3] = _mm_xor_si128(s[3], k[0]);
+    for (i = 1; i < rounds; i++) {
+	s[0] = _mm_aesdec_si128(s[0], k[i]);
+	s[1] = _mm_aesdec_si128(s[1], k[i]);
+	s[2] = _mm_aesdec_si128(s[2], k[i]);
+	s[3] = _mm_aesdec_si128(s[3], k[i]);
+    }
+    s[0] = _mm_aesdeclast_si128(s[0], k[rounds]);
+    s[1] = _mm_aesdeclast_si128(s[1], k[rounds]);
+    s[2] = _mm_aesdeclast_si128(s[2], k[rounds]);
+    s[3] = _mm_aesdeclast_si128(s[3], k[rounds]);
+}
+#else
+ACCEL_FUNC accel_block
+accel_enc1(accel_block s, const accel_block *k, int rounds)
+{
+    int i;
+
+    for (i = 0; i < rounds - 1; i++)
+	s = vaesmcq_u8(vaeseq_u8(s, k[i]));
+    return veorq_u8(vaeseq_u8(s, k[rounds - 1]), k[rounds]);
+}
+
+ACCEL_FUNC accel_block
+accel_dec1(accel_block s, const accel_block *k, int rounds)
+{
+    int i;
+
+    for (i = 0; i < rounds - 1; i++)
+	s = vaesimcq_u8(vaesdq_u8(s, k[i]));
+    return veorq_u8(vaesdq_u8(s, k[rounds - 1]), k[rounds]);
+}
+
+ACCEL_FUNC void
+accel_dec4(accel_block *s, const accel_block *k, int rounds)
+{
+    int i;
+
+    for (i = 0; i < rounds - 1; i++) {
+	s[0] = vaesimcq_u8(vaesdq_u8(s[0], k[i]));
+	s[1] = vaesimcq_u8(vaesdq_u8(s[1], k[i]));
+	s[2] = vaesimcq_u8(vaesdq_u8(s[2], k[i]));
+	s[3] = vaesimcq_u8(vaesdq_u8(s[3], k[i]));
+    }
+    s[0] = veorq_u8(vaesdq_u8(s[0], k[rounds - 1]), k[rounds]);
+    s[1] = veorq_u8(vaesdq_u8(s[1], k[rounds - 1]), k[rounds]);
+    s[2] = veorq_u8(vaesdq_u8(s[2], k[rounds - 1]), k[rounds]);
+    s[3] = veorq_u8(vaesdq_u8(s[3], k[rounds - 1]), k[rounds]);
+}
+#endif
+
+ACCEL_FUNC void
+accel_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
+{
+    accel_block k[RIJNDAEL_MAXNR + 1];
+
+    load_schedule(key, k);
+    ACCEL_STORE(out, accel_enc1(ACCEL_LOAD(in), k, key->rounds));
+}
+
+ACCEL_FUNC void
+accel_decrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
+{
+    accel_block k[RIJNDAEL_MAXNR + 1];
+
+    load_schedule(key, k);
+    ACCEL_STORE(out, accel_dec1(ACCEL_LOAD(in), k, key->rounds));
+}
+
+/*
+ * CBC over whole blocks.  Encryption is inherently serial; decryption
+ * does four blocks at a time.
+ */
+ACCEL_FUNC void
+accel_cbc(const unsigned char *in, unsigned char *out, unsigned long size,
+	  const AES_KEY *key, unsigned char *ivp, int forward_encrypt)
+{
+    accel_block k[RIJNDAEL_MAXNR + 1];
+    accel_block iv = ACCEL_LOAD(ivp);
+    int rounds = key->rounds;
+
+    load_schedule(key, k);
+    if (forward_encrypt) {
+	for (; size >= AES_BLOCK_SIZE; size -= AES_BLOCK_SIZE) {
+	    iv = accel_enc1(ACCEL_XOR(ACCEL_LOAD(in), iv), k, rounds);
+	    ACCEL_STORE(out, iv);
+	    in += AES_BLOCK_SIZE;
+	    out += AES_BLOCK_SIZE;
+	}
+    } else {
+	for (; size >= 4 * AES_BLOCK_SIZE; size -= 4 * AES_BLOCK_SIZE) {
+	    accel_block c[4], s[4];
+
+	    s[0] = c[0] = ACCEL_LOAD(in);
+	    s[1] = c[1] = ACCEL_LOAD(in + AES_BLOCK_SIZE);
+	    s[2] = c[2] = ACCEL_LOAD(in + 2 * AES_BLOCK_SIZE);
+	    s[3] = c[3] = ACCEL_LOAD(in + 3 * AES_BLOCK_SIZE);
+	    accel_dec4(s, k, rounds);
+	    ACCEL_STORE(out, ACCEL_XOR(s[0], iv));
+	    ACCEL_STORE(out + AES_BLOCK_SIZE, ACCEL_XOR(s[1], c[0]));
+	    ACCEL_STORE(out + 2 * AES_BLOCK_SIZE, ACCEL_XOR(s[2], c[1]));
+	    ACCEL_STORE(out + 3 * AES_BLOCK_SIZE, ACCEL_XOR(s[3], c[2]));
+	    iv = c[3];
+	    in += 4 * AES_BLOCK_SIZE;
+	    out += 4 * AES_BLOCK_SIZE;
+	}
+	for (; size >= AES_BLOCK_SIZE; size -= AES_BLOCK_SIZE) {
+	    accel_block c = ACCEL_LOAD(in);
+
+	    ACCEL_STORE(out, ACCEL_XOR(accel_dec1(c, k, rounds), iv));
+	    iv = c;
+	    in += AES_BLOCK_SIZE;
+	    out += AES_BLOCK_SIZE;
+	}
+    }
+    ACCEL_STORE(ivp, iv);
+}
+#endif /* AES_ACCEL_X86 || AES_ACCEL_ARM */
+
 int
 AES_set_encrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
 {
     key->rounds = rijndaelKeySetupEnc(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
+#ifdef HAVE_AES_ACCEL
+    if (aes_accel())
+	schedule_to_bytes(key);
+#endif
     return 0;
 }
 
@@ -56,18 +297,34 @@ AES_set_decrypt_key(const unsigned char *userkey, const int bits, AES_KEY *key)
     key->rounds = rijndaelKeySetupDec(key->key, userkey, bits);
     if (key->rounds == 0)
 	return -1;
+#ifdef HAVE_AES_ACCEL
+    if (aes_accel())
+	schedule_to_bytes(key);
+#endif
     return 0;
 }
 
 void
 AES_encrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
 {
+#ifdef HAVE_AES_ACCEL
+    if (aes_accel()) {
+	accel_encrypt(in, out, key);
+	return;
+    }
+#endif
     rijndaelEncrypt(key->key, key->rounds, in, out);
 }
 
 void
 AES_decrypt(const unsigned char *in, unsigned char *out, const AES_KEY *key)
 {
+#ifdef HAVE_AES_ACCEL
+    if (aes_accel()) {
+	accel_decrypt(in, out, key);
+	return;
+    }
+#endif
     rijndaelDecrypt(key->key, key->rounds, in, out);
 }
 
@@ -79,6 +336,18 @@ AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
     unsigned char tmp[AES_BLOCK_SIZE];
     int i;
 
+#ifdef HAVE_AES_ACCEL
+    /* Whole blocks here; a trailing partial block as below */
+    if (aes_accel() && size >= AES_BLOCK_SIZE) {
+	unsigned long n = size & ~(unsigned long)(AES_BLOCK_SIZE - 1);
+
+	accel_cbc(in, out, n, key, iv, forward_encrypt);
+	in += n;
+	out += n;
+	size -= n;
+    }
+#endif
+
     if (forward_encrypt) {
 	while (size >= AES_BLOCK_SIZE) {
 	    for (i = 0; i < AES_BLOCK_SIZE; i++)
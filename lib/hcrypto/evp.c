@@ -198,6 +198,37 @@ EVP_MD_CTX_cleanup(EVP_MD_CTX *ctx) HC_DEPRECATED
     return 1;
 }
 
+/**
+ * Copy the state of a message digest context to another, so that
+ * digesting can continue from the same point in both.  Used to avoid
+ * rehashing a common prefix, such as an HMAC key pad.
+ *
+ * @param out the context to copy to, initialized or created.
+ * @param in the context to copy from.
+ *
+ * @return 1 on success, 0 if the digest's state can not be copied.
+ *
+ * @ingroup hcrypto_evp
+ */
+
+int
+EVP_MD_CTX_copy_ex(EVP_MD_CTX *out, const EVP_MD_CTX *in)
+{
+    /* Digests with a cleanup function keep state that isn't plain data */
+    if (in->md == NULL || in->md->cleanup != NULL)
+	return 0;
+    if (out->md != in->md || out->engine != in->engine) {
+	EVP_MD_CTX_cleanup(out);
+	out->ptr = malloc(in->md->ctx_size);
+	if (out->ptr == NULL)
+	    return 0;
+	out->md = in->md;
+	out->engine = in->engine;
+    }
+    memcpy(out->ptr, in->ptr, in->md->ctx_size);
+    return 1;
+}
+
 /**
  * Get the EVP_MD use for a specified context.
  *
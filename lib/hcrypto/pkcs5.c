@@ -41,6 +41,109 @@
 #include <evp.h>
 #include <hmac.h>
 
+/*
+ * PBKDF2 spends nearly all of its time in HMAC over short inputs.  The
+ * key pads are hashed once, and each HMAC restarts from copies of those
+ * digest states, which halves the compression function calls per
+ * iteration and avoids HMAC()'s allocations.  If the digest's state
+ * can't be copied, plain HMAC() is used.
+ */
+
+struct prf {
+    const EVP_MD *md;
+    const void *password;
+    size_t password_len;
+    EVP_MD_CTX *ipad;
+    EVP_MD_CTX *opad;
+    EVP_MD_CTX *work;
+};
+
+static void
+prf_cleanup(struct prf *f)
+{
+    if (f->ipad)
+	EVP_MD_CTX_destroy(f->ipad);
+    if (f->opad)
+	EVP_MD_CTX_destroy(f->opad);
+    if (f->work)
+	EVP_MD_CTX_destroy(f->work);
+    f->ipad = f->opad = f->work = NULL;
+}
+
+static int
+prf_pad(EVP_MD_CTX *ctx, const EVP_MD *md, const unsigned char *key,
+	size_t keylen, unsigned char *block, size_t blocksize, int c)
+{
+    size_t i;
+
+    memset(block, c, blocksize);
+    for (i = 0; i < keylen; i++)
+	block[i] ^= key[i];
+    return EVP_DigestInit_ex(ctx, md, NULL) == 1 &&
+	EVP_DigestUpdate(ctx, block, blocksize) == 1;
+}
+
+static int
+prf_init(struct prf *f, const EVP_MD *md,
+	 const void *password, size_t password_len)
+{
+    unsigned char keyhash[EVP_MAX_MD_SIZE];
+    unsigned char *block;
+    const unsigned char *key = password;
+    size_t keylen = password_len;
+    size_t blocksize = EVP_MD_block_size(md);
+    int ok;
+
+    f->md = md;
+    f->password = password;
+    f->password_len = password_len;
+    f->ipad = EVP_MD_CTX_create();
+    f->opad = EVP_MD_CTX_create();
+    f->work = EVP_MD_CTX_create();
+    block = malloc(blocksize);
+    if (f->ipad == NULL || f->opad == NULL || f->work == NULL ||
+	block == NULL) {
+	prf_cleanup(f);
+	free(block);
+	return 0;
+    }
+
+    if (keylen > blocksize) {
+	EVP_Digest(password, password_len, keyhash, NULL, md, NULL);
+	key = keyhash;
+	keylen = EVP_MD_size(md);
+    }
+
+    ok = prf_pad(f->ipad, md, key, keylen, block, blocksize, 0x36) &&
+	prf_pad(f->opad, md, key, keylen, block, blocksize, 0x5c) &&
+	EVP_MD_CTX_copy_ex(f->work, f->ipad) == 1;
+
+    memset_s(block, blocksize, 0, blocksize);
+    memset_s(keyhash, sizeof(keyhash), 0, sizeof(keyhash));
+    free(block);
+    if (!ok)
+	prf_cleanup(f); /* fall back to HMAC() */
+    return 1;
+}
+
+/* out = HMAC(password, data); data and out may be the same buffer */
+static void
+prf(struct prf *f, const void *data, size_t len, unsigned char *out)
+{
+    unsigned int hmacsize;
+
+    if (f->work == NULL) {
+	HMAC(f->md, f->password, f->password_len, data, len, out, &hmacsize);
+	return;
+    }
+    EVP_MD_CTX_copy_ex(f->work, f->ipad);
+    EVP_DigestUpdate(f->work, data, len);
+    EVP_DigestFinal_ex(f->work, out, NULL);
+    EVP_MD_CTX_copy_ex(f->work, f->opad);
+    EVP_DigestUpdate(f->work, out, EVP_MD_size(f->md));
+    EVP_DigestFinal_ex(f->work, out, NULL);
+}
+
 /**
  * As descriped in PKCS5, convert a password, salt, and iteration counter into a crypto key.
  *
@@ -66,12 +169,12 @@ PKCS5_PBKDF2_HMAC(const void * password, size_t password_len,
 		  size_t keylen, void *key)
 {
     size_t datalen, leftofkey, checksumsize;
-    char *data, *tmpcksum;
+    unsigned char *data, *tmpcksum;
+    struct prf f;
     uint32_t keypart;
     unsigned long i;
     int j;
-    char *p;
-    unsigned int hmacsize;
+    unsigned char *p;
 
     if (md == NULL)
 	return 0;
@@ -82,6 +185,10 @@ PKCS5_PBKDF2_HMAC(const void * password, size_t password_len,
     tmpcksum = malloc(checksumsize + datalen);
     if (tmpcksum == NULL)
 	return 0;
+    if (!prf_init(&f, md, password, password_len)) {
+	free(tmpcksum);
+	return 0;
+    }
 
     data = &tmpcksum[checksumsize];
 
@@ -104,13 +211,11 @@ PKCS5_PBKDF2_HMAC(const void * password, size_t password_len,
 	data[datalen - 2] = (keypart >> 8)  & 0xff;
 	data[datalen - 1] = (keypart)       & 0xff;
 
-	HMAC(md, password, password_len, data, datalen,
-	     tmpcksum, &hmacsize);
+	prf(&f, data, datalen, tmpcksum);
 
 	memcpy(p, tmpcksum, len);
 	for (i = 1; i < iter; i++) {
-	    HMAC(md, password, password_len, tmpcksum, checksumsize,
-		 tmpcksum, &hmacsize);
+	    prf(&f, tmpcksum, checksumsize, tmpcksum);
 
 	    for (j = 0; j < len; j++)
 		p[j] ^= tmpcksum[j];
@@ -121,6 +226,8 @@ PKCS5_PBKDF2_HMAC(const void * password, size_t password_len,
 	keypart++;
     }
 
+    prf_cleanup(&f);
+    memset_s(tmpcksum, checksumsize, 0, checksumsize);
     free(tmpcksum);
 
     return 1;
@@ -33,6 +33,7 @@
 #include <roken.h>
 #include <rand.h>
 #include <heim_threads.h>
+#include <heimbase.h>
 
 #ifdef KRB5
 #include <krb5-types.h>
@@ -562,15 +563,82 @@ fortuna_seed(const void *indata, int size)
     HEIMDAL_MUTEX_unlock(&fortuna_mutex);
 }
 
-static int
-fortuna_bytes(unsigned char *outdata, int size)
+/*
+ * Small requests (session keys, confounders, nonces) are served from a
+ * per-thread buffer that is refilled FORTUNA_TLS_BYTES at a time from
+ * main_state, so the common case takes no lock.  Bytes are wiped from
+ * the buffer as they are handed out.  A buffer filled before a fork()
+ * (different pid) or before fortuna_cleanup() (different generation) is
+ * discarded, so parent and child never hand out the same bytes.
+ */
+#define FORTUNA_TLS_BYTES	1024
+#define FORTUNA_TLS_MAX_REQ	64
+
+struct fortuna_tls {
+    pid_t pid;
+    unsigned gen;
+    unsigned avail;
+    unsigned char buf[FORTUNA_TLS_BYTES];
+};
+
+static HEIMDAL_thread_key tls_key;
+static int tls_created;
+/* bumped under fortuna_mutex, read without it */
+static unsigned tls_gen;
+
+static void
+tls_delete(void *ptr)
 {
-    int ret = 0;
+    struct fortuna_tls *t = ptr;
 
-    HEIMDAL_MUTEX_lock(&fortuna_mutex);
+    if (t == NULL)
+	return;
+    memset_s(t, sizeof(*t), 0, sizeof(*t));
+    free(t);
+}
+
+static void
+init_tls(void *ptr)
+{
+    int ret;
+    HEIMDAL_key_create(&tls_key, tls_delete, ret);
+    if (ret == 0)
+	tls_created = 1;
+}
+
+static struct fortuna_tls *
+fortuna_tls(void)
+{
+    static heim_base_once_t once = HEIM_BASE_ONCE_INIT;
+    struct fortuna_tls *t;
+    int ret;
+
+    heim_base_once_f(&once, NULL, init_tls);
+    if (!tls_created)
+	return NULL;
+
+    t = HEIMDAL_getspecific(tls_key);
+    if (t == NULL) {
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+	    return NULL;
+	HEIMDAL_setspecific(tls_key, t, ret);
+	if (ret) {
+	    free(t);
+	    return NULL;
+	}
+    }
+    return t;
+}
 
+/*
+ * fortuna_mutex must be held across calls to this function
+ */
+static int
+fortuna_extract(unsigned char *outdata, int size)
+{
     if (!fortuna_init())
-	goto out;
+	return 0;
 
     resend_bytes += size;
     if (resend_bytes > FORTUNA_RESEED_BYTE || resend_bytes < size) {
@@ -578,9 +646,41 @@ fortuna_bytes(unsigned char *outdata, int size)
 	fortuna_reseed();
     }
     extract_data(&main_state, size, outdata);
-    ret = 1;
+    return 1;
+}
+
+static int
+fortuna_bytes(unsigned char *outdata, int size)
+{
+    struct fortuna_tls *t = NULL;
+    int ret;
 
-out:
+    if (size > 0 && size <= FORTUNA_TLS_MAX_REQ)
+	t = fortuna_tls();
+
+    if (t != NULL) {
+	if (t->pid != getpid() || t->gen != tls_gen) {
+	    memset_s(t->buf, sizeof(t->buf), 0, sizeof(t->buf));
+	    t->avail = 0;
+	}
+	if (t->avail < (unsigned)size) {
+	    HEIMDAL_MUTEX_lock(&fortuna_mutex);
+	    ret = fortuna_extract(t->buf, sizeof(t->buf));
+	    t->gen = tls_gen;
+	    HEIMDAL_MUTEX_unlock(&fortuna_mutex);
+	    if (!ret)
+		return 0;
+	    t->pid = getpid();
+	    t->avail = sizeof(t->buf);
+	}
+	t->avail -= size;
+	memcpy(outdata, t->buf + t->avail, size);
+	memset_s(t->buf + t->avail, size, 0, size);
+	return 1;
+    }
+
+    HEIMDAL_MUTEX_lock(&fortuna_mutex);
+    ret = fortuna_extract(outdata, size);
     HEIMDAL_MUTEX_unlock(&fortuna_mutex);
 
     return ret;
@@ -591,6 +691,7 @@ fortuna_cleanup(void)
 {
     HEIMDAL_MUTEX_lock(&fortuna_mutex);
 
+    tls_gen++;
     init_done = 0;
     have_entropy = 0;
     memset_s(&main_state, sizeof(main_state), 0, sizeof(main_state));
@@ -34,6 +34,7 @@
 #include <config.h>
 #include <roken.h>
 #include <krb5-types.h>
+#include <heim_threads.h>
 #include <assert.h>
 
 #include <rsa.h>
@@ -99,32 +100,6 @@ setup_blind(mp_int *n, mp_int *b, mp_int *bi)
     return ret;
 }
 
-static mp_err
-blind(mp_int *in, mp_int *b, mp_int *e, mp_int *n)
-{
-    mp_err ret;
-    mp_int t1;
-
-    ret = mp_init(&t1);
-    /* in' = (in * b^e) mod n */
-    if (ret == MP_OKAY) ret = mp_exptmod(b, e, n, &t1);
-    if (ret == MP_OKAY) ret = mp_mul(&t1, in, in);
-    if (ret == MP_OKAY) ret = mp_mod(in, n, in);
-    mp_clear(&t1);
-    return ret;
-}
-
-static mp_err
-unblind(mp_int *out, mp_int *bi, mp_int *n)
-{
-    mp_err ret;
-
-    /* out' = (out * 1/b) mod n */
-    ret = mp_mul(out, bi, out);
-    if (ret == MP_OKAY) ret = mp_mod(out, n, out);
-    return ret;
-}
-
 static mp_err
 ltm_rsa_private_calculate(mp_int * in, mp_int * p,  mp_int * q,
 			  mp_int * dmp1, mp_int * dmq1, mp_int * iqmp,
@@ -158,6 +133,182 @@ ltm_rsa_private_calculate(mp_int * in, mp_int * p,  mp_int * q,
     return ret;
 }
 
+/*
+ * What is kept with each key, in rsa->_method_mod_n: the CRT
+ * parameters when the key has p, q and d but not them, and a blinding
+ * pair that is squared for each use instead of computed anew, as
+ * OpenSSL does.  A new pair is made every BLINDING_USES uses.  All of
+ * it is thrown away when the key changes.
+ */
+
+#define BLINDING_USES 32
+
+struct ltm_rsa_key {
+    HEIMDAL_MUTEX mutex;
+    BIGNUM *n;			/* the key the rest was made for */
+    BIGNUM *d;
+    BIGNUM *p;
+    int have_crt;
+    mp_int dmp1, dmq1, iqmp;
+    unsigned int blinding_uses;	/* 0 when there is no pair */
+    mp_int bf;			/* b^e mod n */
+    mp_int bi;			/* 1/b mod n */
+};
+
+static int
+bn_same(BIGNUM **cached, const BIGNUM *bn)
+{
+    if (*cached == NULL && bn == NULL)
+	return 1;
+    if (*cached != NULL && bn != NULL && BN_cmp(*cached, bn) == 0)
+	return 1;
+    if (*cached)
+	BN_free(*cached);
+    *cached = NULL;
+    return 0;
+}
+
+static mp_err
+ltm_rsa_key_check(struct ltm_rsa_key *k, RSA *rsa)
+{
+    int same;
+
+    same = bn_same(&k->n, rsa->n);
+    same = bn_same(&k->d, rsa->d) && same;
+    same = bn_same(&k->p, rsa->p) && same;
+    if (same)
+	return MP_OKAY;
+
+    k->have_crt = 0;
+    k->blinding_uses = 0;
+    if ((rsa->n && (k->n = BN_dup(rsa->n)) == NULL) ||
+	(rsa->d && (k->d = BN_dup(rsa->d)) == NULL) ||
+	(rsa->p && (k->p = BN_dup(rsa->p)) == NULL))
+	return MP_MEM;
+    return MP_OKAY;
+}
+
+/*
+ * Derive dmp1, dmq1 and iqmp from p, q and d.
+ */
+static mp_err
+ltm_rsa_derive_crt(RSA *rsa, mp_int *p, mp_int *q,
+		   mp_int *dmp1, mp_int *dmq1, mp_int *iqmp)
+{
+    mp_err ret;
+    mp_int d, t;
+    int where HEIMDAL_UNUSED_ATTRIBUTE = 0;
+
+    FIRST(mp_init_multi(&d, &t, NULL));
+    THEN_MP(BN2mpz(&d, rsa->d));
+    THEN_MP(mp_sub_d(p, 1, &t));
+    THEN_MP(mp_mod(&d, &t, dmp1));
+    THEN_MP(mp_sub_d(q, 1, &t));
+    THEN_MP(mp_mod(&d, &t, dmq1));
+    THEN_MP(mp_invmod(q, p, iqmp));
+    mp_clear_multi(&d, &t, NULL);
+    return ret;
+}
+
+/*
+ * Take a blinding pair for one use, making a new one if needed.
+ */
+static mp_err
+ltm_rsa_take_blinding(struct ltm_rsa_key *k, mp_int *n, mp_int *e,
+		      mp_int *bf, mp_int *bi)
+{
+    mp_err ret = MP_OKAY;
+    mp_int b;
+    int where HEIMDAL_UNUSED_ATTRIBUTE = 0;
+
+    if (k == NULL || k->blinding_uses == 0 ||
+	k->blinding_uses >= BLINDING_USES) {
+	FIRST(mp_init(&b));
+	THEN_MP(setup_blind(n, &b, bi));
+	THEN_MP(mp_exptmod(&b, e, n, bf));
+	mp_clear(&b);
+	if (k == NULL || ret != MP_OKAY)
+	    return ret;
+	THEN_MP(mp_copy(bf, &k->bf));
+	THEN_MP(mp_copy(bi, &k->bi));
+	k->blinding_uses = 0;
+    } else {
+	THEN_MP(mp_copy(&k->bf, bf));
+	THEN_MP(mp_copy(&k->bi, bi));
+    }
+
+    /* (b^2)^e = (b^e)^2 and 1/b^2 = (1/b)^2 */
+    THEN_MP(mp_sqrmod(&k->bf, n, &k->bf));
+    THEN_MP(mp_sqrmod(&k->bi, n, &k->bi));
+    k->blinding_uses = (ret == MP_OKAY) ? k->blinding_uses + 1 : 0;
+    return ret;
+}
+
+/*
+ * out = in ^ d mod n, blinded unless the key says otherwise.
+ */
+static mp_err
+ltm_rsa_private_op(RSA *rsa, mp_int *in, mp_int *n, mp_int *e, mp_int *out)
+{
+    struct ltm_rsa_key *k = rsa->_method_mod_n;
+    int blinding = (rsa->flags & RSA_FLAG_NO_BLINDING) == 0;
+    int have_crt = rsa->dmp1 && rsa->dmq1 && rsa->iqmp;
+    int crt = rsa->p && rsa->q && (have_crt || rsa->d);
+    mp_int p, q, d, dmp1, dmq1, iqmp, bf, bi;
+    mp_err ret;
+    int where HEIMDAL_UNUSED_ATTRIBUTE = 0;
+
+    FIRST(mp_init_multi(&p, &q, &d, &dmp1, &dmq1, &iqmp, &bf, &bi, NULL));
+    if (ret != MP_OKAY)
+	return ret;
+
+    if (k)
+	HEIMDAL_MUTEX_lock(&k->mutex);
+    THEN_IF_MP(k != NULL, ltm_rsa_key_check(k, rsa));
+
+    if (crt) {
+	THEN_MP(BN2mpz(&p, rsa->p));
+	THEN_MP(BN2mpz(&q, rsa->q));
+	if (have_crt) {
+	    THEN_MP(BN2mpz(&dmp1, rsa->dmp1));
+	    THEN_MP(BN2mpz(&dmq1, rsa->dmq1));
+	    THEN_MP(BN2mpz(&iqmp, rsa->iqmp));
+	} else if (k && k->have_crt) {
+	    THEN_MP(mp_copy(&k->dmp1, &dmp1));
+	    THEN_MP(mp_copy(&k->dmq1, &dmq1));
+	    THEN_MP(mp_copy(&k->iqmp, &iqmp));
+	} else {
+	    THEN_MP(ltm_rsa_derive_crt(rsa, &p, &q, &dmp1, &dmq1, &iqmp));
+	    THEN_IF_MP(k != NULL, mp_copy(&dmp1, &k->dmp1));
+	    THEN_IF_MP(k != NULL, mp_copy(&dmq1, &k->dmq1));
+	    THEN_IF_MP(k != NULL, mp_copy(&iqmp, &k->iqmp));
+	    THEN_IF_VOID(k != NULL, k->have_crt = 1);
+	}
+    } else {
+	THEN_MP(BN2mpz(&d, rsa->d));
+    }
+
+    THEN_IF_MP(blinding, ltm_rsa_take_blinding(k, n, e, &bf, &bi));
+
+    if (k)
+	HEIMDAL_MUTEX_unlock(&k->mutex);
+
+    /* in' = (in * b^e) mod n */
+    THEN_IF_MP(blinding, mp_mulmod(in, &bf, n, in));
+
+    if (crt)
+	THEN_MP(ltm_rsa_private_calculate(in, &p, &q, &dmp1, &dmq1, &iqmp,
+					  out));
+    else
+	THEN_MP(mp_exptmod(in, &d, n, out));
+
+    /* out = (out' * 1/b) mod n */
+    THEN_IF_MP(blinding, mp_mulmod(out, &bi, n, out));
+
+    mp_clear_multi(&p, &q, &d, &dmp1, &dmq1, &iqmp, &bf, &bi, NULL);
+    return ret;
+}
+
 /*
  *
  */
@@ -276,16 +427,13 @@ ltm_rsa_private_encrypt(int flen, const unsigned char* from,
     unsigned char *ptr, *ptr0 = NULL;
     mp_err ret;
     mp_int in, out, n, e;
-    mp_int bi, b;
     size_t size;
-    int blinding = (rsa->flags & RSA_FLAG_NO_BLINDING) == 0;
-    int do_unblind = 0;
     int where = 0;
 
     if (padding != RSA_PKCS1_PADDING)
 	return -1;
 
-    FIRST(mp_init_multi(&e, &n, &in, &out, &b, &bi, NULL));
+    FIRST(mp_init_multi(&e, &n, &in, &out, NULL));
 
     size = RSA_size(rsa);
     if (size < RSA_PKCS1_PADDING_SIZE || size - RSA_PKCS1_PADDING_SIZE < flen)
@@ -310,38 +458,7 @@ ltm_rsa_private_encrypt(int flen, const unsigned char* from,
     free(ptr0);
 
     THEN_IF_MP((mp_isneg(&in) || mp_cmp(&in, &n) >= 0), MP_ERR);
-
-    if (blinding) {
-	THEN_MP(setup_blind(&n, &b, &bi));
-	THEN_MP(blind(&in, &b, &e, &n));
-	do_unblind = 1;
-    }
-
-    if (ret == MP_OKAY && rsa->p && rsa->q && rsa->dmp1 && rsa->dmq1 &&
-        rsa->iqmp) {
-	mp_int p, q, dmp1, dmq1, iqmp;
-
-	FIRST(mp_init_multi(&p, &q, &dmp1, &dmq1, &iqmp, NULL));
-	THEN_MP(BN2mpz(&p, rsa->p));
-	THEN_MP(BN2mpz(&q, rsa->q));
-	THEN_MP(BN2mpz(&dmp1, rsa->dmp1));
-	THEN_MP(BN2mpz(&dmq1, rsa->dmq1));
-	THEN_MP(BN2mpz(&iqmp, rsa->iqmp));
-        THEN_MP(ltm_rsa_private_calculate(&in, &p, &q, &dmp1, &dmq1, &iqmp,
-                                          &out));
-	mp_clear_multi(&p, &q, &dmp1, &dmq1, &iqmp, NULL);
-	if (ret != MP_OKAY) goto out;
-    } else if (ret == MP_OKAY) {
-	mp_int d;
-
-	THEN_MP(BN2mpz(&d, rsa->d));
-	THEN_MP(mp_exptmod(&in, &d, &n, &out));
-	mp_clear(&d);
-	if (ret != MP_OKAY) goto out;
-    }
-
-    if (do_unblind)
-	THEN_MP(unblind(&out, &bi, &n));
+    THEN_MP(ltm_rsa_private_op(rsa, &in, &n, &e, &out));
 
     if (ret == MP_OKAY && size > 0) {
 	size_t ssize;
@@ -352,8 +469,7 @@ ltm_rsa_private_encrypt(int flen, const unsigned char* from,
 	size = ssize;
     }
 
- out:
-    mp_clear_multi(&e, &n, &in, &out, &b, &bi, NULL);
+    mp_clear_multi(&e, &n, &in, &out, NULL);
     return ret == MP_OKAY ? size : -where;
 }
 
@@ -364,9 +480,7 @@ ltm_rsa_private_decrypt(int flen, const unsigned char* from,
     unsigned char *ptr;
     size_t size;
     mp_err ret;
-    mp_int in, out, n, e, b, bi;
-    int blinding = (rsa->flags & RSA_FLAG_NO_BLINDING) == 0;
-    int do_unblind = 0;
+    mp_int in, out, n, e;
     int where = 0;
 
     if (padding != RSA_PKCS1_PADDING)
@@ -376,44 +490,13 @@ ltm_rsa_private_decrypt(int flen, const unsigned char* from,
     if (flen > size)
 	return -2;
 
-    FIRST(mp_init_multi(&in, &n, &e, &out, &b, &bi, NULL));
+    FIRST(mp_init_multi(&in, &n, &e, &out, NULL));
     THEN_MP(BN2mpz(&n, rsa->n));
     THEN_MP(BN2mpz(&e, rsa->e));
     THEN_IF_MP((mp_cmp_d(&e, 3) == MP_LT), MP_ERR);
     THEN_MP(mp_from_ubin(&in, rk_UNCONST(from), flen));
     THEN_IF_MP((mp_isneg(&in) || mp_cmp(&in, &n) >= 0), MP_ERR);
-
-    if (blinding) {
-	THEN_MP(setup_blind(&n, &b, &bi));
-	THEN_MP(blind(&in, &b, &e, &n));
-	do_unblind = 1;
-    }
-
-    if (ret == MP_OKAY && rsa->p && rsa->q && rsa->dmp1 && rsa->dmq1 &&
-        rsa->iqmp) {
-	mp_int p, q, dmp1, dmq1, iqmp;
-
-	THEN_MP(mp_init_multi(&p, &q, &dmp1, &dmq1, &iqmp, NULL));
-	THEN_MP(BN2mpz(&p, rsa->p));
-	THEN_MP(BN2mpz(&q, rsa->q));
-	THEN_MP(BN2mpz(&dmp1, rsa->dmp1));
-	THEN_MP(BN2mpz(&dmq1, rsa->dmq1));
-	THEN_MP(BN2mpz(&iqmp, rsa->iqmp));
-	THEN_MP(ltm_rsa_private_calculate(&in, &p, &q, &dmp1, &dmq1, &iqmp, &out));
-	mp_clear_multi(&p, &q, &dmp1, &dmq1, &iqmp, NULL);
-	if (ret != MP_OKAY) goto out;
-    } else if (ret == MP_OKAY) {
-	mp_int d;
-
-	THEN_IF_MP((mp_isneg(&in) || mp_cmp(&in, &n) >= 0), MP_ERR);
-	THEN_MP(BN2mpz(&d, rsa->d));
-	THEN_MP(mp_exptmod(&in, &d, &n, &out));
-	mp_clear(&d);
-	if (ret != MP_OKAY) goto out;
-    }
-
-    if (do_unblind)
-	THEN_MP(unblind(&out, &bi, &n));
+    THEN_MP(ltm_rsa_private_op(rsa, &in, &n, &e, &out));
 
     if (ret == MP_OKAY) {
         size_t ssize;
@@ -443,7 +526,7 @@ ltm_rsa_private_decrypt(int flen, const unsigned char* from,
     }
 
  out:
-    mp_clear_multi(&e, &n, &in, &out, &b, &bi, NULL);
+    mp_clear_multi(&e, &n, &in, &out, NULL);
     return (ret == MP_OKAY) ? size : -where;
 }
 
@@ -603,12 +686,38 @@ ltm_rsa_generate_key(RSA *rsa, int bits, BIGNUM *e, BN_GENCB *cb)
 static int
 ltm_rsa_init(RSA *rsa)
 {
+    struct ltm_rsa_key *k;
+
+    /* Without it every operation starts from scratch, as before */
+    if ((k = calloc(1, sizeof(*k))) == NULL)
+	return 1;
+    if (mp_init_multi(&k->dmp1, &k->dmq1, &k->iqmp, &k->bf, &k->bi,
+		      NULL) != MP_OKAY) {
+	free(k);
+	return 1;
+    }
+    HEIMDAL_MUTEX_init(&k->mutex);
+    rsa->_method_mod_n = k;
     return 1;
 }
 
 static int
 ltm_rsa_finish(RSA *rsa)
 {
+    struct ltm_rsa_key *k = rsa->_method_mod_n;
+
+    if (k == NULL)
+	return 1;
+    HEIMDAL_MUTEX_destroy(&k->mutex);
+    if (k->n)
+	BN_free(k->n);
+    if (k->d)
+	BN_free(k->d);
+    if (k->p)
+	BN_free(k->p);
+    mp_clear_multi(&k->dmp1, &k->dmq1, &k->iqmp, &k->bf, &k->bi, NULL);
+    free(k);
+    rsa->_method_mod_n = NULL;
     return 1;
 }
 
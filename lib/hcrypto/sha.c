@@ -217,6 +217,168 @@ swap_uint32_t (uint32_t t)
 }
 #endif
 
+/*
+ * As in sha256.c: whole blocks go through the SHA-NI or ARMv8 SHA-1
+ * instructions when the CPU has them.  Define NO_SHA_ACCEL to build
+ * without this.
+ */
+#if !defined(NO_SHA_ACCEL) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SHA1_ACCEL_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif !defined(NO_SHA_ACCEL) && defined(__GNUC__) && defined(__aarch64__) && \
+    (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#define SHA1_ACCEL_ARM 1
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#endif
+#endif
+
+#if defined(SHA1_ACCEL_X86) || defined(SHA1_ACCEL_ARM)
+#define HAVE_SHA1_ACCEL 1
+
+static int
+sha1_accel(void)
+{
+  static volatile int accel = -1;
+
+  if (accel == -1) {
+#ifdef SHA1_ACCEL_X86
+    unsigned int a, b, c, d;
+    int ok = 0;
+
+    if (__get_cpuid_max(0, NULL) >= 7 &&
+	__get_cpuid(1, &a, &b, &c, &d) &&
+	(c & bit_SSSE3) && (c & bit_SSE4_1)) {
+      __cpuid_count(7, 0, a, b, c, d);
+      ok = (b & (1 << 29)) != 0; /* SHA */
+    }
+    accel = ok;
+#elif defined(__linux__)
+    accel = (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+#else
+    accel = 1; /* built for a CPU that has it */
+#endif
+  }
+  return accel;
+}
+
+/*
+ * Each step does four rounds.  W(g) is the message block holding
+ * schedule words 4g..4g+3; only four are live at a time.  The steps are
+ * unrolled since the round function must be an immediate.
+ */
+#define W(g) w[(g) & 3]
+
+#ifdef SHA1_ACCEL_X86
+#define STEP(g)								\
+do {									\
+  if ((g) == 0)								\
+    e[0] = _mm_add_epi32(e[0], W(0));					\
+  else									\
+    e[(g) & 1] = _mm_sha1nexte_epu32(e[(g) & 1], W(g));		\
+  e[((g) + 1) & 1] = abcd;						\
+  if ((g) >= 3 && (g) <= 18)						\
+    W((g) + 1) = _mm_sha1msg2_epu32(W((g) + 1), W(g));			\
+  abcd = _mm_sha1rnds4_epu32(abcd, e[(g) & 1], (g) / 5);		\
+  if ((g) >= 1 && (g) <= 16)						\
+    W((g) - 1) = _mm_sha1msg1_epu32(W((g) - 1), W(g));			\
+  if ((g) >= 2 && (g) <= 17)						\
+    W((g) - 2) = _mm_xor_si128(W((g) - 2), W(g));			\
+} while (0)
+
+__attribute__((target("sha,sse4.1,ssse3"))) static void
+sha1_blocks(uint32_t *state, const unsigned char *p, size_t n)
+{
+  const __m128i mask =
+      _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e_save, e[2], w[4];
+  int i;
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+  e[0] = _mm_set_epi32(state[4], 0, 0, 0);
+
+  for (; n > 0; n--, p += 64) {
+    abcd_save = abcd;
+    e_save = e[0];
+
+    for (i = 0; i < 4; i++)
+      w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)),
+			      mask);
+
+    STEP(0);  STEP(1);  STEP(2);  STEP(3);  STEP(4);
+    STEP(5);  STEP(6);  STEP(7);  STEP(8);  STEP(9);
+    STEP(10); STEP(11); STEP(12); STEP(13); STEP(14);
+    STEP(15); STEP(16); STEP(17); STEP(18); STEP(19);
+
+    e[0] = _mm_sha1nexte_epu32(e[0], e_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+  state[4] = _mm_extract_epi32(e[0], 3);
+}
+#else
+#define ROUNDS(g, abcd, e, t)						\
+  ((g) < 5 ? vsha1cq_u32((abcd), (e), (t)) :				\
+   (g) < 10 ? vsha1pq_u32((abcd), (e), (t)) :				\
+   (g) < 15 ? vsha1mq_u32((abcd), (e), (t)) :				\
+   vsha1pq_u32((abcd), (e), (t)))
+
+#define STEP(g)								\
+do {									\
+  uint32x4_t t = vaddq_u32(W(g), vdupq_n_u32(k[(g) / 5]));		\
+  e[((g) + 1) & 1] = vsha1h_u32(vgetq_lane_u32(abcd, 0));		\
+  abcd = ROUNDS((g), abcd, e[(g) & 1], t);				\
+  if ((g) >= 1 && (g) <= 16)						\
+    W((g) + 3) = vsha1su1q_u32(W((g) + 3), W((g) + 2));		\
+  if ((g) <= 15)							\
+    W(g) = vsha1su0q_u32(W(g), W((g) + 1), W((g) + 2));		\
+} while (0)
+
+static void
+sha1_blocks(uint32_t *state, const unsigned char *p, size_t n)
+{
+  static const uint32_t k[4] = {
+    0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6
+  };
+  uint32x4_t abcd, abcd_save, w[4];
+  uint32_t e_save, e[2];
+  int i;
+
+  abcd = vld1q_u32(state);
+  e[0] = state[4];
+
+  for (; n > 0; n--, p += 64) {
+    abcd_save = abcd;
+    e_save = e[0];
+
+    for (i = 0; i < 4; i++)
+      w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p + 16 * i)));
+
+    STEP(0);  STEP(1);  STEP(2);  STEP(3);  STEP(4);
+    STEP(5);  STEP(6);  STEP(7);  STEP(8);  STEP(9);
+    STEP(10); STEP(11); STEP(12); STEP(13); STEP(14);
+    STEP(15); STEP(16); STEP(17); STEP(18); STEP(19);
+
+    e[0] += e_save;
+    abcd = vaddq_u32(abcd, abcd_save);
+  }
+
+  vst1q_u32(state, abcd);
+  state[4] = e[0];
+}
+#undef ROUNDS
+#endif
+#undef STEP
+#undef W
+#endif /* SHA1_ACCEL_X86 || SHA1_ACCEL_ARM */
+
 struct x32{
   unsigned int a:32;
   unsigned int b:32;
@@ -234,24 +396,42 @@ SHA1_Update (struct sha *m, const void *v, size_t len)
       ++m->sz[1];
   offset = (old_sz / 8)  % 64;
   while(len > 0){
-    size_t l = min(len, 64 - offset);
+    size_t l;
+#ifdef HAVE_SHA1_ACCEL
+    if (offset == 0 && len >= 64 && sha1_accel()) {
+      size_t n = len / 64;
+
+      sha1_blocks(m->counter, p, n);
+      p += n * 64;
+      len -= n * 64;
+      continue;
+    }
+#endif
+    l = min(len, 64 - offset);
     memcpy(m->save + offset, p, l);
     offset += l;
     p += l;
     len -= l;
     if(offset == 64){
+#ifdef HAVE_SHA1_ACCEL
+      if (sha1_accel())
+	sha1_blocks(m->counter, m->save, 1);
+      else
+#endif
+      {
 #if !defined(WORDS_BIGENDIAN) || defined(_CRAY)
-      int i;
-      uint32_t SHA1current[16];
-      struct x32 *us = (struct x32*)m->save;
-      for(i = 0; i < 8; i++){
-	SHA1current[2*i+0] = swap_uint32_t(us[i].a);
-	SHA1current[2*i+1] = swap_uint32_t(us[i].b);
-      }
-      calc(m, SHA1current);
+	int i;
+	uint32_t SHA1current[16];
+	struct x32 *us = (struct x32*)m->save;
+	for(i = 0; i < 8; i++){
+	  SHA1current[2*i+0] = swap_uint32_t(us[i].a);
+	  SHA1current[2*i+1] = swap_uint32_t(us[i].b);
+	}
+	calc(m, SHA1current);
 #else
-      calc(m, (uint32_t*)m->save);
+	calc(m, (uint32_t*)m->save);
 #endif
+      }
       offset = 0;
     }
   }
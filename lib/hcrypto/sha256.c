@@ -75,6 +75,150 @@ static const uint32_t constant_256[64] = {
     0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
 };
 
+/*
+ * Whole blocks are hashed with the SHA-NI instructions on x86, and with
+ * the ARMv8 SHA-2 instructions on aarch64 builds that target them, when
+ * the CPU has them.  This is decided once, at runtime.  The input is
+ * consumed straight from the caller's buffer, with no byte swapping
+ * into a temporary.
+ *
+ * Define NO_SHA_ACCEL to build without this.
+ */
+#if !defined(NO_SHA_ACCEL) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SHA256_ACCEL_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif !defined(NO_SHA_ACCEL) && defined(__GNUC__) && defined(__aarch64__) && \
+    (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#define SHA256_ACCEL_ARM 1
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+#endif
+
+#if defined(SHA256_ACCEL_X86) || defined(SHA256_ACCEL_ARM)
+#define HAVE_SHA256_ACCEL 1
+
+static int
+sha256_accel(void)
+{
+    static volatile int accel = -1;
+
+    if (accel == -1) {
+#ifdef SHA256_ACCEL_X86
+	unsigned int a, b, c, d;
+	int ok = 0;
+
+	if (__get_cpuid_max(0, NULL) >= 7 &&
+	    __get_cpuid(1, &a, &b, &c, &d) &&
+	    (c & bit_SSSE3) && (c & bit_SSE4_1)) {
+	    __cpuid_count(7, 0, a, b, c, d);
+	    ok = (b & (1 << 29)) != 0; /* SHA */
+	}
+	accel = ok;
+#elif defined(__linux__)
+	accel = (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#else
+	accel = 1; /* built for a CPU that has it */
+#endif
+    }
+    return accel;
+}
+
+#ifdef SHA256_ACCEL_X86
+__attribute__((target("sha,sse4.1,ssse3"))) static void
+sha256_blocks(uint32_t *state, const unsigned char *p, size_t n)
+{
+    const __m128i mask =
+	_mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, save0, save1, msg, tmp, w[4];
+    int g;
+
+    /* ABCD EFGH -> ABEF CDGH, the layout sha256rnds2 works on */
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; n > 0; n--, p += 64) {
+	save0 = state0;
+	save1 = state1;
+
+	for (g = 0; g < 4; g++)
+	    w[g] = _mm_shuffle_epi8(
+		_mm_loadu_si128((const __m128i *)(p + 16 * g)), mask);
+
+	/* Four rounds per step; w[] holds the next sixteen schedule words */
+	for (g = 0; g < 16; g++) {
+	    msg = _mm_add_epi32(w[g & 3],
+		_mm_loadu_si128((const __m128i *)&constant_256[4 * g]));
+	    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+	    if (g >= 3 && g < 15) {
+		tmp = _mm_alignr_epi8(w[g & 3], w[(g - 1) & 3], 4);
+		w[(g + 1) & 3] = _mm_add_epi32(w[(g + 1) & 3], tmp);
+		w[(g + 1) & 3] = _mm_sha256msg2_epu32(w[(g + 1) & 3], w[g & 3]);
+	    }
+	    msg = _mm_shuffle_epi32(msg, 0x0E);
+	    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+	    if (g >= 1 && g < 13)
+		w[(g - 1) & 3] = _mm_sha256msg1_epu32(w[(g - 1) & 3], w[g & 3]);
+	}
+
+	state0 = _mm_add_epi32(state0, save0);
+	state1 = _mm_add_epi32(state1, save1);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+#else
+static void
+sha256_blocks(uint32_t *state, const unsigned char *p, size_t n)
+{
+    uint32x4_t state0, state1, save0, save1, msg, tmp, w[4];
+    int g;
+
+    state0 = vld1q_u32(&state[0]);
+    state1 = vld1q_u32(&state[4]);
+
+    for (; n > 0; n--, p += 64) {
+	save0 = state0;
+	save1 = state1;
+
+	for (g = 0; g < 4; g++)
+	    w[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p + 16 * g)));
+
+	for (g = 0; g < 16; g++) {
+	    msg = vaddq_u32(w[g & 3], vld1q_u32(&constant_256[4 * g]));
+	    if (g < 12) {
+		w[g & 3] = vsha256su0q_u32(w[g & 3], w[(g + 1) & 3]);
+		w[g & 3] = vsha256su1q_u32(w[g & 3], w[(g + 2) & 3],
+					   w[(g + 3) & 3]);
+	    }
+	    tmp = state0;
+	    state0 = vsha256hq_u32(state0, state1, msg);
+	    state1 = vsha256h2q_u32(state1, tmp, msg);
+	}
+
+	state0 = vaddq_u32(state0, save0);
+	state1 = vaddq_u32(state1, save1);
+    }
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+#endif
+#endif /* SHA256_ACCEL_X86 || SHA256_ACCEL_ARM */
+
 int
 SHA256_Init (SHA256_CTX *m)
 {
@@ -176,24 +320,42 @@ SHA256_Update (SHA256_CTX *m, const void *v, size_t len)
 	++m->sz[1];
     offset = (old_sz / 8) % 64;
     while(len > 0){
-	size_t l = min(len, 64 - offset);
+	size_t l;
+#ifdef HAVE_SHA256_ACCEL
+	if (offset == 0 && len >= 64 && sha256_accel()) {
+	    size_t n = len / 64;
+
+	    sha256_blocks(m->counter, p, n);
+	    p += n * 64;
+	    len -= n * 64;
+	    continue;
+	}
+#endif
+	l = min(len, 64 - offset);
 	memcpy(m->save + offset, p, l);
 	offset += l;
 	p += l;
 	len -= l;
 	if(offset == 64){
+#ifdef HAVE_SHA256_ACCEL
+	    if (sha256_accel())
+		sha256_blocks(m->counter, m->save, 1);
+	    else
+#endif
+	    {
 #if !defined(WORDS_BIGENDIAN) || defined(_CRAY)
-	    int i;
-	    uint32_t current[16];
-	    struct x32 *us = (struct x32*)m->save;
-	    for(i = 0; i < 8; i++){
-		current[2*i+0] = swap_uint32_t(us[i].a);
-		current[2*i+1] = swap_uint32_t(us[i].b);
-	    }
-	    calc(m, current);
+		int i;
+		uint32_t current[16];
+		struct x32 *us = (struct x32*)m->save;
+		for(i = 0; i < 8; i++){
+		    current[2*i+0] = swap_uint32_t(us[i].a);
+		    current[2*i+1] = swap_uint32_t(us[i].b);
+		}
+		calc(m, current);
 #else
-	    calc(m, (uint32_t*)m->save);
+		calc(m, (uint32_t*)m->save);
 #endif
+	    }
 	    offset = 0;
 	}
     }
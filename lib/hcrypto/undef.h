@@ -100,6 +100,7 @@
 #undef EVP_DigestUpdate
 #undef EVP_MD_CTX_block_size
 #undef EVP_MD_CTX_cleanup
+#undef EVP_MD_CTX_copy_ex
 #undef EVP_MD_CTX_create
 #undef EVP_MD_CTX_init
 #undef EVP_MD_CTX_destroy
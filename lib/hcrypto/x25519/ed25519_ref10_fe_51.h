@@ -20,9 +20,48 @@
 #include <roken.h>
 #include <string.h>
 
-#include "private/common.h"
-#include "private/quirks.h"
-#include "utils.h"
+/* In place of libsodium's private/common.h */
+
+typedef unsigned uint128_t __attribute__((mode(TI)));
+
+static inline uint64_t
+load64_le(const unsigned char src[8])
+{
+#ifndef WORDS_BIGENDIAN
+    uint64_t w;
+    memcpy(&w, src, sizeof w);
+    return w;
+#else
+    uint64_t w = (uint64_t) src[0];
+    w |= (uint64_t) src[1] <<  8;
+    w |= (uint64_t) src[2] << 16;
+    w |= (uint64_t) src[3] << 24;
+    w |= (uint64_t) src[4] << 32;
+    w |= (uint64_t) src[5] << 40;
+    w |= (uint64_t) src[6] << 48;
+    w |= (uint64_t) src[7] << 56;
+    return w;
+#endif
+}
+#define LOAD64_LE(SRC) load64_le(SRC)
+
+static inline void
+store64_le(unsigned char dst[8], uint64_t w)
+{
+#ifndef WORDS_BIGENDIAN
+    memcpy(dst, &w, sizeof w);
+#else
+    dst[0] = (unsigned char) w; w >>= 8;
+    dst[1] = (unsigned char) w; w >>= 8;
+    dst[2] = (unsigned char) w; w >>= 8;
+    dst[3] = (unsigned char) w; w >>= 8;
+    dst[4] = (unsigned char) w; w >>= 8;
+    dst[5] = (unsigned char) w; w >>= 8;
+    dst[6] = (unsigned char) w; w >>= 8;
+    dst[7] = (unsigned char) w;
+#endif
+}
+#define STORE64_LE(DST, W) store64_le((DST), (W))
 
 /*
  h = 0
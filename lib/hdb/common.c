@@ -143,21 +143,296 @@ add_default_salts(krb5_context context, HDB *db, hdb_entry *entry)
     return ret;
 }
 
+/*
+ * The default way to fetch and decode the entry or alias stored under
+ * `key': get a copy of the encoded value with hdb__get(), and decode that.
+ */
+static krb5_error_code
+get_entry_or_alias(krb5_context context,
+                   HDB *db,
+                   krb5_data key,
+                   HDB_EntryOrAlias *eoa)
+{
+    krb5_data value;
+    krb5_error_code ret;
+
+    ret = db->hdb__get(context, db, key, &value);
+    if (ret == 0) {
+        ret = decode_HDB_EntryOrAlias(value.data, value.length, eoa, NULL);
+        krb5_data_free(&value);
+    }
+    return ret;
+}
+
+/*
+ * An in-memory index of alias keys to the keys of the principals they name
+ * ([hdb] alias_index), so that the KDC can fetch the entry for an alias
+ * with one lookup instead of two.  It is built from the aliases listed in
+ * the entries on first use by the KDC, and kept current by _hdb_store() and
+ * _hdb_remove().  Other processes (kadmind, ipropd-slave) may change
+ * aliases meanwhile, so the index is only a hint: a hit is used only if the
+ * entry it leads to still lists the alias, and aliases found the slow way
+ * are added to it.
+ */
+struct hdb_alias_index_ent {
+    struct hdb_alias_index_ent *next;
+    uint32_t hash;
+    krb5_data alias;            /* key of the alias */
+    krb5_data target;           /* key of the principal it names */
+};
+
+struct hdb_alias_index {
+    int enabled;
+    int built;
+    size_t nbuckets;
+    size_t count;
+    struct hdb_alias_index_ent **buckets;
+};
+
+static uint32_t
+alias_index_hash(const krb5_data *key)
+{
+    const unsigned char *p = key->data;
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < key->length; i++)
+        h = (h ^ p[i]) * 16777619U;
+    return h;
+}
+
+static struct hdb_alias_index_ent **
+alias_index_find(struct hdb_alias_index *ai, const krb5_data *alias)
+{
+    struct hdb_alias_index_ent **ep;
+    uint32_t hash = alias_index_hash(alias);
+
+    if (ai->buckets == NULL)
+        return NULL;
+    for (ep = &ai->buckets[hash % ai->nbuckets]; *ep; ep = &(*ep)->next)
+        if ((*ep)->hash == hash &&
+            krb5_data_cmp(&(*ep)->alias, alias) == 0)
+            return ep;
+    return NULL;
+}
+
+static void
+alias_index_del(struct hdb_alias_index *ai, const krb5_data *alias)
+{
+    struct hdb_alias_index_ent **ep, *e;
+
+    if (ai == NULL || (ep = alias_index_find(ai, alias)) == NULL)
+        return;
+    e = *ep;
+    *ep = e->next;
+    krb5_data_free(&e->alias);
+    krb5_data_free(&e->target);
+    free(e);
+    ai->count--;
+}
+
+/* Doubles the number of buckets when full; failure to do so is harmless */
+static void
+alias_index_grow(struct hdb_alias_index *ai)
+{
+    struct hdb_alias_index_ent **buckets, *e, *next;
+    size_t nbuckets = ai->nbuckets ? ai->nbuckets * 2 : 64;
+    size_t i;
+
+    if ((buckets = calloc(nbuckets, sizeof(buckets[0]))) == NULL)
+        return;
+    for (i = 0; i < ai->nbuckets; i++) {
+        for (e = ai->buckets[i]; e; e = next) {
+            next = e->next;
+            e->next = buckets[e->hash % nbuckets];
+            buckets[e->hash % nbuckets] = e;
+        }
+    }
+    free(ai->buckets);
+    ai->buckets = buckets;
+    ai->nbuckets = nbuckets;
+}
+
+/* Add or replace an alias; failures just mean it is not indexed */
+static void
+alias_index_add(struct hdb_alias_index *ai,
+                const krb5_data *alias,
+                const krb5_data *target)
+{
+    struct hdb_alias_index_ent *e;
+
+    if (ai == NULL || !ai->enabled)
+        return;
+    alias_index_del(ai, alias);
+    if (ai->count >= ai->nbuckets)
+        alias_index_grow(ai);
+    if (ai->buckets == NULL || (e = calloc(1, sizeof(*e))) == NULL)
+        return;
+    if (krb5_data_copy(&e->alias, alias->data, alias->length) ||
+        krb5_data_copy(&e->target, target->data, target->length)) {
+        krb5_data_free(&e->alias);
+        free(e);
+        return;
+    }
+    e->hash = alias_index_hash(alias);
+    e->next = ai->buckets[e->hash % ai->nbuckets];
+    ai->buckets[e->hash % ai->nbuckets] = e;
+    ai->count++;
+}
+
+static void
+alias_index_clear(struct hdb_alias_index *ai)
+{
+    struct hdb_alias_index_ent *e, *next;
+    size_t i;
+
+    for (i = 0; i < ai->nbuckets; i++) {
+        for (e = ai->buckets[i]; e; e = next) {
+            next = e->next;
+            krb5_data_free(&e->alias);
+            krb5_data_free(&e->target);
+            free(e);
+        }
+    }
+    free(ai->buckets);
+    ai->buckets = NULL;
+    ai->nbuckets = 0;
+    ai->count = 0;
+}
+
+/* Add the aliases of `entry' to the index */
+static krb5_error_code
+alias_index_add_entry(krb5_context context,
+                      struct hdb_alias_index *ai,
+                      const hdb_entry *entry)
+{
+    const HDB_Ext_Aliases *aliases;
+    krb5_error_code ret;
+    krb5_data key, akey;
+    size_t i;
+
+    ret = hdb_entry_get_aliases(entry, &aliases);
+    if (ret || aliases == NULL || aliases->aliases.len == 0)
+        return ret;
+    ret = hdb_principal2key(context, entry->principal, &key);
+    for (i = 0; ret == 0 && i < aliases->aliases.len; i++) {
+        ret = hdb_principal2key(context, &aliases->aliases.val[i], &akey);
+        if (ret == 0) {
+            alias_index_add(ai, &akey, &key);
+            krb5_data_free(&akey);
+        }
+    }
+    krb5_data_free(&key);
+    return ret;
+}
+
+/*
+ * Return the alias index of `db', building it first if need be, or NULL if
+ * it is not enabled.  Building iterates the HDB, so only do this where no
+ * iteration can be in progress, such as in the KDC.
+ */
+static struct hdb_alias_index *
+alias_index(krb5_context context, HDB *db)
+{
+    struct hdb_alias_index *ai = db->hdb_alias_index;
+    krb5_error_code ret;
+    hdb_entry_ex e;
+
+    if (ai == NULL) {
+        if ((ai = calloc(1, sizeof(*ai))) == NULL)
+            return NULL;
+        ai->enabled = krb5_config_get_bool_default(context, NULL, FALSE,
+                                                   "hdb", "alias_index",
+                                                   NULL);
+        db->hdb_alias_index = ai;
+    }
+    if (!ai->enabled)
+        return NULL;
+    if (ai->built)
+        return ai;
+
+    ai->built = 1;
+    memset(&e, 0, sizeof(e));
+    ret = db->hdb_firstkey(context, db, 0, &e);
+    while (ret == 0) {
+        ret = alias_index_add_entry(context, ai, &e.entry);
+        hdb_free_entry(context, &e);
+        if (ret == 0)
+            ret = db->hdb_nextkey(context, db, 0, &e);
+    }
+    if (ret != HDB_ERR_NOENTRY) {
+        /* Start empty; aliases will be added as they are looked up */
+        alias_index_clear(ai);
+        krb5_clear_error_message(context);
+    }
+    return ai;
+}
+
+void
+_hdb_free_alias_index(HDB *db)
+{
+    if (db->hdb_alias_index == NULL)
+        return;
+    alias_index_clear(db->hdb_alias_index);
+    free(db->hdb_alias_index);
+    db->hdb_alias_index = NULL;
+}
+
+/*
+ * Fetch the entry named by alias `principal' via the alias index, if it
+ * has the alias and the entry still lists it as an alias.
+ */
+static int
+fetch_indexed_alias(krb5_context context,
+                    HDB *db,
+                    struct hdb_alias_index *ai,
+                    krb5_const_principal principal,
+                    const krb5_data *key,
+                    hdb_entry_ex *entry,
+                    hdb_get_entry_or_alias_f get)
+{
+    struct hdb_alias_index_ent **ep;
+    const HDB_Ext_Aliases *aliases = NULL;
+    HDB_EntryOrAlias target;
+    size_t i;
+
+    if ((ep = alias_index_find(ai, key)) == NULL)
+        return 0;
+    if (get(context, db, (*ep)->target, &target)) {
+        krb5_clear_error_message(context);
+        return 0;
+    }
+    if (target.element == choice_HDB_EntryOrAlias_entry &&
+        hdb_entry_get_aliases(&target.u.entry, &aliases) == 0 && aliases) {
+        for (i = 0; i < aliases->aliases.len; i++) {
+            if (krb5_principal_compare(context, &aliases->aliases.val[i],
+                                       principal)) {
+                entry->entry = target.u.entry;
+                return 1;
+            }
+        }
+    }
+    free_HDB_EntryOrAlias(&target);
+    return 0;
+}
+
 static krb5_error_code
 fetch_entry_or_alias(krb5_context context,
                      HDB *db,
                      krb5_const_principal principal,
                      unsigned flags,
-                     hdb_entry_ex *entry)
+                     hdb_entry_ex *entry,
+                     hdb_get_entry_or_alias_f get)
 {
-    HDB_EntryOrAlias eoa;
+    HDB_EntryOrAlias eoa, target;
     krb5_principal enterprise_principal = NULL;
-    krb5_data key, value;
+    struct hdb_alias_index *ai = NULL;
+    krb5_data key;
     krb5_error_code ret;
+    int is_alias = 0;
 
-    value.length = 0;
-    value.data = 0;
-    key = value;
+    key.length = 0;
+    key.data = 0;
 
     if (principal->name.name_type == KRB5_NT_ENTERPRISE_PRINCIPAL) {
 	if (principal->name.name_string.len != 1) {
@@ -175,23 +450,35 @@ fetch_entry_or_alias(krb5_context context,
     }
 
     ret = hdb_principal2key(context, principal, &key);
-    if (ret == 0)
-        ret = db->hdb__get(context, db, key, &value);
-    if (ret == 0)
-        ret = decode_HDB_EntryOrAlias(value.data, value.length, &eoa, NULL);
-    if (ret == 0 && eoa.element == choice_HDB_EntryOrAlias_entry) {
+    /* The alias index is only for the KDC; see alias_index() */
+    if (ret == 0 && (flags & HDB_F_GET_ANY))
+        ai = alias_index(context, db);
+    if (ret == 0 && ai)
+        is_alias = fetch_indexed_alias(context, db, ai, principal, &key,
+                                       entry, get);
+    if (ret == 0 && !is_alias)
+        ret = get(context, db, key, &eoa);
+    if (ret == 0 && is_alias) {
+        /* Found with one lookup via the alias index */
+    } else if (ret == 0 && eoa.element == choice_HDB_EntryOrAlias_entry) {
         entry->entry = eoa.u.entry;
     } else if (ret == 0 && eoa.element == choice_HDB_EntryOrAlias_alias) {
-        krb5_data_free(&key);
+        krb5_data akey = key;
+
+        is_alias = 1;
 	ret = hdb_principal2key(context, eoa.u.alias.principal, &key);
-        if (ret == 0) {
-	    krb5_data_free(&value);
-            ret = db->hdb__get(context, db, key, &value);
-	}
         if (ret == 0)
+            ret = get(context, db, key, &target);
+        if (ret == 0 && target.element == choice_HDB_EntryOrAlias_entry) {
+            entry->entry = target.u.entry;
+            alias_index_add(ai, &akey, &key);
+        } else if (ret == 0) {
             /* No alias chaining */
-            ret = hdb_value2entry(context, &value, &entry->entry);
+            free_HDB_EntryOrAlias(&target);
+            ret = HDB_ERR_NOENTRY;
+        }
 	krb5_free_principal(context, eoa.u.alias.principal);
+        krb5_data_free(&akey);
     } else if (ret == 0)
         ret = ENOTSUP;
     if (ret == 0 && enterprise_principal) {
@@ -204,7 +491,7 @@ fetch_entry_or_alias(krb5_context context,
     }
 
     /* HDB_F_GET_ANY indicates request originated from KDC (not kadmin) */
-    if (ret == 0 && eoa.element == choice_HDB_EntryOrAlias_alias &&
+    if (ret == 0 && is_alias &&
         (flags & (HDB_F_CANON|HDB_F_GET_ANY)) == 0) {
 
         /* `principal' was alias but canon not req'd */
@@ -213,7 +500,6 @@ fetch_entry_or_alias(krb5_context context,
     }
 
     krb5_free_principal(context, enterprise_principal);
-    krb5_data_free(&value);
     krb5_data_free(&key);
     principal = enterprise_principal = NULL;
     return ret;
@@ -222,46 +508,49 @@ fetch_entry_or_alias(krb5_context context,
 krb5_error_code
 _hdb_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
 		unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    return _hdb_fetch_kvno_get(context, db, principal, flags, kvno, entry,
+                               get_entry_or_alias);
+}
+
+/*
+ * Like _hdb_fetch_kvno(), but with a backend-specific way to get and decode
+ * stored values, such as one that decodes them in place from the backend's
+ * own storage rather than from a copy.
+ */
+krb5_error_code
+_hdb_fetch_kvno_get(krb5_context context, HDB *db,
+                    krb5_const_principal principal, unsigned flags,
+                    krb5_kvno kvno, hdb_entry_ex *entry,
+                    hdb_get_entry_or_alias_f get)
 {
     krb5_error_code ret;
 
-    ret = fetch_entry_or_alias(context, db, principal, flags, entry);
+    ret = fetch_entry_or_alias(context, db, principal, flags, entry, get);
     if (ret)
         return ret;
 
-    if ((flags & HDB_F_DECRYPT) && (flags & HDB_F_ALL_KVNOS)) {
-	/* Decrypt the current keys */
-	ret = hdb_unseal_keys(context, db, &entry->entry);
-	if (ret) {
-	    hdb_free_entry(context, entry);
-	    return ret;
-	}
-	/* Decrypt the key history too */
-	ret = hdb_unseal_keys_kvno(context, db, 0, flags, &entry->entry);
-	if (ret) {
-	    hdb_free_entry(context, entry);
-	    return ret;
-	}
-    } else if ((flags & HDB_F_DECRYPT)) {
-	if ((flags & HDB_F_KVNO_SPECIFIED) == 0 || kvno == entry->entry.kvno) {
+    if ((flags & HDB_F_DECRYPT)) {
+	HEIM_PROBE2(hdb__unseal__start,
+		    _krb5_principal_probe_hash(entry->entry.principal), kvno);
+	if ((flags & HDB_F_ALL_KVNOS)) {
+	    /* Decrypt the current keys and the key history */
+	    ret = hdb_unseal_keys_all(context, db, flags, &entry->entry);
+	} else if ((flags & HDB_F_KVNO_SPECIFIED) == 0 ||
+		   kvno == entry->entry.kvno) {
 	    /* Decrypt the current keys */
 	    ret = hdb_unseal_keys(context, db, &entry->entry);
-	    if (ret) {
-		hdb_free_entry(context, entry);
-		return ret;
-	    }
 	} else {
-	    if ((flags & HDB_F_ALL_KVNOS))
-		kvno = 0;
 	    /*
 	     * Find and decrypt the keys from the history that we want,
 	     * and swap them with the current keys
 	     */
 	    ret = hdb_unseal_keys_kvno(context, db, kvno, flags, &entry->entry);
-	    if (ret) {
-		hdb_free_entry(context, entry);
-		return ret;
-	    }
+	}
+	HEIM_PROBE1(hdb__unseal__done, ret);
+	if (ret) {
+	    hdb_free_entry(context, entry);
+	    return ret;
 	}
     }
     if ((flags & HDB_F_FOR_AS_REQ) && (flags & HDB_F_GET_CLIENT)) {
@@ -312,6 +601,8 @@ hdb_remove_aliases(krb5_context context, HDB *db, krb5_data *key)
 	code = hdb_principal2key(context, &aliases->aliases.val[i], &akey);
         if (code == 0) {
             code = db->hdb__del(context, db, akey);
+            if (code == 0)
+                alias_index_del(db->hdb_alias_index, &akey);
             krb5_data_free(&akey);
         }
 	if (code) {
@@ -353,6 +644,9 @@ hdb_add_aliases(krb5_context context, HDB *db,
 	if (code)
 	    return code;
     }
+    if (db->hdb_alias_index)
+        (void) alias_index_add_entry(context, db->hdb_alias_index,
+                                     &entry->entry);
     return 0;
 }
 
@@ -702,6 +996,227 @@ derive_Keys(krb5_context context,
     return ret;
 }
 
+/*
+ * A process-wide LRU cache of derived keysets ([hdb]
+ * derived_keyset_cache_size), so that repeated fetches of the same
+ * virtual principals do not redo the PRF+ work.  Derivation is a pure
+ * function of the base keys, the principal name, the enctype and the kvno,
+ * so these (with a copy of the base keys, so that a new base key is never
+ * confused with the old) are the cache key.  Entries expire when their
+ * kvno stops being needed, as decided in derive_keys_for_kr().  Evicted
+ * keys are wiped.
+ */
+struct dks_cache_ent {
+    struct dks_cache_ent *chain;		/* hash bucket chain */
+    struct dks_cache_ent *newer, *older;	/* LRU list */
+    uint32_t hash;
+    char *princ;
+    krb5int32 etype;
+    krb5uint32 kvno;
+    Keys base;
+    Keys keys;
+    time_t expires;
+};
+
+static struct {
+    HEIMDAL_MUTEX lock;
+    size_t max;
+    size_t nbuckets;
+    size_t count;
+    struct dks_cache_ent **buckets;
+    struct dks_cache_ent *newest, *oldest;
+} dks_cache = { HEIMDAL_MUTEX_INITIALIZER, 0, 0, 0, NULL, NULL, NULL };
+
+static void
+wipe_Keys(Keys *keys)
+{
+    size_t i;
+
+    for (i = 0; i < keys->len; i++)
+        memset_s(keys->val[i].key.keyvalue.data,
+                 keys->val[i].key.keyvalue.length, 0,
+                 keys->val[i].key.keyvalue.length);
+    free_Keys(keys);
+}
+
+static uint32_t
+dks_hash(const char *princ, krb5int32 etype, krb5uint32 kvno)
+{
+    uint32_t h = 2166136261U;
+
+    for (; *princ; princ++)
+        h = (h ^ (unsigned char)*princ) * 16777619U;
+    h = (h ^ (uint32_t)etype) * 16777619U;
+    return (h ^ kvno) * 16777619U;
+}
+
+/* Only the first base key's value is used; the others give the enctypes */
+static int
+dks_same_base(const Keys *a, const Keys *b)
+{
+    size_t i;
+
+    if (a->len != b->len)
+        return 0;
+    for (i = 0; i < a->len; i++)
+        if (a->val[i].key.keytype != b->val[i].key.keytype)
+            return 0;
+    return a->len == 0 ||
+        der_heim_octet_string_cmp(&a->val[0].key.keyvalue,
+                                  &b->val[0].key.keyvalue) == 0;
+}
+
+/* Call with dks_cache.lock held */
+static void
+dks_cache_remove(struct dks_cache_ent *e)
+{
+    struct dks_cache_ent **ep;
+
+    for (ep = &dks_cache.buckets[e->hash % dks_cache.nbuckets]; *ep;
+         ep = &(*ep)->chain) {
+        if (*ep == e) {
+            *ep = e->chain;
+            break;
+        }
+    }
+    if (e->newer)
+        e->newer->older = e->older;
+    else
+        dks_cache.newest = e->older;
+    if (e->older)
+        e->older->newer = e->newer;
+    else
+        dks_cache.oldest = e->newer;
+    dks_cache.count--;
+    wipe_Keys(&e->base);
+    wipe_Keys(&e->keys);
+    free(e->princ);
+    free(e);
+}
+
+/* Call with dks_cache.lock held */
+static struct dks_cache_ent *
+dks_cache_find(const Keys *base, const char *princ, krb5int32 etype,
+               krb5uint32 kvno, uint32_t hash)
+{
+    struct dks_cache_ent *e;
+
+    if (dks_cache.buckets == NULL)
+        return NULL;
+    for (e = dks_cache.buckets[hash % dks_cache.nbuckets]; e; e = e->chain)
+        if (e->hash == hash && e->etype == etype && e->kvno == kvno &&
+            strcmp(e->princ, princ) == 0 && dks_same_base(&e->base, base))
+            return e;
+    return NULL;
+}
+
+/*
+ * Set the size of the derived keyset cache; zero disables it.  Called from
+ * hdb_create().
+ */
+void
+_hdb_set_derived_keyset_cache_size(size_t max)
+{
+    HEIMDAL_MUTEX_lock(&dks_cache.lock);
+    if (max != dks_cache.max) {
+        while (dks_cache.oldest)
+            dks_cache_remove(dks_cache.oldest);
+        free(dks_cache.buckets);
+        dks_cache.buckets = NULL;
+        dks_cache.max = max;
+    }
+    HEIMDAL_MUTEX_unlock(&dks_cache.lock);
+}
+
+/* Look up a cached keyset, copying its keys into `keys' on a hit */
+static int
+dks_cache_get(const Keys *base, const char *princ, krb5int32 etype,
+              krb5uint32 kvno, Keys *keys)
+{
+    uint32_t hash = dks_hash(princ, etype, kvno);
+    struct dks_cache_ent *e;
+    int hit = 0;
+
+    HEIMDAL_MUTEX_lock(&dks_cache.lock);
+    e = dks_cache_find(base, princ, etype, kvno, hash);
+    if (e && e->expires <= time(NULL)) {
+        dks_cache_remove(e);
+        e = NULL;
+    }
+    if (e && copy_Keys(&e->keys, keys) == 0) {
+        hit = 1;
+        /* Move to the front of the LRU list */
+        if (e->newer) {
+            e->newer->older = e->older;
+            if (e->older)
+                e->older->newer = e->newer;
+            else
+                dks_cache.oldest = e->newer;
+            e->older = dks_cache.newest;
+            e->newer = NULL;
+            dks_cache.newest->newer = e;
+            dks_cache.newest = e;
+        }
+    }
+    HEIMDAL_MUTEX_unlock(&dks_cache.lock);
+    return hit;
+}
+
+/* Cache a derived keyset; failures just mean it is not cached */
+static void
+dks_cache_put(const Keys *base, const char *princ, krb5int32 etype,
+              krb5uint32 kvno, const Keys *keys, time_t expires)
+{
+    uint32_t hash = dks_hash(princ, etype, kvno);
+    struct dks_cache_ent *e, *old;
+
+    if (dks_cache.max == 0 || expires <= time(NULL))
+        return;
+    if ((e = calloc(1, sizeof(*e))) == NULL)
+        return;
+    e->hash = hash;
+    e->etype = etype;
+    e->kvno = kvno;
+    e->expires = expires;
+    if ((e->princ = strdup(princ)) == NULL ||
+        copy_Keys(base, &e->base) || copy_Keys(keys, &e->keys)) {
+        wipe_Keys(&e->base);
+        wipe_Keys(&e->keys);
+        free(e->princ);
+        free(e);
+        return;
+    }
+
+    HEIMDAL_MUTEX_lock(&dks_cache.lock);
+    if (dks_cache.buckets == NULL && dks_cache.max) {
+        dks_cache.nbuckets = dks_cache.max | 1;
+        dks_cache.buckets = calloc(dks_cache.nbuckets,
+                                   sizeof(dks_cache.buckets[0]));
+    }
+    if (dks_cache.buckets == NULL) {
+        HEIMDAL_MUTEX_unlock(&dks_cache.lock);
+        wipe_Keys(&e->base);
+        wipe_Keys(&e->keys);
+        free(e->princ);
+        free(e);
+        return;
+    }
+    if ((old = dks_cache_find(base, princ, etype, kvno, hash)) != NULL)
+        dks_cache_remove(old);
+    while (dks_cache.count >= dks_cache.max && dks_cache.oldest)
+        dks_cache_remove(dks_cache.oldest);
+    e->chain = dks_cache.buckets[hash % dks_cache.nbuckets];
+    dks_cache.buckets[hash % dks_cache.nbuckets] = e;
+    e->older = dks_cache.newest;
+    if (dks_cache.newest)
+        dks_cache.newest->newer = e;
+    dks_cache.newest = e;
+    if (dks_cache.oldest == NULL)
+        dks_cache.oldest = e;
+    dks_cache.count++;
+    HEIMDAL_MUTEX_unlock(&dks_cache.lock);
+}
+
 /* Helper for derive_keys_for_kr() */
 static krb5_error_code
 derive_keyset(krb5_context context,
@@ -710,15 +1225,25 @@ derive_keyset(krb5_context context,
               krb5int32 etype,
               krb5uint32 kvno,
               KerberosTime set_time, /* "now" */
+              time_t expires,        /* when the keyset stops being needed */
               hdb_keyset *dks)
 {
+    krb5_error_code ret;
+
     dks->kvno = kvno;
+    dks->keys.len = 0;
     dks->keys.val = 0;
     dks->set_time = malloc(sizeof(*dks->set_time));
     if (dks->set_time == NULL)
         return krb5_enomem(context);
     *dks->set_time = set_time;
-    return derive_Keys(context, princ, kvno, etype, base_keys, &dks->keys);
+    if (dks_cache.max &&
+        dks_cache_get(base_keys, princ, etype, kvno, &dks->keys))
+        return 0;
+    ret = derive_Keys(context, princ, kvno, etype, base_keys, &dks->keys);
+    if (ret == 0 && dks_cache.max)
+        dks_cache_put(base_keys, princ, etype, kvno, &dks->keys, expires);
+    return ret;
 }
 
 /* Possibly derive and install in `h' a keyset identified by `t' */
@@ -796,7 +1321,8 @@ derive_keys_for_kr(krb5_context context,
     }
 
     ret = derive_keyset(context, &base_keys->val[i].keys, princ, etype, kvno,
-                        set_time, &dks);
+                        set_time, set_time + krp->period + (krp->period >> 1),
+                        &dks);
     if (ret == 0)
         ret = hdb_install_keyset(context, &h->entry, is_current_keyset, &dks);
 
@@ -1438,7 +1964,12 @@ fix_princ_name(krb5_context context,
     return ret;
 }
 
-/* Wrapper around db->hdb_fetch_kvno() that implements virtual princs/keys */
+/*
+ * Wrapper around db->hdb_fetch_kvno() that implements virtual princs/keys.
+ *
+ * If `first' is not NULL then the db->hdb_fetch_kvno() of `princ' itself has
+ * already been done (by db->hdb_fetch_kvno_multi()), with result `*first'.
+ */
 static krb5_error_code
 fetch_it(krb5_context context,
          HDB *db,
@@ -1447,7 +1978,8 @@ fetch_it(krb5_context context,
          krb5_timestamp t,
          krb5int32 etype,
          krb5uint32 kvno,
-         hdb_entry_ex *ent)
+         hdb_entry_ex *ent,
+         const krb5_error_code *first)
 {
     krb5_const_principal tmpprinc = princ;
     krb5_principal nsprinc = NULL;
@@ -1504,7 +2036,12 @@ fetch_it(krb5_context context,
          * from the left until we find one or get tired of looking or run out
          * of labels.
          */
-	ret = db->hdb_fetch_kvno(context, db, tmpprinc, flags, kvno, ent);
+        if (first) {
+            ret = *first;
+            first = NULL;
+        } else {
+            ret = db->hdb_fetch_kvno(context, db, tmpprinc, flags, kvno, ent);
+        }
 	if (ret != HDB_ERR_NOENTRY || hdots == 0 || hdots < mindots || !tmp ||
             !do_search)
             break;
@@ -1575,6 +2112,35 @@ fetch_it(krb5_context context,
     return ret;
 }
 
+static krb5_error_code
+fetch_kvno(krb5_context context,
+           HDB *db,
+           krb5_const_principal principal,
+           unsigned int flags,
+           krb5_timestamp t,
+           krb5int32 etype,
+           krb5uint32 kvno,
+           hdb_entry_ex *h,
+           const krb5_error_code *first)
+{
+    krb5_error_code ret;
+
+    ret = fetch_it(context, db, principal, flags, t, etype, kvno, h, first);
+    if (ret == HDB_ERR_NOENTRY)
+	krb5_set_error_message(context, ret, "no such entry found in hdb");
+
+    /*
+     * This check is to support aliases in HDB; the force_canonicalize
+     * check is to allow HDB backends to support realm name canon
+     * independently of principal aliases (used by Samba).
+     */
+    if (ret == 0 && !(flags & HDB_F_ADMIN_DATA) &&
+        !h->entry.flags.force_canonicalize &&
+        !krb5_realm_compare(context, principal, h->entry.principal))
+            ret = HDB_ERR_WRONG_REALM;
+    return ret;
+}
+
 /**
  * Fetch a principal's HDB entry, possibly generating virtual keys from base
  * keys according to strict key rotation schedules.  If a time is given, other
@@ -1608,25 +2174,54 @@ hdb_fetch_kvno(krb5_context context,
                krb5uint32 kvno,
                hdb_entry_ex *h)
 {
-    krb5_error_code ret = HDB_ERR_NOENTRY;
-
     flags |= kvno ? HDB_F_KVNO_SPECIFIED : 0; /* XXX is this needed */
     if (t == 0)
         krb5_timeofday(context, &t);
-    ret = fetch_it(context, db, principal, flags, t, etype, kvno, h);
-    if (ret == HDB_ERR_NOENTRY)
-	krb5_set_error_message(context, ret, "no such entry found in hdb");
+    return fetch_kvno(context, db, principal, flags, t, etype, kvno, h, NULL);
+}
 
-    /*
-     * This check is to support aliases in HDB; the force_canonicalize
-     * check is to allow HDB backends to support realm name canon
-     * independently of principal aliases (used by Samba).
-     */
-    if (ret == 0 && !(flags & HDB_F_ADMIN_DATA) &&
-        !h->entry.flags.force_canonicalize &&
-        !krb5_realm_compare(context, principal, h->entry.principal))
-            ret = HDB_ERR_WRONG_REALM;
-    return ret;
+/**
+ * Fetch several principals' HDB entries, as hdb_fetch_kvno() would, with
+ * the preferred key enctype.  Backends that support it look up all the
+ * principals at once, saving round trips to a remote database.
+ *
+ * Each request's result is set, and its entry too where the result is zero.
+ *
+ * @param context Context
+ * @param db HDB
+ * @param t For virtual keys, use this as the point in time (use zero to mean "now")
+ * @param reqs Lookups to do
+ * @param nreqs Number of lookups
+ *
+ * @return Zero (the results of the lookups are in `reqs').
+ */
+krb5_error_code
+hdb_fetch_kvno_multi(krb5_context context,
+                     HDB *db,
+                     krb5_timestamp t,
+                     struct hdb_fetch_req *reqs,
+                     size_t nreqs)
+{
+    krb5_error_code first;
+    size_t i;
+    int batched;
+
+    if (t == 0)
+        krb5_timeofday(context, &t);
+    for (i = 0; i < nreqs; i++)
+        reqs[i].flags |= reqs[i].kvno ? HDB_F_KVNO_SPECIFIED : 0;
+
+    batched = nreqs > 1 && db->hdb_fetch_kvno_multi &&
+        db->hdb_fetch_kvno_multi(context, db, reqs, nreqs) == 0;
+
+    for (i = 0; i < nreqs; i++) {
+        first = reqs[i].ret;
+        reqs[i].ret = fetch_kvno(context, db, reqs[i].principal,
+                                 reqs[i].flags, t, KRB5_ENCTYPE_NULL,
+                                 reqs[i].kvno, reqs[i].entry,
+                                 batched ? &first : NULL);
+    }
+    return 0;
 }
 
 size_t ASN1CALL
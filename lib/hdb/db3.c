@@ -55,6 +55,7 @@ typedef struct {
     HDB hdb;            /* generic members */
     int lock_fd;        /* DB3-specific */
     int do_sync;        /* DB3-specific */
+    DB_ENV *env;        /* shared environment, if configured */
 } DB3_HDB;
 
 
@@ -71,10 +72,13 @@ DB_close(krb5_context context, HDB *db)
 	dbcp->c_close(dbcp);
     if (d != NULL)
 	d->close(d, 0);
+    if (db3->env != NULL)
+	db3->env->close(db3->env, 0);
     if (db3->lock_fd >= 0)
 	close(db3->lock_fd);
 
     db3->lock_fd = -1;
+    db3->env = NULL;
     db->hdb_dbc = 0;
     db->hdb_db = 0;
 
@@ -88,6 +92,7 @@ DB_destroy(krb5_context context, HDB *db)
 
     ret = hdb_clear_master_key(context, db);
     krb5_config_free_strings(db->virtual_hostbased_princ_svcs);
+    _hdb_free_alias_index(db);
     free(db->hdb_name);
     free(db);
     return ret;
@@ -177,9 +182,27 @@ DB_seq(krb5_context context, HDB *db,
 }
 
 
+#ifndef DB_CURSOR_BULK
+# define DB_CURSOR_BULK 0	/* Missing with DB < 4.8 */
+#endif
+
+/* The cursor is opened on first use and then kept with the handle */
 static krb5_error_code
 DB_firstkey(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
 {
+    DB *d = (DB*)db->hdb_db;
+    DBC *dbc = NULL;
+    int ret;
+
+    if (db->hdb_dbc == NULL) {
+	ret = (*d->cursor)(d, NULL, &dbc, DB_CURSOR_BULK);
+	if (ret) {
+	    krb5_set_error_message(context, ret, "d->cursor: %s",
+				   strerror(ret));
+	    return ret;
+	}
+	db->hdb_dbc = dbc;
+    }
     return DB_seq(context, db, flags, entry, DB_FIRST);
 }
 
@@ -187,6 +210,8 @@ DB_firstkey(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
 static krb5_error_code
 DB_nextkey(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
 {
+    if (db->hdb_dbc == NULL)
+	return HDB_ERR_NOENTRY;
     return DB_seq(context, db, flags, entry, DB_NEXT);
 }
 
@@ -327,7 +352,8 @@ DB__del(krb5_context context, HDB *db, krb5_data key)
 #define WR_CACHE_SZ 0x8000     /* Minimal write cache size */
 
 static int
-_open_db(DB *d, char *fn, int myflags, int flags, mode_t mode, int *fd)
+_open_db(DB *d, char *fn, int myflags, int flags, mode_t mode, int *fd,
+	 int shared)
 {
     int ret;
     int cache_size = (myflags & DB_RDONLY) ? RD_CACHE_SZ : WR_CACHE_SZ;
@@ -352,7 +378,9 @@ _open_db(DB *d, char *fn, int myflags, int flags, mode_t mode, int *fd)
 	return ret;
     }
 
-    d->set_cachesize(d, 0, cache_size, 0);
+    /* A database in a shared environment uses the environment's cache */
+    if (!shared)
+	d->set_cachesize(d, 0, cache_size, 0);
 
 #if (DB_VERSION_MAJOR > 4) || ((DB_VERSION_MAJOR == 4) && (DB_VERSION_MINOR >= 1))
     ret = (*d->open)(d, NULL, fn, NULL, DB_BTREE, myflags, mode);
@@ -368,11 +396,50 @@ _open_db(DB *d, char *fn, int myflags, int flags, mode_t mode, int *fd)
     return ret;
 }
 
+/*
+ * Join the shared environment in [kdc] hdb-db3-env-home, if set, so that
+ * the KDC worker processes share one buffer pool instead of each reading
+ * the database pages into its own.  Every process that opens the
+ * database must then use the same environment.
+ */
+static krb5_error_code
+open_env(krb5_context context, DB3_HDB *db3)
+{
+    const char *home;
+    int cache_size;
+    DB_ENV *env;
+    int ret;
+
+    home = krb5_config_get_string(context, NULL, "kdc", "hdb-db3-env-home",
+				  NULL);
+    if (home == NULL)
+	return 0;
+    cache_size = krb5_config_get_int_default(context, NULL, 0, "kdc",
+					     "hdb-db3-cache-size", NULL);
+
+    if ((ret = db_env_create(&env, 0)) != 0) {
+	krb5_set_error_message(context, ret, "db_env_create: %s",
+			       db_strerror(ret));
+	return ret;
+    }
+    if (cache_size > 0)
+	env->set_cachesize(env, cache_size / (1024 * 1024),
+			   (cache_size % (1024 * 1024)) * 1024, 1);
+    ret = env->open(env, home, DB_CREATE | DB_INIT_MPOOL, 0600);
+    if (ret) {
+	env->close(env, 0);
+	krb5_set_error_message(context, ret, "opening environment %s: %s",
+			       home, db_strerror(ret));
+	return ret;
+    }
+    db3->env = env;
+    return 0;
+}
+
 static krb5_error_code
 DB_open(krb5_context context, HDB *db, int flags, mode_t mode)
 {
     DB3_HDB *db3 = (DB3_HDB *)db;
-    DBC *dbc = NULL;
     char *fn;
     krb5_error_code ret;
     DB *d;
@@ -399,8 +466,16 @@ DB_open(krb5_context context, HDB *db, int flags, mode_t mode)
 	return ENOMEM;
     }
 
-    if (db_create(&d, NULL, 0) != 0) {
+    if ((ret = open_env(context, db3)) != 0) {
+	free(fn);
+	return ret;
+    }
+
+    if (db_create(&d, db3->env, 0) != 0) {
 	free(fn);
+	if (db3->env)
+	    db3->env->close(db3->env, 0);
+	db3->env = NULL;
 	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
 	return ENOMEM;
     }
@@ -408,11 +483,13 @@ DB_open(krb5_context context, HDB *db, int flags, mode_t mode)
 
     /* From here on out always DB_close() before returning on error */
 
-    ret = _open_db(d, fn, myflags, flags, mode, &db3->lock_fd);
+    ret = _open_db(d, fn, myflags, flags, mode, &db3->lock_fd,
+		   db3->env != NULL);
     free(fn);
     if (ret == ENOENT) {
 	/* try to open without .db extension */
-	ret = _open_db(d, db->hdb_name, myflags, flags, mode, &db3->lock_fd);
+	ret = _open_db(d, db->hdb_name, myflags, flags, mode, &db3->lock_fd,
+		       db3->env != NULL);
     }
 
     if (ret) {
@@ -422,18 +499,6 @@ DB_open(krb5_context context, HDB *db, int flags, mode_t mode)
 	return ret;
     }
 
-#ifndef DB_CURSOR_BULK
-# define DB_CURSOR_BULK 0	/* Missing with DB < 4.8 */
-#endif
-    ret = (*d->cursor)(d, NULL, &dbc, DB_CURSOR_BULK);
-
-    if (ret) {
-	DB_close(context, db);
-	krb5_set_error_message(context, ret, "d->cursor: %s", strerror(ret));
-        return ret;
-    }
-    db->hdb_dbc = dbc;
-
     if((flags & O_ACCMODE) == O_RDONLY)
 	ret = hdb_check_db_format(context, db);
     else
@@ -0,0 +1,1021 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The "flat:" HDB backend: an immutable, sorted and hash-indexed snapshot
+ * of a database in one file, for read-only replica KDCs.
+ *
+ * Opened read-only, the file is mapped into memory and lookups are plain
+ * memory reads, with no locks, shared by all processes through the page
+ * cache.  Opening takes no time beyond mmap(2).
+ *
+ * Opened read-write, the snapshot is copied into memory (or not, with
+ * O_TRUNC), changed there, and on close written to a new file that is
+ * then renamed over the old one, so that readers see either the old
+ * snapshot or the new one.  Readers that keep the HDB open (see [kdc]
+ * hdb-keep-open) notice the new file and reopen it.  This makes stores
+ * expensive, so snapshots are best written in one go, with hdb_flat_dump(),
+ * `kadmin -l dump -f flat', or `ipropd-slave --flat-snapshot'.
+ *
+ * File format (all integers are big-endian):
+ *
+ *   header      "HDBFLAT\0", u32 version, u32 log2 of the number of hash
+ *               buckets, u64 number of records, u64 offset of the order
+ *               table, u64 offset of the hash table, u64 file size
+ *   records     u32 key length, u32 value length, key, value, padded to a
+ *               multiple of 8 bytes, sorted by key
+ *   order       u64 offset of each record, in key order
+ *   hash table  u64 offset of a record, or 0 for an empty bucket; open
+ *               addressing with linear probing on the FNV-1a hash of keys
+ *
+ * Keys and values are as for the other backends: encoded principal names,
+ * and encoded entries or aliases.
+ */
+
+#include "hdb_locl.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#define FLAT_MAGIC      "HDBFLAT"       /* and a NUL */
+#define FLAT_VERSION    1
+#define FLAT_HDR_SIZE   48
+#define FLAT_PREFIX     "flat:"
+
+/* A record of a snapshot being written */
+struct flat_rec {
+    struct flat_rec *next;      /* hash chain */
+    uint64_t hash;
+    krb5_data key;
+    krb5_data value;
+    unsigned int deleted:1;
+};
+
+typedef struct flat_info {
+    /* The snapshot, when open */
+    unsigned char *map;
+    size_t size;
+    unsigned int mapped:1;      /* else malloc()ed */
+    uint64_t nrecords;
+    const unsigned char *order;
+    const unsigned char *hash;
+    uint64_t nbuckets;
+    /* Iteration; see FLAT_firstkey() and FLAT_set_shard() */
+    uint64_t next;
+    uint64_t end;
+    unsigned int shard;
+    unsigned int nshards;
+    /* The snapshot being written, when open for writing */
+    unsigned int writable:1;
+    unsigned int dirty:1;
+    struct flat_rec **recs;     /* in order of insertion */
+    size_t nrecs;
+    size_t nalloc;
+    struct flat_rec **buckets;
+    size_t nwbuckets;
+    mode_t mode;
+} flat_info;
+
+static uint64_t
+get_u64(const unsigned char *p)
+{
+    return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+        ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+        ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+        ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+}
+
+static uint32_t
+get_u32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void
+put_u64(unsigned char *p, uint64_t v)
+{
+    int i;
+
+    for (i = 7; i >= 0; i--, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+static void
+put_u32(unsigned char *p, uint32_t v)
+{
+    int i;
+
+    for (i = 3; i >= 0; i--, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+static uint64_t
+flat_hash(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+static size_t
+rec_size(size_t klen, size_t vlen)
+{
+    return (8 + klen + vlen + 7) & ~(size_t)7;
+}
+
+/*
+ * Get the key and value of the record at `off' in the snapshot, checking
+ * that it is within the file.
+ */
+static int
+map_rec(flat_info *fi, uint64_t off, krb5_data *key, krb5_data *value)
+{
+    uint32_t klen, vlen;
+
+    if (off < FLAT_HDR_SIZE || off > fi->size - 8)
+        return HDB_ERR_UK_RERROR;
+    klen = get_u32(fi->map + off);
+    vlen = get_u32(fi->map + off + 4);
+    if ((uint64_t)klen + vlen > fi->size - off - 8)
+        return HDB_ERR_UK_RERROR;
+    key->data = fi->map + off + 8;
+    key->length = klen;
+    value->data = fi->map + off + 8 + klen;
+    value->length = vlen;
+    return 0;
+}
+
+/* Look up `key' in the snapshot; the value points into the map */
+static krb5_error_code
+map_get(flat_info *fi, const krb5_data *key, krb5_data *value)
+{
+    uint64_t mask = fi->nbuckets - 1;
+    uint64_t i, n, off;
+    krb5_data k;
+
+    if (fi->nbuckets == 0)
+        return HDB_ERR_NOENTRY;
+    i = flat_hash(key->data, key->length) & mask;
+    for (n = 0; n < fi->nbuckets; n++, i = (i + 1) & mask) {
+        if ((off = get_u64(fi->hash + 8 * i)) == 0)
+            break;
+        if (map_rec(fi, off, &k, value))
+            return HDB_ERR_UK_RERROR;
+        if (k.length == key->length &&
+            memcmp(k.data, key->data, key->length) == 0)
+            return 0;
+    }
+    return HDB_ERR_NOENTRY;
+}
+
+static void
+unmap_snapshot(flat_info *fi)
+{
+#if defined(HAVE_MMAP) && !defined(NO_MMAP)
+    if (fi->mapped)
+        munmap(fi->map, fi->size);
+    else
+#endif
+    free(fi->map);
+    fi->map = NULL;
+    fi->size = 0;
+    fi->mapped = 0;
+    fi->nrecords = 0;
+    fi->nbuckets = 0;
+    fi->order = NULL;
+    fi->hash = NULL;
+}
+
+static krb5_error_code
+map_snapshot(krb5_context context, HDB *db, flat_info *fi)
+{
+    const char *path = db->hdb_name;
+    unsigned char *p;
+    struct stat st;
+    uint64_t order_off, hash_off;
+    uint32_t log2_nbuckets;
+    int ret = 0;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        ret = errno;
+        krb5_set_error_message(context, ret, "hdb-flat: open %s: %s",
+                               path, strerror(ret));
+        return ret;
+    }
+    rk_cloexec(fd);
+    if (fstat(fd, &st) == -1) {
+        ret = errno;
+        close(fd);
+        krb5_set_error_message(context, ret, "hdb-flat: stat %s: %s",
+                               path, strerror(ret));
+        return ret;
+    }
+    if (st.st_size < FLAT_HDR_SIZE || (uint64_t)st.st_size > SIZE_MAX) {
+        close(fd);
+        goto bad;
+    }
+    fi->size = st.st_size;
+
+#if defined(HAVE_MMAP) && !defined(NO_MMAP)
+    p = mmap(NULL, fi->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED) {
+        fi->map = p;
+        fi->mapped = 1;
+    }
+#endif
+    if (fi->map == NULL) {
+        ssize_t bytes = 0;
+        size_t got;
+
+        if ((fi->map = malloc(fi->size)) == NULL) {
+            close(fd);
+            return krb5_enomem(context);
+        }
+        for (got = 0; got < fi->size; got += bytes) {
+            bytes = read(fd, fi->map + got, fi->size - got);
+            if (bytes <= 0)
+                break;
+        }
+        if (got < fi->size) {
+            ret = bytes < 0 ? errno : HDB_ERR_UK_RERROR;
+            close(fd);
+            unmap_snapshot(fi);
+            krb5_set_error_message(context, ret, "hdb-flat: read %s", path);
+            return ret;
+        }
+    }
+    close(fd);
+
+    p = fi->map;
+    if (memcmp(p, FLAT_MAGIC, sizeof(FLAT_MAGIC)) != 0 ||
+        get_u32(p + 8) != FLAT_VERSION)
+        goto bad;
+    log2_nbuckets = get_u32(p + 12);
+    fi->nrecords = get_u64(p + 16);
+    order_off = get_u64(p + 24);
+    hash_off = get_u64(p + 32);
+    if (log2_nbuckets > 48 || get_u64(p + 40) != fi->size)
+        goto bad;
+    fi->nbuckets = (uint64_t)1 << log2_nbuckets;
+    if (order_off > fi->size || hash_off > fi->size ||
+        fi->nrecords > (fi->size - order_off) / 8 ||
+        fi->nbuckets > (fi->size - hash_off) / 8 ||
+        fi->nrecords >= fi->nbuckets)
+        goto bad;
+    fi->order = p + order_off;
+    fi->hash = p + hash_off;
+    return 0;
+
+bad:
+    unmap_snapshot(fi);
+    krb5_set_error_message(context, HDB_ERR_BADVERSION,
+                           "hdb-flat: %s is not a flat HDB snapshot", path);
+    return HDB_ERR_BADVERSION;
+}
+
+static struct flat_rec *
+wset_find(flat_info *fi, const krb5_data *key, uint64_t hash)
+{
+    struct flat_rec *r;
+
+    if (fi->buckets == NULL)
+        return NULL;
+    for (r = fi->buckets[hash % fi->nwbuckets]; r; r = r->next)
+        if (r->hash == hash && krb5_data_cmp(&r->key, key) == 0)
+            return r;
+    return NULL;
+}
+
+static krb5_error_code
+wset_grow(krb5_context context, flat_info *fi)
+{
+    struct flat_rec **buckets;
+    size_t nbuckets = fi->nwbuckets ? fi->nwbuckets * 2 : 1024;
+    size_t i;
+
+    if ((buckets = calloc(nbuckets, sizeof(buckets[0]))) == NULL)
+        return krb5_enomem(context);
+    for (i = 0; i < fi->nrecs; i++) {
+        struct flat_rec *r = fi->recs[i];
+
+        r->next = buckets[r->hash % nbuckets];
+        buckets[r->hash % nbuckets] = r;
+    }
+    free(fi->buckets);
+    fi->buckets = buckets;
+    fi->nwbuckets = nbuckets;
+    return 0;
+}
+
+/* Add or replace a record in the snapshot being written */
+static krb5_error_code
+wset_put(krb5_context context, flat_info *fi, int replace,
+         const krb5_data *key, const krb5_data *value)
+{
+    uint64_t hash = flat_hash(key->data, key->length);
+    struct flat_rec *r;
+    krb5_data v;
+    krb5_error_code ret;
+
+    if ((r = wset_find(fi, key, hash)) != NULL) {
+        if (!r->deleted && !replace)
+            return HDB_ERR_EXISTS;
+        ret = krb5_data_copy(&v, value->data, value->length);
+        if (ret)
+            return krb5_enomem(context);
+        krb5_data_free(&r->value);
+        r->value = v;
+        r->deleted = 0;
+        fi->dirty = 1;
+        return 0;
+    }
+
+    if (fi->nrecs >= fi->nwbuckets && (ret = wset_grow(context, fi)))
+        return ret;
+    if (fi->nrecs == fi->nalloc) {
+        size_t n = fi->nalloc ? fi->nalloc * 2 : 1024;
+        struct flat_rec **recs = realloc(fi->recs, n * sizeof(recs[0]));
+
+        if (recs == NULL)
+            return krb5_enomem(context);
+        fi->recs = recs;
+        fi->nalloc = n;
+    }
+    if ((r = calloc(1, sizeof(*r))) == NULL)
+        return krb5_enomem(context);
+    if (krb5_data_copy(&r->key, key->data, key->length) ||
+        krb5_data_copy(&r->value, value->data, value->length)) {
+        krb5_data_free(&r->key);
+        free(r);
+        return krb5_enomem(context);
+    }
+    r->hash = hash;
+    r->next = fi->buckets[hash % fi->nwbuckets];
+    fi->buckets[hash % fi->nwbuckets] = r;
+    fi->recs[fi->nrecs++] = r;
+    fi->dirty = 1;
+    return 0;
+}
+
+static void
+wset_free(flat_info *fi)
+{
+    size_t i;
+
+    for (i = 0; i < fi->nrecs; i++) {
+        krb5_data_free(&fi->recs[i]->key);
+        krb5_data_free(&fi->recs[i]->value);
+        free(fi->recs[i]);
+    }
+    free(fi->recs);
+    free(fi->buckets);
+    fi->recs = NULL;
+    fi->buckets = NULL;
+    fi->nrecs = fi->nalloc = fi->nwbuckets = 0;
+}
+
+static int
+rec_cmp(const void *a, const void *b)
+{
+    const struct flat_rec *ra = *(const struct flat_rec * const *)a;
+    const struct flat_rec *rb = *(const struct flat_rec * const *)b;
+    size_t len = ra->key.length < rb->key.length ?
+        ra->key.length : rb->key.length;
+    int c;
+
+    if ((c = memcmp(ra->key.data, rb->key.data, len)) != 0)
+        return c;
+    return ra->key.length < rb->key.length ? -1 :
+        ra->key.length > rb->key.length;
+}
+
+static int
+write_all(FILE *f, const void *p, size_t len)
+{
+    return len == 0 || fwrite(p, len, 1, f) == 1 ? 0 : -1;
+}
+
+/*
+ * Write the snapshot being written to a temporary file and rename it into
+ * place.
+ */
+static krb5_error_code
+wset_commit(krb5_context context, HDB *db, flat_info *fi)
+{
+    static const unsigned char zeros[8];
+    struct flat_rec **live = NULL;
+    unsigned char hdr[FLAT_HDR_SIZE];
+    unsigned char buf[8];
+    uint64_t *table = NULL;
+    uint64_t off, nbuckets, mask, order_off, hash_off;
+    uint32_t log2_nbuckets = 4;
+    size_t i, n;
+    char *tmp = NULL;
+    FILE *f = NULL;
+    int ret = 0;
+    int fd;
+
+    for (i = n = 0; i < fi->nrecs; i++)
+        if (!fi->recs[i]->deleted)
+            n++;
+    while (((uint64_t)1 << log2_nbuckets) < 2 * (uint64_t)n)
+        log2_nbuckets++;
+    nbuckets = (uint64_t)1 << log2_nbuckets;
+    mask = nbuckets - 1;
+    if (nbuckets > SIZE_MAX / sizeof(table[0]) ||
+        (live = calloc(n ? n : 1, sizeof(live[0]))) == NULL ||
+        (table = calloc(nbuckets, sizeof(table[0]))) == NULL) {
+        ret = krb5_enomem(context);
+        goto out;
+    }
+    for (i = n = 0; i < fi->nrecs; i++)
+        if (!fi->recs[i]->deleted)
+            live[n++] = fi->recs[i];
+    qsort(live, n, sizeof(live[0]), rec_cmp);
+
+    /* Lay out the records and index them */
+    for (i = 0, off = FLAT_HDR_SIZE; i < n; i++) {
+        uint64_t b = live[i]->hash & mask;
+
+        while (table[b])
+            b = (b + 1) & mask;
+        table[b] = off;
+        off += rec_size(live[i]->key.length, live[i]->value.length);
+    }
+    order_off = off;
+    hash_off = order_off + 8 * (uint64_t)n;
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, FLAT_MAGIC, sizeof(FLAT_MAGIC));
+    put_u32(hdr + 8, FLAT_VERSION);
+    put_u32(hdr + 12, log2_nbuckets);
+    put_u64(hdr + 16, n);
+    put_u64(hdr + 24, order_off);
+    put_u64(hdr + 32, hash_off);
+    put_u64(hdr + 40, hash_off + 8 * nbuckets);
+
+    if (asprintf(&tmp, "%s.XXXXXX", db->hdb_name) == -1 || tmp == NULL) {
+        tmp = NULL;
+        ret = krb5_enomem(context);
+        goto out;
+    }
+    if ((fd = mkstemp(tmp)) == -1) {
+        ret = errno;
+        krb5_set_error_message(context, ret, "hdb-flat: mkstemp %s: %s",
+                               tmp, strerror(ret));
+        free(tmp);
+        tmp = NULL;
+        goto out;
+    }
+    (void) fchmod(fd, fi->mode ? fi->mode : 0600);
+    if ((f = fdopen(fd, "w")) == NULL) {
+        ret = errno;
+        close(fd);
+        goto out;
+    }
+
+    ret = write_all(f, hdr, sizeof(hdr));
+    for (i = 0; ret == 0 && i < n; i++) {
+        size_t len = 8 + live[i]->key.length + live[i]->value.length;
+
+        put_u32(buf, live[i]->key.length);
+        put_u32(buf + 4, live[i]->value.length);
+        ret = write_all(f, buf, 8);
+        if (ret == 0)
+            ret = write_all(f, live[i]->key.data, live[i]->key.length);
+        if (ret == 0)
+            ret = write_all(f, live[i]->value.data, live[i]->value.length);
+        if (ret == 0)
+            ret = write_all(f, zeros,
+                            rec_size(live[i]->key.length,
+                                     live[i]->value.length) - len);
+    }
+    for (i = 0, off = FLAT_HDR_SIZE; ret == 0 && i < n; i++) {
+        put_u64(buf, off);
+        ret = write_all(f, buf, 8);
+        off += rec_size(live[i]->key.length, live[i]->value.length);
+    }
+    for (i = 0; ret == 0 && i < nbuckets; i++) {
+        put_u64(buf, table[i]);
+        ret = write_all(f, buf, 8);
+    }
+    if (ret == 0 && fflush(f) != 0)
+        ret = -1;
+    if (ret == 0 && fsync(fileno(f)) != 0)
+        ret = -1;
+    if (fclose(f) != 0 && ret == 0)
+        ret = -1;
+    f = NULL;
+    if (ret == 0 && rename(tmp, db->hdb_name) != 0)
+        ret = -1;
+    if (ret) {
+        ret = errno ? errno : EIO;
+        krb5_set_error_message(context, ret, "hdb-flat: writing %s: %s",
+                               db->hdb_name, strerror(ret));
+    }
+
+out:
+    if (f)
+        fclose(f);
+    if (tmp) {
+        if (ret)
+            (void) unlink(tmp);
+        free(tmp);
+    }
+    free(table);
+    free(live);
+    return ret;
+}
+
+/* Copy the snapshot into the snapshot being written */
+static krb5_error_code
+wset_load(krb5_context context, flat_info *fi)
+{
+    krb5_error_code ret = 0;
+    krb5_data key, value;
+    uint64_t i;
+
+    for (i = 0; ret == 0 && i < fi->nrecords; i++) {
+        ret = map_rec(fi, get_u64(fi->order + 8 * i), &key, &value);
+        if (ret == 0)
+            ret = wset_put(context, fi, 1, &key, &value);
+    }
+    fi->dirty = 0;
+    return ret;
+}
+
+static krb5_error_code
+FLAT_close(krb5_context context, HDB *db)
+{
+    flat_info *fi = (flat_info *)db->hdb_db;
+    krb5_error_code ret = 0;
+
+    if (fi->writable && fi->dirty)
+        ret = wset_commit(context, db, fi);
+    wset_free(fi);
+    unmap_snapshot(fi);
+    fi->writable = 0;
+    fi->dirty = 0;
+    return ret;
+}
+
+static krb5_error_code
+FLAT_destroy(krb5_context context, HDB *db)
+{
+    krb5_error_code ret;
+
+    ret = hdb_clear_master_key(context, db);
+    krb5_config_free_strings(db->virtual_hostbased_princ_svcs);
+    _hdb_free_alias_index(db);
+    free(db->hdb_name);
+    free(db->hdb_db);
+    free(db);
+    return ret;
+}
+
+static krb5_error_code
+FLAT_set_sync(krb5_context context, HDB *db, int on)
+{
+    /* Snapshots are always fsync()ed before they are renamed into place */
+    return 0;
+}
+
+static krb5_error_code
+FLAT_lock(krb5_context context, HDB *db, int operation)
+{
+    db->lock_count++;
+    return 0;
+}
+
+static krb5_error_code
+FLAT_unlock(krb5_context context, HDB *db)
+{
+    if (db->lock_count > 1) {
+	db->lock_count--;
+	return 0;
+    }
+    heim_assert(db->lock_count == 1, "HDB lock/unlock sequence does not match");
+    db->lock_count--;
+    return 0;
+}
+
+/* Get the key and value of the `i'th record in iteration order */
+static krb5_error_code
+seq_rec(flat_info *fi, uint64_t i, krb5_data *key, krb5_data *value)
+{
+    if (fi->writable) {
+        if (fi->recs[i]->deleted)
+            return HDB_ERR_NOENTRY;
+        *key = fi->recs[i]->key;
+        *value = fi->recs[i]->value;
+        return 0;
+    }
+    return map_rec(fi, get_u64(fi->order + 8 * i), key, value);
+}
+
+static krb5_error_code
+FLAT_seq(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
+{
+    flat_info *fi = (flat_info *)db->hdb_db;
+    krb5_data key_data, data;
+    krb5_error_code ret;
+
+    memset(entry, 0, sizeof(*entry));
+    for (; fi->next < fi->end; fi->next++) {
+        ret = seq_rec(fi, fi->next, &key_data, &data);
+        if (ret == HDB_ERR_NOENTRY)
+            continue;
+        if (ret)
+            return ret;
+        /* Skip aliases and the format version record */
+        if (hdb_value2entry(context, &data, &entry->entry) == 0)
+            break;
+    }
+    if (fi->next == fi->end)
+        return HDB_ERR_NOENTRY;
+    fi->next++;
+
+    if (db->hdb_master_key_set && (flags & HDB_F_DECRYPT)) {
+	ret = hdb_unseal_keys(context, db, &entry->entry);
+	if (ret) {
+	    hdb_free_entry(context, entry);
+            return ret;
+        }
+    }
+    if (entry->entry.principal == NULL) {
+	entry->entry.principal = malloc(sizeof(*entry->entry.principal));
+	if (entry->entry.principal == NULL) {
+	    hdb_free_entry(context, entry);
+	    krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
+	    return ENOMEM;
+	} else {
+	    hdb_key2principal(context, &key_data, entry->entry.principal);
+	}
+    }
+    return 0;
+}
+
+static krb5_error_code
+FLAT_firstkey(krb5_context context, HDB *db, unsigned flags,
+              hdb_entry_ex *entry)
+{
+    flat_info *fi = (flat_info *)db->hdb_db;
+    uint64_t n = fi->writable ? fi->nrecs : fi->nrecords;
+
+    /* Shards are ranges of the order table, so finding them is free */
+    if (fi->nshards > 1) {
+        fi->next = n * fi->shard / fi->nshards;
+        fi->end = n * (fi->shard + 1) / fi->nshards;
+    } else {
+        fi->next = 0;
+        fi->end = n;
+    }
+    return FLAT_seq(context, db, flags, entry);
+}
+
+static krb5_error_code
+FLAT_nextkey(krb5_context context, HDB *db, unsigned flags,
+             hdb_entry_ex *entry)
+{
+    return FLAT_seq(context, db, flags, entry);
+}
+
+static krb5_error_code
+FLAT_set_shard(krb5_context context, HDB *db,
+               unsigned int shard, unsigned int nshards)
+{
+    flat_info *fi = (flat_info *)db->hdb_db;
+
+    fi->shard = shard;
+    fi->nshards = nshards;
+    return 0;
+}
+
+static krb5_error_code
+FLAT_rename(krb5_context context, HDB *db, const char *new_name)
+{
+    char *name;
+
+    if (strncmp(new_name, FLAT_PREFIX, sizeof(FLAT_PREFIX) - 1) == 0)
+        new_name += sizeof(FLAT_PREFIX) - 1;
+    if ((name = strdup(new_name)) == NULL)
+        return krb5_enomem(context);
+    if (rename(db->hdb_name, new_name) != 0) {
+        free(name);
+        return errno;
+    }
+    free(db->hdb_name);
+    db->hdb_name = name;
+    return 0;
+}
+
+static krb5_error_code
+FLAT__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
+{
+    flat_info *fi = (flat_info *)db->hdb_db;
+    struct flat_rec *r;
+    krb5_data value;
+    krb5_error_code ret;
+
+    if (fi->writable) {
+        r = wset_find(fi, &key, flat_hash(key.data, key.length));
+        if (r == NULL || r->deleted)
+            return HDB_ERR_NOENTRY;
+        value = r->value;
+    } else if ((ret = map_get(fi, &key, &value)) != 0) {
+        return ret;
+    }
+    return krb5_data_copy(reply, value.data, value.length);
+}
+
+/*
+ * Decode the entry or alias stored under `key' straight from the map
+ * rather than from a copy.
+ */
+static krb5_error_code
+FLAT_get_entry_or_alias(krb5_context context,
+                        HDB *db,
+                        krb5_data key,
+                        HDB_EntryOrAlias *eoa)
+{
+    flat_info *fi = (flat_info *)db->hdb_db;
+    struct flat_rec *r;
+    krb5_data value;
+    krb5_error_code ret;
+
+    if (fi->writable) {
+        r = wset_find(fi, &key, flat_hash(key.data, key.length));
+        if (r == NULL || r->deleted)
+            return HDB_ERR_NOENTRY;
+        value = r->value;
+    } else if ((ret = map_get(fi, &key, &value)) != 0) {
+        return ret;
+    }
+    return decode_HDB_EntryOrAlias(value.data, value.length, eoa, NULL);
+}
+
+static krb5_error_code
+FLAT_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
+                unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    return _hdb_fetch_kvno_get(context, db, principal, flags, kvno, entry,
+                               FLAT_get_entry_or_alias);
+}
+
+static krb5_error_code
+FLAT__put(krb5_context context, HDB *db, int replace,
+          krb5_data key, krb5_data value)
+{
+    flat_info *fi = (flat_info *)db->hdb_db;
+
+    if (!fi->writable) {
+        krb5_set_error_message(context, EPERM,
+                               "hdb-flat: %s is open read-only",
+                               db->hdb_name);
+        return EPERM;
+    }
+    return wset_put(context, fi, replace, &key, &value);
+}
+
+static krb5_error_code
+FLAT__del(krb5_context context, HDB *db, krb5_data key)
+{
+    flat_info *fi = (flat_info *)db->hdb_db;
+    struct flat_rec *r;
+
+    if (!fi->writable) {
+        krb5_set_error_message(context, EPERM,
+                               "hdb-flat: %s is open read-only",
+                               db->hdb_name);
+        return EPERM;
+    }
+    r = wset_find(fi, &key, flat_hash(key.data, key.length));
+    if (r == NULL || r->deleted)
+        return HDB_ERR_NOENTRY;
+    krb5_data_free(&r->value);
+    r->deleted = 1;
+    fi->dirty = 1;
+    return 0;
+}
+
+static krb5_error_code
+FLAT_open(krb5_context context, HDB *db, int oflags, mode_t mode)
+{
+    flat_info *fi = (flat_info *)db->hdb_db;
+    krb5_error_code ret = 0;
+    int writable = (oflags & O_ACCMODE) != O_RDONLY;
+
+    fi->mode = mode;
+    fi->writable = writable;
+    fi->dirty = 0;
+    if (!fi->writable || (oflags & O_TRUNC) == 0) {
+        ret = map_snapshot(context, db, fi);
+        if (ret == ENOENT && fi->writable && (oflags & O_CREAT)) {
+            krb5_clear_error_message(context);
+            ret = 0;
+        }
+    }
+    if (ret == 0 && fi->writable) {
+        /* The snapshot being written starts as a copy of the snapshot */
+        ret = wset_grow(context, fi);
+        if (ret == 0)
+            ret = wset_load(context, fi);
+        unmap_snapshot(fi);
+        if (ret == 0 && (oflags & O_TRUNC))
+            fi->dirty = 1;
+    }
+    if (ret) {
+        wset_free(fi);
+        fi->writable = 0;
+        return ret;
+    }
+
+    if (!fi->writable) {
+	ret = hdb_check_db_format(context, db);
+        if (ret == HDB_ERR_NOENTRY)
+            return 0;
+    } else {
+        /* hdb_init_db() calls hdb_check_db_format() */
+	ret = hdb_init_db(context, db);
+    }
+    if (ret) {
+        fi->dirty = 0;
+	FLAT_close(context, db);
+	krb5_set_error_message(context, ret, "hdb_open: failed %s database %s",
+			       writable ? "initialize" : "checking format of",
+			       db->hdb_name);
+    }
+    return ret;
+}
+
+krb5_error_code
+hdb_flat_create(krb5_context context, HDB **db,
+                const char *filename)
+{
+    *db = calloc(1, sizeof(**db));
+    if (*db == NULL) {
+	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
+	return ENOMEM;
+    }
+
+    (*db)->hdb_db = calloc(1, sizeof(flat_info));
+    if ((*db)->hdb_db == NULL) {
+	free(*db);
+	*db = NULL;
+	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
+	return ENOMEM;
+    }
+    (*db)->hdb_name = strdup(filename);
+    if ((*db)->hdb_name == NULL) {
+	free((*db)->hdb_db);
+	free(*db);
+	*db = NULL;
+	krb5_set_error_message(context, ENOMEM, "malloc: out of memory");
+	return ENOMEM;
+    }
+    (*db)->hdb_master_key_set = 0;
+    (*db)->hdb_openp = 0;
+    (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL;
+    (*db)->hdb_open  = FLAT_open;
+    (*db)->hdb_close = FLAT_close;
+    (*db)->hdb_fetch_kvno = FLAT_fetch_kvno;
+    (*db)->hdb_store = _hdb_store;
+    (*db)->hdb_remove = _hdb_remove;
+    (*db)->hdb_firstkey = FLAT_firstkey;
+    (*db)->hdb_nextkey= FLAT_nextkey;
+    (*db)->hdb_lock = FLAT_lock;
+    (*db)->hdb_unlock = FLAT_unlock;
+    (*db)->hdb_rename = FLAT_rename;
+    (*db)->hdb__get = FLAT__get;
+    (*db)->hdb__put = FLAT__put;
+    (*db)->hdb__del = FLAT__del;
+    (*db)->hdb_destroy = FLAT_destroy;
+    (*db)->hdb_set_sync = FLAT_set_sync;
+    (*db)->hdb_set_shard = FLAT_set_shard;
+    return 0;
+}
+
+/* Store an entry and its aliases in `db' as they are, without _hdb_store() */
+static krb5_error_code
+put_entry_and_aliases(krb5_context context, HDB *db, hdb_entry *entry)
+{
+    const HDB_Ext_Aliases *aliases;
+    hdb_entry_alias alias;
+    krb5_data key, value;
+    krb5_error_code ret;
+    size_t i;
+
+    ret = hdb_principal2key(context, entry->principal, &key);
+    if (ret)
+        return ret;
+    ret = hdb_entry2value(context, entry, &value);
+    if (ret == 0) {
+        ret = db->hdb__put(context, db, 1, key, value);
+        krb5_data_free(&value);
+    }
+    krb5_data_free(&key);
+    if (ret == 0)
+        ret = hdb_entry_get_aliases(entry, &aliases);
+    if (ret || aliases == NULL)
+        return ret;
+
+    alias.principal = entry->principal;
+    ret = hdb_entry_alias2value(context, &alias, &value);
+    if (ret)
+        return ret;
+    for (i = 0; ret == 0 && i < aliases->aliases.len; i++) {
+        ret = hdb_principal2key(context, &aliases->aliases.val[i], &key);
+        if (ret == 0) {
+            ret = db->hdb__put(context, db, 1, key, value);
+            krb5_data_free(&key);
+        }
+    }
+    krb5_data_free(&value);
+    return ret;
+}
+
+/**
+ * Write a flat snapshot of a database.
+ *
+ * Copies all the entries and aliases of `src', which must be open, as
+ * they are (with their keys still sealed) to a new "flat:" snapshot at
+ * `path', which replaces any existing one atomically.
+ *
+ * @param context Kerberos 5 context
+ * @param src database to copy
+ * @param path file name of the snapshot, with or without "flat:"
+ *
+ * @return 0 on success, an error code if not
+ */
+krb5_error_code
+hdb_flat_dump(krb5_context context, HDB *src, const char *path)
+{
+    krb5_error_code ret, ret2;
+    hdb_entry_ex e;
+    HDB *dst = NULL;
+
+    if (strncmp(path, FLAT_PREFIX, sizeof(FLAT_PREFIX) - 1) == 0)
+        path += sizeof(FLAT_PREFIX) - 1;
+    ret = hdb_flat_create(context, &dst, path);
+    if (ret)
+        return ret;
+    ret = dst->hdb_open(context, dst, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (ret) {
+        dst->hdb_destroy(context, dst);
+        return ret;
+    }
+
+    memset(&e, 0, sizeof(e));
+    ret = src->hdb_firstkey(context, src, 0, &e);
+    while (ret == 0) {
+        ret = put_entry_and_aliases(context, dst, &e.entry);
+        hdb_free_entry(context, &e);
+        if (ret == 0)
+            ret = src->hdb_nextkey(context, src, 0, &e);
+    }
+    if (ret == HDB_ERR_NOENTRY)
+        ret = 0;
+    if (ret) {
+        /* Leave the existing snapshot be */
+        ((flat_info *)dst->hdb_db)->dirty = 0;
+    }
+    ret2 = dst->hdb_close(context, dst);
+    dst->hdb_destroy(context, dst);
+    return ret ? ret : ret2;
+}
@@ -36,11 +36,224 @@
 #include "hdb_locl.h"
 #include <assert.h>
 
+/*
+ * A FILE keytab is read into a hash index of its entries by principal,
+ * which is rebuilt when the file changes, so that a fetch does not read
+ * the whole keytab.  Other keytab types are searched as before.
+ */
+
+struct hkt_princ {
+    struct hkt_princ *next;	/* hash chain */
+    unsigned long hash;
+    char *name;			/* unparsed */
+    krb5_keytab_entry *val;	/* in keytab order */
+    size_t len;
+};
+
 typedef struct {
     char *path;
     krb5_keytab keytab;
+    /* The index, when `file' is set */
+    char *file;
+    struct hkt_princ **buckets;
+    size_t nbuckets;
+    int indexed;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
 } *hdb_keytab;
 
+static unsigned long
+hkt_hash(const char *s)
+{
+    unsigned long h = 2166136261UL;
+
+    while (*s)
+	h = (h ^ (unsigned char)*s++) * 16777619UL;
+    return h;
+}
+
+static void
+hkt_free_index(krb5_context context, hdb_keytab k)
+{
+    struct hkt_princ *p, *next;
+    size_t i, j;
+
+    for (i = 0; i < k->nbuckets; i++) {
+	for (p = k->buckets[i]; p; p = next) {
+	    next = p->next;
+	    for (j = 0; j < p->len; j++)
+		krb5_kt_free_entry(context, &p->val[j]);
+	    free(p->val);
+	    free(p->name);
+	    free(p);
+	}
+    }
+    free(k->buckets);
+    k->buckets = NULL;
+    k->nbuckets = 0;
+    k->indexed = 0;
+}
+
+static struct hkt_princ *
+hkt_lookup(hdb_keytab k, const char *name, unsigned long hash)
+{
+    struct hkt_princ *p;
+
+    for (p = k->buckets[hash & (k->nbuckets - 1)]; p; p = p->next)
+	if (p->hash == hash && strcmp(p->name, name) == 0)
+	    return p;
+    return NULL;
+}
+
+/* Add an entry to the index, taking over its contents */
+static krb5_error_code
+hkt_index_entry(krb5_context context, hdb_keytab k, krb5_keytab_entry *e)
+{
+    krb5_keytab_entry *val;
+    struct hkt_princ *p;
+    unsigned long hash;
+    krb5_error_code ret;
+    char *name;
+
+    ret = krb5_unparse_name(context, e->principal, &name);
+    if (ret)
+	return ret;
+    hash = hkt_hash(name);
+    p = hkt_lookup(k, name, hash);
+    if (p == NULL) {
+	p = calloc(1, sizeof(*p));
+	if (p == NULL) {
+	    free(name);
+	    return krb5_enomem(context);
+	}
+	p->hash = hash;
+	p->name = name;
+	p->next = k->buckets[hash & (k->nbuckets - 1)];
+	k->buckets[hash & (k->nbuckets - 1)] = p;
+    } else {
+	free(name);
+    }
+    val = realloc(p->val, (p->len + 1) * sizeof(p->val[0]));
+    if (val == NULL)
+	return krb5_enomem(context);
+    p->val = val;
+    p->val[p->len++] = *e;
+    return 0;
+}
+
+/*
+ * (Re)build the index if the keytab file is not the one it was built
+ * from.  A keytab that cannot be read is left to krb5_kt_get_entry().
+ */
+static krb5_error_code
+hkt_update_index(krb5_context context, hdb_keytab k)
+{
+    krb5_keytab_entry e;
+    krb5_kt_cursor cursor;
+    krb5_error_code ret;
+    struct stat st;
+    size_t n;
+
+    if (stat(k->file, &st) == -1) {
+	hkt_free_index(context, k);
+	return 0;
+    }
+    if (k->indexed && st.st_dev == k->dev && st.st_ino == k->ino &&
+	st.st_size == k->size && st.st_mtime == k->mtime &&
+	st.st_ctime == k->ctime)
+	return 0;
+
+    hkt_free_index(context, k);
+
+    /* Guess at the number of entries from the size of the file */
+    for (n = 16; n < (size_t)st.st_size / 64 && n < (1UL << 20); n <<= 1)
+	;
+    k->buckets = calloc(n, sizeof(k->buckets[0]));
+    if (k->buckets == NULL)
+	return krb5_enomem(context);
+    k->nbuckets = n;
+
+    ret = krb5_kt_start_seq_get(context, k->keytab, &cursor);
+    if (ret) {
+	hkt_free_index(context, k);
+	return 0;
+    }
+    while ((ret = krb5_kt_next_entry(context, k->keytab, &e, &cursor)) == 0) {
+	ret = hkt_index_entry(context, k, &e);
+	if (ret) {
+	    krb5_kt_free_entry(context, &e);
+	    break;
+	}
+    }
+    krb5_kt_end_seq_get(context, k->keytab, &cursor);
+    if (ret != KRB5_KT_END) {
+	hkt_free_index(context, k);
+	return ret == ENOMEM ? ret : 0;
+    }
+
+    k->indexed = 1;
+    k->dev = st.st_dev;
+    k->ino = st.st_ino;
+    k->size = st.st_size;
+    k->mtime = st.st_mtime;
+    k->ctime = st.st_ctime;
+    return 0;
+}
+
+/* As krb5_kt_get_entry() with any enctype, from the index */
+static krb5_error_code
+hkt_index_get(krb5_context context, hdb_keytab k,
+	      krb5_const_principal principal, krb5_kvno kvno,
+	      krb5_keytab_entry *entry)
+{
+    krb5_name_canon_iterator iter = NULL;
+    krb5_const_principal try_princ;
+    krb5_keytab_entry *best;
+    struct hkt_princ *p;
+    krb5_error_code ret;
+    size_t i;
+    char *name;
+
+    ret = krb5_name_canon_iterator_start(context, principal, &iter);
+    if (ret)
+	return ret;
+    do {
+	ret = krb5_name_canon_iterate(context, &iter, &try_princ, NULL);
+	if (ret)
+	    break;
+	ret = KRB5_KT_NOTFOUND;
+	if (try_princ == NULL)
+	    continue;
+	if (krb5_unparse_name(context, try_princ, &name))
+	    continue;
+	p = hkt_lookup(k, name, hkt_hash(name));
+	free(name);
+	if (p == NULL)
+	    continue;
+
+	/* The file keytab might only store the lower 8 bits of the kvno */
+	best = NULL;
+	for (i = 0; i < p->len; i++) {
+	    if (kvno == 0) {
+		if (p->val[i].vno > 0 &&
+		    (best == NULL || p->val[i].vno > best->vno))
+		    best = &p->val[i];
+	    } else if (kvno == p->val[i].vno ||
+		       (p->val[i].vno < 256 && kvno % 256 == p->val[i].vno)) {
+		best = &p->val[i];
+		break;
+	    }
+	}
+	if (best)
+	    ret = krb5_kt_copy_entry_contents(context, best, entry);
+    } while (ret == KRB5_KT_NOTFOUND && iter);
+    krb5_free_name_canon_iterator(context, iter);
+    return ret;
+}
+
 /*
  *
  */
@@ -53,6 +266,9 @@ hkt_close(krb5_context context, HDB *db)
 
     assert(k->keytab);
 
+    hkt_free_index(context, k);
+    free(k->file);
+    k->file = NULL;
     ret = krb5_kt_close(context, k->keytab);
     k->keytab = NULL;
 
@@ -114,6 +330,23 @@ hkt_open(krb5_context context, HDB * db, int flags, mode_t mode)
     if (ret)
 	return ret;
 
+    {
+	char type[KRB5_KT_PREFIX_MAX_LEN];
+	char name[MAXPATHLEN];
+
+	if (krb5_kt_get_type(context, k->keytab, type, sizeof(type)) == 0 &&
+	    (strcmp(type, "FILE") == 0 || strcmp(type, "WRFILE") == 0) &&
+	    krb5_kt_get_name(context, k->keytab, name, sizeof(name)) == 0 &&
+	    (k->file = strdup(name)) == NULL) {
+	    krb5_kt_close(context, k->keytab);
+	    k->keytab = NULL;
+	    return krb5_enomem(context);
+	}
+    }
+    if (k->file && (ret = hkt_update_index(context, k)) != 0) {
+	hkt_close(context, db);
+	return ret;
+    }
     return 0;
 }
 
@@ -149,7 +382,13 @@ hkt_fetch_kvno(krb5_context context, HDB * db, krb5_const_principal principal,
      * enctypes should work.
      */
 
-    ret = krb5_kt_get_entry(context, k->keytab, principal, kvno, 0, &ktentry);
+    if (k->file && (ret = hkt_update_index(context, k)) != 0)
+	goto out;
+    if (k->indexed)
+	ret = hkt_index_get(context, k, principal, kvno, &ktentry);
+    else
+	ret = krb5_kt_get_entry(context, k->keytab, principal, kvno, 0,
+				&ktentry);
     if (ret) {
 	ret = HDB_ERR_NOENTRY;
 	goto out;
@@ -62,6 +62,8 @@ struct hdbldapdb {
     char *h_bind_dn;
     char *h_bind_password;
     krb5_boolean h_start_tls;
+    krb5_boolean h_kdc_attrs;	/* hdb-ldap-kdc-attributes-only */
+    time_t h_timeout;		/* hdb-ldap-timeout, 0 for none */
     char *h_createbase;
 };
 
@@ -107,6 +109,35 @@ static char * krb5kdcentry_attrs[] = {
     NULL
 };
 
+/*
+ * What the kdc needs of krb5kdcentry_attrs: LDAP_message2entry() reads
+ * the creator and modifier only with HDB_F_ADMIN_DATA.
+ */
+static char * krb5kdcentry_kdc_attrs[] = {
+    "cn",
+    "createTimestamp",
+    "krb5EncryptionType",
+    "krb5KDCFlags",
+    "krb5Key",
+    "krb5KeyVersionNumber",
+    "krb5MaxLife",
+    "krb5MaxRenew",
+    "krb5PasswordEnd",
+    "krb5PrincipalName",
+    "krb5PrincipalRealm",
+    "krb5ExtendedAttributes",
+    "krb5ValidEnd",
+    "krb5ValidStart",
+    "objectClass",
+    "sambaAcctFlags",
+    "sambaKickoffTime",
+    "sambaNTPassword",
+    "sambaPwdLastSet",
+    "sambaPwdMustChange",
+    "uid",
+    NULL
+};
+
 static char *krb5principal_attrs[] = {
     "cn",
     "createTimestamp",
@@ -863,139 +894,241 @@ escape_value(krb5_context context, const char *unquoted, char **quoted)
 }
 
 
+/*
+ * Wait for the result of search `msgid', and return its result code.
+ */
+static int
+LDAP__search_result(HDB *db, int msgid, LDAPMessage **res)
+{
+    struct hdbldapdb *h = db->hdb_db;
+    struct timeval tv;
+    int rc;
+
+    *res = NULL;
+    tv.tv_sec = h->h_timeout;
+    tv.tv_usec = 0;
+    rc = ldap_result(h->h_lp, msgid, LDAP_MSG_ALL,
+		     h->h_timeout ? &tv : NULL, res);
+    if (rc == 0) {
+	ldap_abandon_ext(h->h_lp, msgid, NULL, NULL);
+	return LDAP_TIMEOUT;
+    }
+    if (rc < 0) {
+	if (ldap_get_option(h->h_lp, LDAP_OPT_RESULT_CODE, &rc) != 0 ||
+	    rc == LDAP_SUCCESS)
+	    rc = LDAP_OTHER;
+	return rc;
+    }
+    rc = ldap_result2error(h->h_lp, *res, 0);
+    if (rc != LDAP_SUCCESS) {
+	ldap_msgfree(*res);
+	*res = NULL;
+    }
+    return rc;
+}
+
+/*
+ * Send the searches for entries matching `filter' and, if given,
+ * `uid_filter', returning their message IDs (-1 for no `uid_filter').
+ */
+static int
+LDAP__search_princ_send(HDB *db, const char *filter, const char *uid_filter,
+			char **attrs, int *msgid, int *uid_msgid)
+{
+    LDAP *lp = HDB2LDAP(db);
+    int rc;
+
+    *uid_msgid = -1;
+    rc = ldap_search_ext(lp, HDB2BASE(db), LDAP_SCOPE_SUBTREE, filter,
+			 attrs, 0, NULL, NULL, NULL, 0, msgid);
+    if (rc != LDAP_SUCCESS)
+	return rc;
+    if (uid_filter) {
+	rc = ldap_search_ext(lp, HDB2BASE(db), LDAP_SCOPE_SUBTREE, uid_filter,
+			     attrs, 0, NULL, NULL, NULL, 0, uid_msgid);
+	if (rc != LDAP_SUCCESS) {
+	    ldap_abandon_ext(lp, *msgid, NULL, NULL);
+	    return rc;
+	}
+    }
+    return LDAP_SUCCESS;
+}
+
+/*
+ * Wait for the searches sent by LDAP__search_princ_send(), returning the
+ * entries matching its `filter' or, if there are none, its `uid_filter'.
+ */
+static int
+LDAP__search_princ_recv(HDB *db, int msgid, int uid_msgid, LDAPMessage **msg)
+{
+    LDAP *lp = HDB2LDAP(db);
+    int rc;
+
+    rc = LDAP__search_result(db, msgid, msg);
+    if (uid_msgid == -1)
+	return rc;
+    if (rc != LDAP_SUCCESS || ldap_count_entries(lp, *msg) > 0) {
+	ldap_abandon_ext(lp, uid_msgid, NULL, NULL);
+	return rc;
+    }
+    ldap_msgfree(*msg);
+    return LDAP__search_result(db, uid_msgid, msg);
+}
+
+/*
+ * Search for entries matching `filter' or, if there are none and
+ * `uid_filter' is given, `uid_filter'.  Both searches are sent at once,
+ * so that the fallback costs no extra round trip to the server.
+ */
+static int
+LDAP__search_princ(HDB *db, const char *filter, const char *uid_filter,
+		   char **attrs, LDAPMessage **msg)
+{
+    int rc, msgid, uid_msgid;
+
+    *msg = NULL;
+    rc = LDAP__search_princ_send(db, filter, uid_filter, attrs,
+				 &msgid, &uid_msgid);
+    if (rc != LDAP_SUCCESS)
+	return rc;
+    return LDAP__search_princ_recv(db, msgid, uid_msgid, msg);
+}
+
+/*
+ * Make the search filters for `princ': by krb5PrincipalName and, for
+ * principals of our default realms, by uid.
+ */
 static krb5_error_code
-LDAP__lookup_princ(krb5_context context,
-		   HDB *db,
-		   const char *princname,
-		   const char *userid,
-		   LDAPMessage **msg)
+LDAP__princ_filters(krb5_context context, krb5_const_principal princ,
+		    char **filter, char **uid_filter)
 {
+    char *name = NULL, *name_short = NULL, *quote;
     krb5_error_code ret;
+    krb5_realm *r, *r0;
     int rc;
-    char *quote, *filter = NULL;
 
-    ret = LDAP__connect(context, db);
+    *filter = NULL;
+    *uid_filter = NULL;
+
+    ret = krb5_unparse_name(context, princ, &name);
     if (ret)
 	return ret;
 
+    ret = krb5_get_default_realms(context, &r0);
+    if(ret) {
+	free(name);
+	return ret;
+    }
+    for (r = r0; *r != NULL; r++) {
+	if(strcmp(krb5_principal_get_realm(context, princ), *r) == 0) {
+	    ret = krb5_unparse_name_short(context, princ, &name_short);
+	    if (ret) {
+		krb5_free_host_realm(context, r0);
+		free(name);
+		return ret;
+	    }
+	    break;
+	}
+    }
+    krb5_free_host_realm(context, r0);
+
     /*
      * Quote searches that contain filter language, this quote
      * searches for *@REALM, which takes very long time.
      */
 
-    ret = escape_value(context, princname, &quote);
+    ret = escape_value(context, name, &quote);
     if (ret)
 	goto out;
 
-    rc = asprintf(&filter,
+    rc = asprintf(filter,
 		  "(&(objectClass=krb5Principal)(krb5PrincipalName=%s))",
 		  quote);
     free(quote);
 
     if (rc < 0) {
+	*filter = NULL;
 	ret = ENOMEM;
 	krb5_set_error_message(context, ret, "malloc: out of memory");
 	goto out;
     }
 
-    ret = LDAP_no_size_limit(context, HDB2LDAP(db));
-    if (ret)
-	goto out;
-
-    rc = ldap_search_ext_s(HDB2LDAP(db), HDB2BASE(db),
-			   LDAP_SCOPE_SUBTREE, filter,
-			   krb5kdcentry_attrs, 0,
-			   NULL, NULL, NULL,
-			   0, msg);
-    if (check_ldap(context, db, rc)) {
-	ret = HDB_ERR_NOENTRY;
-	krb5_set_error_message(context, ret, "ldap_search_ext_s: "
-			      "filter: %s - error: %s",
-			      filter, ldap_err2string(rc));
-	goto out;
-    }
-
-    if (userid && ldap_count_entries(HDB2LDAP(db), *msg) == 0) {
-	free(filter);
-	filter = NULL;
-	ldap_msgfree(*msg);
-	*msg = NULL;
-
-	ret = escape_value(context, userid, &quote);
+    if (name_short) {
+	ret = escape_value(context, name_short, &quote);
 	if (ret)
 	    goto out;
 
-	rc = asprintf(&filter,
+	rc = asprintf(uid_filter,
 	    "(&(|(objectClass=sambaSamAccount)(objectClass=%s))(uid=%s))",
 		      structural_object, quote);
 	free(quote);
 	if (rc < 0) {
+	    *uid_filter = NULL;
 	    ret = ENOMEM;
 	    krb5_set_error_message(context, ret, "asprintf: out of memory");
 	    goto out;
 	}
-
-	ret = LDAP_no_size_limit(context, HDB2LDAP(db));
-	if (ret)
-	    goto out;
-
-	rc = ldap_search_ext_s(HDB2LDAP(db), HDB2BASE(db), LDAP_SCOPE_SUBTREE,
-			       filter, krb5kdcentry_attrs, 0,
-			       NULL, NULL, NULL,
-			       0, msg);
-	if (check_ldap(context, db, rc)) {
-	    ret = HDB_ERR_NOENTRY;
-	    krb5_set_error_message(context, ret,
-				   "ldap_search_ext_s: filter: %s error: %s",
-				   filter, ldap_err2string(rc));
-	    goto out;
-	}
     }
 
-    ret = 0;
-
   out:
-    if (filter)
-	free(filter);
-
+    if (ret) {
+	free(*filter);
+	*filter = NULL;
+    }
+    free(name);
+    free(name_short);
     return ret;
 }
 
 static krb5_error_code
 LDAP_principal2message(krb5_context context, HDB * db,
-		       krb5_const_principal princ, LDAPMessage ** msg)
+		       krb5_const_principal princ, unsigned flags,
+		       LDAPMessage ** msg)
 {
-    char *name, *name_short = NULL;
+    struct hdbldapdb *h = db->hdb_db;
     krb5_error_code ret;
-    krb5_realm *r, *r0;
+    int rc, tries;
+    char *filter = NULL, *uid_filter = NULL;
+    char **attrs = krb5kdcentry_attrs;
 
     *msg = NULL;
 
-    ret = krb5_unparse_name(context, princ, &name);
+    ret = LDAP__princ_filters(context, princ, &filter, &uid_filter);
     if (ret)
 	return ret;
 
-    ret = krb5_get_default_realms(context, &r0);
-    if(ret) {
-	free(name);
-	return ret;
-    }
-    for (r = r0; *r != NULL; r++) {
-	if(strcmp(krb5_principal_get_realm(context, princ), *r) == 0) {
-	    ret = krb5_unparse_name_short(context, princ, &name_short);
-	    if (ret) {
-		krb5_free_host_realm(context, r0);
-		free(name);
-		return ret;
-	    }
+    if (h->h_kdc_attrs && !(flags & HDB_F_ADMIN_DATA))
+	attrs = krb5kdcentry_kdc_attrs;
+
+    for (tries = 0; ; tries++) {
+	ret = LDAP__connect(context, db);
+	if (ret)
+	    goto out;
+
+	ret = LDAP_no_size_limit(context, HDB2LDAP(db));
+	if (ret)
+	    goto out;
+
+	rc = LDAP__search_princ(db, filter, uid_filter, attrs, msg);
+	if (check_ldap(context, db, rc) == 0)
+	    goto out;
+
+	/*
+	 * If the server dropped an idle connection, retry once on a new
+	 * one rather than failing this lookup.
+	 */
+	if (rc != LDAP_SERVER_DOWN || tries > 0)
 	    break;
-	}
     }
-    krb5_free_host_realm(context, r0);
 
-    ret = LDAP__lookup_princ(context, db, name, name_short, msg);
-    free(name);
-    free(name_short);
+    ret = HDB_ERR_NOENTRY;
+    krb5_set_error_message(context, ret, "ldap_search_ext: "
+			   "filter: %s - error: %s",
+			   filter, ldap_err2string(rc));
+
+  out:
+    free(filter);
+    free(uid_filter);
 
     return ret;
 }
@@ -1643,6 +1776,15 @@ LDAP__connect(krb5_context context, HDB * db)
 	return HDB_ERR_BADVERSION;
     }
 
+    if (((struct hdbldapdb *)db->hdb_db)->h_timeout) {
+	struct timeval tv;
+
+	/* Don't let an unreachable server hang lookups in connect() */
+	tv.tv_sec = ((struct hdbldapdb *)db->hdb_db)->h_timeout;
+	tv.tv_usec = 0;
+	(void) ldap_set_option(HDB2LDAP(db), LDAP_OPT_NETWORK_TIMEOUT, &tv);
+    }
+
     if (((struct hdbldapdb *)db->hdb_db)->h_start_tls) {
 	rc = ldap_start_tls_s(HDB2LDAP(db), NULL, NULL);
 
@@ -1685,17 +1827,16 @@ LDAP_open(krb5_context context, HDB * db, int flags, mode_t mode)
     return LDAP__connect(context, db);
 }
 
+/*
+ * Make `entry' from the first entry of search result `msg', and free `msg'.
+ */
 static krb5_error_code
-LDAP_fetch_kvno(krb5_context context, HDB * db, krb5_const_principal principal,
-		unsigned flags, krb5_kvno kvno, hdb_entry_ex * entry)
+LDAP__message2fetch(krb5_context context, HDB * db, LDAPMessage * msg,
+		    unsigned flags, hdb_entry_ex * entry)
 {
-    LDAPMessage *msg, *e;
+    LDAPMessage *e;
     krb5_error_code ret;
 
-    ret = LDAP_principal2message(context, db, principal, &msg);
-    if (ret)
-	return ret;
-
     e = ldap_first_entry(HDB2LDAP(db), msg);
     if (e == NULL) {
 	ret = HDB_ERR_NOENTRY;
@@ -1717,6 +1858,107 @@ LDAP_fetch_kvno(krb5_context context, HDB * db, krb5_const_principal principal,
     return ret;
 }
 
+static krb5_error_code
+LDAP_fetch_kvno(krb5_context context, HDB * db, krb5_const_principal principal,
+		unsigned flags, krb5_kvno kvno, hdb_entry_ex * entry)
+{
+    LDAPMessage *msg;
+    krb5_error_code ret;
+
+    ret = LDAP_principal2message(context, db, principal, flags, &msg);
+    if (ret)
+	return ret;
+    return LDAP__message2fetch(context, db, msg, flags, entry);
+}
+
+/*
+ * Send the searches for all the principals before waiting for any of the
+ * results, so that a batch costs one round trip to the server.
+ */
+static krb5_error_code
+LDAP_fetch_kvno_multi(krb5_context context, HDB * db,
+		      struct hdb_fetch_req *reqs, size_t nreqs)
+{
+    struct hdbldapdb *h = db->hdb_db;
+    LDAPMessage *msg;
+    krb5_error_code ret;
+    char *filter, *uid_filter;
+    char **attrs;
+    size_t i, nsent;
+    int *msgids;
+    int rc = LDAP_SUCCESS;
+    int down = 0;
+
+    msgids = calloc(nreqs * 2, sizeof(msgids[0]));
+    if (msgids == NULL)
+	return krb5_enomem(context);
+
+    ret = LDAP__connect(context, db);
+    if (ret == 0)
+	ret = LDAP_no_size_limit(context, HDB2LDAP(db));
+    if (ret) {
+	free(msgids);
+	return ret;
+    }
+
+    for (nsent = 0; nsent < nreqs; nsent++) {
+	attrs = krb5kdcentry_attrs;
+	if (h->h_kdc_attrs && !(reqs[nsent].flags & HDB_F_ADMIN_DATA))
+	    attrs = krb5kdcentry_kdc_attrs;
+
+	ret = LDAP__princ_filters(context, reqs[nsent].principal,
+				  &filter, &uid_filter);
+	if (ret)
+	    break;
+	rc = LDAP__search_princ_send(db, filter, uid_filter, attrs,
+				     &msgids[nsent * 2],
+				     &msgids[nsent * 2 + 1]);
+	free(filter);
+	free(uid_filter);
+	if (rc != LDAP_SUCCESS)
+	    break;
+    }
+
+    if (ret || rc != LDAP_SUCCESS) {
+	/* Let the caller look them up one at a time */
+	for (i = 0; i < nsent; i++) {
+	    ldap_abandon_ext(HDB2LDAP(db), msgids[i * 2], NULL, NULL);
+	    if (msgids[i * 2 + 1] != -1)
+		ldap_abandon_ext(HDB2LDAP(db), msgids[i * 2 + 1], NULL, NULL);
+	}
+	free(msgids);
+	if (rc != LDAP_SUCCESS)
+	    (void) check_ldap(context, db, rc);
+	return ret ? ret : HDB_ERR_NOENTRY;
+    }
+
+    for (i = 0; i < nreqs; i++) {
+	if (!down) {
+	    rc = LDAP__search_princ_recv(db, msgids[i * 2],
+					 msgids[i * 2 + 1], &msg);
+	    if (check_ldap(context, db, rc) == 0) {
+		reqs[i].ret = LDAP__message2fetch(context, db, msg,
+						  reqs[i].flags,
+						  reqs[i].entry);
+		continue;
+	    }
+	    down = (rc == LDAP_SERVER_DOWN);
+	}
+	if (down) {
+	    /* The rest of the batch was lost with the connection */
+	    reqs[i].ret = LDAP_fetch_kvno(context, db, reqs[i].principal,
+					  reqs[i].flags, reqs[i].kvno,
+					  reqs[i].entry);
+	    continue;
+	}
+	reqs[i].ret = HDB_ERR_NOENTRY;
+	krb5_set_error_message(context, reqs[i].ret, "ldap_search_ext: "
+			       "error: %s", ldap_err2string(rc));
+    }
+    free(msgids);
+    return 0;
+}
+
 #if 0
 static krb5_error_code
 LDAP_fetch(krb5_context context, HDB * db, krb5_const_principal principal,
@@ -1742,7 +1984,8 @@ LDAP_store(krb5_context context, HDB * db, unsigned flags,
     if ((flags & HDB_F_PRECHECK))
         return 0; /* we can't guarantee whether we'll be able to perform it */
 
-    ret = LDAP_principal2message(context, db, entry->entry.principal, &msg);
+    ret = LDAP_principal2message(context, db, entry->entry.principal,
+				 HDB_F_ADMIN_DATA, &msg);
     if (ret == 0)
 	e = ldap_first_entry(HDB2LDAP(db), msg);
 
@@ -1825,7 +2068,8 @@ LDAP_remove(krb5_context context, HDB *db,
     if ((flags & HDB_F_PRECHECK))
         return 0; /* we can't guarantee whether we'll be able to perform it */
 
-    ret = LDAP_principal2message(context, db, principal, &msg);
+    ret = LDAP_principal2message(context, db, principal, HDB_F_ADMIN_DATA,
+				 &msg);
     if (ret)
 	goto out;
 
@@ -2001,6 +2245,13 @@ hdb_ldap_common(krb5_context context,
     h->h_start_tls =
 	krb5_config_get_bool_default(context, NULL, FALSE,
 				     "kdc", "hdb-ldap-start-tls", NULL);
+    h->h_kdc_attrs =
+	krb5_config_get_bool_default(context, NULL, FALSE,
+				     "kdc", "hdb-ldap-kdc-attributes-only",
+				     NULL);
+    h->h_timeout =
+	krb5_config_get_time_default(context, NULL, 0,
+				     "kdc", "hdb-ldap-timeout", NULL);
 
     create_base = krb5_config_get_string(context, NULL, "kdc",
 					 "hdb-ldap-create-base", NULL);
@@ -2021,6 +2272,7 @@ hdb_ldap_common(krb5_context context,
     (*db)->hdb_open = LDAP_open;
     (*db)->hdb_close = LDAP_close;
     (*db)->hdb_fetch_kvno = LDAP_fetch_kvno;
+    (*db)->hdb_fetch_kvno_multi = LDAP_fetch_kvno_multi;
     (*db)->hdb_store = LDAP_store;
     (*db)->hdb_remove = LDAP_remove;
     (*db)->hdb_firstkey = LDAP_firstkey;
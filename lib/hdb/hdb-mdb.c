@@ -90,6 +90,12 @@ mdb2krb5_code(krb5_context context, int code)
 typedef struct mdb_info {
     MDB_env *e;
     MDB_txn *t;
+    MDB_txn *rt;	/* Reset read-only txn for DB__get(); see read_txn() */
+    MDB_txn *wt;	/* Write txn of a batch; see DB_begin_batch() */
+    size_t batch_bytes;	/* Bytes stored in the batch so far */
+    unsigned int shard;	/* Shard to iterate; see DB_set_shard() */
+    unsigned int nshards;
+    size_t shard_left;	/* Entries left in the shard being iterated */
     MDB_dbi d;
     MDB_cursor *c;
     int oflags;
@@ -133,6 +139,13 @@ HEIMDAL_MUTEX keep_them_open_lock = HEIMDAL_MUTEX_INITIALIZER;
  * On success this outputs an `MDB_env *' (the handle for the LMDB) and an
  * `MDB_dbi' (the handle for the main B-tree in the LMDB).
  *
+ * We open the env with MDB_NOTLS so that read-only transactions are not tied
+ * to threads' reader slots.  That lets each HDB handle keep one reset
+ * read-only transaction (and so one reader slot) for its lookups.  The reader
+ * table must then have room for as many HDB handles as may be open at once on
+ * the LMDB, in all processes (see [kdc] hdb-mdb-maxreaders; LMDB defaults to
+ * 126).
+ *
  * ALSO, LMDB requires that we re-open the `MDB_env' when the database grows
  * larger than the mmap size.  We handle this by finding in `keep_them_open'
  * the env we already have, marking it unusable, and the finding some other
@@ -146,7 +159,7 @@ my_mdb_env_create_and_open(krb5_context context,
 {
     struct keep_it_open *p, *n;
     MDB_txn *txn = NULL;
-    unsigned int flags = MDB_NOSUBDIR;
+    unsigned int flags = MDB_NOSUBDIR | MDB_NOTLS;
     struct stat st;
     size_t mapsize = 0;
     int max_readers;
@@ -315,6 +328,10 @@ my_reopen_mdb(krb5_context context, HDB *db, int mapfull)
     char *fn;
     krb5_error_code ret = 0;
 
+    /* The reset read txn belongs to the env we're about to close */
+    mdb_txn_abort(mi->rt);
+    mi->rt = NULL;
+
     /* No-op if we don't have an open one */
     my_mdb_env_close(context, db->hdb_name, &mi->e);
     if (asprintf(&fn, "%s.mdb", db->hdb_name) == -1)
@@ -332,9 +349,13 @@ DB_close(krb5_context context, HDB *db)
 
     mdb_cursor_close(mi->c);
     mdb_txn_abort(mi->t);
+    mdb_txn_abort(mi->rt);
+    mdb_txn_abort(mi->wt);	/* An unfinished batch is abandoned */
     my_mdb_env_close(context, db->hdb_name, &mi->e);
     mi->c = 0;
     mi->t = 0;
+    mi->rt = 0;
+    mi->wt = 0;
     mi->e = 0;
     return 0;
 }
@@ -346,6 +367,7 @@ DB_destroy(krb5_context context, HDB *db)
 
     ret = hdb_clear_master_key(context, db);
     krb5_config_free_strings(db->virtual_hostbased_princ_svcs);
+    _hdb_free_alias_index(db);
     free(db->hdb_name);
     free(db->hdb_db);
     free(db);
@@ -397,6 +419,10 @@ DB_seq(krb5_context context, HDB *db,
      */
     key.mv_size = 0;
     value.mv_size = 0;
+    if (mi->nshards > 1 && mi->shard_left-- == 0) {
+        mi->shard_left = 0;
+        return HDB_ERR_NOENTRY;
+    }
     code = mdb_cursor_get(mi->c, &key, &value, flag);
     if (code)
 	return mdb2krb5_code(context, code);
@@ -427,11 +453,43 @@ DB_seq(krb5_context context, HDB *db,
 }
 
 
+/*
+ * Position the cursor just before the first entry of the shard to iterate,
+ * counting keys without decoding their values, and set `*op' to the cursor
+ * operation that gets that entry.
+ */
+static int
+shard_seek(mdb_info *mi, MDB_cursor_op *op)
+{
+    MDB_val key, value;
+    MDB_stat st;
+    uint64_t start;
+    int code;
+
+    code = mdb_stat(mi->t, mi->d, &st);
+    if (code)
+        return code;
+    start = (uint64_t)st.ms_entries * mi->shard / mi->nshards;
+    mi->shard_left = (uint64_t)st.ms_entries * (mi->shard + 1) / mi->nshards -
+        start;
+    for (*op = MDB_FIRST; code == 0 && start > 0; start--) {
+        code = mdb_cursor_get(mi->c, &key, &value, *op);
+        *op = MDB_NEXT;
+    }
+    if (code == MDB_NOTFOUND) {
+        /* Entries removed since mdb_stat(); the shard is empty */
+        mi->shard_left = 0;
+        code = 0;
+    }
+    return code;
+}
+
 static krb5_error_code
 DB_firstkey(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
 {
     krb5_error_code ret = 0;
     mdb_info *mi = db->hdb_db;
+    MDB_cursor_op op = MDB_FIRST;
     int tries = 3;
     int code = 0;
 
@@ -447,8 +505,10 @@ DB_firstkey(krb5_context context, HDB *db, unsigned flags, hdb_entry_ex *entry)
             code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &mi->t);
         if (code == 0)
             code = mdb_cursor_open(mi->t, mi->d, &mi->c);
+        if (code == 0 && mi->nshards > 1)
+            code = shard_seek(mi, &op);
         if (code == 0) {
-            ret = DB_seq(context, db, flags, entry, MDB_FIRST);
+            ret = DB_seq(context, db, flags, entry, op);
             break;
         }
     } while (code == MDB_MAP_FULL && --tries > 0);
@@ -494,11 +554,28 @@ DB_rename(krb5_context context, HDB *db, const char *new_name)
     return 0;
 }
 
+/*
+ * Start a read-only transaction in mi->rt for a lookup, renewing the one
+ * left reset by the previous lookup if there is one.  Renewing is much
+ * cheaper than mdb_txn_begin(), and keeps our reader slot, so concurrent
+ * lookups from many KDC workers do not contend for the reader table lock.
+ */
+static int
+read_txn(mdb_info *mi)
+{
+    if (mi->rt) {
+        if (mdb_txn_renew(mi->rt) == 0)
+            return 0;
+        mdb_txn_abort(mi->rt);
+        mi->rt = NULL;
+    }
+    return mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &mi->rt);
+}
+
 static krb5_error_code
 DB__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
 {
     mdb_info *mi = (mdb_info*)db->hdb_db;
-    MDB_txn *txn = NULL;
     MDB_val k, v;
     int tries = 3;
     int code = 0;
@@ -506,28 +583,126 @@ DB__get(krb5_context context, HDB *db, krb5_data key, krb5_data *reply)
     k.mv_data = key.data;
     k.mv_size = key.length;
 
+    if (mi->wt) {
+        /* See the batch's own changes */
+        code = mdb_get(mi->wt, mi->d, &k, &v);
+        if (code == 0)
+            krb5_data_copy(reply, v.mv_data, v.mv_size);
+        return mdb2krb5_code(context, code);
+    }
+
     do {
-        if (txn) {
-            mdb_txn_abort(txn);
-            txn = NULL;
-        }
         if (code)
             code = my_reopen_mdb(context, db, 1);
         if (code == 0)
-            code = mdb_txn_begin(mi->e, NULL, MDB_RDONLY, &txn);
+            code = read_txn(mi);
         if (code == 0)
-            code = mdb_get(txn, mi->d, &k, &v);
+            code = mdb_get(mi->rt, mi->d, &k, &v);
         if (code == 0)
             krb5_data_copy(reply, v.mv_data, v.mv_size);
+        if (mi->rt && (code == 0 || code == MDB_NOTFOUND)) {
+            /* Release the snapshot, but keep the txn for the next lookup */
+            mdb_txn_reset(mi->rt);
+        } else if (mi->rt) {
+            mdb_txn_abort(mi->rt);
+            mi->rt = NULL;
+        }
     } while (code == MDB_MAP_FULL && --tries > 0);
 
-    if (code)
-        mdb_txn_abort(txn);
-    else
-        (void) mdb_txn_commit(txn); /* Empty transaction? -> commit */
     return mdb2krb5_code(context, code);
 }
 
+/*
+ * Get and decode the entry or alias stored under `key' straight from the
+ * memory map, while the read txn that makes it valid is held, rather than
+ * decoding a copy of it as DB__get() would let _hdb_fetch_kvno() do.  This
+ * saves an allocation and copy of the whole encoded value (which includes
+ * all the principal's historic keys) per lookup.
+ */
+static krb5_error_code
+DB_get_entry_or_alias(krb5_context context,
+                      HDB *db,
+                      krb5_data key,
+                      HDB_EntryOrAlias *eoa)
+{
+    mdb_info *mi = (mdb_info*)db->hdb_db;
+    krb5_error_code ret = 0;
+    MDB_val k, v;
+    int tries = 3;
+    int code = 0;
+
+    k.mv_data = key.data;
+    k.mv_size = key.length;
+
+    if (mi->wt) {
+        code = mdb_get(mi->wt, mi->d, &k, &v);
+        if (code)
+            return mdb2krb5_code(context, code);
+        return decode_HDB_EntryOrAlias(v.mv_data, v.mv_size, eoa, NULL);
+    }
+
+    do {
+        if (code)
+            code = my_reopen_mdb(context, db, 1);
+        if (code == 0)
+            code = read_txn(mi);
+        if (code == 0)
+            code = mdb_get(mi->rt, mi->d, &k, &v);
+        if (code == 0)
+            ret = decode_HDB_EntryOrAlias(v.mv_data, v.mv_size, eoa, NULL);
+        if (mi->rt && (code == 0 || code == MDB_NOTFOUND)) {
+            mdb_txn_reset(mi->rt);
+        } else if (mi->rt) {
+            mdb_txn_abort(mi->rt);
+            mi->rt = NULL;
+        }
+    } while (code == MDB_MAP_FULL && --tries > 0);
+
+    return code ? mdb2krb5_code(context, code) : ret;
+}
+
+static krb5_error_code
+DB_fetch_kvno(krb5_context context, HDB *db, krb5_const_principal principal,
+              unsigned flags, krb5_kvno kvno, hdb_entry_ex *entry)
+{
+    return _hdb_fetch_kvno_get(context, db, principal, flags, kvno, entry,
+                               DB_get_entry_or_alias);
+}
+
+/*
+ * In a batch, all stores and removals go in one write txn, mi->wt, which
+ * lookups use too, so that they see the batch's own changes.  The map
+ * cannot be grown while the txn is open, so when the batch might not fit
+ * in what is left of it, we commit the batch so far, grow the map, and
+ * carry on in a new txn.
+ */
+static krb5_error_code
+batch_make_room(krb5_context context, HDB *db, size_t len)
+{
+    mdb_info *mi = (mdb_info*)db->hdb_db;
+    MDB_envinfo info;
+    MDB_stat st;
+    int code;
+
+    if (mdb_env_info(mi->e, &info) != 0 || mdb_env_stat(mi->e, &st) != 0)
+        return 0;
+    /* Allow for B-tree overhead of up to twice the data */
+    if ((info.me_last_pgno + 1) * st.ms_psize +
+        3 * (mi->batch_bytes + len) < info.me_mapsize)
+        return 0;
+
+    code = mdb_txn_commit(mi->wt);
+    mi->wt = NULL;
+    mi->batch_bytes = 0;
+    if (code)
+        return mdb2krb5_code(context, code);
+    mi->mapsize += mi->mapsize >> 1;
+    code = my_reopen_mdb(context, db, 1);
+    if (code)
+        return code;
+    return mdb2krb5_code(context, mdb_txn_begin(mi->e, NULL, 0, &mi->wt));
+}
+
 static krb5_error_code
 DB__put(krb5_context context, HDB *db, int replace,
 	krb5_data key, krb5_data value)
@@ -543,6 +718,19 @@ DB__put(krb5_context context, HDB *db, int replace,
     v.mv_data = value.data;
     v.mv_size = value.length;
 
+    if (mi->wt) {
+        krb5_error_code ret;
+
+        ret = batch_make_room(context, db, key.length + value.length);
+        if (ret)
+            return ret;
+        code = mdb_put(mi->wt, mi->d, &k, &v,
+                       replace ? 0 : MDB_NOOVERWRITE);
+        if (code == 0)
+            mi->batch_bytes += key.length + value.length;
+        return mdb2krb5_code(context, code);
+    }
+
     do {
         if (txn) {
             mdb_txn_abort(txn);
@@ -580,6 +768,9 @@ DB__del(krb5_context context, HDB *db, krb5_data key)
     k.mv_data = key.data;
     k.mv_size = key.length;
 
+    if (mi->wt)
+        return mdb2krb5_code(context, mdb_del(mi->wt, mi->d, &k, NULL));
+
     do {
         if (txn) {
             mdb_txn_abort(txn);
@@ -606,6 +797,51 @@ DB__del(krb5_context context, HDB *db, krb5_data key)
     return mdb2krb5_code(context, code);
 }
 
+static krb5_error_code
+DB_begin_batch(krb5_context context, HDB *db)
+{
+    mdb_info *mi = (mdb_info *)db->hdb_db;
+
+    if (mi->wt) {
+        krb5_set_error_message(context, HDB_ERR_UK_SERROR,
+                               "hdb-mdb: batch already started");
+        return HDB_ERR_UK_SERROR;
+    }
+    mi->batch_bytes = 0;
+    return mdb2krb5_code(context, mdb_txn_begin(mi->e, NULL, 0, &mi->wt));
+}
+
+static krb5_error_code
+DB_end_batch(krb5_context context, HDB *db, int commit)
+{
+    mdb_info *mi = (mdb_info *)db->hdb_db;
+    int code = 0;
+
+    if (mi->wt == NULL)
+        return 0;
+    if (commit)
+        code = mdb_txn_commit(mi->wt);
+    else
+        mdb_txn_abort(mi->wt);
+    mi->wt = NULL;
+    return mdb2krb5_code(context, code);
+}
+
+/*
+ * Shards are ranges of entries in key order, found by counting keys from
+ * the first, which is cheap compared to decoding entries.
+ */
+static krb5_error_code
+DB_set_shard(krb5_context context, HDB *db,
+             unsigned int shard, unsigned int nshards)
+{
+    mdb_info *mi = (mdb_info *)db->hdb_db;
+
+    mi->shard = shard;
+    mi->nshards = nshards;
+    return 0;
+}
+
 static krb5_error_code
 DB_open(krb5_context context, HDB *db, int oflags, mode_t mode)
 {
@@ -674,7 +910,7 @@ hdb_mdb_create(krb5_context context, HDB **db,
     (*db)->hdb_capability_flags = HDB_CAP_F_HANDLE_ENTERPRISE_PRINCIPAL;
     (*db)->hdb_open  = DB_open;
     (*db)->hdb_close = DB_close;
-    (*db)->hdb_fetch_kvno = _hdb_fetch_kvno;
+    (*db)->hdb_fetch_kvno = DB_fetch_kvno;
     (*db)->hdb_store = _hdb_store;
     (*db)->hdb_remove = _hdb_remove;
     (*db)->hdb_firstkey = DB_firstkey;
@@ -687,6 +923,9 @@ hdb_mdb_create(krb5_context context, HDB **db,
     (*db)->hdb__del = DB__del;
     (*db)->hdb_destroy = DB_destroy;
     (*db)->hdb_set_sync = DB_set_sync;
+    (*db)->hdb_begin_batch = DB_begin_batch;
+    (*db)->hdb_end_batch = DB_end_batch;
+    (*db)->hdb_set_shard = DB_set_shard;
     return 0;
 }
 #endif /* HAVE_LMDB */
@@ -1232,22 +1232,38 @@ nexttoken(char **p, size_t len, const char *what)
     return q;
 }
 
+static int
+hexval(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Decode hex-encoded binary data in place: the result overwrites the
+ * token in the line buffer, which saves a malloc() per TL data and key.
+ */
 static size_t
-getdata(char **p, unsigned char *buf, size_t len, const char *what)
+getdata(char **p, unsigned char **data, size_t len, const char *what)
 {
+    unsigned char *buf;
     size_t i;
-    int v;
+    int hi, lo;
     char *q = nexttoken(p, 0, what);
     if (q == NULL) {
         warnx("Failed to find hex-encoded binary data (%s) in dump", what);
         return 0;
     }
-    i = 0;
-    while (*q && i < len) {
-	if (sscanf(q, "%02x", &v) != 1)
-	    break;
-	buf[i++] = v;
-	q += 2;
+    *data = buf = (unsigned char *)q;
+    for (i = 0; i < len; i++) {
+        if ((hi = hexval(q[2 * i])) < 0 || (lo = hexval(q[2 * i + 1])) < 0)
+            break;
+        buf[i] = (hi << 4) | lo;
     }
     return i;
 }
@@ -1255,13 +1271,16 @@ getdata(char **p, unsigned char *buf, size_t len, const char *what)
 static int
 getint(char **p, const char *what)
 {
-    int val;
+    long val;
+    char *end;
     char *q = nexttoken(p, 0, what);
     if (!q) {
         warnx("Failed to find a signed integer (%s) in dump", what);
         return -1;
     }
-    if (sscanf(q, "%d", &val) != 1)
+    errno = 0;
+    val = strtol(q, &end, 10);
+    if (end == q || errno || val < INT_MIN || val > INT_MAX)
         return -1;
     return val;
 }
@@ -1269,13 +1288,16 @@ getint(char **p, const char *what)
 static unsigned int
 getuint(char **p, const char *what)
 {
-    int val;
+    unsigned long val;
+    char *end;
     char *q = nexttoken(p, 0, what);
     if (!q) {
         warnx("Failed to find an unsigned integer (%s) in dump", what);
         return 0;
     }
-    if (sscanf(q, "%u", &val) != 1)
+    errno = 0;
+    val = strtoul(q, &end, 10);
+    if (end == q || errno || val > UINT_MAX)
         return 0;
     return val;
 }
@@ -1410,21 +1432,16 @@ _hdb_mit_dump2mitdb_entry(krb5_context context, char *line, krb5_storage *sp)
 
     /* scan and write TL data */
     for (i = 0; i < num_tl_data; i++) {
-        char *reading_what;
+        char reading_what[64];
         int tl_type, tl_length;
         unsigned char *buf;
 
         tl_type = getint(&p, "TL data type");
         tl_length = getint(&p, "data length");
 
-        if (asprintf(&reading_what, "TL data type %d (length %d)",
-                     tl_type, tl_length) < 0)
-            return ENOMEM;
+        snprintf(reading_what, sizeof(reading_what),
+                 "TL data type %d (length %d)", tl_type, tl_length);
 
-        /*
-         * XXX Leaking reading_what, but only on ENOMEM cases anyways,
-         * so we don't care.
-         */
         CHECK_UINT16(tl_type);
         ret = krb5_store_uint16(sp, tl_type);
         if (ret) return ret;
@@ -1433,17 +1450,13 @@ _hdb_mit_dump2mitdb_entry(krb5_context context, char *line, krb5_storage *sp)
         if (ret) return ret;
 
         if (tl_length) {
-            buf = malloc(tl_length);
-            if (!buf) return ENOMEM;
-            if (getdata(&p, buf, tl_length, reading_what) != tl_length)
+            if (getdata(&p, &buf, tl_length, reading_what) != tl_length)
                 return EINVAL;
             sz = krb5_storage_write(sp, buf, tl_length);
-            free(buf);
             if (sz != tl_length) return ENOMEM;
         } else {
             if (strcmp(nexttoken(&p, 0, "'-1' field"), "-1") != 0) return EINVAL;
         }
-        free(reading_what);
     }
 
     for (i = 0; i < num_key_data; i++) {
@@ -1476,12 +1489,9 @@ _hdb_mit_dump2mitdb_entry(krb5_context context, char *line, krb5_storage *sp)
             if (ret) return ret;
 
             if (keylen) {
-                buf = malloc(keylen);
-                if (!buf) return ENOMEM;
-                if (getdata(&p, buf, keylen, "key (or salt) data") != keylen)
+                if (getdata(&p, &buf, keylen, "key (or salt) data") != keylen)
                     return EINVAL;
                 sz = krb5_storage_write(sp, buf, keylen);
-                free(buf);
                 if (sz != keylen) return ENOMEM;
             } else {
                 if (strcmp(nexttoken(&p, 0,
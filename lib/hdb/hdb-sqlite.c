@@ -36,6 +36,14 @@
 
 #define MAX_RETRIES 10
 
+/*
+ * How long SQLite itself retries, with short sleeps, when the database is
+ * busy, before we fall back to retrying once a second.  In WAL mode readers
+ * only see SQLITE_BUSY briefly (e.g., while a writer resets the WAL), so they
+ * should not have to wait for a whole second.
+ */
+#define BUSY_TIMEOUT_MS 5000
+
 typedef struct hdb_sqlite_db {
     double version;
     sqlite3 *db;
@@ -52,7 +60,13 @@ typedef struct hdb_sqlite_db {
     sqlite3_stmt *update_entry;
     sqlite3_stmt *remove;
     sqlite3_stmt *get_all_entries;
+    sqlite3_stmt *get_shard_entries;
 
+    pid_t pid;                  /* Process that opened the connection */
+    int batch;                  /* In hdb_sqlite_begin_batch() */
+    int sharded;                /* See hdb_sqlite_set_shard() */
+    sqlite3_int64 shard_first;  /* Entry.id the shard starts at */
+    sqlite3_int64 shard_count;  /* Number of entries in the shard */
 } hdb_sqlite_db;
 
 /* This should be used to mark updates which make the code incompatible
@@ -114,6 +128,13 @@ typedef struct hdb_sqlite_db {
                  "   WHERE principal = ?)"
 #define HDBSQLITE_GET_ALL_ENTRIES \
                  " SELECT data FROM Entry"
+#define HDBSQLITE_GET_SHARD_ENTRIES \
+                 " SELECT data FROM Entry WHERE id >= ?" \
+                 " ORDER BY id LIMIT ?"
+#define HDBSQLITE_COUNT_ENTRIES \
+                 " SELECT count(*) FROM Entry"
+#define HDBSQLITE_GET_NTH_ENTRY_ID \
+                 " SELECT id FROM Entry ORDER BY id LIMIT 1 OFFSET ?"
 
 /**
  * Wrapper around sqlite3_prepare_v2.
@@ -211,6 +232,11 @@ prep_stmts(krb5_context context, hdb_sqlite_db *hsdb)
     ret = hdb_sqlite_prepare_stmt(context, hsdb->db,
                                   &hsdb->get_all_entries,
                                   HDBSQLITE_GET_ALL_ENTRIES);
+    if (ret)
+        return ret;
+    ret = hdb_sqlite_prepare_stmt(context, hsdb->db,
+                                  &hsdb->get_shard_entries,
+                                  HDBSQLITE_GET_SHARD_ENTRIES);
     return ret;
 }
 
@@ -260,6 +286,10 @@ finalize_stmts(krb5_context context, hdb_sqlite_db *hsdb)
     if (hsdb->get_all_entries != NULL)
         sqlite3_finalize(hsdb->get_all_entries);
     hsdb->get_all_entries = NULL;
+
+    if (hsdb->get_shard_entries != NULL)
+        sqlite3_finalize(hsdb->get_shard_entries);
+    hsdb->get_shard_entries = NULL;
 }
 
 /**
@@ -343,6 +373,7 @@ static krb5_error_code
 hdb_sqlite_open_database(krb5_context context, HDB *db, int flags)
 {
     int ret;
+    int mmap_size;
     hdb_sqlite_db *hsdb = (hdb_sqlite_db*) db->hdb_db;
 
     ret = sqlite3_open_v2(hsdb->db_file, &hsdb->db,
@@ -360,6 +391,25 @@ hdb_sqlite_open_database(krb5_context context, HDB *db, int flags)
 	    ret = krb5_enomem(context);
         return ret;
     }
+    hsdb->pid = getpid();
+
+    sqlite3_busy_timeout(hsdb->db, BUSY_TIMEOUT_MS);
+
+    /*
+     * Memory-mapped I/O saves a copy of each page read by a lookup, and lets
+     * all processes share the pages in the page cache.
+     */
+    mmap_size = krb5_config_get_int_default(context, NULL, 0, "kdc",
+                                            "hdb-sqlite-mmap-size", NULL);
+    if (mmap_size > 0) {
+        char *pragma = NULL;
+
+        if (asprintf(&pragma, "PRAGMA main.mmap_size = %lld",
+                     (long long)mmap_size * 1024) == -1)
+            return krb5_enomem(context);
+        (void) sqlite3_exec(hsdb->db, pragma, NULL, NULL, NULL);
+        free(pragma);
+    }
     return 0;
 }
 
@@ -392,6 +442,10 @@ hdb_sqlite_close_database(krb5_context context, HDB *db)
 
     finalize_stmts(context, hsdb);
 
+    /* Inherited across fork(); see hdb_sqlite_open() */
+    if (hsdb->pid != getpid())
+        return 0;
+
     /* XXX Use sqlite3_close_v2() when we upgrade SQLite3 */
     if (sqlite3_close(hsdb->db) != SQLITE_OK) {
         krb5_set_error_message(context, HDB_ERR_UK_SERROR,
@@ -586,6 +640,85 @@ hdb_sqlite_step_once(krb5_context context, HDB *db, sqlite3_stmt *statement)
     return ret;
 }
 
+/*
+ * Each store or removal is a transaction of its own, except within a
+ * batch (see hdb_sqlite_begin_batch()), where it is a savepoint in the
+ * batch's transaction so that one failing does not undo the others.
+ */
+static krb5_error_code
+hdb_sqlite_begin_op(krb5_context context, hdb_sqlite_db *hsdb)
+{
+    return hdb_sqlite_exec_stmt(context, hsdb,
+                                hsdb->batch ? "SAVEPOINT hdb_op" :
+                                              "BEGIN IMMEDIATE TRANSACTION",
+                                HDB_ERR_UK_SERROR);
+}
+
+static krb5_error_code
+hdb_sqlite_commit_op(krb5_context context, hdb_sqlite_db *hsdb)
+{
+    return hdb_sqlite_exec_stmt(context, hsdb,
+                                hsdb->batch ? "RELEASE hdb_op" : "COMMIT",
+                                HDB_ERR_UK_SERROR);
+}
+
+static krb5_error_code
+hdb_sqlite_rollback_op(krb5_context context, hdb_sqlite_db *hsdb)
+{
+    return hdb_sqlite_exec_stmt(context, hsdb,
+                                hsdb->batch ?
+                                    "ROLLBACK TO hdb_op; RELEASE hdb_op" :
+                                    "ROLLBACK",
+                                0);
+}
+
+/**
+ * Starts a batch of stores and removals, all done in one transaction
+ * until hdb_sqlite_end_batch(), instead of one transaction each.
+ *
+ * @param context The current krb5_context
+ * @param db      Heimdal database handle
+ *
+ * @return        0 if everything worked, an error code if not
+ */
+static krb5_error_code
+hdb_sqlite_begin_batch(krb5_context context, HDB *db)
+{
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *)(db->hdb_db);
+    krb5_error_code ret;
+
+    if (hsdb->batch) {
+        krb5_set_error_message(context, HDB_ERR_UK_SERROR,
+                               "hdb-sqlite: batch already started");
+        return HDB_ERR_UK_SERROR;
+    }
+    ret = hdb_sqlite_exec_stmt(context, hsdb, "BEGIN IMMEDIATE TRANSACTION",
+                               HDB_ERR_UK_SERROR);
+    if (ret == 0)
+        hsdb->batch = 1;
+    return ret;
+}
+
+/**
+ * Commits or rolls back the batch started with hdb_sqlite_begin_batch().
+ *
+ * @param context The current krb5_context
+ * @param db      Heimdal database handle
+ * @param commit  Non-zero to commit, zero to roll back
+ *
+ * @return        0 if everything worked, an error code if not
+ */
+static krb5_error_code
+hdb_sqlite_end_batch(krb5_context context, HDB *db, int commit)
+{
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *)(db->hdb_db);
+
+    if (!hsdb->batch)
+        return 0;
+    hsdb->batch = 0;
+    return hdb_sqlite_exec_stmt(context, hsdb, commit ? "COMMIT" : "ROLLBACK",
+                                HDB_ERR_UK_SERROR);
+}
 
 /**
  * Stores an hdb_entry in the database. If flags contains HDB_F_REPLACE
@@ -613,9 +746,7 @@ hdb_sqlite_store(krb5_context context, HDB *db, unsigned flags,
 
     krb5_data_zero(&value);
 
-    ret = hdb_sqlite_exec_stmt(context, hsdb,
-                               "BEGIN IMMEDIATE TRANSACTION",
-                               HDB_ERR_UK_SERROR);
+    ret = hdb_sqlite_begin_op(context, hsdb);
     if(ret != SQLITE_OK) {
 	ret = HDB_ERR_UK_SERROR;
         krb5_set_error_message(context, ret,
@@ -739,11 +870,11 @@ commit:
     sqlite3_reset(get_ids);
 
     if ((flags & HDB_F_PRECHECK)) {
-        (void) hdb_sqlite_exec_stmt(context, hsdb, "ROLLBACK", 0);
+        (void) hdb_sqlite_rollback_op(context, hsdb);
         return 0;
     }
 
-    ret = hdb_sqlite_exec_stmt(context, hsdb, "COMMIT", HDB_ERR_UK_SERROR);
+    ret = hdb_sqlite_commit_op(context, hsdb);
     if(ret != SQLITE_OK)
 	krb5_warnx(context, "hdb-sqlite: COMMIT problem: %ld: %s",
 		   (long)HDB_ERR_UK_SERROR, sqlite3_errmsg(hsdb->db));
@@ -757,7 +888,7 @@ rollback:
     krb5_warnx(context, "hdb-sqlite: store rollback problem: %d: %s",
 	       ret, sqlite3_errmsg(hsdb->db));
 
-    (void) hdb_sqlite_exec_stmt(context, hsdb, "ROLLBACK", 0);
+    (void) hdb_sqlite_rollback_op(context, hsdb);
     return ret;
 }
 
@@ -784,17 +915,42 @@ hdb_sqlite_close(krb5_context context, HDB *db)
  * many open handles to the database file the handle does not
  * need to be closed, or reopened.
  *
+ * The exception is a handle inherited across fork(), as when the kdc
+ * forks its worker processes after opening its databases: SQLite
+ * connections must not be used in a child process, so each process
+ * opens its own connection, with its own prepared statements, on
+ * first use.  The inherited connection is abandoned without closing
+ * it, as closing it could checkpoint and remove the WAL from under
+ * the parent's connection.
+ *
  * @param context The current krb5 context
  * @param db      Heimdal database handle
  * @param flags
  * @param mode_t
  *
- * @return        Always returns 0
+ * @return        0 on success, an error code if not
  */
 static krb5_error_code
 hdb_sqlite_open(krb5_context context, HDB *db, int flags, mode_t mode)
 {
-    return 0;
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *) db->hdb_db;
+    krb5_error_code ret;
+
+    if (hsdb->db != NULL && hsdb->pid == getpid())
+        return 0;
+
+    finalize_stmts(context, hsdb);
+    hsdb->db = NULL;
+    ret = hdb_sqlite_open_database(context, db, 0);
+    if (ret == 0)
+        ret = prep_stmts(context, hsdb);
+    if (ret) {
+        finalize_stmts(context, hsdb);
+        if (hsdb->db)
+            sqlite3_close(hsdb->db);
+        hsdb->db = NULL;
+    }
+    return ret;
 }
 
 /**
@@ -869,19 +1025,21 @@ hdb_sqlite_nextkey(krb5_context context, HDB *db, unsigned flags,
     krb5_data value;
 
     hdb_sqlite_db *hsdb = (hdb_sqlite_db *) db->hdb_db;
+    sqlite3_stmt *all = hsdb->sharded ? hsdb->get_shard_entries :
+                                        hsdb->get_all_entries;
 
-    sqlite_error = hdb_sqlite_step(context, hsdb->db, hsdb->get_all_entries);
+    sqlite_error = hdb_sqlite_step(context, hsdb->db, all);
     if(sqlite_error == SQLITE_ROW) {
 	/* Found an entry */
-        value.length = sqlite3_column_bytes(hsdb->get_all_entries, 0);
-        value.data = (void *) sqlite3_column_blob(hsdb->get_all_entries, 0);
+        value.length = sqlite3_column_bytes(all, 0);
+        value.data = (void *) sqlite3_column_blob(all, 0);
         memset(entry, 0, sizeof(*entry));
         ret = hdb_value2entry(context, &value, &entry->entry);
     }
     else if(sqlite_error == SQLITE_DONE) {
 	/* No more entries */
         ret = HDB_ERR_NOENTRY;
-        sqlite3_reset(hsdb->get_all_entries);
+        sqlite3_reset(all);
     }
     else {
         ret = HDB_ERR_UK_RERROR;
@@ -905,7 +1063,13 @@ hdb_sqlite_firstkey(krb5_context context, HDB *db, unsigned flags,
     hdb_sqlite_db *hsdb = (hdb_sqlite_db *) db->hdb_db;
     krb5_error_code ret;
 
-    sqlite3_reset(hsdb->get_all_entries);
+    if (hsdb->sharded) {
+        sqlite3_reset(hsdb->get_shard_entries);
+        sqlite3_bind_int64(hsdb->get_shard_entries, 1, hsdb->shard_first);
+        sqlite3_bind_int64(hsdb->get_shard_entries, 2, hsdb->shard_count);
+    } else {
+        sqlite3_reset(hsdb->get_all_entries);
+    }
 
     ret = hdb_sqlite_nextkey(context, db, flags, entry);
     if(ret)
@@ -914,6 +1078,75 @@ hdb_sqlite_firstkey(krb5_context context, HDB *db, unsigned flags,
     return 0;
 }
 
+/*
+ * Runs a query returning one integer, with an optional integer parameter.
+ */
+static krb5_error_code
+hdb_sqlite_get_int64(krb5_context context, hdb_sqlite_db *hsdb,
+                     const char *sql, int nargs, sqlite3_int64 arg,
+                     sqlite3_int64 *value)
+{
+    sqlite3_stmt *stmt;
+    krb5_error_code ret;
+    int sqlite_error;
+
+    ret = hdb_sqlite_prepare_stmt(context, hsdb->db, &stmt, sql);
+    if (ret)
+        return ret;
+    if (nargs)
+        sqlite3_bind_int64(stmt, 1, arg);
+    sqlite_error = hdb_sqlite_step(context, hsdb->db, stmt);
+    if (sqlite_error == SQLITE_ROW) {
+        *value = sqlite3_column_int64(stmt, 0);
+    } else if (sqlite_error == SQLITE_DONE) {
+        ret = HDB_ERR_NOENTRY;
+    } else {
+        ret = HDB_ERR_UK_RERROR;
+        krb5_set_error_message(context, ret, "%s failed: %s", sql,
+                               sqlite3_errmsg(hsdb->db));
+    }
+    sqlite3_finalize(stmt);
+    return ret;
+}
+
+/*
+ * Restricts iteration to a contiguous range of Entry ids holding about
+ * 1/nshards of the entries.
+ */
+static krb5_error_code
+hdb_sqlite_set_shard(krb5_context context, HDB *db,
+                     unsigned int shard, unsigned int nshards)
+{
+    hdb_sqlite_db *hsdb = (hdb_sqlite_db *) db->hdb_db;
+    sqlite3_int64 n, start;
+    krb5_error_code ret;
+
+    hsdb->sharded = 0;
+    if (nshards < 2)
+        return 0;
+
+    ret = hdb_sqlite_get_int64(context, hsdb, HDBSQLITE_COUNT_ENTRIES,
+                               0, 0, &n);
+    if (ret)
+        return ret;
+    start = n * shard / nshards;
+    hsdb->shard_count = n * (shard + 1) / nshards - start;
+    hsdb->shard_first = 0;
+    if (hsdb->shard_count > 0) {
+        ret = hdb_sqlite_get_int64(context, hsdb, HDBSQLITE_GET_NTH_ENTRY_ID,
+                                   1, start, &hsdb->shard_first);
+        if (ret == HDB_ERR_NOENTRY) {
+            /* Entries removed since we counted them */
+            hsdb->shard_count = 0;
+            ret = 0;
+        }
+        if (ret)
+            return ret;
+    }
+    hsdb->sharded = 1;
+    return 0;
+}
+
 /*
  * Renames the database file.
  */
@@ -952,12 +1185,10 @@ hdb_sqlite_remove(krb5_context context, HDB *db,
 
     bind_principal(context, principal, rm, 1);
 
-    ret = hdb_sqlite_exec_stmt(context, hsdb,
-                               "BEGIN IMMEDIATE TRANSACTION",
-                               HDB_ERR_UK_SERROR);
+    ret = hdb_sqlite_begin_op(context, hsdb);
     if (ret != SQLITE_OK) {
 	ret = HDB_ERR_UK_SERROR;
-        (void) hdb_sqlite_exec_stmt(context, hsdb, "ROLLBACK", 0);
+        (void) hdb_sqlite_rollback_op(context, hsdb);
         krb5_set_error_message(context, ret,
 			       "SQLite BEGIN TRANSACTION failed: %s",
 			       sqlite3_errmsg(hsdb->db));
@@ -973,7 +1204,7 @@ hdb_sqlite_remove(krb5_context context, HDB *db,
         sqlite3_clear_bindings(get_ids);
         sqlite3_reset(get_ids);
         if (ret == SQLITE_DONE) {
-            (void) hdb_sqlite_exec_stmt(context, hsdb, "ROLLBACK", 0);
+            (void) hdb_sqlite_rollback_op(context, hsdb);
             return HDB_ERR_NOENTRY;
         }
     }
@@ -982,18 +1213,18 @@ hdb_sqlite_remove(krb5_context context, HDB *db,
     sqlite3_clear_bindings(rm);
     sqlite3_reset(rm);
     if (ret != SQLITE_DONE) {
-        (void) hdb_sqlite_exec_stmt(context, hsdb, "ROLLBACK", 0);
+        (void) hdb_sqlite_rollback_op(context, hsdb);
 	ret = HDB_ERR_UK_SERROR;
         krb5_set_error_message(context, ret, "sqlite remove failed: %d", ret);
         return ret;
     }
 
     if ((flags & HDB_F_PRECHECK)) {
-        (void) hdb_sqlite_exec_stmt(context, hsdb, "ROLLBACK", 0);
+        (void) hdb_sqlite_rollback_op(context, hsdb);
         return 0;
     }
 
-    ret = hdb_sqlite_exec_stmt(context, hsdb, "COMMIT", HDB_ERR_UK_SERROR);
+    ret = hdb_sqlite_commit_op(context, hsdb);
     if (ret != SQLITE_OK)
 	krb5_warnx(context, "hdb-sqlite: COMMIT problem: %ld: %s",
 		   (long)HDB_ERR_UK_SERROR, sqlite3_errmsg(hsdb->db));
@@ -1064,6 +1295,9 @@ hdb_sqlite_create(krb5_context context, HDB **db, const char *filename)
     (*db)->hdb_destroy = hdb_sqlite_destroy;
     (*db)->hdb_rename = hdb_sqlite_rename;
     (*db)->hdb_set_sync = hdb_sqlite_set_sync;
+    (*db)->hdb_begin_batch = hdb_sqlite_begin_batch;
+    (*db)->hdb_end_batch = hdb_sqlite_end_batch;
+    (*db)->hdb_set_shard = hdb_sqlite_set_shard;
     (*db)->hdb__get = NULL;
     (*db)->hdb__put = NULL;
     (*db)->hdb__del = NULL;
@@ -90,6 +90,7 @@ static struct hdb_method methods[] = {
 #ifdef HAVE_SQLITE3
     { HDB_INTERFACE_VERSION, 1, 1, NULL, NULL, "sqlite:", hdb_sqlite_create},
 #endif
+    { HDB_INTERFACE_VERSION, 1, 1, NULL, NULL, "flat:",	hdb_flat_create},
     /* The keytab interface can't use its hdb_open() method to "taste" a DB */
     { HDB_INTERFACE_VERSION, 1, 0, NULL, NULL, "keytab:",	hdb_keytab_create},
     /* The rest are not file-based */
@@ -439,6 +440,88 @@ hdb_foreach(krb5_context context,
     return ret;
 }
 
+/**
+ * Like hdb_foreach(), but only for one of several shards of the
+ * database, so that the shards can be iterated in parallel, each through
+ * its own handle.  Iterating shards 0 to nshards - 1 in turn visits the
+ * entries in the same order as hdb_foreach().  Backends that cannot
+ * shard put every entry in shard 0.
+ *
+ * Each shard is iterated as of when its iteration starts, so entries
+ * stored or removed meanwhile may be missed or seen twice.
+ *
+ * @param context Kerberos 5 context
+ * @param db database handle
+ * @param flags as for hdb_foreach()
+ * @param shard shard to iterate, from 0 to nshards - 1
+ * @param nshards number of shards
+ * @param func function to call for each entry
+ * @param data argument for func
+ *
+ * @return 0 on success, an error code if not
+ */
+krb5_error_code
+hdb_foreach_shard(krb5_context context,
+		  HDB *db,
+		  unsigned flags,
+		  unsigned int shard,
+		  unsigned int nshards,
+		  hdb_foreach_func_t func,
+		  void *data)
+{
+    krb5_error_code ret, ret2;
+
+    if (nshards < 2 || db->hdb_set_shard == NULL)
+	return shard == 0 ? hdb_foreach(context, db, flags, func, data) : 0;
+    if (shard >= nshards)
+	return EINVAL;
+
+    ret = db->hdb_set_shard(context, db, shard, nshards);
+    if (ret)
+	return ret;
+    ret = hdb_foreach(context, db, flags, func, data);
+    ret2 = db->hdb_set_shard(context, db, 0, 1);
+    return ret ? ret : ret2;
+}
+
+/**
+ * Begin a batch of stores and removals on an open database.  Backends
+ * that support it perform the whole batch as one transaction, which is
+ * much faster than one per entry when loading many entries; for other
+ * backends this does nothing.  Each hdb_begin_batch() must be followed
+ * by hdb_end_batch().
+ *
+ * @param context Kerberos 5 context
+ * @param db database handle
+ *
+ * @return 0 on success, an error code if not
+ */
+krb5_error_code
+hdb_begin_batch(krb5_context context, HDB *db)
+{
+    if (db->hdb_begin_batch == NULL)
+	return 0;
+    return db->hdb_begin_batch(context, db);
+}
+
+/**
+ * End a batch of stores and removals started with hdb_begin_batch().
+ *
+ * @param context Kerberos 5 context
+ * @param db database handle
+ * @param commit non-zero to commit the batch, zero to abandon it (where
+ * the backend can)
+ *
+ * @return 0 on success, an error code if not
+ */
+krb5_error_code
+hdb_end_batch(krb5_context context, HDB *db, int commit)
+{
+    if (db->hdb_end_batch == NULL)
+	return 0;
+    return db->hdb_end_batch(context, db, commit);
+}
+
 krb5_error_code
 hdb_check_db_format(krb5_context context, HDB *db)
 {
@@ -701,6 +784,9 @@ load_config(krb5_context context, HDB *db)
     db->new_service_key_delay =
         krb5_config_get_time_default(context, NULL, 0, "hdb",
                                      "new_service_key_delay", NULL);
+    _hdb_set_derived_keyset_cache_size(
+        krb5_config_get_int_default(context, NULL, 0, "hdb",
+                                    "derived_keyset_cache_size", NULL));
     /*
      * XXX Needs freeing in the HDB backends because we don't have a
      * first-class hdb_close() :(
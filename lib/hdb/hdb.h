@@ -116,6 +116,18 @@ typedef struct hdb_entry_ex {
 } hdb_entry_ex;
 
 
+/**
+ * One lookup of a batch for hdb_fetch_kvno_multi()
+ */
+
+struct hdb_fetch_req {
+    krb5_const_principal principal; /* Principal name */
+    unsigned int flags;             /* Fetch flags */
+    krb5uint32 kvno;                /* Key version number, or zero */
+    hdb_entry_ex *entry;            /* Output HDB entry */
+    krb5_error_code ret;            /* Output result of this lookup */
+};
+
 /**
  * HDB backend function pointer structure
  *
@@ -313,9 +325,64 @@ typedef struct HDB {
      * sync and does an fsync().
      */
     krb5_error_code (*hdb_set_sync)(krb5_context, struct HDB *, int);
+
+    /**
+     * Begin a batch of stores and removals
+     *
+     * Optional.  Backends that have transactions perform all the stores
+     * and removals until ->hdb_end_batch() in one, which makes bulk loads
+     * much faster.  Use hdb_begin_batch() rather than calling this
+     * directly.
+     */
+    krb5_error_code (*hdb_begin_batch)(krb5_context, struct HDB *);
+
+    /**
+     * End a batch of stores and removals
+     *
+     * Commits the batch if the third argument is non-zero, or else
+     * abandons it.  Use hdb_end_batch() rather than calling this directly.
+     */
+    krb5_error_code (*hdb_end_batch)(krb5_context, struct HDB *, int);
+
+    /**
+     * Restrict iteration to one shard of the database
+     *
+     * Optional.  Makes ->hdb_firstkey() and ->hdb_nextkey() iterate only
+     * the entries of the shard given by the third argument, numbered from
+     * 0, of the number of shards given by the fourth.  Shards are
+     * contiguous, roughly equal ranges of the backend's iteration order,
+     * so iterating them in turn visits the entries in the same order as
+     * iterating the whole database.  One shard means the whole database.
+     * Use hdb_foreach_shard() rather than calling this directly.
+     */
+    krb5_error_code (*hdb_set_shard)(krb5_context, struct HDB *,
+                                     unsigned int, unsigned int);
+
+    /**
+     * Fetch several entries at once
+     *
+     * Optional.  Does what ->hdb_fetch_kvno() would do for each of the
+     * requests given by the third and fourth arguments, setting each
+     * request's result and, where that is zero, its entry.  Backends
+     * that talk to a server issue the lookups concurrently or as one
+     * query.  Returns non-zero, with no entries fetched, if the batch
+     * could not be run, in which case the caller looks each principal up
+     * with ->hdb_fetch_kvno().  Use hdb_fetch_kvno_multi() rather than
+     * calling this directly.
+     */
+    krb5_error_code (*hdb_fetch_kvno_multi)(krb5_context, struct HDB *,
+                                            struct hdb_fetch_req *, size_t);
+
+    /**
+     * Index of aliases to the principals they name ([hdb] alias_index)
+     *
+     * Private to libhdb; set up on first use by backends that use
+     * _hdb_fetch_kvno() and freed by their ->hdb_destroy().
+     */
+    struct hdb_alias_index *hdb_alias_index;
 }HDB;
 
-#define HDB_INTERFACE_VERSION	11
+#define HDB_INTERFACE_VERSION	12
 
 struct hdb_method {
     int			version;
@@ -0,0 +1,608 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A benchmark for HDB backends, in the same vein as test_concurrency, but
+ * rather than checking that readers and writers make progress this drives N
+ * threads or processes doing a weighted random mix of fetches, stores, and
+ * partial iterations against any HDB and reports throughput and latency
+ * percentiles for each kind of operation.
+ *
+ * Each worker opens its own HDB handle, as the KDC does.  Principals are
+ * named bench<N>@<realm>, and --populate creates them before the run.
+ *
+ * This is not a test -- it's a manual utility:
+ *
+ *  $ ./hdb_bench --populate --principals=10000 --threads=8 \
+ *      --seconds=30 mdb:/var/tmp/bench-hdb
+ *  $ ./hdb_bench --processes=8 --store-weight=0 db3:/var/heimdal/heimdal
+ */
+
+#include "hdb_locl.h"
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <getarg.h>
+
+enum bench_op { OP_FETCH, OP_STORE, OP_ITERATE, OP_MAX };
+
+static const char *op_names[OP_MAX] = { "fetch", "store", "iterate" };
+
+struct op_stats {
+    uint64_t count;
+    uint64_t misses;
+    uint64_t errors;
+    uint32_t *lat;      /* latencies, in microseconds */
+    size_t nlat;
+    size_t alloced;
+};
+
+struct worker {
+    const char *hdb_name;
+    unsigned int idx;
+    uint32_t rnd;
+    pthread_t thread;
+    pid_t pid;
+    int fd;             /* read end of the pipe from a forked worker */
+    double elapsed;     /* seconds */
+    struct op_stats st[OP_MAX];
+};
+
+static char *realm_str = "BENCH.H5L.SE";
+static int nprincipals = 1000;
+static int nthreads = 0;
+static int nprocesses = 0;
+static int seconds = 10;
+static int operations = 0;
+static int weights[OP_MAX] = { 90, 9, 1 };
+static int iterate_count = 100;
+static int populate_flag;
+static int help_flag;
+static int version_flag;
+
+static uint32_t
+bench_random(struct worker *w)
+{
+    /* xorshift32; good enough to pick ops and principals */
+    w->rnd ^= w->rnd << 13;
+    w->rnd ^= w->rnd >> 17;
+    w->rnd ^= w->rnd << 5;
+    return w->rnd;
+}
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+record(struct op_stats *st, double start, double end)
+{
+    double us = (end - start) * 1000000.0;
+
+    st->count++;
+    if (st->nlat == st->alloced) {
+        size_t n = st->alloced ? st->alloced * 2 : 4096;
+        uint32_t *tmp = realloc(st->lat, n * sizeof(st->lat[0]));
+
+        if (tmp == NULL)
+            err(1, "Out of memory");
+        st->lat = tmp;
+        st->alloced = n;
+    }
+    st->lat[st->nlat++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+static krb5_error_code
+make_entry(krb5_context context, hdb_entry_ex *entry, unsigned int n)
+{
+    krb5_error_code ret;
+    char name[32];
+
+    memset(entry, 0, sizeof(*entry));
+    snprintf(name, sizeof(name), "bench%u", n);
+    entry->entry.kvno = 1;
+    entry->entry.created_by.time = time(NULL);
+    entry->entry.flags.client = 1;
+    entry->entry.flags.server = 1;
+    if ((ret = krb5_make_principal(context, &entry->entry.principal,
+                                   realm_str, name, NULL)))
+        return ret;
+    if ((ret = krb5_make_principal(context, &entry->entry.created_by.principal,
+                                   realm_str, "hdb_bench", NULL)))
+        return ret;
+    if ((entry->entry.keys.val = calloc(1, sizeof(Key))) == NULL)
+        return krb5_enomem(context);
+    entry->entry.keys.len = 1;
+    return krb5_generate_random_keyblock(context,
+                                         ETYPE_AES256_CTS_HMAC_SHA1_96,
+                                         &entry->entry.keys.val[0].key);
+}
+
+static enum bench_op
+pick_op(struct worker *w)
+{
+    int total = weights[OP_FETCH] + weights[OP_STORE] + weights[OP_ITERATE];
+    int r = bench_random(w) % total;
+
+    if (r < weights[OP_FETCH])
+        return OP_FETCH;
+    if (r < weights[OP_FETCH] + weights[OP_STORE])
+        return OP_STORE;
+    return OP_ITERATE;
+}
+
+static krb5_error_code
+do_fetch(krb5_context context, HDB *db, struct worker *w)
+{
+    krb5_error_code ret;
+    krb5_principal p = NULL;
+    hdb_entry_ex ent;
+    char name[32];
+
+    memset(&ent, 0, sizeof(ent));
+    snprintf(name, sizeof(name), "bench%u",
+             (unsigned)(bench_random(w) % nprincipals));
+    if ((ret = krb5_make_principal(context, &p, realm_str, name, NULL)))
+        return ret;
+    ret = db->hdb_fetch_kvno(context, db, p,
+                             HDB_F_DECRYPT | HDB_F_GET_CLIENT, 0, &ent);
+    if (ret == 0)
+        hdb_free_entry(context, &ent);
+    krb5_free_principal(context, p);
+    return ret;
+}
+
+static krb5_error_code
+do_store(krb5_context context, HDB *db, struct worker *w)
+{
+    krb5_error_code ret;
+    hdb_entry_ex ent;
+
+    ret = make_entry(context, &ent, bench_random(w) % nprincipals);
+    if (ret == 0)
+        ret = db->hdb_store(context, db, HDB_F_REPLACE, &ent);
+    free_HDB_entry(&ent.entry);
+    return ret;
+}
+
+static krb5_error_code
+do_iterate(krb5_context context, HDB *db)
+{
+    krb5_error_code ret;
+    hdb_entry_ex ent;
+    int i;
+
+    memset(&ent, 0, sizeof(ent));
+    ret = db->hdb_firstkey(context, db, 0, &ent);
+    for (i = 1; ret == 0; i++) {
+        hdb_free_entry(context, &ent);
+        if (i >= iterate_count)
+            break;
+        ret = db->hdb_nextkey(context, db, 0, &ent);
+    }
+    return ret == HDB_ERR_NOENTRY ? 0 : ret;
+}
+
+static void
+run_worker(struct worker *w)
+{
+    krb5_error_code ret;
+    krb5_context context;
+    HDB *db = NULL;
+    uint64_t done = 0;
+    double start, end, t0, t1;
+
+    if ((krb5_init_context(&context)))
+	errx(1, "krb5_init_context failed");
+    if ((ret = hdb_create(context, &db, w->hdb_name)))
+        krb5_err(context, 1, ret, "Could not get a handle for HDB %s",
+                 w->hdb_name);
+    if ((ret = hdb_set_master_keyfile(context, db, NULL)))
+        krb5_err(context, 1, ret, "Could not set master key file");
+    if ((ret = db->hdb_open(context, db,
+                            weights[OP_STORE] ? O_RDWR : O_RDONLY, 0)))
+        krb5_err(context, 1, ret, "Could not open HDB %s", w->hdb_name);
+
+    start = now();
+    end = start + seconds;
+    for (;;) {
+        enum bench_op op;
+
+        if (operations) {
+            if (done >= (uint64_t)operations)
+                break;
+        } else if ((done & 0x3f) == 0 && now() >= end) {
+            break;
+        }
+
+        op = pick_op(w);
+        t0 = now();
+        switch (op) {
+        case OP_FETCH:   ret = do_fetch(context, db, w); break;
+        case OP_STORE:   ret = do_store(context, db, w); break;
+        default:         ret = do_iterate(context, db); break;
+        }
+        t1 = now();
+        record(&w->st[op], t0, t1);
+        if (ret == HDB_ERR_NOENTRY)
+            w->st[op].misses++;
+        else if (ret)
+            w->st[op].errors++;
+        done++;
+    }
+    w->elapsed = now() - start;
+
+    db->hdb_close(context, db);
+    db->hdb_destroy(context, db);
+    krb5_free_context(context);
+}
+
+static void *
+threaded_worker(void *d)
+{
+    run_worker(d);
+    return NULL;
+}
+
+static void
+write_all(int fd, const void *p, size_t len)
+{
+    const unsigned char *b = p;
+    ssize_t bytes;
+
+    while (len) {
+        while ((bytes = write(fd, b, len)) == -1 && errno == EINTR)
+            ;
+        if (bytes <= 0)
+            err(1, "Could not write results to parent");
+        b += bytes;
+        len -= bytes;
+    }
+}
+
+static void
+read_all(int fd, void *p, size_t len)
+{
+    unsigned char *b = p;
+    ssize_t bytes;
+
+    while (len) {
+        while ((bytes = read(fd, b, len)) == -1 && errno == EINTR)
+            ;
+        if (bytes == -1)
+            err(1, "Could not read results from worker");
+        if (bytes == 0)
+            errx(1, "Worker died before reporting results");
+        b += bytes;
+        len -= bytes;
+    }
+}
+
+/*
+ * Forked workers send back their elapsed time, then for each op the
+ * counters followed by the latency array.
+ */
+static void
+send_results(int fd, struct worker *w)
+{
+    size_t i;
+
+    write_all(fd, &w->elapsed, sizeof(w->elapsed));
+    for (i = 0; i < OP_MAX; i++) {
+        write_all(fd, &w->st[i].count, sizeof(w->st[i].count));
+        write_all(fd, &w->st[i].misses, sizeof(w->st[i].misses));
+        write_all(fd, &w->st[i].errors, sizeof(w->st[i].errors));
+        write_all(fd, &w->st[i].nlat, sizeof(w->st[i].nlat));
+        if (w->st[i].nlat)
+            write_all(fd, w->st[i].lat, w->st[i].nlat * sizeof(w->st[i].lat[0]));
+    }
+}
+
+static void
+recv_results(int fd, struct worker *w)
+{
+    size_t i;
+
+    read_all(fd, &w->elapsed, sizeof(w->elapsed));
+    for (i = 0; i < OP_MAX; i++) {
+        read_all(fd, &w->st[i].count, sizeof(w->st[i].count));
+        read_all(fd, &w->st[i].misses, sizeof(w->st[i].misses));
+        read_all(fd, &w->st[i].errors, sizeof(w->st[i].errors));
+        read_all(fd, &w->st[i].nlat, sizeof(w->st[i].nlat));
+        if (w->st[i].nlat == 0)
+            continue;
+        w->st[i].alloced = w->st[i].nlat;
+        if ((w->st[i].lat = calloc(w->st[i].nlat,
+                                   sizeof(w->st[i].lat[0]))) == NULL)
+            err(1, "Out of memory");
+        read_all(fd, w->st[i].lat, w->st[i].nlat * sizeof(w->st[i].lat[0]));
+    }
+}
+
+static void
+populate(krb5_context context, const char *hdb_name)
+{
+    krb5_error_code ret;
+    hdb_entry_ex ent;
+    HDB *db = NULL;
+    int i;
+
+    printf("Populating %s with %d principals\n", hdb_name, nprincipals);
+    if ((ret = hdb_create(context, &db, hdb_name)))
+        krb5_err(context, 1, ret, "Could not get a handle for HDB %s",
+                 hdb_name);
+    if ((ret = hdb_set_master_keyfile(context, db, NULL)))
+        krb5_err(context, 1, ret, "Could not set master key file");
+    if ((ret = db->hdb_open(context, db, O_RDWR | O_CREAT, 0600)))
+        krb5_err(context, 1, ret, "Could not create HDB %s", hdb_name);
+    if ((ret = hdb_begin_batch(context, db)))
+        krb5_err(context, 1, ret, "Could not start a batch on HDB %s",
+                 hdb_name);
+    for (i = 0; i < nprincipals; i++) {
+        if ((ret = make_entry(context, &ent, i)) ||
+            (ret = db->hdb_store(context, db, HDB_F_REPLACE, &ent)))
+            krb5_err(context, 1, ret, "Could not store bench%d in HDB %s",
+                     i, hdb_name);
+        free_HDB_entry(&ent.entry);
+    }
+    if ((ret = hdb_end_batch(context, db, 1)))
+        krb5_err(context, 1, ret, "Could not commit batch to HDB %s",
+                 hdb_name);
+    db->hdb_close(context, db);
+    db->hdb_destroy(context, db);
+}
+
+static int
+lat_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t
+percentile(const uint32_t *lat, size_t n, unsigned int pct)
+{
+    size_t i = (n * pct + 99) / 100;
+
+    return lat[i ? i - 1 : 0];
+}
+
+static void
+report(struct worker *workers, size_t nworkers)
+{
+    uint64_t total = 0;
+    double elapsed = 0;
+    size_t i, k;
+
+    for (k = 0; k < nworkers; k++)
+        if (workers[k].elapsed > elapsed)
+            elapsed = workers[k].elapsed;
+    if (elapsed <= 0)
+        elapsed = 1e-6;
+
+    printf("%-8s %10s %8s %8s %12s %8s %8s %8s %8s\n",
+           "op", "count", "misses", "errors", "ops/s",
+           "p50us", "p90us", "p99us", "maxus");
+    for (i = 0; i < OP_MAX; i++) {
+        struct op_stats all;
+
+        memset(&all, 0, sizeof(all));
+        for (k = 0; k < nworkers; k++) {
+            all.count += workers[k].st[i].count;
+            all.misses += workers[k].st[i].misses;
+            all.errors += workers[k].st[i].errors;
+            all.nlat += workers[k].st[i].nlat;
+        }
+        total += all.count;
+        if (all.nlat == 0)
+            continue;
+        if ((all.lat = calloc(all.nlat, sizeof(all.lat[0]))) == NULL)
+            err(1, "Out of memory");
+        for (k = 0; k < nworkers; k++) {
+            if (workers[k].st[i].nlat == 0)
+                continue;
+            memcpy(all.lat + all.alloced, workers[k].st[i].lat,
+                   workers[k].st[i].nlat * sizeof(all.lat[0]));
+            all.alloced += workers[k].st[i].nlat;
+        }
+        qsort(all.lat, all.nlat, sizeof(all.lat[0]), lat_cmp);
+        printf("%-8s %10llu %8llu %8llu %12.1f %8u %8u %8u %8u\n",
+               op_names[i], (unsigned long long)all.count,
+               (unsigned long long)all.misses,
+               (unsigned long long)all.errors, all.count / elapsed,
+               percentile(all.lat, all.nlat, 50),
+               percentile(all.lat, all.nlat, 90),
+               percentile(all.lat, all.nlat, 99),
+               all.lat[all.nlat - 1]);
+        free(all.lat);
+    }
+    printf("total    %10llu ops in %.2fs with %lu %s: %.1f ops/s\n",
+           (unsigned long long)total, elapsed, (unsigned long)nworkers,
+           nprocesses ? "processes" : "threads", total / elapsed);
+}
+
+struct getargs args[] = {
+    { "threads",	't',	arg_integer, &nthreads,
+	"number of worker threads", "N" },
+    { "processes",	'p',	arg_integer, &nprocesses,
+	"number of worker processes", "N" },
+    { "seconds",	's',	arg_integer, &seconds,
+	"how long to run for", "seconds" },
+    { "operations",	'n',	arg_integer, &operations,
+	"operations per worker (overrides --seconds)", "N" },
+    { "fetch-weight",	0,	arg_integer, &weights[OP_FETCH],
+	"relative weight of fetches", "weight" },
+    { "store-weight",	0,	arg_integer, &weights[OP_STORE],
+	"relative weight of stores", "weight" },
+    { "iterate-weight",	0,	arg_integer, &weights[OP_ITERATE],
+	"relative weight of iterations", "weight" },
+    { "iterate-count",	0,	arg_integer, &iterate_count,
+	"entries visited per iteration", "N" },
+    { "principals",	0,	arg_integer, &nprincipals,
+	"number of bench principals", "N" },
+    { "realm",		'r',	arg_string, &realm_str,
+	"realm of the bench principals", "realm" },
+    { "populate",	0,	arg_flag,   &populate_flag,
+	"create the bench principals first", NULL },
+    { "help",		'h',	arg_flag,   &help_flag,    NULL, NULL },
+    { "version",	0,	arg_flag,   &version_flag, NULL, NULL }
+};
+
+static int num_args = sizeof(args) / sizeof(args[0]);
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    struct worker *workers;
+    const char *hdb_name;
+    size_t nworkers, k;
+    int o = 0;
+
+    setprogname(argv[0]);
+
+    if (getarg(args, num_args, argc, argv, &o))
+	krb5_std_usage(1, args, num_args);
+
+    if (help_flag)
+	krb5_std_usage(0, args, num_args);
+
+    if (version_flag){
+	print_version(NULL);
+	return 0;
+    }
+
+    argc -= o;
+    argv += o;
+    if (argc != 1)
+	krb5_std_usage(1, args, num_args);
+    hdb_name = argv[0];
+
+    if (nthreads && nprocesses)
+        errx(1, "--threads and --processes are mutually exclusive");
+    if (nthreads < 0 || nprocesses < 0 || seconds <= 0 || operations < 0 ||
+        nprincipals <= 0 || iterate_count <= 0 ||
+        weights[OP_FETCH] < 0 || weights[OP_STORE] < 0 ||
+        weights[OP_ITERATE] < 0 ||
+        weights[OP_FETCH] + weights[OP_STORE] + weights[OP_ITERATE] <= 0)
+        errx(1, "Invalid arguments");
+#ifndef HAVE_FORK
+    if (nprocesses)
+        errx(1, "--processes is not supported on this platform");
+#endif
+    nworkers = nprocesses ? nprocesses : (nthreads ? nthreads : 1);
+
+    if ((krb5_init_context(&context)))
+	errx(1, "krb5_init_context failed");
+    if (populate_flag)
+        populate(context, hdb_name);
+
+    if ((workers = calloc(nworkers, sizeof(workers[0]))) == NULL)
+        err(1, "Out of memory");
+    for (k = 0; k < nworkers; k++) {
+        workers[k].hdb_name = hdb_name;
+        workers[k].idx = k;
+        workers[k].rnd = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 8) ^
+            ((k + 1) * 2654435761U);
+        if (workers[k].rnd == 0)
+            workers[k].rnd = 1;
+        workers[k].fd = -1;
+    }
+
+    printf("Running %lu %s against %s for %d %s\n",
+           (unsigned long)nworkers, nprocesses ? "processes" : "threads",
+           hdb_name, operations ? operations : seconds,
+           operations ? "operations each" : "seconds");
+
+    for (k = 0; k < nworkers; k++) {
+        if (nprocesses) {
+#ifdef HAVE_FORK
+            int fds[2];
+
+            if (pipe(fds) == -1)
+                err(1, "Could not create a pipe");
+            switch ((workers[k].pid = fork())) {
+            case -1: err(1, "Could not fork a worker");
+            case  0:
+                (void) close(fds[0]);
+                run_worker(&workers[k]);
+                send_results(fds[1], &workers[k]);
+                _exit(0);
+            default: break;
+            }
+            (void) close(fds[1]);
+            workers[k].fd = fds[0];
+#endif
+        } else if ((errno = pthread_create(&workers[k].thread, NULL,
+                                           threaded_worker, &workers[k]))) {
+            krb5_err(context, 1, errno, "Could not create a worker thread");
+        }
+    }
+
+    for (k = 0; k < nworkers; k++) {
+        if (nprocesses) {
+#ifdef HAVE_FORK
+            int status;
+
+            recv_results(workers[k].fd, &workers[k]);
+            (void) close(workers[k].fd);
+            while (waitpid(workers[k].pid, &status, 0) == -1 &&
+                   errno == EINTR)
+                ;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                errx(1, "Worker process %lu failed", (unsigned long)k);
+#endif
+        } else {
+            (void) pthread_join(workers[k].thread, NULL);
+        }
+    }
+
+    report(workers, nworkers);
+
+    for (k = 0; k < nworkers; k++) {
+        size_t i;
+
+        for (i = 0; i < OP_MAX; i++)
+            free(workers[k].st[i].lat);
+    }
+    free(workers);
+    krb5_free_context(context);
+    return 0;
+}
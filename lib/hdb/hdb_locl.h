@@ -40,6 +40,7 @@
 
 #include <assert.h>
 #include <heimbase.h>
+#include <heimbase-probes.h>
 
 #include <stdio.h>
 #include <string.h>
@@ -65,6 +66,12 @@
 #include "crypto-headers.h"
 #include <krb5.h>
 #include <hdb.h>
+
+/* Get and decode the HDB_EntryOrAlias stored under a key; see common.c */
+typedef krb5_error_code (*hdb_get_entry_or_alias_f)(krb5_context, HDB *,
+                                                    krb5_data,
+                                                    HDB_EntryOrAlias *);
+
 #include <hdb-private.h>
 
 #define HDB_DEFAULT_DB HDB_DB_DIR "/heimdal"
@@ -810,29 +810,64 @@ hdb_generate_key_set_password_with_ks_tuple(krb5_context context,
 					    Key **keys, size_t *num_keys)
 {
     krb5_error_code ret;
-    size_t i;
+    krb5_enctype *enctypes = NULL;
+    krb5_keyblock *blocks = NULL;
+    size_t *idx = NULL;
+    krb5_data pw, opaque;
+    size_t i, j, n;
 
     ret = hdb_generate_key_set(context, principal, ks_tuple, n_ks_tuple,
 				keys, num_keys, 0);
     if (ret)
 	return ret;
 
-    for (i = 0; i < (*num_keys); i++) {
+    pw.data = rk_UNCONST(password);
+    pw.length = strlen(password);
+    krb5_data_zero(&opaque);
+
+    enctypes = calloc(*num_keys, sizeof(enctypes[0]));
+    blocks = calloc(*num_keys, sizeof(blocks[0]));
+    idx = calloc(*num_keys, sizeof(idx[0]));
+    if (enctypes == NULL || blocks == NULL || idx == NULL)
+	ret = krb5_enomem(context);
+
+    /*
+     * Keys with the same salt are made in one call, which lets
+     * enctypes share string-to-key work.  A key still without a value
+     * has not been made yet.
+     */
+    for (i = 0; ret == 0 && i < (*num_keys); i++) {
 	krb5_salt salt;
 	Key *key = &(*keys)[i];
 
+	if (key->key.keyvalue.data != NULL)
+	    continue;
+
+	for (n = 0, j = i; j < (*num_keys); j++) {
+	    Key *k = &(*keys)[j];
+
+	    if (k->key.keyvalue.data != NULL ||
+		k->salt->type != key->salt->type ||
+		der_heim_octet_string_cmp(&k->salt->salt, &key->salt->salt))
+		continue;
+	    idx[n] = j;
+	    enctypes[n++] = k->key.keytype;
+	}
+
 	salt.salttype = key->salt->type;
 	salt.saltvalue.length = key->salt->salt.length;
 	salt.saltvalue.data = key->salt->salt.data;
 
-	ret = krb5_string_to_key_salt (context,
-				       key->key.keytype,
-				       password,
-				       salt,
-				       &key->key);
-	if(ret)
+	ret = krb5_string_to_keys_data_salt_opaque(context, n, enctypes,
+						   pw, salt, opaque, blocks);
+	if (ret)
 	    break;
+	for (j = 0; j < n; j++)
+	    (*keys)[idx[j]].key = blocks[j];
     }
+    free(enctypes);
+    free(blocks);
+    free(idx);
 
     if(ret) {
 	hdb_free_keys (context, *num_keys, *keys);
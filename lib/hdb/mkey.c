@@ -41,6 +41,7 @@ struct hdb_master_key_data {
     krb5_crypto crypto;
     struct hdb_master_key_data *next;
     unsigned int key_usage;
+    unsigned int unseal_usage;	/* key usage that last unsealed a key */
 };
 
 void
@@ -70,6 +71,7 @@ hdb_process_master_key(krb5_context context,
 	return ENOMEM;
     }
     (*mkey)->key_usage = HDB_KU_MKEY;
+    (*mkey)->unseal_usage = HDB_KU_MKEY;
     (*mkey)->keytab.vno = kvno;
     ret = krb5_parse_name(context, "K/M", &(*mkey)->keytab.principal);
     if(ret)
@@ -375,6 +377,7 @@ _hdb_set_master_key_usage(krb5_context context, HDB *db, unsigned int key_usage)
     if (db->hdb_master_key_set == 0)
 	return HDB_ERR_NO_MKEY;
     db->hdb_master_key->key_usage = key_usage;
+    db->hdb_master_key->unseal_usage = key_usage;
     return 0;
 }
 
@@ -419,34 +422,50 @@ _hdb_mkey_encrypt(krb5_context context, hdb_master_key key,
 			ptr, size, res);
 }
 
-krb5_error_code
-hdb_unseal_key_mkey(krb5_context context, Key *k, hdb_master_key mkey)
+/*
+ * Unseal one key.  `*lastp' caches the master key found for the previous
+ * key, as all the keys of an entry are usually sealed with the same one.
+ *
+ * Keys are sealed with key usage HDB_KU_MKEY, or 0 in databases converted
+ * from MIT.  Trying the wrong one first costs a whole failed decryption,
+ * so each master key remembers which usage last worked and tries it first.
+ */
+static krb5_error_code
+unseal_key(krb5_context context, Key *k, hdb_master_key mkey,
+           hdb_master_key *lastp)
 {
-
     krb5_error_code ret;
     krb5_data res;
     size_t keysize;
+    unsigned int usage;
 
     hdb_master_key key;
 
     if(k->mkvno == NULL)
 	return 0;
 
-    key = _hdb_find_master_key(k->mkvno, mkey);
+    key = *lastp;
+    if (key == NULL || (uint32_t)key->keytab.vno != *k->mkvno)
+        key = _hdb_find_master_key(k->mkvno, mkey);
 
     if (key == NULL)
 	return HDB_ERR_NO_MKEY;
+    *lastp = key;
 
-    ret = _hdb_mkey_decrypt(context, key, HDB_KU_MKEY,
+    usage = key->unseal_usage;
+    ret = _hdb_mkey_decrypt(context, key, usage,
 			    k->key.keyvalue.data,
 			    k->key.keyvalue.length,
 			    &res);
     if(ret == KRB5KRB_AP_ERR_BAD_INTEGRITY) {
-	/* try to decrypt with MIT key usage */
-	ret = _hdb_mkey_decrypt(context, key, 0,
+	/* try the other key usage: HDB_KU_MKEY, or 0 as MIT uses */
+	usage = usage == HDB_KU_MKEY ? 0 : HDB_KU_MKEY;
+	ret = _hdb_mkey_decrypt(context, key, usage,
 				k->key.keyvalue.data,
 				k->key.keyvalue.length,
 				&res);
+	if (ret == 0)
+	    key->unseal_usage = usage;
     }
     if (ret)
 	return ret;
@@ -472,15 +491,24 @@ hdb_unseal_key_mkey(krb5_context context, Key *k, hdb_master_key mkey)
     return 0;
 }
 
+krb5_error_code
+hdb_unseal_key_mkey(krb5_context context, Key *k, hdb_master_key mkey)
+{
+    hdb_master_key last = NULL;
+
+    return unseal_key(context, k, mkey, &last);
+}
+
 krb5_error_code
 hdb_unseal_keys_mkey(krb5_context context, hdb_entry *ent, hdb_master_key mkey)
 {
+    hdb_master_key last = NULL;
     size_t i;
 
     for(i = 0; i < ent->keys.len; i++){
 	krb5_error_code ret;
 
-	ret = hdb_unseal_key_mkey(context, &ent->keys.val[i], mkey);
+	ret = unseal_key(context, &ent->keys.val[i], mkey, &last);
 	if (ret)
 	    return ret;
     }
@@ -503,9 +531,9 @@ hdb_unseal_keys(krb5_context context, HDB *db, hdb_entry *ent)
  *                 as the current keyset for the entry (swapping it with a
  *                 historical keyset if need be).
  */
-krb5_error_code
-hdb_unseal_keys_kvno(krb5_context context, HDB *db, krb5_kvno kvno,
-		     unsigned flags, hdb_entry *ent)
+static krb5_error_code
+unseal_keys_kvno(krb5_context context, HDB *db, krb5_kvno kvno,
+		 unsigned flags, hdb_entry *ent, hdb_master_key *lastp)
 {
     krb5_error_code ret = HDB_ERR_NOENTRY;
     HDB_extension *ext;
@@ -562,9 +590,8 @@ hdb_unseal_keys_kvno(krb5_context context, HDB *db, krb5_kvno kvno,
 
 	/* Either the keys we want, or all the keys */
 	for (k = 0; k < hist_keys->val[i].keys.len; k++) {
-	    ret = hdb_unseal_key_mkey(context,
-				      &hist_keys->val[i].keys.val[k],
-				      db->hdb_master_key);
+	    ret = unseal_key(context, &hist_keys->val[i].keys.val[k],
+			     db->hdb_master_key, lastp);
 	    /*
 	     * If kvno == 0 we might not want to bail here!  E.g., if we
 	     * no longer have the right master key, so just ignore this.
@@ -624,6 +651,48 @@ hdb_unseal_keys_kvno(krb5_context context, HDB *db, krb5_kvno kvno,
     return (ret);
 }
 
+krb5_error_code
+hdb_unseal_keys_kvno(krb5_context context, HDB *db, krb5_kvno kvno,
+		     unsigned flags, hdb_entry *ent)
+{
+    hdb_master_key last = NULL;
+
+    return unseal_keys_kvno(context, db, kvno, flags, ent, &last);
+}
+
+/**
+ * Unseal all the keys of an entry, current and historic, in one call.
+ *
+ * Equivalent to hdb_unseal_keys() followed by hdb_unseal_keys_kvno() with
+ * kvno 0, but looks up the master key only once for all the keys sealed
+ * with it.
+ *
+ * @param context Kerberos 5 context
+ * @param db database handle
+ * @param flags HDB_F_* flags, as for hdb_unseal_keys_kvno()
+ * @param ent entry whose keys to unseal
+ *
+ * @return 0 on success, an error code if not
+ */
+krb5_error_code
+hdb_unseal_keys_all(krb5_context context, HDB *db, unsigned flags,
+		    hdb_entry *ent)
+{
+    hdb_master_key last = NULL;
+    krb5_error_code ret;
+    size_t i;
+
+    if (db->hdb_master_key_set == 0)
+	return 0;
+    for (i = 0; i < ent->keys.len; i++) {
+	ret = unseal_key(context, &ent->keys.val[i], db->hdb_master_key,
+			 &last);
+	if (ret)
+	    return ret;
+    }
+    return unseal_keys_kvno(context, db, 0, flags, ent, &last);
+}
+
 krb5_error_code
 hdb_unseal_key(krb5_context context, HDB *db, Key *k)
 {
@@ -757,6 +826,36 @@ hdb_set_master_keyfile (krb5_context context,
     return ret;
 }
 
+/*
+ * Give `to' its own copy of the master keys of `from', e.g., so that the
+ * two handles can be used in different threads (a krb5_crypto must not
+ * be).
+ */
+krb5_error_code
+hdb_copy_master_key(krb5_context context, HDB *from, HDB *to)
+{
+    hdb_master_key p, mkey = NULL, *tail = &mkey;
+    krb5_error_code ret;
+
+    hdb_clear_master_key(context, to);
+    if (from->hdb_master_key_set == 0)
+	return 0;
+
+    for (p = from->hdb_master_key; p; p = p->next) {
+	ret = hdb_process_master_key(context, p->keytab.vno,
+				     &p->keytab.keyblock, 0, tail);
+	if (ret) {
+	    hdb_free_master_key(context, mkey);
+	    return ret;
+	}
+	(*tail)->key_usage = p->key_usage;
+	tail = &(*tail)->next;
+    }
+    to->hdb_master_key = mkey;
+    to->hdb_master_key_set = 1;
+    return 0;
+}
+
 krb5_error_code
 hdb_clear_master_key (krb5_context context,
 		      HDB *db)
@@ -2278,6 +2278,71 @@ out:
     return ret;
 }
 
+/**
+ * Sign many to-be-signed certificate objects with the same issuer
+ * certificate.  Works like calling hx509_ca_sign() on each, but the
+ * issuer information is only computed once.
+ *
+ * All objects are signed even if some fail; the certificates of
+ * failed objects are set to NULL.
+ *
+ * @param context A hx509 context.
+ * @param tbs array of objects to be signed.
+ * @param len number of objects in tbs.
+ * @param signer the CA certificate object to sign with (need private key).
+ * @param certificates returns len certificates, free each with
+ * hx509_cert_free().
+ *
+ * @return An hx509 error code, see hx509_get_error_string(); the
+ * error of the first object that failed to be signed.
+ *
+ * @ingroup hx509_ca
+ */
+
+HX509_LIB_FUNCTION int HX509_LIB_CALL
+hx509_ca_sign_batch(hx509_context context,
+		    hx509_ca_tbs *tbs,
+		    size_t len,
+		    hx509_cert signer,
+		    hx509_cert *certificates)
+{
+    const Certificate *signer_cert;
+    hx509_private_key key;
+    AuthorityKeyIdentifier ai;
+    int ret, saved_ret = 0;
+    size_t i;
+
+    memset(&ai, 0, sizeof(ai));
+
+    for (i = 0; i < len; i++)
+	certificates[i] = NULL;
+
+    signer_cert = _hx509_get_cert(signer);
+    key = _hx509_cert_private_key(signer);
+
+    ret = get_AuthorityKeyIdentifier(context, signer_cert, &ai);
+    if (ret)
+	return ret;
+
+    for (i = 0; i < len; i++) {
+	ret = ca_sign(context,
+		      tbs[i],
+		      key,
+		      &ai,
+		      &signer_cert->tbsCertificate.subject,
+		      &certificates[i]);
+	if (ret) {
+	    certificates[i] = NULL;
+	    if (saved_ret == 0)
+		saved_ret = ret;
+	}
+    }
+
+    free_AuthorityKeyIdentifier(&ai);
+
+    return saved_ret;
+}
+
 /**
  * Work just like hx509_ca_sign() but signs it-self.
  *
@@ -2906,6 +2971,205 @@ tbs_set_times(hx509_context context,
     return 0;
 }
 
+/*
+ * Issuer credentials are cached in the hx509 context, keyed by the store
+ * name, so that we don't re-read (and, for PKCS#11, re-open and re-login to)
+ * the CA's store on every issuance.  Like the context, the cache is not
+ * thread-safe; multi-threaded services (bx509d) use a context per thread.
+ *
+ * Entries are reloaded after `ca_cache_lifetime' seconds, or sooner if any
+ * file named by a FILE:, PEM-FILE:, DER-FILE: or PKCS12: store changes.
+ */
+#define HX509_CA_ISSUER_CACHE_LEN       4
+
+struct hx509_ca_issuer {
+    struct hx509_ca_issuer *next;
+    char *name;
+    hx509_cert signer;
+    hx509_certs chain;
+    time_t loaded;
+    time_t mtime;
+};
+
+static time_t
+issuer_store_mtime(const char *name)
+{
+    const char *residue = strchr(name, ':');
+    char *files, *f, *p;
+    struct stat st;
+    time_t mtime = 0;
+
+    if (residue == NULL ||
+        (strncmp(name, "FILE:", sizeof("FILE:") - 1) != 0 &&
+         strncmp(name, "PEM-FILE:", sizeof("PEM-FILE:") - 1) != 0 &&
+         strncmp(name, "DER-FILE:", sizeof("DER-FILE:") - 1) != 0 &&
+         strncmp(name, "PKCS12:", sizeof("PKCS12:") - 1) != 0))
+        return 0;
+    if ((files = strdup(residue + 1)) == NULL)
+        return 0;
+    for (f = strtok_r(files, ",", &p); f; f = strtok_r(NULL, ",", &p))
+        if (stat(f, &st) == 0 && st.st_mtime > mtime)
+            mtime = st.st_mtime;
+    free(files);
+    return mtime;
+}
+
+static void
+issuer_free(struct hx509_ca_issuer *i)
+{
+    free(i->name);
+    hx509_cert_free(i->signer);
+    hx509_certs_free(&i->chain);
+    free(i);
+}
+
+void
+_hx509_ca_issuers_free(hx509_context context)
+{
+    struct hx509_ca_issuer *i, *next;
+
+    for (i = context->ca_issuers; i; i = next) {
+        next = i->next;
+        issuer_free(i);
+    }
+    context->ca_issuers = NULL;
+}
+
+static heim_error_code
+load_issuer(hx509_context context,
+            heim_log_facility *logf,
+            const char *ca,
+            struct hx509_ca_issuer **out)
+{
+    struct hx509_ca_issuer *i;
+    hx509_certs certs;
+    hx509_query *q;
+    heim_error_code ret;
+
+    *out = NULL;
+    if ((i = calloc(1, sizeof(*i))) == NULL ||
+        (i->name = strdup(ca)) == NULL) {
+        free(i);
+        return hx509_enomem(context);
+    }
+    i->mtime = issuer_store_mtime(ca);
+    i->loaded = time(NULL);
+
+    ret = hx509_certs_init(context, ca, 0, NULL, &certs);
+    if (ret) {
+        heim_log_msg(context->hcontext, logf, 1, NULL,
+                     "Failed to load CA certificate and private key %s",
+                     ca);
+        hx509_set_error_string(context, 0, ret, "Failed to load "
+                               "CA certificate and private key %s", ca);
+        issuer_free(i);
+        return ret;
+    }
+    ret = hx509_query_alloc(context, &q);
+    if (ret) {
+        hx509_certs_free(&certs);
+        issuer_free(i);
+        return ret;
+    }
+
+    hx509_query_match_option(q, HX509_QUERY_OPTION_PRIVATE_KEY);
+    hx509_query_match_option(q, HX509_QUERY_OPTION_KU_KEYCERTSIGN);
+
+    ret = hx509_certs_find(context, certs, q, &i->signer);
+    hx509_query_free(context, q);
+    if (ret) {
+        heim_log_msg(context->hcontext, logf, 1, NULL,
+                     "Failed to find a CA certificate in %s", ca);
+        hx509_set_error_string(context, 0, ret,
+                               "Failed to find a CA certificate in %s",
+                               ca);
+    }
+
+    /*
+     * Keep the certificates (but not the private keys) of the issuer store
+     * for sending the chain.
+     */
+    if (ret == 0)
+        ret = hx509_certs_init(context, "MEMORY:issuer-chain",
+                               HX509_CERTS_NO_PRIVATE_KEYS, NULL, &i->chain);
+    if (ret == 0)
+        ret = hx509_certs_merge(context, i->chain, certs);
+    hx509_certs_free(&certs);
+    if (ret) {
+        issuer_free(i);
+        return ret;
+    }
+    *out = i;
+    return 0;
+}
+
+static heim_error_code
+get_issuer(hx509_context context,
+           const heim_config_binding *cf,
+           heim_log_facility *logf,
+           const char *ca,
+           hx509_cert *signer,
+           hx509_certs *chain)
+{
+    struct hx509_ca_issuer **ip, *i;
+    heim_error_code ret;
+    time_t lifetime;
+    size_t n;
+
+    *signer = NULL;
+    *chain = NULL;
+
+    lifetime = heim_config_get_time_default(context->hcontext, cf, 300,
+                                            "ca_cache_lifetime", NULL);
+
+    for (ip = &context->ca_issuers; (i = *ip); ) {
+        if (strcmp(i->name, ca) != 0) {
+            ip = &i->next;
+            continue;
+        }
+        if (lifetime > 0 && time(NULL) - i->loaded < lifetime &&
+            issuer_store_mtime(ca) == i->mtime) {
+            /* Move to the front */
+            *ip = i->next;
+            i->next = context->ca_issuers;
+            context->ca_issuers = i;
+            break;
+        }
+        *ip = i->next;
+        issuer_free(i);
+        i = NULL;
+        break;
+    }
+
+    if (i == NULL) {
+        ret = load_issuer(context, logf, ca, &i);
+        if (ret)
+            return ret;
+        if (lifetime <= 0) {
+            *signer = hx509_cert_ref(i->signer);
+            *chain = hx509_certs_ref(i->chain);
+            issuer_free(i);
+            return 0;
+        }
+        i->next = context->ca_issuers;
+        context->ca_issuers = i;
+
+        /* Evict the least recently used entry */
+        for (ip = &context->ca_issuers, n = 0;
+             *ip && n < HX509_CA_ISSUER_CACHE_LEN;
+             ip = &(*ip)->next, n++)
+            ;
+        if (*ip) {
+            issuer_free(*ip);
+            *ip = NULL;
+        }
+    }
+
+    *signer = hx509_cert_ref(i->signer);
+    *chain = hx509_certs_ref(i->chain);
+    return 0;
+}
+
 /*
  * Build a certifate for `principal' and its CSR.
  *
@@ -2990,41 +3254,10 @@ _hx509_ca_issue_certificate(hx509_context context,
      *  - encode certificate and chain
      */
 
-    /* Load the issuer certificate and private key */
-    {
-        hx509_certs certs;
-        hx509_query *q;
-
-        ret = hx509_certs_init(context, ca, 0, NULL, &certs);
-        if (ret) {
-            heim_log_msg(context->hcontext, logf, 1, NULL,
-                         "Failed to load CA certificate and private key %s",
-                         ca);
-            hx509_set_error_string(context, 0, ret, "Failed to load "
-                                   "CA certificate and private key %s", ca);
-            goto out;
-        }
-        ret = hx509_query_alloc(context, &q);
-        if (ret) {
-            hx509_certs_free(&certs);
-            goto out;
-        }
-
-        hx509_query_match_option(q, HX509_QUERY_OPTION_PRIVATE_KEY);
-        hx509_query_match_option(q, HX509_QUERY_OPTION_KU_KEYCERTSIGN);
-
-        ret = hx509_certs_find(context, certs, q, &signer);
-        hx509_query_free(context, q);
-        hx509_certs_free(&certs);
-        if (ret) {
-            heim_log_msg(context->hcontext, logf, 1, NULL,
-                         "Failed to find a CA certificate in %s", ca);
-            hx509_set_error_string(context, 0, ret,
-                                   "Failed to find a CA certificate in %s",
-                                   ca);
-            goto out;
-        }
-    }
+    /* Get the (possibly cached) issuer certificate, private key and chain */
+    ret = get_issuer(context, cf, logf, ca, &signer, &chain);
+    if (ret)
+        goto out;
 
     /* Populate the subject public key in the TBS context */
     {
@@ -3067,12 +3300,8 @@ _hx509_ca_issue_certificate(hx509_context context,
                            HX509_CERTS_NO_PRIVATE_KEYS, NULL, out);
     if (ret == 0)
         ret = hx509_certs_add(context, *out, cert);
-    if (ret == 0 && send_chain) {
-        ret = hx509_certs_init(context, ca,
-                               HX509_CERTS_NO_PRIVATE_KEYS, NULL, &chain);
-        if (ret == 0)
-            ret = hx509_certs_merge(context, *out, chain);
-    }
+    if (ret == 0 && send_chain)
+        ret = hx509_certs_merge(context, *out, chain);
 
 out:
     hx509_certs_free(&chain);
@@ -63,6 +63,42 @@ struct hx509_verify_ctx_data {
     unsigned int max_depth;
 #define HX509_VERIFY_MAX_DEPTH 30
     hx509_revoke_ctx revoke_ctx;
+    hx509_verify_cache cache;
+};
+
+/*
+ * Cache of successful path validations, keyed by a digest of the end
+ * entity certificate, the trust anchors and the verification options.
+ * An entry is valid while the verification time is within the
+ * validity of every certificate on the path, before the next update of
+ * the revocation information and no older than the cache's maximum
+ * age.
+ *
+ * The cache also remembers verified signatures of the CA certificates
+ * on paths, keyed by a digest of the certificate and its signer, so
+ * that a new end entity certificate from a known CA only needs its own
+ * signature checked.  A verified signature doesn't depend on the time,
+ * the anchors or the options, so those entries only age out.
+ */
+
+#define HX509_VERIFY_CACHE_DIGEST_LEN	32	/* SHA-256 */
+
+struct hx509_verify_cache_entry {
+    unsigned char digest[HX509_VERIFY_CACHE_DIGEST_LEN];
+    time_t not_before;
+    time_t expires;
+};
+
+struct hx509_verify_cache_data {
+    HEIMDAL_MUTEX mutex;
+    time_t max_age;
+    size_t len;
+    struct hx509_verify_cache_entry *val;
+    struct hx509_verify_cache_entry *sigs;
+    unsigned long path_hits;
+    unsigned long path_misses;
+    unsigned long sig_hits;
+    unsigned long sig_misses;
 };
 
 #define REQUIRE_RFC3280(ctx) ((ctx)->flags & HX509_VERIFY_CTX_F_REQUIRE_RFC3280)
@@ -164,10 +200,12 @@ hx509_context_init(hx509_context *contextp)
     context = calloc(1, sizeof(*context));
     if (context == NULL)
 	return ENOMEM;
+    HEIMDAL_MUTEX_init(&context->sig_cache_mutex);
 
     heim_base_once_f(&init_context, NULL, init_context_once);
 
     if ((context->hcontext = heim_context_init()) == NULL) {
+        HEIMDAL_MUTEX_destroy(&context->sig_cache_mutex);
         free(context);
         return ENOMEM;
     }
@@ -176,6 +214,7 @@ hx509_context_init(hx509_context *contextp)
                                              "HX509_CONFIG",
                                              &files))) {
         heim_context_free(&context->hcontext);
+        HEIMDAL_MUTEX_destroy(&context->sig_cache_mutex);
         free(context);
         return ret;
     }
@@ -281,8 +320,10 @@ hx509_context_free(hx509_context *context)
     if ((*context)->querystat)
 	free((*context)->querystat);
     hx509_certs_free(&(*context)->default_trust_anchors);
+    _hx509_ca_issuers_free(*context);
     heim_config_file_free((*context)->hcontext, (*context)->cf);
     heim_context_free(&(*context)->hcontext);
+    HEIMDAL_MUTEX_destroy(&(*context)->sig_cache_mutex);
     memset(*context, 0, sizeof(**context));
     free(*context);
     *context = NULL;
@@ -642,6 +683,132 @@ hx509_verify_attach_revoke(hx509_verify_ctx ctx, hx509_revoke_ctx revoke_ctx)
     ctx->revoke_ctx = _hx509_revoke_ref(revoke_ctx);
 }
 
+/**
+ * Allocate a cache of successful path validations, see
+ * hx509_verify_attach_cache().  Free with hx509_verify_cache_free().
+ *
+ * @param context A hx509 context.
+ * @param len number of validations to remember.
+ * @param max_age maximum number of seconds a validation is reused.
+ * @param cache returns the newly allocated cache.
+ *
+ * @return An hx509 error code, see hx509_get_error_string().
+ *
+ * @ingroup hx509_verify
+ */
+
+HX509_LIB_FUNCTION int HX509_LIB_CALL
+hx509_verify_cache_init(hx509_context context,
+			size_t len,
+			time_t max_age,
+			hx509_verify_cache *cache)
+{
+    hx509_verify_cache c;
+
+    *cache = NULL;
+
+    if (len == 0) {
+	hx509_set_error_string(context, 0, EINVAL,
+			       "Verify cache must have at least one entry");
+	return EINVAL;
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+	hx509_set_error_string(context, 0, ENOMEM, "out of memory");
+	return ENOMEM;
+    }
+    c->val = calloc(len, sizeof(c->val[0]));
+    c->sigs = calloc(len, sizeof(c->sigs[0]));
+    if (c->val == NULL || c->sigs == NULL) {
+	free(c->val);
+	free(c->sigs);
+	free(c);
+	hx509_set_error_string(context, 0, ENOMEM, "out of memory");
+	return ENOMEM;
+    }
+    c->len = len;
+    c->max_age = max_age;
+    HEIMDAL_MUTEX_init(&c->mutex);
+
+    *cache = c;
+    return 0;
+}
+
+/**
+ * Free a verification cache.
+ *
+ * @param cache the cache to free, set to NULL on return.
+ *
+ * @ingroup hx509_verify
+ */
+
+HX509_LIB_FUNCTION void HX509_LIB_CALL
+hx509_verify_cache_free(hx509_verify_cache *cache)
+{
+    if (cache == NULL || *cache == NULL)
+	return;
+    HEIMDAL_MUTEX_destroy(&(*cache)->mutex);
+    free((*cache)->val);
+    free((*cache)->sigs);
+    free(*cache);
+    *cache = NULL;
+}
+
+/*
+ * Report the hit and miss counts of the signature cache of the
+ * context and, if not NULL, of a verification cache.  Used by
+ * hxtool verify-bench.
+ */
+
+HX509_LIB_FUNCTION void HX509_LIB_CALL
+_hx509_cache_stats(hx509_context context,
+		   hx509_verify_cache cache,
+		   struct hx509_cache_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    HEIMDAL_MUTEX_lock(&context->sig_cache_mutex);
+    stats->sig_hits = context->sig_cache_hits;
+    stats->sig_misses = context->sig_cache_misses;
+    HEIMDAL_MUTEX_unlock(&context->sig_cache_mutex);
+
+    if (cache == NULL)
+	return;
+    HEIMDAL_MUTEX_lock(&cache->mutex);
+    stats->path_hits = cache->path_hits;
+    stats->path_misses = cache->path_misses;
+    stats->ca_sig_hits = cache->sig_hits;
+    stats->ca_sig_misses = cache->sig_misses;
+    HEIMDAL_MUTEX_unlock(&cache->mutex);
+}
+
+/**
+ * Attach a cache of successful path validations to the verification
+ * context.  hx509_verify_path() then skips building and checking the
+ * path of a certificate that was recently found valid against the
+ * same trust anchors and options.  Revocation information is only
+ * consulted again when the cached validation expires, so max_age of
+ * the cache bounds how late a newly revoked certificate is noticed.
+ * Signatures on CA certificates are remembered too, so paths through
+ * a known CA only have the end entity signature checked.
+ *
+ * The cache is not referenced; it must outlive the verification
+ * context.  It may be shared by verification contexts in several
+ * threads.
+ *
+ * @param ctx a verification context.
+ * @param cache a verification cache, or NULL to detach.
+ *
+ * @ingroup hx509_verify
+ */
+
+HX509_LIB_FUNCTION void HX509_LIB_CALL
+hx509_verify_attach_cache(hx509_verify_ctx ctx, hx509_verify_cache cache)
+{
+    ctx->cache = cache;
+}
+
 /**
  * Set the clock time the the verification process is going to
  * use. Used to check certificate in the past and future time. If not
@@ -770,9 +937,9 @@ find_extension(const Certificate *cert, const heim_oid *oid, size_t *idx)
     return NULL;
 }
 
-static int
-find_extension_auth_key_id(const Certificate *subject,
-			   AuthorityKeyIdentifier *ai)
+HX509_LIB_FUNCTION int HX509_LIB_CALL
+_hx509_find_extension_auth_key_id(const Certificate *subject,
+				  AuthorityKeyIdentifier *ai)
 {
     const Extension *e;
     size_t size;
@@ -1107,7 +1274,7 @@ _hx509_cert_is_parent_cmp(const Certificate *subject,
      * subject certificate nor the parent.
      */
 
-    ret_ai = find_extension_auth_key_id(subject, &ai);
+    ret_ai = _hx509_find_extension_auth_key_id(subject, &ai);
     if (ret_ai && ret_ai != HX509_EXTENSION_NOT_FOUND)
 	return 1;
     ret_si = _hx509_find_extension_subject_key_id(issuer, &si);
@@ -1243,7 +1410,7 @@ find_parent(hx509_context context,
 	q.match |= HX509_QUERY_FIND_ISSUER_CERT;
 	q.subject = _hx509_get_cert(current);
     } else {
-	ret = find_extension_auth_key_id(current->data, &ai);
+	ret = _hx509_find_extension_auth_key_id(current->data, &ai);
 	if (ret) {
 	    hx509_set_error_string(context, 0, HX509_CERTIFICATE_MALFORMED,
 				   "Subjectless certificate missing AuthKeyID");
@@ -2225,6 +2392,187 @@ free_name_constraints(hx509_name_constraints *nc)
  * @ingroup hx509_verify
  */
 
+static void
+verify_cache_digest_cert(EVP_MD_CTX *m, hx509_cert cert)
+{
+    Certificate *c = _hx509_get_cert(cert);
+
+    EVP_DigestUpdate(m, c->tbsCertificate._save.data,
+		     c->tbsCertificate._save.length);
+    EVP_DigestUpdate(m, c->signatureValue.data,
+		     (c->signatureValue.length + 7) / 8);
+}
+
+static int HX509_LIB_CALL
+verify_cache_digest_anchor(hx509_context context, void *ctx, hx509_cert cert)
+{
+    verify_cache_digest_cert(ctx, cert);
+    return 0;
+}
+
+static int
+verify_cache_digest(hx509_context context,
+		    hx509_verify_ctx ctx,
+		    hx509_cert cert,
+		    hx509_certs anchors,
+		    unsigned char digest[HX509_VERIFY_CACHE_DIGEST_LEN])
+{
+    EVP_MD_CTX *m;
+    int ret;
+
+    m = EVP_MD_CTX_create();
+    if (m == NULL)
+	return ENOMEM;
+    EVP_DigestInit_ex(m, EVP_sha256(), NULL);
+    EVP_DigestUpdate(m, &ctx->flags, sizeof(ctx->flags));
+    EVP_DigestUpdate(m, &ctx->max_depth, sizeof(ctx->max_depth));
+    EVP_DigestUpdate(m, &ctx->revoke_ctx, sizeof(ctx->revoke_ctx));
+    verify_cache_digest_cert(m, cert);
+    ret = hx509_certs_iter_f(context, anchors, verify_cache_digest_anchor, m);
+    EVP_DigestFinal_ex(m, digest, NULL);
+    EVP_MD_CTX_destroy(m);
+    return ret;
+}
+
+static struct hx509_verify_cache_entry *
+verify_cache_slot(hx509_verify_cache cache,
+		  struct hx509_verify_cache_entry *table,
+		  const unsigned char digest[HX509_VERIFY_CACHE_DIGEST_LEN])
+{
+    uint32_t h;
+
+    h = digest[0] | (digest[1] << 8) | (digest[2] << 16) |
+	((uint32_t)digest[3] << 24);
+    return &table[h % cache->len];
+}
+
+static int
+verify_cache_lookup(hx509_verify_ctx ctx,
+		    const unsigned char digest[HX509_VERIFY_CACHE_DIGEST_LEN])
+{
+    hx509_verify_cache cache = ctx->cache;
+    struct hx509_verify_cache_entry *e;
+    int found;
+
+    e = verify_cache_slot(cache, cache->val, digest);
+
+    HEIMDAL_MUTEX_lock(&cache->mutex);
+    found = e->expires > ctx->time_now &&
+	e->not_before <= ctx->time_now &&
+	ct_memcmp(e->digest, digest, sizeof(e->digest)) == 0;
+    if (found)
+	cache->path_hits++;
+    else
+	cache->path_misses++;
+    HEIMDAL_MUTEX_unlock(&cache->mutex);
+
+    return found;
+}
+
+static void
+verify_cache_store(hx509_verify_ctx ctx,
+		   const unsigned char digest[HX509_VERIFY_CACHE_DIGEST_LEN],
+		   hx509_path *path)
+{
+    hx509_verify_cache cache = ctx->cache;
+    struct hx509_verify_cache_entry *e;
+    time_t not_before = 0, expires, t;
+    size_t i;
+
+    expires = ctx->time_now + cache->max_age;
+    if (ctx->revoke_ctx) {
+	t = _hx509_revoke_next_update(ctx->revoke_ctx);
+	if (t && t < expires)
+	    expires = t;
+    }
+    for (i = 0; i < path->len; i++) {
+	Certificate *c = _hx509_get_cert(path->val[i]);
+
+	/* Trust anchors are only checked for validity on request */
+	if (i + 1 == path->len && !CHECK_TA(ctx))
+	    break;
+	t = _hx509_Time2time_t(&c->tbsCertificate.validity.notBefore);
+	if (t > not_before)
+	    not_before = t;
+	t = _hx509_Time2time_t(&c->tbsCertificate.validity.notAfter);
+	if (t < expires)
+	    expires = t;
+    }
+    if (expires <= ctx->time_now)
+	return;
+
+    e = verify_cache_slot(cache, cache->val, digest);
+    HEIMDAL_MUTEX_lock(&cache->mutex);
+    memcpy(e->digest, digest, sizeof(e->digest));
+    e->not_before = not_before;
+    e->expires = expires;
+    HEIMDAL_MUTEX_unlock(&cache->mutex);
+}
+
+static int
+sig_cache_digest(const Certificate *c,
+		 hx509_cert signer,
+		 unsigned char digest[HX509_VERIFY_CACHE_DIGEST_LEN])
+{
+    const AlgorithmIdentifier *alg = &c->signatureAlgorithm;
+    EVP_MD_CTX *m;
+
+    m = EVP_MD_CTX_create();
+    if (m == NULL)
+	return ENOMEM;
+    EVP_DigestInit_ex(m, EVP_sha256(), NULL);
+    EVP_DigestUpdate(m, c->tbsCertificate._save.data,
+		     c->tbsCertificate._save.length);
+    EVP_DigestUpdate(m, c->signatureValue.data,
+		     (c->signatureValue.length + 7) / 8);
+    EVP_DigestUpdate(m, &alg->algorithm.length,
+		     sizeof(alg->algorithm.length));
+    EVP_DigestUpdate(m, alg->algorithm.components,
+		     alg->algorithm.length * sizeof(alg->algorithm.components[0]));
+    if (alg->parameters)
+	EVP_DigestUpdate(m, alg->parameters->data, alg->parameters->length);
+    verify_cache_digest_cert(m, signer);
+    EVP_DigestFinal_ex(m, digest, NULL);
+    EVP_MD_CTX_destroy(m);
+    return 0;
+}
+
+static int
+sig_cache_lookup(hx509_verify_ctx ctx,
+		 const unsigned char digest[HX509_VERIFY_CACHE_DIGEST_LEN])
+{
+    hx509_verify_cache cache = ctx->cache;
+    struct hx509_verify_cache_entry *e;
+    int found;
+
+    e = verify_cache_slot(cache, cache->sigs, digest);
+    HEIMDAL_MUTEX_lock(&cache->mutex);
+    found = e->expires > ctx->time_now &&
+	ct_memcmp(e->digest, digest, sizeof(e->digest)) == 0;
+    if (found)
+	cache->sig_hits++;
+    else
+	cache->sig_misses++;
+    HEIMDAL_MUTEX_unlock(&cache->mutex);
+
+    return found;
+}
+
+static void
+sig_cache_store(hx509_verify_ctx ctx,
+		const unsigned char digest[HX509_VERIFY_CACHE_DIGEST_LEN])
+{
+    hx509_verify_cache cache = ctx->cache;
+    struct hx509_verify_cache_entry *e;
+
+    e = verify_cache_slot(cache, cache->sigs, digest);
+    HEIMDAL_MUTEX_lock(&cache->mutex);
+    memcpy(e->digest, digest, sizeof(e->digest));
+    e->not_before = 0;
+    e->expires = ctx->time_now + cache->max_age;
+    HEIMDAL_MUTEX_unlock(&cache->mutex);
+}
+
 HX509_LIB_FUNCTION int HX509_LIB_CALL
 hx509_verify_path(hx509_context context,
 		  hx509_verify_ctx ctx,
@@ -2238,6 +2586,9 @@ hx509_verify_path(hx509_context context,
     enum certtype type;
     Name proxy_issuer;
     hx509_certs anchors = NULL;
+    unsigned char digest[HX509_VERIFY_CACHE_DIGEST_LEN];
+    unsigned char sigdigest[HX509_VERIFY_CACHE_DIGEST_LEN];
+    int use_cache = 0, cache_sig;
 
     memset(&proxy_issuer, 0, sizeof(proxy_issuer));
 
@@ -2274,6 +2625,15 @@ hx509_verify_path(hx509_context context,
 	    goto out;
     }
 
+    if (ctx->cache &&
+	verify_cache_digest(context, ctx, cert, anchors, digest) == 0) {
+	use_cache = 1;
+	if (verify_cache_lookup(ctx, digest)) {
+	    ret = 0;
+	    goto out;
+	}
+    }
+
     /*
      * Calculate the path from the certificate user presented to the
      * to an anchor.
@@ -2608,16 +2968,25 @@ hx509_verify_path(hx509_context context,
 	    signer = path.val[i + 1];
 	}
 
-	/* verify signatureValue */
-	ret = _hx509_verify_signature_bitstring(context,
-						signer,
-						&c->signatureAlgorithm,
-						&c->tbsCertificate._save,
-						&c->signatureValue);
-	if (ret) {
-	    hx509_set_error_string(context, HX509_ERROR_APPEND, ret,
-				   "Failed to verify signature of certificate");
-	    goto out;
+	/*
+	 * verify signatureValue, CA certificate signatures that were
+	 * recently verified are remembered by the cache.
+	 */
+	cache_sig = i > 0 && ctx->cache &&
+	    sig_cache_digest(c, signer, sigdigest) == 0;
+	if (!cache_sig || !sig_cache_lookup(ctx, sigdigest)) {
+	    ret = _hx509_verify_signature_bitstring(context,
+						    signer,
+						    &c->signatureAlgorithm,
+						    &c->tbsCertificate._save,
+						    &c->signatureValue);
+	    if (ret) {
+		hx509_set_error_string(context, HX509_ERROR_APPEND, ret,
+				       "Failed to verify signature of certificate");
+		goto out;
+	    }
+	    if (cache_sig)
+		sig_cache_store(ctx, sigdigest);
 	}
 	/*
 	 * Verify that the sigature algorithm is not weak. Ignore
@@ -2631,6 +3000,13 @@ hx509_verify_path(hx509_context context,
 	}
     }
 
+    /*
+     * Proxy certificate validation also sets the base name of the
+     * certificate, so those are not cached.
+     */
+    if (use_cache && proxy_cert_depth == 0)
+	verify_cache_store(ctx, digest, &path);
+
 out:
     hx509_certs_free(&anchors);
     free_Name(&proxy_issuer);
@@ -168,6 +168,8 @@ hx509_cms_unwrap_ContentInfo(const heim_octet_string *in,
 #define CMS_ID_SKI	0
 #define CMS_ID_NAME	1
 
+#define CMS_STREAM_CHUNK	(16 * 1024)
+
 static int
 fill_CMSIdentifier(const hx509_cert cert,
 		   int type,
@@ -325,99 +327,49 @@ find_CMSIdentifier(hx509_context context,
     return 0;
 }
 
-/**
- * Decode and unencrypt EnvelopedData.
- *
- * Extract data and parameteres from from the EnvelopedData. Also
- * supports using detached EnvelopedData.
- *
- * @param context A hx509 context.
- * @param certs Certificate that can decrypt the EnvelopedData
- * encryption key.
- * @param flags HX509_CMS_UE flags to control the behavior.
- * @param data pointer the structure the contains the DER/BER encoded
- * EnvelopedData stucture.
- * @param length length of the data that data point to.
- * @param encryptedContent in case of detached signature, this
- * contains the actual encrypted data, othersize its should be NULL.
- * @param time_now set the current time, if zero the library uses now as the date.
- * @param contentType output type oid, should be freed with der_free_oid().
- * @param content the data, free with der_free_octet_string().
- *
- * @return an hx509 error code.
- *
- * @ingroup hx509_cms
+/*
+ * Find a recipient in the EnvelopedData `ed' that one of `certs' can
+ * decrypt the content key for, and return a crypto context keyed and
+ * parameterized to decrypt the content.
  */
 
-HX509_LIB_FUNCTION int HX509_LIB_CALL
-hx509_cms_unenvelope(hx509_context context,
-		     hx509_certs certs,
-		     int flags,
-		     const void *data,
-		     size_t length,
-		     const heim_octet_string *encryptedContent,
-		     time_t time_now,
-		     heim_oid *contentType,
-		     heim_octet_string *content)
+static int
+envelope_crypto(hx509_context context,
+		hx509_certs certs,
+		int flags,
+		EnvelopedData *ed,
+		time_t time_now,
+		hx509_crypto *crypto,
+		heim_octet_string *ivec)
 {
     heim_octet_string key;
-    EnvelopedData ed;
     hx509_cert cert;
     AlgorithmIdentifier *ai;
-    const heim_octet_string *enccontent;
     heim_octet_string *params, params_data;
-    heim_octet_string ivec;
-    size_t size;
     int ret, matched = 0, findflags = 0;
     size_t i;
 
-
+    *crypto = NULL;
     memset(&key, 0, sizeof(key));
-    memset(&ed, 0, sizeof(ed));
-    memset(&ivec, 0, sizeof(ivec));
-    memset(content, 0, sizeof(*content));
-    memset(contentType, 0, sizeof(*contentType));
+    memset(ivec, 0, sizeof(*ivec));
 
     if ((flags & HX509_CMS_UE_DONT_REQUIRE_KU_ENCIPHERMENT) == 0)
 	findflags |= HX509_QUERY_KU_ENCIPHERMENT;
 
-    ret = decode_EnvelopedData(data, length, &ed, &size);
-    if (ret) {
-	hx509_set_error_string(context, 0, ret,
-			       "Failed to decode EnvelopedData");
-	return ret;
-    }
-
-    if (ed.recipientInfos.len == 0) {
+    if (ed->recipientInfos.len == 0) {
 	ret = HX509_CMS_NO_RECIPIENT_CERTIFICATE;
 	hx509_set_error_string(context, 0, ret,
 			       "No recipient info in enveloped data");
-	goto out;
-    }
-
-    enccontent = ed.encryptedContentInfo.encryptedContent;
-    if (enccontent == NULL) {
-	if (encryptedContent == NULL) {
-	    ret = HX509_CMS_NO_DATA_AVAILABLE;
-	    hx509_set_error_string(context, 0, ret,
-				   "Content missing from encrypted data");
-	    goto out;
-	}
-	enccontent = encryptedContent;
-    } else if (encryptedContent != NULL) {
-	ret = HX509_CMS_NO_DATA_AVAILABLE;
-	hx509_set_error_string(context, 0, ret,
-			       "Both internal and external encrypted data");
-	goto out;
+	return ret;
     }
 
     cert = NULL;
-    for (i = 0; i < ed.recipientInfos.len; i++) {
+    for (i = 0; i < ed->recipientInfos.len; i++) {
 	KeyTransRecipientInfo *ri;
 	char *str;
 	int ret2;
 
-	ri = &ed.recipientInfos.val[i];
+	ri = &ed->recipientInfos.val[i];
 
 	ret = find_CMSIdentifier(context, &ri->rid, certs,
 				 time_now, &cert,
@@ -458,14 +410,7 @@ hx509_cms_unenvelope(hx509_context context,
 	goto out;
     }
 
-    ret = der_copy_oid(&ed.encryptedContentInfo.contentType, contentType);
-    if (ret) {
-	hx509_set_error_string(context, 0, ret,
-			       "Failed to copy EnvelopedData content oid");
-	goto out;
-    }
-
-    ai = &ed.encryptedContentInfo.contentEncryptionAlgorithm;
+    ai = &ed->encryptedContentInfo.contentEncryptionAlgorithm;
     if (ai->parameters) {
 	params_data.data = ai->parameters->data;
 	params_data.length = ai->parameters->length;
@@ -473,82 +418,57 @@ hx509_cms_unenvelope(hx509_context context,
     } else
 	params = NULL;
 
-    {
-	hx509_crypto crypto;
-
-	ret = hx509_crypto_init(context, NULL, &ai->algorithm, &crypto);
-	if (ret)
-	    goto out;
-
-	if (flags & HX509_CMS_UE_ALLOW_WEAK)
-	    hx509_crypto_allow_weak(crypto);
+    ret = hx509_crypto_init(context, NULL, &ai->algorithm, crypto);
+    if (ret)
+	goto out;
 
-	if (params) {
-	    ret = hx509_crypto_set_params(context, crypto, params, &ivec);
-	    if (ret) {
-		hx509_crypto_destroy(crypto);
-		goto out;
-	    }
-	}
+    if (flags & HX509_CMS_UE_ALLOW_WEAK)
+	hx509_crypto_allow_weak(*crypto);
 
-	ret = hx509_crypto_set_key_data(crypto, key.data, key.length);
-	if (ret) {
-	    hx509_crypto_destroy(crypto);
-	    hx509_set_error_string(context, 0, ret,
-				   "Failed to set key for decryption "
-				   "of EnvelopedData");
+    if (params) {
+	ret = hx509_crypto_set_params(context, *crypto, params, ivec);
+	if (ret)
 	    goto out;
-	}
+    }
 
-	ret = hx509_crypto_decrypt(crypto,
-				   enccontent->data,
-				   enccontent->length,
-				   ivec.length ? &ivec : NULL,
-				   content);
-	hx509_crypto_destroy(crypto);
-	if (ret) {
-	    hx509_set_error_string(context, 0, ret,
-				   "Failed to decrypt EnvelopedData");
-	    goto out;
-	}
+    ret = hx509_crypto_set_key_data(*crypto, key.data, key.length);
+    if (ret) {
+	hx509_set_error_string(context, 0, ret,
+			       "Failed to set key for decryption "
+			       "of EnvelopedData");
+	goto out;
     }
 
 out:
-
-    free_EnvelopedData(&ed);
     der_free_octet_string(&key);
-    if (ivec.length)
-	der_free_octet_string(&ivec);
     if (ret) {
-	der_free_oid(contentType);
-	der_free_octet_string(content);
+	if (*crypto)
+	    hx509_crypto_destroy(*crypto);
+	*crypto = NULL;
+	if (ivec->length)
+	    der_free_octet_string(ivec);
     }
-
     return ret;
 }
 
 /**
- * Encrypt end encode EnvelopedData.
+ * Decode and unencrypt EnvelopedData.
  *
- * Encrypt and encode EnvelopedData. The data is encrypted with a
- * random key and the the random key is encrypted with the
- * certificates private key. This limits what private key type can be
- * used to RSA.
+ * Extract data and parameteres from from the EnvelopedData. Also
+ * supports using detached EnvelopedData.
  *
  * @param context A hx509 context.
- * @param flags flags to control the behavior.
- *    - HX509_CMS_EV_NO_KU_CHECK - Don't check KU on certificate
- *    - HX509_CMS_EV_ALLOW_WEAK - Allow weak crytpo
- *    - HX509_CMS_EV_ID_NAME - prefer issuer name and serial number
- * @param cert Certificate to encrypt the EnvelopedData encryption key
- * with.
- * @param data pointer the data to encrypt.
+ * @param certs Certificate that can decrypt the EnvelopedData
+ * encryption key.
+ * @param flags HX509_CMS_UE flags to control the behavior.
+ * @param data pointer the structure the contains the DER/BER encoded
+ * EnvelopedData stucture.
  * @param length length of the data that data point to.
- * @param encryption_type Encryption cipher to use for the bulk data,
- * use NULL to get default.
- * @param contentType type of the data that is encrypted
- * @param content the output of the function,
- * free with der_free_octet_string().
+ * @param encryptedContent in case of detached signature, this
+ * contains the actual encrypted data, othersize its should be NULL.
+ * @param time_now set the current time, if zero the library uses now as the date.
+ * @param contentType output type oid, should be freed with der_free_oid().
+ * @param content the data, free with der_free_octet_string().
  *
  * @return an hx509 error code.
  *
@@ -556,111 +476,357 @@ out:
  */
 
 HX509_LIB_FUNCTION int HX509_LIB_CALL
-hx509_cms_envelope_1(hx509_context context,
+hx509_cms_unenvelope(hx509_context context,
+		     hx509_certs certs,
 		     int flags,
-		     hx509_cert cert,
 		     const void *data,
 		     size_t length,
-		     const heim_oid *encryption_type,
-		     const heim_oid *contentType,
+		     const heim_octet_string *encryptedContent,
+		     time_t time_now,
+		     heim_oid *contentType,
 		     heim_octet_string *content)
 {
-    KeyTransRecipientInfo *ri;
-    heim_octet_string ivec;
-    heim_octet_string key;
-    hx509_crypto crypto = NULL;
-    int ret, cmsidflag;
     EnvelopedData ed;
+    hx509_crypto crypto = NULL;
+    const heim_octet_string *enccontent;
+    heim_octet_string ivec;
     size_t size;
+    int ret;
 
-    memset(&ivec, 0, sizeof(ivec));
-    memset(&key, 0, sizeof(key));
     memset(&ed, 0, sizeof(ed));
+    memset(&ivec, 0, sizeof(ivec));
     memset(content, 0, sizeof(*content));
+    memset(contentType, 0, sizeof(*contentType));
 
-    if (encryption_type == NULL)
-	encryption_type = &asn1_oid_id_aes_256_cbc;
+    ret = decode_EnvelopedData(data, length, &ed, &size);
+    if (ret) {
+	hx509_set_error_string(context, 0, ret,
+			       "Failed to decode EnvelopedData");
+	return ret;
+    }
 
-    if ((flags & HX509_CMS_EV_NO_KU_CHECK) == 0) {
-	ret = _hx509_check_key_usage(context, cert, 1 << 2, TRUE);
-	if (ret)
+    enccontent = ed.encryptedContentInfo.encryptedContent;
+    if (enccontent == NULL) {
+	if (encryptedContent == NULL) {
+	    ret = HX509_CMS_NO_DATA_AVAILABLE;
+	    hx509_set_error_string(context, 0, ret,
+				   "Content missing from encrypted data");
 	    goto out;
+	}
+	enccontent = encryptedContent;
+    } else if (encryptedContent != NULL) {
+	ret = HX509_CMS_NO_DATA_AVAILABLE;
+	hx509_set_error_string(context, 0, ret,
+			       "Both internal and external encrypted data");
+	goto out;
     }
 
-    ret = hx509_crypto_init(context, NULL, encryption_type, &crypto);
+    ret = envelope_crypto(context, certs, flags, &ed, time_now,
+			  &crypto, &ivec);
     if (ret)
 	goto out;
 
-    if (flags & HX509_CMS_EV_ALLOW_WEAK)
-	hx509_crypto_allow_weak(crypto);
-
-    ret = hx509_crypto_set_random_key(crypto, &key);
+    ret = der_copy_oid(&ed.encryptedContentInfo.contentType, contentType);
     if (ret) {
 	hx509_set_error_string(context, 0, ret,
-			       "Create random key for EnvelopedData content");
+			       "Failed to copy EnvelopedData content oid");
 	goto out;
     }
 
-    ret = hx509_crypto_random_iv(crypto, &ivec);
+    ret = hx509_crypto_decrypt(crypto,
+			       enccontent->data,
+			       enccontent->length,
+			       ivec.length ? &ivec : NULL,
+			       content);
     if (ret) {
 	hx509_set_error_string(context, 0, ret,
-			       "Failed to create a random iv");
+			       "Failed to decrypt EnvelopedData");
 	goto out;
     }
 
-    ret = hx509_crypto_encrypt(crypto,
-			       data,
-			       length,
-			       &ivec,
-			       &ed.encryptedContentInfo.encryptedContent);
+out:
+    if (crypto)
+	hx509_crypto_destroy(crypto);
+    free_EnvelopedData(&ed);
+    if (ivec.length)
+	der_free_octet_string(&ivec);
     if (ret) {
-	hx509_set_error_string(context, 0, ret,
-			       "Failed to encrypt EnvelopedData content");
-	goto out;
+	der_free_oid(contentType);
+	der_free_octet_string(content);
     }
 
-    {
-	AlgorithmIdentifier *enc_alg;
-	enc_alg = &ed.encryptedContentInfo.contentEncryptionAlgorithm;
-	ret = der_copy_oid(encryption_type, &enc_alg->algorithm);
-	if (ret) {
-	    hx509_set_error_string(context, 0, ret,
-				   "Failed to set crypto oid "
-				   "for EnvelopedData");
-	    goto out;
-	}
-	ALLOC(enc_alg->parameters, 1);
-	if (enc_alg->parameters == NULL) {
-	    ret = ENOMEM;
-	    hx509_set_error_string(context, 0, ret,
-				   "Failed to allocate crypto parameters "
-				   "for EnvelopedData");
-	    goto out;
-	}
-
-	ret = hx509_crypto_get_params(context,
-				      crypto,
-				      &ivec,
-				      enc_alg->parameters);
-	if (ret) {
-	    goto out;
-	}
-    }
+    return ret;
+}
 
-    ALLOC_SEQ(&ed.recipientInfos, 1);
-    if (ed.recipientInfos.val == NULL) {
-	ret = ENOMEM;
-	hx509_set_error_string(context, 0, ret,
-			       "Failed to allocate recipients info "
-			       "for EnvelopedData");
-	goto out;
-    }
+struct cms_mem_reader {
+    const unsigned char *p;
+    size_t len;
+};
 
-    ri = &ed.recipientInfos.val[0];
+static int
+cms_mem_read(void *ctx, void *buf, size_t len, size_t *got)
+{
+    struct cms_mem_reader *r = ctx;
+
+    if (len > r->len)
+	len = r->len;
+    memcpy(buf, r->p, len);
+    r->p += len;
+    r->len -= len;
+    *got = len;
+    return 0;
+}
 
-    if (flags & HX509_CMS_EV_ID_NAME) {
-	ri->version = 0;
-	cmsidflag = CMS_ID_NAME;
+/**
+ * Decode EnvelopedData and decrypt the content incrementally.
+ *
+ * Like hx509_cms_unenvelope(), but the cleartext is handed to the
+ * writer callback in chunks as it is decrypted and never held in
+ * memory in full. When the EnvelopedData is detached, the encrypted
+ * content is read in chunks from the reader callback, otherwise it
+ * is taken from the EnvelopedData and reader must be NULL.
+ *
+ * Cleartext passed to writer before an error is returned (such as a
+ * padding error at the end of the data) must be discarded by the
+ * caller.
+ *
+ * @param context A hx509 context.
+ * @param certs Certificate that can decrypt the EnvelopedData
+ * encryption key.
+ * @param flags HX509_CMS_UE flags to control the behavior.
+ * @param data pointer the structure the contains the DER/BER encoded
+ * EnvelopedData stucture.
+ * @param length length of the data that data point to.
+ * @param reader reader for detached encrypted content, or NULL.
+ * @param reader_ctx context passed to reader.
+ * @param time_now set the current time, if zero the library uses now as the date.
+ * @param writer called with each chunk of decrypted content.
+ * @param writer_ctx context passed to writer.
+ * @param contentType output type oid, should be freed with der_free_oid().
+ *
+ * @return an hx509 error code.
+ *
+ * @ingroup hx509_cms
+ */
+
+HX509_LIB_FUNCTION int HX509_LIB_CALL
+hx509_cms_unenvelope_stream(hx509_context context,
+			    hx509_certs certs,
+			    int flags,
+			    const void *data,
+			    size_t length,
+			    hx509_cms_read_func reader,
+			    void *reader_ctx,
+			    time_t time_now,
+			    hx509_cms_write_func writer,
+			    void *writer_ctx,
+			    heim_oid *contentType)
+{
+    EnvelopedData ed;
+    hx509_crypto crypto = NULL;
+    struct cms_mem_reader mem;
+    heim_octet_string ivec;
+    size_t size;
+    int ret;
+
+    memset(&ed, 0, sizeof(ed));
+    memset(&ivec, 0, sizeof(ivec));
+    memset(contentType, 0, sizeof(*contentType));
+
+    ret = decode_EnvelopedData(data, length, &ed, &size);
+    if (ret) {
+	hx509_set_error_string(context, 0, ret,
+			       "Failed to decode EnvelopedData");
+	return ret;
+    }
+
+    if (ed.encryptedContentInfo.encryptedContent == NULL) {
+	if (reader == NULL) {
+	    ret = HX509_CMS_NO_DATA_AVAILABLE;
+	    hx509_set_error_string(context, 0, ret,
+				   "Content missing from encrypted data");
+	    goto out;
+	}
+    } else if (reader != NULL) {
+	ret = HX509_CMS_NO_DATA_AVAILABLE;
+	hx509_set_error_string(context, 0, ret,
+			       "Both internal and external encrypted data");
+	goto out;
+    } else {
+	mem.p = ed.encryptedContentInfo.encryptedContent->data;
+	mem.len = ed.encryptedContentInfo.encryptedContent->length;
+	reader = cms_mem_read;
+	reader_ctx = &mem;
+    }
+
+    ret = envelope_crypto(context, certs, flags, &ed, time_now,
+			  &crypto, &ivec);
+    if (ret)
+	goto out;
+
+    ret = der_copy_oid(&ed.encryptedContentInfo.contentType, contentType);
+    if (ret) {
+	hx509_set_error_string(context, 0, ret,
+			       "Failed to copy EnvelopedData content oid");
+	goto out;
+    }
+
+    ret = hx509_crypto_decrypt_stream(crypto,
+				      ivec.length ? &ivec : NULL,
+				      reader, reader_ctx,
+				      writer, writer_ctx);
+    if (ret) {
+	hx509_set_error_string(context, 0, ret,
+			       "Failed to decrypt EnvelopedData");
+	goto out;
+    }
+
+out:
+    if (crypto)
+	hx509_crypto_destroy(crypto);
+    free_EnvelopedData(&ed);
+    if (ivec.length)
+	der_free_octet_string(&ivec);
+    if (ret)
+	der_free_oid(contentType);
+
+    return ret;
+}
+
+/**
+ * Encrypt end encode EnvelopedData.
+ *
+ * Encrypt and encode EnvelopedData. The data is encrypted with a
+ * random key and the the random key is encrypted with the
+ * certificates private key. This limits what private key type can be
+ * used to RSA.
+ *
+ * @param context A hx509 context.
+ * @param flags flags to control the behavior.
+ *    - HX509_CMS_EV_NO_KU_CHECK - Don't check KU on certificate
+ *    - HX509_CMS_EV_ALLOW_WEAK - Allow weak crytpo
+ *    - HX509_CMS_EV_ID_NAME - prefer issuer name and serial number
+ * @param cert Certificate to encrypt the EnvelopedData encryption key
+ * with.
+ * @param data pointer the data to encrypt.
+ * @param length length of the data that data point to.
+ * @param encryption_type Encryption cipher to use for the bulk data,
+ * use NULL to get default.
+ * @param contentType type of the data that is encrypted
+ * @param content the output of the function,
+ * free with der_free_octet_string().
+ *
+ * @return an hx509 error code.
+ *
+ * @ingroup hx509_cms
+ */
+
+HX509_LIB_FUNCTION int HX509_LIB_CALL
+hx509_cms_envelope_1(hx509_context context,
+		     int flags,
+		     hx509_cert cert,
+		     const void *data,
+		     size_t length,
+		     const heim_oid *encryption_type,
+		     const heim_oid *contentType,
+		     heim_octet_string *content)
+{
+    KeyTransRecipientInfo *ri;
+    heim_octet_string ivec;
+    heim_octet_string key;
+    hx509_crypto crypto = NULL;
+    int ret, cmsidflag;
+    EnvelopedData ed;
+    size_t size;
+
+    memset(&ivec, 0, sizeof(ivec));
+    memset(&key, 0, sizeof(key));
+    memset(&ed, 0, sizeof(ed));
+    memset(content, 0, sizeof(*content));
+
+    if (encryption_type == NULL)
+	encryption_type = &asn1_oid_id_aes_256_cbc;
+
+    if ((flags & HX509_CMS_EV_NO_KU_CHECK) == 0) {
+	ret = _hx509_check_key_usage(context, cert, 1 << 2, TRUE);
+	if (ret)
+	    goto out;
+    }
+
+    ret = hx509_crypto_init(context, NULL, encryption_type, &crypto);
+    if (ret)
+	goto out;
+
+    if (flags & HX509_CMS_EV_ALLOW_WEAK)
+	hx509_crypto_allow_weak(crypto);
+
+    ret = hx509_crypto_set_random_key(crypto, &key);
+    if (ret) {
+	hx509_set_error_string(context, 0, ret,
+			       "Create random key for EnvelopedData content");
+	goto out;
+    }
+
+    ret = hx509_crypto_random_iv(crypto, &ivec);
+    if (ret) {
+	hx509_set_error_string(context, 0, ret,
+			       "Failed to create a random iv");
+	goto out;
+    }
+
+    ret = hx509_crypto_encrypt(crypto,
+			       data,
+			       length,
+			       &ivec,
+			       &ed.encryptedContentInfo.encryptedContent);
+    if (ret) {
+	hx509_set_error_string(context, 0, ret,
+			       "Failed to encrypt EnvelopedData content");
+	goto out;
+    }
+
+    {
+	AlgorithmIdentifier *enc_alg;
+	enc_alg = &ed.encryptedContentInfo.contentEncryptionAlgorithm;
+	ret = der_copy_oid(encryption_type, &enc_alg->algorithm);
+	if (ret) {
+	    hx509_set_error_string(context, 0, ret,
+				   "Failed to set crypto oid "
+				   "for EnvelopedData");
+	    goto out;
+	}
+	ALLOC(enc_alg->parameters, 1);
+	if (enc_alg->parameters == NULL) {
+	    ret = ENOMEM;
+	    hx509_set_error_string(context, 0, ret,
+				   "Failed to allocate crypto parameters "
+				   "for EnvelopedData");
+	    goto out;
+	}
+
+	ret = hx509_crypto_get_params(context,
+				      crypto,
+				      &ivec,
+				      enc_alg->parameters);
+	if (ret) {
+	    goto out;
+	}
+    }
+
+    ALLOC_SEQ(&ed.recipientInfos, 1);
+    if (ed.recipientInfos.val == NULL) {
+	ret = ENOMEM;
+	hx509_set_error_string(context, 0, ret,
+			       "Failed to allocate recipients info "
+			       "for EnvelopedData");
+	goto out;
+    }
+
+    ri = &ed.recipientInfos.val[0];
+
+    if (flags & HX509_CMS_EV_ID_NAME) {
+	ri->version = 0;
+	cmsidflag = CMS_ID_NAME;
     } else {
 	ri->version = 2;
 	cmsidflag = CMS_ID_SKI;
@@ -765,143 +931,30 @@ find_attribute(const CMSAttributes *attr, const heim_oid *oid)
     return NULL;
 }
 
-/**
- * Decode SignedData and verify that the signature is correct.
- *
- * @param context A hx509 context.
- * @param ctx a hx509 verify context.
- * @param flags to control the behaivor of the function.
- *    - HX509_CMS_VS_NO_KU_CHECK - Don't check KeyUsage
- *    - HX509_CMS_VS_ALLOW_DATA_OID_MISMATCH - allow oid mismatch
- *    - HX509_CMS_VS_ALLOW_ZERO_SIGNER - no signer, see below.
- * @param data pointer to CMS SignedData encoded data.
- * @param length length of the data that data point to.
- * @param signedContent external data used for signature.
- * @param pool certificate pool to build certificates paths.
- * @param contentType free with der_free_oid().
- * @param content the output of the function, free with
- * der_free_octet_string().
- * @param signer_certs list of the cerficates used to sign this
- * request, free with hx509_certs_free().
- *
- * @return an hx509 error code.
- *
- * @ingroup hx509_cms
- */
-
-HX509_LIB_FUNCTION int HX509_LIB_CALL
-hx509_cms_verify_signed(hx509_context context,
-			hx509_verify_ctx ctx,
-			unsigned int flags,
-			const void *data,
-			size_t length,
-			const heim_octet_string *signedContent,
-			hx509_certs pool,
-			heim_oid *contentType,
-			heim_octet_string *content,
-			hx509_certs *signer_certs)
-{
-    unsigned int verify_flags;
-
-    return hx509_cms_verify_signed_ext(context,
-				       ctx,
-				       flags,
-				       data,
-				       length,
-				       signedContent,
-				       pool,
-				       contentType,
-				       content,
-				       signer_certs,
-				       &verify_flags);
-}
-
-/**
- * Decode SignedData and verify that the signature is correct.
- *
- * @param context A hx509 context.
- * @param ctx a hx509 verify context.
- * @param flags to control the behaivor of the function.
- *    - HX509_CMS_VS_NO_KU_CHECK - Don't check KeyUsage
- *    - HX509_CMS_VS_ALLOW_DATA_OID_MISMATCH - allow oid mismatch
- *    - HX509_CMS_VS_ALLOW_ZERO_SIGNER - no signer, see below.
- * @param data pointer to CMS SignedData encoded data.
- * @param length length of the data that data point to.
- * @param signedContent external data used for signature.
- * @param pool certificate pool to build certificates paths.
- * @param contentType free with der_free_oid().
- * @param content the output of the function, free with
- * der_free_octet_string().
- * @param signer_certs list of the cerficates used to sign this
- * request, free with hx509_certs_free().
- * @param verify_flags flags indicating whether the certificate
- * was verified or not
- *
- * @return an hx509 error code.
- *
- * @ingroup hx509_cms
- */
-
-HX509_LIB_FUNCTION int HX509_LIB_CALL
-hx509_cms_verify_signed_ext(hx509_context context,
-			    hx509_verify_ctx ctx,
-			    unsigned int flags,
-			    const void *data,
-			    size_t length,
-			    const heim_octet_string *signedContent,
-			    hx509_certs pool,
-			    heim_oid *contentType,
-			    heim_octet_string *content,
-			    hx509_certs *signer_certs,
-			    unsigned int *verify_flags)
-{
-    SignerInfo *signer_info;
-    hx509_cert cert = NULL;
-    hx509_certs certs = NULL;
-    SignedData sd;
-    size_t size;
-    int ret, found_valid_sig;
-    size_t i;
-
-    *signer_certs = NULL;
-    *verify_flags = 0;
-
-    content->data = NULL;
-    content->length = 0;
-    contentType->length = 0;
-    contentType->components = NULL;
-
-    memset(&sd, 0, sizeof(sd));
-
-    ret = decode_SignedData(data, length, &sd, &size);
-    if (ret) {
-	hx509_set_error_string(context, 0, ret,
-			       "Failed to decode SignedData");
-	goto out;
-    }
-
-    if (sd.encapContentInfo.eContent == NULL && signedContent == NULL) {
-	ret = HX509_CMS_NO_DATA_AVAILABLE;
-	hx509_set_error_string(context, 0, ret,
-			       "No content data in SignedData");
-	goto out;
-    }
-    if (sd.encapContentInfo.eContent && signedContent) {
-	ret = HX509_CMS_NO_DATA_AVAILABLE;
-	hx509_set_error_string(context, 0, ret,
-			       "Both external and internal SignedData");
-	goto out;
-    }
-
-    if (sd.encapContentInfo.eContent)
-	ret = der_copy_octet_string(sd.encapContentInfo.eContent, content);
-    else
-	ret = der_copy_octet_string(signedContent, content);
-    if (ret) {
-	hx509_set_error_string(context, 0, ret, "malloc: out of memory");
-	goto out;
-    }
-
+/*
+ * Verify the SignerInfos of `sd' against the content, either given
+ * in full in `content' or as one precomputed digest per SignerInfo in
+ * `digests', and collect the signer certificates that validate.
+ */
+
+static int
+verify_signer_infos(hx509_context context,
+		    hx509_verify_ctx ctx,
+		    unsigned int flags,
+		    const SignedData *sd,
+		    const heim_octet_string *content,
+		    const heim_octet_string *digests,
+		    hx509_certs pool,
+		    hx509_certs *signer_certs,
+		    unsigned int *verify_flags)
+{
+    SignerInfo *signer_info;
+    hx509_cert cert = NULL;
+    hx509_certs certs = NULL;
+    size_t size;
+    int ret, found_valid_sig;
+    size_t i;
+
     ret = hx509_certs_init(context, "MEMORY:cms-cert-buffer",
 			   0, NULL, &certs);
     if (ret)
@@ -914,7 +967,7 @@ hx509_cms_verify_signed_ext(hx509_context context,
 
     /* XXX Check CMS version */
 
-    ret = any_to_certs(context, &sd, certs);
+    ret = any_to_certs(context, sd, certs);
     if (ret)
 	goto out;
 
@@ -924,12 +977,12 @@ hx509_cms_verify_signed_ext(hx509_context context,
 	    goto out;
     }
 
-    for (found_valid_sig = 0, i = 0; i < sd.signerInfos.len; i++) {
+    for (found_valid_sig = 0, i = 0; i < sd->signerInfos.len; i++) {
 	heim_octet_string signed_data = { 0, 0 };
 	const heim_oid *match_oid;
 	heim_oid decode_oid;
 
-	signer_info = &sd.signerInfos.val[i];
+	signer_info = &sd->signerInfos.val[i];
 	match_oid = NULL;
 
 	if (signer_info->signature.length == 0) {
@@ -998,11 +1051,21 @@ hx509_cms_verify_signed_ext(hx509_context context,
 		goto next_sigature;
 	    }
 
-	    ret = _hx509_verify_signature(context,
-					  NULL,
-					  &signer_info->digestAlgorithm,
-					  content,
-					  &os);
+	    if (digests == NULL) {
+		ret = _hx509_verify_signature(context,
+					      NULL,
+					      &signer_info->digestAlgorithm,
+					      content,
+					      &os);
+	    } else if (digests[i].data == NULL) {
+		ret = HX509_SIG_ALG_NO_SUPPORTED;
+		hx509_clear_error_string(context);
+	    } else if (os.length != digests[i].length ||
+		       ct_memcmp(os.data, digests[i].data, os.length) != 0) {
+		ret = HX509_CRYPTO_BAD_SIGNATURE;
+		hx509_set_error_string(context, 0, ret,
+				       "Bad messageDigest");
+	    }
 	    der_free_octet_string(&os);
 	    if (ret) {
 		hx509_set_error_string(context, HX509_ERROR_APPEND, ret,
@@ -1052,6 +1115,16 @@ hx509_cms_verify_signed_ext(hx509_context context,
 	    if (size != signed_data.length)
 		_hx509_abort("internal ASN.1 encoder error");
 
+	} else if (content == NULL) {
+	    /*
+	     * Without signed attributes the signature covers the
+	     * content itself, which was not kept around.
+	     */
+	    ret = HX509_CMS_MISSING_SIGNER_DATA;
+	    hx509_set_error_string(context, 0, ret,
+				   "SignerInfo %d in SignedData has no "
+				   "signed attributes", (int)i);
+	    goto next_sigature;
 	} else {
 	    signed_data.data = content->data;
 	    signed_data.length = content->length;
@@ -1066,7 +1139,7 @@ hx509_cms_verify_signed_ext(hx509_context context,
 	 * that doesn't follow CMS signedAttributes rules.
 	 */
 
-	if (der_heim_oid_cmp(match_oid, &sd.encapContentInfo.eContentType) &&
+	if (der_heim_oid_cmp(match_oid, &sd->encapContentInfo.eContentType) &&
 	    (flags & HX509_CMS_VS_ALLOW_DATA_OID_MISMATCH) == 0) {
 	    ret = HX509_CMS_DATA_OID_MISMATCH;
 	    hx509_set_error_string(context, 0, ret,
@@ -1086,7 +1159,8 @@ hx509_cms_verify_signed_ext(hx509_context context,
 				       "Failed to verify signature in "
 				       "CMS SignedData");
 	}
-        if (signed_data.data != NULL && content->data != signed_data.data) {
+        if (signed_data.data != NULL &&
+	    (content == NULL || content->data != signed_data.data)) {
             free(signed_data.data);
             signed_data.data = NULL;
         }
@@ -1120,7 +1194,7 @@ hx509_cms_verify_signed_ext(hx509_context context,
      * in corner cases, it make into a flag that the caller have to
      * turn on.
      */
-    if (sd.signerInfos.len == 0 && (flags & HX509_CMS_VS_ALLOW_ZERO_SIGNER)) {
+    if (sd->signerInfos.len == 0 && (flags & HX509_CMS_VS_ALLOW_ZERO_SIGNER)) {
 	if (*signer_certs)
 	    hx509_certs_free(signer_certs);
     } else if (found_valid_sig == 0) {
@@ -1131,6 +1205,152 @@ hx509_cms_verify_signed_ext(hx509_context context,
 	}
 	goto out;
     }
+    ret = 0;
+
+
+out:
+    if (certs)
+	hx509_certs_free(&certs);
+    return ret;
+}
+
+/**
+ * Decode SignedData and verify that the signature is correct.
+ *
+ * @param context A hx509 context.
+ * @param ctx a hx509 verify context.
+ * @param flags to control the behaivor of the function.
+ *    - HX509_CMS_VS_NO_KU_CHECK - Don't check KeyUsage
+ *    - HX509_CMS_VS_ALLOW_DATA_OID_MISMATCH - allow oid mismatch
+ *    - HX509_CMS_VS_ALLOW_ZERO_SIGNER - no signer, see below.
+ * @param data pointer to CMS SignedData encoded data.
+ * @param length length of the data that data point to.
+ * @param signedContent external data used for signature.
+ * @param pool certificate pool to build certificates paths.
+ * @param contentType free with der_free_oid().
+ * @param content the output of the function, free with
+ * der_free_octet_string().
+ * @param signer_certs list of the cerficates used to sign this
+ * request, free with hx509_certs_free().
+ *
+ * @return an hx509 error code.
+ *
+ * @ingroup hx509_cms
+ */
+
+HX509_LIB_FUNCTION int HX509_LIB_CALL
+hx509_cms_verify_signed(hx509_context context,
+			hx509_verify_ctx ctx,
+			unsigned int flags,
+			const void *data,
+			size_t length,
+			const heim_octet_string *signedContent,
+			hx509_certs pool,
+			heim_oid *contentType,
+			heim_octet_string *content,
+			hx509_certs *signer_certs)
+{
+    unsigned int verify_flags;
+
+    return hx509_cms_verify_signed_ext(context,
+				       ctx,
+				       flags,
+				       data,
+				       length,
+				       signedContent,
+				       pool,
+				       contentType,
+				       content,
+				       signer_certs,
+				       &verify_flags);
+}
+
+/**
+ * Decode SignedData and verify that the signature is correct.
+ *
+ * @param context A hx509 context.
+ * @param ctx a hx509 verify context.
+ * @param flags to control the behaivor of the function.
+ *    - HX509_CMS_VS_NO_KU_CHECK - Don't check KeyUsage
+ *    - HX509_CMS_VS_ALLOW_DATA_OID_MISMATCH - allow oid mismatch
+ *    - HX509_CMS_VS_ALLOW_ZERO_SIGNER - no signer, see below.
+ * @param data pointer to CMS SignedData encoded data.
+ * @param length length of the data that data point to.
+ * @param signedContent external data used for signature.
+ * @param pool certificate pool to build certificates paths.
+ * @param contentType free with der_free_oid().
+ * @param content the output of the function, free with
+ * der_free_octet_string().
+ * @param signer_certs list of the cerficates used to sign this
+ * request, free with hx509_certs_free().
+ * @param verify_flags flags indicating whether the certificate
+ * was verified or not
+ *
+ * @return an hx509 error code.
+ *
+ * @ingroup hx509_cms
+ */
+
+HX509_LIB_FUNCTION int HX509_LIB_CALL
+hx509_cms_verify_signed_ext(hx509_context context,
+			    hx509_verify_ctx ctx,
+			    unsigned int flags,
+			    const void *data,
+			    size_t length,
+			    const heim_octet_string *signedContent,
+			    hx509_certs pool,
+			    heim_oid *contentType,
+			    heim_octet_string *content,
+			    hx509_certs *signer_certs,
+			    unsigned int *verify_flags)
+{
+    SignedData sd;
+    size_t size;
+    int ret;
+
+    *signer_certs = NULL;
+    *verify_flags = 0;
+
+    content->data = NULL;
+    content->length = 0;
+    contentType->length = 0;
+    contentType->components = NULL;
+
+    memset(&sd, 0, sizeof(sd));
+
+    ret = decode_SignedData(data, length, &sd, &size);
+    if (ret) {
+	hx509_set_error_string(context, 0, ret,
+			       "Failed to decode SignedData");
+	goto out;
+    }
+
+    if (sd.encapContentInfo.eContent == NULL && signedContent == NULL) {
+	ret = HX509_CMS_NO_DATA_AVAILABLE;
+	hx509_set_error_string(context, 0, ret,
+			       "No content data in SignedData");
+	goto out;
+    }
+    if (sd.encapContentInfo.eContent && signedContent) {
+	ret = HX509_CMS_NO_DATA_AVAILABLE;
+	hx509_set_error_string(context, 0, ret,
+			       "Both external and internal SignedData");
+	goto out;
+    }
+
+    if (sd.encapContentInfo.eContent)
+	ret = der_copy_octet_string(sd.encapContentInfo.eContent, content);
+    else
+	ret = der_copy_octet_string(signedContent, content);
+    if (ret) {
+	hx509_set_error_string(context, 0, ret, "malloc: out of memory");
+	goto out;
+    }
+
+    ret = verify_signer_infos(context, ctx, flags, &sd, content, NULL,
+			      pool, signer_certs, verify_flags);
+    if (ret)
+	goto out;
 
     ret = der_copy_oid(&sd.encapContentInfo.eContentType, contentType);
     if (ret) {
@@ -1140,8 +1360,6 @@ hx509_cms_verify_signed_ext(hx509_context context,
 
 out:
     free_SignedData(&sd);
-    if (certs)
-	hx509_certs_free(&certs);
     if (ret) {
 	if (content->data)
 	    der_free_octet_string(content);
@@ -1154,6 +1372,163 @@ out:
     return ret;
 }
 
+/**
+ * Decode detached SignedData and verify the signature, reading the
+ * signed content incrementally from a reader callback.
+ *
+ * The content is hashed in chunks as it is read, once per SignerInfo
+ * digest algorithm, and is never held in memory in full. Only
+ * SignerInfos with signed attributes can be verified this way, since
+ * otherwise the signature is made over the content itself.
+ *
+ * @param context A hx509 context.
+ * @param ctx a hx509 verify context.
+ * @param flags to control the behaivor of the function, see
+ * hx509_cms_verify_signed_ext().
+ * @param data pointer to CMS SignedData encoded data, must not
+ * contain the content.
+ * @param length length of the data that data point to.
+ * @param reader called to read the signed content.
+ * @param reader_ctx context passed to reader.
+ * @param pool certificate pool to build certificates paths.
+ * @param contentType free with der_free_oid().
+ * @param signer_certs list of the cerficates used to sign this
+ * request, free with hx509_certs_free().
+ * @param verify_flags flags indicating whether the certificate
+ * was verified or not
+ *
+ * @return an hx509 error code.
+ *
+ * @ingroup hx509_cms
+ */
+
+HX509_LIB_FUNCTION int HX509_LIB_CALL
+hx509_cms_verify_signed_stream(hx509_context context,
+			       hx509_verify_ctx ctx,
+			       unsigned int flags,
+			       const void *data,
+			       size_t length,
+			       hx509_cms_read_func reader,
+			       void *reader_ctx,
+			       hx509_certs pool,
+			       heim_oid *contentType,
+			       hx509_certs *signer_certs,
+			       unsigned int *verify_flags)
+{
+    heim_octet_string *digests = NULL;
+    EVP_MD_CTX **mdctx = NULL;
+    unsigned char *buf = NULL;
+    SignedData sd;
+    size_t size, got, i;
+    int ret;
+
+    *signer_certs = NULL;
+    *verify_flags = 0;
+
+    contentType->length = 0;
+    contentType->components = NULL;
+
+    memset(&sd, 0, sizeof(sd));
+
+    ret = decode_SignedData(data, length, &sd, &size);
+    if (ret) {
+	hx509_set_error_string(context, 0, ret,
+			       "Failed to decode SignedData");
+	goto out;
+    }
+
+    if (sd.encapContentInfo.eContent) {
+	ret = HX509_CMS_NO_DATA_AVAILABLE;
+	hx509_set_error_string(context, 0, ret,
+			       "Both external and internal SignedData");
+	goto out;
+    }
+
+    digests = calloc(sd.signerInfos.len + 1, sizeof(digests[0]));
+    mdctx = calloc(sd.signerInfos.len + 1, sizeof(mdctx[0]));
+    buf = malloc(CMS_STREAM_CHUNK);
+    if (digests == NULL || mdctx == NULL || buf == NULL) {
+	ret = ENOMEM;
+	hx509_set_error_string(context, 0, ret, "malloc: out of memory");
+	goto out;
+    }
+
+    /*
+     * Signers with an unknown digest algorithm are left without a
+     * digest and fail on their own in verify_signer_infos().
+     */
+    for (i = 0; i < sd.signerInfos.len; i++) {
+	const struct signature_alg *md;
+
+	md = _hx509_find_sig_alg(&sd.signerInfos.val[i].digestAlgorithm.algorithm);
+	if (md == NULL || md->evp_md == NULL || (md->flags & SIG_DIGEST) == 0)
+	    continue;
+	mdctx[i] = EVP_MD_CTX_create();
+	if (mdctx[i] == NULL) {
+	    ret = ENOMEM;
+	    hx509_set_error_string(context, 0, ret, "malloc: out of memory");
+	    goto out;
+	}
+	EVP_DigestInit_ex(mdctx[i], md->evp_md(), NULL);
+    }
+
+    while (1) {
+	ret = (*reader)(reader_ctx, buf, CMS_STREAM_CHUNK, &got);
+	if (ret) {
+	    hx509_set_error_string(context, 0, ret,
+				   "Failed to read SignedData content");
+	    goto out;
+	}
+	if (got == 0)
+	    break;
+	for (i = 0; i < sd.signerInfos.len; i++)
+	    if (mdctx[i])
+		EVP_DigestUpdate(mdctx[i], buf, got);
+    }
+
+    for (i = 0; i < sd.signerInfos.len; i++) {
+	if (mdctx[i] == NULL)
+	    continue;
+	digests[i].length = EVP_MD_CTX_size(mdctx[i]);
+	digests[i].data = malloc(digests[i].length);
+	if (digests[i].data == NULL) {
+	    ret = ENOMEM;
+	    hx509_set_error_string(context, 0, ret, "malloc: out of memory");
+	    goto out;
+	}
+	EVP_DigestFinal_ex(mdctx[i], digests[i].data, NULL);
+    }
+
+    ret = verify_signer_infos(context, ctx, flags, &sd, NULL, digests,
+			      pool, signer_certs, verify_flags);
+    if (ret)
+	goto out;
+
+    ret = der_copy_oid(&sd.encapContentInfo.eContentType, contentType);
+    if (ret) {
+	hx509_clear_error_string(context);
+	goto out;
+    }
+
+out:
+    for (i = 0; mdctx && i < sd.signerInfos.len; i++)
+	if (mdctx[i])
+	    EVP_MD_CTX_destroy(mdctx[i]);
+    for (i = 0; digests && i < sd.signerInfos.len; i++)
+	der_free_octet_string(&digests[i]);
+    free(mdctx);
+    free(digests);
+    free(buf);
+    free_SignedData(&sd);
+    if (ret) {
+	if (*signer_certs)
+	    hx509_certs_free(signer_certs);
+	der_free_oid(contentType);
+    }
+
+    return ret;
+}
+
 static int
 add_one_attribute(Attribute **attr,
 		  unsigned int *len,
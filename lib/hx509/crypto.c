@@ -1098,6 +1098,101 @@ _hx509_self_signed_valid(hx509_context context,
 }
 
 
+/*
+ * Signatures made with public key algorithms are remembered once
+ * they have been verified, since the same signatures are checked
+ * again and again (intermediate CAs, OCSP responders, retransmitted
+ * PKINIT requests).  The result depends only on the key, the
+ * algorithm, the data and the signature, so the cache digest covers
+ * exactly those.  Only successes are cached.
+ */
+
+static void
+sig_cache_update(EVP_MD_CTX *m, const void *data, size_t len)
+{
+    uint64_t l = len;
+
+    EVP_DigestUpdate(m, &l, sizeof(l));
+    EVP_DigestUpdate(m, data, len);
+}
+
+static int
+sig_cache_digest(const Certificate *signer,
+		 const AlgorithmIdentifier *alg,
+		 const heim_octet_string *data,
+		 const heim_octet_string *sig,
+		 unsigned char digest[HX509_SIG_CACHE_DIGEST_LEN])
+{
+    const SubjectPublicKeyInfo *spi =
+	&signer->tbsCertificate.subjectPublicKeyInfo;
+    EVP_MD_CTX *m;
+
+    m = EVP_MD_CTX_create();
+    if (m == NULL)
+	return ENOMEM;
+    EVP_DigestInit_ex(m, EVP_sha256(), NULL);
+    sig_cache_update(m, spi->algorithm.algorithm.components,
+		     spi->algorithm.algorithm.length *
+		     sizeof(spi->algorithm.algorithm.components[0]));
+    if (spi->algorithm.parameters)
+	sig_cache_update(m, spi->algorithm.parameters->data,
+			 spi->algorithm.parameters->length);
+    else
+	sig_cache_update(m, NULL, 0);
+    sig_cache_update(m, spi->subjectPublicKey.data,
+		     (spi->subjectPublicKey.length + 7) / 8);
+    sig_cache_update(m, alg->algorithm.components,
+		     alg->algorithm.length * sizeof(alg->algorithm.components[0]));
+    if (alg->parameters)
+	sig_cache_update(m, alg->parameters->data, alg->parameters->length);
+    else
+	sig_cache_update(m, NULL, 0);
+    sig_cache_update(m, data->data, data->length);
+    sig_cache_update(m, sig->data, sig->length);
+    EVP_DigestFinal_ex(m, digest, NULL);
+    EVP_MD_CTX_destroy(m);
+    return 0;
+}
+
+static size_t
+sig_cache_slot(const unsigned char digest[HX509_SIG_CACHE_DIGEST_LEN])
+{
+    uint32_t h;
+
+    h = digest[0] | (digest[1] << 8) | (digest[2] << 16) |
+	((uint32_t)digest[3] << 24);
+    return h % HX509_SIG_CACHE_SIZE;
+}
+
+static int
+sig_cache_lookup(hx509_context context,
+		 const unsigned char digest[HX509_SIG_CACHE_DIGEST_LEN])
+{
+    size_t i = sig_cache_slot(digest);
+    int found;
+
+    HEIMDAL_MUTEX_lock(&context->sig_cache_mutex);
+    found = memcmp(context->sig_cache[i].digest, digest,
+		   HX509_SIG_CACHE_DIGEST_LEN) == 0;
+    if (found)
+	context->sig_cache_hits++;
+    else
+	context->sig_cache_misses++;
+    HEIMDAL_MUTEX_unlock(&context->sig_cache_mutex);
+    return found;
+}
+
+static void
+sig_cache_store(hx509_context context,
+		const unsigned char digest[HX509_SIG_CACHE_DIGEST_LEN])
+{
+    size_t i = sig_cache_slot(digest);
+
+    HEIMDAL_MUTEX_lock(&context->sig_cache_mutex);
+    memcpy(context->sig_cache[i].digest, digest, HX509_SIG_CACHE_DIGEST_LEN);
+    HEIMDAL_MUTEX_unlock(&context->sig_cache_mutex);
+}
+
 HX509_LIB_FUNCTION int HX509_LIB_CALL
 _hx509_verify_signature(hx509_context context,
 			const hx509_cert cert,
@@ -1105,8 +1200,10 @@ _hx509_verify_signature(hx509_context context,
 			const heim_octet_string *data,
 			const heim_octet_string *sig)
 {
+    unsigned char digest[HX509_SIG_CACHE_DIGEST_LEN];
     const struct signature_alg *md;
     const Certificate *signer = NULL;
+    int ret, cache;
 
     if (cert)
 	signer = _hx509_get_cert(cert);
@@ -1133,7 +1230,16 @@ _hx509_verify_signature(hx509_context context,
 	    return HX509_SIG_ALG_DONT_MATCH_KEY_ALG;
 	}
     }
-    return (*md->verify_signature)(context, md, signer, alg, data, sig);
+    if (signer == NULL)
+	return (*md->verify_signature)(context, md, signer, alg, data, sig);
+
+    cache = sig_cache_digest(signer, alg, data, sig, digest) == 0;
+    if (cache && sig_cache_lookup(context, digest))
+	return 0;
+    ret = (*md->verify_signature)(context, md, signer, alg, data, sig);
+    if (ret == 0 && cache)
+	sig_cache_store(context, digest);
+    return ret;
 }
 
 HX509_LIB_FUNCTION int HX509_LIB_CALL
@@ -2299,6 +2405,149 @@ hx509_crypto_decrypt(hx509_crypto crypto,
     return ret;
 }
 
+#define CRYPTO_STREAM_CHUNK	(16 * 1024)
+
+/**
+ * Decrypt data incrementally, reading the ciphertext from a reader
+ * callback and handing the cleartext to a writer callback in chunks,
+ * so that neither needs to be held in memory in full.  PKCS7 padding
+ * is removed from the final block.
+ *
+ * @param crypto crypto context with key set.
+ * @param ivec initialization vector, or NULL.
+ * @param reader called to fetch more ciphertext, signals end of data
+ * by returning 0 with *got set to 0.
+ * @param reader_ctx context passed to reader.
+ * @param writer called with each chunk of cleartext.
+ * @param writer_ctx context passed to writer.
+ *
+ * @return an hx509 error code, or the error returned by reader or
+ * writer.
+ *
+ * @ingroup hx509_crypto
+ */
+
+HX509_LIB_FUNCTION int HX509_LIB_CALL
+hx509_crypto_decrypt_stream(hx509_crypto crypto,
+			    heim_octet_string *ivec,
+			    hx509_cms_read_func reader,
+			    void *reader_ctx,
+			    hx509_cms_write_func writer,
+			    void *writer_ctx)
+{
+    EVP_CIPHER_CTX evp;
+    unsigned char *in = NULL, *out = NULL;
+    size_t have = 0, got, n, bsize;
+    void *idata = NULL;
+    int ret, padding;
+
+    if ((crypto->cipher->flags & CIPHER_WEAK) &&
+	(crypto->flags & ALLOW_WEAK) == 0)
+	return HX509_CRYPTO_ALGORITHM_BEST_BEFORE;
+
+    if (ivec && EVP_CIPHER_iv_length(crypto->c) < (int)ivec->length)
+	return HX509_CRYPTO_INTERNAL_ERROR;
+
+    if (crypto->key.data == NULL)
+	return HX509_CRYPTO_INTERNAL_ERROR;
+
+    bsize = EVP_CIPHER_block_size(crypto->c);
+    padding = (crypto->flags & PADDING_PKCS7) && bsize > 1;
+
+    if (ivec)
+	idata = ivec->data;
+
+    in = malloc(CRYPTO_STREAM_CHUNK);
+    out = malloc(CRYPTO_STREAM_CHUNK);
+    if (in == NULL || out == NULL) {
+	free(in);
+	free(out);
+	return ENOMEM;
+    }
+
+    EVP_CIPHER_CTX_init(&evp);
+
+    ret = EVP_CipherInit_ex(&evp, crypto->c, NULL,
+			    crypto->key.data, idata, 0);
+    if (ret != 1) {
+	ret = HX509_CRYPTO_INTERNAL_ERROR;
+	goto out;
+    }
+
+    while (1) {
+	ret = (*reader)(reader_ctx, in + have, CRYPTO_STREAM_CHUNK - have, &got);
+	if (ret)
+	    goto out;
+	if (got == 0)
+	    break;
+	have += got;
+
+	/*
+	 * Only decrypt whole blocks, and when padding is used hold
+	 * back the last block until we know it really is the last.
+	 */
+	if (padding)
+	    n = ((have - 1) / bsize) * bsize;
+	else
+	    n = (have / bsize) * bsize;
+	if (n == 0)
+	    continue;
+
+	if (EVP_Cipher(&evp, out, in, n) != 1) {
+	    ret = HX509_CRYPTO_INTERNAL_ERROR;
+	    goto out;
+	}
+	ret = (*writer)(writer_ctx, out, n);
+	if (ret)
+	    goto out;
+	memmove(in, in + n, have - n);
+	have -= n;
+    }
+
+    if ((have % bsize) != 0 || (padding && have == 0)) {
+	ret = padding ? HX509_CMS_PADDING_ERROR : HX509_CRYPTO_INTERNAL_ERROR;
+	goto out;
+    }
+    if (have == 0) {
+	ret = 0;
+	goto out;
+    }
+
+    if (EVP_Cipher(&evp, out, in, have) != 1) {
+	ret = HX509_CRYPTO_INTERNAL_ERROR;
+	goto out;
+    }
+
+    if (padding) {
+	size_t padsize = out[have - 1];
+	size_t j;
+
+	if (padsize == 0 || padsize > bsize) {
+	    ret = HX509_CMS_PADDING_ERROR;
+	    goto out;
+	}
+	for (j = 0; j < padsize; j++) {
+	    if (out[have - 1 - j] != padsize) {
+		ret = HX509_CMS_PADDING_ERROR;
+		goto out;
+	    }
+	}
+	have -= padsize;
+    }
+
+    ret = 0;
+    if (have)
+	ret = (*writer)(writer_ctx, out, have);
+
+ out:
+    EVP_CIPHER_CTX_cleanup(&evp);
+    memset_s(in, CRYPTO_STREAM_CHUNK, 0, CRYPTO_STREAM_CHUNK);
+    memset_s(out, CRYPTO_STREAM_CHUNK, 0, CRYPTO_STREAM_CHUNK);
+    free(in);
+    free(out);
+    return ret;
+}
+
 typedef int (*PBE_string2key_func)(hx509_context,
 				   const char *,
 				   const heim_octet_string *,
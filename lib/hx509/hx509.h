@@ -53,6 +53,7 @@ typedef struct hx509_private_key *hx509_private_key;
 typedef struct hx509_private_key_ops hx509_private_key_ops;
 typedef struct hx509_validate_ctx_data *hx509_validate_ctx;
 typedef struct hx509_verify_ctx_data *hx509_verify_ctx;
+typedef struct hx509_verify_cache_data *hx509_verify_cache;
 typedef struct hx509_revoke_ctx_data *hx509_revoke_ctx;
 typedef struct hx509_query_data hx509_query;
 typedef void * hx509_cursor;
@@ -64,6 +65,7 @@ typedef struct hx509_env_data *hx509_env;
 typedef struct hx509_crl *hx509_crl;
 
 typedef void (*hx509_vprint_func)(void *, const char *, va_list);
+typedef int (*hx509_revoke_ocsp_fetch_func)(hx509_context, void *, const char *);
 
 typedef enum {
     HX509_SAN_TYPE_UNSUPPORTED = 0,
@@ -144,6 +146,15 @@ typedef int
 (*hx509_pem_read_func)(hx509_context, const char *, const hx509_pem_header *,
 		       const void *, size_t, void *ctx);
 
+/*
+ * Content callbacks for the streaming CMS functions.  The reader
+ * returns 0 and sets *got to 0 at end of data.
+ */
+typedef int
+(*hx509_cms_read_func)(void *ctx, void *buf, size_t len, size_t *got);
+typedef int
+(*hx509_cms_write_func)(void *ctx, const void *buf, size_t len);
+
 /*
  * Options passed to hx509_query_match_option.
  */
@@ -92,6 +92,7 @@
 struct hx509_keyset_ops;
 struct hx509_collector;
 struct hx509_generate_private_context;
+struct hx509_cache_stats;
 typedef struct hx509_path hx509_path;
 
 #include <heimbase.h>
@@ -120,6 +121,7 @@ struct hx509_peer_info {
 
 struct hx509_name_data {
     Name der_name;
+    struct _hx509_name_prep *prep;	/* cached by hx509_name_cmp() */
 };
 
 struct hx509_path {
@@ -198,6 +200,14 @@ struct _hx509_password {
 
 extern hx509_lock _hx509_empty_lock;
 
+/*
+ * Recently verified signatures, see _hx509_verify_signature().  The
+ * cache is direct mapped on a SHA-256 digest of the key, algorithm,
+ * data and signature.
+ */
+#define HX509_SIG_CACHE_DIGEST_LEN	32
+#define HX509_SIG_CACHE_SIZE		64
+
 struct hx509_context_data {
     struct hx509_keyset_ops **ks_ops;
     int ks_num_ops;
@@ -209,8 +219,25 @@ struct hx509_context_data {
     struct et_list *et_list;
     char *querystat;
     hx509_certs default_trust_anchors;
+    struct hx509_ca_issuer *ca_issuers;
     heim_context hcontext;
     heim_config_section *cf;
+    HEIMDAL_MUTEX sig_cache_mutex;
+    struct {
+	unsigned char digest[HX509_SIG_CACHE_DIGEST_LEN];
+    } sig_cache[HX509_SIG_CACHE_SIZE];
+    unsigned long sig_cache_hits;
+    unsigned long sig_cache_misses;
+};
+
+/* counters reported by _hx509_cache_stats() */
+struct hx509_cache_stats {
+    unsigned long sig_hits;		/* context signature cache */
+    unsigned long sig_misses;
+    unsigned long path_hits;		/* verify cache, whole paths */
+    unsigned long path_misses;
+    unsigned long ca_sig_hits;		/* verify cache, CA signatures */
+    unsigned long ca_sig_misses;
 };
 
 /* _hx509_calculate_path flag field */
@@ -194,6 +194,27 @@ struct pem_data {
     int detached_data;
 };
 
+static int
+stream_read(void *ctx, void *buf, size_t len, size_t *got)
+{
+    FILE *f = ctx;
+
+    *got = fread(buf, 1, len, f);
+    if (*got == 0 && ferror(f))
+	return errno ? errno : EIO;
+    return 0;
+}
+
+static int
+stream_write(void *ctx, const void *buf, size_t len)
+{
+    FILE *f = ctx;
+
+    if (fwrite(buf, 1, len, f) != len)
+	return errno ? errno : EIO;
+    return 0;
+}
+
 static int
 pem_reader(hx509_context contextp, const char *type,
 	   const hx509_pem_header *headers,
@@ -294,7 +315,10 @@ cms_verify_sd(struct cms_verify_sd_options *opt, int argc, char **argv)
 	co.length = sz;
     }
 
-    if (opt->signed_content_string) {
+    if (opt->stream_flag && opt->signed_content_string == NULL)
+	errx(1, "--stream requires --signed-content");
+
+    if (opt->signed_content_string && !opt->stream_flag) {
 	ret = _hx509_map_file_os(opt->signed_content_string, &signeddata);
 	if (ret)
 	    errx(1, "map_file: %s: %d", opt->signed_content_string, ret);
@@ -329,8 +353,23 @@ cms_verify_sd(struct cms_verify_sd_options *opt, int argc, char **argv)
     if (opt->allow_wrong_oid_flag)
 	flags |= HX509_CMS_VS_ALLOW_DATA_OID_MISMATCH;
 
-    ret = hx509_cms_verify_signed(context, ctx, flags, co.data, co.length, sd,
-				  store, &type, &c, &signers);
+    if (opt->stream_flag) {
+	unsigned int verify_flags;
+	FILE *f;
+
+	f = fopen(opt->signed_content_string, "rb");
+	if (f == NULL)
+	    err(1, "Failed to open file %s", opt->signed_content_string);
+	ret = hx509_cms_verify_signed_stream(context, ctx, flags,
+					     co.data, co.length,
+					     stream_read, f, store,
+					     &type, &signers, &verify_flags);
+	fclose(f);
+	c.data = NULL;
+	c.length = 0;
+    } else
+	ret = hx509_cms_verify_signed(context, ctx, flags, co.data, co.length,
+				      sd, store, &type, &c, &signers);
     if (p != co.data)
 	der_free_octet_string(&co);
     else
@@ -363,7 +402,7 @@ cms_verify_sd(struct cms_verify_sd_options *opt, int argc, char **argv)
 
     hx509_lock_free(lock);
 
-    if (argc > 1) {
+    if (argc > 1 && !opt->stream_flag) {
 	ret = _hx509_write_file(argv[1], c.data, c.length);
 	if (ret)
 	    errx(1, "hx509_write_file: %d", ret);
@@ -599,8 +638,24 @@ cms_unenvelope(struct cms_unenvelope_options *opt, int argc, char **argv)
     if (opt->allow_weak_crypto_flag)
 	flags |= HX509_CMS_UE_ALLOW_WEAK;
 
-    ret = hx509_cms_unenvelope(context, certs, flags, co.data, co.length,
-			       NULL, 0, &contentType, &o);
+    if (opt->stream_flag) {
+	FILE *f;
+
+	f = fopen(argv[1], "wb");
+	if (f == NULL)
+	    err(1, "Failed to open file %s", argv[1]);
+	ret = hx509_cms_unenvelope_stream(context, certs, flags,
+					  co.data, co.length, NULL, NULL, 0,
+					  stream_write, f, &contentType);
+	if (fclose(f) != 0 && ret == 0)
+	    ret = errno;
+	if (ret)
+	    unlink(argv[1]);
+	o.data = NULL;
+	o.length = 0;
+    } else
+	ret = hx509_cms_unenvelope(context, certs, flags, co.data, co.length,
+				   NULL, 0, &contentType, &o);
     if (co.data != p)
 	der_free_octet_string(&co);
     if (ret)
@@ -611,11 +666,13 @@ cms_unenvelope(struct cms_unenvelope_options *opt, int argc, char **argv)
     hx509_certs_free(&certs);
     der_free_oid(&contentType);
 
-    ret = _hx509_write_file(argv[1], o.data, o.length);
-    if (ret)
-	errx(1, "hx509_write_file: %d", ret);
+    if (!opt->stream_flag) {
+	ret = _hx509_write_file(argv[1], o.data, o.length);
+	if (ret)
+	    errx(1, "hx509_write_file: %d", ret);
 
-    der_free_octet_string(&o);
+	der_free_octet_string(&o);
+    }
 
     return 0;
 }
@@ -1073,6 +1130,245 @@ pcert_verify(struct verify_options *opt, int argc, char **argv)
     return 0;
 }
 
+/*
+ * verify-bench: replay a corpus of certificates and SignedData
+ * messages through the verification code and report the time spent
+ * in each step, and how well the caches did.
+ */
+
+struct bench_step {
+    const char *name;
+    unsigned long count;
+    unsigned long errors;
+    double seconds;
+};
+
+struct bench {
+    hx509_verify_ctx ctx;
+    hx509_verify_ctx revoke_ctx;
+    hx509_certs pool;
+    struct bench_step path;
+    struct bench_step revoke;
+};
+
+static double
+bench_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+bench_add(struct bench_step *s, double start, int ret)
+{
+    s->seconds += bench_now() - start;
+    s->count++;
+    if (ret)
+	s->errors++;
+}
+
+static void
+bench_print_step(const struct bench_step *s)
+{
+    if (s->count == 0)
+	return;
+    printf("%-24s %10lu %8lu %12.1f\n", s->name, s->count, s->errors,
+	   s->seconds * 1000000.0 / s->count);
+}
+
+static void
+bench_print_cache(const char *name, unsigned long hits, unsigned long misses)
+{
+    if (hits + misses == 0)
+	return;
+    printf("%-24s %10lu %8lu %11.1f%%\n", name, hits, misses,
+	   100.0 * hits / (hits + misses));
+}
+
+static int HX509_LIB_CALL
+bench_path_f(hx509_context hxcontext, void *ptr, hx509_cert cert)
+{
+    struct bench *b = ptr;
+    double start;
+    int ret;
+
+    start = bench_now();
+    ret = hx509_verify_path(hxcontext, b->ctx, cert, b->pool);
+    bench_add(&b->path, start, ret);
+
+    if (b->revoke_ctx) {
+	start = bench_now();
+	ret = hx509_verify_path(hxcontext, b->revoke_ctx, cert, b->pool);
+	bench_add(&b->revoke, start, ret);
+    }
+    return 0;
+}
+
+int
+verify_bench(struct verify_bench_options *opt, int argc, char **argv)
+{
+    struct bench_step cms = { "cms-verify-signed", 0, 0, 0.0 };
+    struct hx509_cache_stats stats;
+    hx509_verify_cache cache = NULL;
+    hx509_revoke_ctx revoke = NULL;
+    hx509_certs anchors, certs;
+    heim_octet_string *msgs;
+    struct bench b;
+    hx509_lock lock;
+    int i, n, ret;
+
+    memset(&b, 0, sizeof(b));
+    b.path.name = "verify-path";
+    b.revoke.name = "verify-path+revoke";
+
+    if (opt->missing_revoke_flag)
+	hx509_context_set_missing_revoke(context, 1);
+    if (opt->iterations_integer <= 0)
+	errx(1, "--iterations must be positive");
+
+    hx509_lock_init(context, &lock);
+    lock_strings(lock, &opt->pass_strings);
+
+    ret = hx509_certs_init(context, "MEMORY:bench-anchors", 0, NULL, &anchors);
+    if (ret == 0)
+	ret = hx509_certs_init(context, "MEMORY:bench-pool", 0, NULL, &b.pool);
+    if (ret == 0)
+	ret = hx509_certs_init(context, "MEMORY:bench-certs", 0, NULL, &certs);
+    if (ret)
+	hx509_err(context, 1, ret, "hx509_certs_init: MEMORY");
+
+    certs_strings(context, "anchors", anchors, lock, &opt->anchors_strings);
+    certs_strings(context, "pool", b.pool, lock, &opt->pool_strings);
+    for (i = 0; i < argc; i++) {
+	char *sn = fix_store_name(context, argv[i], "FILE");
+
+	ret = hx509_certs_append(context, certs, lock, sn);
+	if (ret)
+	    hx509_err(context, 1, ret, "hx509_certs_append: %s", sn);
+	free(sn);
+    }
+
+    if (opt->crl_strings.num_strings || opt->ocsp_strings.num_strings) {
+	ret = hx509_revoke_init(context, &revoke);
+	if (ret)
+	    hx509_err(context, 1, ret, "hx509_revoke_init");
+	for (i = 0; i < opt->crl_strings.num_strings; i++) {
+	    ret = hx509_revoke_add_crl(context, revoke,
+				       opt->crl_strings.strings[i]);
+	    if (ret)
+		hx509_err(context, 1, ret, "hx509_revoke_add_crl: %s",
+			  opt->crl_strings.strings[i]);
+	}
+	for (i = 0; i < opt->ocsp_strings.num_strings; i++) {
+	    ret = hx509_revoke_add_ocsp(context, revoke,
+					opt->ocsp_strings.strings[i]);
+	    if (ret)
+		hx509_err(context, 1, ret, "hx509_revoke_add_ocsp: %s",
+			  opt->ocsp_strings.strings[i]);
+	}
+    }
+
+    if (opt->cache_size_integer > 0) {
+	ret = hx509_verify_cache_init(context, opt->cache_size_integer,
+				      opt->cache_max_age_integer, &cache);
+	if (ret)
+	    hx509_err(context, 1, ret, "hx509_verify_cache_init");
+    }
+
+    ret = hx509_verify_init_ctx(context, &b.ctx);
+    if (ret)
+	hx509_err(context, 1, ret, "hx509_verify_init_ctx");
+    hx509_verify_attach_anchors(b.ctx, anchors);
+    hx509_verify_attach_cache(b.ctx, cache);
+    if (revoke) {
+	ret = hx509_verify_init_ctx(context, &b.revoke_ctx);
+	if (ret)
+	    hx509_err(context, 1, ret, "hx509_verify_init_ctx");
+	hx509_verify_attach_anchors(b.revoke_ctx, anchors);
+	hx509_verify_attach_revoke(b.revoke_ctx, revoke);
+	hx509_verify_attach_cache(b.revoke_ctx, cache);
+    }
+
+    /* Messages are read once, so only verification is timed */
+    n = opt->cms_strings.num_strings;
+    msgs = ecalloc(n ? n : 1, sizeof(msgs[0]));
+    for (i = 0; i < n; i++) {
+	heim_octet_string co;
+	heim_oid oid;
+	size_t sz;
+	void *p;
+
+	ret = rk_undumpdata(opt->cms_strings.strings[i], &p, &sz);
+	if (ret)
+	    err(1, "map_file: %s: %d", opt->cms_strings.strings[i], ret);
+	co.data = p;
+	co.length = sz;
+	if (hx509_cms_unwrap_ContentInfo(&co, &oid, &msgs[i], NULL) == 0) {
+	    der_free_oid(&oid);
+	    rk_xfree(p);
+	} else {
+	    ret = der_copy_octet_string(&co, &msgs[i]);
+	    rk_xfree(p);
+	    if (ret)
+		errx(1, "out of memory");
+	}
+    }
+
+    for (n = 0; n < opt->iterations_integer; n++) {
+	hx509_certs_iter_f(context, certs, bench_path_f, &b);
+
+	for (i = 0; i < opt->cms_strings.num_strings; i++) {
+	    hx509_certs signers = NULL;
+	    heim_octet_string content;
+	    heim_oid type;
+	    double start;
+
+	    start = bench_now();
+	    ret = hx509_cms_verify_signed(context,
+					  b.revoke_ctx ? b.revoke_ctx : b.ctx,
+					  HX509_CMS_VS_ALLOW_DATA_OID_MISMATCH,
+					  msgs[i].data, msgs[i].length, NULL,
+					  b.pool, &type, &content, &signers);
+	    bench_add(&cms, start, ret);
+	    if (ret == 0) {
+		der_free_oid(&type);
+		der_free_octet_string(&content);
+	    }
+	    if (signers)
+		hx509_certs_free(&signers);
+	}
+    }
+
+    printf("%-24s %10s %8s %12s\n", "step", "count", "errors", "usec/op");
+    bench_print_step(&b.path);
+    bench_print_step(&b.revoke);
+    bench_print_step(&cms);
+
+    _hx509_cache_stats(context, cache, &stats);
+    printf("\n%-24s %10s %8s %12s\n", "cache", "hits", "misses", "hit rate");
+    bench_print_cache("signature", stats.sig_hits, stats.sig_misses);
+    bench_print_cache("verify-path", stats.path_hits, stats.path_misses);
+    bench_print_cache("verify-ca-signature",
+		      stats.ca_sig_hits, stats.ca_sig_misses);
+
+    for (i = 0; i < opt->cms_strings.num_strings; i++)
+	der_free_octet_string(&msgs[i]);
+    free(msgs);
+    hx509_verify_destroy_ctx(b.ctx);
+    hx509_verify_destroy_ctx(b.revoke_ctx);
+    hx509_verify_cache_free(&cache);
+    if (revoke)
+	hx509_revoke_free(&revoke);
+    hx509_certs_free(&certs);
+    hx509_certs_free(&b.pool);
+    hx509_certs_free(&anchors);
+    hx509_lock_free(lock);
+
+    return 0;
+}
+
 int
 query(struct query_options *opt, int argc, char **argv)
 {
@@ -1965,155 +2261,51 @@ eval_types(hx509_context contextp,
     return 0;
 }
 
-int
-hxtool_ca(struct certificate_sign_options *opt, int argc, char **argv)
+static hx509_private_key
+generate_key(struct certificate_sign_options *opt)
 {
+    struct hx509_generate_private_context *keyctx;
+    hx509_private_key key;
     int ret;
-    hx509_ca_tbs tbs;
-    hx509_cert signer = NULL, cert = NULL;
-    hx509_private_key private_key = NULL;
-    hx509_private_key cert_key = NULL;
-    hx509_name subject = NULL;
-    SubjectPublicKeyInfo spki;
-    heim_oid oid;
-    size_t i;
-    int delta = 0;
-
-    memset(&oid, 0, sizeof(oid));
-    memset(&spki, 0, sizeof(spki));
-
-    if (opt->ca_certificate_string == NULL && !opt->self_signed_flag)
-	errx(1, "--ca-certificate argument missing (not using --self-signed)");
-    if (opt->ca_private_key_string == NULL && opt->generate_key_string == NULL && opt->self_signed_flag)
-	errx(1, "--ca-private-key argument missing (using --self-signed)");
-    if (opt->certificate_string == NULL)
-	errx(1, "--certificate argument missing");
 
-    if (opt->template_certificate_string && opt->template_fields_string == NULL)
-        errx(1, "--template-certificate used but no --template-fields given");
-
-    if (opt->lifetime_string) {
-	delta = parse_time(opt->lifetime_string, "day");
-	if (delta < 0)
-	    errx(1, "Invalid lifetime: %s", opt->lifetime_string);
-    }
-
-    if (opt->ca_certificate_string) {
-	hx509_certs cacerts = NULL;
-	hx509_query *q;
-        char *sn = fix_store_name(context, opt->ca_certificate_string, "FILE");
-
-        ret = hx509_certs_init(context, sn, 0, NULL, &cacerts);
-	if (ret)
-	    hx509_err(context, 1, ret, "hx509_certs_init: %s", sn);
-
-	ret = hx509_query_alloc(context, &q);
-	if (ret)
-	    errx(1, "hx509_query_alloc: %d", ret);
-
-	hx509_query_match_option(q, HX509_QUERY_OPTION_PRIVATE_KEY);
-	if (!opt->issue_proxy_flag)
-	    hx509_query_match_option(q, HX509_QUERY_OPTION_KU_KEYCERTSIGN);
-
-	ret = hx509_certs_find(context, cacerts, q, &signer);
-	hx509_query_free(context, q);
-	hx509_certs_free(&cacerts);
-	if (ret)
-	    hx509_err(context, 1, ret, "no CA certificate found");
-        free(sn);
-    } else if (opt->self_signed_flag) {
-	if (opt->generate_key_string == NULL
-	    && opt->ca_private_key_string == NULL)
-	    errx(1, "no signing private key");
-
-	if (opt->req_string)
-	    errx(1, "can't be self-signing and have a request at the same time");
-    } else
-	errx(1, "missing ca key");
-
-    if (opt->ca_private_key_string) {
-
-	ret = read_private_key(opt->ca_private_key_string, &private_key);
-	if (ret)
-	    err(1, "read_private_key");
-
-	ret = hx509_private_key2SPKI(context, private_key, &spki);
-	if (ret)
-	    errx(1, "hx509_private_key2SPKI: %d\n", ret);
-
-	if (opt->self_signed_flag)
-	    cert_key = private_key;
-    }
-
-    if (opt->req_string) {
-	hx509_request req;
-        char *cn = fix_csr_name(opt->req_string, "PKCS10");
-
-        /*
-         * Extract the CN and other attributes we want to preserve from the
-         * requested subjectName and then set them in the hx509_env for the
-         * template.
-         */
-	ret = hx509_request_parse(context, cn, &req);
-	if (ret)
-	    hx509_err(context, 1, ret, "parse_request: %s", cn);
-	ret = hx509_request_get_name(context, req, &subject);
-	if (ret)
-	    hx509_err(context, 1, ret, "get name");
-	ret = hx509_request_get_SubjectPublicKeyInfo(context, req, &spki);
-	if (ret)
-	    hx509_err(context, 1, ret, "get spki");
-	hx509_request_free(&req);
-        free(cn);
-    }
-
-    if (opt->generate_key_string) {
-	struct hx509_generate_private_context *keyctx;
-
-	ret = _hx509_generate_private_key_init(context,
-					       &asn1_oid_id_pkcs1_rsaEncryption,
-					       &keyctx);
-	if (ret)
-	    hx509_err(context, 1, ret, "generate private key");
-
-	if (opt->issue_ca_flag)
-	    _hx509_generate_private_key_is_ca(context, keyctx);
+    ret = _hx509_generate_private_key_init(context,
+					   &asn1_oid_id_pkcs1_rsaEncryption,
+					   &keyctx);
+    if (ret)
+	hx509_err(context, 1, ret, "generate private key");
 
-	if (opt->key_bits_integer)
-	    _hx509_generate_private_key_bits(context, keyctx,
-					     opt->key_bits_integer);
+    if (opt->issue_ca_flag)
+	_hx509_generate_private_key_is_ca(context, keyctx);
 
-	ret = _hx509_generate_private_key(context, keyctx,
-					  &cert_key);
-	_hx509_generate_private_key_free(&keyctx);
-	if (ret)
-	    hx509_err(context, 1, ret, "generate private key");
+    if (opt->key_bits_integer)
+	_hx509_generate_private_key_bits(context, keyctx,
+					 opt->key_bits_integer);
 
-	ret = hx509_private_key2SPKI(context, cert_key, &spki);
-	if (ret)
-	    errx(1, "hx509_private_key2SPKI: %d\n", ret);
+    ret = _hx509_generate_private_key(context, keyctx, &key);
+    _hx509_generate_private_key_free(&keyctx);
+    if (ret)
+	hx509_err(context, 1, ret, "generate private key");
 
-	if (opt->self_signed_flag)
-	    private_key = cert_key;
-    }
+    return key;
+}
 
-    if (opt->certificate_private_key_string) {
-	ret = read_private_key(opt->certificate_private_key_string, &cert_key);
-	if (ret)
-	    err(1, "read_private_key for certificate");
-    }
+/*
+ * Build the to-be-signed certificate from the options shared by all
+ * certificates issued by this command.
+ */
 
-    if (opt->subject_string) {
-	if (subject)
-	    hx509_name_free(&subject);
-	ret = hx509_parse_name(context, opt->subject_string, &subject);
-	if (ret)
-	    hx509_err(context, 1, ret, "hx509_parse_name");
-    }
+static hx509_ca_tbs
+build_tbs(struct certificate_sign_options *opt,
+	  int delta,
+	  const SubjectPublicKeyInfo *spki,
+	  hx509_name subject)
+{
+    hx509_ca_tbs tbs;
+    heim_oid oid;
+    size_t i;
+    int ret;
 
-    /*
-     *
-     */
+    memset(&oid, 0, sizeof(oid));
 
     ret = hx509_ca_tbs_init(context, &tbs);
     if (ret)
@@ -2195,8 +2387,8 @@ hxtool_ca(struct certificate_sign_options *opt, int argc, char **argv)
 	der_free_heim_integer(&serialNumber);
     }
 
-    if (spki.subjectPublicKey.length) {
-	ret = hx509_ca_tbs_set_spki(context, tbs, &spki);
+    if (spki && spki->subjectPublicKey.length) {
+	ret = hx509_ca_tbs_set_spki(context, tbs, spki);
 	if (ret)
 	    hx509_err(context, 1, ret, "hx509_ca_tbs_set_spki");
     }
@@ -2301,6 +2493,274 @@ hxtool_ca(struct certificate_sign_options *opt, int argc, char **argv)
 	    hx509_err(context, 1, ret, "hx509_ca_tbs_set_pkinit_max_life");
     }
 
+    return tbs;
+}
+
+static void
+store_cert(const char *store, hx509_cert cert)
+{
+    hx509_certs certs;
+    char *sn = fix_store_name(context, store, "FILE");
+    int ret;
+
+    ret = hx509_certs_init(context, sn, HX509_CERTS_CREATE, NULL, &certs);
+    if (ret)
+	hx509_err(context, 1, ret, "hx509_certs_init");
+
+    ret = hx509_certs_add(context, certs, cert);
+    if (ret)
+	hx509_err(context, 1, ret, "hx509_certs_add");
+
+    ret = hx509_certs_store(context, certs, 0, NULL);
+    if (ret)
+	hx509_err(context, 1, ret, "hx509_certs_store");
+
+    hx509_certs_free(&certs);
+    free(sn);
+}
+
+#define BATCH_SIZE 256
+
+/*
+ * Issue one certificate per line of the --batch file.  Each line has
+ * the certificate store to write followed by the subject name, all
+ * other options apply to every certificate.  Certificates are signed
+ * BATCH_SIZE at a time with hx509_ca_sign_batch().
+ */
+
+static void
+issue_batch(struct certificate_sign_options *opt, hx509_cert signer, int delta)
+{
+    hx509_ca_tbs tbs[BATCH_SIZE];
+    hx509_cert certs[BATCH_SIZE];
+    hx509_private_key keys[BATCH_SIZE];
+    char *stores[BATCH_SIZE];
+    unsigned long lineno = 0;
+    size_t n = 0, i;
+    char buf[1024];
+    FILE *f;
+    int ret;
+
+    f = fopen(opt->batch_string, "r");
+    if (f == NULL)
+	err(1, "%s", opt->batch_string);
+
+    while (1) {
+	char *p = NULL, *store, *subj;
+
+	if (fgets(buf, sizeof(buf), f) != NULL) {
+	    lineno++;
+	    buf[strcspn(buf, "\r\n")] = '\0';
+	    p = buf + strspn(buf, " \t");
+	    if (*p == '\0' || *p == '#')
+		continue;
+	}
+
+	if (p) {
+	    SubjectPublicKeyInfo spki;
+	    hx509_name subject;
+
+	    store = p;
+	    subj = p + strcspn(p, " \t");
+	    if (*subj == '\0')
+		errx(1, "%s:%lu: missing subject", opt->batch_string, lineno);
+	    *subj++ = '\0';
+	    subj += strspn(subj, " \t");
+
+	    ret = hx509_parse_name(context, subj, &subject);
+	    if (ret)
+		hx509_err(context, 1, ret, "%s:%lu: hx509_parse_name",
+			  opt->batch_string, lineno);
+
+	    memset(&spki, 0, sizeof(spki));
+	    keys[n] = NULL;
+	    if (opt->generate_key_string) {
+		keys[n] = generate_key(opt);
+		ret = hx509_private_key2SPKI(context, keys[n], &spki);
+		if (ret)
+		    hx509_err(context, 1, ret, "hx509_private_key2SPKI");
+	    }
+
+	    tbs[n] = build_tbs(opt, delta, &spki, subject);
+	    free_SubjectPublicKeyInfo(&spki);
+	    hx509_name_free(&subject);
+
+	    if ((stores[n] = strdup(store)) == NULL)
+		hx509_err(context, 1, ENOMEM, "out of memory");
+	    n++;
+	}
+
+	if (n == 0 && p == NULL)
+	    break;
+	if (n < BATCH_SIZE && p != NULL)
+	    continue;
+
+	ret = hx509_ca_sign_batch(context, tbs, n, signer, certs);
+	if (ret)
+	    hx509_err(context, 1, ret, "hx509_ca_sign_batch");
+
+	for (i = 0; i < n; i++) {
+	    if (keys[i]) {
+		ret = _hx509_cert_assign_key(certs[i], keys[i]);
+		if (ret)
+		    hx509_err(context, 1, ret, "_hx509_cert_assign_key");
+		hx509_private_key_free(&keys[i]);
+	    }
+	    store_cert(stores[i], certs[i]);
+	    hx509_cert_free(certs[i]);
+	    hx509_ca_tbs_free(&tbs[i]);
+	    free(stores[i]);
+	}
+	n = 0;
+	if (p == NULL)
+	    break;
+    }
+    fclose(f);
+}
+
+int
+hxtool_ca(struct certificate_sign_options *opt, int argc, char **argv)
+{
+    int ret;
+    hx509_ca_tbs tbs;
+    hx509_cert signer = NULL, cert = NULL;
+    hx509_private_key private_key = NULL;
+    hx509_private_key cert_key = NULL;
+    hx509_name subject = NULL;
+    SubjectPublicKeyInfo spki;
+    int delta = 0;
+
+    memset(&spki, 0, sizeof(spki));
+
+    if (opt->ca_certificate_string == NULL && !opt->self_signed_flag)
+	errx(1, "--ca-certificate argument missing (not using --self-signed)");
+    if (opt->ca_private_key_string == NULL && opt->generate_key_string == NULL && opt->self_signed_flag)
+	errx(1, "--ca-private-key argument missing (using --self-signed)");
+    if (opt->batch_string) {
+	if (opt->self_signed_flag || opt->req_string || opt->subject_string ||
+	    opt->serial_number_string || opt->certificate_string ||
+	    opt->certificate_private_key_string)
+	    errx(1, "--batch can't be used with --self-signed, --req, "
+		 "--subject, --serial-number, --certificate or "
+		 "--certificate-private-key");
+    } else if (opt->certificate_string == NULL)
+	errx(1, "--certificate argument missing");
+
+    if (opt->template_certificate_string && opt->template_fields_string == NULL)
+        errx(1, "--template-certificate used but no --template-fields given");
+
+    if (opt->lifetime_string) {
+	delta = parse_time(opt->lifetime_string, "day");
+	if (delta < 0)
+	    errx(1, "Invalid lifetime: %s", opt->lifetime_string);
+    }
+
+    if (opt->ca_certificate_string) {
+	hx509_certs cacerts = NULL;
+	hx509_query *q;
+        char *sn = fix_store_name(context, opt->ca_certificate_string, "FILE");
+
+        ret = hx509_certs_init(context, sn, 0, NULL, &cacerts);
+	if (ret)
+	    hx509_err(context, 1, ret, "hx509_certs_init: %s", sn);
+
+	ret = hx509_query_alloc(context, &q);
+	if (ret)
+	    errx(1, "hx509_query_alloc: %d", ret);
+
+	hx509_query_match_option(q, HX509_QUERY_OPTION_PRIVATE_KEY);
+	if (!opt->issue_proxy_flag)
+	    hx509_query_match_option(q, HX509_QUERY_OPTION_KU_KEYCERTSIGN);
+
+	ret = hx509_certs_find(context, cacerts, q, &signer);
+	hx509_query_free(context, q);
+	hx509_certs_free(&cacerts);
+	if (ret)
+	    hx509_err(context, 1, ret, "no CA certificate found");
+        free(sn);
+    } else if (opt->self_signed_flag) {
+	if (opt->generate_key_string == NULL
+	    && opt->ca_private_key_string == NULL)
+	    errx(1, "no signing private key");
+
+	if (opt->req_string)
+	    errx(1, "can't be self-signing and have a request at the same time");
+    } else
+	errx(1, "missing ca key");
+
+    if (opt->batch_string) {
+	issue_batch(opt, signer, delta);
+	hx509_cert_free(signer);
+	return 0;
+    }
+
+    if (opt->ca_private_key_string) {
+
+	ret = read_private_key(opt->ca_private_key_string, &private_key);
+	if (ret)
+	    err(1, "read_private_key");
+
+	ret = hx509_private_key2SPKI(context, private_key, &spki);
+	if (ret)
+	    errx(1, "hx509_private_key2SPKI: %d\n", ret);
+
+	if (opt->self_signed_flag)
+	    cert_key = private_key;
+    }
+
+    if (opt->req_string) {
+	hx509_request req;
+        char *cn = fix_csr_name(opt->req_string, "PKCS10");
+
+        /*
+         * Extract the CN and other attributes we want to preserve from the
+         * requested subjectName and then set them in the hx509_env for the
+         * template.
+         */
+	ret = hx509_request_parse(context, cn, &req);
+	if (ret)
+	    hx509_err(context, 1, ret, "parse_request: %s", cn);
+	ret = hx509_request_get_name(context, req, &subject);
+	if (ret)
+	    hx509_err(context, 1, ret, "get name");
+	ret = hx509_request_get_SubjectPublicKeyInfo(context, req, &spki);
+	if (ret)
+	    hx509_err(context, 1, ret, "get spki");
+	hx509_request_free(&req);
+        free(cn);
+    }
+
+    if (opt->generate_key_string) {
+	cert_key = generate_key(opt);
+
+	ret = hx509_private_key2SPKI(context, cert_key, &spki);
+	if (ret)
+	    errx(1, "hx509_private_key2SPKI: %d\n", ret);
+
+	if (opt->self_signed_flag)
+	    private_key = cert_key;
+    }
+
+    if (opt->certificate_private_key_string) {
+	ret = read_private_key(opt->certificate_private_key_string, &cert_key);
+	if (ret)
+	    err(1, "read_private_key for certificate");
+    }
+
+    if (opt->subject_string) {
+	if (subject)
+	    hx509_name_free(&subject);
+	ret = hx509_parse_name(context, opt->subject_string, &subject);
+	if (ret)
+	    hx509_err(context, 1, ret, "hx509_parse_name");
+    }
+
+    /*
+     *
+     */
+
+    tbs = build_tbs(opt, delta, &spki, subject);
+
     if (opt->self_signed_flag) {
 	ret = hx509_ca_sign_self(context, tbs, private_key, &cert);
 	if (ret)
@@ -2317,25 +2777,7 @@ hxtool_ca(struct certificate_sign_options *opt, int argc, char **argv)
 	    hx509_err(context, 1, ret, "_hx509_cert_assign_key");
     }
 
-    {
-	hx509_certs certs;
-        char *sn = fix_store_name(context, opt->certificate_string, "FILE");
-
-        ret = hx509_certs_init(context, sn, HX509_CERTS_CREATE, NULL, &certs);
-	if (ret)
-	    hx509_err(context, 1, ret, "hx509_certs_init");
-
-	ret = hx509_certs_add(context, certs, cert);
-	if (ret)
-	    hx509_err(context, 1, ret, "hx509_certs_add");
-
-	ret = hx509_certs_store(context, certs, 0, NULL);
-	if (ret)
-	    hx509_err(context, 1, ret, "hx509_certs_store");
-
-	hx509_certs_free(&certs);
-        free(sn);
-    }
+    store_cert(opt->certificate_string, cert);
 
     if (subject)
 	hx509_name_free(&subject);
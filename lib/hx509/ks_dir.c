@@ -35,28 +35,187 @@
 #include <dirent.h>
 
 /*
- * The DIR keyset module is strange compared to the other modules
- * since it does lazy evaluation and really doesn't keep any local
- * state except for the directory iteration and cert iteration of
- * files. DIR ignores most errors so that the consumer doesn't get
- * failes for stray files in directories.
+ * The DIR keyset module keeps the certificates of each file in the
+ * directory, parsed, together with the file's inode, mtime and size.
+ * Before the keyset is used the directory is rescanned, at most once
+ * a second, and only files that changed are parsed again.  The
+ * certificates of all files are kept in a MEMORY keyset, which is
+ * what is iterated and queried.  DIR ignores most errors so that the
+ * consumer doesn't get failes for stray files in directories.
  */
 
+struct dir_file {
+    char *name;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    off_t size;
+    hx509_certs certs;		/* NULL if the file didn't parse */
+};
+
+struct dir_data {
+    char *path;
+    time_t last_scan;
+    struct dir_file *files;
+    size_t nfiles;
+    hx509_certs all;
+};
+
 struct dircursor {
-    DIR *dir;
     hx509_certs certs;
-    void *iter;
+    hx509_cursor iter;
 };
 
+static void
+free_dir_file(struct dir_file *f)
+{
+    free(f->name);
+    hx509_certs_free(&f->certs);
+}
+
 /*
- *
+ * Rescan the directory, reparsing new and changed files, and rebuild
+ * the MEMORY keyset if anything changed.
  */
 
+static int
+dir_scan(hx509_context context, struct dir_data *dd)
+{
+    struct dir_file *files = NULL, *f;
+    size_t nfiles = 0, i;
+    struct dirent *dir;
+    hx509_certs all;
+    int changed = 0;
+    time_t now;
+    DIR *d;
+    int ret;
+
+    now = time(NULL);
+    if (dd->all && dd->last_scan == now)
+	return 0;
+
+    d = opendir(dd->path);
+    if (d == NULL) {
+	hx509_clear_error_string(context);
+	return errno;
+    }
+    rk_cloexec_dir(d);
+
+    while ((dir = readdir(d)) != NULL) {
+	struct stat sb;
+	char *fn;
+	void *ptr;
+
+	if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
+	    continue;
+
+	if (asprintf(&fn, "%s/%s", dd->path, dir->d_name) == -1) {
+	    ret = ENOMEM;
+	    goto out;
+	}
+	ret = stat(fn, &sb);
+	free(fn);
+	if (ret || !S_ISREG(sb.st_mode))
+	    continue;
+
+	ptr = realloc(files, (nfiles + 1) * sizeof(files[0]));
+	if (ptr == NULL) {
+	    ret = ENOMEM;
+	    goto out;
+	}
+	files = ptr;
+	f = &files[nfiles];
+
+	/* reuse the unchanged file from the last scan */
+	for (i = 0; i < dd->nfiles; i++) {
+	    struct dir_file *o = &dd->files[i];
+
+	    if (o->name && strcmp(o->name, dir->d_name) == 0 &&
+		o->dev == sb.st_dev && o->ino == sb.st_ino &&
+		o->mtime == sb.st_mtime && o->size == sb.st_size)
+		break;
+	}
+	if (i < dd->nfiles) {
+	    *f = dd->files[i];
+	    memset(&dd->files[i], 0, sizeof(dd->files[i]));
+	    nfiles++;
+	    continue;
+	}
+
+	memset(f, 0, sizeof(*f));
+	f->name = strdup(dir->d_name);
+	if (f->name == NULL) {
+	    ret = ENOMEM;
+	    goto out;
+	}
+	f->dev = sb.st_dev;
+	f->ino = sb.st_ino;
+	f->mtime = sb.st_mtime;
+	f->size = sb.st_size;
+	nfiles++;
+	changed = 1;
+
+	if (asprintf(&fn, "FILE:%s/%s", dd->path, dir->d_name) == -1) {
+	    ret = ENOMEM;
+	    goto out;
+	}
+	/* ignore errors */
+	if (hx509_certs_init(context, fn, 0, NULL, &f->certs))
+	    f->certs = NULL;
+	free(fn);
+    }
+
+    /* files that are gone */
+    for (i = 0; i < dd->nfiles; i++)
+	if (dd->files[i].name)
+	    changed = 1;
+
+    if (changed || dd->all == NULL) {
+	ret = hx509_certs_init(context, "MEMORY:dir", 0, NULL, &all);
+	if (ret)
+	    goto out;
+	for (i = 0; i < nfiles; i++)
+	    (void) hx509_certs_merge(context, all, files[i].certs);
+	hx509_certs_free(&dd->all);
+	dd->all = all;
+    }
+
+    for (i = 0; i < dd->nfiles; i++)
+	free_dir_file(&dd->files[i]);
+    free(dd->files);
+    dd->files = files;
+    dd->nfiles = nfiles;
+    dd->last_scan = now;
+    closedir(d);
+    return 0;
+
+out:
+    closedir(d);
+    /* put back what was taken from the last scan, drop the rest */
+    for (i = 0; i < nfiles; i++) {
+	size_t j;
+
+	for (j = 0; j < dd->nfiles; j++) {
+	    if (dd->files[j].name == NULL) {
+		dd->files[j] = files[i];
+		break;
+	    }
+	}
+	if (j == dd->nfiles)
+	    free_dir_file(&files[i]);
+    }
+    free(files);
+    hx509_clear_error_string(context);
+    return ret;
+}
+
 static int
 dir_init(hx509_context context,
 	 hx509_certs certs, void **data, int flags,
 	 const char *residue, hx509_lock lock)
 {
+    struct dir_data *dd;
+
     *data = NULL;
 
     if (residue == NULL || residue[0] == '\0') {
@@ -83,45 +242,81 @@ dir_init(hx509_context context,
 	}
     }
 
-    *data = strdup(residue);
-    if (*data == NULL) {
+    dd = calloc(1, sizeof(*dd));
+    if (dd == NULL) {
+	hx509_clear_error_string(context);
+	return ENOMEM;
+    }
+    dd->path = strdup(residue);
+    if (dd->path == NULL) {
+	free(dd);
 	hx509_clear_error_string(context);
 	return ENOMEM;
     }
 
+    *data = dd;
     return 0;
 }
 
 static int
 dir_free(hx509_certs certs, void *data)
 {
-    free(data);
+    struct dir_data *dd = data;
+    size_t i;
+
+    for (i = 0; i < dd->nfiles; i++)
+	free_dir_file(&dd->files[i]);
+    free(dd->files);
+    hx509_certs_free(&dd->all);
+    free(dd->path);
+    free(dd);
     return 0;
 }
 
+static int
+dir_query(hx509_context context,
+	  hx509_certs certs,
+	  void *data,
+	  const hx509_query *q,
+	  hx509_cert *r)
+{
+    struct dir_data *dd = data;
+    int ret;
+
+    ret = dir_scan(context, dd);
+    if (ret)
+	return ret;
+    return hx509_certs_find(context, dd->all, q, r);
+}
+
 static int
 dir_iter_start(hx509_context context,
 	       hx509_certs certs, void *data, void **cursor)
 {
+    struct dir_data *dd = data;
     struct dircursor *d;
+    int ret;
 
     *cursor = NULL;
 
+    ret = dir_scan(context, dd);
+    if (ret)
+	return ret;
+
     d = calloc(1, sizeof(*d));
     if (d == NULL) {
 	hx509_clear_error_string(context);
 	return ENOMEM;
     }
 
-    d->dir = opendir(data);
-    if (d->dir == NULL) {
-	hx509_clear_error_string(context);
+    /* hold on to the keyset in case a rescan replaces it */
+    d->certs = hx509_certs_ref(dd->all);
+    ret = hx509_certs_start_seq(context, d->certs, &d->iter);
+    if (ret) {
+	hx509_certs_free(&d->certs);
 	free(d);
-	return errno;
+	return ret;
     }
-    rk_cloexec_dir(d->dir);
-    d->certs = NULL;
-    d->iter = NULL;
 
     *cursor = d;
     return 0;
@@ -132,59 +327,8 @@ dir_iter(hx509_context context,
 	 hx509_certs certs, void *data, void *iter, hx509_cert *cert)
 {
     struct dircursor *d = iter;
-    int ret = 0;
-
-    *cert = NULL;
-
-    do {
-	struct dirent *dir;
-	char *fn;
-
-	if (d->certs) {
-	    ret = hx509_certs_next_cert(context, d->certs, d->iter, cert);
-	    if (ret) {
-		hx509_certs_end_seq(context, d->certs, d->iter);
-		d->iter = NULL;
-		hx509_certs_free(&d->certs);
-		return ret;
-	    }
-	    if (*cert) {
-		ret = 0;
-		break;
-	    }
-	    hx509_certs_end_seq(context, d->certs, d->iter);
-	    d->iter = NULL;
-	    hx509_certs_free(&d->certs);
-	}
-
-	dir = readdir(d->dir);
-	if (dir == NULL) {
-	    ret = 0;
-	    break;
-	}
-	if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
-	    continue;
-
-	if (asprintf(&fn, "FILE:%s/%s", (char *)data, dir->d_name) == -1)
-	    return ENOMEM;
 
-	ret = hx509_certs_init(context, fn, 0, NULL, &d->certs);
-	if (ret == 0) {
-
-	    ret = hx509_certs_start_seq(context, d->certs, &d->iter);
-	    if (ret)
-	    hx509_certs_free(&d->certs);
-	}
-	/* ignore errors */
-	if (ret) {
-	    d->certs = NULL;
-	    ret = 0;
-	}
-
-	free(fn);
-    } while(ret == 0);
-
-    return ret;
+    return hx509_certs_next_cert(context, d->certs, d->iter, cert);
 }
 
 
@@ -196,12 +340,8 @@ dir_iter_end(hx509_context context,
 {
     struct dircursor *d = cursor;
 
-    if (d->certs) {
-	hx509_certs_end_seq(context, d->certs, d->iter);
-	d->iter = NULL;
-	hx509_certs_free(&d->certs);
-    }
-    closedir(d->dir);
+    hx509_certs_end_seq(context, d->certs, d->iter);
+    hx509_certs_free(&d->certs);
     free(d);
     return 0;
 }
@@ -214,7 +354,7 @@ static struct hx509_keyset_ops keyset_dir = {
     NULL,
     dir_free,
     NULL,
-    NULL,
+    dir_query,
     dir_iter_start,
     dir_iter,
     dir_iter_end,
@@ -34,11 +34,28 @@
 #include "hx_locl.h"
 
 /*
- * Should use two hash/tree certificates intead of a array.  Criteria
- * should be subject and subjectKeyIdentifier since those two are
- * commonly seached on in CMS and path building.
+ * Certificates are kept in an array, which gives the iteration order,
+ * plus hash indexes on the criteria commonly searched on in CMS and
+ * path building: subjectKeyIdentifier, serial number and signature
+ * (which identifies the certificate).  An index only yields
+ * candidates, each is still checked with _hx509_query_match_cert().
+ *
+ * Subject names are not indexed since they are compared after
+ * normalization, so equal names can have different encodings.
  */
 
+struct mem_index_entry {
+    struct mem_index_entry *next;
+    uint32_t hash;
+    unsigned long pos;
+};
+
+struct mem_index {
+    struct mem_index_entry **buckets;
+    size_t nbuckets;
+    size_t len;
+};
+
 struct mem_data {
     char *name;
     struct {
@@ -46,8 +63,100 @@ struct mem_data {
 	hx509_cert *val;
     } certs;
     hx509_private_key *keys;
+    struct mem_index by_ski;
+    struct mem_index by_serial;
+    struct mem_index by_sig;
+    int noindex;
 };
 
+static uint32_t
+mem_hash(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint32_t h = 2166136261U;
+
+    while (len--) {
+	h ^= *p++;
+	h *= 16777619U;
+    }
+    return h;
+}
+
+static void
+index_free(struct mem_index *idx)
+{
+    struct mem_index_entry *e, *next;
+    size_t i;
+
+    for (i = 0; i < idx->nbuckets; i++) {
+	for (e = idx->buckets[i]; e; e = next) {
+	    next = e->next;
+	    free(e);
+	}
+    }
+    free(idx->buckets);
+    memset(idx, 0, sizeof(*idx));
+}
+
+static int
+index_add(struct mem_index *idx, uint32_t hash, unsigned long pos)
+{
+    struct mem_index_entry *e;
+
+    if (idx->len >= idx->nbuckets * 2) {
+	struct mem_index_entry **buckets, *next;
+	size_t nbuckets = idx->nbuckets ? idx->nbuckets * 2 : 16;
+	size_t i;
+
+	buckets = calloc(nbuckets, sizeof(buckets[0]));
+	if (buckets == NULL)
+	    return ENOMEM;
+	for (i = 0; i < idx->nbuckets; i++) {
+	    for (e = idx->buckets[i]; e; e = next) {
+		next = e->next;
+		e->next = buckets[e->hash & (nbuckets - 1)];
+		buckets[e->hash & (nbuckets - 1)] = e;
+	    }
+	}
+	free(idx->buckets);
+	idx->buckets = buckets;
+	idx->nbuckets = nbuckets;
+    }
+
+    e = malloc(sizeof(*e));
+    if (e == NULL)
+	return ENOMEM;
+    e->hash = hash;
+    e->pos = pos;
+    e->next = idx->buckets[hash & (idx->nbuckets - 1)];
+    idx->buckets[hash & (idx->nbuckets - 1)] = e;
+    idx->len++;
+    return 0;
+}
+
+static int
+index_cert(struct mem_data *mem, hx509_cert c, unsigned long pos)
+{
+    const Certificate *cert = _hx509_get_cert(c);
+    SubjectKeyIdentifier si;
+    int ret;
+
+    ret = index_add(&mem->by_serial,
+		    mem_hash(cert->tbsCertificate.serialNumber.data,
+			     cert->tbsCertificate.serialNumber.length),
+		    pos);
+    if (ret == 0)
+	ret = index_add(&mem->by_sig,
+			mem_hash(cert->signatureValue.data,
+				 (cert->signatureValue.length + 7) / 8),
+			pos);
+    if (ret == 0 && _hx509_find_extension_subject_key_id(cert, &si) == 0) {
+	ret = index_add(&mem->by_ski, mem_hash(si.data, si.length), pos);
+	free_SubjectKeyIdentifier(&si);
+    }
+    return ret;
+}
+
 static int
 mem_init(hx509_context context,
 	 hx509_certs certs, void **data, int flags,
@@ -81,6 +190,9 @@ mem_free(hx509_certs certs, void *data)
 	hx509_private_key_free(&mem->keys[i]);
     free(mem->keys);
     free(mem->name);
+    index_free(&mem->by_ski);
+    index_free(&mem->by_serial);
+    index_free(&mem->by_sig);
     free(mem);
 
     return 0;
@@ -99,11 +211,105 @@ mem_add(hx509_context context, hx509_certs certs, void *data, hx509_cert c)
 
     mem->certs.val = val;
     mem->certs.val[mem->certs.len] = hx509_cert_ref(c);
+
+    /* The indexes are only an optimization, without them we scan */
+    if (!mem->noindex && index_cert(mem, c, mem->certs.len) != 0) {
+	index_free(&mem->by_ski);
+	index_free(&mem->by_serial);
+	index_free(&mem->by_sig);
+	mem->noindex = 1;
+    }
+
     mem->certs.len++;
 
     return 0;
 }
 
+/*
+ * Pick the index, and the key to look up in it, that the query
+ * requires a match on.  Returns NULL if the store has to be scanned.
+ */
+
+static struct mem_index *
+query_index(struct mem_data *mem, const hx509_query *q, uint32_t *hash)
+{
+    if (mem->noindex)
+	return NULL;
+
+    if (q->match & HX509_QUERY_MATCH_CERTIFICATE) {
+	*hash = mem_hash(q->certificate->signatureValue.data,
+			 (q->certificate->signatureValue.length + 7) / 8);
+	return &mem->by_sig;
+    }
+    if (q->match & HX509_QUERY_MATCH_SUBJECT_KEY_ID) {
+	*hash = mem_hash(q->subject_id->data, q->subject_id->length);
+	return &mem->by_ski;
+    }
+    if (q->match & HX509_QUERY_MATCH_SERIALNUMBER) {
+	*hash = mem_hash(q->serial->data, q->serial->length);
+	return &mem->by_serial;
+    }
+    if (q->match & HX509_QUERY_FIND_ISSUER_CERT) {
+	AuthorityKeyIdentifier ai;
+	struct mem_index *idx = NULL;
+
+	/*
+	 * When the subject names its issuer by key identifier the
+	 * issuer must carry a matching subjectKeyIdentifier.
+	 */
+	if (_hx509_find_extension_auth_key_id(q->subject, &ai) == 0) {
+	    if (ai.keyIdentifier) {
+		*hash = mem_hash(ai.keyIdentifier->data,
+				 ai.keyIdentifier->length);
+		idx = &mem->by_ski;
+	    }
+	    free_AuthorityKeyIdentifier(&ai);
+	}
+	return idx;
+    }
+    return NULL;
+}
+
+static int
+mem_query(hx509_context context,
+	  hx509_certs certs,
+	  void *data,
+	  const hx509_query *q,
+	  hx509_cert *r)
+{
+    struct mem_data *mem = data;
+    struct mem_index *idx;
+    unsigned long i, found = mem->certs.len;
+    uint32_t hash;
+
+    idx = query_index(mem, q, &hash);
+    if (idx == NULL) {
+	for (i = 0; i < mem->certs.len; i++) {
+	    if (_hx509_query_match_cert(context, q, mem->certs.val[i])) {
+		found = i;
+		break;
+	    }
+	}
+    } else if (idx->nbuckets) {
+	struct mem_index_entry *e;
+
+	/* Return the first match in insertion order, like a scan would */
+	for (e = idx->buckets[hash & (idx->nbuckets - 1)]; e; e = e->next) {
+	    if (e->hash != hash || e->pos >= found)
+		continue;
+	    if (_hx509_query_match_cert(context, q, mem->certs.val[e->pos]))
+		found = e->pos;
+	}
+    }
+
+    if (found == mem->certs.len) {
+	hx509_clear_error_string(context);
+	return HX509_CERT_NOT_FOUND;
+    }
+    *r = hx509_cert_ref(mem->certs.val[found]);
+    return 0;
+}
+
 static int
 mem_iter_start(hx509_context context,
 	       hx509_certs certs,
@@ -207,7 +413,7 @@ static struct hx509_keyset_ops keyset_mem = {
     NULL,
     mem_free,
     mem_add,
-    NULL,
+    mem_query,
     mem_iter_start,
     mem_iter,
     mem_iter_end,
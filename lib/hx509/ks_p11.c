@@ -37,14 +37,27 @@
 
 #include "ref/pkcs11.h"
 
+/*
+ * Sessions are pooled per slot so that several threads can use the
+ * token's keys at the same time.  A session is opened when none is
+ * idle, up to the token's session limit (at most P11_MAX_SESSIONS),
+ * and goes back to the pool when done.  Login state is shared by all
+ * sessions of the application, so only the first one logs in.
+ */
+#define P11_MAX_SESSIONS	16
+
 struct p11_slot {
     uint64_t flags;
-#define P11_SESSION		1
-#define P11_SESSION_IN_USE	2
 #define P11_LOGIN_REQ		4
 #define P11_LOGIN_DONE		8
 #define P11_TOKEN_PRESENT	16
-    CK_SESSION_HANDLE session;
+    HEIMDAL_MUTEX mutex;
+    struct {
+	CK_SESSION_HANDLE *val;
+	size_t len;
+    } idle;
+    size_t num_sessions;
+    size_t max_sessions;
     CK_SLOT_ID id;
     CK_BBOOL token;
     char *name;
@@ -350,6 +363,11 @@ p11_init_slot(hx509_context context,
     if (token_info.flags & CKF_LOGIN_REQUIRED)
 	slot->flags |= P11_LOGIN_REQ;
 
+    if (token_info.ulMaxSessionCount != CK_EFFECTIVELY_INFINITE &&
+	token_info.ulMaxSessionCount != CK_UNAVAILABLE_INFORMATION &&
+	token_info.ulMaxSessionCount < slot->max_sessions)
+	slot->max_sessions = token_info.ulMaxSessionCount;
+
     ret = p11_get_session(context, p, slot, lock, &session);
     if (ret)
 	return ret;
@@ -372,23 +390,44 @@ p11_get_session(hx509_context context,
 		hx509_lock lock,
 		CK_SESSION_HANDLE *psession)
 {
+    CK_SESSION_HANDLE session;
     CK_RV ret;
 
-    if (slot->flags & P11_SESSION_IN_USE)
-	_hx509_abort("slot already in session");
+    HEIMDAL_MUTEX_lock(&slot->mutex);
 
-    if (slot->flags & P11_SESSION) {
-	slot->flags |= P11_SESSION_IN_USE;
-	*psession = slot->session;
+    if (slot->idle.len > 0) {
+	*psession = slot->idle.val[--slot->idle.len];
+	HEIMDAL_MUTEX_unlock(&slot->mutex);
 	return 0;
     }
 
+    if (slot->num_sessions >= slot->max_sessions) {
+	HEIMDAL_MUTEX_unlock(&slot->mutex);
+	if (context)
+	    hx509_set_error_string(context, 0, HX509_PKCS11_OPEN_SESSION,
+				   "All %lu sessions of slot id %d are in use",
+				   (unsigned long)slot->num_sessions,
+				   (int)slot->id);
+	return HX509_PKCS11_OPEN_SESSION;
+    }
+
+    if (slot->idle.val == NULL) {
+	slot->idle.val = calloc(slot->max_sessions, sizeof(slot->idle.val[0]));
+	if (slot->idle.val == NULL) {
+	    HEIMDAL_MUTEX_unlock(&slot->mutex);
+	    if (context)
+		hx509_set_error_string(context, 0, ENOMEM, "out of memory");
+	    return ENOMEM;
+	}
+    }
+
     ret = P11FUNC(p, OpenSession, (slot->id,
 				   CKF_SERIAL_SESSION,
 				   NULL,
 				   NULL,
-				   &slot->session));
+				   &session));
     if (ret != CKR_OK) {
+	HEIMDAL_MUTEX_unlock(&slot->mutex);
 	if (context)
 	    hx509_set_error_string(context, 0, HX509_PKCS11_OPEN_SESSION,
 				   "Failed to OpenSession for slot id %d "
@@ -397,8 +436,6 @@ p11_get_session(hx509_context context,
 	return HX509_PKCS11_OPEN_SESSION;
     }
 
-    slot->flags |= P11_SESSION;
-
     /*
      * If we have have to login, and haven't tried before and have a
      * prompter or known to work pin code.
@@ -427,7 +464,8 @@ p11_get_session(hx509_context context,
 	    if (ret == -1 || str == NULL) {
 		if (context)
 		    hx509_set_error_string(context, 0, ENOMEM, "out of memory");
-		return ENOMEM;
+		ret = ENOMEM;
+		goto fail;
 	    }
 	    prompt.prompt = str;
 	    prompt.type = HX509_PROMPT_TYPE_PASSWORD;
@@ -442,14 +480,14 @@ p11_get_session(hx509_context context,
 					   "Failed to get pin code for slot "
 					   "id %d with error: %d",
 					   (int)slot->id, ret);
-		return ret;
+		goto fail;
 	    }
 	    free(str);
 	} else {
 	    strlcpy(pin, slot->pin, sizeof(pin));
 	}
 
-	ret = P11FUNC(p, Login, (slot->session, CKU_USER,
+	ret = P11FUNC(p, Login, (session, CKU_USER,
 				 (unsigned char*)pin, strlen(pin)));
 	if (ret != CKR_OK) {
 	    if (context)
@@ -459,16 +497,22 @@ p11_get_session(hx509_context context,
 				       (int)slot->id, ret);
 	    switch(ret) {
 	        case CKR_PIN_LOCKED:
-	            return HX509_PKCS11_PIN_LOCKED;
+	            ret = HX509_PKCS11_PIN_LOCKED;
+	            break;
 	        case CKR_PIN_EXPIRED:
-	            return HX509_PKCS11_PIN_EXPIRED;
+	            ret = HX509_PKCS11_PIN_EXPIRED;
+	            break;
 	        case CKR_PIN_INCORRECT:
-	            return HX509_PKCS11_PIN_INCORRECT;
+	            ret = HX509_PKCS11_PIN_INCORRECT;
+	            break;
 	        case CKR_USER_PIN_NOT_INITIALIZED:
-	            return HX509_PKCS11_PIN_NOT_INITIALIZED;
+	            ret = HX509_PKCS11_PIN_NOT_INITIALIZED;
+	            break;
 	        default:
-	            return HX509_PKCS11_LOGIN;
+	            ret = HX509_PKCS11_LOGIN;
+	            break;
 	    }
+	    goto fail;
 	} else
 	    slot->flags |= P11_LOGIN_DONE;
 
@@ -478,17 +522,24 @@ p11_get_session(hx509_context context,
 		if (context)
 		    hx509_set_error_string(context, 0, ENOMEM,
 					   "out of memory");
-		return ENOMEM;
+		ret = ENOMEM;
+		goto fail;
 	    }
 	}
     } else
 	slot->flags |= P11_LOGIN_DONE;
 
-    slot->flags |= P11_SESSION_IN_USE;
+    slot->num_sessions++;
+    HEIMDAL_MUTEX_unlock(&slot->mutex);
 
-    *psession = slot->session;
+    *psession = session;
 
     return 0;
+
+ fail:
+    P11FUNC(p, CloseSession, (session));
+    HEIMDAL_MUTEX_unlock(&slot->mutex);
+    return ret;
 }
 
 static int
@@ -496,9 +547,11 @@ p11_put_session(struct p11_module *p,
 		struct p11_slot *slot,
 		CK_SESSION_HANDLE session)
 {
-    if ((slot->flags & P11_SESSION_IN_USE) == 0)
+    HEIMDAL_MUTEX_lock(&slot->mutex);
+    if (slot->idle.len >= slot->num_sessions)
 	_hx509_abort("slot not in session");
-    slot->flags &= ~P11_SESSION_IN_USE;
+    slot->idle.val[slot->idle.len++] = session;
+    HEIMDAL_MUTEX_unlock(&slot->mutex);
 
     return 0;
 }
@@ -938,6 +991,11 @@ p11_init(hx509_context context,
 	    goto out;
 	}
 
+	for (i = 0; i < p->num_slots; i++) {
+	    HEIMDAL_MUTEX_init(&p->slot[i].mutex);
+	    p->slot[i].max_sessions = P11_MAX_SESSIONS;
+	}
+
 	for (i = 0; i < p->num_slots; i++) {
 	    if ((p->selected_slot != 0) && (slot_ids[i] != (p->selected_slot - 1)))
 		continue;
@@ -979,11 +1037,14 @@ p11_release_module(struct p11_module *p)
 	return;
 
     for (i = 0; i < p->num_slots; i++) {
-	if (p->slot[i].flags & P11_SESSION_IN_USE)
+	size_t j;
+
+	if (p->slot[i].idle.len != p->slot[i].num_sessions)
 	    _hx509_abort("pkcs11 module release while session in use");
-	if (p->slot[i].flags & P11_SESSION) {
-	    P11FUNC(p, CloseSession, (p->slot[i].session));
-	}
+	for (j = 0; j < p->slot[i].idle.len; j++)
+	    P11FUNC(p, CloseSession, (p->slot[i].idle.val[j]));
+	free(p->slot[i].idle.val);
+	HEIMDAL_MUTEX_destroy(&p->slot[i].mutex);
 
 	if (p->slot[i].name)
 	    free(p->slot[i].name);
@@ -995,8 +1056,6 @@ p11_release_module(struct p11_module *p)
 	    free(p->slot[i].mechs.list);
 
 	    if (p->slot[i].mechs.infos) {
-		size_t j;
-
 		for (j = 0 ; j < p->slot[i].mechs.num ; j++)
 		    free(p->slot[i].mechs.infos[j]);
 		free(p->slot[i].mechs.infos);
@@ -465,15 +465,71 @@ dsstringprep(const DirectoryString *ds, uint32_t **rname, size_t *rlen)
     return 0;
 }
 
+/*
+ * Returns true if the two strings have the same type and the same
+ * encoded value.  Stringprep is a function of those alone, so such
+ * strings always compare equal and the (allocating) stringprep pass
+ * can be skipped.  Certificates almost always carry their issuer's
+ * subject name verbatim, which makes this the common case.
+ */
+
+static int
+ds_identical_p(const DirectoryString *ds1, const DirectoryString *ds2)
+{
+    if (ds1->element != ds2->element)
+	return 0;
+
+    switch(ds1->element) {
+    case choice_DirectoryString_ia5String:
+	return der_ia5_string_cmp(&ds1->u.ia5String, &ds2->u.ia5String) == 0;
+    case choice_DirectoryString_printableString:
+	return der_printable_string_cmp(&ds1->u.printableString,
+					&ds2->u.printableString) == 0;
+    case choice_DirectoryString_teletexString:
+	return strcmp(ds1->u.teletexString, ds2->u.teletexString) == 0;
+    case choice_DirectoryString_bmpString:
+	return der_heim_bmp_string_cmp(&ds1->u.bmpString,
+				       &ds2->u.bmpString) == 0;
+    case choice_DirectoryString_universalString:
+	return der_heim_universal_string_cmp(&ds1->u.universalString,
+					     &ds2->u.universalString) == 0;
+    case choice_DirectoryString_utf8String:
+	return strcmp(ds1->u.utf8String, ds2->u.utf8String) == 0;
+    default:
+	return 0;
+    }
+}
+
+static int
+prep_cmp(const uint32_t *p1, size_t len1, const uint32_t *p2, size_t len2)
+{
+    size_t i;
+    int diff;
+
+    if (len1 != len2)
+	return len1 - len2;
+    for (i = 0; i < len1; i++) {
+	diff = p1[i] - p2[i];
+	if (diff)
+	    return diff;
+    }
+    return 0;
+}
+
 HX509_LIB_FUNCTION int HX509_LIB_CALL
 _hx509_name_ds_cmp(const DirectoryString *ds1,
 		   const DirectoryString *ds2,
 		   int *diff)
 {
     uint32_t *ds1lp, *ds2lp;
-    size_t ds1len, ds2len, i;
+    size_t ds1len, ds2len;
     int ret;
 
+    if (ds_identical_p(ds1, ds2)) {
+	*diff = 0;
+	return 0;
+    }
+
     ret = dsstringprep(ds1, &ds1lp, &ds1len);
     if (ret)
 	return ret;
@@ -483,47 +539,113 @@ _hx509_name_ds_cmp(const DirectoryString *ds1,
 	return ret;
     }
 
-    if (ds1len != ds2len)
-	*diff = ds1len - ds2len;
-    else {
-	for (i = 0; i < ds1len; i++) {
-	    *diff = ds1lp[i] - ds2lp[i];
-	    if (*diff)
-		break;
-	}
-    }
+    *diff = prep_cmp(ds1lp, ds1len, ds2lp, ds2len);
+
     free(ds1lp);
     free(ds2lp);
 
     return 0;
 }
 
-HX509_LIB_FUNCTION int HX509_LIB_CALL
-_hx509_name_cmp(const Name *n1, const Name *n2, int *c)
+/*
+ * The stringprep'ed values of all the AVAs of a hx509_name, in RDN
+ * order, computed the first time the name is compared and kept until
+ * the name is changed or freed.
+ */
+
+struct _hx509_name_prep {
+    size_t len;
+    struct {
+	uint32_t *val;
+	size_t len;
+    } *ava;
+};
+
+static void
+name_prep_free(struct _hx509_name_prep **prep)
+{
+    size_t i;
+
+    if (*prep == NULL)
+	return;
+    for (i = 0; i < (*prep)->len; i++)
+	free((*prep)->ava[i].val);
+    free((*prep)->ava);
+    free(*prep);
+    *prep = NULL;
+}
+
+static int
+name_prep(hx509_name name)
 {
+    const Name *n = &name->der_name;
+    struct _hx509_name_prep *prep;
+    size_t i, j, k, len = 0;
     int ret;
-    size_t i, j;
+
+    if (name->prep)
+	return 0;
+
+    for (i = 0; i < n->u.rdnSequence.len; i++)
+	len += n->u.rdnSequence.val[i].len;
+
+    prep = calloc(1, sizeof(*prep));
+    if (prep == NULL)
+	return ENOMEM;
+    prep->ava = calloc(len ? len : 1, sizeof(prep->ava[0]));
+    if (prep->ava == NULL) {
+	free(prep);
+	return ENOMEM;
+    }
+
+    for (k = 0, i = 0; i < n->u.rdnSequence.len; i++) {
+	for (j = 0; j < n->u.rdnSequence.val[i].len; j++, k++) {
+	    ret = dsstringprep(&n->u.rdnSequence.val[i].val[j].value,
+			       &prep->ava[k].val, &prep->ava[k].len);
+	    if (ret) {
+		name_prep_free(&prep);
+		return ret;
+	    }
+	    prep->len++;
+	}
+    }
+    name->prep = prep;
+    return 0;
+}
+
+static int
+name_cmp(const Name *n1, const struct _hx509_name_prep *p1,
+	 const Name *n2, const struct _hx509_name_prep *p2,
+	 int *c)
+{
+    int ret;
+    size_t i, j, k;
 
     *c = n1->u.rdnSequence.len - n2->u.rdnSequence.len;
     if (*c)
 	return 0;
 
-    for (i = 0 ; i < n1->u.rdnSequence.len; i++) {
+    for (k = 0, i = 0 ; i < n1->u.rdnSequence.len; i++) {
 	*c = n1->u.rdnSequence.val[i].len - n2->u.rdnSequence.val[i].len;
 	if (*c)
 	    return 0;
 
-	for (j = 0; j < n1->u.rdnSequence.val[i].len; j++) {
-	    *c = der_heim_oid_cmp(&n1->u.rdnSequence.val[i].val[j].type,
-				  &n1->u.rdnSequence.val[i].val[j].type);
+	for (j = 0; j < n1->u.rdnSequence.val[i].len; j++, k++) {
+	    const AttributeTypeAndValue *a1 = &n1->u.rdnSequence.val[i].val[j];
+	    const AttributeTypeAndValue *a2 = &n2->u.rdnSequence.val[i].val[j];
+
+	    *c = der_heim_oid_cmp(&a1->type, &a2->type);
 	    if (*c)
 		return 0;
 
-	    ret = _hx509_name_ds_cmp(&n1->u.rdnSequence.val[i].val[j].value,
-				     &n2->u.rdnSequence.val[i].val[j].value,
-				     c);
-	    if (ret)
-		return ret;
+	    if (p1 && p2 && !ds_identical_p(&a1->value, &a2->value)) {
+		*c = prep_cmp(p1->ava[k].val, p1->ava[k].len,
+			      p2->ava[k].val, p2->ava[k].len);
+	    } else {
+		ret = _hx509_name_ds_cmp(&a1->value, &a2->value, c);
+		if (ret)
+		    return ret;
+	    }
 	    if (*c)
 		return 0;
 	}
@@ -532,6 +654,12 @@ _hx509_name_cmp(const Name *n1, const Name *n2, int *c)
     return 0;
 }
 
+HX509_LIB_FUNCTION int HX509_LIB_CALL
+_hx509_name_cmp(const Name *n1, const Name *n2, int *c)
+{
+    return name_cmp(n1, NULL, n2, NULL, c);
+}
+
 /**
  * Compare to hx509 name object, useful for sorting.
  *
@@ -548,7 +676,15 @@ HX509_LIB_FUNCTION int HX509_LIB_CALL
 hx509_name_cmp(hx509_name n1, hx509_name n2)
 {
     int ret, diff;
-    ret = _hx509_name_cmp(&n1->der_name, &n2->der_name, &diff);
+
+    /*
+     * Names that are compared repeatedly (sorting, matching against a
+     * keyset) only pay for stringprep once.
+     */
+    if (name_prep(n1) == 0 && name_prep(n2) == 0)
+	ret = name_cmp(&n1->der_name, n1->prep, &n2->der_name, n2->prep, &diff);
+    else
+	ret = _hx509_name_cmp(&n1->der_name, &n2->der_name, &diff);
     if (ret)
 	return ret;
     return diff;
@@ -874,6 +1010,8 @@ hx509_name_expand(hx509_context context,
     if (env == NULL)
 	return 0;
 
+    name_prep_free(&name->prep);
+
     if (n->element != choice_Name_rdnSequence) {
 	hx509_set_error_string(context, 0, EINVAL, "RDN not of supported type");
 	return EINVAL;
@@ -1034,6 +1172,7 @@ hx509_name_expand(hx509_context context,
 HX509_LIB_FUNCTION void HX509_LIB_CALL
 hx509_name_free(hx509_name *name)
 {
+    name_prep_free(&(*name)->prep);
     free_Name(&(*name)->der_name);
     memset(*name, 0, sizeof(**name));
     free(*name);
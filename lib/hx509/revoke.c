@@ -51,10 +51,31 @@
 
 #include "hx_locl.h"
 
-struct revoke_crl {
+/*
+ * A parsed CRL file.  These are shared, reference counted, between
+ * all revocation contexts in the process, keyed by path, mtime and
+ * size, so that a large CRL is only decoded and indexed once.
+ * Whether the CRL verifies depends on the certificates of the context
+ * using it, so that is tracked in struct revoke_crl.
+ */
+struct crl_serial {
+    const heim_integer *serial;
+    size_t idx;
+};
+
+struct crl_data {
     char *path;
-    time_t last_modfied;
+    time_t mtime;
+    off_t size;
     CRLCertificateList crl;
+    /* revokedCertificates sorted by serial number */
+    struct crl_serial *sorted;
+    size_t nsorted;
+};
+
+struct revoke_crl {
+    char *path;
+    struct crl_data *data;
     int verified;
     int failed_verify;
 };
@@ -78,6 +99,8 @@ struct hx509_revoke_ctx_data {
 	struct revoke_ocsp *val;
 	size_t len;
     } ocsps;
+    hx509_revoke_ocsp_fetch_func ocsp_fetch;
+    void *ocsp_fetch_ctx;
 };
 
 /**
@@ -152,7 +175,7 @@ hx509_revoke_free(hx509_revoke_ctx *ctx)
 
     for (i = 0; i < (*ctx)->crls.len; i++) {
 	free((*ctx)->crls.val[i].path);
-	free_CRLCertificateList(&(*ctx)->crls.val[i].crl);
+	heim_release((*ctx)->crls.val[i].data);
     }
 
     for (i = 0; i < (*ctx)->ocsps.len; i++)
@@ -166,6 +189,41 @@ hx509_revoke_free(hx509_revoke_ctx *ctx)
     *ctx = NULL;
 }
 
+/*
+ * Return the earliest next update time of the loaded CRLs and OCSP
+ * responses, or 0 if none has one.  Revocation results are not worth
+ * remembering past that time.
+ */
+
+HX509_LIB_FUNCTION time_t HX509_LIB_CALL
+_hx509_revoke_next_update(hx509_revoke_ctx ctx)
+{
+    time_t next = 0, t;
+    size_t i, j;
+
+    for (i = 0; i < ctx->crls.len; i++) {
+	const CRLCertificateList *crl = &ctx->crls.val[i].data->crl;
+
+	if (crl->tbsCertList.nextUpdate == NULL)
+	    continue;
+	t = _hx509_Time2time_t(crl->tbsCertList.nextUpdate);
+	if (next == 0 || t < next)
+	    next = t;
+    }
+    for (i = 0; i < ctx->ocsps.len; i++) {
+	const OCSPResponseData *rd = &ctx->ocsps.val[i].ocsp.tbsResponseData;
+
+	for (j = 0; j < rd->responses.len; j++) {
+	    if (rd->responses.val[j].nextUpdate == NULL)
+		continue;
+	    t = *rd->responses.val[j].nextUpdate;
+	    if (next == 0 || t < next)
+		next = t;
+	}
+    }
+    return next;
+}
+
 static int
 verify_ocsp(hx509_context context,
 	    struct revoke_ocsp *ocsp,
@@ -417,7 +475,7 @@ hx509_revoke_add_ocsp(hx509_context context,
     path += 5;
 
     for (i = 0; i < ctx->ocsps.len; i++) {
-	if (strcmp(ctx->ocsps.val[0].path, path) == 0)
+	if (strcmp(ctx->ocsps.val[i].path, path) == 0)
 	    return 0;
     }
 
@@ -588,9 +646,8 @@ crl_parser(hx509_context context, const char *type,
 }
 
 static int
-load_crl(hx509_context context, const char *path, time_t *t, CRLCertificateList *crl)
+load_crl(hx509_context context, const char *path, CRLCertificateList *crl)
 {
-    struct stat sb;
     size_t length;
     void *data;
     FILE *f;
@@ -598,12 +655,6 @@ load_crl(hx509_context context, const char *path, time_t *t, CRLCertificateList
 
     memset(crl, 0, sizeof(*crl));
 
-    ret = stat(path, &sb);
-    if (ret)
-	return errno;
-    
-    *t = sb.st_mtime;
-	
     if ((f = fopen(path, "r")) == NULL)
 	return errno;
 
@@ -624,6 +675,152 @@ load_crl(hx509_context context, const char *path, time_t *t, CRLCertificateList
     return ret;
 }
 
+static void HEIM_CALLCONV
+crl_data_dealloc(void *ptr)
+{
+    struct crl_data *data = ptr;
+
+    free(data->path);
+    free(data->sorted);
+    free_CRLCertificateList(&data->crl);
+}
+
+static int
+crl_serial_cmp(const void *a, const void *b)
+{
+    const struct crl_serial *sa = a, *sb = b;
+    int diff;
+
+    diff = der_heim_integer_cmp(sa->serial, sb->serial);
+    if (diff)
+	return diff;
+    /* keep duplicates in CRL order */
+    return (sa->idx > sb->idx) - (sa->idx < sb->idx);
+}
+
+static int
+sort_crl(struct crl_data *data)
+{
+    const CRLCertificateList *crl = &data->crl;
+    size_t i, len;
+
+    if (crl->tbsCertList.revokedCertificates == NULL)
+	return 0;
+    len = crl->tbsCertList.revokedCertificates->len;
+    if (len == 0)
+	return 0;
+
+    data->sorted = calloc(len, sizeof(data->sorted[0]));
+    if (data->sorted == NULL)
+	return ENOMEM;
+    for (i = 0; i < len; i++) {
+	data->sorted[i].serial =
+	    &crl->tbsCertList.revokedCertificates->val[i].userCertificate;
+	data->sorted[i].idx = i;
+    }
+    qsort(data->sorted, len, sizeof(data->sorted[0]), crl_serial_cmp);
+    data->nsorted = len;
+    return 0;
+}
+
+static HEIMDAL_MUTEX crl_cache_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct {
+    struct crl_data **val;
+    size_t len;
+} crl_cache;
+
+/*
+ * Return the parsed CRL for path, from the cache if the file has not
+ * changed since it was parsed.  The caller must heim_release() it.
+ */
+
+static int
+get_crl(hx509_context context, const char *path, struct crl_data **out)
+{
+    struct crl_data *data;
+    struct stat sb;
+    size_t i;
+    void *ptr;
+    int ret;
+
+    *out = NULL;
+
+    if (stat(path, &sb))
+	return errno;
+
+    HEIMDAL_MUTEX_lock(&crl_cache_mutex);
+    for (i = 0; i < crl_cache.len; i++) {
+	data = crl_cache.val[i];
+	if (strcmp(data->path, path) == 0 &&
+	    data->mtime == sb.st_mtime && data->size == sb.st_size) {
+	    *out = heim_retain(data);
+	    HEIMDAL_MUTEX_unlock(&crl_cache_mutex);
+	    return 0;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&crl_cache_mutex);
+
+    data = heim_alloc(sizeof(*data), "hx509-crl", crl_data_dealloc);
+    if (data == NULL)
+	return ENOMEM;
+    data->mtime = sb.st_mtime;
+    data->size = sb.st_size;
+    data->path = strdup(path);
+    if (data->path == NULL) {
+	heim_release(data);
+	return ENOMEM;
+    }
+
+    ret = load_crl(context, path, &data->crl);
+    if (ret == 0)
+	ret = sort_crl(data);
+    if (ret) {
+	heim_release(data);
+	return ret;
+    }
+
+    /* Replace any older version of the file in the cache */
+    HEIMDAL_MUTEX_lock(&crl_cache_mutex);
+    for (i = 0; i < crl_cache.len; i++) {
+	if (strcmp(crl_cache.val[i]->path, path) == 0) {
+	    heim_release(crl_cache.val[i]);
+	    crl_cache.val[i] = heim_retain(data);
+	    break;
+	}
+    }
+    if (i == crl_cache.len) {
+	ptr = realloc(crl_cache.val,
+		      (crl_cache.len + 1) * sizeof(crl_cache.val[0]));
+	if (ptr) {
+	    crl_cache.val = ptr;
+	    crl_cache.val[crl_cache.len++] = heim_retain(data);
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&crl_cache_mutex);
+
+    *out = data;
+    return 0;
+}
+
+static int
+refresh_crl(hx509_context context, struct revoke_crl *crl)
+{
+    struct crl_data *data;
+    int ret;
+
+    ret = get_crl(context, crl->path, &data);
+    if (ret)
+	return ret;
+    if (data != crl->data) {
+	heim_release(crl->data);
+	crl->data = data;
+	crl->verified = 0;
+	crl->failed_verify = 0;
+    } else
+	heim_release(data);
+    return 0;
+}
+
 /**
  * Add a CRL file to the revokation context.
  *
@@ -675,10 +872,7 @@ hx509_revoke_add_crl(hx509_context context,
 	return ENOMEM;
     }
 
-    ret = load_crl(context,
-		   path,
-		   &ctx->crls.val[ctx->crls.len].last_modfied,
-		   &ctx->crls.val[ctx->crls.len].crl);
+    ret = get_crl(context, path, &ctx->crls.val[ctx->crls.len].data);
     if (ret) {
 	free(ctx->crls.val[ctx->crls.len].path);
 	return ret;
@@ -689,6 +883,117 @@ hx509_revoke_add_crl(hx509_context context,
     return ret;
 }
 
+/*
+ * Earliest nextUpdate of the responses in an OCSP file, 0 if none has
+ * one.
+ */
+
+static time_t
+ocsp_next_update(const struct revoke_ocsp *ocsp)
+{
+    const OCSPResponseData *rd = &ocsp->ocsp.tbsResponseData;
+    time_t next = 0;
+    size_t i;
+
+    for (i = 0; i < rd->responses.len; i++) {
+	if (rd->responses.val[i].nextUpdate == NULL)
+	    continue;
+	if (next == 0 || *rd->responses.val[i].nextUpdate < next)
+	    next = *rd->responses.val[i].nextUpdate;
+    }
+    return next;
+}
+
+/**
+ * Set a function that fetches a fresh OCSP response.  It is called by
+ * hx509_revoke_refresh() with the path of an OCSP file added with
+ * hx509_revoke_add_ocsp() that is about to expire, and should replace
+ * that file with a new response.
+ *
+ * @param ctx hx509 revokation context
+ * @param func fetch function, NULL to remove it
+ * @param ptr context passed to func
+ *
+ * @ingroup hx509_revoke
+ */
+
+HX509_LIB_FUNCTION void HX509_LIB_CALL
+hx509_revoke_set_ocsp_fetcher(hx509_revoke_ctx ctx,
+			      hx509_revoke_ocsp_fetch_func func,
+			      void *ptr)
+{
+    ctx->ocsp_fetch = func;
+    ctx->ocsp_fetch_ctx = ptr;
+}
+
+/**
+ * Bring the revocation data of a revokation context up to date:
+ * reload CRL and OCSP files that changed, and have the OCSP fetcher,
+ * if any, replace responses whose nextUpdate is less than window
+ * seconds away.
+ *
+ * This is meant to be called periodically by a service outside of
+ * its request path, so that hx509_revoke_verify() finds fresh data
+ * and doesn't have to reparse it.
+ *
+ * @param context hx509 context
+ * @param ctx hx509 revokation context
+ * @param now the time now (0 to use the current time)
+ * @param window how long before nextUpdate to refetch OCSP responses
+ *
+ * @return An hx509 error code, see hx509_get_error_string().  All
+ * files are refreshed even if one fails, the last error is returned.
+ *
+ * @ingroup hx509_revoke
+ */
+
+HX509_LIB_FUNCTION int HX509_LIB_CALL
+hx509_revoke_refresh(hx509_context context,
+		     hx509_revoke_ctx ctx,
+		     time_t now,
+		     time_t window)
+{
+    int ret, saved_ret = 0;
+    size_t i;
+
+    if (now == 0)
+	now = time(NULL);
+
+    for (i = 0; i < ctx->crls.len; i++) {
+	ret = refresh_crl(context, &ctx->crls.val[i]);
+	if (ret)
+	    saved_ret = ret;
+    }
+
+    for (i = 0; i < ctx->ocsps.len; i++) {
+	struct revoke_ocsp *ocsp = &ctx->ocsps.val[i];
+	struct stat sb;
+	time_t next;
+
+	if (stat(ocsp->path, &sb) == 0 && ocsp->last_modfied != sb.st_mtime) {
+	    ret = load_ocsp(context, ocsp);
+	    if (ret)
+		saved_ret = ret;
+	}
+
+	if (ctx->ocsp_fetch == NULL)
+	    continue;
+
+	next = ocsp_next_update(ocsp);
+	if (next != 0 && next > now + window)
+	    continue;
+
+	ret = (*ctx->ocsp_fetch)(context, ctx->ocsp_fetch_ctx, ocsp->path);
+	if (ret == 0 &&
+	    stat(ocsp->path, &sb) == 0 && ocsp->last_modfied != sb.st_mtime)
+	    ret = load_ocsp(context, ocsp);
+	if (ret)
+	    saved_ret = ret;
+    }
+
+    return saved_ret;
+}
+
 /**
  * Check that a certificate is not expired according to a revokation
  * context. Also need the parent certificte to the check OCSP
@@ -753,9 +1058,9 @@ hx509_revoke_verify(hx509_context context,
 	    /* verify issuer hashes hash */
 	    ret = _hx509_verify_signature(context,
 					  NULL,
-					  &ocsp->ocsp.tbsResponseData.responses.val[i].certID.hashAlgorithm,
+					  &ocsp->ocsp.tbsResponseData.responses.val[j].certID.hashAlgorithm,
 					  &c->tbsCertificate.issuer._save,
-					  &ocsp->ocsp.tbsResponseData.responses.val[i].certID.issuerNameHash);
+					  &ocsp->ocsp.tbsResponseData.responses.val[j].certID.issuerNameHash);
 	    if (ret != 0)
 		continue;
 
@@ -799,33 +1104,27 @@ hx509_revoke_verify(hx509_context context,
 
     for (i = 0; i < ctx->crls.len; i++) {
 	struct revoke_crl *crl = &ctx->crls.val[i];
-	struct stat sb;
+	const CRLCertificateList *cl;
+	size_t lo, hi;
 	int diff;
 
 	/* check if cert.issuer == crls.val[i].crl.issuer */
 	ret = _hx509_name_cmp(&c->tbsCertificate.issuer,
-			      &crl->crl.tbsCertList.issuer, &diff);
+			      &crl->data->crl.tbsCertList.issuer, &diff);
 	if (ret || diff)
 	    continue;
 
-	ret = stat(crl->path, &sb);
-	if (ret == 0 && crl->last_modfied != sb.st_mtime) {
-	    CRLCertificateList cl;
-
-	    ret = load_crl(context, crl->path, &crl->last_modfied, &cl);
-	    if (ret == 0) {
-		free_CRLCertificateList(&crl->crl);
-		crl->crl = cl;
-		crl->verified = 0;
-		crl->failed_verify = 0;
-	    }
-	}
+	/* pick up a new version of the file, if it changed */
+	(void) refresh_crl(context, crl);
 	if (crl->failed_verify)
 	    continue;
 
+	cl = &crl->data->crl;
+
 	/* verify signature in crl if not already done */
 	if (crl->verified == 0) {
-	    ret = verify_crl(context, ctx, &crl->crl, now, certs, parent_cert);
+	    ret = verify_crl(context, ctx, &crl->data->crl, now, certs,
+			     parent_cert);
 	    if (ret) {
 		crl->failed_verify = 1;
 		continue;
@@ -833,9 +1132,9 @@ hx509_revoke_verify(hx509_context context,
 	    crl->verified = 1;
 	}
 
-	if (crl->crl.tbsCertList.crlExtensions) {
-	    for (j = 0; j < crl->crl.tbsCertList.crlExtensions->len; j++) {
-		if (crl->crl.tbsCertList.crlExtensions->val[j].critical) {
+	if (cl->tbsCertList.crlExtensions) {
+	    for (j = 0; j < cl->tbsCertList.crlExtensions->len; j++) {
+		if (cl->tbsCertList.crlExtensions->val[j].critical) {
 		    hx509_set_error_string(context, 0,
 					   HX509_CRL_UNKNOWN_EXTENSION,
 					   "Unknown CRL extension");
@@ -844,25 +1143,39 @@ hx509_revoke_verify(hx509_context context,
 	    }
 	}
 
-	if (crl->crl.tbsCertList.revokedCertificates == NULL)
+	if (cl->tbsCertList.revokedCertificates == NULL)
 	    return 0;
 
-	/* check if cert is in crl */
-	for (j = 0; j < crl->crl.tbsCertList.revokedCertificates->len; j++) {
+	/* check if cert is in crl, find the first entry with its serial */
+	lo = 0;
+	hi = crl->data->nsorted;
+	while (lo < hi) {
+	    size_t mid = lo + (hi - lo) / 2;
+
+	    if (der_heim_integer_cmp(crl->data->sorted[mid].serial,
+				     &c->tbsCertificate.serialNumber) < 0)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+
+	for (; lo < crl->data->nsorted; lo++) {
+	    const struct crl_serial *e = &crl->data->sorted[lo];
 	    time_t t;
 
-	    ret = der_heim_integer_cmp(&crl->crl.tbsCertList.revokedCertificates->val[j].userCertificate,
-				       &c->tbsCertificate.serialNumber);
-	    if (ret != 0)
-		continue;
+	    if (der_heim_integer_cmp(e->serial,
+				     &c->tbsCertificate.serialNumber) != 0)
+		break;
+
+	    j = e->idx;
 
-	    t = _hx509_Time2time_t(&crl->crl.tbsCertList.revokedCertificates->val[j].revocationDate);
+	    t = _hx509_Time2time_t(&cl->tbsCertList.revokedCertificates->val[j].revocationDate);
 	    if (t > now)
 		continue;
 
-	    if (crl->crl.tbsCertList.revokedCertificates->val[j].crlEntryExtensions)
-		for (k = 0; k < crl->crl.tbsCertList.revokedCertificates->val[j].crlEntryExtensions->len; k++)
-		    if (crl->crl.tbsCertList.revokedCertificates->val[j].crlEntryExtensions->val[k].critical)
+	    if (cl->tbsCertList.revokedCertificates->val[j].crlEntryExtensions)
+		for (k = 0; k < cl->tbsCertList.revokedCertificates->val[j].crlEntryExtensions->len; k++)
+		    if (cl->tbsCertList.revokedCertificates->val[j].crlEntryExtensions->val[k].critical)
 			return HX509_CRL_UNKNOWN_EXTENSION;
 
 	    hx509_set_error_string(context, 0,
@@ -1175,7 +1488,7 @@ print_crl(hx509_context context, struct revoke_crl *crl, FILE *out)
     {
 	hx509_name n;
 	char *s;
-	_hx509_name_from_Name(&crl->crl.tbsCertList.issuer, &n);
+	_hx509_name_from_Name(&crl->data->crl.tbsCertList.issuer, &n);
 	hx509_name_to_string(n, &s);
 	hx509_name_free(&n);
 	fprintf(out, " issuer: %s\n", s);
@@ -1183,7 +1496,7 @@ print_crl(hx509_context context, struct revoke_crl *crl, FILE *out)
     }
 
     fprintf(out, " thisUpdate: %s\n", 
-	    printable_time(_hx509_Time2time_t(&crl->crl.tbsCertList.thisUpdate)));
+	    printable_time(_hx509_Time2time_t(&crl->data->crl.tbsCertList.thisUpdate)));
 
     return 0;
 }
@@ -34,6 +34,7 @@
  */
 
 #include "hi_locl.h"
+#include "heim_threads.h"
 
 #if defined(__APPLE__) && defined(HAVE_GCD)
 
@@ -315,6 +316,8 @@ mach_release(void *ctx)
 struct path_ctx {
     char *path;
     int fd;
+    pid_t pid;			/* that made the connection */
+    HEIMDAL_MUTEX mutex;
 };
 
 static int common_release(void *);
@@ -331,13 +334,34 @@ connect_unix(struct path_ctx *s)
     if (s->fd < 0)
 	return errno;
     rk_cloexec(s->fd);
+#ifdef SO_NOSIGPIPE
+    {
+	int on = 1;
+	(void) setsockopt(s->fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    }
+#endif
 
     if (connect(s->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
 	return errno;
 
+    s->pid = getpid();
     return 0;
 }
 
+/*
+ * Drop the connection and make a new one.  Used after fork(), so the
+ * child does not share the parent's connection, and when the server
+ * has gone away, e.g. because it was restarted.
+ */
+static int
+reconnect_unix(struct path_ctx *s)
+{
+    if (s->fd >= 0)
+	close(s->fd);
+    s->fd = -1;
+    return connect_unix(s);
+}
+
 static int
 common_path_init(const char *base,
                  const char *service,
@@ -350,6 +374,8 @@ common_path_init(const char *base,
     if (s == NULL)
 	return ENOMEM;
     s->fd = -1;
+    s->pid = -1;
+    HEIMDAL_MUTEX_init(&s->mutex);
 
     if (asprintf(&s->path, "%s/.heim_%s-%s", base, service, file) == -1) {
 	free(s);
@@ -378,41 +404,143 @@ unix_socket_init(const char *service,
 }
 
 static int
-unix_socket_ipc(void *ctx,
-		const heim_idata *req, heim_idata *rep,
-		heim_icred *cred)
+send_unix(struct path_ctx *s, const void *buf, size_t len)
 {
-    struct path_ctx *s = ctx;
-    uint32_t len = htonl(req->length);
-    uint32_t rv;
-    int retval;
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+#ifdef MSG_NOSIGNAL
+	n = send(s->fd, p, len, MSG_NOSIGNAL);
+#else
+	n = write(s->fd, p, len);
+#endif
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return -1;
+	p += n;
+	len -= n;
+    }
+    return 0;
+}
 
-    if (cred)
-	*cred = NULL;
+static int
+recv_reply_unix(struct path_ctx *s, heim_idata *rep, int *retval)
+{
+    uint32_t len, rv;
 
     rep->data = NULL;
     rep->length = 0;
 
-    if (net_write(s->fd, &len, sizeof(len)) != sizeof(len))
-	return -1;
-    if (net_write(s->fd, req->data, req->length) != (ssize_t)req->length)
-	return -1;
-
     if (net_read(s->fd, &len, sizeof(len)) != sizeof(len))
 	return -1;
     if (net_read(s->fd, &rv, sizeof(rv)) != sizeof(rv))
 	return -1;
-    retval = ntohl(rv);
+    *retval = ntohl(rv);
 
     rep->length = ntohl(len);
     if (rep->length > 0) {
 	rep->data = malloc(rep->length);
 	if (rep->data == NULL)
 	    return -1;
-	if (net_read(s->fd, rep->data, rep->length) != (ssize_t)rep->length)
+	if (net_read(s->fd, rep->data, rep->length) != (ssize_t)rep->length) {
+	    free(rep->data);
+	    rep->data = NULL;
+	    rep->length = 0;
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Send `n' requests back to back and then read their replies, which
+ * the server sends in order.  Called with the mutex held.
+ */
+static int
+pipeline_unix(struct path_ctx *s, size_t n,
+	      const heim_idata *req, heim_idata *rep, int *rets,
+	      int *sent, size_t *nrecv)
+{
+    size_t i;
+    uint32_t len;
+
+    *sent = 0;
+    *nrecv = 0;
+    for (i = 0; i < n; i++) {
+	len = htonl(req[i].length);
+	if (send_unix(s, &len, sizeof(len)))
+	    return -1;
+	*sent = 1;
+	if (send_unix(s, req[i].data, req[i].length))
 	    return -1;
-    } else
-	rep->data = NULL;
+    }
+    for (i = 0; i < n; i++) {
+	if (recv_reply_unix(s, &rep[i], &rets[i]))
+	    return -1;
+	(*nrecv)++;
+    }
+    return 0;
+}
+
+static int
+unix_socket_batch(void *ctx, size_t n,
+		  const heim_idata *req, heim_idata *rep, int *rets)
+{
+    struct path_ctx *s = ctx;
+    size_t i, nrecv = 0;
+    int ret = 0, sent;
+
+    HEIMDAL_MUTEX_lock(&s->mutex);
+
+    if (s->fd < 0 || s->pid != getpid())
+	ret = reconnect_unix(s);
+    if (ret == 0 &&
+	pipeline_unix(s, n, req, rep, rets, &sent, &nrecv) != 0) {
+	/*
+	 * The connection is unusable now.  If not even the first
+	 * request could be sent the server went away, e.g. was
+	 * restarted, since the last call; try once more on a new
+	 * connection.  Otherwise the requests may have been acted on.
+	 */
+	ret = -1;
+	if (!sent && reconnect_unix(s) == 0 &&
+	    pipeline_unix(s, n, req, rep, rets, &sent, &nrecv) == 0)
+	    ret = 0;
+	else if (s->fd >= 0) {
+	    close(s->fd);
+	    s->fd = -1;
+	}
+    }
+
+    HEIMDAL_MUTEX_unlock(&s->mutex);
+
+    if (ret) {
+	for (i = 0; i < nrecv; i++) {
+	    free(rep[i].data);
+	    rep[i].data = NULL;
+	    rep[i].length = 0;
+	}
+	for (i = 0; i < n; i++)
+	    rets[i] = -1;
+    }
+    return ret;
+}
+
+static int
+unix_socket_ipc(void *ctx,
+		const heim_idata *req, heim_idata *rep,
+		heim_icred *cred)
+{
+    int ret, retval;
+
+    if (cred)
+	*cred = NULL;
+
+    ret = unix_socket_batch(ctx, 1, req, rep, &retval);
+    if (ret)
+	return ret;
 
     return retval;
 }
@@ -423,6 +551,7 @@ common_release(void *ctx)
     struct path_ctx *s = ctx;
     if (s->fd >= 0)
 	close(s->fd);
+    HEIMDAL_MUTEX_destroy(&s->mutex);
     free(s->path);
     free(s);
     return 0;
@@ -518,16 +647,18 @@ struct hipc_ops {
     int (*ipc)(void *,const heim_idata *, heim_idata *, heim_icred *);
     int (*async)(void *, const heim_idata *, void *,
 		 void (*)(void *, int, heim_idata *, heim_icred));
+    int (*batch)(void *, size_t, const heim_idata *, heim_idata *, int *);
 };
 
 struct hipc_ops ipcs[] = {
 #if defined(__APPLE__) && defined(HAVE_GCD)
-    { "MACH", mach_init, mach_release, mach_ipc, mach_async },
+    { "MACH", mach_init, mach_release, mach_ipc, mach_async, NULL },
 #endif
 #ifdef HAVE_DOOR_CREATE
-    { "DOOR", door_init, common_release, door_ipc, NULL },
+    { "DOOR", door_init, common_release, door_ipc, NULL, NULL },
 #endif
-    { "UNIX", unix_socket_init, common_release, unix_socket_ipc, NULL }
+    { "UNIX", unix_socket_init, common_release, unix_socket_ipc, NULL,
+      unix_socket_batch }
 };
 
 struct heim_ipc {
@@ -590,6 +721,31 @@ heim_ipc_call(heim_ipc ctx, const heim_idata *snd, heim_idata *rcv,
     return (ctx->ops->ipc)(ctx->ctx, snd, rcv, cred);
 }
 
+/**
+ * Make `n' calls in one go, where the transport allows, rather than
+ * waiting for each reply before sending the next request.  The
+ * replies and the return values of the calls are stored in `rcv' and
+ * `rets'; the return value is non-zero if the calls could not be made
+ * at all, in which case every entry of `rets' is non-zero too.
+ */
+
+int
+heim_ipc_call_batch(heim_ipc ctx, size_t n, const heim_idata *snd,
+		    heim_idata *rcv, int *rets)
+{
+    size_t i;
+
+    if (ctx->ops->batch != NULL)
+	return (ctx->ops->batch)(ctx->ctx, n, snd, rcv, rets);
+
+    for (i = 0; i < n; i++) {
+	rcv[i].data = NULL;
+	rcv[i].length = 0;
+	rets[i] = (ctx->ops->ipc)(ctx->ctx, &snd[i], &rcv[i], NULL);
+    }
+    return 0;
+}
+
 int
 heim_ipc_async(heim_ipc ctx, const heim_idata *snd, void *userctx,
 	       void (*func)(void *, int, heim_idata *, heim_icred))
@@ -90,6 +90,9 @@ heim_ipc_free_context(heim_ipc);
 int
 heim_ipc_call(heim_ipc, const heim_idata *, heim_idata *, heim_icred *);
 
+int
+heim_ipc_call_batch(heim_ipc, size_t, const heim_idata *, heim_idata *, int *);
+
 int
 heim_ipc_async(heim_ipc, const heim_idata *, void *, void (*func)(void *, int, heim_idata *, heim_icred));
 
@@ -129,5 +132,8 @@ heim_sipc_timeout(time_t);
 void
 heim_sipc_set_timeout_handler(void (*)(void));
 
+int
+heim_sipc_set_threads(int);
+
 void
 heim_sipc_free_context(heim_sipc);
@@ -34,6 +34,7 @@
  */
 
 #include "hi_locl.h"
+#include "heim_threads.h"
 #include <assert.h>
 #include <err.h>
 
@@ -467,10 +468,17 @@ struct client {
     size_t ptr, len;
     uint8_t *inmsg;
     size_t olen;
+    size_t osize;		/* allocated for outmsg */
     uint8_t *outmsg;
 #ifdef HAVE_GCD
     dispatch_source_t in;
     dispatch_source_t out;
+#else
+    unsigned idx;		/* in clients[] */
+    int events;			/* WAITING_* registered, -1 if none */
+    int touched;		/* on the touched list */
+    int busy;			/* has a call on a worker thread */
+    struct socket_call *pending, **pending_tail; /* calls waiting for it */
 #endif
     struct {
 	uid_t uid;
@@ -482,6 +490,9 @@ struct client {
 #ifndef HAVE_GCD
 static unsigned num_clients = 0;
 static struct client **clients = NULL;
+
+static void events_update(struct client *);
+static void touch(struct client *);
 #endif
 
 static void handle_read(struct client *);
@@ -674,9 +685,13 @@ add_new_socket(int fd,
 #else
     clients = erealloc(clients, sizeof(clients[0]) * (num_clients + 1));
     clients[num_clients] = c;
-    num_clients++;
+    c->idx = num_clients++;
+    c->events = -1;
+    c->pending_tail = &c->pending;
+    events_update(c);
 #endif
 
+    heim_mem_account(HEIM_MEM_IPC, sizeof(*c), 1);
     return c;
 }
 
@@ -698,8 +713,15 @@ maybe_close(struct client *c)
     if ((c->flags & WAITING_WRITE) == 0)
 	dispatch_resume(c->out);
     dispatch_release(c->out);
+#else
+    clients[c->idx] = clients[--num_clients];
+    clients[c->idx]->idx = c->idx;
 #endif
     close(c->fd); /* ref count fd close */
+    heim_mem_account(HEIM_MEM_IPC,
+		     -(int64_t)(sizeof(*c) + c->len + c->osize), -1);
+    free(c->inmsg);
+    free(c->outmsg);
     free(c);
     return 1;
 }
@@ -709,14 +731,27 @@ struct socket_call {
     heim_idata in;
     struct client *c;
     heim_icred cred;
+#ifndef HAVE_GCD
+    int returnvalue;		/* of a call completed by another thread */
+    heim_idata reply;
+    struct socket_call *next;	/* on the work or done queue */
+#endif
 };
 
+#ifndef HAVE_GCD
+static void queue_call(struct socket_call *);
+static int queue_completion(struct socket_call *, int, heim_idata *);
+#endif
+
 static void
 output_data(struct client *c, const void *data, size_t len)
 {
     if (c->olen + len < c->olen)
 	abort();
     c->outmsg = erealloc(c->outmsg, c->olen + len);
+    heim_mem_account(HEIM_MEM_IPC,
+		     (int64_t)(c->olen + len) - (int64_t)c->osize, 0);
+    c->osize = c->olen + len;
     memcpy(&c->outmsg[c->olen], data, len);
     c->olen += len;
     c->flags |= WAITING_WRITE;
@@ -732,6 +767,12 @@ socket_complete(heim_sipc_call ctx, int returnvalue, heim_idata *reply)
     if (c == NULL)
 	abort();
 
+#ifndef HAVE_GCD
+    /* Completed off the event loop thread; finish it there */
+    if (queue_completion(sc, returnvalue, reply))
+	return;
+#endif
+
     if ((c->flags & WAITING_CLOSE) == 0) {
 	uint32_t u32;
 
@@ -758,11 +799,29 @@ socket_complete(heim_sipc_call ctx, int returnvalue, heim_idata *reply)
     c->calls--;
     if (sc->cred)
 	heim_ipc_free_cred(sc->cred);
+    heim_mem_account(HEIM_MEM_IPC, -(int64_t)(sizeof(*sc) + sc->in.length), -1);
     free(sc->in.data);
     sc->c = NULL; /* so we can catch double complete */
     free(sc);
 
+#ifdef HAVE_GCD
     maybe_close(c);
+#else
+    /* Pipelined calls are run one at a time so replies stay in order */
+    if (c->busy) {
+	sc = c->pending;
+	c->busy = 0;
+	if (sc != NULL) {
+	    c->pending = sc->next;
+	    if (c->pending == NULL)
+		c->pending_tail = &c->pending;
+	    queue_call(sc);
+	}
+    }
+
+    /* The event loop closes it, if need be, and updates its events */
+    touch(c);
+#endif
 }
 
 /* remove HTTP %-quoting from buf */
@@ -886,6 +945,7 @@ handle_read(struct client *c)
 	c->inmsg = erealloc(c->inmsg,
 			    c->len + 1024);
 	c->len += 1024;
+	heim_mem_account(HEIM_MEM_IPC, 1024, 0);
     }
 
     len = read(c->fd, c->inmsg + c->ptr, c->len - c->ptr);
@@ -943,6 +1003,7 @@ handle_read(struct client *c)
 	}
 
 	c->calls++;
+	heim_mem_account(HEIM_MEM_IPC, sizeof(*cs) + cs->in.length, 1);
 
 	if ((c->flags & UNIX_SOCKET) != 0) {
 	    if (update_client_creds(c))
@@ -950,9 +1011,13 @@ handle_read(struct client *c)
 				      c->unixrights.pid, -1, &cs->cred);
 	}
 
+#ifndef HAVE_GCD
+	queue_call(cs);
+#else
 	c->callback(c->userctx, &cs->in,
 		    cs->cred, socket_complete,
 		    (heim_sipc_call)cs);
+#endif
     }
 }
 
@@ -970,6 +1035,8 @@ handle_write(struct client *c)
 	c->olen -= len;
     } else {
 	c->olen = 0;
+	heim_mem_account(HEIM_MEM_IPC, -(int64_t)c->osize, 0);
+	c->osize = 0;
 	free(c->outmsg);
 	c->outmsg = NULL;
 	c->flags &= ~(WAITING_WRITE);
@@ -979,67 +1046,379 @@ handle_write(struct client *c)
 
 #ifndef HAVE_GCD
 
+/*
+ * The event loop.  Sockets are registered with epoll(7) where we have
+ * it, and their interest updated only when it changes, so each wait
+ * only reports the ready ones; elsewhere we poll() a table kept across
+ * iterations.  Either way only the clients that had events, or whose
+ * calls completed, are looked at afterwards (the "touched" ones).
+ *
+ * With heim_sipc_set_threads() the service callbacks run on a pool of
+ * worker threads, so that one slow call does not hold up the other
+ * clients.  Calls may also be completed from any thread by services
+ * that do their own work asynchronously.  Such completions are queued
+ * and the event loop, which owns all the client state, is woken up to
+ * send the replies.
+ */
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#include <sys/epoll.h>
+#define IPC_EVENTS_EPOLL 1
+#define IPC_MAX_READY 64
+static int epoll_fd = -1;
+#endif
+
+static struct pollfd *poll_fds = NULL;
+static struct client **poll_clients = NULL;
+static unsigned poll_size = 0;
+
+static struct client **touched = NULL;
+static unsigned num_touched = 0, touched_size = 0;
+
+static int wakeup_pipe[2] = { -1, -1 };
+static struct socket_call *done_head = NULL, **done_tail = &done_head;
+static HEIMDAL_MUTEX done_mutex = HEIMDAL_MUTEX_INITIALIZER;
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+static int num_threads = 0;
+static pthread_t loop_thread;
+static int loop_running = 0;
+static struct socket_call *work_head = NULL, **work_tail = &work_head;
+static HEIMDAL_MUTEX work_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
 static void
-process_loop(void)
+touch(struct client *c)
 {
-    struct pollfd *fds;
-    unsigned n;
-    unsigned num_fds;
+    if (c->touched)
+	return;
+    if (num_touched == touched_size) {
+	touched_size = touched_size ? touched_size * 2 : 64;
+	touched = erealloc(touched, touched_size * sizeof(touched[0]));
+    }
+    touched[num_touched++] = c;
+    c->touched = 1;
+}
 
-    while (num_clients > 0) {
+static void
+events_init(void)
+{
+#ifdef IPC_EVENTS_EPOLL
+    if (epoll_fd == -1)
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+#endif
+}
+
+static void
+events_update(struct client *c)
+{
+    int want = c->flags & (WAITING_READ|WAITING_WRITE);
+#ifdef IPC_EVENTS_EPOLL
+    struct epoll_event ev;
+
+    events_init();
+    if (epoll_fd == -1 || c->fd < 0 || want == c->events)
+	return;
+    if (want == 0) {
+	/*
+	 * Unregister clients that wait for nothing (e.g., for their
+	 * calls to complete), as a hangup would be reported regardless.
+	 */
+	if (c->events != -1)
+	    (void) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	c->events = -1;
+	return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    if (want & WAITING_READ)
+	ev.events |= EPOLLIN;
+    if (want & WAITING_WRITE)
+	ev.events |= EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, c->events == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+		  c->fd, &ev) == -1)
+	err(1, "epoll_ctl(2) failed");
+#endif
+    c->events = want;
+}
+
+static void
+wakeup_init(void)
+{
+    if (wakeup_pipe[0] != -1)
+	return;
+    if (pipe(wakeup_pipe) == -1)
+	err(1, "pipe(2) failed");
+    rk_cloexec(wakeup_pipe[0]);
+    rk_cloexec(wakeup_pipe[1]);
+    socket_set_nonblocking(wakeup_pipe[0], 1);
+    socket_set_nonblocking(wakeup_pipe[1], 1);
+#ifdef IPC_EVENTS_EPOLL
+    if (epoll_fd != -1) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_pipe[0], &ev) == -1)
+	    err(1, "epoll_ctl(2) failed");
+    }
+#endif
+}
+
+static int
+on_loop_thread(void)
+{
+#ifdef ENABLE_PTHREAD_SUPPORT
+    return !loop_running || pthread_equal(pthread_self(), loop_thread);
+#else
+    return 1;
+#endif
+}
+
+/*
+ * Queue a call completed off the event loop thread, returning 0 if we
+ * are on it and the caller should complete the call itself.
+ */
+static int
+queue_completion(struct socket_call *sc, int returnvalue, heim_idata *reply)
+{
+    if (on_loop_thread())
+	return 0;
+
+    sc->returnvalue = returnvalue;
+    sc->reply.length = 0;
+    sc->reply.data = NULL;
+    if (reply != NULL && reply->length > 0) {
+	sc->reply.data = emalloc(reply->length);
+	memcpy(sc->reply.data, reply->data, reply->length);
+	sc->reply.length = reply->length;
+    }
+    sc->next = NULL;
+
+    HEIMDAL_MUTEX_lock(&done_mutex);
+    *done_tail = sc;
+    done_tail = &sc->next;
+    HEIMDAL_MUTEX_unlock(&done_mutex);
+
+    while (write(wakeup_pipe[1], "", 1) < 0 && errno == EINTR)
+	;
+    return 1;
+}
+
+static void
+run_completions(void)
+{
+    struct socket_call *sc, *next;
+    char buf[64];
+
+    while (read(wakeup_pipe[0], buf, sizeof(buf)) > 0)
+	;
 
-	fds = malloc(num_clients * sizeof(fds[0]));
-	if(fds == NULL)
-	    abort();
+    HEIMDAL_MUTEX_lock(&done_mutex);
+    sc = done_head;
+    done_head = NULL;
+    done_tail = &done_head;
+    HEIMDAL_MUTEX_unlock(&done_mutex);
 
-	num_fds = num_clients;
+    for (; sc != NULL; sc = next) {
+	heim_idata reply = sc->reply;
+
+	next = sc->next;
+	socket_complete((heim_sipc_call)sc, sc->returnvalue, &reply);
+	free(reply.data);
+    }
+}
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+static void *
+worker(void *arg)
+{
+    struct socket_call *cs;
+    struct client *c;
 
-	for (n = 0 ; n < num_fds; n++) {
-	    fds[n].fd = clients[n]->fd;
-	    fds[n].events = 0;
-	    if (clients[n]->flags & WAITING_READ)
-		fds[n].events |= POLLIN;
-	    if (clients[n]->flags & WAITING_WRITE)
-		fds[n].events |= POLLOUT;
+    for (;;) {
+	HEIMDAL_MUTEX_lock(&work_mutex);
+	while (work_head == NULL)
+	    pthread_cond_wait(&work_cond, &work_mutex);
+	cs = work_head;
+	work_head = cs->next;
+	if (work_head == NULL)
+	    work_tail = &work_head;
+	HEIMDAL_MUTEX_unlock(&work_mutex);
+
+	/* `c' stays around while it has calls outstanding */
+	c = cs->c;
+	c->callback(c->userctx, &cs->in, cs->cred, socket_complete,
+		    (heim_sipc_call)cs);
+    }
+    return NULL;
+}
+#endif
 
-	    fds[n].revents = 0;
+/*
+ * Run a call's callback, on a worker thread if there are any.  A
+ * client's calls then run one at a time, so that replies to pipelined
+ * requests go out in the order the requests came in.
+ */
+static void
+queue_call(struct socket_call *cs)
+{
+    struct client *c = cs->c;
+
+#ifdef ENABLE_PTHREAD_SUPPORT
+    if (num_threads > 0 && loop_running) {
+	cs->next = NULL;
+	if (c->busy) {
+	    *c->pending_tail = cs;
+	    c->pending_tail = &cs->next;
+	    return;
 	}
+	c->busy = 1;
+	HEIMDAL_MUTEX_lock(&work_mutex);
+	*work_tail = cs;
+	work_tail = &cs->next;
+	pthread_cond_signal(&work_cond);
+	HEIMDAL_MUTEX_unlock(&work_mutex);
+	return;
+    }
+#endif
+    c->callback(c->userctx, &cs->in, cs->cred, socket_complete,
+		(heim_sipc_call)cs);
+}
+
+static void
+threads_start(void)
+{
+#ifdef ENABLE_PTHREAD_SUPPORT
+    pthread_t t;
+    int i;
+
+    loop_thread = pthread_self();
+    loop_running = 1;
+    for (i = 0; i < num_threads; i++) {
+	if (pthread_create(&t, NULL, worker, NULL) != 0)
+	    err(1, "pthread_create failed");
+	pthread_detach(t);
+    }
+#endif
+}
 
-	while (poll(fds, num_fds, -1) == -1) {
+/*
+ * Wait for events and handle them, touching the clients concerned.
+ */
+static void
+events_wait(void)
+{
+    unsigned n, num_fds;
+    int ret;
+
+#ifdef IPC_EVENTS_EPOLL
+    if (epoll_fd != -1) {
+	struct epoll_event evs[IPC_MAX_READY];
+	int i;
+
+	while ((ret = epoll_wait(epoll_fd, evs, IPC_MAX_READY, -1)) == -1) {
             if (errno == EINTR || errno == EAGAIN)
                 continue;
-            err(1, "poll(2) failed");
+            err(1, "epoll_wait(2) failed");
         }
+	for (i = 0; i < ret; i++) {
+	    struct client *c = evs[i].data.ptr;
 
-	for (n = 0 ; n < num_fds; n++) {
-	    if (clients[n] == NULL)
-		continue;
-	    if (fds[n].revents & POLLERR) {
-		clients[n]->flags |= WAITING_CLOSE;
+	    if (c == NULL)
+		continue;	/* the wakeup pipe */
+	    touch(c);
+	    if (evs[i].events & EPOLLERR) {
+		c->flags |= WAITING_CLOSE;
+		c->flags &= ~(WAITING_READ|WAITING_WRITE);
 		continue;
 	    }
-
-	    if (fds[n].revents & POLLIN)
-		handle_read(clients[n]);
-	    if (fds[n].revents & POLLOUT)
-		handle_write(clients[n]);
+	    if ((evs[i].events & EPOLLIN) ||
+		((evs[i].events & EPOLLHUP) && (c->flags & WAITING_READ)))
+		handle_read(c);
+	    if (evs[i].events & EPOLLOUT)
+		handle_write(c);
 	}
+	return;
+    }
+#endif
+
+    if (poll_size < num_clients + 1) {
+	poll_size = num_clients + 1;
+	poll_fds = erealloc(poll_fds, poll_size * sizeof(poll_fds[0]));
+	poll_clients = erealloc(poll_clients,
+				poll_size * sizeof(poll_clients[0]));
+    }
+
+    num_fds = num_clients;
+    for (n = 0 ; n < num_fds; n++) {
+	poll_clients[n] = clients[n];
+	poll_fds[n].fd = clients[n]->fd;
+	poll_fds[n].events = 0;
+	if (clients[n]->flags & WAITING_READ)
+	    poll_fds[n].events |= POLLIN;
+	if (clients[n]->flags & WAITING_WRITE)
+	    poll_fds[n].events |= POLLOUT;
+
+	poll_fds[n].revents = 0;
+    }
+    poll_fds[num_fds].fd = wakeup_pipe[0];
+    poll_fds[num_fds].events = POLLIN;
+    poll_fds[num_fds].revents = 0;
+
+    while (poll(poll_fds, num_fds + 1, -1) == -1) {
+        if (errno == EINTR || errno == EAGAIN)
+            continue;
+        err(1, "poll(2) failed");
+    }
+
+    for (n = 0 ; n < num_fds; n++) {
+	struct client *c = poll_clients[n];
 
-	n = 0;
-	while (n < num_clients) {
-	    struct client *c = clients[n];
-	    if (maybe_close(c)) {
-		if (n < num_clients - 1)
-		    clients[n] = clients[num_clients - 1];
-		num_clients--;
-	    } else
-		n++;
+	if (poll_fds[n].revents == 0)
+	    continue;
+	touch(c);
+	if (poll_fds[n].revents & POLLERR) {
+	    c->flags |= WAITING_CLOSE;
+	    c->flags &= ~(WAITING_READ|WAITING_WRITE);
+	    continue;
 	}
 
-	free(fds);
+	if (poll_fds[n].revents & POLLIN)
+	    handle_read(c);
+	if (poll_fds[n].revents & POLLOUT)
+	    handle_write(c);
+    }
+}
+
+static void
+process_loop(void)
+{
+    unsigned n;
+
+    events_init();
+    wakeup_init();
+    threads_start();
+
+    while (num_clients > 0) {
+
+	events_wait();
+	run_completions();
+
+	for (n = 0; n < num_touched; n++) {
+	    struct client *c = touched[n];
+
+	    c->touched = 0;
+	    if (maybe_close(c) == 0)
+		events_update(c);
+	}
+	num_touched = 0;
     }
 }
 
+#endif
 #endif
 
 static int
@@ -1365,6 +1744,25 @@ heim_sipc_set_timeout_handler(void (*func)(void))
 #endif
 }
 
+/**
+ * Run the service callbacks on `n' worker threads instead of the thread
+ * running heim_ipc_main(), so that a slow call does not hold up other
+ * clients.  The callbacks must then be thread-safe.  Call this before
+ * heim_ipc_main().
+ */
+
+int
+heim_sipc_set_threads(int n)
+{
+#if defined(HAVE_GCD)
+    return 0;
+#elif defined(ENABLE_PTHREAD_SUPPORT)
+    num_threads = n > 0 ? n : 0;
+    return 0;
+#else
+    return n > 0 ? ENOTSUP : 0;
+#endif
+}
 
 void
 heim_sipc_free_context(heim_sipc ctx)
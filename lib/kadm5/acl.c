@@ -69,6 +69,216 @@ _kadm5_privs_to_string(uint32_t privs, char *string, size_t len)
     return 0;
 }
 
+/*
+ * The ACL file is parsed once into a compiled ACL, which is shared by
+ * all the server contexts in the process and parsed again when the
+ * file changes.  Its rules are sorted by caller so that a check only
+ * looks at the caller's own rules, in the order of the file, with
+ * their target patterns already parsed.
+ *
+ * Errors are as when the file was read line by line for every check:
+ * a line that fails to parse is only an error for the checks that get
+ * that far in the file without finding a matching rule.
+ */
+
+struct acl_rule {
+    char *caller;		/* unparsed caller principal */
+    size_t line;
+    krb5_error_code ret;	/* error parsing the privs */
+    unsigned flags;
+    krb5_error_code pattern_ret; /* error parsing the pattern */
+    krb5_principal pattern;	/* NULL for any target */
+};
+
+struct acl {
+    char *file;
+    struct stat st;
+    size_t bad_line;		/* first line with a bad caller */
+    krb5_error_code bad_ret;	/* and its error, or 0 */
+    size_t nrules;
+    struct acl_rule *rules;
+};
+
+static HEIMDAL_MUTEX acl_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct acl *acl_cache;
+
+static void
+acl_free(krb5_context context, struct acl *acl)
+{
+    size_t i;
+
+    if (acl == NULL)
+	return;
+    for (i = 0; i < acl->nrules; i++) {
+	free(acl->rules[i].caller);
+	krb5_free_principal(context, acl->rules[i].pattern);
+    }
+    free(acl->rules);
+    free(acl->file);
+    free(acl);
+}
+
+static int
+acl_rule_cmp(const void *a, const void *b)
+{
+    const struct acl_rule *ra = a, *rb = b;
+    int c = strcmp(ra->caller, rb->caller);
+
+    if (c)
+	return c;
+    return ra->line < rb->line ? -1 : ra->line > rb->line;
+}
+
+/* Parse one line of the ACL file into `rule', returns FALSE to skip it */
+static krb5_boolean
+acl_parse_line(krb5_context context, char *buf, size_t line,
+	       struct acl *acl, struct acl_rule *rule)
+{
+    char *foo = NULL, *p, *caller;
+    krb5_principal princ;
+    krb5_error_code ret;
+    uint32_t flags;
+
+    memset(rule, 0, sizeof(*rule));
+    rule->line = line;
+
+    p = strtok_r(buf, " \t\n", &foo);
+    if (p == NULL || *p == '#')
+	return FALSE;
+    ret = krb5_parse_name(context, p, &princ);
+    if (ret == 0) {
+	ret = krb5_unparse_name(context, princ, &caller);
+	krb5_free_principal(context, princ);
+    }
+    if (ret) {
+	if (acl->bad_ret == 0) {
+	    acl->bad_ret = ret;
+	    acl->bad_line = line;
+	}
+	return FALSE;
+    }
+
+    p = strtok_r(NULL, " \t\n", &foo);
+    if (p == NULL) {
+	free(caller);
+	return FALSE;
+    }
+    rule->caller = caller;
+    rule->ret = _kadm5_string_to_privs(p, &flags);
+    rule->flags = flags;
+    if (rule->ret)
+	return TRUE;
+
+    p = strtok_r(NULL, " \t\n", &foo);
+    if (p && (rule->pattern_ret = krb5_parse_name(context, p,
+						  &rule->pattern)))
+	rule->pattern = NULL;
+    return TRUE;
+}
+
+static kadm5_ret_t
+acl_load(kadm5_server_context *context, FILE *f, const struct stat *st,
+	 struct acl **out)
+{
+    struct acl_rule *tmp;
+    struct acl *acl;
+    size_t line = 0, alloced = 0;
+    char buf[256];
+
+    *out = NULL;
+    if ((acl = calloc(1, sizeof(*acl))) == NULL ||
+	(acl->file = strdup(context->config.acl_file)) == NULL) {
+	free(acl);
+	return krb5_enomem(context->context);
+    }
+    acl->st = *st;
+
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+	if (acl->nrules == alloced) {
+	    alloced = alloced ? alloced * 2 : 64;
+	    tmp = realloc(acl->rules, alloced * sizeof(*tmp));
+	    if (tmp == NULL) {
+		acl_free(context->context, acl);
+		return krb5_enomem(context->context);
+	    }
+	    acl->rules = tmp;
+	}
+	if (acl_parse_line(context->context, buf, line++, acl,
+			   &acl->rules[acl->nrules]))
+	    acl->nrules++;
+    }
+    if (acl->nrules)
+	qsort(acl->rules, acl->nrules, sizeof(acl->rules[0]), acl_rule_cmp);
+    *out = acl;
+    return 0;
+}
+
+/* The first rule of `caller', or NULL */
+static const struct acl_rule *
+acl_find_caller(const struct acl *acl, const char *caller)
+{
+    size_t lo = 0, hi = acl->nrules, mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (strcmp(acl->rules[mid].caller, caller) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo < acl->nrules && strcmp(acl->rules[lo].caller, caller) == 0)
+	return &acl->rules[lo];
+    return NULL;
+}
+
+static kadm5_ret_t
+acl_check(kadm5_server_context *context, const struct acl *acl,
+	  const char *caller, krb5_const_principal princ,
+	  unsigned *ret_flags)
+{
+    const struct acl_rule *r, *end = acl->rules + acl->nrules;
+
+    r = acl_find_caller(acl, caller);
+    for (; r && r < end && strcmp(r->caller, caller) == 0; r++) {
+	krb5_boolean match;
+	const char *c0, *pat_c0;
+
+	if (acl->bad_ret && r->line > acl->bad_line)
+	    break;
+	if (r->ret)
+	    return r->ret;
+	if (r->pattern == NULL && r->pattern_ret == 0) {
+	    *ret_flags = r->flags;
+	    return 0;
+	}
+	if (princ == NULL)
+	    continue;
+	if (r->pattern_ret)
+	    return r->pattern_ret;
+
+	c0 = krb5_principal_get_comp_string(context->context, princ, 0);
+	pat_c0 = krb5_principal_get_comp_string(context->context,
+						r->pattern, 0);
+	match = krb5_principal_match(context->context, princ, r->pattern);
+
+	/*
+	 * If `princ' is a WELLKNOWN name, then require the WELLKNOWN label
+	 * be matched exactly.
+	 *
+	 * FIXME: We could do something similar for krbtgt and kadmin other
+	 *        principal types.
+	 */
+	if (match && c0 && strcmp(c0, "WELLKNOWN") == 0 &&
+	    (!pat_c0 || strcmp(pat_c0, "WELLKNOWN") != 0))
+	    match = FALSE;
+	if (match) {
+	    *ret_flags = r->flags;
+	    return 0;
+	}
+    }
+    return acl->bad_ret;
+}
+
 /*
  * retrieve the right for the current caller on `princ' (NULL means all)
  * and store them in `ret_flags'
@@ -80,80 +290,50 @@ fetch_acl (kadm5_server_context *context,
 	   krb5_const_principal princ,
 	   unsigned *ret_flags)
 {
-    FILE *f;
     krb5_error_code ret = 0;
-    char buf[256];
+    struct acl *acl;
+    struct stat st;
+    char *caller;
+    FILE *f;
 
     *ret_flags = 0;
 
     /* no acl file -> no rights */
-    f = fopen(context->config.acl_file, "r");
-    if (f == NULL)
+    if (stat(context->config.acl_file, &st) != 0)
 	return 0;
 
-    while(fgets(buf, sizeof(buf), f) != NULL) {
-	char *foo = NULL, *p;
-	krb5_principal this_princ;
-	unsigned flags = 0;
+    ret = krb5_unparse_name(context->context, context->caller, &caller);
+    if (ret)
+	return ret;
 
-	p = strtok_r(buf, " \t\n", &foo);
-	if(p == NULL)
-	    continue;
-	if (*p == '#')		/* comment */
-	    continue;
-	ret = krb5_parse_name(context->context, p, &this_princ);
-	if(ret)
-	    break;
-	if(!krb5_principal_compare(context->context,
-				   context->caller, this_princ)) {
-	    krb5_free_principal(context->context, this_princ);
-	    continue;
+    HEIMDAL_MUTEX_lock(&acl_mutex);
+    acl = acl_cache;
+    if (acl == NULL ||
+	strcmp(acl->file, context->config.acl_file) != 0 ||
+	acl->st.st_dev != st.st_dev || acl->st.st_ino != st.st_ino ||
+	acl->st.st_size != st.st_size || acl->st.st_mtime != st.st_mtime) {
+	f = fopen(context->config.acl_file, "r");
+	if (f == NULL) {
+	    HEIMDAL_MUTEX_unlock(&acl_mutex);
+	    free(caller);
+	    return 0;
 	}
-	krb5_free_principal(context->context, this_princ);
-	p = strtok_r(NULL, " \t\n", &foo);
-	if(p == NULL)
-	    continue;
-	ret = _kadm5_string_to_privs(p, &flags);
-	if (ret)
-	    break;
-	p = strtok_r(NULL, " \t\n", &foo);
-	if (p == NULL) {
-	    *ret_flags = flags;
-	    break;
-	}
-	if (princ != NULL) {
-	    krb5_principal pattern_princ;
-	    krb5_boolean match;
-            const char *c0 = krb5_principal_get_comp_string(context->context,
-                                                            princ, 0);
-            const char *pat_c0;
-
-	    ret = krb5_parse_name(context->context, p, &pattern_princ);
-	    if (ret)
-		break;
-            pat_c0 = krb5_principal_get_comp_string(context->context,
-                                                    pattern_princ, 0);
-	    match = krb5_principal_match(context->context,
-					 princ, pattern_princ);
-
-            /*
-             * If `princ' is a WELLKNOWN name, then require the WELLKNOWN label
-             * be matched exactly.
-             *
-             * FIXME: We could do something similar for krbtgt and kadmin other
-             *        principal types.
-             */
-            if (match && c0 && strcmp(c0, "WELLKNOWN") == 0 &&
-                (!pat_c0 || strcmp(pat_c0, "WELLKNOWN") != 0))
-                match = FALSE;
-	    krb5_free_principal(context->context, pattern_princ);
-	    if (match) {
-		*ret_flags = flags;
-		break;
-	    }
+	if (fstat(fileno(f), &st) == 0)
+	    ret = acl_load(context, f, &st, &acl);
+	else
+	    ret = errno;
+	fclose(f);
+	if (ret) {
+	    HEIMDAL_MUTEX_unlock(&acl_mutex);
+	    free(caller);
+	    return ret;
 	}
+	acl_free(context->context, acl_cache);
+	acl_cache = acl;
     }
-    fclose(f);
+    ret = acl_check(context, acl, caller, princ, ret_flags);
+    HEIMDAL_MUTEX_unlock(&acl_mutex);
+    free(caller);
     return ret;
 }
 
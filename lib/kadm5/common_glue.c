@@ -205,6 +205,53 @@ kadm5_randkey_principal_3(void *server_handle,
 				      n_ks_tuple, ks_tuple, new_keys, n_keys));
 }
 
+/**
+ * Set random keys for many principals at once, as with
+ * kadm5_randkey_principal_3() on each.  The server commits them in
+ * batches (one transaction and log fsync per batch); remote requests
+ * are pipelined.  `cb' is called with each principal's result and new
+ * keys (which it must copy if it wants to keep them), in order, once
+ * they are committed; it must not use `server_handle'.  A non-zero
+ * return from `cb' is returned, as is any error other than those of
+ * individual principals.
+ */
+kadm5_ret_t
+kadm5_randkey_principals(void *server_handle,
+			 krb5_principal *princs,
+			 int n_princs,
+			 krb5_boolean keepold,
+			 int n_ks_tuple,
+			 krb5_key_salt_tuple *ks_tuple,
+			 int (*cb)(void *, krb5_const_principal, kadm5_ret_t,
+				   krb5_keyblock *, int),
+			 void *cbdata)
+{
+    kadm5_common_context *context = server_handle;
+    krb5_keyblock *keys;
+    int n_keys, i;
+    kadm5_ret_t ret = 0, ret2;
+
+    if (__CALLABLE(randkey_principals))
+	return __CALL(randkey_principals, (server_handle, princs, n_princs,
+					   keepold, n_ks_tuple, ks_tuple,
+					   cb, cbdata));
+    for (i = 0; ret == 0 && i < n_princs; i++) {
+	keys = NULL;
+	n_keys = 0;
+	ret2 = __CALL(randkey_principal, (server_handle, princs[i], keepold,
+					  n_ks_tuple, ks_tuple, &keys,
+					  &n_keys));
+	ret = (*cb)(cbdata, princs[i], ret2, keys, n_keys);
+	if (keys) {
+	    while (n_keys > 0)
+		krb5_free_keyblock_contents(context->context,
+					    &keys[--n_keys]);
+	    free(keys);
+	}
+    }
+    return ret;
+}
+
 kadm5_ret_t
 kadm5_rename_principal(void *server_handle,
 		       krb5_principal source,
@@ -222,6 +269,32 @@ kadm5_get_principals(void *server_handle,
     return __CALL(get_principals, (server_handle, expression, princs, count));
 }
 
+/**
+ * Call `cb' with each principal name matching `expression' (all of them
+ * if NULL) as it is found, rather than collecting them all first as
+ * kadm5_get_principals() does.  A non-zero return from `cb' stops the
+ * iteration and is returned.  `cb' must not use `server_handle'.
+ */
+kadm5_ret_t
+kadm5_iter_principals(void *server_handle,
+		      const char *expression,
+		      int (*cb)(void *, const char *),
+		      void *cbdata)
+{
+    char **princs = NULL;
+    int count = 0, i;
+    kadm5_ret_t ret;
+
+    if (__CALLABLE(iter_principals))
+	return __CALL(iter_principals, (server_handle, expression, cb, cbdata));
+    ret = __CALL(get_principals, (server_handle, expression, &princs, &count));
+    for (i = 0; ret == 0 && i < count; i++)
+	ret = (*cb)(cbdata, princs[i]);
+    if (princs)
+	kadm5_free_name_list(server_handle, princs, &count);
+    return ret;
+}
+
 kadm5_ret_t
 kadm5_get_privs(void *server_handle,
 		uint32_t *privs)
@@ -86,6 +86,8 @@ kadm5_s_unlock(void *server_handle)
     if (!context->keep_open)
 	return KADM5_NOT_LOCKED;
 
+    /* Commit any group commit before the HDB can be changed by others */
+    (void) kadm5_log_group_commit(context);
     context->keep_open = 0;
     ret = context->db->hdb_unlock(context->context, context->db);
     (void) context->db->hdb_close(context->context, context->db);
@@ -104,10 +106,12 @@ set_funcs(kadm5_server_context *c)
     SET(c, flush);
     SET(c, get_principal);
     SET(c, get_principals);
+    SET(c, iter_principals);
     SET(c, get_privs);
     SET(c, modify_principal);
     SET(c, prune_principal);
     SET(c, randkey_principal);
+    SET(c, randkey_principals);
     SET(c, rename_principal);
     SET(c, lock);
     SET(c, unlock);
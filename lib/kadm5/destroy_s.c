@@ -78,6 +78,8 @@ kadm5_s_destroy(void *server_handle)
     krb5_context kcontext = context->context;
 
     _kadm5_s_free_hooks(context);
+    if (context->db != NULL)
+        (void) kadm5_log_group_commit(context);
     if (context->db != NULL)
         ret = context->db->hdb_destroy(kcontext, context->db);
     destroy_kadm5_log_context(&context->log_context);
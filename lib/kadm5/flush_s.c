@@ -37,5 +37,5 @@ RCSID("$Id$");
 kadm5_ret_t
 kadm5_s_flush(void *server_handle)
 {
-    return 0;
+    return kadm5_log_group_commit(server_handle);
 }
@@ -117,3 +117,74 @@ kadm5_c_get_principals(void *server_handle,
     krb5_data_free(&reply);
     return ret;
 }
+
+kadm5_ret_t
+kadm5_c_iter_principals(void *server_handle,
+			const char *expression,
+			int (*cb)(void *, const char *),
+			void *cbdata)
+{
+    kadm5_client_context *context = server_handle;
+    kadm5_ret_t ret, cbret = 0;
+    krb5_storage *sp;
+    unsigned char buf[1024];
+    int32_t tmp, n;
+    krb5_data reply;
+    char *princ;
+
+    ret = _kadm5_connect(server_handle, 0 /* want_write */);
+    if (ret)
+	return ret;
+
+    krb5_data_zero(&reply);
+
+    sp = krb5_storage_from_mem(buf, sizeof(buf));
+    if (sp == NULL)
+	return krb5_enomem(context->context);
+    ret = krb5_store_int32(sp, kadm_get_princs);
+    /* Old servers take any non-zero flags to mean "expression follows" */
+    if (ret == 0)
+	ret = krb5_store_int32(sp, KADM_GET_PRINCS_EXPRESSION |
+				   KADM_GET_PRINCS_STREAM);
+    if (ret == 0)
+	ret = krb5_store_string(sp, expression ? expression : "*");
+    if (ret == 0)
+	ret = _kadm5_client_send(context, sp);
+    krb5_storage_free(sp);
+    if (ret)
+	return ret;
+
+    /*
+     * Read replies until the last one, even after `cb' fails, so that
+     * the connection stays usable.
+     */
+    for (;;) {
+	ret = _kadm5_client_recv(context, &reply);
+	if (ret)
+	    return ret;
+	sp = krb5_storage_from_data(&reply);
+	if (sp == NULL) {
+	    krb5_data_free(&reply);
+	    return krb5_enomem(context->context);
+	}
+	ret = krb5_ret_int32(sp, &tmp);
+	if (ret == 0)
+	    ret = tmp;
+	if (ret == 0)
+	    ret = krb5_ret_int32(sp, &n);
+	for (tmp = 0; ret == 0 && tmp < (n < 0 ? -n : n); tmp++) {
+	    princ = NULL;
+	    ret = krb5_ret_string(sp, &princ);
+	    if (ret == 0 && cbret == 0)
+		cbret = (*cb)(cbdata, princ);
+	    free(princ);
+	}
+	krb5_storage_free(sp);
+	krb5_data_free(&reply);
+	if (ret || n >= 0)
+	    break;
+    }
+    if (ret == 0)
+	krb5_clear_error_message(context->context);
+    return ret ? ret : cbret;
+}
@@ -38,22 +38,10 @@ RCSID("$Id$");
 struct foreach_data {
     const char *exp;
     char *exp2;
-    char **princs;
-    int count;
+    int (*cb)(void *, const char *);
+    void *cbdata;
 };
 
-static krb5_error_code
-add_princ(krb5_context context, struct foreach_data *d, char *princ)
-{
-    char **tmp;
-    tmp = realloc(d->princs, (d->count + 1) * sizeof(*tmp));
-    if (tmp == NULL)
-	return krb5_enomem(context);
-    d->princs = tmp;
-    d->princs[d->count++] = princ;
-    return 0;
-}
-
 static krb5_error_code
 foreach(krb5_context context, HDB *db, hdb_entry_ex *ent, void *data)
 {
@@ -63,24 +51,50 @@ foreach(krb5_context context, HDB *db, hdb_entry_ex *ent, void *data)
     ret = krb5_unparse_name(context, ent->entry.principal, &princ);
     if(ret)
 	return ret;
-    if(d->exp){
-	if(fnmatch(d->exp, princ, 0) == 0 || fnmatch(d->exp2, princ, 0) == 0)
-	    ret = add_princ(context, d, princ);
-	else
-	    free(princ);
-    }else{
-	ret = add_princ(context, d, princ);
-    }
-    if(ret)
-	free(princ);
+    if(d->exp == NULL || fnmatch(d->exp, princ, 0) == 0 ||
+       fnmatch(d->exp2, princ, 0) == 0)
+	ret = (*d->cb)(d->cbdata, princ);
+    free(princ);
+    return ret;
+}
+
+/*
+ * An expression without any pattern characters can only match the one
+ * principal it names (with or without the default realm), so look that
+ * up instead of scanning the whole database.  Aliases are not listed by
+ * a scan either, hence no HDB_F_CANON.
+ */
+static kadm5_ret_t
+lookup_literal(kadm5_server_context *context, struct foreach_data *d)
+{
+    krb5_principal princ = NULL;
+    hdb_entry_ex ent;
+    char *name = NULL;
+    kadm5_ret_t ret;
+
+    memset(&ent, 0, sizeof(ent));
+    ret = krb5_parse_name(context->context, d->exp, &princ);
+    if (ret == 0)
+	ret = context->db->hdb_fetch_kvno(context->context, context->db,
+					  princ, HDB_F_ADMIN_DATA, 0, &ent);
+    if (ret == 0)
+	ret = krb5_unparse_name(context->context, ent.entry.principal, &name);
+    if (ret == 0 && (strcmp(name, d->exp) == 0 || strcmp(name, d->exp2) == 0))
+	ret = (*d->cb)(d->cbdata, name);
+    if (ret == HDB_ERR_NOENTRY || ret == KRB5_PARSE_MALFORMED)
+	ret = 0;
+    free(name);
+    if (ent.entry.principal)
+	hdb_free_entry(context->context, &ent);
+    krb5_free_principal(context->context, princ);
     return ret;
 }
 
 kadm5_ret_t
-kadm5_s_get_principals(void *server_handle,
-		       const char *expression,
-		       char ***princs,
-		       int *count)
+kadm5_s_iter_principals(void *server_handle,
+			const char *expression,
+			int (*cb)(void *, const char *),
+			void *cbdata)
 {
     struct foreach_data d;
     kadm5_server_context *context = server_handle;
@@ -94,7 +108,10 @@ kadm5_s_get_principals(void *server_handle,
 	}
     }
     d.exp = expression;
-    {
+    d.exp2 = NULL;
+    d.cb = cb;
+    d.cbdata = cbdata;
+    if (expression) {
 	krb5_realm r;
 	int aret;
 
@@ -106,20 +123,59 @@ kadm5_s_get_principals(void *server_handle,
             goto out;
 	}
     }
-    d.princs = NULL;
-    d.count = 0;
-    ret = hdb_foreach(context->context, context->db, HDB_F_ADMIN_DATA, foreach, &d);
-
-    if (ret == 0)
-	ret = add_princ(context->context, &d, NULL);
-    if (ret == 0){
-	*princs = d.princs;
-	*count = d.count - 1;
-    } else
-	kadm5_free_name_list(context, d.princs, &d.count);
+    if (expression && strpbrk(expression, "*?[\\") == NULL)
+	ret = lookup_literal(context, &d);
+    else
+	ret = hdb_foreach(context->context, context->db, HDB_F_ADMIN_DATA,
+			  foreach, &d);
     free(d.exp2);
  out:
     if (!context->keep_open)
 	context->db->hdb_close(context->context, context->db);
     return _kadm5_error_code(ret);
 }
+
+struct princ_list {
+    char **princs;
+    int count;
+};
+
+static int
+add_princ(void *data, const char *princ)
+{
+    struct princ_list *l = data;
+    char **tmp;
+
+    tmp = realloc(l->princs, (l->count + 2) * sizeof(*tmp));
+    if (tmp == NULL)
+	return ENOMEM;
+    l->princs = tmp;
+    if ((l->princs[l->count] = strdup(princ)) == NULL)
+	return ENOMEM;
+    l->princs[++l->count] = NULL;
+    return 0;
+}
+
+kadm5_ret_t
+kadm5_s_get_principals(void *server_handle,
+		       const char *expression,
+		       char ***princs,
+		       int *count)
+{
+    kadm5_server_context *context = server_handle;
+    struct princ_list l;
+    kadm5_ret_t ret;
+
+    l.princs = NULL;
+    l.count = 0;
+    ret = kadm5_s_iter_principals(server_handle, expression, add_princ, &l);
+    if (ret == 0 && l.princs == NULL &&
+	(l.princs = calloc(1, sizeof(l.princs[0]))) == NULL)
+	ret = krb5_enomem(context->context);
+    if (ret == 0) {
+	*princs = l.princs;
+	*count = l.count;
+    } else
+	kadm5_free_name_list(context, l.princs, &l.count);
+    return ret;
+}
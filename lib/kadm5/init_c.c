@@ -70,10 +70,12 @@ set_funcs(kadm5_client_context *c)
     SET(c, flush);
     SET(c, get_principal);
     SET(c, get_principals);
+    SET(c, iter_principals);
     SET(c, get_privs);
     SET(c, modify_principal);
     SET(c, prune_principal);
     SET(c, randkey_principal);
+    SET(c, randkey_principals);
     SET(c, rename_principal);
     SET(c, lock);
     SET(c, unlock);
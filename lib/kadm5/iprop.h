@@ -62,9 +62,18 @@ enum iprop_cmd { I_HAVE = 1,
 		 NOW_YOU_HAVE = 5,
 		 ARE_YOU_THERE = 6,
 		 I_AM_HERE = 7,
-		 YOU_HAVE_LAST_VERSION = 8
+		 YOU_HAVE_LAST_VERSION = 8,
+		 MANY_PRINCS = 9
 };
 
+/*
+ * Capabilities a slave may send after the version in I_HAVE (older
+ * masters ignore them).  MANY_PRINCS messages carry a sequence of the
+ * entries of ONE_PRINC messages, and are only sent to slaves that say
+ * they can take them.
+ */
+#define IPROP_CAP_MANY_PRINCS	0x1
+
 extern sig_atomic_t exit_flag;
 void setup_signal(void);
 
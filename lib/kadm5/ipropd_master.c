@@ -137,6 +137,7 @@ struct slave {
 #define SLAVE_F_DEAD	0x1
 #define SLAVE_F_AYT	0x2
 #define SLAVE_F_READY   0x4
+#define SLAVE_F_MANY_PRINCS 0x8 /* takes MANY_PRINCS */
     /*
      * We'll use non-blocking I/O so no slave can hold us back.
      *
@@ -170,11 +171,235 @@ struct slave {
         uint32_t    last_version_sent;
         int         more;               /* need to send more diffs */
     } next_diff;
+    int events;                         /* EVENT_* we're waiting for */
+    int ready;                          /* EVENT_* ready, see events_wait() */
     struct slave *next;
 };
 
 typedef struct slave slave;
 
+/*
+ * Readiness notification for the main loop.  As in the KDC we use
+ * epoll(7) on Linux and kqueue(2) on the BSDs and macOS, and fall back to
+ * select() (limited to FD_SETSIZE) elsewhere or if those fail, so that
+ * the number of slaves is not limited by FD_SETSIZE and waiting costs
+ * little however many of them are idle.
+ *
+ * Each socket is registered with an int into which events_wait() ORs the
+ * EVENT_* flags of its ready events.  Only slaves with output pending are
+ * watched for writability.
+ */
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#include <sys/epoll.h>
+#define IPROP_EVENTS_EPOLL 1
+#elif defined(HAVE_SYS_EVENT_H) && defined(HAVE_KQUEUE)
+#include <sys/event.h>
+#define IPROP_EVENTS_KQUEUE 1
+#endif
+
+#define EVENT_READ      0x1
+#define EVENT_WRITE     0x2
+#define EVENT_MAX_READY 64
+
+struct event_reg {
+    krb5_socket_t s;
+    int want;
+    int *readyp;
+};
+
+static struct {
+    int fd;                     /* epoll/kqueue descriptor, -1 for select() */
+    struct event_reg *regs;     /* registered sockets, select() only */
+    size_t nregs;
+    size_t sregs;
+} events = { -1, NULL, 0, 0 };
+
+static void
+events_init(krb5_context context)
+{
+#if defined(IPROP_EVENTS_EPOLL)
+    events.fd = epoll_create1(EPOLL_CLOEXEC);
+    if (events.fd == -1)
+        krb5_warn(context, errno, "epoll_create1, falling back to select");
+#elif defined(IPROP_EVENTS_KQUEUE)
+    events.fd = kqueue();
+    if (events.fd == -1)
+        krb5_warn(context, errno, "kqueue, falling back to select");
+    else
+        rk_cloexec(events.fd);
+#endif
+}
+
+/*
+ * Change the events we wait for on `s' from `old' to `want', either of
+ * which may be 0 to add or remove `s'.  Sockets must be removed before
+ * they are closed.
+ */
+static int
+events_set(krb5_context context, krb5_socket_t s, int *readyp,
+           int old, int want)
+{
+    struct event_reg *tmp;
+    size_t i;
+
+    if (old == want)
+        return 0;
+
+#if defined(IPROP_EVENTS_EPOLL)
+    if (events.fd != -1) {
+        struct epoll_event ev;
+        int op = old == 0 ? EPOLL_CTL_ADD :
+                 want == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+
+        memset(&ev, 0, sizeof(ev));
+        if (want & EVENT_READ)
+            ev.events |= EPOLLIN;
+        if (want & EVENT_WRITE)
+            ev.events |= EPOLLOUT;
+        ev.data.ptr = readyp;
+        if (epoll_ctl(events.fd, op, s, &ev) == -1) {
+            krb5_warn(context, errno, "epoll_ctl");
+            return -1;
+        }
+        return 0;
+    }
+#elif defined(IPROP_EVENTS_KQUEUE)
+    if (events.fd != -1) {
+        struct kevent kev[2];
+        int n = 0;
+
+        if ((old ^ want) & EVENT_READ)
+            EV_SET(&kev[n++], s, EVFILT_READ,
+                   (want & EVENT_READ) ? EV_ADD : EV_DELETE, 0, 0, readyp);
+        if ((old ^ want) & EVENT_WRITE)
+            EV_SET(&kev[n++], s, EVFILT_WRITE,
+                   (want & EVENT_WRITE) ? EV_ADD : EV_DELETE, 0, 0, readyp);
+        if (kevent(events.fd, kev, n, NULL, 0, NULL) == -1) {
+            krb5_warn(context, errno, "kevent");
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
+    for (i = 0; i < events.nregs; i++)
+        if (events.regs[i].s == s)
+            break;
+    if (want == 0) {
+        if (i < events.nregs)
+            events.regs[i] = events.regs[--events.nregs];
+        return 0;
+    }
+    if (i == events.nregs) {
+#if !defined(NO_LIMIT_FD_SETSIZE) && defined(FD_SETSIZE)
+        if (s >= FD_SETSIZE) {
+            krb5_warnx(context, "socket FD too large");
+            return -1;
+        }
+#endif
+        if (events.nregs == events.sregs) {
+            tmp = realloc(events.regs, (events.sregs + 16) * sizeof(*tmp));
+            if (tmp == NULL) {
+                krb5_warnx(context, "No memory");
+                return -1;
+            }
+            events.regs = tmp;
+            events.sregs += 16;
+        }
+        events.nregs++;
+    }
+    events.regs[i].s = s;
+    events.regs[i].want = want;
+    events.regs[i].readyp = readyp;
+    return 0;
+}
+
+/*
+ * Wait up to `timeout' seconds for events, flagging the ready ones.
+ * Returns the number of sockets with events ready, 0 on timeout, or -1
+ * on error.
+ */
+static int
+events_wait(int timeout)
+{
+    fd_set readset, writeset;
+    struct timeval to;
+    int max_fd = 0;
+    int n = 0;
+    size_t i;
+
+#if defined(IPROP_EVENTS_EPOLL)
+    if (events.fd != -1) {
+        struct epoll_event evs[EVENT_MAX_READY];
+        int ret;
+
+        ret = epoll_wait(events.fd, evs, EVENT_MAX_READY, timeout * 1000);
+        for (n = 0; n < ret; n++) {
+            int *readyp = evs[n].data.ptr;
+
+            /* Errors and hangups are for the reader to find */
+            if (evs[n].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                *readyp |= EVENT_READ;
+            if (evs[n].events & EPOLLOUT)
+                *readyp |= EVENT_WRITE;
+        }
+        return ret;
+    }
+#elif defined(IPROP_EVENTS_KQUEUE)
+    if (events.fd != -1) {
+        struct kevent kevs[EVENT_MAX_READY];
+        struct timespec ts;
+        int ret;
+
+        ts.tv_sec = timeout;
+        ts.tv_nsec = 0;
+        ret = kevent(events.fd, NULL, 0, kevs, EVENT_MAX_READY, &ts);
+        for (n = 0; n < ret; n++) {
+            int *readyp = kevs[n].udata;
+
+            *readyp |= kevs[n].filter == EVFILT_WRITE ? EVENT_WRITE :
+                                                        EVENT_READ;
+        }
+        return ret;
+    }
+#endif
+
+    FD_ZERO(&readset);
+    FD_ZERO(&writeset);
+    for (i = 0; i < events.nregs; i++) {
+        if (max_fd < (int)events.regs[i].s)
+            max_fd = events.regs[i].s;
+        if (events.regs[i].want & EVENT_READ)
+            FD_SET(events.regs[i].s, &readset);
+        if (events.regs[i].want & EVENT_WRITE)
+            FD_SET(events.regs[i].s, &writeset);
+    }
+
+    to.tv_sec = timeout;
+    to.tv_usec = 0;
+    switch (select(max_fd + 1, &readset, &writeset, NULL, &to)) {
+    case -1:
+        return -1;
+    case 0:
+        return 0;
+    default:
+        break;
+    }
+    for (i = 0; i < events.nregs; i++) {
+        int ready = 0;
+
+        if (FD_ISSET(events.regs[i].s, &readset))
+            ready |= EVENT_READ;
+        if (FD_ISSET(events.regs[i].s, &writeset))
+            ready |= EVENT_WRITE;
+        if (ready) {
+            *events.regs[i].readyp |= ready;
+            n++;
+        }
+    }
+    return n;
+}
+
 static int
 check_acl (krb5_context context, const char *name)
 {
@@ -239,6 +464,8 @@ slave_dead(krb5_context context, slave *s)
     krb5_warnx(context, "slave %s dead", s->name);
 
     if (!rk_IS_BAD_SOCKET(s->fd)) {
+        (void) events_set(context, s->fd, &s->ready, s->events, 0);
+        s->events = 0;
 	rk_closesocket (s->fd);
 	s->fd = rk_INVALID_SOCKET;
     }
@@ -251,8 +478,10 @@ remove_slave (krb5_context context, slave *s, slave **root)
 {
     slave **p;
 
-    if (!rk_IS_BAD_SOCKET(s->fd))
+    if (!rk_IS_BAD_SOCKET(s->fd)) {
+        (void) events_set(context, s->fd, &s->ready, s->events, 0);
 	rk_closesocket (s->fd);
+    }
     if (s->name)
 	free (s->name);
     if (s->ac)
@@ -560,6 +789,68 @@ more_diffs(slave *s)
 
 #define SEND_COMPLETE_MAX_RECORDS 50
 #define SEND_DIFFS_MAX_RECORDS 50
+#define SEND_COMPLETE_MAX_BATCH (64 * 1024)
+
+/*
+ * Read the next message to send from the dump.  For slaves that can take
+ * them, runs of ONE_PRINC records are sent as MANY_PRINCS messages of
+ * about SEND_COMPLETE_MAX_BATCH bytes, saving a KRB-PRIV (and its
+ * encryption, framing and write) per principal.
+ */
+static krb5_error_code
+read_dump_message(krb5_context context, slave *s, krb5_data *data)
+{
+    krb5_error_code ret;
+    krb5_storage *batch = NULL;
+    krb5_data rec, value;
+    unsigned char *p;
+    off_t off;
+
+    for (;;) {
+        if ((off = krb5_storage_seek(s->tail.dump, 0, SEEK_CUR)) == -1)
+            return errno;
+        ret = krb5_ret_data(s->tail.dump, &rec);
+        if (ret)
+            break;
+        p = rec.data;
+        if (!(s->flags & SLAVE_F_MANY_PRINCS) || rec.length < 4 ||
+            (((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]) !=
+            ONE_PRINC) {
+            if (batch == NULL) {
+                *data = rec;
+                return 0;
+            }
+            /* Send this one after the batch */
+            krb5_data_free(&rec);
+            if (krb5_storage_seek(s->tail.dump, off, SEEK_SET) != off)
+                ret = errno;
+            break;
+        }
+        if (batch == NULL) {
+            batch = krb5_storage_emem();
+            if (batch == NULL) {
+                krb5_data_free(&rec);
+                return krb5_enomem(context);
+            }
+            ret = krb5_store_uint32(batch, MANY_PRINCS);
+        }
+        value.data = p + 4;
+        value.length = rec.length - 4;
+        if (ret == 0)
+            ret = krb5_store_data(batch, value);
+        krb5_data_free(&rec);
+        if (ret ||
+            krb5_storage_seek(batch, 0, SEEK_CUR) >= SEND_COMPLETE_MAX_BATCH)
+            break;
+    }
+
+    if (batch == NULL)
+        return ret;
+    if (ret == 0 || ret == HEIM_ERR_EOF)
+        ret = krb5_storage_steal_data(batch, data);
+    krb5_storage_free(batch);
+    return ret;
+}
 
 static int
 send_tail(krb5_context context, slave *s)
@@ -621,7 +912,7 @@ send_tail(krb5_context context, slave *s)
          * We're in the middle of a send_complete() that was interrupted by
          * EWOULDBLOCK.  Continue the sending of the dump.
          */
-        ret = krb5_ret_data(s->tail.dump, &data);
+        ret = read_dump_message(context, s, &data);
         if (ret == HEIM_ERR_EOF) {
             krb5_storage_free(s->tail.dump);
             s->tail.dump = NULL;
@@ -951,6 +1242,187 @@ get_first(kadm5_server_context *server_context, int log_fd,
     return 0;
 }
 
+/*
+ * Index of the offsets of the confirmed records in the log, by version, so
+ * that finding where to start sending diffs to a slave that is far behind
+ * doesn't take a walk backwards through the whole log.
+ *
+ * The log's records have consecutive versions, so offs[i] is the offset of
+ * the record with version first + i.  The index is extended as the log
+ * grows, and is rebuilt when the log is truncated or reinitialized, which
+ * we notice from a change in the log's initial version and timestamp.
+ */
+static struct {
+    uint32_t    initial_version;    /* of the log when indexed */
+    uint32_t    initial_tstamp;     /* of the log when indexed */
+    uint32_t    first;              /* version of offs[0] */
+    size_t      n;                  /* number of records indexed */
+    size_t      alloced;
+    off_t       *offs;
+    off_t       end;                /* end of the last record indexed */
+} log_index;
+
+/*
+ * A copy of the tail of the log, up to the end of the index, shared by all
+ * the slaves: with many slaves catching up on the same recent records we
+ * read them from the log once and then send them from here.  Only the
+ * KRB-PRIV encryption is per-slave.
+ */
+#define LOG_TAIL_MAX (4 * 1024 * 1024)
+
+static struct {
+    off_t           off;            /* log offset of buf[0] */
+    size_t          len;
+    size_t          alloced;
+    unsigned char   *buf;
+} log_tail;
+
+static void
+log_index_reset(uint32_t initial_version, uint32_t initial_tstamp)
+{
+    log_index.initial_version = initial_version;
+    log_index.initial_tstamp = initial_tstamp;
+    log_index.first = 0;
+    log_index.n = 0;
+    log_index.end = 0;
+    log_tail.off = 0;
+    log_tail.len = 0;
+}
+
+/*
+ * Append the log's bytes from `start' to `end' to the tail cache, dropping
+ * its oldest bytes to stay under LOG_TAIL_MAX.  Failure to cache is not an
+ * error; we'll just read from the log.
+ */
+static void
+log_tail_append(krb5_storage *sp, off_t start, off_t end)
+{
+    size_t n = end - start;
+    krb5_ssize_t bytes;
+
+    if (log_tail.len == 0 || log_tail.off + (off_t)log_tail.len != start) {
+        log_tail.off = start;
+        log_tail.len = 0;
+    }
+    if (n > LOG_TAIL_MAX) {
+        log_tail.off = end;
+        log_tail.len = 0;
+        return;
+    }
+    if (log_tail.len + n > LOG_TAIL_MAX) {
+        size_t drop = log_tail.len + n - LOG_TAIL_MAX;
+
+        memmove(log_tail.buf, log_tail.buf + drop, log_tail.len - drop);
+        log_tail.off += drop;
+        log_tail.len -= drop;
+    }
+    if (log_tail.len + n > log_tail.alloced) {
+        unsigned char *tmp = realloc(log_tail.buf, LOG_TAIL_MAX);
+
+        if (tmp == NULL) {
+            log_tail.len = 0;
+            return;
+        }
+        log_tail.buf = tmp;
+        log_tail.alloced = LOG_TAIL_MAX;
+    }
+    if (krb5_storage_seek(sp, start, SEEK_SET) != start ||
+        (bytes = krb5_storage_read(sp, log_tail.buf + log_tail.len, n)) < 0 ||
+        (size_t)bytes != n) {
+        log_tail.len = 0;
+        return;
+    }
+    log_tail.len += n;
+}
+
+/*
+ * Copy the log's bytes from `start' to `end' from the tail cache into
+ * `buf', if they're there.
+ */
+static int
+log_tail_get(off_t start, off_t end, void *buf)
+{
+    if (start < log_tail.off || end > log_tail.off + (off_t)log_tail.len)
+        return 0;
+    memcpy(buf, log_tail.buf + (start - log_tail.off), end - start);
+    return 1;
+}
+
+/*
+ * Index the records between the end of the index and the end of the
+ * confirmed records of the log, at `pos'.  Must be called with the log
+ * read-locked.  Leaves sp's offset undefined.
+ */
+static int
+log_index_update(kadm5_server_context *server_context, krb5_storage *sp,
+                 uint32_t initial_version, uint32_t initial_tstamp, off_t pos)
+{
+    krb5_context context = server_context->context;
+    uint32_t ver;
+    off_t start, off;
+    int ret;
+
+    if (log_index.initial_version != initial_version ||
+        log_index.initial_tstamp != initial_tstamp ||
+        log_index.end > pos)
+        log_index_reset(initial_version, initial_tstamp);
+
+    if (log_index.end == 0) {
+        ret = kadm5_log_goto_first(server_context, sp);
+        if (ret)
+            return ret;
+        if ((off = krb5_storage_seek(sp, 0, SEEK_CUR)) < 0)
+            return errno;
+        log_index.end = off;
+    } else if (krb5_storage_seek(sp, log_index.end, SEEK_SET) !=
+               log_index.end) {
+        return errno ? errno : EIO;
+    }
+
+    start = log_index.end;
+    while ((off = log_index.end) < pos) {
+        ret = kadm5_log_next(context, sp, &ver, NULL, NULL, NULL);
+        if (ret)
+            return ret;
+        if (log_index.n > 0 && ver != log_index.first + log_index.n) {
+            /* Not consecutive; index only from here on */
+            log_index.n = 0;
+        }
+        if (log_index.n == 0)
+            log_index.first = ver;
+        if (log_index.n == log_index.alloced) {
+            size_t n = log_index.alloced ? log_index.alloced * 2 : 1024;
+            off_t *tmp = realloc(log_index.offs, n * sizeof(tmp[0]));
+
+            if (tmp == NULL)
+                return krb5_enomem(context);
+            log_index.offs = tmp;
+            log_index.alloced = n;
+        }
+        log_index.offs[log_index.n++] = off;
+        if ((log_index.end = krb5_storage_seek(sp, 0, SEEK_CUR)) < 0) {
+            log_index_reset(initial_version, initial_tstamp);
+            return errno;
+        }
+    }
+    if (log_index.end > start)
+        log_tail_append(sp, start, log_index.end);
+    return 0;
+}
+
+/*
+ * Return the offset of the record with version `ver', or 0 if it is not
+ * indexed.
+ */
+static off_t
+log_index_lookup(uint32_t ver)
+{
+    if (log_index.n == 0 || ver < log_index.first ||
+        ver - log_index.first >= log_index.n)
+        return 0;
+    return log_index.offs[ver - log_index.first];
+}
+
 /*-
  * Find the left end of the diffs in the log we want to send.
  *
@@ -991,6 +1463,12 @@ get_left(kadm5_server_context *server_context, slave *s, krb5_storage *sp,
             (pos = krb5_storage_seek(sp, 0, SEEK_CUR)) < 0)
             goto err;
 
+        /* Index (and cache) any records added since we last looked */
+        ret = log_index_update(server_context, sp, *initial_verp,
+                               *initial_timep, pos);
+        if (ret)
+            krb5_warn(context, ret, "could not index the iprop log");
+
         /*
          * First try to see if we can find it quickly by seeking to the right
          * end of the previous diff sent.
@@ -1012,6 +1490,22 @@ get_left(kadm5_server_context *server_context, slave *s, krb5_storage *sp,
                 return left;
         }
 
+        /* Next try the index */
+        if (ret == 0 && (left = log_index_lookup(s->version + 1)) > 0) {
+            if (krb5_storage_seek(sp, left, SEEK_SET) != left)
+                goto err;
+            if (kadm5_log_next(context, sp, &ver, NULL, NULL, NULL) == 0 &&
+                ver == s->version + 1) {
+                s->next_diff.last_version_sent = s->version;
+                s->next_diff.off_next_version = left;
+                s->next_diff.initial_version = *initial_verp;
+                s->next_diff.initial_tstamp = *initial_timep;
+                return left;
+            }
+            /* The log changed under the index; rebuild it next time */
+            log_index_reset(0, 0);
+        }
+
         if (krb5_storage_seek(sp, pos, SEEK_SET) != pos)
             goto err;
 
@@ -1081,8 +1575,27 @@ get_right(krb5_context context, int log_fd, krb5_storage *sp,
     int ret = 0;
     int i = 0;
     uint32_t ver = s->version;
-    off_t right = krb5_storage_seek(sp, left, SEEK_SET);
+    off_t right;
+
+    /* Use the index if it has the slave's next version at `left' */
+    if (lastver > 0 && (uint32_t)lastver > ver &&
+        log_index_lookup(ver + 1) == left) {
+        uint32_t n = (uint32_t)lastver - ver;
+
+        if (n > SEND_DIFFS_MAX_RECORDS)
+            n = SEND_DIFFS_MAX_RECORDS;
+        ver += n;
+        right = log_index_lookup(ver + 1);
+        if (right == 0 && ver == log_index.first + log_index.n - 1)
+            right = log_index.end;
+        if (right > left) {
+            *verp = ver;
+            return right;
+        }
+        ver = s->version;
+    }
 
+    right = krb5_storage_seek(sp, left, SEEK_SET);
     if (right <= 0) {
         flock(log_fd, LOCK_UN);
         return -1;
@@ -1166,15 +1679,6 @@ send_diffs(kadm5_server_context *server_context, slave *s, int log_fd,
         return;
     }
 
-    if (krb5_storage_seek(sp, left, SEEK_SET) != left) {
-        ret = errno ? errno : EIO;
-        flock(log_fd, LOCK_UN);
-        krb5_warn(context, ret, "send_diffs: krb5_storage_seek");
-        krb5_storage_free(sp);
-        slave_dead(context, s);
-        return;
-    }
-
     ret = krb5_data_alloc(&data, right - left + 4);
     if (ret) {
         flock(log_fd, LOCK_UN);
@@ -1184,11 +1688,27 @@ send_diffs(kadm5_server_context *server_context, slave *s, int log_fd,
         return;
     }
 
-    bytes = krb5_storage_read(sp, (char *)data.data + 4, data.length - 4);
-    flock(log_fd, LOCK_UN);
-    krb5_storage_free(sp);
-    if (bytes != data.length - 4)
-        krb5_errx(context, IPROPD_RESTART, "locked log truncated???");
+    if (log_tail_get(left, right, (char *)data.data + 4)) {
+        flock(log_fd, LOCK_UN);
+        krb5_storage_free(sp);
+    } else {
+        if (krb5_storage_seek(sp, left, SEEK_SET) != left) {
+            ret = errno ? errno : EIO;
+            flock(log_fd, LOCK_UN);
+            krb5_warn(context, ret, "send_diffs: krb5_storage_seek");
+            krb5_data_free(&data);
+            krb5_storage_free(sp);
+            slave_dead(context, s);
+            return;
+        }
+
+        bytes = krb5_storage_read(sp, (char *)data.data + 4,
+                                  data.length - 4);
+        flock(log_fd, LOCK_UN);
+        krb5_storage_free(sp);
+        if (bytes != data.length - 4)
+            krb5_errx(context, IPROPD_RESTART, "locked log truncated???");
+    }
 
     sp = krb5_storage_from_data(&data);
     if (sp == NULL) {
@@ -1304,7 +1824,7 @@ process_msg(kadm5_server_context *server_context, slave *s, int log_fd,
     int ret = 0;
     krb5_data out;
     krb5_storage *sp;
-    uint32_t tmp;
+    uint32_t tmp, caps;
 
     ret = read_msg(context, s, &out);
     if (ret) {
@@ -1331,6 +1851,10 @@ process_msg(kadm5_server_context *server_context, slave *s, int log_fd,
 	    krb5_warnx(context, "process_msg: client send too little I_HAVE data");
 	    break;
 	}
+        /* Newer slaves follow the version with their capabilities */
+        if (krb5_ret_uint32(sp, &caps) == 0 &&
+            (caps & IPROP_CAP_MANY_PRINCS))
+            s->flags |= SLAVE_F_MANY_PRINCS;
         /*
          * XXX Make the slave send the timestamp as well, and try to get it
          * here, and pass it to send_diffs().
@@ -1563,6 +2087,7 @@ main(int argc, char **argv)
     int aret;
     int optidx = 0;
     int restarter_fd = -1;
+    int signal_ready, listen_ready, restarter_ready;
     struct stat st;
 
     setprogname(argv[0]);
@@ -1664,46 +2189,39 @@ main(int argc, char **argv)
     roken_detach_finish(NULL, daemon_child);
     restarter_fd = restarter(context, NULL);
 
+    events_init(context);
+    if (events_set(context, signal_fd, &signal_ready, 0, EVENT_READ) ||
+        events_set(context, listen_fd, &listen_ready, 0, EVENT_READ) ||
+        (restarter_fd > -1 &&
+         events_set(context, restarter_fd, &restarter_ready, 0, EVENT_READ)))
+        krb5_errx (context, IPROPD_RESTART, "could not wait for events");
+
     while (exit_flag == 0){
 	slave *p;
-	fd_set readset, writeset;
-	int max_fd = 0;
-	struct timeval to = {30, 0};
 	uint32_t vers;
         struct stat st2;;
 
-#ifndef NO_LIMIT_FD_SETSIZE
-	if (signal_fd >= FD_SETSIZE || listen_fd >= FD_SETSIZE ||
-            restarter_fd >= FD_SETSIZE)
-	    krb5_errx (context, IPROPD_RESTART, "fd too large");
-#endif
-
-	FD_ZERO(&readset);
-	FD_ZERO(&writeset);
-	FD_SET(signal_fd, &readset);
-	max_fd = max(max_fd, signal_fd);
-	FD_SET(listen_fd, &readset);
-	max_fd = max(max_fd, listen_fd);
-        if (restarter_fd > -1) {
-            FD_SET(restarter_fd, &readset);
-            max_fd = max(max_fd, restarter_fd);
-        }
-
+        signal_ready = listen_ready = restarter_ready = 0;
 	for (p = slaves; p != NULL; p = p->next) {
+            int want = EVENT_READ;
+
+            p->ready = 0;
 	    if (p->flags & SLAVE_F_DEAD)
 		continue;
-	    FD_SET(p->fd, &readset);
             if (have_tail(p) || more_diffs(p))
-                FD_SET(p->fd, &writeset);
-	    max_fd = max(max_fd, p->fd);
+                want |= EVENT_WRITE;
+            if (events_set(context, p->fd, &p->ready, p->events, want) == 0)
+                p->events = want;
+            else
+                slave_dead(context, p);
 	}
 
-	ret = select(max_fd + 1, &readset, &writeset, NULL, &to);
+	ret = events_wait(30);
 	if (ret < 0) {
 	    if (errno == EINTR)
 		continue;
 	    else
-		krb5_err (context, IPROPD_RESTART, errno, "select");
+		krb5_err (context, IPROPD_RESTART, errno, "waiting for events");
 	}
 
         if (stat(server_context->log_context.log_file, &st2) == -1) {
@@ -1759,12 +2277,12 @@ main(int argc, char **argv)
 	    }
 	}
 
-        if (ret && FD_ISSET(restarter_fd, &readset)) {
+        if (restarter_ready) {
             exit_flag = SIGTERM;
             break;
         }
 
-	if (ret && FD_ISSET(signal_fd, &readset)) {
+	if (signal_ready) {
 #ifndef NO_UNIX_SOCKETS
 	    struct sockaddr_un peer_addr;
 #else
@@ -1777,8 +2295,6 @@ main(int argc, char **argv)
 		krb5_warn (context, errno, "recvfrom");
 		continue;
 	    }
-	    --ret;
-	    assert(ret >= 0);
 	    old_version = current_version;
 	    if (flock(log_fd, LOCK_SH) == -1)
                 krb5_err(context, IPROPD_RESTART, errno, "shared flock %s",
@@ -1820,7 +2336,7 @@ main(int argc, char **argv)
 
 	for (p = slaves; p != NULL; p = p->next) {
             if (!(p->flags & SLAVE_F_DEAD) &&
-                FD_ISSET(p->fd, &writeset) &&
+                (p->ready & EVENT_WRITE) &&
                 ((have_tail(p) && send_tail(context, p) == 0) ||
                  (!have_tail(p) && more_diffs(p)))) {
                 send_diffs(server_context, p, log_fd, database,
@@ -1831,9 +2347,7 @@ main(int argc, char **argv)
 	for(p = slaves; p != NULL; p = p->next) {
 	    if (p->flags & SLAVE_F_DEAD)
 	        continue;
-	    if (ret && FD_ISSET(p->fd, &readset)) {
-		--ret;
-		assert(ret >= 0);
+	    if (p->ready & EVENT_READ) {
                 ret = process_msg(server_context, p, log_fd, database,
                                   current_version);
                 if (ret && ret != EWOULDBLOCK)
@@ -1844,11 +2358,8 @@ main(int argc, char **argv)
 		send_are_you_there (context, p);
 	}
 
-	if (ret && FD_ISSET(listen_fd, &readset)) {
+	if (listen_ready)
 	    add_slave (context, keytab, &slaves, listen_fd);
-	    --ret;
-	    assert(ret >= 0);
-	}
 	write_stats(context, slaves, current_version);
     }
 
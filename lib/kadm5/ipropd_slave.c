@@ -179,16 +179,18 @@ ihave(krb5_context context, krb5_auth_context auth_context,
       int fd, uint32_t version)
 {
     int ret;
-    u_char buf[8];
+    u_char buf[12];
     krb5_storage *sp;
     krb5_data data;
 
-    sp = krb5_storage_from_mem(buf, 8);
+    sp = krb5_storage_from_mem(buf, 12);
     ret = krb5_store_uint32(sp, I_HAVE);
     if (ret == 0)
         ret = krb5_store_uint32(sp, version);
+    if (ret == 0)
+        ret = krb5_store_uint32(sp, IPROP_CAP_MANY_PRINCS);
     krb5_storage_free(sp);
-    data.length = 8;
+    data.length = 12;
     data.data   = buf;
 
     if (ret == 0) {
@@ -402,7 +404,7 @@ receive_loop(krb5_context context,
      */
     if (verbose)
         krb5_warnx(context, "replaying entries from master");
-    ret = kadm5_log_recover(server_context, kadm_recover_replay);
+    ret = kadm5_log_recover(server_context, kadm_recover_replay_batch);
     if (ret) {
         krb5_warn(context, ret, "replay failed");
         return ret;
@@ -507,6 +509,24 @@ reinit_log(krb5_context context,
 }
 
 
+static void
+store_one_princ(krb5_context context, HDB *mydb, krb5_data *value)
+{
+    hdb_entry_ex entry;
+    int ret;
+
+    memset(&entry, 0, sizeof(entry));
+
+    ret = hdb_value2entry(context, value, &entry.entry);
+    if (ret)
+        krb5_err(context, IPROPD_RESTART, ret, "hdb_value2entry");
+    ret = mydb->hdb_store(context, mydb, 0, &entry);
+    if (ret)
+        krb5_err(context, IPROPD_RESTART_SLOW, ret, "hdb_store");
+
+    hdb_free_entry(context, &entry);
+}
+
 static krb5_error_code
 receive_everything(krb5_context context, int fd,
 		   kadm5_server_context *server_context,
@@ -554,6 +574,9 @@ receive_everything(krb5_context context, int fd,
         krb5_err(context, IPROPD_RESTART, ret, "db->open");
 
     (void) mydb->hdb_set_sync(context, mydb, 0);
+    ret = hdb_begin_batch(context, mydb);
+    if (ret)
+        krb5_err(context, IPROPD_RESTART, ret, "hdb_begin_batch");
 
     sp = NULL;
     krb5_data_zero(&data);
@@ -571,31 +594,30 @@ receive_everything(krb5_context context, int fd,
 	krb5_ret_uint32(sp, &opcode);
 	if (opcode == ONE_PRINC) {
 	    krb5_data fake_data;
-	    hdb_entry_ex entry;
 
 	    krb5_storage_free(sp);
 
 	    fake_data.data   = (char *)data.data + 4;
 	    fake_data.length = data.length - 4;
 
-	    memset(&entry, 0, sizeof(entry));
-
-	    ret = hdb_value2entry(context, &fake_data, &entry.entry);
-	    if (ret)
-		krb5_err(context, IPROPD_RESTART, ret, "hdb_value2entry");
-	    ret = mydb->hdb_store(server_context->context,
-				  mydb,
-				  0, &entry);
-	    if (ret)
-		krb5_err(context, IPROPD_RESTART_SLOW, ret, "hdb_store");
+	    store_one_princ(context, mydb, &fake_data);
+	    krb5_data_free(&data);
+	} else if (opcode == MANY_PRINCS) {
+	    krb5_data value;
 
-	    hdb_free_entry(context, &entry);
+	    while ((ret = krb5_ret_data(sp, &value)) == 0) {
+		store_one_princ(context, mydb, &value);
+		krb5_data_free(&value);
+	    }
+	    if (ret != HEIM_ERR_EOF)
+		krb5_err(context, IPROPD_RESTART, ret, "MANY_PRINCS");
+	    krb5_storage_free(sp);
 	    krb5_data_free(&data);
 	} else if (opcode == NOW_YOU_HAVE)
 	    ;
 	else
 	    krb5_errx(context, 1, "strange opcode %d", opcode);
-    } while (opcode == ONE_PRINC);
+    } while (opcode == ONE_PRINC || opcode == MANY_PRINCS);
 
     if (opcode != NOW_YOU_HAVE)
         krb5_errx(context, IPROPD_RESTART_SLOW,
@@ -604,6 +626,10 @@ receive_everything(krb5_context context, int fd,
     krb5_ret_uint32(sp, &vno);
     krb5_storage_free(sp);
 
+    ret = hdb_end_batch(context, mydb, 1);
+    if (ret)
+        krb5_err(context, IPROPD_RESTART_SLOW, ret, "hdb_end_batch");
+
     reinit_log(context, server_context, vno);
 
     ret = mydb->hdb_set_sync(context, mydb, !async_hdb);
@@ -668,6 +694,30 @@ slave_status(krb5_context context,
     free(status);
 }
 
+/*
+ * Write a flat snapshot of the database for read-only KDCs (see
+ * --flat-snapshot); failures are not fatal, the next update tries again.
+ */
+static void
+write_flat_snapshot(krb5_context context,
+                    kadm5_server_context *server_context)
+{
+    HDB *db = server_context->db;
+    krb5_error_code ret;
+
+    if (flat_snapshot == NULL)
+        return;
+    ret = db->hdb_open(context, db, O_RDONLY, 0);
+    if (ret == 0) {
+        ret = hdb_flat_dump(context, db, flat_snapshot);
+        (void) db->hdb_close(context, db);
+    }
+    if (ret)
+        krb5_warn(context, ret, "writing flat snapshot %s", flat_snapshot);
+    else if (verbose)
+        krb5_warnx(context, "wrote flat snapshot %s", flat_snapshot);
+}
+
 static void
 is_up_to_date(krb5_context context, const char *file,
 	      kadm5_server_context *server_context)
@@ -684,6 +734,7 @@ is_up_to_date(krb5_context context, const char *file,
 }
 
 static char *database;
+static char *flat_snapshot;
 static char *status_file;
 static char *config_file;
 static int version_flag;
@@ -712,6 +763,8 @@ static struct getargs args[] = {
     { "pidfile-basename", 0, arg_string, &pidfile_basename,
       "basename of pidfile; private argument for testing", "NAME" },
     { "async-hdb", 'a', arg_flag, &async_hdb, NULL, NULL },
+    { "flat-snapshot", 0, arg_string, &flat_snapshot,
+      "write a flat snapshot of the database after each update", "file" },
     { "hostname", 0, arg_string, rk_UNCONST(&slave_str),
       "hostname of slave (if not same as hostname)", "hostname" },
     { "verbose", 0, arg_flag, &verbose, NULL, NULL },
@@ -1066,8 +1119,10 @@ main(int argc, char **argv)
                 /*
                  * If it returns an error, receive() may nonetheless
                  * have committed some entries successfully, so we must
-                 * update the slave_status even if there were errors.
+                 * update the slave_status (and snapshot) even if there
+                 * were errors.
                  */
+                write_flat_snapshot(context, server_context);
                 is_up_to_date(context, status_file, server_context);
 		break;
 	    case TELL_YOU_EVERYTHING :
@@ -1080,10 +1135,12 @@ main(int argc, char **argv)
                     ret = ihave(context, auth_context, master_fd,
                                 server_context->log_context.version);
                 }
-                if (ret)
+                if (ret) {
 		    connected = FALSE;
-                else
+                } else {
+                    write_flat_snapshot(context, server_context);
                     is_up_to_date(context, status_file, server_context);
+                }
                 if (verbose)
                     krb5_warnx(context, "downgraded iprop log lock to shared");
                 kadm5_log_signal_master(server_context);
@@ -1112,6 +1169,7 @@ main(int argc, char **argv)
 	    case NOW_YOU_HAVE :
 	    case I_HAVE :
 	    case ONE_PRINC :
+	    case MANY_PRINCS :
 	    case I_AM_HERE :
 	    default :
 		krb5_warnx (context, "Ignoring command %d", tmp);
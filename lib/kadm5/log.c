@@ -145,6 +145,18 @@ RCSID("$Id$");
  * On masters the log should never have more than one unconfirmed
  * record, but slaves append all of a master's "diffs" and then call
  * kadm5_log_recover() to recover.
+ *
+ * Group commit ([kdc] log-group-commit-size) relaxes that on masters for
+ * runs of operations done while the HDB is locked with kadm5_lock(), and
+ * only for HDB backends that support batches (hdb_begin_batch()).  The
+ * records of a group are appended without fsync()ing each one, and their
+ * HDB changes are made inside one HDB batch.  The group is committed when
+ * it is full, when its first record is older than
+ * [kdc] log-group-commit-latency, when the HDB is unlocked, or before
+ * anything else writes the log: the log is fsync()ed, then the HDB batch
+ * is committed, then the uber record is updated to confirm the whole
+ * group.  So the log is still written ahead of the HDB, and recovery
+ * after a crash replays whatever part of a group was not confirmed.
  */
 
 /*
@@ -464,6 +476,36 @@ get_max_log_size(krb5_context context)
 }
 
 static kadm5_ret_t truncate_if_needed(kadm5_server_context *);
+static kadm5_ret_t log_group_end(kadm5_server_context *, int);
+static kadm5_ret_t log_update_uber(kadm5_server_context *, off_t);
+
+/*
+ * Returns the maximum number of records in a group commit, or 0 if the
+ * records of this context cannot be grouped.  See the comment at the top.
+ */
+static unsigned int
+group_commit_size(kadm5_server_context *context)
+{
+    int n;
+
+    if (!context->keep_open || context->db->hdb_begin_batch == NULL ||
+        context->log_context.read_only)
+        return 0;
+    n = krb5_config_get_int_default(context->context, NULL, 0,
+                                    "kdc",
+                                    "log-group-commit-size",
+                                    NULL);
+    return n > 1 ? n : 0;
+}
+
+static time_t
+group_commit_latency(kadm5_server_context *context)
+{
+    return krb5_config_get_time_default(context->context, NULL, 1,
+                                        "kdc",
+                                        "log-group-commit-latency",
+                                        NULL);
+}
 
 /*
  * Get the version and timestamp metadata of either the first, or last
@@ -638,6 +680,17 @@ log_init(kadm5_server_context *server_context, int lock_mode)
         return ret;
 
     fd = log_context->log_fd;
+    if (log_context->group_open) {
+        /*
+         * The unconfirmed records are those of our open group, whose HDB
+         * changes are already in the open HDB batch; carry on appending.
+         */
+        if (lseek(fd, log_context->group_end, SEEK_SET) == -1) {
+            ret = errno;
+            (void) kadm5_log_end(server_context);
+        }
+        return ret;
+    }
     if (!log_context->read_only) {
         if (fstat(fd, &st) == -1)
             ret = errno;
@@ -749,6 +802,12 @@ kadm5_log_reinit(kadm5_server_context *server_context, uint32_t vno)
     ret = log_open(server_context, LOCK_EX);
     if (ret)
 	return ret;
+    if (log_context->group_open) {
+        /* Don't leave HDB changes in a batch whose records we discard */
+        ret = log_group_end(server_context, 0);
+        if (ret)
+            return ret;
+    }
     if (log_context->log_fd != -1) {
         if (ftruncate(log_context->log_fd, 0) < 0) {
             ret = errno;
@@ -862,6 +921,7 @@ kadm5_log_signal_master(kadm5_server_context *context)
 /*
  * Write sp's contents (which must be a fully formed record, complete
  * with header, payload, and trailer) to the log and fsync the log.
+ * In a group commit the fsync is left to kadm5_log_group_commit().
  *
  * Does not free sp.
  */
@@ -875,6 +935,7 @@ kadm5_log_flush(kadm5_server_context *context, krb5_storage *sp)
     size_t len;
     krb5_ssize_t bytes;
     uint32_t new_ver, prev_ver;
+    enum kadm_ops new_op;
     off_t off, end;
 
     if (strcmp(log_context->log_file, "/dev/null") == 0)
@@ -886,7 +947,7 @@ kadm5_log_flush(kadm5_server_context *context, krb5_storage *sp)
     if (krb5_storage_seek(sp, 0, SEEK_SET) == -1)
         return errno;
 
-    ret = get_header(sp, LOG_DOPEEK, &new_ver, NULL, NULL, NULL);
+    ret = get_header(sp, LOG_DOPEEK, &new_ver, NULL, &new_op, NULL);
     if (ret)
         return ret;
 
@@ -939,6 +1000,18 @@ kadm5_log_flush(kadm5_server_context *context, krb5_storage *sp)
         return KADM5_LOG_CORRUPT;
     }
 
+    /* Start a group (and its HDB batch) if wanted and we can */
+    if (!log_context->group_open && new_op != kadm_nop &&
+        group_commit_size(context) > 1 &&
+        hdb_begin_batch(context->context, context->db) == 0) {
+        log_context->group_open = 1;
+        log_context->group_count = 0;
+        log_context->group_start = time(NULL);
+        log_context->group_end = end;
+        log_context->group_version = prev_ver;
+        log_context->group_time = log_context->last_time;
+    }
+
     len = data.length;
     bytes = krb5_storage_write(sp, data.data, len);
     krb5_data_free(&data);
@@ -946,6 +1019,8 @@ kadm5_log_flush(kadm5_server_context *context, krb5_storage *sp)
         krb5_storage_free(sp);
         ret = bytes == -1 ? errno : KADM5_LOG_CORRUPT;
         krb5_warn(context->context, ret, "short write to iprop log file");
+        if (log_context->group_open)
+            (void) kadm5_log_group_commit(context);
 	return ret;
     }
     if (bytes != (krb5_ssize_t)len) {
@@ -953,7 +1028,14 @@ kadm5_log_flush(kadm5_server_context *context, krb5_storage *sp)
         return EIO;
     }
 
-    ret = krb5_storage_fsync(sp);
+    if (log_context->group_open) {
+        /* The group commit will fsync() this */
+        log_context->group_count++;
+        log_context->group_end = end + len;
+        ret = 0;
+    } else {
+        ret = krb5_storage_fsync(sp);
+    }
     krb5_storage_free(sp);
     if (ret)
         return ret;
@@ -964,6 +1046,119 @@ kadm5_log_flush(kadm5_server_context *context, krb5_storage *sp)
     return 0;
 }
 
+/*
+ * Replay the record just written by kadm5_log_flush() to the HDB and
+ * confirm it.
+ *
+ * Outside a group commit that is kadm5_log_recover(kadm_recover_commit).
+ * In a group the record is replayed into the group's HDB batch and is
+ * confirmed later, with the rest of the group.  If the replay fails the
+ * preceding records of the group are committed and the failed one is left
+ * unconfirmed, as kadm5_log_recover() would leave it.
+ */
+static kadm5_ret_t
+log_commit(kadm5_server_context *context)
+{
+    kadm5_log_context *log_context = &context->log_context;
+    kadm5_ret_t ret;
+    krb5_storage *sp;
+    enum kadm_ops op;
+    uint32_t ver, len;
+    off_t off = -1;
+
+    if (!log_context->group_open)
+        return kadm5_log_recover(context, kadm_recover_commit);
+
+    sp = krb5_storage_from_fd(log_context->log_fd);
+    if (sp == NULL)
+        return krb5_enomem(context->context);
+    if (krb5_storage_seek(sp, log_context->group_end, SEEK_SET) == -1 ||
+        (off = seek_prev(sp, NULL, NULL)) == -1)
+        ret = errno;
+    else
+        ret = get_header(sp, LOG_NOPEEK, &ver, NULL, &op, &len);
+    if (ret == 0)
+        ret = kadm5_log_replay(context, op, ver, len, sp);
+    krb5_storage_free(sp);
+
+    if (ret == 0) {
+        log_context->group_version = ver;
+        log_context->group_time = log_context->last_time;
+        if (log_context->group_count >= group_commit_size(context) ||
+            time(NULL) - log_context->group_start >=
+                group_commit_latency(context))
+            ret = kadm5_log_group_commit(context);
+        return ret;
+    }
+
+    if (off == -1) {
+        /* Can't tell where the failed record starts; replay it all later */
+        (void) log_group_end(context, 0);
+        return ret;
+    }
+    log_context->group_end = off;
+    log_context->group_count--;
+    (void) kadm5_log_group_commit(context);
+    return ret;
+}
+
+/*
+ * End the open group commit, if any.
+ *
+ * If `commit' then fsync() the log, commit the group's HDB batch, and
+ * confirm the group's records in the uber record.  Else abandon the HDB
+ * batch and leave the group's records unconfirmed, for recovery to
+ * replay.
+ */
+static kadm5_ret_t
+log_group_end(kadm5_server_context *context, int commit)
+{
+    kadm5_log_context *log_context = &context->log_context;
+    kadm5_ret_t ret = 0;
+    kadm5_ret_t ret2;
+    int opened = 0;
+
+    if (!log_context->group_open)
+        return 0;
+
+    if (commit && log_context->log_fd == -1) {
+        ret = log_open(context, LOCK_EX);
+        if (ret)
+            commit = 0;
+        else
+            opened = 1;
+    }
+    if (commit && fsync(log_context->log_fd) == -1) {
+        ret = errno;
+        commit = 0;
+    }
+    ret2 = hdb_end_batch(context->context, context->db, commit);
+    if (ret == 0)
+        ret = ret2;
+    if (ret2)
+        commit = 0;
+
+    log_context->version = log_context->group_version;
+    log_context->last_time = log_context->group_time;
+    if (commit && log_context->group_count > 0)
+        ret = log_update_uber(context, log_context->group_end);
+
+    log_context->group_open = 0;
+    log_context->group_count = 0;
+    if (opened)
+        (void) kadm5_log_end(context);
+    return ret;
+}
+
+/*
+ * Commit the open group commit, if any.  See the comment at the top.
+ */
+kadm5_ret_t
+kadm5_log_group_commit(kadm5_server_context *context)
+{
+    return log_group_end(context, 1);
+}
+
 /*
  * Add a `create' operation to the log and perform the create against the HDB.
  */
@@ -1041,7 +1236,7 @@ kadm5_log_create(kadm5_server_context *context, hdb_entry *entry)
     krb5_storage_free(sp);
     krb5_data_free(&value);
     if (ret == 0)
-        ret = kadm5_log_recover(context, kadm_recover_commit);
+        ret = log_commit(context);
     return ret;
 }
 
@@ -1152,7 +1347,7 @@ kadm5_log_delete(kadm5_server_context *context,
     if (ret == 0)
         ret = kadm5_log_flush(context, sp);
     if (ret == 0)
-        ret = kadm5_log_recover(context, kadm_recover_commit);
+        ret = log_commit(context);
     krb5_storage_free(sp);
     return ret;
 }
@@ -1291,7 +1486,7 @@ kadm5_log_rename(kadm5_server_context *context,
         if (ret == 0)
             ret = kadm5_log_flush(context, sp);
         if (ret == 0)
-            ret = kadm5_log_recover(context, kadm_recover_commit);
+            ret = log_commit(context);
     }
     krb5_data_free(&value);
     krb5_storage_free(sp);
@@ -1416,7 +1611,7 @@ kadm5_log_modify(kadm5_server_context *context,
     if (ret == 0)
         ret = kadm5_log_flush(context, sp);
     if (ret == 0)
-        ret = kadm5_log_recover(context, kadm_recover_commit);
+        ret = log_commit(context);
     krb5_data_free(&value);
     krb5_storage_free(sp);
     return ret;
@@ -1751,6 +1946,12 @@ kadm5_log_nop(kadm5_server_context *context, enum kadm_nop_type nop_type)
     if (strcmp(log_context->log_file, "/dev/null") == 0)
         return 0;
 
+    /* Nops are for truncation and such; don't put them in a group */
+    ret = kadm5_log_group_commit(context);
+    if (ret)
+        return ret;
+    vno = log_context->version;
+
     off = lseek(log_context->log_fd, 0, SEEK_CUR);
     if (off == -1)
         return errno;
@@ -1828,8 +2029,40 @@ struct replay_cb_data {
     size_t count;
     uint32_t ver;
     enum kadm_recover_mode mode;
+    size_t pending;             /* records in the open batch */
+    off_t off;                  /* end of the last record replayed */
 };
 
+/* Records replayed per HDB batch by kadm_recover_replay_batch */
+#define RECOVER_BATCH_MAX 1000
+
+/*
+ * Commit the open HDB batch of kadm_recover_replay_batch and only then
+ * confirm its records, and start another batch if `more'.
+ *
+ * If we crash after the commit but before the confirmation is synced then
+ * the batch will be replayed again, which is tolerated as for any replay,
+ * but the log is never confirmed ahead of the HDB.
+ */
+static kadm5_ret_t
+recover_batch_end(kadm5_server_context *context, struct replay_cb_data *data,
+                  krb5_storage *sp, int more)
+{
+    kadm5_ret_t ret;
+
+    ret = hdb_end_batch(context->context, context->db, 1);
+    if (ret == 0 && data->pending > 0) {
+        kadm5_log_set_version(context, data->ver);
+        ret = log_update_uber(context, data->off);
+        if (ret == 0)
+            ret = krb5_storage_fsync(sp);
+    }
+    data->pending = 0;
+    if (ret == 0 && more)
+        ret = hdb_begin_batch(context->context, context->db);
+    return ret;
+}
+
 
 /*
  * Recover or perform the initial commit of an unconfirmed log entry
@@ -1859,7 +2092,7 @@ recover_replay(kadm5_server_context *context,
     switch (ret) {
     case HDB_ERR_NOENTRY:
     case HDB_ERR_EXISTS:
-        if (data->mode != kadm_recover_replay)
+        if (data->mode == kadm_recover_commit)
             return ret;
     case 0:
         break;
@@ -1872,6 +2105,13 @@ recover_replay(kadm5_server_context *context,
     data->count++;
     data->ver = ver;
 
+    if (data->mode == kadm_recover_replay_batch) {
+        data->off = off;
+        if (++data->pending < RECOVER_BATCH_MAX)
+            return 0;
+        return recover_batch_end(context, data, sp, 1);
+    }
+
     /*
      * With replay we may be making multiple HDB changes.  We must sync the
      * confirmation of each one before moving on to the next.  Otherwise, we
@@ -1894,18 +2134,37 @@ kadm5_log_recover(kadm5_server_context *context, enum kadm_recover_mode mode)
     krb5_storage *sp;
     struct replay_cb_data replay_data;
 
+    kadm5_ret_t ret2;
+
+    /* Batches need backend support, and there's no replay on LDAP */
+    if (mode == kadm_recover_replay_batch &&
+        (context->db->hdb_begin_batch == NULL ||
+         (context->db->hdb_capability_flags & HDB_CAP_F_SHARED_DIRECTORY)))
+        mode = kadm_recover_replay;
+
     replay_data.count = 0;
     replay_data.ver = 0;
     replay_data.mode = mode;
+    replay_data.pending = 0;
+    replay_data.off = 0;
 
     sp = krb5_storage_from_fd(context->log_context.log_fd);
     if (sp == NULL)
         return errno ? errno : EIO;
     ret = kadm5_log_goto_end(context, sp);
 
-    if (ret == 0)
+    if (ret == 0 && mode == kadm_recover_replay_batch)
+        ret = hdb_begin_batch(context->context, context->db);
+    if (ret == 0) {
         ret = kadm5_log_foreach(context, kadm_forward | kadm_unconfirmed,
                                 NULL, recover_replay, &replay_data);
+        if (mode == kadm_recover_replay_batch) {
+            /* Keep what was replayed even if we stopped early */
+            ret2 = recover_batch_end(context, &replay_data, sp, 0);
+            if (ret == 0)
+                ret = ret2;
+        }
+    }
     if (ret == 0 && mode == kadm_recover_commit && replay_data.count != 1)
         ret = KADM5_LOG_CORRUPT;
     krb5_storage_free(sp);
@@ -2531,6 +2790,10 @@ kadm5_log_truncate(kadm5_server_context *context, size_t keep, size_t maxbytes)
     if (context->log_context.read_only)
         return EROFS;
 
+    ret = kadm5_log_group_commit(context);
+    if (ret)
+        return ret;
+
     /* Get the desired records. */
     krb5_data_zero(&entries);
     ret = load_entries(context, &entries, keep, maxbytes, &first, &last);
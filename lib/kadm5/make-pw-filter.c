@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Build a banned password filter (see pw_filter.c) from lists of
+ * passwords, one per line.
+ */
+
+#include "kadm5_locl.h"
+#include <getarg.h>
+
+static krb5_context context;
+
+static int bits_per_password = 16;
+static int help_flag;
+static int version_flag;
+
+static struct getargs args[] = {
+    { "bits-per-password", 'b', arg_integer, &bits_per_password,
+      "filter bits per password, 16 gives about 0.2% false positives",
+      "bits" },
+    { "help", 'h', arg_flag, &help_flag, NULL, NULL },
+    { "version", 0, arg_flag, &version_flag, NULL, NULL }
+};
+
+static int num_args = sizeof(args) / sizeof(args[0]);
+
+static void
+usage(int ret)
+{
+    arg_printusage(args, num_args, NULL, "filter password-file ...");
+    exit(ret);
+}
+
+/* Read the passwords in `file', adding them to `f' unless it is NULL */
+static uint64_t
+read_passwords(const char *file, struct kadm5_pw_filter *f)
+{
+    uint64_t count = 0;
+    char buf[1024];
+    size_t len;
+    FILE *in;
+
+    if ((in = fopen(file, "r")) == NULL)
+	krb5_err(context, 1, errno, "open %s", file);
+    while (fgets(buf, sizeof(buf), in) != NULL) {
+	len = strcspn(buf, "\r\n");
+	if (len == 0)
+	    continue;
+	if (f)
+	    _kadm5_pw_filter_add(f, buf, len);
+	count++;
+    }
+    if (ferror(in))
+	krb5_err(context, 1, errno, "read %s", file);
+    fclose(in);
+    return count;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct kadm5_pw_filter *f;
+    krb5_error_code ret;
+    uint64_t count = 0;
+    int optidx = 0;
+    int i;
+
+    setprogname(argv[0]);
+
+    if (getarg(args, num_args, argc, argv, &optidx))
+	usage(1);
+    if (help_flag)
+	usage(0);
+    if (version_flag) {
+	print_version(NULL);
+	exit(0);
+    }
+    argc -= optidx;
+    argv += optidx;
+    if (argc < 2)
+	usage(1);
+    if (bits_per_password < 1 || bits_per_password > 64)
+	errx(1, "bits-per-password must be between 1 and 64");
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context failed: %d", ret);
+
+    /* Size the filter in a first pass, then fill it in a second */
+    for (i = 1; i < argc; i++)
+	count += read_passwords(argv[i], NULL);
+    ret = _kadm5_pw_filter_create(context, count, bits_per_password, &f);
+    if (ret)
+	krb5_err(context, 1, ret, "creating password filter");
+    for (i = 1; i < argc; i++)
+	read_passwords(argv[i], f);
+
+    ret = _kadm5_pw_filter_write(context, f, argv[0]);
+    if (ret)
+	krb5_err(context, 1, ret, "writing password filter");
+    _kadm5_pw_filter_free(f);
+    krb5_free_context(context);
+    return 0;
+}
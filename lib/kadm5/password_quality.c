@@ -223,6 +223,74 @@ external_passwd_quality (krb5_context context,
     return 0;
 }
 
+/*
+ * The banned password filter of [password_quality] banned_passwords,
+ * mapped again when the file changes.
+ */
+static HEIMDAL_MUTEX banned_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct kadm5_pw_filter *banned_filter;
+static char *banned_path;
+static struct stat banned_st;
+
+static int
+banned_passwd_quality (krb5_context context,
+		       krb5_principal principal,
+		       krb5_data *pwd,
+		       const char *opaque,
+		       char *message,
+		       size_t length)
+{
+    krb5_error_code ret = 0;
+    const char *path;
+    struct stat st;
+    int banned;
+
+    path = krb5_config_get_string(context, NULL,
+				  "password_quality",
+				  "banned_passwords",
+				  NULL);
+    if (path == NULL) {
+	snprintf(message, length, "banned password filter not configured");
+	return 1;
+    }
+
+    HEIMDAL_MUTEX_lock(&banned_mutex);
+    if (stat(path, &st) == -1) {
+	ret = errno;
+    } else if (banned_filter == NULL || strcmp(banned_path, path) != 0 ||
+	       st.st_dev != banned_st.st_dev || st.st_ino != banned_st.st_ino ||
+	       st.st_size != banned_st.st_size ||
+	       st.st_mtime != banned_st.st_mtime) {
+	struct kadm5_pw_filter *f;
+	char *p;
+
+	if ((p = strdup(path)) == NULL) {
+	    ret = ENOMEM;
+	} else if ((ret = _kadm5_pw_filter_open(context, path, &f)) == 0) {
+	    _kadm5_pw_filter_free(banned_filter);
+	    free(banned_path);
+	    banned_filter = f;
+	    banned_path = p;
+	    banned_st = st;
+	} else {
+	    free(p);
+	}
+    }
+    if (ret) {
+	HEIMDAL_MUTEX_unlock(&banned_mutex);
+	snprintf(message, length, "banned password filter %s "
+		 "could not be read: %s", path, strerror(ret));
+	return 1;
+    }
+    banned = _kadm5_pw_filter_check(banned_filter, pwd);
+    HEIMDAL_MUTEX_unlock(&banned_mutex);
+
+    if (banned) {
+	strlcpy(message, "Password is too common, or has been leaked", length);
+	return 1;
+    }
+    return 0;
+}
 
 static kadm5_passwd_quality_check_func_v0 passwd_quality_check =
 	min_length_passwd_quality_v0;
@@ -231,6 +299,7 @@ struct kadm5_pw_policy_check_func builtin_funcs[] = {
     { "minimum-length", min_length_passwd_quality },
     { "character-class", char_class_passwd_quality },
     { "external-check", external_passwd_quality },
+    { "banned-passwords", banned_passwd_quality },
     { NULL, NULL }
 };
 struct kadm5_pw_policy_verifier builtin_verifier = {
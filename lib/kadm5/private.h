@@ -54,11 +54,20 @@ struct kadm_func {
     kadm5_ret_t (*get_principal) (void*, krb5_principal,
 				  kadm5_principal_ent_t, uint32_t);
     kadm5_ret_t (*get_principals) (void*, const char*, char***, int*);
+    kadm5_ret_t (*iter_principals) (void*, const char*,
+				    int (*)(void *, const char *), void *);
     kadm5_ret_t (*get_privs) (void*, uint32_t*);
     kadm5_ret_t (*modify_principal) (void*, kadm5_principal_ent_t, uint32_t);
     kadm5_ret_t (*randkey_principal) (void*, krb5_principal, krb5_boolean, int,
 				      krb5_key_salt_tuple*, krb5_keyblock**,
 				      int*);
+    kadm5_ret_t (*randkey_principals) (void*, krb5_principal *, int,
+				       krb5_boolean, int,
+				       krb5_key_salt_tuple *,
+				       int (*)(void *, krb5_const_principal,
+					       kadm5_ret_t, krb5_keyblock *,
+					       int),
+				       void *);
     kadm5_ret_t (*rename_principal) (void*, krb5_principal, krb5_principal);
     kadm5_ret_t (*chpass_principal_with_key) (void *, krb5_principal, int,
 					      int, krb5_key_data *);
@@ -104,6 +113,13 @@ typedef struct kadm5_log_context {
     struct addrinfo *socket_info;
 #endif
     krb5_socket_t socket_fd;
+    /* Group commit state, see log.c */
+    int group_open;
+    unsigned int group_count;
+    time_t group_start;
+    off_t group_end;
+    uint32_t group_version;
+    time_t group_time;
 } kadm5_log_context;
 
 typedef struct kadm5_server_context {
@@ -195,14 +211,27 @@ enum kadm_iter_opts {
 
 enum kadm_recover_mode {
     kadm_recover_commit,
-    kadm_recover_replay
+    kadm_recover_replay,
+    kadm_recover_replay_batch   /* replay, in HDB batches where possible */
 };
 
+/*
+ * Flags in the first argument of kadm_get_princs.  Old clients send
+ * just 0 or 1 (expression present).  With KADM_GET_PRINCS_STREAM the
+ * names come back in several replies of <0, -n, n names>, ended by one
+ * of <ret, 0>; old servers send one ordinary <ret, n, n names> reply.
+ */
+#define KADM_GET_PRINCS_EXPRESSION      1
+#define KADM_GET_PRINCS_STREAM          2
+
 #define KADMIN_APPL_VERSION "KADM0.1"
 #define KADMIN_OLD_APPL_VERSION "KADM0.0"
 
 extern struct heim_plugin_data kadm5_hook_plugin_data;
 
+/* A banned password filter, see pw_filter.c */
+struct kadm5_pw_filter;
+
 #include "kadm5-private.h"
 
 #endif /* __kadm5_privatex_h__ */
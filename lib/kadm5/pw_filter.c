@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Banned password filters.
+ *
+ * A filter is a blocked Bloom filter of the passwords in a (possibly
+ * very large) list of leaked or otherwise banned passwords, built
+ * offline with make-pw-filter(8) and checked by the banned-passwords
+ * policy in kadmind and kpasswdd.  The filter is memory mapped, so a
+ * check costs one hash and touches one 64 byte block of it, and says
+ * "banned" for a password not in the list with a chance set when the
+ * filter was built.
+ *
+ * The file format is, with all integers big-endian:
+ *
+ *	"HPWFLT\0\0"	magic
+ *	uint32		version, 1
+ *	uint32		number of bits set per password
+ *	uint64		number of 512 bit blocks
+ *	uint64		number of passwords
+ *	blocks
+ *
+ * A password is hashed with SHA-256; the first eight bytes pick the
+ * block and the next sixteen the bits within it.
+ */
+
+#include "kadm5_locl.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#define PWF_MAGIC	"HPWFLT\0\0"
+#define PWF_VERSION	1
+#define PWF_HDR_SIZE	32
+#define PWF_BLOCK_BITS	512
+#define PWF_BLOCK_SIZE	(PWF_BLOCK_BITS / 8)
+#define PWF_MAX_K	16
+
+struct kadm5_pw_filter {
+    unsigned char *map;
+    size_t size;
+    int mapped;
+    uint32_t k;
+    uint64_t nblocks;
+    uint64_t count;
+};
+
+static uint32_t
+get_u32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	   ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t
+get_u64(const unsigned char *p)
+{
+    return ((uint64_t)get_u32(p) << 32) | get_u32(p + 4);
+}
+
+static void
+put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+static void
+put_u64(unsigned char *p, uint64_t v)
+{
+    put_u32(p, v >> 32);
+    put_u32(p + 4, v & 0xffffffff);
+}
+
+/* The block of `f' for `pw', and the bits within it in `h1' and `h2' */
+static unsigned char *
+pwf_locate(struct kadm5_pw_filter *f, const void *pw, size_t len,
+	   uint64_t *h1, uint64_t *h2)
+{
+    unsigned char digest[32];
+    EVP_MD_CTX *m;
+    uint64_t b;
+
+    m = EVP_MD_CTX_create();
+    EVP_DigestInit_ex(m, EVP_sha256(), NULL);
+    EVP_DigestUpdate(m, pw, len);
+    EVP_DigestFinal_ex(m, digest, NULL);
+    EVP_MD_CTX_destroy(m);
+
+    b = get_u64(digest) % f->nblocks;
+    *h1 = get_u64(digest + 8);
+    *h2 = get_u64(digest + 16) | 1;
+    memset_s(digest, sizeof(digest), 0, sizeof(digest));
+    return f->map + PWF_HDR_SIZE + b * PWF_BLOCK_SIZE;
+}
+
+static void
+pwf_unmap(struct kadm5_pw_filter *f)
+{
+#if defined(HAVE_MMAP) && !defined(NO_MMAP)
+    if (f->mapped)
+	munmap(f->map, f->size);
+    else
+#endif
+    free(f->map);
+    f->map = NULL;
+    f->size = 0;
+    f->mapped = 0;
+}
+
+/**
+ * Free a password filter from _kadm5_pw_filter_open() or
+ * _kadm5_pw_filter_create().
+ */
+
+void
+_kadm5_pw_filter_free(struct kadm5_pw_filter *f)
+{
+    if (f == NULL)
+	return;
+    pwf_unmap(f);
+    free(f);
+}
+
+/**
+ * Map the password filter in the file `path'.
+ */
+
+krb5_error_code
+_kadm5_pw_filter_open(krb5_context context, const char *path,
+		      struct kadm5_pw_filter **out)
+{
+    struct kadm5_pw_filter *f;
+    krb5_error_code ret = 0;
+    struct stat st;
+    int fd;
+
+    *out = NULL;
+    if ((f = calloc(1, sizeof(*f))) == NULL)
+	return krb5_enomem(context);
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+	ret = errno;
+	krb5_set_error_message(context, ret, "open %s: %s",
+			       path, strerror(ret));
+	free(f);
+	return ret;
+    }
+    rk_cloexec(fd);
+    if (fstat(fd, &st) == -1) {
+	ret = errno;
+	close(fd);
+	free(f);
+	krb5_set_error_message(context, ret, "stat %s: %s",
+			       path, strerror(ret));
+	return ret;
+    }
+    if (st.st_size < PWF_HDR_SIZE || (uint64_t)st.st_size > SIZE_MAX) {
+	close(fd);
+	goto bad;
+    }
+    f->size = st.st_size;
+
+#if defined(HAVE_MMAP) && !defined(NO_MMAP)
+    {
+	void *p = mmap(NULL, f->size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (p != MAP_FAILED) {
+	    f->map = p;
+	    f->mapped = 1;
+	}
+    }
+#endif
+    if (f->map == NULL) {
+	ssize_t bytes = 0;
+	size_t got;
+
+	if ((f->map = malloc(f->size)) == NULL) {
+	    close(fd);
+	    free(f);
+	    return krb5_enomem(context);
+	}
+	for (got = 0; got < f->size; got += bytes) {
+	    bytes = read(fd, f->map + got, f->size - got);
+	    if (bytes <= 0)
+		break;
+	}
+	if (got < f->size) {
+	    ret = bytes < 0 ? errno : EINVAL;
+	    close(fd);
+	    _kadm5_pw_filter_free(f);
+	    krb5_set_error_message(context, ret, "read %s", path);
+	    return ret;
+	}
+    }
+    close(fd);
+
+    if (memcmp(f->map, PWF_MAGIC, sizeof(PWF_MAGIC) - 1) != 0 ||
+	get_u32(f->map + 8) != PWF_VERSION)
+	goto bad;
+    f->k = get_u32(f->map + 12);
+    f->nblocks = get_u64(f->map + 16);
+    f->count = get_u64(f->map + 24);
+    if (f->k == 0 || f->k > PWF_MAX_K || f->nblocks == 0 ||
+	f->nblocks > (f->size - PWF_HDR_SIZE) / PWF_BLOCK_SIZE)
+	goto bad;
+
+    *out = f;
+    return 0;
+
+bad:
+    _kadm5_pw_filter_free(f);
+    krb5_set_error_message(context, EINVAL,
+			   "%s is not a password filter", path);
+    return EINVAL;
+}
+
+/**
+ * Returns TRUE if `pw' may be in the password filter `f', FALSE if it
+ * is certainly not.
+ */
+
+krb5_boolean
+_kadm5_pw_filter_check(struct kadm5_pw_filter *f, const krb5_data *pw)
+{
+    const unsigned char *block;
+    uint64_t h1, h2;
+    uint32_t i, bit;
+
+    block = pwf_locate(f, pw->data, pw->length, &h1, &h2);
+    for (i = 0; i < f->k; i++) {
+	bit = (h1 + i * h2) % PWF_BLOCK_BITS;
+	if ((block[bit / 8] & (1 << (bit % 8))) == 0)
+	    return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Make an empty password filter, in memory, for about `count'
+ * passwords with `bits' bits of filter per password.  More bits make
+ * false positives less likely: 10 bits give about 1%, 16 about 0.2%
+ * and 24 about 0.1%.
+ */
+
+krb5_error_code
+_kadm5_pw_filter_create(krb5_context context, uint64_t count,
+			unsigned int bits, struct kadm5_pw_filter **out)
+{
+    struct kadm5_pw_filter *f;
+    uint64_t nblocks;
+    uint32_t k;
+
+    *out = NULL;
+    if (count == 0)
+	count = 1;
+    if (bits == 0)
+	bits = 16;
+
+    /* The optimal number of bits set per password is bits * ln 2 */
+    k = (bits * 693 + 500) / 1000;
+    if (k == 0)
+	k = 1;
+    if (k > PWF_MAX_K)
+	k = PWF_MAX_K;
+    if (count > UINT64_MAX / bits ||
+	(nblocks = count * bits / PWF_BLOCK_BITS + 1) >
+	(SIZE_MAX - PWF_HDR_SIZE) / PWF_BLOCK_SIZE) {
+	krb5_set_error_message(context, ERANGE,
+			       "password filter would be too large");
+	return ERANGE;
+    }
+
+    if ((f = calloc(1, sizeof(*f))) == NULL)
+	return krb5_enomem(context);
+    f->size = PWF_HDR_SIZE + nblocks * PWF_BLOCK_SIZE;
+    if ((f->map = calloc(1, f->size)) == NULL) {
+	free(f);
+	return krb5_enomem(context);
+    }
+    memcpy(f->map, PWF_MAGIC, sizeof(PWF_MAGIC) - 1);
+    put_u32(f->map + 8, PWF_VERSION);
+    put_u32(f->map + 12, k);
+    put_u64(f->map + 16, nblocks);
+    f->k = k;
+    f->nblocks = nblocks;
+    *out = f;
+    return 0;
+}
+
+/**
+ * Add `pw' to the password filter `f' from _kadm5_pw_filter_create().
+ */
+
+void
+_kadm5_pw_filter_add(struct kadm5_pw_filter *f, const void *pw, size_t len)
+{
+    unsigned char *block;
+    uint64_t h1, h2;
+    uint32_t i, bit;
+
+    block = pwf_locate(f, pw, len, &h1, &h2);
+    for (i = 0; i < f->k; i++) {
+	bit = (h1 + i * h2) % PWF_BLOCK_BITS;
+	block[bit / 8] |= 1 << (bit % 8);
+    }
+    f->count++;
+}
+
+/**
+ * Write the password filter `f' to the file `path', atomically.
+ */
+
+krb5_error_code
+_kadm5_pw_filter_write(krb5_context context, struct kadm5_pw_filter *f,
+		       const char *path)
+{
+    krb5_error_code ret = 0;
+    size_t done;
+    ssize_t bytes;
+    char *tmp;
+    int fd;
+
+    put_u64(f->map + 24, f->count);
+
+    if (asprintf(&tmp, "%s.tmp", path) == -1 || tmp == NULL)
+	return krb5_enomem(context);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+	ret = errno;
+	krb5_set_error_message(context, ret, "open %s: %s",
+			       tmp, strerror(ret));
+	free(tmp);
+	return ret;
+    }
+    for (done = 0; done < f->size; done += bytes) {
+	bytes = write(fd, f->map + done, f->size - done);
+	if (bytes <= 0) {
+	    ret = bytes < 0 ? errno : EIO;
+	    break;
+	}
+    }
+    if (ret == 0 && fsync(fd) == -1)
+	ret = errno;
+    if (close(fd) == -1 && ret == 0)
+	ret = errno;
+    if (ret == 0 && rename(tmp, path) == -1)
+	ret = errno;
+    if (ret) {
+	krb5_set_error_message(context, ret, "write %s: %s",
+			       path, strerror(ret));
+	unlink(tmp);
+    }
+    free(tmp);
+    return ret;
+}
@@ -35,35 +35,21 @@
 
 RCSID("$Id$");
 
-kadm5_ret_t
-kadm5_c_randkey_principal(void *server_handle,
-			  krb5_principal princ,
-			  krb5_boolean keepold,
-			  int n_ks_tuple,
-			  krb5_key_salt_tuple *ks_tuple,
-			  krb5_keyblock **new_keys,
-			  int *n_keys)
+static kadm5_ret_t
+randkey_send(kadm5_client_context *context,
+	     krb5_principal princ,
+	     krb5_boolean keepold,
+	     int n_ks_tuple,
+	     krb5_key_salt_tuple *ks_tuple)
 {
-    kadm5_client_context *context = server_handle;
     kadm5_ret_t ret;
     krb5_storage *sp;
     unsigned char buf[1536];
-    int32_t tmp;
     size_t i;
-    krb5_data reply;
-    krb5_keyblock *k;
-
-    ret = _kadm5_connect(server_handle, 1 /* want_write */);
-    if (ret)
-	return ret;
-
-    krb5_data_zero(&reply);
 
     sp = krb5_storage_from_mem(buf, sizeof(buf));
-    if (sp == NULL) {
-	ret = krb5_enomem(context->context);
-	goto out_keep_error;
-    }
+    if (sp == NULL)
+	return krb5_enomem(context->context);
 
     /*
      * NOTE WELL: This message is extensible.  It currently consists of:
@@ -96,17 +82,30 @@ kadm5_c_randkey_principal(void *server_handle,
             krb5_store_int32(sp, ks_tuple[i].ks_salttype);
     }
     /* Future extensions go here */
-    if (ret)
-	goto out;
+    if (ret) {
+	krb5_clear_error_message(context->context);
+	krb5_storage_free(sp);
+	return ret;
+    }
 
     ret = _kadm5_client_send(context, sp);
-    if (ret)
-	goto out_keep_error;
-    ret = _kadm5_client_recv(context, &reply);
-    if (ret)
-	goto out_keep_error;
     krb5_storage_free(sp);
-    sp = krb5_storage_from_data(&reply);
+    return ret;
+}
+
+static kadm5_ret_t
+randkey_reply(kadm5_client_context *context,
+	      krb5_data *reply,
+	      krb5_keyblock **new_keys,
+	      int *n_keys)
+{
+    kadm5_ret_t ret;
+    krb5_storage *sp;
+    int32_t tmp;
+    size_t i;
+    krb5_keyblock *k;
+
+    sp = krb5_storage_from_data(reply);
     if (sp == NULL) {
 	ret = krb5_enomem(context->context);
 	goto out_keep_error;
@@ -149,6 +148,87 @@ kadm5_c_randkey_principal(void *server_handle,
 
   out_keep_error:
     krb5_storage_free(sp);
-    krb5_data_free(&reply);
+    krb5_data_free(reply);
     return ret;
 }
+
+kadm5_ret_t
+kadm5_c_randkey_principal(void *server_handle,
+			  krb5_principal princ,
+			  krb5_boolean keepold,
+			  int n_ks_tuple,
+			  krb5_key_salt_tuple *ks_tuple,
+			  krb5_keyblock **new_keys,
+			  int *n_keys)
+{
+    kadm5_client_context *context = server_handle;
+    kadm5_ret_t ret;
+    krb5_data reply;
+
+    ret = _kadm5_connect(server_handle, 1 /* want_write */);
+    if (ret)
+	return ret;
+
+    ret = randkey_send(context, princ, keepold, n_ks_tuple, ks_tuple);
+    if (ret == 0)
+	ret = _kadm5_client_recv(context, &reply);
+    if (ret == 0)
+	ret = randkey_reply(context, &reply, new_keys, n_keys);
+    return ret;
+}
+
+/*
+ * Requests sent ahead of their replies; small enough that the replies
+ * fit in the socket buffers, so that neither side blocks writing.
+ */
+#define RANDKEY_WINDOW 32
+
+/*
+ * Pipeline the randkey requests for `princs', so that a kadmind with
+ * [kadmin] batch-requests set can commit them in batches.
+ */
+kadm5_ret_t
+kadm5_c_randkey_principals(void *server_handle,
+			   krb5_principal *princs,
+			   int n_princs,
+			   krb5_boolean keepold,
+			   int n_ks_tuple,
+			   krb5_key_salt_tuple *ks_tuple,
+			   int (*cb)(void *, krb5_const_principal,
+				     kadm5_ret_t, krb5_keyblock *, int),
+			   void *cbdata)
+{
+    kadm5_client_context *context = server_handle;
+    kadm5_ret_t ret, cbret = 0;
+    krb5_keyblock *keys;
+    krb5_data reply;
+    int n_keys;
+    int sent = 0, received = 0;
+
+    ret = _kadm5_connect(server_handle, 1 /* want_write */);
+    if (ret)
+	return ret;
+
+    while (received < n_princs) {
+	while (sent < n_princs && sent - received < RANDKEY_WINDOW) {
+	    ret = randkey_send(context, princs[sent], keepold, n_ks_tuple,
+			       ks_tuple);
+	    if (ret)
+		return ret;
+	    sent++;
+	}
+	ret = _kadm5_client_recv(context, &reply);
+	if (ret)
+	    return ret;
+	keys = NULL;
+	n_keys = 0;
+	ret = randkey_reply(context, &reply, &keys, &n_keys);
+	if (cbret == 0)
+	    cbret = (*cb)(cbdata, princs[received], ret, keys, n_keys);
+	while (n_keys > 0)
+	    krb5_free_keyblock_contents(context->context, &keys[--n_keys]);
+	free(keys);
+	received++;
+    }
+    return cbret;
+}
@@ -202,3 +202,77 @@ kadm5_s_randkey_principal(void *server_handle,
     }
     return _kadm5_error_code(ret);
 }
+
+/* Principals rekeyed per lock and group commit */
+#define RANDKEY_BATCH 1000
+
+struct randkey_result {
+    kadm5_ret_t ret;
+    krb5_keyblock *keys;
+    int n_keys;
+};
+
+/*
+ * Set the keys of each of `princs' to random values, as with
+ * kadm5_s_randkey_principal(), but with the database locked and the
+ * changes group-committed for a batch of principals at a time.  The
+ * results are passed to `cb' once their batch is committed.
+ */
+
+kadm5_ret_t
+kadm5_s_randkey_principals(void *server_handle,
+			   krb5_principal *princs,
+			   int n_princs,
+			   krb5_boolean keepold,
+			   int n_ks_tuple,
+			   krb5_key_salt_tuple *ks_tuple,
+			   int (*cb)(void *, krb5_const_principal,
+				     kadm5_ret_t, krb5_keyblock *, int),
+			   void *cbdata)
+{
+    kadm5_server_context *context = server_handle;
+    struct randkey_result *res;
+    kadm5_ret_t ret = 0;
+    int locked = 0;
+    int i, j, n;
+
+    res = calloc(n_princs < RANDKEY_BATCH ? n_princs + 1 : RANDKEY_BATCH,
+		 sizeof(res[0]));
+    if (res == NULL)
+	return krb5_enomem(context->context);
+
+    for (i = 0; ret == 0 && i < n_princs; i += n) {
+	n = n_princs - i < RANDKEY_BATCH ? n_princs - i : RANDKEY_BATCH;
+
+	if (!context->keep_open) {
+	    ret = kadm5_lock(server_handle);
+	    if (ret)
+		break;
+	    locked = 1;
+	}
+	for (j = 0; j < n; j++) {
+	    res[j].keys = NULL;
+	    res[j].n_keys = 0;
+	    res[j].ret = kadm5_s_randkey_principal(server_handle, princs[i + j],
+						   keepold, n_ks_tuple,
+						   ks_tuple, &res[j].keys,
+						   &res[j].n_keys);
+	}
+	if (locked) {
+	    ret = kadm5_log_group_commit(context);
+	    (void) kadm5_unlock(server_handle);
+	    locked = 0;
+	}
+	for (j = 0; j < n; j++) {
+	    if (ret == 0)
+		ret = (*cb)(cbdata, princs[i + j], res[j].ret, res[j].keys,
+			    res[j].n_keys);
+	    while (res[j].n_keys > 0)
+		krb5_free_keyblock_contents(context->context,
+					    &res[j].keys[--res[j].n_keys]);
+	    free(res[j].keys);
+	}
+    }
+    free(res);
+    return ret;
+}
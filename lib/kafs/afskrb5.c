@@ -37,6 +37,7 @@ struct krb5_kafs_data {
     krb5_context context;
     krb5_ccache id;
     krb5_const_realm realm;
+    int cached_only;
 };
 
 enum {
@@ -172,7 +173,9 @@ get_cred(struct kafs_data *data, const char *name, const char *inst,
     if (invalid)
 	krb5_enctype_enable(d->context, ETYPE_DES_CBC_CRC);
 
-    ret = krb5_get_credentials(d->context, 0, d->id, &in_creds, &out_creds);
+    ret = krb5_get_credentials(d->context,
+			       d->cached_only ? KRB5_GC_CACHED : 0,
+			       d->id, &in_creds, &out_creds);
 
     if (invalid)
 	krb5_enctype_disable(d->context, ETYPE_DES_CBC_CRC);
@@ -203,6 +206,40 @@ free_error(struct kafs_data *data, const char *str)
     krb5_free_error_message(d->context, str);
 }
 
+/*
+ * Is the token we already hold for `cell' good enough to keep?  That
+ * is when it has afs-token-min-lifetime left or, by default, when it
+ * lasts about as long as the TGT, so that a new one could not last
+ * longer.
+ */
+
+static int
+token_is_fresh(struct krb5_kafs_data *d, const char *cell)
+{
+    time_t endtime, min_life, now = time(NULL);
+    char *c;
+
+    if (_kafs_token_endtime(cell, &endtime) != 0 || endtime <= now)
+	return 0;
+
+    c = strdup(cell);
+    if (c == NULL)
+	return 0;
+    _kafs_foldup(c, c);
+    krb5_appdefault_time(d->context, "libkafs", c,
+			 "afs-token-min-lifetime", 0, &min_life);
+    free(c);
+
+    if (min_life <= 0) {
+	if (krb5_cc_get_lifetime(d->context, d->id, &min_life) != 0)
+	    return 0;
+	min_life -= 5 * 60;
+	if (min_life <= 0)
+	    return 0;
+    }
+    return endtime - now >= min_life;
+}
+
 static krb5_error_code
 afslog_uid_int(struct kafs_data *data, const char *cell, const char *rh,
 	       uid_t uid, const char *homedir)
@@ -216,14 +253,26 @@ afslog_uid_int(struct kafs_data *data, const char *cell, const char *rh,
     if (cell == 0 || cell[0] == 0)
 	return _kafs_afslog_all_local_cells (data, uid, homedir);
 
+    if (token_is_fresh(d, cell))
+	return 0;
+
     ret = krb5_cc_get_principal (d->context, d->id, &princ);
     if (ret)
 	return ret;
 
     trealm = krb5_principal_get_realm (d->context, princ);
 
+    /*
+     * Which of the principals _kafs_get_cred() tries works for a cell
+     * rarely changes, so look for all of them in the ccache before
+     * sending the KDC requests that would fail on the way.
+     */
     kt.ticket = NULL;
+    d->cached_only = 1;
     ret = _kafs_get_cred(data, cell, d->realm, trealm, uid, &kt);
+    d->cached_only = 0;
+    if (ret)
+	ret = _kafs_get_cred(data, cell, d->realm, trealm, uid, &kt);
     krb5_free_principal (d->context, princ);
 
     if(ret == 0) {
@@ -278,6 +327,7 @@ krb5_afslog_uid_home(krb5_context context,
     } else
 	d.id = id;
     d.realm = realm;
+    d.cached_only = 0;
     ret = afslog_uid_int(&kd, cell, 0, uid, homedir);
     if (id == NULL)
 	krb5_cc_close(context, d.id);
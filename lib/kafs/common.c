@@ -116,6 +116,53 @@ kafs_settoken_rxkad(const char *cell, struct ClearToken *ct,
     return k_pioctl(0, VIOCSETTOK, &parms, 0);
 }
 
+/*
+ * Find the end time of the token held for `cell', by walking the
+ * tokens with VIOCGETTOK.  Each comes back as the secret token and
+ * the clear token, each preceded by its length, then the primary
+ * flag and the cell name.
+ */
+
+int
+_kafs_token_endtime(const char *cell, time_t *endtime)
+{
+    struct ViceIoctl parms;
+    struct ClearToken ct;
+    char buf[2048], *t, *end;
+    int32_t i, len;
+
+    for (i = 0; ; i++) {
+	parms.in = (void *)&i;
+	parms.in_size = sizeof(i);
+	parms.out = buf;
+	parms.out_size = sizeof(buf);
+	if (k_pioctl(0, VIOCGETTOK, &parms, 0) != 0)
+	    break;
+
+	t = buf;
+	end = buf + sizeof(buf);
+	memcpy(&len, t, sizeof(len));
+	t += sizeof(len);
+	if (len < 0 || len > end - t - (ptrdiff_t)sizeof(len))
+	    continue;
+	t += len;
+	memcpy(&len, t, sizeof(len));
+	t += sizeof(len);
+	if (len != sizeof(ct) ||
+	    len + sizeof(int32_t) >= (size_t)(end - t))
+	    continue;
+	memcpy(&ct, t, sizeof(ct));
+	t += sizeof(ct) + sizeof(int32_t);
+	if (memchr(t, '\0', end - t) == NULL)
+	    continue;
+	if (strcmp(t, cell) == 0) {
+	    *endtime = ct.EndTimestamp;
+	    return 0;
+	}
+    }
+    return ENOENT;
+}
+
 void
 _kafs_fixup_viceid(struct ClearToken *ct, uid_t uid)
 {
@@ -152,6 +152,9 @@ _kafs_v4_to_kt(CREDENTIALS *, uid_t, struct kafs_token *);
 void
 _kafs_fixup_viceid(struct ClearToken *, uid_t);
 
+int
+_kafs_token_endtime(const char *, time_t *);
+
 int
 _kafs_derive_des_key(krb5_enctype, void *, size_t, char[8]);
 
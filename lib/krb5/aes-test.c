@@ -303,6 +303,65 @@ string_to_key_test(krb5_context context)
     return val;
 }
 
+/*
+ * krb5_string_to_keys_data_salt_opaque() must give the same keys as
+ * one krb5_string_to_key_data_salt_opaque() per enctype.
+ */
+static int
+string_to_keys_test(krb5_context context)
+{
+    static const krb5_enctype enctypes[] = {
+	ETYPE_AES256_CTS_HMAC_SHA1_96,
+	ETYPE_ARCFOUR_HMAC_MD5,
+	ETYPE_AES128_CTS_HMAC_SHA1_96,
+	ETYPE_AES128_CTS_HMAC_SHA256_128,
+    };
+    const size_t n = sizeof(enctypes)/sizeof(enctypes[0]);
+    krb5_keyblock batch[sizeof(enctypes)/sizeof(enctypes[0])], key;
+    krb5_data password, opaque;
+    krb5_error_code ret;
+    krb5_salt salt;
+    size_t i;
+    int val = 0;
+
+    password.data = "password";
+    password.length = strlen(password.data);
+    salt.salttype = KRB5_PW_SALT;
+    salt.saltvalue.data = "ATHENA.MIT.EDUraeburn";
+    salt.saltvalue.length = strlen(salt.saltvalue.data);
+    krb5_data_zero(&opaque);
+
+    ret = krb5_string_to_keys_data_salt_opaque(context, n, enctypes,
+					       password, salt, opaque, batch);
+    if (ret) {
+	krb5_warn(context, ret, "string_to_keys_data_salt_opaque");
+	return 1;
+    }
+
+    for (i = 0; i < n; i++) {
+	ret = krb5_string_to_key_data_salt_opaque(context, enctypes[i],
+						  password, salt, opaque,
+						  &key);
+	if (ret) {
+	    krb5_warn(context, ret, "%lu: string_to_key_data_salt_opaque",
+		      (unsigned long)i);
+	    val = 1;
+	    continue;
+	}
+	if (batch[i].keytype != key.keytype ||
+	    batch[i].keyvalue.length != key.keyvalue.length ||
+	    memcmp(batch[i].keyvalue.data, key.keyvalue.data,
+		   key.keyvalue.length) != 0) {
+	    krb5_warnx(context, "%lu: batch key differs", (unsigned long)i);
+	    val = 1;
+	}
+	krb5_free_keyblock_contents(context, &key);
+    }
+    for (i = 0; i < n; i++)
+	krb5_free_keyblock_contents(context, &batch[i]);
+    return val;
+}
+
 static int
 krb_enc(krb5_context context,
 	krb5_crypto crypto,
@@ -1028,6 +1087,7 @@ main(int argc, char **argv)
 	errx (1, "krb5_init_context failed: %d", ret);
 
     val |= string_to_key_test(context);
+    val |= string_to_keys_test(context);
 
     val |= krb_enc_test(context);
     val |= random_to_key(context);
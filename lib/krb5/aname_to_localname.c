@@ -278,26 +278,11 @@ an2ln_default(krb5_context context,
     return 0;
 }
 
-/**
- * Map a principal name to a local username.
- *
- * Returns 0 on success, KRB5_NO_LOCALNAME if no mapping was found, or
- * some Kerberos or system error.
- *
- * Inputs:
- *
- * @param context    A krb5_context
- * @param aname      A principal name
- * @param lnsize     The size of the buffer into which the username will be written
- * @param lname      The buffer into which the username will be written
- *
- * @ingroup krb5_support
- */
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_aname_to_localname(krb5_context context,
-			krb5_const_principal aname,
-			size_t lnsize,
-			char *lname)
+static krb5_error_code
+aname_to_localname(krb5_context context,
+		   krb5_const_principal aname,
+		   size_t lnsize,
+		   char *lname)
 {
     static heim_base_once_t reg_def_plugins = HEIM_BASE_ONCE_INIT;
     krb5_error_code ret;
@@ -366,6 +351,51 @@ krb5_aname_to_localname(krb5_context context,
     return ret;
 }
 
+/**
+ * Map a principal name to a local username.
+ *
+ * Returns 0 on success, KRB5_NO_LOCALNAME if no mapping was found, or
+ * some Kerberos or system error.
+ *
+ * Inputs:
+ *
+ * @param context    A krb5_context
+ * @param aname      A principal name
+ * @param lnsize     The size of the buffer into which the username will be written
+ * @param lname      The buffer into which the username will be written
+ *
+ * @ingroup krb5_support
+ */
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_aname_to_localname(krb5_context context,
+			krb5_const_principal aname,
+			size_t lnsize,
+			char *lname)
+{
+    krb5_error_code ret;
+    const char *cached;
+    char buf[1024];
+
+    if (context->lname_cache_ttl <= 0)
+	return aname_to_localname(context, aname, lnsize, lname);
+
+    if (!_krb5_lname_cache_get_an2ln(context, aname, &cached, &ret)) {
+	ret = aname_to_localname(context, aname, sizeof(buf), buf);
+	if (ret == KRB5_CONFIG_NOTENUFSPACE)
+	    return aname_to_localname(context, aname, lnsize, lname);
+	if (ret != 0 && ret != KRB5_NO_LOCALNAME)
+	    return ret; /* don't cache what may be transient */
+	_krb5_lname_cache_put_an2ln(context, aname, buf, ret);
+	cached = buf;
+    }
+
+    if (lnsize)
+	lname[0] = '\0';
+    if (ret == 0 && strlcpy(lname, cached, lnsize) >= lnsize)
+	ret = KRB5_CONFIG_NOTENUFSPACE;
+    return ret;
+}
+
 static krb5_error_code KRB5_LIB_CALL
 an2ln_def_plug_init(krb5_context context, void **ctx)
 {
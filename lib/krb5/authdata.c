@@ -57,38 +57,37 @@ _kdc_tkt_add_if_relevant_ad(krb5_context context,
 
     /* add the entry to the last element */
     {
-	AuthorizationData ad = { 0, NULL };
-	AuthorizationDataElement ade;
+	AuthorizationDataElement inner, *val;
+	AuthorizationData ad;
+	krb5_data enc;
 
-	ade.ad_type = type;
-	ade.ad_data = *data;
+	/* Wrap `data' without copying it, it is only read by the encoder */
+	inner.ad_type = type;
+	inner.ad_data = *data;
+	ad.len = 1;
+	ad.val = &inner;
 
-	ret = add_AuthorizationData(&ad, &ade);
-	if (ret) {
-	    krb5_set_error_message(context, ret, "add AuthorizationData failed");
-	    return ret;
-	}
-
-	ade.ad_type = KRB5_AUTHDATA_IF_RELEVANT;
-
-	ASN1_MALLOC_ENCODE(AuthorizationData,
-			   ade.ad_data.data, ade.ad_data.length,
+	ASN1_MALLOC_ENCODE(AuthorizationData, enc.data, enc.length,
 			   &ad, &size, ret);
-	free_AuthorizationData(&ad);
 	if (ret) {
 	    krb5_set_error_message(context, ret, "ASN.1 encode of "
 				   "AuthorizationData failed");
 	    return ret;
 	}
-	if (ade.ad_data.length != size)
+	if (enc.length != size)
 	    krb5_abortx(context, "internal asn.1 encoder error");
 
-	ret = add_AuthorizationData(tkt->authorization_data, &ade);
-	der_free_octet_string(&ade.ad_data);
-	if (ret) {
-	    krb5_set_error_message(context, ret, "add AuthorizationData failed");
-	    return ret;
+	/* The ticket takes over the encoding */
+	val = realloc(tkt->authorization_data->val,
+		      (tkt->authorization_data->len + 1) * sizeof(*val));
+	if (val == NULL) {
+	    krb5_data_free(&enc);
+	    return krb5_enomem(context);
 	}
+	tkt->authorization_data->val = val;
+	val[tkt->authorization_data->len].ad_type = KRB5_AUTHDATA_IF_RELEVANT;
+	val[tkt->authorization_data->len].ad_data = enc;
+	tkt->authorization_data->len++;
     }
 
     return 0;
@@ -105,7 +104,6 @@ _kdc_tkt_insert_pac(krb5_context context,
 		    const krb5_data *data)
 {
     AuthorizationDataElement ade;
-    unsigned int i;
     krb5_error_code ret;
 
     ret = _kdc_tkt_add_if_relevant_ad(context, tkt, KRB5_AUTHDATA_WIN2K_PAC,
@@ -115,9 +113,8 @@ _kdc_tkt_insert_pac(krb5_context context,
 
     heim_assert(tkt->authorization_data->len != 0, "No authorization_data!");
     ade = tkt->authorization_data->val[tkt->authorization_data->len - 1];
-    for (i = 0; i < tkt->authorization_data->len - 1; i++) {
-	tkt->authorization_data->val[i + 1] = tkt->authorization_data->val[i];
-    }
+    memmove(&tkt->authorization_data->val[1], &tkt->authorization_data->val[0],
+	    (tkt->authorization_data->len - 1) * sizeof(ade));
     tkt->authorization_data->val[0] = ade;
 
     return 0;
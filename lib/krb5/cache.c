@@ -105,6 +105,20 @@ cc_get_prefix_ops(krb5_context context,
 		  const char *prefix,
 		  const char **residual);
 
+/*
+ * Register ccache types from plugins the first time the types are
+ * looked at, they override the built-in ones.
+ */
+
+static void
+load_cc_plugins(krb5_context context)
+{
+    if (context->flags & KRB5_CTX_F_CC_PLUGINS_LOADED)
+	return;
+    context->flags |= KRB5_CTX_F_CC_PLUGINS_LOADED;
+    (void) _krb5_load_ccache_plugins(context);
+}
+
 /**
  * Add a new ccache type with operations `ops', overwriting any
  * existing one if `override'.
@@ -123,6 +137,20 @@ KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_cc_register(krb5_context context,
 		 const krb5_cc_ops *ops,
 		 krb5_boolean override)
+{
+    load_cc_plugins(context);
+    return _krb5_cc_register(context, ops, override);
+}
+
+/*
+ * krb5_cc_register() without registering the plugins first, for the
+ * built-in types.
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+_krb5_cc_register(krb5_context context,
+		  const krb5_cc_ops *ops,
+		  krb5_boolean override)
 {
     int i;
 
@@ -1412,6 +1440,7 @@ cc_get_prefix_ops(krb5_context context,
 	return &krb5_fcc_ops;
 #endif
 
+    load_cc_plugins(context);
     for(i = 0; i < context->num_cc_ops && context->cc_ops[i]->prefix; i++) {
 	size_t prefix_len = strlen(context->cc_ops[i]->prefix);
 
@@ -1888,6 +1917,7 @@ krb5_cccol_cursor_next(krb5_context context, krb5_cccol_cursor cursor,
 
     *cache = NULL;
 
+    load_cc_plugins(context);
     while (cursor->idx < context->num_cc_ops) {
 
 	if (cursor->cursor == NULL) {
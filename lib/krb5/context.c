@@ -105,13 +105,25 @@ init_context_from_config_file(krb5_context context)
 {
     krb5_error_code ret;
     const char * tmp;
-    char **s;
     krb5_enctype *tmptypes;
 
+    /* [capaths] may have changed */
+    _krb5_transited_cache_free(context);
+    /* and so may [libdefaults] kuserok and auth_to_local rules */
+    _krb5_lname_cache_free(context);
+
     INIT_FIELD(context, time, max_skew, 5 * 60, "clockskew");
     INIT_FIELD(context, time, kdc_timeout, 30, "kdc_timeout");
     INIT_FIELD(context, time, host_timeout, 3, "host_timeout");
+    INIT_FIELD(context, time, kdc_tcp_reuse_timeout, 2,
+	       "kdc_tcp_reuse_timeout");
+    INIT_FIELD(context, time, preauth_hint_lifetime, 0,
+	       "preauth_hint_lifetime");
+    INIT_FIELD(context, int, kdc_parallel, 1, "kdc_parallel");
+    INIT_FIELD(context, int, kdc_parallel_delay, 1000, "kdc_parallel_delay");
     INIT_FIELD(context, int, max_retries, 3, "max_retries");
+    INIT_FIELD(context, time, tgs_negative_timeout, 0,
+	       "tgs_negative_timeout");
 
     INIT_FIELD(context, string, http_proxy, NULL, "http_proxy");
 
@@ -187,6 +199,11 @@ init_context_from_config_file(krb5_context context)
     context->no_ticket_store =
         getenv("KRB5_NO_TICKET_STORE") != NULL;
 
+    INIT_FIELD(context, string, shared_ticket_cache, NULL,
+	       "shared_ticket_cache");
+    INIT_FIELD(context, int, rd_req_ticket_cache, 0, "rd_req_ticket_cache");
+    INIT_FIELD(context, time, lname_cache_ttl, 0, "local_name_cache_ttl");
+
     /* init dns-proxy slime */
     tmp = krb5_config_get_string(context, NULL, "libdefaults",
 				 "dns_proxy", NULL);
@@ -252,17 +269,8 @@ init_context_from_config_file(krb5_context context)
     context->default_cc_name_set = 0;
     context->configured_default_cc_name = NULL;
 
-    tmp = secure_getenv("KRB5_TRACE");
-    if (tmp)
-        heim_add_debug_dest(context->hcontext, "libkrb5", tmp);
-    s = krb5_config_get_strings(context, NULL, "logging", "krb5", NULL);
-    if (s) {
-	char **p;
-
-        for (p = s; *p; p++)
-            heim_add_debug_dest(context->hcontext, "libkrb5", *p);
-        krb5_config_free_strings(s);
-    }
+    /* Debug destinations are opened by the first debug call */
+    context->flags |= KRB5_CTX_F_DEBUG_DEST_PENDING;
 
     tmp = krb5_config_get_string(context, NULL, "libdefaults",
 				 "check-rd-req-server", NULL);
@@ -278,6 +286,11 @@ init_context_from_config_file(krb5_context context)
     if (ret)
 	context->flags |= KRB5_CTX_F_FCACHE_STRICT_CHECKING;
 
+    /* Process-wide, and once on left on */
+    if (krb5_config_get_bool_default(context, NULL, FALSE, "libdefaults",
+				     "memory_accounting", NULL))
+	heim_mem_account_enable(1);
+
     return 0;
 }
 
@@ -288,24 +301,24 @@ cc_ops_register(krb5_context context)
     context->num_cc_ops = 0;
 
 #ifndef KCM_IS_API_CACHE
-    krb5_cc_register(context, &krb5_acc_ops, TRUE);
+    _krb5_cc_register(context, &krb5_acc_ops, TRUE);
 #endif
-    krb5_cc_register(context, &krb5_fcc_ops, TRUE);
-    krb5_cc_register(context, &krb5_dcc_ops, TRUE);
-    krb5_cc_register(context, &krb5_mcc_ops, TRUE);
+    _krb5_cc_register(context, &krb5_fcc_ops, TRUE);
+    _krb5_cc_register(context, &krb5_dcc_ops, TRUE);
+    _krb5_cc_register(context, &krb5_mcc_ops, TRUE);
 #ifdef HAVE_SCC
-    krb5_cc_register(context, &krb5_scc_ops, TRUE);
+    _krb5_cc_register(context, &krb5_scc_ops, TRUE);
 #endif
 #ifdef HAVE_KCM
 #ifdef KCM_IS_API_CACHE
-    krb5_cc_register(context, &krb5_akcm_ops, TRUE);
+    _krb5_cc_register(context, &krb5_akcm_ops, TRUE);
 #endif
-    krb5_cc_register(context, &krb5_kcm_ops, TRUE);
+    _krb5_cc_register(context, &krb5_kcm_ops, TRUE);
 #endif
 #if defined(HAVE_KEYUTILS_H)
-    krb5_cc_register(context, &krb5_krcc_ops, TRUE);
+    _krb5_cc_register(context, &krb5_krcc_ops, TRUE);
 #endif
-    _krb5_load_ccache_plugins(context);
+    /* Plugins are registered by the first lookup, see cache.c */
     return 0;
 }
 
@@ -390,6 +403,12 @@ static const char *sysplugin_dirs[] =  {
 
 static void
 init_context_once(void *ctx)
+{
+    bindtextdomain(HEIMDAL_TEXTDOMAIN, HEIMDAL_LOCALEDIR);
+}
+
+static void
+init_plugins_once(void *ctx)
 {
     krb5_context context = ctx;
     char **dirs;
@@ -407,8 +426,20 @@ init_context_once(void *ctx)
 
     if (dirs != rk_UNCONST(sysplugin_dirs))
 	krb5_config_free_strings(dirs);
+}
 
-    bindtextdomain(HEIMDAL_TEXTDOMAIN, HEIMDAL_LOCALEDIR);
+/*
+ * Scanning the plugin directories opens every DSO in them, so it is
+ * left to the first caller that needs plugins rather than done by
+ * krb5_init_context().
+ */
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+_krb5_init_plugins(krb5_context context)
+{
+    static heim_base_once_t init_plugins = HEIM_BASE_ONCE_INIT;
+
+    heim_base_once_f(&init_plugins, context, init_plugins_once);
 }
 
 /**
@@ -433,6 +464,7 @@ krb5_init_context(krb5_context *context)
     static heim_base_once_t init_context = HEIM_BASE_ONCE_INIT;
     krb5_context p;
     krb5_error_code ret;
+    const char *cache;
     char **files;
     uint8_t rnd;
 
@@ -463,6 +495,10 @@ krb5_init_context(krb5_context *context)
     if (!issuid())
         p->flags |= KRB5_CTX_F_HOMEDIR_ACCESS;
 
+    if ((cache = secure_getenv("KRB5_CONFIG_CACHE")) != NULL &&
+        (ret = heim_context_set_config_cache(p->hcontext, cache)))
+        goto out;
+
     ret = krb5_get_default_config_files(&files);
     if(ret)
 	goto out;
@@ -471,7 +507,6 @@ krb5_init_context(krb5_context *context)
     if(ret)
 	goto out;
 
-    /* done enough to load plugins */
     heim_base_once_f(&init_context, p, init_context_once);
 
     /* init error tables */
@@ -610,6 +645,7 @@ krb5_copy_context(krb5_context context, krb5_context *out)
     _krb5_init_ets(p);
 
     cc_ops_copy(p, context);
+    p->flags |= context->flags & KRB5_CTX_F_CC_PLUGINS_LOADED;
     kt_ops_copy(p, context);
 
     ret = krb5_set_extra_addresses(p, context->extra_addresses);
@@ -666,6 +702,9 @@ krb5_free_context(krb5_context context)
     krb5_set_extra_addresses(context, NULL);
     krb5_set_ignore_addresses(context, NULL);
     krb5_set_send_to_kdc_func(context, NULL, NULL);
+    _krb5_kdc_conns_free(context);
+    _krb5_transited_cache_free(context);
+    _krb5_lname_cache_free(context);
 
 #ifdef PKINIT
     hx509_context_free(&context->hx509ctx);
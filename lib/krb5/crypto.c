@@ -1605,6 +1605,57 @@ iov_uncoalesce(krb5_context context,
     return 0;
 }
 
+/*
+ * Encrypt-then-checksum enctypes checksum `prefix' (the ivec) followed
+ * by the bytes iov_coalesce(..., TRUE, ...) would flatten.  Make a
+ * list of buffers that covers the same bytes in the same order, so the
+ * checksum can be computed without a copy.  Padding is checksummed as
+ * zeros.  Free the list with free().
+ */
+static krb5_error_code
+iov_sign_list(krb5_context context,
+	      krb5_data *prefix,
+	      krb5_crypto_iov *data,
+	      int num_data,
+	      krb5_crypto_iov **out,
+	      int *num_out)
+{
+    static const unsigned char zeros[EVP_MAX_BLOCK_LENGTH];
+    krb5_crypto_iov *hiv, *piv, *l;
+    int i, n = 0;
+
+    hiv = iov_find(data, num_data, KRB5_CRYPTO_TYPE_HEADER);
+    piv = iov_find(data, num_data, KRB5_CRYPTO_TYPE_PADDING);
+
+    heim_assert(piv == NULL || piv->data.length <= sizeof(zeros),
+		"padding too big for checksum");
+
+    l = calloc(num_data + 3, sizeof(l[0]));
+    if (l == NULL)
+	return krb5_enomem(context);
+
+    l[n].flags = KRB5_CRYPTO_TYPE_DATA;
+    l[n++].data = *prefix;
+    l[n].flags = KRB5_CRYPTO_TYPE_DATA;
+    l[n++].data = hiv->data;
+    for (i = 0; i < num_data; i++) {
+	if (data[i].flags == KRB5_CRYPTO_TYPE_DATA ||
+	    data[i].flags == KRB5_CRYPTO_TYPE_SIGN_ONLY) {
+	    l[n].flags = KRB5_CRYPTO_TYPE_DATA;
+	    l[n++].data = data[i].data;
+	}
+    }
+    if (piv) {
+	l[n].flags = KRB5_CRYPTO_TYPE_DATA;
+	l[n].data.data = rk_UNCONST(zeros);
+	l[n++].data.length = piv->data.length;
+    }
+
+    *out = l;
+    *num_out = n;
+    return 0;
+}
+
 static krb5_error_code
 iov_pad_validate(const struct _krb5_encryption_type *et,
 		 krb5_crypto_iov *data,
@@ -1675,11 +1726,12 @@ krb5_encrypt_iov_ivec(krb5_context context,
 {
     size_t headersz, trailersz;
     Checksum cksum;
-    krb5_data enc_data, sign_data;
+    krb5_data enc_data;
     krb5_error_code ret;
     struct _krb5_key_data *dkey;
     const struct _krb5_encryption_type *et = crypto->et;
-    krb5_crypto_iov *tiv, *piv, *hiv;
+    krb5_crypto_iov *tiv, *piv, *hiv, *sign_iov = NULL;
+    int num_sign_iov;
 
     if (num_data < 0) {
         krb5_clear_error_message(context);
@@ -1692,7 +1744,6 @@ krb5_encrypt_iov_ivec(krb5_context context,
     }
 
     krb5_data_zero(&enc_data);
-    krb5_data_zero(&sign_data);
 
     headersz = et->confoundersize;
     trailersz = CHECKSUMSIZE(et->keyed_checksum);
@@ -1758,30 +1809,22 @@ krb5_encrypt_iov_ivec(krb5_context context,
 	ivec_data.length = et->blocksize;
 	ivec_data.data = old_ivec;
 
-	ret = iov_coalesce(context, &ivec_data, data, num_data, TRUE, &sign_data);
+	ret = iov_sign_list(context, &ivec_data, data, num_data,
+			    &sign_iov, &num_sign_iov);
 	if(ret)
 	    goto cleanup;
 
-        ret = create_checksum(context,
-                              et->keyed_checksum,
-                              crypto,
-                              INTEGRITY_USAGE(usage),
-                              sign_data.data,
-                              sign_data.length,
-                              0,
-                              &cksum);
-
-        if(ret == 0 && cksum.checksum.length != trailersz) {
-            free_Checksum (&cksum);
-            krb5_clear_error_message (context);
-            ret = KRB5_CRYPTO_INTERNAL;
-        }
-        if (ret)
-            goto cleanup;
-
-        /* save cksum at end */
-        memcpy(tiv->data.data, cksum.checksum.data, cksum.checksum.length);
-        free_Checksum (&cksum);
+	cksum.checksum = tiv->data;
+	ret = create_checksum_iov(context,
+				  et->keyed_checksum,
+				  crypto,
+				  INTEGRITY_USAGE(usage),
+				  sign_iov,
+				  num_sign_iov,
+				  0,
+				  &cksum);
+	if (ret)
+	    goto cleanup;
 
     } else {
         cksum.checksum = tiv->data;
@@ -1832,10 +1875,7 @@ cleanup:
 	memset_s(enc_data.data, enc_data.length, 0, enc_data.length);
 	krb5_data_free(&enc_data);
     }
-    if (sign_data.data) {
-	memset_s(sign_data.data, sign_data.length, 0, sign_data.length);
-	krb5_data_free(&sign_data);
-    }
+    free(sign_iov);
     return ret;
 }
 
@@ -1869,11 +1909,12 @@ krb5_decrypt_iov_ivec(krb5_context context,
 		      void *ivec)
 {
     Checksum cksum;
-    krb5_data enc_data, sign_data;
+    krb5_data enc_data;
     krb5_error_code ret;
     struct _krb5_key_data *dkey;
     struct _krb5_encryption_type *et = crypto->et;
-    krb5_crypto_iov *tiv, *hiv;
+    krb5_crypto_iov *tiv, *hiv, *sign_iov = NULL;
+    int num_sign_iov;
 
     if(!derived_crypto(context, crypto)) {
 	krb5_clear_error_message(context);
@@ -1897,7 +1938,6 @@ krb5_decrypt_iov_ivec(krb5_context context,
     }
 
     krb5_data_zero(&enc_data);
-    krb5_data_zero(&sign_data);
 
     if (!(et->flags & F_ENC_THEN_CKSUM)) {
 	ret = _get_derived_key(context, crypto, ENCRYPTION_USAGE(usage), &dkey);
@@ -1946,7 +1986,8 @@ krb5_decrypt_iov_ivec(krb5_context context,
 	ivec_data.length = et->blocksize;
 	ivec_data.data = ivec ? ivec : zero_ivec;
 
-	ret = iov_coalesce(context, &ivec_data, data, num_data, TRUE, &sign_data);
+	ret = iov_sign_list(context, &ivec_data, data, num_data,
+			    &sign_iov, &num_sign_iov);
 	if(ret)
 	    goto cleanup;
 
@@ -1954,17 +1995,8 @@ krb5_decrypt_iov_ivec(krb5_context context,
 	cksum.checksum.length = tiv->data.length;
 	cksum.cksumtype       = CHECKSUMTYPE(et->keyed_checksum);
 
-	ret = verify_checksum(context,
-			      crypto,
-			      INTEGRITY_USAGE(usage),
-			      sign_data.data,
-			      sign_data.length,
-			      0,
-			      &cksum);
-	if(ret)
-	    goto cleanup;
-
-	ret = iov_coalesce(context, NULL, data, num_data, FALSE, &enc_data);
+	ret = verify_checksum_iov(context, crypto, INTEGRITY_USAGE(usage),
+				  sign_iov, num_sign_iov, 0, &cksum);
 	if(ret)
 	    goto cleanup;
 
@@ -1976,14 +2008,25 @@ krb5_decrypt_iov_ivec(krb5_context context,
 	if(ret)
 	    goto cleanup;
 
-	ret = (*et->encrypt)(context, dkey, enc_data.data, enc_data.length,
-			     0, usage, ivec);
-	if(ret)
-	    goto cleanup;
+	if (et->encrypt_iov != NULL) {
+	    ret = (*et->encrypt_iov)(context, dkey, data, num_data,
+				     0, usage, ivec);
+	    if(ret)
+		goto cleanup;
+	} else {
+	    ret = iov_coalesce(context, NULL, data, num_data, FALSE, &enc_data);
+	    if(ret)
+		goto cleanup;
 
-	ret = iov_uncoalesce(context, &enc_data, data, num_data);
-	if(ret)
-	    goto cleanup;
+	    ret = (*et->encrypt)(context, dkey, enc_data.data, enc_data.length,
+				 0, usage, ivec);
+	    if(ret)
+		goto cleanup;
+
+	    ret = iov_uncoalesce(context, &enc_data, data, num_data);
+	    if(ret)
+		goto cleanup;
+	}
     }
 
 cleanup:
@@ -1991,10 +2034,7 @@ cleanup:
 	memset_s(enc_data.data, enc_data.length, 0, enc_data.length);
 	krb5_data_free(&enc_data);
     }
-    if (sign_data.data) {
-	memset_s(sign_data.data, sign_data.length, 0, sign_data.length);
-	krb5_data_free(&sign_data);
-    }
+    free(sign_iov);
     return ret;
 }
 
@@ -2198,6 +2238,7 @@ krb5_encrypt_ivec(krb5_context context,
 {
     krb5_error_code ret;
 
+    HEIM_PROBE3(krb5__encrypt__start, CRYPTO_ETYPE(crypto), usage, len);
     switch (crypto->et->flags & F_CRYPTO_MASK) {
     case F_RFC3961_ENC:
 	ret = encrypt_internal_derived(context, crypto, usage,
@@ -2216,6 +2257,7 @@ krb5_encrypt_ivec(krb5_context context,
 	break;
     }
 
+    HEIM_PROBE1(krb5__encrypt__done, ret);
     return ret;
 }
 
@@ -2259,6 +2301,7 @@ krb5_decrypt_ivec(krb5_context context,
 {
     krb5_error_code ret;
 
+    HEIM_PROBE3(krb5__decrypt__start, CRYPTO_ETYPE(crypto), usage, len);
     switch (crypto->et->flags & F_CRYPTO_MASK) {
     case F_RFC3961_ENC:
 	ret = decrypt_internal_derived(context, crypto, usage,
@@ -2277,6 +2320,7 @@ krb5_decrypt_ivec(krb5_context context,
 	break;
     }
 
+    HEIM_PROBE1(krb5__decrypt__done, ret);
     return ret;
 }
 
@@ -2303,6 +2347,187 @@ krb5_decrypt_EncryptedData(krb5_context context,
 			e->cipher.data, e->cipher.length, result);
 }
 
+static void
+batch_free(size_t num, krb5_data *out)
+{
+    size_t i;
+
+    for (i = 0; i < num; i++) {
+	if (out[i].data)
+	    memset_s(out[i].data, out[i].length, 0, out[i].length);
+	krb5_data_free(&out[i]);
+    }
+}
+
+/**
+ * Encrypt several independent messages with the same crypto context
+ * and key usage.
+ *
+ * The output is the same as calling krb5_encrypt() on each message.
+ * For derived-key enctypes the keys are derived and scheduled once and
+ * each message is encrypted in place in its final, exactly sized
+ * buffer, avoiding the intermediate copies and allocations of the
+ * single-message path.
+ *
+ * @param context Kerberos context
+ * @param crypto Kerberos crypto context
+ * @param usage Key usage for all messages
+ * @param num number of messages
+ * @param in array of num plaintexts
+ * @param out array of num ciphertexts, free each with krb5_data_free()
+ *
+ * @return Return an error code or 0; on error no output is returned.
+ *
+ * @ingroup krb5_crypto
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_encrypt_batch(krb5_context context,
+		   krb5_crypto crypto,
+		   unsigned usage,
+		   size_t num,
+		   const krb5_data *in,
+		   krb5_data *out)
+{
+    const struct _krb5_encryption_type *et = crypto->et;
+    krb5_key_usage ku = usage;
+    krb5_crypto_iov iov[4];
+    krb5_error_code ret = 0;
+    size_t i, sz, block_sz, checksum_sz;
+    unsigned char *p;
+
+    for (i = 0; i < num; i++)
+	krb5_data_zero(&out[i]);
+
+    if (!derived_crypto(context, crypto)) {
+	for (i = 0; ret == 0 && i < num; i++)
+	    ret = krb5_encrypt(context, crypto, usage,
+			       in[i].data, in[i].length, &out[i]);
+	goto out;
+    }
+
+    ret = krb5_crypto_prepare_usages(context, crypto, &ku, 1);
+    checksum_sz = CHECKSUMSIZE(et->keyed_checksum);
+
+    for (i = 0; ret == 0 && i < num; i++) {
+	sz = et->confoundersize + in[i].length;
+	block_sz = (sz + et->padsize - 1) &~ (et->padsize - 1); /* pad */
+
+	if (krb5_data_alloc(&out[i], block_sz + checksum_sz)) {
+	    ret = krb5_enomem(context);
+	    break;
+	}
+	p = out[i].data;
+
+	iov[0].flags = KRB5_CRYPTO_TYPE_HEADER;
+	iov[0].data.data = p;
+	iov[0].data.length = et->confoundersize;
+	iov[1].flags = KRB5_CRYPTO_TYPE_DATA;
+	iov[1].data.data = p + et->confoundersize;
+	iov[1].data.length = in[i].length;
+	iov[2].flags = KRB5_CRYPTO_TYPE_PADDING;
+	iov[2].data.data = p + sz;
+	iov[2].data.length = block_sz - sz;
+	iov[3].flags = KRB5_CRYPTO_TYPE_TRAILER;
+	iov[3].data.data = p + block_sz;
+	iov[3].data.length = checksum_sz;
+
+	if (in[i].length)
+	    memcpy(iov[1].data.data, in[i].data, in[i].length);
+	ret = krb5_encrypt_iov_ivec(context, crypto, usage, iov, 4, NULL);
+    }
+
+ out:
+    if (ret)
+	batch_free(num, out);
+    return ret;
+}
+
+/**
+ * Decrypt several independent messages with the same crypto context
+ * and key usage.
+ *
+ * The output is the same as calling krb5_decrypt() on each message;
+ * see krb5_encrypt_batch().
+ *
+ * @param context Kerberos context
+ * @param crypto Kerberos crypto context
+ * @param usage Key usage for all messages
+ * @param num number of messages
+ * @param in array of num ciphertexts
+ * @param out array of num plaintexts, free each with krb5_data_free()
+ *
+ * @return Return an error code or 0; on error no output is returned.
+ *
+ * @ingroup krb5_crypto
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_decrypt_batch(krb5_context context,
+		   krb5_crypto crypto,
+		   unsigned usage,
+		   size_t num,
+		   const krb5_data *in,
+		   krb5_data *out)
+{
+    const struct _krb5_encryption_type *et = crypto->et;
+    krb5_key_usage ku = usage;
+    krb5_crypto_iov iov[3];
+    krb5_error_code ret = 0;
+    size_t i, len, checksum_sz;
+    unsigned char *p;
+
+    for (i = 0; i < num; i++)
+	krb5_data_zero(&out[i]);
+
+    if (!derived_crypto(context, crypto)) {
+	for (i = 0; ret == 0 && i < num; i++)
+	    ret = krb5_decrypt(context, crypto, usage,
+			       in[i].data, in[i].length, &out[i]);
+	goto out;
+    }
+
+    ret = krb5_crypto_prepare_usages(context, crypto, &ku, 1);
+    checksum_sz = CHECKSUMSIZE(et->keyed_checksum);
+
+    for (i = 0; ret == 0 && i < num; i++) {
+	len = in[i].length;
+	if (len < et->confoundersize + checksum_sz) {
+	    krb5_set_error_message(context, KRB5_BAD_MSIZE,
+				   N_("Encrypted data shorter then "
+				      "checksum + confounder", ""));
+	    ret = KRB5_BAD_MSIZE;
+	    break;
+	}
+	if (krb5_data_copy(&out[i], in[i].data, len)) {
+	    ret = krb5_enomem(context);
+	    break;
+	}
+	p = out[i].data;
+
+	iov[0].flags = KRB5_CRYPTO_TYPE_HEADER;
+	iov[0].data.data = p;
+	iov[0].data.length = et->confoundersize;
+	iov[1].flags = KRB5_CRYPTO_TYPE_DATA;
+	iov[1].data.data = p + et->confoundersize;
+	iov[1].data.length = len - et->confoundersize - checksum_sz;
+	iov[2].flags = KRB5_CRYPTO_TYPE_TRAILER;
+	iov[2].data.data = p + len - checksum_sz;
+	iov[2].data.length = checksum_sz;
+
+	ret = krb5_decrypt_iov_ivec(context, crypto, usage, iov, 3, NULL);
+	if (ret)
+	    break;
+	memmove(p, iov[1].data.data, iov[1].data.length);
+	out[i].length = iov[1].data.length;
+    }
+
+ out:
+    if (ret)
+	batch_free(num, out);
+    return ret;
+}
+
 /************************************************************
  *                                                          *
  ************************************************************/
@@ -2482,6 +2707,7 @@ _new_derived_key(krb5_crypto crypto, unsigned usage)
     if(d == NULL)
 	return NULL;
     crypto->key_usage = d;
+    heim_mem_account(HEIM_MEM_CRYPTO, sizeof(*d), 0);
     d += crypto->num_key_usage++;
     memset(d, 0, sizeof(*d));
     d->usage = usage;
@@ -2519,25 +2745,58 @@ krb5_derive_key(krb5_context context,
     return ret;
 }
 
+/*
+ * Slot in crypto->dk_index[] for a derived key usage (see
+ * ENCRYPTION_USAGE() and friends), or -1 if it isn't indexed.
+ */
+static int
+dk_index_slot(unsigned usage)
+{
+    unsigned u = usage >> 8;
+
+    if (u >= DK_INDEX_USAGES)
+	return -1;
+    switch (usage & 0xff) {
+    case 0xAA:
+	return u;
+    case 0x55:
+	return DK_INDEX_USAGES + u;
+    case 0x99:
+	return 2 * DK_INDEX_USAGES + u;
+    default:
+	return -1;
+    }
+}
+
 static krb5_error_code
 _get_derived_key(krb5_context context,
 		 krb5_crypto crypto,
 		 unsigned usage,
 		 struct _krb5_key_data **key)
 {
-    int i;
+    int i, slot;
     struct _krb5_key_data *d;
     unsigned char constant[5];
 
     *key = NULL;
-    for(i = 0; i < crypto->num_key_usage; i++)
-	if(crypto->key_usage[i].usage == usage) {
-	    *key = &crypto->key_usage[i].key;
-	    return 0;
-	}
+    slot = dk_index_slot(usage);
+    if (slot >= 0 && crypto->dk_index[slot]) {
+	*key = &crypto->key_usage[crypto->dk_index[slot] - 1].key;
+	return 0;
+    }
+    /* Indexed usages not in the index were never derived */
+    if (slot < 0 || crypto->num_key_usage >= UCHAR_MAX) {
+	for(i = 0; i < crypto->num_key_usage; i++)
+	    if(crypto->key_usage[i].usage == usage) {
+		*key = &crypto->key_usage[i].key;
+		return 0;
+	    }
+    }
     d = _new_derived_key(crypto, usage);
     if (d == NULL)
 	return krb5_enomem(context);
+    if (slot >= 0 && crypto->num_key_usage <= UCHAR_MAX)
+	crypto->dk_index[slot] = crypto->num_key_usage;
     *key = d;
     krb5_copy_keyblock(context, crypto->key.key, &d->key);
     _krb5_put_int(constant, usage, sizeof(constant));
@@ -2597,9 +2856,132 @@ krb5_crypto_init(krb5_context context,
     (*crypto)->num_key_usage = 0;
     (*crypto)->key_usage = NULL;
     (*crypto)->flags = 0;
+    heim_mem_account(HEIM_MEM_CRYPTO, sizeof(**crypto), 1);
     return 0;
 }
 
+/**
+ * Derive the keys for a set of key usages up front.  A long-lived
+ * crypto context (a GSS-API security context, say) can call this right
+ * after krb5_crypto_init() so that later encryption and checksum
+ * operations don't pay for key derivation.  This does nothing for
+ * encryption types that don't use derived keys.
+ *
+ * @param context Kerberos context
+ * @param crypto crypto context to prepare
+ * @param usages the key usages that will be used with crypto
+ * @param num_usages the number of elements in usages
+ *
+ * @return Return an error code or 0.
+ *
+ * @ingroup krb5_crypto
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_crypto_prepare_usages(krb5_context context,
+			   krb5_crypto crypto,
+			   const krb5_key_usage *usages,
+			   size_t num_usages)
+{
+    struct _krb5_checksum_type *kct = crypto->et->keyed_checksum;
+    struct _krb5_key_data *dkey;
+    krb5_error_code ret = 0;
+    size_t i;
+
+    if (!derived_crypto(context, crypto))
+	return 0;
+    for (i = 0; ret == 0 && i < num_usages; i++) {
+	ret = _get_derived_key(context, crypto,
+			       ENCRYPTION_USAGE(usages[i]), &dkey);
+	if (ret == 0)
+	    ret = _key_schedule(context, dkey);
+	if (ret == 0)
+	    ret = _get_derived_key(context, crypto,
+				   INTEGRITY_USAGE(usages[i]), &dkey);
+	if (ret == 0 && kct && (kct->flags & F_DERIVED))
+	    ret = _get_derived_key(context, crypto,
+				   CHECKSUM_USAGE(usages[i]), &dkey);
+    }
+    return ret;
+}
+
+/*
+ * Store the keys derived so far in a crypto context, so that a copy of
+ * the context made with _krb5_crypto_ret_derived_keys() elsewhere (a
+ * GSS-API security context imported into another process, say) need
+ * not derive them again.
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+_krb5_crypto_store_derived_keys(krb5_context context,
+				krb5_crypto crypto,
+				krb5_storage *sp)
+{
+    krb5_error_code ret;
+    int i;
+
+    ret = krb5_store_uint32(sp, crypto->num_key_usage);
+    for (i = 0; ret == 0 && i < crypto->num_key_usage; i++) {
+	ret = krb5_store_uint32(sp, crypto->key_usage[i].usage);
+	if (ret == 0)
+	    ret = krb5_store_keyblock(sp, *crypto->key_usage[i].key.key);
+    }
+    return ret;
+}
+
+/*
+ * Add to a crypto context, made from the same key, the derived keys
+ * stored by _krb5_crypto_store_derived_keys().  Usages the context
+ * already has a key for are skipped.
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+_krb5_crypto_ret_derived_keys(krb5_context context,
+			      krb5_crypto crypto,
+			      krb5_storage *sp)
+{
+    struct _krb5_key_data *d;
+    krb5_error_code ret;
+    krb5_keyblock kb;
+    uint32_t n, usage;
+    int i, slot, have;
+
+    ret = krb5_ret_uint32(sp, &n);
+    if (ret == 0 && n > UCHAR_MAX)
+	ret = KRB5_BAD_MSIZE;
+    while (ret == 0 && n--) {
+	ret = krb5_ret_uint32(sp, &usage);
+	if (ret == 0)
+	    ret = krb5_ret_keyblock(sp, &kb);
+	if (ret)
+	    break;
+	if (kb.keyvalue.length != crypto->et->keytype->size) {
+	    krb5_free_keyblock_contents(context, &kb);
+	    ret = KRB5_BAD_KEYSIZE;
+	    break;
+	}
+	for (have = 0, i = 0; !have && i < crypto->num_key_usage; i++)
+	    have = crypto->key_usage[i].usage == usage;
+	if (have) {
+	    krb5_free_keyblock_contents(context, &kb);
+	    continue;
+	}
+	if ((d = _new_derived_key(crypto, usage)) == NULL ||
+	    (d->key = malloc(sizeof(*d->key))) == NULL) {
+	    if (d)
+		crypto->num_key_usage--;
+	    krb5_free_keyblock_contents(context, &kb);
+	    ret = krb5_enomem(context);
+	    break;
+	}
+	*d->key = kb;
+	slot = dk_index_slot(usage);
+	if (slot >= 0 && crypto->num_key_usage <= UCHAR_MAX)
+	    crypto->dk_index[slot] = crypto->num_key_usage;
+    }
+    return ret;
+}
+
 static void
 free_key_schedule(krb5_context context,
 		  struct _krb5_key_data *key,
@@ -2629,20 +3011,8 @@ free_key_usage(krb5_context context, struct _krb5_key_usage *ku,
     _krb5_free_key_data(context, &ku->key, et);
 }
 
-/**
- * Free a crypto context created by krb5_crypto_init().
- *
- * @param context Kerberos context
- * @param crypto crypto context to free
- *
- * @return Return an error code or 0.
- *
- * @ingroup krb5_crypto
- */
-
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_crypto_destroy(krb5_context context,
-		    krb5_crypto crypto)
+static void
+crypto_free(krb5_context context, krb5_crypto crypto)
 {
     int i;
 
@@ -2657,7 +3027,201 @@ krb5_crypto_destroy(krb5_context context,
     if (crypto->hmacctx)
 	HMAC_CTX_free(crypto->hmacctx);
 
+    heim_mem_account(HEIM_MEM_CRYPTO,
+		     -(int64_t)(sizeof(*crypto) +
+				crypto->num_key_usage * sizeof(crypto->key_usage[0])),
+		     -1);
     free (crypto);
+}
+
+/*
+ * Process-wide cache of idle crypto contexts for long-term keys (service
+ * keys, krbtgt keys), so that their key schedules and derived keys
+ * survive from one request to the next.  krb5_crypto_init_cached() takes
+ * a matching context out of the cache, so a context is never shared, and
+ * krb5_crypto_destroy() puts it back.  The least recently used context is
+ * destroyed (and its keys zeroed) when the cache is full, and so is any
+ * context that has been idle for CRYPTO_CACHE_IDLE seconds.
+ *
+ * The cache is sized by [libdefaults] crypto_context_cache_size, read the
+ * first time it is used; it is off by default.
+ */
+#define CRYPTO_CACHE_IDLE 300
+
+struct crypto_cache_ent {
+    krb5_crypto crypto;
+    time_t used;
+};
+
+static HEIMDAL_MUTEX crypto_cache_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct crypto_cache_ent *crypto_cache;
+static size_t crypto_cache_size;
+static int crypto_cache_configured;
+
+static uint32_t
+crypto_cache_hash(krb5_enctype etype, const krb5_keyblock *key)
+{
+    const unsigned char *p = key->keyvalue.data;
+    uint32_t h = 2166136261U ^ (uint32_t)etype;
+    size_t i;
+
+    for (i = 0; i < key->keyvalue.length; i++)
+	h = (h ^ p[i]) * 16777619U;
+    return h;
+}
+
+static size_t
+crypto_cache_slots(krb5_context context)
+{
+    size_t n;
+
+    HEIMDAL_MUTEX_lock(&crypto_cache_mutex);
+    if (!crypto_cache_configured) {
+	int size = krb5_config_get_int_default(context, NULL, 0, "libdefaults",
+					       "crypto_context_cache_size",
+					       NULL);
+
+	if (size > 0 &&
+	    (crypto_cache = calloc(size, sizeof(crypto_cache[0]))) != NULL)
+	    crypto_cache_size = size;
+	crypto_cache_configured = 1;
+    }
+    n = crypto_cache_size;
+    HEIMDAL_MUTEX_unlock(&crypto_cache_mutex);
+    return n;
+}
+
+/* Returns TRUE if the cache took crypto */
+static krb5_boolean
+crypto_cache_put(krb5_context context, krb5_crypto crypto)
+{
+    struct crypto_cache_ent *victim = NULL;
+    krb5_crypto evicted = NULL;
+    time_t now = time(NULL);
+    size_t i;
+
+    HEIMDAL_MUTEX_lock(&crypto_cache_mutex);
+    for (i = 0; i < crypto_cache_size; i++) {
+	struct crypto_cache_ent *e = &crypto_cache[i];
+
+	if (e->crypto == NULL) {
+	    victim = e;
+	    break;
+	}
+	if (victim == NULL || e->used < victim->used)
+	    victim = e;
+    }
+    if (victim) {
+	evicted = victim->crypto;
+	victim->crypto = crypto;
+	victim->used = now;
+	crypto->flags = 0;
+    }
+    HEIMDAL_MUTEX_unlock(&crypto_cache_mutex);
+    if (evicted)
+	crypto_free(context, evicted);
+    return victim != NULL;
+}
+
+/**
+ * Like krb5_crypto_init(), but for long-term keys: if a crypto context for
+ * the same key is idle in the process-wide crypto context cache it is
+ * reused, with the keys already scheduled and derived, and
+ * krb5_crypto_destroy() returns the context to the cache rather than
+ * freeing it.  Without [libdefaults] crypto_context_cache_size this is
+ * just krb5_crypto_init().
+ *
+ * @param context Kerberos context
+ * @param key the key block information with all key data
+ * @param etype the encryption type
+ * @param crypto the resulting crypto context
+ *
+ * @return Return an error code or 0.
+ *
+ * @ingroup krb5_crypto
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_crypto_init_cached(krb5_context context,
+			const krb5_keyblock *key,
+			krb5_enctype etype,
+			krb5_crypto *crypto)
+{
+    krb5_crypto found = NULL;
+    krb5_crypto expired[8];
+    size_t i, nexpired = 0;
+    time_t now;
+    uint32_t hash;
+    krb5_error_code ret;
+
+    *crypto = NULL;
+    if (crypto_cache_slots(context) == 0)
+	return krb5_crypto_init(context, key, etype, crypto);
+
+    if(etype == (krb5_enctype)ETYPE_NULL)
+	etype = key->keytype;
+    hash = crypto_cache_hash(etype, key);
+    now = time(NULL);
+
+    HEIMDAL_MUTEX_lock(&crypto_cache_mutex);
+    for (i = 0; i < crypto_cache_size; i++) {
+	struct crypto_cache_ent *e = &crypto_cache[i];
+	krb5_crypto c = e->crypto;
+
+	if (c == NULL)
+	    continue;
+	if (now - e->used > CRYPTO_CACHE_IDLE &&
+	    nexpired < sizeof(expired)/sizeof(expired[0])) {
+	    expired[nexpired++] = c;
+	    e->crypto = NULL;
+	    continue;
+	}
+	if (found == NULL && c->cache_hash == hash &&
+	    c->et->type == etype &&
+	    c->key.key->keytype == key->keytype &&
+	    c->key.key->keyvalue.length == key->keyvalue.length &&
+	    ct_memcmp(c->key.key->keyvalue.data, key->keyvalue.data,
+		      key->keyvalue.length) == 0) {
+	    found = c;
+	    e->crypto = NULL;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&crypto_cache_mutex);
+
+    for (i = 0; i < nexpired; i++)
+	crypto_free(context, expired[i]);
+    if (found) {
+	*crypto = found;
+	return 0;
+    }
+
+    ret = krb5_crypto_init(context, key, etype, crypto);
+    if (ret == 0) {
+	(*crypto)->cached = 1;
+	(*crypto)->cache_hash = hash;
+    }
+    return ret;
+}
+
+/**
+ * Free a crypto context created by krb5_crypto_init(), or return one
+ * created by krb5_crypto_init_cached() to the crypto context cache.
+ *
+ * @param context Kerberos context
+ * @param crypto crypto context to free
+ *
+ * @return Return an error code or 0.
+ *
+ * @ingroup krb5_crypto
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_crypto_destroy(krb5_context context,
+		    krb5_crypto crypto)
+{
+    if (crypto->cached && crypto_cache_put(context, crypto))
+	return 0;
+    crypto_free(context, crypto);
     return 0;
 }
 
@@ -136,6 +136,9 @@ struct _krb5_encryption_type {
 #define INTEGRITY_USAGE(U) (((U) << 8) | 0x55)
 #define CHECKSUM_USAGE(U) (((U) << 8) | 0x99)
 
+/* Key usages below this have their derived keys directly indexed */
+#define DK_INDEX_USAGES 64
+
 /* Checksums */
 
 extern struct _krb5_checksum_type _krb5_checksum_none;
@@ -219,7 +222,12 @@ struct krb5_crypto_data {
     HMAC_CTX *hmacctx;
     int num_key_usage;
     struct _krb5_key_usage *key_usage;
+    /* key_usage[] index + 1 of derived keys for usages < DK_INDEX_USAGES */
+    unsigned char dk_index[3 * DK_INDEX_USAGES];
     krb5_flags flags;
+    /* from krb5_crypto_init_cached(); see crypto.c */
+    int cached;
+    uint32_t cache_hash;
 };
 
 /*
@@ -0,0 +1,464 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Benchmark the RFC3961 layer: encrypt/decrypt (flat and iov),
+ * keyed checksums, krb5_crypto_init() and string-to-key for each
+ * enctype and message size, reporting ns/op and MB/s.
+ *
+ * The hcrypto backend (builtin, OpenSSL, PKCS#11, ...) is chosen when
+ * libhcrypto is built, so compare backends by running this from each
+ * build.
+ */
+
+#include "krb5_locl.h"
+#include <err.h>
+#include <getarg.h>
+
+static getarg_strings enctype_strs = { 0, NULL };
+static getarg_strings size_strs = { 0, NULL };
+static getarg_strings op_strs = { 0, NULL };
+static char *seconds_str = "0.5";
+static int version_flag;
+static int help_flag;
+
+static struct getargs args[] = {
+    { "enctype",	'e',	arg_strings,	&enctype_strs,
+      "enctype to benchmark (repeatable)", "enctype" },
+    { "size",		's',	arg_strings,	&size_strs,
+      "message size in bytes (repeatable)", "bytes" },
+    { "op",		'o',	arg_strings,	&op_strs,
+      "operation to benchmark (repeatable)",
+      "encrypt|decrypt|encrypt-iov|decrypt-iov|checksum|verify|"
+      "crypto-init|string-to-key" },
+    { "seconds",	't',	arg_string,	&seconds_str,
+      "time to spend on each measurement", "seconds" },
+    { "version",	0,	arg_flag,	&version_flag,
+      "print version", NULL },
+    { "help",		0,	arg_flag,	&help_flag,
+      NULL, NULL }
+};
+
+static const char *default_enctypes[] = {
+    "aes128-cts-hmac-sha1-96",
+    "aes256-cts-hmac-sha1-96",
+    "aes128-cts-hmac-sha256-128",
+    "aes256-cts-hmac-sha384-192",
+    "arcfour-hmac-md5",
+    "des3-cbc-sha1",
+};
+
+static const size_t default_sizes[] = {
+    16, 64, 256, 1024, 8192, 65536
+};
+
+#define USAGE KRB5_KU_USAGE_ACCEPTOR_SEAL
+
+struct bench {
+    krb5_context context;
+    krb5_enctype enctype;
+    krb5_keyblock key;
+    krb5_crypto crypto;
+    size_t size;
+    unsigned char *buf;
+    krb5_data enc;		/* krb5_encrypt() of buf */
+    Checksum cksum;		/* krb5_create_checksum() of buf */
+    krb5_crypto_iov iov[4];	/* header, data, padding, trailer */
+    unsigned char *iovbuf;
+    unsigned char *iovenc;	/* encrypted iovbuf, for decrypt-iov */
+    size_t iovlen;		/* 0 if the enctype has no iov support */
+};
+
+static double seconds;
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+op_encrypt(struct bench *b)
+{
+    krb5_error_code ret;
+    krb5_data out;
+
+    ret = krb5_encrypt(b->context, b->crypto, USAGE, b->buf, b->size, &out);
+    if (ret)
+	krb5_err(b->context, 1, ret, "krb5_encrypt");
+    krb5_data_free(&out);
+}
+
+static void
+op_decrypt(struct bench *b)
+{
+    krb5_error_code ret;
+    krb5_data out;
+
+    ret = krb5_decrypt(b->context, b->crypto, USAGE,
+		       b->enc.data, b->enc.length, &out);
+    if (ret)
+	krb5_err(b->context, 1, ret, "krb5_decrypt");
+    krb5_data_free(&out);
+}
+
+static void
+op_encrypt_iov(struct bench *b)
+{
+    krb5_error_code ret;
+
+    ret = krb5_encrypt_iov_ivec(b->context, b->crypto, USAGE,
+				b->iov, 4, NULL);
+    if (ret)
+	krb5_err(b->context, 1, ret, "krb5_encrypt_iov_ivec");
+}
+
+/* Includes restoring the ciphertext, since decryption is in place */
+static void
+op_decrypt_iov(struct bench *b)
+{
+    krb5_error_code ret;
+
+    memcpy(b->iovbuf, b->iovenc, b->iovlen);
+    ret = krb5_decrypt_iov_ivec(b->context, b->crypto, USAGE,
+				b->iov, 4, NULL);
+    if (ret)
+	krb5_err(b->context, 1, ret, "krb5_decrypt_iov_ivec");
+}
+
+static void
+op_checksum(struct bench *b)
+{
+    krb5_error_code ret;
+    Checksum cksum;
+
+    ret = krb5_create_checksum(b->context, b->crypto, USAGE, 0,
+			       b->buf, b->size, &cksum);
+    if (ret)
+	krb5_err(b->context, 1, ret, "krb5_create_checksum");
+    free_Checksum(&cksum);
+}
+
+static void
+op_verify(struct bench *b)
+{
+    krb5_error_code ret;
+
+    ret = krb5_verify_checksum(b->context, b->crypto, USAGE,
+			       b->buf, b->size, &b->cksum);
+    if (ret)
+	krb5_err(b->context, 1, ret, "krb5_verify_checksum");
+}
+
+static void
+op_crypto_init(struct bench *b)
+{
+    krb5_error_code ret;
+    krb5_crypto crypto;
+
+    ret = krb5_crypto_init(b->context, &b->key, 0, &crypto);
+    if (ret)
+	krb5_err(b->context, 1, ret, "krb5_crypto_init");
+    krb5_crypto_destroy(b->context, crypto);
+}
+
+static void
+op_string_to_key(struct bench *b)
+{
+    krb5_error_code ret;
+    krb5_keyblock key;
+    krb5_salt salt;
+
+    salt.salttype = KRB5_PW_SALT;
+    salt.saltvalue.data = "EXAMPLE.COMbench";
+    salt.saltvalue.length = strlen(salt.saltvalue.data);
+    ret = krb5_string_to_key_salt(b->context, b->enctype,
+				  "mYsecreitPassword", salt, &key);
+    if (ret)
+	krb5_err(b->context, 1, ret, "krb5_string_to_key_salt");
+    krb5_free_keyblock_contents(b->context, &key);
+}
+
+static struct {
+    const char *name;
+    void (*func)(struct bench *);
+    int sized;			/* does the message size matter? */
+    int iov;			/* needs iov support */
+} ops[] = {
+    { "encrypt",	op_encrypt,		1, 0 },
+    { "decrypt",	op_decrypt,		1, 0 },
+    { "encrypt-iov",	op_encrypt_iov,		1, 1 },
+    { "decrypt-iov",	op_decrypt_iov,		1, 1 },
+    { "checksum",	op_checksum,		1, 0 },
+    { "verify",		op_verify,		1, 0 },
+    { "crypto-init",	op_crypto_init,		0, 0 },
+    { "string-to-key",	op_string_to_key,	0, 0 },
+};
+
+static int
+op_selected(const char *name)
+{
+    int i;
+
+    if (op_strs.num_strings == 0)
+	return 1;
+    for (i = 0; i < op_strs.num_strings; i++)
+	if (strcmp(op_strs.strings[i], name) == 0)
+	    return 1;
+    return 0;
+}
+
+/*
+ * Run `op' in doubling batches until `seconds' have passed; one call
+ * is made first so that lazily derived keys are not counted.
+ */
+static void
+measure(struct bench *b, const char *etname, int o)
+{
+    unsigned long n = 0, batch = 1, i;
+    double start, t;
+
+    ops[o].func(b);
+
+    start = now();
+    do {
+	for (i = 0; i < batch; i++)
+	    ops[o].func(b);
+	n += batch;
+	if (batch < 65536)
+	    batch *= 2;
+	t = now() - start;
+    } while (t < seconds);
+
+    if (ops[o].sized)
+	printf("%-28s %-14s %8lu %12.0f %10.2f\n", etname, ops[o].name,
+	       (unsigned long)b->size, t * 1e9 / n,
+	       (double)b->size * n / t / 1e6);
+    else
+	printf("%-28s %-14s %8s %12.0f %10s\n", etname, ops[o].name,
+	       "-", t * 1e9 / n, "-");
+    fflush(stdout);
+}
+
+static void
+setup_size(struct bench *b, size_t size)
+{
+    krb5_context context = b->context;
+    krb5_error_code ret;
+    size_t hlen, plen, tlen, i;
+
+    b->size = size;
+    b->buf = emalloc(size ? size : 1);
+    for (i = 0; i < size; i++)
+	b->buf[i] = i & 0xff;
+
+    ret = krb5_encrypt(context, b->crypto, USAGE, b->buf, size, &b->enc);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_encrypt");
+    ret = krb5_create_checksum(context, b->crypto, USAGE, 0,
+			       b->buf, size, &b->cksum);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_create_checksum");
+
+    b->iovlen = 0;
+    b->iovbuf = b->iovenc = NULL;
+
+    /* Only derived-key enctypes do iov */
+    ret = krb5_crypto_length(context, b->crypto,
+			     KRB5_CRYPTO_TYPE_HEADER, &hlen);
+    if (ret == 0)
+	ret = krb5_crypto_length(context, b->crypto,
+				 KRB5_CRYPTO_TYPE_TRAILER, &tlen);
+    if (ret == 0)
+	ret = krb5_crypto_length(context, b->crypto,
+				 KRB5_CRYPTO_TYPE_PADDING, &plen);
+    if (ret)
+	return;
+    if (plen > 1)
+	plen -= (hlen + size) % plen ? (hlen + size) % plen : plen;
+    else
+	plen = 0;
+
+    b->iovlen = hlen + size + plen + tlen;
+    b->iovbuf = emalloc(b->iovlen);
+    b->iovenc = emalloc(b->iovlen);
+    b->iov[0].flags = KRB5_CRYPTO_TYPE_HEADER;
+    b->iov[0].data.data = b->iovbuf;
+    b->iov[0].data.length = hlen;
+    b->iov[1].flags = KRB5_CRYPTO_TYPE_DATA;
+    b->iov[1].data.data = b->iovbuf + hlen;
+    b->iov[1].data.length = size;
+    b->iov[2].flags = KRB5_CRYPTO_TYPE_PADDING;
+    b->iov[2].data.data = b->iovbuf + hlen + size;
+    b->iov[2].data.length = plen;
+    b->iov[3].flags = KRB5_CRYPTO_TYPE_TRAILER;
+    b->iov[3].data.data = b->iovbuf + hlen + size + plen;
+    b->iov[3].data.length = tlen;
+
+    memcpy(b->iov[1].data.data, b->buf, size);
+    ret = krb5_encrypt_iov_ivec(context, b->crypto, USAGE, b->iov, 4, NULL);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_encrypt_iov_ivec");
+    memcpy(b->iovenc, b->iovbuf, b->iovlen);
+}
+
+static void
+cleanup_size(struct bench *b)
+{
+    krb5_data_free(&b->enc);
+    free_Checksum(&b->cksum);
+    free(b->buf);
+    free(b->iovbuf);
+    free(b->iovenc);
+}
+
+static void
+bench_enctype(krb5_context context, const char *etname,
+	      const size_t *sizes, size_t nsizes)
+{
+    struct bench b;
+    krb5_error_code ret;
+    size_t s;
+    int o;
+
+    memset(&b, 0, sizeof(b));
+    b.context = context;
+
+    ret = krb5_string_to_enctype(context, etname, &b.enctype);
+    if (ret)
+	krb5_err(context, 1, ret, "%s", etname);
+    if (krb5_enctype_valid(context, b.enctype) != 0) {
+	printf("%-28s skipped (not enabled)\n", etname);
+	return;
+    }
+
+    ret = krb5_generate_random_keyblock(context, b.enctype, &b.key);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+    ret = krb5_crypto_init(context, &b.key, 0, &b.crypto);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init");
+
+    for (s = 0; s < nsizes; s++) {
+	setup_size(&b, sizes[s]);
+	for (o = 0; o < sizeof(ops)/sizeof(ops[0]); o++)
+	    if (ops[o].sized && op_selected(ops[o].name) &&
+		(b.iovlen > 0 || !ops[o].iov))
+		measure(&b, etname, o);
+	cleanup_size(&b);
+    }
+    for (o = 0; o < sizeof(ops)/sizeof(ops[0]); o++)
+	if (!ops[o].sized && op_selected(ops[o].name))
+	    measure(&b, etname, o);
+
+    krb5_crypto_destroy(context, b.crypto);
+    krb5_free_keyblock_contents(context, &b.key);
+}
+
+static void
+usage(int ret)
+{
+    arg_printusage(args, sizeof(args)/sizeof(*args), NULL, "");
+    exit(ret);
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    krb5_error_code ret;
+    size_t *sizes, nsizes, i;
+    int optidx = 0, o;
+    char *end;
+
+    setprogname(argv[0]);
+
+    if (getarg(args, sizeof(args) / sizeof(args[0]), argc, argv, &optidx))
+	usage(1);
+    if (help_flag)
+	usage(0);
+    if (version_flag) {
+	print_version(NULL);
+	exit(0);
+    }
+    if (argc != optidx)
+	usage(1);
+
+    seconds = strtod(seconds_str, &end);
+    if (*end != '\0' || seconds <= 0)
+	errx(1, "bad --seconds: %s", seconds_str);
+
+    for (i = 0; i < op_strs.num_strings; i++) {
+	for (o = 0; o < sizeof(ops)/sizeof(ops[0]); o++)
+	    if (strcmp(op_strs.strings[i], ops[o].name) == 0)
+		break;
+	if (o == sizeof(ops)/sizeof(ops[0]))
+	    errx(1, "unknown --op: %s", op_strs.strings[i]);
+    }
+
+    if (size_strs.num_strings) {
+	nsizes = size_strs.num_strings;
+	sizes = ecalloc(nsizes, sizeof(sizes[0]));
+	for (i = 0; i < nsizes; i++) {
+	    sizes[i] = strtoul(size_strs.strings[i], &end, 0);
+	    if (*end != '\0')
+		errx(1, "bad --size: %s", size_strs.strings[i]);
+	}
+    } else {
+	nsizes = sizeof(default_sizes)/sizeof(default_sizes[0]);
+	sizes = ecalloc(nsizes, sizeof(sizes[0]));
+	memcpy(sizes, default_sizes, sizeof(default_sizes));
+    }
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context failed: %d", ret);
+
+    printf("%-28s %-14s %8s %12s %10s\n",
+	   "enctype", "op", "size", "ns/op", "MB/s");
+
+    if (enctype_strs.num_strings) {
+	for (i = 0; i < enctype_strs.num_strings; i++)
+	    bench_enctype(context, enctype_strs.strings[i], sizes, nsizes);
+    } else {
+	for (i = 0; i < sizeof(default_enctypes)/sizeof(default_enctypes[0]); i++)
+	    bench_enctype(context, default_enctypes[i], sizes, nsizes);
+    }
+
+    free(sizes);
+    krb5_free_context(context);
+    return 0;
+}
@@ -35,12 +35,15 @@
 
 #include "krb5_locl.h"
 
+struct fcc_index;
+
 typedef struct krb5_fcache{
     char *filename;
     char *res;
     char *sub;
     char *tmpfn;
     int version;
+    struct fcc_index *index;
 }krb5_fcache;
 
 struct fcc_cursor {
@@ -66,6 +69,38 @@ struct fcc_cursor {
 
 #define FCC_CURSOR(C) ((struct fcc_cursor*)(C))
 
+/*
+ * An in-memory image of a ccache file with its credentials indexed by
+ * the components of their server principal (not the realm, so that
+ * KRB5_TC_DONT_MATCH_REALM lookups can use it too).  It is only used
+ * while the file's identity, size and mtime are unchanged.
+ */
+struct fcc_index_entry {
+    size_t offset;		/* of the credential in the image */
+    uint32_t hash;		/* of the server principal's components */
+    size_t next;		/* next entry in the same bucket, in file order */
+};
+
+struct fcc_index {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    unsigned char *map;
+    size_t len;
+    int mapped;
+    int version;
+    krb5_error_code error;	/* from reading past the last entry */
+    size_t nentries;
+    struct fcc_index_entry *entries;
+    size_t nbuckets;
+    size_t *buckets;
+};
+
+#define FCC_INDEX_NONE ((size_t)-1)
+
+static void fcc_free_index(struct fcc_index *);
+
 static krb5_error_code KRB5_CALLCONV
 fcc_get_name_2(krb5_context context,
 	       krb5_ccache id,
@@ -706,6 +741,7 @@ fcc_close(krb5_context context,
     free(RESFILENAME(id));
     free(SUBFILENAME(id));
     free(FILENAME(id));
+    fcc_free_index(FCACHE(id)->index);
     krb5_data_free(&id->data);
     return 0;
 }
@@ -773,34 +809,19 @@ fcc_store_cred(krb5_context context,
     return ret;
 }
 
+/*
+ * Read the file header from `sp', leaving it positioned at the default
+ * principal.
+ */
 static krb5_error_code
-init_fcc(krb5_context context,
-	 krb5_ccache id,
-	 const char *operation,
-	 krb5_storage **ret_sp,
-	 int *ret_fd,
-	 krb5_deltat *kdc_offset)
+read_header(krb5_context context,
+	    krb5_ccache id,
+	    krb5_storage *sp,
+	    krb5_deltat *kdc_offset)
 {
-    int fd;
     int8_t pvno, tag;
-    krb5_storage *sp;
     krb5_error_code ret;
 
-    *ret_fd = -1;
-    *ret_sp = NULL;
-    if (kdc_offset)
-	*kdc_offset = 0;
-
-    ret = fcc_open(context, id, operation, &fd, O_RDONLY, 0);
-    if(ret)
-	return ret;
-
-    sp = krb5_storage_stdio_from_fd(fd, "r");
-    if(sp == NULL) {
-	krb5_clear_error_message(context);
-	ret = ENOMEM;
-	goto out;
-    }
     krb5_storage_set_eof_code(sp, KRB5_CC_END);
     ret = krb5_ret_int8(sp, &pvno);
     if (ret != 0) {
@@ -813,21 +834,21 @@ init_fcc(krb5_context context,
 	    krb5_set_error_message(context, ret, N_("Error reading pvno "
 						    "in cache file: %s", ""),
 				   FILENAME(id));
-	goto out;
+	return ret;
     }
     if (pvno != 5) {
 	ret = KRB5_CCACHE_BADVNO;
 	krb5_set_error_message(context, ret, N_("Bad version number in credential "
 						"cache file: %s", ""),
 			       FILENAME(id));
-	goto out;
+	return ret;
     }
     ret = krb5_ret_int8(sp, &tag); /* should not be host byte order */
     if (ret != 0) {
 	ret = KRB5_CC_FORMAT;
 	krb5_set_error_message(context, ret, "Error reading tag in "
 			      "cache file: %s", FILENAME(id));
-	goto out;
+	return ret;
     }
     FCACHE(id)->version = tag;
     storage_set_flags(context, sp, FCACHE(id)->version);
@@ -841,7 +862,7 @@ init_fcc(krb5_context context,
 	    krb5_set_error_message(context, ret,
 				   N_("Error reading tag length in "
 				      "cache file: %s", ""), FILENAME(id));
-	    goto out;
+	    return ret;
 	}
 	while(length > 0) {
 	    int16_t dtag, data_len;
@@ -854,7 +875,7 @@ init_fcc(krb5_context context,
 		krb5_set_error_message(context, ret, N_("Error reading dtag in "
 							"cache file: %s", ""),
 				       FILENAME(id));
-		goto out;
+		return ret;
 	    }
 	    ret = krb5_ret_int16 (sp, &data_len);
 	    if(ret) {
@@ -863,7 +884,7 @@ init_fcc(krb5_context context,
 				       N_("Error reading dlength "
 					  "in cache file: %s",""),
 				       FILENAME(id));
-		goto out;
+		return ret;
 	    }
 	    switch (dtag) {
 	    case FCC_TAG_DELTATIME : {
@@ -877,7 +898,7 @@ init_fcc(krb5_context context,
 					   N_("Error reading kdc_sec in "
 					      "cache file: %s", ""),
 					   FILENAME(id));
-		    goto out;
+		    return ret;
 		}
 		context->kdc_sec_offset = offset;
 		if (kdc_offset)
@@ -893,7 +914,7 @@ init_fcc(krb5_context context,
 					       N_("Error reading unknown "
 						  "tag in cache file: %s", ""),
 					       FILENAME(id));
-			goto out;
+			return ret;
 		    }
 		}
 		break;
@@ -912,8 +933,41 @@ init_fcc(krb5_context context,
 			       N_("Unknown version number (%d) in "
 				  "credential cache file: %s", ""),
 			       (int)tag, FILENAME(id));
+	return ret;
+    }
+    return 0;
+}
+
+static krb5_error_code
+init_fcc(krb5_context context,
+	 krb5_ccache id,
+	 const char *operation,
+	 krb5_storage **ret_sp,
+	 int *ret_fd,
+	 krb5_deltat *kdc_offset)
+{
+    int fd;
+    krb5_storage *sp;
+    krb5_error_code ret;
+
+    *ret_fd = -1;
+    *ret_sp = NULL;
+    if (kdc_offset)
+	*kdc_offset = 0;
+
+    ret = fcc_open(context, id, operation, &fd, O_RDONLY, 0);
+    if(ret)
+	return ret;
+
+    sp = krb5_storage_stdio_from_fd(fd, "r");
+    if(sp == NULL) {
+	krb5_clear_error_message(context);
+	ret = ENOMEM;
 	goto out;
     }
+    ret = read_header(context, id, sp, kdc_offset);
+    if (ret)
+	goto out;
     *ret_sp = sp;
     *ret_fd = fd;
 
@@ -1030,6 +1084,262 @@ fcc_end_get (krb5_context context,
     return 0;
 }
 
+static void
+fcc_free_index(struct fcc_index *idx)
+{
+    if (idx == NULL)
+	return;
+#if defined(HAVE_MMAP) && !defined(NO_MMAP)
+    if (idx->mapped)
+	munmap(idx->map, idx->len);
+    else
+#endif
+    free(idx->map);
+    free(idx->entries);
+    free(idx->buckets);
+    free(idx);
+}
+
+static krb5_storage *
+index_storage(krb5_context context, struct fcc_index *idx)
+{
+    krb5_storage *sp;
+
+    sp = krb5_storage_from_readonly_mem(idx->map ? idx->map : "", idx->len);
+    if (sp == NULL)
+	return NULL;
+    krb5_storage_set_eof_code(sp, KRB5_CC_END);
+    storage_set_flags(context, sp, idx->version);
+    return sp;
+}
+
+/*
+ * Map `fd' and index the credentials in it.
+ *
+ * The file is mapped shared so that cred_delete()'s in-place rewrites
+ * are seen.  Caches are replaced by rename(2) and only ever appended
+ * to otherwise, so the mapping never extends past the end of the file.
+ */
+static krb5_error_code
+build_index(krb5_context context, krb5_ccache id, int fd,
+	    const struct stat *sb, struct fcc_index **ret_idx)
+{
+    struct fcc_index *idx;
+    krb5_storage *sp = NULL;
+    krb5_principal principal;
+    krb5_error_code ret;
+    size_t i, n, alloced = 0;
+
+    *ret_idx = NULL;
+
+    if ((uint64_t)sb->st_size > SIZE_MAX)
+	return KRB5_CC_FORMAT;
+
+    idx = calloc(1, sizeof(*idx));
+    if (idx == NULL)
+	return krb5_enomem(context);
+    idx->dev = sb->st_dev;
+    idx->ino = sb->st_ino;
+    idx->size = sb->st_size;
+    idx->mtime = sb->st_mtime;
+    idx->len = sb->st_size;
+
+    if (idx->len > 0) {
+#if defined(HAVE_MMAP) && !defined(NO_MMAP)
+	void *p = mmap(NULL, idx->len, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (p != MAP_FAILED) {
+	    idx->map = p;
+	    idx->mapped = 1;
+	}
+#endif
+	if (idx->map == NULL) {
+	    ssize_t bytes = 0;
+	    size_t got;
+
+	    if ((idx->map = malloc(idx->len)) == NULL) {
+		fcc_free_index(idx);
+		return krb5_enomem(context);
+	    }
+	    for (got = 0; got < idx->len; got += bytes) {
+		bytes = read(fd, idx->map + got, idx->len - got);
+		if (bytes <= 0)
+		    break;
+	    }
+	    if (got < idx->len) {
+		ret = bytes < 0 ? errno : KRB5_CC_END;
+		krb5_set_error_message(context, ret,
+				       N_("Failed to read cache file %s", ""),
+				       FILENAME(id));
+		fcc_free_index(idx);
+		return ret;
+	    }
+	}
+    }
+
+    /* read_header() sets the storage flags once it knows the version */
+    sp = krb5_storage_from_readonly_mem(idx->map ? idx->map : "", idx->len);
+    if (sp == NULL) {
+	fcc_free_index(idx);
+	return krb5_enomem(context);
+    }
+    ret = read_header(context, id, sp, NULL);
+    if (ret == 0) {
+	idx->version = FCACHE(id)->version;
+	ret = krb5_ret_principal(sp, &principal);
+	if (ret)
+	    krb5_clear_error_message(context);
+	else
+	    krb5_free_principal(context, principal);
+    }
+    if (ret) {
+	krb5_storage_free(sp);
+	fcc_free_index(idx);
+	return ret;
+    }
+
+    /*
+     * Like fcc_get_next(), stop at the first credential that can't be
+     * read; lookups that match nothing before it fail with its error.
+     */
+    for (;;) {
+	krb5_creds creds;
+	off_t off = krb5_storage_seek(sp, 0, SEEK_CUR);
+
+	ret = krb5_ret_creds(sp, &creds);
+	if (ret) {
+	    krb5_clear_error_message(context);
+	    idx->error = ret;
+	    break;
+	}
+	if (idx->nentries == alloced) {
+	    struct fcc_index_entry *tmp;
+
+	    n = alloced ? alloced * 2 : 16;
+	    tmp = realloc(idx->entries, n * sizeof(tmp[0]));
+	    if (tmp == NULL) {
+		krb5_free_cred_contents(context, &creds);
+		krb5_storage_free(sp);
+		fcc_free_index(idx);
+		return krb5_enomem(context);
+	    }
+	    idx->entries = tmp;
+	    alloced = n;
+	}
+	idx->entries[idx->nentries].offset = off;
+	idx->entries[idx->nentries].hash =
+	    _krb5_principal_hash_any_realm(creds.server);
+	idx->nentries++;
+	krb5_free_cred_contents(context, &creds);
+    }
+    krb5_storage_free(sp);
+
+    for (idx->nbuckets = 16; idx->nbuckets < idx->nentries; idx->nbuckets *= 2)
+	;
+    idx->buckets = malloc(idx->nbuckets * sizeof(idx->buckets[0]));
+    if (idx->buckets == NULL) {
+	fcc_free_index(idx);
+	return krb5_enomem(context);
+    }
+    for (i = 0; i < idx->nbuckets; i++)
+	idx->buckets[i] = FCC_INDEX_NONE;
+    /* Insert backwards so each bucket lists its entries in file order */
+    for (i = idx->nentries; i > 0; i--) {
+	struct fcc_index_entry *e = &idx->entries[i - 1];
+	size_t *b = &idx->buckets[e->hash & (idx->nbuckets - 1)];
+
+	e->next = *b;
+	*b = i - 1;
+    }
+
+    *ret_idx = idx;
+    return 0;
+}
+
+/*
+ * Look up a credential through the index, rebuilding it first if the
+ * file has changed since it was built.  Returns the same credential as
+ * the sequential search in krb5_cc_retrieve_cred() would: the first
+ * one in the file that matches.
+ */
+static krb5_error_code KRB5_CALLCONV
+fcc_retrieve(krb5_context context,
+	     krb5_ccache id,
+	     krb5_flags whichfields,
+	     const krb5_creds *mcreds,
+	     krb5_creds *creds)
+{
+    krb5_fcache *f = FCACHE(id);
+    struct fcc_index *idx;
+    krb5_storage *sp;
+    krb5_error_code ret;
+    struct stat sb;
+    uint32_t hash = 0;
+    size_t i;
+    int fd;
+
+    if (f == NULL)
+        return krb5_einval(context, 2);
+
+    ret = fcc_open(context, id, "retrieve", &fd, O_RDONLY, 0);
+    if (ret)
+	return ret;
+    if (fstat(fd, &sb) == -1) {
+	ret = errno;
+	close(fd);
+	krb5_set_error_message(context, ret, N_("Failed to stat cache file", ""));
+	return ret;
+    }
+    idx = f->index;
+    if (idx == NULL || idx->dev != sb.st_dev || idx->ino != sb.st_ino ||
+	idx->size != sb.st_size || idx->mtime != sb.st_mtime) {
+	fcc_free_index(f->index);
+	f->index = NULL;
+	ret = build_index(context, id, fd, &sb, &f->index);
+	if (ret) {
+	    close(fd);
+	    return ret;
+	}
+	idx = f->index;
+    }
+    close(fd);
+
+    sp = index_storage(context, idx);
+    if (sp == NULL)
+	return krb5_enomem(context);
+
+    if (mcreds->server) {
+	hash = _krb5_principal_hash_any_realm(mcreds->server);
+	i = idx->buckets[hash & (idx->nbuckets - 1)];
+    } else {
+	i = idx->nentries ? 0 : FCC_INDEX_NONE;
+    }
+
+    while (i != FCC_INDEX_NONE) {
+	struct fcc_index_entry *e = &idx->entries[i];
+
+	if (mcreds->server == NULL || e->hash == hash) {
+	    krb5_storage_seek(sp, e->offset, SEEK_SET);
+	    ret = krb5_ret_creds(sp, creds);
+	    if (ret) {
+		krb5_clear_error_message(context);
+		break;
+	    }
+	    if (krb5_compare_creds(context, whichfields, mcreds, creds))
+		break;
+	    krb5_free_cred_contents(context, creds);
+	}
+	if (mcreds->server)
+	    i = e->next;
+	else if (++i == idx->nentries)
+	    i = FCC_INDEX_NONE;
+    }
+    if (i == FCC_INDEX_NONE)
+	ret = idx->error;
+    krb5_storage_free(sp);
+    return ret;
+}
+
 static void KRB5_CALLCONV
 cred_delete(krb5_context context,
 	    krb5_ccache id,
@@ -1670,7 +1980,7 @@ KRB5_LIB_VARIABLE const krb5_cc_ops krb5_fcc_ops = {
     fcc_destroy,
     fcc_close,
     fcc_store_cred,
-    NULL, /* fcc_retrieve */
+    fcc_retrieve,
     fcc_get_principal,
     fcc_get_first,
     fcc_get_next,
@@ -1541,6 +1541,149 @@ store_cred(krb5_context context, krb5_ccache ccache,
     krb5_cc_store_cred(context, ccache, creds);
 }
 
+/*
+ * With [libdefaults] tgs_negative_timeout set, a service the KDC says
+ * doesn't exist, or whose referrals lead nowhere, is remembered for
+ * that long in a "negative-tgs" ccache config entry (the error code and
+ * when it expires), and requests for it fail without asking again.
+ */
+static krb5_boolean
+negative_cacheable(krb5_error_code code)
+{
+    return code == KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN ||
+	code == KRB5_GET_IN_TKT_LOOP ||
+	code == KRB5KDC_ERR_PATH_NOT_ACCEPTED;
+}
+
+static krb5_error_code
+check_negative_cache(krb5_context context, krb5_ccache ccache,
+		     krb5_const_principal server)
+{
+    krb5_error_code ret = 0;
+    krb5_storage *sp;
+    krb5_data data;
+    int32_t code;
+    uint32_t expires;
+
+    if (context->tgs_negative_timeout <= 0)
+	return 0;
+
+    if (krb5_cc_get_config(context, ccache, server, "negative-tgs", &data)) {
+	krb5_clear_error_message(context);
+	return 0;
+    }
+    sp = krb5_storage_from_data(&data);
+    if (sp != NULL &&
+	krb5_ret_int32(sp, &code) == 0 &&
+	krb5_ret_uint32(sp, &expires) == 0 &&
+	negative_cacheable(code) && expires > (uint32_t)time(NULL)) {
+	ret = code;
+	krb5_set_error_message(context, ret,
+			       N_("Cached TGS failure, retrying in %us", ""),
+			       (unsigned)(expires - time(NULL)));
+    }
+    krb5_storage_free(sp);
+    krb5_data_free(&data);
+    return ret;
+}
+
+static void
+store_negative_cache(krb5_context context, krb5_ccache ccache,
+		     krb5_const_principal server, krb5_error_code code)
+{
+    krb5_storage *sp;
+    krb5_data data;
+    const char *msg;
+
+    if (context->tgs_negative_timeout <= 0 || context->no_ticket_store ||
+	!negative_cacheable(code))
+	return;
+
+    sp = krb5_storage_emem();
+    if (sp == NULL)
+	return;
+    krb5_data_zero(&data);
+    msg = krb5_get_error_message(context, code);
+    if (krb5_store_int32(sp, code) == 0 &&
+	krb5_store_uint32(sp, time(NULL) + context->tgs_negative_timeout) == 0 &&
+	krb5_storage_to_data(sp, &data) == 0)
+	(void) krb5_cc_set_config(context, ccache, server, "negative-tgs",
+				  &data);
+    krb5_storage_free(sp);
+    krb5_data_free(&data);
+    /* Keep the KDC's error message for the caller */
+    krb5_set_error_message(context, code, "%s", msg);
+    krb5_free_error_message(context, msg);
+}
+
+/*
+ * The [libdefaults] shared_ticket_cache, when set, is looked at after
+ * the caller's ccache and before asking the KDC, so that processes
+ * that share it only get each service ticket once.  Tickets that only
+ * make sense for one request are kept out of it.
+ */
+static krb5_boolean
+use_shared_cc(krb5_context context, krb5_flags options)
+{
+    return context->shared_ticket_cache != NULL &&
+	!context->no_ticket_store &&
+	(options & (KRB5_GC_NO_STORE | KRB5_GC_USER_USER |
+		    KRB5_GC_CONSTRAINED_DELEGATION | KRB5_GC_ANONYMOUS)) == 0;
+}
+
+static krb5_error_code
+check_shared_cc(krb5_context context, krb5_flags options,
+		krb5_creds *in_creds, krb5_creds *out_creds)
+{
+    krb5_error_code ret;
+    krb5_ccache id;
+
+    if (!use_shared_cc(context, options))
+	return KRB5_CC_END;
+
+    ret = krb5_cc_resolve(context, context->shared_ticket_cache, &id);
+    if (ret == 0) {
+	ret = check_cc(context, options, id, in_creds, out_creds);
+	krb5_cc_close(context, id);
+    }
+    if (ret == 0 && (options & KRB5_GC_FORWARDABLE) &&
+	!out_creds->flags.b.forwardable) {
+	krb5_free_cred_contents(context, out_creds);
+	ret = KRB5_CC_END;
+    }
+    /* A shared cache that is missing or broken is only a miss */
+    if (ret) {
+	krb5_clear_error_message(context);
+	return KRB5_CC_END;
+    }
+    return 0;
+}
+
+static void
+store_shared_cc(krb5_context context, krb5_flags options,
+		krb5_const_principal server_princ, krb5_creds *creds)
+{
+    krb5_principal principal;
+    krb5_ccache id;
+
+    if (!use_shared_cc(context, options))
+	return;
+
+    if (krb5_cc_resolve(context, context->shared_ticket_cache, &id))
+	goto out;
+    /* Whose cache it is doesn't matter, but it has to be initialized */
+    if (krb5_cc_get_principal(context, id, &principal) == 0)
+	krb5_free_principal(context, principal);
+    else if (krb5_cc_initialize(context, id, creds->client)) {
+	krb5_cc_close(context, id);
+	goto out;
+    }
+    store_cred(context, id, server_princ, creds);
+    krb5_cc_close(context, id);
+out:
+    krb5_clear_error_message(context);
+}
+
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_get_credentials_with_flags(krb5_context context,
@@ -1558,6 +1701,7 @@ krb5_get_credentials_with_flags(krb5_context context,
     krb5_principal save_princ = in_creds->server;
     krb5_creds **tgts;
     krb5_creds *res_creds;
+    krb5_boolean asked_kdc = FALSE;
     int i;
 
     memset(&fast_state, 0, sizeof(fast_state));
@@ -1618,14 +1762,28 @@ next_rule:
     } else if(ret != KRB5_CC_END) {
         goto out;
     }
-    if (options & KRB5_GC_CACHED)
-	goto next_rule;
 
     if(options & KRB5_GC_USER_USER)
 	flags.b.enc_tkt_in_skey = 1;
     if (flags.b.enc_tkt_in_skey)
 	options |= KRB5_GC_NO_STORE;
 
+    if (check_shared_cc(context, options, in_creds, res_creds) == 0) {
+	store_cred(context, ccache, in_creds->server, res_creds);
+	*out_creds = res_creds;
+        res_creds = NULL;
+	goto out;
+    }
+    if (options & KRB5_GC_CACHED)
+	goto next_rule;
+
+    if ((options & KRB5_GC_NO_STORE) == 0) {
+	ret = check_negative_cache(context, ccache, save_princ);
+	if (ret)
+	    goto out;
+	asked_kdc = TRUE;
+    }
+
     tgts = NULL;
     ret = _krb5_get_cred_kdc_any(context, flags, ccache, &fast_state,
 				 in_creds, NULL, NULL, out_creds, &tgts);
@@ -1641,8 +1799,10 @@ next_rule:
 	!(rule_opts & KRB5_NCRO_USE_FAST))
 	goto next_rule;
 
-    if(ret == 0 && (options & KRB5_GC_NO_STORE) == 0)
+    if(ret == 0 && (options & KRB5_GC_NO_STORE) == 0) {
 	store_cred(context, ccache, in_creds->server, *out_creds);
+	store_shared_cc(context, options, in_creds->server, *out_creds);
+    }
 
     if (ret == 0 && _krb5_have_debug(context, 5)) {
         char *unparsed;
@@ -1660,6 +1820,8 @@ next_rule:
 
 out:
     in_creds->server = save_princ;
+    if (asked_kdc && ret)
+	store_negative_cache(context, ccache, save_princ, ret);
     krb5_free_creds(context, res_creds);
     krb5_free_name_canon_iterator(context, name_canon_iter);
     _krb5_fast_free(context, &fast_state);
@@ -1791,6 +1953,7 @@ krb5_get_creds(krb5_context context,
     krb5_const_principal try_princ = NULL;
     krb5_name_canon_iterator name_canon_iter = NULL;
     krb5_name_canon_rule_options rule_opts;
+    krb5_boolean negative_ok, asked_kdc = FALSE;
     int i;
     int type;
     const char *comp;
@@ -1841,6 +2004,12 @@ krb5_get_creds(krb5_context context,
 	options |= KRB5_TC_MATCH_KEYTYPE;
     }
 
+    /* Failures of plain requests only are remembered */
+    negative_ok =
+	(opt == NULL || (opt->self == NULL && opt->ticket == NULL)) &&
+	(options & (KRB5_GC_NO_STORE | KRB5_GC_USER_USER |
+		    KRB5_GC_CONSTRAINED_DELEGATION)) == 0;
+
     ret = krb5_name_canon_iterator_start(context, in_creds.server,
 					 &name_canon_iter);
     if (ret)
@@ -1871,9 +2040,24 @@ next_rule:
 	    goto out;
 	}
     }
+    /* Impersonated and evidence-ticket requests aren't shared either */
+    if ((opt == NULL || (opt->self == NULL && opt->ticket == NULL)) &&
+	check_shared_cc(context, options, &in_creds, res_creds) == 0) {
+	store_cred(context, ccache, inprinc, res_creds);
+	*out_creds = res_creds;
+	res_creds = NULL;
+	goto out;
+    }
     if (options & KRB5_GC_CACHED)
 	goto next_rule;
 
+    if (negative_ok) {
+	ret = check_negative_cache(context, ccache, inprinc);
+	if (ret)
+	    goto out;
+	asked_kdc = TRUE;
+    }
+
     type = krb5_principal_get_type(context, try_princ);
     comp = krb5_principal_get_comp_string(context, try_princ, 0);
     if ((type == KRB5_NT_SRV_HST || type == KRB5_NT_UNKNOWN) &&
@@ -1913,8 +2097,11 @@ next_rule:
 	!(rule_opts & KRB5_NCRO_USE_FAST))
 	goto next_rule;
 
-    if (ret == 0 && (options & KRB5_GC_NO_STORE) == 0)
+    if (ret == 0 && (options & KRB5_GC_NO_STORE) == 0) {
 	store_cred(context, ccache, inprinc, *out_creds);
+	if (opt == NULL || (opt->self == NULL && opt->ticket == NULL))
+	    store_shared_cc(context, options, inprinc, *out_creds);
+    }
 
     if (ret == 0 && _krb5_have_debug(context, 5)) {
         char *unparsed;
@@ -1931,6 +2118,8 @@ next_rule:
     }
 
 out:
+    if (asked_kdc && ret)
+	store_negative_cache(context, ccache, inprinc, ret);
     _krb5_fast_free(context, &fast_state);
     krb5_free_creds(context, res_creds);
     krb5_free_principal(context, in_creds.client);
@@ -92,9 +92,11 @@ struct krb5_get_init_creds_ctx {
 	unsigned int change_password_prompt:1;
 	unsigned int allow_enc_pa_rep:1;
 	unsigned int allow_save_as_reply_key:1;
+	unsigned int used_pa_hint:1;
     } runflags;
 
     struct pa_info_data paid;
+    struct pa_info_data pa_hint;
 
     METHOD_DATA md;
     KRB_ERROR error;
@@ -217,6 +219,7 @@ free_init_creds_ctx(krb5_context context, krb5_init_creds_context ctx)
     free(ctx->kdc_hostname);
     free(ctx->sitename);
     free_paid(context, &ctx->paid);
+    free_paid(context, &ctx->pa_hint);
     memset_s(ctx, sizeof(*ctx), 0, sizeof(*ctx));
 }
 
@@ -1798,10 +1801,18 @@ enc_ts_step(krb5_context context, krb5_init_creds_context ctx, void *pa_ctx, PA_
      * into KDCs that are doing failed auth counting based on the
      * ENC_TS tries.
      *
-     * Stashing the salt for the next run is a diffrent issue and
-     * could be considered in the future.
+     * The exception is salt info stashed by the previous run (see
+     * pa_hint_load()), that is used once for the first request.
      */
 
+    if (ppaid == NULL && ctx->pa_hint.etype != KRB5_ENCTYPE_NULL) {
+	_krb5_debug(context, 5, "TS-ENC: using remembered etype-info");
+	paid = ctx->pa_hint;
+	memset(&ctx->pa_hint, 0, sizeof(ctx->pa_hint));
+	ppaid = &paid;
+	ctx->runflags.used_pa_hint = 1;
+    }
+
     if (ppaid == NULL) {
 	_krb5_debug(context, 5,
 		     "TS-ENC: waiting for KDC to set pw-salt/etype_info{,2}");
@@ -2984,6 +2995,134 @@ available_padata_count(METHOD_DATA *md)
     return count;
 }
 
+/*
+ * When [libdefaults] preauth_hint_lifetime is set, the etype-info used
+ * for a successful ENC-TS exchange is stored as a config entry in the
+ * ccache, and the next run for the same client uses it to send
+ * PA-ENC-TIMESTAMP in the first AS-REQ instead of waiting for
+ * KRB5KDC_ERR_PREAUTH_REQUIRED to learn it.
+ */
+
+#define PA_HINT_CONFIG "preauth-hint"
+
+static void
+pa_hint_load(krb5_context context, krb5_init_creds_context ctx)
+{
+    krb5_principal principal = NULL;
+    krb5_ccache id = NULL;
+    krb5_storage *sp = NULL;
+    krb5_data data, salt, s2kparams;
+    int64_t stored;
+    int32_t etype, salttype;
+
+    krb5_data_zero(&data);
+    krb5_data_zero(&salt);
+    krb5_data_zero(&s2kparams);
+
+    if (krb5_cc_default(context, &id))
+	return;
+    if (krb5_cc_get_principal(context, id, &principal) ||
+	!krb5_principal_compare(context, principal, ctx->cred.client) ||
+	krb5_cc_get_config(context, id, NULL, PA_HINT_CONFIG, &data))
+	goto out;
+
+    sp = krb5_storage_from_readonly_mem(data.data, data.length);
+    if (sp == NULL)
+	goto out;
+    if (krb5_ret_int64(sp, &stored) ||
+	krb5_ret_int32(sp, &etype) ||
+	krb5_ret_int32(sp, &salttype) ||
+	krb5_ret_data(sp, &salt) ||
+	krb5_ret_data(sp, &s2kparams))
+	goto out;
+
+    if (stored + context->preauth_hint_lifetime < time(NULL)) {
+	_krb5_debug(context, 5, "init_creds: preauth hint expired");
+	goto out;
+    }
+    if (krb5_enctype_valid(context, etype) != 0)
+	goto out;
+
+    if (set_paid(&ctx->pa_hint, context, etype, salttype,
+		 salt.data, salt.length,
+		 s2kparams.length ? &s2kparams : NULL) == 0)
+	_krb5_debug(context, 5, "init_creds: using preauth hint for etype %d",
+		    (int)etype);
+
+ out:
+    if (sp)
+	krb5_storage_free(sp);
+    krb5_data_free(&salt);
+    krb5_data_free(&s2kparams);
+    krb5_data_free(&data);
+    if (principal)
+	krb5_free_principal(context, principal);
+    krb5_cc_close(context, id);
+}
+
+static krb5_error_code
+pa_hint_store(krb5_context context,
+	      krb5_init_creds_context ctx,
+	      krb5_ccache id)
+{
+    krb5_error_code ret;
+    krb5_storage *sp;
+    krb5_data data, empty;
+
+    krb5_data_zero(&empty);
+
+    sp = krb5_storage_emem();
+    if (sp == NULL)
+	return krb5_enomem(context);
+
+    ret = krb5_store_int64(sp, time(NULL));
+    if (ret == 0)
+	ret = krb5_store_int32(sp, ctx->paid.etype);
+    if (ret == 0)
+	ret = krb5_store_int32(sp, ctx->paid.salt.salttype);
+    if (ret == 0)
+	ret = krb5_store_data(sp, ctx->paid.salt.saltvalue);
+    if (ret == 0)
+	ret = krb5_store_data(sp, ctx->paid.s2kparams ?
+			      *ctx->paid.s2kparams : empty);
+    if (ret == 0)
+	ret = krb5_storage_to_data(sp, &data);
+    krb5_storage_free(sp);
+    if (ret)
+	return ret;
+
+    ret = krb5_cc_set_config(context, id, NULL, PA_HINT_CONFIG, &data);
+    krb5_data_free(&data);
+    return ret;
+}
+
+/*
+ * Called when the KDC failed the preauthentication built from a
+ * remembered hint; returns TRUE if the KDC sent etype-info that
+ * differs from the hint, in which case it is worth one more try.
+ */
+
+static krb5_boolean
+pa_hint_stale(krb5_context context, krb5_init_creds_context ctx)
+{
+    struct pa_info_data paid, *ppaid;
+    krb5_boolean stale;
+
+    memset(&paid, 0, sizeof(paid));
+    paid.etype = KRB5_ENCTYPE_NULL;
+
+    ppaid = process_pa_info(context, ctx->cred.client, &ctx->as_req,
+			    &paid, &ctx->md);
+    if (ppaid == NULL)
+	return FALSE;
+
+    stale = ppaid->etype != ctx->paid.etype ||
+	ppaid->salt.salttype != ctx->paid.salt.salttype ||
+	krb5_data_cmp(&ppaid->salt.saltvalue, &ctx->paid.salt.saltvalue) != 0;
+    free_paid(context, &paid);
+    return stale;
+}
+
 static krb5_error_code
 init_creds_step(krb5_context context,
 		krb5_init_creds_context ctx,
@@ -3019,6 +3158,10 @@ init_creds_step(krb5_context context,
 
 	/* XXX should happen after we get back reply from KDC */
 	pa_configure(context, ctx, NULL);
+
+	if (context->preauth_hint_lifetime > 0 &&
+	    ctx->gss_init_ctx == NULL && ctx->pk_init_ctx == NULL)
+	    pa_hint_load(context, ctx);
     }
 
 #define MAX_PA_COUNTER 15
@@ -3341,6 +3484,19 @@ init_creds_step(krb5_context context,
 
 	    } else if (ret == KRB5KDC_ERR_PREAUTH_FAILED) {
 
+		/*
+		 * If the first request was built from a remembered
+		 * hint and the KDC now sends other etype-info, the
+		 * hint was stale, so try again with what it sent.
+		 */
+		if (ctx->runflags.used_pa_hint) {
+		    ctx->runflags.used_pa_hint = 0;
+		    if (pa_hint_stale(context, ctx)) {
+			_krb5_debug(context, 10, "Preauth hint was stale, trying again");
+			goto retry;
+		    }
+		}
+
 		/*
 		 * Old MIT KDC can't handle KRB5_PADATA_REQ_ENC_PA_REP,
 		 * so drop it and try again. But only try that for MIT
@@ -3661,6 +3817,13 @@ krb5_init_creds_store(krb5_context context,
 	    return ret;
     }
 
+    /* The hint is only an optimization, ignore failures to save it */
+    if (context->preauth_hint_lifetime > 0 &&
+	ctx->pa_used != NULL &&
+	strcmp(ctx->pa_used, "ENCRYPTED_TIMESTAMP") == 0 &&
+	ctx->paid.etype != KRB5_ENCTYPE_NULL)
+	(void) pa_hint_store(context, ctx, id);
+
     return 0;
 }
 
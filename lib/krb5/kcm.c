@@ -55,8 +55,16 @@ typedef struct krb5_kcm_cursor {
     unsigned long offset;
     unsigned long length;
     kcmuuid_t *uuids;
+    /* replies to GET_CRED_BY_UUID fetched ahead of kcm_get_next() */
+    krb5_data *replies;
+    int *rets;
+    unsigned long nreplies;
+    unsigned long reply;
 } *krb5_kcm_cursor;
 
+/* How many credentials kcm_get_next() fetches per round trip */
+#define KCM_PREFETCH 64
+
 
 #define KCMCACHE(X)	((krb5_kcmcache *)(X)->data.data)
 #define CACHENAME(X)	(KCMCACHE(X)->name)
@@ -66,12 +74,9 @@ static HEIMDAL_MUTEX kcm_mutex = HEIMDAL_MUTEX_INITIALIZER;
 static heim_ipc kcm_ipc = NULL;
 
 static krb5_error_code
-kcm_send_request(krb5_context context,
-		 krb5_storage *request,
-		 krb5_data *response_data)
+kcm_ipc_context(void)
 {
     krb5_error_code ret = 0;
-    krb5_data request_data;
 
     HEIMDAL_MUTEX_lock(&kcm_mutex);
     if (kcm_ipc == NULL)
@@ -79,6 +84,20 @@ kcm_send_request(krb5_context context,
     HEIMDAL_MUTEX_unlock(&kcm_mutex);
     if (ret)
 	return KRB5_CC_NOSUPP;
+    return 0;
+}
+
+static krb5_error_code
+kcm_send_request(krb5_context context,
+		 krb5_storage *request,
+		 krb5_data *response_data)
+{
+    krb5_error_code ret = 0;
+    krb5_data request_data;
+
+    ret = kcm_ipc_context();
+    if (ret)
+	return ret;
 
     ret = krb5_storage_to_data(request, &request_data);
     if (ret) {
@@ -166,58 +185,74 @@ kcm_alloc(krb5_context context,
     return 0;
 }
 
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_kcm_call(krb5_context context,
-	      krb5_storage *request,
-	      krb5_storage **response_p,
-	      krb5_data *response_data_p)
+/*
+ * Check the status at the start of a reply, and hand the rest of it to
+ * the caller if wanted.  Takes over `response_data'.
+ */
+static krb5_error_code
+kcm_parse_response(krb5_context context,
+		   krb5_data *response_data,
+		   krb5_storage **response_p,
+		   krb5_data *response_data_p)
 {
-    krb5_data response_data;
     krb5_error_code ret;
     int32_t status;
     krb5_storage *response;
 
-    if (response_p != NULL)
-	*response_p = NULL;
-
-    krb5_data_zero(&response_data);
-
-    ret = kcm_send_request(context, request, &response_data);
-    if (ret)
-	return ret;
-
-    response = krb5_storage_from_data(&response_data);
+    response = krb5_storage_from_data(response_data);
     if (response == NULL) {
-	krb5_data_free(&response_data);
+	krb5_data_free(response_data);
 	return KRB5_CC_IO;
     }
 
     ret = krb5_ret_int32(response, &status);
     if (ret) {
 	krb5_storage_free(response);
-	krb5_data_free(&response_data);
+	krb5_data_free(response_data);
 	return KRB5_CC_FORMAT;
     }
 
     if (status) {
 	krb5_storage_free(response);
-	krb5_data_free(&response_data);
+	krb5_data_free(response_data);
 	return status;
     }
 
     if (response_p != NULL) {
-	*response_data_p = response_data;
+	*response_data_p = *response_data;
 	*response_p = response;
 
 	return 0;
     }
 
     krb5_storage_free(response);
-    krb5_data_free(&response_data);
+    krb5_data_free(response_data);
 
     return 0;
 }
 
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_kcm_call(krb5_context context,
+	      krb5_storage *request,
+	      krb5_storage **response_p,
+	      krb5_data *response_data_p)
+{
+    krb5_data response_data;
+    krb5_error_code ret;
+
+    if (response_p != NULL)
+	*response_p = NULL;
+
+    krb5_data_zero(&response_data);
+
+    ret = kcm_send_request(context, request, &response_data);
+    if (ret)
+	return ret;
+
+    return kcm_parse_response(context, &response_data,
+			      response_p, response_data_p);
+}
+
 static void
 kcm_free(krb5_context context, krb5_ccache *id)
 {
@@ -624,6 +659,89 @@ kcm_get_first (krb5_context context,
     return 0;
 }
 
+static void
+kcm_free_replies(krb5_kcm_cursor c)
+{
+    unsigned long i;
+
+    for (i = c->reply; i < c->nreplies; i++)
+	krb5_data_free(&c->replies[i]);
+    free(c->replies);
+    free(c->rets);
+    c->replies = NULL;
+    c->rets = NULL;
+    c->nreplies = c->reply = 0;
+}
+
+/*
+ * Fetch the next KCM_PREFETCH credentials in one round trip.
+ */
+static krb5_error_code
+kcm_prefetch(krb5_context context, krb5_kcmcache *k, krb5_kcm_cursor c)
+{
+    krb5_error_code ret;
+    krb5_storage *request;
+    krb5_data *requests;
+    unsigned long i, n;
+
+    kcm_free_replies(c);
+
+    n = min(c->length - c->offset, KCM_PREFETCH);
+    if (n == 0)
+	return 0;
+
+    ret = kcm_ipc_context();
+    if (ret)
+	return ret;
+
+    requests = calloc(n, sizeof(requests[0]));
+    c->replies = calloc(n, sizeof(c->replies[0]));
+    c->rets = calloc(n, sizeof(c->rets[0]));
+    if (requests == NULL || c->replies == NULL || c->rets == NULL) {
+	free(requests);
+	kcm_free_replies(c);
+	return krb5_enomem(context);
+    }
+
+    for (i = 0; i < n; i++) {
+	ret = krb5_kcm_storage_request(context, KCM_OP_GET_CRED_BY_UUID,
+				       &request);
+	if (ret)
+	    break;
+	ret = krb5_store_stringz(request, k->name);
+	if (ret == 0 &&
+	    krb5_storage_write(request, &c->uuids[c->offset + i],
+			       sizeof(c->uuids[0])) != sizeof(c->uuids[0]))
+	    ret = ENOMEM;
+	if (ret == 0)
+	    ret = krb5_storage_steal_data(request, &requests[i]);
+	krb5_storage_free(request);
+	if (ret)
+	    break;
+    }
+
+    if (ret == 0 &&
+	heim_ipc_call_batch(kcm_ipc, n, requests, c->replies, c->rets) != 0)
+	ret = KRB5_CC_NOSUPP;
+
+    for (i = 0; i < n; i++)
+	krb5_data_free(&requests[i]);
+    free(requests);
+
+    if (ret) {
+	free(c->replies);
+	free(c->rets);
+	c->replies = NULL;
+	c->rets = NULL;
+	krb5_clear_error_message(context);
+	return ret;
+    }
+
+    c->offset += n;
+    c->nreplies = n;
+    return 0;
+}
+
 /*
  * Request:
  *      NameZ
@@ -631,6 +749,9 @@ kcm_get_first (krb5_context context,
  *
  * Response:
  *      Creds
+ *
+ * The requests for a cursor's credentials are sent KCM_PREFETCH at a
+ * time, without waiting for each reply before sending the next.
  */
 static krb5_error_code
 kcm_get_next (krb5_context context,
@@ -641,37 +762,29 @@ kcm_get_next (krb5_context context,
     krb5_error_code ret;
     krb5_kcmcache *k = KCMCACHE(id);
     krb5_kcm_cursor c = KCMCURSOR(*cursor);
-    krb5_storage *request, *response;
+    krb5_storage *response;
     krb5_data response_data;
-    ssize_t sret;
+    unsigned long i;
 
  again:
 
-    if (c->offset >= c->length)
-	return KRB5_CC_END;
-
-    ret = krb5_kcm_storage_request(context, KCM_OP_GET_CRED_BY_UUID, &request);
-    if (ret)
-	return ret;
-
-    ret = krb5_store_stringz(request, k->name);
-    if (ret) {
-	krb5_storage_free(request);
-	return ret;
+    if (c->reply >= c->nreplies) {
+	ret = kcm_prefetch(context, k, c);
+	if (ret)
+	    return ret;
+	if (c->nreplies == 0)
+	    return KRB5_CC_END;
     }
 
-    sret = krb5_storage_write(request,
-			      &c->uuids[c->offset],
-			      sizeof(c->uuids[c->offset]));
-    c->offset++;
-    if (sret != sizeof(c->uuids[c->offset])) {
-	krb5_storage_free(request);
+    i = c->reply++;
+    if (c->rets[i]) {
+	krb5_data_free(&c->replies[i]);
 	krb5_clear_error_message(context);
-	return ENOMEM;
+	return KRB5_CC_NOSUPP;
     }
 
-    ret = krb5_kcm_call(context, request, &response, &response_data);
-    krb5_storage_free(request);
+    ret = kcm_parse_response(context, &c->replies[i],
+			     &response, &response_data);
     if (ret == KRB5_CC_END) {
 	goto again;
     } else if (ret)
@@ -702,6 +815,7 @@ kcm_end_get (krb5_context context,
 {
     krb5_kcm_cursor c = KCMCURSOR(*cursor);
 
+    kcm_free_replies(c);
     free(c->uuids);
     free(c);
 
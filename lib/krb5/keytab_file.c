@@ -45,6 +45,14 @@
 struct fkt_data {
     char *filename;
     int flags;
+    /*
+     * The file as the last fkt_add_entry() on this handle left it.  If
+     * it is still the same size the next add appends without a scan.
+     */
+    int end_valid;
+    dev_t end_dev;
+    ino_t end_ino;
+    off_t end;
 };
 
 static krb5_error_code
@@ -294,6 +302,7 @@ fkt_resolve(krb5_context context, const char *name, krb5_keytab id)
 	return krb5_enomem(context);
     }
     d->flags = 0;
+    d->end_valid = 0;
     id->data = d;
     return 0;
 }
@@ -320,11 +329,14 @@ fkt_close(krb5_context context, krb5_keytab id)
     return 0;
 }
 
+static void fkt_cache_drop(krb5_context, const char *);
+
 static krb5_error_code KRB5_CALLCONV
 fkt_destroy(krb5_context context, krb5_keytab id)
 {
     struct fkt_data *d = id->data;
     _krb5_erase_file(context, d->filename);
+    fkt_cache_drop(context, d->filename);
     return 0;
 }
 
@@ -516,6 +528,257 @@ fkt_end_seq_get(krb5_context context,
     return 0;
 }
 
+/*
+ * Decoded copies of FILE keytabs, shared by all handles in the process
+ * and indexed by principal name, so that krb5_kt_get_entry() does not
+ * read and decode the whole file each time.  A copy is used while the
+ * file's identity, size and times are unchanged, and only if it was
+ * read at least two seconds after the last modification, since an
+ * in-place change within the same second leaves all of them as they
+ * were.
+ */
+
+#define FKT_CACHE_MAX 8
+
+struct fkt_cache {
+    struct fkt_cache *next;
+    char *filename;
+    int flags;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+    time_t loaded;
+    size_t len;
+    krb5_keytab_entry *entries;
+    size_t nbuckets;
+    size_t *buckets;		/* index + 1 of first entry, 0 if none */
+    size_t *chain;		/* index + 1 of next entry, in file order */
+};
+
+static HEIMDAL_MUTEX fkt_cache_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct fkt_cache *fkt_caches;
+
+static void
+fkt_cache_free(krb5_context context, struct fkt_cache *c)
+{
+    size_t i;
+
+    for (i = 0; i < c->len; i++)
+	krb5_kt_free_entry(context, &c->entries[i]);
+    free(c->entries);
+    free(c->buckets);
+    free(c->chain);
+    free(c->filename);
+    free(c);
+}
+
+static void
+fkt_cache_drop(krb5_context context, const char *filename)
+{
+    struct fkt_cache **p, *c;
+
+    HEIMDAL_MUTEX_lock(&fkt_cache_mutex);
+    for (p = &fkt_caches; (c = *p) != NULL; ) {
+	if (strcmp(c->filename, filename) == 0) {
+	    *p = c->next;
+	    fkt_cache_free(context, c);
+	} else {
+	    p = &c->next;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&fkt_cache_mutex);
+}
+
+static int
+fkt_cache_valid(const struct fkt_cache *c, const struct stat *st)
+{
+    return c->dev == st->st_dev && c->ino == st->st_ino &&
+	c->size == st->st_size && c->mtime == st->st_mtime &&
+	c->ctime == st->st_ctime && c->loaded > st->st_mtime + 1;
+}
+
+/*
+ * Read the keytab into a new cache entry.  Like the sequential search,
+ * stops at the first entry that can not be decoded.
+ */
+
+static krb5_error_code
+fkt_cache_load(krb5_context context, krb5_keytab id, struct fkt_cache **out)
+{
+    struct fkt_data *d = id->data;
+    krb5_keytab_entry *e;
+    struct fkt_cache *c;
+    krb5_kt_cursor cursor;
+    krb5_error_code ret;
+    struct stat st;
+    size_t alloc = 0, i, b;
+
+    *out = NULL;
+    ret = fkt_start_seq_get_int(context, id, O_RDONLY | O_BINARY | O_CLOEXEC,
+				0, &cursor);
+    if (ret)
+	return ret;
+    if (fstat(cursor.fd, &st) == -1) {
+	ret = errno;
+	fkt_end_seq_get(context, id, &cursor);
+	return ret;
+    }
+    if ((c = calloc(1, sizeof(*c))) == NULL) {
+	fkt_end_seq_get(context, id, &cursor);
+	return krb5_enomem(context);
+    }
+    c->dev = st.st_dev;
+    c->ino = st.st_ino;
+    c->size = st.st_size;
+    c->mtime = st.st_mtime;
+    c->ctime = st.st_ctime;
+    c->loaded = time(NULL);
+    c->flags = d->flags;
+    if ((c->filename = strdup(d->filename)) == NULL)
+	goto enomem;
+
+    for (;;) {
+	if (c->len == alloc) {
+	    alloc = alloc ? alloc * 2 : 16;
+	    e = realloc(c->entries, alloc * sizeof(e[0]));
+	    if (e == NULL)
+		goto enomem;
+	    c->entries = e;
+	}
+	if (fkt_next_entry_int(context, id, &c->entries[c->len], &cursor,
+			       NULL, NULL))
+	    break;
+	c->len++;
+    }
+    fkt_end_seq_get(context, id, &cursor);
+    krb5_clear_error_message(context);
+
+    for (c->nbuckets = 16; c->nbuckets < c->len; c->nbuckets *= 2)
+	;
+    c->buckets = calloc(c->nbuckets, sizeof(c->buckets[0]));
+    c->chain = calloc(c->len ? c->len : 1, sizeof(c->chain[0]));
+    if (c->buckets == NULL || c->chain == NULL) {
+	fkt_cache_free(context, c);
+	return krb5_enomem(context);
+    }
+    /* Insert backwards so that each bucket lists entries in file order */
+    for (i = c->len; i > 0; i--) {
+	b = _krb5_principal_hash_any_realm(c->entries[i - 1].principal) &
+	    (c->nbuckets - 1);
+	c->chain[i - 1] = c->buckets[b];
+	c->buckets[b] = i;
+    }
+    *out = c;
+    return 0;
+
+  enomem:
+    fkt_end_seq_get(context, id, &cursor);
+    fkt_cache_free(context, c);
+    return krb5_enomem(context);
+}
+
+/* Called with fkt_cache_mutex held */
+static krb5_error_code
+fkt_cache_get(krb5_context context, krb5_keytab id, struct fkt_cache **out)
+{
+    struct fkt_data *d = id->data;
+    struct fkt_cache **p, *c;
+    krb5_error_code ret;
+    struct stat st;
+    size_t n = 0;
+
+    *out = NULL;
+    if (stat(d->filename, &st) == -1)
+	return errno;
+
+    for (p = &fkt_caches; (c = *p) != NULL; p = &c->next, n++) {
+	if (strcmp(c->filename, d->filename) == 0 && c->flags == d->flags)
+	    break;
+    }
+    if (c != NULL) {
+	*p = c->next;
+	if (fkt_cache_valid(c, &st)) {
+	    c->next = fkt_caches;
+	    fkt_caches = c;
+	    *out = c;
+	    return 0;
+	}
+	fkt_cache_free(context, c);
+	n--;
+    }
+
+    ret = fkt_cache_load(context, id, &c);
+    if (ret)
+	return ret;
+    c->next = fkt_caches;
+    fkt_caches = c;
+
+    /* Keep the most recently used few */
+    if (n + 1 > FKT_CACHE_MAX) {
+	for (p = &fkt_caches; (*p)->next != NULL; p = &(*p)->next)
+	    ;
+	fkt_cache_free(context, *p);
+	*p = NULL;
+    }
+    *out = c;
+    return 0;
+}
+
+static krb5_error_code KRB5_CALLCONV
+fkt_get(krb5_context context,
+	krb5_keytab id,
+	krb5_const_principal principal,
+	krb5_kvno kvno,
+	krb5_enctype enctype,
+	krb5_keytab_entry *entry)
+{
+    const krb5_keytab_entry *tmp, *best = NULL;
+    krb5_error_code ret;
+    struct fkt_cache *c;
+    size_t i;
+
+    HEIMDAL_MUTEX_lock(&fkt_cache_mutex);
+    ret = fkt_cache_get(context, id, &c);
+    if (ret) {
+	HEIMDAL_MUTEX_unlock(&fkt_cache_mutex);
+	/* As krb5_kt_get_entry() does when it can not read the keytab */
+	context->error_code = KRB5_KT_NOTFOUND;
+	return KRB5_KT_NOTFOUND;
+    }
+
+    /* Same matching as the sequential search in krb5_kt_get_entry() */
+    if (principal != NULL)
+	i = c->buckets[_krb5_principal_hash_any_realm(principal) &
+		       (c->nbuckets - 1)];
+    else
+	i = c->len ? 1 : 0;
+    for (; i != 0; i = principal ? c->chain[i - 1] : (i < c->len ? i + 1 : 0)) {
+	tmp = &c->entries[i - 1];
+	if (!krb5_kt_compare(context, rk_UNCONST(tmp), principal, 0, enctype))
+	    continue;
+	/* the file keytab might only store the lower 8 bits of
+	   the kvno, so only compare those bits */
+	if (kvno == tmp->vno || (tmp->vno < 256 && kvno % 256 == tmp->vno)) {
+	    best = tmp;
+	    break;
+	} else if (kvno == 0 && tmp->vno > (best ? best->vno : 0)) {
+	    best = tmp;
+	}
+    }
+    if (best != NULL)
+	ret = krb5_kt_copy_entry_contents(context, best, entry);
+    else
+	ret = KRB5_KT_NOTFOUND;
+    HEIMDAL_MUTEX_unlock(&fkt_cache_mutex);
+
+    if (ret == KRB5_KT_NOTFOUND)
+	return _krb5_kt_principal_not_found(context, KRB5_KT_NOTFOUND,
+					    id, principal, enctype, kvno);
+    return ret;
+}
+
 static krb5_error_code KRB5_CALLCONV
 fkt_setup_keytab(krb5_context context,
 		 krb5_keytab id,
@@ -542,6 +805,9 @@ fkt_add_entry(krb5_context context,
     struct fkt_data *d = id->data;
     krb5_data keytab;
     int32_t len;
+    int32_t rest = 0;
+    int append = 0;
+    struct stat st;
 
     fd = open(d->filename, O_RDWR | O_BINARY | O_CLOEXEC);
     if (fd < 0) {
@@ -618,6 +884,9 @@ fkt_add_entry(krb5_context context,
 	    id->version = tag;
 	    storage_set_flags(context, sp, id->version);
 	}
+	append = d->end_valid && fstat(fd, &st) == 0 &&
+	    st.st_dev == d->end_dev && st.st_ino == d->end_ino &&
+	    st.st_size == d->end;
     }
 
     {
@@ -691,33 +960,60 @@ fkt_add_entry(krb5_context context,
 	}
     }
 
-    while(1) {
-        off_t here;
+    /*
+     * Put the entry in the smallest hole left by fkt_remove_entry()
+     * that it fits, splitting off what it doesn't fill as a new hole,
+     * or else at the end.  A file as this handle last left it has no
+     * hole worth the scan for the next entry, so that is appended.
+     */
+    len = keytab.length;
+    if (append) {
+	krb5_storage_seek(sp, d->end, SEEK_SET);
+    } else {
+	off_t best = -1;
+	int32_t best_len = 0;
+
+	while(1) {
+	    off_t here;
+	    int32_t rlen;
 
-        here = krb5_storage_seek(sp, 0, SEEK_CUR);
-        if (here == -1) {
-            ret = errno;
-            krb5_set_error_message(context, ret,
-                                   N_("Failed writing keytab block "
-                                      "in keytab %s: %s", ""),
-                                   d->filename, strerror(ret));
-            goto out;
-        }
-	ret = krb5_ret_int32(sp, &len);
-	if (ret) {
-            /* There could have been a partial length.  Recover! */
-            (void) krb5_storage_truncate(sp, here);
-	    len = keytab.length;
-	    break;
-	}
-	if(len < 0) {
-	    len = -len;
-	    if(len >= (int)keytab.length) {
-		krb5_storage_seek(sp, -4, SEEK_CUR);
+	    here = krb5_storage_seek(sp, 0, SEEK_CUR);
+	    if (here == -1) {
+		ret = errno;
+		krb5_set_error_message(context, ret,
+				       N_("Failed writing keytab block "
+					  "in keytab %s: %s", ""),
+				       d->filename, strerror(ret));
+		goto out;
+	    }
+	    ret = krb5_ret_int32(sp, &rlen);
+	    if (ret) {
+		/* There could have been a partial length.  Recover! */
+		(void) krb5_storage_truncate(sp, here);
+		krb5_storage_seek(sp, here, SEEK_SET);
+		ret = 0;
 		break;
 	    }
+	    if(rlen < 0) {
+		rlen = -rlen;
+		if (rlen >= (int32_t)keytab.length &&
+		    (best == -1 || rlen < best_len)) {
+		    best = here;
+		    best_len = rlen;
+		    if (rlen == (int32_t)keytab.length)
+			break;
+		}
+	    }
+	    krb5_storage_seek(sp, rlen, SEEK_CUR);
+	}
+	if (best != -1) {
+	    krb5_storage_seek(sp, best, SEEK_SET);
+	    /* A hole needs room for its length and at least one byte */
+	    if (best_len - (int32_t)keytab.length > 4)
+		rest = best_len - keytab.length - 4;
+	    else
+		len = best_len;
 	}
-	krb5_storage_seek(sp, len, SEEK_CUR);
     }
     ret = krb5_store_int32(sp, len);
     if (ret != 0)
@@ -730,13 +1026,22 @@ fkt_add_entry(krb5_context context,
 				  "in keytab %s: %s", ""),
 			       d->filename, strerror(ret));
     }
+    if (ret == 0 && rest)
+	ret = krb5_store_int32(sp, -rest);
     memset(keytab.data, 0, keytab.length);
     krb5_data_free(&keytab);
   out:
     if (ret == 0)
         ret = krb5_storage_fsync(sp);
+    d->end_valid = ret == 0 && fstat(fd, &st) == 0;
+    if (d->end_valid) {
+	d->end_dev = st.st_dev;
+	d->end_ino = st.st_ino;
+	d->end = st.st_size;
+    }
     krb5_storage_free(sp);
     close(fd);
+    fkt_cache_drop(context, d->filename);
     return ret;
 }
 
@@ -789,6 +1094,7 @@ fkt_remove_entry(krb5_context context,
 	krb5_kt_free_entry(context, &e);
     }
     (void) krb5_kt_end_seq_get(context, id, &cursor);
+    fkt_cache_drop(context, fkt->filename);
     if (ret == KRB5_KT_END)
         ret = 0;
     if (ret) {
@@ -812,7 +1118,7 @@ const krb5_kt_ops krb5_fkt_ops = {
     fkt_get_name,
     fkt_close,
     fkt_destroy,
-    NULL, /* get */
+    fkt_get,
     fkt_start_seq_get,
     fkt_next_entry,
     fkt_end_seq_get,
@@ -828,7 +1134,7 @@ const krb5_kt_ops krb5_wrfkt_ops = {
     fkt_get_name,
     fkt_close,
     fkt_destroy,
-    NULL, /* get */
+    fkt_get,
     fkt_start_seq_get,
     fkt_next_entry,
     fkt_end_seq_get,
@@ -844,7 +1150,7 @@ const krb5_kt_ops krb5_javakt_ops = {
     fkt_get_name,
     fkt_close,
     fkt_destroy,
-    NULL, /* get */
+    fkt_get,
     fkt_start_seq_get,
     fkt_next_entry,
     fkt_end_seq_get,
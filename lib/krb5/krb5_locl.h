@@ -82,6 +82,7 @@ struct mbuf;
 #include <com_err.h>
 
 #include <heimbase.h>
+#include <heimbase-probes.h>
 
 #define HEIMDAL_TEXTDOMAIN "heimdal_krb5"
 
@@ -290,9 +291,16 @@ typedef struct krb5_context_data {
     time_t max_skew;
     time_t kdc_timeout;
     time_t host_timeout;
+    time_t kdc_tcp_reuse_timeout;
+    time_t preauth_hint_lifetime;
+    int kdc_parallel;			/* KDCs to ask at once */
+    int kdc_parallel_delay;		/* ms before asking the next KDC */
+    int rd_req_ticket_cache;		/* decrypted tickets to keep */
     unsigned max_retries;
     int32_t kdc_sec_offset;
     int32_t kdc_usec_offset;
+    struct timeval time_cache;		/* see krb5_set_time_cache() */
+    int time_cached;
     krb5_config_section *cf;
     const krb5_cc_ops **cc_ops;
     int num_cc_ops;
@@ -329,14 +337,23 @@ typedef struct krb5_context_data {
 #define KRB5_CTX_F_FCACHE_STRICT_CHECKING	32
 #define KRB5_CTX_F_ENFORCE_OK_AS_DELEGATE	64
 #define KRB5_CTX_F_REPORT_CANONICAL_CLIENT_NAME	128
+#define KRB5_CTX_F_CC_PLUGINS_LOADED		256
+#define KRB5_CTX_F_DEBUG_DEST_PENDING		512
     struct send_to_kdc *send_to_kdc;
 #ifdef PKINIT
     hx509_context hx509ctx;
 #endif
     unsigned int num_kdc_requests;
+    struct _krb5_kdc_conn *kdc_conns;	/* idle TCP connections to KDCs */
     krb5_name_canon_rule name_canon_rules;
     size_t config_include_depth;
     krb5_boolean no_ticket_store;       /* Don't store service tickets */
+    const char *shared_ticket_cache;	/* service tickets shared by
+                                           processes, or NULL */
+    struct _krb5_transited_cache *transited_cache; /* checked transited
+                                                      encodings */
+    time_t lname_cache_ttl;		/* kuserok/an2ln results kept for */
+    struct _krb5_lname_cache *lname_cache;
 } krb5_context_data;
 
 #define KRB5_DEFAULT_CCNAME_FILE "FILE:%{TEMP}/krb5cc_%{uid}"
@@ -57,6 +57,362 @@ is_invalid_tld_srv_target(const char *target)
 	    && strchr(&target[35], '.') == NULL);
 }
 
+/*
+ * SRV lookups are cached for the life of the process, whichever
+ * context made them, for as long as the records' TTLs allow.  A failed
+ * lookup is remembered for SRV_NEGATIVE_TTL seconds, as the resolver
+ * doesn't tell us the SOA minimum.  With [libdefaults] dns_cache_file
+ * set the cache is also kept in that file, so that short-lived
+ * processes share it.
+ */
+#define SRV_NEGATIVE_TTL	30
+#define SRV_CACHE_MAX		64
+
+struct srv_cache_rec {
+    unsigned priority;
+    unsigned weight;
+    unsigned port;
+    char *target;
+};
+
+struct srv_cache_entry {
+    char *domain;
+    char *type;
+    time_t expires;
+    size_t nrecs;		/* 0 for a failed lookup */
+    struct srv_cache_rec *recs;
+    struct srv_cache_entry *next;
+};
+
+static HEIMDAL_MUTEX srv_cache_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct srv_cache_entry *srv_cache;
+
+static void
+srv_cache_free_entry(struct srv_cache_entry *e)
+{
+    size_t i;
+
+    if (e == NULL)
+	return;
+    for (i = 0; i < e->nrecs; i++)
+	free(e->recs[i].target);
+    free(e->recs);
+    free(e->domain);
+    free(e->type);
+    free(e);
+}
+
+static struct srv_cache_entry *
+srv_cache_new_entry(const char *domain, const char *type, time_t expires,
+		    size_t nrecs)
+{
+    struct srv_cache_entry *e;
+
+    if ((e = calloc(1, sizeof(*e))) == NULL)
+	return NULL;
+    e->domain = strdup(domain);
+    e->type = strdup(type);
+    e->expires = expires;
+    e->nrecs = nrecs;
+    if (nrecs)
+	e->recs = calloc(nrecs, sizeof(e->recs[0]));
+    if (e->domain == NULL || e->type == NULL || (nrecs && e->recs == NULL)) {
+	e->nrecs = 0;
+	srv_cache_free_entry(e);
+	return NULL;
+    }
+    return e;
+}
+
+/* Find a live entry, dropping expired ones; called with the mutex held */
+static struct srv_cache_entry *
+srv_cache_find(const char *domain, const char *type, time_t now)
+{
+    struct srv_cache_entry **ep, *e;
+
+    for (ep = &srv_cache; (e = *ep) != NULL; ) {
+	if (e->expires <= now) {
+	    *ep = e->next;
+	    srv_cache_free_entry(e);
+	    continue;
+	}
+	if (strcasecmp(e->domain, domain) == 0 &&
+	    strcasecmp(e->type, type) == 0)
+	    return e;
+	ep = &e->next;
+    }
+    return NULL;
+}
+
+/* Add `e', replacing any entry for the same name; mutex held */
+static void
+srv_cache_add(struct srv_cache_entry *e)
+{
+    struct srv_cache_entry **ep, *old;
+    size_t n = 0;
+
+    for (ep = &srv_cache; (old = *ep) != NULL; ) {
+	if (strcasecmp(old->domain, e->domain) == 0 &&
+	    strcasecmp(old->type, e->type) == 0) {
+	    *ep = old->next;
+	    srv_cache_free_entry(old);
+	    continue;
+	}
+	/* Keep the cache bounded; the oldest entries are at the end */
+	if (++n >= SRV_CACHE_MAX) {
+	    *ep = old->next;
+	    srv_cache_free_entry(old);
+	    continue;
+	}
+	ep = &old->next;
+    }
+    e->next = srv_cache;
+    srv_cache = e;
+}
+
+/*
+ * Make a reply as rk_dns_lookup() would from a cache entry, so that
+ * rk_dns_srv_order() shuffles it afresh for every caller.
+ */
+static struct rk_dns_reply *
+srv_cache_reply(const struct srv_cache_entry *e)
+{
+    struct rk_resource_record **tail, *rr;
+    struct rk_dns_reply *r;
+    size_t i;
+
+    if ((r = calloc(1, sizeof(*r))) == NULL)
+	return NULL;
+    r->q.domain = strdup(e->domain);
+    r->q.type = rk_ns_t_srv;
+    r->q.class = rk_ns_c_in;
+    if (r->q.domain == NULL) {
+	rk_dns_free_data(r);
+	return NULL;
+    }
+    tail = &r->head;
+    for (i = 0; i < e->nrecs; i++) {
+	const struct srv_cache_rec *rec = &e->recs[i];
+	size_t len = strlen(rec->target);
+
+	if ((rr = calloc(1, sizeof(*rr))) == NULL) {
+	    rk_dns_free_data(r);
+	    return NULL;
+	}
+	*tail = rr;
+	tail = &rr->next;
+	rr->domain = strdup(e->domain);
+	rr->type = rk_ns_t_srv;
+	rr->class = rk_ns_c_in;
+	rr->u.srv = malloc(sizeof(*rr->u.srv) + len);
+	if (rr->domain == NULL || rr->u.srv == NULL) {
+	    rk_dns_free_data(r);
+	    return NULL;
+	}
+	rr->size = sizeof(*rr->u.srv) + len;
+	rr->u.srv->priority = rec->priority;
+	rr->u.srv->weight = rec->weight;
+	rr->u.srv->port = rec->port;
+	memcpy(rr->u.srv->target, rec->target, len + 1);
+    }
+    return r;
+}
+
+static struct srv_cache_entry *
+srv_cache_entry_from_reply(const char *domain, const char *type,
+			   const struct rk_dns_reply *r, time_t now)
+{
+    struct srv_cache_entry *e;
+    struct rk_resource_record *rr;
+    unsigned ttl = UINT_MAX;
+    size_t n = 0;
+
+    for (rr = r->head; rr; rr = rr->next) {
+	if (rr->type != rk_ns_t_srv)
+	    continue;
+	ttl = min(ttl, rr->ttl);
+	n++;
+    }
+    /* Nothing to remember, or records that must not be cached */
+    if (n == 0 || ttl == 0)
+	return NULL;
+
+    if ((e = srv_cache_new_entry(domain, type, now + ttl, n)) == NULL)
+	return NULL;
+    for (n = 0, rr = r->head; rr; rr = rr->next) {
+	if (rr->type != rk_ns_t_srv)
+	    continue;
+	e->recs[n].priority = rr->u.srv->priority;
+	e->recs[n].weight = rr->u.srv->weight;
+	e->recs[n].port = rr->u.srv->port;
+	if ((e->recs[n].target = strdup(rr->u.srv->target)) == NULL) {
+	    srv_cache_free_entry(e);
+	    return NULL;
+	}
+	n++;
+    }
+    return e;
+}
+
+/*
+ * The cache file has one line per record,
+ *
+ *	expires domain type priority weight port target
+ *
+ * with "- - - -" for the record fields of a failed lookup.  It is only
+ * trusted if it belongs to us (or root) and only we can write it.
+ */
+static void
+srv_cache_load(krb5_context context, const char *fn, time_t now)
+{
+    struct srv_cache_entry *e = NULL;
+    struct stat sb;
+    char buf[1100];
+    FILE *f;
+    int fd;
+
+    if ((fd = open(fn, O_RDONLY | O_CLOEXEC)) < 0)
+	return;
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) ||
+#ifndef _WIN32
+	(sb.st_uid != geteuid() && sb.st_uid != 0) ||
+#endif
+	(sb.st_mode & 022) != 0 || (f = fdopen(fd, "r")) == NULL) {
+	close(fd);
+	return;
+    }
+
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+	char domain[1024], type[16], prio[16], weight[16], port[16];
+	char target[1024];
+	struct srv_cache_rec *tmp;
+	long long expires;
+
+	if (sscanf(buf, "%lld %1023s %15s %15s %15s %15s %1023s", &expires,
+		   domain, type, prio, weight, port, target) != 7)
+	    break;
+	if (e == NULL || strcasecmp(e->domain, domain) != 0 ||
+	    strcasecmp(e->type, type) != 0) {
+	    if (e != NULL && e->expires > now &&
+		srv_cache_find(e->domain, e->type, now) == NULL)
+		srv_cache_add(e);
+	    else
+		srv_cache_free_entry(e);
+	    if ((e = srv_cache_new_entry(domain, type, expires, 0)) == NULL)
+		break;
+	}
+	if (strcmp(target, "-") == 0)
+	    continue;
+	tmp = realloc(e->recs, (e->nrecs + 1) * sizeof(e->recs[0]));
+	if (tmp == NULL)
+	    break;
+	e->recs = tmp;
+	tmp = &e->recs[e->nrecs];
+	tmp->priority = strtoul(prio, NULL, 10);
+	tmp->weight = strtoul(weight, NULL, 10);
+	tmp->port = strtoul(port, NULL, 10);
+	if ((tmp->target = strdup(target)) == NULL)
+	    break;
+	e->nrecs++;
+    }
+    if (e != NULL && !ferror(f) && feof(f) && e->expires > now &&
+	srv_cache_find(e->domain, e->type, now) == NULL)
+	srv_cache_add(e);
+    else
+	srv_cache_free_entry(e);
+    fclose(f);
+}
+
+static void
+srv_cache_save(krb5_context context, const char *fn, time_t now)
+{
+    struct srv_cache_entry *e;
+    char *tmpfn = NULL;
+    FILE *f = NULL;
+    size_t i;
+    int fd;
+
+    if (asprintf(&tmpfn, "%s.XXXXXX", fn) < 0 || tmpfn == NULL)
+	return;
+    if ((fd = mkstemp(tmpfn)) < 0) {
+	free(tmpfn);
+	return;
+    }
+    if ((f = fdopen(fd, "w")) == NULL) {
+	close(fd);
+	goto out;
+    }
+    for (e = srv_cache; e; e = e->next) {
+	if (e->expires <= now)
+	    continue;
+	if (e->nrecs == 0)
+	    fprintf(f, "%lld %s %s - - - -\n", (long long)e->expires,
+		    e->domain, e->type);
+	for (i = 0; i < e->nrecs; i++)
+	    fprintf(f, "%lld %s %s %u %u %u %s\n", (long long)e->expires,
+		    e->domain, e->type, e->recs[i].priority,
+		    e->recs[i].weight, e->recs[i].port, e->recs[i].target);
+    }
+    if (fclose(f) == 0 && rk_rename(tmpfn, fn) == 0) {
+	free(tmpfn);
+	return;
+    }
+    _krb5_debug(context, 5, "Could not write DNS cache file %s", fn);
+out:
+    (void) unlink(tmpfn);
+    free(tmpfn);
+}
+
+/*
+ * rk_dns_lookup() through the cache.
+ */
+static struct rk_dns_reply *
+srv_lookup(krb5_context context, const char *domain, const char *dns_type)
+{
+    struct srv_cache_entry *e;
+    struct rk_dns_reply *r = NULL;
+    const char *fn;
+    time_t now = time(NULL);
+    int i;
+
+    fn = krb5_config_get_string(context, NULL, "libdefaults",
+				"dns_cache_file", NULL);
+
+    HEIMDAL_MUTEX_lock(&srv_cache_mutex);
+    for (i = 0; i < 2; i++) {
+	if ((e = srv_cache_find(domain, dns_type, now)) != NULL) {
+	    if (e->nrecs)
+		r = srv_cache_reply(e);
+	    HEIMDAL_MUTEX_unlock(&srv_cache_mutex);
+	    _krb5_debug(context, 5, "DNS lookup of %s answered from cache",
+			domain);
+	    return r;
+	}
+	if (fn == NULL || i > 0)
+	    break;
+	srv_cache_load(context, fn, now);
+    }
+    HEIMDAL_MUTEX_unlock(&srv_cache_mutex);
+
+    r = rk_dns_lookup(domain, dns_type);
+    if (r != NULL)
+	e = srv_cache_entry_from_reply(domain, dns_type, r, now);
+    else
+	e = srv_cache_new_entry(domain, dns_type, now + SRV_NEGATIVE_TTL, 0);
+    if (e == NULL)
+	return r;
+
+    HEIMDAL_MUTEX_lock(&srv_cache_mutex);
+    srv_cache_add(e);
+    if (fn != NULL) {
+	/* Keep what other processes have added since we last looked */
+	srv_cache_load(context, fn, now);
+	srv_cache_save(context, fn, now);
+    }
+    HEIMDAL_MUTEX_unlock(&srv_cache_mutex);
+    return r;
+}
+
 /*
  * set `res' and `count' to the result of looking up SRV RR in DNS for
  * `proto', `proto', `realm' using `dns_type'.
@@ -99,7 +455,7 @@ srv_find_realm(krb5_context context, krb5_krbhst_info ***res, int *count,
     else
 	snprintf(domain, sizeof(domain), "_%s._%s.%s.", service, proto, realm);
 
-    r = rk_dns_lookup(domain, dns_type);
+    r = srv_lookup(context, domain, dns_type);
     if(r == NULL) {
 	_krb5_debug(context, 0,
 		    "DNS lookup failed domain: %s", domain);
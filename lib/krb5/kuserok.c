@@ -457,6 +457,91 @@ krb5_kuserok(krb5_context context,
 
 static const char *kuserok_plugin_deps[] = { "krb5", NULL };
 
+/*
+ * Add the k5login file(s) that `rule' reads to `paths', which has room
+ * for `max' of them, for the result cache.  Returns FALSE if they can't
+ * all be named.
+ */
+static krb5_boolean
+kuserok_rule_paths(krb5_context context, struct plctx *ctx, const char *rule,
+		   char **paths, size_t *n, size_t max)
+{
+    const char *dir = NULL;
+    char *path = NULL;
+
+    if (strcmp(rule, "USER-K5LOGIN") == 0) {
+#ifndef _WIN32
+	struct passwd pw, *pwd = NULL;
+	char pwbuf[2048];
+	char *path_exp;
+
+	dir = ctx->k5login_dir;
+	if (dir == NULL) {
+	    if (!_krb5_homedir_access(context))
+		return TRUE;
+	    if (getpwnam_r(ctx->luser, &pw, pwbuf, sizeof(pwbuf), &pwd) != 0 ||
+		pwd == NULL)
+		return TRUE;
+	    dir = pwd->pw_dir;
+	}
+	if (*n + 2 > max || asprintf(&path, "%s/.k5login.d", dir) == -1)
+	    return FALSE;
+	if (_krb5_expand_path_tokensv(context, path, 1, &path_exp,
+				      "luser", ctx->luser, NULL) != 0) {
+	    free(path);
+	    return FALSE;
+	}
+	free(path);
+	paths[(*n)++] = path_exp;
+	if ((path = strdup(path_exp)) == NULL)
+	    return FALSE;
+	path[strlen(path) - strlen(".d")] = '\0';
+	paths[(*n)++] = path;
+#endif
+	return TRUE;
+    }
+
+    if (strcmp(rule, "SYSTEM-K5LOGIN") == 0)
+	dir = ctx->k5login_dir ? ctx->k5login_dir : SYSTEM_K5LOGIN_DIR;
+    else if (strncmp(rule, "SYSTEM-K5LOGIN:", strlen("SYSTEM-K5LOGIN:")) == 0)
+	dir = rule + strlen("SYSTEM-K5LOGIN:");
+    else
+	return TRUE; /* SIMPLE, DENY and plugins are left to the TTL */
+
+    if (*n + 1 > max ||
+	asprintf(&path, "%s/%s", dir, ctx->luser) == -1)
+	return FALSE;
+    paths[(*n)++] = path;
+    return TRUE;
+}
+
+/*
+ * Remember the answer for `ctx' in the context's cache, along with the
+ * k5login files it was drawn from by the first `nrules' of `rules'.
+ */
+static void
+kuserok_cache_result(krb5_context context, struct plctx *ctx,
+		     char **rules, size_t nrules)
+{
+    char *paths[5];
+    size_t i, n = 0;
+    krb5_boolean ok = TRUE;
+
+    if (rules == NULL) {
+	ok = kuserok_rule_paths(context, ctx, "USER-K5LOGIN", paths, &n, 4);
+    } else {
+	for (i = 0; ok && i < nrules; i++)
+	    ok = kuserok_rule_paths(context, ctx, rules[i], paths, &n, 4);
+    }
+    paths[n] = NULL;
+    if (ok)
+	_krb5_lname_cache_put_kuserok(context, ctx->principal, ctx->luser,
+				      !!(ctx->flags & KUSEROK_ANAME_TO_LNAME_OK),
+				      ctx->result, paths);
+    for (i = 0; i < n; i++)
+	free(paths[i]);
+}
+
 static struct heim_plugin_data
 kuserok_plugin_data = {
     "krb5",
@@ -476,6 +561,7 @@ _krb5_kuserok(krb5_context context,
     krb5_error_code ret;
     struct plctx ctx;
     char **rules;
+    size_t n = 0;
 
     /*
      * XXX we should have a struct with a krb5_context field and a
@@ -486,6 +572,11 @@ _krb5_kuserok(krb5_context context,
      */
     heim_base_once_f(&reg_def_plugins, context, reg_def_plugins_once);
 
+    if (context->lname_cache_ttl > 0 &&
+	_krb5_lname_cache_get_kuserok(context, principal, luser, an2ln_ok,
+				      &ctx.result))
+	return ctx.result;
+
     ctx.flags = 0;
     ctx.luser = luser;
     ctx.principal = principal;
@@ -521,10 +612,8 @@ _krb5_kuserok(krb5_context context,
 
 	ctx.result = FALSE;
     } else {
-	size_t n;
-
-	for (n = 0; rules[n]; n++) {
-	    ctx.rule = rules[n];
+	while (rules[n]) {
+	    ctx.rule = rules[n++];
 
 	    ret = _krb5_plugin_run_f(context, &kuserok_plugin_data,
 				     0, &ctx, plcallback);
@@ -534,6 +623,8 @@ _krb5_kuserok(krb5_context context,
     }
 
 out:
+    if (context->lname_cache_ttl > 0)
+	kuserok_cache_result(context, &ctx, rules, n);
     krb5_config_free_strings(rules);
 
     return ctx.result;
@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * A cache, per context, of the answers of krb5_kuserok() and
+ * krb5_aname_to_localname(), for services that authorize the same few
+ * principals as the same few users over and over.  It is only used
+ * when [libdefaults] local_name_cache_ttl is set, and entries are kept
+ * for at most that long.
+ *
+ * A krb5_kuserok() answer also remembers the k5login files it depends
+ * on, and is dropped as soon as one of them is created, removed or
+ * modified.  Changes to the files in a k5login directory, and to the
+ * databases of auth_to_local rules, are only seen once the entry
+ * expires.  The whole cache is dropped when the configuration is
+ * reloaded.
+ */
+
+#include "krb5_locl.h"
+
+#define LNAME_CACHE_MAX		256
+#define LNAME_CACHE_MAX_FILES	4
+
+struct lname_cache_file {
+    char *path;
+    int exists;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+};
+
+struct lname_cache_entry {
+    struct lname_cache_entry *next;
+    int kind;			/* LNAME_AN2LN or LNAME_KUSEROK* */
+#define LNAME_AN2LN		0
+#define LNAME_KUSEROK		1
+#define LNAME_KUSEROK_NO_AN2LN	2
+    char *principal;
+    char *luser;		/* NULL for LNAME_AN2LN */
+    time_t expires;
+    krb5_error_code ret;	/* LNAME_AN2LN */
+    char *lname;		/* LNAME_AN2LN */
+    krb5_boolean result;	/* LNAME_KUSEROK* */
+    size_t nfiles;
+    struct lname_cache_file files[LNAME_CACHE_MAX_FILES];
+};
+
+struct _krb5_lname_cache {
+    struct lname_cache_entry *head;
+    size_t n;
+};
+
+static void
+entry_free(struct lname_cache_entry *e)
+{
+    size_t i;
+
+    for (i = 0; i < e->nfiles; i++)
+	free(e->files[i].path);
+    free(e->principal);
+    free(e->luser);
+    free(e->lname);
+    free(e);
+}
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+_krb5_lname_cache_free(krb5_context context)
+{
+    struct _krb5_lname_cache *c = context->lname_cache;
+    struct lname_cache_entry *e;
+
+    if (c == NULL)
+	return;
+    while ((e = c->head) != NULL) {
+	c->head = e->next;
+	entry_free(e);
+    }
+    free(c);
+    context->lname_cache = NULL;
+}
+
+static void
+file_stat(struct lname_cache_file *f)
+{
+    struct stat st;
+
+    f->exists = stat(f->path, &st) == 0;
+    if (!f->exists)
+	return;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->size = st.st_size;
+    f->mtime = st.st_mtime;
+}
+
+static krb5_boolean
+file_changed(const struct lname_cache_file *f)
+{
+    struct lname_cache_file now;
+
+    now.path = f->path;
+    file_stat(&now);
+    if (now.exists != f->exists)
+	return TRUE;
+    return now.exists &&
+	(now.dev != f->dev || now.ino != f->ino ||
+	 now.size != f->size || now.mtime != f->mtime);
+}
+
+/*
+ * Find the live entry of `kind' for `principal' and `luser', most
+ * recently used first, dropping what has expired or changed on the
+ * way.
+ */
+static struct lname_cache_entry *
+lookup(krb5_context context, int kind, krb5_const_principal principal,
+       const char *luser)
+{
+    struct _krb5_lname_cache *c = context->lname_cache;
+    struct lname_cache_entry **p, *e;
+    time_t now = time(NULL);
+    char *name;
+    size_t i;
+
+    if (c == NULL ||
+	krb5_unparse_name(context, principal, &name) != 0)
+	return NULL;
+
+    for (p = &c->head; (e = *p) != NULL; ) {
+	if (e->expires < now) {
+	    *p = e->next;
+	    entry_free(e);
+	    c->n--;
+	    continue;
+	}
+	if (e->kind != kind || strcmp(e->principal, name) != 0 ||
+	    (luser && strcmp(e->luser, luser) != 0)) {
+	    p = &e->next;
+	    continue;
+	}
+	for (i = 0; i < e->nfiles; i++)
+	    if (file_changed(&e->files[i]))
+		break;
+	*p = e->next;
+	if (i < e->nfiles) {
+	    entry_free(e);
+	    c->n--;
+	    e = NULL;
+	} else {
+	    e->next = c->head;
+	    c->head = e;
+	}
+	break;
+    }
+    free(name);
+    return e;
+}
+
+/* Make a new entry, most recently used, dropping the least if full */
+static struct lname_cache_entry *
+add(krb5_context context, int kind, krb5_const_principal principal,
+    const char *luser)
+{
+    struct _krb5_lname_cache *c = context->lname_cache;
+    struct lname_cache_entry **p, *e;
+
+    if (c == NULL) {
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+	    return NULL;
+	context->lname_cache = c;
+    }
+    if ((e = calloc(1, sizeof(*e))) == NULL)
+	return NULL;
+    e->kind = kind;
+    e->expires = time(NULL) + context->lname_cache_ttl;
+    if (krb5_unparse_name(context, principal, &e->principal) != 0 ||
+	(luser && (e->luser = strdup(luser)) == NULL)) {
+	entry_free(e);
+	return NULL;
+    }
+
+    if (c->n >= LNAME_CACHE_MAX) {
+	for (p = &c->head; (*p)->next; p = &(*p)->next)
+	    ;
+	entry_free(*p);
+	*p = NULL;
+	c->n--;
+    }
+    e->next = c->head;
+    c->head = e;
+    c->n++;
+    return e;
+}
+
+/*
+ * Look up a cached krb5_kuserok() answer, returns FALSE if there is
+ * none.
+ */
+
+KRB5_LIB_FUNCTION krb5_boolean KRB5_LIB_CALL
+_krb5_lname_cache_get_kuserok(krb5_context context,
+			      krb5_const_principal principal,
+			      const char *luser,
+			      krb5_boolean an2ln_ok,
+			      krb5_boolean *result)
+{
+    struct lname_cache_entry *e;
+
+    e = lookup(context, an2ln_ok ? LNAME_KUSEROK : LNAME_KUSEROK_NO_AN2LN,
+	       principal, luser);
+    if (e == NULL)
+	return FALSE;
+    *result = e->result;
+    return TRUE;
+}
+
+/*
+ * Cache a krb5_kuserok() answer, which depends on the NULL-terminated
+ * list of files `paths'.
+ */
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+_krb5_lname_cache_put_kuserok(krb5_context context,
+			      krb5_const_principal principal,
+			      const char *luser,
+			      krb5_boolean an2ln_ok,
+			      krb5_boolean result,
+			      char * const *paths)
+{
+    struct lname_cache_entry *e;
+    size_t i;
+
+    for (i = 0; paths && paths[i]; i++)
+	if (i == LNAME_CACHE_MAX_FILES)
+	    return;
+
+    e = add(context, an2ln_ok ? LNAME_KUSEROK : LNAME_KUSEROK_NO_AN2LN,
+	    principal, luser);
+    if (e == NULL)
+	return;
+    e->result = result;
+    for (i = 0; paths && paths[i]; i++) {
+	if ((e->files[i].path = strdup(paths[i])) == NULL) {
+	    /* Can't tell when this goes stale */
+	    e->expires = 0;
+	    return;
+	}
+	e->nfiles++;
+	file_stat(&e->files[i]);
+    }
+}
+
+/*
+ * Look up a cached krb5_aname_to_localname() answer, returns FALSE if
+ * there is none.  `*lname' is only set when `*ret' is 0.
+ */
+
+KRB5_LIB_FUNCTION krb5_boolean KRB5_LIB_CALL
+_krb5_lname_cache_get_an2ln(krb5_context context,
+			    krb5_const_principal aname,
+			    const char **lname,
+			    krb5_error_code *ret)
+{
+    struct lname_cache_entry *e;
+
+    e = lookup(context, LNAME_AN2LN, aname, NULL);
+    if (e == NULL)
+	return FALSE;
+    *lname = e->lname;
+    *ret = e->ret;
+    return TRUE;
+}
+
+/*
+ * Cache a krb5_aname_to_localname() answer.
+ */
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+_krb5_lname_cache_put_an2ln(krb5_context context,
+			    krb5_const_principal aname,
+			    const char *lname,
+			    krb5_error_code ret)
+{
+    struct lname_cache_entry *e;
+
+    e = add(context, LNAME_AN2LN, aname, NULL);
+    if (e == NULL)
+	return;
+    e->ret = ret;
+    if (ret == 0 && (e->lname = strdup(lname)) == NULL)
+	e->expires = 0;
+}
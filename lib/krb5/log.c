@@ -194,6 +194,32 @@ krb5_log(krb5_context context,
     return ret;
 }
 
+/*
+ * Open the debug destinations from KRB5_TRACE and [logging] krb5,
+ * which krb5_init_context() leaves to the first debug call.
+ */
+
+static void
+init_debug_dest(krb5_context context)
+{
+    const char *trace;
+    char **s, **p;
+
+    if ((context->flags & KRB5_CTX_F_DEBUG_DEST_PENDING) == 0)
+	return;
+    context->flags &= ~KRB5_CTX_F_DEBUG_DEST_PENDING;
+
+    trace = secure_getenv("KRB5_TRACE");
+    if (trace)
+        heim_add_debug_dest(context->hcontext, "libkrb5", trace);
+    s = krb5_config_get_strings(context, NULL, "logging", "krb5", NULL);
+    if (s) {
+        for (p = s; *p; p++)
+            heim_add_debug_dest(context->hcontext, "libkrb5", *p);
+        krb5_config_free_strings(s);
+    }
+}
+
 void KRB5_LIB_FUNCTION
 _krb5_debug(krb5_context context,
 	    int level,
@@ -203,9 +229,11 @@ _krb5_debug(krb5_context context,
 {
     va_list ap;
 
+    if (context == NULL || context->hcontext == NULL)
+        return;
+    init_debug_dest(context);
     va_start(ap, fmt);
-    if (context && context->hcontext)
-        heim_vdebug(context->hcontext, level, fmt, ap);
+    heim_vdebug(context->hcontext, level, fmt, ap);
     va_end(ap);
 }
 
@@ -218,9 +246,11 @@ krb5_debug(krb5_context context,
 {
     va_list ap;
 
+    if (context == NULL || context->hcontext == NULL)
+        return;
+    init_debug_dest(context);
     va_start(ap, fmt);
-    if (context && context->hcontext)
-        heim_vdebug(context->hcontext, level, fmt, ap);
+    heim_vdebug(context->hcontext, level, fmt, ap);
     va_end(ap);
 }
 
@@ -229,6 +259,7 @@ _krb5_have_debug(krb5_context context, int level)
 {
     if (context == NULL || context->hcontext == NULL)
 	return 0;
+    init_debug_dest(context);
     return heim_have_debug(context->hcontext, level);
 }
 
@@ -242,6 +273,7 @@ KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_set_debug_dest(krb5_context context, const char *program,
                     const char *log_spec)
 {
+    init_debug_dest(context);
     return heim_add_debug_dest(context->hcontext, program, log_spec);
 }
 
@@ -44,20 +44,150 @@ typedef struct krb5_mcache {
     struct link {
 	krb5_creds cred;
 	struct link *next;
+	struct link *hnext;	/* next in the same cred_hash bucket */
+	uint32_t hash;		/* of cred.server, ignoring the realm */
     } *creds;
-    struct krb5_mcache *next;
+    struct link **cred_hash;	/* newest first, like creds; may be NULL */
+    size_t cred_nbuckets;
+    size_t ncreds;
+    struct krb5_mcache *next;	/* in the same registry bucket */
     time_t mtime;
     krb5_deltat kdc_offset;
     HEIMDAL_MUTEX mutex;
 } krb5_mcache;
 
-static HEIMDAL_MUTEX mcc_mutex = HEIMDAL_MUTEX_INITIALIZER;
-static struct krb5_mcache *mcc_head;
+/*
+ * Named caches are kept in a hash table.  Bucket `i' is protected by
+ * mcc_locks[i % MCC_NLOCKS], which is taken before any cache's mutex.
+ */
+#define MCC_NBUCKETS	4096
+#define MCC_NLOCKS	64
+
+/* Caches with more credentials than this index them by server */
+#define MCC_CRED_HASH_MIN	8
+
+static heim_base_once_t mcc_locks_once = HEIM_BASE_ONCE_INIT;
+static HEIMDAL_MUTEX mcc_locks[MCC_NLOCKS];
+static struct krb5_mcache *mcc_buckets[MCC_NBUCKETS];
 
 #define	MCACHE(X)	((krb5_mcache *)(X)->data.data)
 
 #define MISDEAD(X)	((X)->dead)
 
+static void
+mcc_init_locks(void *arg)
+{
+    size_t i;
+
+    for (i = 0; i < MCC_NLOCKS; i++)
+	HEIMDAL_MUTEX_init(&mcc_locks[i]);
+}
+
+static size_t
+mcc_bucket(const char *name)
+{
+    uint32_t h = 2166136261U;
+
+    for (; *name; name++)
+	h = (h ^ (unsigned char)*name) * 16777619U;
+    return h % MCC_NBUCKETS;
+}
+
+static HEIMDAL_MUTEX *
+mcc_lock(size_t bucket)
+{
+    heim_base_once_f(&mcc_locks_once, NULL, mcc_init_locks);
+    return &mcc_locks[bucket % MCC_NLOCKS];
+}
+
+/* Remove `m' from the registry; the caller holds the bucket's lock */
+static void
+mcc_unlink(krb5_mcache *m, size_t bucket)
+{
+    krb5_mcache **n;
+
+    for (n = &mcc_buckets[bucket]; *n != NULL; n = &(*n)->next) {
+	if (*n == m) {
+	    *n = m->next;
+	    break;
+	}
+    }
+    m->next = NULL;
+}
+
+/*
+ * Rebuild the credential index with room for the current number of
+ * credentials.  If that fails the old index, which is still complete,
+ * is kept.
+ */
+static void
+mcc_rehash(krb5_mcache *m)
+{
+    struct link **hash, **tails, *l;
+    size_t n, i;
+
+    for (n = 16; n < m->ncreds; n *= 2)
+	;
+    hash = calloc(n, sizeof(hash[0]));
+    tails = calloc(n, sizeof(tails[0]));
+    if (hash == NULL || tails == NULL) {
+	free(hash);
+	free(tails);
+	return;
+    }
+    for (l = m->creds; l != NULL; l = l->next) {
+	i = l->hash & (n - 1);
+	l->hnext = NULL;
+	if (tails[i])
+	    tails[i]->hnext = l;
+	else
+	    hash[i] = l;
+	tails[i] = l;
+    }
+    free(tails);
+    free(m->cred_hash);
+    m->cred_hash = hash;
+    m->cred_nbuckets = n;
+}
+
+/* Index `l', which has just been put at the head of m->creds */
+static void
+mcc_index_cred(krb5_mcache *m, struct link *l)
+{
+    size_t i;
+
+    l->hash = l->cred.server ?
+	_krb5_principal_hash_any_realm(l->cred.server) : 0;
+    l->hnext = NULL;
+    m->ncreds++;
+    if (m->cred_hash) {
+	i = l->hash & (m->cred_nbuckets - 1);
+	l->hnext = m->cred_hash[i];
+	m->cred_hash[i] = l;
+	if (m->ncreds > 2 * m->cred_nbuckets)
+	    mcc_rehash(m);
+    } else if (m->ncreds > MCC_CRED_HASH_MIN) {
+	mcc_rehash(m);
+    }
+}
+
+static void
+mcc_unindex_cred(krb5_mcache *m, struct link *l)
+{
+    struct link **q;
+
+    m->ncreds--;
+    if (m->cred_hash == NULL)
+	return;
+    for (q = &m->cred_hash[l->hash & (m->cred_nbuckets - 1)];
+	 *q != NULL; q = &(*q)->hnext) {
+	if (*q == l) {
+	    *q = l->hnext;
+	    break;
+	}
+    }
+}
+
 static krb5_error_code KRB5_CALLCONV
 mcc_get_name_2(krb5_context context,
 	       krb5_ccache id,
@@ -78,7 +208,9 @@ static krb5_error_code
 mcc_alloc(krb5_context context, const char *name, krb5_mcache **out)
 {
     krb5_mcache *m, *m_c;
+    HEIMDAL_MUTEX *lock;
     size_t counter = 0;
+    size_t bucket;
     int ret = 0;
 
     *out = NULL;
@@ -115,28 +247,28 @@ again:
     }
 
     /* check for dups first */
-    HEIMDAL_MUTEX_lock(&mcc_mutex);
-    for (m_c = mcc_head; m_c != NULL; m_c = m_c->next)
+    bucket = mcc_bucket(m->name);
+    lock = mcc_lock(bucket);
+    HEIMDAL_MUTEX_lock(lock);
+    for (m_c = mcc_buckets[bucket]; m_c != NULL; m_c = m_c->next)
         if (strcmp(m->name, m_c->name) == 0)
             break;
     if (m_c) {
         free(m->name);
-        free(m);
-        if (name) {
-            /* We raced with another thread to create this cache */
-            m = m_c;
-            HEIMDAL_MUTEX_lock(&(m->mutex));
-            m->refcnt++;
-            HEIMDAL_MUTEX_unlock(&(m->mutex));
-        } else {
+        m->name = NULL;
+        if (name == NULL) {
             /* How likely are we to conflict on new_unique anyways?? */
             counter++;
-            free(m->name);
-            m->name = NULL;
-            HEIMDAL_MUTEX_unlock(&mcc_mutex);
+            HEIMDAL_MUTEX_unlock(lock);
             goto again;
         }
-        HEIMDAL_MUTEX_unlock(&mcc_mutex);
+        /* We raced with another thread to create this cache */
+        free(m);
+        m = m_c;
+        HEIMDAL_MUTEX_lock(&(m->mutex));
+        m->refcnt++;
+        HEIMDAL_MUTEX_unlock(&(m->mutex));
+        HEIMDAL_MUTEX_unlock(lock);
         *out = m;
         return 0;
     }
@@ -148,10 +280,10 @@ again:
     m->creds = NULL;
     m->mtime = time(NULL);
     m->kdc_offset = 0;
-    m->next = mcc_head;
+    m->next = mcc_buckets[bucket];
     HEIMDAL_MUTEX_init(&(m->mutex));
-    mcc_head = m;
-    HEIMDAL_MUTEX_unlock(&mcc_mutex);
+    mcc_buckets[bucket] = m;
+    HEIMDAL_MUTEX_unlock(lock);
     *out = m;
     return 0;
 }
@@ -213,6 +345,10 @@ mcc_destroy_internal(krb5_context context,
     }
 
     m->creds = NULL;
+    free(m->cred_hash);
+    m->cred_hash = NULL;
+    m->cred_nbuckets = 0;
+    m->ncreds = 0;
     return;
 }
 
@@ -277,7 +413,9 @@ static krb5_error_code KRB5_CALLCONV
 mcc_destroy(krb5_context context,
 	    krb5_ccache id)
 {
-    krb5_mcache **n, *m = MCACHE(id);
+    krb5_mcache *m = MCACHE(id);
+    HEIMDAL_MUTEX *lock;
+    size_t bucket;
 
     if (m->anonymous) {
         HEIMDAL_MUTEX_lock(&(m->mutex));
@@ -291,28 +429,25 @@ mcc_destroy(krb5_context context,
         return 0;
     }
 
-    HEIMDAL_MUTEX_lock(&mcc_mutex);
+    bucket = mcc_bucket(m->name);
+    lock = mcc_lock(bucket);
+    HEIMDAL_MUTEX_lock(lock);
     HEIMDAL_MUTEX_lock(&(m->mutex));
     if (m->refcnt == 0)
     {
     	HEIMDAL_MUTEX_unlock(&(m->mutex));
-	HEIMDAL_MUTEX_unlock(&mcc_mutex);
+	HEIMDAL_MUTEX_unlock(lock);
     	krb5_abortx(context, "mcc_destroy: refcnt already 0");
     }
 
     if (!MISDEAD(m)) {
-	/* if this is an active mcache, remove it from the linked
-           list, and free all data */
-	for(n = &mcc_head; n && *n; n = &(*n)->next) {
-	    if(m == *n) {
-		*n = m->next;
-		break;
-	    }
-	}
+	/* if this is an active mcache, remove it from the registry,
+           and free all data */
+	mcc_unlink(m, bucket);
 	mcc_destroy_internal(context, m);
     }
     HEIMDAL_MUTEX_unlock(&(m->mutex));
-    HEIMDAL_MUTEX_unlock(&mcc_mutex);
+    HEIMDAL_MUTEX_unlock(lock);
     return 0;
 }
 
@@ -333,8 +468,10 @@ mcc_store_cred(krb5_context context,
     }
 
     l = malloc (sizeof(*l));
-    if (l == NULL)
+    if (l == NULL) {
+	HEIMDAL_MUTEX_unlock(&(m->mutex));
         return krb5_enomem(context);
+    }
     l->next = m->creds;
     m->creds = l;
     memset (&l->cred, 0, sizeof(l->cred));
@@ -345,6 +482,7 @@ mcc_store_cred(krb5_context context,
     	HEIMDAL_MUTEX_unlock(&(m->mutex));
     	return ret;
     }
+    mcc_index_cred(m, l);
     m->mtime = time(NULL);
 	HEIMDAL_MUTEX_unlock(&(m->mutex));
     return 0;
@@ -422,6 +560,48 @@ mcc_end_get (krb5_context context,
     return 0;
 }
 
+/*
+ * Return the newest matching credential, as the sequential search in
+ * krb5_cc_retrieve_cred() would, looking only at credentials for the
+ * same server when the cache is indexed.
+ */
+static krb5_error_code KRB5_CALLCONV
+mcc_retrieve(krb5_context context,
+	     krb5_ccache id,
+	     krb5_flags which,
+	     const krb5_creds *mcreds,
+	     krb5_creds *creds)
+{
+    krb5_mcache *m = MCACHE(id);
+    krb5_error_code ret = KRB5_CC_END;
+    struct link *l;
+    uint32_t hash;
+
+    HEIMDAL_MUTEX_lock(&(m->mutex));
+    if (MISDEAD(m)) {
+	HEIMDAL_MUTEX_unlock(&(m->mutex));
+	return ENOENT;
+    }
+    if (m->cred_hash && mcreds->server) {
+	hash = _krb5_principal_hash_any_realm(mcreds->server);
+	for (l = m->cred_hash[hash & (m->cred_nbuckets - 1)];
+	     l != NULL; l = l->hnext) {
+	    if (l->hash == hash &&
+		krb5_compare_creds(context, which, mcreds, &l->cred))
+		break;
+	}
+    } else {
+	for (l = m->creds; l != NULL; l = l->next) {
+	    if (krb5_compare_creds(context, which, mcreds, &l->cred))
+		break;
+	}
+    }
+    if (l != NULL)
+	ret = krb5_copy_creds_contents(context, &l->cred, creds);
+    HEIMDAL_MUTEX_unlock(&(m->mutex));
+    return ret;
+}
+
 static krb5_error_code KRB5_CALLCONV
 mcc_remove_cred(krb5_context context,
 		 krb5_ccache id,
@@ -436,6 +616,7 @@ mcc_remove_cred(krb5_context context,
     for(q = &m->creds, p = *q; p; p = *q) {
 	if(krb5_compare_creds(context, which, mcreds, &p->cred)) {
 	    *q = p->next;
+	    mcc_unindex_cred(m, p);
 	    krb5_free_cred_contents(context, &p->cred);
 	    free(p);
 	    m->mtime = time(NULL);
@@ -454,27 +635,73 @@ mcc_set_flags(krb5_context context,
     return 0; /* XXX */
 }
 
+/*
+ * Iterating over the caches takes a reference to each of them up
+ * front, since the registry's buckets can change once their locks are
+ * dropped.
+ */
 struct mcache_iter {
-    krb5_mcache *cache;
+    krb5_mcache **caches;
+    size_t ncaches;
+    size_t next;
 };
 
+/* Drop a reference that is not held through a krb5_ccache */
+static void
+mcc_release(krb5_mcache *m)
+{
+    if (mcc_close_internal(m)) {
+	HEIMDAL_MUTEX_destroy(&(m->mutex));
+	free(m);
+    }
+}
+
+static void
+mcc_free_iter(struct mcache_iter *iter)
+{
+    size_t i;
+
+    for (i = iter->next; i < iter->ncaches; i++)
+	mcc_release(iter->caches[i]);
+    free(iter->caches);
+    free(iter);
+}
+
 static krb5_error_code KRB5_CALLCONV
 mcc_get_cache_first(krb5_context context, krb5_cc_cursor *cursor)
 {
     struct mcache_iter *iter;
+    krb5_mcache *m, **tmp;
+    size_t i, b, alloced = 0;
 
     iter = calloc(1, sizeof(*iter));
     if (iter == NULL)
 	return krb5_enomem(context);
 
-    HEIMDAL_MUTEX_lock(&mcc_mutex);
-    iter->cache = mcc_head;
-    if (iter->cache) {
-	HEIMDAL_MUTEX_lock(&(iter->cache->mutex));
-	iter->cache->refcnt++;
-	HEIMDAL_MUTEX_unlock(&(iter->cache->mutex));
+    for (i = 0; i < MCC_NLOCKS; i++) {
+	HEIMDAL_MUTEX *lock = mcc_lock(i);
+
+	HEIMDAL_MUTEX_lock(lock);
+	for (b = i; b < MCC_NBUCKETS; b += MCC_NLOCKS) {
+	    for (m = mcc_buckets[b]; m != NULL; m = m->next) {
+		if (iter->ncaches == alloced) {
+		    alloced = alloced ? alloced * 2 : 16;
+		    tmp = realloc(iter->caches, alloced * sizeof(tmp[0]));
+		    if (tmp == NULL) {
+			HEIMDAL_MUTEX_unlock(lock);
+			mcc_free_iter(iter);
+			return krb5_enomem(context);
+		    }
+		    iter->caches = tmp;
+		}
+		HEIMDAL_MUTEX_lock(&(m->mutex));
+		m->refcnt++;
+		HEIMDAL_MUTEX_unlock(&(m->mutex));
+		iter->caches[iter->ncaches++] = m;
+	    }
+	}
+	HEIMDAL_MUTEX_unlock(lock);
     }
-    HEIMDAL_MUTEX_unlock(&mcc_mutex);
 
     *cursor = iter;
     return 0;
@@ -487,25 +714,15 @@ mcc_get_cache_next(krb5_context context, krb5_cc_cursor cursor, krb5_ccache *id)
     krb5_error_code ret;
     krb5_mcache *m;
 
-    if (iter->cache == NULL)
+    if (iter->next >= iter->ncaches)
 	return KRB5_CC_END;
 
-    HEIMDAL_MUTEX_lock(&mcc_mutex);
-    m = iter->cache;
-    if (m->next)
-    {
-    	HEIMDAL_MUTEX_lock(&(m->next->mutex));
-    	m->next->refcnt++;
-    	HEIMDAL_MUTEX_unlock(&(m->next->mutex));
-    }
-
-    iter->cache = m->next;
-    HEIMDAL_MUTEX_unlock(&mcc_mutex);
-
     ret = _krb5_cc_allocate(context, &krb5_mcc_ops, id);
     if (ret)
 	return ret;
 
+    /* The iterator's reference passes to the new handle */
+    m = iter->caches[iter->next++];
     (*id)->data.data = m;
     (*id)->data.length = sizeof(*m);
 
@@ -515,12 +732,7 @@ mcc_get_cache_next(krb5_context context, krb5_cc_cursor cursor, krb5_ccache *id)
 static krb5_error_code KRB5_CALLCONV
 mcc_end_cache_get(krb5_context context, krb5_cc_cursor cursor)
 {
-    struct mcache_iter *iter = cursor;
-
-    if (iter->cache)
-    	mcc_close_internal(iter->cache);
-    iter->cache = NULL;
-    free(iter);
+    mcc_free_iter(cursor);
     return 0;
 }
 
@@ -528,26 +740,33 @@ static krb5_error_code KRB5_CALLCONV
 mcc_move(krb5_context context, krb5_ccache from, krb5_ccache to)
 {
     krb5_mcache *mfrom = MCACHE(from), *mto = MCACHE(to);
-    struct link *creds;
+    struct link *creds, **cred_hash;
     krb5_principal principal;
-    krb5_mcache **n;
+    HEIMDAL_MUTEX *lock;
+    size_t bucket, n;
 
-    HEIMDAL_MUTEX_lock(&mcc_mutex);
+    bucket = mcc_bucket(mfrom->name);
+    lock = mcc_lock(bucket);
+    HEIMDAL_MUTEX_lock(lock);
 
-    /* drop the from cache from the linked list to avoid lookups */
-    for(n = &mcc_head; n && *n; n = &(*n)->next) {
-	if(mfrom == *n) {
-	    *n = mfrom->next;
-	    break;
-	}
-    }
+    /* drop the from cache from the registry to avoid lookups */
+    mcc_unlink(mfrom, bucket);
 
     HEIMDAL_MUTEX_lock(&(mfrom->mutex));
     HEIMDAL_MUTEX_lock(&(mto->mutex));
-    /* swap creds */
+    /* swap creds and their index */
     creds = mto->creds;
     mto->creds = mfrom->creds;
     mfrom->creds = creds;
+    cred_hash = mto->cred_hash;
+    mto->cred_hash = mfrom->cred_hash;
+    mfrom->cred_hash = cred_hash;
+    n = mto->cred_nbuckets;
+    mto->cred_nbuckets = mfrom->cred_nbuckets;
+    mfrom->cred_nbuckets = n;
+    n = mto->ncreds;
+    mto->ncreds = mfrom->ncreds;
+    mfrom->ncreds = n;
     /* swap principal */
     principal = mto->primary_principal;
     mto->primary_principal = mfrom->primary_principal;
@@ -557,7 +776,7 @@ mcc_move(krb5_context context, krb5_ccache from, krb5_ccache to)
 
     HEIMDAL_MUTEX_unlock(&(mfrom->mutex));
     HEIMDAL_MUTEX_unlock(&(mto->mutex));
-    HEIMDAL_MUTEX_unlock(&mcc_mutex);
+    HEIMDAL_MUTEX_unlock(lock);
 
     krb5_cc_destroy(context, from);
     return 0;
@@ -619,7 +838,7 @@ KRB5_LIB_VARIABLE const krb5_cc_ops krb5_mcc_ops = {
     mcc_destroy,
     mcc_close,
     mcc_store_cred,
-    NULL, /* mcc_retrieve */
+    mcc_retrieve,
     mcc_get_principal,
     mcc_get_first,
     mcc_get_next,
@@ -50,6 +50,7 @@ struct PACTYPE {
 struct krb5_pac_data {
     struct PACTYPE *pac;
     krb5_data data;
+    krb5_boolean borrowed; /* data points into the caller's buffer */
     struct PAC_INFO_BUFFER *server_checksum;
     struct PAC_INFO_BUFFER *privsvr_checksum;
     struct PAC_INFO_BUFFER *logon_name;
@@ -96,8 +97,6 @@ struct krb5_pac_data {
 		}						\
 	} while(0)
 
-static const char zeros[PAC_ALIGNMENT] = { 0 };
-
 /*
  * HMAC-MD5 checksum over any key (needed for the PAC routines)
  */
@@ -141,13 +140,9 @@ HMAC_MD5_any_checksum(krb5_context context,
 }
 
 
-/*
- *
- */
-
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_pac_parse(krb5_context context, const void *ptr, size_t len,
-	       krb5_pac *pac)
+static krb5_error_code
+pac_parse(krb5_context context, const void *ptr, size_t len,
+	  krb5_boolean borrowed, krb5_pac *pac)
 {
     krb5_error_code ret;
     krb5_pac p;
@@ -289,9 +284,15 @@ krb5_pac_parse(krb5_context context, const void *ptr, size_t len,
 	}
     }
 
-    ret = krb5_data_copy(&p->data, ptr, len);
-    if (ret)
-	goto out;
+    if (borrowed) {
+	p->data.data = rk_UNCONST(ptr);
+	p->data.length = len;
+	p->borrowed = TRUE;
+    } else {
+	ret = krb5_data_copy(&p->data, ptr, len);
+	if (ret)
+	    goto out;
+    }
 
     krb5_storage_free(sp);
 
@@ -311,6 +312,53 @@ out:
     return ret;
 }
 
+/*
+ *
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_pac_parse(krb5_context context, const void *ptr, size_t len,
+	       krb5_pac *pac)
+{
+    return pac_parse(context, ptr, len, FALSE, pac);
+}
+
+/*
+ * Like krb5_pac_parse(), but the PAC refers to the buffers in `ptr'
+ * instead of copying them, so `ptr' must stay valid and unchanged
+ * until the PAC is freed.  Individual buffers are only copied out
+ * when asked for with krb5_pac_get_buffer(), which is all most
+ * acceptors need from a PAC with a large logon info buffer.
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+_krb5_pac_parse_borrowed(krb5_context context, const void *ptr, size_t len,
+			 krb5_pac *pac)
+{
+    return pac_parse(context, ptr, len, TRUE, pac);
+}
+
+/*
+ * Give a borrowed PAC its own copy of the data before it is modified.
+ */
+
+static krb5_error_code
+pac_own_data(krb5_context context, krb5_pac p)
+{
+    krb5_error_code ret;
+    krb5_data copy;
+
+    if (!p->borrowed)
+	return 0;
+
+    ret = krb5_data_copy(&copy, p->data.data, p->data.length);
+    if (ret)
+	return krb5_enomem(context);
+    p->data = copy;
+    p->borrowed = FALSE;
+    return 0;
+}
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_pac_init(krb5_context context, krb5_pac *pac)
 {
@@ -348,6 +396,10 @@ krb5_pac_add_buffer(krb5_context context, krb5_pac p,
     size_t len, offset, header_end, old_end;
     uint32_t i;
 
+    ret = pac_own_data(context, p);
+    if (ret)
+	return ret;
+
     len = p->pac->numbuffers;
 
     ptr = realloc(p->pac,
@@ -521,7 +573,8 @@ krb5_pac_free(krb5_context context, krb5_pac pac)
 {
     if (pac == NULL)
 	return;
-    krb5_data_free(&pac->data);
+    if (!pac->borrowed)
+	krb5_data_free(&pac->data);
     krb5_data_free(&pac->ticket_sign_data);
 
     krb5_free_principal(context, pac->upn_princ);
@@ -618,7 +671,7 @@ verify_checksum(krb5_context context,
    } else {
 	krb5_crypto crypto = NULL;
 
-	ret = krb5_crypto_init(context, key, 0, &crypto);
+	ret = krb5_crypto_init_cached(context, key, 0, &crypto);
 	if (ret)
 		goto out;
 
@@ -665,7 +718,7 @@ create_checksum(krb5_context context,
         if (ret)
             return ret;
     } else {
-	ret = krb5_crypto_init(context, key, 0, &crypto);
+	ret = krb5_crypto_init_cached(context, key, 0, &crypto);
 	if (ret)
 	    return ret;
 
@@ -1196,29 +1249,13 @@ build_attributes_info(krb5_context context,
     return ret;
 }
 
-/**
- * Verify the PAC.
- *
- * @param context Kerberos 5 context.
- * @param pac the pac structure returned by krb5_pac_parse().
- * @param authtime The time of the ticket the PAC belongs to.
- * @param principal the principal to verify.
- * @param server The service key, most always be given.
- * @param privsvr The KDC key, may be given.
-
- * @return Returns 0 to indicate success. Otherwise an kerberos et
- * error code is returned, see krb5_get_error_message().
- *
- * @ingroup krb5_pac
- */
-
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_pac_verify(krb5_context context,
-		const krb5_pac pac,
-		time_t authtime,
-		krb5_const_principal principal,
-		const krb5_keyblock *server,
-		const krb5_keyblock *privsvr)
+static krb5_error_code
+pac_verify(krb5_context context,
+	   const krb5_pac pac,
+	   time_t authtime,
+	   krb5_const_principal principal,
+	   const krb5_keyblock *server,
+	   const krb5_keyblock *privsvr)
 {
     krb5_error_code ret;
 
@@ -1310,11 +1347,12 @@ krb5_pac_verify(krb5_context context,
 				 &pac->canon_princ, &pac->sid);
 	if (ret)
 	    return ret;
+    }
 
-	if (principal && pac->canon_princ &&
-	    !krb5_realm_compare(context, principal, pac->canon_princ)) {
-	    return KRB5KRB_AP_ERR_MODIFIED;
-	}
+    /* The UPN DNS info may have been parsed on demand already */
+    if (principal && pac->canon_princ &&
+	!krb5_realm_compare(context, principal, pac->canon_princ)) {
+	return KRB5KRB_AP_ERR_MODIFIED;
     }
 
     if (pac->attributes_info) {
@@ -1327,27 +1365,36 @@ krb5_pac_verify(krb5_context context,
     return 0;
 }
 
-/*
+/**
+ * Verify the PAC.
  *
+ * @param context Kerberos 5 context.
+ * @param pac the pac structure returned by krb5_pac_parse().
+ * @param authtime The time of the ticket the PAC belongs to.
+ * @param principal the principal to verify.
+ * @param server The service key, most always be given.
+ * @param privsvr The KDC key, may be given.
+
+ * @return Returns 0 to indicate success. Otherwise an kerberos et
+ * error code is returned, see krb5_get_error_message().
+ *
+ * @ingroup krb5_pac
  */
 
-static krb5_error_code
-fill_zeros(krb5_context context, krb5_storage *sp, size_t len)
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_pac_verify(krb5_context context,
+		const krb5_pac pac,
+		time_t authtime,
+		krb5_const_principal principal,
+		const krb5_keyblock *server,
+		const krb5_keyblock *privsvr)
 {
-    ssize_t sret;
-    size_t l;
-
-    while (len) {
-	l = len;
-	if (l > sizeof(zeros))
-	    l = sizeof(zeros);
-	sret = krb5_storage_write(sp, zeros, l);
-	if (sret != l)
-	    return krb5_enomem(context);
+    krb5_error_code ret;
 
-	len -= sret;
-    }
-    return 0;
+    HEIM_PROBE1(krb5__pac__verify__start, _krb5_principal_probe_hash(principal));
+    ret = pac_verify(context, pac, authtime, principal, server, privsvr);
+    HEIM_PROBE1(krb5__pac__verify__done, ret);
+    return ret;
 }
 
 static krb5_error_code
@@ -1360,7 +1407,7 @@ pac_checksum(krb5_context context,
     krb5_error_code ret;
     krb5_crypto crypto = NULL;
 
-    ret = krb5_crypto_init(context, key, 0, &crypto);
+    ret = krb5_crypto_init_cached(context, key, 0, &crypto);
     if (ret)
 	return ret;
 
@@ -1383,99 +1430,85 @@ pac_checksum(krb5_context context,
     return 0;
 }
 
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-_krb5_pac_sign(krb5_context context,
-	       krb5_pac p,
-	       time_t authtime,
-	       krb5_const_principal principal,
-	       const krb5_keyblock *server_key,
-	       const krb5_keyblock *priv_key,
-	       uint16_t rodc_id,
-	       krb5_const_principal upn_princ,
-	       krb5_const_principal canon_princ,
-	       uint64_t *pac_attributes, /* optional */
-	       krb5_data *data)
-{
-    krb5_error_code ret;
-    krb5_storage *sp = NULL, *spdata = NULL;
-    uint32_t end;
-    size_t server_size, priv_size;
-    uint32_t server_offset = 0, priv_offset = 0, ticket_offset = 0;
-    uint32_t server_cksumtype = 0, priv_cksumtype = 0;
-    int num = 0;
-    size_t i, sz;
-    krb5_data logon, d;
-    krb5_data upn_dns_info;
-    krb5_data attributes_info;
+/*
+ * Record the well-known buffers of the PAC, refusing duplicates.
+ */
 
-    krb5_data_zero(&d);
-    krb5_data_zero(&logon);
-    krb5_data_zero(&upn_dns_info);
-    krb5_data_zero(&attributes_info);
+static krb5_error_code
+pac_find_buffers(krb5_context context, krb5_pac p)
+{
+    struct PAC_INFO_BUFFER **slot;
+    const char *what;
+    size_t i;
 
     for (i = 0; i < p->pac->numbuffers; i++) {
-	if (p->pac->buffers[i].type == PAC_SERVER_CHECKSUM) {
-	    if (p->server_checksum == NULL) {
-		p->server_checksum = &p->pac->buffers[i];
-	    }
-	    if (p->server_checksum != &p->pac->buffers[i]) {
-		ret = KRB5KDC_ERR_BADOPTION;
-		krb5_set_error_message(context, ret,
-				       N_("PAC has multiple server checksums", ""));
-		goto out;
-	    }
-	} else if (p->pac->buffers[i].type == PAC_PRIVSVR_CHECKSUM) {
-	    if (p->privsvr_checksum == NULL) {
-		p->privsvr_checksum = &p->pac->buffers[i];
-	    }
-	    if (p->privsvr_checksum != &p->pac->buffers[i]) {
-		ret = KRB5KDC_ERR_BADOPTION;
-		krb5_set_error_message(context, ret,
-				       N_("PAC has multiple KDC checksums", ""));
-		goto out;
-	    }
-	} else if (p->pac->buffers[i].type == PAC_LOGON_NAME) {
-	    if (p->logon_name == NULL) {
-		p->logon_name = &p->pac->buffers[i];
-	    }
-	    if (p->logon_name != &p->pac->buffers[i]) {
-		ret = KRB5KDC_ERR_BADOPTION;
-		krb5_set_error_message(context, ret,
-				       N_("PAC has multiple logon names", ""));
-		goto out;
-	    }
-	} else if (p->pac->buffers[i].type == PAC_UPN_DNS_INFO) {
-	    if (p->upn_dns_info == NULL) {
-		p->upn_dns_info = &p->pac->buffers[i];
-	    }
-	    if (p->upn_dns_info != &p->pac->buffers[i]) {
-		ret = KRB5KDC_ERR_BADOPTION;
-		krb5_set_error_message(context, ret,
-				       N_("PAC has multiple UPN DNS info buffers", ""));
-		goto out;
-	    }
-	} else if (p->pac->buffers[i].type == PAC_TICKET_CHECKSUM) {
-	    if (p->ticket_checksum == NULL) {
-		p->ticket_checksum = &p->pac->buffers[i];
-	    }
-	    if (p->ticket_checksum != &p->pac->buffers[i]) {
-		ret = KRB5KDC_ERR_BADOPTION;
-		krb5_set_error_message(context, ret,
-				       N_("PAC has multiple ticket checksums", ""));
-		goto out;
-	    }
-	} else if (p->pac->buffers[i].type == PAC_ATTRIBUTES_INFO) {
-	    if (p->attributes_info == NULL) {
-		p->attributes_info = &p->pac->buffers[i];
-	    }
-	    if (p->attributes_info != &p->pac->buffers[i]) {
-		ret = KRB5KDC_ERR_BADOPTION;
-		krb5_set_error_message(context, ret,
-				       N_("PAC has multiple attributes info buffers", ""));
-		goto out;
-	    }
+	switch (p->pac->buffers[i].type) {
+	case PAC_SERVER_CHECKSUM:
+	    slot = &p->server_checksum;
+	    what = "server checksums";
+	    break;
+	case PAC_PRIVSVR_CHECKSUM:
+	    slot = &p->privsvr_checksum;
+	    what = "KDC checksums";
+	    break;
+	case PAC_LOGON_NAME:
+	    slot = &p->logon_name;
+	    what = "logon names";
+	    break;
+	case PAC_UPN_DNS_INFO:
+	    slot = &p->upn_dns_info;
+	    what = "UPN DNS info buffers";
+	    break;
+	case PAC_TICKET_CHECKSUM:
+	    slot = &p->ticket_checksum;
+	    what = "ticket checksums";
+	    break;
+	case PAC_ATTRIBUTES_INFO:
+	    slot = &p->attributes_info;
+	    what = "attributes info buffers";
+	    break;
+	default:
+	    continue;
+	}
+	if (*slot == NULL)
+	    *slot = &p->pac->buffers[i];
+	if (*slot != &p->pac->buffers[i]) {
+	    krb5_set_error_message(context, KRB5KDC_ERR_BADOPTION,
+				   N_("PAC has multiple %s", ""), what);
+	    return KRB5KDC_ERR_BADOPTION;
 	}
     }
+    return 0;
+}
+
+static struct PAC_INFO_BUFFER *
+pac_append_buffer(krb5_pac p, uint32_t type)
+{
+    struct PAC_INFO_BUFFER *b = &p->pac->buffers[p->pac->numbuffers++];
+
+    memset(b, 0, sizeof(*b));
+    b->type = type;
+    return b;
+}
+
+/*
+ * Make sure the PAC has all the buffers that signing will fill in,
+ * adding empty ones for those that are missing.
+ */
+
+static krb5_error_code
+pac_reserve_buffers(krb5_context context,
+		    krb5_pac p,
+		    krb5_boolean want_upn_dns_info,
+		    krb5_boolean want_attributes_info)
+{
+    krb5_error_code ret;
+    int num = 0;
+    void *ptr;
+
+    ret = pac_find_buffers(context, p);
+    if (ret)
+	return ret;
 
     if (p->logon_name == NULL)
 	num++;
@@ -1483,259 +1516,333 @@ _krb5_pac_sign(krb5_context context,
 	num++;
     if (p->privsvr_checksum == NULL)
 	num++;
-    if ((upn_princ || canon_princ) && p->upn_dns_info == NULL)
+    if (want_upn_dns_info && p->upn_dns_info == NULL)
 	num++;
     if (p->ticket_sign_data.length != 0 && p->ticket_checksum == NULL)
 	num++;
-    if (pac_attributes && p->attributes_info == NULL)
+    if (want_attributes_info && p->attributes_info == NULL)
 	num++;
 
-    if (num) {
-	void *ptr;
+    if (num == 0)
+	return 0;
 
-	ptr = realloc(p->pac, sizeof(*p->pac) + (sizeof(p->pac->buffers[0]) * (p->pac->numbuffers + num - 1)));
-	if (ptr == NULL) {
-	    ret = krb5_enomem(context);
-            goto out;
-        }
+    ptr = realloc(p->pac, sizeof(*p->pac) + (sizeof(p->pac->buffers[0]) * (p->pac->numbuffers + num - 1)));
+    if (ptr == NULL)
+	return krb5_enomem(context);
+    p->pac = ptr;
 
-	p->pac = ptr;
+    /* The buffer array moved, find the buffers again */
+    p->server_checksum = p->privsvr_checksum = p->logon_name = NULL;
+    p->upn_dns_info = p->ticket_checksum = p->attributes_info = NULL;
+    ret = pac_find_buffers(context, p);
+    if (ret)
+	return ret;
 
-	if (p->logon_name == NULL) {
-	    p->logon_name = &p->pac->buffers[p->pac->numbuffers++];
-	    memset(p->logon_name, 0, sizeof(*p->logon_name));
-	    p->logon_name->type = PAC_LOGON_NAME;
-	}
-	if (p->server_checksum == NULL) {
-	    p->server_checksum = &p->pac->buffers[p->pac->numbuffers++];
-	    memset(p->server_checksum, 0, sizeof(*p->server_checksum));
-	    p->server_checksum->type = PAC_SERVER_CHECKSUM;
-	}
-	if (p->privsvr_checksum == NULL) {
-	    p->privsvr_checksum = &p->pac->buffers[p->pac->numbuffers++];
-	    memset(p->privsvr_checksum, 0, sizeof(*p->privsvr_checksum));
-	    p->privsvr_checksum->type = PAC_PRIVSVR_CHECKSUM;
-	}
-	if ((upn_princ || canon_princ) && p->upn_dns_info == NULL) {
-	    p->upn_dns_info = &p->pac->buffers[p->pac->numbuffers++];
-	    memset(p->upn_dns_info, 0, sizeof(*p->upn_dns_info));
-	    p->upn_dns_info->type = PAC_UPN_DNS_INFO;
-	}
-	if (p->ticket_sign_data.length != 0 && p->ticket_checksum == NULL) {
-	    p->ticket_checksum = &p->pac->buffers[p->pac->numbuffers++];
-	    memset(p->ticket_checksum, 0, sizeof(*p->ticket_checksum));
-	    p->ticket_checksum->type = PAC_TICKET_CHECKSUM;
-	}
-	if (pac_attributes && p->attributes_info == NULL) {
-	    p->attributes_info = &p->pac->buffers[p->pac->numbuffers++];
-	    memset(p->attributes_info, 0, sizeof(*p->attributes_info));
-	    p->attributes_info->type = PAC_ATTRIBUTES_INFO;
-	}
-    }
+    if (p->logon_name == NULL)
+	p->logon_name = pac_append_buffer(p, PAC_LOGON_NAME);
+    if (p->server_checksum == NULL)
+	p->server_checksum = pac_append_buffer(p, PAC_SERVER_CHECKSUM);
+    if (p->privsvr_checksum == NULL)
+	p->privsvr_checksum = pac_append_buffer(p, PAC_PRIVSVR_CHECKSUM);
+    if (want_upn_dns_info && p->upn_dns_info == NULL)
+	p->upn_dns_info = pac_append_buffer(p, PAC_UPN_DNS_INFO);
+    if (p->ticket_sign_data.length != 0 && p->ticket_checksum == NULL)
+	p->ticket_checksum = pac_append_buffer(p, PAC_TICKET_CHECKSUM);
+    if (want_attributes_info && p->attributes_info == NULL)
+	p->attributes_info = pac_append_buffer(p, PAC_ATTRIBUTES_INFO);
 
-    /* Calculate LOGON NAME */
-    ret = build_logon_name(context, authtime, principal, &logon);
+    return 0;
+}
 
-    /* Set lengths for checksum */
-    if (ret == 0)
-        ret = pac_checksum(context, server_key, &server_cksumtype, &server_size);
+static void
+pac_put_uint32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
 
-    if (ret == 0)
-        ret = pac_checksum(context, priv_key, &priv_cksumtype, &priv_size);
+static void
+pac_put_uint16(unsigned char *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
 
-    if (ret == 0 && (upn_princ || canon_princ)) {
-	krb5_boolean upn_defaulted =
-	    upn_princ && krb5_principal_compare(context, principal, upn_princ);
+struct pac_sign_layout {
+    const krb5_data *logon;
+    const krb5_data *upn_dns_info;
+    const krb5_data *attributes_info;
+    size_t server_size;
+    size_t priv_size;
+    uint16_t rodc_id;
+};
 
-	ret = build_upn_dns_info(context, upn_princ, upn_defaulted,
-				 canon_princ, NULL, &upn_dns_info);
-    }
+/*
+ * Size of buffer `b' in the signed PAC and where its content comes
+ * from; checksum buffers have no source, their content is written
+ * in place.
+ */
 
-    if (ret == 0 && pac_attributes)
-	ret = build_attributes_info(context, *pac_attributes, &attributes_info);
+static uint32_t
+pac_layout_buffer(krb5_pac p,
+		  const struct pac_sign_layout *l,
+		  const struct PAC_INFO_BUFFER *b,
+		  const void **src)
+{
+    *src = NULL;
+
+    if (b->type == PAC_SERVER_CHECKSUM)
+	return l->server_size + 4;
+    if (b->type == PAC_PRIVSVR_CHECKSUM ||
+	(p->ticket_sign_data.length != 0 && b->type == PAC_TICKET_CHECKSUM))
+	return l->priv_size + 4 + (l->rodc_id != 0 ? sizeof(l->rodc_id) : 0);
+    if (l->logon->length != 0 && b->type == PAC_LOGON_NAME) {
+	*src = l->logon->data;
+	return l->logon->length;
+    }
+    if (l->upn_dns_info->length != 0 && b->type == PAC_UPN_DNS_INFO) {
+	*src = l->upn_dns_info->data;
+	return l->upn_dns_info->length;
+    }
+    if (l->attributes_info->length != 0 && b->type == PAC_ATTRIBUTES_INFO) {
+	*src = l->attributes_info->data;
+	return l->attributes_info->length;
+    }
+    *src = (char *)p->data.data + b->offset_lo;
+    return b->buffersize;
+}
 
-    /* Encode PAC */
-    if (ret == 0) {
-        sp = krb5_storage_emem();
-        if (sp == NULL)
-            ret = krb5_enomem(context);
-    }
+/*
+ * Encode and sign the PAC in a single pass: the total size is known
+ * up front, so the header and all buffers are written straight into
+ * the output with the checksum slots reserved as zeros, and the
+ * checksums are then computed in place.
+ */
 
-    if (ret == 0) {
-        krb5_storage_set_flags(sp, KRB5_STORAGE_BYTEORDER_LE);
-        spdata = krb5_storage_emem();
-        if (spdata == NULL)
-            ret = krb5_enomem(context);
-    }
+static krb5_error_code
+pac_layout_sign(krb5_context context,
+		krb5_pac p,
+		const krb5_keyblock *server_key,
+		const krb5_keyblock *priv_key,
+		uint16_t rodc_id,
+		const krb5_data *logon,
+		const krb5_data *upn_dns_info,
+		const krb5_data *attributes_info,
+		krb5_data *data)
+{
+    struct pac_sign_layout l;
+    uint32_t server_offset = 0, priv_offset = 0, ticket_offset = 0;
+    uint32_t server_cksumtype = 0, priv_cksumtype = 0;
+    uint32_t end, len;
+    unsigned char *d, *h;
+    const void *src;
+    krb5_error_code ret;
+    uint64_t total;
+    size_t i;
 
+    krb5_data_zero(data);
+
+    l.logon = logon;
+    l.upn_dns_info = upn_dns_info;
+    l.attributes_info = attributes_info;
+    l.rodc_id = rodc_id;
+
+    ret = pac_checksum(context, server_key, &server_cksumtype, &l.server_size);
+    if (ret == 0)
+	ret = pac_checksum(context, priv_key, &priv_cksumtype, &l.priv_size);
     if (ret)
-        goto out;
+	return ret;
 
-    krb5_storage_set_flags(spdata, KRB5_STORAGE_BYTEORDER_LE);
+    total = PACTYPE_SIZE + (PAC_INFO_BUFFER_SIZE * p->pac->numbuffers);
+    for (i = 0; i < p->pac->numbuffers; i++) {
+	len = pac_layout_buffer(p, &l, &p->pac->buffers[i], &src);
+	total += ((len + PAC_ALIGNMENT - 1) / PAC_ALIGNMENT) * PAC_ALIGNMENT;
+    }
+    if (total > UINT32_MAX) {
+	krb5_set_error_message(context, EINVAL, "PAC too large");
+	return EINVAL;
+    }
 
-    CHECK(ret, krb5_store_uint32(sp, p->pac->numbuffers), out);
-    CHECK(ret, krb5_store_uint32(sp, p->pac->version), out);
+    ret = krb5_data_alloc(data, total);
+    if (ret)
+	return krb5_enomem(context);
+    d = data->data;
+    memset(d, 0, data->length);
+
+    pac_put_uint32(d, p->pac->numbuffers);
+    pac_put_uint32(d + 4, p->pac->version);
 
+    h = d + PACTYPE_SIZE;
     end = PACTYPE_SIZE + (PAC_INFO_BUFFER_SIZE * p->pac->numbuffers);
 
-    for (i = 0; i < p->pac->numbuffers; i++) {
-	uint32_t len;
-	size_t sret;
-	void *ptr = NULL;
+    for (i = 0; i < p->pac->numbuffers; i++, h += PAC_INFO_BUFFER_SIZE) {
+	const struct PAC_INFO_BUFFER *b = &p->pac->buffers[i];
 
-	/* store data */
+	len = pac_layout_buffer(p, &l, b, &src);
 
-	if (p->pac->buffers[i].type == PAC_SERVER_CHECKSUM) {
-	    len = server_size + 4;
+	if (src != NULL) {
+	    memcpy(d + end, src, len);
+	} else if (b->type == PAC_SERVER_CHECKSUM) {
 	    server_offset = end + 4;
-	    CHECK(ret, krb5_store_uint32(spdata, server_cksumtype), out);
-	    CHECK(ret, fill_zeros(context, spdata, server_size), out);
-	} else if (p->pac->buffers[i].type == PAC_PRIVSVR_CHECKSUM) {
-	    len = priv_size + 4;
+	    pac_put_uint32(d + end, server_cksumtype);
+	} else if (b->type == PAC_PRIVSVR_CHECKSUM) {
+	    /* RODCIdentifier is filled in after signing */
 	    priv_offset = end + 4;
-	    CHECK(ret, krb5_store_uint32(spdata, priv_cksumtype), out);
-	    CHECK(ret, fill_zeros(context, spdata, priv_size), out);
-	    if (rodc_id != 0) {
-		len += sizeof(rodc_id);
-		CHECK(ret, fill_zeros(context, spdata, sizeof(rodc_id)), out);
-	    }
-	} else if (p->ticket_sign_data.length != 0 &&
-		   p->pac->buffers[i].type == PAC_TICKET_CHECKSUM) {
-	    len = priv_size + 4;
-	    ticket_offset = end + 4;
-	    CHECK(ret, krb5_store_uint32(spdata, priv_cksumtype), out);
-	    CHECK(ret, fill_zeros(context, spdata, priv_size), out);
-	    if (rodc_id != 0) {
-		len += sizeof(rodc_id);
-		CHECK(ret, krb5_store_uint16(spdata, rodc_id), out);
-	    }
-	} else if (p->pac->buffers[i].type == PAC_LOGON_NAME) {
-	    len = krb5_storage_write(spdata, logon.data, logon.length);
-	    if (logon.length != len) {
-		ret = KRB5KDC_ERR_BADOPTION;
-		goto out;
-	    }
-	} else if (upn_dns_info.length != 0 &&
-		   p->pac->buffers[i].type == PAC_UPN_DNS_INFO) {
-	    len = krb5_storage_write(spdata, upn_dns_info.data, upn_dns_info.length);
-	    if (upn_dns_info.length != len) {
-		ret = KRB5KDC_ERR_BADOPTION;
-		goto out;
-	    }
-	} else if (attributes_info.length != 0 &&
-		   p->pac->buffers[i].type == PAC_ATTRIBUTES_INFO) {
-	    len = krb5_storage_write(spdata, attributes_info.data, attributes_info.length);
-	    if (attributes_info.length != len) {
-		ret = KRB5KDC_ERR_BADOPTION;
-		goto out;
-	    }
+	    pac_put_uint32(d + end, priv_cksumtype);
 	} else {
-	    len = p->pac->buffers[i].buffersize;
-	    ptr = (char *)p->data.data + p->pac->buffers[i].offset_lo;
-
-	    sret = krb5_storage_write(spdata, ptr, len);
-	    if (sret != len) {
-		ret = krb5_enomem(context);
-		goto out;
-	    }
-	    /* XXX if not aligned, fill_zeros */
-	}
-
-	/* write header */
-	CHECK(ret, krb5_store_uint32(sp, p->pac->buffers[i].type), out);
-	CHECK(ret, krb5_store_uint32(sp, len), out);
-	CHECK(ret, krb5_store_uint32(sp, end), out);
-	CHECK(ret, krb5_store_uint32(sp, 0), out);
-
-	/* advance data endpointer and align */
-	{
-	    int32_t e;
-
-	    end += len;
-	    e = ((end + PAC_ALIGNMENT - 1) / PAC_ALIGNMENT) * PAC_ALIGNMENT;
-	    if ((int32_t)end != e) {
-		CHECK(ret, fill_zeros(context, spdata, e - end), out);
-	    }
-	    end = e;
+	    ticket_offset = end + 4;
+	    pac_put_uint32(d + end, priv_cksumtype);
+	    if (rodc_id != 0)
+		pac_put_uint16(d + ticket_offset + l.priv_size, rodc_id);
 	}
 
-    }
-
-    /* assert (server_offset != 0 && priv_offset != 0); */
+	pac_put_uint32(h, b->type);
+	pac_put_uint32(h + 4, len);
+	pac_put_uint32(h + 8, end);
+	pac_put_uint32(h + 12, 0);
 
-    /* export PAC */
-    if (ret == 0)
-        ret = krb5_storage_to_data(spdata, &d);
-    if (ret == 0) {
-        sz = krb5_storage_write(sp, d.data, d.length);
-        if (sz != d.length) {
-            krb5_data_free(&d);
-            ret = krb5_enomem(context);
-            goto out;
-        }
+	end += len;
+	end = ((end + PAC_ALIGNMENT - 1) / PAC_ALIGNMENT) * PAC_ALIGNMENT;
     }
-    krb5_data_free(&d);
 
-    if (ret == 0)
-        ret = krb5_storage_to_data(sp, &d);
+    heim_assert(server_offset != 0 && priv_offset != 0,
+		"PAC missing checksum buffers");
 
     /* sign */
-    if (ret == 0 && p->ticket_sign_data.length)
+    if (p->ticket_sign_data.length)
 	ret = create_checksum(context, priv_key, priv_cksumtype,
 			      p->ticket_sign_data.data,
 			      p->ticket_sign_data.length,
-			      (char *)d.data + ticket_offset, priv_size);
+			      d + ticket_offset, l.priv_size);
     if (ret == 0)
-        ret = create_checksum(context, server_key, server_cksumtype,
-                              d.data, d.length,
-                              (char *)d.data + server_offset, server_size);
+	ret = create_checksum(context, server_key, server_cksumtype,
+			      d, data->length,
+			      d + server_offset, l.server_size);
     if (ret == 0)
-        ret = create_checksum(context, priv_key, priv_cksumtype,
-                              (char *)d.data + server_offset, server_size,
-                              (char *)d.data + priv_offset, priv_size);
-    if (ret == 0 && rodc_id != 0) {
-	krb5_data rd;
-	krb5_storage *rs = krb5_storage_emem();
-	if (rs == NULL)
-	    ret = krb5_enomem(context);
-	krb5_storage_set_flags(rs, KRB5_STORAGE_BYTEORDER_LE);
-        if (ret == 0)
-            ret = krb5_store_uint16(rs, rodc_id);
-        if (ret == 0)
-            ret = krb5_storage_to_data(rs, &rd);
-	krb5_storage_free(rs);
-	if (ret)
-	    goto out;
-	heim_assert(rd.length == sizeof(rodc_id), "invalid length");
-	memcpy((char *)d.data + priv_offset + priv_size, rd.data, rd.length);
-	krb5_data_free(&rd);
+	ret = create_checksum(context, priv_key, priv_cksumtype,
+			      d + server_offset, l.server_size,
+			      d + priv_offset, l.priv_size);
+    if (ret) {
+	krb5_data_free(data);
+	return ret;
     }
+    if (rodc_id != 0)
+	pac_put_uint16(d + priv_offset + l.priv_size, rodc_id);
 
-    if (ret)
-        goto out;
+    return 0;
+}
 
-    /* done */
-    *data = d;
+static krb5_error_code
+pac_sign(krb5_context context,
+	 krb5_pac p,
+	 time_t authtime,
+	 krb5_const_principal principal,
+	 const krb5_keyblock *server_key,
+	 const krb5_keyblock *priv_key,
+	 uint16_t rodc_id,
+	 krb5_const_principal upn_princ,
+	 krb5_const_principal canon_princ,
+	 uint64_t *pac_attributes,
+	 krb5_data *data)
+{
+    krb5_error_code ret;
+    krb5_data logon;
+    krb5_data upn_dns_info;
+    krb5_data attributes_info;
 
-    krb5_data_free(&logon);
-    krb5_data_free(&upn_dns_info);
-    krb5_data_free(&attributes_info);
-    krb5_storage_free(sp);
-    krb5_storage_free(spdata);
+    krb5_data_zero(&logon);
+    krb5_data_zero(&upn_dns_info);
+    krb5_data_zero(&attributes_info);
+
+    ret = pac_reserve_buffers(context, p, upn_princ || canon_princ,
+			      pac_attributes != NULL);
+
+    /* Calculate LOGON NAME */
+    if (ret == 0)
+	ret = build_logon_name(context, authtime, principal, &logon);
+
+    if (ret == 0 && (upn_princ || canon_princ)) {
+	krb5_boolean upn_defaulted =
+	    upn_princ && krb5_principal_compare(context, principal, upn_princ);
+
+	ret = build_upn_dns_info(context, upn_princ, upn_defaulted,
+				 canon_princ, NULL, &upn_dns_info);
+    }
+
+    if (ret == 0 && pac_attributes)
+	ret = build_attributes_info(context, *pac_attributes, &attributes_info);
+
+    if (ret == 0)
+	ret = pac_layout_sign(context, p, server_key, priv_key, rodc_id,
+			      &logon, &upn_dns_info, &attributes_info, data);
 
-    return 0;
-out:
-    krb5_data_free(&d);
     krb5_data_free(&logon);
     krb5_data_free(&upn_dns_info);
     krb5_data_free(&attributes_info);
-    if (sp)
-	krb5_storage_free(sp);
-    if (spdata)
-	krb5_storage_free(spdata);
     return ret;
 }
 
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+_krb5_pac_sign(krb5_context context,
+	       krb5_pac p,
+	       time_t authtime,
+	       krb5_const_principal principal,
+	       const krb5_keyblock *server_key,
+	       const krb5_keyblock *priv_key,
+	       uint16_t rodc_id,
+	       krb5_const_principal upn_princ,
+	       krb5_const_principal canon_princ,
+	       uint64_t *pac_attributes, /* optional */
+	       krb5_data *data)
+{
+    krb5_error_code ret;
+
+    HEIM_PROBE1(krb5__pac__sign__start, _krb5_principal_probe_hash(principal));
+    ret = pac_sign(context, p, authtime, principal, server_key, priv_key,
+		   rodc_id, upn_princ, canon_princ, pac_attributes, data);
+    HEIM_PROBE1(krb5__pac__sign__done, ret);
+    return ret;
+}
+
+/*
+ * Re-sign a parsed PAC without rebuilding any of its buffers: the
+ * logon name, UPN DNS info and attributes are copied as they are and
+ * only the checksums are recomputed.  A ticket checksum buffer is
+ * added if ticket_sign_data is set and the PAC has none.
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+_krb5_pac_resign(krb5_context context,
+		 krb5_pac p,
+		 const krb5_keyblock *server_key,
+		 const krb5_keyblock *priv_key,
+		 uint16_t rodc_id,
+		 krb5_data *data)
+{
+    krb5_error_code ret;
+    krb5_data empty;
+
+    krb5_data_zero(data);
+    krb5_data_zero(&empty);
+
+    ret = pac_find_buffers(context, p);
+    if (ret)
+	return ret;
+    if (p->logon_name == NULL) {
+	krb5_set_error_message(context, EINVAL, "PAC missing logon name");
+	return EINVAL;
+    }
+
+    ret = pac_reserve_buffers(context, p, FALSE, FALSE);
+    if (ret)
+	return ret;
+
+    return pac_layout_sign(context, p, server_key, priv_key, rodc_id,
+			   &empty, &empty, &empty, data);
+}
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_pac_get_kdc_checksum_info(krb5_context context,
 			       krb5_pac pac,
@@ -1796,8 +1903,20 @@ _krb5_pac_get_canon_principal(krb5_context context,
 			      krb5_pac pac,
 			      krb5_principal *canon_princ)
 {
+    krb5_error_code ret;
+
     *canon_princ = NULL;
 
+    /* Decode the UPN DNS info buffer on first use */
+    if (pac->upn_dns_info &&
+	pac->upn_princ == NULL && pac->canon_princ == NULL && pac->sid.data == NULL) {
+	ret = parse_upn_dns_info(context, pac->upn_dns_info, &pac->data,
+				 &pac->upn_princ, &pac->upn_flags,
+				 &pac->canon_princ, &pac->sid);
+	if (ret)
+	    return ret;
+    }
+
     if (pac->canon_princ == NULL) {
 	krb5_set_error_message(context, ENOENT,
 			       "PAC missing UPN DNS info buffer");
@@ -153,6 +153,8 @@ _krb5_plugin_run_f(krb5_context context,
 		   krb5_error_code (KRB5_LIB_CALL *func)(krb5_context, const void *, void *, void *))
 {
     int32_t (HEIM_LIB_CALL *func2)(void *, const void *, void *, void *) = (void *)func;
+
+    _krb5_init_plugins(context);
     return heim_plugin_run_f(context->hcontext, (heim_pcontext)context, caller,
                              flags, KRB5_PLUGIN_NO_HANDLE, userctx, func2);
 }
@@ -164,6 +164,28 @@ krb5_principal_get_realm(krb5_context context,
     return princ_realm(principal);
 }
 
+/*
+ * Hash a principal for USDT probes: heim_probe_hash() of its unparsed
+ * name (quoting aside), without the cost of unparsing it.
+ */
+
+KRB5_LIB_FUNCTION uint32_t KRB5_LIB_CALL
+_krb5_principal_probe_hash(krb5_const_principal principal)
+{
+    uint32_t h = 0;
+    size_t i;
+
+    if (principal == NULL)
+	return 0;
+    for (i = 0; i < princ_num_comp(principal); i++) {
+	if (i > 0)
+	    h = heim_probe_hash(h, "/");
+	h = heim_probe_hash(h, princ_ncomp(principal, i));
+    }
+    h = heim_probe_hash(h, "@");
+    return heim_probe_hash(h, princ_realm(principal));
+}
+
 KRB5_LIB_FUNCTION const char* KRB5_LIB_CALL
 krb5_principal_get_comp_string(krb5_context context,
 			       krb5_const_principal principal,
@@ -956,15 +978,42 @@ krb5_principal_compare_any_realm(krb5_context context,
 				 krb5_const_principal princ2)
 {
     size_t i;
+    if (princ1 == princ2)
+	return TRUE;
     if(princ_num_comp(princ1) != princ_num_comp(princ2))
 	return FALSE;
-    for(i = 0; i < princ_num_comp(princ1); i++){
+    /*
+     * Go backwards, the last component (the host of a service, the
+     * realm of a krbtgt) is the one that usually differs.
+     */
+    for(i = princ_num_comp(princ1); i-- > 0; ){
 	if(strcmp(princ_ncomp(princ1, i), princ_ncomp(princ2, i)) != 0)
 	    return FALSE;
     }
     return TRUE;
 }
 
+/*
+ * Hash the name components of a principal, ignoring the realm, so that
+ * principals that krb5_principal_compare_any_realm() considers equal
+ * hash the same.
+ */
+
+KRB5_LIB_FUNCTION uint32_t KRB5_LIB_CALL
+_krb5_principal_hash_any_realm(krb5_const_principal p)
+{
+    uint32_t h = 2166136261U;
+    const char *s;
+    size_t i;
+
+    for (i = 0; i < princ_num_comp(p); i++) {
+	for (s = princ_ncomp(p, i); *s; s++)
+	    h = (h ^ (unsigned char)*s) * 16777619U;
+	h = (h ^ '/') * 16777619U;
+    }
+    return h;
+}
+
 KRB5_LIB_FUNCTION krb5_boolean KRB5_LIB_CALL
 _krb5_principal_compare_PrincipalName(krb5_context context,
 				      krb5_const_principal princ1,
@@ -1003,9 +1052,10 @@ krb5_principal_compare(krb5_context context,
 		       krb5_const_principal princ1,
 		       krb5_const_principal princ2)
 {
-    if (!krb5_realm_compare(context, princ1, princ2))
+    /* Most principals compared share the realm, so check it last */
+    if (!krb5_principal_compare_any_realm(context, princ1, princ2))
 	return FALSE;
-    return krb5_principal_compare_any_realm(context, princ1, princ2);
+    return princ1 == princ2 || krb5_realm_compare(context, princ1, princ2);
 }
 
 /**
@@ -34,6 +34,121 @@
 
 #include "krb5_locl.h"
 
+/*
+ * Decrypted tickets, shared by all contexts in the process when
+ * [libdefaults] rd_req_ticket_cache is set, so that a client that
+ * presents the same ticket again only costs its authenticator.
+ * Entries are found by a SHA-256 digest of the key and the ticket
+ * ciphertext, so they are only ever returned for the key that
+ * decrypted them, and are kept until the ticket has expired.  All the
+ * checks on the decrypted ticket are made again on every use.
+ */
+
+struct tkt_cache_entry {
+    struct tkt_cache_entry *next;
+    unsigned char digest[32];
+    time_t expires;
+    EncTicketPart ticket;
+};
+
+static HEIMDAL_MUTEX tkt_cache_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct tkt_cache_entry *tkt_cache;
+
+static void
+tkt_cache_entry_free(struct tkt_cache_entry *e)
+{
+    memset_s(e->ticket.key.keyvalue.data, e->ticket.key.keyvalue.length,
+	     0, e->ticket.key.keyvalue.length);
+    free_EncTicketPart(&e->ticket);
+    free(e);
+}
+
+static void
+tkt_cache_digest(const krb5_keyblock *key,
+		 const EncryptedData *enc_part,
+		 unsigned char digest[32])
+{
+    unsigned char buf[8];
+    EVP_MD_CTX *m;
+
+    buf[0] = (key->keytype >> 24) & 0xff;
+    buf[1] = (key->keytype >> 16) & 0xff;
+    buf[2] = (key->keytype >> 8) & 0xff;
+    buf[3] = key->keytype & 0xff;
+    buf[4] = (enc_part->etype >> 24) & 0xff;
+    buf[5] = (enc_part->etype >> 16) & 0xff;
+    buf[6] = (enc_part->etype >> 8) & 0xff;
+    buf[7] = enc_part->etype & 0xff;
+
+    m = EVP_MD_CTX_create();
+    EVP_DigestInit_ex(m, EVP_sha256(), NULL);
+    EVP_DigestUpdate(m, buf, sizeof(buf));
+    EVP_DigestUpdate(m, key->keyvalue.data, key->keyvalue.length);
+    EVP_DigestUpdate(m, enc_part->cipher.data, enc_part->cipher.length);
+    EVP_DigestFinal_ex(m, digest, NULL);
+    EVP_MD_CTX_destroy(m);
+}
+
+/* Copy a cached ticket into `out', returns FALSE if there is none */
+static krb5_boolean
+tkt_cache_find(krb5_context context,
+	       const unsigned char digest[32],
+	       EncTicketPart *out)
+{
+    struct tkt_cache_entry **p, *e;
+    krb5_boolean found = FALSE;
+    time_t now = time(NULL);
+
+    HEIMDAL_MUTEX_lock(&tkt_cache_mutex);
+    for (p = &tkt_cache; (e = *p) != NULL; ) {
+	if (e->expires < now) {
+	    *p = e->next;
+	    tkt_cache_entry_free(e);
+	    continue;
+	}
+	if (ct_memcmp(e->digest, digest, sizeof(e->digest)) == 0) {
+	    found = copy_EncTicketPart(&e->ticket, out) == 0;
+	    /* Most recently used first */
+	    *p = e->next;
+	    e->next = tkt_cache;
+	    tkt_cache = e;
+	    break;
+	}
+	p = &e->next;
+    }
+    HEIMDAL_MUTEX_unlock(&tkt_cache_mutex);
+    return found;
+}
+
+static void
+tkt_cache_add(krb5_context context,
+	      const unsigned char digest[32],
+	      const EncTicketPart *ticket)
+{
+    struct tkt_cache_entry **p, *e;
+    int n = 0;
+
+    if ((e = calloc(1, sizeof(*e))) == NULL)
+	return;
+    if (copy_EncTicketPart(ticket, &e->ticket)) {
+	free(e);
+	return;
+    }
+    memcpy(e->digest, digest, sizeof(e->digest));
+    e->expires = ticket->endtime + context->max_skew;
+
+    HEIMDAL_MUTEX_lock(&tkt_cache_mutex);
+    e->next = tkt_cache;
+    tkt_cache = e;
+    for (p = &tkt_cache; *p != NULL && n < context->rd_req_ticket_cache; n++)
+	p = &(*p)->next;
+    while ((e = *p) != NULL) {
+	*p = e->next;
+	tkt_cache_entry_free(e);
+    }
+    HEIMDAL_MUTEX_unlock(&tkt_cache_mutex);
+}
+
 static krb5_error_code
 decrypt_tkt_enc_part (krb5_context context,
 		      krb5_keyblock *key,
@@ -44,8 +159,16 @@ decrypt_tkt_enc_part (krb5_context context,
     krb5_data plain;
     size_t len;
     krb5_crypto crypto;
+    unsigned char digest[32];
 
-    ret = krb5_crypto_init(context, key, 0, &crypto);
+    if (context->rd_req_ticket_cache > 0) {
+	tkt_cache_digest(key, enc_part, digest);
+	if (tkt_cache_find(context, digest, decr_part))
+	    return 0;
+    }
+
+    /* The service's long-term key */
+    ret = krb5_crypto_init_cached(context, key, 0, &crypto);
     if (ret)
 	return ret;
     ret = krb5_decrypt_EncryptedData (context,
@@ -62,6 +185,8 @@ decrypt_tkt_enc_part (krb5_context context,
         krb5_set_error_message(context, ret,
 			       N_("Failed to decode encrypted "
 				  "ticket part", ""));
+    else if (context->rd_req_ticket_cache > 0)
+	tkt_cache_add(context, digest, decr_part);
     krb5_data_free (&plain);
     return ret;
 }
@@ -103,32 +228,57 @@ decrypt_authenticator (krb5_context context,
     return ret;
 }
 
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_decode_ap_req(krb5_context context,
-		   const krb5_data *inbuf,
-		   krb5_ap_req *ap_req)
+static krb5_error_code
+decode_ap_req(krb5_context context,
+	      const krb5_data *inbuf,
+	      krb5_ap_req *ap_req,
+	      int borrowed)
 {
     krb5_error_code ret;
     size_t len;
-    ret = decode_AP_REQ(inbuf->data, inbuf->length, ap_req, &len);
+
+    if (borrowed)
+	ret = decode_AP_REQ_borrowed(inbuf->data, inbuf->length, ap_req, &len);
+    else
+	ret = decode_AP_REQ(inbuf->data, inbuf->length, ap_req, &len);
     if (ret)
 	return ret;
-    if (ap_req->pvno != 5){
-	free_AP_REQ(ap_req);
-	krb5_clear_error_message (context);
-	return KRB5KRB_AP_ERR_BADVERSION;
-    }
-    if (ap_req->msg_type != krb_ap_req){
-	free_AP_REQ(ap_req);
-	krb5_clear_error_message (context);
-	return KRB5KRB_AP_ERR_MSG_TYPE;
-    }
-    if (ap_req->ticket.tkt_vno != 5){
-	free_AP_REQ(ap_req);
+    if (ap_req->pvno != 5)
+	ret = KRB5KRB_AP_ERR_BADVERSION;
+    else if (ap_req->msg_type != krb_ap_req)
+	ret = KRB5KRB_AP_ERR_MSG_TYPE;
+    else if (ap_req->ticket.tkt_vno != 5)
+	ret = KRB5KRB_AP_ERR_BADVERSION;
+    if (ret) {
+	if (borrowed)
+	    free_AP_REQ_borrowed(ap_req);
+	else
+	    free_AP_REQ(ap_req);
 	krb5_clear_error_message (context);
-	return KRB5KRB_AP_ERR_BADVERSION;
     }
-    return 0;
+    return ret;
+}
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_decode_ap_req(krb5_context context,
+		   const krb5_data *inbuf,
+		   krb5_ap_req *ap_req)
+{
+    return decode_ap_req(context, inbuf, ap_req, 0);
+}
+
+/*
+ * Like krb5_decode_ap_req(), but the OCTET STRINGs of `ap_req' (the
+ * ticket and authenticator ciphertexts) point into `inbuf', which must
+ * outlive it.  Free with free_AP_REQ_borrowed().
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+_krb5_decode_ap_req_borrowed(krb5_context context,
+			     const krb5_data *inbuf,
+			     krb5_ap_req *ap_req)
+{
+    return decode_ap_req(context, inbuf, ap_req, 1);
 }
 
 static krb5_error_code
@@ -152,6 +302,10 @@ check_transited(krb5_context context, Ticket *ticket, EncTicketPart *enc)
     if(enc->transited.contents.length == 0)
 	return 0;
 
+    if (_krb5_transited_cache_find(context, enc->crealm, ticket->realm,
+				   &enc->transited.contents))
+	return 0;
+
     ret = krb5_domain_x500_decode(context, enc->transited.contents,
 				  &realms, &num_realms,
 				  enc->crealm,
@@ -161,6 +315,9 @@ check_transited(krb5_context context, Ticket *ticket, EncTicketPart *enc)
     ret = krb5_check_transited(context, enc->crealm,
 			       ticket->realm,
 			       realms, num_realms, NULL);
+    if (ret == 0)
+	_krb5_transited_cache_add(context, enc->crealm, ticket->realm,
+				  &enc->transited.contents);
     for (n = 0; n < num_realms; n++)
 	free(realms[n]);
     free(realms);
@@ -187,6 +344,35 @@ find_etypelist(krb5_context context,
     return ret;
 }
 
+/* Check the times and transited encoding of the decrypted ticket `t' */
+static krb5_error_code
+check_ticket(krb5_context context,
+	     Ticket *ticket,
+	     EncTicketPart *t,
+	     krb5_flags flags)
+{
+    krb5_timestamp now;
+    time_t start = t->authtime;
+
+    krb5_timeofday (context, &now);
+    if(t->starttime)
+	start = *t->starttime;
+    if(start - now > context->max_skew
+       || (t->flags.invalid
+	   && !(flags & KRB5_VERIFY_AP_REQ_IGNORE_INVALID))) {
+	krb5_clear_error_message (context);
+	return KRB5KRB_AP_ERR_TKT_NYV;
+    }
+    if(now - t->endtime > context->max_skew) {
+	krb5_clear_error_message (context);
+	return KRB5KRB_AP_ERR_TKT_EXPIRED;
+    }
+
+    if(!t->flags.transited_policy_checked)
+	return check_transited(context, ticket, t);
+    return 0;
+}
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_decrypt_ticket(krb5_context context,
 		    Ticket *ticket,
@@ -200,33 +386,10 @@ krb5_decrypt_ticket(krb5_context context,
     if (ret)
 	return ret;
 
-    {
-	krb5_timestamp now;
-	time_t start = t.authtime;
-
-	krb5_timeofday (context, &now);
-	if(t.starttime)
-	    start = *t.starttime;
-	if(start - now > context->max_skew
-	   || (t.flags.invalid
-	       && !(flags & KRB5_VERIFY_AP_REQ_IGNORE_INVALID))) {
-	    free_EncTicketPart(&t);
-	    krb5_clear_error_message (context);
-	    return KRB5KRB_AP_ERR_TKT_NYV;
-	}
-	if(now - t.endtime > context->max_skew) {
-	    free_EncTicketPart(&t);
-	    krb5_clear_error_message (context);
-	    return KRB5KRB_AP_ERR_TKT_EXPIRED;
-	}
-
-	if(!t.flags.transited_policy_checked) {
-	    ret = check_transited(context, ticket, &t);
-	    if(ret) {
-		free_EncTicketPart(&t);
-		return ret;
-	    }
-	}
+    ret = check_ticket(context, ticket, &t, flags);
+    if (ret) {
+	free_EncTicketPart(&t);
+	return ret;
     }
 
     if(out)
@@ -294,16 +457,17 @@ krb5_verify_ap_req(krb5_context context,
 				KRB5_KU_AP_REQ_AUTH);
 }
 
-KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
-krb5_verify_ap_req2(krb5_context context,
-		    krb5_auth_context *auth_context,
-		    krb5_ap_req *ap_req,
-		    krb5_const_principal server,
-		    krb5_keyblock *keyblock,
-		    krb5_flags flags,
-		    krb5_flags *ap_req_options,
-		    krb5_ticket **ticket,
-		    krb5_key_usage usage)
+static krb5_error_code
+verify_ap_req(krb5_context context,
+	      krb5_auth_context *auth_context,
+	      krb5_ap_req *ap_req,
+	      krb5_const_principal server,
+	      krb5_keyblock *keyblock,
+	      const EncTicketPart *decrypted,
+	      krb5_flags flags,
+	      krb5_flags *ap_req_options,
+	      krb5_ticket **ticket,
+	      krb5_key_usage usage)
 {
     krb5_ticket *t;
     krb5_auth_context ac;
@@ -330,7 +494,11 @@ krb5_verify_ap_req2(krb5_context context,
 	goto out;
     }
 
-    if (ap_req->ap_options.use_session_key && ac->keyblock){
+    if (decrypted) {
+	ret = copy_EncTicketPart(decrypted, &t->ticket);
+	if (ret == 0)
+	    ret = check_ticket(context, &ap_req->ticket, &t->ticket, flags);
+    } else if (ap_req->ap_options.use_session_key && ac->keyblock){
 	ret = krb5_decrypt_ticket(context, &ap_req->ticket,
 				  ac->keyblock,
 				  &t->ticket,
@@ -507,6 +675,43 @@ krb5_verify_ap_req2(krb5_context context,
     return ret;
 }
 
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_verify_ap_req2(krb5_context context,
+		    krb5_auth_context *auth_context,
+		    krb5_ap_req *ap_req,
+		    krb5_const_principal server,
+		    krb5_keyblock *keyblock,
+		    krb5_flags flags,
+		    krb5_flags *ap_req_options,
+		    krb5_ticket **ticket,
+		    krb5_key_usage usage)
+{
+    return verify_ap_req(context, auth_context, ap_req, server, keyblock,
+			 NULL, flags, ap_req_options, ticket, usage);
+}
+
+/*
+ * As krb5_verify_ap_req2(), but for a ticket that the caller has
+ * already decrypted into `decrypted', such as from a cache of its own.
+ * Only the authenticator is decrypted; the ticket is checked as
+ * krb5_decrypt_ticket() would.
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+_krb5_verify_ap_req_decrypted(krb5_context context,
+			      krb5_auth_context *auth_context,
+			      krb5_ap_req *ap_req,
+			      krb5_const_principal server,
+			      const EncTicketPart *decrypted,
+			      krb5_flags flags,
+			      krb5_flags *ap_req_options,
+			      krb5_ticket **ticket,
+			      krb5_key_usage usage)
+{
+    return verify_ap_req(context, auth_context, ap_req, server, NULL,
+			 decrypted, flags, ap_req_options, ticket, usage);
+}
+
 /*
  *
  */
@@ -857,6 +1062,7 @@ krb5_rd_req_ctx(krb5_context context,
     krb5_principal service = NULL;
 
     *outctx = NULL;
+    memset(&ap_req, 0, sizeof(ap_req));
 
     o = calloc(1, sizeof(*o));
     if (o == NULL)
@@ -868,7 +1074,7 @@ krb5_rd_req_ctx(krb5_context context,
 	    goto out;
     }
 
-    ret = krb5_decode_ap_req(context, inbuf, &ap_req);
+    ret = _krb5_decode_ap_req_borrowed(context, inbuf, &ap_req);
     if(ret)
 	goto out;
 
@@ -1053,10 +1259,12 @@ krb5_rd_req_ctx(krb5_context context,
 						      KRB5_AUTHDATA_WIN2K_PAC,
 						      &data);
 	if (ret == 0) {
-	    ret = krb5_pac_parse(context, data.data, data.length, &pac);
-	    krb5_data_free(&data);
-	    if (ret)
+	    ret = _krb5_pac_parse_borrowed(context, data.data, data.length,
+					   &pac);
+	    if (ret) {
+		krb5_data_free(&data);
 		goto out;
+	    }
 
 	    ret = krb5_pac_verify(context,
 				  pac,
@@ -1082,6 +1290,7 @@ krb5_rd_req_ctx(krb5_context context,
 		    ret = ret2;
 	    }
 	    krb5_pac_free(context, pac);
+	    krb5_data_free(&data);
 	    if (ret)
 		goto out;
 	} else
@@ -1094,7 +1303,7 @@ out:
     } else
 	*outctx = o;
 
-    free_AP_REQ(&ap_req);
+    free_AP_REQ_borrowed(&ap_req);
 
     if (service)
 	krb5_free_principal(context, service);
@@ -34,8 +34,25 @@
 #include "krb5_locl.h"
 #include <vis.h>
 
+/*
+ * Two types of replay cache are supported.  FILE appends each entry
+ * to a file that is read through in full for every store.  HASH keeps
+ * a fixed size, open addressed hash table in a file that is memory
+ * mapped and locked around each store; entries older than the
+ * lifespan are dead and their slots reused, so no expunge is needed.
+ */
+
+#define RC_TYPE_FILE	0
+#define RC_TYPE_HASH	1
+
+struct rc_hash_header;
+
 struct krb5_rcache_data {
     char *name;
+    int type;
+    int fd;				/* HASH: mapped file, or -1 */
+    struct rc_hash_header *map;
+    size_t maplen;
 };
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
@@ -57,8 +74,14 @@ krb5_rc_resolve_type(krb5_context context,
 		     krb5_rcache *id,
 		     const char *type)
 {
+    int rctype;
+
     *id = NULL;
-    if (strcmp(type, "FILE") != 0) {
+    if (strcmp(type, "FILE") == 0)
+	rctype = RC_TYPE_FILE;
+    else if (strcmp(type, "HASH") == 0)
+	rctype = RC_TYPE_HASH;
+    else {
 	krb5_set_error_message (context, KRB5_RC_TYPE_NOTFOUND,
 				N_("replay cache type %s not supported", ""),
 				type);
@@ -70,6 +93,8 @@ krb5_rc_resolve_type(krb5_context context,
 			       N_("malloc: out of memory", ""));
 	return KRB5_RC_MALLOC;
     }
+    (*id)->type = rctype;
+    (*id)->fd = -1;
     return 0;
 }
 
@@ -79,16 +104,21 @@ krb5_rc_resolve_full(krb5_context context,
 		     const char *string_name)
 {
     krb5_error_code ret;
+    const char *type;
 
     *id = NULL;
 
-    if (strncmp(string_name, "FILE:", 5) != 0) {
+    if (strncmp(string_name, "FILE:", 5) == 0)
+	type = "FILE";
+    else if (strncmp(string_name, "HASH:", 5) == 0)
+	type = "HASH";
+    else {
 	krb5_set_error_message(context, KRB5_RC_TYPE_NOTFOUND,
 			       N_("replay cache type %s not supported", ""),
 			       string_name);
 	return KRB5_RC_TYPE_NOTFOUND;
     }
-    ret = krb5_rc_resolve_type(context, id, "FILE");
+    ret = krb5_rc_resolve_type(context, id, type);
     if(ret)
 	return ret;
     ret = krb5_rc_resolve(context, *id, string_name + 5);
@@ -123,15 +153,195 @@ struct rc_entry{
     unsigned char data[16];
 };
 
+#define RC_HASH_MAGIC	0x52434831	/* "RCH1" */
+#define RC_HASH_SLOTS	65536
+#define RC_HASH_PROBES	16
+
+struct rc_hash_header {
+    uint32_t magic;
+    uint32_t nslots;
+    int64_t lifespan;
+};
+
+struct rc_hash_slot {
+    int64_t stamp;			/* 0 for an unused slot */
+    unsigned char data[16];
+};
+
+#define RC_HASH_SIZE(n) \
+    (sizeof(struct rc_hash_header) + (n) * sizeof(struct rc_hash_slot))
+
+static krb5_error_code
+rc_errno(krb5_context context, const char *op, const char *name)
+{
+    krb5_error_code ret = errno;
+    char buf[128];
+
+    rk_strerror_r(ret, buf, sizeof(buf));
+    krb5_set_error_message(context, ret, "%s(%s): %s", op, name, buf);
+    return ret;
+}
+
+static void
+rc_hash_unmap(krb5_rcache id)
+{
+#ifdef HAVE_MMAP
+    if (id->map)
+	munmap((void *)id->map, id->maplen);
+#endif
+    if (id->fd >= 0)
+	close(id->fd);
+    id->map = NULL;
+    id->maplen = 0;
+    id->fd = -1;
+}
+
+static krb5_error_code
+rc_hash_create(krb5_context context, krb5_rcache id, krb5_deltat lifespan)
+{
+    struct rc_hash_header hdr;
+    int fd;
+
+    rc_hash_unmap(id);
+
+    fd = open(id->name, O_RDWR | O_CREAT | O_TRUNC | O_BINARY | O_CLOEXEC,
+	      0600);
+    if (fd < 0)
+	return rc_errno(context, "open", id->name);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = RC_HASH_MAGIC;
+    hdr.nslots = RC_HASH_SLOTS;
+    hdr.lifespan = lifespan;
+
+    if (ftruncate(fd, RC_HASH_SIZE(RC_HASH_SLOTS)) < 0 ||
+	write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+	krb5_error_code ret = rc_errno(context, "write", id->name);
+	close(fd);
+	return ret;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Map the hash table of `id', creating it with the clock skew as
+ * lifespan if it does not exist yet.
+ */
+
+static krb5_error_code
+rc_hash_map(krb5_context context, krb5_rcache id)
+{
+#ifdef HAVE_MMAP
+    struct rc_hash_header *hdr;
+    struct stat sb;
+    krb5_error_code ret;
+    void *p;
+
+    if (id->map)
+	return 0;
+
+    id->fd = open(id->name, O_RDWR | O_BINARY | O_CLOEXEC);
+    if (id->fd < 0 && errno == ENOENT) {
+	ret = rc_hash_create(context, id, context->max_skew);
+	if (ret)
+	    return ret;
+	id->fd = open(id->name, O_RDWR | O_BINARY | O_CLOEXEC);
+    }
+    if (id->fd < 0)
+	return rc_errno(context, "open", id->name);
+
+    if (fstat(id->fd, &sb) < 0) {
+	ret = rc_errno(context, "stat", id->name);
+	rc_hash_unmap(id);
+	return ret;
+    }
+    if ((size_t)sb.st_size < sizeof(*hdr))
+	goto bad;
+
+    p = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	     id->fd, 0);
+    if (p == MAP_FAILED) {
+	ret = rc_errno(context, "mmap", id->name);
+	rc_hash_unmap(id);
+	return ret;
+    }
+    id->map = hdr = p;
+    id->maplen = sb.st_size;
+
+    if (hdr->magic != RC_HASH_MAGIC || hdr->nslots == 0 ||
+	id->maplen != RC_HASH_SIZE(hdr->nslots))
+	goto bad;
+    return 0;
+
+bad:
+    rc_hash_unmap(id);
+    krb5_set_error_message(context, KRB5_RC_IO_UNKNOWN,
+			   "%s is not a HASH replay cache", id->name);
+    return KRB5_RC_IO_UNKNOWN;
+#else
+    krb5_set_error_message(context, KRB5_RC_TYPE_NOTFOUND,
+			   N_("replay cache type %s not supported", ""),
+			   "HASH");
+    return KRB5_RC_TYPE_NOTFOUND;
+#endif
+}
+
+static krb5_error_code
+rc_hash_store(krb5_context context, krb5_rcache id,
+	      const unsigned char data[16])
+{
+    struct rc_hash_slot *slots, *e, *victim = NULL;
+    krb5_error_code ret;
+    int64_t now, oldest;
+    uint32_t h;
+    size_t i;
+
+    ret = rc_hash_map(context, id);
+    if (ret)
+	return ret;
+
+    ret = _krb5_xlock(context, id->fd, TRUE, id->name);
+    if (ret)
+	return ret;
+
+    now = time(NULL);
+    oldest = now - id->map->lifespan;
+    slots = (struct rc_hash_slot *)(id->map + 1);
+    h = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+
+    for (i = 0; i < RC_HASH_PROBES; i++) {
+	e = &slots[(h + i) % id->map->nslots];
+	if (e->stamp >= oldest &&
+	    memcmp(e->data, data, sizeof(e->data)) == 0) {
+	    _krb5_xunlock(context, id->fd);
+	    krb5_clear_error_message(context);
+	    return KRB5_RC_REPLAY;
+	}
+	/* A dead slot is better than any live one, else the oldest */
+	if (victim == NULL || e->stamp < victim->stamp)
+	    victim = e;
+    }
+    victim->stamp = now;
+    memcpy(victim->data, data, sizeof(victim->data));
+
+    _krb5_xunlock(context, id->fd);
+    return 0;
+}
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_initialize(krb5_context context,
 		   krb5_rcache id,
 		   krb5_deltat auth_lifespan)
 {
-    FILE *f = fopen(id->name, "w");
+    FILE *f;
     struct rc_entry tmp;
     int ret;
 
+    if (id->type == RC_TYPE_HASH)
+	return rc_hash_create(context, id, auth_lifespan);
+
+    f = fopen(id->name, "w");
     if(f == NULL) {
 	char buf[128];
 	ret = errno;
@@ -159,6 +369,7 @@ krb5_rc_destroy(krb5_context context,
 {
     int ret;
 
+    rc_hash_unmap(id);
     if(remove(id->name) < 0) {
 	char buf[128];
 	ret = errno;
@@ -173,6 +384,7 @@ KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_rc_close(krb5_context context,
 	      krb5_rcache id)
 {
+    rc_hash_unmap(id);
     free(id->name);
     free(id);
     return 0;
@@ -210,6 +422,8 @@ krb5_rc_store(krb5_context context,
 
     ent.stamp = time(NULL);
     checksum_authenticator(rep, ent.data);
+    if (id->type == RC_TYPE_HASH)
+	return rc_hash_store(context, id, ent.data);
     f = fopen(id->name, "r");
     if(f == NULL) {
 	char buf[128];
@@ -267,9 +481,23 @@ krb5_rc_get_lifespan(krb5_context context,
 		     krb5_rcache id,
 		     krb5_deltat *auth_lifespan)
 {
-    FILE *f = fopen(id->name, "r");
+    FILE *f;
     int r;
     struct rc_entry ent;
+
+    if (id->type == RC_TYPE_HASH) {
+	krb5_error_code ret = rc_hash_map(context, id);
+	if (ret)
+	    return ret;
+	*auth_lifespan = id->map->lifespan;
+	return 0;
+    }
+
+    f = fopen(id->name, "r");
+    if (f == NULL) {
+	krb5_clear_error_message (context);
+	return KRB5_RC_IO_UNKNOWN;
+    }
     r = fread(&ent, sizeof(ent), 1, f);
     fclose(f);
     if(r){
@@ -291,7 +519,7 @@ KRB5_LIB_FUNCTION const char* KRB5_LIB_CALL
 krb5_rc_get_type(krb5_context context,
 		 krb5_rcache id)
 {
-    return "FILE";
+    return id->type == RC_TYPE_HASH ? "HASH" : "FILE";
 }
 
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
@@ -35,18 +35,28 @@
 
 int _krb5_AES_SHA1_string_to_default_iterator = 4096;
 
-static krb5_error_code
-AES_SHA1_string_to_key(krb5_context context,
-		       krb5_enctype enctype,
-		       krb5_data password,
-		       krb5_salt salt,
-		       krb5_data opaque,
-		       krb5_keyblock *key)
+/*
+ * The PBKDF2 output for a shorter key is a prefix of the output for a
+ * longer one, so keys of several AES-SHA1 enctypes for the same
+ * password, salt and iteration count are made from one PBKDF2 run.
+ * On failure no keys are returned.
+ */
+
+krb5_error_code
+_krb5_AES_SHA1_string_to_keys(krb5_context context,
+			      size_t num_enctypes,
+			      const krb5_enctype *enctypes,
+			      krb5_data password,
+			      krb5_salt salt,
+			      krb5_data opaque,
+			      krb5_keyblock *keys)
 {
-    krb5_error_code ret;
+    krb5_error_code ret = 0;
     uint32_t iter;
     struct _krb5_encryption_type *et;
     struct _krb5_key_data kd;
+    krb5_data pbkdf2;
+    size_t i, maxsize = 0;
 
     if (opaque.length == 0)
 	iter = _krb5_AES_SHA1_string_to_default_iterator;
@@ -57,41 +67,74 @@ AES_SHA1_string_to_key(krb5_context context,
     } else
 	return KRB5_PROG_KEYTYPE_NOSUPP; /* XXX */
 
-    et = _krb5_find_enctype(enctype);
-    if (et == NULL)
-	return KRB5_PROG_KEYTYPE_NOSUPP;
+    for (i = 0; i < num_enctypes; i++) {
+	et = _krb5_find_enctype(enctypes[i]);
+	if (et == NULL)
+	    return KRB5_PROG_KEYTYPE_NOSUPP;
+	if (et->keytype->size > maxsize)
+	    maxsize = et->keytype->size;
+    }
 
-    kd.schedule = NULL;
-    ALLOC(kd.key, 1);
-    if (kd.key == NULL)
+    ret = krb5_data_alloc(&pbkdf2, maxsize);
+    if (ret)
 	return krb5_enomem(context);
-    kd.key->keytype = enctype;
-    ret = krb5_data_alloc(&kd.key->keyvalue, et->keytype->size);
-    if (ret) {
-	krb5_set_error_message (context, ret, N_("malloc: out of memory", ""));
-	return ret;
-    }
 
     ret = PKCS5_PBKDF2_HMAC(password.data, password.length,
 			    salt.saltvalue.data, salt.saltvalue.length,
 			    iter,
 			    EVP_sha1(),
-			    et->keytype->size, kd.key->keyvalue.data);
+			    maxsize, pbkdf2.data);
     if (ret != 1) {
-	_krb5_free_key_data(context, &kd, et);
+	krb5_data_free(&pbkdf2);
 	krb5_set_error_message(context, KRB5_PROG_KEYTYPE_NOSUPP,
 			       "Error calculating s2k");
 	return KRB5_PROG_KEYTYPE_NOSUPP;
     }
+    ret = 0;
 
-    ret = _krb5_derive_key(context, et, &kd, "kerberos", strlen("kerberos"));
-    if (ret == 0)
-	ret = krb5_copy_keyblock_contents(context, kd.key, key);
-    _krb5_free_key_data(context, &kd, et);
+    for (i = 0; i < num_enctypes; i++) {
+	et = _krb5_find_enctype(enctypes[i]);
 
+	kd.schedule = NULL;
+	ALLOC(kd.key, 1);
+	if (kd.key == NULL) {
+	    ret = krb5_enomem(context);
+	    break;
+	}
+	kd.key->keytype = enctypes[i];
+	ret = krb5_data_copy(&kd.key->keyvalue, pbkdf2.data,
+			     et->keytype->size);
+	if (ret == 0)
+	    ret = _krb5_derive_key(context, et, &kd,
+				   "kerberos", strlen("kerberos"));
+	if (ret == 0)
+	    ret = krb5_copy_keyblock_contents(context, kd.key, &keys[i]);
+	_krb5_free_key_data(context, &kd, et);
+	if (ret)
+	    break;
+    }
+    memset_s(pbkdf2.data, pbkdf2.length, 0, pbkdf2.length);
+    krb5_data_free(&pbkdf2);
+
+    if (ret) {
+	while (i-- > 0)
+	    krb5_free_keyblock_contents(context, &keys[i]);
+    }
     return ret;
 }
 
+static krb5_error_code
+AES_SHA1_string_to_key(krb5_context context,
+		       krb5_enctype enctype,
+		       krb5_data password,
+		       krb5_salt salt,
+		       krb5_data opaque,
+		       krb5_keyblock *key)
+{
+    return _krb5_AES_SHA1_string_to_keys(context, 1, &enctype, password,
+					 salt, opaque, key);
+}
+
 struct salt_type _krb5_AES_SHA1_salt[] = {
     {
 	KRB5_PW_SALT,
@@ -267,6 +267,74 @@ krb5_string_to_key_data_salt_opaque (krb5_context context,
     return HEIM_ERR_SALTTYPE_NOSUPP;
 }
 
+/*
+ * Do string -> key for each of the `num_enctypes' encryption types in
+ * `enctypes' on the same `password', `salt' and `opaque', returning
+ * the key for enctypes[i] in keys[i].  Enctypes whose string -> key
+ * can share work are done together; the AES-SHA1 enctypes share one
+ * PBKDF2 run.  On failure no keys are returned.
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_string_to_keys_data_salt_opaque(krb5_context context,
+				     size_t num_enctypes,
+				     const krb5_enctype *enctypes,
+				     krb5_data password,
+				     krb5_salt salt,
+				     krb5_data opaque,
+				     krb5_keyblock *keys)
+{
+    struct _krb5_encryption_type *et;
+    krb5_enctype *shared = NULL;
+    krb5_keyblock *shared_keys = NULL;
+    size_t *shared_idx = NULL;
+    size_t i, nshared = 0;
+    krb5_error_code ret = 0;
+
+    for (i = 0; i < num_enctypes; i++)
+	krb5_keyblock_zero(&keys[i]);
+
+    if (salt.salttype == KRB5_PW_SALT) {
+	shared = calloc(num_enctypes, sizeof(shared[0]));
+	shared_keys = calloc(num_enctypes, sizeof(shared_keys[0]));
+	shared_idx = calloc(num_enctypes, sizeof(shared_idx[0]));
+	if (shared == NULL || shared_keys == NULL || shared_idx == NULL) {
+	    ret = krb5_enomem(context);
+	    goto out;
+	}
+    }
+
+    for (i = 0; ret == 0 && i < num_enctypes; i++) {
+	et = _krb5_find_enctype(enctypes[i]);
+	if (shared && et && et->keytype->string_to_key == _krb5_AES_SHA1_salt) {
+	    shared_idx[nshared] = i;
+	    shared[nshared++] = enctypes[i];
+	} else
+	    ret = krb5_string_to_key_data_salt_opaque(context, enctypes[i],
+						      password, salt, opaque,
+						      &keys[i]);
+    }
+
+    if (ret == 0 && nshared > 0)
+	ret = _krb5_AES_SHA1_string_to_keys(context, nshared, shared,
+					    password, salt, opaque,
+					    shared_keys);
+    if (ret == 0) {
+	for (i = 0; i < nshared; i++)
+	    keys[shared_idx[i]] = shared_keys[i];
+    }
+
+ out:
+    free(shared);
+    free(shared_keys);
+    free(shared_idx);
+    if (ret) {
+	for (i = 0; i < num_enctypes; i++)
+	    krb5_free_keyblock_contents(context, &keys[i]);
+    }
+    return ret;
+}
+
 /*
  * Do a string -> key for encryption type `enctype' operation on the
  * string `password' (with salt `salt'), returning the resulting key
@@ -47,6 +47,10 @@ typedef struct krb5_scache {
 
     sqlite3_stmt *icred;
     sqlite3_stmt *dcred;
+    sqlite3_stmt *dcredoid;
+    sqlite3_stmt *scred;
+    sqlite3_stmt *scredcid;
+    sqlite3_stmt *scredserver;
     sqlite3_stmt *iprincipal;
 
     sqlite3_stmt *icache;
@@ -142,6 +146,32 @@ typedef struct krb5_scache {
 
 #define SQL_IPRINCIPAL "INSERT INTO principals (principal, type, credential_id) VALUES (?,?,?)"
 
+/*
+ * Indices, created when missing so that databases made before they
+ * existed get them too.  The principals of type 1 are the servers of
+ * the credentials.
+ */
+
+#define SQL_XCREDS ""							\
+	"CREATE INDEX IF NOT EXISTS credentials_cid "			\
+	"ON credentials (cid, created_at)"
+#define SQL_XPRINCIPALS ""						\
+	"CREATE INDEX IF NOT EXISTS principals_principal "		\
+	"ON principals (principal, type)"
+#define SQL_XPRINCIPALS_CRED ""						\
+	"CREATE INDEX IF NOT EXISTS principals_credential "		\
+	"ON principals (credential_id)"
+
+#define SQL_DCRED_OID "DELETE FROM credentials WHERE oid=?"
+#define SQL_SCRED "SELECT cred FROM credentials WHERE oid=?"
+#define SQL_SCRED_CID ""						\
+	"SELECT cred,oid FROM credentials WHERE cid=? "			\
+	"ORDER BY created_at,oid"
+#define SQL_SCRED_SERVER ""						\
+	"SELECT c.cred FROM principals p, credentials c "		\
+	"WHERE p.principal=? AND p.type=1 AND c.oid=p.credential_id "	\
+	"AND c.cid=? ORDER BY c.created_at,c.oid"
+
 /*
  * sqlite destructors
  */
@@ -174,6 +204,14 @@ scc_free(krb5_scache *s)
 	sqlite3_finalize(s->icred);
     if (s->dcred)
 	sqlite3_finalize(s->dcred);
+    if (s->dcredoid)
+	sqlite3_finalize(s->dcredoid);
+    if (s->scred)
+	sqlite3_finalize(s->scred);
+    if (s->scredcid)
+	sqlite3_finalize(s->scredcid);
+    if (s->scredserver)
+	sqlite3_finalize(s->scredserver);
     if (s->iprincipal)
 	sqlite3_finalize(s->iprincipal);
     if (s->icache)
@@ -527,6 +565,51 @@ create_cache(krb5_context context, krb5_scache *s)
     return 0;
 }
 
+/*
+ * Readers don't block on writers, nor writers on readers, in WAL mode,
+ * and with synchronous=NORMAL a commit doesn't fsync: the database can
+ * lose the last transactions on power loss but can't be corrupted.
+ * Both can be set with [libdefaults] scc_journal_mode and
+ * scc_synchronous, the names are taken from the SQLite3 pragmas.
+ */
+static void
+set_pragmas(krb5_context context, krb5_scache *s)
+{
+    static const char *journal_modes[] = {
+	"delete", "truncate", "persist", "memory", "wal", "off", NULL
+    };
+    static const char *sync_levels[] = {
+	"off", "normal", "full", "extra", NULL
+    };
+    const char *mode, *level;
+    char *str;
+    size_t i;
+
+    mode = krb5_config_get_string_default(context, NULL, "wal", "libdefaults",
+					  "scc_journal_mode", NULL);
+    level = krb5_config_get_string_default(context, NULL, "normal",
+					   "libdefaults", "scc_synchronous",
+					   NULL);
+
+    for (i = 0; journal_modes[i]; i++)
+	if (strcasecmp(mode, journal_modes[i]) == 0)
+	    break;
+    if (journal_modes[i] &&
+	asprintf(&str, "PRAGMA journal_mode=%s", journal_modes[i]) != -1) {
+	exec_stmt(context, s->db, str, 0);
+	free(str);
+    }
+
+    for (i = 0; sync_levels[i]; i++)
+	if (strcasecmp(level, sync_levels[i]) == 0)
+	    break;
+    if (sync_levels[i] &&
+	asprintf(&str, "PRAGMA synchronous=%s", sync_levels[i]) != -1) {
+	exec_stmt(context, s->db, str, 0);
+	free(str);
+    }
+}
+
 static krb5_error_code
 make_database(krb5_context context, krb5_scache *s)
 {
@@ -560,6 +643,15 @@ make_database(krb5_context context, krb5_scache *s)
 	if (ret) goto out;
     }
 
+    set_pragmas(context, s);
+
+    ret = exec_stmt(context, s->db, SQL_XCREDS, KRB5_CC_IO);
+    if (ret) goto out;
+    ret = exec_stmt(context, s->db, SQL_XPRINCIPALS, KRB5_CC_IO);
+    if (ret) goto out;
+    ret = exec_stmt(context, s->db, SQL_XPRINCIPALS_CRED, KRB5_CC_IO);
+    if (ret) goto out;
+
 #ifdef TRACEME
     sqlite3_trace(s->db, trace, NULL);
 #endif
@@ -568,6 +660,14 @@ make_database(krb5_context context, krb5_scache *s)
     if (ret) goto out;
     ret = prepare_stmt(context, s->db, &s->dcred, SQL_DCRED);
     if (ret) goto out;
+    ret = prepare_stmt(context, s->db, &s->dcredoid, SQL_DCRED_OID);
+    if (ret) goto out;
+    ret = prepare_stmt(context, s->db, &s->scred, SQL_SCRED);
+    if (ret) goto out;
+    ret = prepare_stmt(context, s->db, &s->scredcid, SQL_SCRED_CID);
+    if (ret) goto out;
+    ret = prepare_stmt(context, s->db, &s->scredserver, SQL_SCRED_SERVER);
+    if (ret) goto out;
     ret = prepare_stmt(context, s->db, &s->iprincipal, SQL_IPRINCIPAL);
     if (ret) goto out;
     ret = prepare_stmt(context, s->db, &s->icache, SQL_ICACHE);
@@ -1028,7 +1128,6 @@ scc_get_principal(krb5_context context,
 struct cred_ctx {
     char *drop;
     sqlite3_stmt *stmt;
-    sqlite3_stmt *credstmt;
 };
 
 static krb5_error_code KRB5_CALLCONV
@@ -1115,16 +1214,6 @@ scc_get_first (krb5_context context,
 	return ret;
     }
 
-    ret = prepare_stmt(context, s->db, &ctx->credstmt,
-		       "SELECT cred FROM credentials WHERE oid = ?");
-    if (ret) {
-	sqlite3_finalize(ctx->stmt);
-	exec_stmt(context, s->db, ctx->drop, 0);
-	free(ctx->drop);
-	free(ctx);
-	return ret;
-    }
-
     *cursor = ctx;
 
     return 0;
@@ -1159,27 +1248,27 @@ next:
 
     /* read cred from credentials table */
 
-    sqlite3_bind_int(ctx->credstmt, 1, oid);
+    sqlite3_bind_int64(s->scred, 1, oid);
 
-    ret = sqlite3_step(ctx->credstmt);
+    ret = sqlite3_step(s->scred);
     if (ret != SQLITE_ROW) {
-	sqlite3_reset(ctx->credstmt);
+	sqlite3_reset(s->scred);
 	goto next;
     }
 
-    if (sqlite3_column_type(ctx->credstmt, 0) != SQLITE_BLOB) {
+    if (sqlite3_column_type(s->scred, 0) != SQLITE_BLOB) {
 	krb5_set_error_message(context, KRB5_CC_END,
 			       N_("credential of wrong type for SCC:%s", ""),
 			       s->name);
-	sqlite3_reset(ctx->credstmt);
+	sqlite3_reset(s->scred);
 	return KRB5_CC_END;
     }
 
-    data = sqlite3_column_blob(ctx->credstmt, 0);
-    len = sqlite3_column_bytes(ctx->credstmt, 0);
+    data = sqlite3_column_blob(s->scred, 0);
+    len = sqlite3_column_bytes(s->scred, 0);
 
     ret = decode_creds(context, data, len, creds);
-    sqlite3_reset(ctx->credstmt);
+    sqlite3_reset(s->scred);
     return ret;
 }
 
@@ -1192,7 +1281,6 @@ scc_end_get (krb5_context context,
     krb5_scache *s = SCACHE(id);
 
     sqlite3_finalize(ctx->stmt);
-    sqlite3_finalize(ctx->credstmt);
 
     exec_stmt(context, s->db, ctx->drop, 0);
 
@@ -1202,6 +1290,69 @@ scc_end_get (krb5_context context,
     return 0;
 }
 
+/*
+ * Return the oldest matching credential, as the sequential search in
+ * krb5_cc_retrieve_cred() would, looking only at the credentials for
+ * the server through the index when the server's realm must match.
+ */
+static krb5_error_code KRB5_CALLCONV
+scc_retrieve(krb5_context context,
+	     krb5_ccache id,
+	     krb5_flags which,
+	     const krb5_creds *mcreds,
+	     krb5_creds *creds)
+{
+    krb5_scache *s = SCACHE(id);
+    krb5_error_code ret;
+    sqlite3_stmt *stmt;
+
+    ret = make_database(context, s);
+    if (ret)
+	return ret;
+
+    if (mcreds->server &&
+	!(which & (KRB5_TC_DONT_MATCH_REALM | KRB5_TC_MATCH_SRV_NAMEONLY))) {
+	stmt = s->scredserver;
+	ret = bind_principal(context, s->db, stmt, 1, mcreds->server);
+	if (ret)
+	    return ret;
+	sqlite3_bind_int64(stmt, 2, s->cid);
+    } else {
+	stmt = s->scredcid;
+	sqlite3_bind_int64(stmt, 1, s->cid);
+    }
+
+    while (1) {
+	ret = sqlite3_step(stmt);
+	if (ret == SQLITE_DONE) {
+	    krb5_clear_error_message(context);
+	    ret = KRB5_CC_END;
+	    break;
+	} else if (ret != SQLITE_ROW) {
+	    ret = KRB5_CC_IO;
+	    krb5_set_error_message(context, ret,
+				   N_("scache Database failed: %s", ""),
+				   sqlite3_errmsg(s->db));
+	    break;
+	}
+
+	if (sqlite3_column_type(stmt, 0) != SQLITE_BLOB)
+	    continue;
+
+	ret = decode_creds(context, sqlite3_column_blob(stmt, 0),
+			   sqlite3_column_bytes(stmt, 0), creds);
+	if (ret)
+	    break;
+	if (krb5_compare_creds(context, which, mcreds, creds))
+	    break;
+	krb5_free_cred_contents(context, creds);
+    }
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return ret;
+}
+
 static krb5_error_code KRB5_CALLCONV
 scc_remove_cred(krb5_context context,
 		 krb5_ccache id,
@@ -1219,12 +1370,7 @@ scc_remove_cred(krb5_context context,
     if (ret)
 	return ret;
 
-    ret = prepare_stmt(context, s->db, &stmt,
-		       "SELECT cred,oid FROM credentials "
-		       "WHERE cid = ?");
-    if (ret)
-	return ret;
-
+    stmt = s->scredcid;
     sqlite3_bind_int(stmt, 1, s->cid);
 
     /* find credential... */
@@ -1268,19 +1414,16 @@ scc_remove_cred(krb5_context context,
 	}
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
 
     if (id) {
-	ret = prepare_stmt(context, s->db, &stmt,
-			   "DELETE FROM credentials WHERE oid=?");
-	if (ret)
-	    return ret;
-	sqlite3_bind_int(stmt, 1, credid);
+	stmt = s->dcredoid;
+	sqlite3_bind_int64(stmt, 1, credid);
 
 	do {
 	    ret = sqlite3_step(stmt);
 	} while (ret == SQLITE_ROW);
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	if (ret != SQLITE_DONE) {
 	    ret = KRB5_CC_IO;
 	    krb5_set_error_message(context, ret,
@@ -1562,7 +1705,7 @@ KRB5_LIB_VARIABLE const krb5_cc_ops krb5_scc_ops = {
     scc_destroy,
     scc_close,
     scc_store_cred,
-    NULL, /* scc_retrieve */
+    scc_retrieve,
     scc_get_principal,
     scc_get_first,
     scc_get_next,
@@ -42,10 +42,14 @@
  * The send to kdc code is responsible to request the list of KDC from
  * the locate-kdc subsystem and then send requests to each of them.
  *
- * - Each second a new hostname is tried.
+ * - The first kdc_parallel hostnames are tried at once, then a new
+ *   hostname every kdc_parallel_delay milliseconds (one second by
+ *   default) without a reply.
  * - If the hostname have several addresses, the first will be tried
  *   directly then in turn the other will be tried every 3 seconds
- *   (host_timeout).
+ *   (host_timeout).  Addresses are tried fastest first, and those that
+ *   failed recently last; when all of them did, the next hostname is
+ *   tried at once.
  * - UDP requests are tried 3 times, and it tried with a individual timeout of kdc_timeout / 3.
  * - TCP and HTTP requests are tried 1 time.
  *
@@ -335,6 +339,8 @@ struct host {
     time_t timeout;
     krb5_data data;
     unsigned int tid;
+    unsigned int reused:1;	/* fd is a kept open TCP connection */
+    struct timeval start;	/* when the first packet went out */
 };
 
 static void
@@ -396,15 +402,278 @@ deallocate_host(void *ptr)
     host->ai = NULL;
 }
 
+/*
+ * Idle TCP connections to KDCs.
+ *
+ * After a complete reply over TCP the connection is kept for up to
+ * kdc_tcp_reuse_timeout seconds, so that the next request to the same
+ * address (say, the next of many TGS-REQs) need not set up a new one.
+ * A connection that the KDC has closed in the meantime is noticed
+ * before it is used, or when the request sent on it fails, and is then
+ * replaced by a fresh connection.
+ */
+
+#define KDC_CONN_CACHE 4
+
+struct _krb5_kdc_conn {
+    rk_socket_t fd;
+    time_t idle_since;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+};
+
+static void
+kdc_conn_close(struct _krb5_kdc_conn *c)
+{
+    if (!rk_IS_BAD_SOCKET(c->fd))
+	rk_closesocket(c->fd);
+    c->fd = rk_INVALID_SOCKET;
+}
+
+/*
+ * An idle connection should have nothing to read; if it does the KDC
+ * has closed it (or sent something we did not ask for).
+ */
+
+static int
+kdc_conn_is_dead(rk_socket_t fd)
+{
+    struct timeval tv;
+    fd_set rfds;
+
+#ifndef NO_LIMIT_FD_SETSIZE
+    if (fd >= FD_SETSIZE)
+	return 1;
+#endif
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    return select(fd + 1, &rfds, NULL, NULL, &tv) != 0;
+}
+
+static rk_socket_t
+kdc_conn_get(krb5_context context, const struct addrinfo *ai)
+{
+    time_t now = time(NULL);
+    rk_socket_t fd;
+    size_t i;
+
+    if (context->kdc_conns == NULL)
+	return rk_INVALID_SOCKET;
+
+    for (i = 0; i < KDC_CONN_CACHE; i++) {
+	struct _krb5_kdc_conn *c = &context->kdc_conns[i];
+
+	if (rk_IS_BAD_SOCKET(c->fd))
+	    continue;
+	if (now - c->idle_since > context->kdc_tcp_reuse_timeout) {
+	    kdc_conn_close(c);
+	    continue;
+	}
+	if (c->addrlen != ai->ai_addrlen ||
+	    memcmp(&c->addr, ai->ai_addr, c->addrlen) != 0)
+	    continue;
+	fd = c->fd;
+	c->fd = rk_INVALID_SOCKET;
+	if (kdc_conn_is_dead(fd)) {
+	    rk_closesocket(fd);
+	    continue;
+	}
+	return fd;
+    }
+    return rk_INVALID_SOCKET;
+}
+
+static void
+kdc_conn_put(krb5_context context, struct host *host)
+{
+    struct _krb5_kdc_conn *c = NULL;
+    size_t i;
+
+    if (context->kdc_tcp_reuse_timeout <= 0 ||
+	host->ai->ai_addrlen > sizeof(c->addr))
+	return;
+
+    if (context->kdc_conns == NULL) {
+	context->kdc_conns = calloc(KDC_CONN_CACHE,
+				    sizeof(context->kdc_conns[0]));
+	if (context->kdc_conns == NULL)
+	    return;
+	for (i = 0; i < KDC_CONN_CACHE; i++)
+	    context->kdc_conns[i].fd = rk_INVALID_SOCKET;
+    }
+
+    /* Take a free slot, or else evict the longest idle connection */
+    for (i = 0; i < KDC_CONN_CACHE; i++) {
+	struct _krb5_kdc_conn *e = &context->kdc_conns[i];
+
+	if (rk_IS_BAD_SOCKET(e->fd)) {
+	    c = e;
+	    break;
+	}
+	if (c == NULL || e->idle_since < c->idle_since)
+	    c = e;
+    }
+    kdc_conn_close(c);
+
+    c->fd = host->fd;
+    c->idle_since = time(NULL);
+    c->addrlen = host->ai->ai_addrlen;
+    memcpy(&c->addr, host->ai->ai_addr, c->addrlen);
+    host->fd = rk_INVALID_SOCKET;
+}
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+_krb5_kdc_conns_free(krb5_context context)
+{
+    size_t i;
+
+    if (context->kdc_conns == NULL)
+	return;
+    for (i = 0; i < KDC_CONN_CACHE; i++)
+	kdc_conn_close(&context->kdc_conns[i]);
+    free(context->kdc_conns);
+    context->kdc_conns = NULL;
+}
+
+/*
+ * How KDC addresses have been doing, process wide: a smoothed round
+ * trip time, and when they last failed to answer.
+ */
+
+#define KDC_HEALTH_SIZE		64
+#define KDC_HEALTH_DEAD_TIME	60	/* how long a failure counts */
+#define KDC_HEALTH_UNKNOWN	1000	/* ms assumed for new addresses */
+
+struct kdc_health {
+    int proto;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+    unsigned long srtt;		/* ms */
+    time_t last_fail;
+    time_t last_used;
+};
+
+static HEIMDAL_MUTEX kdc_health_mutex = HEIMDAL_MUTEX_INITIALIZER;
+static struct kdc_health kdc_health[KDC_HEALTH_SIZE];
+
+/* Called with kdc_health_mutex held */
+static struct kdc_health *
+kdc_health_find(const struct addrinfo *ai, int proto, int create)
+{
+    struct kdc_health *h, *oldest = &kdc_health[0];
+    size_t i;
+
+    for (i = 0; i < KDC_HEALTH_SIZE; i++) {
+	h = &kdc_health[i];
+	if (h->addrlen == ai->ai_addrlen && h->proto == proto &&
+	    memcmp(&h->addr, ai->ai_addr, ai->ai_addrlen) == 0)
+	    return h;
+	if (h->last_used < oldest->last_used)
+	    oldest = h;
+    }
+    if (!create || ai->ai_addrlen > sizeof(oldest->addr))
+	return NULL;
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->proto = proto;
+    oldest->addrlen = ai->ai_addrlen;
+    memcpy(&oldest->addr, ai->ai_addr, ai->ai_addrlen);
+    return oldest;
+}
+
+static void
+kdc_health_update(struct host *host, krb5_boolean ok)
+{
+    struct kdc_health *h;
+    struct timeval now;
+    unsigned long rtt;
+
+    if (host->start.tv_sec == 0)
+	return;
+
+    gettimeofday(&now, NULL);
+    HEIMDAL_MUTEX_lock(&kdc_health_mutex);
+    h = kdc_health_find(host->ai, host->hi->proto, 1);
+    if (h != NULL) {
+	h->last_used = now.tv_sec;
+	if (ok) {
+	    timevalsub(&now, &host->start);
+	    rtt = now.tv_sec * 1000 + now.tv_usec / 1000 + 1;
+	    h->srtt = h->srtt ? (7 * h->srtt + rtt) / 8 : rtt;
+	    h->last_fail = 0;
+	} else {
+	    h->last_fail = h->last_used;
+	}
+    }
+    HEIMDAL_MUTEX_unlock(&kdc_health_mutex);
+}
+
+/* Lower is better; ULONG_MAX if the address failed recently */
+static unsigned long
+kdc_health_score(const struct addrinfo *ai, int proto, time_t now)
+{
+    struct kdc_health *h;
+    unsigned long score = KDC_HEALTH_UNKNOWN;
+
+    HEIMDAL_MUTEX_lock(&kdc_health_mutex);
+    h = kdc_health_find(ai, proto, 0);
+    if (h != NULL) {
+	if (h->last_fail && now - h->last_fail < KDC_HEALTH_DEAD_TIME)
+	    score = ULONG_MAX;
+	else if (h->srtt)
+	    score = h->srtt;
+    }
+    HEIMDAL_MUTEX_unlock(&kdc_health_mutex);
+    return score;
+}
+
 static void
 host_dead(krb5_context context, struct host *host, const char *msg)
 {
     debug_host(context, 5, host, "%s", msg);
+    kdc_health_update(host, FALSE);
     rk_closesocket(host->fd);
     host->fd = rk_INVALID_SOCKET;
     host->state = DEAD;
 }
 
+/*
+ * The kept open connection `host' was reused, but the KDC had given up
+ * on it.  Start over with a new connection to the same address.
+ */
+
+static void
+host_reconnect(krb5_context context, struct host *host)
+{
+    struct addrinfo *a = host->ai;
+    rk_socket_t fd;
+
+    debug_host(context, 5, host, "reused connection failed, reconnecting");
+    rk_closesocket(host->fd);
+    host->fd = rk_INVALID_SOCKET;
+    host->reused = 0;
+    krb5_data_free(&host->data);
+
+    fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+    if (rk_IS_BAD_SOCKET(fd)) {
+	host->state = DEAD;
+	return;
+    }
+    rk_cloexec(fd);
+#ifndef NO_LIMIT_FD_SETSIZE
+    if (fd >= FD_SETSIZE) {
+	rk_closesocket(fd);
+	host->state = DEAD;
+	return;
+    }
+#endif
+    socket_set_nonblocking(fd, 1);
+    host->fd = fd;
+    host->state = CONNECT;
+    host->timeout = 0;
+}
+
 static krb5_error_code
 send_stream(krb5_context context, struct host *host)
 {
@@ -520,6 +789,16 @@ host_connect(krb5_context context, krb5_sendto_ctx ctx, struct host *host)
     krb5_krbhst_info *hi = host->hi;
     struct addrinfo *ai = host->ai;
 
+    if (host->start.tv_sec == 0)
+	gettimeofday(&host->start, NULL);
+
+    if (host->reused) {
+	debug_host(context, 5, host, "reusing connection to host");
+	host_connected(context, ctx, host);
+	host_next_timeout(context, host);
+	return;
+    }
+
     debug_host(context, 5, host, "connecting to host");
 
     if (connect(host->fd, ai->ai_addr, ai->ai_addrlen) < 0) {
@@ -767,7 +1046,16 @@ eval_host_state(krb5_context context,
 	} else if (ret == 0) {
 	    /* if recv_foo function returns 0, we have a complete reply */
 	    debug_host(context, 5, host, "host completed");
+	    kdc_health_update(host, TRUE);
+	    if (host->hi->proto == KRB5_KRBHST_TCP) {
+		kdc_conn_put(context, host);
+		if (rk_IS_BAD_SOCKET(host->fd))
+		    host->state = DEAD;
+	    }
 	    return 1;
+	} else if (host->reused && host->data.length == 0) {
+	    host_reconnect(context, host);
+	    return 0;
 	} else {
 	    host_dead(context, host, "host disconnected");
 	}
@@ -783,6 +1071,8 @@ eval_host_state(krb5_context context,
 	ret = host->fun->send_fn(context, host);
 	if (ret == -1) {
 	    /* not done yet */
+	} else if (ret && host->reused) {
+	    host_reconnect(context, host);
 	} else if (ret) {
 	    host_dead(context, host, "host dead, write failed");
 	} else
@@ -796,16 +1086,28 @@ eval_host_state(krb5_context context,
  *
  */
 
+/*
+ * Queue the addresses of `hi', best first.  `*all_failed' says whether
+ * every one of them failed recently, so the next KDC should be tried
+ * without waiting.
+ */
+
 static krb5_error_code
-submit_request(krb5_context context, krb5_sendto_ctx ctx, krb5_krbhst_info *hi)
+submit_request(krb5_context context, krb5_sendto_ctx ctx, krb5_krbhst_info *hi,
+	       krb5_boolean *all_failed)
 {
     unsigned long submitted_host = 0;
     krb5_boolean freeai = FALSE;
     struct timeval nrstart, nrstop;
     krb5_error_code ret;
-    struct addrinfo *ai = NULL, *a;
+    struct addrinfo *ai = NULL, *a, **sorted = NULL;
+    unsigned long *scores = NULL;
+    size_t i, j, naddrs;
+    time_t now;
     struct host *host;
 
+    *all_failed = FALSE;
+
     ret = kdc_via_plugin(context, hi, context->kdc_timeout,
 			 ctx->send_data, &ctx->response);
     if (ret == 0) {
@@ -873,10 +1175,47 @@ submit_request(krb5_context context, krb5_sendto_ctx ctx, krb5_krbhst_info *hi)
 
     ctx->stats.num_hosts++;
 
-    for (a = ai; a != NULL; a = a->ai_next) {
-	rk_socket_t fd;
+    /* Order the addresses by how they have been doing, stably */
+    for (naddrs = 0, a = ai; a != NULL; a = a->ai_next)
+	naddrs++;
+    sorted = calloc(naddrs ? naddrs : 1, sizeof(sorted[0]));
+    scores = calloc(naddrs ? naddrs : 1, sizeof(scores[0]));
+    if (sorted == NULL || scores == NULL) {
+	free(sorted);
+	free(scores);
+	if (freeai)
+	    freeaddrinfo(ai);
+	return krb5_enomem(context);
+    }
+    now = time(NULL);
+    *all_failed = naddrs > 0;
+    for (i = 0, a = ai; a != NULL; a = a->ai_next, i++) {
+	unsigned long score = kdc_health_score(a, hi->proto, now);
+
+	if (score != ULONG_MAX)
+	    *all_failed = FALSE;
+	for (j = i; j > 0 && scores[j - 1] > score; j--) {
+	    sorted[j] = sorted[j - 1];
+	    scores[j] = scores[j - 1];
+	}
+	sorted[j] = a;
+	scores[j] = score;
+    }
+    free(scores);
 
-	fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+    for (i = 0; i < naddrs; i++) {
+	krb5_boolean reused = FALSE;
+	rk_socket_t fd = rk_INVALID_SOCKET;
+
+	a = sorted[i];
+
+	if (hi->proto == KRB5_KRBHST_TCP) {
+	    fd = kdc_conn_get(context, a);
+	    reused = !rk_IS_BAD_SOCKET(fd);
+	}
+	if (!reused)
+	    fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC,
+			a->ai_protocol);
 	if (rk_IS_BAD_SOCKET(fd))
 	    continue;
 	rk_cloexec(fd);
@@ -894,12 +1233,14 @@ submit_request(krb5_context context, krb5_sendto_ctx ctx, krb5_krbhst_info *hi)
 	if (host == NULL) {
             if (freeai)
                 freeaddrinfo(ai);
+	    free(sorted);
 	    rk_closesocket(fd);
 	    return ENOMEM;
 	}
 	host->hi = hi;
 	host->fd = fd;
 	host->ai = a;
+	host->reused = reused;
 	/* next version of stid */
 	host->tid = ctx->stid = (ctx->stid & 0xffff0000) | ((ctx->stid & 0xffff) + 1);
 
@@ -945,6 +1286,7 @@ submit_request(krb5_context context, krb5_sendto_ctx ctx, krb5_krbhst_info *hi)
 	submitted_host++;
     }
 
+    free(sorted);
     if (freeai)
 	freeaddrinfo(ai);
 
@@ -1100,8 +1442,15 @@ wait_response(krb5_context context, int *action, krb5_sendto_ctx ctx)
 	return 0;
     }
 
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
+    /* Until all KDCs are in play, the next one is due after the delay */
+    if ((ctx->stateflags & KRBHST_COMPLETED) == 0 &&
+	context->kdc_parallel_delay > 0 && context->kdc_parallel_delay < 1000) {
+	tv.tv_sec = 0;
+	tv.tv_usec = context->kdc_parallel_delay * 1000;
+    } else {
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+    }
 
     ret = select(wait_ctx.max_fd + 1, &wait_ctx.rfds, &wait_ctx.wfds, NULL, &tv);
     if (ret < 0)
@@ -1150,6 +1499,8 @@ krb5_sendto_context(krb5_context context,
     int numreset = 0;
 
     krb5_data_zero(receive);
+    HEIM_PROBE2(krb5__sendto__start, heim_probe_hash(0, realm),
+		send_data->length);
     
     if (ctx == NULL) {
 	ret = krb5_sendto_ctx_alloc(context, &ctx);
@@ -1244,8 +1595,12 @@ krb5_sendto_context(krb5_context context,
 
 	    action = KRB5_SENDTO_CONTINUE;
 	    if (ret == 0) {
+		krb5_boolean all_failed;
+
 		_krb5_debug(context, 5, "submitting new requests to new host");
-		if (submit_request(context, ctx, hi) != 0)
+		if (submit_request(context, ctx, hi, &all_failed) != 0 ||
+		    all_failed ||
+		    ctx->stats.num_hosts < (unsigned long)context->kdc_parallel)
 		    action = KRB5_SENDTO_TIMEOUT;
 	    } else {
 		_krb5_debug(context, 5, "out of hosts, waiting for replies");
@@ -1353,5 +1708,6 @@ out:
     if (handle)
 	krb5_krbhst_free(context, handle);
 
+    HEIM_PROBE2(krb5__sendto__done, heim_probe_hash(0, realm), ret);
     return ret;
 }
@@ -42,6 +42,7 @@ struct krb5_storage_data {
     int (*trunc)(struct krb5_storage_data*, off_t);
     int (*fsync)(struct krb5_storage_data*);
     void (*free)(struct krb5_storage_data*);
+    krb5_error_code (*steal)(struct krb5_storage_data*, krb5_data*);
     krb5_flags flags;
     int eof_code;
     size_t max_alloc;
@@ -111,6 +111,31 @@ main(int argc, char **argv)
 		    "\x0\x0\x0\x4TEST"
 		    "\x0\x0\x0\x6""foobar", 26);
 
+    {
+	krb5_data data;
+	uint32_t i;
+
+	sp = krb5_storage_emem();
+	for (i = 0; i < 256 * 1024; i++)
+	    krb5_store_uint32(sp, i);
+	if (krb5_storage_steal_data(sp, &data) != 0 ||
+	    data.length != 4 * 256 * 1024) {
+	    printf("steal: wrong length\n");
+	    nerr++;
+	} else {
+	    unsigned char *p = data.data;
+	    for (i = 0; i < 256 * 1024; i++, p += 4) {
+		if (((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) != i) {
+		    printf("steal: wrong data at %u\n", (unsigned)i);
+		    nerr++;
+		    break;
+		}
+	    }
+	}
+	krb5_data_free(&data);
+	krb5_storage_free(sp);
+    }
+
     krb5_free_context(context);
 
     return nerr ? 1 : 0;
@@ -336,6 +336,28 @@ krb5_storage_to_data(krb5_storage *sp, krb5_data *data)
     return 0;
 }
 
+/**
+ * Return the content of storage like krb5_storage_to_data(), but
+ * without copying it when the backend can hand over its buffer, as
+ * storages from krb5_storage_emem() do.  After this the storage
+ * should only be freed.
+ *
+ * @param sp the storage to take the data from
+ * @param data the data, free with krb5_data_free()
+ *
+ * @return 0 for success, or a Kerberos 5 error code on failure.
+ *
+ * @ingroup krb5_storage
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_storage_steal_data(krb5_storage *sp, krb5_data *data)
+{
+    if (sp->steal)
+	return (*sp->steal)(sp, data);
+    return krb5_storage_to_data(sp, data);
+}
+
 static size_t
 pack_int(uint8_t *p, uint64_t val)
 {
@@ -61,6 +61,9 @@ emem_store(krb5_storage *sp, const void *data, size_t size)
 	size_t sz, off;
 	off = s->ptr - s->base;
 	sz = off + size;
+	/* grow geometrically so that large messages are not quadratic */
+	if (sz < s->size + s->size / 2)
+	    sz = s->size + s->size / 2;
 	if (sz < 4096)
 	    sz *= 2;
 	base = realloc(s->base, sz);
@@ -134,6 +137,24 @@ emem_trunc(krb5_storage *sp, off_t offset)
     return 0;
 }
 
+static krb5_error_code
+emem_steal(krb5_storage *sp, krb5_data *data)
+{
+    emem_storage *s = (emem_storage*)sp->data;
+
+    if (s->len == 0) {
+	free(s->base);
+	krb5_data_zero(data);
+    } else {
+	data->data = s->base;
+	data->length = s->len;
+    }
+    s->base = NULL;
+    s->ptr = NULL;
+    s->size = 0;
+    s->len = 0;
+    return 0;
+}
 
 static void
 emem_free(krb5_storage *sp)
@@ -157,6 +178,7 @@ emem_free(krb5_storage *sp)
  * @sa krb5_storage_from_fd()
  * @sa krb5_storage_from_data()
  * @sa krb5_storage_from_socket()
+ * @sa krb5_storage_steal_data()
  */
 
 KRB5_LIB_FUNCTION krb5_storage * KRB5_LIB_CALL
@@ -190,6 +212,7 @@ krb5_storage_emem(void)
     sp->store = emem_store;
     sp->seek = emem_seek;
     sp->trunc = emem_trunc;
+    sp->steal = emem_steal;
     sp->fsync = NULL;
     sp->free = emem_free;
     sp->max_alloc = UINT_MAX/8;
@@ -193,6 +193,7 @@ krb5_storage_from_fd(int fd_in)
     sp->store = fd_store;
     sp->seek = fd_seek;
     sp->trunc = fd_trunc;
+    sp->steal = NULL;
     sp->fsync = fd_sync;
     sp->free = fd_free;
     sp->max_alloc = UINT_MAX/8;
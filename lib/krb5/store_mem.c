@@ -145,6 +145,7 @@ krb5_storage_from_mem(void *buf, size_t len)
     sp->store = mem_store;
     sp->seek = mem_seek;
     sp->trunc = mem_trunc;
+    sp->steal = NULL;
     sp->fsync = NULL;
     sp->free = NULL;
     sp->max_alloc = UINT_MAX/8;
@@ -205,6 +206,7 @@ krb5_storage_from_readonly_mem(const void *buf, size_t len)
     sp->store = mem_no_store;
     sp->seek = mem_seek;
     sp->trunc = mem_no_trunc;
+    sp->steal = NULL;
     sp->fsync = NULL;
     sp->free = NULL;
     sp->max_alloc = UINT_MAX/8;
@@ -153,6 +153,7 @@ krb5_storage_from_socket(krb5_socket_t sock_in)
     sp->store = socket_store;
     sp->seek = socket_seek;
     sp->trunc = socket_trunc;
+    sp->steal = NULL;
     sp->fsync = socket_sync;
     sp->free = socket_free;
     sp->max_alloc = UINT_MAX/8;
@@ -255,6 +255,7 @@ krb5_storage_stdio_from_fd(int fd_in, const char *mode)
     sp->store = stdio_store;
     sp->seek = stdio_seek;
     sp->trunc = stdio_trunc;
+    sp->steal = NULL;
     sp->fsync = stdio_sync;
     sp->free = stdio_free;
     sp->max_alloc = UINT_MAX/8;
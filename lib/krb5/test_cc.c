@@ -377,6 +377,111 @@ test_cache_remove(krb5_context context, const char *type)
     krb5_free_principal(context, cred.client);
 }
 
+static void
+store_host_cred(krb5_context context, krb5_ccache id, int n)
+{
+    krb5_error_code ret;
+    krb5_creds cred;
+    char *host;
+
+    if (asprintf(&host, "h%d.su.se", n) < 0 || host == NULL)
+	krb5_errx(context, 1, "out of memory");
+    memset(&cred, 0, sizeof(cred));
+    ret = krb5_make_principal(context, &cred.server, "SU.SE", "host",
+			      host, NULL);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_make_principal");
+    free(host);
+    ret = krb5_parse_name(context, "lha@SU.SE", &cred.client);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_name");
+    cred.times.endtime = time(NULL) + 300 + n;
+
+    ret = krb5_cc_store_cred(context, id, &cred);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_cc_store_cred");
+    krb5_free_cred_contents(context, &cred);
+}
+
+static void
+retrieve_host_cred(krb5_context context, krb5_ccache id, int n,
+		   krb5_flags which, const char *realm, int find)
+{
+    krb5_error_code ret;
+    krb5_creds mcred, found;
+    char *host;
+
+    if (asprintf(&host, "h%d.su.se", n) < 0 || host == NULL)
+	krb5_errx(context, 1, "out of memory");
+    memset(&mcred, 0, sizeof(mcred));
+    ret = krb5_make_principal(context, &mcred.server, realm, "host",
+			      host, NULL);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_make_principal");
+
+    memset(&found, 0, sizeof(found));
+    ret = krb5_cc_retrieve_cred(context, id, which, &mcred, &found);
+    if (find && ret)
+	krb5_err(context, 1, ret, "krb5_cc_retrieve_cred: host/%s", host);
+    if (!find && ret == 0)
+	krb5_errx(context, 1, "krb5_cc_retrieve_cred found host/%s@%s",
+		  host, realm);
+    if (find && (krb5_principal_compare_any_realm(context, mcred.server,
+						  found.server) == FALSE ||
+		 found.times.endtime < time(NULL) + 300 + n - 60))
+	krb5_errx(context, 1, "krb5_cc_retrieve_cred: wrong cred for host/%s",
+		  host);
+    if (ret == 0)
+	krb5_free_cred_contents(context, &found);
+    krb5_free_principal(context, mcred.server);
+    free(host);
+}
+
+static void
+test_cache_retrieve(krb5_context context, const char *type)
+{
+    krb5_error_code ret;
+    krb5_ccache id;
+    krb5_principal p;
+    int i;
+
+    ret = krb5_parse_name(context, "lha@SU.SE", &p);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_name");
+
+    ret = krb5_cc_new_unique(context, type, NULL, &id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_cc_gen_new: %s", type);
+
+    if (strcmp(krb5_cc_get_type(context, id), "FILE") == 0)
+        unlink_this = krb5_cc_get_name(context, id);
+
+    ret = krb5_cc_initialize(context, id, p);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_cc_initialize");
+
+    for (i = 0; i < 40; i++)
+	store_host_cred(context, id, i);
+
+    for (i = 0; i < 40; i += 7)
+	retrieve_host_cred(context, id, i, 0, "SU.SE", 1);
+    retrieve_host_cred(context, id, 3, 0, "KTH.SE", 0);
+    retrieve_host_cred(context, id, 3, KRB5_TC_DONT_MATCH_REALM, "KTH.SE", 1);
+    retrieve_host_cred(context, id, 40, 0, "SU.SE", 0);
+
+    /* Lookups must see credentials stored after the previous lookup */
+    store_host_cred(context, id, 40);
+    retrieve_host_cred(context, id, 40, 0, "SU.SE", 1);
+    retrieve_host_cred(context, id, 0, 0, "SU.SE", 1);
+
+    ret = krb5_cc_destroy(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_cc_destroy");
+    unlink_this = NULL;
+
+    krb5_free_principal(context, p);
+}
+
 static void
 test_mcc_default(void)
 {
@@ -989,6 +1094,8 @@ main(int argc, char **argv)
 
     test_cache_remove(context, krb5_cc_type_file);
     test_cache_remove(context, krb5_cc_type_memory);
+    test_cache_retrieve(context, krb5_cc_type_file);
+    test_cache_retrieve(context, krb5_cc_type_memory);
 #ifdef USE_SQLITE
     test_cache_remove(context, krb5_cc_type_scc);
 #endif
@@ -87,6 +87,76 @@ time_encryption(krb5_context context, size_t size,
     krb5_free_keyblock_contents(context, &key);
 }
 
+/*
+ * Check that derived keys are found again for both indexed and
+ * non-indexed usages, with and without krb5_crypto_prepare_usages().
+ */
+static void
+test_derived_usages(krb5_context context, krb5_enctype etype)
+{
+    static const krb5_key_usage usages[] = {
+	KRB5_KU_TICKET, KRB5_KU_AS_REP_ENC_PART, KRB5_KU_USAGE_ACCEPTOR_SEAL,
+	KRB5_KU_USAGE_INITIATOR_SIGN, DK_INDEX_USAGES - 1, DK_INDEX_USAGES,
+	1000, 0x484442
+    };
+    static const char plain[] = "derived key usage test";
+    krb5_error_code ret;
+    krb5_keyblock key;
+    krb5_crypto c1, c2;
+    krb5_data enc, dec;
+    size_t i;
+    int pass;
+
+    ret = krb5_generate_random_keyblock(context, etype, &key);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+    ret = krb5_crypto_init(context, &key, 0, &c1);
+    if (ret == 0)
+	ret = krb5_crypto_init(context, &key, 0, &c2);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init");
+    ret = krb5_crypto_prepare_usages(context, c2, usages,
+				     sizeof(usages)/sizeof(usages[0]));
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_prepare_usages");
+
+    /* Twice, so the second pass finds every key already derived */
+    for (pass = 0; pass < 2; pass++) {
+	for (i = 0; i < sizeof(usages)/sizeof(usages[0]); i++) {
+	    ret = krb5_encrypt(context, c1, usages[i], plain, sizeof(plain),
+			       &enc);
+	    if (ret)
+		krb5_err(context, 1, ret, "encrypt usage %d", usages[i]);
+	    ret = krb5_decrypt(context, c2, usages[i], enc.data, enc.length,
+			       &dec);
+	    if (ret)
+		krb5_err(context, 1, ret, "decrypt usage %d", usages[i]);
+	    if (dec.length != sizeof(plain) ||
+		memcmp(dec.data, plain, sizeof(plain)) != 0)
+		krb5_errx(context, 1, "usage %d: plaintext mismatch",
+			  usages[i]);
+	    krb5_data_free(&enc);
+	    krb5_data_free(&dec);
+
+	    /* A different usage must not decrypt */
+	    ret = krb5_encrypt(context, c1, usages[i], plain, sizeof(plain),
+			       &enc);
+	    if (ret)
+		krb5_err(context, 1, ret, "encrypt usage %d", usages[i]);
+	    ret = krb5_decrypt(context, c2, usages[i] + 1, enc.data,
+			       enc.length, &dec);
+	    if (ret == 0)
+		krb5_errx(context, 1, "usage %d decrypted as usage %d",
+			  usages[i], usages[i] + 1);
+	    krb5_data_free(&enc);
+	}
+    }
+
+    krb5_crypto_destroy(context, c1);
+    krb5_crypto_destroy(context, c2);
+    krb5_free_keyblock_contents(context, &key);
+}
+
 static void
 time_s2k(krb5_context context,
 	 krb5_enctype etype,
@@ -197,6 +267,8 @@ main(int argc, char **argv)
 
 	krb5_enctype_enable(context, enctypes[i]);
 
+	test_derived_usages(context, enctypes[i]);
+
 	time_encryption(context, 16, enctypes[i], enciter);
 	time_encryption(context, 32, enctypes[i], enciter);
 	time_encryption(context, 512, enctypes[i], enciter);
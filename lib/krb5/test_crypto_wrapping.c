@@ -94,6 +94,92 @@ test_wrapping(krb5_context context,
 }
 
 
+/*
+ * Check that krb5_encrypt_batch() output decrypts with krb5_decrypt()
+ * and that krb5_decrypt_batch() undoes krb5_encrypt().
+ */
+
+#define BATCH_NUM 17
+
+static void
+test_batch(krb5_context context, krb5_enctype etype)
+{
+    krb5_error_code ret;
+    krb5_keyblock key;
+    krb5_crypto crypto;
+    krb5_data in[BATCH_NUM], enc[BATCH_NUM], dec[BATCH_NUM], data;
+    unsigned char buf[BATCH_NUM * 7];
+    size_t i;
+
+    ret = krb5_generate_random_keyblock(context, etype, &key);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+
+    ret = krb5_crypto_init(context, &key, 0, &crypto);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_crypto_init");
+
+    for (i = 0; i < sizeof(buf); i++)
+	buf[i] = i;
+    for (i = 0; i < BATCH_NUM; i++) {
+	in[i].data = buf;
+	in[i].length = i * 7;
+    }
+
+    ret = krb5_encrypt_batch(context, crypto, 3, BATCH_NUM, in, enc);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_encrypt_batch");
+
+    for (i = 0; i < BATCH_NUM; i++) {
+	if (enc[i].length != krb5_get_wrapped_length(context, crypto,
+						     in[i].length))
+	    krb5_errx(context, 1, "batch wrapped length %lu wrong",
+		      (unsigned long)i);
+	ret = krb5_decrypt(context, crypto, 3,
+			   enc[i].data, enc[i].length, &data);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_decrypt of batch %lu",
+		     (unsigned long)i);
+	if (data.length < in[i].length ||
+	    memcmp(data.data, in[i].data, in[i].length) != 0)
+	    krb5_errx(context, 1, "batch encrypt %lu mismatch",
+		      (unsigned long)i);
+	krb5_data_free(&data);
+	krb5_data_free(&enc[i]);
+
+	ret = krb5_encrypt(context, crypto, 3,
+			   in[i].data, in[i].length, &enc[i]);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_encrypt");
+    }
+
+    ret = krb5_decrypt_batch(context, crypto, 3, BATCH_NUM, enc, dec);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_decrypt_batch");
+
+    for (i = 0; i < BATCH_NUM; i++) {
+	if (dec[i].length < in[i].length ||
+	    memcmp(dec[i].data, in[i].data, in[i].length) != 0)
+	    krb5_errx(context, 1, "batch decrypt %lu mismatch",
+		      (unsigned long)i);
+	krb5_data_free(&dec[i]);
+    }
+
+    /* a bad message fails the whole batch */
+    ((unsigned char *)enc[BATCH_NUM - 1].data)[0] ^= 1;
+    ret = krb5_decrypt_batch(context, crypto, 3, BATCH_NUM, enc, dec);
+    if (ret == 0)
+	krb5_errx(context, 1, "krb5_decrypt_batch accepted modified data");
+    for (i = 0; i < BATCH_NUM; i++) {
+	if (dec[i].data != NULL)
+	    krb5_errx(context, 1, "krb5_decrypt_batch left output on error");
+	krb5_data_free(&enc[i]);
+    }
+
+    krb5_crypto_destroy(context, crypto);
+    krb5_free_keyblock_contents(context, &key);
+}
+
 
 static int version_flag = 0;
 static int help_flag	= 0;
@@ -161,6 +247,7 @@ main(int argc, char **argv)
 
 	test_wrapping(context, 0, 1024, 1, enctypes[i]);
 	test_wrapping(context, 1024, 1024 * 100, 1024, enctypes[i]);
+	test_batch(context, enctypes[i]);
     }
     krb5_free_context(context);
 
@@ -170,6 +170,106 @@ test_memory_keytab(krb5_context context, const char *keytab, const char *keytab2
     krb5_free_keyblock_contents(context, &entry3.keyblock);
 }
 
+/*
+ * Test lookups in a FILE keytab, which are answered from an index.
+ */
+
+static void
+add_file_entry(krb5_context context, krb5_keytab id, const char *name,
+	       krb5_kvno vno, krb5_enctype enctype)
+{
+    krb5_keytab_entry entry;
+    krb5_error_code ret;
+
+    memset(&entry, 0, sizeof(entry));
+    ret = krb5_parse_name(context, name, &entry.principal);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_name");
+    entry.vno = vno;
+    ret = krb5_generate_random_keyblock(context, enctype, &entry.keyblock);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_generate_random_keyblock");
+    ret = krb5_kt_add_entry(context, id, &entry);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_add_entry");
+    krb5_kt_free_entry(context, &entry);
+}
+
+static krb5_kvno
+get_file_entry(krb5_context context, krb5_keytab id, const char *name,
+	       krb5_kvno vno, krb5_enctype enctype)
+{
+    krb5_keytab_entry entry;
+    krb5_principal p;
+    krb5_error_code ret;
+
+    ret = krb5_parse_name(context, name, &p);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_name");
+    ret = krb5_kt_get_entry(context, id, p, vno, enctype, &entry);
+    krb5_free_principal(context, p);
+    if (ret == KRB5_KT_NOTFOUND)
+	return 0;
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_get_entry");
+    vno = entry.vno;
+    krb5_kt_free_entry(context, &entry);
+    return vno;
+}
+
+static void
+test_file_keytab_get(krb5_context context, const char *keytab)
+{
+    krb5_keytab_entry entry;
+    krb5_error_code ret;
+    krb5_keytab id;
+    char name[64];
+    int i;
+
+    ret = krb5_kt_resolve(context, keytab, &id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_resolve");
+
+    for (i = 0; i < 50; i++) {
+	snprintf(name, sizeof(name), "host/h%d.su.se@SU.SE", i);
+	add_file_entry(context, id, name, 1, ETYPE_AES256_CTS_HMAC_SHA1_96);
+    }
+    add_file_entry(context, id, "lha@SU.SE", 1, ETYPE_AES256_CTS_HMAC_SHA1_96);
+    add_file_entry(context, id, "lha@SU.SE", 300, ETYPE_AES256_CTS_HMAC_SHA1_96);
+    add_file_entry(context, id, "lha@SU.SE", 2, ETYPE_AES128_CTS_HMAC_SHA1_96);
+
+    if (get_file_entry(context, id, "lha@SU.SE", 0, 0) != 300)
+	krb5_errx(context, 1, "highest kvno not found");
+    if (get_file_entry(context, id, "lha@SU.SE", 2, 0) != 2)
+	krb5_errx(context, 1, "kvno 2 not found");
+    if (get_file_entry(context, id, "lha@SU.SE", 0,
+		       ETYPE_AES128_CTS_HMAC_SHA1_96) != 2)
+	krb5_errx(context, 1, "enctype not matched");
+    if (get_file_entry(context, id, "lha@SU.SE", 3, 0) != 0)
+	krb5_errx(context, 1, "kvno 3 found");
+    if (get_file_entry(context, id, "lha@FOO.SE", 1, 0) != 0)
+	krb5_errx(context, 1, "wrong realm matched");
+    if (get_file_entry(context, id, "host/h42.su.se@SU.SE", 1, 0) != 1)
+	krb5_errx(context, 1, "host entry not found");
+
+    /* Changes through the keytab are seen right away */
+    memset(&entry, 0, sizeof(entry));
+    ret = krb5_parse_name(context, "lha@SU.SE", &entry.principal);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_parse_name");
+    entry.vno = 300;
+    ret = krb5_kt_remove_entry(context, id, &entry);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_remove_entry");
+    krb5_free_principal(context, entry.principal);
+    if (get_file_entry(context, id, "lha@SU.SE", 0, 0) != 2)
+	krb5_errx(context, 1, "removed entry still found");
+
+    ret = krb5_kt_destroy(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_kt_destroy");
+}
+
 static void
 perf_add(krb5_context context, krb5_keytab id, int times)
 {
@@ -283,6 +383,8 @@ main(int argc, char **argv)
 
 	test_memory_keytab(context, "MEMORY:foo", "MEMORY:foo2");
 
+	test_file_keytab_get(context, "FILE:test_keytab.kt");
+
     }
 
     krb5_free_context(context);
@@ -979,6 +979,35 @@ main(int argc, char **argv)
     if (ret)
 	krb5_err(context, 1, ret, "krb5_pac_verify");
 
+    /* a borrowed PAC must verify the same and copy on modification */
+    {
+	krb5_pac pac2;
+
+	ret = _krb5_pac_parse_borrowed(context, saved_pac, sizeof(saved_pac),
+				       &pac2);
+	if (ret)
+	    krb5_err(context, 1, ret, "_krb5_pac_parse_borrowed");
+
+	ret = krb5_pac_verify(context, pac2, authtime, p,
+			      &member_keyblock, &kdc_keyblock);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_pac_verify borrowed");
+
+	ret = krb5_pac_get_buffer(context, pac2, 1, &data);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_pac_get_buffer borrowed");
+	if (data.length != type_1_length)
+	    krb5_errx(context, 1, "borrowed type 1 have wrong length: %lu",
+		      (unsigned long)data.length);
+
+	ret = krb5_pac_add_buffer(context, pac2, 1000, &data);
+	krb5_data_free(&data);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_pac_add_buffer borrowed");
+
+	krb5_pac_free(context, pac2);
+    }
+
     ret = _krb5_pac_sign(context, pac, authtime, p,
 			 &member_keyblock, &kdc_keyblock, 0, NULL, NULL,
 			 NULL, &data);
@@ -997,6 +1026,28 @@ main(int argc, char **argv)
     if (ret)
 	krb5_err(context, 1, ret, "krb5_pac_verify 2");
 
+    /* re-sign without rebuilding the buffers */
+    {
+	krb5_pac pac2;
+
+	ret = _krb5_pac_resign(context, pac, &member_keyblock,
+			       &kdc_keyblock, 0, &data);
+	if (ret)
+	    krb5_err(context, 1, ret, "_krb5_pac_resign");
+
+	ret = krb5_pac_parse(context, data.data, data.length, &pac2);
+	krb5_data_free(&data);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_pac_parse resign");
+
+	ret = krb5_pac_verify(context, pac2, authtime, p,
+			      &member_keyblock, &kdc_keyblock);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_pac_verify resign");
+
+	krb5_pac_free(context, pac2);
+    }
+
     /* make a copy and try to reproduce it */
     {
 	uint32_t *list;
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2026 Kungliga Tekniska Högskolan
+ * (Royal Institute of Technology, Stockholm, Sweden).
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "krb5_locl.h"
+#include <err.h>
+
+static void
+make_auth(Authenticator *auth, char **comp, time_t now, int cusec)
+{
+    memset(auth, 0, sizeof(*auth));
+    auth->crealm = "TEST.H5L.SE";
+    auth->cname.name_type = KRB5_NT_PRINCIPAL;
+    auth->cname.name_string.len = 1;
+    auth->cname.name_string.val = comp;
+    auth->ctime = now;
+    auth->cusec = cusec;
+}
+
+static void
+test_type(krb5_context context, const char *name)
+{
+    krb5_error_code ret;
+    krb5_rcache id;
+    Authenticator a1, a2;
+    char *comp[] = { "lha" };
+    time_t now = time(NULL);
+    krb5_deltat lifespan;
+    int i;
+
+    ret = krb5_rc_resolve_full(context, &id, name);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_resolve_full(%s)", name);
+    ret = krb5_rc_initialize(context, id, 300);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_initialize(%s)", name);
+
+    ret = krb5_rc_get_lifespan(context, id, &lifespan);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_get_lifespan");
+    if (lifespan != 300)
+	krb5_errx(context, 1, "%s: lifespan %d != 300", name, (int)lifespan);
+
+    make_auth(&a1, comp, now, 1);
+    make_auth(&a2, comp, now, 2);
+
+    ret = krb5_rc_store(context, id, &a1);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_store(%s) 1", name);
+    ret = krb5_rc_store(context, id, &a2);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_store(%s) 2", name);
+    ret = krb5_rc_store(context, id, &a1);
+    if (ret != KRB5_RC_REPLAY)
+	krb5_errx(context, 1, "%s: replay not detected", name);
+
+    /* Fill up well past the probe length, the first must still be there */
+    for (i = 3; i < 1000; i++) {
+	make_auth(&a2, comp, now, i);
+	ret = krb5_rc_store(context, id, &a2);
+	if (ret)
+	    krb5_err(context, 1, ret, "krb5_rc_store(%s) %d", name, i);
+    }
+    ret = krb5_rc_store(context, id, &a1);
+    if (ret != KRB5_RC_REPLAY)
+	krb5_errx(context, 1, "%s: replay not detected after fill", name);
+
+    ret = krb5_rc_destroy(context, id);
+    if (ret)
+	krb5_err(context, 1, ret, "krb5_rc_destroy(%s)", name);
+}
+
+int
+main(int argc, char **argv)
+{
+    krb5_context context;
+    krb5_error_code ret;
+
+    setprogname(argv[0]);
+
+    ret = krb5_init_context(&context);
+    if (ret)
+	errx(1, "krb5_init_context");
+
+    test_type(context, "FILE:test_rcache.file");
+    test_type(context, "HASH:test_rcache.hash");
+
+    krb5_free_context(context);
+
+    return 0;
+}
@@ -83,7 +83,10 @@ KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_timeofday (krb5_context context,
 		krb5_timestamp *timeret)
 {
-    *timeret = time(NULL) + context->kdc_sec_offset;
+    if (context->time_cached)
+	*timeret = context->time_cache.tv_sec + context->kdc_sec_offset;
+    else
+	*timeret = time(NULL) + context->kdc_sec_offset;
     return 0;
 }
 
@@ -98,13 +101,45 @@ krb5_us_timeofday (krb5_context context,
 {
     struct timeval tv;
 
-    gettimeofday (&tv, NULL);
+    if (context->time_cached)
+	tv = context->time_cache;
+    else
+	gettimeofday (&tv, NULL);
 
     *sec  = tv.tv_sec + context->kdc_sec_offset;
     *usec = tv.tv_usec;		/* XXX */
     return 0;
 }
 
+/**
+ * Make krb5_timeofday() and krb5_us_timeofday() answer from `now'
+ * (local system time; the KDC offset is still applied) instead of
+ * reading the clock, until called again.  Servers call this once per
+ * request so that the many time queries made while processing it
+ * agree and cost nothing; a NULL `now' goes back to the clock.
+ *
+ * The cache is per context, so a context that is used by several
+ * threads must not have it set.
+ *
+ * @param context Kerberos 5 context.
+ * @param now The time to use, or NULL.
+ *
+ * @return Kerberos 5 error code, see krb5_get_error_message().
+ *
+ * @ingroup krb5
+ */
+
+KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
+krb5_set_time_cache(krb5_context context, const struct timeval *now)
+{
+    if (now) {
+	context->time_cache = *now;
+	context->time_cached = 1;
+    } else
+	context->time_cached = 0;
+    return 0;
+}
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_format_time(krb5_context context, time_t t,
 		 char *s, size_t len, krb5_boolean include_time)
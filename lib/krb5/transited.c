@@ -641,6 +641,108 @@ krb5_check_transited(krb5_context context,
     return 0;
 }
 
+/*
+ * A cache, per context, of the transited encodings that have passed
+ * krb5_check_transited() for a client and server realm.  There are
+ * only ever a few distinct transited paths, so this is a small ring,
+ * emptied when the configuration (and so [capaths]) changes.
+ */
+
+#define TRANSITED_CACHE_SIZE 16
+
+struct _krb5_transited_cache {
+    struct {
+	char *client_realm;
+	char *server_realm;
+	krb5_data contents;
+    } ent[TRANSITED_CACHE_SIZE];
+    unsigned int next;
+};
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+_krb5_transited_cache_free(krb5_context context)
+{
+    struct _krb5_transited_cache *c = context->transited_cache;
+    size_t i;
+
+    if (c == NULL)
+	return;
+    for (i = 0; i < TRANSITED_CACHE_SIZE; i++) {
+	free(c->ent[i].client_realm);
+	free(c->ent[i].server_realm);
+	krb5_data_free(&c->ent[i].contents);
+    }
+    free(c);
+    context->transited_cache = NULL;
+}
+
+/*
+ * Returns TRUE if the transited encoding `contents' from
+ * `client_realm' to `server_realm' has passed krb5_check_transited()
+ * before with this context's configuration.
+ */
+
+KRB5_LIB_FUNCTION krb5_boolean KRB5_LIB_CALL
+_krb5_transited_cache_find(krb5_context context,
+			   krb5_const_realm client_realm,
+			   krb5_const_realm server_realm,
+			   const krb5_data *contents)
+{
+    struct _krb5_transited_cache *c = context->transited_cache;
+    size_t i;
+
+    if (c == NULL)
+	return FALSE;
+    for (i = 0; i < TRANSITED_CACHE_SIZE; i++) {
+	if (c->ent[i].client_realm == NULL ||
+	    krb5_data_cmp(&c->ent[i].contents, contents) != 0 ||
+	    strcmp(c->ent[i].client_realm, client_realm) != 0 ||
+	    strcmp(c->ent[i].server_realm, server_realm) != 0)
+	    continue;
+	return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * Remember that the transited encoding `contents' from `client_realm'
+ * to `server_realm' has passed krb5_check_transited().
+ */
+
+KRB5_LIB_FUNCTION void KRB5_LIB_CALL
+_krb5_transited_cache_add(krb5_context context,
+			  krb5_const_realm client_realm,
+			  krb5_const_realm server_realm,
+			  const krb5_data *contents)
+{
+    struct _krb5_transited_cache *c = context->transited_cache;
+    char *cr, *sr;
+    krb5_data d;
+    unsigned int i;
+
+    if (c == NULL) {
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+	    return;
+	context->transited_cache = c;
+    }
+    cr = strdup(client_realm);
+    sr = strdup(server_realm);
+    if (cr == NULL || sr == NULL ||
+	krb5_data_copy(&d, contents->data, contents->length) != 0) {
+	free(cr);
+	free(sr);
+	return;
+    }
+
+    i = c->next++ % TRANSITED_CACHE_SIZE;
+    free(c->ent[i].client_realm);
+    free(c->ent[i].server_realm);
+    krb5_data_free(&c->ent[i].contents);
+    c->ent[i].client_realm = cr;
+    c->ent[i].server_realm = sr;
+    c->ent[i].contents = d;
+}
+
 KRB5_LIB_FUNCTION krb5_error_code KRB5_LIB_CALL
 krb5_check_transited_realms(krb5_context context,
 			    const char *const *realms,
@@ -1723,21 +1723,21 @@ out:
 
 static const int authtimediff = 3600 * 2; /* 2 hours */
 
+/*
+ * Parse the client's NTLMv2 blob: check its header and timestamp and
+ * pick out the client answer and the targetinfo.  This only depends
+ * on the answer, so it's done once per verification no matter how
+ * many domain spellings are tried.
+ */
+
 static int
-verify_ntlm2(const void *key, size_t len,
-	     const char *username,
-	     const char *target,
-	     int upper_case_target,
-	     time_t now,
-	     const unsigned char serverchallenge[8],
-	     const struct ntlm_buf *answer,
-	     struct ntlm_buf *infotarget,
-	     unsigned char ntlmv2[16])
+parse_ntlm2_answer(time_t now,
+		   const struct ntlm_buf *answer,
+		   unsigned char clientanswer[16],
+		   struct ntlm_buf *infotarget)
 {
     krb5_error_code ret;
-    unsigned char clientanswer[16];
     unsigned char clientnonce[8];
-    unsigned char serveranswer[16];
     krb5_storage *sp;
     uint64_t t;
     time_t authtime;
@@ -1752,12 +1752,6 @@ verify_ntlm2(const void *key, size_t len,
     if (now == 0)
 	now = time(NULL);
 
-    /* calculate ntlmv2 key */
-
-    heim_ntlm_ntlmv2_key(key, len, username, target, upper_case_target, ntlmv2);
-
-    /* calculate and build ntlmv2 answer */
-
     sp = krb5_storage_from_readonly_mem(answer->data, answer->length);
     if (sp == NULL)
 	return ENOMEM;
@@ -1802,29 +1796,54 @@ verify_ntlm2(const void *key, size_t len,
 	  infotarget->length);
 
     krb5_storage_free(sp);
-    sp = NULL;
+    return 0;
+out:
+    heim_ntlm_free_buf(infotarget);
+    krb5_storage_free(sp);
+    return ret;
+}
 
-    if (answer->length < 16) {
-	ret = HNTLM_ERR_INVALID_LENGTH;
-	goto out;
-    }
+/*
+ * Derive the NTLMv2 key for one spelling of the domain and check the
+ * client answer against it.
+ */
+
+static int
+verify_ntlm2(const void *key, size_t len,
+	     const char *username,
+	     const char *target,
+	     int upper_case_target,
+	     const unsigned char serverchallenge[8],
+	     const struct ntlm_buf *answer,
+	     const unsigned char clientanswer[16],
+	     unsigned char ntlmv2[16])
+{
+    unsigned char serveranswer[16];
+    int ret;
+
+    ret = heim_ntlm_ntlmv2_key(key, len, username, target,
+			       upper_case_target, ntlmv2);
+    if (ret)
+	return ret;
 
     heim_ntlm_derive_ntlm2_sess(ntlmv2,
 				((unsigned char *)answer->data) + 16, answer->length - 16,
 				serverchallenge,
 				serveranswer);
 
-    if (memcmp(serveranswer, clientanswer, 16) != 0) {
-	heim_ntlm_free_buf(infotarget);
+    if (ct_memcmp(serveranswer, clientanswer, 16) != 0)
 	return HNTLM_ERR_AUTH;
-    }
 
     return 0;
-out:
-    heim_ntlm_free_buf(infotarget);
-    if (sp)
-	krb5_storage_free(sp);
-    return ret;
+}
+
+static int
+has_lower_ascii(const char *s)
+{
+    for (; *s; s++)
+	if (*s >= 'a' && *s <= 'z')
+	    return 1;
+    return 0;
 }
 
 /**
@@ -1856,29 +1875,45 @@ heim_ntlm_verify_ntlm2(const void *key, size_t len,
 		       struct ntlm_buf *infotarget,
 		       unsigned char ntlmv2[16])
 {
+    unsigned char clientanswer[16];
     int ret;
-    
+
+    /**
+     * The blob is parsed, and its timestamp checked, only once; the
+     * domain spellings below only differ in the derived key.
+     */
+
+    ret = parse_ntlm2_answer(now, answer, clientanswer, infotarget);
+    if (ret)
+	return ret;
+
     /**
      * First check with the domain as the client passed it to the function.
      */
 
-    ret = verify_ntlm2(key, len, username, target, 0, now,
-		       serverchallenge, answer, infotarget, ntlmv2);
+    ret = verify_ntlm2(key, len, username, target, 0,
+		       serverchallenge, answer, clientanswer, ntlmv2);
 
     /**
-     * Second check with domain uppercased.
+     * Second check with domain uppercased, unless that would not
+     * change it.
      */
 
-    if (ret)
-	ret = verify_ntlm2(key, len, username, target, 1, now,
-			   serverchallenge, answer, infotarget, ntlmv2);
+    if (ret && has_lower_ascii(target))
+	ret = verify_ntlm2(key, len, username, target, 1,
+			   serverchallenge, answer, clientanswer, ntlmv2);
 
     /**
      * Third check with empty domain.
      */
-    if (ret)
-	ret = verify_ntlm2(key, len, username, "", 0, now,
-			   serverchallenge, answer, infotarget, ntlmv2);
+    if (ret && target[0] != '\0')
+	ret = verify_ntlm2(key, len, username, "", 0,
+			   serverchallenge, answer, clientanswer, ntlmv2);
+
+    if (ret) {
+	memset(ntlmv2, 0, 16);
+	heim_ntlm_free_buf(infotarget);
+    }
     return ret;
 }
 
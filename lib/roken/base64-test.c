@@ -92,5 +92,28 @@ main(int argc, char **argv)
 	    numerr++;
 	}
     }
+
+    {
+	/* Long enough for the SIMD code paths, with every odd tail */
+	unsigned char buf[1027], out[1027];
+	char *str;
+	size_t i;
+	int len;
+
+	for (i = 0; i < sizeof(buf); i++)
+	    buf[i] = (i * 7 + 3) & 0xff;
+	for (len = 0; len < (int)sizeof(buf); len += 97) {
+	    if (rk_base64_encode(buf, len, &str) != (len + 2) / 3 * 4) {
+		fprintf(stderr, "failed test %d: encode length\n", numtest);
+		numerr++;
+	    } else if (rk_base64_decode(str, out) != len ||
+		       memcmp(buf, out, len) != 0) {
+		fprintf(stderr, "failed test %d: round trip\n", numtest);
+		numerr++;
+	    }
+	    free(str);
+	    numtest++;
+	}
+    }
     return numerr;
 }
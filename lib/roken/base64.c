@@ -48,16 +48,376 @@
 static const char base64_chars[] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+/* Inverse of base64_chars[], -1 for characters not in the alphabet */
+static const signed char base64_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+    -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+/*
+ * Bulk encoding and decoding with SIMD.
+ *
+ * On x86 the SSSE3 (and, if the CPU and OS support it, AVX2) versions
+ * of Wojciech Muła's pshufb-based algorithms encode 12 (24) bytes to 16
+ * (32) characters and decode the reverse at a time.  On aarch64 NEON
+ * table lookups do 48 bytes / 64 characters at a time.  Which to use is
+ * decided once, at runtime.
+ *
+ * These only ever handle whole blocks of input that contain no padding
+ * or characters outside the alphabet; everything else is left to the
+ * scalar code, so results (including errors) are the same either way.
+ *
+ * Define NO_BASE64_ACCEL to build without this.
+ */
+#if !defined(NO_BASE64_ACCEL) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define BASE64_ACCEL_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#elif !defined(NO_BASE64_ACCEL) && defined(__GNUC__) && \
+    defined(__aarch64__) && defined(__ARM_NEON)
+#define BASE64_ACCEL_ARM 1
+#include <arm_neon.h>
+#endif
+
+#if defined(BASE64_ACCEL_X86) || defined(BASE64_ACCEL_ARM)
+#define HAVE_BASE64_ACCEL 1
+
+enum { ACCEL_NONE = 0, ACCEL_SSSE3, ACCEL_AVX2, ACCEL_NEON };
+
 static int
-pos(char c)
+base64_accel(void)
+{
+    static volatile int accel = -1;
+
+    if (accel == -1) {
+#ifdef BASE64_ACCEL_X86
+	unsigned int a, b, c, d;
+	int ok = ACCEL_NONE;
+
+	if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSSE3)) {
+	    ok = ACCEL_SSSE3;
+	    /* AVX2 also needs the OS to save the YMM registers */
+	    if ((c & bit_OSXSAVE) && (c & bit_AVX) &&
+		__get_cpuid_max(0, NULL) >= 7) {
+		unsigned int xlo, xhi;
+
+		__asm__ __volatile__ ("xgetbv" : "=a" (xlo), "=d" (xhi) : "c" (0));
+		__cpuid_count(7, 0, a, b, c, d);
+		if ((xlo & 6) == 6 && (b & (1 << 5)))
+		    ok = ACCEL_AVX2;
+	    }
+	}
+	accel = ok;
+#else
+	accel = ACCEL_NEON; /* Advanced SIMD is mandatory on aarch64 */
+#endif
+    }
+    return accel;
+}
+#endif
+
+#ifdef BASE64_ACCEL_X86
+
+__attribute__((target("ssse3"))) static size_t
+encode_ssse3(const unsigned char *in, size_t len, char *out)
+{
+    const __m128i shuf = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+				       7, 6, 8, 7, 10, 9, 11, 10);
+    const __m128i lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+				      '0' - 52, '0' - 52, '0' - 52,
+				      '0' - 52, '0' - 52, '0' - 52,
+				      '0' - 52, '0' - 52, '+' - 62,
+				      '/' - 63, 'A', 0, 0);
+    size_t i;
+
+    /* Each step reads 16 bytes but consumes 12 */
+    for (i = 0; i + 16 <= len; i += 12, out += 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(const void *)(in + i));
+	__m128i t0, t1, idx, res, less;
+
+	v = _mm_shuffle_epi8(v, shuf);
+	t0 = _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00));
+	t0 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	t1 = _mm_and_si128(v, _mm_set1_epi32(0x003f03f0));
+	t1 = _mm_mullo_epi16(t1, _mm_set1_epi32(0x01000010));
+	idx = _mm_or_si128(t0, t1);
+
+	res = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+	less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+	res = _mm_or_si128(res, _mm_and_si128(less, _mm_set1_epi8(13)));
+	res = _mm_add_epi8(_mm_shuffle_epi8(lut, res), idx);
+	_mm_storeu_si128((__m128i *)(void *)out, res);
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+encode_avx2(const unsigned char *in, size_t len, char *out)
+{
+    const __m256i shuf = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+					  7, 6, 8, 7, 10, 9, 11, 10,
+					  1, 0, 2, 1, 4, 3, 5, 4,
+					  7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i lut = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+					 '0' - 52, '0' - 52, '0' - 52,
+					 '0' - 52, '0' - 52, '0' - 52,
+					 '0' - 52, '0' - 52, '+' - 62,
+					 '/' - 63, 'A', 0, 0,
+					 'a' - 26, '0' - 52, '0' - 52,
+					 '0' - 52, '0' - 52, '0' - 52,
+					 '0' - 52, '0' - 52, '0' - 52,
+					 '0' - 52, '0' - 52, '+' - 62,
+					 '/' - 63, 'A', 0, 0);
+    size_t i;
+
+    /* Each step reads 28 bytes (12 per lane) but consumes 24 */
+    for (i = 0; i + 28 <= len; i += 24, out += 32) {
+	__m128i lo = _mm_loadu_si128((const __m128i *)(const void *)(in + i));
+	__m128i hi = _mm_loadu_si128((const __m128i *)(const void *)(in + i + 12));
+	__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+	__m256i t0, t1, idx, res, less;
+
+	v = _mm256_shuffle_epi8(v, shuf);
+	t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+	t0 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+	t1 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+	t1 = _mm256_mullo_epi16(t1, _mm256_set1_epi32(0x01000010));
+	idx = _mm256_or_si256(t0, t1);
+
+	res = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+	less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+	res = _mm256_or_si256(res, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+	res = _mm256_add_epi8(_mm256_shuffle_epi8(lut, res), idx);
+	_mm256_storeu_si256((__m256i *)(void *)out, res);
+    }
+    return i;
+}
+
+/*
+ * Decoding classifies each character by its high and low nibbles; a
+ * character is in the alphabet iff the two lookups have no bit in
+ * common.  A second lookup gives the offset that turns it into its
+ * 6-bit value, and multiply-adds pack those into bytes.
+ */
+__attribute__((target("ssse3"))) static size_t
+decode_ssse3(const char *in, size_t len, unsigned char *out)
+{
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11,
+					 0x11, 0x11, 0x11, 0x11,
+					 0x11, 0x11, 0x13, 0x1a,
+					 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02,
+					 0x04, 0x08, 0x04, 0x08,
+					 0x10, 0x10, 0x10, 0x10,
+					 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+					   0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+				       8, 14, 13, 12, -1, -1, -1, -1);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16, out += 12) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(const void *)(in + i));
+	__m128i hi_nib, lo_nib, hi, lo, roll;
+	unsigned char tmp[16];
+
+	hi_nib = _mm_and_si128(_mm_srli_epi32(v, 4), mask_2f);
+	lo_nib = _mm_and_si128(v, mask_2f);
+	hi = _mm_shuffle_epi8(lut_hi, hi_nib);
+	lo = _mm_shuffle_epi8(lut_lo, lo_nib);
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+					     _mm_setzero_si128())) != 0xffff)
+	    break;
+
+	roll = _mm_add_epi8(_mm_cmpeq_epi8(v, mask_2f), hi_nib);
+	v = _mm_add_epi8(v, _mm_shuffle_epi8(lut_roll, roll));
+	v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+	v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+	v = _mm_shuffle_epi8(v, pack);
+
+	/* Only 12 of the 16 bytes are output; don't overrun the caller */
+	_mm_storeu_si128((__m128i *)(void *)tmp, v);
+	memcpy(out, tmp, 12);
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+decode_avx2(const char *in, size_t len, unsigned char *out)
 {
-    const char *p;
-    for (p = base64_chars; *p; p++)
-	if (*p == c)
-	    return p - base64_chars;
-    return -1;
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11,
+					    0x11, 0x11, 0x11, 0x11,
+					    0x11, 0x11, 0x13, 0x1a,
+					    0x1b, 0x1b, 0x1b, 0x1a,
+					    0x15, 0x11, 0x11, 0x11,
+					    0x11, 0x11, 0x11, 0x11,
+					    0x11, 0x11, 0x13, 0x1a,
+					    0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02,
+					    0x04, 0x08, 0x04, 0x08,
+					    0x10, 0x10, 0x10, 0x10,
+					    0x10, 0x10, 0x10, 0x10,
+					    0x10, 0x10, 0x01, 0x02,
+					    0x04, 0x08, 0x04, 0x08,
+					    0x10, 0x10, 0x10, 0x10,
+					    0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+					      0, 0, 0, 0, 0, 0, 0, 0,
+					      0, 16, 19, 4, -65, -65, -71, -71,
+					      0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+					  8, 14, 13, 12, -1, -1, -1, -1,
+					  2, 1, 0, 6, 5, 4, 10, 9,
+					  8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32, out += 24) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)(const void *)(in + i));
+	__m256i hi_nib, lo_nib, hi, lo, roll;
+	unsigned char tmp[32];
+
+	hi_nib = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask_2f);
+	lo_nib = _mm256_and_si256(v, mask_2f);
+	hi = _mm256_shuffle_epi8(lut_hi, hi_nib);
+	lo = _mm256_shuffle_epi8(lut_lo, lo_nib);
+	if (!_mm256_testz_si256(lo, hi))
+	    break;
+
+	roll = _mm256_add_epi8(_mm256_cmpeq_epi8(v, mask_2f), hi_nib);
+	v = _mm256_add_epi8(v, _mm256_shuffle_epi8(lut_roll, roll));
+	v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+	v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+	v = _mm256_shuffle_epi8(v, pack);
+	/* Gather the 12 bytes from each lane */
+	v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6,
+							     3, 7));
+
+	_mm256_storeu_si256((__m256i *)(void *)tmp, v);
+	memcpy(out, tmp, 24);
+    }
+    return i;
+}
+
+static size_t
+encode_accel(const unsigned char *in, size_t len, char *out)
+{
+    switch (base64_accel()) {
+    case ACCEL_AVX2:
+	return encode_avx2(in, len, out);
+    case ACCEL_SSSE3:
+	return encode_ssse3(in, len, out);
+    default:
+	return 0;
+    }
 }
 
+static size_t
+decode_accel(const char *in, size_t len, unsigned char *out)
+{
+    switch (base64_accel()) {
+    case ACCEL_AVX2:
+	return decode_avx2(in, len, out);
+    case ACCEL_SSSE3:
+	return decode_ssse3(in, len, out);
+    default:
+	return 0;
+    }
+}
+
+#endif /* BASE64_ACCEL_X86 */
+
+#ifdef BASE64_ACCEL_ARM
+
+static size_t
+encode_accel(const unsigned char *in, size_t len, char *out)
+{
+    const uint8x16x4_t lut = vld1q_u8_x4((const uint8_t *)base64_chars);
+    const uint8x16_t m6 = vdupq_n_u8(0x3f);
+    size_t i;
+
+    for (i = 0; i + 48 <= len; i += 48, out += 64) {
+	uint8x16x3_t v = vld3q_u8(in + i);
+	uint8x16x4_t r;
+
+	r.val[0] = vshrq_n_u8(v.val[0], 2);
+	r.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(v.val[0], 4),
+				     vshrq_n_u8(v.val[1], 4)), m6);
+	r.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(v.val[1], 2),
+				     vshrq_n_u8(v.val[2], 6)), m6);
+	r.val[3] = vandq_u8(v.val[2], m6);
+	r.val[0] = vqtbl4q_u8(lut, r.val[0]);
+	r.val[1] = vqtbl4q_u8(lut, r.val[1]);
+	r.val[2] = vqtbl4q_u8(lut, r.val[2]);
+	r.val[3] = vqtbl4q_u8(lut, r.val[3]);
+	vst4q_u8((uint8_t *)out, r);
+    }
+    return i;
+}
+
+/*
+ * Map 16 characters to their 6-bit values, or to 0xff for characters
+ * outside the alphabet.  Each 64-entry lookup yields 0 for indices out
+ * of its range.
+ */
+static inline uint8x16_t
+decode_lookup(uint8x16x4_t lut_lo, uint8x16x4_t lut_hi, uint8x16_t c)
+{
+    uint8x16_t lo = vqtbl4q_u8(lut_lo, c);
+    uint8x16_t hi = vqtbl4q_u8(lut_hi, vsubq_u8(c, vdupq_n_u8(64)));
+
+    /* Characters >= 128 find nothing in either table */
+    return vorrq_u8(vorrq_u8(lo, hi), vcgeq_u8(c, vdupq_n_u8(128)));
+}
+
+static size_t
+decode_accel(const char *in, size_t len, unsigned char *out)
+{
+    const uint8_t *tbl = (const uint8_t *)base64_values;
+    const uint8x16x4_t lut_lo = vld1q_u8_x4(tbl);
+    const uint8x16x4_t lut_hi = vld1q_u8_x4(tbl + 64);
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64, out += 48) {
+	uint8x16x4_t v = vld4q_u8((const uint8_t *)in + i);
+	uint8x16x3_t r;
+	uint8x16_t bad;
+
+	v.val[0] = decode_lookup(lut_lo, lut_hi, v.val[0]);
+	v.val[1] = decode_lookup(lut_lo, lut_hi, v.val[1]);
+	v.val[2] = decode_lookup(lut_lo, lut_hi, v.val[2]);
+	v.val[3] = decode_lookup(lut_lo, lut_hi, v.val[3]);
+	bad = vorrq_u8(vorrq_u8(v.val[0], v.val[1]),
+		       vorrq_u8(v.val[2], v.val[3]));
+	if (vmaxvq_u8(bad) & 0xc0)
+	    break;
+
+	r.val[0] = vorrq_u8(vshlq_n_u8(v.val[0], 2), vshrq_n_u8(v.val[1], 4));
+	r.val[1] = vorrq_u8(vshlq_n_u8(v.val[1], 4), vshrq_n_u8(v.val[2], 2));
+	r.val[2] = vorrq_u8(vshlq_n_u8(v.val[2], 6), v.val[3]);
+	vst3q_u8(out, r);
+    }
+    return i;
+}
+
+#endif /* BASE64_ACCEL_ARM */
+
 ROKEN_LIB_FUNCTION int ROKEN_LIB_CALL
 rk_base64_encode(const void *data, int size, char **str)
 {
@@ -78,41 +438,44 @@ rk_base64_encode(const void *data, int size, char **str)
 	return -1;
     }
     q = (const unsigned char *) data;
+    i = 0;
+
+#ifdef HAVE_BASE64_ACCEL
+    i = encode_accel(q, size, p);
+    p += i / 3 * 4;
+#endif
 
-    for (i = 0; i < size;) {
-	c = q[i++];
-	c *= 256;
-	if (i < size)
-	    c += q[i];
-	i++;
-	c *= 256;
-	if (i < size)
-	    c += q[i];
-	i++;
+    for (; i + 3 <= size; i += 3, p += 4) {
+	c = (q[i] << 16) | (q[i + 1] << 8) | q[i + 2];
 	p[0] = base64_chars[(c & 0x00fc0000) >> 18];
 	p[1] = base64_chars[(c & 0x0003f000) >> 12];
 	p[2] = base64_chars[(c & 0x00000fc0) >> 6];
 	p[3] = base64_chars[(c & 0x0000003f) >> 0];
-	if (i > size)
-	    p[3] = '=';
-	if (i > size + 1)
-	    p[2] = '=';
+    }
+    if (i < size) {
+	c = q[i] << 16;
+	if (i + 1 < size)
+	    c |= q[i + 1] << 8;
+	p[0] = base64_chars[(c & 0x00fc0000) >> 18];
+	p[1] = base64_chars[(c & 0x0003f000) >> 12];
+	p[2] = i + 1 < size ? base64_chars[(c & 0x00000fc0) >> 6] : '=';
+	p[3] = '=';
 	p += 4;
     }
     *p = 0;
     *str = s;
-    return (int) strlen(s);
+    return (int) (p - s);
 }
 
 #define DECODE_ERROR 0xffffffff
 
 static unsigned int
-token_decode(const char *token)
+token_decode(const char *token, size_t len)
 {
     int i;
     unsigned int val = 0;
     int marker = 0;
-    if (strlen(token) < 4)
+    if (len < 4)
 	return DECODE_ERROR;
     for (i = 0; i < 4; i++) {
 	val *= 64;
@@ -120,8 +483,10 @@ token_decode(const char *token)
 	    marker++;
 	else if (marker > 0)
 	    return DECODE_ERROR;
+	else if (base64_values[(unsigned char)token[i]] < 0)
+	    return DECODE_ERROR;
 	else
-	    val += pos(token[i]);
+	    val += base64_values[(unsigned char)token[i]];
     }
     if (marker > 2)
 	return DECODE_ERROR;
@@ -131,13 +496,32 @@ token_decode(const char *token)
 ROKEN_LIB_FUNCTION int ROKEN_LIB_CALL
 rk_base64_decode(const char *str, void *data)
 {
-    const char *p;
+    const char *p, *end;
     unsigned char *q;
 
     q = data;
-    for (p = str; *p && (*p == '=' || strchr(base64_chars, *p)); p += 4) {
-	unsigned int val = token_decode(p);
-	unsigned int marker = (val >> 24) & 0xff;
+    end = str + strlen(str);
+    for (p = str;
+	 p < end && (*p == '=' || base64_values[(unsigned char)*p] >= 0);
+	 p += 4) {
+	unsigned int val, marker;
+
+#ifdef HAVE_BASE64_ACCEL
+	{
+	    size_t n = decode_accel(p, end - p, q);
+
+	    if (n) {
+		p += n;
+		q += n / 4 * 3;
+		if (p == end ||
+		    (*p != '=' && base64_values[(unsigned char)*p] < 0))
+		    break;
+	    }
+	}
+#endif
+
+	val = token_decode(p, end - p);
+	marker = (val >> 24) & 0xff;
 	if (val == DECODE_ERROR) {
             errno = EINVAL;
 	    return -1;
@@ -49,6 +49,26 @@ translation_cmp(const void *key, const void *data)
     return t1->key - t2->key;
 }
 
+/*
+ * Number of leading table entries for ASCII code points.  The table is
+ * sorted, so ASCII input need only be looked up in this prefix.
+ */
+static size_t
+ascii_table_size(void)
+{
+    size_t l = 0, r = _wind_map_table_size;
+
+    while (l < r) {
+	size_t m = l + ((r - l) >> 1);
+
+	if (_wind_map_table[m].key < 0x80)
+	    l = m + 1;
+	else
+	    r = m;
+    }
+    return l;
+}
+
 int
 _wind_stringprep_map(const uint32_t *in, size_t in_len,
 		     uint32_t *out, size_t *out_len,
@@ -56,13 +76,20 @@ _wind_stringprep_map(const uint32_t *in, size_t in_len,
 {
     unsigned i;
     unsigned o = 0;
+    size_t ascii_size = (size_t)-1;
 
     for (i = 0; i < in_len; ++i) {
 	struct translation ts = {in[i], 0, 0, 0};
 	const struct translation *s;
+	size_t size = _wind_map_table_size;
 
+	if (in[i] < 0x80) {
+	    if (ascii_size == (size_t)-1)
+		ascii_size = ascii_table_size();
+	    size = ascii_size;
+	}
 	s = (const struct translation *)
-	    bsearch(&ts, _wind_map_table, _wind_map_table_size,
+	    bsearch(&ts, _wind_map_table, size,
 		    sizeof(_wind_map_table[0]),
 		    translation_cmp);
 	if (s != NULL && (s->flags & flags)) {
@@ -60,7 +60,8 @@ wind_stringprep(const uint32_t *in, size_t in_len,
     size_t tmp_len = in_len * 3;
     uint32_t *tmp;
     int ret;
-    size_t olen;
+    size_t i, olen;
+    int ascii;
 
     if (in_len == 0) {
 	*out_len = 0;
@@ -77,21 +78,42 @@ wind_stringprep(const uint32_t *in, size_t in_len,
 	return ret;
     }
 
+    /*
+     * Nearly all principal names and DNs are ASCII.  ASCII is already
+     * in normal form (no ASCII character decomposes or combines) and
+     * contains no RandALCat characters, so for ASCII we can skip both
+     * normalization and the bidi check.
+     */
+    for (i = 0; i < tmp_len; i++)
+	if (tmp[i] >= 0x80)
+	    break;
+    ascii = (i == tmp_len);
+
     olen = *out_len;
-    ret = _wind_stringprep_normalize(tmp, tmp_len, tmp, &olen);
-    if (ret) {
-	free(tmp);
-	return ret;
+    if (ascii) {
+	if (tmp_len > olen) {
+	    free(tmp);
+	    return WIND_ERR_OVERRUN;
+	}
+	olen = tmp_len;
+    } else {
+	ret = _wind_stringprep_normalize(tmp, tmp_len, tmp, &olen);
+	if (ret) {
+	    free(tmp);
+	    return ret;
+	}
     }
     ret = _wind_stringprep_prohibited(tmp, olen, flags);
     if (ret) {
 	free(tmp);
 	return ret;
     }
-    ret = _wind_stringprep_testbidi(tmp, olen, flags);
-    if (ret) {
-	free(tmp);
-	return ret;
+    if (!ascii) {
+	ret = _wind_stringprep_testbidi(tmp, olen, flags);
+	if (ret) {
+	    free(tmp);
+	    return ret;
+	}
     }
 
     /* Insignificant Character Handling for ldap-prep */